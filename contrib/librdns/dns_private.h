@@ -37,6 +37,13 @@ static const int default_io_cnt = 8;
 static const int default_tcp_io_cnt = 1;
 
 #define UDP_PACKET_SIZE (4096)
+/* Maximum number of UDP packets sent or received by a single syscall */
+#define RDNS_SEND_BATCH 32
+#define RDNS_RECV_BATCH 16
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+#define RDNS_USE_MMSG 1
+#endif
 
 #define DNS_COMPRESSION_BITS 0xC0
 
@@ -201,6 +208,14 @@ struct rdns_io_channel {
 	 */
 	struct rdns_tcp_channel *tcp;
 	uint64_t uses;
+	/*
+	 * New UDP requests are queued and sent at once on the next write
+	 * readiness, so all requests made in one loop iteration take a single
+	 * syscall
+	 */
+	struct rdns_request *send_queue[RDNS_SEND_BATCH];
+	unsigned int send_queue_len;
+	void *async_send; /** async write event for the queued requests */
 	ref_entry_t ref;
 };
 
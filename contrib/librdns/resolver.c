@@ -61,6 +61,134 @@
 __KHASH_IMPL(rdns_requests_hash, kh_inline, int, struct rdns_request *, true,
 			 kh_int_hash_func, kh_int_hash_equal);
 
+#ifdef RDNS_USE_MMSG
+static void rdns_process_udp_flush(struct rdns_io_channel *ioc);
+
+/*
+ * Queues a new UDP request to be sent with others made in the same loop
+ * iteration, returns false if the request should be sent immediately
+ */
+static bool
+rdns_ioc_enqueue_send(struct rdns_io_channel *ioc, struct rdns_request *req)
+{
+	struct rdns_resolver *resolver = ioc->resolver;
+
+	if (IS_CHANNEL_TCP(ioc) || resolver->curve_plugin != NULL) {
+		return false;
+	}
+
+	if (ioc->send_queue_len == RDNS_SEND_BATCH) {
+		rdns_process_udp_flush(ioc);
+
+		if (ioc->send_queue_len == RDNS_SEND_BATCH) {
+			/* Socket is not writable, so do not batch anymore */
+			return false;
+		}
+	}
+
+	ioc->send_queue[ioc->send_queue_len++] = req;
+	REF_RETAIN(req);
+
+	if (ioc->async_send == NULL) {
+		ioc->async_send = resolver->async->add_write(resolver->async->data,
+													 ioc->sock, ioc);
+	}
+
+	return true;
+}
+
+/*
+ * Sends all queued requests that are still waiting for a reply, a request
+ * that cannot be sent due to an error is retransmitted on its timeout
+ */
+static void
+rdns_process_udp_flush(struct rdns_io_channel *ioc)
+{
+	struct rdns_resolver *resolver = ioc->resolver;
+	struct rdns_request *reqs[RDNS_SEND_BATCH], *req;
+	struct mmsghdr msgs[RDNS_SEND_BATCH];
+	struct iovec iovs[RDNS_SEND_BATCH];
+	unsigned int i, n = 0, sent = 0;
+	int r;
+
+	if (ioc->async_send) {
+		resolver->async->del_write(resolver->async->data, ioc->async_send);
+		ioc->async_send = NULL;
+	}
+
+	for (i = 0; i < ioc->send_queue_len; i++) {
+		req = ioc->send_queue[i];
+
+		/* Request could be already released or moved to another channel */
+		if (req->state == RDNS_REQUEST_WAIT_REPLY && req->async_event != NULL &&
+			req->io == ioc) {
+			reqs[n] = req;
+			iovs[n].iov_base = req->packet;
+			iovs[n].iov_len = req->pos;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+
+			if (!IS_CHANNEL_CONNECTED(ioc)) {
+				msgs[n].msg_hdr.msg_name = ioc->saddr;
+				msgs[n].msg_hdr.msg_namelen = ioc->slen;
+			}
+
+			n++;
+		}
+		else {
+			REF_RELEASE(req);
+		}
+	}
+
+	ioc->send_queue_len = 0;
+
+	while (sent < n) {
+		r = sendmmsg(ioc->sock, &msgs[sent], n - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Keep the rest queued until the socket is writable */
+				for (i = sent; i < n; i++) {
+					ioc->send_queue[ioc->send_queue_len++] = reqs[i];
+				}
+
+				ioc->async_send = resolver->async->add_write(resolver->async->data,
+															 ioc->sock, ioc);
+				n = sent;
+				break;
+			}
+			else {
+				rdns_debug("send failed: %s for server %s", strerror(errno),
+						   ioc->srv->name);
+				sent++;
+			}
+		}
+		else {
+			sent += r;
+		}
+	}
+
+	if (n > 0 && !IS_CHANNEL_CONNECTED(ioc)) {
+		/* Connect socket */
+		if (connect(ioc->sock, ioc->saddr, ioc->slen) == -1) {
+			rdns_err("cannot connect after sending request: %s for server %s",
+					 strerror(errno), ioc->srv->name);
+		}
+		else {
+			ioc->flags |= RDNS_CHANNEL_CONNECTED;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		REF_RELEASE(reqs[i]);
+	}
+}
+#endif
+
 static int
 rdns_send_request(struct rdns_request *req, int fd, bool new_req)
 {
@@ -69,6 +197,7 @@ rdns_send_request(struct rdns_request *req, int fd, bool new_req)
 	struct rdns_resolver *resolver = req->resolver;
 	struct dns_header *header;
 	const int max_id_cycles = 32;
+	bool queued = false;
 	khiter_t k;
 
 	/* Find ID collision */
@@ -92,6 +221,14 @@ rdns_send_request(struct rdns_request *req, int fd, bool new_req)
 		}
 	}
 
+#ifdef RDNS_USE_MMSG
+	if (new_req && fd == req->io->sock && rdns_ioc_enqueue_send(req->io, req)) {
+		/* Request is sent on the next write readiness */
+		queued = true;
+		r = req->pos;
+	}
+	else
+#endif
 	if (resolver->curve_plugin == NULL) {
 		if (!IS_CHANNEL_CONNECTED(req->io)) {
 			r = sendto(fd, req->packet, req->pos, 0,
@@ -139,7 +276,7 @@ rdns_send_request(struct rdns_request *req, int fd, bool new_req)
 			return -1;
 		}
 	}
-	else if (!IS_CHANNEL_CONNECTED(req->io)) {
+	else if (!queued && !IS_CHANNEL_CONNECTED(req->io)) {
 		/* Connect socket */
 		r = connect(fd, req->io->saddr, req->io->slen);
 
@@ -529,32 +666,11 @@ rdns_reschedule_req_over_tcp(struct rdns_request *req, struct rdns_server *serv)
 }
 
 static void
-rdns_process_udp_read(int fd, struct rdns_io_channel *ioc)
+rdns_process_udp_packet(struct rdns_io_channel *ioc, struct rdns_request *req,
+						uint8_t *in, ssize_t r)
 {
-	struct rdns_resolver *resolver;
-	struct rdns_request *req = NULL;
-	ssize_t r;
+	struct rdns_resolver *resolver = ioc->resolver;
 	struct rdns_reply *rep;
-	uint8_t in[UDP_PACKET_SIZE];
-
-	resolver = ioc->resolver;
-
-	/* First read packet from socket */
-	if (resolver->curve_plugin == NULL) {
-		r = recv(fd, in, sizeof(in), 0);
-		if (r > (int) (sizeof(struct dns_header) + sizeof(struct dns_query))) {
-			req = rdns_find_dns_request(in, ioc);
-		}
-	}
-	else {
-		r = resolver->curve_plugin->cb.curve_plugin.recv_cb(ioc, in,
-															sizeof(in), resolver->curve_plugin->data, &req,
-															ioc->saddr, ioc->slen);
-		if (req == NULL &&
-			r > (int) (sizeof(struct dns_header) + sizeof(struct dns_query))) {
-			req = rdns_find_dns_request(in, ioc);
-		}
-	}
 
 	if (req != NULL) {
 		if (rdns_parse_reply(in, r, req, &rep)) {
@@ -605,6 +721,87 @@ rdns_process_udp_read(int fd, struct rdns_io_channel *ioc)
 	}
 }
 
+#ifdef RDNS_USE_MMSG
+/*
+ * Reads all replies that are available on a socket using as few syscalls
+ * as possible
+ */
+static void
+rdns_process_udp_read_batch(int fd, struct rdns_io_channel *ioc)
+{
+	static uint8_t in[RDNS_RECV_BATCH][UDP_PACKET_SIZE];
+	struct mmsghdr msgs[RDNS_RECV_BATCH];
+	struct iovec iovs[RDNS_RECV_BATCH];
+	struct rdns_request *req;
+	int i, r;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < RDNS_RECV_BATCH; i++) {
+		iovs[i].iov_base = in[i];
+		iovs[i].iov_len = sizeof(in[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* Callbacks can release the last reference to this channel */
+	REF_RETAIN(ioc);
+
+	do {
+		r = recvmmsg(fd, msgs, RDNS_RECV_BATCH, MSG_DONTWAIT, NULL);
+
+		for (i = 0; i < r; i++) {
+			req = NULL;
+
+			if (msgs[i].msg_len > sizeof(struct dns_header) + sizeof(struct dns_query)) {
+				req = rdns_find_dns_request(in[i], ioc);
+			}
+
+			rdns_process_udp_packet(ioc, req, in[i], msgs[i].msg_len);
+		}
+		/* Full batch means that there could be more replies pending */
+	} while (r == RDNS_RECV_BATCH && IS_CHANNEL_ACTIVE(ioc));
+
+	REF_RELEASE(ioc);
+}
+#endif
+
+static void
+rdns_process_udp_read(int fd, struct rdns_io_channel *ioc)
+{
+	struct rdns_resolver *resolver;
+	struct rdns_request *req = NULL;
+	ssize_t r;
+	uint8_t in[UDP_PACKET_SIZE];
+
+	resolver = ioc->resolver;
+
+	/* First read packet from socket */
+	if (resolver->curve_plugin == NULL) {
+#ifdef RDNS_USE_MMSG
+		rdns_process_udp_read_batch(fd, ioc);
+
+		return;
+#else
+		r = recv(fd, in, sizeof(in), 0);
+		if (r > (int) (sizeof(struct dns_header) + sizeof(struct dns_query))) {
+			req = rdns_find_dns_request(in, ioc);
+		}
+#endif
+	}
+	else {
+		r = resolver->curve_plugin->cb.curve_plugin.recv_cb(ioc, in,
+															sizeof(in), resolver->curve_plugin->data, &req,
+															ioc->saddr, ioc->slen);
+		if (req == NULL &&
+			r > (int) (sizeof(struct dns_header) + sizeof(struct dns_query))) {
+			req = rdns_find_dns_request(in, ioc);
+		}
+	}
+
+	rdns_process_udp_packet(ioc, req, in, r);
+}
+
 void rdns_process_read(int fd, void *arg)
 {
 	struct rdns_io_channel *ioc = (struct rdns_io_channel *) arg;
@@ -985,6 +1182,15 @@ void rdns_process_write(int fd, void *arg)
 	if (tag == RDNS_IO_CHANNEL_TAG) {
 		struct rdns_io_channel *ioc = (struct rdns_io_channel *) arg;
 
+#ifdef RDNS_USE_MMSG
+		if (!IS_CHANNEL_TCP(ioc)) {
+			/* Queued UDP requests */
+			rdns_process_udp_flush(ioc);
+
+			return;
+		}
+#endif
+
 		if (IS_CHANNEL_CONNECTED(ioc)) {
 			rdns_process_tcp_write(fd, ioc);
 		}
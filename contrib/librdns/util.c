@@ -550,6 +550,15 @@ rdns_ioc_free (struct rdns_io_channel *ioc)
 		REF_RELEASE (req);
 	});
 
+	if (ioc->async_send) {
+		ioc->resolver->async->del_write(ioc->resolver->async->data,
+				ioc->async_send);
+	}
+
+	for (unsigned int i = 0; i < ioc->send_queue_len; i ++) {
+		REF_RELEASE (ioc->send_queue[i]);
+	}
+
 	if (ioc->async_io) {
 		ioc->resolver->async->del_read(ioc->resolver->async->data,
 				ioc->async_io);
@@ -67,6 +67,24 @@ local function gen_learn_functor(redis_params, learn_script_id)
   end
 end
 
+local function gen_learn_batch_functor(redis_params, learn_batch_script_id, ev_base)
+  return function(expanded_key, is_spam, symbol, learns, stat_tokens, callback)
+    local function learn_batch_redis_cb(err, data)
+      lua_util.debugm(N, rspamd_config, 'learn batch redis cb: %s, %s', err, data)
+      if err then
+        callback(false, err)
+      else
+        callback(true)
+      end
+    end
+
+    lua_redis.exec_redis_script(learn_batch_script_id,
+        { ev_base = ev_base, cfg = rspamd_config, is_write = true, key = expanded_key },
+        learn_batch_redis_cb,
+        { expanded_key, tostring(is_spam), symbol, tostring(learns), stat_tokens })
+  end
+end
+
 local function load_redis_params(classifier_ucl, statfile_ucl)
   local redis_params
 
@@ -111,7 +129,7 @@ end
 --- Init bayes classifier
 --- @param classifier_ucl ucl of the classifier config
 --- @param statfile_ucl ucl of the statfile config
---- @return a pair of (classify_functor, learn_functor) or `nil` in case of error
+--- @return classify_functor, learn_functor and batch_learn_functor (if there is an event loop) or `nil` in case of error
 exports.lua_bayes_init_statfile = function(classifier_ucl, statfile_ucl, symbol, is_spam, ev_base, stat_periodic_cb)
 
   local redis_params = load_redis_params(classifier_ucl, statfile_ucl)
@@ -120,7 +138,16 @@ exports.lua_bayes_init_statfile = function(classifier_ucl, statfile_ucl, symbol,
     return nil
   end
 
-  local classify_script_id = lua_redis.load_redis_script_from_file("bayes_classify.lua", redis_params)
+  -- Classification can use a shorter timeout, so a slow Redis server makes
+  -- this classifier skipped instead of delaying the whole task
+  local classify_params = redis_params
+  local classify_timeout = tonumber(statfile_ucl.classify_timeout or classifier_ucl.classify_timeout)
+  if classify_timeout and classify_timeout > 0 then
+    classify_params = lua_util.shallowcopy(redis_params)
+    classify_params.timeout = classify_timeout
+  end
+
+  local classify_script_id = lua_redis.load_redis_script_from_file("bayes_classify.lua", classify_params)
   local learn_script_id = lua_redis.load_redis_script_from_file("bayes_learn.lua", redis_params)
   local stat_script_id = lua_redis.load_redis_script_from_file("bayes_stat.lua", redis_params)
   local max_users = classifier_ucl.max_users or 1000
@@ -172,7 +199,14 @@ exports.lua_bayes_init_statfile = function(classifier_ucl, statfile_ucl, symbol,
     end)
   end
 
-  return gen_classify_functor(redis_params, classify_script_id), gen_learn_functor(redis_params, learn_script_id)
+  local learn_batch_functor
+  if ev_base then
+    local learn_batch_script_id = lua_redis.load_redis_script_from_file("bayes_learn_batch.lua", redis_params)
+    learn_batch_functor = gen_learn_batch_functor(redis_params, learn_batch_script_id, ev_base)
+  end
+
+  return gen_classify_functor(redis_params, classify_script_id), gen_learn_functor(redis_params, learn_script_id),
+      learn_batch_functor
 end
 
 local function gen_cache_check_functor(redis_params, check_script_id, conf)
@@ -389,7 +389,8 @@ end
 --   * password: HTTP password
 -- @param {params} HTTP request params
 -- @param {string} query select query (passed in `query` request element with spaces escaped)
--- @param {table|mixed} rows mix of strings, numbers or tables (for arrays)
+-- @param {table|text} rows mix of strings, numbers or tables (for arrays) or
+--   rows serialized by `rspamd_rowbinary`
 -- @param {function} ok_cb callback to be called in case of success
 -- @param {function} fail_cb callback to be called in case of some error
 -- @return {boolean} whether a connection was successful
@@ -406,15 +407,24 @@ exports.insert = function(upstream, settings, params, query, rows,
 
   http_params.callback = mk_http_insert_cb(upstream, http_params, ok_cb, fail_cb)
   http_params.gzip = settings.use_gzip
-  http_params.mime_type = 'text/plain'
   http_params.timeout = settings.timeout or default_timeout
   http_params.no_ssl_verify = settings.no_ssl_verify
   http_params.user = settings.user
   http_params.password = settings.password
   http_params.method = 'POST'
-  http_params.body = { rspamd_text.fromtable(rows, '\n'), '\n' }
   http_params.log_obj = params.task or params.config
 
+  local format = 'TabSeparated'
+  if type(rows) == 'userdata' then
+    -- Already serialized by rspamd_rowbinary with names and types header
+    format = 'RowBinaryWithNamesAndTypes'
+    http_params.mime_type = 'application/octet-stream'
+    http_params.body = rows
+  else
+    http_params.mime_type = 'text/plain'
+    http_params.body = { rspamd_text.fromtable(rows, '\n'), '\n' }
+  end
+
   if not http_params.url then
     local connect_prefix = "http://"
     if settings.use_https then
@@ -422,11 +432,12 @@ exports.insert = function(upstream, settings, params, query, rows,
     end
     local ip_addr = upstream:get_addr():to_string(true)
     local database = settings.database or 'default'
-    http_params.url = string.format('%s%s/?database=%s&query=%s%%20FORMAT%%20TabSeparated',
+    http_params.url = string.format('%s%s/?database=%s&query=%s%%20FORMAT%%20%s',
         connect_prefix,
         ip_addr,
         escape_spaces(database),
-        escape_spaces(query))
+        escape_spaces(query),
+        format)
   end
 
   return rspamd_http.request(http_params)
@@ -0,0 +1,106 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+--[[[
+-- @module lua_ffi/task
+-- This module contains ffi fast paths for the most frequently used task methods.
+-- Task userdata is passed to C as is, so no extra Lua C calls are done.
+--]]
+
+local ffi = require 'ffi'
+
+ffi.cdef [[
+int rspamd_task_has_symbol_ffi(void *ptask, const char *symbol);
+double rspamd_task_get_symbol_score_ffi(void *ptask, const char *symbol, int *found);
+int rspamd_task_insert_result_ffi(void *ptask, const char *symbol,
+		double weight, const char *opt, size_t optlen);
+const char *rspamd_task_get_header_ffi(void *ptask, const char *name, int strong);
+unsigned int rspamd_task_get_urls_ffi(void *ptask, const char **urls, unsigned int *lens,
+		unsigned int max);
+]]
+
+local NULL = ffi.new 'void*'
+local found_buf = ffi.new 'int[1]'
+local URLS_MAX = 1024
+local urls_buf = ffi.new('const char *[?]', URLS_MAX)
+local lens_buf = ffi.new('unsigned int[?]', URLS_MAX)
+
+local exports = {}
+
+--[[[
+-- @function lua_ffi.task.has_symbol(task, symbol)
+-- Same as `task:has_symbol(symbol)`
+--]]
+exports.has_symbol = function(task, symbol)
+  return ffi.C.rspamd_task_has_symbol_ffi(task, symbol) ~= 0
+end
+
+--[[[
+-- @function lua_ffi.task.get_symbol_score(task, symbol)
+-- Returns score of a symbol or nil if it has not been inserted
+--]]
+exports.get_symbol_score = function(task, symbol)
+  local score = ffi.C.rspamd_task_get_symbol_score_ffi(task, symbol, found_buf)
+
+  if found_buf[0] ~= 0 then
+    return score
+  end
+
+  return nil
+end
+
+--[[[
+-- @function lua_ffi.task.insert_result(task, symbol, weight[, option])
+-- Same as `task:insert_result(symbol, weight, option)` with a single string option
+--]]
+exports.insert_result = function(task, symbol, weight, opt)
+  if opt then
+    return ffi.C.rspamd_task_insert_result_ffi(task, symbol, weight or 1.0, opt, #opt) ~= 0
+  end
+
+  return ffi.C.rspamd_task_insert_result_ffi(task, symbol, weight or 1.0, nil, 0) ~= 0
+end
+
+--[[[
+-- @function lua_ffi.task.get_header(task, name[, case_sensitive])
+-- Same as `task:get_header(name, case_sensitive)`
+--]]
+exports.get_header = function(task, name, strong)
+  local hdr = ffi.C.rspamd_task_get_header_ffi(task, name, strong and 1 or 0)
+
+  if hdr ~= NULL then
+    return ffi.string(hdr)
+  end
+
+  return nil
+end
+
+--[[[
+-- @function lua_ffi.task.get_urls_strings(task)
+-- Returns list of urls strings as `task:get_urls()` with no arguments would return
+--]]
+exports.get_urls_strings = function(task)
+  local n = ffi.C.rspamd_task_get_urls_ffi(task, urls_buf, lens_buf, URLS_MAX)
+  local res = {}
+
+  for i = 0, n - 1 do
+    res[i + 1] = ffi.string(urls_buf[i], lens_buf[i])
+  end
+
+  return res
+end
+
+return exports
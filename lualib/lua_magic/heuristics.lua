@@ -481,23 +481,24 @@ exports.text_part_heuristic = function(part, log_obj, _)
     end
   end
 
-  local content = part:get_content()
   local mtype, msubtype = part:get_type()
-  local clen = #content
+  local clen = part:get_length()
   local is_text
 
   if clen > 0 then
+    -- Spans do not require the whole part to be decoded
     if clen > 80 * 3 then
       -- Use chunks
-      is_text = is_span_text(content:span(1, 160)) and is_span_text(content:span(clen - 80, 80))
+      is_text = is_span_text(part:get_content_span(1, 160)) and
+          is_span_text(part:get_content_span(clen - 80, 80))
     else
-      is_text = is_span_text(content)
+      is_text = is_span_text(part:get_content())
     end
 
     if is_text and mtype ~= 'message' then
       -- Try patterns
       local span_len = math.min(4096, clen)
-      local start_span = content:span(1, span_len)
+      local start_span = part:get_content_span(1, span_len)
       local matches = txt_trie:match(start_span)
       local res = {}
       local fname = part:get_filename()
@@ -523,7 +524,7 @@ exports.text_part_heuristic = function(part, log_obj, _)
         if weight then
           if weight >= 40 then
             -- Extra validation for csv extension
-            if ext ~= 'csv' or validate_csv(part, content, log_obj) then
+            if ext ~= 'csv' or validate_csv(part, part:get_content(), log_obj) then
               return ext, weight
             end
           elseif fname and weight >= 20 then
@@ -539,7 +540,7 @@ exports.text_part_heuristic = function(part, log_obj, _)
       end
 
       if msubtype:lower() == 'csv' then
-        if validate_csv(part, content, log_obj) then
+        if validate_csv(part, part:get_content(), log_obj) then
           return 'csv', 40
         end
       end
@@ -157,7 +157,7 @@ end
 
 process_patterns(rspamd_config)
 
-local function match_chunk(chunk, input, tlen, offset, trie, processed_tbl, log_obj, res, part)
+local function match_chunk(chunk, get_input, tlen, offset, trie, processed_tbl, log_obj, res, part)
   local matches = trie:match(chunk)
 
   local last = tlen
@@ -227,7 +227,7 @@ local function match_chunk(chunk, input, tlen, offset, trie, processed_tbl, log_
             pattern.ext, pos, offset)
         if match_position(pos + offset, position) then
           if match.heuristic then
-            local ext, weight = match.heuristic(input, log_obj, pos + offset, part)
+            local ext, weight = match.heuristic(get_input(), log_obj, pos + offset, part)
 
             if ext then
               add_result(weight, ext)
@@ -262,7 +262,7 @@ local function match_chunk(chunk, input, tlen, offset, trie, processed_tbl, log_
 
       if all_right then
         if match.heuristic then
-          local ext, weight = match.heuristic(input, log_obj, matched_pos + offset, part)
+          local ext, weight = match.heuristic(get_input(), log_obj, matched_pos + offset, part)
 
           if ext then
             add_result(weight, ext)
@@ -296,28 +296,37 @@ exports.detect = function(part, log_obj)
   if not log_obj then
     log_obj = rspamd_config
   end
-  local input = part:get_content()
 
   local res = {}
+  local inplen = part:get_length()
+  local input
+
+  -- Large parts might be not decoded yet, so we use spans of the content
+  -- and obtain the whole content merely if some heuristic requires it
+  local function get_input()
+    if not input then
+      input = part:get_content()
+
+      if type(input) == 'string' then
+        -- Convert to rspamd_text
+        input = rspamd_text.fromstring(input)
+      end
+    end
 
-  if type(input) == 'string' then
-    -- Convert to rspamd_text
-    input = rspamd_text.fromstring(input)
+    return input
   end
 
-  if type(input) == 'userdata' then
-    local inplen = #input
-
+  if inplen > 0 then
     -- Check tail matches
     if inplen > min_tail_offset then
-      local tail = input:span(inplen - min_tail_offset, min_tail_offset)
-      match_chunk(tail, input, inplen, inplen - min_tail_offset,
+      local tail = part:get_content_span(inplen - min_tail_offset, min_tail_offset)
+      match_chunk(tail, get_input, inplen, inplen - min_tail_offset,
           compiled_tail_patterns, tail_patterns, log_obj, res, part)
     end
 
     -- Try short match
-    local head = input:span(1, math.min(max_short_offset, inplen))
-    match_chunk(head, input, inplen, 0,
+    local head = part:get_content_span(1, math.min(max_short_offset, inplen))
+    match_chunk(head, get_input, inplen, 0,
         compiled_short_patterns, short_patterns, log_obj, res, part)
 
     -- Check if we have enough data or go to long patterns
@@ -329,24 +338,21 @@ exports.detect = function(part, log_obj)
     end
 
     -- No way, let's check data in chunks or just the whole input if it is small enough
-    if #input > exports.chunk_size * 3 then
+    if inplen > exports.chunk_size * 3 then
       -- Chunked version as input is too long
-      local chunk1, chunk2 = input:span(1, exports.chunk_size * 2),
-      input:span(inplen - exports.chunk_size, exports.chunk_size)
+      local chunk1, chunk2 = part:get_content_span(1, exports.chunk_size * 2),
+      part:get_content_span(inplen - exports.chunk_size, exports.chunk_size)
       local offset1, offset2 = 0, inplen - exports.chunk_size
 
-      match_chunk(chunk1, input, inplen,
+      match_chunk(chunk1, get_input, inplen,
           offset1, compiled_patterns, processed_patterns, log_obj, res, part)
-      match_chunk(chunk2, input, inplen,
+      match_chunk(chunk2, get_input, inplen,
           offset2, compiled_patterns, processed_patterns, log_obj, res, part)
     else
       -- Input is short enough to match it at all
-      match_chunk(input, input, inplen, 0,
+      match_chunk(get_input(), get_input, inplen, 0,
           compiled_patterns, processed_patterns, log_obj, res, part)
     end
-  else
-    -- Table input is NYI
-    assert(0, 'table input for match')
   end
 
   local extensions = process_detected(res)
@@ -97,6 +97,32 @@ local external_map_schema = ts.shape {
 local rspamd_http = require "rspamd_http"
 local ucl = require "ucl"
 
+-- Results of lookups are memoized per task as many rules check the same map
+-- with the same key; returns a table of results for this map or nil
+local function task_map_memo(task, map, key)
+  local kt = type(key)
+
+  if kt ~= 'string' and kt ~= 'number' then
+    return nil
+  end
+
+  local memo = task:cache_get('lua_maps_memo')
+
+  if not memo then
+    memo = {}
+    task:cache_set('lua_maps_memo', memo)
+  end
+
+  local map_memo = memo[map]
+
+  if not map_memo then
+    map_memo = {}
+    memo[map] = map_memo
+  end
+
+  return map_memo
+end
+
 local function url_encode_string(str)
   str = string.gsub(str, "([^%w _%%%-%.~])",
       function(c)
@@ -218,7 +244,20 @@ local function rspamd_map_add_from_ucl(opt, mtype, description, callback)
           end
           query_external_map(t.__data, t.__upstreams, k, cb, task)
         else
-          local result = t.__data:get_key(k)
+          local memo = task and task_map_memo(task, t, k)
+          local result
+
+          if memo and memo[k] ~= nil then
+            result = memo[k] or nil
+          else
+            result = t.__data:get_key(k)
+
+            if memo then
+              -- False means that a key is not found
+              memo[k] = result or false
+            end
+          end
+
           if cb then
             if result then
               cb(true, result, 200, task)
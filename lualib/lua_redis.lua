@@ -33,6 +33,7 @@ local common_schema = {
   username = ts.string:is_optional():describe("Username"),
   password = ts.string:is_optional():describe("Password"),
   expand_keys = ts.boolean:is_optional():describe("Expand keys"),
+  cluster = ts.boolean:is_optional():describe("Servers are seed nodes of Redis Cluster"),
   sentinels = (ts.string + ts.array_of(ts.string)):is_optional():describe("Sentinel servers"),
   sentinel_watch_time = (ts.number + ts.string / lutil.parse_time_interval):is_optional():describe("Sentinel watch time"),
   sentinel_masters_pattern = ts.string:is_optional():describe("Sentinel masters pattern"),
@@ -385,6 +386,10 @@ local function process_redis_opts(options, redis_params)
     redis_params['sentinel_masters_pattern'] = options['sentinel_masters_pattern']
   end
 
+  if type(options['cluster']) == 'boolean' and redis_params['cluster'] == nil then
+    redis_params['cluster'] = options['cluster']
+  end
+
 end
 
 local function enrich_defaults(rspamd_config, module, redis_params)
@@ -852,6 +857,217 @@ local function get_key_indexes(cmd, args)
   return idx_l
 end
 
+-- Redis Cluster support: slots map is discovered by `CLUSTER SLOTS` sent to
+-- the configured servers and is refreshed when a node replies with MOVED
+local cluster_states = setmetatable({}, { __mode = 'k' })
+local cluster_refresh_interval = 1.0
+local cluster_max_redirects = 5
+
+local function cluster_get_state(redis_params)
+  local state = cluster_states[redis_params]
+
+  if not state then
+    state = {
+      slots = {}, -- slot -> node name
+      nodes = {}, -- node name -> upstream list
+      last_refresh = 0,
+      refreshing = false,
+    }
+    cluster_states[redis_params] = state
+  end
+
+  return state
+end
+
+local function cluster_node_name(host, port)
+  if string.find(host, ':') then
+    return string.format('[%s]:%s', host, port)
+  end
+
+  return string.format('%s:%s', host, port)
+end
+
+local function cluster_node_upstream(state, node)
+  local ups = state.nodes[node]
+
+  if not ups then
+    local upstream_list = require "rspamd_upstream_list"
+    ups = upstream_list.create(rspamd_config, node, 6379)
+
+    if not ups then
+      return nil
+    end
+
+    state.nodes[node] = ups
+  end
+
+  return ups:get_upstream_round_robin()
+end
+
+local function cluster_refresh(redis_params, state, attrs)
+  local now = rspamd_util.get_time()
+
+  if state.refreshing or now - state.last_refresh < cluster_refresh_interval then
+    return
+  end
+
+  local rspamd_redis = require "rspamd_redis"
+  local addr = redis_params['read_servers']:get_upstream_round_robin()
+
+  local function cluster_slots_cb(err, data)
+    state.refreshing = false
+
+    if err or type(data) ~= 'table' then
+      addr:fail()
+      logger.infox(rspamd_config, 'cannot get cluster slots from %s: %s',
+          addr:get_addr():to_string(true), err)
+      return
+    end
+
+    addr:ok()
+    local slots = {}
+
+    for _, range in ipairs(data) do
+      local first, last, master = tonumber(range[1]), tonumber(range[2]), range[3]
+
+      if first and last and type(master) == 'table' and master[2] then
+        local host = master[1]
+
+        if type(host) ~= 'string' or #host == 0 then
+          -- Unknown endpoint means the node we have asked
+          host = addr:get_addr():to_string()
+        end
+
+        local node = cluster_node_name(host, master[2])
+
+        for slot = first, last do
+          slots[slot] = node
+        end
+      end
+    end
+
+    state.slots = slots
+    lutil.debugm(N, rspamd_config, 'updated cluster slots from %s',
+        addr:get_addr():to_string(true))
+  end
+
+  -- Slots are not related to a task, so its session is not used
+  local opts = {
+    config = attrs.config or rspamd_config,
+    ev_base = attrs.ev_base or attrs.task:get_ev_base(),
+    host = addr:get_addr(),
+    timeout = redis_params['timeout'],
+    callback = cluster_slots_cb,
+    cmd = 'CLUSTER',
+    args = { 'SLOTS' },
+    username = redis_params['username'],
+    password = redis_params['password'],
+  }
+
+  state.last_refresh = now
+  state.refreshing = rspamd_redis.make_request(opts)
+end
+
+-- Returns key that defines the slot of a command
+local function cluster_routing_key(command, args, key)
+  local f = process_cmd[string.lower(command)]
+
+  if f and type(args) == 'table' then
+    local indexes = f(args)
+
+    if indexes and indexes[1] and args[indexes[1]] then
+      return tostring(args[indexes[1]])
+    end
+  end
+
+  return key
+end
+
+-- Sends request to the node that owns the slot of the key and follows
+-- MOVED and ASK redirections, uses `addr` if the slot is not known yet
+local function cluster_make_request(redis_params, options, addr, key, callback)
+  local rspamd_redis = require "rspamd_redis"
+  local state = cluster_get_state(redis_params)
+  local routing_key = cluster_routing_key(options.cmd, options.args, key)
+  local redirects = 0
+  local asking = false
+
+  if routing_key then
+    local node = state.slots[rspamd_redis.key_slot(routing_key)]
+
+    if node then
+      addr = cluster_node_upstream(state, node) or addr
+    else
+      cluster_refresh(redis_params, state, options)
+    end
+  end
+
+  local function send_request()
+    options.host = addr:get_addr()
+
+    if not asking then
+      return rspamd_redis.make_request(options)
+    end
+
+    -- ASKING must precede the command on the same connection
+    local cb = options.callback
+    options.callback = nil
+    local ret, conn = rspamd_redis.connect(options)
+    options.callback = cb
+
+    if ret and conn then
+      conn:add_cmd('ASKING', {})
+      ret = conn:add_cmd(cb, options.cmd, options.args or {})
+    end
+
+    return ret, conn
+  end
+
+  options.callback = function(err, data)
+    if type(err) == 'string' and redirects < cluster_max_redirects then
+      local kind, slot, node = string.match(err, '^(%u+) (%d+) (%S+)')
+
+      if kind == 'MOVED' or kind == 'ASK' then
+        local naddr = cluster_node_upstream(state, node)
+
+        if naddr then
+          if kind == 'MOVED' then
+            state.slots[tonumber(slot)] = node
+            cluster_refresh(redis_params, state, options)
+          end
+
+          lutil.debugm(N, rspamd_config, 'redirected by %s to %s', kind, node)
+          redirects = redirects + 1
+          asking = kind == 'ASK'
+          addr = naddr
+
+          if send_request() then
+            return
+          end
+        end
+      end
+    end
+
+    if err then
+      addr:fail()
+    else
+      addr:ok()
+    end
+
+    if callback then
+      callback(err, data, addr)
+    end
+  end
+
+  local ret, conn = send_request()
+
+  if not ret then
+    addr:fail()
+  end
+
+  return ret, conn, addr
+end
+
 local gen_meta = {
   principal_recipient = function(task)
     return task:get_principal_recipient()
@@ -1019,6 +1235,10 @@ local function rspamd_redis_make_request(task, redis_params, key, is_write,
       ' (host=%s, timeout=%s): cmd: %s', ip_addr,
       options.timeout, options.cmd)
 
+  if redis_params.cluster then
+    return cluster_make_request(redis_params, options, addr, key, callback)
+  end
+
   local ret, conn = rspamd_redis.make_request(options)
 
   if not ret then
@@ -1044,6 +1264,268 @@ end
 exports.rspamd_redis_make_request = rspamd_redis_make_request
 exports.redis_make_request = rspamd_redis_make_request
 
+--[[[
+-- Cross-plugin batching of redis reads
+--
+-- Plugins register readers that return the list of read requests they are going
+-- to make for a message. All such requests for the same redis servers and the same
+-- stage are sent by a single helper symbol as one pipeline per upstream, so a
+-- message costs one round trip instead of a round trip per plugin.
+-- Later, `redis_make_request_batched` returns prefetched replies without
+-- any network activity and falls back to the normal request otherwise.
+--]]
+
+local batch_groups = {}
+local batch_cache_key = 'lua_redis_batch'
+
+local function batch_request_id(redis_params, cmd, args)
+  local parts = { redis_params.hash or '', string.upper(cmd) }
+
+  for _, arg in ipairs(args or E) do
+    parts[#parts + 1] = tostring(arg)
+  end
+
+  return table.concat(parts, '\0')
+end
+
+local function batch_select_upstream(redis_params, key, rr_addr)
+  if key then
+    return redis_params['read_servers']:get_upstream_by_hash(key), rr_addr
+  end
+
+  if not rr_addr then
+    -- All keyless requests of a batch go to the same upstream
+    rr_addr = redis_params['read_servers']:get_upstream_round_robin()
+  end
+
+  return rr_addr, rr_addr
+end
+
+local function batch_send(task, redis_params, addr, reqs, results)
+  local rspamd_redis = require "rspamd_redis"
+  local options = {
+    task = task,
+    host = addr:get_addr(),
+    timeout = redis_params['timeout'],
+  }
+
+  if redis_params['username'] then
+    options['username'] = redis_params['username']
+  end
+
+  if redis_params['password'] then
+    options['password'] = redis_params['password']
+  end
+
+  if redis_params['db'] then
+    options['dbname'] = redis_params['db']
+  end
+
+  local ret, conn = rspamd_redis.connect(options)
+
+  if not ret then
+    addr:fail()
+    logger.warnx(task, "cannot connect to redis server %s for batched reads", addr)
+    return
+  end
+
+  local failed = false
+  local pending = #reqs
+
+  for _, req in ipairs(reqs) do
+    local args = req.args
+
+    if redis_params['expand_keys'] then
+      local m = get_key_expansion_metadata(task)
+      args = lutil.shallowcopy(args)
+      for _, i in ipairs(get_key_indexes(req.cmd, args)) do
+        args[i] = lutil.template(args[i], m)
+      end
+    end
+
+    local function batch_cb(err, data)
+      if err then
+        -- Errors are not cached, so consumers retry with a normal request
+        failed = true
+      else
+        results[req.id] = { data = data }
+      end
+
+      pending = pending - 1
+
+      if pending == 0 then
+        if failed then
+          addr:fail()
+        else
+          addr:ok()
+        end
+      end
+    end
+
+    local added, err = conn:add_cmd(batch_cb, req.cmd, args)
+
+    if not added then
+      addr:fail()
+      logger.warnx(task, "cannot add batched redis command %s: %s", req.cmd, err)
+      return
+    end
+  end
+end
+
+local function batch_execute(task, group)
+  local by_upstream = {}
+  local rr_addr
+  local results = task:cache_get(batch_cache_key)
+
+  if not results then
+    results = {}
+    task:cache_set(batch_cache_key, results)
+  end
+
+  for _, reader in ipairs(group.readers) do
+    local ok, reqs = pcall(reader.prepare, task)
+
+    if not ok then
+      logger.errx(task, 'cannot prepare batched redis reads for %s: %s', reader.name, reqs)
+    elseif reqs then
+      for _, r in ipairs(reqs) do
+        local id = batch_request_id(group.redis_params, r.cmd, r.args)
+
+        if not results[id] then
+          local addr
+          addr, rr_addr = batch_select_upstream(group.redis_params, r.key, rr_addr)
+
+          if addr then
+            local name = addr:get_name()
+
+            if not by_upstream[name] then
+              by_upstream[name] = { addr = addr, reqs = {}, ids = {} }
+            end
+
+            local ups = by_upstream[name]
+            -- The same request could be registered by different plugins
+            if not ups.ids[id] then
+              ups.ids[id] = true
+              table.insert(ups.reqs, { id = id, cmd = r.cmd, args = r.args or {} })
+            end
+          end
+        end
+      end
+    end
+  end
+
+  for _, ups in pairs(by_upstream) do
+    lutil.debugm(N, task, 'send %s batched redis reads to %s', #ups.reqs, ups.addr)
+    batch_send(task, group.redis_params, ups.addr, ups.reqs, results)
+  end
+end
+
+--[[[
+-- @function lua_redis.register_batch_read(rspamd_config, redis_params, reader)
+-- Registers a reader for cross-plugin batching of redis reads. Reader is a table with the following fields:
+-- * `name`: name of the reader (e.g. module name)
+-- * `prepare`: function(task) that returns an array of requests `{cmd = 'GET', args = {...}, key = 'hash key'}` or nil
+-- * `stage`: either `prefilter` or `filter` (default)
+-- * `priority`: priority of the prefilter that consumes the results (prefilters only)
+-- * `symbols`: optional list of filter symbols that consume the results (filters only)
+-- Requests are prefetched before the consumers are executed and the consumers should use
+-- `lua_redis.redis_make_request_batched` with the same command and arguments to get the results
+-- @param {rspamd_config} rspamd_config config object
+-- @param {table} redis_params redis configuration in format returned by lua_redis.parse_redis_server()
+-- @param {table} reader reader definition
+-- @return {string} name of the batching symbol
+--]]
+local function register_batch_read(rspamd_config, redis_params, reader)
+  local stage = reader.stage or 'filter'
+  local priority = 0
+
+  if redis_params.cluster then
+    -- Requests are routed per key in the cluster mode, so nothing could be batched
+    return nil
+  end
+
+  if stage == 'prefilter' then
+    -- Prefilters with lower priority are not started before the higher priority ones are done
+    priority = (reader.priority or lutil.symbols_priorities.medium) + 1
+  elseif stage ~= 'filter' then
+    logger.errx(rspamd_config, 'invalid stage for batched redis reads: %s', stage)
+    return nil
+  end
+
+  local group_key = string.format('%s:%s:%s', stage, priority, redis_params.hash or '')
+  local group = batch_groups[group_key]
+
+  if not group then
+    local ngroups = 0
+
+    for _, _ in pairs(batch_groups) do
+      ngroups = ngroups + 1
+    end
+
+    group = {
+      redis_params = redis_params,
+      readers = {},
+      symbol = string.format('REDIS_BATCH_%s_%d', string.upper(stage), ngroups),
+    }
+    batch_groups[group_key] = group
+
+    rspamd_config:register_symbol({
+      name = group.symbol,
+      type = (stage == 'prefilter') and 'prefilter' or 'callback',
+      priority = priority,
+      flags = 'empty,nostat',
+      callback = function(task)
+        batch_execute(task, group)
+      end,
+    })
+  end
+
+  table.insert(group.readers, reader)
+
+  if stage == 'filter' then
+    for _, sym in ipairs(reader.symbols or E) do
+      rspamd_config:register_dependency(sym, group.symbol)
+    end
+  end
+
+  return group.symbol
+end
+
+exports.register_batch_read = register_batch_read
+
+--[[[
+-- @function lua_redis.redis_make_request_batched(task, redis_params, key, is_write, callback, command, args)
+-- Same as `lua_redis.redis_make_request` but uses results prefetched by readers
+-- registered with `lua_redis.register_batch_read` if available. In this case the callback is
+-- called immediately and no request is sent
+-- @return {boolean} `true` if the request has been sent or the result has been found
+--]]
+local function rspamd_redis_make_request_batched(task, redis_params, key, is_write,
+                                                 callback, command, args, extra_opts)
+  if task and redis_params and command and not is_write then
+    local results = task:cache_get(batch_cache_key)
+
+    if results then
+      local res = results[batch_request_id(redis_params, command, args)]
+
+      if res then
+        lutil.debugm(N, task, 'use batched redis reply for %s', command)
+
+        if callback then
+          callback(res.err, res.data)
+        end
+
+        return true
+      end
+    end
+  end
+
+  return rspamd_redis_make_request(task, redis_params, key, is_write,
+      callback, command, args, extra_opts)
+end
+
+exports.redis_make_request_batched = rspamd_redis_make_request_batched
+
 local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
                                            is_write, callback, command, args, extra_opts)
   if not ev_base or not redis_params or not command then
@@ -1112,6 +1594,11 @@ local function redis_make_request_taskless(ev_base, cfg, redis_params, key,
   lutil.debugm(N, cfg, 'perform taskless request to redis server' ..
       ' (host=%s, timeout=%s): cmd: %s', options.host:tostring(true),
       options.timeout, options.cmd)
+
+  if redis_params.cluster then
+    return cluster_make_request(redis_params, options, addr, key, callback)
+  end
+
   local ret, conn = rspamd_redis.make_request(options)
   if not ret then
     logger.errx('cannot execute redis request')
@@ -1160,6 +1647,12 @@ local function prepare_redis_call(script)
   if script.redis_params.write_servers then
     servers = lutil.table_merge(servers, script.redis_params.write_servers:all_upstreams())
   end
+  if script.redis_params.cluster then
+    -- Scripts are needed on all known cluster nodes
+    for _, ups in pairs(cluster_get_state(script.redis_params).nodes) do
+      servers = lutil.table_merge(servers, ups:all_upstreams())
+    end
+  end
 
   -- Call load script on each server, set loaded flag
   script.in_flight = #servers
@@ -1558,6 +2051,90 @@ end
 
 exports.redis_connect_sync = redis_connect_sync
 
+--[[[
+-- @function lua_redis.sync_pipeline(redis_params, nconns)
+-- Creates a set of synchronous connections (for rspamadm tools) that allows to
+-- have up to `nconns` batches of commands in flight. Each batch is wrapped in
+-- MULTI/EXEC, so it is applied atomically. Batches are acknowledged in the
+-- order they have been sent.
+-- @param {table} redis_params redis server params
+-- @param {number} nconns number of connections
+-- @return {table} pipeline object with methods `send(cmds, cb)` (where `cmds`
+-- is a list of `{cmd, args}` and `cb` is called once the batch is applied) and
+-- `flush()` (waits for all batches in flight), both return `true` or `false, err`
+--]]
+local function sync_pipeline(redis_params, nconns)
+  local slots = {}
+
+  for i = 1, math.max(nconns or 1, 1) do
+    local ret, conn = redis_connect_sync(redis_params, true)
+
+    if not ret then
+      return nil, 'cannot connect to redis server'
+    end
+
+    slots[i] = { conn = conn }
+  end
+
+  local cur = 0
+  local pipeline = {}
+
+  local function wait_slot(slot)
+    if slot.cb then
+      local cb = slot.cb
+      slot.cb = nil
+      -- The last reply is the one for EXEC
+      local replies = { slot.conn:exec() }
+
+      if not replies[#replies - 1] then
+        return false, tostring(replies[#replies])
+      end
+
+      cb()
+    end
+
+    return true
+  end
+
+  function pipeline.send(cmds, cb)
+    cur = cur % #slots + 1
+    -- Slots are used in turn, so this slot has the oldest batch in flight
+    local slot = slots[cur]
+    local ret, err = wait_slot(slot)
+
+    if not ret then
+      return false, err
+    end
+
+    slot.conn:add_cmd('MULTI', {})
+    for _, cmd in ipairs(cmds) do
+      slot.conn:add_cmd(cmd[1], cmd[2])
+    end
+    slot.conn:add_cmd('EXEC', {})
+    slot.cb = cb or function()
+    end
+
+    return true
+  end
+
+  function pipeline.flush()
+    for _ = 1, #slots do
+      cur = cur % #slots + 1
+      local ret, err = wait_slot(slots[cur])
+
+      if not ret then
+        return false, err
+      end
+    end
+
+    return true
+  end
+
+  return pipeline
+end
+
+exports.sync_pipeline = sync_pipeline
+
 --[[[
 -- @function lua_redis.request(redis_params, attrs, req)
 -- Sends a request to Redis synchronously with coroutines or asynchronously using
@@ -1649,7 +2226,9 @@ exports.request = function(redis_params, attrs, req)
       ' (host=%s, timeout=%s): cmd: %s, arguments: %s', addr,
       opts.timeout, opts.cmd, opts.args)
 
-  if opts.callback then
+  if opts.callback and redis_params.cluster then
+    return cluster_make_request(redis_params, opts, addr, attrs.key, attrs.callback)
+  elseif opts.callback then
     local ret, conn = rspamd_redis.make_request(opts)
     if not ret then
       logger.errx(log_obj, 'cannot execute redis request')
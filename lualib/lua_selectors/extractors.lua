@@ -400,6 +400,8 @@ e.g. `get_user`]],
       local type = args[2] or 'string'
       return task:get_mempool():get_variable(args[1], type), (type)
     end,
+    -- Value might change while a task is processed
+    ['volatile'] = true,
     ['description'] = [[Get specific pool var. The first argument must be variable name,
 the second argument is optional and defines the type (string by default)]],
     ['args_schema'] = { ts.string, ts.string:is_optional() }
@@ -419,6 +421,8 @@ the second argument is optional and defines the type (string by default)]],
       end
       return val, 'string'
     end,
+    -- Value might change while a task is processed
+    ['volatile'] = true,
     ['description'] = [[Get value of specific key from task cache. The first argument must be
 the key name]],
     ['args_schema'] = { ts.string }
@@ -531,6 +535,8 @@ The first argument must be header name.]],
         return symbol[1], 'table'
       end
     end,
+    -- Value might change while a task is processed
+    ['volatile'] = true,
     ['description'] = 'Get specific symbol. The first argument must be the symbol name. ' ..
         'The second argument is an optional shadow result name. ' ..
         'Returns the symbol table. See task:get_symbol()',
@@ -544,6 +550,8 @@ The first argument must be header name.]],
         return res, 'table'
       end
     end,
+    -- Value might change while a task is processed
+    ['volatile'] = true,
     ['description'] = 'Get full scan result (either default or shadow if shadow result name is specified)' ..
         'Returns the result table. See task:get_metric_result()',
     ['args_schema'] = { ts.string:is_optional() }
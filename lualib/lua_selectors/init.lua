@@ -71,6 +71,48 @@ local function implicit_tostring(t, ud_or_table)
   return nil
 end
 
+-- Builds a canonical key for a function with its arguments, returns nil if
+-- arguments cannot be represented in a key
+local function canonical_key(name, args)
+  local parts = { name }
+
+  for i, arg in ipairs(args or E) do
+    local t = type(arg)
+    if t ~= 'string' and t ~= 'number' and t ~= 'boolean' then
+      return nil
+    end
+    parts[i + 1] = tostring(arg)
+  end
+
+  return table.concat(parts, '\0')
+end
+
+-- Extractors are shared by many selectors (e.g. `from` in `from:domain` and
+-- `from:addr`), so their results are memoized per task
+local function extract_value(task, selector)
+  if not selector.cache_key then
+    return selector.get_value(task, selector.args)
+  end
+
+  local cached = task:cache_get(selector.cache_key)
+
+  if cached == nil then
+    local input, etype = selector.get_value(task, selector.args)
+
+    if input then
+      task:cache_set(selector.cache_key, { input, etype })
+    else
+      task:cache_set(selector.cache_key, false)
+    end
+
+    return input, etype
+  elseif cached then
+    return cached[1], cached[2]
+  end
+
+  return nil
+end
+
 local function process_selector(task, sel)
   local function allowed_type(t)
     if t == 'string' or t == 'string_list' then
@@ -84,7 +126,7 @@ local function process_selector(task, sel)
     return pure_type(t)
   end
 
-  local input, etype = sel.selector.get_value(task, sel.selector.args)
+  local input, etype = extract_value(task, sel.selector)
 
   if not input then
     lua_util.debugm(M, task, 'no value extracted for %s', sel.selector.name)
@@ -432,6 +474,30 @@ exports.parse_selector = function(cfg, str)
       return nil
     end
 
+    if not res.selector.volatile then
+      local extractor_key = canonical_key(res.selector.name, res.selector.args)
+
+      if extractor_key then
+        res.selector.cache_key = 'selector_extract_' .. extractor_key
+        local elt_keys = { extractor_key }
+
+        for _, proc in ipairs(res.processor_pipe) do
+          local proc_key = canonical_key((proc.method and '__' or '') .. proc.name,
+              proc.args)
+
+          if not proc_key then
+            elt_keys = nil
+            break
+          end
+          table.insert(elt_keys, proc_key)
+        end
+
+        if elt_keys then
+          res.cache_key = 'selector_elt_' .. table.concat(elt_keys, '\1')
+        end
+      end
+    end
+
     table.insert(output, res)
   end
 
@@ -446,6 +512,10 @@ exports.register_extractor = function(cfg, name, selector)
     if extractors[name] then
       logger.warnx(cfg, 'redefining selector %s', name)
     end
+    if selector.volatile == nil then
+      -- We know nothing about custom extractors, so their values are not cached
+      selector.volatile = true
+    end
     extractors[name] = selector
 
     return true
@@ -479,7 +549,19 @@ exports.process_selectors = function(task, selectors_pipe)
   local ret = {}
 
   for _, sel in ipairs(selectors_pipe) do
-    local r = process_selector(task, sel)
+    local r
+
+    if sel.cache_key then
+      -- The same element is often used by different selectors
+      r = task:cache_get(sel.cache_key)
+
+      if r == nil then
+        r = process_selector(task, sel)
+        task:cache_set(sel.cache_key, r == nil and false or r)
+      end
+    else
+      r = process_selector(task, sel)
+    end
 
     -- If any element is nil, then the whole selector is nil
     if not r then
@@ -617,7 +699,7 @@ exports.create_selector_closure_fn = function(log_obj, cfg, selector_str, delimi
     return nil
   end
 
-  return function(task)
+  local function process(task)
     local res = exports.process_selectors(task, selector)
 
     if res then
@@ -626,6 +708,30 @@ exports.create_selector_closure_fn = function(log_obj, cfg, selector_str, delimi
 
     return nil
   end
+
+  if fun.any(function(sel)
+    return sel.selector.volatile
+  end, selector) then
+    return process
+  end
+
+  -- The same selector is often used by many rules, so it is computed once per task
+  local cache_key = string.format('selector_%s_%s_%s', tostring(fn),
+      delimiter or '', selector_str)
+
+  return function(task)
+    local res = task:cache_get(cache_key)
+
+    if res == nil then
+      res = process(task)
+      -- False means that we have no value
+      task:cache_set(cache_key, res == nil and false or res)
+    elseif res == false then
+      res = nil
+    end
+
+    return res
+  end
 end
 
 --[[[
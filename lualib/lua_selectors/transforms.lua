@@ -152,8 +152,10 @@ local transform_function = {
       ['list'] = true
     },
     ['process'] = function(inp, t, _)
-      table.sort(inp)
-      return inp, t
+      -- Input might be shared with other selectors, so sort a copy
+      local res = fun.totable(inp)
+      table.sort(res)
+      return res, t
     end,
     ['description'] = 'Sort strings lexicographically',
   },
@@ -139,6 +139,66 @@ end
 
 exports.convert_bayes_schema = convert_bayes_schema
 
+local function load_convert_checkpoint(path)
+  local ucl = require "ucl"
+  local f = io.open(path, 'r')
+
+  if not f then
+    return {}
+  end
+
+  local parser = ucl.parser()
+  local res, err = parser:parse_string(f:read('*a'))
+  f:close()
+
+  if not res then
+    logger.errx('cannot parse checkpoint %s: %s', path, err)
+    return {}
+  end
+
+  return parser:get_object() or {}
+end
+
+local function save_convert_checkpoint(path, checkpoint)
+  local ucl = require "ucl"
+  local tmp = path .. '.tmp'
+  local f = io.open(tmp, 'w')
+
+  if f then
+    f:write(ucl.to_format(checkpoint, 'json-compact'))
+    f:close()
+    os.rename(tmp, path)
+  end
+end
+
+-- Reads table by rowid ranges calling `cb(rows, last_rowid)` for each batch
+-- until it returns false
+local function sqlite_rows_batched(db, query, from_rowid, batch, cb)
+  local last = from_rowid
+
+  while true do
+    local rows = {}
+
+    for row in db:rows(query, last, batch) do
+      rows[#rows + 1] = row
+    end
+
+    if #rows == 0 then
+      return true
+    end
+
+    last = tonumber(rows[#rows].rowid)
+
+    if not cb(rows, last) then
+      return false
+    end
+
+    if #rows < batch then
+      return true
+    end
+  end
+end
+
 -- It now accepts both ham and spam databases
 -- parameters:
 -- redis_params - how do we connect to a redis server
@@ -149,13 +209,37 @@ exports.convert_bayes_schema = convert_bayes_schema
 -- learn_cache_spam - name for sqlite database with spam learn cache
 -- learn_cache_ham - name for sqlite database with ham learn cache
 -- reset_previous - if true, then the old database is flushed (slow)
+-- opts - optional table:
+--   connections - number of redis connections with batches in flight (4 by default)
+--   batch - number of rows per batch (1000 by default)
+--   checkpoint - file to store progress in, conversion is resumed from it if it exists
 local function convert_sqlite_to_redis(redis_params,
                                        sqlite_db_spam, sqlite_db_ham, symbol_spam, symbol_ham,
-                                       learn_cache_db, expire, reset_previous)
+                                       learn_cache_db, expire, reset_previous, opts)
+  opts = opts or {}
   local nusers = 0
-  local lim = 1000 -- Update each 1000 tokens
+  -- Each batch is replied at once, so it is limited by lua stack size
+  local lim = math.min(math.max(opts.batch or 1000, 1), 1500)
   local users_map = {}
   local converted = 0
+  local checkpoint = {}
+  local last_save = 0
+
+  if opts.checkpoint then
+    checkpoint = load_convert_checkpoint(opts.checkpoint)
+  end
+
+  local function update_checkpoint(key, rowid, force)
+    if opts.checkpoint then
+      checkpoint[key] = rowid
+      local now = util.get_time()
+
+      if force or now - last_save >= 1.0 then
+        save_convert_checkpoint(opts.checkpoint, checkpoint)
+        last_save = now
+      end
+    end
+  end
 
   local db_spam = sqlite3.open(sqlite_db_spam)
   if not db_spam then
@@ -175,7 +259,16 @@ local function convert_sqlite_to_redis(redis_params,
     return false
   end
 
-  if reset_previous then
+  local pipeline = lua_redis.sync_pipeline(redis_params, opts.connections or 4)
+
+  if not pipeline then
+    logger.errx("cannot connect to redis server")
+    return false
+  end
+
+  if reset_previous and next(checkpoint) then
+    logger.messagex('Resuming from %s, old data is not cleaned up', opts.checkpoint)
+  elseif reset_previous then
     -- Do a more complicated cleanup
     -- execute a lua script that cleans up data
     local script = [[
@@ -211,8 +304,8 @@ end
       what = 'spam'
     end
 
+    local checkpoint_key = what .. ':' .. (is_spam and sqlite_db_spam or sqlite_db_ham)
     local learns = {}
-    db:sql('BEGIN;')
     -- Fill users mapping
     for row in db:rows('SELECT * FROM users;') do
       if row.id == '0' then
@@ -233,77 +326,80 @@ end
       end
     end
 
-    local function send_batch(tokens, prefix)
-      -- We use the new schema: RS[user]_token -> H=ham count
-      --                                          S=spam count
-      local hash_key = 'H'
-      if is_spam then
-        hash_key = 'S'
-      end
-      for _, tok in ipairs(tokens) do
-        -- tok schema:
-        -- tok[1] = token_id (uint64 represented as a string)
-        -- tok[2] = token value (number)
-        -- tok[3] = user_map[user_id] or ''
-        local rkey = string.format('%s%s_%s', prefix, tok[3], tok[1])
-        conn:add_cmd('HINCRBYFLOAT', { rkey, hash_key, tostring(tok[2]) })
-
-        if expire and expire ~= 0 then
-          conn:add_cmd('EXPIRE', { rkey, tostring(expire) })
-        end
-      end
-
-      return conn:exec()
+    -- We use the new schema: RS[user]_token -> H=ham count
+    --                                          S=spam count
+    local hash_key = 'H'
+    if is_spam then
+      hash_key = 'S'
     end
-    -- Fill tokens, sending data to redis each `lim` records
 
-    local ntokens = db:query('SELECT count(*) as c FROM tokens')['c']
-    local tokens = {}
-    local num = 0
+    local ntokens = tonumber(db:query('SELECT count(*) as c FROM tokens')['c'])
+    local from_rowid = checkpoint[checkpoint_key] or 0
     local total = 0
+    local start_time = util.get_time()
 
-    for row in db:rows('SELECT token,value,user FROM tokens;') do
-      local user = ''
-      if row.user ~= 0 and users_map[row.user] then
-        user = users_map[row.user]
-      end
+    if from_rowid > 0 then
+      total = tonumber(db:query('SELECT count(*) as c FROM tokens WHERE rowid <= ?1',
+          from_rowid)['c'])
+      logger.messagex('Resume %s tokens after rowid %s', what, from_rowid)
+    end
 
-      table.insert(tokens, { row.token, row.value, user })
-      num = num + 1
-      total = total + 1
-      if num > lim then
-        -- TODO: we use the default 'RS' prefix, it can be false in case of
-        -- classifiers with labels
-        local ret, err_str = send_batch(tokens, 'RS')
-        if not ret then
-          logger.errx('Cannot send tokens to the redis server: ' .. err_str)
-          db:sql('COMMIT;')
-          return false
-        end
+    local start_total = total
 
-        num = 0
-        tokens = {}
-      end
+    -- Batches are read by rowid ranges and sent over several connections
+    local ret, err_str = true, nil
+    db:sql('BEGIN;')
+    sqlite_rows_batched(db,
+        'SELECT rowid,token,value,user FROM tokens WHERE rowid > ?1 ORDER BY rowid LIMIT ?2',
+        from_rowid, lim, function(rows, last_rowid)
+          local cmds = {}
+
+          for _, row in ipairs(rows) do
+            local user = ''
+            if row.user ~= 0 and users_map[row.user] then
+              user = users_map[row.user]
+            end
+
+            -- TODO: we use the default 'RS' prefix, it can be false in case of
+            -- classifiers with labels
+            local rkey = string.format('RS%s_%s', user, row.token)
+            cmds[#cmds + 1] = { 'HINCRBYFLOAT', { rkey, hash_key, tostring(row.value) } }
+
+            if expire and expire ~= 0 then
+              cmds[#cmds + 1] = { 'EXPIRE', { rkey, tostring(expire) } }
+            end
+          end
+
+          local nrows = #rows
+          ret, err_str = pipeline.send(cmds, function()
+            total = total + nrows
+            update_checkpoint(checkpoint_key, last_rowid)
+            local elapsed = util.get_time() - start_time
+            io.write(string.format('Processed batch %s: %s/%s (%.0f tokens/s)\r', what, total, ntokens,
+                elapsed > 0 and (total - start_total) / elapsed or 0))
+          end)
+
+          return ret
+        end)
+
+    db:sql('COMMIT;')
+
+    if ret then
+      ret, err_str = pipeline.flush()
+    end
 
-      io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+    if not ret then
+      logger.errx('Cannot send tokens to the redis server: ' .. tostring(err_str))
+      return false
     end
-    -- Last batch
-    if #tokens > 0 then
-      local ret, err_str = send_batch(tokens, 'RS')
-      if not ret then
-        logger.errx('Cannot send tokens to the redis server: ' .. err_str)
-        db:sql('COMMIT;')
-        return false
-      end
 
-      io.write(string.format('Processed batch %s: %s/%s\r', what, total, ntokens))
+    if opts.checkpoint and checkpoint[checkpoint_key] then
+      update_checkpoint(checkpoint_key, checkpoint[checkpoint_key], true)
     end
     io.write('\n')
 
     converted = converted + total
 
-    -- Close DB
-    db:sql('COMMIT;')
     local symbol = symbol_ham
     local learns_elt = "learns_ham"
 
@@ -341,44 +437,55 @@ end
   if learn_cache_db then
     logger.messagex('Convert learned ids from %s', learn_cache_db)
     local db = sqlite3.open(learn_cache_db)
-    local ret = true
     local total = 0
+    local checkpoint_key = 'cache:' .. learn_cache_db
 
     if not db then
       logger.errx('Cannot open cache database: ' .. learn_cache_db)
       return false
     end
 
-    db:sql('BEGIN;')
+    local ret, err_str = true, nil
+    sqlite_rows_batched(db,
+        'SELECT rowid,digest,flag FROM learns WHERE rowid > ?1 ORDER BY rowid LIMIT ?2',
+        checkpoint[checkpoint_key] or 0, lim, function(rows, last_rowid)
+          local cmds = {}
 
-    for row in db:rows('SELECT * FROM learns;') do
-      local is_spam
-      local digest = tostring(util.encode_base32(row.digest))
+          for _, row in ipairs(rows) do
+            local is_spam
+            local digest = tostring(util.encode_base32(row.digest))
 
-      if row.flag == '0' then
-        is_spam = '-1'
-      else
-        is_spam = '1'
-      end
+            if row.flag == '0' then
+              is_spam = '-1'
+            else
+              is_spam = '1'
+            end
 
-      if not conn:add_cmd('HSET', { 'learned_ids', digest, is_spam }) then
-        logger.errx('Cannot add hash: ' .. digest)
-        ret = false
-      else
-        total = total + 1
-      end
-    end
-    db:sql('COMMIT;')
+            cmds[#cmds + 1] = { 'HSET', { 'learned_ids', digest, is_spam } }
+          end
+
+          local nrows = #rows
+          ret, err_str = pipeline.send(cmds, function()
+            total = total + nrows
+            update_checkpoint(checkpoint_key, last_rowid)
+          end)
+
+          return ret
+        end)
 
     if ret then
-      conn:exec()
+      ret, err_str = pipeline.flush()
     end
 
     if ret then
+      if checkpoint[checkpoint_key] then
+        update_checkpoint(checkpoint_key, checkpoint[checkpoint_key], true)
+      end
       logger.messagex('Converted %s cached items from sqlite3 learned cache to redis',
           total)
     else
-      logger.errx('Error occurred during sending data to redis')
+      logger.errx('Error occurred during sending data to redis: %s', err_str)
+      return false
     end
   end
 
@@ -62,6 +62,7 @@ local default_options = {
   symbol_spam = 'NEURAL_SPAM',
   symbol_ham = 'NEURAL_HAM',
   max_inputs = nil, -- when PCA is used
+  quantize = false, -- use int8 quantized ANN in scanners (less memory, slightly less precise)
   blacklisted_symbols = {}, -- list of symbols skipped in neural processing
 }
 
@@ -193,9 +194,18 @@ local function get_roc_thresholds(ann, inputs, outputs, alpha, beta)
 
   local function get_scores(nn, input_vectors)
     local scores = {}
-    for i = 1, #inputs do
-      local score = nn:apply1(input_vectors[i], nn.pca)[1]
-      scores[#scores + 1] = score
+    local batch_size = 256
+    -- Vectors are applied in batches, so each batch is a single forward pass
+    for i = 1, #input_vectors, batch_size do
+      local batch = {}
+      for j = i, math.min(i + batch_size - 1, #input_vectors) do
+        batch[#batch + 1] = input_vectors[j]
+      end
+
+      local outs = nn:apply(batch, nn.pca)
+      for _, out in ipairs(outs) do
+        scores[#scores + 1] = out[1]
+      end
     end
 
     return scores
@@ -524,7 +534,8 @@ local function spawn_train(params)
             lr = params.rule.train.learning_rate,
             max_epoch = params.rule.train.max_iterations,
             cb = train_cb,
-            pca = pca
+            pca = pca,
+            threads = params.rule.train.learn_threads,
           })
 
       if not ret then
@@ -0,0 +1,31 @@
+-- Lua script to apply coalesced bayes learns
+-- This script accepts the following parameters:
+-- key1 - prefix for bayes tokens (e.g. for per-user classification)
+-- key2 - boolean is_spam
+-- key3 - string symbol
+-- key4 - number of learns to add (negative for unlearns)
+-- key5 - token keys interleaved with their increments encoded in messagepack array of strings
+
+local prefix = KEYS[1]
+local is_spam = KEYS[2] == 'true' and true or false
+local symbol = KEYS[3]
+local learns = tonumber(KEYS[4])
+local input_tokens = cmsgpack.unpack(KEYS[5])
+
+local hash_key = is_spam and 'S' or 'H'
+local learned_key = is_spam and 'learns_spam' or 'learns_ham'
+
+redis.call('SADD', symbol .. '_keys', prefix)
+redis.call('HSET', prefix, 'version', '2') -- new schema
+
+if learns ~= 0 then
+  redis.call('HINCRBY', prefix, learned_key, learns) -- increase or decrease learned count
+end
+
+for i = 1, #input_tokens, 2 do
+  local delta = tonumber(input_tokens[i + 1])
+
+  if delta ~= 0 then
+    redis.call('HINCRBY', input_tokens[i], hash_key, delta)
+  end
+end
@@ -0,0 +1,79 @@
+-- This script merges hits accounted locally by a worker into a token bucket
+-- (used by the ratelimit plugin when `local_buckets` are enabled).
+
+-- KEYS: Input parameters
+-- KEYS[1] - prefix: The Redis key prefix used to store the bucket information.
+-- KEYS[2] - now: The current time in milliseconds.
+-- KEYS[3] - leak_rate: The bucket leak rate (messages per millisecond).
+-- KEYS[4] - dynamic_rate_multiplier: Aggregated multiplier to adjust the rate limit dynamically.
+-- KEYS[5] - dynamic_burst_multiplier: Aggregated multiplier to adjust the burst limit dynamically.
+-- KEYS[6] - max_dyn_rate: The maximum allowed value for the dynamic rate multiplier.
+-- KEYS[7] - max_burst_rate: The maximum allowed value for the dynamic burst multiplier.
+-- KEYS[8] - expire: The expiration time for the Redis key storing the bucket information, in seconds.
+-- KEYS[9] - hits: The number of hits accounted locally since the previous reconciliation.
+
+-- Returns:
+-- An array containing the current burst value, the dynamic rate multiplier
+-- and the dynamic burst multiplier
+
+local prefix = KEYS[1]
+local now = tonumber(KEYS[2])
+local leak_rate = tonumber(KEYS[3])
+local hits = tonumber(KEYS[9])
+local last = redis.call('HGET', prefix, 'l')
+
+if not last then
+  -- 1. New bucket (or expired one)
+  redis.call('HMSET', prefix, 'l', tostring(now), 'b', tostring(hits), 'dr', '10000', 'db', '10000', 'p', '0')
+  redis.call('EXPIRE', prefix, KEYS[8])
+  return { tostring(hits), '1', '1' }
+end
+last = tonumber(last)
+
+local burst, dr, db = unpack(redis.call('HMGET', prefix, 'b', 'dr', 'db'))
+burst = tonumber(burst or '0')
+dr = tonumber(dr or '10000') / 10000.0
+db = tonumber(db or '10000') / 10000.0
+if burst < 0 then
+  burst = 0
+end
+if dr == 0 then
+  dr = 0.0001
+end
+if db == 0 then
+  db = 0.0001
+end
+
+-- 2. Leak tokens for the time passed
+if burst > 0 and last < now then
+  local leaked = (now - last) * leak_rate * dr
+  if leaked > burst then
+    leaked = burst
+  end
+  burst = burst - leaked
+end
+
+-- 3. Apply dynamic multipliers in the same way as ratelimit_update.lua does
+local function update_mult(cur, mult, max_mult)
+  if max_mult > 1 then
+    if (mult > 1.0 and cur < max_mult) or (mult < 1.0 and cur > (1.0 / max_mult)) then
+      cur = cur * mult
+      if cur < 0.0001 then
+        cur = 0.0001
+      end
+    end
+  end
+
+  return cur
+end
+
+dr = update_mult(dr, tonumber(KEYS[4]), tonumber(KEYS[6]))
+db = update_mult(db, tonumber(KEYS[5]), tonumber(KEYS[7]))
+
+-- 4. Add local hits and store everything back
+burst = burst + hits
+redis.call('HMSET', prefix, 'b', tostring(burst), 'l', tostring(now),
+    'dr', tostring(math.floor(dr * 10000)), 'db', tostring(math.floor(db * 10000)))
+redis.call('EXPIRE', prefix, KEYS[8])
+
+return { tostring(burst), tostring(dr), tostring(db) }
@@ -0,0 +1,236 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+local argparse = require "argparse"
+local rspamd_util = require "rspamd_util"
+local ucl = require "ucl"
+
+local parser = argparse()
+    :name "rspamadm binlog"
+    :description "Render binary task log (logging.binary_log) as text or JSON"
+    :help_description_margin(30)
+
+parser:argument "input":args "*"
+      :description('Process specified inputs')
+      :default("stdin")
+parser:flag "-j --json"
+      :description('Output one JSON object per record')
+parser:flag "-S --sort"
+      :description('Sort symbols by name as in the text log')
+
+-- Must match src/libserver/task_binlog.h
+local MAGIC = 0x4c425352
+
+local fields = {
+  [1] = { 'ts', 'd' },
+  [2] = { 'message_id', 's' },
+  [3] = { 'qid', 's' },
+  [4] = { 'ip', 's' },
+  [5] = { 'user', 's' },
+  [6] = { 'smtp_from', 's' },
+  [7] = { 'smtp_rcpts', 's', true },
+  [8] = { 'action', 's' },
+  [9] = { 'score', 'd' },
+  [10] = { 'required_score', 'd' },
+  [11] = { 'symbols', 'symbol', true },
+  [12] = { 'time_real', 'd' },
+  [13] = { 'len', 'u64' },
+  [14] = { 'dns_req', 'u32' },
+  [15] = { 'digest', 'hex' },
+  [16] = { 'settings_id', 's' },
+}
+
+local function parse_record(body)
+  local res = {}
+  local pos, len = 1, #body
+
+  while pos <= len do
+    local tag, v
+    tag, pos = rspamd_util.unpack('<B', body, pos)
+    local fdef = fields[tag]
+
+    if not fdef then
+      return nil, string.format('unknown field %d', tag)
+    end
+
+    local kind = fdef[2]
+
+    if kind == 'd' then
+      v, pos = rspamd_util.unpack('<d', body, pos)
+    elseif kind == 's' then
+      v, pos = rspamd_util.unpack('<s2', body, pos)
+    elseif kind == 'hex' then
+      v, pos = rspamd_util.unpack('<s2', body, pos)
+      v = v:gsub('.', function(c)
+        return string.format('%02x', c:byte())
+      end)
+    elseif kind == 'u64' then
+      v, pos = rspamd_util.unpack('<I8', body, pos)
+    elseif kind == 'u32' then
+      v, pos = rspamd_util.unpack('<I4', body, pos)
+    elseif kind == 'symbol' then
+      local score, name, nopts
+      score, name, nopts, pos = rspamd_util.unpack('<ds2I2', body, pos)
+      v = { name = name, score = score }
+
+      if nopts > 0 then
+        v.options = {}
+
+        for i = 1, nopts do
+          v.options[i], pos = rspamd_util.unpack('<s2', body, pos)
+        end
+      end
+    end
+
+    if fdef[3] then
+      local ar = res[fdef[1]] or {}
+      ar[#ar + 1] = v
+      res[fdef[1]] = ar
+    else
+      res[fdef[1]] = v
+    end
+  end
+
+  return res
+end
+
+local function render_text(rec)
+  local out = {}
+  local function add(fmt, ...)
+    out[#out + 1] = string.format(fmt, ...)
+  end
+
+  add('%s id: <%s>', os.date('%Y-%m-%d %H:%M:%S', math.floor(rec.ts or 0)),
+      rec.message_id or 'undef')
+
+  if rec.qid then
+    add('qid: <%s>', rec.qid)
+  end
+  if rec.ip then
+    add('ip: %s', rec.ip)
+  end
+  if rec.user then
+    add('user: %s', rec.user)
+  end
+  if rec.smtp_from then
+    add('from: <%s>', rec.smtp_from)
+  end
+
+  local syms = {}
+  for _, sym in ipairs(rec.symbols or {}) do
+    syms[#syms + 1] = string.format('%s(%.2f){%s}', sym.name, sym.score,
+        sym.options and (table.concat(sym.options, ';') .. ';') or '')
+  end
+
+  add('(default: %s: [%.2f/%.2f] [%s])',
+      rec.action or 'undef', rec.score or 0, rec.required_score or 0,
+      table.concat(syms, ','))
+  add('len: %d', rec.len or 0)
+  add('time: %.3fms', (rec.time_real or 0) * 1000.0)
+  add('dns req: %d', rec.dns_req or 0)
+  add('digest: <%s>', rec.digest or 'undef')
+
+  if rec.smtp_rcpts then
+    add('rcpts: <%s>', table.concat(rec.smtp_rcpts, ','))
+  end
+  if rec.settings_id then
+    add('settings_id: %s', rec.settings_id)
+  end
+
+  return table.concat(out, ', ')
+end
+
+local function process_file(f, fname, opts)
+  local nrec = 0
+
+  while true do
+    local hdr = f:read(8)
+
+    if not hdr or #hdr < 8 then
+      break
+    end
+
+    local magic, len = rspamd_util.unpack('<I4I4', hdr)
+
+    if magic ~= MAGIC then
+      io.stderr:write(string.format('%s: bad record magic after %d records\n',
+          fname, nrec))
+      return
+    end
+
+    local body = f:read(len)
+
+    if not body or #body < len then
+      io.stderr:write(string.format('%s: truncated record after %d records\n',
+          fname, nrec))
+      return
+    end
+
+    local ok, rec, err = pcall(parse_record, body)
+
+    if not ok or not rec then
+      io.stderr:write(string.format('%s: cannot parse record %d: %s\n',
+          fname, nrec + 1, err or rec))
+    else
+      if opts.sort and rec.symbols then
+        table.sort(rec.symbols, function(a, b)
+          return a.name < b.name
+        end)
+      end
+
+      if opts.json then
+        io.write(ucl.to_format(rec, 'json-compact'))
+      else
+        io.write(render_text(rec))
+      end
+      io.write('\n')
+    end
+
+    nrec = nrec + 1
+  end
+end
+
+local function handler(args)
+  local opts = parser:parse(args)
+
+  for _, fname in ipairs(opts.input) do
+    local f, err
+
+    if fname == 'stdin' then
+      f = io.stdin
+    else
+      f, err = io.open(fname, 'rb')
+    end
+
+    if not f then
+      io.stderr:write(string.format('cannot open %s: %s\n', fname, err))
+      os.exit(1)
+    end
+
+    process_file(f, fname, opts)
+
+    if f ~= io.stdin then
+      f:close()
+    end
+  end
+end
+
+return {
+  name = 'binlog',
+  aliases = { 'binary_log' },
+  handler = handler,
+  description = parser._description
+}
@@ -1,152 +1,90 @@
 local sqlite3 = require "rspamd_sqlite3"
-local redis = require "rspamd_redis"
 local util = require "rspamd_util"
+local lua_redis = require "lua_redis"
+local ucl = require "ucl"
 
-local function connect_redis(server, username, password, db)
-  local ret
-  local conn, err = redis.connect_sync({
-    host = server,
-  })
+-- Each digest is written as HMSET + EXPIRE and SET + EXPIRE for each of its
+-- shingles (up to 32), all replies of a batch are returned at once, so the
+-- batch is limited by lua stack size
+local max_batch = 50
 
-  if not conn then
-    return nil, 'Cannot connect: ' .. err
-  end
+local function load_checkpoint(path)
+  local f = io.open(path, 'r')
 
-  if username then
-    if password then
-      ret = conn:add_cmd('AUTH', { username, password })
-      if not ret then
-        return nil, 'Cannot queue command'
-      end
-    else
-      return nil, 'Redis requires a password when username is supplied'
-    end
-  elseif password then
-    ret = conn:add_cmd('AUTH', { password })
-    if not ret then
-      return nil, 'Cannot queue command'
-    end
+  if not f then
+    return {}
   end
-  if db then
-    ret = conn:add_cmd('SELECT', { db })
-    if not ret then
-      return nil, 'Cannot queue command'
-    end
+
+  local parser = ucl.parser()
+  local res, err = parser:parse_string(f:read('*a'))
+  f:close()
+
+  if not res then
+    print(string.format('Cannot parse checkpoint %s: %s', path, err))
+    return {}
   end
 
-  return conn, nil
+  return parser:get_object() or {}
 end
 
-local function send_digests(digests, redis_host, redis_username, redis_password, redis_db)
-  local conn, err = connect_redis(redis_host, redis_username, redis_password, redis_db)
-  if err then
-    print(err)
-    return false
-  end
-  local ret
-  for _, v in ipairs(digests) do
-    ret = conn:add_cmd('HMSET', {
-      'fuzzy' .. v[1],
-      'F', v[2],
-      'V', v[3],
-    })
-    if not ret then
-      print('Cannot batch command')
-      return false
-    end
-    ret = conn:add_cmd('EXPIRE', {
-      'fuzzy' .. v[1],
-      tostring(v[4]),
-    })
-    if not ret then
-      print('Cannot batch command')
-      return false
-    end
-  end
-  ret, err = conn:exec()
-  if not ret then
-    print('Cannot execute batched commands: ' .. err)
-    return false
+local function save_checkpoint(path, checkpoint)
+  local tmp = path .. '.tmp'
+  local f = io.open(tmp, 'w')
+
+  if f then
+    f:write(ucl.to_format(checkpoint, 'json-compact'))
+    f:close()
+    os.rename(tmp, path)
   end
-  return true
 end
 
-local function send_shingles(shingles, redis_host, redis_username, redis_password, redis_db)
-  local conn, err = connect_redis(redis_host, redis_username, redis_password, redis_db)
-  if err then
-    print("Redis error: " .. err)
-    return false
-  end
-  local ret
-  for _, v in ipairs(shingles) do
-    ret = conn:add_cmd('SET', {
-      'fuzzy_' .. v[2] .. '_' .. v[1],
-      v[4],
-    })
-    if not ret then
-      print('Cannot batch SET command: ' .. err)
-      return false
-    end
-    ret = conn:add_cmd('EXPIRE', {
-      'fuzzy_' .. v[2] .. '_' .. v[1],
-      tostring(v[3]),
-    })
-    if not ret then
-      print('Cannot batch command')
-      return false
+local function digests_commands(db, digests, now, expiry)
+  local cmds = {}
+  local ndigests, nshingles = 0, 0
+  local by_id = {}
+
+  for _, row in ipairs(digests) do
+    local expire_in = math.floor(now - row.time + expiry)
+
+    if expire_in >= 1 then
+      by_id[row.id] = { row.digest, expire_in }
+      cmds[#cmds + 1] = { 'HMSET', {
+        'fuzzy' .. row.digest,
+        'F', row.flag,
+        'V', row.value,
+      } }
+      cmds[#cmds + 1] = { 'EXPIRE', { 'fuzzy' .. row.digest, tostring(expire_in) } }
+      ndigests = ndigests + 1
     end
   end
-  ret, err = conn:exec()
-  if not ret then
-    print('Cannot execute batched commands: ' .. err)
-    return false
-  end
-  return true
-end
 
-local function update_counters(total, redis_host, redis_username, redis_password, redis_db)
-  local conn, err = connect_redis(redis_host, redis_username, redis_password, redis_db)
-  if err then
-    print(err)
-    return false
-  end
-  local ret
-  ret = conn:add_cmd('SET', {
-    'fuzzylocal',
-    total,
-  })
-  if not ret then
-    print('Cannot batch command')
-    return false
-  end
-  ret = conn:add_cmd('SET', {
-    'fuzzy_count',
-    total,
-  })
-  if not ret then
-    print('Cannot batch command')
-    return false
-  end
-  ret, err = conn:exec()
-  if not ret then
-    print('Cannot execute batched commands: ' .. err)
-    return false
+  if #cmds > 0 then
+    -- Shingles of the whole batch are read at once instead of a query per digest
+    for srow in db:rows('SELECT digest_id, value, number FROM shingles ' ..
+        'WHERE digest_id > ?1 AND digest_id <= ?2', tonumber(digests[1].id) - 1,
+        tonumber(digests[#digests].id)) do
+      local digest = by_id[srow.digest_id]
+
+      if digest then
+        local key = 'fuzzy_' .. srow.number .. '_' .. srow.value
+        cmds[#cmds + 1] = { 'SET', { key, digest[1] } }
+        cmds[#cmds + 1] = { 'EXPIRE', { key, tostring(digest[2]) } }
+        nshingles = nshingles + 1
+      end
+    end
   end
-  return true
+
+  return cmds, ndigests, nshingles
 end
 
 return function(_, res)
   local db = sqlite3.open(res['source_db'])
-  local shingles = {}
-  local digests = {}
-  local num_batch_digests = 0
-  local num_batch_shingles = 0
   local total_digests = 0
   local total_shingles = 0
-  local lim_batch = 1000 -- Update each 1000 entries
-  local redis_username = res['redis_username']
-  local redis_password = res['redis_password']
+  local lim_batch = math.min(math.max(res['batch'] or max_batch, 1), max_batch)
   local redis_db = nil
+  local checkpoint = {}
+  local last_save = 0
 
   if res['redis_db'] then
     redis_db = tostring(res['redis_db'])
@@ -157,51 +95,114 @@ return function(_, res)
     return
   end
 
-  local now = util.get_time()
-  for row in db:rows('SELECT id, flag, digest, value, time FROM digests') do
+  local redis_params = lua_redis.try_load_redis_servers({
+    servers = res['redis_host'],
+    username = res['redis_username'],
+    password = res['redis_password'],
+    db = redis_db,
+  }, nil)
 
-    local expire_in = math.floor(now - row.time + res['expiry'])
-    if expire_in >= 1 then
-      table.insert(digests, { row.digest, row.flag, row.value, expire_in })
-      num_batch_digests = num_batch_digests + 1
-      total_digests = total_digests + 1
-      for srow in db:rows('SELECT value, number FROM shingles WHERE digest_id = ' .. row.id) do
-        table.insert(shingles, { srow.value, srow.number, expire_in, row.digest })
-        total_shingles = total_shingles + 1
-        num_batch_shingles = num_batch_shingles + 1
-      end
+  if not redis_params then
+    print('Cannot parse redis host: ' .. res['redis_host'])
+    return
+  end
+
+  local pipeline, err = lua_redis.sync_pipeline(redis_params, res['connections'] or 4)
+
+  if not pipeline then
+    print('Redis error: ' .. err)
+    return
+  end
+
+  if res['checkpoint'] then
+    checkpoint = load_checkpoint(res['checkpoint'])
+
+    if checkpoint.id then
+      total_digests = checkpoint.digests or 0
+      total_shingles = checkpoint.shingles or 0
+      print(string.format('Resuming after digest %d', checkpoint.id))
     end
-    if num_batch_digests >= lim_batch then
-      if not send_digests(digests, res['redis_host'], redis_username, redis_password, redis_db) then
-        return
+  end
+
+  local function update_checkpoint(id, ndigests, nshingles, force)
+    total_digests = total_digests + ndigests
+    total_shingles = total_shingles + nshingles
+
+    if res['checkpoint'] then
+      checkpoint.id = id
+      checkpoint.digests = total_digests
+      checkpoint.shingles = total_shingles
+      local ts = util.get_time()
+
+      if force or ts - last_save >= 1.0 then
+        save_checkpoint(res['checkpoint'], checkpoint)
+        last_save = ts
       end
-      num_batch_digests = 0
-      digests = {}
     end
-    if num_batch_shingles >= lim_batch then
-      if not send_shingles(shingles, res['redis_host'], redis_username, redis_password, redis_db) then
+  end
+
+  local now = util.get_time()
+  local start = now
+  local last_id = checkpoint.id or 0
+
+  while true do
+    local digests = {}
+
+    for row in db:rows('SELECT id, flag, digest, value, time FROM digests ' ..
+        'WHERE id > ?1 ORDER BY id LIMIT ?2', last_id, lim_batch) do
+      digests[#digests + 1] = row
+    end
+
+    if #digests == 0 then
+      break
+    end
+
+    last_id = tonumber(digests[#digests].id)
+    local cmds, ndigests, nshingles = digests_commands(db, digests, now, res['expiry'])
+
+    -- Batches with all digests expired are skipped, they are rechecked on resume
+    if #cmds > 0 then
+      local batch_id = last_id
+      local ret
+      ret, err = pipeline.send(cmds, function()
+        update_checkpoint(batch_id, ndigests, nshingles)
+        io.write(string.format('\rMigrated %d digests and %d shingles (%.0f digests/s)',
+            total_digests, total_shingles,
+            total_digests / math.max(util.get_time() - start, 0.001)))
+        io.flush()
+      end)
+
+      if not ret then
+        print('\nCannot execute batched commands: ' .. err)
         return
       end
-      num_batch_shingles = 0
-      shingles = {}
     end
-  end
-  if digests[1] then
-    if not send_digests(digests, res['redis_host'], redis_username, redis_password, redis_db) then
-      return
+
+    if #digests < lim_batch then
+      break
     end
   end
-  if shingles[1] then
-    if not send_shingles(shingles, res['redis_host'], redis_username, redis_password, redis_db) then
-      return
-    end
+
+  local ret
+  ret, err = pipeline.flush()
+
+  if not ret then
+    print('\nCannot execute batched commands: ' .. err)
+    return
   end
 
+  update_checkpoint(last_id, 0, 0, true)
+
   local message = string.format(
-      'Migrated %d digests and %d shingles',
+      '\nMigrated %d digests and %d shingles',
       total_digests, total_shingles
   )
-  if not update_counters(total_digests, res['redis_host'], redis_username, redis_password, redis_db) then
+
+  ret = pipeline.send({
+    { 'SET', { 'fuzzylocal', tostring(total_digests) } },
+    { 'SET', { 'fuzzy_count', tostring(total_digests) } },
+  })
+  if not ret or not pipeline.flush() then
     message = message .. ' but failed to update counters'
   end
   print(message)
@@ -0,0 +1,207 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+local argparse = require "argparse"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_util = require "rspamd_util"
+local ucl = require "ucl"
+
+local parser = argparse()
+    :name "rspamadm mapbench"
+    :description "Measure load time, memory and lookup speed of the configured maps"
+    :help_description_margin(32)
+
+parser:option "-c --config"
+      :description "Path to config file"
+      :argname("<cfg>")
+      :default(rspamd_paths["CONFDIR"] .. "/" .. "rspamd.conf")
+parser:option "-m --map"
+      :description "Only check maps with URI matching this Lua pattern"
+      :argname("<pattern>")
+parser:option "-k --keys"
+      :description "File with sample keys to look up (one per line), otherwise map keys are used"
+      :argname("<file>")
+parser:option "-n --lookups"
+      :description "Number of lookups of each kind"
+      :argname("<N>")
+      :convert(tonumber)
+      :default(10000)
+parser:option "-s --samples"
+      :description "Maximum number of sample keys taken from a map"
+      :argname("<N>")
+      :convert(tonumber)
+      :default(1000)
+parser:flag "--compact"
+      :description "Compact JSON output"
+
+-- Maps that support lookups by a string key
+local lookup_types = {
+  radix = true,
+  set = true,
+  hash = true,
+  regexp = true,
+  regexp_multi = true,
+  cdb = true,
+}
+
+local function load_config(opts)
+  local _r, err = rspamd_config:load_ucl(opts['config'])
+
+  if not _r then
+    rspamd_logger.errx('cannot parse %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  _r, err = rspamd_config:parse_rcl({ 'logging', 'worker' })
+  if not _r then
+    rspamd_logger.errx('cannot process %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  -- Plugins define most of maps, only local and cached data is read
+  rspamd_config:init_subsystem('filters,maps')
+end
+
+local function read_keys(fname)
+  local f = io.open(fname, 'r')
+
+  if not f then
+    rspamd_logger.errx('cannot open %s', fname)
+    os.exit(1)
+  end
+
+  local keys = {}
+  for line in f:lines() do
+    if #line > 0 then
+      keys[#keys + 1] = line
+    end
+  end
+  f:close()
+
+  return keys
+end
+
+local function map_keys(map, map_type, max_samples)
+  local keys = {}
+
+  -- Regexps are not keys that could match themselves
+  if map_type == 'regexp' or map_type == 'regexp_multi' then
+    return keys
+  end
+
+  map:foreach(function(k, _)
+    if #keys < max_samples then
+      if map_type == 'radix' then
+        -- Strip mask from a network
+        k = k:match('^([^/]+)') or k
+      end
+      keys[#keys + 1] = k
+    end
+  end)
+
+  return keys
+end
+
+local function miss_keys(map_type, n)
+  local keys = {}
+
+  for i = 1, n do
+    if map_type == 'radix' then
+      -- Random addresses from the reserved 240.0.0.0/4 block
+      keys[i] = string.format('%d.%d.%d.%d', math.random(240, 254),
+          math.random(0, 255), math.random(0, 255), math.random(1, 254))
+    else
+      keys[i] = rspamd_util.random_hex(16)
+    end
+  end
+
+  return keys
+end
+
+-- Returns nanoseconds per lookup and a number of found keys
+local function bench_lookups(map, keys, n)
+  local found = 0
+  local nkeys = #keys
+  local t1 = rspamd_util.get_ticks()
+
+  for i = 1, n do
+    if map:get_key(keys[(i - 1) % nkeys + 1]) then
+      found = found + 1
+    end
+  end
+
+  local t2 = rspamd_util.get_ticks()
+
+  return (t2 - t1) * 1e9 / n, found
+end
+
+local function handler(args)
+  local opts = parser:parse(args)
+
+  load_config(opts)
+
+  local sample_keys = opts.keys and read_keys(opts.keys)
+  local result = {}
+
+  for _, map in ipairs(rspamd_config:get_maps()) do
+    local uri = map:get_uri()
+
+    if not opts.map or (uri and uri:match(opts.map)) then
+      local st = map:get_data_stats()
+      local res = {
+        uri = uri,
+        type = st.type,
+        elements = st.elements,
+        memory = st.memory,
+        load_time = st.load_time,
+      }
+
+      if st.hs_size > 0 then
+        res.hs_size = st.hs_size
+      end
+
+      if lookup_types[st.type] and st.elements > 0 and opts.lookups > 0 then
+        local hits = sample_keys or map_keys(map, st.type, opts.samples)
+
+        if #hits > 0 then
+          local ns, found = bench_lookups(map, hits, opts.lookups)
+          res.hit_ns = ns
+          res.hit_ratio = found / opts.lookups
+        end
+
+        res.miss_ns = bench_lookups(map, miss_keys(st.type, opts.samples),
+            opts.lookups)
+      end
+
+      result[#result + 1] = res
+    end
+  end
+
+  -- Most expensive maps first
+  table.sort(result, function(a, b)
+    return a.memory > b.memory
+  end)
+
+  io.write(ucl.to_format(result, opts.compact and 'json-compact' or 'json'))
+  io.write('\n')
+end
+
+return {
+  name = 'mapbench',
+  aliases = { 'map_bench' },
+  handler = handler,
+  description = parser._description
+}
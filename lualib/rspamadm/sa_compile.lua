@@ -0,0 +1,495 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+-- Converts SpamAssassin rules to the rules of the regexp module, so they are
+-- evaluated as native expressions with all regular expressions in re_cache.
+-- Rules that cannot be expressed this way (eval functions, tags replacements,
+-- conditional blocks and so on) are written to a separate file that should be
+-- loaded by the spamassassin plugin as usual.
+
+local argparse = require "argparse"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_regexp = require "rspamd_regexp"
+local rspamd_util = require "rspamd_util"
+local lua_util = require "lua_util"
+local ucl = require "ucl"
+
+local parser = argparse()
+    :name "rspamadm sa_compile"
+    :description "Compile SpamAssassin rules to the native regexp module rules"
+    :help_description_margin(32)
+
+parser:argument "inputs"
+      :description "SpamAssassin rules files (glob patterns are allowed)"
+      :argname("<file>")
+      :args "+"
+parser:option "-o --output"
+      :description("Compiled rules (include it in the regexp module)")
+      :argname("<file>")
+      :default('sa_compiled.conf')
+parser:option "-r --rest"
+      :description("Rules that cannot be compiled (use it as the spamassassin module ruleset)")
+      :argname("<file>")
+      :default('sa_rest.cf')
+parser:option "-a --alpha"
+      :description("Minimum score to register non-meta rules as symbols (as `alpha` in the spamassassin module)")
+      :argname("<score>")
+      :convert(tonumber)
+      :default(0.5)
+parser:option "-m --max-expression"
+      :description("Maximum length of an expression produced from a meta rule")
+      :argname("<bytes>")
+      :convert(tonumber)
+      :default(65536)
+
+local opts
+
+-- Type flags of regexp atoms in mime expressions
+local body_types = {
+  body = 'C',
+  rawbody = 'D',
+  full = 'M',
+  uri = 'U',
+}
+
+-- Converts /re/flags or m{re}flags to the body and flags suitable for a mime expression atom
+local function convert_re(re_expr)
+  local delim, body, flags
+  local first = re_expr:sub(1, 1)
+
+  if first == '/' then
+    delim = '/'
+    body = re_expr:sub(2)
+  elseif first == 'm' and #re_expr > 2 then
+    local pairs_delim = { ['{'] = '}', ['('] = ')', ['['] = ']', ['<'] = '>' }
+    local open = re_expr:sub(2, 2)
+    delim = pairs_delim[open] or open
+    body = re_expr:sub(3)
+  else
+    return nil
+  end
+
+  -- Closing delimiter is the last one in the expression
+  local last
+  local pos = 1
+  while true do
+    local found = body:find(delim, pos, true)
+    if not found then
+      break
+    end
+    last = found
+    pos = found + 1
+  end
+
+  if not last then
+    return nil
+  end
+
+  flags = body:sub(last + 1)
+  body = body:sub(1, last - 1)
+
+  if not flags:match('^[imsx]*$') then
+    return nil
+  end
+
+  if delim ~= '/' then
+    -- Slashes are terminators in mime expressions, so they must be escaped
+    local out = {}
+    local escaped = false
+    for c in body:gmatch('.') do
+      if c == '/' and not escaped then
+        out[#out + 1] = '\\/'
+      else
+        out[#out + 1] = c
+      end
+      escaped = (c == '\\') and not escaped
+    end
+    body = table.concat(out)
+  end
+
+  if not rspamd_regexp.create(string.format('/%s/%s', body, flags)) then
+    return nil
+  end
+
+  return body, flags
+end
+
+local function rule_flags(rule)
+  if rule.maxhits then
+    return nil
+  end
+
+  return rule.multiple and 'A' or ''
+end
+
+-- Returns an expression for a header rule or nil if it is not supported
+local function compile_header(rule)
+  if rule.exists then
+    local hdrs = { rule.exists }
+    if rule.exists == 'MESSAGEID' then
+      hdrs = { 'Message-ID', 'X-Message-ID', 'Resent-Message-ID' }
+    elseif rule.exists == 'ToCc' then
+      hdrs = { 'To', 'Cc', 'Bcc' }
+    end
+
+    local atoms = {}
+    for i, h in ipairs(hdrs) do
+      atoms[i] = string.format('header_exists(%s)', h)
+    end
+
+    return table.concat(atoms, ' | ')
+  end
+
+  local body, flags = convert_re(rule.re)
+  local extra = rule_flags(rule)
+
+  if not body or not extra then
+    return nil
+  end
+
+  local atoms = {}
+
+  for _, h in ipairs(lua_util.str_split(rule.header, '|')) do
+    local name, modifiers = h:match('^([^:]+):?(.*)$')
+    local type_flag = rule.mime and 'B' or 'H'
+    local strong = ''
+
+    for _, m in ipairs(lua_util.str_split(modifiers, ':')) do
+      if m == 'raw' and not rule.mime then
+        type_flag = 'X'
+      elseif m == 'case' then
+        strong = 'S'
+      elseif m ~= '' then
+        -- addr, name and others require functions
+        return nil
+      end
+    end
+
+    local names = { name }
+    if name == 'ALL' then
+      if type_flag ~= 'H' or strong ~= '' then
+        return nil
+      end
+      names = {}
+      atoms[#atoms + 1] = string.format('/%s/%sR%s', body, flags, extra)
+    elseif name == 'MESSAGEID' then
+      names = { 'Message-ID', 'X-Message-ID', 'Resent-Message-ID' }
+    elseif name == 'ToCc' then
+      names = { 'To', 'Cc', 'Bcc' }
+    elseif not name:match('^[%w%-_]+$') then
+      return nil
+    end
+
+    for _, n in ipairs(names) do
+      atoms[#atoms + 1] = string.format('%s=/%s/%s%s%s%s', n, body, flags,
+          type_flag, strong, extra)
+    end
+  end
+
+  if #atoms == 0 then
+    return nil
+  end
+
+  local expr = table.concat(atoms, ' | ')
+
+  if rule.negate then
+    expr = string.format('!(%s)', expr)
+  end
+
+  return expr
+end
+
+local function parse_rules(contents)
+  local rules = {}
+  local lines = {}
+  local scores = {}
+  local replaced = {}
+  local depth = 0
+
+  local function get_rule(sym)
+    local r = rules[sym]
+    if not r then
+      r = { symbol = sym }
+      rules[sym] = r
+    end
+    return r
+  end
+
+  for _, content in ipairs(contents) do
+    for l in content:gmatch('([^\n]*)\n?') do
+      local line = { text = l }
+      lines[#lines + 1] = line
+      l = lua_util.rspamd_str_trim(l)
+      local kw, sym, rest = l:match('^(%S+)%s+(%S+)%s*(.*)$')
+
+      if l:match('^if') then
+        depth = depth + 1
+      elseif l:match('^endif') then
+        depth = math.max(depth - 1, 0)
+      elseif kw == 'score' then
+        line.owner = sym
+        local s = {}
+        for w in rest:gsub('#.*$', ''):gmatch('%S+') do
+          s[#s + 1] = w
+        end
+        -- As in the spamassassin module, assume bayes and network tests are enabled
+        scores[sym] = tonumber(s[#s == 4 and 4 or 1])
+      elseif kw == 'describe' or kw == 'tflags' or kw == 'priority' then
+        line.owner = sym
+        local r = get_rule(sym)
+        if kw == 'describe' then
+          r.description = rest
+        elseif kw == 'tflags' then
+          for f in rest:gmatch('%S+') do
+            if f == 'multiple' then
+              r.multiple = true
+            elseif f:match('^maxhits=') then
+              r.maxhits = true
+            elseif f == 'publish' then
+              r.unsupported = true
+            end
+          end
+        end
+      elseif kw == 'replace_rules' then
+        for s in (sym .. ' ' .. rest):gmatch('%S+') do
+          replaced[s] = true
+        end
+      elseif kw == 'header' or kw == 'mimeheader' or kw == 'meta' or body_types[kw] then
+        line.owner = sym
+        -- Redefinition replaces the rule but keeps its flags and description
+        local r = get_rule(sym)
+        r.type, r.meta, r.re, r.header, r.exists, r.negate = nil, nil, nil, nil, nil, nil
+
+        if depth > 0 then
+          r.unsupported = true
+        end
+
+        if kw == 'meta' then
+          r.type = 'meta'
+          r.meta = rest
+        elseif body_types[kw] then
+          r.type = kw
+          r.re = rest
+          if not rest:match('^[/m]') then
+            r.unsupported = true
+          end
+        else
+          r.type = 'header'
+          r.mime = kw == 'mimeheader'
+          local hdr, op, re = rest:match('^([^%s=!]+)%s*([=!]~)%s*(.+)$')
+          if hdr then
+            r.header = hdr
+            r.negate = op == '!~'
+            r.re = re
+            if re:find('%[if%-unset:') then
+              r.unsupported = true
+            end
+          elseif rest:match('^exists:[%w%-_]+$') then
+            r.exists = rest:match('^exists:(.+)$')
+          else
+            r.unsupported = true
+          end
+        end
+      end
+    end
+  end
+
+  for sym, _ in pairs(replaced) do
+    if rules[sym] then
+      rules[sym].unsupported = true
+    end
+  end
+
+  return rules, lines, scores
+end
+
+local function meta_atoms(meta)
+  local res = {}
+  for atom in meta:gmatch('[%a_][%w_]*') do
+    res[#res + 1] = atom
+  end
+  return res
+end
+
+local function compile_rules(rules)
+  local compiled = {}
+  local visiting = {}
+
+  local function compile(sym)
+    if compiled[sym] ~= nil then
+      return compiled[sym]
+    end
+
+    local r = rules[sym]
+    if not r or r.unsupported or visiting[sym] then
+      -- Foreign symbols or loops are left for the spamassassin module
+      compiled[sym] = false
+      return false
+    end
+
+    local expr
+    visiting[sym] = true
+
+    if r.type == 'meta' then
+      local failed = false
+      expr = r.meta:gsub('[%a_][%w_]*', function(atom)
+        if failed then
+          return atom
+        end
+        local sub = compile(atom)
+        if not sub then
+          failed = true
+          return atom
+        end
+        return '(' .. sub .. ')'
+      end)
+
+      if failed or #expr > opts.max_expression then
+        expr = nil
+      end
+    elseif r.type == 'header' then
+      expr = compile_header(r)
+    elseif body_types[r.type] then
+      local body, flags = convert_re(r.re)
+      local extra = rule_flags(r)
+      if body and extra then
+        expr = string.format('/%s/%s%s%s', body, flags, body_types[r.type], extra)
+      end
+    end
+
+    visiting[sym] = nil
+    compiled[sym] = expr or false
+
+    return compiled[sym]
+  end
+
+  for sym, _ in pairs(rules) do
+    compile(sym)
+  end
+
+  return compiled
+end
+
+local function handler(args)
+  opts = parser:parse(args)
+
+  local files = {}
+  for _, pattern in ipairs(opts.inputs) do
+    local matched = rspamd_util.glob(pattern)
+    if not matched or #matched == 0 then
+      rspamd_logger.errx('cannot find any files matching pattern %s', pattern)
+      os.exit(1)
+    end
+    for _, fname in ipairs(matched) do
+      files[#files + 1] = fname
+    end
+  end
+
+  local contents, errors = rspamd_util.read_files(files)
+  for i, fname in ipairs(files) do
+    if not contents[i] then
+      rspamd_logger.errx('cannot read %s: %s', fname, errors[i])
+      os.exit(1)
+    end
+  end
+
+  local rules, lines, scores = parse_rules(contents)
+  local compiled = compile_rules(rules)
+
+  -- Symbols registered by the compiled rules
+  local symbols = {}
+  local output = {}
+  local nsymbols = 0
+
+  for sym, expr in pairs(compiled) do
+    local r = rules[sym]
+    if expr and sym:sub(1, 2) ~= '__' then
+      local score = scores[sym]
+      if r.type == 'meta' or (score and math.abs(score) > opts.alpha) then
+        output[sym] = {
+          re = expr,
+          score = score or 0.0,
+          description = r.description,
+          one_shot = true,
+        }
+        symbols[sym] = true
+        nsymbols = nsymbols + 1
+      end
+    end
+  end
+
+  -- Compiled subrules must be kept if they are used by metas that are not compiled
+  local keep = {}
+  local function keep_rule(sym)
+    if keep[sym] or symbols[sym] then
+      return
+    end
+    keep[sym] = true
+    local r = rules[sym]
+    if r and r.type == 'meta' then
+      for _, atom in ipairs(meta_atoms(r.meta)) do
+        keep_rule(atom)
+      end
+    end
+  end
+
+  for sym, expr in pairs(compiled) do
+    if not expr then
+      keep_rule(sym)
+    end
+  end
+
+  local out = io.open(opts.output, 'w')
+  if not out then
+    rspamd_logger.errx('cannot open %s for writing', opts.output)
+    os.exit(1)
+  end
+  out:write(string.format('# Compiled from %s by rspamadm sa_compile, do not edit\n',
+      table.concat(files, ', ')))
+  out:write(ucl.to_format(output, 'ucl'))
+  out:close()
+
+  local rest = io.open(opts.rest, 'w')
+  if not rest then
+    rspamd_logger.errx('cannot open %s for writing', opts.rest)
+    os.exit(1)
+  end
+  local nrest = 0
+  for _, line in ipairs(lines) do
+    if not line.owner or keep[line.owner] or not compiled[line.owner] then
+      rest:write(line.text)
+      rest:write('\n')
+    end
+  end
+  for sym, _ in pairs(keep) do
+    if rules[sym] and not compiled[sym] then
+      nrest = nrest + 1
+    end
+  end
+  rest:close()
+
+  rspamd_logger.messagex('compiled %s symbols to %s, %s rules are left in %s',
+      nsymbols, opts.output, nrest, opts.rest)
+  rspamd_logger.messagex('include %s in local.d/regexp.conf and use %s as the spamassassin ruleset',
+      opts.output, opts.rest)
+end
+
+return {
+  name = 'sa_compile',
+  aliases = { 'sacompile' },
+  handler = handler,
+  description = parser._description
+}
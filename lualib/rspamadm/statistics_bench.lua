@@ -0,0 +1,244 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+local argparse = require "argparse"
+local lua_redis = require "lua_redis"
+local lua_util = require "lua_util"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_task = require "rspamd_task"
+local rspamd_util = require "rspamd_util"
+local ucl = require "ucl"
+
+local parser = argparse()
+    :name "rspamadm statistics_bench"
+    :description "Measure statistics tokenization and backend lookups over a corpus"
+    :help_description_margin(32)
+
+parser:argument "corpus"
+      :description "Messages or directories with messages"
+      :argname "<path>"
+      :args "+"
+parser:option "-c --config"
+      :description "Path to config file"
+      :argname("<cfg>")
+      :default(rspamd_paths["CONFDIR"] .. "/" .. "rspamd.conf")
+parser:option "-n --iterations"
+      :description "Number of passes over the corpus"
+      :argname("<N>")
+      :convert(tonumber)
+      :default(1)
+parser:option "-r --redis"
+      :description "Also measure bayes lookups on this Redis server"
+      :argname("<host>")
+parser:option "-p --prefix"
+      :description "Bayes keys prefix in Redis"
+      :argname("<prefix>")
+      :default("RS")
+parser:flag "--compact"
+      :description "Compact JSON output"
+
+local function load_config(opts)
+  local _r, err = rspamd_config:load_ucl(opts['config'])
+
+  if not _r then
+    rspamd_logger.errx('cannot parse %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  _r, err = rspamd_config:parse_rcl({ 'logging', 'worker' })
+  if not _r then
+    rspamd_logger.errx('cannot process %s: %s', opts['config'], err)
+    os.exit(1)
+  end
+
+  rspamd_config:init_subsystem('langdet,stat')
+end
+
+local function get_files(paths)
+  local files = {}
+
+  for _, p in ipairs(paths) do
+    local err, st = rspamd_util.stat(p)
+
+    if not err and st.type == 'directory' then
+      for _, f in ipairs(rspamd_util.glob(p .. '/*')) do
+        files[#files + 1] = f
+      end
+    else
+      files[#files + 1] = p
+    end
+  end
+
+  return files
+end
+
+-- Returns summary of a list of timings (in seconds)
+local function summarize(timings)
+  local n = #timings
+
+  if n == 0 then
+    return { count = 0 }
+  end
+
+  table.sort(timings)
+  local total = 0
+  for _, t in ipairs(timings) do
+    total = total + t
+  end
+
+  local function percentile(p)
+    return timings[math.max(1, math.ceil(n * p))]
+  end
+
+  return {
+    count = n,
+    total = total,
+    mean = total / n,
+    p50 = percentile(0.5),
+    p95 = percentile(0.95),
+    p99 = percentile(0.99),
+    max = timings[n],
+    -- Messages per second of the stage itself
+    throughput = total > 0 and n / total or 0,
+  }
+end
+
+local function redis_classifier(opts)
+  local redis_params = lua_redis.try_load_redis_servers({ servers = opts.redis },
+      rspamd_config, true)
+
+  if not redis_params then
+    rspamd_logger.errx('cannot parse Redis server: %s', opts.redis)
+    os.exit(1)
+  end
+
+  local res, conn = lua_redis.redis_connect_sync(redis_params, false)
+
+  if not res then
+    rspamd_logger.errx('cannot connect to Redis server: %s', opts.redis)
+    os.exit(1)
+  end
+
+  -- Use the same script as classifier does
+  local path = lua_util.join_path(rspamd_paths.LUALIBDIR, 'redis_scripts', 'bayes_classify.lua')
+  local f = io.open(path, 'r')
+
+  if not f then
+    rspamd_logger.errx('cannot open %s', path)
+    os.exit(1)
+  end
+
+  local script = lua_util.strip_lua_comments(f:read('*all'))
+  f:close()
+
+  return function(tokens)
+    local keys = {}
+
+    for i, tok in ipairs(tokens) do
+      keys[i] = string.format('%s_%s', opts.prefix, tok.data)
+    end
+
+    conn:add_cmd('EVAL', { script, '2', opts.prefix, ucl.to_format(keys, 'msgpack') })
+    local ok, err = conn:exec()
+
+    if not ok then
+      rspamd_logger.errx('cannot classify: %s', err)
+    end
+  end
+end
+
+local function handler(args)
+  local opts = parser:parse(args)
+
+  load_config(opts)
+
+  local files = get_files(opts.corpus)
+  local classify = opts.redis and redis_classifier(opts)
+  local stages = {
+    parse = {},
+    tokenize = {},
+    redis = {},
+  }
+  local ntokens, max_tokens, nmessages = 0, 0, 0
+  -- Pool counters are process wide, so any pool can be used to read them
+  local pool_stat_start = rspamd_config:get_mempool():stat()
+
+  for _ = 1, opts.iterations do
+    for _, fname in ipairs(files) do
+      local t1 = rspamd_util.get_ticks()
+      local res, task = rspamd_task.load_from_file(fname, rspamd_config)
+
+      if not res then
+        rspamd_logger.errx('cannot read message from %s: %s', fname, task)
+      else
+        task:process_message()
+        local t2 = rspamd_util.get_ticks()
+        local tokens = task:get_stat_tokens() or {}
+        local t3 = rspamd_util.get_ticks()
+
+        stages.parse[#stages.parse + 1] = t2 - t1
+        stages.tokenize[#stages.tokenize + 1] = t3 - t2
+
+        if classify and #tokens > 0 then
+          classify(tokens)
+          local t4 = rspamd_util.get_ticks()
+          stages.redis[#stages.redis + 1] = t4 - t3
+        end
+
+        nmessages = nmessages + 1
+        ntokens = ntokens + #tokens
+        max_tokens = math.max(max_tokens, #tokens)
+        task:destroy()
+      end
+    end
+  end
+
+  local result = {
+    messages = nmessages,
+    iterations = opts.iterations,
+    tokens = {
+      mean = nmessages > 0 and ntokens / nmessages or 0,
+      max = max_tokens,
+    },
+    stages = {},
+  }
+
+  for name, timings in pairs(stages) do
+    if #timings > 0 then
+      result.stages[name] = summarize(timings)
+    end
+  end
+
+  if nmessages > 0 then
+    local pool = rspamd_config:get_mempool()
+    local pool_stat_end = pool:stat()
+    result.mempool = {}
+
+    for _, k in ipairs({ 'pools_allocated', 'chunks_allocated', 'oversized_chunks', 'bytes_allocated' }) do
+      result.mempool[k .. '_per_message'] = (pool_stat_end[k] - pool_stat_start[k]) / nmessages
+    end
+  end
+
+  io.write(ucl.to_format(result, opts.compact and 'json-compact' or 'json'))
+  io.write('\n')
+end
+
+return {
+  name = 'statistics_bench',
+  aliases = { 'stat_bench', 'bayes_bench' },
+  handler = handler,
+  description = parser._description
+}
@@ -49,7 +49,9 @@ dump:mutex(
     dump:flag "-j --json"
         :description "Json output",
     dump:flag "-C --cdb"
-        :description "CDB output"
+        :description "CDB output",
+    dump:flag "-m --model"
+        :description "Compact model output (for the compact backend)"
 )
 dump:flag "-c --compress"
     :description "Compress output"
@@ -223,6 +225,91 @@ local function dump_cdb(out, opts, last, pattern)
   end
 end
 
+-- Must match the compact statistics backend
+local model_block_size = 64
+
+local function dump_model(out, opts, last, pattern)
+  local results = out[pattern]
+
+  if not out.model_elts then
+    out.model_elts = {}
+  end
+
+  for _, o in ipairs(results.elts) do
+    table.insert(out.model_elts, o)
+  end
+
+  if not last then
+    return
+  end
+
+  local elts = out.model_elts
+  out.model_elts = nil
+  -- Zero padded hex strings are sorted as unsigned 64 bit numbers
+  table.sort(elts, function(a, b)
+    return a.hex < b.hex
+  end)
+
+  local max_count = 0
+  for _, o in ipairs(elts) do
+    max_count = math.max(max_count, o.spam, o.ham)
+  end
+
+  local counter_fmt, counter_bytes = '<I4I4', 4
+  if max_count <= 0xffff then
+    counter_fmt, counter_bytes = '<I2I2', 2
+  end
+
+  local nblocks = math.floor((#elts + model_block_size - 1) / model_block_size)
+  local fname = string.format('%s.model', pattern)
+  local tmp_fname = fname .. '.new'
+  local f, err = io.open(tmp_fname, 'wb')
+
+  if not f then
+    rspamd_logger.errx("cannot open %s: %s", tmp_fname, err)
+    os.exit(1)
+  end
+
+  local function learns(v)
+    return math.max(tonumber(v or '0') or 0, 0)
+  end
+
+  f:write(rspamd_util.pack('<c8I4I4I8I8I8I4I4I8I8', 'rsbayes1', 1, counter_bytes,
+      #elts, learns(results.learns_spam), learns(results.learns_ham),
+      model_block_size, 0, nblocks, 0))
+
+  local function write_tokens(step, fn)
+    local buf = {}
+    for i = 1, #elts, step do
+      buf[#buf + 1] = fn(elts[i])
+      if #buf >= opts.batch_size then
+        f:write(table.concat(buf))
+        buf = {}
+      end
+    end
+    f:write(table.concat(buf))
+  end
+  local function pack_token(o)
+    -- Split into halves as Lua numbers cannot represent all 64 bit values
+    return rspamd_util.pack('<I4I4', tonumber(o.hex:sub(9, 16), 16),
+        tonumber(o.hex:sub(1, 8), 16))
+  end
+
+  write_tokens(model_block_size, pack_token)
+  write_tokens(1, pack_token)
+  write_tokens(1, function(o)
+    return rspamd_util.pack(counter_fmt, o.spam, o.ham)
+  end)
+  f:close()
+
+  -- Replace the model atomically as scanners reload it on change
+  local _, rename_err = os.rename(tmp_fname, fname)
+  if rename_err then
+    rspamd_logger.errx("cannot rename %s to %s: %s", tmp_fname, fname, rename_err)
+    os.exit(1)
+  end
+end
+
 local function dump_pattern(conn, pattern, opts, out, key)
   local cursor = 0
 
@@ -263,7 +350,17 @@ local function dump_pattern(conn, pattern, opts, out, key)
     -- Output keeping track of the commas
     for i, d in ipairs(tokens) do
       if cursor == 0 and i == #tokens or not opts.json then
-        if opts.cdb then
+        if opts.model then
+          local tok_str = string.match(d.key, '_(%d+)$')
+          if tok_str then
+            local hex = rspamd_i64.fromstring(tok_str):hex()
+            table.insert(out[key].elts, {
+              hex = string.rep('0', 16 - #hex) .. hex,
+              spam = math.max(tonumber(d.data["S"] or '0') or 0, 0),
+              ham = math.max(tonumber(d.data["H"] or '0') or 0, 0),
+            })
+          end
+        elseif opts.cdb then
           table.insert(out[key].elts, {
             key = rspamd_i64.fromstring(string.match(d.key, '%d+')),
             value = rspamd_util.pack('ff', tonumber(d.data["S"] or '0') or 0,
@@ -286,13 +383,18 @@ local function dump_pattern(conn, pattern, opts, out, key)
 
     -- Do not write the last chunk of out as it will be processed afterwards
     if cursor ~= 0 then
-      if opts.cdb then
-        dump_out(out, opts, false)
-        clear_fcn(out)
-      else
+      if opts.model then
+        dump_model(out, opts, false, key)
+        out[key].elts = {}
+      elseif opts.cdb then
         dump_cdb(out, opts, false, key)
         out[key].elts = {}
+      else
+        dump_out(out, opts, false)
+        clear_fcn(out)
       end
+    elseif opts.model then
+      dump_model(out, opts, true, key)
     elseif opts.cdb then
       dump_cdb(out, opts, true, key)
     end
@@ -335,7 +437,7 @@ local function dump_handler(opts)
             if opts.json then
               out[#out + 1] = string.format('{"pattern": "%s", "meta": %s, "elts": {\n',
                   k, ucl.to_format(redis_map_zip(additional_keys), 'json-compact'))
-            elseif opts.cdb then
+            elseif opts.cdb or opts.model then
               out[k] = redis_map_zip(additional_keys)
               out[k].elts = {}
             else
@@ -0,0 +1,160 @@
+--[[
+Copyright (c) 2024, Vsevolod Stakhov <vsevolod@rspamd.com>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+local argparse = require "argparse"
+local rspamd_logger = require "rspamd_logger"
+local rspamd_util = require "rspamd_util"
+
+local parser = argparse()
+    :name "rspamadm zstd_train"
+    :description "Train zstd dictionaries for the scan protocol from sample traffic"
+    :help_description_margin(32)
+
+parser:argument "inputs"
+      :description "Messages, directories with messages or json replies logs"
+      :argname("<file>")
+      :args "+"
+parser:option "-o --output"
+      :description("Dictionary file")
+      :argname("<file>")
+      :default('rspamd.dict')
+parser:flag "-r --replies"
+      :description("Inputs are line delimited json replies (e.g. from rspamc --corpus or rspamc -j --compact)")
+parser:option "-m --maxdict"
+      :description("Maximum dictionary size")
+      :argname("<bytes>")
+      :convert(tonumber)
+      :default(112640)
+parser:option "-n --max-samples"
+      :description("Maximum number of samples to use")
+      :argname("<N>")
+      :convert(tonumber)
+      :default(100000)
+parser:option "-z --zstd"
+      :description("Use specific zstd binary path")
+      :argname("<path>")
+      :default('zstd')
+
+local opts
+
+local function collect_files(path, dest)
+  if #dest >= opts.max_samples then
+    return
+  end
+
+  local err, st = rspamd_util.stat(path)
+
+  if err then
+    rspamd_logger.errx('cannot stat %s: %s', path, err)
+    return
+  end
+
+  if st.type == 'directory' then
+    for _, fname in ipairs(rspamd_util.glob(path .. '/*')) do
+      collect_files(fname, dest)
+    end
+  elseif st.type == 'regular' and st.size > 0 then
+    table.insert(dest, path)
+  end
+end
+
+-- Each reply is a separate sample, so they are spilled to a temporary directory
+local function collect_replies(path, tmpdir, dest)
+  local f = io.open(path, 'r')
+
+  if not f then
+    rspamd_logger.errx('cannot open %s', path)
+    return
+  end
+
+  for line in f:lines() do
+    if #dest >= opts.max_samples then
+      break
+    end
+
+    if line:sub(1, 1) == '{' then
+      local fname = string.format('%s/%d.json', tmpdir, #dest)
+      local out = assert(io.open(fname, 'w'))
+      out:write(line)
+      out:close()
+      table.insert(dest, fname)
+    end
+  end
+
+  f:close()
+end
+
+local function handler(args)
+  opts = parser:parse(args)
+
+  local samples = {}
+  local tmpdir
+
+  if opts.replies then
+    tmpdir = os.tmpname()
+    os.remove(tmpdir)
+    assert(rspamd_util.mkdir(tmpdir))
+
+    for _, input in ipairs(opts.inputs) do
+      collect_replies(input, tmpdir, samples)
+    end
+  else
+    for _, input in ipairs(opts.inputs) do
+      collect_files(input, samples)
+    end
+  end
+
+  if #samples == 0 then
+    rspamd_logger.errx('no samples found')
+    os.exit(1)
+  end
+
+  local list_name = os.tmpname()
+  local list = assert(io.open(list_name, 'w'))
+  for _, fname in ipairs(samples) do
+    list:write(fname)
+    list:write('\n')
+  end
+  list:close()
+
+  rspamd_logger.messagex('training dictionary from %s samples', #samples)
+  local zstd_command = string.format('%s -q --train --maxdict=%d --filelist=%s -o %s',
+      opts.zstd, opts.maxdict, list_name, opts.output)
+  local ret = os.execute(zstd_command)
+
+  os.remove(list_name)
+  if tmpdir then
+    for _, fname in ipairs(samples) do
+      os.remove(fname)
+    end
+    os.remove(tmpdir)
+  end
+
+  if ret ~= 0 and ret ~= true then
+    rspamd_logger.errx('cannot train dictionary using: %s', zstd_command)
+    os.exit(1)
+  end
+
+  rspamd_logger.messagex('dictionary is written to %s, use it as %s in options.inc',
+      opts.output, opts.replies and 'zstd_output_dictionary' or 'zstd_input_dictionary')
+end
+
+return {
+  name = 'zstd_train',
+  aliases = { 'zstdtrain' },
+  handler = handler,
+  description = parser._description
+}
@@ -24,6 +24,8 @@
 #include <vector>
 #include <string>
 #include <optional>
+#include <deque>
+#include <memory>
 #include <algorithm>
 #include <functional>
 #include <iostream>
@@ -83,9 +85,11 @@ static gboolean extended_urls = FALSE;
 static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
 static gboolean compressed = TRUE;
+static gboolean compact = FALSE;
 static gboolean profile = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
+static gboolean corpus = FALSE;
 static const char *pubkey = nullptr;
 static const char *user_agent = "rspamc";
 static const char *files_list = nullptr;
@@ -171,6 +175,8 @@ static GOptionEntry entries[] =
 		 "Enable zstd compression", nullptr},
 		{"profile", '\0', 0, G_OPTION_ARG_NONE, &profile,
 		 "Profile symbols execution time", nullptr},
+		{"compact", '\0', 0, G_OPTION_ARG_NONE, &compact,
+		 "Do not request symbols descriptions and metric scores in reply", nullptr},
 		{"dictionary", 'D', 0, G_OPTION_ARG_FILENAME, &dictionary,
 		 "Use dictionary to compress data", nullptr},
 		{"skip-images", '\0', 0, G_OPTION_ARG_NONE, &skip_images,
@@ -181,6 +187,8 @@ static GOptionEntry entries[] =
 		 "Use specific User-Agent instead of \"rspamc\"", nullptr},
 		{"files-list", '\0', 0, G_OPTION_ARG_FILENAME, &files_list,
 		 "Read one or more newline separated filenames to scan from file", nullptr},
+		{"corpus", '\0', 0, G_OPTION_ARG_NONE, &corpus,
+		 "Scan files, directories and mailboxes reusing connections, output results as json lines", nullptr},
 		{nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr}};
 
 static void rspamc_symbols_output(FILE *out, ucl_object_t *obj);
@@ -823,6 +831,10 @@ add_options(GQueue *opts)
 		flagbuf += "profile,";
 	}
 
+	if (compact) {
+		flagbuf += "compact,";
+	}
+
 	flagbuf += "body_block,";
 
 	if (skip_images) {
@@ -1938,14 +1950,11 @@ rspamc_client_cb(struct rspamd_client_connection *conn,
 	}
 }
 
-static void
-rspamc_process_input(struct ev_loop *ev_base, const struct rspamc_command &cmd,
-					 FILE *in, const std::string &name, GQueue *attrs)
+static auto
+rspamc_parse_connect_str(const struct rspamc_command &cmd) -> std::pair<std::string, uint16_t>
 {
-	struct rspamd_client_connection *conn;
 	const char *p;
 	uint16_t port;
-	GError *err = nullptr;
 	std::string hostbuf;
 
 	if (connect_str[0] == '[') {
@@ -1994,6 +2003,17 @@ rspamc_process_input(struct ev_loop *ev_base, const struct rspamc_command &cmd,
 		}
 	}
 
+	return {hostbuf, port};
+}
+
+static void
+rspamc_process_input(struct ev_loop *ev_base, const struct rspamc_command &cmd,
+					 FILE *in, const std::string &name, GQueue *attrs)
+{
+	struct rspamd_client_connection *conn;
+	GError *err = nullptr;
+	auto [hostbuf, port] = rspamc_parse_connect_str(cmd);
+
 	conn = rspamd_client_init(http_ctx, ev_base, hostbuf.c_str(), port, timeout, pubkey);
 
 	if (conn != nullptr) {
@@ -2169,6 +2189,307 @@ rspamc_process_dir(struct ev_loop *ev_base, const struct rspamc_command &cmd,
 }
 
 
+/*
+ * Corpus mode: messages from files, directories and mailboxes are sent over
+ * a pool of kept alive connections with up to `max_requests` requests in
+ * flight, every result is printed as a single json line
+ */
+struct rspamc_corpus_item {
+	/* Keeps the mapped file alive while its messages are being sent */
+	std::shared_ptr<rspamd::util::raii_mmaped_file> map;
+	std::string_view data;
+	std::string name;
+};
+
+struct rspamc_corpus {
+	struct ev_loop *ev_base;
+	const struct rspamc_command *cmd;
+	GQueue *attrs;
+	std::string host;
+	uint16_t port;
+	std::deque<std::string> paths;
+	std::deque<rspamc_corpus_item> pending;
+	std::vector<struct rspamd_client_connection *> idle;
+	int inflight = 0;
+	ev_timer pump;
+};
+
+struct rspamc_corpus_request {
+	struct rspamc_corpus *corpus;
+	rspamc_corpus_item item;
+	bool reused;
+};
+
+static auto
+rspamc_is_excluded(const std::string &fpath) -> bool
+{
+	auto **ex = exclude_compiled;
+
+	while (ex != nullptr && *ex != nullptr) {
+#if GLIB_MAJOR_VERSION >= 2 && GLIB_MINOR_VERSION >= 70
+		if (g_pattern_spec_match(*ex, fpath.size(), fpath.c_str(), nullptr)) {
+#else
+		if (g_pattern_match(*ex, fpath.size(), fpath.c_str(), nullptr)) {
+#endif
+			return true;
+		}
+
+		ex++;
+	}
+
+	return false;
+}
+
+static auto
+rspamc_corpus_output_error(std::string_view name, std::string_view error) -> void
+{
+	auto *obj = ucl_object_typed_new(UCL_OBJECT);
+
+	ucl_object_insert_key(obj, ucl_object_fromlstring(name.data(), name.size()),
+						  "filename", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromlstring(error.data(), error.size()),
+						  "error", 0, false);
+
+	auto *ucl_out = (char *) ucl_object_emit(obj, UCL_EMIT_JSON_COMPACT);
+	rspamc_print(stdout, "{}\n", ucl_out);
+	free(ucl_out);
+	ucl_object_unref(obj);
+	retcode = EXIT_FAILURE;
+}
+
+static auto
+rspamc_corpus_add_file(struct rspamc_corpus *corpus, const std::string &path) -> void
+{
+	auto maybe_map = rspamd::util::raii_mmaped_file::mmap_shared(path.c_str(), O_RDONLY, PROT_READ);
+
+	if (!maybe_map.has_value()) {
+		rspamc_corpus_output_error(path, maybe_map.error().error_message);
+		return;
+	}
+
+	auto map = std::make_shared<rspamd::util::raii_mmaped_file>(std::move(maybe_map.value()));
+	std::string_view data{(const char *) map->get_map(), map->get_size()};
+
+	if (!data.starts_with("From ")) {
+		corpus->pending.push_back(rspamc_corpus_item{map, data, path});
+		return;
+	}
+
+	/* Mailbox: split on `From ` lines without copying messages */
+	std::size_t pos = 0;
+	auto nmsg = 0;
+
+	while (pos < data.size()) {
+		auto eol = data.find('\n', pos);
+
+		if (eol == std::string_view::npos) {
+			break;
+		}
+
+		auto next = data.find("\nFrom ", eol);
+		auto end = next == std::string_view::npos ? data.size() : next + 1;
+
+		if (end > eol + 1) {
+			corpus->pending.push_back(rspamc_corpus_item{map,
+														 data.substr(eol + 1, end - eol - 1),
+														 fmt::format("{}:{}", path, ++nmsg)});
+		}
+
+		pos = end;
+	}
+}
+
+/* Expands paths lazily until there is something to send */
+static auto
+rspamc_corpus_fill(struct rspamc_corpus *corpus) -> bool
+{
+	while (corpus->pending.empty()) {
+		if (corpus->paths.empty()) {
+			return false;
+		}
+
+		auto path = std::move(corpus->paths.front());
+		corpus->paths.pop_front();
+		struct stat st;
+
+		if (stat(path.c_str(), &st) == -1) {
+			rspamc_corpus_output_error(path, strerror(errno));
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			auto *d = opendir(path.c_str());
+
+			if (d == nullptr) {
+				rspamc_corpus_output_error(path, strerror(errno));
+				continue;
+			}
+
+			struct dirent *pentry;
+
+			while ((pentry = readdir(d)) != nullptr) {
+				if (pentry->d_name[0] == '.') {
+					continue;
+				}
+
+				auto fpath = fmt::format("{}{}{}", path, G_DIR_SEPARATOR, pentry->d_name);
+
+				if (!rspamc_is_excluded(fpath)) {
+					corpus->paths.emplace_back(std::move(fpath));
+				}
+			}
+
+			closedir(d);
+		}
+		else if (S_ISREG(st.st_mode)) {
+			if (st.st_size == 0) {
+				rspamc_corpus_output_error(path, "empty file");
+				continue;
+			}
+
+			rspamc_corpus_add_file(corpus, path);
+		}
+	}
+
+	return true;
+}
+
+static void
+rspamc_corpus_schedule(struct rspamc_corpus *corpus)
+{
+	/* Requests are never sent from the client callbacks */
+	if (!ev_is_active(&corpus->pump)) {
+		ev_timer_set(&corpus->pump, 0.0, 0.0);
+		ev_timer_start(corpus->ev_base, &corpus->pump);
+	}
+}
+
+static void
+rspamc_corpus_cb(struct rspamd_client_connection *conn,
+				 struct rspamd_http_message *msg,
+				 const char *name, ucl_object_t *result, GString *input,
+				 gpointer ud, double start_time, double send_time,
+				 const char *body, gsize bodylen,
+				 GError *err)
+{
+	auto *req = (struct rspamc_corpus_request *) ud;
+	auto *corpus = req->corpus;
+	double finish = rspamd_get_ticks(FALSE);
+
+	corpus->inflight--;
+
+	if (err != nullptr && msg == nullptr && req->reused) {
+		/* Server could close an idle connection, retry using a new one */
+		rspamd_client_destroy(conn);
+		corpus->pending.push_front(std::move(req->item));
+	}
+	else {
+		if (result != nullptr) {
+			ucl_object_insert_key(result,
+								  ucl_object_fromlstring(req->item.name.data(), req->item.name.size()),
+								  "filename", 0, false);
+			ucl_object_insert_key(result,
+								  ucl_object_fromdouble(finish - (send_time > 0 ? send_time : start_time)),
+								  "scan_time", 0, false);
+
+			auto *ucl_out = (char *) ucl_object_emit(result, UCL_EMIT_JSON_COMPACT);
+			rspamc_print(stdout, "{}\n", ucl_out);
+			free(ucl_out);
+			ucl_object_unref(result);
+		}
+		else {
+			rspamc_corpus_output_error(req->item.name,
+									   err ? err->message : "no result");
+		}
+
+		if (err == nullptr && rspamd_client_is_reusable(conn)) {
+			corpus->idle.push_back(conn);
+		}
+		else {
+			rspamd_client_destroy(conn);
+		}
+	}
+
+	delete req;
+	rspamc_corpus_schedule(corpus);
+}
+
+static void
+rspamc_corpus_pump(EV_P_ ev_timer *w, int revents)
+{
+	auto *corpus = (struct rspamc_corpus *) w->data;
+
+	while (corpus->inflight < max_requests && rspamc_corpus_fill(corpus)) {
+		struct rspamd_client_connection *conn;
+		bool reused = false;
+
+		if (!corpus->idle.empty()) {
+			conn = corpus->idle.back();
+			corpus->idle.pop_back();
+			reused = true;
+		}
+		else {
+			conn = rspamd_client_init(http_ctx, corpus->ev_base, corpus->host.c_str(),
+									  corpus->port, timeout, pubkey);
+
+			if (conn == nullptr) {
+				rspamc_print(stderr, "cannot connect to {}: {}\n", connect_str,
+							 strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			rspamd_client_set_keepalive(conn, TRUE);
+		}
+
+		auto *req = new rspamc_corpus_request{corpus, std::move(corpus->pending.front()), reused};
+		corpus->pending.pop_front();
+		GError *err = nullptr;
+
+		if (!rspamd_client_command_buf(conn, corpus->cmd->path, corpus->attrs,
+									   req->item.data.data(), req->item.data.size(),
+									   rspamc_corpus_cb, req, compressed, dictionary,
+									   req->item.name.c_str(), &err)) {
+			rspamc_corpus_output_error(req->item.name,
+									   err ? err->message : "cannot send request");
+
+			if (err) {
+				g_error_free(err);
+			}
+
+			rspamd_client_destroy(conn);
+			delete req;
+			continue;
+		}
+
+		corpus->inflight++;
+	}
+}
+
+static void
+rspamc_process_corpus(struct ev_loop *ev_base, const struct rspamc_command &cmd,
+					  std::vector<std::string> &&files, GQueue *attrs)
+{
+	struct rspamc_corpus corpus;
+	auto [hostbuf, port] = rspamc_parse_connect_str(cmd);
+
+	corpus.ev_base = ev_base;
+	corpus.cmd = &cmd;
+	corpus.attrs = attrs;
+	corpus.host = std::move(hostbuf);
+	corpus.port = port;
+	corpus.paths.assign(std::make_move_iterator(files.begin()),
+						std::make_move_iterator(files.end()));
+
+	ev_timer_init(&corpus.pump, rspamc_corpus_pump, 0.0, 0.0);
+	corpus.pump.data = &corpus;
+	rspamc_corpus_schedule(&corpus);
+	ev_loop(ev_base, 0);
+
+	for (auto *conn: corpus.idle) {
+		rspamd_client_destroy(conn);
+	}
+}
+
 static void
 rspamc_kwattr_free(gpointer p)
 {
@@ -2335,36 +2656,41 @@ int main(int argc, char **argv, char **env)
 			}
 		}
 
-		for (const auto &file: files) {
-			if (cmd.cmd == RSPAMC_COMMAND_FUZZY_DELHASH) {
-				add_client_header(kwattrs, "Hash", file.c_str());
-			}
-			else {
-				struct stat st;
-
-				if (stat(file.c_str(), &st) == -1) {
-					rspamc_print(stderr, "cannot stat file {}\n", file);
-					exit(EXIT_FAILURE);
-				}
-				if (S_ISDIR(st.st_mode)) {
-					/* Directories are processed with a separate limit */
-					rspamc_process_dir(event_loop, cmd, file.c_str(), kwattrs);
-					cur_req = 0;
+		if (corpus && cmd.need_input) {
+			rspamc_process_corpus(event_loop, cmd, std::move(files), kwattrs);
+		}
+		else {
+			for (const auto &file: files) {
+				if (cmd.cmd == RSPAMC_COMMAND_FUZZY_DELHASH) {
+					add_client_header(kwattrs, "Hash", file.c_str());
 				}
 				else {
-					in = fopen(file.c_str(), "r");
-					if (in == nullptr) {
-						rspamc_print(stderr, "cannot open file {}\n", file);
+					struct stat st;
+
+					if (stat(file.c_str(), &st) == -1) {
+						rspamc_print(stderr, "cannot stat file {}\n", file);
 						exit(EXIT_FAILURE);
 					}
-					rspamc_process_input(event_loop, cmd, in, file.c_str(), kwattrs);
-					cur_req++;
-					fclose(in);
-				}
-				if (cur_req >= max_requests) {
-					cur_req = 0;
-					/* Wait for completion */
-					ev_loop(event_loop, 0);
+					if (S_ISDIR(st.st_mode)) {
+						/* Directories are processed with a separate limit */
+						rspamc_process_dir(event_loop, cmd, file.c_str(), kwattrs);
+						cur_req = 0;
+					}
+					else {
+						in = fopen(file.c_str(), "r");
+						if (in == nullptr) {
+							rspamc_print(stderr, "cannot open file {}\n", file);
+							exit(EXIT_FAILURE);
+						}
+						rspamc_process_input(event_loop, cmd, in, file.c_str(), kwattrs);
+						cur_req++;
+						fclose(in);
+					}
+					if (cur_req >= max_requests) {
+						cur_req = 0;
+						/* Wait for completion */
+						ev_loop(event_loop, 0);
+					}
 				}
 			}
 		}
@@ -50,6 +50,16 @@ struct rspamd_client_connection {
 	double send_time;
 	struct rspamd_client_request *req;
 	struct rspamd_keypair_cache *keys_cache;
+	/* Ask server to keep connection for further requests */
+	gboolean keepalive;
+	/* Server has agreed to keep connection after the last reply */
+	gboolean reusable;
+	/* Compression contexts are reused by all requests over this connection */
+	ZSTD_CCtx *zctx;
+	ZSTD_DStream *zstream;
+	ZSTD_CDict *cdict;
+	char *dict_path;
+	unsigned int dict_id;
 };
 
 struct rspamd_client_request {
@@ -99,6 +109,7 @@ rspamd_client_error_handler(struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_client_connection *c;
 
 	c = req->conn;
+	c->reusable = FALSE;
 	req->cb(c, NULL, c->server_name->str, NULL,
 			req->input, req->ud,
 			c->start_time, c->send_time, NULL, 0, err);
@@ -131,6 +142,19 @@ rspamd_client_finish_handler(struct rspamd_http_connection *conn,
 		return 0;
 	}
 	else {
+		c->reusable = FALSE;
+
+		if (c->keepalive) {
+			rspamd_ftok_t cmp;
+
+			tok = rspamd_http_message_find_header(msg, "Connection");
+			RSPAMD_FTOK_ASSIGN(&cmp, "keep-alive");
+
+			if (tok && rspamd_ftok_casecmp(tok, &cmp) == 0) {
+				c->reusable = TRUE;
+			}
+		}
+
 		if (rspamd_http_message_get_body(msg, NULL) == NULL || msg->code / 100 != 2) {
 			err = g_error_new(RCLIENT_ERROR, msg->code, "HTTP error: %d, %.*s",
 							  msg->code,
@@ -157,7 +181,11 @@ rspamd_client_finish_handler(struct rspamd_http_connection *conn,
 				ZSTD_outBuffer zout;
 				gsize outlen, r;
 
-				zstream = ZSTD_createDStream();
+				if (c->zstream == NULL) {
+					c->zstream = ZSTD_createDStream();
+				}
+
+				zstream = c->zstream;
 				ZSTD_initDStream(zstream);
 
 				zin.pos = 0;
@@ -184,7 +212,6 @@ rspamd_client_finish_handler(struct rspamd_http_connection *conn,
 								req->input, req->ud, c->start_time,
 								c->send_time, body, bodylen, err);
 						g_error_free(err);
-						ZSTD_freeDStream(zstream);
 
 						goto end;
 					}
@@ -196,8 +223,6 @@ rspamd_client_finish_handler(struct rspamd_http_connection *conn,
 					}
 				}
 
-				ZSTD_freeDStream(zstream);
-
 				start = zout.dst;
 				len = zout.pos;
 			}
@@ -319,28 +344,88 @@ rspamd_client_init(struct rspamd_http_context *http_ctx,
 	return conn;
 }
 
-gboolean
-rspamd_client_command(struct rspamd_client_connection *conn,
-					  const char *command, GQueue *attrs,
-					  FILE *in, rspamd_client_callback cb,
-					  gpointer ud, gboolean compressed,
-					  const char *comp_dictionary,
-					  const char *filename,
-					  GError **err)
+/*
+ * Digests a compression dictionary once per connection
+ */
+static gboolean
+rspamd_client_load_dictionary(struct rspamd_client_connection *conn,
+							  const char *path, GError **err)
+{
+	void *dict;
+	gsize dict_len = 0;
+
+	if (conn->dict_path && strcmp(conn->dict_path, path) == 0) {
+		return TRUE;
+	}
+
+	if (conn->cdict) {
+		ZSTD_freeCDict(conn->cdict);
+		conn->cdict = NULL;
+		g_free(conn->dict_path);
+		conn->dict_path = NULL;
+	}
+
+	dict = rspamd_file_xmap(path, PROT_READ, &dict_len, TRUE);
+
+	if (dict == NULL) {
+		g_set_error(err, RCLIENT_ERROR, errno,
+					"cannot open dictionary %s: %s",
+					path,
+					strerror(errno));
+
+		return FALSE;
+	}
+
+	conn->dict_id = ZSTD_getDictID_fromDict(dict, dict_len);
+	conn->cdict = ZSTD_createCDict(dict, dict_len, 1);
+	munmap(dict, dict_len);
+
+	if (conn->cdict == NULL) {
+		g_set_error(err, RCLIENT_ERROR, 500,
+					"cannot load dictionary %s", path);
+
+		return FALSE;
+	}
+
+	conn->dict_path = g_strdup(path);
+
+	return TRUE;
+}
+
+/*
+ * Sends a request with a body from `data`, `input` is owned by the request
+ * and passed to the callback as is
+ */
+static gboolean
+rspamd_client_command_common(struct rspamd_client_connection *conn,
+							 const char *command, GQueue *attrs,
+							 const char *data, gsize len, GString *input,
+							 rspamd_client_callback cb,
+							 gpointer ud, gboolean compressed,
+							 const char *comp_dictionary,
+							 const char *filename,
+							 GError **err)
 {
 	struct rspamd_client_request *req;
 	struct rspamd_http_client_header *nh;
-	char *p;
-	gsize remain, old_len;
 	GList *cur;
-	GString *input = NULL;
 	rspamd_fstring_t *body;
 	unsigned int dict_id = 0;
-	gsize dict_len = 0;
-	void *dict = NULL;
-	ZSTD_CCtx *zctx;
 	gboolean ret;
 
+	if (conn->req_sent) {
+		/* Connection has been kept alive after the previous request */
+		rspamd_http_connection_reset(conn->http_conn);
+		conn->req_sent = FALSE;
+		conn->send_time = 0;
+	}
+
+	conn->reusable = FALSE;
+
+	if (conn->req != NULL) {
+		rspamd_client_request_free(conn->req);
+	}
+
 	req = g_malloc0(sizeof(struct rspamd_client_request));
 	req->conn = conn;
 	req->cb = cb;
@@ -351,87 +436,72 @@ rspamd_client_command(struct rspamd_client_connection *conn,
 		req->msg->peer_key = rspamd_pubkey_ref(conn->key);
 	}
 
-	if (in != NULL) {
-		/* Read input stream */
-		input = g_string_sized_new(BUFSIZ);
-
-		while (!feof(in)) {
-			p = input->str + input->len;
-			remain = input->allocated_len - input->len - 1;
-			if (remain == 0) {
-				old_len = input->len;
-				g_string_set_size(input, old_len * 2);
-				input->len = old_len;
-				continue;
-			}
-			remain = fread(p, 1, remain, in);
-			if (remain > 0) {
-				input->len += remain;
-				input->str[input->len] = '\0';
-			}
-		}
-		if (ferror(in) != 0) {
-			g_set_error(err, RCLIENT_ERROR, ferror(in), "input IO error: %s", strerror(ferror(in)));
-			g_free(req);
-			g_string_free(input, TRUE);
-			return FALSE;
-		}
+	if (conn->keepalive) {
+		req->msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
+	}
 
+	if (data != NULL) {
 		if (!compressed) {
 			/* Detect zstd input */
-			if (input->len > 4 && memcmp(input->str, "\x28\xb5\x2f\xfd", 4) == 0) {
+			if (len > 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0) {
 				compressed = TRUE;
 			}
-			body = rspamd_fstring_new_init(input->str, input->len);
+			body = rspamd_fstring_new_init(data, len);
 		}
 		else {
 			if (comp_dictionary) {
-				dict = rspamd_file_xmap(comp_dictionary, PROT_READ, &dict_len,
-										TRUE);
-
-				if (dict == NULL) {
-					g_set_error(err, RCLIENT_ERROR, errno,
-								"cannot open dictionary %s: %s",
-								comp_dictionary,
-								strerror(errno));
+				if (!rspamd_client_load_dictionary(conn, comp_dictionary, err)) {
+					rspamd_http_message_unref(req->msg);
 					g_free(req);
-					g_string_free(input, TRUE);
+
+					if (input) {
+						g_string_free(input, TRUE);
+					}
 
 					return FALSE;
 				}
 
-				dict_id = -1;
+				dict_id = conn->dict_id;
 			}
 
-			body = rspamd_fstring_sized_new(ZSTD_compressBound(input->len));
-			zctx = ZSTD_createCCtx();
-			body->len = ZSTD_compress_usingDict(zctx, body->str, body->allocated,
-												input->str, input->len,
-												dict, dict_len,
-												1);
+			if (conn->zctx == NULL) {
+				conn->zctx = ZSTD_createCCtx();
+			}
 
-			munmap(dict, dict_len);
+			body = rspamd_fstring_sized_new(ZSTD_compressBound(len));
+
+			if (comp_dictionary) {
+				body->len = ZSTD_compress_usingCDict(conn->zctx, body->str,
+													 body->allocated,
+													 data, len,
+													 conn->cdict);
+			}
+			else {
+				body->len = ZSTD_compressCCtx(conn->zctx, body->str,
+											  body->allocated,
+											  data, len, 1);
+			}
 
 			if (ZSTD_isError(body->len)) {
-				g_set_error(err, RCLIENT_ERROR, ferror(in), "compression error");
+				g_set_error(err, RCLIENT_ERROR, 500, "compression error");
+				rspamd_http_message_unref(req->msg);
 				g_free(req);
-				g_string_free(input, TRUE);
+
+				if (input) {
+					g_string_free(input, TRUE);
+				}
+
 				rspamd_fstring_free(body);
-				ZSTD_freeCCtx(zctx);
 
 				return FALSE;
 			}
-
-			ZSTD_freeCCtx(zctx);
 		}
 
 		rspamd_http_message_set_body_from_fstring_steal(req->msg, body);
-		req->input = input;
-	}
-	else {
-		req->input = NULL;
 	}
 
+	req->input = input;
+
 	/* Convert headers */
 	cur = attrs->head;
 	while (cur != NULL) {
@@ -480,6 +550,84 @@ rspamd_client_command(struct rspamd_client_connection *conn,
 	return ret;
 }
 
+gboolean
+rspamd_client_command(struct rspamd_client_connection *conn,
+					  const char *command, GQueue *attrs,
+					  FILE *in, rspamd_client_callback cb,
+					  gpointer ud, gboolean compressed,
+					  const char *comp_dictionary,
+					  const char *filename,
+					  GError **err)
+{
+	char *p;
+	gsize remain, old_len;
+	GString *input = NULL;
+
+	if (in != NULL) {
+		/* Read input stream */
+		input = g_string_sized_new(BUFSIZ);
+
+		while (!feof(in)) {
+			p = input->str + input->len;
+			remain = input->allocated_len - input->len - 1;
+			if (remain == 0) {
+				old_len = input->len;
+				g_string_set_size(input, old_len * 2);
+				input->len = old_len;
+				continue;
+			}
+			remain = fread(p, 1, remain, in);
+			if (remain > 0) {
+				input->len += remain;
+				input->str[input->len] = '\0';
+			}
+		}
+		if (ferror(in) != 0) {
+			g_set_error(err, RCLIENT_ERROR, ferror(in), "input IO error: %s", strerror(ferror(in)));
+			g_string_free(input, TRUE);
+			return FALSE;
+		}
+
+		return rspamd_client_command_common(conn, command, attrs,
+											input->str, input->len, input,
+											cb, ud, compressed, comp_dictionary,
+											filename, err);
+	}
+
+	return rspamd_client_command_common(conn, command, attrs,
+										NULL, 0, NULL,
+										cb, ud, compressed, comp_dictionary,
+										filename, err);
+}
+
+gboolean
+rspamd_client_command_buf(struct rspamd_client_connection *conn,
+						  const char *command, GQueue *attrs,
+						  const char *data, gsize len,
+						  rspamd_client_callback cb,
+						  gpointer ud, gboolean compressed,
+						  const char *comp_dictionary,
+						  const char *filename,
+						  GError **err)
+{
+	return rspamd_client_command_common(conn, command, attrs,
+										data, len, NULL,
+										cb, ud, compressed, comp_dictionary,
+										filename, err);
+}
+
+void rspamd_client_set_keepalive(struct rspamd_client_connection *conn,
+								 gboolean keepalive)
+{
+	conn->keepalive = keepalive;
+}
+
+gboolean
+rspamd_client_is_reusable(struct rspamd_client_connection *conn)
+{
+	return conn->reusable;
+}
+
 void rspamd_client_destroy(struct rspamd_client_connection *conn)
 {
 	if (conn != NULL) {
@@ -499,6 +647,19 @@ void rspamd_client_destroy(struct rspamd_client_connection *conn)
 			rspamd_keypair_unref(conn->keypair);
 		}
 
+		if (conn->zctx) {
+			ZSTD_freeCCtx(conn->zctx);
+		}
+
+		if (conn->zstream) {
+			ZSTD_freeDStream(conn->zstream);
+		}
+
+		if (conn->cdict) {
+			ZSTD_freeCDict(conn->cdict);
+		}
+
+		g_free(conn->dict_path);
 		g_string_free(conn->server_name, TRUE);
 		g_free(conn);
 	}
@@ -93,6 +93,38 @@ gboolean rspamd_client_command(
 	const char *filename,
 	GError **err);
 
+/**
+ * Same as `rspamd_client_command` but with input from a buffer, e.g. a
+ * memory mapped file, that must be valid until the command is sent
+ */
+gboolean rspamd_client_command_buf(
+	struct rspamd_client_connection *conn,
+	const char *command,
+	GQueue *attrs,
+	const char *data,
+	gsize len,
+	rspamd_client_callback cb,
+	gpointer ud,
+	gboolean compressed,
+	const char *comp_dictionary,
+	const char *filename,
+	GError **err);
+
+/**
+ * Ask server to keep connection open after a reply
+ * @param conn
+ * @param keepalive
+ */
+void rspamd_client_set_keepalive(struct rspamd_client_connection *conn,
+								 gboolean keepalive);
+
+/**
+ * Returns TRUE if server has kept connection after the last reply, so
+ * another command could be sent using it
+ * @param conn
+ */
+gboolean rspamd_client_is_reusable(struct rspamd_client_connection *conn);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
@@ -17,6 +17,7 @@
 #include "libserver/dynamic_cfg.h"
 #include "libserver/cfg_file_private.h"
 #include "libutil/rrd.h"
+#include "libutil/shm_cache.h"
 #include "libserver/maps/map.h"
 #include "libserver/maps/map_helpers.h"
 #include "libserver/maps/map_private.h"
@@ -127,6 +128,25 @@ worker_t controller_worker = {
 /*
  * Worker's context
  */
+/* JSON of a history row that is kept until the row is overwritten */
+struct rspamd_controller_history_fragment {
+	uint32_t seq;
+	unsigned int nsymbols;
+	const char **symbols;
+	rspamd_fstring_t *json;
+};
+
+struct rspamd_controller_history_cache {
+	unsigned int generation;
+	unsigned int nrows;
+	struct rspamd_controller_history_fragment *rows;
+};
+
+struct rspamd_controller_graph_cache {
+	uint64_t key;
+	rspamd_fstring_t *json;
+};
+
 struct rspamd_controller_worker_ctx {
 	uint64_t magic;
 	/* Events base */
@@ -183,6 +203,30 @@ struct rspamd_controller_worker_ctx {
 	unsigned int scanners_count;
 	unsigned int workers_hb_lost;
 	ev_timer health_check_timer;
+
+	/* Cached replies for frequently polled endpoints */
+	struct rspamd_controller_history_cache history_cache;
+	struct rspamd_controller_graph_cache graph_cache[4];
+	rspamd_fstring_t *stat_cache;
+	ev_tstamp stat_cache_time;
+	ev_tstamp stat_cache_ttl;
+
+	/* Learn requests are forwarded to these controllers if set */
+	char *learners_line;
+	struct upstream_list *learners;
+	ev_tstamp learners_timeout;
+	unsigned int learners_max_pending;
+	unsigned int learners_pending;
+	/* This controller serves learn requests only */
+	gboolean learner;
+};
+
+/* Learn request being forwarded to a learner controller */
+struct rspamd_controller_learn_fwd {
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
 };
 
 struct rspamd_controller_plugin_cbdata {
@@ -419,9 +463,13 @@ rspamd_controller_check_forwarded(struct rspamd_controller_session *session,
 	const char *comma;
 	const char *hdr_name = "X-Forwarded-For", *alt_hdr_name = "X-Real-IP";
 	char ip_buf[INET6_ADDRSTRLEN + 1];
-	rspamd_inet_addr_t *addr = NULL;
+	rspamd_inet_addr_t *addr;
 	int ret = 0;
 
+	/* Forwarded address is used for the check only, so avoid allocations */
+	addr = g_alloca(rspamd_inet_address_storage_size());
+	memset(addr, 0, rspamd_inet_address_storage_size());
+
 	hdr = rspamd_http_message_find_header(msg, hdr_name);
 
 	if (hdr) {
@@ -439,15 +487,13 @@ rspamd_controller_check_forwarded(struct rspamd_controller_session *session,
 		else {
 			comma = hdr->begin;
 		}
-		if (rspamd_parse_inet_address(&addr, comma,
-									  (hdr->begin + hdr->len) - comma,
-									  RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
+		if (rspamd_parse_inet_address_ip(comma,
+										 (hdr->begin + hdr->len) - comma,
+										 addr)) {
 			/* We have addr now, so check if it is still trusted */
 			if (ctx->secure_map &&
 				rspamd_match_radix_map_addr(ctx->secure_map, addr) != NULL) {
-				/* rspamd_inet_address_to_string is not reentrant */
-				rspamd_strlcpy(ip_buf, rspamd_inet_address_to_string(addr),
-							   sizeof(ip_buf));
+				rspamd_inet_address_to_string_buf(addr, ip_buf, sizeof(ip_buf));
 				msg_info_session("allow unauthorized proxied connection "
 								 "from a trusted IP %s via %s",
 								 ip_buf,
@@ -457,8 +503,6 @@ rspamd_controller_check_forwarded(struct rspamd_controller_session *session,
 			else {
 				ret = -1;
 			}
-
-			rspamd_inet_address_free(addr);
 		}
 		else {
 			msg_warn_session("cannot parse forwarded IP: %T", hdr);
@@ -470,14 +514,11 @@ rspamd_controller_check_forwarded(struct rspamd_controller_session *session,
 		hdr = rspamd_http_message_find_header(msg, alt_hdr_name);
 
 		if (hdr) {
-			if (rspamd_parse_inet_address(&addr, hdr->begin, hdr->len,
-										  RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
+			if (rspamd_parse_inet_address_ip(hdr->begin, hdr->len, addr)) {
 				/* We have addr now, so check if it is still trusted */
 				if (ctx->secure_map &&
 					rspamd_match_radix_map_addr(ctx->secure_map, addr) != NULL) {
-					/* rspamd_inet_address_to_string is not reentrant */
-					rspamd_strlcpy(ip_buf, rspamd_inet_address_to_string(addr),
-								   sizeof(ip_buf));
+					rspamd_inet_address_to_string_buf(addr, ip_buf, sizeof(ip_buf));
 					msg_info_session("allow unauthorized proxied connection "
 									 "from a trusted IP %s via %s",
 									 ip_buf,
@@ -487,8 +528,6 @@ rspamd_controller_check_forwarded(struct rspamd_controller_session *session,
 				else {
 					ret = -1;
 				}
-
-				rspamd_inet_address_free(addr);
 			}
 			else {
 				msg_warn_session("cannot parse real IP: %T", hdr);
@@ -751,7 +790,7 @@ rspamd_controller_handle_auth(struct rspamd_http_connection_entry *conn_ent,
 	}
 
 	obj = ucl_object_typed_new(UCL_OBJECT);
-	memcpy(&st, session->ctx->srv->stat, sizeof(st));
+	rspamd_main_stat_snapshot(session->ctx->srv, &st);
 	data[0] = st.actions_stat[METRIC_ACTION_NOACTION];
 	data[1] = st.actions_stat[METRIC_ACTION_ADD_HEADER] +
 			  st.actions_stat[METRIC_ACTION_REWRITE_SUBJECT];
@@ -938,6 +977,25 @@ rspamd_controller_can_edit_map(struct rspamd_map_backend *bk)
 	return FALSE;
 }
 
+static void
+rspamd_controller_map_data_stat(ucl_object_t *obj, struct rspamd_map *map)
+{
+	struct rspamd_map_data_stat st;
+
+	rspamd_map_get_data_stat(map, &st);
+	ucl_object_insert_key(obj, ucl_object_fromint(st.nelts),
+						  "elements", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(st.memory),
+						  "memory", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromdouble(st.load_time),
+						  "load_time", 0, false);
+
+	if (st.hs_size > 0) {
+		ucl_object_insert_key(obj, ucl_object_fromint(st.hs_size),
+							  "hs_size", 0, false);
+	}
+}
+
 /*
  * Maps command handler:
  * request: /maps
@@ -946,7 +1004,10 @@ rspamd_controller_can_edit_map(struct rspamd_map_backend *bk)
  *      {
  *      "map": "name",
  *      "description": "description",
- *      "editable": true
+ *      "editable": true,
+ *      "elements": 100,
+ *      "memory": 4096,
+ *      "load_time": 0.01
  *      },
  *      {...}
  * ]
@@ -996,6 +1057,7 @@ rspamd_controller_handle_maps(struct rspamd_http_connection_entry *conn_ent,
 									  "uri", 0, false);
 				ucl_object_insert_key(obj, ucl_object_frombool(editable),
 									  "editable", 0, false);
+				rspamd_controller_map_data_stat(obj, map);
 				ucl_array_append(top, obj);
 			}
 		}
@@ -1148,6 +1210,7 @@ rspamd_controller_handle_pie_chart(
 	struct rspamd_controller_worker_ctx *ctx;
 	double data[5], total;
 	ucl_object_t *top;
+	struct rspamd_stat st;
 
 	ctx = session->ctx;
 
@@ -1156,15 +1219,16 @@ rspamd_controller_handle_pie_chart(
 	}
 
 	top = ucl_object_typed_new(UCL_ARRAY);
-	total = ctx->srv->stat->messages_scanned;
+	rspamd_main_stat_snapshot(ctx->srv, &st);
+	total = st.messages_scanned;
 	if (total != 0) {
 
-		data[0] = ctx->srv->stat->actions_stat[METRIC_ACTION_NOACTION];
-		data[1] = ctx->srv->stat->actions_stat[METRIC_ACTION_SOFT_REJECT];
-		data[2] = (ctx->srv->stat->actions_stat[METRIC_ACTION_ADD_HEADER] +
-				   ctx->srv->stat->actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
-		data[3] = ctx->srv->stat->actions_stat[METRIC_ACTION_GREYLIST];
-		data[4] = ctx->srv->stat->actions_stat[METRIC_ACTION_REJECT];
+		data[0] = st.actions_stat[METRIC_ACTION_NOACTION];
+		data[1] = st.actions_stat[METRIC_ACTION_SOFT_REJECT];
+		data[2] = (st.actions_stat[METRIC_ACTION_ADD_HEADER] +
+				   st.actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
+		data[3] = st.actions_stat[METRIC_ACTION_GREYLIST];
+		data[4] = st.actions_stat[METRIC_ACTION_REJECT];
 	}
 	else {
 		memset(data, 0, sizeof(data));
@@ -1244,6 +1308,8 @@ rspamd_controller_handle_graph(
 	struct rspamd_controller_worker_ctx *ctx;
 	rspamd_ftok_t srch, *value;
 	struct rspamd_rrd_query_result *rrd_result;
+	struct rspamd_controller_graph_cache *graph_cache;
+	uint64_t cache_key;
 	gulong i, k, start_row, cnt, t, ts, step;
 	double *acc;
 	ucl_object_t *res, *elt[METRIC_ACTION_MAX];
@@ -1318,6 +1384,19 @@ rspamd_controller_handle_graph(
 
 	g_assert(rrd_result->ds_count == G_N_ELEMENTS(elt));
 
+	/* Points change only when a consolidated row is completed */
+	graph_cache = &ctx->graph_cache[rra_num];
+	cache_key = (uint64_t) (rrd_result->last_update / rrd_result->pdp_per_cdp) *
+					rrd_result->rra_rows +
+				rrd_result->cur_row + 1;
+
+	if (graph_cache->json && graph_cache->key == cache_key) {
+		rspamd_controller_send_cached_json(conn_ent, msg, graph_cache->json);
+		g_free(rrd_result);
+
+		return 0;
+	}
+
 	res = ucl_object_typed_new(UCL_ARRAY);
 	/* How much full updates happened since the last update */
 	ts = rrd_result->last_update / rrd_result->pdp_per_cdp - rrd_result->rra_rows;
@@ -1371,7 +1450,16 @@ rspamd_controller_handle_graph(
 		ucl_array_append(res, elt[i]);
 	}
 
-	rspamd_controller_send_ucl(conn_ent, res);
+	if (graph_cache->json) {
+		graph_cache->json->len = 0;
+	}
+	else {
+		graph_cache->json = rspamd_fstring_sized_new(BUFSIZ);
+	}
+
+	rspamd_ucl_emit_fstring(res, UCL_EMIT_JSON_COMPACT, &graph_cache->json);
+	graph_cache->key = cache_key;
+	rspamd_controller_send_cached_json(conn_ent, msg, graph_cache->json);
 	ucl_object_unref(res);
 	g_free(acc);
 	g_free(rrd_result);
@@ -1379,6 +1467,146 @@ rspamd_controller_handle_graph(
 	return 0;
 }
 
+static ucl_object_t *
+rspamd_controller_history_row_ucl(struct roll_history_row *row)
+{
+	struct tm tm;
+	char timebuf[32];
+	ucl_object_t *obj;
+	unsigned int j;
+
+	rspamd_localtime(row->timestamp, &tm);
+	strftime(timebuf, sizeof(timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromstring(timebuf), "time", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(row->timestamp), "unix_time", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromstring(row->message_id), "id", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromstring(row->from_addr),
+						  "ip", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromstring(rspamd_action_to_str(
+							  row->action)),
+						  "action", 0, false);
+
+	if (!isnan(row->score)) {
+		ucl_object_insert_key(obj, ucl_object_fromdouble(row->score), "score", 0, false);
+	}
+	else {
+		ucl_object_insert_key(obj,
+							  ucl_object_fromdouble(0.0), "score", 0, false);
+	}
+
+	if (!isnan(row->required_score)) {
+		ucl_object_insert_key(obj,
+							  ucl_object_fromdouble(
+								  row->required_score),
+							  "required_score", 0, false);
+	}
+	else {
+		ucl_object_insert_key(obj,
+							  ucl_object_fromdouble(0.0), "required_score", 0, false);
+	}
+
+	ucl_object_t *syms_obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_reserve(syms_obj, row->nsymbols);
+
+	for (j = 0; j < row->nsymbols; j++) {
+		ucl_object_t *cur = ucl_object_typed_new(UCL_OBJECT);
+
+		ucl_object_insert_key(cur, ucl_object_fromdouble(row->symbols[j].score),
+							  "score", 0, false);
+		ucl_object_insert_key(syms_obj, cur, row->symbols[j].name, 0, true);
+	}
+
+	ucl_object_insert_key(obj, syms_obj, "symbols", 0, false);
+
+	ucl_object_insert_key(obj, ucl_object_fromint(row->len),
+						  "size", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromdouble(row->scan_time),
+						  "scan_time", 0, false);
+
+	if (row->user[0] != '\0') {
+		ucl_object_insert_key(obj, ucl_object_fromstring(row->user),
+							  "user", 0, false);
+	}
+	if (row->from_addr[0] != '\0') {
+		ucl_object_insert_key(obj, ucl_object_fromstring(row->from_addr), "from", 0, false);
+	}
+
+	return obj;
+}
+
+static void
+rspamd_controller_history_cache_clear(struct rspamd_controller_history_cache *cache)
+{
+	unsigned int i;
+
+	if (cache->rows == NULL) {
+		return;
+	}
+
+	for (i = 0; i < cache->nrows; i++) {
+		if (cache->rows[i].json) {
+			rspamd_fstring_free(cache->rows[i].json);
+		}
+
+		g_free(cache->rows[i].symbols);
+	}
+
+	g_free(cache->rows);
+	cache->rows = NULL;
+	cache->nrows = 0;
+}
+
+/*
+ * Returns JSON of a history row, rows are converted once and then reused
+ * until they are overwritten
+ */
+static struct rspamd_controller_history_fragment *
+rspamd_controller_history_fragment(struct rspamd_controller_history_cache *cache,
+								   struct roll_history *history,
+								   unsigned int row_num,
+								   struct roll_history_row *row)
+{
+	struct rspamd_controller_history_fragment *frag = &cache->rows[row_num];
+	uint32_t seq = __atomic_load_n(&history->seq[row_num], __ATOMIC_ACQUIRE);
+	ucl_object_t *obj;
+	unsigned int j;
+
+	if (frag->json && frag->seq == seq) {
+		return frag;
+	}
+
+	if (!rspamd_roll_history_get_row(history, row_num, row)) {
+		return NULL;
+	}
+
+	obj = rspamd_controller_history_row_ucl(row);
+
+	if (frag->json) {
+		frag->json->len = 0;
+	}
+	else {
+		frag->json = rspamd_fstring_sized_new(512);
+	}
+
+	rspamd_ucl_emit_fstring(obj, UCL_EMIT_JSON_COMPACT, &frag->json);
+	ucl_object_unref(obj);
+
+	/* Symbol names are interned in shared memory, so they outlive rows */
+	frag->symbols = g_realloc(frag->symbols, sizeof(const char *) * MAX(row->nsymbols, 1));
+	frag->nsymbols = row->nsymbols;
+
+	for (j = 0; j < row->nsymbols; j++) {
+		frag->symbols[j] = row->symbols[j].name;
+	}
+
+	frag->seq = seq;
+
+	return frag;
+}
+
 static void
 rspamd_controller_handle_legacy_history(
 	struct rspamd_controller_session *session,
@@ -1386,108 +1614,125 @@ rspamd_controller_handle_legacy_history(
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
-	struct roll_history_row *row, *copied_rows;
-	unsigned int i, rows_proc, row_num;
-	struct tm tm;
-	char timebuf[32], **syms;
-	ucl_object_t *top, *obj;
+	struct roll_history *history = ctx->srv->history;
+	struct rspamd_controller_history_cache *cache = &ctx->history_cache;
+	struct rspamd_controller_history_fragment *frag;
+	struct roll_history_row *row;
+	unsigned int i, j, row_num, generation, nrows = 0;
+	GHashTable *query_args;
+	const rspamd_ftok_t *arg;
+	rspamd_ftok_t srch;
+	rspamd_fstring_t *reply;
+	double min_score = -(G_MAXDOUBLE), since = 0;
+	int action_filter = -1;
+	char *symbol_filter = NULL;
 
-	top = ucl_object_typed_new(UCL_ARRAY);
+	/* Optional filters: min_score, action, symbol and since (unix time) */
+	query_args = rspamd_http_message_parse_query(msg);
+	RSPAMD_FTOK_ASSIGN(&srch, "min_score");
+	arg = g_hash_table_lookup(query_args, &srch);
 
-	/* Set lock on history */
-	copied_rows = g_malloc(sizeof(*copied_rows) * ctx->srv->history->nrows);
-	memcpy(copied_rows, ctx->srv->history->rows,
-		   sizeof(*copied_rows) * ctx->srv->history->nrows);
-
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
-
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
-			row_num = 0;
-		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			rspamd_localtime(row->timestamp, &tm);
-			strftime(timebuf, sizeof(timebuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
-			obj = ucl_object_typed_new(UCL_OBJECT);
-			ucl_object_insert_key(obj, ucl_object_fromstring(timebuf), "time", 0, false);
-			ucl_object_insert_key(obj, ucl_object_fromint(row->timestamp), "unix_time", 0, false);
-			ucl_object_insert_key(obj, ucl_object_fromstring(row->message_id), "id", 0, false);
-			ucl_object_insert_key(obj, ucl_object_fromstring(row->from_addr),
-								  "ip", 0, false);
-			ucl_object_insert_key(obj,
-								  ucl_object_fromstring(rspamd_action_to_str(
-									  row->action)),
-								  "action", 0, false);
-
-			if (!isnan(row->score)) {
-				ucl_object_insert_key(obj, ucl_object_fromdouble(row->score), "score", 0, false);
-			}
-			else {
-				ucl_object_insert_key(obj,
-									  ucl_object_fromdouble(0.0), "score", 0, false);
-			}
+	if (arg) {
+		char *val = rspamd_ftokdup(arg);
+		min_score = g_ascii_strtod(val, NULL);
+		g_free(val);
+	}
 
-			if (!isnan(row->required_score)) {
-				ucl_object_insert_key(obj,
-									  ucl_object_fromdouble(
-										  row->required_score),
-									  "required_score", 0, false);
-			}
-			else {
-				ucl_object_insert_key(obj,
-									  ucl_object_fromdouble(0.0), "required_score", 0, false);
-			}
+	RSPAMD_FTOK_ASSIGN(&srch, "since");
+	arg = g_hash_table_lookup(query_args, &srch);
 
-			syms = g_strsplit_set(row->symbols, ", ", -1);
+	if (arg) {
+		char *val = rspamd_ftokdup(arg);
+		since = g_ascii_strtod(val, NULL);
+		g_free(val);
+	}
 
-			if (syms) {
-				unsigned int nelts = g_strv_length(syms);
-				ucl_object_t *syms_obj = ucl_object_typed_new(UCL_OBJECT);
-				ucl_object_reserve(syms_obj, nelts);
+	RSPAMD_FTOK_ASSIGN(&srch, "action");
+	arg = g_hash_table_lookup(query_args, &srch);
 
-				for (unsigned int j = 0; j < nelts; j++) {
-					g_strstrip(syms[j]);
+	if (arg) {
+		char *val = rspamd_ftokdup(arg);
+		enum rspamd_action_type act;
 
-					if (strlen(syms[j]) == 0) {
-						/* Empty garbage */
-						continue;
-					}
+		if (rspamd_action_from_str(val, &act)) {
+			action_filter = act;
+		}
+		else {
+			g_free(val);
+			g_hash_table_unref(query_args);
+			rspamd_controller_send_error(conn_ent, 400, "invalid action");
 
-					ucl_object_t *cur = ucl_object_typed_new(UCL_OBJECT);
+			return;
+		}
 
-					ucl_object_insert_key(cur, ucl_object_fromdouble(0.0),
-										  "score", 0, false);
-					ucl_object_insert_key(syms_obj, cur, syms[j], 0, true);
-				}
+		g_free(val);
+	}
 
-				ucl_object_insert_key(obj, syms_obj, "symbols", 0, false);
-				g_strfreev(syms);
-			}
+	RSPAMD_FTOK_ASSIGN(&srch, "symbol");
+	arg = g_hash_table_lookup(query_args, &srch);
+
+	if (arg) {
+		symbol_filter = rspamd_ftokdup(arg);
+	}
+
+	g_hash_table_unref(query_args);
+
+	generation = __atomic_load_n(&history->generation, __ATOMIC_ACQUIRE);
+
+	if (cache->rows == NULL || cache->generation != generation ||
+		cache->nrows != history->nrows) {
+		rspamd_controller_history_cache_clear(cache);
+		cache->rows = g_malloc0(sizeof(*cache->rows) * history->nrows);
+		cache->nrows = history->nrows;
+		cache->generation = generation;
+	}
 
-			ucl_object_insert_key(obj, ucl_object_fromint(row->len),
-								  "size", 0, false);
-			ucl_object_insert_key(obj,
-								  ucl_object_fromdouble(row->scan_time),
-								  "scan_time", 0, false);
+	reply = rspamd_fstring_sized_new(BUFSIZ);
+	reply = rspamd_fstring_append(reply, "[", 1);
+	row = g_malloc(sizeof(*row));
 
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key(obj, ucl_object_fromstring(row->user),
-									  "user", 0, false);
+	/* Go through all rows starting from the oldest one */
+	row_num = g_atomic_int_get(&history->cur_row) % history->nrows;
+
+	for (i = 0; i < history->nrows; i++, row_num = (row_num + 1) % history->nrows) {
+		/* Filter by columns first, so most rows are not touched */
+		if (!rspamd_roll_history_row_completed(history, row_num) ||
+			history->score[row_num] < min_score ||
+			history->timestamp[row_num] <= since ||
+			(action_filter != -1 && history->action[row_num] != action_filter)) {
+			continue;
+		}
+
+		frag = rspamd_controller_history_fragment(cache, history, row_num, row);
+
+		if (frag == NULL) {
+			continue;
+		}
+
+		if (symbol_filter) {
+			for (j = 0; j < frag->nsymbols; j++) {
+				if (strcmp(frag->symbols[j], symbol_filter) == 0) {
+					break;
+				}
 			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key(obj, ucl_object_fromstring(row->from_addr), "from", 0, false);
+
+			if (j == frag->nsymbols) {
+				continue;
 			}
-			ucl_array_append(top, obj);
-			rows_proc++;
 		}
+
+		if (nrows++ > 0) {
+			reply = rspamd_fstring_append(reply, ",", 1);
+		}
+
+		reply = rspamd_fstring_append(reply, frag->json->str, frag->json->len);
 	}
 
-	rspamd_controller_send_ucl(conn_ent, top);
-	ucl_object_unref(top);
-	g_free(copied_rows);
+	reply = rspamd_fstring_append(reply, "]", 1);
+	rspamd_controller_send_cached_json(conn_ent, msg, reply);
+	rspamd_fstring_free(reply);
+	g_free(row);
+	g_free(symbol_filter);
 }
 
 static gboolean
@@ -1659,6 +1904,8 @@ rspamd_controller_handle_ready(struct rspamd_http_connection_entry *conn_ent,
  * History command handler:
  * request: /history
  * headers: Password
+ * query: min_score, action, symbol and since (unix time) to filter rows
+ * (built-in history only, replies have ETag and honour If-None-Match)
  * reply: json [
  *      { label: "Foo", data: 11 },
  *      { label: "Bar", data: 20 },
@@ -1752,8 +1999,7 @@ rspamd_controller_handle_history_reset(struct rspamd_http_connection_entry *conn
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	unsigned int completed_rows, i, t;
+	unsigned int completed_rows;
 	lua_State *L;
 
 	ctx = session->ctx;
@@ -1764,22 +2010,7 @@ rspamd_controller_handle_history_reset(struct rspamd_http_connection_entry *conn
 	}
 
 	if (ctx->srv->history && !ctx->srv->history->disabled) {
-		/* Clean from start to the current row */
-		completed_rows = g_atomic_int_get(&ctx->srv->history->cur_row);
-
-		completed_rows = MIN(completed_rows, ctx->srv->history->nrows - 1);
-
-		for (i = 0; i <= completed_rows; i++) {
-			t = g_atomic_int_get(&ctx->srv->history->cur_row);
-
-			/* We somehow come to the race condition */
-			if (i > t) {
-				break;
-			}
-
-			row = &ctx->srv->history->rows[i];
-			memset(row, 0, sizeof(*row));
-		}
+		completed_rows = rspamd_roll_history_reset(ctx->srv->history);
 
 		msg_info_session("<%s> cleared %d entries from history",
 						 rspamd_inet_address_to_string(session->from_addr),
@@ -2059,6 +2290,147 @@ rspamd_controller_check_fin_task(void *ud)
 	return FALSE;
 }
 
+static void
+rspamd_controller_learn_fwd_free(struct rspamd_controller_learn_fwd *fwd)
+{
+	struct rspamd_controller_session *session = fwd->conn_ent->ud;
+
+	session->learn_fwd = NULL;
+	fwd->ctx->learners_pending--;
+	rspamd_http_connection_unref(fwd->conn);
+	g_free(fwd);
+}
+
+static void
+rspamd_controller_learn_fwd_error(struct rspamd_http_connection *conn,
+								  GError *err)
+{
+	struct rspamd_controller_learn_fwd *fwd =
+		(struct rspamd_controller_learn_fwd *) conn->ud;
+	struct rspamd_http_connection_entry *conn_ent = fwd->conn_ent;
+	struct rspamd_controller_session *session = conn_ent->ud;
+
+	msg_err_session("cannot forward learn request to %s: %e",
+					rspamd_upstream_name(fwd->up), err);
+	rspamd_upstream_fail(fwd->up, FALSE, err ? err->message : "unknown error");
+	rspamd_controller_learn_fwd_free(fwd);
+	rspamd_controller_send_error(conn_ent, 502, "Learner is not available");
+}
+
+static int
+rspamd_controller_learn_fwd_finish(struct rspamd_http_connection *conn,
+								   struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_learn_fwd *fwd =
+		(struct rspamd_controller_learn_fwd *) conn->ud;
+	struct rspamd_http_connection_entry *conn_ent = fwd->conn_ent;
+	struct rspamd_http_message *reply;
+	const char *body;
+	gsize len = 0;
+
+	/* Learner has replied, so it is alive whatever the learn result is */
+	rspamd_upstream_ok(fwd->up);
+
+	reply = rspamd_http_new_message(HTTP_RESPONSE);
+	reply->date = time(NULL);
+	reply->code = msg->code;
+
+	if (msg->status) {
+		reply->status = rspamd_fstring_new_init(msg->status->str,
+												msg->status->len);
+	}
+
+	body = rspamd_http_message_get_body(msg, &len);
+
+	if (body && len > 0) {
+		rspamd_http_message_set_body(reply, body, len);
+	}
+
+	rspamd_controller_learn_fwd_free(fwd);
+	rspamd_http_connection_reset(conn_ent->conn);
+	rspamd_http_router_insert_headers(conn_ent->rt, reply);
+	rspamd_http_connection_write_message(conn_ent->conn, reply, NULL,
+										 "application/json", conn_ent,
+										 conn_ent->rt->timeout);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
+/*
+ * Passes learn request to one of the learner controllers, so this process
+ * is not blocked by the bulk learning
+ */
+static void
+rspamd_controller_learn_forward(struct rspamd_http_connection_entry *conn_ent,
+								struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_controller_learn_fwd *fwd;
+	struct rspamd_http_message *fwd_msg;
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
+	GError *err = NULL;
+
+	if (ctx->learners_max_pending > 0 &&
+		ctx->learners_pending >= ctx->learners_max_pending) {
+		msg_info_session("too many pending learn requests: %ud",
+						 ctx->learners_pending);
+		rspamd_controller_send_error(conn_ent, 503,
+									 "Too many pending learn requests");
+		return;
+	}
+
+	up = rspamd_upstream_get(ctx->learners, RSPAMD_UPSTREAM_ROUND_ROBIN,
+							 NULL, 0);
+
+	if (up == NULL) {
+		rspamd_controller_send_error(conn_ent, 503, "No learners available");
+		return;
+	}
+
+	fwd_msg = rspamd_http_connection_copy_msg(msg, &err);
+
+	if (fwd_msg == NULL) {
+		msg_err_session("cannot copy learn request: %e", err);
+		g_error_free(err);
+		rspamd_controller_send_error(conn_ent, 500, "Internal error");
+		return;
+	}
+
+	conn = rspamd_http_connection_new_client(ctx->http_ctx,
+											 NULL,
+											 rspamd_controller_learn_fwd_error,
+											 rspamd_controller_learn_fwd_finish,
+											 RSPAMD_HTTP_CLIENT_SIMPLE,
+											 rspamd_upstream_addr_next(up));
+
+	if (conn == NULL) {
+		rspamd_upstream_fail(up, TRUE, strerror(errno));
+		rspamd_http_message_unref(fwd_msg);
+		rspamd_controller_send_error(conn_ent, 502, "Learner is not available");
+		return;
+	}
+
+	rspamd_http_message_remove_header(fwd_msg, "Host");
+	rspamd_http_message_remove_header(fwd_msg, "Connection");
+	rspamd_http_message_remove_header(fwd_msg, "Content-Length");
+	rspamd_http_message_add_header(fwd_msg, "Host", rspamd_upstream_name(up));
+	rspamd_http_message_add_header(fwd_msg, "Connection", "close");
+
+	fwd = g_malloc0(sizeof(*fwd));
+	fwd->ctx = ctx;
+	fwd->conn_ent = conn_ent;
+	fwd->conn = conn;
+	fwd->up = up;
+	session->learn_fwd = fwd;
+	ctx->learners_pending++;
+
+	rspamd_http_connection_write_message(conn, fwd_msg, rspamd_upstream_name(up),
+										 NULL, fwd, ctx->learners_timeout);
+}
+
 static int
 rspamd_controller_handle_learn_common(
 	struct rspamd_http_connection_entry *conn_ent,
@@ -2084,6 +2456,11 @@ rspamd_controller_handle_learn_common(
 		return 0;
 	}
 
+	if (ctx->learners != NULL) {
+		rspamd_controller_learn_forward(conn_ent, msg);
+		return 0;
+	}
+
 	task = rspamd_task_new(session->ctx->worker, session->cfg, session->pool,
 						   session->ctx->lang_det, ctx->event_loop, FALSE);
 
@@ -2588,6 +2965,8 @@ struct rspamd_stat_cbdata {
 	ucl_object_t *top;
 	ucl_object_t *stat;
 	struct rspamd_task *task;
+	/* Request to reply with a cached copy, NULL if a reply is not cached */
+	struct rspamd_http_message *cached_req;
 	uint64_t learned;
 };
 
@@ -2627,8 +3006,23 @@ rspamd_controller_stat_fin_task(void *ud)
 		ucl_object_insert_key(top, ar, "fuzzy_hashes", 0, false);
 	}
 
-	rspamd_controller_send_ucl(conn_ent, top);
+	if (cbdata->cached_req) {
+		struct rspamd_controller_worker_ctx *ctx = cbdata->ctx;
 
+		if (ctx->stat_cache) {
+			ctx->stat_cache->len = 0;
+		}
+		else {
+			ctx->stat_cache = rspamd_fstring_sized_new(BUFSIZ);
+		}
+
+		rspamd_ucl_emit_fstring(top, UCL_EMIT_JSON_COMPACT, &ctx->stat_cache);
+		ctx->stat_cache_time = ev_now(ctx->event_loop);
+		rspamd_controller_send_cached_json(conn_ent, cbdata->cached_req, ctx->stat_cache);
+	}
+	else {
+		rspamd_controller_send_ucl(conn_ent, top);
+	}
 
 	return TRUE;
 }
@@ -2640,6 +3034,10 @@ rspamd_controller_stat_cleanup_task(void *ud)
 
 	rspamd_task_free(cbdata->task);
 	ucl_object_unref(cbdata->top);
+
+	if (cbdata->cached_req) {
+		rspamd_http_message_unref(cbdata->cached_req);
+	}
 }
 
 /*
@@ -2648,6 +3046,24 @@ rspamd_controller_stat_cleanup_task(void *ud)
  * headers: Password
  * reply: json data
  */
+static void
+rspamd_controller_shm_cache_stat(const char *name, rspamd_shm_cache_t *c, void *ud)
+{
+	ucl_object_t *top = (ucl_object_t *) ud, *sub;
+	struct rspamd_shm_cache_stat st;
+
+	rspamd_shm_cache_stat(c, &st);
+	sub = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(sub, ucl_object_fromint(rspamd_shm_cache_capacity(c)),
+						  "capacity", 0, false);
+	ucl_object_insert_key(sub, ucl_object_fromint(st.hits), "hits", 0, false);
+	ucl_object_insert_key(sub, ucl_object_fromint(st.misses), "misses", 0, false);
+	ucl_object_insert_key(sub, ucl_object_fromint(st.inserts), "inserts", 0, false);
+	ucl_object_insert_key(sub, ucl_object_fromint(st.evictions), "evictions", 0, false);
+	ucl_object_insert_key(sub, ucl_object_fromint(st.rejects), "rejects", 0, false);
+	ucl_object_insert_key(top, sub, name, 0, true);
+}
+
 static int
 rspamd_controller_handle_stat_common(
 	struct rspamd_http_connection_entry *conn_ent,
@@ -2667,7 +3083,7 @@ rspamd_controller_handle_stat_common(
 
 	memset(&mem_st, 0, sizeof(mem_st));
 	rspamd_mempool_stat(&mem_st);
-	memcpy(&stat_copy, session->ctx->worker->srv->stat, sizeof(stat_copy));
+	rspamd_main_stat_snapshot(session->ctx->worker->srv, &stat_copy);
 	stat = &stat_copy;
 	ctx = session->ctx;
 
@@ -2678,6 +3094,11 @@ rspamd_controller_handle_stat_common(
 	cbdata->conn_ent = conn_ent;
 	cbdata->task = task;
 	cbdata->ctx = ctx;
+
+	if (!do_reset && ctx->stat_cache_ttl > 0) {
+		cbdata->cached_req = rspamd_http_message_ref(msg);
+	}
+
 	top = ucl_object_typed_new(UCL_OBJECT);
 	cbdata->top = top;
 
@@ -2711,14 +3132,6 @@ rspamd_controller_handle_stat_common(
 		else {
 			ham += stat->actions_stat[i];
 		}
-		if (do_reset) {
-#ifndef HAVE_ATOMIC_BUILTINS
-			session->ctx->worker->srv->stat->actions_stat[i] = 0;
-#else
-			__atomic_store_n(&session->ctx->worker->srv->stat->actions_stat[i],
-							 0, __ATOMIC_RELEASE);
-#endif
-		}
 	}
 	ucl_object_insert_key(top, sub, "actions", 0, false);
 
@@ -2760,12 +3173,15 @@ rspamd_controller_handle_stat_common(
 						  "chunks_oversized", 0, false);
 	ucl_object_insert_key(top,
 						  ucl_object_fromint(mem_st.fragmented_size), "fragmented", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromint(mem_st.hugepage_bytes), "hugepage_bytes", 0, false);
+
+	sub = ucl_object_typed_new(UCL_OBJECT);
+	rspamd_shm_cache_foreach(rspamd_controller_shm_cache_stat, sub);
+	ucl_object_insert_key(top, sub, "shared_caches", 0, false);
 
 	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
+		rspamd_main_stat_reset(session->ctx->srv, &stat_copy);
 		rspamd_mempool_stat_reset();
 	}
 
@@ -2786,10 +3202,20 @@ rspamd_controller_handle_stat(struct rspamd_http_connection_entry *conn_ent,
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+
 	if (!rspamd_controller_check_password(conn_ent, session, msg, FALSE)) {
 		return 0;
 	}
 
+	/* Pollers within the ttl get the same reply without querying backends */
+	if (ctx->stat_cache && ctx->stat_cache_ttl > 0 &&
+		ev_now(ctx->event_loop) - ctx->stat_cache_time < ctx->stat_cache_ttl) {
+		rspamd_controller_send_cached_json(conn_ent, msg, ctx->stat_cache);
+
+		return 0;
+	}
+
 	return rspamd_controller_handle_stat_common(conn_ent, msg, FALSE);
 }
 
@@ -2806,6 +3232,8 @@ rspamd_controller_handle_statreset(
 
 	msg_info_session("<%s> reset stat",
 					 rspamd_inet_address_to_string(session->from_addr));
+	/* Cached reply has counters that are reset now */
+	session->ctx->stat_cache_time = 0;
 	return rspamd_controller_handle_stat_common(conn_ent, msg, TRUE);
 }
 
@@ -2960,7 +3388,7 @@ rspamd_controller_handle_metrics_common(
 
 	uptime = ev_time() - session->ctx->srv->start_time;
 	ctx = session->ctx;
-	memcpy(&stat_copy, session->ctx->worker->srv->stat, sizeof(stat_copy));
+	rspamd_main_stat_snapshot(session->ctx->worker->srv, &stat_copy);
 
 	top = rspamd_worker_metrics_object(session->ctx->cfg, &stat_copy, uptime);
 	ucl_object_insert_key(top, ucl_object_fromint(session->ctx->srv->start_time), "start_time", 0, false);
@@ -2984,23 +3412,8 @@ rspamd_controller_handle_metrics_common(
 	task->http_conn = rspamd_http_connection_ref(conn_ent->conn);
 	task->sock = conn_ent->conn->fd;
 
-	if (stat_copy.messages_scanned > 0 && do_reset) {
-		for (int i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
-
-#ifndef HAVE_ATOMIC_BUILTINS
-			session->ctx->worker->srv->stat->actions_stat[i] = 0;
-#else
-			__atomic_store_n(&session->ctx->worker->srv->stat->actions_stat[i],
-							 0, __ATOMIC_RELEASE);
-#endif
-		}
-	}
-
 	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
+		rspamd_main_stat_reset(session->ctx->srv, &stat_copy);
 		rspamd_mempool_stat_reset();
 	}
 
@@ -3405,12 +3818,17 @@ rspamd_controller_finish_handler(struct rspamd_http_connection_entry *conn_ent)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
-	session->ctx->worker->srv->stat->control_connections_count++;
+	RSPAMD_STAT_INC(rspamd_main_local_stat(session->ctx->worker->srv),
+					control_connections_count);
 
 	if (session->task != NULL) {
 		rspamd_session_destroy(session->task->s);
 	}
 
+	if (session->learn_fwd != NULL) {
+		rspamd_controller_learn_fwd_free(session->learn_fwd);
+	}
+
 	session->wrk->nconns--;
 	rspamd_inet_address_free(session->from_addr);
 	REF_RELEASE(session->cfg);
@@ -3500,6 +3918,9 @@ init_controller_worker(struct rspamd_config *cfg)
 	ctx->magic = rspamd_controller_ctx_magic;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->task_timeout = NAN;
+	ctx->stat_cache_ttl = 1.0;
+	ctx->learners_timeout = 10.0;
+	ctx->learners_max_pending = 32;
 
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
@@ -3594,6 +4015,16 @@ init_controller_worker(struct rspamd_config *cfg)
 									  0,
 									  "Encryption keypair");
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "stat_cache_ttl",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_controller_worker_ctx,
+													  stat_cache_ttl),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "Reuse /stat reply for this time, 0 to disable, default: 1.0 seconds");
+
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "task_timeout",
@@ -3604,6 +4035,46 @@ init_controller_worker(struct rspamd_config *cfg)
 									  RSPAMD_CL_FLAG_TIME_FLOAT,
 									  "Maximum task processing time, default: 8.0 seconds");
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "learners",
+									  rspamd_rcl_parse_struct_string,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_controller_worker_ctx,
+													  learners_line),
+									  0,
+									  "Forward learn requests to these controllers (upstreams line)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "learners_timeout",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_controller_worker_ctx,
+													  learners_timeout),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "Timeout for learn requests forwarded to learners, default: 10.0 seconds");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "learners_max_pending",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_controller_worker_ctx,
+													  learners_max_pending),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Reject learn requests with 503 when this number of them is being forwarded, 0 for no limit, default: 32");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "learner",
+									  rspamd_rcl_parse_struct_boolean,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_controller_worker_ctx,
+													  learner),
+									  0,
+									  "Serve learn requests only (to be used as `learners` of another controller)");
+
 	return ctx;
 }
 
@@ -3913,93 +4384,127 @@ start_controller_worker(struct rspamd_worker *worker)
 	rspamd_mempool_add_destructor(ctx->cfg->cfg_pool,
 								  (rspamd_mempool_destruct_t) rspamd_http_context_free,
 								  ctx->http_ctx);
+	if (ctx->learners_line) {
+		if (ctx->learner) {
+			msg_warn_ctx("`learners` is ignored for a learner controller");
+		}
+		else {
+			ctx->learners = rspamd_upstreams_create(ctx->cfg->ups_ctx);
+
+			if (!rspamd_upstreams_parse_line(ctx->learners, ctx->learners_line,
+											 DEFAULT_CONTROL_PORT, NULL)) {
+				msg_err_ctx("cannot parse learners: %s", ctx->learners_line);
+				rspamd_upstreams_destroy(ctx->learners);
+				ctx->learners = NULL;
+			}
+		}
+	}
+
 	ctx->http = rspamd_http_router_new(rspamd_controller_error_handler,
 									   rspamd_controller_finish_handler, ctx->timeout,
 									   ctx->static_files_dir, ctx->http_ctx);
 
-	/* Add callbacks for different methods */
-	rspamd_http_router_add_path(ctx->http,
-								PATH_AUTH,
-								rspamd_controller_handle_auth);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_SYMBOLS,
-								rspamd_controller_handle_symbols);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_ACTIONS,
-								rspamd_controller_handle_actions);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_MAPS,
-								rspamd_controller_handle_maps);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_GET_MAP,
-								rspamd_controller_handle_get_map);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_PIE_CHART,
-								rspamd_controller_handle_pie_chart);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_GRAPH,
-								rspamd_controller_handle_graph);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_HEALTHY,
-								rspamd_controller_handle_healthy);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_READY,
-								rspamd_controller_handle_ready);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_HISTORY,
-								rspamd_controller_handle_history);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_HISTORY_RESET,
-								rspamd_controller_handle_history_reset);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_LEARN_SPAM,
-								rspamd_controller_handle_learnspam);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_LEARN_HAM,
-								rspamd_controller_handle_learnham);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_METRICS,
-								rspamd_controller_handle_metrics);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_SAVE_ACTIONS,
-								rspamd_controller_handle_saveactions);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_SAVE_SYMBOLS,
-								rspamd_controller_handle_savesymbols);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_SAVE_MAP,
-								rspamd_controller_handle_savemap);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_SCAN,
-								rspamd_controller_handle_scan);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_CHECK,
-								rspamd_controller_handle_scan);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_CHECKV2,
-								rspamd_controller_handle_scan);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_STAT,
-								rspamd_controller_handle_stat);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_STAT_RESET,
-								rspamd_controller_handle_statreset);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_COUNTERS,
-								rspamd_controller_handle_counters);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_ERRORS,
-								rspamd_controller_handle_errors);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_NEIGHBOURS,
-								rspamd_controller_handle_neighbours);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_PLUGINS,
-								rspamd_controller_handle_plugins);
-	rspamd_http_router_add_path(ctx->http,
-								PATH_PING,
-								rspamd_controller_handle_ping);
-	rspamd_controller_register_plugins_paths(ctx);
+	if (ctx->learner) {
+		/*
+		 * Learner controllers serve learn requests forwarded by the main
+		 * controller, so they must not run controller periodics
+		 */
+		worker->flags &= ~RSPAMD_WORKER_CONTROLLER;
+		rspamd_http_router_add_path(ctx->http,
+									PATH_LEARN_SPAM,
+									rspamd_controller_handle_learnspam);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_LEARN_HAM,
+									rspamd_controller_handle_learnham);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_PING,
+									rspamd_controller_handle_ping);
+	}
+	else {
+		/* Add callbacks for different methods */
+		rspamd_http_router_add_path(ctx->http,
+									PATH_AUTH,
+									rspamd_controller_handle_auth);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_SYMBOLS,
+									rspamd_controller_handle_symbols);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_ACTIONS,
+									rspamd_controller_handle_actions);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_MAPS,
+									rspamd_controller_handle_maps);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_GET_MAP,
+									rspamd_controller_handle_get_map);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_PIE_CHART,
+									rspamd_controller_handle_pie_chart);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_GRAPH,
+									rspamd_controller_handle_graph);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_HEALTHY,
+									rspamd_controller_handle_healthy);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_READY,
+									rspamd_controller_handle_ready);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_HISTORY,
+									rspamd_controller_handle_history);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_HISTORY_RESET,
+									rspamd_controller_handle_history_reset);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_LEARN_SPAM,
+									rspamd_controller_handle_learnspam);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_LEARN_HAM,
+									rspamd_controller_handle_learnham);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_METRICS,
+									rspamd_controller_handle_metrics);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_SAVE_ACTIONS,
+									rspamd_controller_handle_saveactions);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_SAVE_SYMBOLS,
+									rspamd_controller_handle_savesymbols);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_SAVE_MAP,
+									rspamd_controller_handle_savemap);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_SCAN,
+									rspamd_controller_handle_scan);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_CHECK,
+									rspamd_controller_handle_scan);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_CHECKV2,
+									rspamd_controller_handle_scan);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_STAT,
+									rspamd_controller_handle_stat);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_STAT_RESET,
+									rspamd_controller_handle_statreset);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_COUNTERS,
+									rspamd_controller_handle_counters);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_ERRORS,
+									rspamd_controller_handle_errors);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_NEIGHBOURS,
+									rspamd_controller_handle_neighbours);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_PLUGINS,
+									rspamd_controller_handle_plugins);
+		rspamd_http_router_add_path(ctx->http,
+									PATH_PING,
+									rspamd_controller_handle_ping);
+		rspamd_controller_register_plugins_paths(ctx);
+	}
 
 #if 0
 	rspamd_regexp_t *lua_re = rspamd_regexp_new ("^/.*/.*\\.lua$", NULL, NULL);
@@ -4073,6 +4578,10 @@ start_controller_worker(struct rspamd_worker *worker)
 	rspamd_stat_close();
 	rspamd_http_router_free(ctx->http);
 
+	if (ctx->learners) {
+		rspamd_upstreams_destroy(ctx->learners);
+	}
+
 	if (ctx->cached_password.len > 0) {
 		m = (gpointer) ctx->cached_password.begin;
 		munmap(m, ctx->cached_password.len);
@@ -4083,6 +4592,18 @@ start_controller_worker(struct rspamd_worker *worker)
 		munmap(m, ctx->cached_enable_password.len);
 	}
 
+	rspamd_controller_history_cache_clear(&ctx->history_cache);
+
+	for (unsigned int i = 0; i < G_N_ELEMENTS(ctx->graph_cache); i++) {
+		if (ctx->graph_cache[i].json) {
+			rspamd_fstring_free(ctx->graph_cache[i].json);
+		}
+	}
+
+	if (ctx->stat_cache) {
+		rspamd_fstring_free(ctx->stat_cache);
+	}
+
 	g_hash_table_unref(ctx->plugins);
 	g_hash_table_unref(ctx->custom_commands);
 
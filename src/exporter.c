@@ -0,0 +1,325 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Exporter worker: receives compact per-task records from scanners over a
+ * datagram socket and passes them to `export_callback` of the corresponding
+ * entry in `rspamd_plugins`. Plugins then batch records from all scanners and
+ * send them to their sinks from this process only.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/cfg_file.h"
+#include "libserver/cfg_rcl.h"
+#include "libserver/worker_util.h"
+#include "libserver/rspamd_control.h"
+#include "libserver/http/http_context.h"
+#include "libserver/maps/map.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+
+static gpointer init_exporter(struct rspamd_config *cfg);
+__attribute__((noreturn)) static void start_exporter(struct rspamd_worker *worker);
+
+worker_t exporter_worker = {
+	"exporter",     /* Name */
+	init_exporter,  /* Init function */
+	start_exporter, /* Start function */
+	RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE | RSPAMD_WORKER_EXPORTER,
+	RSPAMD_WORKER_SOCKET_NONE,
+	RSPAMD_WORKER_VER /* Version info */
+};
+
+static const uint64_t rspamd_exporter_magic = 0x6a3c3d07c5e1f2b9ULL;
+static const unsigned int default_max_batch = 1024;
+static const gsize default_max_record_size = 256 * 1024;
+/* Delay before announcing our socket so that scanners have started */
+static const double announce_delay = 1.0;
+
+struct exporter_ctx {
+	uint64_t magic;
+	/* Events base */
+	struct ev_loop *event_loop;
+	/* DNS resolver */
+	struct rspamd_dns_resolver *resolver;
+	/* Config */
+	struct rspamd_config *cfg;
+	/* END OF COMMON PART */
+	struct rspamd_http_context *http_ctx;
+	struct rspamd_worker *worker;
+	unsigned int max_batch;
+	gsize max_record_size;
+	gsize receive_buffer;
+	/* Our side of the socket pair, the other one is passed to scanners */
+	int fd;
+	int peer_fd;
+	unsigned char *buf;
+	uint64_t received;
+	uint64_t unhandled;
+	ev_io io_ev;
+	ev_timer announce_ev;
+};
+
+static gpointer
+init_exporter(struct rspamd_config *cfg)
+{
+	struct exporter_ctx *ctx;
+	GQuark type;
+
+	type = g_quark_try_string("exporter");
+	ctx = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(*ctx));
+
+	ctx->magic = rspamd_exporter_magic;
+	ctx->cfg = cfg;
+	ctx->fd = -1;
+	ctx->peer_fd = -1;
+	ctx->max_batch = default_max_batch;
+	ctx->max_record_size = default_max_record_size;
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "max_batch",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct exporter_ctx, max_batch),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Maximum number of records processed per event loop iteration (default: 1024)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "max_record_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct exporter_ctx, max_record_size),
+									  RSPAMD_CL_FLAG_INT_SIZE,
+									  "Maximum size of a single record (default: 256k)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "receive_buffer",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct exporter_ctx, receive_buffer),
+									  RSPAMD_CL_FLAG_INT_SIZE,
+									  "Size of the socket queue; scanners buffer records locally when it is full (default: system)");
+
+	return ctx;
+}
+
+static void
+rspamd_exporter_announce(struct exporter_ctx *ctx)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	memset(&srv_cmd, 0, sizeof(srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_LOG_PIPE;
+	srv_cmd.cmd.log_pipe.type = RSPAMD_LOG_PIPE_EXPORT;
+
+	msg_info("send exporter socket to other processes");
+	rspamd_srv_send_command(ctx->worker, ctx->event_loop, &srv_cmd,
+							ctx->peer_fd, NULL, NULL);
+}
+
+static void
+rspamd_exporter_announce_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct exporter_ctx *ctx = (struct exporter_ctx *) w->data;
+
+	ev_timer_stop(EV_A_ w);
+	rspamd_exporter_announce(ctx);
+}
+
+static gboolean
+rspamd_exporter_child_change(struct rspamd_main *rspamd_main,
+							 struct rspamd_worker *worker, int fd,
+							 int attached_fd,
+							 struct rspamd_control_command *cmd,
+							 gpointer ud)
+{
+	struct exporter_ctx *ctx = (struct exporter_ctx *) ud;
+	struct rspamd_control_reply rep;
+
+	/* Respawned processes do not have our socket, so announce it once more */
+	if (cmd->cmd.child_change.what != rspamd_child_offline) {
+		ev_timer_stop(ctx->event_loop, &ctx->announce_ev);
+		ev_timer_set(&ctx->announce_ev, announce_delay, 0.0);
+		ev_timer_start(ctx->event_loop, &ctx->announce_ev);
+	}
+
+	memset(&rep, 0, sizeof(rep));
+	rep.type = RSPAMD_CONTROL_CHILD_CHANGE;
+
+	if (write(fd, &rep, sizeof(rep)) != sizeof(rep)) {
+		msg_err("cannot write reply to the control socket: %s",
+				strerror(errno));
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_exporter_process_record(struct exporter_ctx *ctx,
+							   const unsigned char *data, gsize len)
+{
+	lua_State *L = ctx->cfg->lua_state;
+	const unsigned char *p;
+	int err_idx;
+
+	p = memchr(data, '\0', len);
+
+	if (p == NULL || p == data) {
+		msg_err("got malformed export record of %z bytes", len);
+		return;
+	}
+
+	lua_pushcfunction(L, &rspamd_lua_traceback);
+	err_idx = lua_gettop(L);
+
+	lua_getglobal(L, "rspamd_plugins");
+
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, (const char *) data);
+
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -1, "export_callback");
+
+			if (lua_isfunction(L, -1)) {
+				p++;
+				lua_pushlstring(L, (const char *) p, len - (p - data));
+
+				if (lua_pcall(L, 1, 0, err_idx) != 0) {
+					msg_err("call to export callback of %s failed: %s",
+							(const char *) data, lua_tostring(L, -1));
+				}
+
+				lua_settop(L, err_idx - 1);
+
+				return;
+			}
+		}
+	}
+
+	lua_settop(L, err_idx - 1);
+
+	if (ctx->unhandled++ == 0) {
+		msg_warn("no export callback for records of %s", (const char *) data);
+	}
+}
+
+static void
+rspamd_exporter_io(EV_P_ ev_io *w, int revents)
+{
+	struct exporter_ctx *ctx = (struct exporter_ctx *) w->data;
+	unsigned int i;
+	ssize_t r;
+
+	/* Limit batch to allow other events (e.g. sinks replies) to be processed */
+	for (i = 0; i < ctx->max_batch; i++) {
+		r = recv(ctx->fd, ctx->buf, ctx->max_record_size, MSG_DONTWAIT | MSG_TRUNC);
+
+		if (r == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				msg_err("cannot read from the exporter socket: %s",
+						strerror(errno));
+			}
+
+			break;
+		}
+
+		if ((gsize) r > ctx->max_record_size) {
+			msg_err("skip export record of %z bytes: it is larger than max_record_size",
+					(gsize) r);
+			continue;
+		}
+
+		ctx->received++;
+		rspamd_exporter_process_record(ctx, ctx->buf, r);
+	}
+}
+
+static void
+start_exporter(struct rspamd_worker *worker)
+{
+	struct exporter_ctx *ctx = worker->ctx;
+	int sv[2];
+
+	g_assert(rspamd_worker_check_context(worker->ctx, rspamd_exporter_magic));
+	ctx->cfg = worker->srv->cfg;
+	ctx->worker = worker;
+	ctx->event_loop = rspamd_prepare_worker(worker, "exporter", NULL);
+
+	ctx->resolver = rspamd_dns_resolver_init(worker->srv->logger,
+											 ctx->event_loop,
+											 worker->srv->cfg);
+	rspamd_upstreams_library_config(worker->srv->cfg, ctx->cfg->ups_ctx,
+									ctx->event_loop, ctx->resolver->r);
+	ctx->http_ctx = rspamd_http_context_create(ctx->cfg, ctx->event_loop,
+											   ctx->cfg->ups_ctx);
+	rspamd_mempool_add_destructor(ctx->cfg->cfg_pool,
+								  (rspamd_mempool_destruct_t) rspamd_http_context_free,
+								  ctx->http_ctx);
+	rspamd_map_watch(worker->srv->cfg, ctx->event_loop, ctx->resolver,
+					 worker, RSPAMD_MAP_WATCH_WORKER);
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+		msg_err("cannot create exporter socket: %s", strerror(errno));
+		/* Tell main not to respawn more workers */
+		exit(EXIT_SUCCESS);
+	}
+
+	ctx->fd = sv[0];
+	ctx->peer_fd = sv[1];
+	rspamd_socket_nonblocking(ctx->fd);
+
+	if (ctx->receive_buffer > 0) {
+		int sz = ctx->receive_buffer;
+
+		if (setsockopt(ctx->fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz)) == -1) {
+			msg_warn("cannot set receive buffer to %z: %s",
+					 ctx->receive_buffer, strerror(errno));
+		}
+	}
+
+	ctx->buf = g_malloc(ctx->max_record_size + 1);
+	ctx->max_batch = MAX(ctx->max_batch, 1);
+
+	rspamd_control_worker_add_cmd_handler(worker, RSPAMD_CONTROL_CHILD_CHANGE,
+										  rspamd_exporter_child_change, ctx);
+
+	rspamd_lua_run_postloads(ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
+							 worker);
+
+	ctx->io_ev.data = ctx;
+	ev_io_init(&ctx->io_ev, rspamd_exporter_io, ctx->fd, EV_READ);
+	ev_io_start(ctx->event_loop, &ctx->io_ev);
+
+	ctx->announce_ev.data = ctx;
+	ev_timer_init(&ctx->announce_ev, rspamd_exporter_announce_cb,
+				  announce_delay, 0.0);
+	ev_timer_start(ctx->event_loop, &ctx->announce_ev);
+
+	ev_loop(ctx->event_loop, 0);
+	rspamd_worker_block_signals();
+
+	msg_info("exporter has received %uL records", ctx->received);
+
+	close(ctx->fd);
+	close(ctx->peer_fd);
+	g_free(ctx->buf);
+
+	REF_RELEASE(ctx->cfg);
+	rspamd_log_close(worker->srv->logger);
+	rspamd_unset_crash_handler(worker->srv);
+
+	exit(EXIT_SUCCESS);
+}
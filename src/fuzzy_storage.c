@@ -24,6 +24,9 @@
 #include "libserver/maps/map.h"
 #include "libserver/maps/map_helpers.h"
 #include "libserver/fuzzy_backend/fuzzy_backend.h"
+#include "libserver/fuzzy_backend/fuzzy_delta.h"
+#include "libserver/http/http_router.h"
+#include "libserver/http/http_message.h"
 #include "ottery.h"
 #include "ref.h"
 #include "xxhash.h"
@@ -33,6 +36,8 @@
 #include "libcryptobox/keypairs_cache.h"
 #include "libcryptobox/keypair.h"
 #include "libutil/hash.h"
+#include "libutil/leaky_sketch.h"
+#include "libutil/cxx/cpu_pool.h"
 #include "libserver/maps/map_private.h"
 #include "contrib/uthash/utlist.h"
 #include "lua/lua_common.h"
@@ -42,16 +47,24 @@
 
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
-#define DEFAULT_KEYPAIR_CACHE_SIZE 512
+#define DEFAULT_KEYPAIR_CACHE_SIZE 8192
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
 #define DEFAULT_MAX_BUCKETS 2000
 #define DEFAULT_BUCKET_TTL 3600
 #define DEFAULT_BUCKET_MASK 24
+#define RATELIMIT_SKETCH_DEPTH 4
+#define DEFAULT_DELTA_LOG_SIZE (64 * 1024 * 1024)
+#define DEFAULT_REPLICATION_INTERVAL 1.0
+#define DEFAULT_REPLICATION_PORT 11336
+/* Limit of frames sent to a follower in a single reply */
+#define FUZZY_REPLICATION_MAX_REPLY (4 * 1024 * 1024)
 /* Update stats on keys each 1 hour */
 #define KEY_STAT_INTERVAL 3600.0
 
 static const char *local_db_name = "local";
+/* Source of replicated updates, its version is bumped with each applied batch */
+static const char *replication_db_name = "replication";
 
 /* Init functions */
 gpointer init_fuzzy(struct rspamd_config *cfg);
@@ -140,6 +153,11 @@ KHASH_INIT(rspamd_fuzzy_keys_hash,
 		   const unsigned char *, struct fuzzy_key *, 1,
 		   fuzzy_kp_hash, fuzzy_kp_equal);
 
+#ifdef HAVE_SENDMMSG
+/* Maximum number of replies sent with a single syscall */
+#define FUZZY_REPLY_BATCH 64
+#endif
+
 struct rspamd_fuzzy_storage_ctx {
 	uint64_t magic;
 	/* Events base */
@@ -165,8 +183,11 @@ struct rspamd_fuzzy_storage_ctx {
 	const ucl_object_t *blocked_map;
 	const ucl_object_t *ratelimit_whitelist_map;
 	const ucl_object_t *dynamic_keys_map;
+	const ucl_object_t *keypair_cache_preload;
 
 	unsigned int keypair_cache_size;
+	/* Threads used to decrypt commands */
+	unsigned int cpu_threads;
 	ev_timer stat_ev;
 	ev_io peer_ev;
 
@@ -184,6 +205,8 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_http_context *http_ctx;
 	rspamd_lru_hash_t *errors_ips;
 	rspamd_lru_hash_t *ratelimit_buckets;
+	/* Fixed size alternative to ratelimit_buckets */
+	struct rspamd_leaky_sketch *ratelimit_sketch;
 	struct rspamd_fuzzy_backend *backend;
 	GArray *updates_pending;
 	unsigned int updates_failed;
@@ -195,6 +218,7 @@ struct rspamd_fuzzy_storage_ctx {
 	unsigned int leaky_bucket_ttl;
 	unsigned int leaky_bucket_mask;
 	unsigned int max_buckets;
+	unsigned int ratelimit_sketch_size;
 	gboolean ratelimit_log_only;
 	double leaky_bucket_burst;
 	double leaky_bucket_rate;
@@ -208,6 +232,26 @@ struct rspamd_fuzzy_storage_ctx {
 	khash_t(fuzzy_key_ids_set) * default_forbidden_ids;
 	/* Ids that should not override other ids */
 	khash_t(fuzzy_key_ids_set) * weak_ids;
+#ifdef HAVE_SENDMMSG
+	/* Replies produced within a loop iteration, flushed with sendmmsg */
+	struct fuzzy_session *pending_replies[FUZZY_REPLY_BATCH];
+	unsigned int npending_replies;
+	ev_prepare replies_flush_ev;
+#endif
+	/* Replication */
+	const char *delta_log_path;
+	gsize delta_log_size;
+	const char *replication_bind;
+	const char *replication_leader;
+	double replication_interval;
+	struct rspamd_fuzzy_delta_log *delta_log;
+	struct rspamd_http_connection_router *replication_router;
+	ev_io replication_accept_ev;
+	struct upstream_list *replication_leaders;
+	ev_timer replication_ev;
+	gboolean replication_inflight;
+	/* Logged batch might have not been applied to the backend */
+	gboolean replication_recover;
 };
 
 enum fuzzy_cmd_type {
@@ -249,6 +293,11 @@ struct rspamd_updates_cbdata {
 	gboolean final;
 };
 
+struct rspamd_delta_cbdata {
+	GArray *updates;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+};
+
 
 static void rspamd_fuzzy_write_reply(struct fuzzy_session *session);
 static gboolean rspamd_fuzzy_process_updates_queue(struct rspamd_fuzzy_storage_ctx *ctx,
@@ -404,6 +453,92 @@ ucl_keymap_dtor_cb(struct map_cb_data *data)
 	}
 }
 
+static void
+rspamd_fuzzy_propagate_blocked(struct fuzzy_session *session,
+							   rspamd_inet_addr_t *masked)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	srv_cmd.type = RSPAMD_SRV_FUZZY_BLOCKED;
+	srv_cmd.cmd.fuzzy_blocked.af = rspamd_inet_address_get_af(masked);
+
+	if (srv_cmd.cmd.fuzzy_blocked.af == AF_INET || srv_cmd.cmd.fuzzy_blocked.af == AF_INET6) {
+		socklen_t slen;
+		struct sockaddr *sa = rspamd_inet_address_get_sa(masked, &slen);
+
+		if (slen <= sizeof(srv_cmd.cmd.fuzzy_blocked.addr)) {
+			memcpy(&srv_cmd.cmd.fuzzy_blocked.addr, sa, slen);
+			msg_debug("propagating blocked address to other workers");
+			rspamd_srv_send_command(session->worker, session->ctx->event_loop, &srv_cmd, -1, NULL, NULL);
+		}
+		else {
+			msg_err("bad address length: %d, expected to be %d", (int) slen, (int) sizeof(srv_cmd.cmd.fuzzy_blocked.addr));
+		}
+	}
+}
+
+/*
+ * Value that keeps a sketch counter above the burst for the whole bucket ttl
+ */
+static inline double
+rspamd_fuzzy_sketch_ban_value(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	return ctx->leaky_bucket_burst + 1.0 +
+		   ctx->leaky_bucket_rate * ctx->leaky_bucket_ttl;
+}
+
+static inline const void *
+rspamd_fuzzy_sketch_key(rspamd_inet_addr_t *masked, gsize *klen)
+{
+	const unsigned char *key;
+	unsigned int len;
+
+	key = rspamd_inet_address_get_hash_key(masked, &len);
+	*klen = len;
+
+	return key;
+}
+
+/*
+ * Approximate version of the leaky buckets: ban is represented by raising the
+ * counters well above the burst, so they leak back below it in `bucket_ttl`
+ */
+static gboolean
+rspamd_fuzzy_check_ratelimit_sketch(struct fuzzy_session *session,
+									rspamd_inet_addr_t *masked)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	const void *key;
+	gsize klen;
+	double cur;
+
+	key = rspamd_fuzzy_sketch_key(masked, &klen);
+	cur = rspamd_leaky_sketch_estimate(ctx->ratelimit_sketch, key, klen,
+									   session->timestamp);
+
+	if (cur < ctx->leaky_bucket_burst) {
+		/* Allow one more request */
+		rspamd_leaky_sketch_raise(ctx->ratelimit_sketch, key, klen, cur + 1.0);
+
+		return TRUE;
+	}
+
+	if (cur < ctx->leaky_bucket_burst + 1.0) {
+		/* Not banned yet */
+		msg_info("ratelimiting %s (%s), %.1f max elts",
+				 rspamd_inet_address_to_string(session->addr),
+				 rspamd_inet_address_to_string(masked),
+				 ctx->leaky_bucket_burst);
+		rspamd_leaky_sketch_raise(ctx->ratelimit_sketch, key, klen,
+								  rspamd_fuzzy_sketch_ban_value(ctx));
+		rspamd_fuzzy_propagate_blocked(session, masked);
+	}
+
+	rspamd_fuzzy_maybe_call_blacklisted(ctx, session->addr, "ratelimit");
+
+	return FALSE;
+}
+
 static gboolean
 rspamd_fuzzy_check_ratelimit(struct fuzzy_session *session)
 {
@@ -439,6 +574,14 @@ rspamd_fuzzy_check_ratelimit(struct fuzzy_session *session)
 									   MIN(MAX(session->ctx->leaky_bucket_mask * 4, 64), 128));
 	}
 
+	if (session->ctx->ratelimit_sketch) {
+		gboolean ret = rspamd_fuzzy_check_ratelimit_sketch(session, masked);
+
+		rspamd_inet_address_free(masked);
+
+		return ret;
+	}
+
 	elt = rspamd_lru_hash_lookup(session->ctx->ratelimit_buckets, masked,
 								 (time_t) session->timestamp);
 
@@ -496,24 +639,7 @@ rspamd_fuzzy_check_ratelimit(struct fuzzy_session *session)
 		}
 
 		if (new_ratelimit) {
-			struct rspamd_srv_command srv_cmd;
-
-			srv_cmd.type = RSPAMD_SRV_FUZZY_BLOCKED;
-			srv_cmd.cmd.fuzzy_blocked.af = rspamd_inet_address_get_af(masked);
-
-			if (srv_cmd.cmd.fuzzy_blocked.af == AF_INET || srv_cmd.cmd.fuzzy_blocked.af == AF_INET6) {
-				socklen_t slen;
-				struct sockaddr *sa = rspamd_inet_address_get_sa(masked, &slen);
-
-				if (slen <= sizeof(srv_cmd.cmd.fuzzy_blocked.addr)) {
-					memcpy(&srv_cmd.cmd.fuzzy_blocked.addr, sa, slen);
-					msg_debug("propagating blocked address to other workers");
-					rspamd_srv_send_command(session->worker, session->ctx->event_loop, &srv_cmd, -1, NULL, NULL);
-				}
-				else {
-					msg_err("bad address length: %d, expected to be %d", (int) slen, (int) sizeof(srv_cmd.cmd.fuzzy_blocked.addr));
-				}
-			}
+			rspamd_fuzzy_propagate_blocked(session, masked);
 		}
 
 		rspamd_inet_address_free(masked);
@@ -587,6 +713,11 @@ rspamd_fuzzy_check_write(struct fuzzy_session *session)
 		return FALSE;
 	}
 
+	if (session->ctx->replication_leader) {
+		/* Followers are written by the leader only, otherwise they diverge */
+		return FALSE;
+	}
+
 	if (session->ctx->update_ips != NULL && session->addr) {
 		if (rspamd_inet_address_get_af(session->addr) == AF_UNIX) {
 			return TRUE;
@@ -711,6 +842,31 @@ rspamd_fuzzy_stat_callback(EV_P_ ev_timer *w, int revents)
 static void
 fuzzy_update_version_callback(uint64_t ver, void *ud)
 {
+	struct rspamd_delta_cbdata *cbdata = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	GError *err = NULL;
+
+	if (cbdata == NULL) {
+		return;
+	}
+
+	ctx = cbdata->ctx;
+
+	if (ctx->delta_log) {
+		/* Backend version might be reset, but the log version must grow */
+		ver = MAX(ver, rspamd_fuzzy_delta_log_version(ctx->delta_log) + 1);
+
+		if (!rspamd_fuzzy_delta_log_append(ctx->delta_log, ver,
+										   (const struct fuzzy_peer_cmd *) cbdata->updates->data,
+										   cbdata->updates->len, &err)) {
+			msg_err("cannot write %ud updates to delta log: %e",
+					cbdata->updates->len, err);
+			g_error_free(err);
+		}
+	}
+
+	g_array_free(cbdata->updates, TRUE);
+	g_free(cbdata);
 }
 
 static void
@@ -738,8 +894,23 @@ rspamd_fuzzy_updates_cb(gboolean success,
 				 cbdata->updates_pending->len,
 				 ctx->updates_pending->len,
 				 nadded, ndeleted, nextended, nignored);
-		rspamd_fuzzy_backend_version(ctx->backend, source,
-									 fuzzy_update_version_callback, NULL);
+		if (ctx->delta_log && ctx->replication_leaders == NULL) {
+			/* Followers reject local writes and log frames received from the leader */
+			struct rspamd_delta_cbdata *delta_cbdata = g_malloc(sizeof(*delta_cbdata));
+
+			delta_cbdata->ctx = ctx;
+			delta_cbdata->updates = g_array_sized_new(FALSE, FALSE,
+													  sizeof(struct fuzzy_peer_cmd),
+													  cbdata->updates_pending->len);
+			g_array_append_vals(delta_cbdata->updates, cbdata->updates_pending->data,
+								cbdata->updates_pending->len);
+			rspamd_fuzzy_backend_version(ctx->backend, source,
+										 fuzzy_update_version_callback, delta_cbdata);
+		}
+		else {
+			rspamd_fuzzy_backend_version(ctx->backend, source,
+										 fuzzy_update_version_callback, NULL);
+		}
 		ctx->updates_failed = 0;
 
 		if (cbdata->final || ctx->worker->state != rspamd_worker_state_running) {
@@ -825,46 +996,161 @@ rspamd_fuzzy_process_updates_queue(struct rspamd_fuzzy_storage_ctx *ctx,
 	return FALSE;
 }
 
+static void rspamd_fuzzy_write_reply_single(struct fuzzy_session *session);
+
 static void
 rspamd_fuzzy_reply_io(EV_P_ ev_io *w, int revents)
 {
 	struct fuzzy_session *session = (struct fuzzy_session *) w->data;
 
 	ev_io_stop(EV_A_ w);
-	rspamd_fuzzy_write_reply(session);
+	rspamd_fuzzy_write_reply_single(session);
 	REF_RELEASE(session);
 }
 
-static void
-rspamd_fuzzy_write_reply(struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data(struct fuzzy_session *session, gsize *len)
 {
-	gssize r;
-	gsize len;
-	gconstpointer data;
-
 	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
 		session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
 		/* Encrypted reply */
-		data = &session->reply;
-
 		if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
-			len = sizeof(session->reply);
+			*len = sizeof(session->reply);
 		}
 		else {
-			len = sizeof(session->reply.hdr) + sizeof(session->reply.rep.v1);
+			*len = sizeof(session->reply.hdr) + sizeof(session->reply.rep.v1);
 		}
+
+		return &session->reply;
+	}
+
+	if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
+		*len = sizeof(session->reply.rep);
 	}
 	else {
-		data = &session->reply.rep;
+		*len = sizeof(session->reply.rep.v1);
+	}
 
-		if (session->epoch > RSPAMD_FUZZY_EPOCH10) {
-			len = sizeof(session->reply.rep);
+	return &session->reply.rep;
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+rspamd_fuzzy_flush_replies(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct mmsghdr msgs[FUZZY_REPLY_BATCH];
+	struct iovec iovs[FUZZY_REPLY_BATCH];
+	struct fuzzy_session *session;
+	unsigned int i, n, start, end;
+	socklen_t slen;
+	gsize len;
+	int r;
+
+	n = ctx->npending_replies;
+	ctx->npending_replies = 0;
+
+	if (ev_is_active(&ctx->replies_flush_ev)) {
+		ev_prepare_stop(ctx->event_loop, &ctx->replies_flush_ev);
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+
+	for (i = 0; i < n; i++) {
+		session = ctx->pending_replies[i];
+		iovs[i].iov_base = (void *) rspamd_fuzzy_reply_data(session, &len);
+		iovs[i].iov_len = len;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		if (session->addr) {
+			msgs[i].msg_hdr.msg_name = rspamd_inet_address_get_sa(session->addr, &slen);
+			msgs[i].msg_hdr.msg_namelen = slen;
+		}
+	}
+
+	start = 0;
+
+	while (start < n) {
+		/* Replies for the same listening socket are sent at once */
+		end = start + 1;
+
+		while (end < n && ctx->pending_replies[end]->fd == ctx->pending_replies[start]->fd) {
+			end++;
+		}
+
+		r = sendmmsg(ctx->pending_replies[start]->fd, &msgs[start], end - start, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				/* Socket buffer is full, wait for each reply separately */
+				for (i = start; i < end; i++) {
+					rspamd_fuzzy_write_reply_single(ctx->pending_replies[i]);
+				}
+
+				start = end;
+			}
+			else {
+				/* Skip the reply that has failed and send the rest */
+				msg_err("error while writing reply: %s", strerror(errno));
+				start++;
+			}
 		}
 		else {
-			len = sizeof(session->reply.rep.v1);
+			start += r;
 		}
 	}
 
+	for (i = 0; i < n; i++) {
+		session = ctx->pending_replies[i];
+		REF_RELEASE(session);
+	}
+}
+
+static void
+rspamd_fuzzy_replies_flush_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = (struct rspamd_fuzzy_storage_ctx *) w->data;
+
+	rspamd_fuzzy_flush_replies(ctx);
+}
+#endif
+
+static void
+rspamd_fuzzy_write_reply(struct fuzzy_session *session)
+{
+#ifdef HAVE_SENDMMSG
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+
+	/* Replies are sent in batches before the next loop iteration */
+	REF_RETAIN(session);
+	ctx->pending_replies[ctx->npending_replies++] = session;
+
+	if (ctx->npending_replies == FUZZY_REPLY_BATCH) {
+		rspamd_fuzzy_flush_replies(ctx);
+	}
+	else if (!ev_is_active(&ctx->replies_flush_ev)) {
+		ev_prepare_start(ctx->event_loop, &ctx->replies_flush_ev);
+	}
+#else
+	rspamd_fuzzy_write_reply_single(session);
+#endif
+}
+
+static void
+rspamd_fuzzy_write_reply_single(struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	data = rspamd_fuzzy_reply_data(session, &len);
 	r = rspamd_inet_address_sendto(session->fd, data, len, 0,
 								   session->addr);
 
@@ -1490,7 +1776,7 @@ rspamd_fuzzy_process_command(struct fuzzy_session *session)
 	if (cmd->cmd == FUZZY_CHECK) {
 		bool can_continue = true;
 
-		if (session->ctx->ratelimit_buckets) {
+		if (session->ctx->ratelimit_buckets || session->ctx->ratelimit_sketch) {
 			if (session->ctx->ratelimit_log_only) {
 				(void) rspamd_fuzzy_check_ratelimit(session); /* Check but ignore */
 			}
@@ -1621,6 +1907,34 @@ rspamd_fuzzy_command_valid(struct rspamd_fuzzy_cmd *cmd, int r)
 	return ret;
 }
 
+static struct fuzzy_key *
+rspamd_fuzzy_find_decrypt_key(struct rspamd_fuzzy_storage_ctx *ctx,
+							  const struct rspamd_fuzzy_encrypted_req_hdr *hdr)
+{
+	struct fuzzy_key *key = NULL;
+
+	/* Try to find the desired key */
+	khiter_t k = kh_get(rspamd_fuzzy_keys_hash, ctx->keys, hdr->key_id);
+	if (k == kh_end(ctx->keys)) {
+
+		key = ctx->default_key;
+
+		/* Check dynamic keys */
+		if (ctx->dynamic_keys) {
+			k = kh_get(rspamd_fuzzy_keys_hash, ctx->dynamic_keys, hdr->key_id);
+
+			if (k != kh_end(ctx->keys)) {
+				key = kh_val(ctx->dynamic_keys, k);
+			}
+		}
+	}
+	else {
+		key = kh_val(ctx->keys, k);
+	}
+
+	return key;
+}
+
 static gboolean
 rspamd_fuzzy_decrypt_command(struct fuzzy_session *s, unsigned char *buf, gsize buflen)
 {
@@ -1642,24 +1956,7 @@ rspamd_fuzzy_decrypt_command(struct fuzzy_session *s, unsigned char *buf, gsize
 	buf += sizeof(hdr);
 	buflen -= sizeof(hdr);
 
-	/* Try to find the desired key */
-	khiter_t k = kh_get(rspamd_fuzzy_keys_hash, s->ctx->keys, hdr.key_id);
-	if (k == kh_end(s->ctx->keys)) {
-
-		key = s->ctx->default_key;
-
-		/* Check dynamic keys */
-		if (s->ctx->dynamic_keys) {
-			k = kh_get(rspamd_fuzzy_keys_hash, s->ctx->dynamic_keys, hdr.key_id);
-
-			if (k != kh_end(s->ctx->keys)) {
-				key = kh_val(s->ctx->dynamic_keys, k);
-			}
-		}
-	}
-	else {
-		key = kh_val(s->ctx->keys, k);
-	}
+	key = rspamd_fuzzy_find_decrypt_key(s->ctx, &hdr);
 
 	if (key == NULL) {
 		/* Cannot find any suitable decryption key */
@@ -1835,10 +2132,12 @@ rspamd_fuzzy_extensions_from_wire(struct fuzzy_session *s, unsigned char *buf, g
 	return TRUE;
 }
 
+static gboolean rspamd_fuzzy_cmd_from_plain(unsigned char *buf, unsigned int buflen,
+											struct fuzzy_session *s, gboolean encrypted);
+
 static gboolean
 rspamd_fuzzy_cmd_from_wire(unsigned char *buf, unsigned int buflen, struct fuzzy_session *s)
 {
-	enum rspamd_fuzzy_epoch epoch;
 	gboolean encrypted = FALSE;
 
 	if (buflen < sizeof(struct rspamd_fuzzy_cmd)) {
@@ -1870,6 +2169,18 @@ rspamd_fuzzy_cmd_from_wire(unsigned char *buf, unsigned int buflen, struct fuzzy
 		}
 	}
 
+	return rspamd_fuzzy_cmd_from_plain(buf, buflen, s, encrypted);
+}
+
+/*
+ * Parses and validates an unencrypted (or already decrypted) command
+ */
+static gboolean
+rspamd_fuzzy_cmd_from_plain(unsigned char *buf, unsigned int buflen, struct fuzzy_session *s,
+							gboolean encrypted)
+{
+	enum rspamd_fuzzy_epoch epoch;
+
 	/* Fill the normal command */
 	if (buflen < sizeof(s->cmd.basic)) {
 		msg_debug("truncated normal fuzzy command of size %d received", buflen);
@@ -1963,65 +2274,223 @@ fuzzy_session_destroy(gpointer d)
 #define MSGVEC_LEN 1
 #endif
 
-union sa_union {
-	struct sockaddr sa;
-	struct sockaddr_in s4;
-	struct sockaddr_in6 s6;
-	struct sockaddr_un su;
-	struct sockaddr_storage ss;
-};
-/*
- * Accept new connection and construct task
- */
 static void
-accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
+rspamd_fuzzy_session_invalid(struct fuzzy_session *session)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct fuzzy_session *session;
-	gssize r, msg_len;
 	uint64_t *nerrors;
-	struct iovec iovs[MSGVEC_LEN];
-	uint8_t bufs[MSGVEC_LEN][FUZZY_INPUT_BUFLEN];
-	union sa_union peer_sa[MSGVEC_LEN];
-	socklen_t salen = sizeof(peer_sa[0]);
-#ifdef HAVE_RECVMMSG
-#define MSG_FIELD(msg, field) msg.msg_hdr.field
-	struct mmsghdr msg[MSGVEC_LEN];
-#else
-#define MSG_FIELD(msg, field) msg.field
-	struct msghdr msg[MSGVEC_LEN];
-#endif
 
-	memset(msg, 0, sizeof(*msg) * MSGVEC_LEN);
-	ctx = (struct rspamd_fuzzy_storage_ctx *) worker->ctx;
+	session->ctx->stat.invalid_requests++;
 
-	/* Prepare messages to receive */
-	for (int i = 0; i < MSGVEC_LEN; i++) {
-		/* Prepare msghdr structs */
-		iovs[i].iov_base = bufs[i];
-		iovs[i].iov_len = sizeof(bufs[i]);
-		MSG_FIELD(msg[i], msg_name) = (void *) &peer_sa[i];
-		MSG_FIELD(msg[i], msg_namelen) = salen;
-		MSG_FIELD(msg[i], msg_iov) = &iovs[i];
-		MSG_FIELD(msg[i], msg_iovlen) = 1;
+	if (session->addr) {
+		nerrors = rspamd_lru_hash_lookup(session->ctx->errors_ips,
+										 session->addr, -1);
+
+		if (nerrors == NULL) {
+			nerrors = g_malloc(sizeof(*nerrors));
+			*nerrors = 1;
+			rspamd_lru_hash_insert(session->ctx->errors_ips,
+								   rspamd_inet_address_copy(session->addr, NULL),
+								   nerrors, -1, -1);
+		}
+		else {
+			*nerrors = *nerrors + 1;
+		}
 	}
+}
 
-	/* Got some data */
-	if (revents == EV_READ) {
-		ev_now_update_if_cheap(ctx->event_loop);
-		for (;;) {
-#ifdef HAVE_RECVMMSG
-			r = recvmmsg(w->fd, msg, MSGVEC_LEN, 0, NULL);
-#else
-			r = recvmsg(w->fd, msg, 0);
-#endif
+/*
+ * Encrypted command decrypted by a thread from the worker cpu pool
+ */
+struct fuzzy_decrypt_job {
+	struct fuzzy_session *session;
+	struct fuzzy_key *key;
+	struct rspamd_cryptobox_pubkey *rk;
+	gboolean need_nm;
+	gboolean decrypted;
+	gsize len;
+	unsigned char buf[FUZZY_INPUT_BUFLEN];
+};
 
-			if (r == -1) {
-				if (errno == EINTR) {
-					continue;
-				}
-				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+/* Executed in a pool thread: only job data is touched here */
+static void
+rspamd_fuzzy_decrypt_work(void *ud)
+{
+	struct fuzzy_decrypt_job *job = (struct fuzzy_decrypt_job *) ud;
+	struct rspamd_fuzzy_encrypted_req_hdr hdr;
+
+	memcpy(&hdr, job->buf, sizeof(hdr));
+
+	if (job->need_nm) {
+		rspamd_pubkey_calculate_nm(job->rk, job->key->key);
+	}
+
+	job->decrypted = rspamd_cryptobox_decrypt_nm_inplace(job->buf + sizeof(hdr),
+														 job->len - sizeof(hdr),
+														 hdr.nonce,
+														 rspamd_pubkey_get_nm(job->rk, job->key->key),
+														 hdr.mac, RSPAMD_CRYPTOBOX_MODE_25519);
+}
+
+static void
+rspamd_fuzzy_decrypt_done(void *ud)
+{
+	struct fuzzy_decrypt_job *job = (struct fuzzy_decrypt_job *) ud;
+	struct fuzzy_session *session = job->session;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+
+	if (job->decrypted) {
+		if (job->need_nm && ctx->keypair_cache) {
+			rspamd_keypair_cache_store(ctx->keypair_cache, job->key->key, job->rk);
+		}
+
+		/* Transfer key reference to the session */
+		session->key = job->key;
+		memcpy(session->nm, rspamd_pubkey_get_nm(job->rk, job->key->key),
+			   sizeof(session->nm));
+
+		if (rspamd_fuzzy_cmd_from_plain(job->buf + sizeof(struct rspamd_fuzzy_encrypted_req_hdr),
+										job->len - sizeof(struct rspamd_fuzzy_encrypted_req_hdr),
+										session, TRUE)) {
+			rspamd_fuzzy_process_command(session);
+		}
+		else {
+			rspamd_fuzzy_session_invalid(session);
+		}
+	}
+	else {
+		msg_err("decryption failed; ip=%s",
+				rspamd_inet_address_to_string(session->addr));
+		REF_RELEASE(job->key);
+		rspamd_fuzzy_session_invalid(session);
+	}
+
+	rspamd_pubkey_unref(job->rk);
+	rspamd_explicit_memzero(job->buf, sizeof(job->buf));
+	REF_RELEASE(session);
+	g_free(job);
+}
+
+/*
+ * Schedules decryption of an encrypted command in the cpu pool, returns FALSE
+ * if the command should be processed inline
+ */
+static gboolean
+rspamd_fuzzy_offload_decrypt(struct fuzzy_session *session,
+							 const unsigned char *buf, gsize buflen)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct rspamd_fuzzy_encrypted_req_hdr hdr;
+	struct fuzzy_decrypt_job *job;
+	struct fuzzy_key *key;
+	struct rspamd_cryptobox_pubkey *rk;
+
+	if (buflen < sizeof(struct rspamd_fuzzy_encrypted_cmd) || buflen > FUZZY_INPUT_BUFLEN ||
+		memcmp(buf, fuzzy_encrypted_magic, sizeof(fuzzy_encrypted_magic)) != 0) {
+		return FALSE;
+	}
+
+	if (ctx->default_key == NULL && ctx->dynamic_keys == NULL) {
+		return FALSE;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if ((key = rspamd_fuzzy_find_decrypt_key(ctx, &hdr)) == NULL) {
+		return FALSE;
+	}
+
+	rk = rspamd_pubkey_from_bin(hdr.pubkey, sizeof(hdr.pubkey),
+								RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	if (rk == NULL) {
+		return FALSE;
+	}
+
+	job = g_malloc(sizeof(*job));
+	job->session = session;
+	job->key = key;
+	job->rk = rk;
+	job->decrypted = FALSE;
+	job->len = buflen;
+	memcpy(job->buf, buf, buflen);
+	/* Expensive part, ECDH, is done in the thread if the cache has no value */
+	job->need_nm = ctx->keypair_cache == NULL ||
+				   !rspamd_keypair_cache_lookup(ctx->keypair_cache, key->key, rk);
+
+	REF_RETAIN(key);
+	REF_RETAIN(session);
+
+	if (!rspamd_cpu_pool_push(session->worker->cpu_pool, rspamd_fuzzy_decrypt_work,
+							  rspamd_fuzzy_decrypt_done, job)) {
+		REF_RELEASE(session);
+		REF_RELEASE(key);
+		rspamd_pubkey_unref(rk);
+		g_free(job);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+union sa_union {
+	struct sockaddr sa;
+	struct sockaddr_in s4;
+	struct sockaddr_in6 s6;
+	struct sockaddr_un su;
+	struct sockaddr_storage ss;
+};
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_session *session;
+	gssize r, msg_len;
+	struct iovec iovs[MSGVEC_LEN];
+	uint8_t bufs[MSGVEC_LEN][FUZZY_INPUT_BUFLEN];
+	union sa_union peer_sa[MSGVEC_LEN];
+	socklen_t salen = sizeof(peer_sa[0]);
+#ifdef HAVE_RECVMMSG
+#define MSG_FIELD(msg, field) msg.msg_hdr.field
+	struct mmsghdr msg[MSGVEC_LEN];
+#else
+#define MSG_FIELD(msg, field) msg.field
+	struct msghdr msg[MSGVEC_LEN];
+#endif
+
+	memset(msg, 0, sizeof(*msg) * MSGVEC_LEN);
+	ctx = (struct rspamd_fuzzy_storage_ctx *) worker->ctx;
+
+	/* Prepare messages to receive */
+	for (int i = 0; i < MSGVEC_LEN; i++) {
+		/* Prepare msghdr structs */
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		MSG_FIELD(msg[i], msg_name) = (void *) &peer_sa[i];
+		MSG_FIELD(msg[i], msg_namelen) = salen;
+		MSG_FIELD(msg[i], msg_iov) = &iovs[i];
+		MSG_FIELD(msg[i], msg_iovlen) = 1;
+	}
+
+	/* Got some data */
+	if (revents == EV_READ) {
+		ev_now_update_if_cheap(ctx->event_loop);
+		for (;;) {
+#ifdef HAVE_RECVMMSG
+			r = recvmmsg(w->fd, msg, MSGVEC_LEN, 0, NULL);
+#else
+			r = recvmsg(w->fd, msg, 0);
+#endif
+
+			if (r == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				else if (errno == EAGAIN || errno == EWOULDBLOCK) {
 
 					return;
 				}
@@ -2067,35 +2536,27 @@ accept_fuzzy_socket(EV_P_ ev_io *w, int revents)
 				msg_len = msg[i].msg_len;
 #endif
 
-				if (rspamd_fuzzy_cmd_from_wire(iovs[i].iov_base,
-											   msg_len, session)) {
+				if (worker->cpu_pool &&
+					rspamd_fuzzy_offload_decrypt(session, iovs[i].iov_base, msg_len)) {
+					/* Processing continues in rspamd_fuzzy_decrypt_done */
+				}
+				else if (rspamd_fuzzy_cmd_from_wire(iovs[i].iov_base,
+													msg_len, session)) {
 					/* Check shingles count sanity */
 					rspamd_fuzzy_process_command(session);
 				}
 				else {
 					/* Discard input */
-					session->ctx->stat.invalid_requests++;
 					msg_debug("invalid fuzzy command of size %z received", r);
-
-					if (session->addr) {
-						nerrors = rspamd_lru_hash_lookup(session->ctx->errors_ips,
-														 session->addr, -1);
-
-						if (nerrors == NULL) {
-							nerrors = g_malloc(sizeof(*nerrors));
-							*nerrors = 1;
-							rspamd_lru_hash_insert(session->ctx->errors_ips,
-												   rspamd_inet_address_copy(session->addr, NULL),
-												   nerrors, -1, -1);
-						}
-						else {
-							*nerrors = *nerrors + 1;
-						}
-					}
+					rspamd_fuzzy_session_invalid(session);
 				}
 
 				REF_RELEASE(session);
 			}
+#ifdef HAVE_SENDMMSG
+			/* Send replies for the whole received batch */
+			rspamd_fuzzy_flush_replies(ctx);
+#endif
 #ifdef HAVE_RECVMMSG
 			/* Stop reading as we are using recvmmsg instead of recvmsg */
 			break;
@@ -2174,7 +2635,25 @@ rspamd_fuzzy_control_blocked(struct rspamd_main *rspamd_main,
 		rep.reply.fuzzy_blocked.status = -1;
 	}
 
-	if (addr) {
+	if (addr && ctx->ratelimit_sketch) {
+		const void *key;
+		gsize klen;
+
+		key = rspamd_fuzzy_sketch_key(addr, &klen);
+
+		if (rspamd_leaky_sketch_estimate(ctx->ratelimit_sketch, key, klen, now) <
+			ctx->leaky_bucket_burst + 1.0) {
+			rspamd_leaky_sketch_raise(ctx->ratelimit_sketch, key, klen,
+									  rspamd_fuzzy_sketch_ban_value(ctx));
+			msg_info("propagating ratelimiting %s, %.1f max elts",
+					 rspamd_inet_address_to_string(addr),
+					 ctx->leaky_bucket_burst);
+			rspamd_fuzzy_maybe_call_blacklisted(ctx, addr, "ratelimit");
+		}
+
+		rspamd_inet_address_free(addr);
+	}
+	else if (addr && ctx->ratelimit_buckets) {
 		elt = rspamd_lru_hash_lookup(ctx->ratelimit_buckets, addr,
 									 (time_t) now);
 
@@ -2212,6 +2691,9 @@ rspamd_fuzzy_control_blocked(struct rspamd_main *rspamd_main,
 			rspamd_fuzzy_maybe_call_blacklisted(ctx, addr, "ratelimit");
 		}
 	}
+	else if (addr) {
+		rspamd_inet_address_free(addr);
+	}
 
 	if (write(fd, &rep, sizeof(rep)) != sizeof(rep)) {
 		msg_err("cannot write reply to the control socket: %s",
@@ -2221,6 +2703,75 @@ rspamd_fuzzy_control_blocked(struct rspamd_main *rspamd_main,
 	return TRUE;
 }
 
+static unsigned int
+rspamd_fuzzy_preload_pubkey(struct rspamd_fuzzy_storage_ctx *ctx,
+							const char *b32, gsize len)
+{
+	struct rspamd_cryptobox_pubkey *rk;
+	struct fuzzy_key *key;
+	unsigned int npreloaded = 0;
+
+	rk = rspamd_pubkey_from_base32(b32, len, RSPAMD_KEYPAIR_KEX,
+								   RSPAMD_CRYPTOBOX_MODE_25519);
+
+	if (rk == NULL) {
+		msg_warn("cannot preload invalid public key: %*s", (int) len, b32);
+		return 0;
+	}
+
+	/* A client can use any of our keys */
+	kh_foreach_value(ctx->keys, key, {
+		rspamd_keypair_cache_preload(ctx->keypair_cache, key->key, rk);
+		npreloaded++;
+	});
+
+	rspamd_pubkey_unref(rk);
+
+	return npreloaded;
+}
+
+static void
+rspamd_fuzzy_preload_keypair_cache(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	unsigned int npreloaded = 0;
+
+	while ((cur = ucl_object_iterate(ctx->keypair_cache_preload, &it, true)) != NULL) {
+		const char *str = ucl_object_tostring(cur);
+
+		if (str == NULL) {
+			msg_warn("invalid keypair_cache_preload element, string expected");
+			continue;
+		}
+
+		if (g_file_test(str, G_FILE_TEST_IS_REGULAR)) {
+			char line[256];
+			FILE *f;
+
+			if ((f = fopen(str, "r")) == NULL) {
+				msg_warn("cannot open %s: %s", str, strerror(errno));
+				continue;
+			}
+
+			while (fgets(line, sizeof(line), f) != NULL) {
+				g_strstrip(line);
+
+				if (line[0] != '\0' && line[0] != '#') {
+					npreloaded += rspamd_fuzzy_preload_pubkey(ctx, line, strlen(line));
+				}
+			}
+
+			fclose(f);
+		}
+		else {
+			npreloaded += rspamd_fuzzy_preload_pubkey(ctx, str, strlen(str));
+		}
+	}
+
+	msg_info("preloaded %ud shared secrets to the keypairs cache", npreloaded);
+}
+
 static gboolean
 rspamd_fuzzy_storage_reload(struct rspamd_main *rspamd_main,
 							struct rspamd_worker *worker, int fd,
@@ -2375,6 +2926,19 @@ rspamd_fuzzy_stat_to_ucl(struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat)
 						  0,
 						  false);
 
+	if (ctx->keypair_cache) {
+		struct rspamd_keypair_cache_stat kp_stat;
+
+		rspamd_keypair_cache_get_stat(ctx->keypair_cache, &kp_stat);
+		elt = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(elt, ucl_object_fromint(kp_stat.hits), "hits", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(kp_stat.misses), "misses", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(kp_stat.preloaded), "preloaded", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(kp_stat.size), "size", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(kp_stat.max_size), "max_size", 0, false);
+		ucl_object_insert_key(obj, elt, "keypair_cache", 0, false);
+	}
+
 	if (ctx->errors_ips && ip_stat) {
 		gpointer k, v;
 		int i = 0;
@@ -2432,6 +2996,25 @@ rspamd_fuzzy_maybe_load_ratelimits(struct rspamd_fuzzy_storage_ctx *ctx)
 {
 	char path[PATH_MAX];
 
+	if (ctx->ratelimit_sketch) {
+		GError *err = NULL;
+
+		rspamd_snprintf(path, sizeof(path), "%s" G_DIR_SEPARATOR_S "fuzzy_ratelimits.sketch",
+						RSPAMD_DBDIR);
+
+		if (access(path, R_OK) != -1) {
+			if (rspamd_leaky_sketch_load(ctx->ratelimit_sketch, path, &err)) {
+				msg_info("loaded ratelimit counters from %s", path);
+			}
+			else {
+				msg_err("cannot load ratelimit counters: %e", err);
+				g_error_free(err);
+			}
+		}
+
+		return;
+	}
+
 	rspamd_snprintf(path, sizeof(path), "%s" G_DIR_SEPARATOR_S "fuzzy_ratelimits.ucl",
 					RSPAMD_DBDIR);
 
@@ -2500,6 +3083,23 @@ rspamd_fuzzy_maybe_save_ratelimits(struct rspamd_fuzzy_storage_ctx *ctx)
 {
 	char path[PATH_MAX];
 
+	if (ctx->ratelimit_sketch) {
+		GError *err = NULL;
+
+		rspamd_snprintf(path, sizeof(path), "%s" G_DIR_SEPARATOR_S "fuzzy_ratelimits.sketch",
+						RSPAMD_DBDIR);
+
+		if (rspamd_leaky_sketch_save(ctx->ratelimit_sketch, path, &err)) {
+			msg_info("saved ratelimit counters in %s", path);
+		}
+		else {
+			msg_warn("cannot save ratelimit counters: %e", err);
+			g_error_free(err);
+		}
+
+		return;
+	}
+
 	rspamd_snprintf(path, sizeof(path), "%s" G_DIR_SEPARATOR_S "fuzzy_ratelimits.ucl.new",
 					RSPAMD_DBDIR);
 	FILE *f = fopen(path, "w");
@@ -2923,6 +3523,8 @@ init_fuzzy(struct rspamd_config *cfg)
 	ctx->leaky_bucket_burst = NAN;
 	ctx->leaky_bucket_rate = NAN;
 	ctx->delay = NAN;
+	ctx->delta_log_size = DEFAULT_DELTA_LOG_SIZE;
+	ctx->replication_interval = DEFAULT_REPLICATION_INTERVAL;
 	ctx->default_forbidden_ids = kh_init(fuzzy_key_ids_set);
 	ctx->weak_ids = kh_init(fuzzy_key_ids_set);
 
@@ -3029,6 +3631,26 @@ init_fuzzy(struct rspamd_config *cfg)
 									  RSPAMD_CL_FLAG_UINT,
 									  "Size of keypairs cache, default: " G_STRINGIFY(DEFAULT_KEYPAIR_CACHE_SIZE));
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "keypair_cache_preload",
+									  rspamd_rcl_parse_struct_ucl,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx,
+													  keypair_cache_preload),
+									  0,
+									  "Client public keys (or files with a key per line) to put to the keypairs cache on start");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cpu_threads",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx,
+													  cpu_threads),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Number of threads used to decrypt commands (default: 0, disabled)");
+
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "encrypted_only",
@@ -3100,6 +3722,15 @@ init_fuzzy(struct rspamd_config *cfg)
 									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, max_buckets),
 									  RSPAMD_CL_FLAG_UINT,
 									  "Maximum number of leaky buckets (default: " G_STRINGIFY(DEFAULT_MAX_BUCKETS) ")");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "ratelimit_sketch_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, ratelimit_sketch_size),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Use approximate fixed size ratelimit counters instead of leaky buckets, "
+									  "number of counters per row (default: 0, disabled)");
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "ratelimit_network_mask",
@@ -3140,6 +3771,46 @@ init_fuzzy(struct rspamd_config *cfg)
 									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, ratelimit_log_only),
 									  0,
 									  "Don't really ban on ratelimit reaching, just log");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "delta_log",
+									  rspamd_rcl_parse_struct_string,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, delta_log_path),
+									  0,
+									  "Write compressed log of updates used for replication to this file");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "delta_log_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, delta_log_size),
+									  RSPAMD_CL_FLAG_INT_SIZE,
+									  "Rotate delta log when it is larger than this size (default: 64M)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "replication_bind",
+									  rspamd_rcl_parse_struct_string,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, replication_bind),
+									  0,
+									  "Serve delta log to followers on this TCP address (allowed by `allow_update`)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "replication_leader",
+									  rspamd_rcl_parse_struct_string,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, replication_leader),
+									  0,
+									  "Follow delta log of the specified leader(s), local updates are rejected then");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "replication_interval",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_fuzzy_storage_ctx, replication_interval),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "How often to poll the leader for new updates (default: " G_STRINGIFY(DEFAULT_REPLICATION_INTERVAL) " seconds)");
 
 
 	return ctx;
@@ -3236,23 +3907,670 @@ fuzzy_peer_rep(struct rspamd_worker *worker,
 }
 
 /*
- * Start worker process
+ * Replication: the update worker of a leader serves its delta log over HTTP,
+ * followers poll it from the last version they have applied
  */
-__attribute__((noreturn)) void
-start_fuzzy(struct rspamd_worker *worker)
+struct rspamd_fuzzy_replication_session {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	rspamd_inet_addr_t *addr;
+};
+
+struct rspamd_fuzzy_replication_request {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct upstream *up;
+	struct rspamd_http_connection *conn;
+};
+
+struct rspamd_fuzzy_replication_apply {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	GArray *updates;
+	gsize len;
+	uint64_t from;
+	uint64_t version;
+	/* Version of the replication source in the backend before applying */
+	uint64_t rev;
+};
+
+static void rspamd_fuzzy_replication_poll(struct rspamd_fuzzy_storage_ctx *ctx);
+
+static int
+rspamd_fuzzy_replication_handler(struct rspamd_http_connection_entry *conn_ent,
+								 struct rspamd_http_message *msg)
 {
-	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct rspamd_fuzzy_replication_session *session = conn_ent->ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = session->ctx;
+	struct rspamd_http_message *reply;
+	const rspamd_ftok_t *hdr;
+	rspamd_fstring_t *frames;
 	GError *err = NULL;
-	struct rspamd_srv_command srv_cmd;
-	struct rspamd_config *cfg = worker->srv->cfg;
+	uint64_t from = 0;
+	char version_buf[32];
 
-	g_assert(rspamd_worker_check_context(worker->ctx, rspamd_fuzzy_storage_magic));
-	ctx->event_loop = rspamd_prepare_worker(worker,
-											"fuzzy",
+	hdr = rspamd_http_message_find_header(msg, "From-Version");
+
+	if (hdr && !rspamd_strtou64(hdr->begin, hdr->len, &from)) {
+		rspamd_controller_send_error(conn_ent, 400, "invalid version");
+
+		return 0;
+	}
+
+	frames = rspamd_fuzzy_delta_log_read(ctx->delta_log, from,
+										 FUZZY_REPLICATION_MAX_REPLY, &err);
+
+	if (frames == NULL) {
+		msg_info("cannot send delta from version %uL to %s: %e", from,
+				 rspamd_inet_address_to_string_pretty(session->addr), err);
+		rspamd_controller_send_error(conn_ent,
+									 err->code == RSPAMD_FUZZY_DELTA_ERROR_GONE ? 410 : 500,
+									 "%s", err->message);
+		g_error_free(err);
+
+		return 0;
+	}
+
+	msg_debug("send %uz bytes of delta from version %uL to %s", frames->len, from,
+			  rspamd_inet_address_to_string_pretty(session->addr));
+	reply = rspamd_http_new_message(HTTP_RESPONSE);
+	reply->date = time(NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init("OK", 2);
+	rspamd_snprintf(version_buf, sizeof(version_buf), "%uL",
+					rspamd_fuzzy_delta_log_version(ctx->delta_log));
+	rspamd_http_message_add_header(reply, "Last-Version", version_buf);
+	rspamd_http_message_set_body_from_fstring_steal(reply, frames);
+	rspamd_http_connection_reset(conn_ent->conn);
+	rspamd_http_router_insert_headers(conn_ent->rt, reply);
+	rspamd_http_connection_write_message(conn_ent->conn,
+										 reply,
+										 NULL,
+										 "application/octet-stream",
+										 conn_ent,
+										 conn_ent->rt->timeout);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_error_handler(struct rspamd_http_connection_entry *conn_ent,
+									   GError *err)
+{
+	struct rspamd_fuzzy_replication_session *session = conn_ent->ud;
+
+	msg_info("replication connection from %s failed: %e",
+			 rspamd_inet_address_to_string_pretty(session->addr), err);
+}
+
+static void
+rspamd_fuzzy_replication_finish_handler(struct rspamd_http_connection_entry *conn_ent)
+{
+	struct rspamd_fuzzy_replication_session *session = conn_ent->ud;
+
+	rspamd_inet_address_free(session->addr);
+	g_free(session);
+}
+
+static void
+rspamd_fuzzy_replication_accept(EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx =
+		(struct rspamd_fuzzy_storage_ctx *) w->data;
+	struct rspamd_fuzzy_replication_session *session;
+	rspamd_inet_addr_t *addr = NULL;
+	int nfd;
+
+	if ((nfd = rspamd_accept_from_socket(w->fd, &addr, NULL, NULL)) == -1) {
+		msg_warn("accept failed: %s", strerror(errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		rspamd_inet_address_free(addr);
+		return;
+	}
+
+	/* Followers are allowed the same way as updates */
+	if (ctx->update_ips == NULL ||
+		rspamd_match_radix_map_addr(ctx->update_ips, addr) == NULL) {
+		msg_info("replication is not allowed for %s",
+				 rspamd_inet_address_to_string_pretty(addr));
+		rspamd_inet_address_free(addr);
+		close(nfd);
+
+		return;
+	}
+
+	session = g_malloc0(sizeof(*session));
+	session->ctx = ctx;
+	session->addr = addr;
+	rspamd_http_router_handle_socket(ctx->replication_router, nfd, session);
+}
+
+/*
+ * Frames are appended to the delta log before they are applied and the state
+ * file keeps the version of the replication source in the backend, that is
+ * bumped in the same transaction as the updates are written. So after a crash
+ * the batch is applied again only if the backend has not got it.
+ */
+static char *
+rspamd_fuzzy_replication_state_path(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	return g_strdup_printf("%s.applied", ctx->delta_log_path);
+}
+
+static gboolean
+rspamd_fuzzy_replication_state_save(struct rspamd_fuzzy_storage_ctx *ctx,
+									struct rspamd_fuzzy_replication_apply *apply)
+{
+	char *path = rspamd_fuzzy_replication_state_path(ctx), *tmp_path, buf[96];
+	gsize len;
+	gboolean ret = FALSE;
+	int fd;
+
+	tmp_path = g_strdup_printf("%s.tmp", path);
+	len = rspamd_snprintf(buf, sizeof(buf), "%uL %uL %uL\n",
+						  apply->from, apply->version, apply->rev);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (fd == -1) {
+		msg_err("cannot open %s: %s", tmp_path, strerror(errno));
+	}
+	else {
+		if (write(fd, buf, len) != (ssize_t) len || fsync(fd) == -1) {
+			msg_err("cannot write %s: %s", tmp_path, strerror(errno));
+		}
+		else if (rename(tmp_path, path) == -1) {
+			msg_err("cannot rename %s to %s: %s", tmp_path, path, strerror(errno));
+		}
+		else {
+			ret = TRUE;
+		}
+
+		close(fd);
+	}
+
+	g_free(tmp_path);
+	g_free(path);
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_replication_state_load(struct rspamd_fuzzy_storage_ctx *ctx,
+									struct rspamd_fuzzy_replication_apply *apply)
+{
+	char *path = rspamd_fuzzy_replication_state_path(ctx), *content = NULL;
+	gboolean ret = FALSE;
+
+	if (g_file_get_contents(path, &content, NULL, NULL)) {
+		guint64 from, version, rev;
+
+		if (sscanf(content, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+				   &from, &version, &rev) == 3) {
+			apply->from = from;
+			apply->version = version;
+			apply->rev = rev;
+			ret = TRUE;
+		}
+		else {
+			msg_err("invalid replication state in %s", path);
+		}
+
+		g_free(content);
+	}
+
+	g_free(path);
+
+	return ret;
+}
+
+static void
+rspamd_fuzzy_replication_state_clear(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	char *path = rspamd_fuzzy_replication_state_path(ctx);
+
+	if (unlink(path) == -1 && errno != ENOENT) {
+		msg_err("cannot remove %s: %s", path, strerror(errno));
+	}
+
+	g_free(path);
+}
+
+static void
+rspamd_fuzzy_replication_apply_free(struct rspamd_fuzzy_replication_apply *apply)
+{
+	if (apply->updates) {
+		g_array_free(apply->updates, TRUE);
+	}
+
+	g_free(apply);
+}
+
+static void
+rspamd_fuzzy_replication_applied_cb(gboolean success,
+									unsigned int nadded,
+									unsigned int ndeleted,
+									unsigned int nextended,
+									unsigned int nignored,
+									void *ud)
+{
+	struct rspamd_fuzzy_replication_apply *apply = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = apply->ctx;
+	gboolean more = FALSE;
+
+	ctx->replication_inflight = FALSE;
+
+	if (success) {
+		rspamd_fuzzy_replication_state_clear(ctx);
+		ctx->replication_recover = FALSE;
+		more = apply->len >= FUZZY_REPLICATION_MAX_REPLY / 2;
+
+		msg_info("applied replicated updates up to version %uL: "
+				 "%d added; %d deleted; %d extended; %d duplicates",
+				 apply->version, nadded, ndeleted, nextended, nignored);
+		rspamd_fuzzy_backend_count(ctx->backend, fuzzy_count_callback, ctx);
+	}
+	else {
+		/* Frames are in the log already, so they are applied from there */
+		msg_err("cannot apply %ud replicated updates, retry later",
+				apply->updates->len);
+		ctx->replication_recover = TRUE;
+	}
+
+	rspamd_fuzzy_replication_apply_free(apply);
+
+	if (more && ctx->worker->state == rspamd_worker_state_running) {
+		/* Catch up without waiting for the next interval */
+		rspamd_fuzzy_replication_poll(ctx);
+	}
+}
+
+static void
+rspamd_fuzzy_replication_rev_cb(uint64_t rev, void *ud)
+{
+	struct rspamd_fuzzy_replication_apply *apply = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = apply->ctx;
+
+	apply->rev = rev;
+
+	if (!rspamd_fuzzy_replication_state_save(ctx, apply)) {
+		/* Frames are logged already, so they must be applied anyway */
+		msg_warn("apply updates up to version %uL with no replication state",
+				 apply->version);
+	}
+
+	rspamd_fuzzy_backend_process_updates(ctx->backend, apply->updates,
+										 replication_db_name,
+										 rspamd_fuzzy_replication_applied_cb,
+										 apply);
+}
+
+static void
+rspamd_fuzzy_replication_recover_cb(uint64_t rev, void *ud)
+{
+	struct rspamd_fuzzy_replication_apply *apply = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = apply->ctx;
+	rspamd_fstring_t *frames;
+	GError *err = NULL;
+	uint64_t version = 0;
+
+	if (rev > apply->rev) {
+		msg_info("replicated updates up to version %uL have been already applied",
+				 apply->version);
+		rspamd_fuzzy_replication_state_clear(ctx);
+		ctx->replication_recover = FALSE;
+		ctx->replication_inflight = FALSE;
+		rspamd_fuzzy_replication_apply_free(apply);
+		rspamd_fuzzy_replication_poll(ctx);
+
+		return;
+	}
+	else if (rev < apply->rev) {
+		/* Versions never decrease, so the backend has not replied */
+		msg_err("cannot get version of replicated updates, retry later");
+		ctx->replication_inflight = FALSE;
+		rspamd_fuzzy_replication_apply_free(apply);
+
+		return;
+	}
+
+	frames = rspamd_fuzzy_delta_log_read(ctx->delta_log, apply->from,
+										 FUZZY_REPLICATION_MAX_REPLY, &err);
+
+	if (frames != NULL) {
+		apply->updates = rspamd_fuzzy_delta_decode((const unsigned char *) frames->str,
+												   frames->len, apply->from,
+												   &version, &err);
+		apply->len = frames->len;
+		rspamd_fstring_free(frames);
+	}
+
+	if (apply->updates == NULL || version != apply->version) {
+		msg_err("cannot read replicated updates from %uL to %uL from delta log: %e",
+				apply->from, apply->version, err);
+
+		if (err) {
+			g_error_free(err);
+		}
+
+		ctx->replication_inflight = FALSE;
+		rspamd_fuzzy_replication_apply_free(apply);
+
+		return;
+	}
+
+	msg_info("apply replicated updates from %uL to %uL again", apply->from,
+			 apply->version);
+	rspamd_fuzzy_backend_process_updates(ctx->backend, apply->updates,
+										 replication_db_name,
+										 rspamd_fuzzy_replication_applied_cb,
+										 apply);
+}
+
+static void
+rspamd_fuzzy_replication_recover(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct rspamd_fuzzy_replication_apply *apply;
+
+	apply = g_malloc0(sizeof(*apply));
+	apply->ctx = ctx;
+
+	if (!rspamd_fuzzy_replication_state_load(ctx, apply)) {
+		/* Batch has not been logged, so it is fetched from the leader again */
+		ctx->replication_recover = FALSE;
+		rspamd_fuzzy_replication_apply_free(apply);
+		rspamd_fuzzy_replication_poll(ctx);
+
+		return;
+	}
+
+	ctx->replication_inflight = TRUE;
+	rspamd_fuzzy_backend_version(ctx->backend, replication_db_name,
+								 rspamd_fuzzy_replication_recover_cb, apply);
+}
+
+static void
+rspamd_fuzzy_replication_request_free(struct rspamd_fuzzy_replication_request *req)
+{
+	rspamd_http_connection_unref(req->conn);
+	g_free(req);
+}
+
+static void
+rspamd_fuzzy_replication_client_error(struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamd_fuzzy_replication_request *req =
+		(struct rspamd_fuzzy_replication_request *) conn->ud;
+
+	msg_err("cannot get delta from %s: %e", rspamd_upstream_name(req->up), err);
+	rspamd_upstream_fail(req->up, FALSE, err ? err->message : "unknown error");
+	req->ctx->replication_inflight = FALSE;
+	rspamd_fuzzy_replication_request_free(req);
+}
+
+static int
+rspamd_fuzzy_replication_client_finish(struct rspamd_http_connection *conn,
+									   struct rspamd_http_message *msg)
+{
+	struct rspamd_fuzzy_replication_request *req =
+		(struct rspamd_fuzzy_replication_request *) conn->ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = req->ctx;
+	struct rspamd_fuzzy_replication_apply *apply;
+	const char *body;
+	GArray *updates;
+	GError *err = NULL;
+	uint64_t version;
+	gsize len = 0;
+
+	if (msg->code == 200) {
+		rspamd_upstream_ok(req->up);
+		body = rspamd_http_message_get_body(msg, &len);
+
+		if (len > 0) {
+			uint64_t from = rspamd_fuzzy_delta_log_version(ctx->delta_log);
+
+			updates = rspamd_fuzzy_delta_decode((const unsigned char *) body, len,
+												from, &version, &err);
+
+			if (updates == NULL) {
+				msg_err("invalid delta from %s: %e", rspamd_upstream_name(req->up), err);
+				g_error_free(err);
+			}
+			else if (!rspamd_fuzzy_delta_log_append_frames(ctx->delta_log,
+														   (const unsigned char *) body,
+														   len, &err)) {
+				/* Frames are kept as is, so followers could be chained */
+				msg_err("cannot append replicated frames to delta log: %e", err);
+				g_error_free(err);
+				g_array_free(updates, TRUE);
+			}
+			else {
+				apply = g_malloc0(sizeof(*apply));
+				apply->ctx = ctx;
+				apply->updates = updates;
+				apply->len = len;
+				apply->from = from;
+				apply->version = version;
+				rspamd_fuzzy_replication_request_free(req);
+				/* Still inflight until applied */
+				rspamd_fuzzy_backend_version(ctx->backend, replication_db_name,
+											 rspamd_fuzzy_replication_rev_cb, apply);
+
+				return 0;
+			}
+		}
+	}
+	else if (msg->code == 410) {
+		rspamd_upstream_ok(req->up);
+		msg_err("leader %s has no delta from version %uL, full resync is required",
+				rspamd_upstream_name(req->up),
+				rspamd_fuzzy_delta_log_version(ctx->delta_log));
+	}
+	else {
+		msg_err("cannot get delta from %s: bad reply code %d",
+				rspamd_upstream_name(req->up), msg->code);
+		rspamd_upstream_fail(req->up, FALSE, "bad reply code");
+	}
+
+	ctx->replication_inflight = FALSE;
+	rspamd_fuzzy_replication_request_free(req);
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_poll(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct rspamd_fuzzy_replication_request *req;
+	struct rspamd_http_message *msg;
+	struct rspamd_http_connection *conn;
+	struct upstream *up;
+	char version_buf[32];
+
+	if (ctx->replication_inflight) {
+		return;
+	}
+
+	if (ctx->replication_recover) {
+		rspamd_fuzzy_replication_recover(ctx);
+
+		return;
+	}
+
+	up = rspamd_upstream_get(ctx->replication_leaders, RSPAMD_UPSTREAM_ROUND_ROBIN,
+							 NULL, 0);
+
+	if (up == NULL) {
+		return;
+	}
+
+	conn = rspamd_http_connection_new_client(ctx->http_ctx,
+											 NULL,
+											 rspamd_fuzzy_replication_client_error,
+											 rspamd_fuzzy_replication_client_finish,
+											 RSPAMD_HTTP_CLIENT_SIMPLE,
+											 rspamd_upstream_addr_next(up));
+
+	if (conn == NULL) {
+		rspamd_upstream_fail(up, TRUE, strerror(errno));
+		return;
+	}
+
+	msg = rspamd_http_new_message(HTTP_REQUEST);
+	msg->method = HTTP_GET;
+	msg->url = rspamd_fstring_new_init("/delta", sizeof("/delta") - 1);
+	rspamd_snprintf(version_buf, sizeof(version_buf), "%uL",
+					rspamd_fuzzy_delta_log_version(ctx->delta_log));
+	rspamd_http_message_add_header(msg, "From-Version", version_buf);
+
+	req = g_malloc0(sizeof(*req));
+	req->ctx = ctx;
+	req->up = up;
+	req->conn = conn;
+	ctx->replication_inflight = TRUE;
+
+	rspamd_http_connection_write_message(conn, msg, rspamd_upstream_name(up),
+										 NULL, req, DEFAULT_MASTER_TIMEOUT);
+}
+
+static void
+rspamd_fuzzy_replication_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx =
+		(struct rspamd_fuzzy_storage_ctx *) w->data;
+
+	rspamd_fuzzy_replication_poll(ctx);
+}
+
+static void
+rspamd_fuzzy_replication_init(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GError *err = NULL;
+	rspamd_inet_addr_t *addr = NULL;
+	int fd;
+
+	if (ctx->delta_log_path == NULL) {
+		if (ctx->replication_bind || ctx->replication_leader) {
+			msg_err("replication requires `delta_log` to be set");
+		}
+
+		return;
+	}
+
+	ctx->delta_log = rspamd_fuzzy_delta_log_open(ctx->delta_log_path,
+												 ctx->delta_log_size, &err);
+
+	if (ctx->delta_log == NULL) {
+		msg_err("cannot open delta log: %e", err);
+		g_error_free(err);
+
+		return;
+	}
+
+	msg_info("opened delta log %s, version %uL", ctx->delta_log_path,
+			 rspamd_fuzzy_delta_log_version(ctx->delta_log));
+
+	if (ctx->replication_leader) {
+		ctx->replication_leaders = rspamd_upstreams_create(ctx->cfg->ups_ctx);
+
+		if (!rspamd_upstreams_parse_line(ctx->replication_leaders,
+										 ctx->replication_leader,
+										 DEFAULT_REPLICATION_PORT, NULL)) {
+			msg_err("cannot parse replication leader: %s", ctx->replication_leader);
+			rspamd_upstreams_destroy(ctx->replication_leaders);
+			ctx->replication_leaders = NULL;
+		}
+		else {
+			char *state_path = rspamd_fuzzy_replication_state_path(ctx);
+
+			/* Last logged batch might have not been applied before restart */
+			ctx->replication_recover = access(state_path, F_OK) == 0;
+			g_free(state_path);
+			ctx->replication_ev.data = ctx;
+			ev_timer_init(&ctx->replication_ev, rspamd_fuzzy_replication_timer_cb,
+						  ctx->replication_interval, ctx->replication_interval);
+			ev_timer_start(ctx->event_loop, &ctx->replication_ev);
+		}
+	}
+
+	if (ctx->replication_bind) {
+		if (!rspamd_parse_inet_address(&addr, ctx->replication_bind,
+									   strlen(ctx->replication_bind),
+									   RSPAMD_INET_ADDRESS_PARSE_DEFAULT)) {
+			msg_err("cannot parse replication address: %s", ctx->replication_bind);
+
+			return;
+		}
+
+		if (rspamd_inet_address_get_port(addr) == 0) {
+			rspamd_inet_address_set_port(addr, DEFAULT_REPLICATION_PORT);
+		}
+
+		fd = rspamd_inet_address_listen(addr, SOCK_STREAM,
+										RSPAMD_INET_ADDRESS_LISTEN_ASYNC, -1);
+
+		if (fd == -1) {
+			msg_err("cannot listen on %s: %s",
+					rspamd_inet_address_to_string_pretty(addr), strerror(errno));
+			rspamd_inet_address_free(addr);
+
+			return;
+		}
+
+		msg_info("serve delta log on %s", rspamd_inet_address_to_string_pretty(addr));
+		rspamd_inet_address_free(addr);
+		ctx->replication_router = rspamd_http_router_new(
+			rspamd_fuzzy_replication_error_handler,
+			rspamd_fuzzy_replication_finish_handler,
+			DEFAULT_MASTER_TIMEOUT,
+			NULL,
+			ctx->http_ctx);
+		rspamd_http_router_add_path(ctx->replication_router, "/delta",
+									rspamd_fuzzy_replication_handler);
+		ctx->replication_accept_ev.data = ctx;
+		ev_io_init(&ctx->replication_accept_ev, rspamd_fuzzy_replication_accept,
+				   fd, EV_READ);
+		ev_io_start(ctx->event_loop, &ctx->replication_accept_ev);
+	}
+}
+
+static void
+rspamd_fuzzy_replication_stop(struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->replication_router) {
+		ev_io_stop(ctx->event_loop, &ctx->replication_accept_ev);
+		close(ctx->replication_accept_ev.fd);
+		rspamd_http_router_free(ctx->replication_router);
+		ctx->replication_router = NULL;
+	}
+
+	if (ctx->replication_leaders) {
+		ev_timer_stop(ctx->event_loop, &ctx->replication_ev);
+	}
+}
+
+/*
+ * Start worker process
+ */
+__attribute__((noreturn)) void
+start_fuzzy(struct rspamd_worker *worker)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	GError *err = NULL;
+	struct rspamd_srv_command srv_cmd;
+	struct rspamd_config *cfg = worker->srv->cfg;
+
+	g_assert(rspamd_worker_check_context(worker->ctx, rspamd_fuzzy_storage_magic));
+	ctx->event_loop = rspamd_prepare_worker(worker,
+											"fuzzy",
 											NULL);
 	ctx->peer_fd = -1;
 	ctx->worker = worker;
 	ctx->cfg = worker->srv->cfg;
+#ifdef HAVE_SENDMMSG
+	ev_prepare_init(&ctx->replies_flush_ev, rspamd_fuzzy_replies_flush_cb);
+	ctx->replies_flush_ev.data = ctx;
+#endif
 	ctx->resolver = rspamd_dns_resolver_init(worker->srv->logger,
 											 ctx->event_loop,
 											 worker->srv->cfg);
@@ -3265,6 +4583,10 @@ start_fuzzy(struct rspamd_worker *worker)
 	if (ctx->keypair_cache_size > 0) {
 		/* Create keypairs cache */
 		ctx->keypair_cache = rspamd_keypair_cache_new(ctx->keypair_cache_size);
+
+		if (ctx->keypair_cache_preload) {
+			rspamd_fuzzy_preload_keypair_cache(ctx);
+		}
 	}
 
 
@@ -3285,6 +4607,7 @@ start_fuzzy(struct rspamd_worker *worker)
 												 sizeof(struct fuzzy_peer_cmd), 1024);
 		rspamd_fuzzy_backend_start_update(ctx->backend, ctx->sync_timeout,
 										  rspamd_fuzzy_storage_periodic_callback, ctx);
+		rspamd_fuzzy_replication_init(ctx);
 
 		if (ctx->dedicated_update_worker && worker->cf->count > 1) {
 			msg_info_config("stop serving clients request in dedicated update mode");
@@ -3412,9 +4735,18 @@ start_fuzzy(struct rspamd_worker *worker)
 
 	/* Ratelimits */
 	if (!isnan(ctx->leaky_bucket_rate) && !isnan(ctx->leaky_bucket_burst)) {
-		ctx->ratelimit_buckets = rspamd_lru_hash_new_full(ctx->max_buckets,
-														  NULL, fuzzy_rl_bucket_free,
-														  rspamd_inet_address_hash, rspamd_inet_address_equal);
+		if (ctx->ratelimit_sketch_size > 0) {
+			ctx->ratelimit_sketch = rspamd_leaky_sketch_new(ctx->ratelimit_sketch_size,
+															RATELIMIT_SKETCH_DEPTH,
+															ctx->leaky_bucket_rate);
+			msg_info("use approximate ratelimits, %uz bytes of counters",
+					 rspamd_leaky_sketch_bytes(ctx->ratelimit_sketch));
+		}
+		else {
+			ctx->ratelimit_buckets = rspamd_lru_hash_new_full(ctx->max_buckets,
+															  NULL, fuzzy_rl_bucket_free,
+															  rspamd_inet_address_hash, rspamd_inet_address_equal);
+		}
 
 		rspamd_fuzzy_maybe_load_ratelimits(ctx);
 	}
@@ -3470,12 +4802,26 @@ start_fuzzy(struct rspamd_worker *worker)
 	};
 	rspamd_lua_add_metamethod(ctx->cfg->lua_state, rspamd_worker_classname, &fuzzy_lua_reg);
 
+	if (ctx->cpu_threads > 0) {
+		worker->cpu_pool = rspamd_cpu_pool_new(ctx->event_loop, ctx->cpu_threads, 0);
+		msg_info("started %ud threads to decrypt fuzzy commands", ctx->cpu_threads);
+	}
+
 	rspamd_lua_run_postloads(ctx->cfg->lua_state, ctx->cfg, ctx->event_loop,
 							 worker);
 
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
 
+	if (worker->cpu_pool) {
+		/* Completes all pending commands */
+		rspamd_cpu_pool_destroy(worker->cpu_pool);
+		worker->cpu_pool = NULL;
+	}
+#ifdef HAVE_SENDMMSG
+	rspamd_fuzzy_flush_replies(ctx);
+#endif
+
 	if (ctx->peer_fd != -1) {
 		if (worker->index == 0) {
 			ev_io_stop(ctx->event_loop, &ctx->peer_ev);
@@ -3483,6 +4829,10 @@ start_fuzzy(struct rspamd_worker *worker)
 		close(ctx->peer_fd);
 	}
 
+	if (worker->index == 0) {
+		rspamd_fuzzy_replication_stop(ctx);
+	}
+
 	if (worker->index == 0 && ctx->updates_pending->len > 0) {
 
 		msg_info_config("start another event loop to sync fuzzy storage");
@@ -3501,6 +4851,11 @@ start_fuzzy(struct rspamd_worker *worker)
 	if (worker->index == 0) {
 		g_array_free(ctx->updates_pending, TRUE);
 		ctx->updates_pending = NULL;
+
+		if (ctx->delta_log) {
+			rspamd_fuzzy_delta_log_close(ctx->delta_log);
+			ctx->delta_log = NULL;
+		}
 	}
 
 	if (ctx->keypair_cache) {
@@ -3517,6 +4872,15 @@ start_fuzzy(struct rspamd_worker *worker)
 		rspamd_lru_hash_destroy(ctx->ratelimit_buckets);
 	}
 
+	if (ctx->ratelimit_sketch) {
+		if ((!ctx->dedicated_update_worker && worker->index == 0) ||
+			(ctx->dedicated_update_worker && worker->index == 1)) {
+			rspamd_fuzzy_maybe_save_ratelimits(ctx);
+		}
+
+		rspamd_leaky_sketch_destroy(ctx->ratelimit_sketch);
+	}
+
 	if (ctx->lua_pre_handler_cbref != -1) {
 		luaL_unref(ctx->cfg->lua_state, LUA_REGISTRYINDEX, ctx->lua_pre_handler_cbref);
 	}
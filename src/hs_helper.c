@@ -20,6 +20,7 @@
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
 #include "unix-std.h"
+#include "libutil/cxx/cpu_pool.h"
 
 #ifdef HAVE_GLOB_H
 #include <glob.h>
@@ -57,6 +58,9 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	double max_time;
 	double recompile_time;
+	unsigned int cpu_threads;
+	/* The last sealed bundle of compiled databases sent to other processes */
+	int bundle_fd;
 	ev_timer recompile_timer;
 };
 
@@ -72,8 +76,12 @@ init_hs_helper(struct rspamd_config *cfg)
 	ctx->magic = rspamd_hs_helper_magic;
 	ctx->cfg = cfg;
 	ctx->hs_dir = NULL;
+	ctx->bundle_fd = -1;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	ctx->cpu_threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
 
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
@@ -107,6 +115,14 @@ init_hs_helper(struct rspamd_config *cfg)
 									  G_STRUCT_OFFSET(struct hs_helper_ctx, max_time),
 									  RSPAMD_CL_FLAG_TIME_FLOAT,
 									  "Maximum time to wait for compilation of a single expression");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cpu_threads",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct hs_helper_ctx, cpu_threads),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Number of threads to compile hyperscan shards in parallel (default: number of CPUs, 0 to compile in the main thread)");
 
 	return ctx;
 }
@@ -252,8 +268,31 @@ rspamd_rs_delayed_cb(EV_P_ ev_timer *w, int revents)
 	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
 	static struct rspamd_srv_command srv_cmd;
 	struct hs_helper_ctx *ctx;
+	GError *err = NULL;
+	int bundle_fd;
 
 	ctx = (struct hs_helper_ctx *) worker->ctx;
+
+	/*
+	 * Processes use databases from the bundle directly, so they neither read
+	 * nor deserialize cache files; the bundle is kept open here until
+	 * the next one is sent, as the command is sent asynchronously
+	 */
+	bundle_fd = rspamd_re_cache_hyperscan_bundle(ctx->cfg->re_cache,
+												 ctx->hs_dir, &err);
+
+	if (bundle_fd == -1) {
+		msg_info("cannot create hyperscan bundle, other processes will load "
+				 "cache files: %e",
+				 err);
+		g_error_free(err);
+	}
+
+	if (ctx->bundle_fd != -1) {
+		close(ctx->bundle_fd);
+	}
+
+	ctx->bundle_fd = bundle_fd;
 	memset(&srv_cmd, 0, sizeof(srv_cmd));
 	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
 	rspamd_strlcpy(srv_cmd.cmd.hs_loaded.cache_dir, ctx->hs_dir,
@@ -262,7 +301,7 @@ rspamd_rs_delayed_cb(EV_P_ ev_timer *w, int revents)
 	hack_global_forced = FALSE;
 
 	rspamd_srv_send_command(worker,
-							ctx->event_loop, &srv_cmd, -1, NULL, NULL);
+							ctx->event_loop, &srv_cmd, bundle_fd, NULL, NULL);
 	ev_timer_stop(EV_A_ w);
 	g_free(w);
 
@@ -335,6 +374,7 @@ rspamd_rs_compile(struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	rspamd_re_cache_compile_hyperscan(ctx->cfg->re_cache,
 									  ctx->hs_dir, ctx->max_time, !forced,
 									  ctx->event_loop,
+									  worker->cpu_pool,
 									  rspamd_rs_compile_cb,
 									  (void *) worker);
 
@@ -402,6 +442,11 @@ start_hs_helper(struct rspamd_worker *worker)
 											"hs_helper",
 											NULL);
 
+	if (ctx->cpu_threads > 0) {
+		worker->cpu_pool = rspamd_cpu_pool_new(ctx->event_loop, ctx->cpu_threads, 0);
+		msg_info("started %ud threads to compile hyperscan databases", ctx->cpu_threads);
+	}
+
 	if (!rspamd_rs_compile(ctx, worker, FALSE)) {
 		/* Tell main not to respawn more workers */
 		exit(EXIT_SUCCESS);
@@ -418,6 +463,11 @@ start_hs_helper(struct rspamd_worker *worker)
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
 
+	if (worker->cpu_pool) {
+		rspamd_cpu_pool_destroy(worker->cpu_pool);
+		worker->cpu_pool = NULL;
+	}
+
 	rspamd_log_close(worker->srv->logger);
 	REF_RELEASE(ctx->cfg);
 	rspamd_unset_crash_handler(worker->srv);
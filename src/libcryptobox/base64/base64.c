@@ -346,6 +346,11 @@ base64_load(void)
 	/* Enable reference */
 	base64_list[0].enabled = true;
 
+	/* Could be reloaded with a reduced cpu_config, e.g. by benchmarks */
+	for (i = 1; i < G_N_ELEMENTS(base64_list); i++) {
+		base64_list[i].enabled = false;
+	}
+
 	if (cpu_config != 0) {
 		for (i = 1; i < G_N_ELEMENTS(base64_list); i++) {
 			if (base64_list[i].cpu_flags & cpu_config) {
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "blake2.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+static const uint64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+
+static const uint8_t blake2b_sigma[12][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+	{11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+	{7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+	{9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+	{2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+	{12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+	{13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+	{6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+#define ADD(a, b) _mm256_add_epi64((a), (b))
+#define XOR(a, b) _mm256_xor_si256((a), (b))
+#define ROTR32(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8((x), r24)
+#define ROTR16(x) _mm256_shuffle_epi8((x), r16)
+#define ROTR63(x) XOR(_mm256_srli_epi64((x), 63), ADD((x), (x)))
+
+#define G(r, i, a, b, c, d)                                 \
+	do {                                                    \
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i + 0]]); \
+		d = ROTR32(XOR(d, a));                              \
+		c = ADD(c, d);                                      \
+		b = ROTR24(XOR(b, c));                              \
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * i + 1]]); \
+		d = ROTR16(XOR(d, a));                              \
+		c = ADD(c, d);                                      \
+		b = ROTR63(XOR(b, c));                              \
+	} while (0)
+
+/* Loads 4 words of each of 4 lanes, so every vector holds the same word of all lanes */
+static inline void
+blake2b_mb_load_words(__m256i *m, const unsigned char *const *in, size_t off)
+{
+	__m256i a, b, c, d, t0, t1, t2, t3;
+
+	a = _mm256_loadu_si256((const __m256i *) (in[0] + off));
+	b = _mm256_loadu_si256((const __m256i *) (in[1] + off));
+	c = _mm256_loadu_si256((const __m256i *) (in[2] + off));
+	d = _mm256_loadu_si256((const __m256i *) (in[3] + off));
+
+	t0 = _mm256_unpacklo_epi64(a, b);
+	t1 = _mm256_unpackhi_epi64(a, b);
+	t2 = _mm256_unpacklo_epi64(c, d);
+	t3 = _mm256_unpackhi_epi64(c, d);
+
+	m[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+	m[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+	m[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+	m[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+void blake2b_mb_compress_avx2(uint64_t *h, const unsigned char *const *in,
+							  size_t nblocks, uint64_t t)
+{
+	const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+										 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+										 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	__m256i s[8], v[16], m[16];
+	unsigned int i, r;
+	size_t blk;
+
+	for (i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i *) (h + i * BLAKE2B_MB_LANES));
+	}
+
+	for (blk = 0; blk < nblocks; blk++) {
+		size_t off = blk * BLAKE2B_BLOCKBYTES;
+
+		t += BLAKE2B_BLOCKBYTES;
+
+		for (i = 0; i < 4; i++) {
+			blake2b_mb_load_words(&m[i * 4], in, off + i * 32);
+		}
+
+		for (i = 0; i < 8; i++) {
+			v[i] = s[i];
+			v[i + 8] = _mm256_set1_epi64x((long long) blake2b_iv[i]);
+		}
+
+		v[12] = XOR(v[12], _mm256_set1_epi64x((long long) t));
+
+		for (r = 0; r < 12; r++) {
+			G(r, 0, v[0], v[4], v[8], v[12]);
+			G(r, 1, v[1], v[5], v[9], v[13]);
+			G(r, 2, v[2], v[6], v[10], v[14]);
+			G(r, 3, v[3], v[7], v[11], v[15]);
+			G(r, 4, v[0], v[5], v[10], v[15]);
+			G(r, 5, v[1], v[6], v[11], v[12]);
+			G(r, 6, v[2], v[7], v[8], v[13]);
+			G(r, 7, v[3], v[4], v[9], v[14]);
+		}
+
+		for (i = 0; i < 8; i++) {
+			s[i] = XOR(s[i], XOR(v[i], v[i + 8]));
+		}
+	}
+
+	for (i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i *) (h + i * BLAKE2B_MB_LANES), s[i]);
+	}
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+#endif
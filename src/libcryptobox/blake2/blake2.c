@@ -0,0 +1,328 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Multi-buffer BLAKE2b: independent messages are hashed in parallel SIMD lanes,
+ * one message per 64 bit lane. Lanes are advanced in lock step while all of them
+ * have full blocks, the rest of each message is finished by the scalar code.
+ * The result is the same as for `rspamd_cryptobox_hash` (64 bytes output).
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+#include "blake2.h"
+
+extern unsigned cpu_config;
+
+/* Messages are sorted by length in batches of this size, so lanes have similar lengths */
+#define BLAKE2B_MB_BATCH 64
+
+static const uint64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL};
+
+static const uint8_t blake2b_sigma[12][16] = {
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+	{11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+	{7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+	{9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+	{2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+	{12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+	{13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+	{6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+	{10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+	{14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3}};
+
+typedef struct blake2b_mb_impl {
+	unsigned int enabled;
+	unsigned int cpu_flags;
+	const char *desc;
+	blake2b_mb_compress_func compress;
+} blake2b_mb_impl_t;
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#if defined(HAVE_AVX2) && defined(__x86_64__)
+void blake2b_mb_compress_avx2(uint64_t *h, const unsigned char *const *in,
+							  size_t nblocks, uint64_t t) __attribute__((__target__("avx2")));
+#define BLAKE2B_MB_AVX2 {0, CPUID_AVX2, "avx2", blake2b_mb_compress_avx2}
+#endif
+#endif
+
+static blake2b_mb_impl_t blake2b_mb_list[] = {
+	/* Reference implementation hashes messages one by one via libsodium */
+	{0, 0, "ref", NULL},
+#ifdef BLAKE2B_MB_AVX2
+	BLAKE2B_MB_AVX2,
+#endif
+};
+
+static const blake2b_mb_impl_t *blake2b_mb_opt = &blake2b_mb_list[0];
+
+const char *
+blake2b_load(void)
+{
+	unsigned int i;
+
+	blake2b_mb_opt = &blake2b_mb_list[0];
+	blake2b_mb_list[0].enabled = true;
+
+	/* Could be reloaded with a reduced cpu_config, e.g. by benchmarks */
+	for (i = 1; i < G_N_ELEMENTS(blake2b_mb_list); i++) {
+		blake2b_mb_list[i].enabled = false;
+
+		if (cpu_config & blake2b_mb_list[i].cpu_flags) {
+			blake2b_mb_list[i].enabled = true;
+			blake2b_mb_opt = &blake2b_mb_list[i];
+		}
+	}
+
+	return blake2b_mb_opt->desc;
+}
+
+static inline uint64_t
+blake2b_load64(const unsigned char *p)
+{
+	return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) |
+		   ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		   ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) |
+		   ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint64_t
+blake2b_rotr64(uint64_t w, unsigned int c)
+{
+	return (w >> c) | (w << (64 - c));
+}
+
+#define G(r, i, a, b, c, d)                         \
+	do {                                            \
+		a = a + b + m[blake2b_sigma[r][2 * i + 0]]; \
+		d = blake2b_rotr64(d ^ a, 32);              \
+		c = c + d;                                  \
+		b = blake2b_rotr64(b ^ c, 24);              \
+		a = a + b + m[blake2b_sigma[r][2 * i + 1]]; \
+		d = blake2b_rotr64(d ^ a, 16);              \
+		c = c + d;                                  \
+		b = blake2b_rotr64(b ^ c, 63);              \
+	} while (0)
+
+static void
+blake2b_compress(uint64_t h[8], const unsigned char *block, uint64_t t, uint64_t f)
+{
+	uint64_t m[16], v[16];
+	unsigned int i, r;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = blake2b_load64(block + i * sizeof(uint64_t));
+	}
+
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = blake2b_iv[i];
+	}
+
+	v[12] ^= t;
+	v[14] ^= f;
+
+	for (r = 0; r < 12; r++) {
+		G(r, 0, v[0], v[4], v[8], v[12]);
+		G(r, 1, v[1], v[5], v[9], v[13]);
+		G(r, 2, v[2], v[6], v[10], v[14]);
+		G(r, 3, v[3], v[7], v[11], v[15]);
+		G(r, 4, v[0], v[5], v[10], v[15]);
+		G(r, 5, v[1], v[6], v[11], v[12]);
+		G(r, 6, v[2], v[7], v[8], v[13]);
+		G(r, 7, v[3], v[4], v[9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+#undef G
+
+/*
+ * Hashes the rest of the message starting from the block `done`, the message is
+ * prepended with the key block for keyed hashing
+ */
+static void
+blake2b_mb_finish(uint64_t h[8], const unsigned char *keyblock,
+				  const unsigned char *data, gsize len, gsize done,
+				  unsigned char *out)
+{
+	gsize kblen = keyblock ? BLAKE2B_BLOCKBYTES : 0, total = kblen + len;
+	gsize off = done * BLAKE2B_BLOCKBYTES;
+	unsigned char last[BLAKE2B_BLOCKBYTES];
+	unsigned int i;
+
+	while (total - off > BLAKE2B_BLOCKBYTES) {
+		const unsigned char *blk = (off < kblen) ? keyblock : data + (off - kblen);
+
+		off += BLAKE2B_BLOCKBYTES;
+		blake2b_compress(h, blk, off, 0);
+	}
+
+	memset(last, 0, sizeof(last));
+
+	if (off < kblen) {
+		/* Empty keyed message */
+		memcpy(last, keyblock, BLAKE2B_BLOCKBYTES);
+	}
+	else if (total > off) {
+		memcpy(last, data + (off - kblen), total - off);
+	}
+
+	blake2b_compress(h, last, total, ~0ULL);
+
+	for (i = 0; i < 8; i++) {
+		uint64_t w = h[i];
+
+		for (unsigned int j = 0; j < 8; j++) {
+			out[i * 8 + j] = (unsigned char) (w >> (j * 8));
+		}
+	}
+}
+
+static void
+blake2b_mb_hash_lanes(const blake2b_mb_impl_t *impl,
+					  unsigned char *out,
+					  const struct rspamd_cryptobox_segment *segments,
+					  const gsize *idx, unsigned int nlanes,
+					  const unsigned char *keyblock, gsize keylen)
+{
+	uint64_t h[8 * BLAKE2B_MB_LANES], lane_h[8];
+	const unsigned char *in[BLAKE2B_MB_LANES];
+	gsize kblocks = keyblock ? 1 : 0, common = G_MAXSIZE, done = 0;
+	unsigned int lane, i;
+
+	for (lane = 0; lane < nlanes; lane++) {
+		/* The last block is always processed as final */
+		gsize total = kblocks * BLAKE2B_BLOCKBYTES + segments[idx[lane]].len;
+		gsize nblocks = total > 0 ? (total - 1) / BLAKE2B_BLOCKBYTES : 0;
+
+		common = MIN(common, nblocks);
+	}
+
+	if (nlanes < 2 || common == 0) {
+		/* Nothing to parallelize */
+		for (lane = 0; lane < nlanes; lane++) {
+			rspamd_cryptobox_hash(out + idx[lane] * rspamd_cryptobox_HASHBYTES,
+								  segments[idx[lane]].data, segments[idx[lane]].len,
+								  keyblock, keylen);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < 8; i++) {
+		uint64_t w = blake2b_iv[i];
+
+		if (i == 0) {
+			w ^= 0x01010000ULL ^ (keylen << 8) ^ BLAKE2B_OUTBYTES;
+		}
+
+		for (lane = 0; lane < BLAKE2B_MB_LANES; lane++) {
+			h[i * BLAKE2B_MB_LANES + lane] = w;
+		}
+	}
+
+	if (keyblock) {
+		for (lane = 0; lane < BLAKE2B_MB_LANES; lane++) {
+			in[lane] = keyblock;
+		}
+
+		impl->compress(h, in, 1, 0);
+		done = 1;
+	}
+
+	/* Unused lanes just repeat the first message */
+	for (lane = 0; lane < BLAKE2B_MB_LANES; lane++) {
+		in[lane] = segments[idx[lane < nlanes ? lane : 0]].data;
+	}
+
+	impl->compress(h, in, common - done, done * BLAKE2B_BLOCKBYTES);
+
+	for (lane = 0; lane < nlanes; lane++) {
+		for (i = 0; i < 8; i++) {
+			lane_h[i] = h[i * BLAKE2B_MB_LANES + lane];
+		}
+
+		blake2b_mb_finish(lane_h, keyblock, segments[idx[lane]].data,
+						  segments[idx[lane]].len, common,
+						  out + idx[lane] * rspamd_cryptobox_HASHBYTES);
+	}
+}
+
+void rspamd_cryptobox_hash_multi(unsigned char *out,
+								 const struct rspamd_cryptobox_segment *segments,
+								 gsize cnt,
+								 const unsigned char *key,
+								 gsize keylen)
+{
+	const blake2b_mb_impl_t *impl = blake2b_mb_opt;
+	unsigned char keyblock[BLAKE2B_BLOCKBYTES];
+	gsize idx[BLAKE2B_MB_BATCH], i, j, batch_start, batch_len;
+
+	if (key == NULL || keylen == 0) {
+		key = NULL;
+		keylen = 0;
+	}
+
+	if (impl->compress == NULL || keylen > BLAKE2B_KEYBYTES || cnt < 2) {
+		for (i = 0; i < cnt; i++) {
+			rspamd_cryptobox_hash(out + i * rspamd_cryptobox_HASHBYTES,
+								  segments[i].data, segments[i].len, key, keylen);
+		}
+
+		return;
+	}
+
+	if (key) {
+		memset(keyblock, 0, sizeof(keyblock));
+		memcpy(keyblock, key, keylen);
+	}
+
+	for (batch_start = 0; batch_start < cnt; batch_start += batch_len) {
+		batch_len = MIN(cnt - batch_start, BLAKE2B_MB_BATCH);
+
+		/* Insertion sort by length, so lanes are not stalled by short messages */
+		for (i = 0; i < batch_len; i++) {
+			gsize cur = batch_start + i;
+
+			for (j = i; j > 0 && segments[idx[j - 1]].len < segments[cur].len; j--) {
+				idx[j] = idx[j - 1];
+			}
+
+			idx[j] = cur;
+		}
+
+		for (i = 0; i < batch_len; i += BLAKE2B_MB_LANES) {
+			blake2b_mb_hash_lanes(impl, out, segments, &idx[i],
+								  MIN(batch_len - i, BLAKE2B_MB_LANES),
+								  key ? keyblock : NULL, keylen);
+		}
+	}
+
+	if (key) {
+		rspamd_explicit_memzero(keyblock, sizeof(keyblock));
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBCRYPTOBOX_BLAKE2_BLAKE2_H_
+#define SRC_LIBCRYPTOBOX_BLAKE2_BLAKE2_H_
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLAKE2B_BLOCKBYTES 128
+#define BLAKE2B_OUTBYTES 64
+#define BLAKE2B_KEYBYTES 64
+/* Number of independent messages processed in parallel by SIMD implementations */
+#define BLAKE2B_MB_LANES 4
+
+/*
+ * Multi-buffer compression function: processes `nblocks` consecutive non-final
+ * blocks from each of BLAKE2B_MB_LANES inputs. `h` holds states interleaved by
+ * words: h[word * BLAKE2B_MB_LANES + lane], `t` is the counter before the first block
+ */
+typedef void (*blake2b_mb_compress_func)(uint64_t *h,
+										 const unsigned char *const *in,
+										 size_t nblocks, uint64_t t);
+
+/*
+ * Selects multi-buffer implementation according to the cpu features,
+ * returns its description
+ */
+const char *blake2b_load(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_LIBCRYPTOBOX_BLAKE2_BLAKE2_H_ */
@@ -25,6 +25,7 @@
 #include "chacha20/chacha.h"
 #include "catena/catena.h"
 #include "base64/base64.h"
+#include "blake2/blake2.h"
 #include "ottery.h"
 #include "printf.h"
 #define XXH_INLINE_ALL
@@ -306,6 +307,7 @@ rspamd_cryptobox_init(void)
 
 	ctx->chacha20_impl = chacha_load();
 	ctx->base64_impl = base64_load();
+	ctx->blake2b_impl = blake2b_load();
 #if defined(HAVE_USABLE_OPENSSL) && (OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER))
 	/* Needed for old openssl api, not sure about LibreSSL */
 	ERR_load_EC_strings();
@@ -623,6 +625,30 @@ bool rspamd_cryptobox_verify(const unsigned char *sig,
 	return ret;
 }
 
+gsize rspamd_cryptobox_verify_many(const struct rspamd_cryptobox_verify_req *reqs,
+								   gsize n,
+								   bool *results,
+								   enum rspamd_cryptobox_mode mode)
+{
+	gsize i, nvalid = 0;
+
+	/*
+	 * libsodium does not expose group operations required for a real batch
+	 * (multi-scalar) verification, so signatures are verified one by one
+	 */
+	for (i = 0; i < n; i++) {
+		results[i] = rspamd_cryptobox_verify(reqs[i].sig, reqs[i].siglen,
+											 reqs[i].m, reqs[i].mlen,
+											 reqs[i].pk, mode);
+
+		if (results[i]) {
+			nvalid++;
+		}
+	}
+
+	return nvalid;
+}
+
 static gsize
 rspamd_cryptobox_encrypt_ctx_len(enum rspamd_cryptobox_mode mode)
 {
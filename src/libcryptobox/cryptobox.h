@@ -76,6 +76,7 @@ struct rspamd_cryptobox_library_ctx {
 	char *cpu_extensions;
 	const char *chacha20_impl;
 	const char *base64_impl;
+	const char *blake2b_impl;
 	unsigned long cpu_config;
 };
 
@@ -222,6 +223,27 @@ bool rspamd_cryptobox_verify(const unsigned char *sig,
 							 const rspamd_pk_t pk,
 							 enum rspamd_cryptobox_mode mode);
 
+struct rspamd_cryptobox_verify_req {
+	const unsigned char *sig;
+	gsize siglen;
+	const unsigned char *m;
+	gsize mlen;
+	const unsigned char *pk;
+};
+
+/**
+ * Verifies many signatures one by one, a convenience wrapper over
+ * rspamd_cryptobox_verify
+ * @param reqs array of signatures, messages and public keys
+ * @param n number of elements in `reqs`
+ * @param results output array of `n` elements, true for valid signatures
+ * @return number of valid signatures
+ */
+gsize rspamd_cryptobox_verify_many(const struct rspamd_cryptobox_verify_req *reqs,
+								   gsize n,
+								   bool *results,
+								   enum rspamd_cryptobox_mode mode);
+
 /**
  * Securely clear the buffer specified
  * @param buf buffer to zero
@@ -345,6 +367,22 @@ void rspamd_cryptobox_hash(unsigned char *out,
 						   const unsigned char *key,
 						   gsize keylen);
 
+/**
+ * Hashes `cnt` independent messages, output is the same as for
+ * `rspamd_cryptobox_hash` called for each segment. Messages are processed
+ * in parallel if SIMD implementation is available
+ * @param out output buffer of `cnt * rspamd_cryptobox_HASHBYTES` length
+ * @param segments input messages
+ * @param cnt number of messages
+ * @param key optional key (NULL for non-keyed hash)
+ * @param keylen length of the key
+ */
+void rspamd_cryptobox_hash_multi(unsigned char *out,
+								 const struct rspamd_cryptobox_segment *segments,
+								 gsize cnt,
+								 const unsigned char *key,
+								 gsize keylen);
+
 enum rspamd_cryptobox_fast_hash_type {
 	RSPAMD_CRYPTOBOX_XXHASH64 = 0,
 	RSPAMD_CRYPTOBOX_XXHASH32,
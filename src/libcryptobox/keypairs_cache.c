@@ -26,6 +26,7 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	struct rspamd_keypair_cache_stat stat;
 };
 
 static void
@@ -65,6 +66,7 @@ rspamd_keypair_cache_new(unsigned int max_items)
 	c = g_malloc0(sizeof(*c));
 	c->hash = rspamd_lru_hash_new_full(max_items, NULL,
 									   rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
+	c->stat.max_size = max_items;
 
 	return c;
 }
@@ -93,6 +95,7 @@ void rspamd_keypair_cache_process(struct rspamd_keypair_cache *c,
 	}
 
 	if (new == NULL) {
+		c->stat.misses++;
 		new = g_malloc0(sizeof(*new));
 
 		if (posix_memalign((void **) &new->nm, 32, sizeof(*new->nm)) != 0) {
@@ -125,6 +128,9 @@ void rspamd_keypair_cache_process(struct rspamd_keypair_cache *c,
 
 		rspamd_lru_hash_insert(c->hash, new, new, time(NULL), -1);
 	}
+	else {
+		c->stat.hits++;
+	}
 
 	g_assert(new != NULL);
 
@@ -132,6 +138,93 @@ void rspamd_keypair_cache_process(struct rspamd_keypair_cache *c,
 	REF_RETAIN(rk->nm);
 }
 
+static inline void
+rspamd_keypair_cache_fill_pair(struct rspamd_keypair_elt *elt,
+							   struct rspamd_cryptobox_keypair *lk,
+							   struct rspamd_cryptobox_pubkey *rk)
+{
+	memcpy(elt->pair, rk->id, rspamd_cryptobox_HASHBYTES);
+	memcpy(&elt->pair[rspamd_cryptobox_HASHBYTES], lk->id,
+		   rspamd_cryptobox_HASHBYTES);
+}
+
+gboolean
+rspamd_keypair_cache_lookup(struct rspamd_keypair_cache *c,
+							struct rspamd_cryptobox_keypair *lk,
+							struct rspamd_cryptobox_pubkey *rk)
+{
+	struct rspamd_keypair_elt search, *found;
+
+	g_assert(lk != NULL);
+	g_assert(rk != NULL);
+
+	memset(&search, 0, sizeof(search));
+	rspamd_keypair_cache_fill_pair(&search, lk, rk);
+	found = rspamd_lru_hash_lookup(c->hash, &search, time(NULL));
+
+	if (found == NULL) {
+		c->stat.misses++;
+
+		return FALSE;
+	}
+
+	c->stat.hits++;
+
+	if (rk->nm) {
+		REF_RELEASE(rk->nm);
+	}
+
+	rk->nm = found->nm;
+	REF_RETAIN(rk->nm);
+
+	return TRUE;
+}
+
+void rspamd_keypair_cache_store(struct rspamd_keypair_cache *c,
+								struct rspamd_cryptobox_keypair *lk,
+								struct rspamd_cryptobox_pubkey *rk)
+{
+	struct rspamd_keypair_elt *new;
+
+	g_assert(lk != NULL);
+	g_assert(rk != NULL);
+	g_assert(rk->nm != NULL);
+
+	new = g_malloc0(sizeof(*new));
+	rspamd_keypair_cache_fill_pair(new, lk, rk);
+
+	/* Keys are not owned by the hash, so we cannot replace an existing element */
+	if (rspamd_lru_hash_lookup(c->hash, new, time(NULL)) != NULL) {
+		g_free(new);
+
+		return;
+	}
+
+	new->nm = rk->nm;
+	REF_RETAIN(new->nm);
+
+	rspamd_lru_hash_insert(c->hash, new, new, time(NULL), -1);
+}
+
+void rspamd_keypair_cache_preload(struct rspamd_keypair_cache *c,
+								  struct rspamd_cryptobox_keypair *lk,
+								  struct rspamd_cryptobox_pubkey *rk)
+{
+	struct rspamd_keypair_cache_stat saved = c->stat;
+
+	/* Preloading should not affect hit rate */
+	rspamd_keypair_cache_process(c, lk, rk);
+	c->stat = saved;
+	c->stat.preloaded++;
+}
+
+void rspamd_keypair_cache_get_stat(struct rspamd_keypair_cache *c,
+								   struct rspamd_keypair_cache_stat *st)
+{
+	*st = c->stat;
+	st->size = rspamd_lru_hash_size(c->hash);
+}
+
 void rspamd_keypair_cache_destroy(struct rspamd_keypair_cache *c)
 {
 	if (c != NULL) {
@@ -26,6 +26,14 @@ extern "C" {
 
 struct rspamd_keypair_cache;
 
+struct rspamd_keypair_cache_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t preloaded;
+	unsigned int size;
+	unsigned int max_size;
+};
+
 /**
  * Create new keypair cache of the specified size
  * @param max_items defines maximum count of elements in the cache
@@ -44,6 +52,45 @@ void rspamd_keypair_cache_process(struct rspamd_keypair_cache *c,
 								  struct rspamd_cryptobox_keypair *lk,
 								  struct rspamd_cryptobox_pubkey *rk);
 
+/**
+ * Sets cached beforenm value for the remote key without calculating it
+ * @param c cache of keypairs
+ * @param lk local key
+ * @param rk remote key
+ * @return TRUE if the value has been found in the cache
+ */
+gboolean rspamd_keypair_cache_lookup(struct rspamd_keypair_cache *c,
+									 struct rspamd_cryptobox_keypair *lk,
+									 struct rspamd_cryptobox_pubkey *rk);
+
+/**
+ * Stores beforenm value of the remote key calculated elsewhere (e.g. by
+ * `rspamd_pubkey_calculate_nm` in another thread)
+ * @param c cache of keypairs
+ * @param lk local key
+ * @param rk remote key with nm set
+ */
+void rspamd_keypair_cache_store(struct rspamd_keypair_cache *c,
+								struct rspamd_cryptobox_keypair *lk,
+								struct rspamd_cryptobox_pubkey *rk);
+
+/**
+ * Calculates and stores beforenm value for a known remote key in advance,
+ * so the first request from this peer does not need ECDH
+ * @param c cache of keypairs
+ * @param lk local key
+ * @param rk remote key
+ */
+void rspamd_keypair_cache_preload(struct rspamd_keypair_cache *c,
+								  struct rspamd_cryptobox_keypair *lk,
+								  struct rspamd_cryptobox_pubkey *rk);
+
+/**
+ * Returns usage statistics of the cache
+ */
+void rspamd_keypair_cache_get_stat(struct rspamd_keypair_cache *c,
+								   struct rspamd_keypair_cache_stat *st);
+
 /**
  * Destroy old keypair cache
  * @param c cache object
@@ -19,6 +19,8 @@
 #include "task.h"
 #include "archives.h"
 #include "libmime/mime_encoding.h"
+#include "libmime/mime_parser.h"
+#include "libutil/hash.h"
 #include <unicode/uchar.h>
 #include <unicode/utf8.h>
 #include <unicode/utf16.h>
@@ -34,6 +36,26 @@
 
 INIT_LOG_MODULE(archive)
 
+/* Listings of archives already seen by this worker */
+#define RSPAMD_ARCHIVES_CACHE_SIZE 1024
+#define RSPAMD_ARCHIVES_CACHE_TTL 3600
+/* Per message limits for archives inspection */
+#define RSPAMD_ARCHIVES_MAX_BYTES (256 * 1024 * 1024)
+#define RSPAMD_ARCHIVES_MAX_TIME 0.5
+
+struct rspamd_archive_cache_key {
+	unsigned char digest[rspamd_cryptobox_HASHBYTES];
+	enum rspamd_archive_type type;
+};
+
+struct rspamd_archive_cache_elt {
+	gboolean is_archive; /* FALSE if a part has not been recognised */
+	enum rspamd_archive_flags flags;
+	GPtrArray *files; /* Array of struct rspamd_archive_file */
+};
+
+static rspamd_lru_hash_t *archives_cache = NULL;
+
 static void
 rspamd_archive_dtor(gpointer p)
 {
@@ -54,6 +76,158 @@ rspamd_archive_dtor(gpointer p)
 	g_ptr_array_free(arch->files, TRUE);
 }
 
+static unsigned int
+rspamd_archive_cache_hash(gconstpointer p)
+{
+	const struct rspamd_archive_cache_key *key = p;
+
+	/* Digest is a cryptographic hash, so its prefix is good enough */
+	return (unsigned int) rspamd_cryptobox_fast_hash(key->digest,
+													 sizeof(uint64_t), key->type);
+}
+
+static gboolean
+rspamd_archive_cache_equal(gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_archive_cache_key *k1 = a, *k2 = b;
+
+	return k1->type == k2->type &&
+		   memcmp(k1->digest, k2->digest, sizeof(k1->digest)) == 0;
+}
+
+static void
+rspamd_archive_cache_elt_dtor(gpointer p)
+{
+	struct rspamd_archive_cache_elt *elt = p;
+	struct rspamd_archive_file *f;
+	unsigned int i;
+
+	if (elt->files) {
+		PTR_ARRAY_FOREACH(elt->files, i, f)
+		{
+			if (f->fname) {
+				g_string_free(f->fname, TRUE);
+			}
+
+			g_free(f);
+		}
+
+		g_ptr_array_free(elt->files, TRUE);
+	}
+
+	g_free(elt);
+}
+
+static GPtrArray *
+rspamd_archive_files_copy(GPtrArray *files)
+{
+	GPtrArray *res;
+	struct rspamd_archive_file *f, *nf;
+	unsigned int i;
+
+	res = g_ptr_array_sized_new(files->len);
+
+	PTR_ARRAY_FOREACH(files, i, f)
+	{
+		nf = g_malloc(sizeof(*nf));
+		memcpy(nf, f, sizeof(*nf));
+		if (f->fname) {
+			nf->fname = g_string_new_len(f->fname->str, f->fname->len);
+		}
+		g_ptr_array_add(res, nf);
+	}
+
+	return res;
+}
+
+static void
+rspamd_archive_cache_key_init(struct rspamd_archive_cache_key *key,
+							  struct rspamd_mime_part *part,
+							  enum rspamd_archive_type type)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(key->digest, part->digest, sizeof(key->digest));
+	key->type = type;
+}
+
+/*
+ * Restores the result of archive processing from the cache, returns FALSE
+ * if a part has not been processed before
+ */
+static gboolean
+rspamd_archive_cache_restore(struct rspamd_task *task,
+							 struct rspamd_mime_part *part,
+							 enum rspamd_archive_type type)
+{
+	struct rspamd_archive_cache_key key;
+	struct rspamd_archive_cache_elt *elt;
+	struct rspamd_archive *arch;
+
+	if (archives_cache == NULL) {
+		return FALSE;
+	}
+
+	rspamd_archive_cache_key_init(&key, part, type);
+	elt = rspamd_lru_hash_lookup(archives_cache, &key, (time_t) task->task_timestamp);
+
+	if (elt == NULL) {
+		return FALSE;
+	}
+
+	if (elt->is_archive) {
+		arch = rspamd_mempool_alloc0(task->task_pool, sizeof(*arch));
+		arch->files = rspamd_archive_files_copy(elt->files);
+		arch->type = type;
+		arch->flags = elt->flags;
+		arch->size = part->parsed_data.len;
+
+		if (part->cd) {
+			arch->archive_name = &part->cd->filename;
+		}
+
+		rspamd_mempool_add_destructor(task->task_pool, rspamd_archive_dtor,
+									  arch);
+		part->part_type = RSPAMD_MIME_PART_ARCHIVE;
+		part->specific.arch = arch;
+	}
+
+	msg_debug_archive("restored %s archive from the cache: %d files",
+					  rspamd_archive_type_str(type),
+					  elt->is_archive ? (int) elt->files->len : 0);
+
+	return TRUE;
+}
+
+static void
+rspamd_archive_cache_save(struct rspamd_task *task,
+						  struct rspamd_mime_part *part,
+						  enum rspamd_archive_type type)
+{
+	struct rspamd_archive_cache_key *key;
+	struct rspamd_archive_cache_elt *elt;
+
+	if (archives_cache == NULL) {
+		archives_cache = rspamd_lru_hash_new_full(RSPAMD_ARCHIVES_CACHE_SIZE,
+												  g_free, rspamd_archive_cache_elt_dtor,
+												  rspamd_archive_cache_hash, rspamd_archive_cache_equal);
+	}
+
+	key = g_malloc(sizeof(*key));
+	rspamd_archive_cache_key_init(key, part, type);
+	elt = g_malloc0(sizeof(*elt));
+
+	if (part->part_type == RSPAMD_MIME_PART_ARCHIVE && part->specific.arch) {
+		struct rspamd_archive *arch = part->specific.arch;
+
+		elt->is_archive = TRUE;
+		elt->flags = arch->flags;
+		elt->files = rspamd_archive_files_copy(arch->files);
+	}
+
+	rspamd_lru_hash_insert(archives_cache, key, elt, (time_t) task->task_timestamp,
+						   RSPAMD_ARCHIVES_CACHE_TTL);
+}
+
 static bool
 rspamd_archive_file_try_utf(struct rspamd_task *task,
 							struct rspamd_archive *arch,
@@ -173,42 +347,53 @@ static void
 rspamd_archive_process_zip(struct rspamd_task *task,
 						   struct rspamd_mime_part *part)
 {
-	const unsigned char *p, *start, *end, *eocd = NULL, *cd;
+	const unsigned char *p, *eocd = NULL, *cd, *cd_end;
 	const uint32_t eocd_magic = 0x06054b50, cd_basic_len = 46;
 	const unsigned char cd_magic[] = {0x50, 0x4b, 0x01, 0x02};
 	const unsigned int max_processed = 1024;
 	uint32_t cd_offset, cd_size, comp_size, uncomp_size, processed = 0;
 	uint16_t extra_len, fname_len, comment_len;
+	gsize len, tail_len, tail_offset, off, eocd_offset = 0;
+	rspamd_ftok_t tail, cd_span;
 	struct rspamd_archive *arch;
 	struct rspamd_archive_file *f = NULL;
 
-	/* Zip files have interesting data at the end of archive */
-	p = part->parsed_data.begin + part->parsed_data.len - 1;
-	start = part->parsed_data.begin;
-	end = p;
-
-	/* Search for EOCD:
-	 * 22 bytes is a typical size of eocd without a comment and
-	 * end points one byte after the last character
+	/*
+	 * Zip files have interesting data at the end of archive, so we read
+	 * merely the end of central directory and the central directory itself
+	 * and do not need the whole part to be decoded
 	 */
-	p -= 21;
+	len = part->parsed_data.len;
+	tail_len = MIN(len, max_processed + 22);
+	tail_offset = len - tail_len;
 
-	while (p > start + sizeof(uint32_t)) {
+	if (!rspamd_mime_part_get_content_span(part, tail_offset, tail_len, &tail) ||
+		tail.len != tail_len) {
+		msg_info_task("zip archive is invalid (cannot read EOCD)");
+
+		return;
+	}
+
+	/* Search for EOCD: 22 bytes is a typical size of eocd without a comment */
+	off = len > 22 ? len - 22 : 0;
+
+	while (off > sizeof(uint32_t)) {
 		uint32_t t;
 
 		if (processed > max_processed) {
 			break;
 		}
 
-		/* XXX: not an efficient approach */
+		p = (const unsigned char *) tail.begin + (off - tail_offset);
 		memcpy(&t, p, sizeof(t));
 
 		if (GUINT32_FROM_LE(t) == eocd_magic) {
 			eocd = p;
+			eocd_offset = off;
 			break;
 		}
 
-		p--;
+		off--;
 		processed++;
 	}
 
@@ -220,7 +405,7 @@ rspamd_archive_process_zip(struct rspamd_task *task,
 		return;
 	}
 
-	if (end - eocd < 21) {
+	if (len - 1 - eocd_offset < 21) {
 		msg_info_task("zip archive is invalid (short EOCD)");
 
 		return;
@@ -233,13 +418,28 @@ rspamd_archive_process_zip(struct rspamd_task *task,
 	cd_offset = GUINT32_FROM_LE(cd_offset);
 
 	/* We need to check sanity as well */
-	if (cd_offset + cd_size > (unsigned int) (eocd - start)) {
+	if ((gsize) cd_offset + cd_size > eocd_offset) {
 		msg_info_task("zip archive is invalid (bad size/offset for CD)");
 
 		return;
 	}
 
-	cd = start + cd_offset;
+	/* Records are allowed to span up to EOCD */
+	if (eocd_offset == cd_offset) {
+		/* Empty archive */
+		cd_span.begin = (const char *) eocd;
+		cd_span.len = 0;
+	}
+	else if (!rspamd_mime_part_get_content_span(part, cd_offset,
+												eocd_offset - cd_offset, &cd_span) ||
+			 cd_span.len != eocd_offset - cd_offset) {
+		msg_info_task("zip archive is invalid (cannot read CD)");
+
+		return;
+	}
+
+	cd = (const unsigned char *) cd_span.begin;
+	cd_end = cd + cd_span.len;
 
 	arch = rspamd_mempool_alloc0(task->task_pool, sizeof(*arch));
 	arch->files = g_ptr_array_new();
@@ -250,11 +450,11 @@ rspamd_archive_process_zip(struct rspamd_task *task,
 	rspamd_mempool_add_destructor(task->task_pool, rspamd_archive_dtor,
 								  arch);
 
-	while (cd < start + cd_offset + cd_size) {
+	while (cd < (const unsigned char *) cd_span.begin + cd_size) {
 		uint16_t flags;
 
 		/* Read central directory record */
-		if (eocd - cd < cd_basic_len ||
+		if (cd_end - cd < cd_basic_len ||
 			memcmp(cd, cd_magic, sizeof(cd_magic)) != 0) {
 			msg_info_task("zip archive is invalid (bad cd record)");
 
@@ -274,7 +474,7 @@ rspamd_archive_process_zip(struct rspamd_task *task,
 		memcpy(&comment_len, cd + 32, sizeof(comment_len));
 		comment_len = GUINT16_FROM_LE(comment_len);
 
-		if (cd + fname_len + comment_len + extra_len + cd_basic_len > eocd) {
+		if (cd + fname_len + comment_len + extra_len + cd_basic_len > cd_end) {
 			msg_info_task("zip archive is invalid (too large cd record)");
 
 			return;
@@ -585,6 +785,7 @@ rspamd_archive_process_rar(struct rspamd_task *task,
 	struct rspamd_archive_file *f;
 	int r;
 
+	rspamd_mime_part_get_content(part);
 	p = part->parsed_data.begin;
 	end = p + part->parsed_data.len;
 
@@ -1736,6 +1937,7 @@ rspamd_archive_process_7zip(struct rspamd_task *task,
 	const unsigned char sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 	uint64_t section_offset = 0, section_length = 0;
 
+	rspamd_mime_part_get_content(part);
 	start = part->parsed_data.begin;
 	p = start;
 	end = p + part->parsed_data.len;
@@ -1797,6 +1999,7 @@ rspamd_archive_process_gzip(struct rspamd_task *task,
 	const unsigned char gz_magic[] = {0x1F, 0x8B};
 	unsigned char flags;
 
+	rspamd_mime_part_get_content(part);
 	start = part->parsed_data.begin;
 	p = start;
 	end = p + part->parsed_data.len;
@@ -1950,6 +2153,19 @@ set:
 	arch->size = part->parsed_data.len;
 }
 
+static gboolean
+rspamd_archive_part_has_magic(struct rspamd_mime_part *part,
+							  const unsigned char *magic, gsize magic_len)
+{
+	rspamd_ftok_t head;
+
+	/* Part might be not decoded yet, so we decode merely its beginning */
+	return part->parsed_data.len > magic_len &&
+		   rspamd_mime_part_get_content_span(part, 0, magic_len, &head) &&
+		   head.len == magic_len &&
+		   memcmp(head.begin, magic, magic_len) == 0;
+}
+
 static gboolean
 rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const char *str,
 							const unsigned char *magic_start, gsize magic_len)
@@ -1966,9 +2182,7 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const char *str,
 											 str, strlen(str)) != -1) {
 			/* We still need to check magic, see #1848 */
 			if (magic_start != NULL) {
-				if (part->parsed_data.len > magic_len &&
-					memcmp(part->parsed_data.begin,
-						   magic_start, magic_len) == 0) {
+				if (rspamd_archive_part_has_magic(part, magic_start, magic_len)) {
 					return TRUE;
 				}
 				/* No magic, refuse this type of archive */
@@ -1989,9 +2203,7 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const char *str,
 			if (rspamd_lc_cmp(p, str, strlen(str)) == 0) {
 				if (*(p - 1) == '.') {
 					if (magic_start != NULL) {
-						if (part->parsed_data.len > magic_len &&
-							memcmp(part->parsed_data.begin,
-								   magic_start, magic_len) == 0) {
+						if (rspamd_archive_part_has_magic(part, magic_start, magic_len)) {
 							return TRUE;
 						}
 						/* No magic, refuse this type of archive */
@@ -2004,16 +2216,14 @@ rspamd_archive_cheat_detect(struct rspamd_mime_part *part, const char *str,
 		}
 
 		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len &&
-				memcmp(part->parsed_data.begin, magic_start, magic_len) == 0) {
+			if (rspamd_archive_part_has_magic(part, magic_start, magic_len)) {
 				return TRUE;
 			}
 		}
 	}
 	else {
 		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len &&
-				memcmp(part->parsed_data.begin, magic_start, magic_len) == 0) {
+			if (rspamd_archive_part_has_magic(part, magic_start, magic_len)) {
 				return TRUE;
 			}
 		}
@@ -2030,26 +2240,66 @@ void rspamd_archives_process(struct rspamd_task *task)
 	const unsigned char zip_magic[] = {0x50, 0x4b, 0x03, 0x04};
 	const unsigned char sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 	const unsigned char gz_magic[] = {0x1F, 0x8B, 0x08};
+	void (*process_func)(struct rspamd_task *, struct rspamd_mime_part *);
+	enum rspamd_archive_type type = RSPAMD_ARCHIVE_ZIP;
+	gsize processed_bytes = 0;
+	double start_time = rspamd_get_virtual_ticks();
+
+	if (task->flags & RSPAMD_TASK_FLAG_MEMORY_PRESSURE) {
+		/* Unpacking could take a lot of memory, so archives are not inspected */
+		msg_debug_archive("skip archives processing due to memory pressure");
+		return;
+	}
 
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
 	{
 		if (part->part_type == RSPAMD_MIME_PART_UNDEFINED) {
 			if (part->parsed_data.len > 0) {
+				process_func = NULL;
+
 				if (rspamd_archive_cheat_detect(part, "zip",
 												zip_magic, sizeof(zip_magic))) {
-					rspamd_archive_process_zip(task, part);
+					process_func = rspamd_archive_process_zip;
+					type = RSPAMD_ARCHIVE_ZIP;
 				}
 				else if (rspamd_archive_cheat_detect(part, "rar",
 													 rar_magic, sizeof(rar_magic))) {
-					rspamd_archive_process_rar(task, part);
+					process_func = rspamd_archive_process_rar;
+					type = RSPAMD_ARCHIVE_RAR;
 				}
 				else if (rspamd_archive_cheat_detect(part, "7z",
 													 sz_magic, sizeof(sz_magic))) {
-					rspamd_archive_process_7zip(task, part);
+					process_func = rspamd_archive_process_7zip;
+					type = RSPAMD_ARCHIVE_7ZIP;
 				}
 				else if (rspamd_archive_cheat_detect(part, "gz",
 													 gz_magic, sizeof(gz_magic))) {
-					rspamd_archive_process_gzip(task, part);
+					process_func = rspamd_archive_process_gzip;
+					type = RSPAMD_ARCHIVE_GZIP;
+				}
+
+				if (process_func == NULL) {
+					continue;
+				}
+
+				/* Gzip file name can be taken from a part, so it is not cached */
+				if (type == RSPAMD_ARCHIVE_GZIP ||
+					!rspamd_archive_cache_restore(task, part, type)) {
+					if (processed_bytes + part->parsed_data.len > RSPAMD_ARCHIVES_MAX_BYTES ||
+						rspamd_get_virtual_ticks() - start_time > RSPAMD_ARCHIVES_MAX_TIME) {
+						msg_info_task("skip %s archive of size %z: archives processing "
+									  "limits are reached",
+									  rspamd_archive_type_str(type),
+									  part->parsed_data.len);
+						continue;
+					}
+
+					processed_bytes += part->parsed_data.len;
+					process_func(task, part);
+
+					if (type != RSPAMD_ARCHIVE_GZIP) {
+						rspamd_archive_cache_save(task, part, type);
+					}
 				}
 
 				if (part->ct && (part->ct->flags & RSPAMD_CONTENT_TYPE_TEXT) &&
@@ -17,6 +17,7 @@
 #include "images.h"
 #include "task.h"
 #include "message.h"
+#include "mime_parser.h"
 #include "libserver/html/html.h"
 
 #define msg_debug_images(...) rspamd_conditional_debug_fast(NULL, NULL,                                               \
@@ -29,11 +30,24 @@ INIT_LOG_MODULE(images)
 #ifdef USABLE_GD
 #include "gd.h"
 #include "hash.h"
+#include "libutil/shm_cache.h"
+#include "cryptobox.h"
+#include "platform_config.h"
 #include <math.h>
 
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+#include <immintrin.h>
+
+extern unsigned cpu_config;
+#endif
+
 #define RSPAMD_NORMALIZED_DIM 64
+/* DCT data does not depend on anything but the image itself */
+#define RSPAMD_IMAGES_SHARED_CACHE_TTL 86400
 
 static rspamd_lru_hash_t *images_hash = NULL;
+static rspamd_shm_cache_t *images_shared_hash = NULL;
+static gsize images_shared_hash_size = 0;
 #endif
 
 static const uint8_t png_signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
@@ -361,6 +375,176 @@ rspamd_image_dct_block(int pixels[8][8], double *out)
 	}
 }
 
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+static inline void
+rspamd_image_dct_transpose_avx2(__m256i r[8]) __attribute__((__target__("avx2")));
+static void
+rspamd_image_dct_pass_avx2(__m256i x[9]) __attribute__((__target__("avx2")));
+static void
+rspamd_image_dct_block_avx2(int pixels[8][8], double *out) __attribute__((__target__("avx2")));
+
+static inline void
+rspamd_image_dct_transpose_avx2(__m256i r[8])
+{
+	__m256i t0, t1, t2, t3, t4, t5, t6, t7;
+	__m256i u0, u1, u2, u3, u4, u5, u6, u7;
+
+	t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	u0 = _mm256_unpacklo_epi64(t0, t2);
+	u1 = _mm256_unpackhi_epi64(t0, t2);
+	u2 = _mm256_unpacklo_epi64(t1, t3);
+	u3 = _mm256_unpackhi_epi64(t1, t3);
+	u4 = _mm256_unpacklo_epi64(t4, t6);
+	u5 = _mm256_unpackhi_epi64(t4, t6);
+	u6 = _mm256_unpacklo_epi64(t5, t7);
+	u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/* Stages 1-3 of the scalar version for 8 rows or columns at once */
+static void
+rspamd_image_dct_pass_avx2(__m256i x[9])
+{
+	const __m256i c1 = _mm256_set1_epi32(1004), s1 = _mm256_set1_epi32(200),
+				  c3 = _mm256_set1_epi32(851), s3 = _mm256_set1_epi32(569),
+				  r2c6 = _mm256_set1_epi32(554), r2s6 = _mm256_set1_epi32(1337);
+	__m256i t;
+
+	/* Stage 1 */
+	x[8] = _mm256_add_epi32(x[7], x[0]);
+	x[0] = _mm256_sub_epi32(x[0], x[7]);
+	x[7] = _mm256_add_epi32(x[1], x[6]);
+	x[1] = _mm256_sub_epi32(x[1], x[6]);
+	x[6] = _mm256_add_epi32(x[2], x[5]);
+	x[2] = _mm256_sub_epi32(x[2], x[5]);
+	x[5] = _mm256_add_epi32(x[3], x[4]);
+	x[3] = _mm256_sub_epi32(x[3], x[4]);
+
+	/* Stage 2 */
+	x[4] = _mm256_add_epi32(x[8], x[5]);
+	x[8] = _mm256_sub_epi32(x[8], x[5]);
+	x[5] = _mm256_add_epi32(x[7], x[6]);
+	x[7] = _mm256_sub_epi32(x[7], x[6]);
+	t = _mm256_mullo_epi32(c1, _mm256_add_epi32(x[1], x[2]));
+	x[2] = _mm256_add_epi32(_mm256_mullo_epi32(
+								_mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), s1), c1), x[2]),
+							t);
+	x[1] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(s1, c1), x[1]), t);
+	t = _mm256_mullo_epi32(c3, _mm256_add_epi32(x[0], x[3]));
+	x[3] = _mm256_add_epi32(_mm256_mullo_epi32(
+								_mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), s3), c3), x[3]),
+							t);
+	x[0] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(s3, c3), x[0]), t);
+
+	/* Stage 3 */
+	x[6] = _mm256_add_epi32(x[4], x[5]);
+	x[4] = _mm256_sub_epi32(x[4], x[5]);
+	t = _mm256_mullo_epi32(r2c6, _mm256_add_epi32(x[7], x[8]));
+	x[7] = _mm256_add_epi32(_mm256_mullo_epi32(
+								_mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), r2s6), r2c6), x[7]),
+							t);
+	x[8] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(r2s6, r2c6), x[8]), t);
+	x[5] = _mm256_add_epi32(x[0], x[2]);
+	x[0] = _mm256_sub_epi32(x[0], x[2]);
+	x[2] = _mm256_add_epi32(x[3], x[1]);
+	x[3] = _mm256_sub_epi32(x[3], x[1]);
+}
+
+/*
+ * The same fixed point DCT as rspamd_image_dct_block, rows and columns
+ * are transformed in 8 lanes, so results are bit exact
+ */
+static void
+rspamd_image_dct_block_avx2(int pixels[8][8], double *out)
+{
+	const __m256i r2 = _mm256_set1_epi32(181);
+	__m256i x[9], r[8];
+	int i;
+
+	/* transform rows, lane is a row */
+	for (i = 0; i < 8; i++) {
+		x[i] = _mm256_loadu_si256((const __m256i *) pixels[i]);
+	}
+
+	rspamd_image_dct_pass_avx2(x);
+
+	r[0] = x[6];
+	r[4] = x[4];
+	r[2] = _mm256_srai_epi32(x[8], 10);
+	r[6] = _mm256_srai_epi32(x[7], 10);
+	r[7] = _mm256_srai_epi32(_mm256_sub_epi32(x[2], x[5]), 10);
+	r[1] = _mm256_srai_epi32(_mm256_add_epi32(x[2], x[5]), 10);
+	r[3] = _mm256_srai_epi32(_mm256_mullo_epi32(x[3], r2), 17);
+	r[5] = _mm256_srai_epi32(_mm256_mullo_epi32(x[0], r2), 17);
+
+	/* transform columns, lane is a column */
+	rspamd_image_dct_transpose_avx2(r);
+
+	for (i = 0; i < 8; i++) {
+		x[i] = r[i];
+	}
+
+	rspamd_image_dct_pass_avx2(x);
+
+	r[0] = _mm256_srai_epi32(_mm256_add_epi32(x[6], _mm256_set1_epi32(16)), 3);
+	r[1] = _mm256_srai_epi32(_mm256_add_epi32(x[4], _mm256_set1_epi32(16)), 3);
+	r[2] = _mm256_srai_epi32(_mm256_add_epi32(x[8], _mm256_set1_epi32(16384)), 13);
+	r[3] = _mm256_srai_epi32(_mm256_add_epi32(x[7], _mm256_set1_epi32(16384)), 13);
+	r[4] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_sub_epi32(x[2], x[5]),
+											  _mm256_set1_epi32(16384)),
+							 13);
+	r[5] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(x[2], x[5]),
+											  _mm256_set1_epi32(16384)),
+							 13);
+	r[6] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(x[3], 8), r2),
+											  _mm256_set1_epi32(8192)),
+							 12);
+	r[7] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(x[0], 8), r2),
+											  _mm256_set1_epi32(8192)),
+							 12);
+
+	/* Output is row major again */
+	rspamd_image_dct_transpose_avx2(r);
+
+	for (i = 0; i < 8; i++) {
+		_mm256_storeu_pd(out + i * 8,
+						 _mm256_cvtepi32_pd(_mm256_castsi256_si128(r[i])));
+		_mm256_storeu_pd(out + i * 8 + 4,
+						 _mm256_cvtepi32_pd(_mm256_extracti128_si256(r[i], 1)));
+	}
+}
+#endif
+
+static inline void
+rspamd_image_dct(int pixels[8][8], double *out)
+{
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (cpu_config & CPUID_AVX2) {
+		rspamd_image_dct_block_avx2(pixels, out);
+
+		return;
+	}
+#endif
+
+	rspamd_image_dct_block(pixels, out);
+}
+
 struct rspamd_image_cache_entry {
 	unsigned char digest[64];
 	unsigned char dct[RSPAMD_DCT_LEN / NBBY];
@@ -418,6 +602,32 @@ rspamd_image_check_hash(struct rspamd_task *task, struct rspamd_image *img)
 		return TRUE;
 	}
 
+	if (images_shared_hash) {
+		unsigned char dct[RSPAMD_DCT_LEN / NBBY];
+		gsize dct_len = 0;
+
+		/* The same image might have been processed by another worker */
+		if (rspamd_shm_cache_lookup(images_shared_hash, img->parent->digest,
+									sizeof(img->parent->digest), task->task_timestamp,
+									dct, &dct_len, NULL, NULL) != RSPAMD_SHM_CACHE_MISS &&
+			dct_len == sizeof(dct)) {
+			img->dct = g_malloc(RSPAMD_DCT_LEN / NBBY);
+			rspamd_mempool_add_destructor(task->task_pool, g_free,
+										  img->dct);
+			memcpy(img->dct, dct, sizeof(dct));
+			img->is_normalized = TRUE;
+
+			found = g_malloc0(sizeof(*found));
+			memcpy(found->dct, dct, sizeof(dct));
+			memcpy(found->digest, img->parent->digest, sizeof(found->digest));
+			rspamd_lru_hash_insert(images_hash, found->digest, found,
+								   task->tv.tv_sec, 0);
+			msg_debug_images("found DCT data in the shared cache");
+
+			return TRUE;
+		}
+	}
+
 	return FALSE;
 }
 
@@ -438,11 +648,43 @@ rspamd_image_save_hash(struct rspamd_task *task, struct rspamd_image *img)
 			rspamd_lru_hash_insert(images_hash, found->digest, found,
 								   task->tv.tv_sec, 0);
 		}
+
+		if (images_shared_hash) {
+			rspamd_shm_cache_insert(images_shared_hash, img->parent->digest,
+									sizeof(img->parent->digest),
+									img->dct, RSPAMD_DCT_LEN / NBBY,
+									task->task_timestamp, RSPAMD_IMAGES_SHARED_CACHE_TTL);
+		}
 	}
 }
 
 #endif
 
+void rspamd_images_shared_cache_init(struct rspamd_config *cfg)
+{
+#ifdef USABLE_GD
+	if (images_shared_hash && images_shared_hash_size == cfg->images_shared_cache_size) {
+		/* Keep the existing entries on reload */
+		return;
+	}
+
+	/* Workers of the previous generation keep their own mapping */
+	rspamd_shm_cache_destroy(images_shared_hash);
+	images_shared_hash = NULL;
+	images_shared_hash_size = cfg->images_shared_cache_size;
+
+	if (images_shared_hash_size > 0) {
+		images_shared_hash = rspamd_shm_cache_new("images", images_shared_hash_size,
+												  RSPAMD_DCT_LEN / NBBY, 0);
+
+		if (images_shared_hash == NULL) {
+			msg_err_config("cannot allocate shared images cache of %z elements: %s",
+						   images_shared_hash_size, strerror(errno));
+		}
+	}
+#endif
+}
+
 void rspamd_image_normalize(struct rspamd_task *task, struct rspamd_image *img)
 {
 #ifdef USABLE_GD
@@ -533,8 +775,8 @@ void rspamd_image_normalize(struct rspamd_task *task, struct rspamd_image *img)
 					p[k][7] = gdImageGetPixel(dst, i + k, j + 7);
 				}
 
-				rspamd_image_dct_block(p,
-									   dct + i * RSPAMD_NORMALIZED_DIM + j);
+				rspamd_image_dct(p,
+								 dct + i * RSPAMD_NORMALIZED_DIM + j);
 
 				double avg = 0.0;
 
@@ -601,6 +843,8 @@ process_image(struct rspamd_task *task, struct rspamd_mime_part *part)
 {
 	struct rspamd_image *img;
 
+	/* Materialize content if it has not been decoded yet */
+	rspamd_mime_part_get_content(part);
 	img = rspamd_maybe_process_image(task->task_pool, &part->parsed_data);
 
 	if (img != NULL) {
@@ -660,11 +904,11 @@ rspamd_image_process_part(struct rspamd_task *task, struct rspamd_mime_part *par
 
 	if (img) {
 		/* Check Content-Id */
-		rh = rspamd_message_get_header_from_hash(part->raw_headers,
-												 "Content-Id", FALSE);
+		rh = rspamd_message_get_header_from_hash_by_id(part->raw_headers,
+													   RSPAMD_MIME_HEADER_CONTENT_ID, FALSE);
 
 		if (rh) {
-			cid = rh->decoded;
+			cid = rspamd_mime_header_get_decoded(rh);
 
 			if (*cid == '<') {
 				cid++;
@@ -11,6 +11,7 @@ extern "C" {
 struct html_image;
 struct rspamd_task;
 struct rspamd_mime_part;
+struct rspamd_config;
 
 #define RSPAMD_DCT_LEN (64 * 64)
 
@@ -69,6 +70,12 @@ const char *rspamd_image_type_str(enum rspamd_image_type type);
 
 void rspamd_image_normalize(struct rspamd_task *task, struct rspamd_image *img);
 
+/**
+ * Creates cache of DCT data shared by all workers, must be called before
+ * workers are forked
+ */
+void rspamd_images_shared_cache_init(struct rspamd_config *cfg);
+
 #ifdef __cplusplus
 }
 #endif
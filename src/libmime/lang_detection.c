@@ -87,6 +87,7 @@ struct rspamd_language_elt {
 	double mean;
 	double std;
 	unsigned int occurrences; /* total number of parts with this language */
+	unsigned int id;          /* index in detector languages list */
 };
 
 struct rspamd_ngramm_elt {
@@ -101,6 +102,24 @@ struct rspamd_ngramm_chain {
 	char *utf;
 };
 
+/*
+ * Flat open addressing table of trigrams built after all languages are loaded,
+ * each slot refers to a range of (language id, probability) pairs
+ */
+struct rspamd_ngramm_slot {
+	uint64_t key; /* packed trigram, zero for empty slots */
+	uint32_t start;
+	uint32_t nlangs;
+};
+
+struct rspamd_ngramm_table {
+	struct rspamd_ngramm_slot *slots;
+	uint16_t *langs;
+	double *probs;
+	gsize mask;
+	gsize nngramms;
+};
+
 struct rspamd_stop_word_range {
 	unsigned int start;
 	unsigned int stop;
@@ -178,6 +197,8 @@ KHASH_INIT(rspamd_languages_hash, const char *, struct rspamd_language_elt *, tr
 struct rspamd_lang_detector {
 	khash_t(rspamd_languages_hash) * languages;
 	khash_t(rspamd_trigram_hash) * trigrams[RSPAMD_LANGUAGE_MAX]; /* trigrams frequencies */
+	struct rspamd_ngramm_table ngramms[RSPAMD_LANGUAGE_MAX];     /* compiled from trigrams */
+	GPtrArray *languages_list;                                    /* indexed by language id */
 	struct rspamd_stop_word_elt stop_words[RSPAMD_LANGUAGE_MAX];
 	khash_t(rspamd_stopwords_hash) * stop_words_norm;
 	UConverter *uchar_converter;
@@ -694,6 +715,8 @@ rspamd_language_detector_read_file(struct rspamd_config *cfg,
 	khiter_t k = kh_put(rspamd_languages_hash, d->languages, nelt->name, &ret);
 	g_assert(ret > 0); /* must be unique */
 	kh_value(d->languages, k) = nelt;
+	nelt->id = d->languages_list->len;
+	g_ptr_array_add(d->languages_list, nelt);
 	ucl_object_unref(top);
 }
 
@@ -763,12 +786,109 @@ rspamd_language_detector_process_chain(struct rspamd_config *cfg,
 	}
 }
 
+static inline uint64_t
+rspamd_ngramm_pack(const UChar32 *s)
+{
+	/* 21 bit per code point, the highest bit marks non empty slot */
+	return (1ULL << 63) | (((uint64_t) s[0] & 0x1FFFFF) << 42) |
+		   (((uint64_t) s[1] & 0x1FFFFF) << 21) | ((uint64_t) s[2] & 0x1FFFFF);
+}
+
+static inline gsize
+rspamd_ngramm_slot_idx(uint64_t key, gsize mask)
+{
+	key *= 0x9E3779B97F4A7C15ULL;
+
+	return (key ^ (key >> 32)) & mask;
+}
+
+static inline const struct rspamd_ngramm_slot *
+rspamd_ngramm_table_lookup(const struct rspamd_ngramm_table *tbl,
+						   const UChar32 *window)
+{
+	uint64_t key;
+	gsize i;
+
+	if (tbl->slots == NULL) {
+		return NULL;
+	}
+
+	key = rspamd_ngramm_pack(window);
+
+	for (i = rspamd_ngramm_slot_idx(key, tbl->mask);; i = (i + 1) & tbl->mask) {
+		if (tbl->slots[i].key == key) {
+			return &tbl->slots[i];
+		}
+		else if (tbl->slots[i].key == 0) {
+			return NULL;
+		}
+	}
+}
+
+static void
+rspamd_language_detector_compile_ngramms(khash_t(rspamd_trigram_hash) * htb,
+										 struct rspamd_ngramm_table *tbl)
+{
+	const UChar32 *key;
+	struct rspamd_ngramm_chain chain;
+	struct rspamd_ngramm_elt *elt;
+	gsize nslots = 2, nelts = 0, cur = 0, idx;
+	unsigned int i;
+
+	memset(tbl, 0, sizeof(*tbl));
+
+	if (kh_size(htb) == 0) {
+		return;
+	}
+
+	kh_foreach_value(htb, chain, {
+		nelts += chain.languages->len;
+	});
+
+	/* Keep load factor below 0.5 */
+	while (nslots < kh_size(htb) * 2) {
+		nslots <<= 1;
+	}
+
+	tbl->slots = g_new0(struct rspamd_ngramm_slot, nslots);
+	tbl->langs = g_new(uint16_t, MAX(nelts, 1));
+	tbl->probs = g_new(double, MAX(nelts, 1));
+	tbl->mask = nslots - 1;
+	tbl->nngramms = kh_size(htb);
+
+	kh_foreach(htb, key, chain, {
+		uint64_t k = rspamd_ngramm_pack(key);
+
+		for (idx = rspamd_ngramm_slot_idx(k, tbl->mask); tbl->slots[idx].key != 0;
+			 idx = (idx + 1) & tbl->mask)
+			;
+
+		tbl->slots[idx].key = k;
+		tbl->slots[idx].start = cur;
+
+		PTR_ARRAY_FOREACH(chain.languages, i, elt)
+		{
+			tbl->langs[cur] = elt->elt->id;
+			tbl->probs[cur] = elt->prob;
+			cur++;
+		}
+
+		tbl->slots[idx].nlangs = cur - tbl->slots[idx].start;
+	});
+}
+
 static void
 rspamd_language_detector_dtor(struct rspamd_lang_detector *d)
 {
 	if (d) {
 		for (unsigned int i = 0; i < RSPAMD_LANGUAGE_MAX; i++) {
-			kh_destroy(rspamd_trigram_hash, d->trigrams[i]);
+			if (d->trigrams[i]) {
+				kh_destroy(rspamd_trigram_hash, d->trigrams[i]);
+			}
+
+			g_free(d->ngramms[i].slots);
+			g_free(d->ngramms[i].langs);
+			g_free(d->ngramms[i].probs);
 			rspamd_multipattern_destroy(d->stop_words[i].mp);
 			g_array_free(d->stop_words[i].ranges, TRUE);
 		}
@@ -777,6 +897,10 @@ rspamd_language_detector_dtor(struct rspamd_lang_detector *d)
 			kh_destroy(rspamd_languages_hash, d->languages);
 		}
 
+		if (d->languages_list) {
+			g_ptr_array_free(d->languages_list, TRUE);
+		}
+
 		kh_destroy(rspamd_stopwords_hash, d->stop_words_norm);
 		rspamd_lang_detection_fasttext_destroy(d->fasttext_detector);
 	}
@@ -851,6 +975,7 @@ rspamd_language_detector_init(struct rspamd_config *cfg)
 	ret = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(*ret));
 	ret->languages = kh_init(rspamd_languages_hash);
 	kh_resize(rspamd_languages_hash, ret->languages, gl.gl_pathc);
+	ret->languages_list = g_ptr_array_sized_new(gl.gl_pathc);
 	ret->uchar_converter = rspamd_get_utf8_converter();
 	ret->short_text_limit = short_text_limit;
 	ret->stop_words_norm = kh_init(rspamd_stopwords_hash);
@@ -898,6 +1023,9 @@ rspamd_language_detector_init(struct rspamd_config *cfg)
 			rspamd_language_detector_process_chain(cfg, chain);
 		});
 
+		rspamd_language_detector_compile_ngramms(ret->trigrams[i],
+												 &ret->ngramms[i]);
+
 		if (!rspamd_multipattern_compile(ret->stop_words[i].mp, 0, &err)) {
 			msg_err_config("cannot compile stop words for %z language group: %e",
 						   i, err);
@@ -905,6 +1033,9 @@ rspamd_language_detector_init(struct rspamd_config *cfg)
 		}
 
 		total += kh_size(ret->trigrams[i]);
+		/* Chains are not needed after compilation */
+		kh_destroy(rspamd_trigram_hash, ret->trigrams[i]);
+		ret->trigrams[i] = NULL;
 	}
 
 	ret->fasttext_detector = rspamd_lang_detection_fasttext_init(cfg);
@@ -1074,71 +1205,32 @@ rspamd_language_detector_next_ngramm(rspamd_stat_token_t *tok, UChar32 *window,
 /*
  * Do full guess for a specific ngramm, checking all languages defined
  */
-static void
-rspamd_language_detector_process_ngramm_full(struct rspamd_task *task,
-											 struct rspamd_lang_detector *d,
+static inline void
+rspamd_language_detector_process_ngramm_full(const struct rspamd_ngramm_table *tbl,
 											 UChar32 *window,
-											 khash_t(rspamd_candidates_hash) * candidates,
-											 khash_t(rspamd_trigram_hash) * trigrams)
+											 double *scores,
+											 unsigned char *seen)
 {
-	unsigned int i;
-	int ret;
-	struct rspamd_ngramm_chain *chain = NULL;
-	struct rspamd_ngramm_elt *elt;
-	struct rspamd_lang_detector_res *cand;
-	khiter_t k;
-	double prob;
-
-	k = kh_get(rspamd_trigram_hash, trigrams, window);
-	if (k != kh_end(trigrams)) {
-		chain = &kh_value(trigrams, k);
-	}
-
-	if (chain) {
-		PTR_ARRAY_FOREACH(chain->languages, i, elt)
-		{
-			prob = elt->prob;
+	const struct rspamd_ngramm_slot *slot;
+	unsigned int i, end;
 
-			if (prob < chain->mean) {
-				continue;
-			}
+	slot = rspamd_ngramm_table_lookup(tbl, window);
 
-			k = kh_get(rspamd_candidates_hash, candidates, elt->elt->name);
-			if (k != kh_end(candidates)) {
-				cand = kh_value(candidates, k);
-			}
-			else {
-				cand = NULL;
-			}
+	if (slot) {
+		end = slot->start + slot->nlangs;
 
-#ifdef NGRAMMS_DEBUG
-			msg_err("gramm: %s, lang: %s, prob: %.3f", chain->utf,
-					elt->elt->name, log2(elt->prob));
-#endif
-			if (cand == NULL) {
-				cand = rspamd_mempool_alloc(task->task_pool, sizeof(*cand));
-				cand->elt = elt->elt;
-				cand->lang = elt->elt->name;
-				cand->prob = prob;
-
-				k = kh_put(rspamd_candidates_hash, candidates, elt->elt->name,
-						   &ret);
-				kh_value(candidates, k) = cand;
-			}
-			else {
-				/* Update guess */
-				cand->prob += prob;
-			}
+		for (i = slot->start; i < end; i++) {
+			scores[tbl->langs[i]] += tbl->probs[i];
+			seen[tbl->langs[i]] = 1;
 		}
 	}
 }
 
 static void
-rspamd_language_detector_detect_word(struct rspamd_task *task,
-									 struct rspamd_lang_detector *d,
-									 rspamd_stat_token_t *tok,
-									 khash_t(rspamd_candidates_hash) * candidates,
-									 khash_t(rspamd_trigram_hash) * trigrams)
+rspamd_language_detector_detect_word(rspamd_stat_token_t *tok,
+									 const struct rspamd_ngramm_table *tbl,
+									 double *scores,
+									 unsigned char *seen)
 {
 	const unsigned int wlen = 3;
 	UChar32 window[3];
@@ -1146,8 +1238,7 @@ rspamd_language_detector_detect_word(struct rspamd_task *task,
 
 	/* Split words */
 	while ((cur = rspamd_language_detector_next_ngramm(tok, window, wlen, cur)) != -1) {
-		rspamd_language_detector_process_ngramm_full(task,
-													 d, window, candidates, trigrams);
+		rspamd_language_detector_process_ngramm_full(tbl, window, scores, seen);
 	}
 }
 
@@ -1219,6 +1310,37 @@ rspamd_language_detector_filter_negligible(struct rspamd_task *task,
 	msg_debug_lang_det("removed %d languages", filtered);
 }
 
+/*
+ * Stop checking words when a language leads by this factor after a half of
+ * the selected words, others are filtered by step2 anyway
+ */
+static const double early_exit_ratio = 8.0;
+static const unsigned int early_exit_check_mask = 0x7;
+
+static gboolean
+rspamd_language_detector_has_leader(const double *scores,
+									const unsigned char *seen,
+									unsigned int nlangs)
+{
+	double first = 0, second = 0;
+	unsigned int i;
+
+	for (i = 0; i < nlangs; i++) {
+		if (seen[i]) {
+			if (scores[i] > first) {
+				second = first;
+				first = scores[i];
+			}
+			else if (scores[i] > second) {
+				second = scores[i];
+			}
+		}
+	}
+
+	return first > 0 && log2(first) >= cutoff_limit &&
+		   first > second * early_exit_ratio;
+}
+
 static void
 rspamd_language_detector_detect_type(struct rspamd_task *task,
 									 unsigned int nwords,
@@ -1228,11 +1350,17 @@ rspamd_language_detector_detect_type(struct rspamd_task *task,
 									 khash_t(rspamd_candidates_hash) * candidates,
 									 struct rspamd_mime_text_part *part)
 {
-	unsigned int nparts = MIN(words->len, nwords);
+	unsigned int nparts = MIN(words->len, nwords), nlangs = d->languages_list->len;
 	goffset *selected_words;
 	rspamd_stat_token_t *tok;
+	struct rspamd_language_elt *elt;
+	struct rspamd_lang_detector_res *cand;
+	double *scores;
+	unsigned char *seen;
 	unsigned int i;
 	uint64_t seed;
+	int ret;
+	khiter_t k;
 
 	/* Seed PRNG with part digest to provide some sort of determinism */
 	memcpy(&seed, part->mime_part->digest, sizeof(seed));
@@ -1240,18 +1368,44 @@ rspamd_language_detector_detect_type(struct rspamd_task *task,
 	rspamd_language_detector_random_select(words, nparts, selected_words, &seed);
 	msg_debug_lang_det("randomly selected %d words", nparts);
 
+	scores = g_new0(double, nlangs);
+	seen = g_malloc0(nlangs);
+
 	for (i = 0; i < nparts; i++) {
 		tok = &g_array_index(words, rspamd_stat_token_t,
 							 selected_words[i]);
 
 		if (tok->unicode.len >= 3) {
-			rspamd_language_detector_detect_word(task, d, tok, candidates,
-												 d->trigrams[cat]);
+			rspamd_language_detector_detect_word(tok, &d->ngramms[cat],
+												 scores, seen);
+		}
+
+		if (i >= nparts / 2 && i + 1 < nparts &&
+			(i & early_exit_check_mask) == early_exit_check_mask &&
+			rspamd_language_detector_has_leader(scores, seen, nlangs)) {
+			msg_debug_lang_det("stop after %d words of %d: single leader found",
+							   i + 1, nparts);
+			break;
+		}
+	}
+
+	for (i = 0; i < nlangs; i++) {
+		if (seen[i]) {
+			elt = g_ptr_array_index(d->languages_list, i);
+			cand = rspamd_mempool_alloc(task->task_pool, sizeof(*cand));
+			cand->elt = elt;
+			cand->lang = elt->name;
+			cand->prob = scores[i];
+
+			k = kh_put(rspamd_candidates_hash, candidates, elt->name, &ret);
+			kh_value(candidates, k) = cand;
 		}
 	}
 
 	/* Filter negligible candidates */
 	rspamd_language_detector_filter_negligible(task, candidates);
+	g_free(scores);
+	g_free(seen);
 	g_free(selected_words);
 }
 
@@ -142,6 +142,120 @@ rspamd_mime_part_extract_words(struct rspamd_task *task,
 	}
 }
 
+/* Moves bounds of a sample to spaces, so neither words nor characters are cut */
+static void
+rspamd_mime_part_align_sample(const char *text, gsize total,
+							  gsize *pstart, gsize *pend)
+{
+	gsize start = *pstart, end = *pend, i;
+
+	if (start > 0) {
+		for (i = start; i < end && !g_ascii_isspace(text[i]); i++);
+
+		if (i < end) {
+			start = i + 1;
+		}
+		else {
+			while (start < end && (text[start] & 0xC0) == 0x80) {
+				start++;
+			}
+		}
+	}
+
+	if (end < total) {
+		for (i = end; i > start && !g_ascii_isspace(text[i - 1]); i--);
+
+		if (i > start) {
+			end = i - 1;
+		}
+		else {
+			while (end > start && (text[end] & 0xC0) == 0x80) {
+				end--;
+			}
+		}
+	}
+
+	*pstart = start;
+	*pend = MAX(start, end);
+}
+
+/*
+ * Too long parts are tokenized by samples, so the words of huge parts do not
+ * take time proportional to their length; words still point to the part text
+ */
+static void
+rspamd_mime_part_create_words_sampled(struct rspamd_task *task,
+									  struct rspamd_mime_text_part *part,
+									  enum rspamd_tokenize_type tok_type)
+{
+	struct rspamd_sample_range ranges[RSPAMD_SAMPLE_MAX_RANGES];
+	struct rspamd_process_exception *ex, *shifted;
+	const char *text = (const char *) part->utf_stripped_content->data;
+	gsize total = part->utf_stripped_content->len, start, end;
+	unsigned int nranges, i;
+	GList *cur, *exceptions;
+
+	nranges = rspamd_sample_ranges(total, task->cfg->max_text_part_len, ranges);
+	part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_SAMPLED;
+	msg_info_task("text part is too long: %z bytes while limit is %z, "
+				  "extract words from %ud samples",
+				  total, task->cfg->max_text_part_len, nranges);
+
+	for (i = 0; i < nranges; i++) {
+		start = ranges[i].off;
+		end = start + ranges[i].len;
+		rspamd_mime_part_align_sample(text, total, &start, &end);
+
+		if (end == start) {
+			continue;
+		}
+
+		/* Tokenizer expects exceptions relative to the text it is given */
+		exceptions = NULL;
+
+		for (cur = part->exceptions; cur != NULL; cur = g_list_next(cur)) {
+			ex = (struct rspamd_process_exception *) cur->data;
+
+			if (ex->pos >= end) {
+				break;
+			}
+
+			if (ex->pos >= start && ex->pos + ex->len <= end) {
+				shifted = rspamd_mempool_alloc(task->task_pool, sizeof(*shifted));
+				memcpy(shifted, ex, sizeof(*ex));
+				shifted->pos -= start;
+				exceptions = g_list_prepend(exceptions, shifted);
+			}
+		}
+
+		exceptions = g_list_reverse(exceptions);
+
+		if (tok_type == RSPAMD_TOKENIZE_UTF) {
+			UText utxt = UTEXT_INITIALIZER;
+			UErrorCode uc_err = U_ZERO_ERROR;
+
+			utext_openUTF8(&utxt, text + start, end - start, &uc_err);
+
+			if (U_SUCCESS(uc_err)) {
+				part->utf_words = rspamd_tokenize_text(text + start, end - start,
+													   &utxt, tok_type, task->cfg,
+													   exceptions, NULL, part->utf_words,
+													   task->task_pool);
+			}
+
+			utext_close(&utxt);
+		}
+		else {
+			part->utf_words = rspamd_tokenize_text(text + start, end - start,
+												   NULL, tok_type, task->cfg,
+												   exceptions, NULL, part->utf_words,
+												   task->task_pool);
+		}
+
+		g_list_free(exceptions);
+	}
+}
+
 static void
 rspamd_mime_part_create_words(struct rspamd_task *task,
 							  struct rspamd_mime_text_part *part)
@@ -185,15 +299,21 @@ rspamd_mime_part_create_words(struct rspamd_task *task,
 		tok_type = RSPAMD_TOKENIZE_RAW;
 	}
 
-	part->utf_words = rspamd_tokenize_text(
-		part->utf_stripped_content->data,
-		part->utf_stripped_content->len,
-		&part->utf_stripped_text,
-		tok_type, task->cfg,
-		part->exceptions,
-		NULL,
-		NULL,
-		task->task_pool);
+	if (task->cfg && task->cfg->max_text_part_len > 0 &&
+		part->utf_stripped_content->len > task->cfg->max_text_part_len) {
+		rspamd_mime_part_create_words_sampled(task, part, tok_type);
+	}
+	else {
+		part->utf_words = rspamd_tokenize_text(
+			part->utf_stripped_content->data,
+			part->utf_stripped_content->len,
+			&part->utf_stripped_text,
+			tok_type, task->cfg,
+			part->exceptions,
+			NULL,
+			NULL,
+			task->task_pool);
+	}
 
 
 	if (part->utf_words) {
@@ -567,17 +687,45 @@ rspamd_normalize_text_part(struct rspamd_task *task,
 								  part->newlines);
 }
 
-#define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
+struct rspamd_word_pos {
+	uint64_t h;
+	unsigned int pos;
+};
 
+static int
+rspamd_word_pos_cmp(const void *a, const void *b)
+{
+	const struct rspamd_word_pos *w1 = a, *w2 = b;
+
+	if (w1->h != w2->h) {
+		return w1->h < w2->h ? -1 : 1;
+	}
+
+	return (int) w1->pos - (int) w2->pos;
+}
+
+/*
+ * Replacement of equal words costs 2 and replacement of different words costs 0,
+ * so the distance is `n + m - 2 * L`, where L is the length of the longest
+ * alignment of pairwise different words. L is computed by the bit-parallel LCS
+ * algorithm (Allison-Dix, Hyyro) in O(n * m / 64) with the "not equal" relation
+ * used as a match
+ */
 static unsigned int
 rspamd_words_levenshtein_distance(struct rspamd_task *task,
 								  GArray *w1, GArray *w2)
 {
-	unsigned int s1len, s2len, x, y, lastdiag, olddiag;
-	unsigned int *column, ret;
-	uint64_t h1, h2;
-	int eq;
-	static const unsigned int max_words = 8192;
+	unsigned int s1len, s2len, nblocks, x, b, k, lo, hi, mid, lcs;
+	struct rspamd_word_pos *sorted;
+	uint64_t *v, h, eq, cur, u, sum, carry, valid;
+	static const unsigned int max_words = 65536;
+
+	if (w1->len > w2->len) {
+		/* The shorter sequence is used as a pattern */
+		GArray *tmp = w1;
+		w1 = w2;
+		w2 = tmp;
+	}
 
 	s1len = w1->len;
 	s2len = w2->len;
@@ -588,42 +736,83 @@ rspamd_words_levenshtein_distance(struct rspamd_task *task,
 					  max_words, s1len, s2len);
 
 		/* Use approximate comparison of number of words */
-		if (s1len > s2len) {
-			return s1len - s2len;
-		}
-		else {
-			return s2len - s1len;
-		}
+		return s2len - s1len;
 	}
 
-	column = g_malloc0((s1len + 1) * sizeof(unsigned int));
+	if (s1len == 0) {
+		return s2len;
+	}
+
+	nblocks = (s1len + 63) / 64;
+	sorted = g_malloc(s1len * sizeof(*sorted));
+	v = g_malloc(nblocks * sizeof(*v));
 
-	for (y = 1; y <= s1len; y++) {
-		column[y] = y;
+	for (x = 0; x < s1len; x++) {
+		sorted[x].h = g_array_index(w1, uint64_t, x);
+		sorted[x].pos = x;
 	}
 
-	for (x = 1; x <= s2len; x++) {
-		column[0] = x;
+	qsort(sorted, s1len, sizeof(*sorted), rspamd_word_pos_cmp);
+	memset(v, 0xff, nblocks * sizeof(*v));
 
-		for (y = 1, lastdiag = x - 1; y <= s1len; y++) {
-			olddiag = column[y];
-			h1 = g_array_index(w1, uint64_t, y - 1);
-			h2 = g_array_index(w2, uint64_t, x - 1);
-			eq = (h1 == h2) ? 1 : 0;
-			/*
-			 * Cost of replacement is twice higher than cost of add/delete
-			 * to calculate percentage properly
-			 */
-			column[y] = MIN3(column[y] + 1, column[y - 1] + 1,
-							 lastdiag + (eq * 2));
-			lastdiag = olddiag;
+	for (x = 0; x < s2len; x++) {
+		h = g_array_index(w2, uint64_t, x);
+
+		/* Positions of the equal words in the pattern are [lo, hi) */
+		lo = 0;
+		hi = s1len;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+
+			if (sorted[mid].h < h) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		hi = lo;
+
+		while (hi < s1len && sorted[hi].h == h) {
+			hi++;
 		}
+
+		carry = 0;
+		k = lo;
+
+		for (b = 0; b < nblocks; b++) {
+			eq = 0;
+
+			while (k < hi && sorted[k].pos < (b + 1) * 64) {
+				eq |= 1ULL << (sorted[k].pos & 63);
+				k++;
+			}
+
+			/* Match mask is ~eq, so V' = (V + (V & ~eq)) | (V & eq) */
+			cur = v[b];
+			u = cur & ~eq;
+			sum = cur + carry;
+			carry = sum < carry;
+			sum += u;
+			carry |= sum < u;
+			v[b] = sum | (cur & eq);
+		}
+	}
+
+	/* LCS is the number of zero bits in V */
+	lcs = 0;
+
+	for (b = 0; b < nblocks; b++) {
+		valid = (b == nblocks - 1 && (s1len & 63)) ? (1ULL << (s1len & 63)) - 1 : ~0ULL;
+		lcs += __builtin_popcountll(~v[b] & valid);
 	}
 
-	ret = column[s1len];
-	g_free(column);
+	g_free(sorted);
+	g_free(v);
 
-	return ret;
+	return s1len + s2len - 2 * lcs;
 }
 
 static int
@@ -845,6 +1034,7 @@ rspamd_message_process_text_part_maybe(struct rspamd_task *task,
 									   uint16_t *cur_url_order)
 {
 	struct rspamd_mime_text_part *text_part;
+	const rspamd_ftok_t *parsed;
 	unsigned int flags = 0;
 	enum rspamd_action_type act;
 
@@ -858,8 +1048,9 @@ rspamd_message_process_text_part_maybe(struct rspamd_task *task,
 	text_part->mime_part = mime_part;
 	text_part->raw.begin = mime_part->raw_data.begin;
 	text_part->raw.len = mime_part->raw_data.len;
-	text_part->parsed.begin = mime_part->parsed_data.begin;
-	text_part->parsed.len = mime_part->parsed_data.len;
+	parsed = rspamd_mime_part_get_content(mime_part);
+	text_part->parsed.begin = parsed->begin;
+	text_part->parsed.len = parsed->len;
 	text_part->utf_stripped_text = (UText) UTEXT_INITIALIZER;
 	text_part->flags |= flags;
 
@@ -1392,6 +1583,43 @@ rspamd_mime_text_part_position_compare_func(const void *v1, const void *v2)
 	}
 }
 
+gboolean
+rspamd_message_parse_headers(struct rspamd_task *task,
+							 const char *begin, gsize len)
+{
+	char *copy;
+
+	/* Skip any space characters like rspamd_message_parse does */
+	while (len > 0 && g_ascii_isspace(*begin)) {
+		begin++;
+		len--;
+	}
+
+	if (len == 0) {
+		return FALSE;
+	}
+
+	if (task->message) {
+		rspamd_message_unref(task->message);
+	}
+
+	task->message = rspamd_message_new(task);
+	/* Input buffer can be reallocated while the rest of message is received */
+	copy = rspamd_mempool_alloc(task->task_pool, len + 1);
+	memcpy(copy, begin, len);
+	copy[len] = '\0';
+
+	MESSAGE_FIELD(task, raw_headers_content).begin = copy;
+	MESSAGE_FIELD(task, raw_headers_content).len = len;
+	MESSAGE_FIELD(task, raw_headers_content).body_start = copy + len;
+	rspamd_mime_headers_process(task,
+								MESSAGE_FIELD(task, raw_headers),
+								&MESSAGE_FIELD(task, headers_order),
+								copy, len, TRUE);
+
+	return TRUE;
+}
+
 void rspamd_message_process(struct rspamd_task *task)
 {
 	unsigned int i;
@@ -1701,6 +1929,92 @@ void rspamd_message_process(struct rspamd_task *task)
 
 	rspamd_images_link(task);
 	rspamd_tokenize_meta_words(task);
+	/* Part types are known now, so drop a table built before processing */
+	MESSAGE_FIELD(task, parts_table) = NULL;
+}
+
+struct rspamd_mime_parts_table *
+rspamd_message_get_parts_table(struct rspamd_task *task)
+{
+	struct rspamd_mime_parts_table *tbl;
+	struct rspamd_mime_part *part;
+	unsigned int i, n;
+	int *last_child;
+
+	if (task->message == NULL) {
+		tbl = rspamd_mempool_alloc0(task->task_pool, sizeof(*tbl));
+
+		return tbl;
+	}
+
+	n = MESSAGE_FIELD(task, parts)->len;
+	tbl = MESSAGE_FIELD(task, parts_table);
+
+	if (tbl && tbl->nparts == n) {
+		return tbl;
+	}
+
+	tbl = rspamd_mempool_alloc0(task->task_pool, sizeof(*tbl));
+	tbl->nparts = n;
+
+	if (n == 0) {
+		MESSAGE_FIELD(task, parts_table) = tbl;
+
+		return tbl;
+	}
+
+	tbl->parent = rspamd_mempool_alloc(task->task_pool, sizeof(int) * n);
+	tbl->first_child = rspamd_mempool_alloc(task->task_pool, sizeof(int) * n);
+	tbl->next_sibling = rspamd_mempool_alloc(task->task_pool, sizeof(int) * n);
+	tbl->type = rspamd_mempool_alloc(task->task_pool, sizeof(uint8_t) * n);
+	tbl->cte = rspamd_mempool_alloc(task->task_pool, sizeof(uint8_t) * n);
+	tbl->flags = rspamd_mempool_alloc(task->task_pool, sizeof(unsigned int) * n);
+	tbl->raw_len = rspamd_mempool_alloc(task->task_pool, sizeof(gsize) * n);
+	tbl->parsed_len = rspamd_mempool_alloc(task->task_pool, sizeof(gsize) * n);
+	tbl->digest = rspamd_mempool_alloc(task->task_pool, sizeof(*tbl->digest) * n);
+	last_child = rspamd_mempool_alloc(task->task_pool, sizeof(int) * n);
+
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		tbl->parent[i] = -1;
+		tbl->first_child[i] = -1;
+		tbl->next_sibling[i] = -1;
+		last_child[i] = -1;
+		tbl->type[i] = part->part_type;
+		tbl->cte[i] = part->cte;
+		tbl->flags[i] = part->flags;
+		tbl->raw_len[i] = part->raw_data.len;
+		tbl->parsed_len[i] = part->parsed_data.len;
+		memcpy(tbl->digest[i], part->digest, sizeof(part->digest));
+	}
+
+	/* Children are linked in parse order */
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		struct rspamd_mime_part *parent = part->parent_part;
+		int pidx;
+
+		if (parent == NULL || parent->part_number >= n ||
+			g_ptr_array_index(MESSAGE_FIELD(task, parts), parent->part_number) != parent) {
+			continue;
+		}
+
+		pidx = parent->part_number;
+		tbl->parent[i] = pidx;
+
+		if (last_child[pidx] == -1) {
+			tbl->first_child[pidx] = i;
+		}
+		else {
+			tbl->next_sibling[last_child[pidx]] = i;
+		}
+
+		last_child[pidx] = i;
+	}
+
+	MESSAGE_FIELD(task, parts_table) = tbl;
+
+	return tbl;
 }
 
 
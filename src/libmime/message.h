@@ -28,6 +28,7 @@ struct rspamd_task;
 struct controller_session;
 struct rspamd_image;
 struct rspamd_archive;
+struct rspamd_mime_part_lazy;
 
 enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_ATTACHEMENT = (1u << 1u),
@@ -86,7 +87,12 @@ struct rspamd_mime_part {
 	char *detected_ext;
 	struct rspamd_content_disposition *cd;
 	rspamd_ftok_t raw_data;
+	/*
+	 * If `lazy` is set, only the length is known; use
+	 * rspamd_mime_part_get_content to access the data
+	 */
 	rspamd_ftok_t parsed_data;
+	struct rspamd_mime_part_lazy *lazy;
 	struct rspamd_mime_part *parent_part;
 
 	struct rspamd_mime_header *headers_order;
@@ -118,10 +124,13 @@ struct rspamd_mime_part {
 #define RSPAMD_MIME_TEXT_PART_FLAG_8BIT_RAW (1 << 3)
 #define RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED (1 << 4)
 #define RSPAMD_MIME_TEXT_PART_ATTACHMENT (1 << 5)
+/* Words are extracted from samples of the text as it is too long */
+#define RSPAMD_MIME_TEXT_PART_FLAG_SAMPLED (1 << 6)
 
 #define IS_TEXT_PART_EMPTY(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_EMPTY)
 #define IS_TEXT_PART_UTF(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_UTF)
 #define IS_TEXT_PART_HTML(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_HTML)
+#define IS_TEXT_PART_SAMPLED(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_SAMPLED)
 #define IS_TEXT_PART_ATTACHMENT(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_ATTACHMENT)
 
 
@@ -167,12 +176,31 @@ struct rspamd_message_raw_headers_content {
 	const char *body_start;
 };
 
+/*
+ * Flat view of the message parts: arrays are indexed by the part number, which
+ * is the index in `parts` (parse order), relations between parts are indices
+ * as well with -1 meaning no part
+ */
+struct rspamd_mime_parts_table {
+	unsigned int nparts;
+	int *parent;
+	int *first_child;
+	int *next_sibling;
+	uint8_t *type; /* enum rspamd_mime_part_type */
+	uint8_t *cte;  /* enum rspamd_cte */
+	unsigned int *flags;
+	gsize *raw_len;
+	gsize *parsed_len;
+	unsigned char (*digest)[rspamd_cryptobox_HASHBYTES];
+};
+
 struct rspamd_message {
 	const char *message_id;
 	char *subject;
 
 	GPtrArray *parts;      /**< list of parsed parts							*/
 	GPtrArray *text_parts; /**< list of text parts								*/
+	struct rspamd_mime_parts_table *parts_table; /**< flat view of parts, built on demand */
 	struct rspamd_message_raw_headers_content raw_headers_content;
 	void *received_headers; /**< list of received headers						*/
 	khash_t(rspamd_url_hash) * urls;
@@ -196,12 +224,31 @@ struct rspamd_message {
  */
 gboolean rspamd_message_parse(struct rspamd_task *task);
 
+/**
+ * Parse headers of a message which body has not been received yet; the
+ * resulting message has only headers and is replaced by rspamd_message_parse
+ * @param task worker_task object
+ * @param begin start of the message
+ * @param len length of the headers block
+ * @return TRUE if headers have been processed
+ */
+gboolean rspamd_message_parse_headers(struct rspamd_task *task,
+									  const char *begin, gsize len);
+
 /**
  * Process content in task (e.g. HTML parsing)
  * @param task
  */
 void rspamd_message_process(struct rspamd_task *task);
 
+/**
+ * Returns flat table of the message parts; it is built on the first call after
+ * the message has been processed and rebuilt if more parts are added
+ * @param task
+ * @return table allocated in the task pool (empty if there is no message)
+ */
+struct rspamd_mime_parts_table *rspamd_message_get_parts_table(struct rspamd_task *task);
+
 
 /**
  * Converts string to cte
@@ -35,7 +35,7 @@
 #define RSPAMD_CHARSET_FLAG_UTF (1 << 0)
 #define RSPAMD_CHARSET_FLAG_ASCII (1 << 1)
 
-#define RSPAMD_CHARSET_CACHE_SIZE 32
+#define RSPAMD_CHARSET_CACHE_SIZE 128
 #define RSPAMD_CHARSET_MAX_CONTENT 512
 
 #define SET_PART_RAW(part) ((part)->flags &= ~RSPAMD_MIME_TEXT_PART_FLAG_UTF)
@@ -52,6 +52,7 @@ struct rspamd_charset_substitution {
 #include "mime_encoding_list.h"
 
 static GHashTable *sub_hash = NULL;
+static rspamd_lru_hash_t *converters_cache = NULL;
 
 static const UChar iso_8859_16_map[] = {
 	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
@@ -71,6 +72,11 @@ static const UChar iso_8859_16_map[] = {
 	0x0111, 0x0144, 0x00F2, 0x00F3, 0x00F4, 0x0151, 0x00F6, 0x015B,
 	0x0171, 0x00F9, 0x00FA, 0x00FB, 0x00FC, 0x0119, 0x021B, 0x00FF};
 
+/* UTF-8 sequences for all bytes of a single byte charset, length is in the last byte */
+struct rspamd_charset_utf8_table {
+	unsigned char seq[256][4];
+};
+
 struct rspamd_charset_converter {
 	char *canon_name;
 	union {
@@ -78,6 +84,43 @@ struct rspamd_charset_converter {
 		const UChar *cnv_table;
 	} d;
 	gboolean is_internal;
+	/* ASCII characters are mapped to themselves and there are no shift states */
+	gboolean ascii_compatible;
+	/* Set for single byte charsets only */
+	struct rspamd_charset_utf8_table *utf8_table;
+};
+
+/* Charsets that are converted in workers most often */
+static const char *const preloaded_charsets[] = {
+	"windows-1250",
+	"windows-1251",
+	"windows-1252",
+	"windows-1253",
+	"windows-1254",
+	"windows-1255",
+	"windows-1256",
+	"windows-1257",
+	"windows-1258",
+	"KOI8-R",
+	"KOI8-U",
+	"ISO-8859-1",
+	"ISO-8859-2",
+	"ISO-8859-3",
+	"ISO-8859-4",
+	"ISO-8859-5",
+	"ISO-8859-7",
+	"ISO-8859-9",
+	"ISO-8859-13",
+	"ISO-8859-15",
+	"ISO-8859-16",
+	"IBM866",
+	"GB2312",
+	"GBK",
+	"Big5",
+	"Shift_JIS",
+	"EUC-JP",
+	"EUC-KR",
+	"ISO-2022-JP",
 };
 
 static GQuark
@@ -95,10 +138,159 @@ rspamd_converter_dtor(gpointer p)
 		ucnv_close(c->d.conv);
 	}
 
+	g_free(c->utf8_table);
 	g_free(c->canon_name);
 	g_free(c);
 }
 
+/*
+ * Single byte charsets are converted with a table built from the converter
+ * itself, so the result is the same as of the conversion via ICU
+ */
+static void
+rspamd_converter_init_tables(struct rspamd_charset_converter *cnv)
+{
+	UChar uc[256];
+	char bytes[256];
+	UErrorCode uc_err = U_ZERO_ERROR;
+	int32_t r;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(bytes); i++) {
+		bytes[i] = (char) i;
+	}
+
+	if (!cnv->is_internal) {
+		UConverterType type = ucnv_getType(cnv->d.conv);
+
+		if (type == UCNV_MBCS) {
+			/* Multibyte charsets are ASCII compatible if ASCII is identical */
+			r = ucnv_toUChars(cnv->d.conv, uc, 128, bytes, 128, &uc_err);
+			ucnv_reset(cnv->d.conv);
+
+			if (U_SUCCESS(uc_err) && r == 128) {
+				cnv->ascii_compatible = TRUE;
+
+				for (i = 0; i < 128; i++) {
+					if (uc[i] != i) {
+						cnv->ascii_compatible = FALSE;
+						break;
+					}
+				}
+			}
+		}
+
+		if ((type != UCNV_SBCS && type != UCNV_LATIN_1) ||
+			ucnv_getMaxCharSize(cnv->d.conv) != 1) {
+			return;
+		}
+
+		uc_err = U_ZERO_ERROR;
+		r = ucnv_toUChars(cnv->d.conv, uc, G_N_ELEMENTS(uc), bytes,
+						  G_N_ELEMENTS(bytes), &uc_err);
+		ucnv_reset(cnv->d.conv);
+
+		if (!U_SUCCESS(uc_err) || r != G_N_ELEMENTS(uc)) {
+			return;
+		}
+	}
+	else {
+		r = rspamd_converter_to_uchars(cnv, uc, G_N_ELEMENTS(uc), bytes,
+									   G_N_ELEMENTS(bytes), &uc_err);
+	}
+
+	cnv->utf8_table = g_malloc(sizeof(*cnv->utf8_table));
+	cnv->ascii_compatible = TRUE;
+
+	for (i = 0; i < G_N_ELEMENTS(uc); i++) {
+		unsigned char *seq = cnv->utf8_table->seq[i];
+		UChar c = uc[i];
+
+		if (U16_IS_SURROGATE(c)) {
+			/* Cannot be a single character, keep ICU for this charset */
+			g_free(cnv->utf8_table);
+			cnv->utf8_table = NULL;
+			cnv->ascii_compatible = FALSE;
+
+			return;
+		}
+
+		if (i < 128 && c != i) {
+			cnv->ascii_compatible = FALSE;
+		}
+
+		if (c < 0x80) {
+			seq[0] = c;
+			seq[3] = 1;
+		}
+		else if (c < 0x800) {
+			seq[0] = 0xC0 | (c >> 6);
+			seq[1] = 0x80 | (c & 0x3F);
+			seq[3] = 2;
+		}
+		else {
+			seq[0] = 0xE0 | (c >> 12);
+			seq[1] = 0x80 | ((c >> 6) & 0x3F);
+			seq[2] = 0x80 | (c & 0x3F);
+			seq[3] = 3;
+		}
+	}
+}
+
+/*
+ * Returns size of the output buffer for a direct conversion to UTF-8 or
+ * 0 if input should be converted by ICU
+ */
+static gsize
+rspamd_converter_direct_size(struct rspamd_charset_converter *cnv,
+							 const char *in, gsize len, gboolean *ascii)
+{
+	*ascii = FALSE;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (cnv->ascii_compatible && !rspamd_str_has_8bit((const unsigned char *) in, len)) {
+		*ascii = TRUE;
+
+		return len;
+	}
+
+	if (cnv->utf8_table) {
+		return len * 3;
+	}
+
+	return 0;
+}
+
+static gsize
+rspamd_converter_direct_to_utf8(struct rspamd_charset_converter *cnv,
+								const char *in, gsize len, char *out,
+								gboolean ascii)
+{
+	const unsigned char *p = (const unsigned char *) in, *end = p + len;
+	unsigned char *o = (unsigned char *) out;
+
+	if (ascii) {
+		memcpy(out, in, len);
+
+		return len;
+	}
+
+	/* Output has 3 bytes per input byte, so we can always copy 3 bytes */
+	while (p < end) {
+		const unsigned char *seq = cnv->utf8_table->seq[*p++];
+
+		o[0] = seq[0];
+		o[1] = seq[1];
+		o[2] = seq[2];
+		o += seq[3];
+	}
+
+	return o - (unsigned char *) out;
+}
+
 int32_t
 rspamd_converter_to_uchars(struct rspamd_charset_converter *cnv,
 						   UChar *dest,
@@ -140,13 +332,12 @@ rspamd_mime_get_converter_cached(const char *enc,
 								 UErrorCode *err)
 {
 	const char *canon_name;
-	static rspamd_lru_hash_t *cache;
 	struct rspamd_charset_converter *conv;
 
-	if (cache == NULL) {
-		cache = rspamd_lru_hash_new_full(RSPAMD_CHARSET_CACHE_SIZE, NULL,
-										 rspamd_converter_dtor, rspamd_str_hash,
-										 rspamd_str_equal);
+	if (converters_cache == NULL) {
+		converters_cache = rspamd_lru_hash_new_full(RSPAMD_CHARSET_CACHE_SIZE, NULL,
+													rspamd_converter_dtor, rspamd_str_hash,
+													rspamd_str_equal);
 	}
 
 	if (enc == NULL) {
@@ -167,7 +358,7 @@ rspamd_mime_get_converter_cached(const char *enc,
 		return NULL;
 	}
 
-	conv = rspamd_lru_hash_lookup(cache, (gpointer) canon_name, 0);
+	conv = rspamd_lru_hash_lookup(converters_cache, (gpointer) canon_name, 0);
 
 	if (conv == NULL) {
 		if (!(strcmp(canon_name, "ISO-8859-16") == 0 ||
@@ -184,7 +375,8 @@ rspamd_mime_get_converter_cached(const char *enc,
 									NULL,
 									NULL,
 									err);
-				rspamd_lru_hash_insert(cache, conv->canon_name, conv, 0, 0);
+				rspamd_converter_init_tables(conv);
+				rspamd_lru_hash_insert(converters_cache, conv->canon_name, conv, 0, 0);
 			}
 			else {
 				g_free(conv);
@@ -197,14 +389,32 @@ rspamd_mime_get_converter_cached(const char *enc,
 			conv->is_internal = TRUE;
 			conv->d.cnv_table = iso_8859_16_map;
 			conv->canon_name = g_strdup(canon_name);
+			rspamd_converter_init_tables(conv);
 
-			rspamd_lru_hash_insert(cache, conv->canon_name, conv, 0, 0);
+			rspamd_lru_hash_insert(converters_cache, conv->canon_name, conv, 0, 0);
 		}
 	}
 
 	return conv;
 }
 
+void rspamd_mime_preload_converters(void)
+{
+	rspamd_mempool_t *pool;
+	UErrorCode uc_err;
+	unsigned int i;
+
+	pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "charsets", 0);
+
+	for (i = 0; i < G_N_ELEMENTS(preloaded_charsets); i++) {
+		uc_err = U_ZERO_ERROR;
+		rspamd_mime_get_converter_cached(preloaded_charsets[i], pool, FALSE,
+										 &uc_err);
+	}
+
+	rspamd_mempool_delete(pool);
+}
+
 static void
 rspamd_mime_encoding_substitute_init(void)
 {
@@ -329,6 +539,8 @@ rspamd_mime_text_to_utf8(rspamd_mempool_t *pool,
 	char *d;
 	int32_t r, clen, dlen;
 	UChar *tmp_buf;
+	gsize direct_len;
+	gboolean ascii;
 
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *utf8_converter;
@@ -360,6 +572,19 @@ rspamd_mime_text_to_utf8(rspamd_mempool_t *pool,
 		return NULL;
 	}
 
+	direct_len = rspamd_converter_direct_size(conv, input, len, &ascii);
+
+	if (direct_len > 0) {
+		d = rspamd_mempool_alloc(pool, direct_len);
+		r = rspamd_converter_direct_to_utf8(conv, input, len, d, ascii);
+
+		if (olen) {
+			*olen = r;
+		}
+
+		return d;
+	}
+
 	tmp_buf = g_new(UChar, len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars(conv, tmp_buf, len + 1, input, len, &uc_err);
@@ -409,6 +634,8 @@ rspamd_mime_text_part_utf8_convert(struct rspamd_task *task,
 	char *d;
 	int32_t r, clen, dlen, uc_len;
 	UChar *tmp_buf;
+	gsize direct_len;
+	gboolean ascii;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *utf8_converter;
 	struct rspamd_charset_converter *conv;
@@ -425,6 +652,25 @@ rspamd_mime_text_part_utf8_convert(struct rspamd_task *task,
 		return FALSE;
 	}
 
+	direct_len = rspamd_converter_direct_size(conv, input->data, input->len,
+											  &ascii);
+
+	if (direct_len > 0) {
+		d = rspamd_mempool_alloc(task->task_pool, direct_len);
+		r = rspamd_converter_direct_to_utf8(conv, input->data, input->len,
+											d, ascii);
+		msg_debug_task("converted text part from %s to UTF-8 directly, "
+					   "inlen: %d, outlen: %d",
+					   charset, input->len, r);
+
+		text_part->utf_raw_content = rspamd_mempool_alloc(task->task_pool,
+														  sizeof(*text_part->utf_raw_content) + sizeof(gpointer) * 4);
+		text_part->utf_raw_content->data = d;
+		text_part->utf_raw_content->len = r;
+
+		return TRUE;
+	}
+
 	tmp_buf = g_new(UChar, input->len + 1);
 	uc_err = U_ZERO_ERROR;
 	uc_len = rspamd_converter_to_uchars(conv,
@@ -486,6 +732,8 @@ rspamd_mime_to_utf8_byte_array(GByteArray *in,
 {
 	int32_t r, clen, dlen;
 	UChar *tmp_buf;
+	gsize direct_len;
+	gboolean ascii;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *utf8_converter;
 	struct rspamd_charset_converter *conv;
@@ -526,6 +774,16 @@ rspamd_mime_to_utf8_byte_array(GByteArray *in,
 		return FALSE;
 	}
 
+	direct_len = rspamd_converter_direct_size(conv, in->data, in->len, &ascii);
+
+	if (direct_len > 0) {
+		g_byte_array_set_size(out, direct_len);
+		out->len = rspamd_converter_direct_to_utf8(conv, in->data, in->len,
+												   out->data, ascii);
+
+		return TRUE;
+	}
+
 	tmp_buf = g_new(UChar, in->len + 1);
 	uc_err = U_ZERO_ERROR;
 	r = rspamd_converter_to_uchars(conv,
@@ -114,6 +114,12 @@ struct rspamd_charset_converter *rspamd_mime_get_converter_cached(
 	gboolean is_canon,
 	UErrorCode *err);
 
+/**
+ * Opens converters for the most common charsets, so they are inherited
+ * by workers and not created in each of them
+ */
+void rspamd_mime_preload_converters(void);
+
 /**
  * Performs charset->utf16 conversion
  * @param cnv
@@ -22,6 +22,7 @@
 #include "mime_expressions.h"
 #include "libserver/html/html.h"
 #include "lua/lua_common.h"
+#include "libserver/mempool_vars_internal.h"
 #include "utlist.h"
 
 gboolean rspamd_compare_encoding(struct rspamd_task *task,
@@ -114,8 +115,9 @@ struct rspamd_regexp_atom {
  * Rspamd expression function
  */
 struct rspamd_function_atom {
-	char *name;   /**< name of function								*/
-	GArray *args; /**< its args										*/
+	char *name;     /**< name of function								*/
+	GArray *args;   /**< its args										*/
+	char *memo_key; /**< name and normalised args to memoize result per task	*/
 };
 
 enum rspamd_mime_atom_type {
@@ -144,28 +146,30 @@ static struct _fl {
 	const char *name;
 	rspamd_internal_func_t func;
 	void *user_data;
+	/* Result depends merely on the message, so it is evaluated once per task */
+	gboolean memoize;
 } rspamd_functions_list[] = {
-	{"check_smtp_data", rspamd_check_smtp_data, NULL},
-	{"compare_encoding", rspamd_compare_encoding, NULL},
-	{"compare_parts_distance", rspamd_parts_distance, NULL},
-	{"compare_recipients_distance", rspamd_recipients_distance, NULL},
-	{"compare_transfer_encoding", rspamd_compare_transfer_encoding, NULL},
-	{"content_type_compare_param", rspamd_content_type_compare_param, NULL},
-	{"content_type_has_param", rspamd_content_type_has_param, NULL},
-	{"content_type_is_subtype", rspamd_content_type_is_subtype, NULL},
-	{"content_type_is_type", rspamd_content_type_is_type, NULL},
-	{"has_content_part", rspamd_has_content_part, NULL},
-	{"has_content_part_len", rspamd_has_content_part_len, NULL},
-	{"has_fake_html", rspamd_has_fake_html, NULL},
-	{"has_flag", rspamd_has_flag_expr, NULL},
-	{"has_html_tag", rspamd_has_html_tag, NULL},
-	{"has_only_html_part", rspamd_has_only_html_part, NULL},
-	{"has_symbol", rspamd_has_symbol_expr, NULL},
-	{"header_exists", rspamd_header_exists, NULL},
-	{"is_empty_body", rspamd_is_empty_body, NULL},
-	{"is_html_balanced", rspamd_is_html_balanced, NULL},
-	{"is_recipients_sorted", rspamd_is_recipients_sorted, NULL},
-	{"raw_header_exists", rspamd_raw_header_exists, NULL},
+	{"check_smtp_data", rspamd_check_smtp_data, NULL, TRUE},
+	{"compare_encoding", rspamd_compare_encoding, NULL, TRUE},
+	{"compare_parts_distance", rspamd_parts_distance, NULL, TRUE},
+	{"compare_recipients_distance", rspamd_recipients_distance, NULL, TRUE},
+	{"compare_transfer_encoding", rspamd_compare_transfer_encoding, NULL, TRUE},
+	{"content_type_compare_param", rspamd_content_type_compare_param, NULL, TRUE},
+	{"content_type_has_param", rspamd_content_type_has_param, NULL, TRUE},
+	{"content_type_is_subtype", rspamd_content_type_is_subtype, NULL, TRUE},
+	{"content_type_is_type", rspamd_content_type_is_type, NULL, TRUE},
+	{"has_content_part", rspamd_has_content_part, NULL, TRUE},
+	{"has_content_part_len", rspamd_has_content_part_len, NULL, TRUE},
+	{"has_fake_html", rspamd_has_fake_html, NULL, TRUE},
+	{"has_flag", rspamd_has_flag_expr, NULL, FALSE},
+	{"has_html_tag", rspamd_has_html_tag, NULL, TRUE},
+	{"has_only_html_part", rspamd_has_only_html_part, NULL, TRUE},
+	{"has_symbol", rspamd_has_symbol_expr, NULL, FALSE},
+	{"header_exists", rspamd_header_exists, NULL, TRUE},
+	{"is_empty_body", rspamd_is_empty_body, NULL, TRUE},
+	{"is_html_balanced", rspamd_is_html_balanced, NULL, TRUE},
+	{"is_recipients_sorted", rspamd_is_recipients_sorted, NULL, TRUE},
+	{"raw_header_exists", rspamd_raw_header_exists, NULL, TRUE},
 };
 
 const struct rspamd_atom_subr mime_expr_subr = {
@@ -530,6 +534,38 @@ rspamd_mime_expr_parse_regexp_atom(rspamd_mempool_t *pool, const char *line,
 	return result;
 }
 
+/*
+ * Atoms with the same function and arguments share the key: strings are
+ * prefixed by their length and regexps are identified by pointers, as
+ * regexps with the same text are the same objects in the regexp cache
+ */
+static char *
+rspamd_mime_expr_function_memo_key(rspamd_mempool_t *pool,
+								   struct rspamd_function_atom *func)
+{
+	GString *buf = g_string_new(func->name);
+	struct expression_argument *arg;
+	char *ret;
+	unsigned int i;
+
+	for (i = 0; i < func->args->len; i++) {
+		arg = &g_array_index(func->args, struct expression_argument, i);
+
+		if (arg->type == EXPRESSION_ARGUMENT_REGEXP) {
+			rspamd_printf_gstring(buf, "|r%p", arg->data);
+		}
+		else {
+			rspamd_printf_gstring(buf, "|s%uz:%s", strlen(arg->data),
+								  (const char *) arg->data);
+		}
+	}
+
+	ret = rspamd_mempool_strdup(pool, buf->str);
+	g_string_free(buf, TRUE);
+
+	return ret;
+}
+
 struct rspamd_function_atom *
 rspamd_mime_expr_parse_function_atom(rspamd_mempool_t *pool, const char *input)
 {
@@ -641,6 +677,8 @@ rspamd_mime_expr_parse_function_atom(rspamd_mempool_t *pool, const char *input)
 		}
 	}
 
+	res->memo_key = rspamd_mime_expr_function_memo_key(pool, res);
+
 	return res;
 }
 
@@ -1121,6 +1159,9 @@ rspamd_mime_expr_process_function(struct rspamd_function_atom *func,
 								  lua_State *L)
 {
 	struct _fl *selected, key;
+	GHashTable *memo;
+	gpointer cached;
+	gboolean ret;
 
 	key.name = func->name;
 
@@ -1134,7 +1175,28 @@ rspamd_mime_expr_process_function(struct rspamd_function_atom *func,
 		return FALSE;
 	}
 
-	return selected->func(task, func->args, selected->user_data);
+	if (!selected->memoize) {
+		return selected->func(task, func->args, selected->user_data);
+	}
+
+	memo = rspamd_mempool_get_variable(task->task_pool,
+									   RSPAMD_MEMPOOL_MIME_EXPR_MEMO);
+
+	if (memo == NULL) {
+		/* Keys are owned by atoms in the config pool */
+		memo = g_hash_table_new(rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_set_variable(task->task_pool,
+									RSPAMD_MEMPOOL_MIME_EXPR_MEMO, memo,
+									(rspamd_mempool_destruct_t) g_hash_table_unref);
+	}
+	else if ((cached = g_hash_table_lookup(memo, func->memo_key)) != NULL) {
+		return GPOINTER_TO_INT(cached) - 1;
+	}
+
+	ret = selected->func(task, func->args, selected->user_data);
+	g_hash_table_insert(memo, func->memo_key, GINT_TO_POINTER(ret + 1));
+
+	return ret;
 }
 
 static double
@@ -1236,6 +1298,7 @@ void register_expression_function(const char *name,
 	new[functions_number - 1].name = name;
 	new[functions_number - 1].func = func;
 	new[functions_number - 1].user_data = user_data;
+	new[functions_number - 1].memoize = FALSE;
 	qsort(new, functions_number, sizeof(struct _fl), fl_cmp);
 	list_ptr = new;
 }
@@ -1540,8 +1603,8 @@ rspamd_compare_transfer_encoding(struct rspamd_task *task,
 								 void *unused)
 {
 	struct expression_argument *arg;
+	struct rspamd_mime_parts_table *tbl;
 	unsigned int i;
-	struct rspamd_mime_part *part;
 	enum rspamd_cte cte;
 
 	if (args == NULL) {
@@ -1562,12 +1625,11 @@ rspamd_compare_transfer_encoding(struct rspamd_task *task,
 		return FALSE;
 	}
 
-	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
-	{
-		if (IS_PART_TEXT(part)) {
-			if (part->cte == cte) {
-				return TRUE;
-			}
+	tbl = rspamd_message_get_parts_table(task);
+
+	for (i = 0; i < tbl->nparts; i++) {
+		if (tbl->type[i] == RSPAMD_MIME_PART_TEXT && tbl->cte[i] == cte) {
+			return TRUE;
 		}
 	}
 
@@ -2273,12 +2335,13 @@ rspamd_is_empty_body(struct rspamd_task *task,
 					 GArray *args,
 					 void *unused)
 {
-	struct rspamd_mime_part *part;
+	struct rspamd_mime_parts_table *tbl;
 	unsigned int i;
 
-	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
-	{
-		if (part->parsed_data.len > 0) {
+	tbl = rspamd_message_get_parts_table(task);
+
+	for (i = 0; i < tbl->nparts; i++) {
+		if (tbl->parsed_len[i] > 0) {
 			return FALSE;
 		}
 	}
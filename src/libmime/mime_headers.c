@@ -30,14 +30,104 @@ KHASH_INIT(rspamd_mime_headers_htb, char *,
 
 struct rspamd_mime_headers_table {
 	khash_t(rspamd_mime_headers_htb) htb;
+	/* Heads of the same elements as in htb for the well-known headers */
+	struct rspamd_mime_header *known[RSPAMD_MIME_HEADER_MAX];
 	ref_entry_t ref;
 };
 
+struct rspamd_mime_header_known_name {
+	const char *name;
+	gsize len;
+};
+
+#define RSPAMD_MIME_HEADER_NAME(s) {s, sizeof(s) - 1}
+
+/* Indexed by enum rspamd_mime_header_id */
+static const struct rspamd_mime_header_known_name known_headers[RSPAMD_MIME_HEADER_MAX] = {
+	[RSPAMD_MIME_HEADER_UNKNOWN] = {NULL, 0},
+	[RSPAMD_MIME_HEADER_RECEIVED] = RSPAMD_MIME_HEADER_NAME("Received"),
+	[RSPAMD_MIME_HEADER_FROM] = RSPAMD_MIME_HEADER_NAME("From"),
+	[RSPAMD_MIME_HEADER_TO] = RSPAMD_MIME_HEADER_NAME("To"),
+	[RSPAMD_MIME_HEADER_CC] = RSPAMD_MIME_HEADER_NAME("Cc"),
+	[RSPAMD_MIME_HEADER_BCC] = RSPAMD_MIME_HEADER_NAME("Bcc"),
+	[RSPAMD_MIME_HEADER_SENDER] = RSPAMD_MIME_HEADER_NAME("Sender"),
+	[RSPAMD_MIME_HEADER_REPLY_TO] = RSPAMD_MIME_HEADER_NAME("Reply-To"),
+	[RSPAMD_MIME_HEADER_SUBJECT] = RSPAMD_MIME_HEADER_NAME("Subject"),
+	[RSPAMD_MIME_HEADER_DATE] = RSPAMD_MIME_HEADER_NAME("Date"),
+	[RSPAMD_MIME_HEADER_MESSAGE_ID] = RSPAMD_MIME_HEADER_NAME("Message-Id"),
+	[RSPAMD_MIME_HEADER_IN_REPLY_TO] = RSPAMD_MIME_HEADER_NAME("In-Reply-To"),
+	[RSPAMD_MIME_HEADER_REFERENCES] = RSPAMD_MIME_HEADER_NAME("References"),
+	[RSPAMD_MIME_HEADER_RETURN_PATH] = RSPAMD_MIME_HEADER_NAME("Return-Path"),
+	[RSPAMD_MIME_HEADER_DELIVERED_TO] = RSPAMD_MIME_HEADER_NAME("Delivered-To"),
+	[RSPAMD_MIME_HEADER_MIME_VERSION] = RSPAMD_MIME_HEADER_NAME("MIME-Version"),
+	[RSPAMD_MIME_HEADER_CONTENT_TYPE] = RSPAMD_MIME_HEADER_NAME("Content-Type"),
+	[RSPAMD_MIME_HEADER_CONTENT_TRANSFER_ENCODING] = RSPAMD_MIME_HEADER_NAME("Content-Transfer-Encoding"),
+	[RSPAMD_MIME_HEADER_CONTENT_DISPOSITION] = RSPAMD_MIME_HEADER_NAME("Content-Disposition"),
+	[RSPAMD_MIME_HEADER_CONTENT_ID] = RSPAMD_MIME_HEADER_NAME("Content-Id"),
+	[RSPAMD_MIME_HEADER_DKIM_SIGNATURE] = RSPAMD_MIME_HEADER_NAME("DKIM-Signature"),
+	[RSPAMD_MIME_HEADER_ARC_SEAL] = RSPAMD_MIME_HEADER_NAME("ARC-Seal"),
+	[RSPAMD_MIME_HEADER_ARC_MESSAGE_SIGNATURE] = RSPAMD_MIME_HEADER_NAME("ARC-Message-Signature"),
+	[RSPAMD_MIME_HEADER_ARC_AUTHENTICATION_RESULTS] = RSPAMD_MIME_HEADER_NAME("ARC-Authentication-Results"),
+	[RSPAMD_MIME_HEADER_AUTHENTICATION_RESULTS] = RSPAMD_MIME_HEADER_NAME("Authentication-Results"),
+	[RSPAMD_MIME_HEADER_LIST_ID] = RSPAMD_MIME_HEADER_NAME("List-Id"),
+	[RSPAMD_MIME_HEADER_LIST_UNSUBSCRIBE] = RSPAMD_MIME_HEADER_NAME("List-Unsubscribe"),
+	[RSPAMD_MIME_HEADER_X_MAILER] = RSPAMD_MIME_HEADER_NAME("X-Mailer"),
+	[RSPAMD_MIME_HEADER_USER_AGENT] = RSPAMD_MIME_HEADER_NAME("User-Agent"),
+};
+
+#undef RSPAMD_MIME_HEADER_NAME
+
+enum rspamd_mime_header_id
+rspamd_mime_header_id_by_name(const char *name, gsize len)
+{
+	unsigned int i;
+
+	/* The list is short and lengths mostly differ, so only a few names are compared */
+	for (i = RSPAMD_MIME_HEADER_UNKNOWN + 1; i < RSPAMD_MIME_HEADER_MAX; i++) {
+		if (known_headers[i].len == len &&
+			g_ascii_strncasecmp(known_headers[i].name, name, len) == 0) {
+			return (enum rspamd_mime_header_id) i;
+		}
+	}
+
+	return RSPAMD_MIME_HEADER_UNKNOWN;
+}
+
+static char *
+rspamd_mime_header_decode_value(rspamd_mempool_t *pool, const char *in,
+								gsize inlen, gboolean *invalid_utf)
+{
+	char *decoded;
+
+	decoded = rspamd_mime_header_decode(pool, in, inlen, invalid_utf);
+
+	if (decoded == NULL) {
+		/* As we strip comments in place... */
+		decoded = rspamd_mempool_strdup(pool, "");
+	}
+
+	/* We also validate utf8 and replace all non-valid utf8 chars */
+	rspamd_mime_charset_utf_enforce(decoded, strlen(decoded));
+
+	return decoded;
+}
+
+char *
+rspamd_mime_header_get_decoded(struct rspamd_mime_header *rh)
+{
+	if (rh->decoded == NULL && rh->value != NULL && rh->pool != NULL) {
+		rh->decoded = rspamd_mime_header_decode_value(rh->pool, rh->value,
+													  strlen(rh->value), NULL);
+	}
+
+	return rh->decoded;
+}
+
 static void
 rspamd_mime_header_check_special(struct rspamd_task *task,
-								 struct rspamd_mime_header *rh)
+								 struct rspamd_mime_header *rh,
+								 enum rspamd_mime_header_id hdr_id)
 {
-	uint64_t h;
 	const char *p, *end;
 	char *id;
 	int max_recipients = -1, len;
@@ -46,39 +136,50 @@ rspamd_mime_header_check_special(struct rspamd_task *task,
 		max_recipients = task->cfg->max_recipients;
 	}
 
-	h = rspamd_icase_hash(rh->name, strlen(rh->name), 0xdeadbabe);
+	switch (hdr_id) {
+	case RSPAMD_MIME_HEADER_RECEIVED:
+	case RSPAMD_MIME_HEADER_MESSAGE_ID:
+	case RSPAMD_MIME_HEADER_SUBJECT:
+	case RSPAMD_MIME_HEADER_RETURN_PATH:
+	case RSPAMD_MIME_HEADER_DELIVERED_TO:
+		/* These headers are always used decoded */
+		rspamd_mime_header_get_decoded(rh);
+		break;
+	default:
+		break;
+	}
 
-	switch (h) {
-	case 0x88705DC4D9D61ABULL: /* received */
+	switch (hdr_id) {
+	case RSPAMD_MIME_HEADER_RECEIVED:
 		if (rspamd_received_header_parse(task, rh->decoded, strlen(rh->decoded), rh)) {
 			rh->flags |= RSPAMD_HEADER_RECEIVED;
 		}
 		break;
-	case 0x76F31A09F4352521ULL: /* to */
+	case RSPAMD_MIME_HEADER_TO:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_TO | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x7EB117C1480B76ULL: /* cc */
+	case RSPAMD_MIME_HEADER_CC:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_CC | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xE4923E11C4989C8DULL: /* bcc */
+	case RSPAMD_MIME_HEADER_BCC:
 		MESSAGE_FIELD(task, rcpt_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, rcpt_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_BCC | RSPAMD_HEADER_RCPT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x41E1985EDC1CBDE4ULL: /* from */
+	case RSPAMD_MIME_HEADER_FROM:
 		MESSAGE_FIELD(task, from_mime) = rspamd_email_address_from_mime(task->task_pool,
 																		rh->value, strlen(rh->value),
 																		MESSAGE_FIELD(task, from_mime), max_recipients);
 		rh->flags |= RSPAMD_HEADER_FROM | RSPAMD_HEADER_SENDER | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0x43A558FC7C240226ULL: /* message-id */ {
+	case RSPAMD_MIME_HEADER_MESSAGE_ID: {
 
 		rh->flags = RSPAMD_HEADER_MESSAGE_ID | RSPAMD_HEADER_UNIQUE;
 		p = rh->decoded;
@@ -119,65 +220,74 @@ rspamd_mime_header_check_special(struct rspamd_task *task,
 
 		break;
 	}
-	case 0xB91D3910358E8212ULL: /* subject */
+	case RSPAMD_MIME_HEADER_SUBJECT:
 		if (MESSAGE_FIELD(task, subject) == NULL) {
 			MESSAGE_FIELD(task, subject) = rh->decoded;
 		}
 		rh->flags = RSPAMD_HEADER_SUBJECT | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xEE4AA2EAAC61D6F4ULL: /* return-path */
+	case RSPAMD_MIME_HEADER_RETURN_PATH:
 		if (task->from_envelope == NULL) {
 			task->from_envelope = rspamd_email_address_from_smtp(rh->decoded,
 																 strlen(rh->decoded));
 		}
 		rh->flags = RSPAMD_HEADER_RETURN_PATH | RSPAMD_HEADER_UNIQUE;
 		break;
-	case 0xB9EEFAD2E93C2161ULL: /* delivered-to */
+	case RSPAMD_MIME_HEADER_DELIVERED_TO:
 		if (task->deliver_to == NULL) {
 			task->deliver_to = rh->decoded;
 		}
 		rh->flags = RSPAMD_HEADER_DELIVERED_TO;
 		break;
-	case 0x2EC3BFF3C393FC10ULL: /* date */
-	case 0xAC0DDB1A1D214CAULL:  /* sender */
-	case 0x54094572367AB695ULL: /* in-reply-to */
-	case 0x81CD9E9131AB6A9AULL: /* content-type */
-	case 0xC39BD9A75AA25B60ULL: /* content-transfer-encoding */
-	case 0xB3F6704CB3AD6589ULL: /* references */
+	case RSPAMD_MIME_HEADER_DATE:
+	case RSPAMD_MIME_HEADER_SENDER:
+	case RSPAMD_MIME_HEADER_IN_REPLY_TO:
+	case RSPAMD_MIME_HEADER_CONTENT_TYPE:
+	case RSPAMD_MIME_HEADER_CONTENT_TRANSFER_ENCODING:
+	case RSPAMD_MIME_HEADER_REFERENCES:
 		rh->flags = RSPAMD_HEADER_UNIQUE;
 		break;
+	default:
+		break;
 	}
 }
 
 static void
 rspamd_mime_header_add(struct rspamd_task *task,
-					   khash_t(rspamd_mime_headers_htb) * target,
+					   struct rspamd_mime_headers_table *target,
 					   struct rspamd_mime_header **order_ptr,
 					   struct rspamd_mime_header *rh,
 					   gboolean check_special)
 {
 	khiter_t k;
 	struct rspamd_mime_header *ex;
+	enum rspamd_mime_header_id id;
 	int res;
 
-	k = kh_put(rspamd_mime_headers_htb, target, rh->name, &res);
+	id = rspamd_mime_header_id_by_name(rh->name, strlen(rh->name));
+	k = kh_put(rspamd_mime_headers_htb, &target->htb, rh->name, &res);
 
 	if (res == 0) {
-		ex = kh_value(target, k);
+		ex = kh_value(&target->htb, k);
 		DL_APPEND(ex, rh);
 		msg_debug_task("append raw header %s: %s", rh->name, rh->value);
 	}
 	else {
-		kh_value(target, k) = rh;
+		kh_value(&target->htb, k) = rh;
 		rh->prev = rh;
 		rh->next = NULL;
+
+		if (id != RSPAMD_MIME_HEADER_UNKNOWN) {
+			target->known[id] = rh;
+		}
+
 		msg_debug_task("add new raw header %s: %s", rh->name, rh->value);
 	}
 
 	LL_PREPEND2(*order_ptr, rh, ord_next);
 
 	if (check_special) {
-		rspamd_mime_header_check_special(task, rh);
+		rspamd_mime_header_check_special(task, rh, id);
 	}
 }
 
@@ -385,38 +495,39 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 			}
 
 			nh->value = tmp;
+			nh->pool = task->task_pool;
 
-			gboolean broken_utf = FALSE;
-
-			nh->decoded = rspamd_mime_header_decode(task->task_pool,
-													nh->value, strlen(tmp), &broken_utf);
+			/*
+			 * Values are decoded on demand, but raw 8 bit characters are
+			 * checked here as they affect the task flags
+			 */
+			if (rspamd_str_has_8bit((const unsigned char *) tmp, strlen(tmp))) {
+				gboolean broken_utf = FALSE;
 
-			if (broken_utf) {
-				task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
-			}
+				nh->decoded = rspamd_mime_header_decode_value(task->task_pool,
+															  tmp, strlen(tmp), &broken_utf);
 
-			if (nh->decoded == NULL) {
-				/* As we strip comments in place... */
-				nh->decoded = rspamd_mempool_strdup(task->task_pool, "");
+				if (broken_utf) {
+					task->flags |= RSPAMD_TASK_FLAG_BAD_UNICODE;
+				}
 			}
 
-			/* We also validate utf8 and replace all non-valid utf8 chars */
-			rspamd_mime_charset_utf_enforce(nh->decoded, strlen(nh->decoded));
 			nh->order = norder++;
-			rspamd_mime_header_add(task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add(task, target, order_ptr, nh, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
 		case 5:
 			/* Header has only name, no value */
 			nh->value = rspamd_mempool_strdup(task->task_pool, "");
+			nh->pool = task->task_pool;
 			nh->decoded = rspamd_mempool_strdup(task->task_pool, "");
 			nh->raw_len = p - nh->raw_value;
 			if (shift_by_one) {
 				nh->raw_len++;
 			}
 			nh->order = norder++;
-			rspamd_mime_header_add(task, &target->htb, order_ptr, nh, check_newlines);
+			rspamd_mime_header_add(task, target, order_ptr, nh, check_newlines);
 			nh = NULL;
 			state = 0;
 			break;
@@ -916,6 +1027,29 @@ rspamd_mime_message_id_generate(const char *fqdn)
 	return g_string_free(out, FALSE);
 }
 
+static inline struct rspamd_mime_header *
+rspamd_message_header_select(struct rspamd_mime_header *hdr, gboolean need_modified)
+{
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	if (!need_modified) {
+		if (hdr->flags & RSPAMD_HEADER_NON_EXISTING) {
+			return NULL;
+		}
+
+		return hdr;
+	}
+	else {
+		if (hdr->flags & RSPAMD_HEADER_MODIFIED) {
+			return hdr->modified_chain;
+		}
+
+		return hdr;
+	}
+}
+
 struct rspamd_mime_header *
 rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 									const char *field,
@@ -927,7 +1061,6 @@ rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 
 	khiter_t k;
 	khash_t(rspamd_mime_headers_htb) *htb = &hdrs->htb;
-	struct rspamd_mime_header *hdr;
 
 	if (htb) {
 		k = kh_get(rspamd_mime_headers_htb, htb, (char *) field);
@@ -936,25 +1069,32 @@ rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 			return NULL;
 		}
 
-		hdr = kh_value(htb, k);
-
-		if (!need_modified) {
-			if (hdr->flags & RSPAMD_HEADER_NON_EXISTING) {
-				return NULL;
-			}
+		return rspamd_message_header_select(kh_value(htb, k), need_modified);
+	}
 
-			return hdr;
-		}
-		else {
-			if (hdr->flags & RSPAMD_HEADER_MODIFIED) {
-				return hdr->modified_chain;
-			}
+	return NULL;
+}
 
-			return hdr;
-		}
+struct rspamd_mime_header *
+rspamd_message_get_header_from_hash_by_id(struct rspamd_mime_headers_table *hdrs,
+										  enum rspamd_mime_header_id id,
+										  gboolean need_modified)
+{
+	if (hdrs == NULL || id <= RSPAMD_MIME_HEADER_UNKNOWN || id >= RSPAMD_MIME_HEADER_MAX) {
+		return NULL;
 	}
 
-	return NULL;
+	return rspamd_message_header_select(hdrs->known[id], need_modified);
+}
+
+struct rspamd_mime_header *
+rspamd_message_get_header_array_by_id(struct rspamd_task *task,
+									  enum rspamd_mime_header_id id,
+									  gboolean need_modified)
+{
+	return rspamd_message_get_header_from_hash_by_id(
+		MESSAGE_FIELD_CHECK(task, raw_headers),
+		id, need_modified);
 }
 
 struct rspamd_mime_header *
@@ -1116,9 +1256,15 @@ void rspamd_message_set_modified_header(struct rspamd_task *task,
 			hdr_elt->name = rspamd_mempool_strdup(task->task_pool, hdr_name);
 
 			int r;
+			enum rspamd_mime_header_id id;
 			k = kh_put(rspamd_mime_headers_htb, htb, hdr_elt->name, &r);
 
 			kh_value(htb, k) = hdr_elt;
+			id = rspamd_mime_header_id_by_name(hdr_name, strlen(hdr_name));
+
+			if (id != RSPAMD_MIME_HEADER_UNKNOWN) {
+				hdrs->known[id] = hdr_elt;
+			}
 
 			if (order_ptr) {
 				/*
@@ -55,6 +55,43 @@ enum rspamd_mime_header_flags {
 	RSPAMD_HEADER_NON_EXISTING = 1u << 18u, /* Header was not in the original message */
 };
 
+/*
+ * Well-known headers that are also indexed by their id in a headers table,
+ * so they are looked up without hashing of their names
+ */
+enum rspamd_mime_header_id {
+	RSPAMD_MIME_HEADER_UNKNOWN = 0,
+	RSPAMD_MIME_HEADER_RECEIVED,
+	RSPAMD_MIME_HEADER_FROM,
+	RSPAMD_MIME_HEADER_TO,
+	RSPAMD_MIME_HEADER_CC,
+	RSPAMD_MIME_HEADER_BCC,
+	RSPAMD_MIME_HEADER_SENDER,
+	RSPAMD_MIME_HEADER_REPLY_TO,
+	RSPAMD_MIME_HEADER_SUBJECT,
+	RSPAMD_MIME_HEADER_DATE,
+	RSPAMD_MIME_HEADER_MESSAGE_ID,
+	RSPAMD_MIME_HEADER_IN_REPLY_TO,
+	RSPAMD_MIME_HEADER_REFERENCES,
+	RSPAMD_MIME_HEADER_RETURN_PATH,
+	RSPAMD_MIME_HEADER_DELIVERED_TO,
+	RSPAMD_MIME_HEADER_MIME_VERSION,
+	RSPAMD_MIME_HEADER_CONTENT_TYPE,
+	RSPAMD_MIME_HEADER_CONTENT_TRANSFER_ENCODING,
+	RSPAMD_MIME_HEADER_CONTENT_DISPOSITION,
+	RSPAMD_MIME_HEADER_CONTENT_ID,
+	RSPAMD_MIME_HEADER_DKIM_SIGNATURE,
+	RSPAMD_MIME_HEADER_ARC_SEAL,
+	RSPAMD_MIME_HEADER_ARC_MESSAGE_SIGNATURE,
+	RSPAMD_MIME_HEADER_ARC_AUTHENTICATION_RESULTS,
+	RSPAMD_MIME_HEADER_AUTHENTICATION_RESULTS,
+	RSPAMD_MIME_HEADER_LIST_ID,
+	RSPAMD_MIME_HEADER_LIST_UNSUBSCRIBE,
+	RSPAMD_MIME_HEADER_X_MAILER,
+	RSPAMD_MIME_HEADER_USER_AGENT,
+	RSPAMD_MIME_HEADER_MAX,
+};
+
 struct rspamd_mime_header {
 	const char *raw_value; /* As it is in the message (unfolded and unparsed) */
 	gsize raw_len;
@@ -64,7 +101,8 @@ struct rspamd_mime_header {
 	char *name; /* Also used for key */
 	char *value;
 	char *separator;
-	char *decoded;
+	char *decoded; /* Filled on demand, use rspamd_mime_header_get_decoded */
+	rspamd_mempool_t *pool; /* Where decoded value is allocated */
 	struct rspamd_mime_header *modified_chain; /* Headers modified during transform */
 	struct rspamd_mime_header *prev, *next;    /* Headers with the same name */
 	struct rspamd_mime_header *ord_next;       /* Overall order of headers, slist */
@@ -96,6 +134,14 @@ void rspamd_mime_headers_process(struct rspamd_task *task,
 char *rspamd_mime_header_decode(rspamd_mempool_t *pool, const char *in,
 								gsize inlen, gboolean *invalid_utf);
 
+/**
+ * Returns decoded value of a header, rfc2047 decoding is performed on the
+ * first call
+ * @param rh header
+ * @return zero terminated utf8 value or NULL if a header has no value
+ */
+char *rspamd_mime_header_get_decoded(struct rspamd_mime_header *rh);
+
 /**
  * Encode mime header if needed
  * @param in
@@ -133,6 +179,29 @@ rspamd_message_get_header_from_hash(struct rspamd_mime_headers_table *hdrs,
 									const char *field,
 									gboolean need_modified);
 
+/**
+ * Returns id of a well-known header or RSPAMD_MIME_HEADER_UNKNOWN
+ * @param name header's name (caseless)
+ * @param len length of the name
+ */
+enum rspamd_mime_header_id rspamd_mime_header_id_by_name(const char *name, gsize len);
+
+/**
+ * Same as `rspamd_message_get_header_from_hash` for a well-known header
+ */
+struct rspamd_mime_header *
+rspamd_message_get_header_from_hash_by_id(struct rspamd_mime_headers_table *hdrs,
+										  enum rspamd_mime_header_id id,
+										  gboolean need_modified);
+
+/**
+ * Same as `rspamd_message_get_header_array` for a well-known header
+ */
+struct rspamd_mime_header *
+rspamd_message_get_header_array_by_id(struct rspamd_task *task,
+									  enum rspamd_mime_header_id id,
+									  gboolean need_modified);
+
 /**
  * Modifies a header (or insert one if not found)
  * @param hdrs
@@ -16,6 +16,7 @@
 
 
 #include "config.h"
+#include "platform_config.h"
 #include "task.h"
 #include "mime_parser.h"
 #include "mime_headers.h"
@@ -27,6 +28,14 @@
 #include <openssl/pkcs7.h>
 #include "contrib/fastutf8/fastutf8.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+extern unsigned cpu_config;
+
 struct rspamd_mime_parser_lib_ctx {
 	struct rspamd_multipattern *mp_boundary;
 	unsigned char hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
@@ -398,7 +407,7 @@ rspamd_mime_part_get_cte(struct rspamd_task *task,
 	enum rspamd_cte cte = RSPAMD_CTE_UNKNOWN;
 	gboolean parent_propagated = FALSE;
 
-	hdr = rspamd_message_get_header_from_hash(hdrs, "Content-Transfer-Encoding", FALSE);
+	hdr = rspamd_message_get_header_from_hash_by_id(hdrs, RSPAMD_MIME_HEADER_CONTENT_TRANSFER_ENCODING, FALSE);
 
 	if (hdr == NULL) {
 		if (part->parent_part && part->parent_part->cte != RSPAMD_CTE_UNKNOWN &&
@@ -478,8 +487,8 @@ rspamd_mime_part_get_cd(struct rspamd_task *task, struct rspamd_mime_part *part)
 	rspamd_ftok_t srch;
 	struct rspamd_content_type_param *found;
 
-	hdr = rspamd_message_get_header_from_hash(part->raw_headers,
-											  "Content-Disposition", FALSE);
+	hdr = rspamd_message_get_header_from_hash_by_id(part->raw_headers,
+													RSPAMD_MIME_HEADER_CONTENT_DISPOSITION, FALSE);
 
 
 	if (hdr == NULL) {
@@ -568,83 +577,436 @@ rspamd_mime_part_get_cd(struct rspamd_task *task, struct rspamd_mime_part *part)
 	part->cd = cd;
 }
 
+/* Blake2b applied to string 'rspamd' */
+static const unsigned char rspamd_mime_digest_key[] = {
+	0xef,
+	0x43,
+	0xae,
+	0x80,
+	0xcc,
+	0x8d,
+	0xc3,
+	0x4c,
+	0x6f,
+	0x1b,
+	0xd6,
+	0x18,
+	0x1b,
+	0xae,
+	0x87,
+	0x74,
+	0x0c,
+	0xca,
+	0xf7,
+	0x8e,
+	0x5f,
+	0x2e,
+	0x54,
+	0x32,
+	0xf6,
+	0x79,
+	0xb9,
+	0x27,
+	0x26,
+	0x96,
+	0x20,
+	0x92,
+	0x70,
+	0x07,
+	0x85,
+	0xeb,
+	0x83,
+	0xf7,
+	0x89,
+	0xe0,
+	0xd7,
+	0x32,
+	0x2a,
+	0xd2,
+	0x1a,
+	0x64,
+	0x41,
+	0xef,
+	0x49,
+	0xff,
+	0xc3,
+	0x8c,
+	0x54,
+	0xf9,
+	0x67,
+	0x74,
+	0x30,
+	0x1e,
+	0x70,
+	0x2e,
+	0xb7,
+	0x12,
+	0x09,
+	0xfe,
+};
+
+/* Base64 and QP parts larger than this are decoded on the first access */
+#define RSPAMD_MIME_LAZY_DECODE_MIN (64 * 1024)
+/* Size of encoded chunks for streaming decoding, must be a multiple of 4 */
+#define RSPAMD_MIME_STREAM_CHUNK 4096
+
+struct rspamd_mime_part_lazy {
+	rspamd_mempool_t *pool;
+	gsize nchars; /* number of base64 alphabet characters in raw data, 0 for QP */
+};
+
+static gboolean
+rspamd_mime_part_qp_stream(struct rspamd_mime_part *part, gsize *decoded_len)
+{
+	char out[RSPAMD_MIME_STREAM_CHUNK + 8];
+	struct rspamd_qp_decoder dec;
+	rspamd_cryptobox_hash_state_t st;
+	const char *p, *end;
+	gsize total = 0, chunk;
+	gssize r;
+
+	p = part->raw_data.begin;
+	end = p + part->raw_data.len;
+	rspamd_qp_decoder_init(&dec);
+	rspamd_cryptobox_hash_init(&st, rspamd_mime_digest_key,
+							   sizeof(rspamd_mime_digest_key));
+
+	while (p < end) {
+		chunk = MIN(end - p, RSPAMD_MIME_STREAM_CHUNK);
+		r = rspamd_qp_decoder_feed(&dec, p, chunk, out, sizeof(out),
+								   p + chunk == end);
+
+		if (r == -1) {
+			return FALSE;
+		}
+
+		rspamd_cryptobox_hash_update(&st, out, r);
+		total += r;
+		p += chunk;
+	}
+
+	if (total > 0) {
+		rspamd_cryptobox_hash_final(&st, part->digest);
+	}
+
+	*decoded_len = total;
+
+	return TRUE;
+}
+
+/* Decodes at least `need` bytes from the beginning of a QP part */
+static gssize
+rspamd_mime_part_qp_prefix(struct rspamd_mime_part *part, char *out,
+						   gsize outlen, gsize need)
+{
+	struct rspamd_qp_decoder dec;
+	const char *p, *end;
+	gsize total = 0, chunk;
+	gssize r;
+
+	p = part->raw_data.begin;
+	end = p + part->raw_data.len;
+	rspamd_qp_decoder_init(&dec);
+
+	while (p < end && total < need) {
+		chunk = MIN(end - p, RSPAMD_MIME_STREAM_CHUNK);
+		r = rspamd_qp_decoder_feed(&dec, p, chunk, out + total, outlen - total,
+								   p + chunk == end);
+
+		if (r == -1) {
+			return -1;
+		}
+
+		total += r;
+		p += chunk;
+	}
+
+	return total;
+}
+
 void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part)
 {
-	/* Blake2b applied to string 'rspamd' */
-	static const unsigned char hash_key[] = {
-		0xef,
-		0x43,
-		0xae,
-		0x80,
-		0xcc,
-		0x8d,
-		0xc3,
-		0x4c,
-		0x6f,
-		0x1b,
-		0xd6,
-		0x18,
-		0x1b,
-		0xae,
-		0x87,
-		0x74,
-		0x0c,
-		0xca,
-		0xf7,
-		0x8e,
-		0x5f,
-		0x2e,
-		0x54,
-		0x32,
-		0xf6,
-		0x79,
-		0xb9,
-		0x27,
-		0x26,
-		0x96,
-		0x20,
-		0x92,
-		0x70,
-		0x07,
-		0x85,
-		0xeb,
-		0x83,
-		0xf7,
-		0x89,
-		0xe0,
-		0xd7,
-		0x32,
-		0x2a,
-		0xd2,
-		0x1a,
-		0x64,
-		0x41,
-		0xef,
-		0x49,
-		0xff,
-		0xc3,
-		0x8c,
-		0x54,
-		0xf9,
-		0x67,
-		0x74,
-		0x30,
-		0x1e,
-		0x70,
-		0x2e,
-		0xb7,
-		0x12,
-		0x09,
-		0xfe,
-	};
+	if (part->lazy) {
+		/* Digest has been calculated by the streaming decoder */
+		return;
+	}
 
 	if (part->parsed_data.len > 0) {
 		rspamd_cryptobox_hash(part->digest,
 							  part->parsed_data.begin, part->parsed_data.len,
-							  hash_key, sizeof(hash_key));
+							  rspamd_mime_digest_key, sizeof(rspamd_mime_digest_key));
 	}
 }
 
+static inline gboolean
+rspamd_mime_b64_is_alpha(unsigned char c)
+{
+	return g_ascii_isalnum(c) || c == '+' || c == '/';
+}
+
+/*
+ * Decodes base64 part in small chunks to get its digest and decoded length
+ * without allocating the decoded content. Chunked decoding is equal to
+ * the full one merely for well formed base64, so we refuse to process data
+ * with padding anywhere but in the end.
+ */
+static gboolean
+rspamd_mime_part_b64_stream(struct rspamd_mime_part *part,
+							gsize *decoded_len, gsize *nchars)
+{
+	unsigned char in[RSPAMD_MIME_STREAM_CHUNK + 4];
+	unsigned char out[RSPAMD_MIME_STREAM_CHUNK / 4 * 3 + 12];
+	rspamd_cryptobox_hash_state_t st;
+	const unsigned char *p, *end;
+	gsize inlen = 0, outlen, total = 0, nalpha = 0;
+	gboolean padding = FALSE;
+
+	p = (const unsigned char *) part->raw_data.begin;
+	end = p + part->raw_data.len;
+	rspamd_cryptobox_hash_init(&st, rspamd_mime_digest_key,
+							   sizeof(rspamd_mime_digest_key));
+
+	while (p < end) {
+		unsigned char c = *p++;
+
+		if (rspamd_mime_b64_is_alpha(c)) {
+			if (padding) {
+				return FALSE;
+			}
+
+			in[inlen++] = c;
+			nalpha++;
+
+			if (inlen == RSPAMD_MIME_STREAM_CHUNK) {
+				rspamd_cryptobox_base64_decode(in, inlen, out, &outlen);
+				rspamd_cryptobox_hash_update(&st, out, outlen);
+				total += outlen;
+				inlen = 0;
+			}
+		}
+		else if (c == '=') {
+			if (inlen == sizeof(in)) {
+				return FALSE;
+			}
+
+			padding = TRUE;
+			in[inlen++] = c;
+		}
+		/* Other characters are skipped by the decoder */
+	}
+
+	if (inlen > 0) {
+		rspamd_cryptobox_base64_decode(in, inlen, out, &outlen);
+		rspamd_cryptobox_hash_update(&st, out, outlen);
+		total += outlen;
+	}
+
+	if (total > 0) {
+		rspamd_cryptobox_hash_final(&st, part->digest);
+	}
+
+	*decoded_len = total;
+	*nchars = nalpha;
+
+	return TRUE;
+}
+
+static void
+rspamd_mime_part_decode_b64(struct rspamd_mime_part *part,
+							rspamd_mempool_t *pool)
+{
+	rspamd_fstring_t *parsed;
+
+	parsed = rspamd_fstring_sized_new(part->raw_data.len / 4 * 3 + 12);
+	rspamd_cryptobox_base64_decode(part->raw_data.begin,
+								   part->raw_data.len,
+								   parsed->str, &parsed->len);
+	part->parsed_data.begin = parsed->str;
+	part->parsed_data.len = parsed->len;
+	rspamd_mempool_notify_alloc(pool, parsed->len);
+	rspamd_mempool_add_destructor(pool,
+								  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
+}
+
+static void
+rspamd_mime_part_decode_qp(struct rspamd_mime_part *part,
+						   rspamd_mempool_t *pool)
+{
+	rspamd_fstring_t *parsed;
+	gssize r;
+
+	/* Streaming decoder has checked that output fits */
+	parsed = rspamd_fstring_sized_new(part->raw_data.len);
+	r = rspamd_decode_qp_buf(part->raw_data.begin, part->raw_data.len,
+							 parsed->str, parsed->allocated);
+	parsed->len = r > 0 ? r : 0;
+	part->parsed_data.begin = parsed->str;
+	part->parsed_data.len = parsed->len;
+	rspamd_mempool_notify_alloc(pool, parsed->len);
+	rspamd_mempool_add_destructor(pool,
+								  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
+}
+
+const rspamd_ftok_t *
+rspamd_mime_part_get_content(struct rspamd_mime_part *part)
+{
+	if (part->lazy) {
+		if (part->cte == RSPAMD_CTE_QP) {
+			rspamd_mime_part_decode_qp(part, part->lazy->pool);
+		}
+		else {
+			rspamd_mime_part_decode_b64(part, part->lazy->pool);
+		}
+
+		part->lazy = NULL;
+	}
+
+	return &part->parsed_data;
+}
+
+/* Returns position of the base64 character with the specified index */
+static const char *
+rspamd_mime_part_b64_seek(struct rspamd_mime_part *part, gsize idx)
+{
+	const char *p, *begin = part->raw_data.begin,
+				   *end = part->raw_data.begin + part->raw_data.len;
+	gsize n, nchars = part->lazy->nchars;
+
+	if (idx >= nchars) {
+		return end;
+	}
+
+	if (idx <= nchars / 2) {
+		for (p = begin, n = 0; p < end; p++) {
+			if (rspamd_mime_b64_is_alpha(*p)) {
+				if (n == idx) {
+					return p;
+				}
+
+				n++;
+			}
+		}
+	}
+	else {
+		for (p = end, n = nchars; p > begin;) {
+			p--;
+
+			if (rspamd_mime_b64_is_alpha(*p)) {
+				n--;
+
+				if (n == idx) {
+					return p;
+				}
+			}
+		}
+	}
+
+	return end;
+}
+
+gboolean
+rspamd_mime_part_get_content_span(struct rspamd_mime_part *part,
+								  gsize offset, gsize len,
+								  rspamd_ftok_t *span)
+{
+	const char *start, *stop;
+	unsigned char *out;
+	gsize first, last, outlen, skip;
+
+	if (offset >= part->parsed_data.len) {
+		return FALSE;
+	}
+
+	len = MIN(len, part->parsed_data.len - offset);
+
+	if (part->lazy && part->cte == RSPAMD_CTE_QP) {
+		gssize r;
+
+		if (offset + len > RSPAMD_MIME_LAZY_DECODE_MIN) {
+			/* QP cannot be decoded from the middle, so decode everything */
+			rspamd_mime_part_get_content(part);
+		}
+		else {
+			gsize outlen = offset + len + RSPAMD_MIME_STREAM_CHUNK + 8;
+
+			out = rspamd_mempool_alloc(part->lazy->pool, outlen);
+			r = rspamd_mime_part_qp_prefix(part, (char *) out, outlen, offset + len);
+
+			if (r <= (gssize) offset) {
+				return FALSE;
+			}
+
+			span->begin = (const char *) out + offset;
+			span->len = MIN(len, r - offset);
+
+			return TRUE;
+		}
+	}
+
+	if (part->lazy == NULL) {
+		span->begin = part->parsed_data.begin + offset;
+		span->len = len;
+
+		return TRUE;
+	}
+
+	/* Decode only base64 quads that cover the requested span */
+	first = offset / 3;
+	last = (offset + len + 2) / 3;
+	start = rspamd_mime_part_b64_seek(part, first * 4);
+	stop = rspamd_mime_part_b64_seek(part, last * 4);
+	out = rspamd_mempool_alloc(part->lazy->pool, (stop - start) / 4 * 3 + 12);
+	rspamd_cryptobox_base64_decode(start, stop - start, out, &outlen);
+	skip = offset - first * 3;
+
+	if (outlen <= skip) {
+		return FALSE;
+	}
+
+	span->begin = (const char *) out + skip;
+	span->len = MIN(len, outlen - skip);
+
+	return TRUE;
+}
+
+/*
+ * Large binary parts are not decoded until something needs their
+ * content, digest and length are obtained by the streaming decoders
+ */
+static gboolean
+rspamd_mime_part_set_lazy(struct rspamd_task *task,
+						  struct rspamd_mime_part *part,
+						  struct rspamd_content_type *ct)
+{
+	gsize decoded_len, nchars = 0;
+
+	if (part->raw_data.len < RSPAMD_MIME_LAZY_DECODE_MIN ||
+		part->ct == NULL ||
+		(part->ct->flags & (RSPAMD_CONTENT_TYPE_TEXT |
+							RSPAMD_CONTENT_TYPE_MESSAGE |
+							RSPAMD_CONTENT_TYPE_SMIME)) ||
+		(ct && (ct->flags & RSPAMD_CONTENT_TYPE_SMIME))) {
+		return FALSE;
+	}
+
+	if (part->cte == RSPAMD_CTE_QP) {
+		if (!rspamd_mime_part_qp_stream(part, &decoded_len)) {
+			return FALSE;
+		}
+	}
+	else if (!rspamd_mime_part_b64_stream(part, &decoded_len, &nchars)) {
+		return FALSE;
+	}
+
+	part->lazy = rspamd_mempool_alloc(task->task_pool, sizeof(*part->lazy));
+	part->lazy->pool = task->task_pool;
+	part->lazy->nchars = nchars;
+	part->parsed_data.begin = NULL;
+	part->parsed_data.len = decoded_len;
+
+	return TRUE;
+}
+
 static enum rspamd_mime_parse_error
 rspamd_mime_parse_normal_part(struct rspamd_task *task,
 							  struct rspamd_mime_part *part,
@@ -707,6 +1069,10 @@ rspamd_mime_parse_normal_part(struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_CTE_QP:
+		if (rspamd_mime_part_set_lazy(task, part, ct)) {
+			break;
+		}
+
 		parsed = rspamd_fstring_sized_new(part->raw_data.len);
 		r = rspamd_decode_qp_buf(part->raw_data.begin, part->raw_data.len,
 								 parsed->str, parsed->allocated);
@@ -734,15 +1100,11 @@ rspamd_mime_parse_normal_part(struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_CTE_B64:
-		parsed = rspamd_fstring_sized_new(part->raw_data.len / 4 * 3 + 12);
-		rspamd_cryptobox_base64_decode(part->raw_data.begin,
-									   part->raw_data.len,
-									   parsed->str, &parsed->len);
-		part->parsed_data.begin = parsed->str;
-		part->parsed_data.len = parsed->len;
-		rspamd_mempool_notify_alloc(task->task_pool, parsed->len);
-		rspamd_mempool_add_destructor(task->task_pool,
-									  (rspamd_mempool_destruct_t) rspamd_fstring_free, parsed);
+		if (rspamd_mime_part_set_lazy(task, part, ct)) {
+			break;
+		}
+
+		rspamd_mime_part_decode_b64(part, task->task_pool);
 		break;
 	case RSPAMD_CTE_UUE:
 		parsed = rspamd_fstring_sized_new(part->raw_data.len / 4 * 3 + 12);
@@ -938,8 +1300,8 @@ rspamd_mime_process_multipart_node(struct rspamd_task *task,
 			}
 		}
 
-		hdr = rspamd_message_get_header_from_hash(npart->raw_headers,
-												  "Content-Type", FALSE);
+		hdr = rspamd_message_get_header_from_hash_by_id(npart->raw_headers,
+														RSPAMD_MIME_HEADER_CONTENT_TYPE, FALSE);
 	}
 	else {
 		npart->raw_headers_str = 0;
@@ -1337,6 +1699,131 @@ rspamd_mime_preprocess_cb(struct rspamd_multipattern *mp,
 	return 0;
 }
 
+/*
+ * Boundary candidates are `\r--` or `\n--` sequences: we compare three shifted
+ * vectors to find them many bytes at once and call the boundary callback for
+ * each candidate in order, the same way as the multipattern does
+ */
+#define RSPAMD_MIME_IS_BOUNDARY_START(p) (((p)[0] == '\r' || (p)[0] == '\n') && \
+										  (p)[1] == '-' && (p)[2] == '-')
+
+static inline void
+rspamd_mime_boundaries_scalar(const char *text, gsize start, gsize len,
+							  struct rspamd_mime_parser_ctx *st)
+{
+	for (gsize i = start; i + 3 <= len; i++) {
+		if (RSPAMD_MIME_IS_BOUNDARY_START(text + i)) {
+			rspamd_mime_preprocess_cb(NULL, 0, i, i + 3, text, len, st);
+		}
+	}
+}
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+static gsize
+rspamd_mime_boundaries_avx2(const char *text, gsize len,
+							struct rspamd_mime_parser_ctx *st) __attribute__((__target__("avx2")));
+
+static gsize
+rspamd_mime_boundaries_avx2(const char *text, gsize len,
+							struct rspamd_mime_parser_ctx *st)
+{
+	const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n'),
+				  dash = _mm256_set1_epi8('-');
+	gsize i = 0;
+
+	while (i + 32 + 2 <= len) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *) (text + i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *) (text + i + 1));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *) (text + i + 2));
+		__m256i nl = _mm256_or_si256(_mm256_cmpeq_epi8(v0, cr),
+									 _mm256_cmpeq_epi8(v0, lf));
+		__m256i dd = _mm256_and_si256(_mm256_cmpeq_epi8(v1, dash),
+									  _mm256_cmpeq_epi8(v2, dash));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(nl, dd));
+
+		while (mask) {
+			unsigned int off = __builtin_ctz(mask);
+
+			rspamd_mime_preprocess_cb(NULL, 0, i + off, i + off + 3, text, len, st);
+			mask &= mask - 1;
+		}
+
+		i += 32;
+	}
+
+	return i;
+}
+#endif
+
+static void
+rspamd_mime_scan_boundaries(const char *text, gsize len,
+							struct rspamd_mime_parser_ctx *st)
+{
+#if !defined(__x86_64__) && !(defined(__aarch64__) && defined(__ARM_NEON))
+	/* No vector implementation, use multipattern as before */
+	rspamd_multipattern_lookup(lib_ctx->mp_boundary, text, len,
+							   rspamd_mime_preprocess_cb, st, NULL);
+#else
+	gsize i = 0;
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (cpu_config & CPUID_AVX2) {
+		i = rspamd_mime_boundaries_avx2(text, len, st);
+		rspamd_mime_boundaries_scalar(text, i, len, st);
+
+		return;
+	}
+#endif
+#ifdef __x86_64__
+	/* SSE2 is always available on x86_64 */
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n'),
+				  dash = _mm_set1_epi8('-');
+
+	while (i + 16 + 2 <= len) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *) (text + i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *) (text + i + 1));
+		__m128i v2 = _mm_loadu_si128((const __m128i *) (text + i + 2));
+		__m128i nl = _mm_or_si128(_mm_cmpeq_epi8(v0, cr), _mm_cmpeq_epi8(v0, lf));
+		__m128i dd = _mm_and_si128(_mm_cmpeq_epi8(v1, dash), _mm_cmpeq_epi8(v2, dash));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(nl, dd));
+
+		while (mask) {
+			unsigned int off = __builtin_ctz(mask);
+
+			rspamd_mime_preprocess_cb(NULL, 0, i + off, i + off + 3, text, len, st);
+			mask &= mask - 1;
+		}
+
+		i += 16;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t cr = vdupq_n_u8('\r'), lf = vdupq_n_u8('\n'),
+					 dash = vdupq_n_u8('-');
+
+	while (i + 16 + 2 <= len) {
+		uint8x16_t v0 = vld1q_u8((const uint8_t *) (text + i));
+		uint8x16_t v1 = vld1q_u8((const uint8_t *) (text + i + 1));
+		uint8x16_t v2 = vld1q_u8((const uint8_t *) (text + i + 2));
+		uint8x16_t m = vandq_u8(vorrq_u8(vceqq_u8(v0, cr), vceqq_u8(v0, lf)),
+								vandq_u8(vceqq_u8(v1, dash), vceqq_u8(v2, dash)));
+
+		if (vmaxvq_u8(m) != 0) {
+			/* Candidates are rare, so we just check this block byte by byte */
+			for (unsigned int off = 0; off < 16; off++) {
+				if (RSPAMD_MIME_IS_BOUNDARY_START(text + i + off)) {
+					rspamd_mime_preprocess_cb(NULL, 0, i + off, i + off + 3, text, len, st);
+				}
+			}
+		}
+
+		i += 16;
+	}
+#endif
+
+	rspamd_mime_boundaries_scalar(text, i, len, st);
+#endif
+}
+
 static goffset
 rspamd_mime_parser_headers_heuristic(GString *input, goffset *body_start)
 {
@@ -1410,16 +1897,14 @@ rspamd_mime_preprocess_message(struct rspamd_task *task,
 {
 
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup(lib_ctx->mp_boundary,
-								   top->raw_data.begin - 1,
-								   top->raw_data.len + 1,
-								   rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries(top->raw_data.begin - 1,
+									top->raw_data.len + 1,
+									st);
 	}
 	else {
-		rspamd_multipattern_lookup(lib_ctx->mp_boundary,
-								   st->pos,
-								   st->end - st->pos,
-								   rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries(st->pos,
+									st->end - st->pos,
+									st);
 	}
 }
 
@@ -1492,9 +1977,9 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 				}
 			}
 
-			hdr = rspamd_message_get_header_from_hash(
+			hdr = rspamd_message_get_header_from_hash_by_id(
 				MESSAGE_FIELD(task, raw_headers),
-				"Content-Type", FALSE);
+				RSPAMD_MIME_HEADER_CONTENT_TYPE, FALSE);
 		}
 		else {
 			/* First apply heuristic, maybe we have just headers */
@@ -1522,9 +2007,9 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 					}
 				}
 
-				hdr = rspamd_message_get_header_from_hash(
+				hdr = rspamd_message_get_header_from_hash_by_id(
 					MESSAGE_FIELD(task, raw_headers),
-					"Content-Type", FALSE);
+					RSPAMD_MIME_HEADER_CONTENT_TYPE, FALSE);
 				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
 			}
 			else {
@@ -1578,8 +2063,8 @@ rspamd_mime_parse_message(struct rspamd_task *task,
 				}
 			}
 
-			hdr = rspamd_message_get_header_from_hash(npart->raw_headers,
-													  "Content-Type", FALSE);
+			hdr = rspamd_message_get_header_from_hash_by_id(npart->raw_headers,
+															RSPAMD_MIME_HEADER_CONTENT_TYPE, FALSE);
 		}
 		else {
 			body_pos = 0;
@@ -17,6 +17,7 @@
 #define SRC_LIBMIME_MIME_PARSER_H_
 
 #include "config.h"
+#include "libutil/fstring.h"
 
 
 #ifdef __cplusplus
@@ -38,6 +39,27 @@ enum rspamd_mime_parse_error rspamd_mime_parse_task(struct rspamd_task *task,
 
 void rspamd_mime_parser_calc_digest(struct rspamd_mime_part *part);
 
+/**
+ * Returns decoded content of a part, large encoded parts are decoded
+ * on the first call only
+ * @param part
+ * @return parsed data of a part
+ */
+const rspamd_ftok_t *rspamd_mime_part_get_content(struct rspamd_mime_part *part);
+
+/**
+ * Returns span of the decoded content of a part without decoding
+ * the whole part if it has not been decoded yet
+ * @param part
+ * @param offset offset in the decoded content
+ * @param len maximum length of the span
+ * @param span output span, valid while the task is alive
+ * @return TRUE if offset is within the content
+ */
+gboolean rspamd_mime_part_get_content_span(struct rspamd_mime_part *part,
+										   gsize offset, gsize len,
+										   rspamd_ftok_t *span);
+
 
 #ifdef __cplusplus
 }
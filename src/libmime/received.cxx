@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "libserver/cfg_file.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/logger.hxx"
 #include "mime_string.hxx"
 #include "smtp_parsers.h"
 #include "message.h"
@@ -26,6 +27,8 @@
 #include "frozen/string.h"
 #include "frozen/unordered_map.h"
 
+#include <array>
+
 namespace rspamd::mime {
 
 enum class received_part_type {
@@ -37,31 +40,111 @@ enum class received_part_type {
 	RSPAMD_RECEIVED_PART_UNKNOWN,
 };
 
-struct received_part {
-	received_part_type type;
-	mime_string data;
-	std::vector<mime_string> comments;
-
-	explicit received_part(received_part_type t)
-		: type(t),
-		  data(received_char_filter)
-	{
+/*
+ * Most of Received headers consist of printable lowercase ascii only, which is
+ * not altered by `received_char_filter`, so parts just point to the header
+ * itself and a normalised copy is built for the rest
+ */
+static inline auto
+received_span_is_clean(std::string_view in) -> bool
+{
+	for (auto c: in) {
+		if (c < 0x20 || c >= 0x7f || (c >= 'A' && c <= 'Z')) {
+			return false;
+		}
 	}
-};
+
+	return true;
+}
 
 static inline auto
-received_part_set_or_append(const char *begin,
-							gsize len,
-							mime_string &dest) -> void
+received_span_trim(std::string_view in) -> std::string_view
 {
-	if (len == 0) {
-		return;
+	auto first = in.find_first_not_of(" \t");
+
+	if (first == std::string_view::npos) {
+		return in.substr(0, 0);
 	}
 
-	dest.append(begin, len);
-	dest.trim(" \t");
+	return in.substr(first, in.find_last_not_of(" \t") - first + 1);
 }
 
+static auto
+received_span_normalise(std::string_view in, mime_string &storage) -> std::string_view
+{
+	if (received_span_is_clean(in)) {
+		return received_span_trim(in);
+	}
+
+	storage = mime_string{in, received_char_filter};
+	storage.trim(" \t");
+
+	return storage.as_view();
+}
+
+struct received_part {
+	received_part_type type = received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN;
+	/* Views point either to the header or to the storage below */
+	std::string_view data;
+	std::string_view comment;
+	bool seen_comment = false;
+	mime_string data_storage;
+	mime_string comment_storage;
+
+	auto reset(received_part_type t) -> void
+	{
+		type = t;
+		data = {};
+		comment = {};
+		seen_comment = false;
+	}
+
+	auto append_data(const char *begin, gsize len) -> void
+	{
+		if (len == 0) {
+			return;
+		}
+
+		auto chunk = std::string_view{begin, len};
+
+		if (data.empty()) {
+			data = received_span_normalise(chunk, data_storage);
+		}
+		else if (data.data() != data_storage.data() &&
+				 data.data() + data.size() == begin &&
+				 received_span_is_clean(chunk)) {
+			data = std::string_view{data.data(), data.size() + len};
+		}
+		else {
+			mime_string concat{received_char_filter};
+
+			concat.append(data);
+			concat.append(chunk);
+			concat.trim(" \t");
+			data_storage = std::move(concat);
+			data = data_storage.as_view();
+		}
+	}
+
+	/* Only the first comment is used */
+	auto add_comment(const char *begin, gsize len) -> void
+	{
+		if (!seen_comment) {
+			comment = received_span_normalise(std::string_view{begin, len},
+											  comment_storage);
+			seen_comment = true;
+		}
+	}
+};
+
+/* Parts of a header that are used, `id` and unknown parts are skipped */
+struct received_parts {
+	static constexpr auto max_parts = 8;
+	std::array<received_part, max_parts> parts;
+	std::size_t nparts = 0;
+	received_part scratch;
+};
+
 static auto
 received_process_part(const std::string_view &data,
 					  received_part_type type,
@@ -108,10 +191,7 @@ received_process_part(const std::string_view &data,
 				if (ebraces >= obraces) {
 					if (type != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN) {
 						if (p > c) {
-							npart.comments.emplace_back(received_char_filter);
-							auto &comment = npart.comments.back();
-							received_part_set_or_append(c, p - c,
-														comment);
+							npart.add_comment(c, p - c);
 						}
 					}
 
@@ -130,8 +210,7 @@ received_process_part(const std::string_view &data,
 			if (*p == '(') {
 				if (p > c) {
 					if (type != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN) {
-						received_part_set_or_append(c, p - c,
-													npart.data);
+						npart.append_data(c, p - c);
 					}
 				}
 
@@ -144,8 +223,7 @@ received_process_part(const std::string_view &data,
 			else if (g_ascii_isspace(*p)) {
 				if (p > c) {
 					if (type != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN) {
-						received_part_set_or_append(c, p - c,
-													npart.data);
+						npart.append_data(c, p - c);
 					}
 				}
 
@@ -157,15 +235,14 @@ received_process_part(const std::string_view &data,
 				/* It is actually delimiter of date part if not in the comments */
 				if (p > c) {
 					if (type != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN) {
-						received_part_set_or_append(c, p - c,
-													npart.data);
+						npart.append_data(c, p - c);
 					}
 				}
 
 				state = all_done;
 				continue;
 			}
-			else if (npart.data.size() > 0) {
+			else if (!npart.data.empty()) {
 				/* We have already received data and find something with no ( */
 				if (!seen_tcpinfo && type == received_part_type::RSPAMD_RECEIVED_PART_FROM) {
 					/* Check if we have something special here, such as TCPinfo */
@@ -189,8 +266,7 @@ received_process_part(const std::string_view &data,
 			break;
 		case read_tcpinfo:
 			if (*p == ']') {
-				received_part_set_or_append(c, p - c + 1,
-											npart.data);
+				npart.append_data(c, p - c + 1);
 				seen_tcpinfo = TRUE;
 				state = skip_spaces;
 				next_state = read_data;
@@ -216,8 +292,7 @@ received_process_part(const std::string_view &data,
 	case read_data:
 		if (p > c) {
 			if (type != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN) {
-				received_part_set_or_append(c, p - c,
-											npart.data);
+				npart.append_data(c, p - c);
 			}
 
 			last = p - data.data();
@@ -252,9 +327,9 @@ constexpr auto lit_compare_lowercase(const char lit[N], const char *in) -> bool
 
 static auto
 received_spill(const std::string_view &in,
-			   std::ptrdiff_t &date_pos) -> std::vector<received_part>
+			   std::ptrdiff_t &date_pos,
+			   received_parts &parts) -> bool
 {
-	std::vector<received_part> parts;
 	std::ptrdiff_t pos = 0;
 	auto seen_from = false, seen_by = false;
 
@@ -294,20 +369,26 @@ received_spill(const std::string_view &in,
 	auto len = end - p;
 
 	if (len == 0) {
-		return parts;
+		return false;
 	}
 
 	auto maybe_process_part = [&](received_part_type what) -> bool {
-		parts.emplace_back(what);
-		auto &rcvd_part = parts.back();
+		auto store = what != received_part_type::RSPAMD_RECEIVED_PART_ID &&
+					 what != received_part_type::RSPAMD_RECEIVED_PART_UNKNOWN &&
+					 parts.nparts < parts.parts.size();
+		auto &rcvd_part = store ? parts.parts[parts.nparts] : parts.scratch;
 		auto chunk = std::string_view{p, (std::size_t)(end - p)};
 
-		if (!received_process_part(chunk, what, pos, rcvd_part)) {
-			parts.pop_back();
+		rcvd_part.reset(what);
 
+		if (!received_process_part(chunk, what, pos, rcvd_part)) {
 			return false;
 		}
 
+		if (store) {
+			parts.nparts++;
+		}
+
 		return true;
 	};
 
@@ -317,7 +398,7 @@ received_spill(const std::string_view &in,
 		/* We can now store from part */
 		if (!maybe_process_part(received_part_type::RSPAMD_RECEIVED_PART_FROM)) {
 			/* Do not accept malformed from */
-			return {};
+			return false;
 		}
 
 		g_assert(pos != 0);
@@ -330,7 +411,7 @@ received_spill(const std::string_view &in,
 		p += sizeof("by") - 1;
 
 		if (!maybe_process_part(received_part_type::RSPAMD_RECEIVED_PART_BY)) {
-			return {};
+			return false;
 		}
 
 		g_assert(pos != 0);
@@ -341,7 +422,7 @@ received_spill(const std::string_view &in,
 
 	if (!seen_from && !seen_by) {
 		/* Useless received */
-		return {};
+		return false;
 	}
 
 	while (p < end) {
@@ -376,7 +457,7 @@ received_spill(const std::string_view &in,
 				}
 
 				if (p == end) {
-					return {};
+					return false;
 				}
 				else if (*p == ';') {
 					date_pos = p - in.data() + 1;
@@ -399,7 +480,7 @@ received_spill(const std::string_view &in,
 		}
 	}
 
-	return parts;
+	return parts.nparts > 0;
 }
 
 #define RSPAMD_INET_ADDRESS_PARSE_RECEIVED \
@@ -557,7 +638,7 @@ received_process_from(rspamd_mempool_t *pool,
 					  const received_part &rpart,
 					  received_header &rh)
 {
-	if (rpart.data.size() > 0) {
+	if (!rpart.data.empty()) {
 		/* We have seen multiple cases:
 		 * - [ip] (hostname/unknown [real_ip])
 		 * - helo (hostname/unknown [real_ip])
@@ -568,18 +649,14 @@ received_process_from(rspamd_mempool_t *pool,
 		 */
 		auto seen_ip_in_data = false;
 
-		if (!rpart.comments.empty()) {
+		if (rpart.seen_comment) {
 			/* We can have info within comment as part of RFC */
-			received_process_host_tcpinfo(
-				pool, rh,
-				rpart.comments[0].as_view());
+			received_process_host_tcpinfo(pool, rh, rpart.comment);
 		}
 
 		if (rh.real_ip.size() == 0) {
 			/* Try to do the same with data */
-			if (received_process_host_tcpinfo(
-					pool, rh,
-					rpart.data.as_view())) {
+			if (received_process_host_tcpinfo(pool, rh, rpart.data)) {
 				seen_ip_in_data = true;
 			}
 		}
@@ -587,22 +664,17 @@ received_process_from(rspamd_mempool_t *pool,
 		if (!seen_ip_in_data) {
 			if (rh.real_ip.size() != 0) {
 				/* Get announced hostname (usually helo) */
-				received_process_rdns(pool,
-									  rpart.data.as_view(),
-									  rh.from_hostname);
+				received_process_rdns(pool, rpart.data, rh.from_hostname);
 			}
 			else {
-				received_process_host_tcpinfo(pool,
-											  rh, rpart.data.as_view());
+				received_process_host_tcpinfo(pool, rh, rpart.data);
 			}
 		}
 	}
 	else {
 		/* rpart->dlen = 0 */
-		if (!rpart.comments.empty()) {
-			received_process_host_tcpinfo(
-				pool, rh,
-				rpart.comments[0].as_view());
+		if (rpart.seen_comment) {
+			received_process_host_tcpinfo(pool, rh, rpart.comment);
 		}
 	}
 }
@@ -644,9 +716,9 @@ received_header_parse(received_header_chain &chain, rspamd_mempool_t *pool,
 																													   received_flags::SSL},
 																										 {"local", received_flags::LOCAL}});
 
-	auto parts = received_spill(in, date_pos);
+	received_parts parts;
 
-	if (parts.empty()) {
+	if (!received_spill(in, date_pos, parts)) {
 		return false;
 	}
 
@@ -655,19 +727,18 @@ received_header_parse(received_header_chain &chain, rspamd_mempool_t *pool,
 	rh.flags = received_flags::UNKNOWN;
 	rh.hdr = hdr;
 
-	for (const auto &part: parts) {
+	for (auto i = 0u; i < parts.nparts; i++) {
+		const auto &part = parts.parts[i];
 		switch (part.type) {
 		case received_part_type::RSPAMD_RECEIVED_PART_FROM:
 			received_process_from(pool, part, rh);
 			break;
 		case received_part_type::RSPAMD_RECEIVED_PART_BY:
-			received_process_rdns(pool,
-								  part.data.as_view(),
-								  rh.by_hostname);
+			received_process_rdns(pool, part.data, rh.by_hostname);
 			break;
 		case received_part_type::RSPAMD_RECEIVED_PART_WITH:
-			if (part.data.size() > 0) {
-				auto proto_flag_it = protos_map.find(part.data.as_view());
+			if (!part.data.empty()) {
+				auto proto_flag_it = protos_map.find(part.data);
 
 				if (proto_flag_it != protos_map.end()) {
 					rh.flags = proto_flag_it->second;
@@ -768,8 +839,8 @@ received_maybe_fix_task(struct rspamd_task *task) -> bool
 												   top_recv.real_ip.data(),
 												   top_recv.real_ip.size(),
 												   RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
-						msg_warn_task("cannot get IP from received header: '%s'",
-									  top_recv.real_ip.data());
+						msg_warn_task_fmt("cannot get IP from received header: '{}'",
+										  top_recv.real_ip.as_view());
 						task->from_addr = nullptr;
 					}
 				}
@@ -804,7 +875,7 @@ received_export_to_lua(received_header_chain *chain, lua_State *L) -> bool
 	for (const auto &rh: chain->as_vector()) {
 		lua_createtable(L, 0, 10);
 
-		if (rh.hdr && rh.hdr->decoded) {
+		if (rh.hdr && rspamd_mime_header_get_decoded(rh.hdr)) {
 			rspamd_lua_table_set(L, "raw", rh.hdr->decoded);
 		}
 
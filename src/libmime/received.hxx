@@ -25,6 +25,7 @@
 #include "libmime/email_addr.h"
 #include "libserver/task.h"
 #include "contrib/ankerl/unordered_dense.h"
+#include "libutil/cxx/mempool_allocator.hxx"
 #include <vector>
 #include <string_view>
 #include <utility>
@@ -244,6 +245,7 @@ struct received_header {
 class received_header_chain {
 public:
 	explicit received_header_chain(struct rspamd_task *task)
+		: headers(mempool_allocator<received_header>{task->task_pool})
 	{
 		headers.reserve(2);
 		rspamd_mempool_add_destructor(task->task_pool,
@@ -297,7 +299,7 @@ public:
 	{
 		return headers.size();
 	}
-	constexpr auto as_vector() const -> const std::vector<received_header> &
+	constexpr auto as_vector() const -> const pool_vector<received_header> &
 	{
 		return headers;
 	}
@@ -307,7 +309,7 @@ private:
 	{
 		delete static_cast<received_header_chain *>(ptr);
 	}
-	std::vector<received_header> headers;
+	pool_vector<received_header> headers;
 };
 
 }// namespace rspamd::mime
@@ -35,6 +35,22 @@ INIT_LOG_MODULE(metric)
 /* Average symbols count to optimize hash allocation */
 static struct rspamd_counter_data symbols_count;
 
+/* Returns index of a symbol in `symbols_by_id` or -1 if it is not indexed */
+static inline int
+rspamd_scan_result_symbol_idx(struct rspamd_scan_result *result,
+							  struct rspamd_symbol *sdef)
+{
+	if (sdef && sdef->cache_item) {
+		int id = rspamd_symcache_item_id(sdef->cache_item);
+
+		if (id >= 0 && id < (int) result->nsymbols_by_id) {
+			return id;
+		}
+	}
+
+	return -1;
+}
+
 static void
 rspamd_scan_result_dtor(gpointer d)
 {
@@ -108,6 +124,12 @@ rspamd_create_metric_result(struct rspamd_task *task,
 														   sizeof(struct rspamd_action_config) * nact);
 		rspamd_config_actions_foreach_enumerate(task->cfg, rspamd_metric_actions_foreach_cb, metric_res);
 		metric_res->nactions = nact;
+
+		if (task->cfg->cache) {
+			metric_res->nsymbols_by_id = rspamd_symcache_items_count(task->cfg->cache);
+			metric_res->symbols_by_id = rspamd_mempool_alloc0(task->task_pool,
+															  sizeof(struct rspamd_symbol_result *) * metric_res->nsymbols_by_id);
+		}
 	}
 
 	rspamd_mempool_add_destructor(task->task_pool,
@@ -235,7 +257,7 @@ insert_metric_result(struct rspamd_task *task,
 	struct rspamd_symbol *sdef;
 	struct rspamd_symbols_group *gr = NULL;
 	const ucl_object_t *mobj, *sobj;
-	int max_shots = G_MAXINT, ret;
+	int max_shots = G_MAXINT, ret, sym_idx;
 	unsigned int i;
 	khiter_t k;
 	gboolean single = !!(flags & RSPAMD_SYMBOL_INSERT_SINGLE);
@@ -289,6 +311,11 @@ insert_metric_result(struct rspamd_task *task,
 						 symbol, *sdef->weight_ptr);
 	}
 
+	if (fabs(weight) > 1.0 || (sdef == NULL && final_score != 0)) {
+		/* Static weight of this symbol does not bound its score */
+		rspamd_symcache_set_dynamic_score(task, sdef ? sdef->cache_item : NULL);
+	}
+
 	if (task->settings) {
 		double corr;
 		mobj = ucl_object_lookup(task->settings, "scores");
@@ -310,10 +337,21 @@ insert_metric_result(struct rspamd_task *task,
 		}
 	}
 
-	k = kh_get(rspamd_symbols_hash, metric_res->symbols, symbol);
-	if (k != kh_end(metric_res->symbols)) {
+	sym_idx = rspamd_scan_result_symbol_idx(metric_res, sdef);
+
+	if (sym_idx >= 0) {
+		symbol_result = metric_res->symbols_by_id[sym_idx];
+	}
+	else {
+		k = kh_get(rspamd_symbols_hash, metric_res->symbols, symbol);
+
+		if (k != kh_end(metric_res->symbols)) {
+			symbol_result = kh_value(metric_res->symbols, k);
+		}
+	}
+
+	if (symbol_result) {
 		/* Existing metric score */
-		symbol_result = kh_value(metric_res->symbols, k);
 		if (single) {
 			max_shots = 1;
 		}
@@ -434,6 +472,10 @@ insert_metric_result(struct rspamd_task *task,
 		symbol_result = rspamd_mempool_alloc0(task->task_pool, sizeof(*symbol_result));
 		kh_value(metric_res->symbols, k) = symbol_result;
 
+		if (sym_idx >= 0) {
+			metric_res->symbols_by_id[sym_idx] = symbol_result;
+		}
+
 		symbol_result->name = sym_cpy;
 		symbol_result->sym = sdef;
 		symbol_result->nshots = 1;
@@ -800,6 +842,48 @@ rspamd_task_add_result_option(struct rspamd_task *task,
 	return ret;
 }
 
+unsigned int
+rspamd_task_add_result_options(struct rspamd_task *task,
+							   struct rspamd_symbol_result *s,
+							   const rspamd_ftok_t *opts,
+							   unsigned int nopts)
+{
+	struct rspamd_symbol_result *cur;
+	unsigned int i, nadded = 0;
+
+	if (s == NULL || nopts == 0) {
+		return 0;
+	}
+
+	/* Size options hashes once instead of growing them option by option */
+	LL_FOREACH(s, cur)
+	{
+		if (cur->opts_len < 0 ||
+			(cur->sym && (cur->sym->flags & RSPAMD_SYMBOL_FLAG_ONEPARAM))) {
+			continue;
+		}
+
+		if (!cur->options) {
+			cur->options = kh_init(rspamd_options_hash);
+		}
+
+		/* Keep load factor below the khash upper bound */
+		khint_t nbuckets = (kh_size(cur->options) + nopts) * 4 / 3 + 1;
+
+		if (kh_n_buckets(cur->options) < nbuckets) {
+			kh_resize(rspamd_options_hash, cur->options, nbuckets);
+		}
+	}
+
+	for (i = 0; i < nopts; i++) {
+		if (rspamd_task_add_result_option(task, s, opts[i].begin, opts[i].len)) {
+			nadded++;
+		}
+	}
+
+	return nadded;
+}
+
 struct rspamd_action_config *
 rspamd_find_action_config_for_action(struct rspamd_scan_result *scan_result,
 									 struct rspamd_action *act)
@@ -985,6 +1069,22 @@ rspamd_task_find_symbol_result(struct rspamd_task *task, const char *sym,
 	return res;
 }
 
+struct rspamd_symbol_result *
+rspamd_task_find_symbol_result_by_id(struct rspamd_task *task, int id,
+									 struct rspamd_scan_result *result)
+{
+	if (result == NULL) {
+		/* Use default result */
+		result = task->result;
+	}
+
+	if (id >= 0 && id < (int) result->nsymbols_by_id) {
+		return result->symbols_by_id[id];
+	}
+
+	return NULL;
+}
+
 struct rspamd_symbol_result *rspamd_task_remove_symbol_result(
 	struct rspamd_task *task,
 	const char *symbol,
@@ -1031,6 +1131,12 @@ struct rspamd_symbol_result *rspamd_task_remove_symbol_result(
 			}
 		}
 
+		int sym_idx = rspamd_scan_result_symbol_idx(result, res->sym);
+
+		if (sym_idx >= 0) {
+			result->symbols_by_id[sym_idx] = NULL;
+		}
+
 		kh_del(rspamd_symbols_hash, result->symbols, k);
 	}
 	else {
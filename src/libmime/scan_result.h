@@ -105,6 +105,8 @@ struct rspamd_scan_result {
 	double negative_score;
 	struct kh_rspamd_symbols_hash_s *symbols;          /**< symbols of metric						*/
 	struct kh_rspamd_symbols_group_hash_s *sym_groups; /**< groups of symbols						*/
+	struct rspamd_symbol_result **symbols_by_id;       /**< the same results indexed by symcache id	*/
+	unsigned int nsymbols_by_id;
 	struct rspamd_action_config *actions_config;
 	const char *name;         /**< for named results, NULL is the default result */
 	struct rspamd_task *task; /**< back reference */
@@ -197,6 +199,19 @@ gboolean rspamd_task_add_result_option(struct rspamd_task *task,
 									   const char *opt,
 									   gsize vlen);
 
+/**
+ * Adds many options to symbol at once, duplicates are skipped
+ * @param task
+ * @param s
+ * @param opts array of options
+ * @param nopts number of options
+ * @return number of options actually added
+ */
+unsigned int rspamd_task_add_result_options(struct rspamd_task *task,
+											struct rspamd_symbol_result *s,
+											const rspamd_ftok_t *opts,
+											unsigned int nopts);
+
 /**
  * Finds symbol result
  * @param task
@@ -207,6 +222,16 @@ struct rspamd_symbol_result *
 rspamd_task_find_symbol_result(struct rspamd_task *task, const char *sym,
 							   struct rspamd_scan_result *result);
 
+/**
+ * Finds symbol result by symcache id of the symbol
+ * @param task
+ * @param id
+ * @return
+ */
+struct rspamd_symbol_result *
+rspamd_task_find_symbol_result_by_id(struct rspamd_task *task, int id,
+									 struct rspamd_scan_result *result);
+
 /**
  * Compatibility function to iterate on symbols hash
  * @param task
@@ -18,10 +18,16 @@
 #include "contrib/uthash/utlist.h"
 #include "contrib/libucl/khash.h"
 #include "async_session.h"
+#include "tracing.h"
 #include "cryptobox.h"
 
 #define RSPAMD_SESSION_FLAG_DESTROYING (1 << 1)
 #define RSPAMD_SESSION_FLAG_CLEANUP (1 << 2)
+/* Events addition time is recorded to report the oldest pending event */
+#define RSPAMD_SESSION_FLAG_DEBUG (1 << 3)
+
+/* Events are allocated from the pool by chunks of this size and then reused */
+#define RSPAMD_SESSION_EVENTS_SLAB 16
 
 #define RSPAMD_SESSION_CAN_ADD_EVENT(s) (!((s)->flags & (RSPAMD_SESSION_FLAG_DESTROYING | RSPAMD_SESSION_FLAG_CLEANUP)))
 
@@ -53,6 +59,16 @@ struct rspamd_async_event {
 	const char *event_source;
 	event_finalizer_t fin;
 	void *user_data;
+	/* Pending events list ordered by addition, free list otherwise */
+	struct rspamd_async_event *prev, *next;
+	/* Ticks when an event has been added, debug mode only */
+	double added;
+	unsigned int subsystem_idx;
+};
+
+struct rspamd_session_subsystem {
+	const char *name;
+	unsigned int pending;
 };
 
 static inline bool
@@ -79,7 +95,7 @@ rspamd_event_hash(const struct rspamd_async_event *ev)
 	return rspamd_cryptobox_fast_hash(&st, sizeof(st), rspamd_hash_seed());
 }
 
-/* Define **SET** of events */
+/* Define **SET** of events, used to find an event to remove */
 KHASH_INIT(rspamd_events_hash,
 		   struct rspamd_async_event *,
 		   char,
@@ -92,8 +108,15 @@ struct rspamd_async_session {
 	event_finalizer_t restore;
 	event_finalizer_t cleanup;
 	khash_t(rspamd_events_hash) * events;
+	/* Pending events, the head is the oldest one */
+	struct rspamd_async_event *events_list;
+	struct rspamd_async_event *free_events;
+	struct rspamd_session_subsystem *subsystems;
+	unsigned int nsubsystems;
+	unsigned int subsystems_size;
 	void *user_data;
 	rspamd_mempool_t *pool;
+	struct rspamd_task_trace *trace;
 	unsigned int flags;
 };
 
@@ -127,9 +150,122 @@ rspamd_session_create(rspamd_mempool_t *pool,
 	kh_resize(rspamd_events_hash, s->events, MAX(4, events_count.mean));
 	rspamd_mempool_add_destructor(pool, rspamd_session_dtor, s);
 
+	if (rspamd_log_default_logger() != NULL &&
+		rspamd_logger_need_log(rspamd_log_default_logger(), G_LOG_LEVEL_DEBUG,
+							   rspamd_events_log_id)) {
+		s->flags |= RSPAMD_SESSION_FLAG_DEBUG;
+	}
+
 	return s;
 }
 
+static unsigned int
+rspamd_session_subsystem_idx(struct rspamd_async_session *session,
+							 const char *subsystem)
+{
+	struct rspamd_session_subsystem *cur;
+	unsigned int i;
+
+	if (subsystem == NULL) {
+		subsystem = "unknown";
+	}
+
+	/* There are just a few subsystems per session, so a linear search is fine */
+	for (i = 0; i < session->nsubsystems; i++) {
+		cur = &session->subsystems[i];
+
+		if (cur->name == subsystem || strcmp(cur->name, subsystem) == 0) {
+			return i;
+		}
+	}
+
+	if (session->nsubsystems == session->subsystems_size) {
+		unsigned int nsize = MAX(8, session->subsystems_size * 2);
+
+		cur = rspamd_mempool_alloc(session->pool, nsize * sizeof(*cur));
+
+		if (session->nsubsystems > 0) {
+			memcpy(cur, session->subsystems, session->nsubsystems * sizeof(*cur));
+		}
+
+		session->subsystems = cur;
+		session->subsystems_size = nsize;
+	}
+
+	cur = &session->subsystems[session->nsubsystems];
+	cur->name = subsystem;
+	cur->pending = 0;
+
+	return session->nsubsystems++;
+}
+
+static struct rspamd_async_event *
+rspamd_session_event_alloc(struct rspamd_async_session *session)
+{
+	struct rspamd_async_event *ev;
+
+	if (session->free_events == NULL) {
+		struct rspamd_async_event *slab;
+		unsigned int i;
+
+		slab = rspamd_mempool_alloc(session->pool,
+									sizeof(*slab) * RSPAMD_SESSION_EVENTS_SLAB);
+
+		for (i = 0; i < RSPAMD_SESSION_EVENTS_SLAB; i++) {
+			slab[i].next = session->free_events;
+			session->free_events = &slab[i];
+		}
+	}
+
+	ev = session->free_events;
+	session->free_events = ev->next;
+
+	return ev;
+}
+
+static void
+rspamd_session_event_release(struct rspamd_async_session *session,
+							 struct rspamd_async_event *ev)
+{
+	DL_DELETE(session->events_list, ev);
+	session->subsystems[ev->subsystem_idx].pending--;
+	ev->next = session->free_events;
+	session->free_events = ev;
+}
+
+static void
+rspamd_session_log_oldest(struct rspamd_async_session *session, gboolean forced)
+{
+	struct rspamd_async_event *ev = session->events_list;
+	unsigned int i;
+
+	if (ev == NULL) {
+		return;
+	}
+
+	if (session->flags & RSPAMD_SESSION_FLAG_DEBUG) {
+		msg_debug_session("oldest pending event: %p, subsystem: %s, "
+						  "scheduled from: %s, pending for %.3fs",
+						  ev->user_data, ev->subsystem, ev->event_source,
+						  rspamd_get_ticks(FALSE) - ev->added);
+	}
+	else if (forced) {
+		msg_info_session("oldest pending event: %p, subsystem: %s, "
+						 "scheduled from: %s",
+						 ev->user_data, ev->subsystem, ev->event_source);
+	}
+
+	if (forced) {
+		for (i = 0; i < session->nsubsystems; i++) {
+			if (session->subsystems[i].pending > 0) {
+				msg_info_session("pending %ud events from subsystem %s",
+								 session->subsystems[i].pending,
+								 session->subsystems[i].name);
+			}
+		}
+	}
+}
+
 struct rspamd_async_event *
 rspamd_session_add_event_full(struct rspamd_async_session *session,
 							  event_finalizer_t fin,
@@ -153,12 +289,13 @@ rspamd_session_add_event_full(struct rspamd_async_session *session,
 		return NULL;
 	}
 
-	new_event = rspamd_mempool_alloc(session->pool,
-									 sizeof(struct rspamd_async_event));
+	new_event = rspamd_session_event_alloc(session);
 	new_event->fin = fin;
 	new_event->user_data = user_data;
 	new_event->subsystem = subsystem;
 	new_event->event_source = event_source;
+	new_event->subsystem_idx = rspamd_session_subsystem_idx(session, subsystem);
+	new_event->added = (session->flags & RSPAMD_SESSION_FLAG_DEBUG) ? rspamd_get_ticks(FALSE) : 0;
 
 	msg_debug_session("added event: %p, pending %d (+1) events, "
 					  "subsystem: %s (%s)",
@@ -169,6 +306,13 @@ rspamd_session_add_event_full(struct rspamd_async_session *session,
 
 	kh_put(rspamd_events_hash, session->events, new_event, &ret);
 	g_assert(ret > 0);
+	DL_APPEND(session->events_list, new_event);
+	session->subsystems[new_event->subsystem_idx].pending++;
+
+	if (G_UNLIKELY(session->trace)) {
+		rspamd_tracing_span_begin(session->trace, RSPAMD_TRACE_SPAN_EVENT,
+								  subsystem, new_event);
+	}
 
 	return new_event;
 }
@@ -199,13 +343,14 @@ void rspamd_session_remove_event_full(struct rspamd_async_session *session,
 
 		msg_err_session("cannot find event: %p(%p) from %s (%d total events)", fin, ud,
 						event_source, (int) kh_size(session->events));
-		kh_foreach_key(session->events, found_ev, {
+		DL_FOREACH(session->events_list, found_ev)
+		{
 			msg_err_session("existing event %s (%s): %p(%p)",
 							found_ev->subsystem,
 							found_ev->event_source,
 							found_ev->fin,
 							found_ev->user_data);
-		});
+		}
 
 		g_assert_not_reached();
 	}
@@ -220,6 +365,13 @@ void rspamd_session_remove_event_full(struct rspamd_async_session *session,
 					  found_ev->event_source);
 	kh_del(rspamd_events_hash, session->events, k);
 
+	if (G_UNLIKELY(session->trace)) {
+		rspamd_tracing_span_end(session->trace, found_ev);
+	}
+
+	/* Event is not used after this point, so it could be reused by fin */
+	rspamd_session_event_release(session, found_ev);
+
 	/* Remove event */
 	if (fin) {
 		fin(ud);
@@ -228,6 +380,12 @@ void rspamd_session_remove_event_full(struct rspamd_async_session *session,
 	rspamd_session_pending(session);
 }
 
+void rspamd_session_set_trace(struct rspamd_async_session *session,
+							  struct rspamd_task_trace *trace)
+{
+	session->trace = trace;
+}
+
 gboolean
 rspamd_session_destroy(struct rspamd_async_session *session)
 {
@@ -250,7 +408,8 @@ rspamd_session_destroy(struct rspamd_async_session *session)
 
 void rspamd_session_cleanup(struct rspamd_async_session *session, bool forced_cleanup)
 {
-	struct rspamd_async_event *ev;
+	struct rspamd_async_event *ev, *tmp;
+	int ret;
 
 	if (session == NULL) {
 		msg_err("session is NULL");
@@ -258,12 +417,14 @@ void rspamd_session_cleanup(struct rspamd_async_session *session, bool forced_cl
 	}
 
 	session->flags |= RSPAMD_SESSION_FLAG_CLEANUP;
-	khash_t(rspamd_events_hash) *uncancellable_events = kh_init(rspamd_events_hash);
 
-	kh_foreach_key(session->events, ev, {
-		/* Call event's finalizer */
-		int ret;
+	if (forced_cleanup) {
+		rspamd_session_log_oldest(session, TRUE);
+	}
 
+	DL_FOREACH_SAFE(session->events_list, ev, tmp)
+	{
+		/* Call event's finalizer */
 		if (ev->fin != NULL) {
 			if (forced_cleanup) {
 				msg_info_session("forced removed event on destroy: %p, subsystem: %s, scheduled from: %s",
@@ -277,8 +438,10 @@ void rspamd_session_cleanup(struct rspamd_async_session *session, bool forced_cl
 								  ev->subsystem);
 			}
 			ev->fin(ev->user_data);
+			rspamd_session_event_release(session, ev);
 		}
 		else {
+			/* Assume an event is uncancellable, keep it in the list */
 			if (forced_cleanup) {
 				msg_info_session("NOT forced removed event on destroy - uncancellable: "
 								 "%p, subsystem: %s, scheduled from: %s",
@@ -291,18 +454,22 @@ void rspamd_session_cleanup(struct rspamd_async_session *session, bool forced_cl
 								  ev->user_data,
 								  ev->subsystem);
 			}
-			/* Assume an event is uncancellable, move it to a new hash table */
-			kh_put(rspamd_events_hash, uncancellable_events, ev, &ret);
 		}
-	});
+	}
+
+	/* Uncancellable events are usually absent, so it is cheaper to rebuild the set */
+	kh_clear(rspamd_events_hash, session->events);
+
+	DL_FOREACH(session->events_list, ev)
+	{
+		kh_put(rspamd_events_hash, session->events, ev, &ret);
+	}
 
-	kh_destroy(rspamd_events_hash, session->events);
-	session->events = uncancellable_events;
 	if (forced_cleanup) {
-		msg_info_session("pending %d uncancellable events", kh_size(uncancellable_events));
+		msg_info_session("pending %d uncancellable events", kh_size(session->events));
 	}
 	else {
-		msg_debug_session("pending %d uncancellable events", kh_size(uncancellable_events));
+		msg_debug_session("pending %d uncancellable events", kh_size(session->events));
 	}
 
 	session->flags &= ~RSPAMD_SESSION_FLAG_CLEANUP;
@@ -344,6 +511,10 @@ unsigned int rspamd_session_events_pending(struct rspamd_async_session *session)
 	npending = kh_size(session->events);
 	msg_debug_session("pending %d events", npending);
 
+	if (G_UNLIKELY(session->flags & RSPAMD_SESSION_FLAG_DEBUG)) {
+		rspamd_session_log_oldest(session, FALSE);
+	}
+
 	return npending;
 }
 
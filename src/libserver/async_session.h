@@ -25,6 +25,7 @@ extern "C" {
 
 struct rspamd_async_event;
 struct rspamd_async_session;
+struct rspamd_task_trace;
 
 typedef void (*event_finalizer_t)(gpointer ud);
 
@@ -114,6 +115,14 @@ unsigned int rspamd_session_events_pending(struct rspamd_async_session *session)
  */
 gboolean rspamd_session_blocked(struct rspamd_async_session *s);
 
+/**
+ * Record spans for all events of the session in the trace specified
+ * @param session
+ * @param trace
+ */
+void rspamd_session_set_trace(struct rspamd_async_session *session,
+							  struct rspamd_task_trace *trace);
+
 #ifdef __cplusplus
 }
 #endif
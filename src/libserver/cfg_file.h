@@ -48,6 +48,7 @@ struct worker_s;
 struct rspamd_external_libs_ctx;
 struct rspamd_cryptobox_pubkey;
 struct rspamd_dns_resolver;
+struct rspamd_io_replay;
 
 /**
  * Logging type
@@ -128,6 +129,8 @@ struct rspamd_symbol {
 	unsigned int flags;
 	void *cache_item;
 	int nshots;
+	char *json_prefix; /* Escaped `"name":{"name":"name","score":` for scan replies */
+	unsigned int json_prefix_len;
 };
 
 /**
@@ -213,6 +216,10 @@ struct rspamd_worker_conf {
 	ucl_object_t *options;                     /**< other worker's options								*/
 	struct rspamd_worker_lua_script *scripts;  /**< registered lua scripts								*/
 	gboolean enabled;
+	gboolean cpu_affinity;                     /**< pin workers to CPUs spread over NUMA nodes			*/
+	uint64_t max_memory;                       /**< memory limit to degrade at, 0 means cgroup limit		*/
+	double memory_pressure;                    /**< part of the memory limit to start degradation at		*/
+	GList *memory_pressure_disable;            /**< symbols disabled under memory pressure				*/
 	ref_entry_t ref;
 };
 
@@ -336,6 +343,7 @@ struct rspamd_config {
 	char *rspamd_group;              /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;      /**< memory pool for config								*/
 	char *cfg_name;                  /**< name of config file								*/
+	char *cfg_snapshot;              /**< path to the parsed config snapshot (NULL if disabled)	*/
 	char *pid_file;                  /**< name of pid file									*/
 	char *temp_dir;                  /**< dir for temp files									*/
 	char *control_socket_path;       /**< path to the control socket							*/
@@ -356,6 +364,9 @@ struct rspamd_config {
 	gboolean allow_raw_input;                                /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                              /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                           /**< use vectorized hyperscan matching					*/
+	unsigned int hs_shard_size;                              /**< maximum number of expressions in a hyperscan shard	*/
+	double re_profile_rate;                                  /**< part of tasks where regexps are timed				*/
+	double re_time_budget;                                   /**< time of a regexp per message to warn about			*/
 	gboolean enable_shutdown_workaround;                     /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                                /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                          /**< Enable session cache for debug						*/
@@ -373,10 +384,23 @@ struct rspamd_config {
 	gsize max_message;           /**< maximum size for messages							*/
 	gsize max_pic_size;          /**< maximum size for a picture to process				*/
 	gsize images_cache_size;     /**< size of LRU cache for DCT data from images			*/
+	gsize images_shared_cache_size; /**< size of DCT data cache shared by workers		*/
+	double mempool_size_percentile; /**< percentile of pools sizes used to size new pools	*/
+	gboolean hugepages;             /**< back large long-lived structures by huge pages		*/
+	double trace_sample_rate;       /**< fraction of tasks to be traced (0 to disable)		*/
+	char *trace_collector;          /**< OTLP/HTTP collectors to export spans to			*/
+	char *trace_collector_path;     /**< path of OTLP traces endpoint						*/
+	double trace_flush_interval;    /**< interval to export collected spans					*/
+	unsigned int trace_batch_size;  /**< number of spans that triggers export				*/
+	char *io_record;                /**< file to append redis, http and tcp replies to		*/
+	char *io_replay;                /**< file to replay redis, http and tcp replies from	*/
+	double io_replay_latency;       /**< delay of replayed replies with no recorded latency */
+	struct rspamd_io_replay *io_replay_ctx; /**< record/replay state, created on demand		*/
 	double task_timeout;         /**< maximum message processing time					*/
 	int default_max_shots;       /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 	int32_t heartbeats_loss_max; /**< number of heartbeats lost to consider worker's termination */
 	double heartbeat_interval;   /**< interval for heartbeats for workers				*/
+	double reload_warmup_timeout; /**< max time to wait for new workers warm-up on reload (0 to disable) */
 
 	enum rspamd_log_type log_type;                      /**< log type											*/
 	int log_facility;                                   /**< log facility in case of syslog						*/
@@ -385,6 +409,8 @@ struct rspamd_config {
 	gboolean log_buffered;                              /**< whether logging is buffered						*/
 	gboolean log_silent_workers;                        /**< silence info messages from workers					*/
 	uint32_t log_buf_size;                              /**< length of log buffer								*/
+	gboolean log_async;                                 /**< write log file from a separate thread				*/
+	uint32_t log_async_size;                            /**< length of async log ring							*/
 	const ucl_object_t *debug_ip_map;                   /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                                  /**< whether we should log URLs                         */
 	GHashTable *debug_modules;                          /**< logging modules to debug							*/
@@ -393,12 +419,15 @@ struct rspamd_config {
 	unsigned int log_error_elts;                        /**< number of elements in error logbuf					*/
 	unsigned int log_error_elt_maxlen;                  /**< maximum size of error log element					*/
 	unsigned int log_task_max_elts;                     /**< maximum number of elements in task logging			*/
+	char *log_binary_file;                              /**< path to binary task log							*/
+	gboolean log_binary_only;                           /**< do not write text task log if binary log is used	*/
 	struct rspamd_worker_log_pipe *log_pipes;
 
 	gboolean compat_messages; /**< use old messages in the protocol (array) 			*/
 
 	GPtrArray *script_modules;    /**< a list of script modules to load				*/
 	GHashTable *explicit_modules; /**< modules that should be always loaded				*/
+	GList *histogram_symbols;     /**< symbols with execution time histograms			*/
 
 	GList *filters;                                  /**< linked list of all filters							*/
 	GList *workers;                                  /**< linked list of all workers params					*/
@@ -420,6 +449,7 @@ struct rspamd_config {
 	double map_timeout;               /**< maps watch timeout									*/
 	double map_file_watch_multiplier; /**< multiplier for watch timeout when maps are files	*/
 	char *maps_cache_dir;             /**< where to save HTTP cached data						*/
+	gsize map_image_min_size;         /**< share hash maps larger than this via images		*/
 
 	double monitored_interval;  /**< interval between monitored checks					*/
 	gboolean disable_monitored; /**< disable monitoring completely						*/
@@ -428,6 +458,8 @@ struct rspamd_config {
 	struct rspamd_symcache *cache; /**< symbols cache object								*/
 	char *cache_filename;          /**< filename of cache file								*/
 	double cache_reload_time;      /**< how often cache reload should be performed			*/
+	gboolean cache_cost_scheduling; /**< order filters by score per time and stop on decided action */
+	unsigned int cache_network_concurrency; /**< start up to this number of network filters first (0 to disable) */
 	char *checksum;                /**< real checksum of config file						*/
 	gpointer lua_state;            /**< pointer to lua state								*/
 	gpointer lua_thread_pool;      /**< pointer to lua thread (coroutine) pool				*/
@@ -462,12 +494,18 @@ struct rspamd_config {
 	unsigned int lua_gc_step;        /**< lua gc step 										*/
 	unsigned int lua_gc_pause;       /**< lua gc pause										*/
 	unsigned int full_gc_iters;      /**< iterations between full gc cycle					*/
+	unsigned int lua_threads_prewarm; /**< lua threads created before forking workers		*/
+	gsize lua_gc_budget;             /**< lua garbage left by tasks before a forced gc step	*/
 	unsigned int max_lua_urls;       /**< maximum number of urls to be passed to Lua			*/
 	unsigned int max_urls;           /**< maximum number of urls to be processed in general	*/
 	int max_recipients;              /**< maximum number of recipients to be processed	*/
 	unsigned int max_blas_threads;   /**< maximum threads for openblas when learning ANN		*/
 	unsigned int max_opts_len;       /**< maximum length for all options for a symbol		*/
 	gsize max_html_len;              /**< maximum length of HTML document					*/
+	gsize max_text_part_len;         /**< text of a part used for words, longer is sampled	*/
+	unsigned int max_stat_words;     /**< words of a part used for statistics, 0 - no limit	*/
+	gsize css_cache_size;            /**< memory limit for cached parsed stylesheets		*/
+	unsigned int url_intern_size;    /**< number of parsed urls shared between tasks		*/
 
 	struct module_s **compiled_modules;   /**< list of compiled C modules							*/
 	struct worker_s **compiled_workers;   /**< list of compiled C modules							*/
@@ -477,6 +515,7 @@ struct rspamd_config {
 	struct rspamd_external_libs_ctx *libs_ctx;  /**< context for external libraries						*/
 	struct rspamd_monitored_ctx *monitored_ctx; /**< context for monitored resources					*/
 	void *redis_pool;                           /**< redis connection pool								*/
+	unsigned int redis_shared_conns;            /**< multiplexed connections per redis server			*/
 
 	struct rspamd_re_cache *re_cache; /**< static regexp cache								*/
 
@@ -489,6 +528,7 @@ struct rspamd_config {
 
 	char *ssl_ca_path;            /**< path to CA certs									*/
 	char *ssl_ciphers;            /**< set of preferred ciphers							*/
+	gboolean ssl_ktls;            /**< use kernel TLS offload if available				*/
 	char *zstd_input_dictionary;  /**< path to zstd input dictionary						*/
 	char *zstd_output_dictionary; /**< path to zstd output dictionary						*/
 	ucl_object_t *neighbours;     /**< other servers in the cluster						*/
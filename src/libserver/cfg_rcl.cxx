@@ -28,6 +28,7 @@
 #include "libutil/multipattern.h"
 #include "libmime/email_addr.h"
 #include "libmime/lang_detection.h"
+#include "libserver/mempool_vars_internal.h"
 
 #include <string>
 #include <filesystem>
@@ -299,6 +300,11 @@ rspamd_rcl_logging_handler(rspamd_mempool_t *pool, const ucl_object_t *obj,
 		cfg->log_flags |= RSPAMD_LOG_FLAG_USEC;
 	}
 
+	val = ucl_object_lookup_any(obj, "async", "log_async", nullptr);
+	if (val && ucl_object_toboolean(val)) {
+		cfg->log_async = TRUE;
+	}
+
 	return rspamd_rcl_section_parse_defaults(cfg, *section, cfg->cfg_pool, obj,
 											 (void *) cfg, err);
 }
@@ -903,7 +909,7 @@ rspamd_rcl_lua_handler(rspamd_mempool_t *pool, const ucl_object_t *obj,
 			auto err_idx = lua_gettop(L);
 
 			/* Load file */
-			if (luaL_loadfile(L, lua_file.c_str()) != 0) {
+			if (rspamd_lua_load_file_cached(L, lua_file.c_str()) != 0) {
 				g_set_error(err,
 							CFG_RCL_ERROR,
 							EINVAL,
@@ -1638,6 +1644,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, log_buf_size),
 									   RSPAMD_CL_FLAG_INT_32,
 									   "Size of log buffer in bytes (for file logging)");
+		rspamd_rcl_add_default_handler(sub,
+									   "log_async_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, log_async_size),
+									   RSPAMD_CL_FLAG_INT_32,
+									   "Size of log ring in bytes when async file logging is enabled");
 		rspamd_rcl_add_default_handler(sub,
 									   "log_urls",
 									   rspamd_rcl_parse_struct_boolean,
@@ -1688,6 +1700,18 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, log_task_max_elts),
 									   RSPAMD_CL_FLAG_UINT,
 									   "Maximum number of elements in task log entry (7 by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "binary_log",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, log_binary_file),
+									   0,
+									   "Write structured binary task log to this file (see `rspamadm binlog`)");
+		rspamd_rcl_add_default_handler(sub,
+									   "binary_log_only",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, log_binary_only),
+									   0,
+									   "Do not write text task log line when binary log is enabled");
 
 		/* Documentation only options, handled in log_handler to map flags */
 		rspamd_rcl_add_doc_by_path(cfg,
@@ -1760,6 +1784,18 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, cache_reload_time),
 									   RSPAMD_CL_FLAG_TIME_FLOAT,
 									   "How often cache reload should be performed");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_cost_scheduling",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_cost_scheduling),
+									   0,
+									   "Order filters by expected score per time and skip the rest once the action cannot change");
+		rspamd_rcl_add_default_handler(sub,
+									   "cache_network_concurrency",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, cache_network_concurrency),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Start up to this number of network filters with resolved dependencies before other filters (0 to disable)");
 
 		/* Old DNS configuration */
 		rspamd_rcl_add_default_handler(sub,
@@ -1792,6 +1828,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, dns_max_requests),
 									   RSPAMD_CL_FLAG_INT_32,
 									   "Maximum DNS requests per task (default: 64)");
+		rspamd_rcl_add_default_handler(sub,
+									   "redis_shared_connections",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, redis_shared_conns),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Number of connections per Redis server shared by single Redis requests with pipelining (default: 0, disabled)");
 		rspamd_rcl_add_default_handler(sub,
 									   "control_socket",
 									   rspamd_rcl_parse_struct_string,
@@ -1804,6 +1846,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, explicit_modules),
 									   RSPAMD_CL_FLAG_STRING_LIST_HASH,
 									   "Always load these modules even if they are not configured explicitly");
+		rspamd_rcl_add_default_handler(sub,
+									   "histogram_symbols",
+									   rspamd_rcl_parse_struct_string_list,
+									   G_STRUCT_OFFSET(struct rspamd_config, histogram_symbols),
+									   0,
+									   "Export execution time histograms for these symbols in metrics (up to 16)");
 		rspamd_rcl_add_default_handler(sub,
 									   "allow_raw_input",
 									   rspamd_rcl_parse_struct_boolean,
@@ -1858,6 +1906,12 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, maps_cache_dir),
 									   0,
 									   "Directory to save maps cached data (default: $DBDIR)");
+		rspamd_rcl_add_default_handler(sub,
+									   "map_image_min_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, map_image_min_size),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Share hash maps with data larger than this between processes via images in maps_cache_dir (default: 0, disabled)");
 		rspamd_rcl_add_default_handler(sub,
 									   "monitoring_watch_interval",
 									   rspamd_rcl_parse_struct_time,
@@ -1948,6 +2002,32 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, max_word_len),
 									   RSPAMD_CL_FLAG_INT_SIZE,
 									   "Maximum length of the html part to be parsed");
+		rspamd_rcl_add_default_handler(sub,
+									   "max_text_part_len",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, max_text_part_len),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Maximum length of a text part to extract words from, head, tail and pieces of the middle "
+									   "of longer parts are used (1Mb by default, 0 for no limit)");
+		rspamd_rcl_add_default_handler(sub,
+									   "max_stat_words",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, max_stat_words),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Maximum number of words of a text part used for statistics, sampled in the same way "
+									   "(0 for no limit by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "css_cache_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, css_cache_size),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Memory limit for the cache of parsed stylesheets (0 to disable)");
+		rspamd_rcl_add_default_handler(sub,
+									   "url_intern_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, url_intern_size),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Number of parsed urls shared between tasks of a worker (0 to disable)");
 		rspamd_rcl_add_default_handler(sub,
 									   "words_decay",
 									   rspamd_rcl_parse_struct_integer,
@@ -1984,6 +2064,25 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, disable_hyperscan),
 									   0,
 									   "Disable hyperscan optimizations for regular expressions");
+		rspamd_rcl_add_default_handler(sub,
+									   "hyperscan_shard_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, hs_shard_size),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Maximum number of expressions in a single hyperscan database of a class, "
+									   "so a changed expression causes recompilation of its shard only (1024 by default, 0 to disable)");
+		rspamd_rcl_add_default_handler(sub,
+									   "regexp_profile_rate",
+									   rspamd_rcl_parse_struct_double,
+									   G_STRUCT_OFFSET(struct rspamd_config, re_profile_rate),
+									   0,
+									   "Part of messages where time of each regexp is measured (0.1 by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "regexp_time_budget",
+									   rspamd_rcl_parse_struct_time,
+									   G_STRUCT_OFFSET(struct rspamd_config, re_time_budget),
+									   RSPAMD_CL_FLAG_TIME_FLOAT,
+									   "Warn if a regexp takes more time for a single message (50ms by default)");
 		rspamd_rcl_add_default_handler(sub,
 									   "vectorized_hyperscan",
 									   rspamd_rcl_parse_struct_boolean,
@@ -2050,6 +2149,72 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, ssl_ciphers),
 									   0,
 									   "List of ssl ciphers (e.g. HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4)");
+		rspamd_rcl_add_default_handler(sub,
+									   "ssl_ktls",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, ssl_ktls),
+									   0,
+									   "Use kernel TLS offload for outgoing connections if supported by OpenSSL and kernel");
+		rspamd_rcl_add_default_handler(sub,
+									   "mempool_size_percentile",
+									   rspamd_rcl_parse_struct_double,
+									   G_STRUCT_OFFSET(struct rspamd_config, mempool_size_percentile),
+									   0,
+									   "Percentile of the recent pools sizes used to choose initial size of new pools (0.85 by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "hugepages",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_config, hugepages),
+									   0,
+									   "Use transparent huge pages for large long-lived structures: config pool, maps and hyperscan databases (false by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "trace_sample_rate",
+									   rspamd_rcl_parse_struct_double,
+									   G_STRUCT_OFFSET(struct rspamd_config, trace_sample_rate),
+									   0,
+									   "Fraction of tasks to record tracing spans for (0 by default, tracing is disabled)");
+		rspamd_rcl_add_default_handler(sub,
+									   "trace_collector",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, trace_collector),
+									   0,
+									   "OpenTelemetry collectors to export spans to via OTLP/HTTP (port 4318 by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "trace_collector_path",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, trace_collector_path),
+									   0,
+									   "Path of OTLP traces endpoint (/v1/traces by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "trace_flush_interval",
+									   rspamd_rcl_parse_struct_time,
+									   G_STRUCT_OFFSET(struct rspamd_config, trace_flush_interval),
+									   RSPAMD_CL_FLAG_TIME_FLOAT,
+									   "Interval to export collected spans (5s by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "trace_batch_size",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, trace_batch_size),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Number of collected spans that triggers export before the interval (512 by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "io_record",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, io_record),
+									   RSPAMD_CL_FLAG_STRING_PATH,
+									   "Append replies of redis, http and tcp requests made from lua to this file");
+		rspamd_rcl_add_default_handler(sub,
+									   "io_replay",
+									   rspamd_rcl_parse_struct_string,
+									   G_STRUCT_OFFSET(struct rspamd_config, io_replay),
+									   RSPAMD_CL_FLAG_STRING_PATH,
+									   "Serve redis, http and tcp requests made from lua with replies recorded in this file");
+		rspamd_rcl_add_default_handler(sub,
+									   "io_replay_latency",
+									   rspamd_rcl_parse_struct_time,
+									   G_STRUCT_OFFSET(struct rspamd_config, io_replay_latency),
+									   RSPAMD_CL_FLAG_TIME_FLOAT,
+									   "Delay of replayed replies that have no recorded latency (0 by default)");
 		rspamd_rcl_add_default_handler(sub,
 									   "max_message",
 									   rspamd_rcl_parse_struct_integer,
@@ -2065,9 +2230,15 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 		rspamd_rcl_add_default_handler(sub,
 									   "images_cache",
 									   rspamd_rcl_parse_struct_integer,
-									   G_STRUCT_OFFSET(struct rspamd_config, max_pic_size),
+									   G_STRUCT_OFFSET(struct rspamd_config, images_cache_size),
 									   RSPAMD_CL_FLAG_INT_SIZE,
 									   "Size of DCT data cache for images (256 elements by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "images_shared_cache",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, images_shared_cache_size),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Size of DCT data cache for images shared by all workers (2048 elements by default, 0 to disable)");
 		rspamd_rcl_add_default_handler(sub,
 									   "zstd_input_dictionary",
 									   rspamd_rcl_parse_struct_string,
@@ -2140,12 +2311,32 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_config, full_gc_iters),
 									   RSPAMD_CL_FLAG_UINT,
 									   "Task scanned before memory gc is performed (default: 0 - disabled)");
+		rspamd_rcl_add_default_handler(sub,
+									   "lua_threads_prewarm",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, lua_threads_prewarm),
+									   RSPAMD_CL_FLAG_UINT,
+									   "Number of Lua coroutines created before scanner workers are forked (default: 0)");
+		rspamd_rcl_add_default_handler(sub,
+									   "lua_gc_budget",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_config, lua_gc_budget),
+									   RSPAMD_CL_FLAG_INT_SIZE,
+									   "Lua memory allocated by tasks before a GC step is forced between tasks; "
+									   "smaller steps are done when a worker is idle (default: 0, disabled)");
 		rspamd_rcl_add_default_handler(sub,
 									   "heartbeat_interval",
 									   rspamd_rcl_parse_struct_time,
 									   G_STRUCT_OFFSET(struct rspamd_config, heartbeat_interval),
 									   RSPAMD_CL_FLAG_TIME_FLOAT,
 									   "Time between workers heartbeats");
+		rspamd_rcl_add_default_handler(sub,
+									   "reload_warmup_timeout",
+									   rspamd_rcl_parse_struct_time,
+									   G_STRUCT_OFFSET(struct rspamd_config, reload_warmup_timeout),
+									   RSPAMD_CL_FLAG_TIME_FLOAT,
+									   "On reload, keep old workers accepting until new ones have loaded maps and hyperscan, "
+									   "but no longer than this time (default: 0 - disabled)");
 		rspamd_rcl_add_default_handler(sub,
 									   "heartbeats_loss_max",
 									   rspamd_rcl_parse_struct_integer,
@@ -2386,6 +2577,30 @@ rspamd_rcl_config_init(struct rspamd_config *cfg, GHashTable *skip_sections)
 									   G_STRUCT_OFFSET(struct rspamd_worker_conf, enabled),
 									   0,
 									   "Enable or disable a worker (true by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "cpu_affinity",
+									   rspamd_rcl_parse_struct_boolean,
+									   G_STRUCT_OFFSET(struct rspamd_worker_conf, cpu_affinity),
+									   0,
+									   "Pin each worker to a single CPU, spreading workers over NUMA nodes (false by default)");
+		rspamd_rcl_add_default_handler(sub,
+									   "max_memory",
+									   rspamd_rcl_parse_struct_integer,
+									   G_STRUCT_OFFSET(struct rspamd_worker_conf, max_memory),
+									   RSPAMD_CL_FLAG_INT_64,
+									   "Memory (RSS) limit of a worker used to enter degraded mode, cgroup limit is used if not set");
+		rspamd_rcl_add_default_handler(sub,
+									   "memory_pressure",
+									   rspamd_rcl_parse_struct_double,
+									   G_STRUCT_OFFSET(struct rspamd_worker_conf, memory_pressure),
+									   0,
+									   "Part of the memory limit when a worker starts to shed optional work (0.9 by default, 0 to disable)");
+		rspamd_rcl_add_default_handler(sub,
+									   "memory_pressure_disable",
+									   rspamd_rcl_parse_struct_string_list,
+									   G_STRUCT_OFFSET(struct rspamd_worker_conf, memory_pressure_disable),
+									   0,
+									   "Symbols that are disabled while a worker is under memory pressure");
 	}
 
 	if (!(skip_sections && g_hash_table_lookup(skip_sections, "modules"))) {
@@ -3518,6 +3733,28 @@ rspamd_rcl_decrypt_handler(struct ucl_parser *parser,
 	return true;
 }
 
+/* Checks for tags that are configured for lupa in `lua_util` */
+static bool
+rspamd_rcl_jinja_has_tags(const unsigned char *source, size_t source_len)
+{
+	if (source_len < 2) {
+		return false;
+	}
+
+	const auto *end = source + source_len;
+	const auto *p = (const unsigned char *) memchr(source, '{', source_len);
+
+	while (p != nullptr && p + 1 < end) {
+		if (p[1] == '%' || p[1] == '=' || p[1] == '#') {
+			return true;
+		}
+
+		p = (const unsigned char *) memchr(p + 1, '{', end - p - 1);
+	}
+
+	return false;
+}
+
 static bool
 rspamd_rcl_jinja_handler(struct ucl_parser *parser,
 						 const unsigned char *source, size_t source_len,
@@ -3527,6 +3764,28 @@ rspamd_rcl_jinja_handler(struct ucl_parser *parser,
 	auto *cfg = (struct rspamd_config *) user_data;
 	auto *L = RSPAMD_LUA_CFG_STATE(cfg);
 
+	if (!rspamd_rcl_jinja_has_tags(source, source_len)) {
+		/*
+		 * Most of the included files are not templates, and lupa just normalises
+		 * newlines in a plain text, so do the same without calling lua
+		 */
+		auto *ndata = (unsigned char *) UCL_ALLOC(MAX(source_len, 1));
+		size_t nlen = 0;
+
+		for (size_t i = 0; i < source_len; i++) {
+			if (source[i] == '\r' && i + 1 < source_len && source[i + 1] == '\n') {
+				continue;
+			}
+
+			ndata[nlen++] = source[i];
+		}
+
+		*destination = ndata;
+		*dest_len = nlen;
+
+		return true;
+	}
+
 	lua_pushcfunction(L, &rspamd_lua_traceback);
 	auto err_idx = lua_gettop(L);
 
@@ -3695,6 +3954,377 @@ rspamd_config_parse_ucl(struct rspamd_config *cfg,
 	return TRUE;
 }
 
+/*
+ * Parsed config snapshot: the UCL tree as it is after all includes, variables,
+ * templates and priorities have been processed. It is keyed by the build, the
+ * command line variables and the environment and remembers every file that
+ * has been looked at while parsing, so it is used only if none of them has
+ * been changed, added or removed since the snapshot has been written.
+ */
+static const std::uint8_t config_snapshot_magic[8] = {'r', 's', 'c', 'f', 'g', 1, 0, 0};
+
+struct rspamd_config_snapshot_header {
+	std::uint8_t magic[8];
+	std::uint8_t key[rspamd_cryptobox_HASHBYTES];
+	std::uint32_t nfiles;
+	std::uint32_t unused;
+	std::uint64_t files_len;
+	std::uint64_t data_len;
+};
+
+/* Path of `pathlen` bytes padded to 8 bytes follows each record */
+struct rspamd_config_snapshot_file {
+	std::int64_t mtime;
+	std::int64_t size;
+	std::uint64_t ino;
+	std::uint32_t exists;
+	std::uint32_t pathlen;
+};
+
+struct rspamd_config_snapshot_trace {
+	std::vector<std::string> files;
+	ankerl::unordered_dense::set<std::string> seen;
+	bool cacheable = true;
+
+	auto add(std::string &&path) -> void
+	{
+		if (seen.insert(path).second) {
+			files.emplace_back(std::move(path));
+		}
+	}
+};
+
+static inline auto
+rspamd_config_snapshot_padded_len(std::size_t len) -> std::size_t
+{
+	return (len + 7) & ~(std::size_t) 7;
+}
+
+static auto
+rspamd_config_snapshot_stat(const std::string &path) -> rspamd_config_snapshot_file
+{
+	struct stat st;
+	rspamd_config_snapshot_file rec{};
+
+	if (stat(path.c_str(), &st) == 0) {
+		rec.mtime = st.st_mtime;
+		rec.size = st.st_size;
+		rec.ino = st.st_ino;
+		rec.exists = 1;
+	}
+
+	rec.pathlen = path.size();
+
+	return rec;
+}
+
+static void
+rspamd_config_snapshot_trace_include(struct ucl_parser *parser,
+									 const ucl_object_t *parent,
+									 const ucl_object_t *args,
+									 const char *path,
+									 size_t pathlen,
+									 void *ud)
+{
+	auto *trace = (rspamd_config_snapshot_trace *) ud;
+	auto fpath = std::string{path, pathlen};
+
+	if (fpath.find_first_of("*?[") != std::string::npos) {
+		/* Files matching a glob are traced separately, a new match changes the directory */
+		fpath = std::filesystem::path{fpath}.parent_path().string();
+
+		if (fpath.find_first_of("*?[") != std::string::npos) {
+			trace->cacheable = false;
+			return;
+		}
+	}
+
+	trace->add(std::move(fpath));
+}
+
+static void
+rspamd_config_snapshot_key(const char *filename,
+						   GHashTable *vars,
+						   gboolean skip_jinja,
+						   char **lua_env,
+						   unsigned char *key)
+{
+	rspamd_cryptobox_hash_state_t hs;
+	std::vector<std::string> strs;
+
+	auto hash_str = [&](std::string_view s) {
+		auto len = (std::uint64_t) s.size();
+		rspamd_cryptobox_hash_update(&hs, (const unsigned char *) &len, sizeof(len));
+		rspamd_cryptobox_hash_update(&hs, (const unsigned char *) s.data(), s.size());
+	};
+
+	rspamd_cryptobox_hash_init(&hs, nullptr, 0);
+	hash_str(RVERSION);
+	hash_str(RID);
+	hash_str(filename);
+	hash_str(skip_jinja ? "1" : "0");
+
+	if (vars != nullptr) {
+		GHashTableIter it;
+		gpointer k, v;
+
+		g_hash_table_iter_init(&it, vars);
+
+		while (g_hash_table_iter_next(&it, &k, &v)) {
+			strs.emplace_back(fmt::format("{}={}", (const char *) k, (const char *) v));
+		}
+	}
+
+	/* Templates can use both environment and host name */
+	auto **env = g_get_environ();
+
+	for (auto **cur = env; *cur != nullptr; cur++) {
+		strs.emplace_back(*cur);
+	}
+
+	g_strfreev(env);
+	std::sort(strs.begin(), strs.end());
+
+	for (const auto &s: strs) {
+		hash_str(s);
+	}
+
+	char hostbuf[256];
+	memset(hostbuf, 0, sizeof(hostbuf));
+	gethostname(hostbuf, sizeof(hostbuf) - 1);
+	hash_str(hostbuf);
+
+	if (lua_env) {
+		for (auto **cur = lua_env; *cur != nullptr; cur++) {
+			hash_str(*cur);
+		}
+	}
+
+	rspamd_cryptobox_hash_final(&hs, key);
+}
+
+static auto
+rspamd_config_snapshot_load(struct rspamd_config *cfg, const unsigned char *key) -> bool
+{
+	auto snap_maybe = rspamd::util::raii_mmaped_file::mmap_shared(cfg->cfg_snapshot,
+																  O_RDONLY, PROT_READ, 0);
+
+	if (!snap_maybe) {
+		msg_debug_config("cannot open config snapshot %s: %*s", cfg->cfg_snapshot,
+						 (int) snap_maybe.error().error_message.size(),
+						 snap_maybe.error().error_message.data());
+		return false;
+	}
+
+	const auto &snap = snap_maybe.value();
+	const auto *p = (const unsigned char *) snap.get_map();
+	auto len = snap.get_size();
+	rspamd_config_snapshot_header hdr;
+
+	if (len < sizeof(hdr)) {
+		msg_info_config("config snapshot %s is truncated, ignore it", cfg->cfg_snapshot);
+		return false;
+	}
+
+	memcpy(&hdr, p, sizeof(hdr));
+
+	if (memcmp(hdr.magic, config_snapshot_magic, sizeof(hdr.magic)) != 0 ||
+		hdr.files_len > len || hdr.data_len > len ||
+		sizeof(hdr) + hdr.files_len + hdr.data_len != len) {
+		msg_info_config("config snapshot %s is invalid, ignore it", cfg->cfg_snapshot);
+		return false;
+	}
+
+	if (memcmp(hdr.key, key, sizeof(hdr.key)) != 0) {
+		msg_info_config("config snapshot %s has been built for other variables or environment, "
+						"ignore it",
+						cfg->cfg_snapshot);
+		return false;
+	}
+
+	const auto *files = p + sizeof(hdr), *files_end = files + hdr.files_len;
+
+	for (auto i = 0u; i < hdr.nfiles; i++) {
+		rspamd_config_snapshot_file rec;
+
+		if (files_end - files < (std::ptrdiff_t) sizeof(rec)) {
+			msg_info_config("config snapshot %s is invalid, ignore it", cfg->cfg_snapshot);
+			return false;
+		}
+
+		memcpy(&rec, files, sizeof(rec));
+		files += sizeof(rec);
+
+		if ((std::size_t) (files_end - files) < rspamd_config_snapshot_padded_len(rec.pathlen)) {
+			msg_info_config("config snapshot %s is invalid, ignore it", cfg->cfg_snapshot);
+			return false;
+		}
+
+		auto path = std::string{(const char *) files, rec.pathlen};
+		files += rspamd_config_snapshot_padded_len(rec.pathlen);
+		auto cur = rspamd_config_snapshot_stat(path);
+
+		if (cur.exists != rec.exists || cur.mtime != rec.mtime ||
+			cur.size != rec.size || cur.ino != rec.ino) {
+			msg_info_config("config snapshot %s is stale: %s has been changed",
+							cfg->cfg_snapshot, path.c_str());
+			return false;
+		}
+	}
+
+	auto parser = std::shared_ptr<ucl_parser>(ucl_parser_new(UCL_PARSER_NO_FILEVARS), ucl_parser_free);
+
+	if (!ucl_parser_add_chunk(parser.get(), files_end, hdr.data_len)) {
+		msg_err_config("cannot parse config snapshot %s: %s", cfg->cfg_snapshot,
+					   ucl_parser_get_error(parser.get()));
+		return false;
+	}
+
+	cfg->cfg_ucl_obj = ucl_parser_get_object(parser.get());
+
+	return true;
+}
+
+static auto
+rspamd_config_snapshot_save(struct rspamd_config *cfg,
+							const unsigned char *key,
+							const rspamd_config_snapshot_trace &trace) -> bool
+{
+	std::vector<unsigned char> files;
+
+	for (const auto &path: trace.files) {
+		auto rec = rspamd_config_snapshot_stat(path);
+		const auto *rec_ptr = (const unsigned char *) &rec;
+
+		files.insert(files.end(), rec_ptr, rec_ptr + sizeof(rec));
+		files.insert(files.end(), path.begin(), path.end());
+		files.resize(files.size() + (rspamd_config_snapshot_padded_len(path.size()) - path.size()), 0);
+	}
+
+	std::size_t data_len;
+	auto *data = ucl_object_emit_len(cfg->cfg_ucl_obj, UCL_EMIT_CONFIG, &data_len);
+
+	if (data == nullptr) {
+		return false;
+	}
+
+	auto file_sink = rspamd::util::raii_file_sink::create(cfg->cfg_snapshot,
+														  O_WRONLY | O_TRUNC, 00600);
+
+	if (!file_sink.has_value()) {
+		free(data);
+
+		if (errno == EEXIST) {
+			/* Some other process is already writing the snapshot */
+			return false;
+		}
+
+		msg_err_config("cannot write config snapshot: %s", file_sink.error().error_message.data());
+
+		return false;
+	}
+
+	rspamd_config_snapshot_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, config_snapshot_magic, sizeof(hdr.magic));
+	memcpy(hdr.key, key, sizeof(hdr.key));
+	hdr.nfiles = trace.files.size();
+	hdr.files_len = files.size();
+	hdr.data_len = data_len;
+
+	struct iovec iov[3];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = files.data();
+	iov[1].iov_len = files.size();
+	iov[2].iov_base = data;
+	iov[2].iov_len = data_len;
+
+	auto total = sizeof(hdr) + files.size() + data_len;
+	auto written = writev(file_sink->get_fd(), iov, G_N_ELEMENTS(iov));
+	free(data);
+
+	if (written != (ssize_t) total) {
+		msg_err_config("cannot write config snapshot %s, error %d, %s", cfg->cfg_snapshot,
+					   errno, strerror(errno));
+
+		return false;
+	}
+
+	if (!file_sink->write_output()) {
+		msg_err_config("cannot rename config snapshot to %s, error %d, %s", cfg->cfg_snapshot,
+					   errno, strerror(errno));
+
+		return false;
+	}
+
+	msg_info_config("saved config snapshot to %s, %d files tracked", cfg->cfg_snapshot,
+					(int) trace.files.size());
+
+	return true;
+}
+
+/*
+ * Loads the UCL tree from the snapshot if it is up to date, otherwise parses the
+ * config and refreshes the snapshot
+ */
+static gboolean
+rspamd_config_parse_ucl_cached(struct rspamd_config *cfg,
+							   const char *filename,
+							   GHashTable *vars,
+							   gboolean skip_jinja,
+							   char **lua_env,
+							   GError **err)
+{
+	if (cfg->cfg_snapshot == nullptr) {
+		return rspamd_config_parse_ucl(cfg, filename, vars, nullptr, nullptr, skip_jinja, err);
+	}
+
+	unsigned char key[rspamd_cryptobox_HASHBYTES];
+	rspamd_config_snapshot_key(filename, vars, skip_jinja, lua_env, key);
+
+	if (rspamd_config_snapshot_load(cfg, key)) {
+		msg_info_config("loaded parsed config from snapshot %s", cfg->cfg_snapshot);
+
+		return TRUE;
+	}
+
+	rspamd_config_snapshot_trace trace;
+	auto keyfile = fmt::format("{}.key", filename);
+	trace.add(filename);
+	trace.add(std::string{keyfile});
+
+	if (lua_env) {
+		for (auto **cur = lua_env; *cur != nullptr; cur++) {
+			trace.add(*cur);
+		}
+	}
+
+	if (!rspamd_config_parse_ucl(cfg, filename, vars, rspamd_config_snapshot_trace_include,
+								 &trace, skip_jinja, err)) {
+		return FALSE;
+	}
+
+	if (access(keyfile.c_str(), R_OK) == 0) {
+		/* Never store the decrypted config */
+		trace.cacheable = false;
+	}
+
+	if (rspamd_mempool_get_variable(cfg->cfg_pool, RSPAMD_MEMPOOL_UCL_INCLUDE_MAP) != nullptr) {
+		/* Maps included in the config are registered whilst parsing */
+		trace.cacheable = false;
+	}
+
+	if (trace.cacheable) {
+		rspamd_config_snapshot_save(cfg, key, trace);
+	}
+	else {
+		msg_info_config("config %s cannot be stored in snapshot", filename);
+	}
+
+	return TRUE;
+}
+
 gboolean
 rspamd_config_read(struct rspamd_config *cfg,
 				   const char *filename,
@@ -3715,7 +4345,7 @@ rspamd_config_read(struct rspamd_config *cfg,
 		return FALSE;
 	}
 
-	if (!rspamd_config_parse_ucl(cfg, filename, vars, nullptr, nullptr, skip_jinja, &err)) {
+	if (!rspamd_config_parse_ucl_cached(cfg, filename, vars, skip_jinja, lua_env, &err)) {
 		msg_err_config_forced("failed to load config: %e", err);
 		g_error_free(err);
 
@@ -26,6 +26,7 @@
 #include "maps/map_helpers.h"
 #include "maps/map_private.h"
 #include "dynamic_cfg.h"
+#include "libserver/mempool_vars_internal.h"
 #include "utlist.h"
 #include "stat_api.h"
 #include "unix-std.h"
@@ -86,6 +87,9 @@
 #define DEFAULT_MAX_SESSIONS 100
 #define DEFAULT_MAX_WORKERS 4
 #define DEFAULT_MAX_HTML_SIZE DEFAULT_MAX_MESSAGE / 5 /* 10 Mb */
+#define DEFAULT_MAX_TEXT_PART_SIZE (1 * 1024 * 1024)
+#define DEFAULT_CSS_CACHE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_URL_INTERN_SIZE 16384
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
 #define DEFAULT_LUA_GC_STEP 200
@@ -219,7 +223,7 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	struct rspamd_config *cfg;
 	rspamd_mempool_t *pool;
 
-	pool = rspamd_mempool_new(8 * 1024 * 1024, "cfg", 0);
+	pool = rspamd_mempool_new(8 * 1024 * 1024, "cfg", RSPAMD_MEMPOOL_HUGEPAGES);
 	cfg = rspamd_mempool_alloc0_type(pool, struct rspamd_config);
 	/* Allocate larger pool for cfg */
 	cfg->cfg_pool = pool;
@@ -286,6 +290,9 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->max_recipients = 1024;
 	cfg->max_blas_threads = 1;
 	cfg->max_opts_len = 4096;
+	cfg->hs_shard_size = 1024;
+	cfg->re_profile_rate = 0.1;
+	cfg->re_time_budget = 0.05;
 	cfg->gtube_patterns_policy = RSPAMD_GTUBE_REJECT;
 
 	/* Default log line */
@@ -302,6 +309,9 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 	cfg->max_word_len = DEFAULT_MAX_WORD;
 	cfg->max_html_len = DEFAULT_MAX_HTML_SIZE;
+	cfg->max_text_part_len = DEFAULT_MAX_TEXT_PART_SIZE;
+	cfg->css_cache_size = DEFAULT_CSS_CACHE_SIZE;
+	cfg->url_intern_size = DEFAULT_URL_INTERN_SIZE;
 
 	/* GC limits */
 	cfg->lua_gc_pause = DEFAULT_LUA_GC_PAUSE;
@@ -330,6 +340,10 @@ rspamd_config_new(enum rspamd_config_init_flags flags)
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
 	cfg->images_cache_size = 256;
+	cfg->images_shared_cache_size = 2048;
+	cfg->mempool_size_percentile = RSPAMD_MEMPOOL_DEFAULT_PERCENTILE;
+	cfg->trace_flush_interval = 5.0;
+	cfg->trace_batch_size = 512;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init();
 	cfg->neighbours = ucl_object_typed_new(UCL_OBJECT);
 	cfg->redis_pool = rspamd_redis_pool_init();
@@ -832,6 +846,21 @@ rspamd_config_post_load(struct rspamd_config *cfg,
 	rspamd_adjust_clocks_resolution(cfg);
 	rspamd_logger_configure_modules(cfg->debug_modules);
 
+	if (cfg->mempool_size_percentile > 0 && cfg->mempool_size_percentile < 1.0) {
+		rspamd_mempool_set_suggestion_percentile(cfg->mempool_size_percentile);
+	}
+	else {
+		msg_warn_config("invalid mempool_size_percentile %.2f, must be in range (0, 1)",
+						cfg->mempool_size_percentile);
+	}
+
+	rspamd_mempool_set_hugepages(cfg->hugepages);
+
+	if (cfg->hugepages) {
+		/* Config pool is created before we know if huge pages are enabled */
+		rspamd_mempool_advise_hugepages(cfg->cfg_pool);
+	}
+
 	if (cfg->one_shot_mode) {
 		msg_info_config("enabling one shot mode (was %d max shots)",
 						cfg->default_max_shots);
@@ -893,6 +922,8 @@ rspamd_config_post_load(struct rspamd_config *cfg,
 			rspamd_url_init(cfg->tld_file);
 		}
 
+		rspamd_url_set_intern_size(cfg->url_intern_size);
+
 		rspamd_mempool_add_destructor(cfg->cfg_pool, rspamd_urls_config_dtor,
 									  nullptr);
 	}
@@ -1082,6 +1113,7 @@ rspamd_config_new_worker(struct rspamd_config *cfg,
 		c->rlimit_nofile = 0;
 		c->rlimit_maxcore = 0;
 		c->enabled = TRUE;
+		c->memory_pressure = 0.9;
 
 		REF_INIT_RETAIN(c, rspamd_worker_conf_dtor);
 		rspamd_mempool_add_destructor(cfg->cfg_pool,
@@ -1100,6 +1132,8 @@ rspamd_include_map_handler(const unsigned char *data, gsize len,
 
 	auto ftok = rspamd_ftok_t{.len = len + 1, .begin = (char *) data};
 	auto *map_line = rspamd_mempool_ftokdup(cfg->cfg_pool, &ftok);
+	/* Config with included maps cannot be restored from a snapshot */
+	rspamd_mempool_set_variable(cfg->cfg_pool, RSPAMD_MEMPOOL_UCL_INCLUDE_MAP, map_line, nullptr);
 
 	auto *cbdata = new rspamd_ucl_map_cbdata{cfg};
 	auto **pcbdata = new rspamd_ucl_map_cbdata *(cbdata);
@@ -2680,8 +2714,10 @@ rspamd_init_libs(void)
 	return ctx;
 }
 
+static void rspamd_free_zstd_dictionary(struct zstd_dictionary *dict);
+
 static struct zstd_dictionary *
-rspamd_open_zstd_dictionary(const char *path)
+rspamd_open_zstd_dictionary(const char *path, bool for_compression)
 {
 	struct zstd_dictionary *dict;
 
@@ -2694,10 +2730,25 @@ rspamd_open_zstd_dictionary(const char *path)
 		return nullptr;
 	}
 
-	dict->id = -1;
+	/* Raw content dictionaries have no id and cannot be announced to peers */
+	dict->id = ZSTD_getDictID_fromDict(dict->dict, dict->size);
 
 	if (dict->id == 0) {
-		g_free(dict);
+		rspamd_free_zstd_dictionary(dict);
+
+		return nullptr;
+	}
+
+	/* Dictionary is digested once and then referenced by all streams */
+	if (for_compression) {
+		dict->cdict = ZSTD_createCDict(dict->dict, dict->size, 1);
+	}
+	else {
+		dict->ddict = ZSTD_createDDict(dict->dict, dict->size);
+	}
+
+	if (dict->cdict == nullptr && dict->ddict == nullptr) {
+		rspamd_free_zstd_dictionary(dict);
 
 		return nullptr;
 	}
@@ -2709,6 +2760,14 @@ static void
 rspamd_free_zstd_dictionary(struct zstd_dictionary *dict)
 {
 	if (dict) {
+		if (dict->cdict) {
+			ZSTD_freeCDict((ZSTD_CDict *) dict->cdict);
+		}
+
+		if (dict->ddict) {
+			ZSTD_freeDDict((ZSTD_DDict *) dict->ddict);
+		}
+
 		munmap(dict->dict, dict->size);
 		g_free(dict);
 	}
@@ -2749,6 +2808,8 @@ rspamd_config_libs(struct rspamd_external_libs_ctx *ctx,
 
 		rspamd_free_zstd_dictionary(ctx->in_dict);
 		rspamd_free_zstd_dictionary(ctx->out_dict);
+		ctx->in_dict = nullptr;
+		ctx->out_dict = nullptr;
 
 		if (ctx->out_zstream) {
 			ZSTD_freeCStream((ZSTD_CCtx *) ctx->out_zstream);
@@ -2762,7 +2823,7 @@ rspamd_config_libs(struct rspamd_external_libs_ctx *ctx,
 
 		if (cfg->zstd_input_dictionary) {
 			ctx->in_dict = rspamd_open_zstd_dictionary(
-				cfg->zstd_input_dictionary);
+				cfg->zstd_input_dictionary, false);
 
 			if (ctx->in_dict == nullptr) {
 				msg_err_config("cannot open zstd dictionary in %s",
@@ -2771,7 +2832,7 @@ rspamd_config_libs(struct rspamd_external_libs_ctx *ctx,
 		}
 		if (cfg->zstd_output_dictionary) {
 			ctx->out_dict = rspamd_open_zstd_dictionary(
-				cfg->zstd_output_dictionary);
+				cfg->zstd_output_dictionary, true);
 
 			if (ctx->out_dict == nullptr) {
 				msg_err_config("cannot open zstd dictionary in %s",
@@ -2828,6 +2889,16 @@ rspamd_config_libs(struct rspamd_external_libs_ctx *ctx,
 			ZSTD_freeDStream((ZSTD_DCtx *) ctx->in_zstream);
 			ctx->in_zstream = nullptr;
 		}
+		else if (ctx->in_dict) {
+			/* Session resets keep the referenced dictionary */
+			r = ZSTD_DCtx_refDDict((ZSTD_DCtx *) ctx->in_zstream,
+								   (const ZSTD_DDict *) ctx->in_dict->ddict);
+
+			if (ZSTD_isError(r)) {
+				msg_err("cannot load decompression dictionary: %s",
+						ZSTD_getErrorName(r));
+			}
+		}
 
 		/* Init compression */
 		ctx->out_zstream = ZSTD_createCStream();
@@ -2839,6 +2910,15 @@ rspamd_config_libs(struct rspamd_external_libs_ctx *ctx,
 			ZSTD_freeCStream((ZSTD_CCtx *) ctx->out_zstream);
 			ctx->out_zstream = nullptr;
 		}
+		else if (ctx->out_dict) {
+			r = ZSTD_CCtx_refCDict((ZSTD_CCtx *) ctx->out_zstream,
+								   (const ZSTD_CDict *) ctx->out_dict->cdict);
+
+			if (ZSTD_isError(r)) {
+				msg_err("cannot load compression dictionary: %s",
+						ZSTD_getErrorName(r));
+			}
+		}
 #ifdef HAVE_OPENBLAS_SET_NUM_THREADS
 		openblas_set_num_threads(cfg->max_blas_threads);
 #endif
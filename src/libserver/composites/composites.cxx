@@ -22,6 +22,7 @@
 #include "composites.h"
 
 #include <cmath>
+#include <algorithm>
 #include <vector>
 #include <variant>
 #include "libutil/cxx/util.hxx"
@@ -210,6 +211,7 @@ struct rspamd_composite_atom {
 	rspamd_composite_atom_type comp_type = rspamd_composite_atom_type::ATOM_UNKNOWN;
 	const struct rspamd_composite *ncomp; /* underlying composite */
 	std::vector<rspamd_composite_option_match> opts;
+	int sym_id = -2; /* symcache id of the symbol, -1 if none, -2 if not resolved yet */
 };
 
 enum rspamd_composite_action : std::uint8_t {
@@ -566,9 +568,176 @@ process_symbol_removal(rspamd_expression_atom_t *atom,
 	}
 }
 
+static auto
+symbol_id_from_def(struct rspamd_symbol *sdef) -> int
+{
+	if (sdef && sdef->cache_item) {
+		return rspamd_symcache_item_id((struct rspamd_symcache_item *) sdef->cache_item);
+	}
+
+	return -1;
+}
+
+static auto
+atom_symbol_id(struct rspamd_task *task, struct rspamd_composite_atom *atom) -> int
+{
+	if (atom->sym_id == -2) {
+		atom->sym_id = symbol_id_from_def((struct rspamd_symbol *) g_hash_table_lookup(task->cfg->symbols,
+																					  atom->norm_symbol.data()));
+	}
+
+	return atom->sym_id;
+}
+
+/* Results are indexed by symcache id, so avoid hashing of names when it is known */
+static inline auto
+find_symbol_result(struct composites_data *cd, std::string_view sym, int sym_id) -> struct rspamd_symbol_result *
+{
+	if (sym_id >= 0 && sym_id < (int) cd->metric_res->nsymbols_by_id) {
+		return rspamd_task_find_symbol_result_by_id(cd->task, sym_id, cd->metric_res);
+	}
+
+	return rspamd_task_find_symbol_result(cd->task, sym.data(), cd->metric_res);
+}
+
+struct composite_deps_data {
+	struct rspamd_task *task;
+	std::vector<int> deps;
+	bool always_check;
+};
+
+static auto composite_prepare_deps(struct rspamd_task *task, const rspamd_composite *comp) -> void;
+
+static auto
+composite_deps_add_symbol(composite_deps_data *dd, struct rspamd_symbol *sdef) -> void
+{
+	auto id = symbol_id_from_def(sdef);
+
+	if (id >= 0) {
+		dd->deps.push_back(id);
+	}
+	else {
+		/* Results of such symbols are not indexed */
+		dd->always_check = true;
+	}
+}
+
+static auto
+composite_deps_atom_cb(gpointer ud, rspamd_expression_atom_t *atom) -> double
+{
+	auto *dd = (composite_deps_data *) ud;
+	auto *comp_atom = (struct rspamd_composite_atom *) atom->data;
+	auto *cfg = dd->task->cfg;
+	auto sym = comp_atom->norm_symbol;
+	auto group_prefix = 0;
+
+	if (sym.size() > 2) {
+		if (sym.substr(0, 2) == "g:") {
+			group_prefix = 2;
+		}
+		else if (sym.substr(0, 3) == "g+:" || sym.substr(0, 3) == "g-:") {
+			group_prefix = 3;
+		}
+	}
+
+	if (group_prefix > 0) {
+		auto *gr = (struct rspamd_symbols_group *) g_hash_table_lookup(cfg->groups,
+																	   sym.substr(group_prefix).data());
+
+		if (gr != nullptr) {
+			GHashTableIter it;
+			gpointer k, v;
+
+			g_hash_table_iter_init(&it, gr->symbols);
+
+			while (g_hash_table_iter_next(&it, &k, &v)) {
+				composite_deps_add_symbol(dd, (struct rspamd_symbol *) v);
+			}
+		}
+
+		return 0;
+	}
+
+	auto *sdef = (struct rspamd_symbol *) g_hash_table_lookup(cfg->symbols, sym.data());
+	const auto *ncomp = COMPOSITE_MANAGER_FROM_PTR(cfg->composites_manager)->find(sym);
+
+	if (sdef) {
+		composite_deps_add_symbol(dd, sdef);
+	}
+
+	if (ncomp) {
+		/* Nested composite is evaluated on demand, so its deps are ours */
+		composite_prepare_deps(dd->task, ncomp);
+
+		if (ncomp->deps_state != rspamd_composite_deps_state::ready || ncomp->always_check) {
+			dd->always_check = true;
+		}
+		else {
+			dd->deps.insert(dd->deps.end(), ncomp->deps.begin(), ncomp->deps.end());
+		}
+	}
+	else if (!sdef) {
+		/* Can be inserted with no definition */
+		dd->always_check = true;
+	}
+
+	return 0;
+}
+
+static auto
+composite_prepare_deps(struct rspamd_task *task, const rspamd_composite *comp) -> void
+{
+	/* A composite that is being computed is a cyclic reference, caller handles it */
+	if (comp->deps_state != rspamd_composite_deps_state::unknown) {
+		return;
+	}
+
+	comp->deps_state = rspamd_composite_deps_state::computing;
+
+	composite_deps_data dd{task, {}, false};
+	/* All atoms are visited with no short circuit, each of them is zero */
+	auto rc = rspamd_process_expression_closure(comp->expr, composite_deps_atom_cb,
+												RSPAMD_EXPRESSION_FLAG_NOOPT, &dd, nullptr);
+
+	if (fabs(rc) > epsilon) {
+		/* True when nothing matches, e.g. `!A` */
+		dd.always_check = true;
+	}
+
+	std::sort(dd.deps.begin(), dd.deps.end());
+	dd.deps.erase(std::unique(dd.deps.begin(), dd.deps.end()), dd.deps.end());
+	comp->deps = std::move(dd.deps);
+	comp->always_check = dd.always_check;
+	comp->deps_state = rspamd_composite_deps_state::ready;
+}
+
+/*
+ * Returns false if none of symbols that can make a composite true are in the
+ * result, so an expression evaluates to zero anyway
+ */
+static auto
+composite_may_match(struct composites_data *cd, const rspamd_composite *comp) -> bool
+{
+	composite_prepare_deps(cd->task, comp);
+
+	if (comp->deps_state != rspamd_composite_deps_state::ready || comp->always_check) {
+		return true;
+	}
+
+	for (auto id: comp->deps) {
+		if (id >= (int) cd->metric_res->nsymbols_by_id ||
+			cd->metric_res->symbols_by_id[id] != nullptr) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static auto
 process_single_symbol(struct composites_data *cd,
 					  std::string_view sym,
+					  int sym_id,
 					  struct rspamd_symbol_result **pms,
 					  struct rspamd_composite_atom *atom) -> double
 {
@@ -576,7 +745,7 @@ process_single_symbol(struct composites_data *cd,
 	double rc = 0;
 	struct rspamd_task *task = cd->task;
 
-	if ((ms = rspamd_task_find_symbol_result(cd->task, sym.data(), cd->metric_res)) == nullptr) {
+	if ((ms = find_symbol_result(cd, sym, sym_id)) == nullptr) {
 		msg_debug_composites("not found symbol %s in composite %s", sym.data(),
 							 cd->composite->sym.c_str());
 
@@ -608,16 +777,14 @@ process_single_symbol(struct composites_data *cd,
 				cd->composite = saved;
 				cd->checked[cd->composite->id * 2] = false;
 
-				ms = rspamd_task_find_symbol_result(cd->task, sym.data(),
-													cd->metric_res);
+				ms = find_symbol_result(cd, sym, sym_id);
 			}
 			else {
 				/*
 				 * XXX: in case of cyclic references this would return 0
 				 */
 				if (cd->checked[atom->ncomp->id * 2 + 1]) {
-					ms = rspamd_task_find_symbol_result(cd->task, sym.data(),
-														cd->metric_res);
+					ms = find_symbol_result(cd, sym, sym_id);
 				}
 			}
 		}
@@ -679,9 +846,8 @@ rspamd_composite_expr_process(void *ud, rspamd_expression_atom_t *atom) -> doubl
 	if (cd->checked[cd->composite->id * 2]) {
 		/* We have already checked this composite, so just return its value */
 		if (cd->checked[cd->composite->id * 2 + 1]) {
-			ms = rspamd_task_find_symbol_result(cd->task,
-												comp_atom->norm_symbol.data(),
-												cd->metric_res);
+			ms = find_symbol_result(cd, comp_atom->norm_symbol,
+									atom_symbol_id(task, comp_atom));
 		}
 
 		if (ms) {
@@ -720,6 +886,7 @@ rspamd_composite_expr_process(void *ud, rspamd_expression_atom_t *atom) -> doubl
 				if (cond(sdef->score)) {
 					rc = process_single_symbol(cd,
 											   std::string_view(sdef->name),
+											   symbol_id_from_def(sdef),
 											   &ms,
 											   comp_atom);
 
@@ -752,7 +919,7 @@ rspamd_composite_expr_process(void *ud, rspamd_expression_atom_t *atom) -> doubl
 			rc = group_process_functor([](auto sc) { return sc < 0.; }, 3);
 		}
 		else {
-			rc = process_single_symbol(cd, sym, &ms, comp_atom);
+			rc = process_single_symbol(cd, sym, atom_symbol_id(task, comp_atom), &ms, comp_atom);
 
 			if (fabs(rc) > epsilon) {
 				process_symbol_removal(atom,
@@ -763,7 +930,7 @@ rspamd_composite_expr_process(void *ud, rspamd_expression_atom_t *atom) -> doubl
 		}
 	}
 	else {
-		rc = process_single_symbol(cd, sym, &ms, comp_atom);
+		rc = process_single_symbol(cd, sym, atom_symbol_id(task, comp_atom), &ms, comp_atom);
 
 		if (fabs(rc) > epsilon) {
 			process_symbol_removal(atom,
@@ -832,6 +999,16 @@ composites_foreach_callback(gpointer key, gpointer value, void *data)
 				return;
 			}
 
+			if (!composite_may_match(cd, comp)) {
+				msg_debug_composites("%s: skip composite %s as none of its symbols are found",
+									 cd->metric_res->name,
+									 cd->composite->sym.c_str());
+				cd->checked[comp->id * 2] = true;
+				cd->checked[comp->id * 2 + 1] = false;
+
+				return;
+			}
+
 			msg_debug_composites("%s: start processing composite %s",
 								 cd->metric_res->name,
 								 cd->composite->sym.c_str());
@@ -978,9 +1155,100 @@ composites_metric_callback(struct rspamd_task *task)
 	}
 }
 
+struct composite_potential_data {
+	struct rspamd_config *cfg;
+	ankerl::unordered_dense::set<const struct rspamd_symbol *> seen;
+	double pos;
+	double neg;
+};
+
+static auto
+composite_potential_add_symbol(composite_potential_data *pd, const struct rspamd_symbol *sdef) -> void
+{
+	/* A symbol is removed once, whatever number of composites include it */
+	if (!pd->seen.insert(sdef).second) {
+		return;
+	}
+
+	auto w = sdef->weight_ptr ? *sdef->weight_ptr : sdef->score;
+
+	if (w > 0) {
+		pd->neg += w;
+	}
+	else {
+		pd->pos -= w;
+	}
+}
+
+static auto
+composite_potential_atom_cb(gpointer ud, rspamd_expression_atom_t *atom) -> double
+{
+	auto *pd = (composite_potential_data *) ud;
+	auto *comp_atom = (struct rspamd_composite_atom *) atom->data;
+	auto sym = comp_atom->norm_symbol;
+	auto group_prefix = 0;
+
+	if (sym.size() > 2) {
+		if (sym.substr(0, 2) == "g:") {
+			group_prefix = 2;
+		}
+		else if (sym.substr(0, 3) == "g+:" || sym.substr(0, 3) == "g-:") {
+			group_prefix = 3;
+		}
+	}
+
+	if (group_prefix > 0) {
+		auto *gr = (struct rspamd_symbols_group *) g_hash_table_lookup(pd->cfg->groups,
+																	   sym.substr(group_prefix).data());
+
+		if (gr != nullptr) {
+			GHashTableIter it;
+			gpointer k, v;
+
+			g_hash_table_iter_init(&it, gr->symbols);
+
+			while (g_hash_table_iter_next(&it, &k, &v)) {
+				composite_potential_add_symbol(pd, (struct rspamd_symbol *) v);
+			}
+		}
+
+		return 0;
+	}
+
+	auto *sdef = (struct rspamd_symbol *) g_hash_table_lookup(pd->cfg->symbols, sym.data());
+
+	if (sdef) {
+		composite_potential_add_symbol(pd, sdef);
+	}
+
+	return 0;
+}
+
 }// namespace rspamd::composites
 
 
+void rspamd_composites_removal_potential(struct rspamd_config *cfg,
+										 double *pos, double *neg)
+{
+	rspamd::composites::composite_potential_data pd{cfg, {}, 0.0, 0.0};
+
+	if (cfg->composites_manager) {
+		for (const auto &comp: COMPOSITE_MANAGER_FROM_PTR(cfg->composites_manager)->get_all()) {
+			if (comp->policy == rspamd::composites::rspamd_composite_policy::RSPAMD_COMPOSITE_POLICY_LEAVE) {
+				continue;
+			}
+
+			/* All atoms are visited with no short circuit */
+			rspamd_process_expression_closure(comp->expr,
+											  rspamd::composites::composite_potential_atom_cb,
+											  RSPAMD_EXPRESSION_FLAG_NOOPT, &pd, nullptr);
+		}
+	}
+
+	*pos = pd.pos;
+	*neg = pd.neg;
+}
+
 void rspamd_composites_process_task(struct rspamd_task *task)
 {
 	if (task->result && !RSPAMD_TASK_IS_SKIPPED(task)) {
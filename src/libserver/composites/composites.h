@@ -32,6 +32,15 @@ struct rspamd_config;
  */
 void rspamd_composites_process_task(struct rspamd_task *task);
 
+/**
+ * Returns the maximum score change caused by removal of composites atoms:
+ * removal of negative weights can raise the score by `pos` at most and
+ * removal of positive weights can lower it by `neg` at most
+ * @param cfg
+ */
+void rspamd_composites_removal_potential(struct rspamd_config *cfg,
+										 double *pos, double *neg);
+
 /**
  * Creates a composites manager
  * @param cfg
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "libutil/expression.h"
 #include "libutil/cxx/hash_util.hxx"
 #include "libserver/cfg_file.h"
@@ -38,6 +39,12 @@ enum class rspamd_composite_policy {
 	RSPAMD_COMPOSITE_POLICY_UNKNOWN
 };
 
+enum class rspamd_composite_deps_state {
+	unknown = 0,
+	computing,
+	ready,
+};
+
 /**
  * Static composites structure
  */
@@ -47,6 +54,14 @@ struct rspamd_composite {
 	struct rspamd_expression *expr;
 	int id;
 	rspamd_composite_policy policy;
+	/*
+	 * Sorted symcache ids of symbols that can make this composite true, computed
+	 * on the first use as symbols are not known when composites are parsed
+	 */
+	mutable std::vector<int> deps;
+	/* Composite must be evaluated regardless of deps */
+	mutable bool always_check = true;
+	mutable rspamd_composite_deps_state deps_state = rspamd_composite_deps_state::unknown;
 };
 
 #define COMPOSITE_MANAGER_FROM_PTR(ptr) (reinterpret_cast<rspamd::composites::composites_manager *>(ptr))
@@ -64,6 +79,11 @@ public:
 		return all_composites.size();
 	}
 
+	auto get_all() const -> const std::vector<std::shared_ptr<rspamd_composite>> &
+	{
+		return all_composites;
+	}
+
 	auto find(std::string_view name) const -> const rspamd_composite *
 	{
 		auto found = composites.find(std::string(name));
@@ -19,6 +19,11 @@
 #include "css_parser.hxx"
 #include "libserver/html/html_tag.hxx"
 #include "libserver/html/html_block.hxx"
+#include "libcryptobox/cryptobox.h"
+#include "fmt/core.h"
+
+#include <list>
+#include <mutex>
 
 /* Keep unit tests implementation here (it'll possibly be moved outside one day) */
 #define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
@@ -105,7 +110,8 @@ auto css_style_sheet::add_selector_rule(std::unique_ptr<css_selector> &&selector
 	}
 }
 
-auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspamd::html::html_block *
+auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag,
+									  rspamd_mempool_t *task_pool) -> rspamd::html::html_block *
 {
 	std::optional<std::string_view> id_comp, class_comp;
 	rspamd::html::html_block *res = nullptr;
@@ -130,7 +136,7 @@ auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspa
 
 		if (found_id_sel != pimpl->id_selectors.end()) {
 			const auto &decl = *(found_id_sel->second);
-			res = decl.compile_to_block(pool);
+			res = decl.compile_to_block(task_pool);
 		}
 	}
 
@@ -164,7 +170,7 @@ auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspa
 
 			if (found_class_sel != pimpl->class_selectors.end()) {
 				const auto &decl = *(found_class_sel->second);
-				auto *tmp = decl.compile_to_block(pool);
+				auto *tmp = decl.compile_to_block(task_pool);
 
 				if (res == nullptr) {
 					res = tmp;
@@ -183,7 +189,7 @@ auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspa
 
 		if (found_tag_sel != pimpl->tags_selector.end()) {
 			const auto &decl = *(found_tag_sel->second);
-			auto *tmp = decl.compile_to_block(pool);
+			auto *tmp = decl.compile_to_block(task_pool);
 
 			if (res == nullptr) {
 				res = tmp;
@@ -196,7 +202,7 @@ auto css_style_sheet::check_tag_block(const rspamd::html::html_tag *tag) -> rspa
 
 	/* Finally, universal selector */
 	if (pimpl->universal_selector) {
-		auto *tmp = pimpl->universal_selector->second->compile_to_block(pool);
+		auto *tmp = pimpl->universal_selector->second->compile_to_block(task_pool);
 
 		if (res == nullptr) {
 			res = tmp;
@@ -224,4 +230,126 @@ auto css_parse_style(rspamd_mempool_t *pool,
 	return std::make_pair(nullptr, parse_res.error());
 }
 
+/*
+ * Cached sheets live in their own pools, as selectors refer to the parsed
+ * input; a holder owns both and is kept alive by all shared pointers
+ */
+struct css_cached_sheet {
+	std::shared_ptr<css_style_sheet> sheet;
+	rspamd_mempool_t *pool;
+
+	css_cached_sheet()
+		: pool(rspamd_mempool_new(rspamd_mempool_suggest_size(), "css", 0))
+	{
+	}
+
+	~css_cached_sheet()
+	{
+		sheet.reset();
+		rspamd_mempool_delete(pool);
+	}
+};
+
+class css_sheets_cache {
+	struct cache_elt {
+		std::shared_ptr<css_cached_sheet> holder;
+		std::size_t size;
+		std::list<std::uint64_t>::iterator lru_it;
+	};
+
+	ankerl::unordered_dense::map<std::uint64_t, cache_elt> sheets;
+	std::list<std::uint64_t> lru; /* Most recent first */
+	std::size_t used = 0;
+	std::mutex mtx;
+
+	auto evict(std::size_t max_size) -> void
+	{
+		while (used > max_size && !lru.empty()) {
+			auto found = sheets.find(lru.back());
+			used -= found->second.size;
+			sheets.erase(found);
+			lru.pop_back();
+		}
+	}
+
+public:
+	auto lookup(std::uint64_t key) -> std::shared_ptr<css_cached_sheet>
+	{
+		std::lock_guard<std::mutex> lk{mtx};
+		auto found = sheets.find(key);
+
+		if (found == sheets.end()) {
+			return nullptr;
+		}
+
+		lru.splice(lru.begin(), lru, found->second.lru_it);
+
+		return found->second.holder;
+	}
+
+	auto insert(std::uint64_t key, std::shared_ptr<css_cached_sheet> holder,
+				std::size_t size, std::size_t max_size) -> void
+	{
+		std::lock_guard<std::mutex> lk{mtx};
+
+		if (size > max_size || sheets.contains(key)) {
+			return;
+		}
+
+		lru.push_front(key);
+		sheets.emplace(key, cache_elt{std::move(holder), size, lru.begin()});
+		used += size;
+		evict(max_size);
+	}
+};
+
+auto css_parse_cached(rspamd_mempool_t *pool,
+					  const std::vector<std::string_view> &blocks,
+					  std::size_t max_size) -> std::shared_ptr<css_style_sheet>
+{
+	static css_sheets_cache cache;
+	std::uint64_t key = 0;
+	std::size_t input_len = 0;
+
+	for (const auto &block: blocks) {
+		key = rspamd_cryptobox_fast_hash(block.data(), block.size(), key ^ block.size());
+		input_len += block.size();
+	}
+
+	auto holder = cache.lookup(key);
+
+	if (!holder) {
+		holder = std::make_shared<css_cached_sheet>();
+
+		for (const auto &block: blocks) {
+			auto ret_maybe = parse_css(holder->pool, block, std::move(holder->sheet));
+
+			if (!ret_maybe.has_value()) {
+				if (ret_maybe.error().is_fatal()) {
+					auto err_str = fmt::format(
+						"cannot parse css (error code: {}): {}",
+						static_cast<int>(ret_maybe.error().type),
+						ret_maybe.error().description.value_or("unknown error"));
+					msg_info_pool("%*s", (int) err_str.size(), err_str.data());
+				}
+			}
+			else {
+				holder->sheet = ret_maybe.value();
+			}
+		}
+
+		/* Parsed rules are kept in the heap, so count the input twice */
+		cache.insert(key, holder,
+					 rspamd_mempool_get_used_size(holder->pool) + input_len * 2,
+					 max_size);
+	}
+
+	if (!holder->sheet) {
+		return nullptr;
+	}
+
+	/* Share ownership of the holder, so its pool outlives the sheet users */
+	return std::shared_ptr<css_style_sheet>(holder, holder->sheet.get());
+}
+
 }// namespace rspamd::css
\ No newline at end of file
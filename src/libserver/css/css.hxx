@@ -20,6 +20,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 #include "logger.h"
 #include "css_rule.hxx"
 #include "css_selector.hxx"
@@ -50,7 +51,12 @@ public:
 	auto add_selector_rule(std::unique_ptr<css_selector> &&selector,
 						   css_declarations_block_ptr decls) -> void;
 
-	auto check_tag_block(const rspamd::html::html_tag *tag) -> rspamd::html::html_block *;
+	/*
+	 * Returns a block for a tag allocated in the specified pool, the sheet
+	 * itself is not modified, so it could be shared between tasks
+	 */
+	auto check_tag_block(const rspamd::html::html_tag *tag,
+						 rspamd_mempool_t *task_pool) -> rspamd::html::html_block *;
 
 private:
 	class impl;
@@ -63,6 +69,16 @@ auto css_parse_style(rspamd_mempool_t *pool,
 					 std::string_view input,
 					 std::shared_ptr<css_style_sheet> &&existing) -> css_return_pair;
 
+/*
+ * Returns a stylesheet equal to the result of parsing all `blocks` in order,
+ * parsed sheets are kept in a process wide LRU cache limited by `max_size`
+ * bytes and keyed by the hash of blocks, so they are immutable and shared.
+ * Returns nullptr if there are no rules.
+ */
+auto css_parse_cached(rspamd_mempool_t *pool,
+					  const std::vector<std::string_view> &blocks,
+					  std::size_t max_size) -> std::shared_ptr<css_style_sheet>;
+
 }// namespace rspamd::css
 
 #endif//RSPAMD_CSS_H
\ No newline at end of file
@@ -888,5 +888,32 @@ TEST_SUITE("css")
 
 		rspamd_mempool_delete(pool);
 	}
+
+	TEST_CASE("cached css parse")
+	{
+		auto *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
+										"css", 0);
+		const std::vector<std::string_view> blocks{
+			"p { color: rgb(100%, 50%, 0%); display: none; }",
+			".cls { font-size: 0px; }",
+		};
+
+		auto first = css_parse_cached(pool, blocks, 1024 * 1024);
+		REQUIRE(first.get() != nullptr);
+		auto second = css_parse_cached(pool, blocks, 1024 * 1024);
+		CHECK(first.get() == second.get());
+
+		/* A different set of blocks is parsed separately */
+		auto other = css_parse_cached(pool, {blocks[0]}, 1024 * 1024);
+		REQUIRE(other.get() != nullptr);
+		CHECK(other.get() != first.get());
+
+		/* Nothing is cached if a sheet does not fit */
+		auto uncached = css_parse_cached(pool, {blocks[1]}, 1);
+		REQUIRE(uncached.get() != nullptr);
+		CHECK(css_parse_cached(pool, {blocks[1]}, 1).get() != uncached.get());
+
+		rspamd_mempool_delete(pool);
+	}
 }
 }// namespace rspamd::css
@@ -26,6 +26,12 @@
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
 
+#ifdef __x86_64__
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /* special DNS tokens */
 #define DKIM_DNSKEYNAME "_domainkey"
 
@@ -1790,173 +1796,196 @@ rspamd_get_dkim_key(rspamd_dkim_context_t *ctx,
 												   ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step(struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
-							  const char **start, unsigned int size,
-							  gssize *remain)
+/* Canonicalised body is hashed by blocks of this size */
+#define DKIM_CANON_BUF_SIZE 16384
+
+struct rspamd_dkim_canon_out {
+	EVP_MD_CTX *ck;
+	gssize remain; /* octets allowed by l= tag */
+	gsize total;
+	gsize len;
+	char buf[DKIM_CANON_BUF_SIZE];
+};
+
+static inline gboolean
+rspamd_dkim_canon_special(unsigned char c, gboolean relaxed)
 {
-	const char *h;
-	char *t;
-	unsigned int len, inlen;
-	gssize octets_remain;
-	gboolean got_sp, ret = TRUE;
-	char buf[1024];
-
-	len = size;
-	inlen = sizeof(buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
-	octets_remain = *remain;
+	if (relaxed) {
+		/* Space or any of \t, \n, \v, \f, \r as g_ascii_isspace does */
+		return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+	}
 
-	while (len > 0 && inlen > 0 && (octets_remain > 0)) {
+	return c == '\r' || c == '\n';
+}
 
-		if (*h == '\r' || *h == '\n') {
-			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t--;
-			}
-			*t++ = '\r';
-			*t++ = '\n';
+/*
+ * Returns the first position in [p, end) that is not copied to the
+ * canonicalised body as is: line endings and, for relaxed mode, whitespaces
+ */
+static inline const char *
+rspamd_dkim_canon_scan(const char *p, const char *end, gboolean relaxed)
+{
+#ifdef __x86_64__
+	const __m128i vcr = _mm_set1_epi8('\r'), vlf = _mm_set1_epi8('\n'),
+				  vsp = _mm_set1_epi8(' '), vtab = _mm_set1_epi8('\t'),
+				  vrange = _mm_set1_epi8('\r' - '\t');
 
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-				octets_remain -= 2;
-			}
-			else {
-				h++;
-				len--;
-				if (octets_remain >= 2) {
-					octets_remain -= 2; /* Input has just \n or \r so we actually add more octets */
-				}
-				else {
-					octets_remain--;
-					break;
-				}
-			}
-			break;
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p), m;
+		unsigned int mask;
+
+		if (relaxed) {
+			__m128i d = _mm_sub_epi8(v, vtab);
+
+			/* Unsigned d <= range */
+			m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(d, vrange), d),
+							 _mm_cmpeq_epi8(v, vsp));
 		}
-		else if (g_ascii_isspace(*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				octets_remain--;
-				got_sp = TRUE;
-				continue;
-			}
+		else {
+			m = _mm_or_si128(_mm_cmpeq_epi8(v, vcr), _mm_cmpeq_epi8(v, vlf));
+		}
+
+		mask = _mm_movemask_epi8(m);
+
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+
+		p += 16;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t vcr = vdupq_n_u8('\r'), vlf = vdupq_n_u8('\n'),
+					 vsp = vdupq_n_u8(' '), vtab = vdupq_n_u8('\t'),
+					 vrange = vdupq_n_u8('\r' - '\t');
+
+	while (end - p >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) p), m;
+
+		if (relaxed) {
+			m = vorrq_u8(vcleq_u8(vsubq_u8(v, vtab), vrange), vceqq_u8(v, vsp));
 		}
 		else {
-			got_sp = FALSE;
+			m = vorrq_u8(vceqq_u8(v, vcr), vceqq_u8(v, vlf));
 		}
 
-		*t++ = *h++;
-		inlen--;
-		len--;
-		octets_remain--;
+		if (vmaxvq_u8(m) != 0) {
+			break;
+		}
+
+		p += 16;
 	}
+#endif
 
-	if (octets_remain < 0) {
-		/* Absurdic l tag value, but we still need to rewind the t pointer back */
-		while (t > buf && octets_remain < 0) {
-			t--;
-			octets_remain++;
+	while (p < end) {
+		if (rspamd_dkim_canon_special(*p, relaxed)) {
+			return p;
 		}
+		p++;
+	}
 
-		ret = FALSE;
+	return end;
+}
+
+static inline void
+rspamd_dkim_canon_flush(struct rspamd_dkim_canon_out *out)
+{
+	if (out->len > 0) {
+		EVP_DigestUpdate(out->ck, out->buf, out->len);
+		out->total += out->len;
+		out->len = 0;
 	}
+}
 
-	*start = h;
+static inline void
+rspamd_dkim_canon_emit(struct rspamd_dkim_canon_out *out, const char *src, gsize n)
+{
+	if ((gssize) n > out->remain) {
+		n = out->remain;
+	}
 
-	if (t - buf > 0) {
-		gsize cklen = t - buf;
+	out->remain -= n;
 
-		EVP_DigestUpdate(ck, buf, cklen);
-		ctx->body_canonicalised += cklen;
-		msg_debug_dkim("relaxed update signature with body buffer "
-					   "(%z size, %z -> %z remain)",
-					   cklen, *remain, octets_remain);
-		*remain = octets_remain;
+	if (n >= sizeof(out->buf) / 2) {
+		/* Long runs are hashed directly from the message */
+		rspamd_dkim_canon_flush(out);
+		EVP_DigestUpdate(out->ck, src, n);
+		out->total += n;
 	}
+	else {
+		if (out->len + n > sizeof(out->buf)) {
+			rspamd_dkim_canon_flush(out);
+		}
 
-	return ret && ((len > 0) && (octets_remain > 0));
+		memcpy(out->buf + out->len, src, n);
+		out->len += n;
+	}
 }
 
-static gboolean
-rspamd_dkim_simple_body_step(struct rspamd_dkim_common_ctx *ctx,
-							 EVP_MD_CTX *ck, const char **start, unsigned int size,
-							 gssize *remain)
+/*
+ * Canonicalises [*start, end) and updates hash in a single pass: runs of
+ * plain characters are found by vector compares and copied (or hashed) as a
+ * whole, line endings are converted to CRLF, and in relaxed mode whitespaces
+ * runs are folded to a single space and dropped at the end of line.
+ * At most `*remain` octets are hashed.
+ */
+static void
+rspamd_dkim_canon_body_run(struct rspamd_dkim_common_ctx *ctx, EVP_MD_CTX *ck,
+						   const char **start, const char *end,
+						   gssize *remain, gboolean relaxed)
 {
-	const char *h;
-	char *t;
-	unsigned int len, inlen;
-	gssize octets_remain;
-	char buf[1024];
-
-	len = size;
-	inlen = sizeof(buf) - 1;
-	h = *start;
-	t = &buf[0];
-	octets_remain = *remain;
-
-	while (len > 0 && inlen > 0 && (octets_remain != 0)) {
-		if (*h == '\r' || *h == '\n') {
-			*t++ = '\r';
-			*t++ = '\n';
-
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-
-				if (octets_remain >= 2) {
-					octets_remain -= 2; /* Input has just \n or \r so we actually add more octets */
-				}
-				else {
-					octets_remain--;
-				}
-			}
-			else {
-				h++;
-				len--;
+	struct rspamd_dkim_canon_out out;
+	const char *p = *start, *c;
+	gboolean pending_sp = FALSE;
 
-				if (octets_remain >= 2) {
-					octets_remain -= 2; /* Input has just \n or \r so we actually add more octets */
-				}
-				else {
-					octets_remain--;
-				}
+	out.ck = ck;
+	out.remain = *remain;
+	out.total = 0;
+	out.len = 0;
+
+	while (p < end && out.remain > 0) {
+		c = rspamd_dkim_canon_scan(p, end, relaxed);
+
+		if (c > p) {
+			if (pending_sp) {
+				rspamd_dkim_canon_emit(&out, " ", 1);
+				pending_sp = FALSE;
 			}
-			break;
-		}
 
-		*t++ = *h++;
-		octets_remain--;
-		inlen--;
-		len--;
-	}
+			rspamd_dkim_canon_emit(&out, p, c - p);
+			p = c;
+		}
+		else if (*p == '\r' || *p == '\n') {
+			/* Ignore spaces at the end of line */
+			pending_sp = FALSE;
 
-	*start = h;
+			if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+				p += 2;
+			}
+			else {
+				p++;
+			}
 
-	if (t - buf > 0) {
-		gsize cklen = t - buf;
+			rspamd_dkim_canon_emit(&out, CRLF, sizeof(CRLF) - 1);
+		}
+		else {
+			/* Ignore multiple spaces */
+			pending_sp = TRUE;
+			p++;
+		}
+	}
 
-		EVP_DigestUpdate(ck, buf, cklen);
-		ctx->body_canonicalised += cklen;
-		msg_debug_dkim("simple update signature with body buffer "
-					   "(%z size, %z -> %z remain)",
-					   cklen, *remain, octets_remain);
-		*remain = octets_remain;
+	if (pending_sp && out.remain > 0) {
+		rspamd_dkim_canon_emit(&out, " ", 1);
 	}
 
-	return ((len != 0) && (octets_remain != 0));
+	rspamd_dkim_canon_flush(&out);
+	ctx->body_canonicalised += out.total;
+	msg_debug_dkim("%s update signature with body buffer "
+				   "(%z size, %z -> %z remain)",
+				   relaxed ? "relaxed" : "simple",
+				   out.total, *remain, out.remain);
+	*start = p;
+	*remain = out.remain;
 }
 
 static const char *
@@ -2182,9 +2211,8 @@ rspamd_dkim_canonize_body(struct rspamd_task *task,
 		else {
 			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
 				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step(ctx, ctx->body_hash,
-													&start, end - start, &remain))
-					;
+				rspamd_dkim_canon_body_run(ctx, ctx->body_hash,
+										   &start, end, &remain, FALSE);
 
 				/*
 				 * If we have l= tag then we cannot add crlf...
@@ -2212,16 +2240,15 @@ rspamd_dkim_canonize_body(struct rspamd_task *task,
 					start = "\r\n";
 					end = start + 2;
 
-					rspamd_dkim_simple_body_step(ctx, ctx->body_hash,
-												 &start, end - start, &remain);
+					rspamd_dkim_canon_body_run(ctx, ctx->body_hash,
+											   &start, end, &remain, FALSE);
 				}
 			}
 			else {
 				size_t orig_len = remain;
 
-				while (rspamd_dkim_relaxed_body_step(ctx, ctx->body_hash,
-													 &start, end - start, &remain))
-					;
+				rspamd_dkim_canon_body_run(ctx, ctx->body_hash,
+										   &start, end, &remain, TRUE);
 
 				if (ctx->len > 0 && remain > (double) orig_len * 0.1) {
 					msg_info_task("DKIM l tag does not cover enough of the body: %d (%d actual size)",
@@ -2233,8 +2260,8 @@ rspamd_dkim_canonize_body(struct rspamd_task *task,
 					start = "\r\n";
 					end = start + 2;
 					remain = 2;
-					rspamd_dkim_relaxed_body_step(ctx, ctx->body_hash,
-												  &start, end - start, &remain);
+					rspamd_dkim_canon_body_run(ctx, ctx->body_hash,
+											   &start, end, &remain, TRUE);
 				}
 			}
 		}
@@ -2527,7 +2554,7 @@ rspamd_dkim_canonize_header(struct rspamd_dkim_common_ctx *ctx,
 										 count);
 
 				for (cur = rh->prev, i = 0; i < max_list_iters; cur = cur->prev, i++) {
-					if (cur->decoded &&
+					if (rspamd_mime_header_get_decoded(cur) &&
 						rspamd_substring_search(cur->decoded, strlen(cur->decoded),
 												idx_buf, id_len) != -1) {
 						sel = cur;
@@ -2609,8 +2636,9 @@ rspamd_dkim_canonize_header(struct rspamd_dkim_common_ctx *ctx,
 
 				DL_FOREACH(rh, cur)
 				{
-					uint64_t th = rspamd_cryptobox_fast_hash(cur->decoded,
-															 strlen(cur->decoded), rspamd_hash_seed());
+					const char *decoded = rspamd_mime_header_get_decoded(cur);
+					uint64_t th = rspamd_cryptobox_fast_hash(decoded,
+															 strlen(decoded), rspamd_hash_seed());
 
 					if (th == ctx->sig_hash) {
 						rspamd_dkim_signature_update(ctx, cur->raw_value,
@@ -2691,20 +2719,19 @@ rspamd_dkim_type_to_string(enum rspamd_dkim_type t)
 	}
 }
 
-/**
- * Check task for dkim context using dkim key
- * @param ctx dkim verify context
- * @param key dkim key (from cache or from dns request)
- * @param task task to check
- * @return
+/*
+ * Checks body hash and calculates headers digest; if the returned result has
+ * DKIM_CONTINUE code, the signature must be verified against `raw_digest`
  */
-struct rspamd_dkim_check_result *
-rspamd_dkim_check(rspamd_dkim_context_t *ctx,
-				  rspamd_dkim_key_t *key,
-				  struct rspamd_task *task)
+static struct rspamd_dkim_check_result *
+rspamd_dkim_check_digest(rspamd_dkim_context_t *ctx,
+						 rspamd_dkim_key_t *key,
+						 struct rspamd_task *task,
+						 unsigned char *raw_digest,
+						 gsize *pdlen,
+						 int *pnid)
 {
 	const char *body_end, *body_start;
-	unsigned char raw_digest[EVP_MAX_MD_SIZE];
 	struct rspamd_dkim_cached_hash *cached_bh = NULL;
 	EVP_MD_CTX *cpy_ctx = NULL;
 	gsize dlen = 0;
@@ -2783,8 +2810,8 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 			EVP_DigestFinal_ex(cpy_ctx, raw_digest, NULL);
 
 			cached_bh->digest_normal = rspamd_mempool_alloc(task->task_pool,
-															sizeof(raw_digest));
-			memcpy(cached_bh->digest_normal, raw_digest, sizeof(raw_digest));
+															EVP_MAX_MD_SIZE);
+			memcpy(cached_bh->digest_normal, raw_digest, EVP_MAX_MD_SIZE);
 		}
 
 		/* Check bh field */
@@ -2805,8 +2832,8 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 				EVP_DigestUpdate(cpy_ctx, "\r\n", 2);
 				EVP_DigestFinal_ex(cpy_ctx, raw_digest, NULL);
 				cached_bh->digest_crlf = rspamd_mempool_alloc(task->task_pool,
-															  sizeof(raw_digest));
-				memcpy(cached_bh->digest_crlf, raw_digest, sizeof(raw_digest));
+															  EVP_MAX_MD_SIZE);
+				memcpy(cached_bh->digest_crlf, raw_digest, EVP_MAX_MD_SIZE);
 
 				if (memcmp(ctx->bh, raw_digest, ctx->bhlen) != 0) {
 					msg_debug_dkim(
@@ -2824,8 +2851,8 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 					EVP_DigestUpdate(cpy_ctx, "\n", 1);
 					EVP_DigestFinal_ex(cpy_ctx, raw_digest, NULL);
 					cached_bh->digest_cr = rspamd_mempool_alloc(task->task_pool,
-																sizeof(raw_digest));
-					memcpy(cached_bh->digest_cr, raw_digest, sizeof(raw_digest));
+																EVP_MAX_MD_SIZE);
+					memcpy(cached_bh->digest_cr, raw_digest, EVP_MAX_MD_SIZE);
 
 					if (memcmp(ctx->bh, raw_digest, ctx->bhlen) != 0) {
 						msg_debug_dkim("bh value mismatch after added LF: %*xs versus %*xs",
@@ -2914,12 +2941,61 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 		nid = NID_sha1;
 	}
 
+	*pdlen = dlen;
+	*pnid = nid;
+
+	return res;
+}
+
+/*
+ * Pure signature verification, it does not touch task or context and can be
+ * executed in any thread
+ */
+static gboolean
+rspamd_dkim_verify_digest(rspamd_dkim_key_t *key, int nid,
+						  const unsigned char *digest, gsize dlen,
+						  const unsigned char *sig, gsize siglen)
+{
 	switch (key->type) {
 	case RSPAMD_DKIM_KEY_RSA:
-		if (RSA_verify(nid, raw_digest, dlen, ctx->b, ctx->blen,
-					   key->key.key_rsa) != 1) {
-			msg_debug_dkim("headers rsa verify failed");
+		if (RSA_verify(nid, digest, dlen, sig, siglen, key->key.key_rsa) != 1) {
 			ERR_clear_error();
+			return FALSE;
+		}
+		break;
+	case RSPAMD_DKIM_KEY_ECDSA:
+		if (ECDSA_verify(nid, digest, dlen, sig, siglen, key->key.key_ecdsa) != 1) {
+			ERR_clear_error();
+			return FALSE;
+		}
+		break;
+	case RSPAMD_DKIM_KEY_EDDSA:
+		if (!rspamd_cryptobox_verify(sig, siglen, digest, dlen,
+									 key->key.key_eddsa, RSPAMD_CRYPTOBOX_MODE_25519)) {
+			return FALSE;
+		}
+		break;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_dkim_check_finish(rspamd_dkim_context_t *ctx,
+						 rspamd_dkim_key_t *key,
+						 struct rspamd_task *task,
+						 struct rspamd_dkim_check_result *res,
+						 gboolean verified)
+{
+	const char *body_end, *body_start;
+
+	body_end = task->msg.begin + task->msg.len;
+	body_start = MESSAGE_FIELD(task, raw_headers_content).body_start;
+
+	if (!verified) {
+		switch (key->type) {
+		case RSPAMD_DKIM_KEY_RSA:
+			msg_debug_dkim("headers rsa verify failed");
 			res->rcode = DKIM_REJECT;
 			res->fail_reason = "headers rsa verify failed";
 
@@ -2932,11 +3008,8 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 				ctx->domain, ctx->selector,
 				RSPAMD_DKIM_KEY_ID_LEN, rspamd_dkim_key_id(key),
 				ctx->dkim_header);
-		}
-		break;
-	case RSPAMD_DKIM_KEY_ECDSA:
-		if (ECDSA_verify(nid, raw_digest, dlen, ctx->b, ctx->blen,
-						 key->key.key_ecdsa) != 1) {
+			break;
+		case RSPAMD_DKIM_KEY_ECDSA:
 			msg_info_dkim(
 				"%s: headers ECDSA verification failure; "
 				"body length %d->%d; headers length %d; d=%s; s=%s; key_md5=%*xs; orig header: %s",
@@ -2947,14 +3020,10 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 				RSPAMD_DKIM_KEY_ID_LEN, rspamd_dkim_key_id(key),
 				ctx->dkim_header);
 			msg_debug_dkim("headers ecdsa verify failed");
-			ERR_clear_error();
 			res->rcode = DKIM_REJECT;
 			res->fail_reason = "headers ecdsa verify failed";
-		}
-		break;
-	case RSPAMD_DKIM_KEY_EDDSA:
-		if (!rspamd_cryptobox_verify(ctx->b, ctx->blen, raw_digest, dlen,
-									 key->key.key_eddsa, RSPAMD_CRYPTOBOX_MODE_25519)) {
+			break;
+		case RSPAMD_DKIM_KEY_EDDSA:
 			msg_info_dkim(
 				"%s: headers EDDSA verification failure; "
 				"body length %d->%d; headers length %d; d=%s; s=%s; key_md5=%*xs; orig header: %s",
@@ -2967,11 +3036,10 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 			msg_debug_dkim("headers eddsa verify failed");
 			res->rcode = DKIM_REJECT;
 			res->fail_reason = "headers eddsa verify failed";
+			break;
 		}
-		break;
 	}
 
-
 	if (ctx->common.type == RSPAMD_DKIM_ARC_SEAL && res->rcode == DKIM_CONTINUE) {
 		switch (ctx->cv) {
 		case RSPAMD_ARC_INVALID:
@@ -2988,6 +3056,137 @@ rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 			break;
 		}
 	}
+}
+
+/**
+ * Check task for dkim context using dkim key
+ * @param ctx dkim verify context
+ * @param key dkim key (from cache or from dns request)
+ * @param task task to check
+ * @return
+ */
+struct rspamd_dkim_check_result *
+rspamd_dkim_check(rspamd_dkim_context_t *ctx,
+				  rspamd_dkim_key_t *key,
+				  struct rspamd_task *task)
+{
+	unsigned char raw_digest[EVP_MAX_MD_SIZE];
+	struct rspamd_dkim_check_result *res;
+	gsize dlen = 0;
+	int nid = 0;
+
+	res = rspamd_dkim_check_digest(ctx, key, task, raw_digest, &dlen, &nid);
+
+	if (res != NULL && res->rcode == DKIM_CONTINUE) {
+		rspamd_dkim_check_finish(ctx, key, task, res,
+								 rspamd_dkim_verify_digest(key, nid, raw_digest, dlen,
+														   ctx->b, ctx->blen));
+	}
+
+	return res;
+}
+
+struct rspamd_dkim_verify_job {
+	/* Context and result are allocated in the task pool: not used in the thread */
+	rspamd_dkim_context_t *ctx;
+	struct rspamd_dkim_check_result *res;
+	rspamd_dkim_key_t *key;
+	dkim_check_cb_f cb;
+	gpointer ud;
+	/* Points to the context, task is held by the offload whilst the job runs */
+	const unsigned char *sig;
+	gsize siglen;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	gsize dlen;
+	int nid;
+	gboolean verified;
+	gboolean in_call;
+};
+
+static void
+rspamd_dkim_verify_job_free(struct rspamd_dkim_verify_job *job)
+{
+	rspamd_dkim_key_unref(job->key);
+	g_free(job);
+}
+
+static void
+rspamd_dkim_verify_work(void *ud)
+{
+	struct rspamd_dkim_verify_job *job = ud;
+
+	job->verified = rspamd_dkim_verify_digest(job->key, job->nid,
+											  job->digest, job->dlen,
+											  job->sig, job->siglen);
+}
+
+static void
+rspamd_dkim_verify_done(struct rspamd_task *task, void *ud)
+{
+	struct rspamd_dkim_verify_job *job = ud;
+
+	if (job->in_call) {
+		/* Executed inline, result is returned by rspamd_dkim_check_async */
+		rspamd_dkim_check_finish(job->ctx, job->key, task, job->res, job->verified);
+
+		return;
+	}
+
+	if (task != NULL) {
+		rspamd_dkim_check_finish(job->ctx, job->key, task, job->res, job->verified);
+		job->cb(job->res, job->ud);
+	}
+
+	rspamd_dkim_verify_job_free(job);
+}
+
+struct rspamd_dkim_check_result *
+rspamd_dkim_check_async(rspamd_dkim_context_t *ctx,
+						rspamd_dkim_key_t *key,
+						struct rspamd_task *task,
+						dkim_check_cb_f cb,
+						gpointer ud)
+{
+	struct rspamd_dkim_verify_job *job;
+	struct rspamd_dkim_check_result *res;
+
+	job = g_malloc0(sizeof(*job));
+	res = rspamd_dkim_check_digest(ctx, key, task, job->digest, &job->dlen, &job->nid);
+
+	if (res == NULL || res->rcode != DKIM_CONTINUE) {
+		g_free(job);
+
+		return res;
+	}
+
+	if (key->type == RSPAMD_DKIM_KEY_EDDSA) {
+		/* Ed25519 verification is too cheap to pay for a thread switch */
+		rspamd_dkim_check_finish(ctx, key, task, res,
+								 rspamd_dkim_verify_digest(key, job->nid,
+														   job->digest, job->dlen,
+														   ctx->b, ctx->blen));
+		g_free(job);
+
+		return res;
+	}
+
+	job->ctx = ctx;
+	job->res = res;
+	job->key = rspamd_dkim_key_ref(key);
+	job->cb = cb;
+	job->ud = ud;
+	job->sig = (const unsigned char *) ctx->b;
+	job->siglen = ctx->blen;
+	job->in_call = TRUE;
+
+	if (rspamd_task_offload(task, rspamd_dkim_verify_work,
+							rspamd_dkim_verify_done, job)) {
+		job->in_call = FALSE;
+
+		return NULL;
+	}
+
+	rspamd_dkim_verify_job_free(job);
 
 	return res;
 }
@@ -3065,6 +3264,25 @@ unsigned int rspamd_dkim_key_get_ttl(rspamd_dkim_key_t *k)
 	return 0;
 }
 
+const char *
+rspamd_dkim_key_get_raw(rspamd_dkim_key_t *k, gsize *len)
+{
+	if (k) {
+		*len = k->keylen;
+		return (const char *) k->raw_key;
+	}
+
+	*len = 0;
+
+	return NULL;
+}
+
+enum rspamd_dkim_key_type
+rspamd_dkim_key_get_type(rspamd_dkim_key_t *k)
+{
+	return k->type;
+}
+
 const char *
 rspamd_dkim_get_dns_key(rspamd_dkim_context_t *ctx)
 {
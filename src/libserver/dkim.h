@@ -200,6 +200,20 @@ struct rspamd_dkim_check_result *rspamd_dkim_check(rspamd_dkim_context_t *ctx,
 												   rspamd_dkim_key_t *key,
 												   struct rspamd_task *task);
 
+typedef void (*dkim_check_cb_f)(struct rspamd_dkim_check_result *res, gpointer ud);
+
+/**
+ * Same as `rspamd_dkim_check` but RSA and ECDSA signatures are verified in the
+ * worker's cpu pool if it is configured
+ * @return check result if it is done inline, otherwise NULL and `cb` is called
+ * later from the event loop (it is not called if the task is destroyed before)
+ */
+struct rspamd_dkim_check_result *rspamd_dkim_check_async(rspamd_dkim_context_t *ctx,
+														 rspamd_dkim_key_t *key,
+														 struct rspamd_task *task,
+														 dkim_check_cb_f cb,
+														 gpointer ud);
+
 struct rspamd_dkim_check_result *
 rspamd_dkim_create_result(rspamd_dkim_context_t *ctx,
 						  enum rspamd_dkim_check_rcode rcode,
@@ -230,6 +244,14 @@ const char *rspamd_dkim_get_dns_key(rspamd_dkim_context_t *ctx);
 
 unsigned int rspamd_dkim_key_get_ttl(rspamd_dkim_key_t *k);
 
+/**
+ * Returns base64 encoded key data (as in `p=` tag without spaces), it can be
+ * passed to `rspamd_dkim_make_key` to create the same key
+ */
+const char *rspamd_dkim_key_get_raw(rspamd_dkim_key_t *k, gsize *len);
+
+enum rspamd_dkim_key_type rspamd_dkim_key_get_type(rspamd_dkim_key_t *k);
+
 /**
  * Create DKIM public key from a raw data
  * @param keydata
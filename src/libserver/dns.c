@@ -25,6 +25,7 @@
 #include "contrib/librdns/dns_private.h"
 #include "contrib/librdns/rdns_ev.h"
 #include "unix-std.h"
+#include "libserver/worker_util.h"
 
 #include <unicode/uidna.h>
 
@@ -52,6 +53,7 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 	.data = NULL};
 
 struct rspamd_dns_request_ud {
+	struct rspamd_dns_resolver *resolver;
 	struct rspamd_async_session *session;
 	dns_callback_type cb;
 	gpointer ud;
@@ -60,6 +62,10 @@ struct rspamd_dns_request_ud {
 	struct rspamd_symcache_dynamic_item *item;
 	struct rdns_request *req;
 	struct rdns_reply *reply;
+	ev_tstamp start;
+	/* Replayed reply is delivered after the recorded latency */
+	ev_timer replay_tm;
+	gboolean replay_delayed;
 };
 
 struct rspamd_dns_fail_cache_entry {
@@ -107,11 +113,107 @@ rspamd_dns_fail_equal(gconstpointer p1, gconstpointer p2)
 	return FALSE;
 }
 
+static struct rspamd_dns_fail_cache_entry *
+rspamd_dns_cache_entry_new(const char *name, enum rdns_request_type type)
+{
+	char *target;
+	gsize namelen;
+	struct rspamd_dns_fail_cache_entry *nentry;
+
+	/* Allocate in a single entry to allow further free in a single call */
+	namelen = strlen(name);
+	nentry = g_malloc(sizeof(*nentry) + namelen + 1);
+	target = ((char *) nentry) + sizeof(*nentry);
+	rspamd_strlcpy(target, name, namelen + 1);
+	nentry->type = type;
+	nentry->name = target;
+	nentry->namelen = namelen;
+
+	return nentry;
+}
+
+/*
+ * Returns how long a reply could be cached or a negative value if it should
+ * not be cached at all
+ */
+static double
+rspamd_dns_reply_cache_ttl(struct rspamd_dns_resolver *resolver,
+						   struct rdns_reply *reply)
+{
+	struct rdns_reply_entry *entry;
+	double ttl = resolver->answers_cache_max_ttl;
+
+	if (reply->flags & RDNS_TRUNCATED) {
+		return -1;
+	}
+
+	if (reply->code == RDNS_RC_NXDOMAIN ||
+		(reply->code == RDNS_RC_NOERROR && reply->entries == NULL)) {
+		/* No SOA record is available, so use the configured time */
+		return MIN(ttl, resolver->answers_cache_negative_ttl);
+	}
+	else if (reply->code != RDNS_RC_NOERROR) {
+		return -1;
+	}
+
+	DL_FOREACH(reply->entries, entry)
+	{
+		if (entry->ttl < ttl) {
+			ttl = entry->ttl;
+		}
+	}
+
+	return ttl > 0 ? ttl : -1;
+}
+
+static void
+rspamd_dns_answers_cache_insert(struct rspamd_dns_resolver *resolver,
+								struct rdns_reply *reply,
+								ev_tstamp now)
+{
+	double ttl = rspamd_dns_reply_cache_ttl(resolver, reply);
+
+	if (ttl > 0) {
+		struct rspamd_dns_fail_cache_entry *nentry;
+		struct rdns_request *req = reply->request;
+
+		nentry = rspamd_dns_cache_entry_new(req->requested_names[0].name,
+											req->requested_names[0].type);
+
+		/* Rdns request is retained there and owns the reply */
+		rspamd_lru_hash_insert(resolver->answers_cache,
+							   nentry, rdns_request_retain(req),
+							   now, ttl);
+	}
+}
+
+static void
+rspamd_dns_fails_cache_insert(struct rspamd_dns_resolver *resolver,
+							  struct rdns_request *req,
+							  ev_tstamp now)
+{
+	struct rspamd_dns_fail_cache_entry *nentry;
+
+	nentry = rspamd_dns_cache_entry_new(req->requested_names[0].name,
+										req->requested_names[0].type);
+
+	/* Rdns request is retained there */
+	rspamd_lru_hash_insert(resolver->fails_cache,
+						   nentry, rdns_request_retain(req),
+						   now, resolver->fails_cache_time);
+}
+
 static void
 rspamd_dns_fin_cb(gpointer arg)
 {
 	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *) arg;
 
+	if (reqdata->replay_delayed) {
+		/* Session is terminated before a replayed reply is due */
+		ev_timer_stop(reqdata->resolver->event_loop, &reqdata->replay_tm);
+		reqdata->replay_delayed = FALSE;
+	}
+
 	if (reqdata->item) {
 		rspamd_symcache_set_cur_item(reqdata->task, reqdata->item);
 	}
@@ -143,39 +245,143 @@ rspamd_dns_fin_cb(gpointer arg)
 	}
 }
 
+/*
+ * Appends a reply received from network to the record file in the format
+ * of `fake_records`, so the same replies could be replayed later
+ */
 static void
-rspamd_dns_callback(struct rdns_reply *reply, gpointer ud)
+rspamd_dns_record_reply(struct rspamd_dns_resolver *resolver,
+						struct rdns_reply *reply,
+						double latency)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rdns_request *req = reply->request;
+	struct rdns_reply_entry *entry;
+	enum rdns_request_type rtype = req->requested_names[0].type;
+	ucl_object_t *top, *replies;
+	char addrbuf[INET6_ADDRSTRLEN + 1], recbuf[512], *out;
+	GString *line;
+
+	if (req->state == RDNS_REQUEST_FAKE || reply->code == RDNS_RC_TIMEOUT ||
+		req->qcount != 1) {
+		return;
+	}
 
-	reqdata->reply = reply;
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top,
+						  ucl_object_fromstring(req->requested_names[0].name),
+						  "name", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromstring(rdns_str_from_type(rtype)),
+						  "type", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromstring(rdns_strerror(reply->code)),
+						  "rcode", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromdouble(latency),
+						  "latency", 0, false);
+
+	if (reply->code == RDNS_RC_NOERROR) {
+		replies = ucl_object_typed_new(UCL_ARRAY);
+
+		LL_FOREACH(reply->entries, entry)
+		{
+			if (entry->type != rtype) {
+				/* CNAMEs and other auxiliary records are not replayed */
+				continue;
+			}
 
+			switch (rtype) {
+			case RDNS_REQUEST_A:
+				inet_ntop(AF_INET, &entry->content.a.addr, addrbuf,
+						  sizeof(addrbuf));
+				ucl_array_append(replies, ucl_object_fromstring(addrbuf));
+				break;
+			case RDNS_REQUEST_AAAA:
+				inet_ntop(AF_INET6, &entry->content.aaa.addr, addrbuf,
+						  sizeof(addrbuf));
+				ucl_array_append(replies, ucl_object_fromstring(addrbuf));
+				break;
+			case RDNS_REQUEST_NS:
+				ucl_array_append(replies,
+								 ucl_object_fromstring(entry->content.ns.name));
+				break;
+			case RDNS_REQUEST_PTR:
+				ucl_array_append(replies,
+								 ucl_object_fromstring(entry->content.ptr.name));
+				break;
+			case RDNS_REQUEST_TXT:
+				ucl_array_append(replies,
+								 ucl_object_fromstring(entry->content.txt.data));
+				break;
+			case RDNS_REQUEST_MX:
+				rspamd_snprintf(recbuf, sizeof(recbuf), "%d %s",
+								(int) entry->content.mx.priority,
+								entry->content.mx.name);
+				ucl_array_append(replies, ucl_object_fromstring(recbuf));
+				break;
+			case RDNS_REQUEST_SOA:
+				rspamd_snprintf(recbuf, sizeof(recbuf), "%s %s %ud %d %d %d %ud",
+								entry->content.soa.mname,
+								entry->content.soa.admin,
+								entry->content.soa.serial,
+								(int) entry->content.soa.refresh,
+								(int) entry->content.soa.retry,
+								(int) entry->content.soa.expire,
+								entry->content.soa.minimum);
+				ucl_array_append(replies, ucl_object_fromstring(recbuf));
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (ucl_array_head(replies) == NULL) {
+			/* Nothing could be replayed for this type */
+			ucl_object_unref(replies);
+			ucl_object_unref(top);
+
+			return;
+		}
+
+		ucl_object_insert_key(top, replies, "replies", 0, false);
+	}
+
+	out = (char *) ucl_object_emit(top, UCL_EMIT_JSON_COMPACT);
+	ucl_object_unref(top);
+
+	if (out) {
+		line = g_string_new(out);
+		g_string_append_c(line, '\n');
+
+		/* Single write to an append only file is not interleaved by other workers */
+		if (write(resolver->record_fd, line->str, line->len) == -1) {
+			msg_err("cannot record dns reply for %s: %s",
+					req->requested_names[0].name, strerror(errno));
+		}
+
+		g_string_free(line, TRUE);
+		free(out);
+	}
+}
+
+static void
+rspamd_dns_deliver_reply(struct rspamd_dns_request_ud *reqdata,
+						 struct rdns_reply *reply)
+{
+	rspamd_worker_stat_hist_time(RSPAMD_STAT_HIST_DNS,
+								 ev_now(reqdata->resolver->event_loop) - reqdata->start);
+
+	if (reqdata->resolver->answers_cache) {
+		rspamd_dns_answers_cache_insert(reqdata->resolver, reply,
+										ev_now(reqdata->resolver->event_loop));
+	}
 
 	if (reqdata->session) {
 		if (reply->code == RDNS_RC_SERVFAIL &&
 			reqdata->task &&
 			reqdata->task->resolver->fails_cache) {
-
-			/* Add to cache... */
-			const char *name = reqdata->req->requested_names[0].name;
-			char *target;
-			gsize namelen;
-			struct rspamd_dns_fail_cache_entry *nentry;
-
-			/* Allocate in a single entry to allow further free in a single call */
-			namelen = strlen(name);
-			nentry = g_malloc(sizeof(nentry) + namelen + 1);
-			target = ((char *) nentry) + sizeof(nentry);
-			rspamd_strlcpy(target, name, namelen + 1);
-			nentry->type = reqdata->req->requested_names[0].type;
-			nentry->name = target;
-			nentry->namelen = namelen;
-
-			/* Rdns request is retained there */
-			rspamd_lru_hash_insert(reqdata->task->resolver->fails_cache,
-								   nentry, rdns_request_retain(reply->request),
-								   reqdata->task->task_timestamp,
-								   reqdata->task->resolver->fails_cache_time);
+			rspamd_dns_fails_cache_insert(reqdata->task->resolver,
+										  reply->request,
+										  reqdata->task->task_timestamp);
 		}
 
 		/*
@@ -195,14 +401,89 @@ rspamd_dns_callback(struct rdns_reply *reply, gpointer ud)
 	}
 }
 
-struct rspamd_dns_request_ud *
-rspamd_dns_resolver_request(struct rspamd_dns_resolver *resolver,
-							struct rspamd_async_session *session,
-							rspamd_mempool_t *pool,
-							dns_callback_type cb,
-							gpointer ud,
-							enum rdns_request_type type,
-							const char *name)
+static void
+rspamd_dns_replay_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_dns_request_ud *reqdata =
+		(struct rspamd_dns_request_ud *) w->data;
+	struct rdns_request *req = reqdata->req;
+
+	reqdata->replay_delayed = FALSE;
+	/* Reqdata might be freed on delivery */
+	rspamd_dns_deliver_reply(reqdata, reqdata->reply);
+	rdns_request_release(req);
+}
+
+/*
+ * Returns how long a replayed reply should be delayed to emulate the network
+ */
+static double
+rspamd_dns_replay_delay(struct rspamd_dns_resolver *resolver,
+						struct rdns_reply *reply)
+{
+	struct rdns_request *req = reply->request;
+	struct rspamd_dns_fail_cache_entry search;
+	double *recorded;
+
+	if (req->state != RDNS_REQUEST_FAKE) {
+		return 0;
+	}
+
+	if (resolver->replay_latencies) {
+		search.name = req->requested_names[0].name;
+		search.namelen = strlen(search.name);
+		search.type = req->requested_names[0].type;
+
+		recorded = g_hash_table_lookup(resolver->replay_latencies, &search);
+
+		if (recorded) {
+			return *recorded;
+		}
+	}
+
+	return resolver->replay_latency;
+}
+
+static void
+rspamd_dns_callback(struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_resolver *resolver = reqdata->resolver;
+	double delay;
+
+	reqdata->reply = reply;
+
+	if (resolver->record_fd != -1) {
+		rspamd_dns_record_reply(resolver, reply,
+								ev_now(resolver->event_loop) - reqdata->start);
+	}
+
+	delay = rspamd_dns_replay_delay(resolver, reply);
+
+	if (delay > 0) {
+		/* Request owns the reply, so keep it until the delayed delivery */
+		rdns_request_retain(reply->request);
+		reqdata->replay_delayed = TRUE;
+		ev_timer_init(&reqdata->replay_tm, rspamd_dns_replay_timer_cb,
+					  delay, 0.0);
+		reqdata->replay_tm.data = reqdata;
+		ev_timer_start(resolver->event_loop, &reqdata->replay_tm);
+
+		return;
+	}
+
+	rspamd_dns_deliver_reply(reqdata, reply);
+}
+
+static struct rspamd_dns_request_ud *
+rspamd_dns_resolver_request_timeout(struct rspamd_dns_resolver *resolver,
+									struct rspamd_async_session *session,
+									rspamd_mempool_t *pool,
+									dns_callback_type cb,
+									gpointer ud,
+									enum rdns_request_type type,
+									const char *name,
+									double timeout)
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
@@ -257,12 +538,14 @@ rspamd_dns_resolver_request(struct rspamd_dns_resolver *resolver,
 	}
 
 	reqdata->pool = pool;
+	reqdata->resolver = resolver;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->start = ev_now(resolver->event_loop);
 
 	req = rdns_make_request_full(resolver->r, rspamd_dns_callback, reqdata,
-								 resolver->request_timeout, resolver->max_retransmits, 1, name,
+								 timeout, resolver->max_retransmits, 1, name,
 								 type);
 	reqdata->req = req;
 
@@ -291,29 +574,364 @@ rspamd_dns_resolver_request(struct rspamd_dns_resolver *resolver,
 	return reqdata;
 }
 
+struct rspamd_dns_request_ud *
+rspamd_dns_resolver_request(struct rspamd_dns_resolver *resolver,
+							struct rspamd_async_session *session,
+							rspamd_mempool_t *pool,
+							dns_callback_type cb,
+							gpointer ud,
+							enum rdns_request_type type,
+							const char *name)
+{
+	return rspamd_dns_resolver_request_timeout(resolver, session, pool, cb, ud,
+											   type, name, resolver->request_timeout);
+}
+
+/*
+ * Returns timeout of a single DNS attempt so all retransmits of a request
+ * fit into the time left for a task, 0 if there is no time left
+ */
+static double
+rspamd_dns_task_request_timeout(struct rspamd_task *task)
+{
+	struct rspamd_dns_resolver *resolver = task->resolver;
+	unsigned int attempts = MAX(resolver->max_retransmits, 1);
+
+	return rspamd_task_adjust_timeout(task, resolver->request_timeout * attempts) / attempts;
+}
+
 struct rspamd_dns_cached_delayed_cbdata {
 	struct rspamd_task *task;
 	dns_callback_type cb;
 	gpointer ud;
 	ev_timer tm;
 	struct rdns_request *req;
+	struct rspamd_symcache_dynamic_item *item;
+	gboolean servfail;
+	/* Shared request this one is waiting for */
+	struct rspamd_dns_inflight_elt *inflight;
+	/* Next request waiting for the same prefetched or shared reply */
+	struct rspamd_dns_cached_delayed_cbdata *next, *prev;
+};
+
+/* Request shared by all tasks that need the same record, the key must be the first member */
+struct rspamd_dns_inflight_elt {
+	struct rspamd_dns_fail_cache_entry key;
+	struct rspamd_dns_resolver *resolver;
+	struct rdns_request *req;
+	struct rspamd_dns_cached_delayed_cbdata *waiters;
+};
+
+/* Request prefetched for a task, the key must be the first member */
+struct rspamd_dns_prefetch_elt {
+	struct rspamd_dns_fail_cache_entry key;
+	struct rdns_request *req;
+	struct rspamd_dns_cached_delayed_cbdata *waiters;
+	gboolean done;
 };
 
+#define RSPAMD_DNS_PREFETCH_VAR "dns_prefetch"
+
 static void
-rspamd_fail_cache_cb(EV_P_ ev_timer *w, int revents)
+rspamd_dns_cached_fin_cb(gpointer arg)
 {
 	struct rspamd_dns_cached_delayed_cbdata *cbd =
-		(struct rspamd_dns_cached_delayed_cbdata *) w->data;
-	struct rdns_reply fake_reply;
-
-	ev_timer_stop(EV_A_ w);
-	memset(&fake_reply, 0, sizeof(fake_reply));
-	fake_reply.code = RDNS_RC_SERVFAIL;
-	fake_reply.request = cbd->req;
-	fake_reply.resolver = cbd->req->resolver;
-	fake_reply.requested_name = cbd->req->requested_names[0].name;
-	cbd->cb(&fake_reply, cbd->ud);
+		(struct rspamd_dns_cached_delayed_cbdata *) arg;
+
+	ev_timer_stop(cbd->task->event_loop, &cbd->tm);
+
+	if (cbd->inflight) {
+		/* Task is terminated, but the shared request is still needed by others */
+		DL_DELETE(cbd->inflight->waiters, cbd);
+		cbd->inflight = NULL;
+	}
+
+	if (cbd->item) {
+		rspamd_symcache_set_cur_item(cbd->task, cbd->item);
+	}
+
+	if (cbd->servfail || cbd->req->reply == NULL) {
+		/* No reply if a task is terminated while waiting for a prefetched or shared one */
+		struct rdns_reply fake_reply;
+
+		memset(&fake_reply, 0, sizeof(fake_reply));
+		fake_reply.code = cbd->servfail ? RDNS_RC_SERVFAIL : RDNS_RC_TIMEOUT;
+		fake_reply.request = cbd->req;
+		fake_reply.resolver = cbd->req->resolver;
+		fake_reply.requested_name = cbd->req->requested_names[0].name;
+		cbd->cb(&fake_reply, cbd->ud);
+	}
+	else {
+		cbd->cb(cbd->req->reply, cbd->ud);
+	}
+
 	rdns_request_release(cbd->req);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_dec_check(cbd->task, cbd->item, M);
+	}
+}
+
+static void
+rspamd_dns_cached_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_dns_cached_delayed_cbdata *cbd =
+		(struct rspamd_dns_cached_delayed_cbdata *) w->data;
+
+	rspamd_session_remove_event(cbd->task->s, rspamd_dns_cached_fin_cb, cbd);
+}
+
+static struct rspamd_dns_cached_delayed_cbdata *
+rspamd_dns_cached_cbdata_new(struct rspamd_task *task,
+							 dns_callback_type cb,
+							 gpointer ud,
+							 struct rdns_request *req,
+							 gboolean servfail)
+{
+	struct rspamd_dns_cached_delayed_cbdata *cbd =
+		rspamd_mempool_alloc0(task->task_pool, sizeof(*cbd));
+
+	cbd->task = task;
+	cbd->cb = cb;
+	cbd->ud = ud;
+	cbd->req = rdns_request_retain(req);
+	cbd->servfail = servfail;
+	cbd->item = rspamd_symcache_get_cur_item(task);
+
+	if (cbd->item) {
+		rspamd_symcache_item_async_inc(task, cbd->item, M);
+	}
+
+	rspamd_session_add_event(task->s, rspamd_dns_cached_fin_cb, cbd, M);
+	ev_timer_init(&cbd->tm, rspamd_dns_cached_timer_cb, 0.0, 0.0);
+	cbd->tm.data = cbd;
+
+	return cbd;
+}
+
+/*
+ * Replies from cache are delivered from the event loop, as callers do not
+ * expect their callbacks to be called before request function returns
+ */
+static void
+rspamd_dns_reply_from_cache(struct rspamd_task *task,
+							dns_callback_type cb,
+							gpointer ud,
+							struct rdns_request *req,
+							gboolean servfail)
+{
+	struct rspamd_dns_cached_delayed_cbdata *cbd;
+
+	cbd = rspamd_dns_cached_cbdata_new(task, cb, ud, req, servfail);
+	ev_timer_start(task->event_loop, &cbd->tm);
+}
+
+static void
+rspamd_dns_prefetch_cb(struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_prefetch_elt *elt = (struct rspamd_dns_prefetch_elt *) ud;
+	struct rspamd_dns_cached_delayed_cbdata *cbd;
+
+	elt->done = TRUE;
+
+	LL_FOREACH(elt->waiters, cbd)
+	{
+		/* Waiters are finalised by the session itself when it is destroyed */
+		if (!rspamd_session_blocked(cbd->task->s)) {
+			ev_timer_start(cbd->task->event_loop, &cbd->tm);
+		}
+	}
+
+	elt->waiters = NULL;
+}
+
+static void
+rspamd_dns_inflight_cb(struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_inflight_elt *elt = (struct rspamd_dns_inflight_elt *) ud;
+	struct rspamd_dns_resolver *resolver = elt->resolver;
+	struct rspamd_dns_cached_delayed_cbdata *cbd, *tmp;
+
+	/* New requests for this name are now served by caches or sent again */
+	g_hash_table_remove(resolver->inflight, &elt->key);
+
+	if (reply->code == RDNS_RC_SERVFAIL && resolver->fails_cache) {
+		rspamd_dns_fails_cache_insert(resolver, reply->request, ev_time());
+	}
+
+	DL_FOREACH_SAFE(elt->waiters, cbd, tmp)
+	{
+		cbd->inflight = NULL;
+		cbd->next = NULL;
+		cbd->prev = NULL;
+
+		/* Waiters are finalised by the session itself when it is destroyed */
+		if (!rspamd_session_blocked(cbd->task->s)) {
+			ev_timer_start(cbd->task->event_loop, &cbd->tm);
+		}
+	}
+
+	rdns_request_release(elt->req);
+	g_free(elt);
+}
+
+/*
+ * Attaches a task to the request for the same name and type that is already
+ * sent by some task of this worker or sends a new one. The request itself is
+ * not bound to any session, so it outlives a task that has started it and
+ * each task gets its own session event
+ */
+static gboolean
+rspamd_dns_inflight_request(struct rspamd_task *task,
+							dns_callback_type cb,
+							gpointer ud,
+							enum rdns_request_type type,
+							const char *name)
+{
+	struct rspamd_dns_resolver *resolver = task->resolver;
+	struct rspamd_dns_fail_cache_entry search;
+	struct rspamd_dns_inflight_elt *elt;
+	struct rspamd_dns_cached_delayed_cbdata *cbd;
+
+	search.name = name;
+	search.namelen = strlen(name);
+	search.type = type;
+
+	elt = g_hash_table_lookup(resolver->inflight, &search);
+
+	if (elt == NULL) {
+		struct rspamd_dns_request_ud *reqdata;
+		char *target;
+
+		/* Allocate in a single entry to allow further free in a single call */
+		elt = g_malloc0(sizeof(*elt) + search.namelen + 1);
+		target = ((char *) elt) + sizeof(*elt);
+		rspamd_strlcpy(target, name, search.namelen + 1);
+		elt->key.name = target;
+		elt->key.namelen = search.namelen;
+		elt->key.type = type;
+		elt->resolver = resolver;
+
+		reqdata = rspamd_dns_resolver_request(resolver, NULL, NULL,
+											  rspamd_dns_inflight_cb, elt,
+											  type, name);
+
+		if (reqdata == NULL) {
+			g_free(elt);
+
+			return FALSE;
+		}
+
+		/* Reply is attached to the request by rdns, so waiters can use it */
+		elt->req = rdns_request_retain(reqdata->req);
+		g_hash_table_insert(resolver->inflight, &elt->key, elt);
+	}
+	else {
+		resolver->inflight_hits++;
+		msg_debug_task("wait for pending request for %s", name);
+	}
+
+	cbd = rspamd_dns_cached_cbdata_new(task, cb, ud, elt->req, FALSE);
+	cbd->inflight = elt;
+	DL_APPEND(elt->waiters, cbd);
+
+	return TRUE;
+}
+
+static struct rspamd_dns_prefetch_elt *
+rspamd_dns_prefetch_lookup(struct rspamd_task *task,
+						   enum rdns_request_type type,
+						   const char *name)
+{
+	GHashTable *prefetched;
+	struct rspamd_dns_fail_cache_entry search;
+
+	prefetched = rspamd_mempool_get_variable(task->task_pool,
+											 RSPAMD_DNS_PREFETCH_VAR);
+
+	if (prefetched == NULL) {
+		return NULL;
+	}
+
+	search.name = name;
+	search.namelen = strlen(name);
+	search.type = type;
+
+	return g_hash_table_lookup(prefetched, &search);
+}
+
+gboolean
+rspamd_dns_resolver_prefetch_task(struct rspamd_task *task,
+								  enum rdns_request_type type,
+								  const char *name)
+{
+	GHashTable *prefetched;
+	struct rspamd_dns_prefetch_elt *elt;
+	struct rspamd_dns_request_ud *reqdata;
+	double timeout;
+
+	if (task->resolver == NULL || rspamd_session_blocked(task->s)) {
+		return FALSE;
+	}
+
+	if (rspamd_dns_prefetch_lookup(task, type, name) != NULL) {
+		return TRUE;
+	}
+
+	if (task->resolver->answers_cache) {
+		struct rspamd_dns_fail_cache_entry search;
+
+		search.name = name;
+		search.namelen = strlen(name);
+		search.type = type;
+
+		if (rspamd_lru_hash_lookup(task->resolver->answers_cache,
+								   &search, ev_now(task->event_loop)) != NULL) {
+			/* Already known */
+			return TRUE;
+		}
+	}
+
+	timeout = rspamd_dns_task_request_timeout(task);
+
+	if (timeout <= 0) {
+		return FALSE;
+	}
+
+	elt = rspamd_mempool_alloc0(task->task_pool, sizeof(*elt));
+	elt->key.name = rspamd_mempool_strdup(task->task_pool, name);
+	elt->key.namelen = strlen(name);
+	elt->key.type = type;
+
+	reqdata = rspamd_dns_resolver_request_timeout(task->resolver, task->s,
+												  task->task_pool, rspamd_dns_prefetch_cb, elt,
+												  type, name, timeout);
+
+	if (reqdata == NULL) {
+		return FALSE;
+	}
+
+	reqdata->task = task;
+	/* Reply is attached to the request by rdns, so waiters can use it */
+	elt->req = rdns_request_retain(reqdata->req);
+	rspamd_mempool_add_destructor(task->task_pool,
+								  (rspamd_mempool_destruct_t) rdns_request_release,
+								  elt->req);
+
+	prefetched = rspamd_mempool_get_variable(task->task_pool,
+											 RSPAMD_DNS_PREFETCH_VAR);
+
+	if (prefetched == NULL) {
+		prefetched = g_hash_table_new(rspamd_dns_fail_hash, rspamd_dns_fail_equal);
+		rspamd_mempool_set_variable(task->task_pool, RSPAMD_DNS_PREFETCH_VAR,
+									prefetched,
+									(rspamd_mempool_destruct_t) g_hash_table_unref);
+	}
+
+	g_hash_table_insert(prefetched, &elt->key, elt);
+	msg_debug_task("prefetch %s", name);
+
+	return TRUE;
 }
 
 static gboolean
@@ -325,43 +943,101 @@ make_dns_request_task_common(struct rspamd_task *task,
 							 gboolean forced)
 {
 	struct rspamd_dns_request_ud *reqdata;
+	double timeout;
 
 	if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
 		return FALSE;
 	}
 
-	if (task->resolver->fails_cache) {
-		/* Search in failures cache */
+	if (task->resolver->fails_cache || task->resolver->answers_cache) {
 		struct rspamd_dns_fail_cache_entry search;
 		struct rdns_request *req;
 
+		if (rspamd_session_blocked(task->s)) {
+			return FALSE;
+		}
+
 		search.name = name;
 		search.namelen = strlen(name);
 		search.type = type;
 
-		if ((req = rspamd_lru_hash_lookup(task->resolver->fails_cache,
+		if (task->resolver->fails_cache &&
+			(req = rspamd_lru_hash_lookup(task->resolver->fails_cache,
 										  &search, task->task_timestamp)) != NULL) {
-			/*
-			 * We need to reply with SERVFAIL again to the API, so add a special
-			 * timer, uh-oh, and fire it
-			 */
-			struct rspamd_dns_cached_delayed_cbdata *cbd =
-				rspamd_mempool_alloc0(task->task_pool, sizeof(*cbd));
-
-			ev_timer_init(&cbd->tm, rspamd_fail_cache_cb, 0.0, 0.0);
-			cbd->task = task;
-			cbd->cb = cb;
-			cbd->ud = ud;
-			cbd->req = rdns_request_retain(req);
-			cbd->tm.data = cbd;
+			/* We need to reply with SERVFAIL again to the API */
+			rspamd_dns_reply_from_cache(task, cb, ud, req, TRUE);
 
 			return TRUE;
 		}
+
+		if (task->resolver->answers_cache) {
+			/* Use event loop time as entries are inserted with it */
+			req = rspamd_lru_hash_lookup(task->resolver->answers_cache,
+										 &search, ev_now(task->event_loop));
+
+			if (req != NULL) {
+				task->resolver->answers_cache_hits++;
+				task->dns_requests++;
+				msg_debug_task("reply for %s from dns cache", name);
+				rspamd_dns_reply_from_cache(task, cb, ud, req, FALSE);
+
+				return TRUE;
+			}
+
+			task->resolver->answers_cache_misses++;
+		}
+	}
+
+	if (rspamd_session_blocked(task->s)) {
+		return FALSE;
 	}
 
-	reqdata = rspamd_dns_resolver_request(
+	struct rspamd_dns_prefetch_elt *prefetched;
+
+	if ((prefetched = rspamd_dns_prefetch_lookup(task, type, name)) != NULL) {
+		struct rspamd_dns_cached_delayed_cbdata *cbd;
+
+		task->dns_requests++;
+		cbd = rspamd_dns_cached_cbdata_new(task, cb, ud, prefetched->req, FALSE);
+
+		if (prefetched->done) {
+			msg_debug_task("reply for %s from prefetched request", name);
+			ev_timer_start(task->event_loop, &cbd->tm);
+		}
+		else {
+			msg_debug_task("wait for prefetched request for %s", name);
+			LL_PREPEND(prefetched->waiters, cbd);
+		}
+
+		return TRUE;
+	}
+
+	if (task->resolver->inflight) {
+		if (rspamd_dns_inflight_request(task, cb, ud, type, name)) {
+			task->dns_requests++;
+
+			if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
+				msg_info_task("stop resolving on reaching %ud requests",
+							  task->dns_requests);
+			}
+
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	timeout = rspamd_dns_task_request_timeout(task);
+
+	if (timeout <= 0) {
+		msg_info_task("do not resolve %s: task has no time left", name);
+
+		return FALSE;
+	}
+
+	reqdata = rspamd_dns_resolver_request_timeout(
 		task->resolver, task->s, task->task_pool, cb, ud,
-		type, name);
+		type, name, timeout);
 
 	if (reqdata) {
 		task->dns_requests++;
@@ -506,7 +1182,8 @@ rspamd_process_fake_reply(struct rspamd_config *cfg,
 	it = ucl_object_iterate_new(cur_arr);
 
 	while ((cur = ucl_object_iterate_safe(it, true))) {
-		const ucl_object_t *type_obj, *name_obj, *code_obj, *replies_obj;
+		const ucl_object_t *type_obj, *name_obj, *code_obj, *replies_obj,
+			*latency_obj;
 		enum rdns_request_type rtype = RDNS_REQUEST_A;
 		enum dns_rcode rcode = RDNS_RC_NOERROR;
 		struct rdns_reply_entry *replies = NULL;
@@ -545,6 +1222,16 @@ rspamd_process_fake_reply(struct rspamd_config *cfg,
 			}
 		}
 
+		latency_obj = ucl_object_lookup(cur, "latency");
+		if (latency_obj && dns_resolver->replay_latencies) {
+			double *latency = g_malloc(sizeof(*latency));
+
+			*latency = ucl_object_todouble(latency_obj);
+			g_hash_table_replace(dns_resolver->replay_latencies,
+								 rspamd_dns_cache_entry_new(name, rtype),
+								 latency);
+		}
+
 		if (rcode == RDNS_RC_NOERROR) {
 			/* We want replies to be set for this rcode */
 			replies_obj = ucl_object_lookup(cur, "replies");
@@ -803,14 +1490,113 @@ rspamd_dns_read_hosts_file(struct rspamd_config *cfg,
 	return true;
 }
 
+/*
+ * Loads replies recorded by `record` option, one JSON object per line
+ */
+static bool
+rspamd_dns_read_replay_file(struct rspamd_config *cfg,
+							struct rspamd_dns_resolver *dns_resolver,
+							const char *fname)
+{
+	FILE *fp;
+	char *linebuf = NULL;
+	gsize buflen = 0;
+	gssize r;
+	unsigned int nrecords = 0;
+
+	fp = fopen(fname, "r");
+
+	if (fp == NULL) {
+		msg_err_config("cannot open dns replay file %s: %s", fname,
+					   strerror(errno));
+
+		return false;
+	}
+
+	if (dns_resolver->replay_latencies == NULL) {
+		dns_resolver->replay_latencies = g_hash_table_new_full(
+			rspamd_dns_fail_hash, rspamd_dns_fail_equal, g_free, g_free);
+	}
+
+	while ((r = getline(&linebuf, &buflen, fp)) > 0) {
+		struct ucl_parser *parser;
+		ucl_object_t *obj, *arr;
+
+		g_strchomp(linebuf);
+
+		if (linebuf[0] == '\0') {
+			continue;
+		}
+
+		parser = ucl_parser_new(UCL_PARSER_NO_FILEVARS);
+
+		if (!ucl_parser_add_string(parser, linebuf, 0)) {
+			msg_err_config("invalid record in dns replay file %s: %s",
+						   fname, ucl_parser_get_error(parser));
+			ucl_parser_free(parser);
+			continue;
+		}
+
+		obj = ucl_parser_get_object(parser);
+		ucl_parser_free(parser);
+
+		if (ucl_object_lookup(obj, "proto")) {
+			/* Redis, http or tcp reply recorded to the same file */
+			ucl_object_unref(obj);
+			continue;
+		}
+
+		arr = ucl_object_typed_new(UCL_ARRAY);
+		ucl_array_append(arr, obj);
+		rspamd_process_fake_reply(cfg, dns_resolver, arr);
+		ucl_object_unref(arr);
+		nrecords++;
+	}
+
+	if (linebuf) {
+		free(linebuf);
+	}
+
+	fclose(fp);
+	msg_info_config("loaded %ud dns replies to replay from %s",
+					nrecords, fname);
+
+	return true;
+}
+
+void rspamd_dns_resolver_replay(struct rspamd_dns_resolver *dns_resolver,
+								struct rspamd_config *cfg,
+								const char *replay_file,
+								const char *record_file)
+{
+	if (replay_file) {
+		rspamd_dns_read_replay_file(cfg, dns_resolver, replay_file);
+	}
+
+	if (record_file && dns_resolver->record_fd == -1) {
+		dns_resolver->record_fd = open(record_file,
+									   O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+									   00644);
+
+		if (dns_resolver->record_fd == -1) {
+			msg_err_config("cannot open dns record file %s: %s",
+						   record_file, strerror(errno));
+		}
+	}
+}
+
 static void
 rspamd_dns_resolver_config_ucl(struct rspamd_config *cfg,
 							   struct rspamd_dns_resolver *dns_resolver,
 							   const ucl_object_t *dns_section)
 {
 	const ucl_object_t *fake_replies, *fails_cache_size, *fails_cache_time,
-		*hosts;
+		*hosts, *answers_cache_size, *elt;
 	static const ev_tstamp default_fails_cache_time = 10.0;
+	static const ev_tstamp default_answers_cache_max_ttl = 300.0;
+	static const ev_tstamp default_answers_cache_negative_ttl = 30.0;
+	static const int64_t default_answers_cache_size = 4096;
+	int64_t cache_size = default_answers_cache_size;
 
 	/* Process fake replies */
 	fake_replies = ucl_object_lookup_any(dns_section, "fake_records",
@@ -869,6 +1655,61 @@ rspamd_dns_resolver_config_ucl(struct rspamd_config *cfg,
 			g_free, (GDestroyNotify) rdns_request_release,
 			rspamd_dns_fail_hash, rspamd_dns_fail_equal);
 	}
+
+	elt = ucl_object_lookup(dns_section, "prefetch");
+	if (elt) {
+		dns_resolver->prefetch = ucl_object_toboolean(elt);
+	}
+
+	elt = ucl_object_lookup(dns_section, "share_requests");
+	if ((elt == NULL || ucl_object_toboolean(elt)) && dns_resolver->inflight == NULL) {
+		dns_resolver->inflight = g_hash_table_new(rspamd_dns_fail_hash,
+												  rspamd_dns_fail_equal);
+	}
+
+	elt = ucl_object_lookup(dns_section, "replay_latency");
+	if (elt) {
+		dns_resolver->replay_latency = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_lookup(dns_section, "replay");
+	if (elt && ucl_object_type(elt) == UCL_STRING) {
+		rspamd_dns_resolver_replay(dns_resolver, cfg, ucl_object_tostring(elt),
+								   NULL);
+	}
+
+	elt = ucl_object_lookup(dns_section, "record");
+	if (elt && ucl_object_type(elt) == UCL_STRING) {
+		rspamd_dns_resolver_replay(dns_resolver, cfg, NULL,
+								   ucl_object_tostring(elt));
+	}
+
+	answers_cache_size = ucl_object_lookup(dns_section, "answers_cache_size");
+	if (answers_cache_size && ucl_object_type(answers_cache_size) == UCL_INT) {
+		cache_size = ucl_object_toint(answers_cache_size);
+	}
+
+	if (cache_size > 0 && dns_resolver->answers_cache == NULL) {
+		dns_resolver->answers_cache_max_ttl = default_answers_cache_max_ttl;
+		dns_resolver->answers_cache_negative_ttl = default_answers_cache_negative_ttl;
+
+		elt = ucl_object_lookup(dns_section, "answers_cache_max_ttl");
+		if (elt) {
+			dns_resolver->answers_cache_max_ttl = ucl_object_todouble(elt);
+		}
+
+		elt = ucl_object_lookup(dns_section, "answers_cache_negative_ttl");
+		if (elt) {
+			dns_resolver->answers_cache_negative_ttl = ucl_object_todouble(elt);
+		}
+
+		if (dns_resolver->answers_cache_max_ttl > 0) {
+			dns_resolver->answers_cache = rspamd_lru_hash_new_full(
+				cache_size,
+				g_free, (GDestroyNotify) rdns_request_release,
+				rspamd_dns_fail_hash, rspamd_dns_fail_equal);
+		}
+	}
 }
 
 struct rspamd_dns_resolver *
@@ -880,6 +1721,7 @@ rspamd_dns_resolver_init(rspamd_logger_t *logger,
 
 	dns_resolver = g_malloc0(sizeof(struct rspamd_dns_resolver));
 	dns_resolver->event_loop = ev_base;
+	dns_resolver->record_fd = -1;
 
 	if (cfg != NULL) {
 		dns_resolver->request_timeout = cfg->dns_timeout;
@@ -991,6 +1833,23 @@ void rspamd_dns_resolver_deinit(struct rspamd_dns_resolver *resolver)
 			rspamd_lru_hash_destroy(resolver->fails_cache);
 		}
 
+		if (resolver->answers_cache) {
+			rspamd_lru_hash_destroy(resolver->answers_cache);
+		}
+
+		if (resolver->inflight) {
+			/* Pending requests are terminated with the resolver above */
+			g_hash_table_unref(resolver->inflight);
+		}
+
+		if (resolver->replay_latencies) {
+			g_hash_table_unref(resolver->replay_latencies);
+		}
+
+		if (resolver->record_fd != -1) {
+			close(resolver->record_fd);
+		}
+
 		uidna_close(resolver->uidna);
 
 		g_free(resolver);
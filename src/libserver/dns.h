@@ -37,12 +37,27 @@ struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct ev_loop *event_loop;
 	rspamd_lru_hash_t *fails_cache;
+	rspamd_lru_hash_t *answers_cache;
 	void *uidna;
 	double fails_cache_time;
+	double answers_cache_max_ttl;
+	double answers_cache_negative_ttl;
+	uint64_t answers_cache_hits;
+	uint64_t answers_cache_misses;
+	/* Requests in flight shared by all tasks of a worker */
+	GHashTable *inflight;
+	uint64_t inflight_hits;
+	/* Issue requests for the well known records of a message early */
+	gboolean prefetch;
 	struct upstream_list *ups;
 	struct rspamd_config *cfg;
 	double request_timeout;
 	unsigned int max_retransmits;
+	/* Real replies are appended there to be replayed as fake records */
+	int record_fd;
+	/* Delays of replayed records, both recorded and the configured default */
+	GHashTable *replay_latencies;
+	double replay_latency;
 };
 
 /* Rspamd DNS API */
@@ -56,6 +71,17 @@ struct rspamd_dns_resolver *rspamd_dns_resolver_init(rspamd_logger_t *logger,
 
 void rspamd_dns_resolver_deinit(struct rspamd_dns_resolver *resolver);
 
+/**
+ * Loads replies to replay and opens the file to record replies to,
+ * as `replay` and `record` options do
+ * @param replay_file file with recorded replies or NULL
+ * @param record_file file to append replies to or NULL
+ */
+void rspamd_dns_resolver_replay(struct rspamd_dns_resolver *resolver,
+								struct rspamd_config *cfg,
+								const char *replay_file,
+								const char *record_file);
+
 struct rspamd_dns_request_ud;
 
 /**
@@ -89,6 +115,19 @@ gboolean rspamd_dns_resolver_request_task_forced(struct rspamd_task *task,
 												 enum rdns_request_type type,
 												 const char *name);
 
+/**
+ * Starts a request on behalf of a task before some plugin needs it. Requests
+ * for the same name and type made by the task later are attached to the
+ * prefetched one instead of being sent again
+ * @param task
+ * @param type request type
+ * @param name name to resolve
+ * @return TRUE if request was sent
+ */
+gboolean rspamd_dns_resolver_prefetch_task(struct rspamd_task *task,
+										   enum rdns_request_type type,
+										   const char *name);
+
 /**
  * Converts a name into idna from UTF8
  * @param resolver resolver (must be initialised)
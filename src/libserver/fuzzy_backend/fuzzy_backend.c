@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_mmap.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
 
@@ -26,6 +27,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MMAP = 2,
 };
 
 static void *rspamd_fuzzy_backend_init_sqlite(struct rspamd_fuzzy_backend *bk,
@@ -96,6 +98,16 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
+	},
+	[RSPAMD_FUZZY_BACKEND_MMAP] = {
+		.init = rspamd_fuzzy_backend_init_mmap,
+		.check = rspamd_fuzzy_backend_check_mmap,
+		.update = rspamd_fuzzy_backend_update_mmap,
+		.count = rspamd_fuzzy_backend_count_mmap,
+		.version = rspamd_fuzzy_backend_version_mmap,
+		.id = rspamd_fuzzy_backend_id_mmap,
+		.periodic = rspamd_fuzzy_backend_expire_mmap,
+		.close = rspamd_fuzzy_backend_close_mmap,
 	}};
 
 struct rspamd_fuzzy_backend {
@@ -288,6 +300,9 @@ rspamd_fuzzy_backend_create(struct ev_loop *ev_base,
 			else if (strcmp(ucl_object_tostring(elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp(ucl_object_tostring(elt), "mmap") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MMAP;
+			}
 			else {
 				g_set_error(err, rspamd_fuzzy_backend_quark(),
 							EINVAL, "invalid backend type: %s",
@@ -0,0 +1,965 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_mmap.h"
+#include "unix-std.h"
+
+#include <sys/mman.h>
+
+/*
+ * File layout:
+ * - header (FUZZY_MMAP_HDR_SIZE bytes)
+ * - digests table: open addressing with linear probing, each slot is protected
+ * by a sequence counter (seqlock), so readers in other processes never block
+ * - shingles table: (band, shingle) -> digest slot, entries are immutable once
+ * published and are dropped merely on compaction
+ *
+ * There is a single writer (the worker that processes updates), it serialises
+ * with others via file lock. When a table becomes too loaded or too many slots are
+ * deleted, the writer rebuilds the file, renames it over the old one and marks the
+ * old header as stale, so readers remap the new file on the next lookup.
+ */
+
+#define FUZZY_MMAP_MAGIC "rsfzmm01"
+#define FUZZY_MMAP_HDR_SIZE 4096
+#define FUZZY_MMAP_MAX_SOURCES 16
+#define FUZZY_MMAP_DEFAULT_CAPACITY (1u << 18u)
+/* Not all digests have shingles, so we do not reserve all RSPAMD_SHINGLE_SIZE entries */
+#define FUZZY_MMAP_SHINGLES_MULT 16
+#define FUZZY_MMAP_MAX_LOAD 0.75
+/* How many times a reader retries a slot that is being modified */
+#define FUZZY_MMAP_MAX_READ_RETRIES 1024
+
+enum fuzzy_mmap_slot_state {
+	FUZZY_MMAP_SLOT_EMPTY = 0,
+	FUZZY_MMAP_SLOT_USED = 1,
+	FUZZY_MMAP_SLOT_DELETED = 2,
+};
+
+struct fuzzy_mmap_source {
+	char name[56];
+	uint64_t version;
+};
+
+struct fuzzy_mmap_hdr {
+	char magic[8];
+	uint32_t stale; /* set when the file is replaced by a compacted one */
+	uint32_t reserved;
+	uint64_t instance_id;
+	uint64_t capacity;
+	uint64_t shingles_capacity;
+	uint64_t nused;
+	uint64_t ndeleted;
+	uint64_t nshingles;
+	uint64_t next_id;
+	struct fuzzy_mmap_source sources[FUZZY_MMAP_MAX_SOURCES];
+};
+
+G_STATIC_ASSERT(sizeof(struct fuzzy_mmap_hdr) <= FUZZY_MMAP_HDR_SIZE);
+
+struct fuzzy_mmap_slot {
+	uint32_t seq; /* odd whilst the slot is being modified */
+	uint32_t state;
+	uint64_t id;
+	int64_t time;
+	int32_t value;
+	uint32_t flag;
+	unsigned char digest[rspamd_cryptobox_HASHBYTES];
+};
+
+struct fuzzy_mmap_shingle {
+	uint64_t hash;
+	uint64_t id;
+	uint32_t band; /* band + 1, zero means empty entry */
+	uint32_t slot;
+};
+
+struct rspamd_fuzzy_backend_mmap {
+	char *path;
+	int fd;
+	gsize len;
+	struct fuzzy_mmap_hdr *hdr;
+	struct fuzzy_mmap_slot *slots;
+	struct fuzzy_mmap_shingle *shingles;
+	char id[17];
+};
+
+#define msg_err_fuzzy_backend(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
+															   "fuzzy_mmap", backend->id, \
+															   G_STRFUNC,                 \
+															   __VA_ARGS__)
+#define msg_warn_fuzzy_backend(...) rspamd_default_log_function(G_LOG_LEVEL_WARNING,  \
+																"fuzzy_mmap", backend->id, \
+																G_STRFUNC,                 \
+																__VA_ARGS__)
+#define msg_info_fuzzy_backend(...) rspamd_default_log_function(G_LOG_LEVEL_INFO,     \
+																"fuzzy_mmap", backend->id, \
+																G_STRFUNC,                 \
+																__VA_ARGS__)
+#define msg_debug_fuzzy_backend(...) rspamd_conditional_debug_fast(NULL, NULL,                                  \
+																   rspamd_fuzzy_mmap_log_id, "fuzzy_mmap", backend->id, \
+																   G_STRFUNC,                                   \
+																   __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_mmap)
+
+static GQuark
+rspamd_fuzzy_backend_mmap_quark(void)
+{
+	return g_quark_from_static_string("fuzzy-backend-mmap");
+}
+
+static inline gsize
+fuzzy_mmap_file_size(uint64_t capacity, uint64_t shingles_capacity)
+{
+	return FUZZY_MMAP_HDR_SIZE + capacity * sizeof(struct fuzzy_mmap_slot) +
+		   shingles_capacity * sizeof(struct fuzzy_mmap_shingle);
+}
+
+static inline uint64_t
+fuzzy_mmap_digest_hash(const void *digest)
+{
+	uint64_t h;
+
+	/* Digests are distributed uniformly already */
+	memcpy(&h, digest, sizeof(h));
+
+	return h;
+}
+
+static inline uint64_t
+fuzzy_mmap_shingle_hash(uint64_t value, unsigned int band)
+{
+	/* Shingles values are not random enough, so mix them with the band */
+	value ^= (uint64_t) (band + 1) * 0x9E3779B97F4A7C15ULL;
+	value ^= value >> 33u;
+	value *= 0xff51afd7ed558ccdULL;
+	value ^= value >> 33u;
+
+	return value;
+}
+
+static gboolean
+fuzzy_mmap_read_slot(const struct fuzzy_mmap_slot *slot, struct fuzzy_mmap_slot *out)
+{
+	uint32_t s1, s2;
+
+	for (unsigned int i = 0; i < FUZZY_MMAP_MAX_READ_RETRIES; i++) {
+		s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (s1 & 1u) {
+			continue;
+		}
+
+		memcpy(out, slot, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+		if (s1 == s2) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+fuzzy_mmap_write_slot(struct fuzzy_mmap_slot *slot, const struct fuzzy_mmap_slot *val)
+{
+	/* Robust to a writer that has died in the middle of an update */
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) | 1u;
+
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(((unsigned char *) slot) + G_STRUCT_OFFSET(struct fuzzy_mmap_slot, state),
+		   ((const unsigned char *) val) + G_STRUCT_OFFSET(struct fuzzy_mmap_slot, state),
+		   sizeof(*slot) - G_STRUCT_OFFSET(struct fuzzy_mmap_slot, state));
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns index of the slot with the digest or -1; `free_idx` is set to the slot
+ * where the digest could be inserted
+ */
+static int64_t
+fuzzy_mmap_find(struct rspamd_fuzzy_backend_mmap *backend,
+				const void *digest,
+				struct fuzzy_mmap_slot *out,
+				int64_t *free_idx)
+{
+	struct fuzzy_mmap_slot snap;
+	uint64_t mask = backend->hdr->capacity - 1, idx, i;
+	int64_t tombstone = -1;
+
+	idx = fuzzy_mmap_digest_hash(digest) & mask;
+
+	for (i = 0; i < backend->hdr->capacity; i++, idx = (idx + 1) & mask) {
+		if (!fuzzy_mmap_read_slot(&backend->slots[idx], &snap)) {
+			continue;
+		}
+
+		if (snap.state == FUZZY_MMAP_SLOT_EMPTY) {
+			if (free_idx) {
+				*free_idx = tombstone != -1 ? tombstone : (int64_t) idx;
+			}
+
+			return -1;
+		}
+		else if (snap.state == FUZZY_MMAP_SLOT_DELETED) {
+			if (tombstone == -1) {
+				tombstone = idx;
+			}
+		}
+		else if (memcmp(snap.digest, digest, sizeof(snap.digest)) == 0) {
+			if (out) {
+				memcpy(out, &snap, sizeof(snap));
+			}
+
+			return idx;
+		}
+	}
+
+	if (free_idx) {
+		*free_idx = tombstone;
+	}
+
+	return -1;
+}
+
+static void
+fuzzy_mmap_insert_shingle(struct fuzzy_mmap_shingle *table, uint64_t capacity,
+						  uint64_t value, unsigned int band,
+						  uint64_t id, uint32_t slot)
+{
+	uint64_t mask = capacity - 1, idx, i;
+	struct fuzzy_mmap_shingle *e;
+
+	idx = fuzzy_mmap_shingle_hash(value, band) & mask;
+
+	for (i = 0; i < capacity; i++, idx = (idx + 1) & mask) {
+		e = &table[idx];
+
+		if (e->band == 0) {
+			e->hash = value;
+			e->id = id;
+			e->slot = slot;
+			/* Publish entry */
+			__atomic_store_n(&e->band, band + 1, __ATOMIC_RELEASE);
+
+			return;
+		}
+	}
+}
+
+static void
+fuzzy_mmap_init_hdr(struct fuzzy_mmap_hdr *hdr, uint64_t capacity,
+					const struct fuzzy_mmap_hdr *old)
+{
+	memcpy(hdr->magic, FUZZY_MMAP_MAGIC, sizeof(hdr->magic));
+	hdr->capacity = capacity;
+	hdr->shingles_capacity = capacity * FUZZY_MMAP_SHINGLES_MULT;
+
+	if (old) {
+		hdr->instance_id = old->instance_id;
+		hdr->next_id = old->next_id;
+		memcpy(hdr->sources, old->sources, sizeof(hdr->sources));
+	}
+	else {
+		hdr->instance_id = rspamd_random_uint64_fast();
+		hdr->next_id = 1;
+	}
+}
+
+static gboolean
+fuzzy_mmap_map(struct rspamd_fuzzy_backend_mmap *backend, int fd, gsize len,
+			   GError **err)
+{
+	void *map;
+	struct fuzzy_mmap_hdr *hdr;
+
+	if (len < FUZZY_MMAP_HDR_SIZE) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), EINVAL,
+					"file %s is truncated", backend->path);
+		return FALSE;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), errno,
+					"cannot mmap %s: %s", backend->path, strerror(errno));
+		return FALSE;
+	}
+
+	hdr = (struct fuzzy_mmap_hdr *) map;
+
+	if (memcmp(hdr->magic, FUZZY_MMAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->capacity == 0 || (hdr->capacity & (hdr->capacity - 1)) != 0 ||
+		(hdr->shingles_capacity & (hdr->shingles_capacity - 1)) != 0 ||
+		fuzzy_mmap_file_size(hdr->capacity, hdr->shingles_capacity) > len) {
+		munmap(map, len);
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), EINVAL,
+					"file %s is not a valid fuzzy hashes file", backend->path);
+		return FALSE;
+	}
+
+	backend->fd = fd;
+	backend->len = len;
+	backend->hdr = hdr;
+	backend->slots = (struct fuzzy_mmap_slot *) (((unsigned char *) map) + FUZZY_MMAP_HDR_SIZE);
+	backend->shingles = (struct fuzzy_mmap_shingle *) (backend->slots + hdr->capacity);
+	rspamd_snprintf(backend->id, sizeof(backend->id), "%016xL", hdr->instance_id);
+
+	return TRUE;
+}
+
+/*
+ * Creates and maps a new empty file, all slots are zeroed (empty) by ftruncate
+ */
+static gboolean
+fuzzy_mmap_create(struct rspamd_fuzzy_backend_mmap *backend, int fd,
+				  uint64_t capacity, const struct fuzzy_mmap_hdr *old,
+				  GError **err)
+{
+	gsize len = fuzzy_mmap_file_size(capacity, capacity * FUZZY_MMAP_SHINGLES_MULT);
+	struct fuzzy_mmap_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	fuzzy_mmap_init_hdr(&hdr, capacity, old);
+
+	if (ftruncate(fd, len) == -1 ||
+		pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), errno,
+					"cannot create %s: %s", backend->path, strerror(errno));
+		return FALSE;
+	}
+
+	return fuzzy_mmap_map(backend, fd, len, err);
+}
+
+static gboolean
+fuzzy_mmap_open(struct rspamd_fuzzy_backend_mmap *backend, uint64_t capacity,
+				GError **err)
+{
+	int fd;
+	struct stat st;
+	gboolean ret;
+
+	fd = open(backend->path, O_RDWR | O_CREAT, 00644);
+
+	if (fd == -1) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), errno,
+					"cannot open %s: %s", backend->path, strerror(errno));
+		return FALSE;
+	}
+
+	/* Serialise initialisation with other workers */
+	rspamd_file_lock(fd, FALSE);
+
+	if (fstat(fd, &st) == -1) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(), errno,
+					"cannot stat %s: %s", backend->path, strerror(errno));
+		ret = FALSE;
+	}
+	else if (st.st_size == 0) {
+		ret = fuzzy_mmap_create(backend, fd, capacity, NULL, err);
+	}
+	else {
+		ret = fuzzy_mmap_map(backend, fd, st.st_size, err);
+	}
+
+	rspamd_file_unlock(fd, FALSE);
+
+	if (!ret) {
+		close(fd);
+	}
+
+	return ret;
+}
+
+static void
+fuzzy_mmap_unmap(struct rspamd_fuzzy_backend_mmap *backend)
+{
+	if (backend->hdr) {
+		munmap(backend->hdr, backend->len);
+		backend->hdr = NULL;
+	}
+
+	if (backend->fd != -1) {
+		close(backend->fd);
+		backend->fd = -1;
+	}
+}
+
+/*
+ * Switch to the new file if the current one has been compacted by the writer
+ */
+static void
+fuzzy_mmap_check_stale(struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_backend_mmap nbackend;
+	GError *err = NULL;
+
+	if (G_LIKELY(!__atomic_load_n(&backend->hdr->stale, __ATOMIC_ACQUIRE))) {
+		return;
+	}
+
+	memcpy(&nbackend, backend, sizeof(nbackend));
+	nbackend.fd = -1;
+	nbackend.hdr = NULL;
+
+	if (!fuzzy_mmap_open(&nbackend, backend->hdr->capacity, &err)) {
+		msg_err_fuzzy_backend("cannot reopen compacted hashes: %e", err);
+		g_error_free(err);
+
+		return;
+	}
+
+	fuzzy_mmap_unmap(backend);
+	memcpy(backend, &nbackend, sizeof(nbackend));
+	msg_debug_fuzzy_backend("switched to compacted hashes file, capacity: %L",
+							(int64_t) backend->hdr->capacity);
+}
+
+/*
+ * Writer only: rebuilds tables in a new file removing deleted slots and stale
+ * shingles, then atomically replaces the current file
+ */
+static gboolean
+fuzzy_mmap_compact(struct rspamd_fuzzy_backend_mmap *backend, uint64_t capacity)
+{
+	struct rspamd_fuzzy_backend_mmap nbackend;
+	struct fuzzy_mmap_slot *slot, *nslot;
+	struct fuzzy_mmap_shingle *e;
+	uint32_t *remap;
+	uint64_t i, j, idx, mask;
+	GError *err = NULL;
+	char *tmp_path;
+	int fd;
+
+	tmp_path = g_strdup_printf("%s.new", backend->path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		msg_err_fuzzy_backend("cannot create %s: %s", tmp_path, strerror(errno));
+		g_free(tmp_path);
+
+		return FALSE;
+	}
+
+	memcpy(&nbackend, backend, sizeof(nbackend));
+
+	if (!fuzzy_mmap_create(&nbackend, fd, capacity, backend->hdr, &err)) {
+		msg_err_fuzzy_backend("cannot compact hashes: %e", err);
+		g_error_free(err);
+		close(fd);
+		unlink(tmp_path);
+		g_free(tmp_path);
+
+		return FALSE;
+	}
+
+	remap = g_malloc(sizeof(*remap) * backend->hdr->capacity);
+	mask = capacity - 1;
+
+	for (i = 0; i < backend->hdr->capacity; i++) {
+		slot = &backend->slots[i];
+		remap[i] = G_MAXUINT32;
+
+		if (slot->state != FUZZY_MMAP_SLOT_USED) {
+			continue;
+		}
+
+		idx = fuzzy_mmap_digest_hash(slot->digest) & mask;
+
+		for (j = 0; j < capacity; j++, idx = (idx + 1) & mask) {
+			nslot = &nbackend.slots[idx];
+
+			if (nslot->state == FUZZY_MMAP_SLOT_EMPTY) {
+				memcpy(nslot, slot, sizeof(*nslot));
+				nslot->seq = 0;
+				remap[i] = idx;
+				nbackend.hdr->nused++;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < backend->hdr->shingles_capacity; i++) {
+		e = &backend->shingles[i];
+
+		if (e->band == 0 || e->slot >= backend->hdr->capacity ||
+			remap[e->slot] == G_MAXUINT32 ||
+			backend->slots[e->slot].id != e->id) {
+			/* Shingle of the deleted digest */
+			continue;
+		}
+
+		fuzzy_mmap_insert_shingle(nbackend.shingles, nbackend.hdr->shingles_capacity,
+								  e->hash, e->band - 1, e->id, remap[e->slot]);
+		nbackend.hdr->nshingles++;
+	}
+
+	g_free(remap);
+
+	if (rename(tmp_path, backend->path) == -1) {
+		msg_err_fuzzy_backend("cannot rename %s to %s: %s", tmp_path,
+							  backend->path, strerror(errno));
+		fuzzy_mmap_unmap(&nbackend);
+		unlink(tmp_path);
+		g_free(tmp_path);
+
+		return FALSE;
+	}
+
+	g_free(tmp_path);
+	msg_info_fuzzy_backend("compacted hashes: %L used, %L deleted; capacity %L -> %L",
+						   (int64_t) backend->hdr->nused, (int64_t) backend->hdr->ndeleted,
+						   (int64_t) backend->hdr->capacity, (int64_t) capacity);
+
+	/* Readers will switch to the new file */
+	rspamd_file_lock(nbackend.fd, FALSE);
+	__atomic_store_n(&backend->hdr->stale, 1, __ATOMIC_RELEASE);
+	rspamd_file_unlock(backend->fd, FALSE);
+	fuzzy_mmap_unmap(backend);
+	memcpy(backend, &nbackend, sizeof(nbackend));
+
+	return TRUE;
+}
+
+static struct fuzzy_mmap_source *
+fuzzy_mmap_get_source(struct fuzzy_mmap_hdr *hdr, const char *src, gboolean create)
+{
+	unsigned int i;
+
+	for (i = 0; i < FUZZY_MMAP_MAX_SOURCES; i++) {
+		if (hdr->sources[i].name[0] == '\0') {
+			if (create) {
+				rspamd_strlcpy(hdr->sources[i].name, src, sizeof(hdr->sources[i].name));
+				return &hdr->sources[i];
+			}
+
+			break;
+		}
+
+		if (strncmp(hdr->sources[i].name, src, sizeof(hdr->sources[i].name) - 1) == 0) {
+			return &hdr->sources[i];
+		}
+	}
+
+	return NULL;
+}
+
+void *
+rspamd_fuzzy_backend_init_mmap(struct rspamd_fuzzy_backend *bk,
+							   const ucl_object_t *obj,
+							   struct rspamd_config *cfg,
+							   GError **err)
+{
+	struct rspamd_fuzzy_backend_mmap *backend;
+	const ucl_object_t *elt;
+	uint64_t capacity = FUZZY_MMAP_DEFAULT_CAPACITY, req;
+	const char *path;
+
+	elt = ucl_object_lookup_any(obj, "hashfile", "hash_file", "file",
+								"database", NULL);
+
+	if (elt == NULL || ucl_object_type(elt) != UCL_STRING) {
+		g_set_error(err, rspamd_fuzzy_backend_mmap_quark(),
+					EINVAL, "missing hashes file path");
+		return NULL;
+	}
+
+	path = ucl_object_tostring(elt);
+	elt = ucl_object_lookup(obj, "capacity");
+
+	if (elt != NULL && ucl_object_toint(elt) > 0) {
+		req = ucl_object_toint(elt);
+		capacity = 1024;
+
+		while (capacity < req) {
+			capacity <<= 1u;
+		}
+	}
+
+	backend = g_malloc0(sizeof(*backend));
+	backend->fd = -1;
+	backend->path = g_strdup(path);
+
+	if (!fuzzy_mmap_open(backend, capacity, err)) {
+		g_free(backend->path);
+		g_free(backend);
+
+		return NULL;
+	}
+
+	msg_info_fuzzy_backend("opened %s: %L hashes, capacity %L",
+						   backend->path, (int64_t) backend->hdr->nused,
+						   (int64_t) backend->hdr->capacity);
+
+	return backend;
+}
+
+void rspamd_fuzzy_backend_check_mmap(struct rspamd_fuzzy_backend *bk,
+									 const struct rspamd_fuzzy_cmd *cmd,
+									 rspamd_fuzzy_check_cb cb, void *ud,
+									 void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct fuzzy_mmap_shingle *e;
+	struct fuzzy_mmap_slot snap;
+	struct rspamd_fuzzy_reply rep;
+	uint64_t ids[RSPAMD_SHINGLE_SIZE], mask, idx, j, sel_id = 0;
+	uint32_t slots[RSPAMD_SHINGLE_SIZE], sel_slot = 0, band;
+	unsigned int i, k, nids = 0, cnt, max_cnt = 0;
+	int64_t expire = rspamd_fuzzy_backend_get_expire(bk), now = time(NULL);
+
+	memset(&rep, 0, sizeof(rep));
+	memcpy(rep.digest, cmd->digest, sizeof(rep.digest));
+	fuzzy_mmap_check_stale(backend);
+
+	if (fuzzy_mmap_find(backend, cmd->digest, &snap, NULL) != -1) {
+		if (now - snap.time > expire) {
+			msg_debug_fuzzy_backend("requested hash has been expired");
+		}
+		else {
+			rep.v1.value = snap.value;
+			rep.v1.prob = 1.0;
+			rep.v1.flag = snap.flag;
+			rep.ts = snap.time;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
+		mask = backend->hdr->shingles_capacity - 1;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			idx = fuzzy_mmap_shingle_hash(shcmd->sgl.hashes[i], i) & mask;
+
+			for (j = 0; j < backend->hdr->shingles_capacity; j++, idx = (idx + 1) & mask) {
+				e = &backend->shingles[idx];
+				band = __atomic_load_n(&e->band, __ATOMIC_ACQUIRE);
+
+				if (band == 0) {
+					break;
+				}
+
+				if (band == i + 1 && e->hash == shcmd->sgl.hashes[i] &&
+					fuzzy_mmap_read_slot(&backend->slots[e->slot], &snap) &&
+					snap.state == FUZZY_MMAP_SLOT_USED && snap.id == e->id) {
+					ids[nids] = e->id;
+					slots[nids] = e->slot;
+					nids++;
+					break;
+				}
+			}
+		}
+
+		/* Select the digest referred by the most of shingles */
+		for (i = 0; i < nids; i++) {
+			cnt = 0;
+
+			for (k = 0; k < nids; k++) {
+				if (ids[k] == ids[i]) {
+					cnt++;
+				}
+			}
+
+			if (cnt > max_cnt) {
+				max_cnt = cnt;
+				sel_id = ids[i];
+				sel_slot = slots[i];
+			}
+		}
+
+		if (max_cnt > 0) {
+			rep.v1.prob = (float) max_cnt / (float) RSPAMD_SHINGLE_SIZE;
+
+			if (rep.v1.prob > 0.5 &&
+				fuzzy_mmap_read_slot(&backend->slots[sel_slot], &snap) &&
+				snap.state == FUZZY_MMAP_SLOT_USED && snap.id == sel_id) {
+				msg_debug_fuzzy_backend("found fuzzy hash with probability %.2f",
+										rep.v1.prob);
+
+				if (now - snap.time > expire) {
+					msg_debug_fuzzy_backend("requested hash has been expired");
+					rep.v1.prob = 0.0;
+				}
+				else {
+					rep.ts = snap.time;
+					memcpy(rep.digest, snap.digest, sizeof(rep.digest));
+					rep.v1.value = snap.value;
+					rep.v1.flag = snap.flag;
+				}
+			}
+			else {
+				rep.v1.value = 0;
+			}
+		}
+	}
+
+	if (cb) {
+		cb(&rep, ud);
+	}
+}
+
+static gboolean
+fuzzy_mmap_ensure_space(struct rspamd_fuzzy_backend_mmap *backend,
+						gboolean has_shingles)
+{
+	struct fuzzy_mmap_hdr *hdr = backend->hdr;
+
+	if ((hdr->nused + hdr->ndeleted + 1) > hdr->capacity * FUZZY_MMAP_MAX_LOAD ||
+		(has_shingles &&
+		 (hdr->nshingles + RSPAMD_SHINGLE_SIZE) > hdr->shingles_capacity * FUZZY_MMAP_MAX_LOAD)) {
+		/* Grow only if we cannot get enough space by removing deleted slots */
+		uint64_t ncap = hdr->capacity;
+
+		if ((hdr->nused + 1) > hdr->capacity * FUZZY_MMAP_MAX_LOAD / 2 ||
+			has_shingles) {
+			ncap *= 2;
+		}
+
+		return fuzzy_mmap_compact(backend, ncap);
+	}
+
+	return TRUE;
+}
+
+void rspamd_fuzzy_backend_update_mmap(struct rspamd_fuzzy_backend *bk,
+									  GArray *updates, const char *src,
+									  rspamd_fuzzy_update_cb cb, void *ud,
+									  void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct fuzzy_mmap_source *source;
+	struct fuzzy_mmap_slot snap;
+	int64_t idx, free_idx, now = time(NULL);
+	unsigned int i, band;
+	unsigned int nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0, nignored = 0;
+	gboolean success = TRUE;
+
+	fuzzy_mmap_check_stale(backend);
+	rspamd_file_lock(backend->fd, FALSE);
+
+	for (i = 0; i < updates->len; i++) {
+		io_cmd = &g_array_index(updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+			shcmd = &io_cmd->cmd.shingle;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+			shcmd = NULL;
+		}
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			if (!fuzzy_mmap_ensure_space(backend, shcmd != NULL)) {
+				success = FALSE;
+				break;
+			}
+
+			idx = fuzzy_mmap_find(backend, cmd->digest, &snap, &free_idx);
+
+			if (idx != -1) {
+				if (snap.flag == cmd->flag) {
+					/* We need to increase weight */
+					snap.value += cmd->value;
+				}
+				else {
+					/* We need to relearn actually */
+					snap.value = cmd->value;
+					snap.flag = cmd->flag;
+				}
+
+				snap.time = now;
+				fuzzy_mmap_write_slot(&backend->slots[idx], &snap);
+			}
+			else if (free_idx != -1) {
+				if (backend->slots[free_idx].state == FUZZY_MMAP_SLOT_DELETED) {
+					backend->hdr->ndeleted--;
+				}
+
+				memset(&snap, 0, sizeof(snap));
+				snap.state = FUZZY_MMAP_SLOT_USED;
+				snap.id = backend->hdr->next_id++;
+				snap.time = now;
+				snap.value = cmd->value;
+				snap.flag = cmd->flag;
+				memcpy(snap.digest, cmd->digest, sizeof(snap.digest));
+				fuzzy_mmap_write_slot(&backend->slots[free_idx], &snap);
+				backend->hdr->nused++;
+
+				if (shcmd && cmd->shingles_count > 0) {
+					for (band = 0; band < RSPAMD_SHINGLE_SIZE; band++) {
+						fuzzy_mmap_insert_shingle(backend->shingles,
+												  backend->hdr->shingles_capacity,
+												  shcmd->sgl.hashes[band], band,
+												  snap.id, free_idx);
+					}
+
+					backend->hdr->nshingles += RSPAMD_SHINGLE_SIZE;
+				}
+			}
+			else {
+				/* Cannot happen as we keep load factor below 1 */
+				msg_err_fuzzy_backend("no free slots in hashes table");
+				success = FALSE;
+				break;
+			}
+
+			nadded++;
+			nupdates++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			idx = fuzzy_mmap_find(backend, cmd->digest, &snap, NULL);
+
+			if (idx != -1) {
+				snap.state = FUZZY_MMAP_SLOT_DELETED;
+				fuzzy_mmap_write_slot(&backend->slots[idx], &snap);
+				backend->hdr->nused--;
+				backend->hdr->ndeleted++;
+			}
+
+			ndeleted++;
+			nupdates++;
+		}
+		else if (cmd->cmd == FUZZY_REFRESH) {
+			idx = fuzzy_mmap_find(backend, cmd->digest, &snap, NULL);
+
+			if (idx != -1) {
+				snap.time = now;
+				fuzzy_mmap_write_slot(&backend->slots[idx], &snap);
+			}
+
+			nextended++;
+		}
+		else {
+			nignored++;
+		}
+	}
+
+	if (nupdates > 0 && src) {
+		source = fuzzy_mmap_get_source(backend->hdr, src, TRUE);
+
+		if (source) {
+			source->version++;
+		}
+	}
+
+	rspamd_file_unlock(backend->fd, FALSE);
+
+	if (cb) {
+		cb(success, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+void rspamd_fuzzy_backend_count_mmap(struct rspamd_fuzzy_backend *bk,
+									 rspamd_fuzzy_count_cb cb, void *ud,
+									 void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	fuzzy_mmap_check_stale(backend);
+
+	if (cb) {
+		cb(backend->hdr->nused, ud);
+	}
+}
+
+void rspamd_fuzzy_backend_version_mmap(struct rspamd_fuzzy_backend *bk,
+									   const char *src,
+									   rspamd_fuzzy_version_cb cb, void *ud,
+									   void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct fuzzy_mmap_source *source;
+
+	fuzzy_mmap_check_stale(backend);
+	source = fuzzy_mmap_get_source(backend->hdr, src, FALSE);
+
+	if (cb) {
+		cb(source ? source->version : 0, ud);
+	}
+}
+
+const char *
+rspamd_fuzzy_backend_id_mmap(struct rspamd_fuzzy_backend *bk,
+							 void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	return backend->id;
+}
+
+void rspamd_fuzzy_backend_expire_mmap(struct rspamd_fuzzy_backend *bk,
+									  void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct fuzzy_mmap_slot snap, *slot;
+	int64_t expire = rspamd_fuzzy_backend_get_expire(bk), now = time(NULL);
+	uint64_t i, nexpired = 0;
+
+	fuzzy_mmap_check_stale(backend);
+	rspamd_file_lock(backend->fd, FALSE);
+
+	for (i = 0; i < backend->hdr->capacity; i++) {
+		slot = &backend->slots[i];
+
+		if (slot->state == FUZZY_MMAP_SLOT_USED && now - slot->time > expire) {
+			memcpy(&snap, slot, sizeof(snap));
+			snap.state = FUZZY_MMAP_SLOT_DELETED;
+			fuzzy_mmap_write_slot(slot, &snap);
+			backend->hdr->nused--;
+			backend->hdr->ndeleted++;
+			nexpired++;
+		}
+	}
+
+	if (nexpired > 0) {
+		msg_info_fuzzy_backend("expired %L hashes", (int64_t) nexpired);
+	}
+
+	if (backend->hdr->ndeleted > backend->hdr->capacity / 4) {
+		/* Compaction also drops shingles of the deleted digests */
+		fuzzy_mmap_compact(backend, backend->hdr->capacity);
+	}
+
+	msync(backend->hdr, backend->len, MS_ASYNC);
+	rspamd_file_unlock(backend->fd, FALSE);
+}
+
+void rspamd_fuzzy_backend_close_mmap(struct rspamd_fuzzy_backend *bk,
+									 void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	if (backend->hdr) {
+		msync(backend->hdr, backend->len, MS_ASYNC);
+	}
+
+	fuzzy_mmap_unmap(backend);
+	g_free(backend->path);
+	g_free(backend);
+}
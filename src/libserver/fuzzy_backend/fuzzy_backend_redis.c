@@ -29,6 +29,10 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+/* Maximum number of sessions whose shingles are requested by a single MGET */
+#define REDIS_SHINGLES_BATCH_MAX 16
+/* Flush shingles queue regardless of the window when it is that long */
+#define REDIS_SHINGLES_QUEUE_MAX (REDIS_SHINGLES_BATCH_MAX * 8)
 
 #define msg_err_redis_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL,                \
 															   "fuzzy_redis", session->backend->id, \
@@ -61,6 +65,26 @@ struct rspamd_fuzzy_backend_redis {
 	int conf_ref;
 	bool terminated;
 	ref_entry_t ref;
+	/* Shingles lookups coalescing */
+	struct ev_loop *event_loop;
+	double shingles_batch_window;
+	GPtrArray *pending_shingles;
+	ev_timer shingles_batch_ev;
+};
+
+/* Connection used to send pipelined shingles MGETs for a number of sessions */
+struct rspamd_fuzzy_redis_shingles_pipeline {
+	struct rspamd_fuzzy_backend_redis *backend;
+	redisAsyncContext *ctx;
+	struct upstream *up;
+	ev_timer timeout;
+	unsigned int pending;
+};
+
+struct rspamd_fuzzy_redis_shingles_batch {
+	struct rspamd_fuzzy_redis_shingles_pipeline *pipeline;
+	unsigned int nsessions;
+	struct rspamd_fuzzy_redis_session *sessions[REDIS_SHINGLES_BATCH_MAX];
 };
 
 enum rspamd_fuzzy_redis_command {
@@ -180,9 +204,15 @@ rspamd_fuzzy_backend_redis_dtor(struct rspamd_fuzzy_backend_redis *backend)
 		g_free(backend->id);
 	}
 
+	if (backend->pending_shingles) {
+		g_ptr_array_free(backend->pending_shingles, TRUE);
+	}
+
 	g_free(backend);
 }
 
+static void rspamd_fuzzy_redis_shingles_batch_cb(EV_P_ ev_timer *w, int revents);
+
 void *
 rspamd_fuzzy_backend_init_redis(struct rspamd_fuzzy_backend *bk,
 								const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
@@ -275,6 +305,18 @@ rspamd_fuzzy_backend_init_redis(struct rspamd_fuzzy_backend *bk,
 
 	lua_settop(L, 0);
 
+	elt = ucl_object_lookup(obj, "shingles_batch_window");
+
+	if (elt != NULL && ucl_object_todouble(elt) > 0) {
+		/* Microseconds */
+		backend->shingles_batch_window = ucl_object_todouble(elt) / 1e6;
+		backend->pending_shingles = g_ptr_array_sized_new(REDIS_SHINGLES_QUEUE_MAX);
+		backend->event_loop = rspamd_fuzzy_backend_event_base(bk);
+		ev_timer_init(&backend->shingles_batch_ev, rspamd_fuzzy_redis_shingles_batch_cb,
+					  backend->shingles_batch_window, 0.0);
+		backend->shingles_batch_ev.data = backend;
+	}
+
 	REF_INIT_RETAIN(backend, rspamd_fuzzy_backend_redis_dtor);
 	backend->pool = cfg->redis_pool;
 	rspamd_cryptobox_hash_init(&st, NULL, 0);
@@ -341,124 +383,147 @@ rspamd_fuzzy_backend_redis_shingles_cmp(const void *a, const void *b)
 	return memcmp(sha->digest, shb->digest, sizeof(sha->digest));
 }
 
+/*
+ * Processes RSPAMD_SHINGLE_SIZE elements of MGET reply, session is either
+ * continued with the digest check or finished
+ */
 static void
-rspamd_fuzzy_redis_shingles_callback(redisAsyncContext *c, gpointer r,
-									 gpointer priv)
+rspamd_fuzzy_redis_shingles_process(struct rspamd_fuzzy_redis_session *session,
+									redisReply **elements)
 {
-	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
+	redisReply *cur;
 	struct rspamd_fuzzy_reply rep;
 	GString *key;
 	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
 	unsigned int i, found = 0, max_found = 0, cur_found = 0;
 
-	ev_timer_stop(session->event_loop, &session->timeout);
 	memset(&rep, 0, sizeof(rep));
+	shingles = g_alloca(sizeof(struct _rspamd_fuzzy_shingles_helper) *
+						RSPAMD_SHINGLE_SIZE);
 
-	if (c->err == 0 && reply != NULL) {
-		rspamd_upstream_ok(session->up);
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		cur = elements[i];
 
-		if (reply->type == REDIS_REPLY_ARRAY &&
-			reply->elements == RSPAMD_SHINGLE_SIZE) {
-			shingles = g_alloca(sizeof(struct _rspamd_fuzzy_shingles_helper) *
-								RSPAMD_SHINGLE_SIZE);
+		if (cur->type == REDIS_REPLY_STRING) {
+			shingles[i].found = 1;
+			memcpy(shingles[i].digest, cur->str, MIN(64, cur->len));
+			found++;
+		}
+		else {
+			memset(shingles[i].digest, 0, sizeof(shingles[i].digest));
+			shingles[i].found = 0;
+		}
+	}
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-				cur = reply->element[i];
+	if (found > RSPAMD_SHINGLE_SIZE / 2) {
+		/* Now sort to find the most frequent element */
+		qsort(shingles, RSPAMD_SHINGLE_SIZE,
+			  sizeof(struct _rspamd_fuzzy_shingles_helper),
+			  rspamd_fuzzy_backend_redis_shingles_cmp);
 
-				if (cur->type == REDIS_REPLY_STRING) {
-					shingles[i].found = 1;
-					memcpy(shingles[i].digest, cur->str, MIN(64, cur->len));
-					found++;
-				}
-				else {
-					memset(shingles[i].digest, 0, sizeof(shingles[i].digest));
-					shingles[i].found = 0;
-				}
+		prev = &shingles[0];
+
+		for (i = 1; i < RSPAMD_SHINGLE_SIZE; i++) {
+			if (!shingles[i].found) {
+				continue;
 			}
 
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
-				/* Now sort to find the most frequent element */
-				qsort(shingles, RSPAMD_SHINGLE_SIZE,
-					  sizeof(struct _rspamd_fuzzy_shingles_helper),
-					  rspamd_fuzzy_backend_redis_shingles_cmp);
-
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i++) {
-					if (!shingles[i].found) {
-						continue;
-					}
-
-					if (memcmp(shingles[i].digest, prev->digest, 64) == 0) {
-						cur_found++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
-					}
-					else {
-						cur_found = 1;
-						prev = &shingles[i];
-					}
+			if (memcmp(shingles[i].digest, prev->digest, 64) == 0) {
+				cur_found++;
+
+				if (cur_found > max_found) {
+					max_found = cur_found;
+					sel = &shingles[i];
 				}
+			}
+			else {
+				cur_found = 1;
+				prev = &shingles[i];
+			}
+		}
+
+		if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
+			session->prob = ((float) max_found) / RSPAMD_SHINGLE_SIZE;
+			rep.v1.prob = session->prob;
+
+			g_assert(sel != NULL);
+
+			/* Prepare new check command */
+			rspamd_fuzzy_redis_session_free_args(session);
+			session->nargs = 5;
+			session->argv = g_malloc(sizeof(char *) * session->nargs);
+			session->argv_lens = g_malloc(sizeof(gsize) * session->nargs);
+
+			key = g_string_new(session->backend->redis_object);
+			g_string_append_len(key, sel->digest, sizeof(sel->digest));
+			session->argv[0] = g_strdup("HMGET");
+			session->argv_lens[0] = 5;
+			session->argv[1] = key->str;
+			session->argv_lens[1] = key->len;
+			session->argv[2] = g_strdup("V");
+			session->argv_lens[2] = 1;
+			session->argv[3] = g_strdup("F");
+			session->argv_lens[3] = 1;
+			session->argv[4] = g_strdup("C");
+			session->argv_lens[4] = 1;
+			g_string_free(key, FALSE); /* Do not free underlying array */
+			memcpy(session->found_digest, sel->digest,
+				   sizeof(session->cmd->digest));
+
+			g_assert(session->ctx != NULL);
+			if (redisAsyncCommandArgv(session->ctx,
+									  rspamd_fuzzy_redis_check_callback,
+									  session, session->nargs,
+									  (const char **) session->argv,
+									  session->argv_lens) != REDIS_OK) {
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float) max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.v1.prob = session->prob;
-
-					g_assert(sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args(session);
-					session->nargs = 5;
-					session->argv = g_malloc(sizeof(char *) * session->nargs);
-					session->argv_lens = g_malloc(sizeof(gsize) * session->nargs);
-
-					key = g_string_new(session->backend->redis_object);
-					g_string_append_len(key, sel->digest, sizeof(sel->digest));
-					session->argv[0] = g_strdup("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup("F");
-					session->argv_lens[3] = 1;
-					session->argv[4] = g_strdup("C");
-					session->argv_lens[4] = 1;
-					g_string_free(key, FALSE); /* Do not free underlying array */
-					memcpy(session->found_digest, sel->digest,
-						   sizeof(session->cmd->digest));
-
-					g_assert(session->ctx != NULL);
-					if (redisAsyncCommandArgv(session->ctx,
-											  rspamd_fuzzy_redis_check_callback,
-											  session, session->nargs,
-											  (const char **) session->argv,
-											  session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset(&rep, 0, sizeof(rep));
-							session->callback.cb_check(&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor(session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						session->timeout.data = session;
-						ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
-						ev_timer_init(&session->timeout,
-									  rspamd_fuzzy_redis_timeout,
-									  session->backend->timeout, 0.0);
-						ev_timer_start(session->event_loop, &session->timeout);
-					}
-
-					return;
+				if (session->callback.cb_check) {
+					memset(&rep, 0, sizeof(rep));
+					session->callback.cb_check(&rep, session->cbdata);
 				}
+
+				rspamd_fuzzy_redis_session_dtor(session, TRUE);
 			}
+			else {
+				/* Add timeout */
+				session->timeout.data = session;
+				ev_now_update_if_cheap((struct ev_loop *) session->event_loop);
+				ev_timer_init(&session->timeout,
+							  rspamd_fuzzy_redis_timeout,
+							  session->backend->timeout, 0.0);
+				ev_timer_start(session->event_loop, &session->timeout);
+			}
+
+			return;
+		}
+	}
+
+	if (session->callback.cb_check) {
+		session->callback.cb_check(&rep, session->cbdata);
+	}
+
+	rspamd_fuzzy_redis_session_dtor(session, FALSE);
+}
+
+static void
+rspamd_fuzzy_redis_shingles_callback(redisAsyncContext *c, gpointer r,
+									 gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r;
+	struct rspamd_fuzzy_reply rep;
+
+	ev_timer_stop(session->event_loop, &session->timeout);
+	memset(&rep, 0, sizeof(rep));
+
+	if (c->err == 0 && reply != NULL) {
+		rspamd_upstream_ok(session->up);
+
+		if (reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == RSPAMD_SHINGLE_SIZE) {
+			rspamd_fuzzy_redis_shingles_process(session, reply->element);
+
+			return;
 		}
 		else if (reply->type == REDIS_REPLY_ERROR) {
 			msg_err_redis_session("fuzzy backend redis error: \"%s\"",
@@ -483,6 +548,248 @@ rspamd_fuzzy_redis_shingles_callback(redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor(session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_shingles_fail(struct rspamd_fuzzy_redis_session *session)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	if (session->callback.cb_check) {
+		memset(&rep, 0, sizeof(rep));
+		session->callback.cb_check(&rep, session->cbdata);
+	}
+
+	rspamd_fuzzy_redis_session_dtor(session, FALSE);
+}
+
+static void
+rspamd_fuzzy_redis_pipeline_unref(struct rspamd_fuzzy_redis_shingles_pipeline *pipeline)
+{
+	redisAsyncContext *ac;
+
+	if (--pipeline->pending > 0) {
+		return;
+	}
+
+	ev_timer_stop(pipeline->backend->event_loop, &pipeline->timeout);
+
+	if (pipeline->ctx) {
+		ac = pipeline->ctx;
+		pipeline->ctx = NULL;
+		rspamd_redis_pool_release_connection(pipeline->backend->pool,
+											 ac, RSPAMD_REDIS_RELEASE_DEFAULT);
+	}
+
+	rspamd_upstream_unref(pipeline->up);
+	REF_RELEASE(pipeline->backend);
+	g_free(pipeline);
+}
+
+static void
+rspamd_fuzzy_redis_pipeline_timeout(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_redis_shingles_pipeline *pipeline =
+		(struct rspamd_fuzzy_redis_shingles_pipeline *) w->data;
+	redisAsyncContext *ac;
+	static char errstr[128];
+
+	if (pipeline->ctx) {
+		ac = pipeline->ctx;
+		pipeline->ctx = NULL;
+		ac->err = REDIS_ERR_IO;
+		rspamd_snprintf(errstr, sizeof(errstr), "%s", strerror(ETIMEDOUT));
+		ac->errstr = errstr;
+
+		/* This will call all pending batches callbacks */
+		rspamd_redis_pool_release_connection(pipeline->backend->pool,
+											 ac, RSPAMD_REDIS_RELEASE_FATAL);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_batch_callback(redisAsyncContext *c, gpointer r,
+								  gpointer priv)
+{
+	struct rspamd_fuzzy_redis_shingles_batch *batch = priv;
+	struct rspamd_fuzzy_redis_shingles_pipeline *pipeline = batch->pipeline;
+	redisReply *reply = r;
+	unsigned int i;
+
+	if (c->err == 0 && reply != NULL) {
+		rspamd_upstream_ok(pipeline->up);
+
+		if (reply->type == REDIS_REPLY_ARRAY &&
+			reply->elements == batch->nsessions * RSPAMD_SHINGLE_SIZE) {
+			/* Split reply between sessions */
+			for (i = 0; i < batch->nsessions; i++) {
+				rspamd_fuzzy_redis_shingles_process(batch->sessions[i],
+													&reply->element[i * RSPAMD_SHINGLE_SIZE]);
+			}
+
+			g_free(batch);
+			rspamd_fuzzy_redis_pipeline_unref(pipeline);
+
+			return;
+		}
+		else if (reply->type == REDIS_REPLY_ERROR) {
+			msg_err("fuzzy backend redis error: \"%s\"", reply->str);
+		}
+	}
+	else if (c->errstr) {
+		msg_err("error getting shingles for %ud sessions: %s", batch->nsessions,
+				c->errstr);
+		rspamd_upstream_fail(pipeline->up, FALSE, c->errstr);
+	}
+
+	for (i = 0; i < batch->nsessions; i++) {
+		rspamd_fuzzy_redis_shingles_fail(batch->sessions[i]);
+	}
+
+	g_free(batch);
+	rspamd_fuzzy_redis_pipeline_unref(pipeline);
+}
+
+/*
+ * Sends shingles of all queued sessions as pipelined MGET commands over a single
+ * connection, each MGET covers up to REDIS_SHINGLES_BATCH_MAX sessions
+ */
+static void
+rspamd_fuzzy_redis_flush_shingles(struct rspamd_fuzzy_backend_redis *backend)
+{
+	struct rspamd_fuzzy_redis_shingles_pipeline *pipeline;
+	struct rspamd_fuzzy_redis_shingles_batch *batch;
+	struct rspamd_fuzzy_redis_session *session;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct upstream_list *ups;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	GPtrArray *queue;
+	GString *key;
+	char **argv;
+	gsize *argv_lens;
+	unsigned int i, j, k, nargs;
+
+	ev_timer_stop(backend->event_loop, &backend->shingles_batch_ev);
+
+	if (backend->pending_shingles->len == 0) {
+		return;
+	}
+
+	queue = backend->pending_shingles;
+	backend->pending_shingles = g_ptr_array_sized_new(REDIS_SHINGLES_QUEUE_MAX);
+	ups = rspamd_redis_get_servers(backend, "read_servers");
+	up = ups ? rspamd_upstream_get(ups, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0) : NULL;
+	pipeline = NULL;
+
+	if (up) {
+		addr = rspamd_upstream_addr_next(up);
+		g_assert(addr != NULL);
+		pipeline = g_malloc0(sizeof(*pipeline));
+		pipeline->backend = backend;
+		REF_RETAIN(backend);
+		pipeline->up = rspamd_upstream_ref(up);
+		/* Hold pipeline until all commands are sent */
+		pipeline->pending = 1;
+		pipeline->ctx = rspamd_redis_pool_connect(backend->pool,
+												  backend->dbname,
+												  backend->username, backend->password,
+												  rspamd_inet_address_to_string(addr),
+												  rspamd_inet_address_get_port(addr));
+
+		if (pipeline->ctx == NULL) {
+			rspamd_upstream_fail(up, TRUE, strerror(errno));
+		}
+	}
+
+	for (i = 0; i < queue->len; i += REDIS_SHINGLES_BATCH_MAX) {
+		batch = g_malloc0(sizeof(*batch));
+		batch->pipeline = pipeline;
+		batch->nsessions = MIN(queue->len - i, REDIS_SHINGLES_BATCH_MAX);
+
+		for (j = 0; j < batch->nsessions; j++) {
+			batch->sessions[j] = g_ptr_array_index(queue, i + j);
+		}
+
+		if (pipeline == NULL || pipeline->ctx == NULL) {
+			for (j = 0; j < batch->nsessions; j++) {
+				rspamd_fuzzy_redis_shingles_fail(batch->sessions[j]);
+			}
+
+			g_free(batch);
+			continue;
+		}
+
+		nargs = batch->nsessions * RSPAMD_SHINGLE_SIZE + 1;
+		argv = g_malloc(sizeof(char *) * nargs);
+		argv_lens = g_malloc(sizeof(gsize) * nargs);
+		argv[0] = g_strdup("MGET");
+		argv_lens[0] = 4;
+
+		for (j = 0; j < batch->nsessions; j++) {
+			session = batch->sessions[j];
+			shcmd = (const struct rspamd_fuzzy_shingle_cmd *) session->cmd;
+
+			for (k = 0; k < RSPAMD_SHINGLE_SIZE; k++) {
+				key = g_string_sized_new(strlen(backend->redis_object) + 2 + 2 +
+										 sizeof("18446744073709551616"));
+				rspamd_printf_gstring(key, "%s_%d_%uL", backend->redis_object,
+									  k, shcmd->sgl.hashes[k]);
+				argv[j * RSPAMD_SHINGLE_SIZE + k + 1] = key->str;
+				argv_lens[j * RSPAMD_SHINGLE_SIZE + k + 1] = key->len;
+				g_string_free(key, FALSE); /* Do not free underlying array */
+			}
+		}
+
+		/* Hiredis copies command to its output buffer */
+		if (redisAsyncCommandArgv(pipeline->ctx, rspamd_fuzzy_redis_batch_callback,
+								  batch, nargs,
+								  (const char **) argv, argv_lens) != REDIS_OK) {
+			msg_err("cannot execute redis command on %s: %s",
+					rspamd_inet_address_to_string_pretty(rspamd_upstream_addr_cur(up)),
+					pipeline->ctx->errstr);
+
+			for (j = 0; j < batch->nsessions; j++) {
+				rspamd_fuzzy_redis_shingles_fail(batch->sessions[j]);
+			}
+
+			g_free(batch);
+		}
+		else {
+			pipeline->pending++;
+		}
+
+		for (j = 0; j < nargs; j++) {
+			g_free(argv[j]);
+		}
+
+		g_free(argv);
+		g_free(argv_lens);
+	}
+
+	g_ptr_array_free(queue, TRUE);
+
+	if (pipeline) {
+		if (pipeline->pending > 1) {
+			pipeline->timeout.data = pipeline;
+			ev_now_update_if_cheap(backend->event_loop);
+			ev_timer_init(&pipeline->timeout,
+						  rspamd_fuzzy_redis_pipeline_timeout,
+						  backend->timeout, 0.0);
+			ev_timer_start(backend->event_loop, &pipeline->timeout);
+		}
+
+		rspamd_fuzzy_redis_pipeline_unref(pipeline);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_shingles_batch_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_fuzzy_backend_redis *backend =
+		(struct rspamd_fuzzy_backend_redis *) w->data;
+
+	rspamd_fuzzy_redis_flush_shingles(backend);
+}
+
 static void
 rspamd_fuzzy_backend_check_shingles(struct rspamd_fuzzy_redis_session *session)
 {
@@ -490,6 +797,25 @@ rspamd_fuzzy_backend_check_shingles(struct rspamd_fuzzy_redis_session *session)
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 	GString *key;
 	unsigned int i, init_len;
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+
+	if (backend->pending_shingles) {
+		/* Coalesce shingles of all sessions arriving within the window */
+		session->shingles_checked = TRUE;
+		g_ptr_array_add(backend->pending_shingles, session);
+
+		if (backend->pending_shingles->len >= REDIS_SHINGLES_QUEUE_MAX) {
+			rspamd_fuzzy_redis_flush_shingles(backend);
+		}
+		else if (!ev_is_active(&backend->shingles_batch_ev)) {
+			ev_now_update_if_cheap(backend->event_loop);
+			ev_timer_set(&backend->shingles_batch_ev,
+						 backend->shingles_batch_window, 0.0);
+			ev_timer_start(backend->event_loop, &backend->shingles_batch_ev);
+		}
+
+		return;
+	}
 
 	rspamd_fuzzy_redis_session_free_args(session);
 	/* First of all check digest */
@@ -0,0 +1,527 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_delta.h"
+#include "unix-std.h"
+
+#ifdef SYS_ZSTD
+#include "zstd.h"
+#else
+#include "contrib/zstd/zstd.h"
+#endif
+
+#include <sys/uio.h>
+
+#define RSPAMD_FUZZY_DELTA_MAGIC 0x31747a66u /* "fzt1" */
+/* Compression level: deltas are written once and read many times */
+#define RSPAMD_FUZZY_DELTA_ZSTD_LEVEL 3
+/* Sanity limit for a single frame */
+#define RSPAMD_FUZZY_DELTA_MAX_CMDS (1u << 20u)
+
+RSPAMD_PACKED(rspamd_fuzzy_delta_frame)
+{
+	uint32_t magic;
+	uint32_t ncmds;
+	uint64_t version;
+	uint64_t prev_version;
+	uint32_t clen;
+	uint32_t reserved;
+};
+
+struct rspamd_fuzzy_delta_entry {
+	uint64_t version;
+	uint64_t prev_version;
+	uint64_t offset;
+	uint32_t len; /* including header */
+	int fd;
+};
+
+struct rspamd_fuzzy_delta_log {
+	char *path;
+	int fd;
+	int old_fd;
+	gsize size;
+	gsize max_size;
+	GArray *index; /* struct rspamd_fuzzy_delta_entry, ordered by version */
+};
+
+GQuark
+rspamd_fuzzy_delta_quark(void)
+{
+	return g_quark_from_static_string("fuzzy-delta");
+}
+
+static gboolean
+rspamd_fuzzy_delta_frame_valid(const struct rspamd_fuzzy_delta_frame *hdr)
+{
+	return hdr->magic == RSPAMD_FUZZY_DELTA_MAGIC &&
+		   hdr->ncmds > 0 && hdr->ncmds <= RSPAMD_FUZZY_DELTA_MAX_CMDS &&
+		   hdr->version > hdr->prev_version &&
+		   hdr->clen <= ZSTD_compressBound((gsize) hdr->ncmds * sizeof(struct fuzzy_peer_cmd));
+}
+
+/*
+ * Scans frames of a log file, truncated frame at the end (e.g. after crash) is
+ * removed if the file is writable
+ */
+static gboolean
+rspamd_fuzzy_delta_log_scan(struct rspamd_fuzzy_delta_log *log, int fd,
+							gboolean writable, gsize *psize, GError **err)
+{
+	struct rspamd_fuzzy_delta_frame hdr;
+	struct rspamd_fuzzy_delta_entry entry;
+	struct stat st;
+	uint64_t offset = 0;
+
+	if (fstat(fd, &st) == -1) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+					"cannot stat %s: %s", log->path, strerror(errno));
+		return FALSE;
+	}
+
+	while (offset + sizeof(hdr) <= (uint64_t) st.st_size) {
+		if (pread(fd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+			g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+						"cannot read %s: %s", log->path, strerror(errno));
+			return FALSE;
+		}
+
+		if (!rspamd_fuzzy_delta_frame_valid(&hdr) ||
+			offset + sizeof(hdr) + hdr.clen > (uint64_t) st.st_size) {
+			break;
+		}
+
+		if (log->index->len > 0 &&
+			g_array_index(log->index, struct rspamd_fuzzy_delta_entry,
+						  log->index->len - 1)
+					.version >= hdr.version) {
+			break;
+		}
+
+		entry.version = hdr.version;
+		entry.prev_version = hdr.prev_version;
+		entry.offset = offset;
+		entry.len = sizeof(hdr) + hdr.clen;
+		entry.fd = fd;
+		g_array_append_val(log->index, entry);
+		offset += entry.len;
+	}
+
+	if (offset != (uint64_t) st.st_size) {
+		msg_warn("delta log %s has %L garbage bytes at the end", log->path,
+				 (int64_t) (st.st_size - offset));
+
+		if (writable && ftruncate(fd, offset) == -1) {
+			g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+						"cannot truncate %s: %s", log->path, strerror(errno));
+			return FALSE;
+		}
+	}
+
+	*psize = offset;
+
+	return TRUE;
+}
+
+struct rspamd_fuzzy_delta_log *
+rspamd_fuzzy_delta_log_open(const char *path, gsize max_size, GError **err)
+{
+	struct rspamd_fuzzy_delta_log *log;
+	char *old_path;
+	gsize old_size;
+
+	log = g_malloc0(sizeof(*log));
+	log->path = g_strdup(path);
+	log->max_size = max_size;
+	log->fd = -1;
+	log->old_fd = -1;
+	log->index = g_array_new(FALSE, FALSE, sizeof(struct rspamd_fuzzy_delta_entry));
+
+	old_path = g_strdup_printf("%s.old", path);
+	log->old_fd = open(old_path, O_RDONLY);
+	g_free(old_path);
+
+	if (log->old_fd != -1 &&
+		!rspamd_fuzzy_delta_log_scan(log, log->old_fd, FALSE, &old_size, err)) {
+		rspamd_fuzzy_delta_log_close(log);
+
+		return NULL;
+	}
+
+	log->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 00644);
+
+	if (log->fd == -1) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+					"cannot open %s: %s", path, strerror(errno));
+		rspamd_fuzzy_delta_log_close(log);
+
+		return NULL;
+	}
+
+	if (!rspamd_fuzzy_delta_log_scan(log, log->fd, TRUE, &log->size, err)) {
+		rspamd_fuzzy_delta_log_close(log);
+
+		return NULL;
+	}
+
+	return log;
+}
+
+uint64_t
+rspamd_fuzzy_delta_log_version(struct rspamd_fuzzy_delta_log *log)
+{
+	if (log->index->len == 0) {
+		return 0;
+	}
+
+	return g_array_index(log->index, struct rspamd_fuzzy_delta_entry,
+						 log->index->len - 1)
+		.version;
+}
+
+static void
+rspamd_fuzzy_delta_log_rotate(struct rspamd_fuzzy_delta_log *log)
+{
+	struct rspamd_fuzzy_delta_entry *entry;
+	char *old_path;
+	unsigned int i, nold = 0;
+	int fd;
+
+	old_path = g_strdup_printf("%s.old", log->path);
+
+	if (rename(log->path, old_path) == -1) {
+		msg_err("cannot rotate delta log %s: %s", log->path, strerror(errno));
+		g_free(old_path);
+
+		return;
+	}
+
+	g_free(old_path);
+	fd = open(log->path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 00644);
+
+	if (fd == -1) {
+		msg_err("cannot create delta log %s: %s", log->path, strerror(errno));
+
+		return;
+	}
+
+	/* Frames of the previous old file are dropped */
+	for (i = 0; i < log->index->len; i++) {
+		entry = &g_array_index(log->index, struct rspamd_fuzzy_delta_entry, i);
+
+		if (entry->fd == log->old_fd) {
+			nold++;
+		}
+	}
+
+	if (nold > 0) {
+		g_array_remove_range(log->index, 0, nold);
+	}
+
+	if (log->old_fd != -1) {
+		close(log->old_fd);
+	}
+
+	log->old_fd = log->fd;
+	log->fd = fd;
+	log->size = 0;
+	msg_info("rotated delta log %s, %ud frames are kept", log->path,
+			 log->index->len);
+}
+
+static gboolean
+rspamd_fuzzy_delta_log_write(struct rspamd_fuzzy_delta_log *log,
+							 const struct rspamd_fuzzy_delta_frame *hdr,
+							 const void *data,
+							 GError **err)
+{
+	struct rspamd_fuzzy_delta_entry entry;
+	struct iovec iov[2];
+	gssize r;
+
+	iov[0].iov_base = (void *) hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = hdr->clen;
+
+	r = writev(log->fd, iov, G_N_ELEMENTS(iov));
+
+	if (r != (gssize) (sizeof(*hdr) + hdr->clen)) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+					"cannot write %s: %s", log->path,
+					r == -1 ? strerror(errno) : "short write");
+
+		/* Do not leave partial frames */
+		if (ftruncate(log->fd, log->size) == -1) {
+			msg_err("cannot truncate %s: %s", log->path, strerror(errno));
+		}
+
+		return FALSE;
+	}
+
+	entry.version = hdr->version;
+	entry.prev_version = hdr->prev_version;
+	entry.offset = log->size;
+	entry.len = r;
+	entry.fd = log->fd;
+	g_array_append_val(log->index, entry);
+	log->size += r;
+
+	if (log->size > log->max_size) {
+		rspamd_fuzzy_delta_log_rotate(log);
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_delta_log_append(struct rspamd_fuzzy_delta_log *log,
+							  uint64_t version,
+							  const struct fuzzy_peer_cmd *cmds,
+							  gsize ncmds,
+							  GError **err)
+{
+	struct rspamd_fuzzy_delta_frame hdr;
+	gsize clen, srclen = ncmds * sizeof(*cmds);
+	void *cbuf;
+	gboolean ret;
+
+	if (ncmds == 0) {
+		return TRUE;
+	}
+
+	if (ncmds > RSPAMD_FUZZY_DELTA_MAX_CMDS ||
+		version <= rspamd_fuzzy_delta_log_version(log)) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+					"invalid frame: %uL commands, version %uL, log version %uL",
+					(uint64_t) ncmds, version, rspamd_fuzzy_delta_log_version(log));
+		return FALSE;
+	}
+
+	cbuf = g_malloc(ZSTD_compressBound(srclen));
+	clen = ZSTD_compress(cbuf, ZSTD_compressBound(srclen), cmds, srclen,
+						 RSPAMD_FUZZY_DELTA_ZSTD_LEVEL);
+
+	if (ZSTD_isError(clen)) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+					"cannot compress frame: %s", ZSTD_getErrorName(clen));
+		g_free(cbuf);
+
+		return FALSE;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RSPAMD_FUZZY_DELTA_MAGIC;
+	hdr.ncmds = ncmds;
+	hdr.version = version;
+	hdr.prev_version = rspamd_fuzzy_delta_log_version(log);
+	hdr.clen = clen;
+
+	ret = rspamd_fuzzy_delta_log_write(log, &hdr, cbuf, err);
+	g_free(cbuf);
+
+	return ret;
+}
+
+/*
+ * Iterates over frames checking that they form a chain starting from `from`
+ */
+static const struct rspamd_fuzzy_delta_frame *
+rspamd_fuzzy_delta_next_frame(const unsigned char **pdata, gsize *plen,
+							  uint64_t prev, GError **err)
+{
+	struct rspamd_fuzzy_delta_frame *hdr;
+
+	if (*plen < sizeof(*hdr)) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+					"truncated frame header");
+		return NULL;
+	}
+
+	hdr = (struct rspamd_fuzzy_delta_frame *) *pdata;
+
+	if (!rspamd_fuzzy_delta_frame_valid(hdr) || *plen < sizeof(*hdr) + hdr->clen) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+					"invalid frame");
+		return NULL;
+	}
+
+	if (hdr->prev_version != prev) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_GONE,
+					"frame %uL follows version %uL, expected %uL",
+					hdr->version, hdr->prev_version, prev);
+		return NULL;
+	}
+
+	*pdata += sizeof(*hdr) + hdr->clen;
+	*plen -= sizeof(*hdr) + hdr->clen;
+
+	return hdr;
+}
+
+gboolean
+rspamd_fuzzy_delta_log_append_frames(struct rspamd_fuzzy_delta_log *log,
+									 const unsigned char *data,
+									 gsize len,
+									 GError **err)
+{
+	const struct rspamd_fuzzy_delta_frame *hdr;
+
+	while (len > 0) {
+		hdr = rspamd_fuzzy_delta_next_frame(&data, &len,
+											rspamd_fuzzy_delta_log_version(log), err);
+
+		if (hdr == NULL ||
+			!rspamd_fuzzy_delta_log_write(log, hdr, ((const unsigned char *) hdr) + sizeof(*hdr),
+										  err)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+rspamd_fstring_t *
+rspamd_fuzzy_delta_log_read(struct rspamd_fuzzy_delta_log *log,
+							uint64_t from,
+							gsize max_len,
+							GError **err)
+{
+	struct rspamd_fuzzy_delta_entry *entry;
+	rspamd_fstring_t *res;
+	unsigned int i, start;
+
+	if (from == rspamd_fuzzy_delta_log_version(log)) {
+		return rspamd_fstring_new();
+	}
+
+	/* Frames are ordered, so we can find the next frame by a binary search */
+	start = 0;
+	i = log->index->len;
+
+	while (start < i) {
+		unsigned int mid = start + (i - start) / 2;
+
+		entry = &g_array_index(log->index, struct rspamd_fuzzy_delta_entry, mid);
+
+		if (entry->version <= from) {
+			start = mid + 1;
+		}
+		else {
+			i = mid;
+		}
+	}
+
+	if (start >= log->index->len ||
+		g_array_index(log->index, struct rspamd_fuzzy_delta_entry, start).prev_version != from) {
+		g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_GONE,
+					"version %uL is not available in delta log", from);
+		return NULL;
+	}
+
+	res = rspamd_fstring_sized_new(MIN(max_len, log->size));
+
+	for (i = start; i < log->index->len; i++) {
+		entry = &g_array_index(log->index, struct rspamd_fuzzy_delta_entry, i);
+
+		if (i > start && res->len + entry->len > max_len) {
+			break;
+		}
+
+		if (res->allocated < res->len + entry->len) {
+			res = rspamd_fstring_grow(res, entry->len);
+		}
+
+		if (pread(entry->fd, res->str + res->len, entry->len, entry->offset) !=
+			(gssize) entry->len) {
+			g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_IO,
+						"cannot read %s: %s", log->path, strerror(errno));
+			rspamd_fstring_free(res);
+
+			return NULL;
+		}
+
+		res->len += entry->len;
+	}
+
+	return res;
+}
+
+GArray *
+rspamd_fuzzy_delta_decode(const unsigned char *data,
+						  gsize len,
+						  uint64_t from,
+						  uint64_t *last_version,
+						  GError **err)
+{
+	const struct rspamd_fuzzy_delta_frame *hdr;
+	GArray *res;
+	gsize r, dlen;
+
+	res = g_array_new(FALSE, FALSE, sizeof(struct fuzzy_peer_cmd));
+
+	while (len > 0) {
+		hdr = rspamd_fuzzy_delta_next_frame(&data, &len, from, err);
+
+		if (hdr == NULL) {
+			g_array_free(res, TRUE);
+
+			return NULL;
+		}
+
+		dlen = (gsize) hdr->ncmds * sizeof(struct fuzzy_peer_cmd);
+		g_array_set_size(res, res->len + hdr->ncmds);
+		r = ZSTD_decompress(&g_array_index(res, struct fuzzy_peer_cmd,
+										   res->len - hdr->ncmds),
+							dlen, ((const unsigned char *) hdr) + sizeof(*hdr),
+							hdr->clen);
+
+		if (ZSTD_isError(r) || r != dlen) {
+			g_set_error(err, rspamd_fuzzy_delta_quark(), RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+						"cannot decompress frame %uL: %s", hdr->version,
+						ZSTD_isError(r) ? ZSTD_getErrorName(r) : "bad length");
+			g_array_free(res, TRUE);
+
+			return NULL;
+		}
+
+		from = hdr->version;
+	}
+
+	if (last_version) {
+		*last_version = from;
+	}
+
+	return res;
+}
+
+void rspamd_fuzzy_delta_log_close(struct rspamd_fuzzy_delta_log *log)
+{
+	if (log->fd != -1) {
+		fsync(log->fd);
+		close(log->fd);
+	}
+
+	if (log->old_fd != -1) {
+		close(log->old_fd);
+	}
+
+	g_array_free(log->index, TRUE);
+	g_free(log->path);
+	g_free(log);
+}
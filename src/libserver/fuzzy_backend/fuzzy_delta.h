@@ -0,0 +1,103 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SRC_LIBSERVER_FUZZY_BACKEND_FUZZY_DELTA_H_
+#define SRC_LIBSERVER_FUZZY_BACKEND_FUZZY_DELTA_H_
+
+#include "config.h"
+#include "fstring.h"
+#include "fuzzy_wire.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Delta log of fuzzy storage updates used for replication.
+ * Log consists of zstd compressed frames of struct fuzzy_peer_cmd, each frame
+ * carries its version and the version of the previous frame, so a follower can
+ * tail the log from the last version it has applied and gaps are detected.
+ */
+struct rspamd_fuzzy_delta_log;
+
+enum rspamd_fuzzy_delta_error {
+	RSPAMD_FUZZY_DELTA_ERROR_IO = 1,
+	RSPAMD_FUZZY_DELTA_ERROR_FORMAT,
+	/* Version requested is no longer (or not yet) available in the log */
+	RSPAMD_FUZZY_DELTA_ERROR_GONE,
+};
+
+GQuark rspamd_fuzzy_delta_quark(void);
+
+/**
+ * Opens (or creates) delta log, when the log grows above `max_size` it is
+ * rotated to `path.old`, so at most 2 * max_size bytes are kept
+ */
+struct rspamd_fuzzy_delta_log *rspamd_fuzzy_delta_log_open(const char *path,
+														   gsize max_size,
+														   GError **err);
+
+/**
+ * Returns version of the last frame in the log or 0 if log is empty
+ */
+uint64_t rspamd_fuzzy_delta_log_version(struct rspamd_fuzzy_delta_log *log);
+
+/**
+ * Compresses and appends a new frame, `version` must be greater than the log version
+ */
+gboolean rspamd_fuzzy_delta_log_append(struct rspamd_fuzzy_delta_log *log,
+									   uint64_t version,
+									   const struct fuzzy_peer_cmd *cmds,
+									   gsize ncmds,
+									   GError **err);
+
+/**
+ * Appends frames as is (e.g. received from the leader), frames must continue the log
+ */
+gboolean rspamd_fuzzy_delta_log_append_frames(struct rspamd_fuzzy_delta_log *log,
+											  const unsigned char *data,
+											  gsize len,
+											  GError **err);
+
+/**
+ * Returns frames that follow `from` version, at least one frame is returned
+ * if there are any and the total length is limited by `max_len` otherwise.
+ * If `from` is not known to the log, RSPAMD_FUZZY_DELTA_ERROR_GONE is returned.
+ * @return frames (possibly empty) or NULL on error
+ */
+rspamd_fstring_t *rspamd_fuzzy_delta_log_read(struct rspamd_fuzzy_delta_log *log,
+											  uint64_t from,
+											  gsize max_len,
+											  GError **err);
+
+/**
+ * Decodes frames that must continue the `from` version
+ * @param last_version version of the last frame decoded
+ * @return array of struct fuzzy_peer_cmd or NULL on error
+ */
+GArray *rspamd_fuzzy_delta_decode(const unsigned char *data,
+								  gsize len,
+								  uint64_t from,
+								  uint64_t *last_version,
+								  GError **err);
+
+void rspamd_fuzzy_delta_log_close(struct rspamd_fuzzy_delta_log *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,6 +24,7 @@
 #include "libserver/css/css.hxx"
 #include "libserver/task.h"
 #include "libserver/cfg_file.h"
+#include "libserver/logger.hxx"
 
 #include "url.h"
 #include "contrib/libucl/khash.h"
@@ -41,9 +42,71 @@
 
 #include <unicode/uversion.h>
 
+#ifdef __x86_64__
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace rspamd::html {
 
 static const unsigned int max_tags = 8192; /* Ignore tags if this maximum is reached */
+/*
+ * Deeper tags are attached to the ancestor at this level, so tree traversals
+ * and balance checks have bounded recursion and cost for nested garbage
+ */
+static const unsigned int max_depth = 256;
+
+/*
+ * Returns the first position in [p, end) holding any of the specified
+ * characters or end if there are none. Used to jump over plain runs of text
+ * so the state machine sees structural bytes only.
+ */
+static inline auto
+html_scan_special(const char *p, const char *end, char c1, char c2, char c3) -> const char *
+{
+#ifdef __x86_64__
+	const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2),
+				  v3 = _mm_set1_epi8(c3);
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)),
+								 _mm_cmpeq_epi8(v, v3));
+		unsigned int mask = _mm_movemask_epi8(m);
+
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+
+		p += 16;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t v1 = vdupq_n_u8(c1), v2 = vdupq_n_u8(c2),
+					 v3 = vdupq_n_u8(c3);
+
+	while (end - p >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) p);
+		uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, v1), vceqq_u8(v, v2)),
+								vceqq_u8(v, v3));
+
+		if (vmaxvq_u8(m) != 0) {
+			break;
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < end) {
+		if (*p == c1 || *p == c2 || *p == c3) {
+			return p;
+		}
+		p++;
+	}
+
+	return end;
+}
 
 static const html_tags_storage html_tags_defs;
 
@@ -174,8 +237,7 @@ html_check_balance(struct html_content *hc,
 		 */
 
 		if (hc->all_tags.empty()) {
-			hc->all_tags.push_back(std::make_unique<html_tag>());
-			auto *vtag = hc->all_tags.back().get();
+			auto *vtag = hc->new_tag();
 			vtag->id = Tag_HTML;
 			vtag->flags = FL_VIRTUAL;
 			vtag->tag_start = 0;
@@ -1338,6 +1400,7 @@ auto html_process_input(struct rspamd_task *task,
 	auto overflow_input = false;
 	struct html_tag *cur_tag = nullptr, *parent_tag = nullptr, cur_closing_tag;
 	struct tag_content_parser_state content_parser_env;
+	std::vector<std::string_view> css_blocks;
 	auto process_size = in->len;
 
 
@@ -1373,13 +1436,14 @@ auto html_process_input(struct rspamd_task *task,
 	auto *pool = task->task_pool;
 	auto cur_url_part_order = 0u;
 
-	auto *hc = new html_content;
+	/* Containers are allocated in the task pool, hc itself is destroyed by the pool */
+	auto *hc = new html_content(task->task_pool);
 	rspamd_mempool_add_destructor(task->task_pool, html_content::html_content_dtor, hc);
 
 	if (task->cfg && in->len > task->cfg->max_html_len) {
-		msg_notice_task("html input is too big: %z, limit is %z",
-						in->len,
-						task->cfg->max_html_len);
+		msg_notice_task_fmt("html input is too big: {}, limit is {}",
+							in->len,
+							task->cfg->max_html_len);
 		process_size = task->cfg->max_html_len;
 		overflow_input = true;
 	}
@@ -1393,8 +1457,7 @@ auto html_process_input(struct rspamd_task *task,
 			return nullptr;
 		}
 
-		hc->all_tags.emplace_back(std::make_unique<html_tag>());
-		auto *ntag = hc->all_tags.back().get();
+		auto *ntag = hc->new_tag();
 		ntag->tag_start = c - start;
 		ntag->flags = flags;
 
@@ -1426,9 +1489,18 @@ auto html_process_input(struct rspamd_task *task,
 			pt = pt->parent;
 		}
 
+		if (pt && pt->depth >= rspamd::html::max_depth) {
+			hc->flags |= RSPAMD_HTML_FLAG_TOO_DEEP;
+
+			while (pt->depth >= rspamd::html::max_depth) {
+				pt = pt->parent;
+			}
+		}
+
 		if (pt) {
 			g_assert(cur_tag != pt);
 			cur_tag->parent = pt;
+			cur_tag->depth = pt->depth + 1;
 			g_assert(cur_tag->parent != &cur_closing_tag);
 			parent_tag = pt;
 			parent_tag->children.push_back(cur_tag);
@@ -1437,6 +1509,7 @@ auto html_process_input(struct rspamd_task *task,
 			if (hc->root_tag) {
 				if (cur_tag != hc->root_tag) {
 					cur_tag->parent = hc->root_tag;
+					cur_tag->depth = 1;
 					g_assert(cur_tag->parent != cur_tag);
 					hc->root_tag->children.push_back(cur_tag);
 					parent_tag = hc->root_tag;
@@ -1448,14 +1521,14 @@ auto html_process_input(struct rspamd_task *task,
 				}
 				else {
 					/* Insert a fake html tag */
-					hc->all_tags.emplace_back(std::make_unique<html_tag>());
-					auto *top_tag = hc->all_tags.back().get();
+					auto *top_tag = hc->new_tag();
 					top_tag->tag_start = 0;
 					top_tag->flags = FL_VIRTUAL;
 					top_tag->id = Tag_HTML;
 					top_tag->content_offset = 0;
 					top_tag->children.push_back(cur_tag);
 					cur_tag->parent = top_tag;
+					cur_tag->depth = 1;
 					g_assert(cur_tag->parent != cur_tag);
 					hc->root_tag = top_tag;
 					parent_tag = top_tag;
@@ -1777,6 +1850,13 @@ auto html_process_input(struct rspamd_task *task,
 			break;
 
 		case comment_content:
+			if (t != '-' && t != '>') {
+				/* Nothing but dashes and braces can end a comment */
+				p = html_scan_special(p, end, '-', '>', '>');
+				ebrace = 0;
+				continue;
+			}
+
 			if (t == '-') {
 				ebrace++;
 			}
@@ -1794,7 +1874,7 @@ auto html_process_input(struct rspamd_task *task,
 
 		case html_text_content:
 			if (t != '<') {
-				p++;
+				p = html_scan_special(p, end, '<', '<', '<');
 			}
 			else {
 				state = tag_begin;
@@ -1805,8 +1885,11 @@ auto html_process_input(struct rspamd_task *task,
 			if (t == '<') {
 				c = p;
 				state = tag_raw_text_less_than;
+				p++;
+			}
+			else {
+				p = html_scan_special(p, end, '<', '<', '<');
 			}
-			p++;
 			break;
 		case tag_raw_text_less_than:
 			if (t == '/') {
@@ -1866,11 +1949,28 @@ auto html_process_input(struct rspamd_task *task,
 				state = tag_end_opening;
 			}
 			else {
-				p++;
+				p = html_scan_special(p, end, '>', '>', '>');
 			}
 			break;
 
 		case tag_content:
+			if (content_parser_env.cur_state == parse_dqvalue ||
+				content_parser_env.cur_state == parse_sqvalue) {
+				/*
+				 * Quoted values (e.g. inline styles) are copied as is up to
+				 * the quote, so we append a whole run at once, zero bytes and
+				 * `>` still go via the per character logic
+				 */
+				auto quote = content_parser_env.cur_state == parse_sqvalue ? '\'' : '"';
+				const auto *run_end = html_scan_special(p, end, quote, '>', '\0');
+
+				if (run_end != p) {
+					content_parser_env.buf.append(p, run_end - p);
+					p = run_end;
+					continue;
+				}
+			}
+
 			html_parse_tag_content(pool, hc, cur_tag, p, content_parser_env);
 
 			if (t == '>') {
@@ -1999,7 +2099,16 @@ auto html_process_input(struct rspamd_task *task,
 					auto *opening_tag = cur_tag->parent;
 
 					if (opening_tag && opening_tag->id == Tag_STYLE &&
-						(int) opening_tag->content_offset < opening_tag->closing.start) {
+						(int) opening_tag->content_offset < opening_tag->closing.start &&
+						task->cfg && task->cfg->css_cache_size > 0) {
+						/* Parse (or reuse) all style blocks seen so far at once */
+						css_blocks.emplace_back(start + opening_tag->content_offset,
+												opening_tag->closing.start - opening_tag->content_offset);
+						hc->css_style = rspamd::css::css_parse_cached(pool, css_blocks,
+																	 task->cfg->css_cache_size);
+					}
+					else if (opening_tag && opening_tag->id == Tag_STYLE &&
+							 (int) opening_tag->content_offset < opening_tag->closing.start) {
 						auto ret_maybe = rspamd::css::parse_css(pool,
 																{start + opening_tag->content_offset,
 																 opening_tag->closing.start - opening_tag->content_offset},
@@ -2041,16 +2150,16 @@ auto html_process_input(struct rspamd_task *task,
 						cur_opening_tag = hc->root_tag;
 					}
 
-					auto &&vtag = std::make_unique<html_tag>();
+					auto *vtag = hc->new_tag();
 					vtag->id = cur_tag->id;
 					vtag->flags = FL_VIRTUAL | FL_CLOSED | cur_tag->flags;
 					vtag->tag_start = cur_tag->closing.start;
 					vtag->content_offset = p - start + 1;
 					vtag->closing = cur_tag->closing;
 					vtag->parent = cur_opening_tag;
+					vtag->depth = cur_opening_tag->depth + 1;
 					g_assert(vtag->parent != &cur_closing_tag);
-					cur_opening_tag->children.push_back(vtag.get());
-					hc->all_tags.emplace_back(std::move(vtag));
+					cur_opening_tag->children.push_back(vtag);
 					cur_tag = cur_opening_tag;
 					parent_tag = cur_tag->parent;
 					g_assert(cur_tag->parent != &cur_closing_tag);
@@ -2082,7 +2191,7 @@ auto html_process_input(struct rspamd_task *task,
 	/* Propagate styles */
 	hc->traverse_block_tags([&hc, &pool](const html_tag *tag) -> bool {
 		if (hc->css_style && tag->id > Tag_UNKNOWN && tag->id < Tag_MAX) {
-			auto *css_block = hc->css_style->check_tag_block(tag);
+			auto *css_block = hc->css_style->check_tag_block(tag, pool);
 
 			if (css_block) {
 				if (tag->block) {
@@ -37,6 +37,7 @@ extern "C" {
 #define RSPAMD_HTML_FLAG_TOO_MANY_TAGS (1 << 6)
 #define RSPAMD_HTML_FLAG_HAS_DATA_URLS (1 << 7)
 #define RSPAMD_HTML_FLAG_HAS_ZEROS (1 << 8)
+#define RSPAMD_HTML_FLAG_TOO_DEEP (1 << 9)
 
 /*
  * Image flags
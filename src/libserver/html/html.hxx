@@ -23,6 +23,7 @@
 #include "libserver/html/html_tag.hxx"
 #include "libserver/html/html.h"
 #include "libserver/html/html_tags.h"
+#include "libutil/cxx/mempool_allocator.hxx"
 
 
 #include <vector>
@@ -44,20 +45,40 @@ struct html_content {
 	struct html_tag *root_tag = nullptr;
 	int flags = 0;
 	std::vector<bool> tags_seen;
-	std::vector<html_image *> images;
-	std::vector<std::unique_ptr<struct html_tag>> all_tags;
+	pool_vector<html_image *> images;
+	pool_vector<struct html_tag *> all_tags;
 	std::string parsed;
 	std::string invisible;
 	std::shared_ptr<css::css_style_sheet> css_style;
 
 	/* Preallocate and reserve all internal structures */
-	html_content()
+	explicit html_content(rspamd_mempool_t *pool = nullptr)
+		: images(mempool_allocator<html_image *>{pool}),
+		  all_tags(mempool_allocator<struct html_tag *>{pool})
 	{
 		tags_seen.resize(Tag_MAX, false);
 		all_tags.reserve(128);
 		parsed.reserve(256);
 	}
 
+	/* Creates a new tag in the pool of the content */
+	auto new_tag() -> struct html_tag *
+	{
+		auto *pool = all_tags.get_allocator().get_pool();
+		struct html_tag *tag;
+
+		if (pool) {
+			tag = new (rspamd_mempool_alloc_type(pool, struct html_tag)) html_tag(pool);
+		}
+		else {
+			tag = new html_tag();
+		}
+
+		all_tags.push_back(tag);
+
+		return tag;
+	}
+
 	static void html_content_dtor(void *ptr)
 	{
 		delete html_content::from_ptr(ptr);
@@ -115,9 +136,9 @@ struct html_content {
 
 	auto traverse_all_tags(fu2::function<bool(const html_tag *)> &&func) const -> bool
 	{
-		for (const auto &tag: all_tags) {
+		for (const auto *tag: all_tags) {
 			if (!(tag->flags & (FL_XML | FL_VIRTUAL))) {
-				if (!func(tag.get())) {
+				if (!func(tag)) {
 					return false;
 				}
 			}
@@ -127,7 +148,14 @@ struct html_content {
 	}
 
 private:
-	~html_content() = default;
+	~html_content()
+	{
+		if (all_tags.get_allocator().get_pool() == nullptr) {
+			for (auto *tag: all_tags) {
+				delete tag;
+			}
+		}
+	}
 };
 
 
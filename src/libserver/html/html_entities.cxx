@@ -2177,18 +2177,15 @@ static const html_entity_def html_entities_array[] = {
 class html_entities_storage {
 	ankerl::unordered_dense::map<std::string_view, html_entity_def> entity_by_name;
 	ankerl::unordered_dense::map<std::string_view, html_entity_def> entity_by_name_heur;
-	ankerl::unordered_dense::map<unsigned, html_entity_def> entity_by_id;
 
 public:
 	html_entities_storage()
 	{
 		auto nelts = G_N_ELEMENTS(html_entities_array);
 		entity_by_name.reserve(nelts);
-		entity_by_id.reserve(nelts);
 
 		for (const auto &e: html_entities_array) {
 			entity_by_name[e.name] = e;
-			entity_by_id[e.code] = e;
 
 			if (e.allow_heuristic) {
 				entity_by_name_heur[e.name] = e;
@@ -2214,16 +2211,6 @@ public:
 
 		return nullptr;
 	}
-
-	auto by_id(int id) const -> const html_entity_def *
-	{
-		auto it = entity_by_id.find(id);
-		if (it != entity_by_id.end()) {
-			return &(it->second);
-		}
-
-		return nullptr;
-	}
 };
 
 static const html_entities_storage html_entities_defs;
@@ -2391,17 +2378,19 @@ decode_html_entitles_inplace(char *s, std::size_t len, bool norm_spaces)
 		}
 		else {
 			uc = maybe_num.value();
-			/* Search for a replacement */
-			const auto *entity_def = html_entities_defs.by_id(uc);
 
-			if (entity_def) {
-				auto rep_len = strlen(entity_def->replacement);
+			/*
+			 * Numeric entity is a code point itself, so no table lookup is needed;
+			 * entity is never shorter than its replacement
+			 */
+			if (uc > 0 && uc < 0x80) {
+				*t++ = (char) uc;
 
-				if (end - t >= rep_len) {
-					memcpy(t, entity_def->replacement,
-						   rep_len);
-					t += rep_len;
-				}
+				return true;
+			}
+			else if (uc == 160) {
+				/* Like `&nbsp;` */
+				*t++ = ' ';
 
 				return true;
 			}
@@ -2460,7 +2449,35 @@ decode_html_entitles_inplace(char *s, std::size_t len, bool norm_spaces)
 
 	while (h - s < len && t <= h) {
 		switch (state) {
-		case parser_state::normal_content:
+		case parser_state::normal_content: {
+			/* Move runs without entities (and spaces to normalise) at once */
+			const char *run_end;
+
+			if (!norm_spaces) {
+				run_end = (const char *) memchr(h, '&', end - h);
+
+				if (run_end == nullptr) {
+					run_end = end;
+				}
+			}
+			else {
+				run_end = h;
+
+				while (run_end < end && *run_end != '&' && !g_ascii_isspace(*run_end)) {
+					run_end++;
+				}
+			}
+
+			if (run_end > h) {
+				if (t != h) {
+					memmove(t, h, run_end - h);
+				}
+
+				t += run_end - h;
+				h += run_end - h;
+				continue;
+			}
+
 			if (*h == '&') {
 				state = parser_state::ampersand;
 				seen_hash = false;
@@ -2481,6 +2498,7 @@ decode_html_entitles_inplace(char *s, std::size_t len, bool norm_spaces)
 				}
 			}
 			break;
+		}
 		case parser_state::ampersand:
 			if ((*h == ';' || g_ascii_isspace(*h)) && h > e) {
 				replace_entity();
@@ -2613,6 +2631,8 @@ TEST_SUITE("html entities")
 			{"FOO&#41;BAR", "FOO)BAR"},
 			{"FOO&#x41;BAR", "FOOABAR"},
 			{"FOO&#X41;BAR", "FOOABAR"},
+			{"FOO&#62;BAR", "FOO>BAR"},
+			{"FOO&#160;BAR", "FOO BAR"},
 			{"FOO&#BAR", "FOO&#BAR"},
 			{"FOO&#ZOO", "FOO&#ZOO"},
 			{"FOO&#xBAR", "FOOºR"},
@@ -2639,6 +2659,26 @@ TEST_SUITE("html entities")
 			}
 		}
 	}
+
+	TEST_CASE("html entities decode without spaces normalisation")
+	{
+		std::vector<std::pair<std::string, std::string>> cases{
+			{"abc\n \tdef", "abc\n \tdef"},
+			{"    abc &amp;  def   ", "    abc &  def   "},
+			{"&lt;a&gt;", "<a>"},
+			{"no entities at all", "no entities at all"},
+			{"FOO&#x41;BAR&", "FOOABAR&"},
+		};
+
+		for (const auto &c: cases) {
+			SUBCASE(("decode entities: " + c.first).c_str())
+			{
+				std::string cpy{c.first};
+				decode_html_entitles_inplace(cpy);
+				CHECK(cpy == c.second);
+			}
+		}
+	}
 }
 
 }// namespace rspamd::html
\ No newline at end of file
@@ -26,6 +26,7 @@
 #include <cstdint>
 
 #include "html_tags.h"
+#include "libutil/cxx/mempool_allocator.hxx"
 
 struct rspamd_url;
 struct html_image;
@@ -96,15 +97,26 @@ struct html_tag {
 	unsigned int content_offset = 0;
 	std::uint32_t flags = 0;
 	std::int32_t id = Tag_UNKNOWN;
+	unsigned int depth = 0; /* Nesting level, root is zero */
 	html_closing_tag closing;
 
-	std::vector<html_tag_component> components;
+	pool_vector<html_tag_component> components;
 
 	html_tag_extra_t extra;
 	mutable struct html_block *block = nullptr;
-	std::vector<struct html_tag *> children;
+	pool_vector<struct html_tag *> children;
 	struct html_tag *parent;
 
+	/*
+	 * Tags of a task are allocated in its pool as well as their containers,
+	 * so they are never destructed and are freed with the pool
+	 */
+	explicit html_tag(rspamd_mempool_t *pool = nullptr)
+		: components(mempool_allocator<html_tag_component>{pool}),
+		  children(mempool_allocator<struct html_tag *>{pool})
+	{
+	}
+
 	auto find_component(html_component_type what) const -> std::optional<std::string_view>
 	{
 		for (const auto &comp: components) {
@@ -132,6 +144,7 @@ struct html_tag {
 		extra = std::monostate{};
 		components.clear();
 		flags = 0;
+		depth = 0;
 		block = nullptr;
 		children.clear();
 		closing.clear();
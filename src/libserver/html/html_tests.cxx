@@ -207,6 +207,12 @@ TEST_SUITE("html")
 			{"<html><head><p>oh my god</head><body></body></html>", "oh my god\n"},
 			{"<html><head><title>oh my god</head><body></body></html>", ""},
 			{"<html><body><html><head>displayed</body></html></body></html>", "displayed"},
+			/* Long runs that are skipped in blocks */
+			{"<p title=\"a > b, 'quoted' and long enough to span several blocks\">long text without any tags inside it</p>",
+			 "long text without any tags inside it\n"},
+			{"<p title='a > \"b\" and long enough to span several blocks of input'>test</p>", "test\n"},
+			{"<!-- comment - with -- dashes and > braces inside - long -->test", "test"},
+			{"<script>var a = 'long script body that is skipped'; if (a < b) {}</script>test", "test"},
 
 		};
 
@@ -245,6 +251,47 @@ TEST_SUITE("html")
 		rspamd_mempool_delete(pool);
 	}
 
+	TEST_CASE("html tags depth")
+	{
+		std::string input;
+
+		for (auto i = 0; i < 1000; i++) {
+			input += "<div>";
+		}
+		input += "deep";
+		for (auto i = 0; i < 1000; i++) {
+			input += "</div>";
+		}
+
+		rspamd_url_init(NULL);
+		auto *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
+										"html", 0);
+		struct rspamd_task fake_task;
+		memset(&fake_task, 0, sizeof(fake_task));
+		fake_task.task_pool = pool;
+
+		GByteArray *tmp = g_byte_array_sized_new(input.size());
+		g_byte_array_append(tmp, (const uint8_t *) input.data(), input.size());
+		auto *hc = html_process_input(&fake_task, tmp, nullptr, nullptr, nullptr, true, nullptr);
+		CHECK(hc != nullptr);
+		CHECK((hc->flags & RSPAMD_HTML_FLAG_TOO_DEEP) != 0);
+		CHECK(hc->parsed.find("deep") != std::string::npos);
+
+		for (const auto *tag: hc->all_tags) {
+			auto depth = 0u;
+
+			for (auto *pt = tag->parent; pt != nullptr; pt = pt->parent) {
+				depth++;
+			}
+
+			CHECK(depth == tag->depth);
+			CHECK(depth <= 256);
+		}
+
+		g_byte_array_free(tmp, TRUE);
+		rspamd_mempool_delete(pool);
+	}
+
 	TEST_CASE("html urls extraction")
 	{
 		using namespace std::string_literals;
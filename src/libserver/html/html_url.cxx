@@ -158,8 +158,8 @@ auto html_url_is_phished(rspamd_mempool_t *pool,
 		}
 
 		text_url = rspamd_mempool_alloc0_type(pool, struct rspamd_url);
-		auto rc = rspamd_url_parse(text_url, url_str, strlen(url_str), pool,
-								   RSPAMD_URL_PARSE_TEXT);
+		auto rc = rspamd_url_parse_cached(text_url, url_str, strlen(url_str), pool,
+										  RSPAMD_URL_PARSE_TEXT);
 
 		if (rc == URI_ERRNO_OK) {
 			text_url->flags |= RSPAMD_URL_FLAG_HTML_DISPLAYED;
@@ -455,7 +455,7 @@ auto html_process_url(rspamd_mempool_t *pool, std::string_view &input)
 
 	url = rspamd_mempool_alloc0_type(pool, struct rspamd_url);
 	rspamd_url_normalise_propagate_flags(pool, decoded, &dlen, saved_flags);
-	rc = rspamd_url_parse(url, decoded, dlen, pool, RSPAMD_URL_PARSE_HREF);
+	rc = rspamd_url_parse_cached(url, decoded, dlen, pool, RSPAMD_URL_PARSE_HREF);
 
 	/* Filter some completely damaged urls */
 	if (rc == URI_ERRNO_OK && url->hostlen > 0 &&
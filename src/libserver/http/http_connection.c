@@ -53,6 +53,7 @@ enum rspamd_http_priv_flags {
 	RSPAMD_HTTP_CONN_FLAG_PROXY = 1u << 5u,
 	RSPAMD_HTTP_CONN_FLAG_PROXY_REQUEST = 1u << 6u,
 	RSPAMD_HTTP_CONN_OWN_SOCKET = 1u << 7u,
+	RSPAMD_HTTP_CONN_FLAG_FD_PASSING = 1u << 8u,
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
@@ -76,6 +77,10 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	/* Descriptor to be sent with the first chunk of the output (not owned) */
+	int pass_fd;
+	/* Descriptor received from a peer via SCM_RIGHTS (owned until stolen) */
+	int received_fd;
 };
 
 static const rspamd_ftok_t key_header = {
@@ -767,6 +772,11 @@ rspamd_http_write_helper(struct rspamd_http_connection *conn)
 	GError *err;
 	struct iovec *cur_iov;
 	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
 
 	priv = conn->priv;
 
@@ -809,6 +819,18 @@ rspamd_http_write_helper(struct rspamd_http_connection *conn)
 	flags = MSG_NOSIGNAL;
 #endif
 
+	if (priv->pass_fd != -1 && !priv->ssl) {
+		/* Attach descriptor to the first byte sent */
+		memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &priv->pass_fd, sizeof(int));
+	}
+
 	if (priv->ssl) {
 		r = rspamd_ssl_writev(priv->ssl, msg.msg_iov, msg.msg_iovlen);
 		g_free(cur_iov);
@@ -830,6 +852,11 @@ rspamd_http_write_helper(struct rspamd_http_connection *conn)
 	}
 	else {
 		priv->wr_pos += r;
+
+		if (r > 0) {
+			/* Descriptor has been delivered with this chunk */
+			priv->pass_fd = -1;
+		}
 	}
 
 	if (priv->wr_pos >= priv->wr_total) {
@@ -863,6 +890,52 @@ call_finish_handler:
 	}
 }
 
+static gssize
+rspamd_http_recv_with_fd(int fd,
+						 struct rspamd_http_connection_private *priv,
+						 char *data, gsize len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	gssize r;
+	int passed_fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	r = recvmsg(fd, &msg, 0);
+
+	if (r <= 0) {
+		return r;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+			cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+			memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+
+			if (priv->received_fd != -1) {
+				/* Peers must not send more than a descriptor per message */
+				close(priv->received_fd);
+			}
+
+			priv->received_fd = passed_fd;
+		}
+	}
+
+	return r;
+}
+
 static gssize
 rspamd_http_try_read(int fd,
 					 struct rspamd_http_connection *conn,
@@ -896,6 +969,9 @@ rspamd_http_try_read(int fd,
 	if (priv->ssl) {
 		r = rspamd_ssl_read(priv->ssl, data, len);
 	}
+	else if (priv->flags & RSPAMD_HTTP_CONN_FLAG_FD_PASSING) {
+		r = rspamd_http_recv_with_fd(fd, priv, data, len);
+	}
 	else {
 		r = read(fd, data, len);
 	}
@@ -1137,6 +1213,8 @@ rspamd_http_connection_new_common(struct rspamd_http_context *ctx,
 	conn->priv = priv;
 	priv->ctx = ctx;
 	priv->flags = priv_flags;
+	priv->pass_fd = -1;
+	priv->received_fd = -1;
 
 	if (type == RSPAMD_HTTP_SERVER) {
 		priv->cache = ctx->server_kp_cache;
@@ -1255,6 +1333,8 @@ rspamd_http_connection_new_client_keepalive(struct rspamd_http_context *ctx,
 											   opts & RSPAMD_HTTP_CLIENT_SSL);
 
 	if (conn) {
+		rspamd_http_context_acquire_keepalive(ctx, conn);
+
 		return conn;
 	}
 
@@ -1266,6 +1346,7 @@ rspamd_http_connection_new_client_keepalive(struct rspamd_http_context *ctx,
 	if (conn) {
 		rspamd_http_context_prepare_keepalive(ctx, conn, addr, host,
 											  opts & RSPAMD_HTTP_CLIENT_SSL);
+		rspamd_http_context_acquire_keepalive(ctx, conn);
 	}
 
 	return conn;
@@ -1470,6 +1551,11 @@ void rspamd_http_connection_free(struct rspamd_http_connection *conn)
 	priv = conn->priv;
 
 	if (priv != NULL) {
+		if (conn->keepalive_busy) {
+			/* Connection has not been returned to the keepalive pool */
+			rspamd_http_context_release_keepalive(priv->ctx, conn);
+		}
+
 		rspamd_http_connection_reset(conn);
 
 		if (priv->ssl) {
@@ -1489,6 +1575,10 @@ void rspamd_http_connection_free(struct rspamd_http_connection *conn)
 			close(conn->fd);
 		}
 
+		if (priv->received_fd != -1) {
+			close(priv->received_fd);
+		}
+
 		g_free(priv);
 	}
 
@@ -1680,6 +1770,10 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 	int meth_len = 0;
 	const char *conn_type = "close";
 
+	if (msg->flags & RSPAMD_HTTP_FLAG_KEEP_ALIVE) {
+		conn_type = "keep-alive";
+	}
+
 	if (conn->type == RSPAMD_HTTP_SERVER) {
 		/* Format reply */
 		if (msg->method < HTTP_SYMBOLS) {
@@ -1720,12 +1814,12 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 					meth_len =
 						rspamd_snprintf(repbuf, replen,
 										"HTTP/1.1 %d %T\r\n"
-										"Connection: close\r\n"
+										"Connection: %s\r\n"
 										"Server: %s\r\n"
 										"Date: %s\r\n"
 										"Content-Length: %z\r\n"
 										"Content-Type: %s", /* NO \r\n at the end ! */
-										msg->code, &status, priv->ctx->config.server_hdr,
+										msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 										datebuf,
 										bodylen, mime_type);
 				}
@@ -1733,11 +1827,11 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 					meth_len =
 						rspamd_snprintf(repbuf, replen,
 										"HTTP/1.1 %d %T\r\n"
-										"Connection: close\r\n"
+										"Connection: %s\r\n"
 										"Server: %s\r\n"
 										"Date: %s\r\n"
 										"Content-Length: %z", /* NO \r\n at the end ! */
-										msg->code, &status, priv->ctx->config.server_hdr,
+										msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 										datebuf,
 										bodylen);
 				}
@@ -1745,12 +1839,12 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 				/* External reply */
 				rspamd_printf_fstring(buf,
 									  "HTTP/1.1 200 OK\r\n"
-									  "Connection: close\r\n"
+									  "Connection: %s\r\n"
 									  "Server: %s\r\n"
 									  "Date: %s\r\n"
 									  "Content-Length: %z\r\n"
 									  "Content-Type: application/octet-stream\r\n",
-									  priv->ctx->config.server_hdr,
+									  conn_type, priv->ctx->config.server_hdr,
 									  datebuf, enclen);
 			}
 			else {
@@ -1758,12 +1852,12 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 					meth_len =
 						rspamd_printf_fstring(buf,
 											  "HTTP/1.1 %d %T\r\n"
-											  "Connection: close\r\n"
+											  "Connection: %s\r\n"
 											  "Server: %s\r\n"
 											  "Date: %s\r\n"
 											  "Content-Length: %z\r\n"
 											  "Content-Type: %s\r\n",
-											  msg->code, &status, priv->ctx->config.server_hdr,
+											  msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 											  datebuf,
 											  bodylen, mime_type);
 				}
@@ -1771,11 +1865,11 @@ int rspamd_http_message_write_header(const char *mime_type, gboolean encrypted,
 					meth_len =
 						rspamd_printf_fstring(buf,
 											  "HTTP/1.1 %d %T\r\n"
-											  "Connection: close\r\n"
+											  "Connection: %s\r\n"
 											  "Server: %s\r\n"
 											  "Date: %s\r\n"
 											  "Content-Length: %z\r\n",
-											  msg->code, &status, priv->ctx->config.server_hdr,
+											  msg->code, &status, conn_type, priv->ctx->config.server_hdr,
 											  datebuf,
 											  bodylen);
 				}
@@ -2078,6 +2172,13 @@ rspamd_http_connection_write_message_common(struct rspamd_http_connection *conn,
 		rspamd_http_detach_shared(msg);
 	}
 
+	if (msg->body_tail.len > 0 &&
+		(encrypted || allow_shared || msg->method >= HTTP_SYMBOLS ||
+		 msg->body_buf.len == 0)) {
+		/* External body segment can be written as is merely for plain replies */
+		rspamd_http_message_flatten_body_tail(msg);
+	}
+
 	if (allow_shared) {
 		char tmpbuf[64];
 
@@ -2089,6 +2190,13 @@ rspamd_http_connection_write_message_common(struct rspamd_http_connection *conn,
 			/* Insert new headers */
 			rspamd_http_message_add_header(msg, "Shm",
 										   msg->body_buf.c.shared.name->shm_name);
+
+			if ((priv->flags & RSPAMD_HTTP_CONN_FLAG_FD_PASSING) &&
+				msg->body_buf.c.shared.shm_fd != -1) {
+				/* Peer gets the segment itself and does not need to open it by name */
+				priv->pass_fd = msg->body_buf.c.shared.shm_fd;
+				rspamd_http_message_add_header(msg, "Shm-Fd", "1");
+			}
 			rspamd_snprintf(tmpbuf, sizeof(tmpbuf), "%d",
 							(int) (msg->body_buf.begin - msg->body_buf.str));
 			rspamd_http_message_add_header(msg, "Shm-Offset",
@@ -2220,8 +2328,8 @@ rspamd_http_connection_write_message_common(struct rspamd_http_connection *conn,
 			}
 			else {
 				pbody = (char *) msg->body_buf.begin;
-				bodylen = msg->body_buf.len;
-				priv->outlen = 3;
+				bodylen = msg->body_buf.len + msg->body_tail.len;
+				priv->outlen = msg->body_tail.len > 0 ? 4 : 3;
 
 				if (msg->method == HTTP_INVALID) {
 					msg->method = HTTP_POST;
@@ -2343,7 +2451,12 @@ else
 
 if (pbody != NULL) {
 	priv->out[i].iov_base = pbody;
-	priv->out[i++].iov_len = bodylen;
+	priv->out[i++].iov_len = bodylen - msg->body_tail.len;
+
+	if (msg->body_tail.len > 0) {
+		priv->out[i].iov_base = (void *) msg->body_tail.begin;
+		priv->out[i++].iov_len = msg->body_tail.len;
+	}
 }
 }
 
@@ -2461,6 +2574,23 @@ void rspamd_http_connection_own_socket(struct rspamd_http_connection *conn)
 	priv->flags |= RSPAMD_HTTP_CONN_OWN_SOCKET;
 }
 
+void rspamd_http_connection_allow_fd_passing(struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+
+	priv->flags |= RSPAMD_HTTP_CONN_FLAG_FD_PASSING;
+}
+
+int rspamd_http_connection_steal_received_fd(struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	int fd = priv->received_fd;
+
+	priv->received_fd = -1;
+
+	return fd;
+}
+
 const struct rspamd_cryptobox_pubkey *
 rspamd_http_connection_get_peer_key(struct rspamd_http_connection *conn)
 {
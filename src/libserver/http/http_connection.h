@@ -83,6 +83,10 @@ struct rspamd_storage_shmem {
  * Message is intended for SSL connection
  */
 #define RSPAMD_HTTP_FLAG_WANT_SSL (1 << 8)
+/**
+ * Connection should be kept open after this message
+ */
+#define RSPAMD_HTTP_FLAG_KEEP_ALIVE (1 << 9)
 /**
  * Options for HTTP connection
  */
@@ -119,6 +123,7 @@ struct rspamd_http_connection {
 	const char *log_tag;
 	/* Used for keepalive */
 	struct rspamd_keepalive_hash_key *keepalive_hash_key;
+	gboolean keepalive_busy;
 	gsize max_size;
 	unsigned opts;
 	enum rspamd_http_connection_type type;
@@ -214,6 +219,22 @@ void rspamd_http_connection_set_key(struct rspamd_http_connection *conn,
  */
 void rspamd_http_connection_own_socket(struct rspamd_http_connection *conn);
 
+/**
+ * Allow passing of descriptors over this connection (unix sockets only):
+ * shared bodies are sent as a descriptor via SCM_RIGHTS with `Shm-Fd` header,
+ * descriptors sent by a peer are accepted and could be obtained by
+ * `rspamd_http_connection_steal_received_fd`
+ * @param conn
+ */
+void rspamd_http_connection_allow_fd_passing(struct rspamd_http_connection *conn);
+
+/**
+ * Returns descriptor received from a peer (the caller must close it) or -1
+ * @param conn
+ * @return
+ */
+int rspamd_http_connection_steal_received_fd(struct rspamd_http_connection *conn);
+
 /**
  * Get peer's public key
  * @param conn connection structure
@@ -42,6 +42,16 @@ struct rspamd_http_keepalive_cbdata {
 	struct rspamd_io_ev ev;
 };
 
+struct rspamd_http_keepalive_waiter {
+	struct rspamd_keepalive_hash_key *hk;
+	struct rspamd_http_context *ctx;
+	rspamd_http_keepalive_wait_cb cb;
+	gpointer ud;
+	GList *link;
+	ev_timer tm;
+	gboolean ready;
+};
+
 static void
 rspamd_http_keepalive_queue_cleanup(GQueue *conns)
 {
@@ -64,6 +74,18 @@ rspamd_http_keepalive_queue_cleanup(GQueue *conns)
 	g_queue_clear(conns);
 }
 
+static void
+rspamd_http_keepalive_waiters_cleanup(struct rspamd_http_context *ctx,
+									  struct rspamd_keepalive_hash_key *hk)
+{
+	struct rspamd_http_keepalive_waiter *waiter;
+
+	while ((waiter = g_queue_pop_head(&hk->waiters)) != NULL) {
+		ev_timer_stop(ctx->event_loop, &waiter->tm);
+		g_free(waiter);
+	}
+}
+
 static void
 rspamd_http_context_client_rotate_ev(struct ev_loop *loop, ev_timer *w, int revents)
 {
@@ -92,6 +114,7 @@ rspamd_http_context_new_default(struct rspamd_config *cfg,
 	static const int default_kp_size = 1024;
 	static const double default_rotate_time = 120;
 	static const double default_keepalive_interval = 65;
+	static const unsigned int default_keepalive_max_idle = 64;
 	static const char *default_user_agent = "rspamd-" RSPAMD_VERSION_FULL;
 	static const char *default_server_hdr = "rspamd/" RSPAMD_VERSION_FULL;
 
@@ -101,6 +124,7 @@ rspamd_http_context_new_default(struct rspamd_config *cfg,
 	ctx->config.client_key_rotate_time = default_rotate_time;
 	ctx->config.user_agent = default_user_agent;
 	ctx->config.keepalive_interval = default_keepalive_interval;
+	ctx->config.keepalive_max_idle = default_keepalive_max_idle;
 	ctx->config.server_hdr = default_server_hdr;
 	ctx->ups_ctx = ups_ctx;
 
@@ -265,6 +289,20 @@ rspamd_http_context_create(struct rspamd_config *cfg,
 				ctx->config.keepalive_interval = ucl_object_todouble(keepalive_interval);
 			}
 
+			const ucl_object_t *keepalive_limit;
+
+			keepalive_limit = ucl_object_lookup(client_obj, "keepalive_max_idle");
+
+			if (keepalive_limit) {
+				ctx->config.keepalive_max_idle = ucl_object_toint(keepalive_limit);
+			}
+
+			keepalive_limit = ucl_object_lookup(client_obj, "keepalive_max_conns");
+
+			if (keepalive_limit) {
+				ctx->config.keepalive_max_conns = ucl_object_toint(keepalive_limit);
+			}
+
 			const ucl_object_t *http_proxy;
 			http_proxy = ucl_object_lookup(client_obj, "http_proxy");
 
@@ -327,6 +365,7 @@ void rspamd_http_context_free(struct rspamd_http_context *ctx)
 
 		rspamd_inet_address_free(hk->addr);
 		rspamd_http_keepalive_queue_cleanup(&hk->conns);
+		rspamd_http_keepalive_waiters_cleanup(ctx, hk);
 		g_free(hk);
 	});
 
@@ -459,6 +498,7 @@ rspamd_http_context_check_keepalive(struct rspamd_http_context *ctx,
 								   phk->host,
 								   (int) phk->is_ssl,
 								   conns->length);
+			phk->stat.reused++;
 
 			/* We transfer refcount here! */
 			return conn;
@@ -523,6 +563,7 @@ void rspamd_http_context_prepare_keepalive(struct rspamd_http_context *ctx,
 	if (k != kh_end(ctx->keep_alive_hash)) {
 		/* Reuse existing */
 		conn->keepalive_hash_key = kh_key(ctx->keep_alive_hash, k);
+		conn->keepalive_hash_key->stat.created++;
 		msg_debug_http_context("use existing keepalive element %s (%s)",
 							   rspamd_inet_address_to_string_pretty(conn->keepalive_hash_key->addr),
 							   conn->keepalive_hash_key->host);
@@ -532,8 +573,10 @@ void rspamd_http_context_prepare_keepalive(struct rspamd_http_context *ctx,
 		GQueue empty_init = G_QUEUE_INIT;
 		int r;
 
-		phk = g_malloc(sizeof(*phk));
+		phk = g_malloc0(sizeof(*phk));
 		phk->conns = empty_init;
+		phk->waiters = empty_init;
+		phk->stat.created = 1;
 		phk->host = g_strdup(host);
 		phk->is_ssl = is_ssl;
 		phk->addr = rspamd_inet_address_copy(addr, NULL);
@@ -559,6 +602,7 @@ rspamd_http_keepalive_handler(int fd, short what, gpointer ud)
 	 */
 
 	g_queue_delete_link(cbdata->queue, cbdata->link);
+	cbdata->conn->keepalive_hash_key->stat.expired++;
 	msg_debug_http_context("remove keepalive element %s (%s), %d connections left",
 						   rspamd_inet_address_to_string_pretty(cbdata->conn->keepalive_hash_key->addr),
 						   cbdata->conn->keepalive_hash_key->host,
@@ -645,6 +689,9 @@ void rspamd_http_context_push_keepalive(struct rspamd_http_context *ctx,
 		}
 	}
 
+	/* Connection is idle from now, so another request can use its slot */
+	rspamd_http_context_release_keepalive(ctx, conn);
+
 	/* Move connection to the keepalive pool */
 	cbdata = g_malloc0(sizeof(*cbdata));
 
@@ -667,4 +714,260 @@ void rspamd_http_context_push_keepalive(struct rspamd_http_context *ctx,
 						   cbdata->conn->keepalive_hash_key->host,
 						   cbdata->queue->length,
 						   timeout);
+
+	if (ctx->config.keepalive_max_idle > 0 &&
+		cbdata->queue->length > ctx->config.keepalive_max_idle) {
+		/* Evict the least recently used connection */
+		struct rspamd_http_keepalive_cbdata *old = g_queue_pop_tail(cbdata->queue);
+
+		msg_debug_http_context("evict keepalive element %s (%s), %d connections queued",
+							   rspamd_inet_address_to_string_pretty(old->conn->keepalive_hash_key->addr),
+							   old->conn->keepalive_hash_key->host,
+							   old->queue->length);
+		old->conn->keepalive_hash_key->stat.evicted++;
+		/* unref call closes fd, so we need to remove ev watcher first! */
+		rspamd_ev_watcher_stop(ctx->event_loop, &old->ev);
+		rspamd_http_connection_unref(old->conn);
+		g_free(old);
+	}
+}
+
+void rspamd_http_context_acquire_keepalive(struct rspamd_http_context *ctx,
+										   struct rspamd_http_connection *conn)
+{
+	g_assert(conn->keepalive_hash_key != NULL);
+
+	if (!conn->keepalive_busy) {
+		conn->keepalive_busy = TRUE;
+		conn->keepalive_hash_key->busy++;
+	}
+}
+
+static void
+rspamd_http_keepalive_waiter_handler(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_http_keepalive_waiter *waiter =
+		(struct rspamd_http_keepalive_waiter *) w->data;
+	struct rspamd_keepalive_hash_key *hk = waiter->hk;
+
+	ev_timer_stop(loop, w);
+
+	if (waiter->ready) {
+		/* Reservation is converted to a busy slot by the callback */
+		hk->reserved--;
+	}
+	else {
+		g_queue_delete_link(&hk->waiters, waiter->link);
+		hk->stat.wait_timeouts++;
+		msg_debug_http_context("timeout waiting for keepalive slot %s (%s), %d waiters left",
+							   rspamd_inet_address_to_string_pretty(hk->addr),
+							   hk->host,
+							   hk->waiters.length);
+	}
+
+	waiter->cb(waiter->ready, waiter->ud);
+	g_free(waiter);
+}
+
+static void
+rspamd_http_keepalive_wake_waiter(struct rspamd_http_context *ctx,
+								  struct rspamd_keepalive_hash_key *hk)
+{
+	struct rspamd_http_keepalive_waiter *waiter;
+
+	if (hk->waiters.length > 0 &&
+		(ctx->config.keepalive_max_conns == 0 ||
+		 hk->busy + hk->reserved < ctx->config.keepalive_max_conns)) {
+		/* Wake up the first waiter on the next loop iteration */
+		waiter = g_queue_pop_head(&hk->waiters);
+		waiter->link = NULL;
+		waiter->ready = TRUE;
+		hk->reserved++;
+
+		ev_timer_stop(ctx->event_loop, &waiter->tm);
+		ev_timer_set(&waiter->tm, 0.0, 0.0);
+		ev_timer_start(ctx->event_loop, &waiter->tm);
+
+		msg_debug_http_context("wake keepalive waiter %s (%s), %d waiters left",
+							   rspamd_inet_address_to_string_pretty(hk->addr),
+							   hk->host,
+							   hk->waiters.length);
+	}
+}
+
+void rspamd_http_context_release_keepalive(struct rspamd_http_context *ctx,
+										   struct rspamd_http_connection *conn)
+{
+	struct rspamd_keepalive_hash_key *hk = conn->keepalive_hash_key;
+
+	if (!conn->keepalive_busy) {
+		return;
+	}
+
+	conn->keepalive_busy = FALSE;
+	g_assert(hk->busy > 0);
+	hk->busy--;
+	rspamd_http_keepalive_wake_waiter(ctx, hk);
+}
+
+static struct rspamd_keepalive_hash_key *
+rspamd_http_context_find_keepalive(struct rspamd_http_context *ctx,
+								   const rspamd_inet_addr_t *addr,
+								   const char *host,
+								   bool is_ssl)
+{
+	struct rspamd_keepalive_hash_key hk;
+	khiter_t k;
+
+	hk.addr = (rspamd_inet_addr_t *) addr;
+	hk.host = (char *) host;
+	hk.port = rspamd_inet_address_get_port(addr);
+	hk.is_ssl = is_ssl;
+
+	k = kh_get(rspamd_keep_alive_hash, ctx->keep_alive_hash, &hk);
+
+	if (k != kh_end(ctx->keep_alive_hash)) {
+		return kh_key(ctx->keep_alive_hash, k);
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_http_context_keepalive_saturated(struct rspamd_http_context *ctx,
+										const rspamd_inet_addr_t *addr,
+										const char *host,
+										bool is_ssl)
+{
+	struct rspamd_keepalive_hash_key *phk;
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default();
+	}
+
+	if (ctx->config.keepalive_max_conns == 0) {
+		return FALSE;
+	}
+
+	phk = rspamd_http_context_find_keepalive(ctx, addr, host, is_ssl);
+
+	if (phk == NULL) {
+		return FALSE;
+	}
+
+	/* Do not overtake requests that are already waiting */
+	return phk->waiters.length > 0 ||
+		   phk->busy + phk->reserved >= ctx->config.keepalive_max_conns;
+}
+
+struct rspamd_http_keepalive_waiter *
+rspamd_http_context_wait_keepalive(struct rspamd_http_context *ctx,
+								   const rspamd_inet_addr_t *addr,
+								   const char *host,
+								   bool is_ssl,
+								   double timeout,
+								   rspamd_http_keepalive_wait_cb cb,
+								   gpointer ud)
+{
+	struct rspamd_keepalive_hash_key *phk;
+	struct rspamd_http_keepalive_waiter *waiter;
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default();
+	}
+
+	phk = rspamd_http_context_find_keepalive(ctx, addr, host, is_ssl);
+
+	if (phk == NULL) {
+		return NULL;
+	}
+
+	waiter = g_malloc0(sizeof(*waiter));
+	waiter->hk = phk;
+	waiter->ctx = ctx;
+	waiter->cb = cb;
+	waiter->ud = ud;
+	g_queue_push_tail(&phk->waiters, waiter);
+	waiter->link = phk->waiters.tail;
+	phk->stat.waited++;
+
+	waiter->tm.data = waiter;
+	ev_timer_init(&waiter->tm, rspamd_http_keepalive_waiter_handler, timeout, 0.0);
+	ev_timer_start(ctx->event_loop, &waiter->tm);
+
+	msg_debug_http_context("wait for keepalive slot %s (%s), %d busy, %d waiters",
+						   rspamd_inet_address_to_string_pretty(phk->addr),
+						   phk->host,
+						   phk->busy,
+						   phk->waiters.length);
+
+	return waiter;
+}
+
+void rspamd_http_context_cancel_wait(struct rspamd_http_keepalive_waiter *waiter)
+{
+	struct rspamd_keepalive_hash_key *hk = waiter->hk;
+
+	ev_timer_stop(waiter->ctx->event_loop, &waiter->tm);
+
+	if (waiter->ready) {
+		/* Slot has been reserved for us, pass it further */
+		hk->reserved--;
+		rspamd_http_keepalive_wake_waiter(waiter->ctx, hk);
+	}
+	else {
+		g_queue_delete_link(&hk->waiters, waiter->link);
+	}
+
+	g_free(waiter);
+}
+
+ucl_object_t *
+rspamd_http_context_keepalive_stat(struct rspamd_http_context *ctx)
+{
+	struct rspamd_keepalive_hash_key *hk;
+	ucl_object_t *top, *elt;
+
+	if (ctx == NULL) {
+		ctx = rspamd_http_context_default();
+	}
+
+	top = ucl_object_typed_new(UCL_ARRAY);
+
+	kh_foreach_key(ctx->keep_alive_hash, hk, {
+		elt = ucl_object_typed_new(UCL_OBJECT);
+
+		ucl_object_insert_key(elt,
+							  ucl_object_fromstring(rspamd_inet_address_to_string_pretty(hk->addr)),
+							  "addr", 0, false);
+
+		if (hk->host) {
+			ucl_object_insert_key(elt, ucl_object_fromstring(hk->host),
+								  "host", 0, false);
+		}
+
+		ucl_object_insert_key(elt, ucl_object_frombool(hk->is_ssl),
+							  "ssl", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->conns.length),
+							  "idle", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->busy),
+							  "busy", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->waiters.length),
+							  "waiting", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.created),
+							  "created", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.reused),
+							  "reused", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.evicted),
+							  "evicted", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.expired),
+							  "expired", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.waited),
+							  "waited", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(hk->stat.wait_timeouts),
+							  "wait_timeouts", 0, false);
+		ucl_array_append(top, elt);
+	});
+
+	return top;
 }
\ No newline at end of file
@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 struct rspamd_http_context;
+struct rspamd_http_keepalive_waiter;
 struct rspamd_config;
 struct rspamd_http_message;
 struct upstream_ctx;
@@ -37,6 +38,8 @@ struct rspamd_http_context_cfg {
 	unsigned int kp_cache_size_server;
 	unsigned int ssl_cache_size;
 	double keepalive_interval;
+	unsigned int keepalive_max_idle;  /* idle connections kept per peer, 0 - unlimited */
+	unsigned int keepalive_max_conns; /* busy connections allowed per peer, 0 - unlimited */
 	double client_key_rotate_time;
 	const char *user_agent;
 	const char *http_proxy;
@@ -115,6 +118,73 @@ void rspamd_http_context_push_keepalive(struct rspamd_http_context *ctx,
 										struct rspamd_http_message *msg,
 										struct ev_loop *ev_base);
 
+/**
+ * Marks keepalive connection as busy, so it is accounted against
+ * `keepalive_max_conns` limit until it is either pushed back to the pool or freed
+ * @param ctx
+ * @param conn
+ */
+void rspamd_http_context_acquire_keepalive(struct rspamd_http_context *ctx,
+										   struct rspamd_http_connection *conn);
+
+/**
+ * Releases busy slot of a keepalive connection and wakes up the first waiter if any
+ * @param ctx
+ * @param conn
+ */
+void rspamd_http_context_release_keepalive(struct rspamd_http_context *ctx,
+										   struct rspamd_http_connection *conn);
+
+/**
+ * Checks if a new keepalive connection to the specified peer must wait for
+ * a free slot (limit of busy connections is reached or somebody is already waiting)
+ * @param ctx
+ * @param addr
+ * @param host
+ * @param is_ssl
+ * @return
+ */
+gboolean rspamd_http_context_keepalive_saturated(struct rspamd_http_context *ctx,
+												 const rspamd_inet_addr_t *addr,
+												 const char *host,
+												 bool is_ssl);
+
+typedef void (*rspamd_http_keepalive_wait_cb)(gboolean ready, gpointer ud);
+
+/**
+ * Queues a request for a free keepalive slot. Callback is called with `ready`
+ * set to TRUE when a slot is available or with FALSE on timeout. Waiters are
+ * served in FIFO order. Waiter is freed after callback is called.
+ * @param ctx
+ * @param addr
+ * @param host
+ * @param is_ssl
+ * @param timeout
+ * @param cb
+ * @param ud
+ * @return waiter or NULL if there is no such a peer in the pool
+ */
+struct rspamd_http_keepalive_waiter *rspamd_http_context_wait_keepalive(struct rspamd_http_context *ctx,
+																		const rspamd_inet_addr_t *addr,
+																		const char *host,
+																		bool is_ssl,
+																		double timeout,
+																		rspamd_http_keepalive_wait_cb cb,
+																		gpointer ud);
+
+/**
+ * Cancels pending waiter, callback is not called
+ * @param waiter
+ */
+void rspamd_http_context_cancel_wait(struct rspamd_http_keepalive_waiter *waiter);
+
+/**
+ * Returns an array of keepalive pool statistics per peer
+ * @param ctx
+ * @return new ucl array
+ */
+ucl_object_t *rspamd_http_context_keepalive_stat(struct rspamd_http_context *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -334,6 +334,50 @@ rspamd_http_message_set_body_from_fstring_steal(struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+gboolean
+rspamd_http_message_move_body_to_shmem(struct rspamd_http_message *msg)
+{
+	union _rspamd_storage_u *storage;
+	rspamd_fstring_t *old_body;
+	const char *data;
+	gsize len, offset;
+
+	if (msg->flags & RSPAMD_HTTP_FLAG_SHMEM) {
+		return TRUE;
+	}
+
+	storage = &msg->body_buf.c;
+	old_body = storage->normal;
+	data = msg->body_buf.begin;
+	len = msg->body_buf.len;
+
+	if (old_body == NULL || len == 0) {
+		return FALSE;
+	}
+
+	/* Body might start after some data already consumed from the buffer */
+	offset = data - old_body->str;
+
+	/* Detach the old body, so it is not freed by storage cleanup */
+	storage->shared.name = NULL;
+	storage->shared.shm_fd = -1;
+	msg->body_buf.str = MAP_FAILED;
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+	if (!rspamd_http_message_set_body(msg, data, len)) {
+		/* Restore the original body */
+		rspamd_http_message_set_body_from_fstring_steal(msg, old_body);
+		msg->body_buf.begin = msg->body_buf.str + offset;
+		msg->body_buf.len = len;
+
+		return FALSE;
+	}
+
+	rspamd_fstring_free(old_body);
+
+	return TRUE;
+}
+
 gboolean
 rspamd_http_message_set_body_from_fstring_copy(struct rspamd_http_message *msg,
 											   const rspamd_fstring_t *fstr)
@@ -440,6 +484,33 @@ rspamd_http_message_append_body(struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+void rspamd_http_message_set_body_tail(struct rspamd_http_message *msg,
+									   const char *data, gsize len)
+{
+	msg->body_tail.begin = data;
+	msg->body_tail.len = data ? len : 0;
+}
+
+gboolean
+rspamd_http_message_flatten_body_tail(struct rspamd_http_message *msg)
+{
+	const char *data = msg->body_tail.begin;
+	gsize len = msg->body_tail.len;
+
+	if (len == 0) {
+		return TRUE;
+	}
+
+	msg->body_tail.begin = NULL;
+	msg->body_tail.len = 0;
+
+	if (msg->body_buf.len == 0) {
+		return rspamd_http_message_set_body(msg, data, len);
+	}
+
+	return rspamd_http_message_append_body(msg, data, len);
+}
+
 void rspamd_http_message_storage_cleanup(struct rspamd_http_message *msg)
 {
 	union _rspamd_storage_u *storage;
@@ -474,6 +545,8 @@ void rspamd_http_message_storage_cleanup(struct rspamd_http_message *msg)
 	}
 
 	msg->body_buf.len = 0;
+	msg->body_tail.begin = NULL;
+	msg->body_tail.len = 0;
 }
 
 void rspamd_http_message_free(struct rspamd_http_message *msg)
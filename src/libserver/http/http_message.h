@@ -121,6 +121,14 @@ void rspamd_http_message_set_method(struct rspamd_http_message *msg,
 gboolean rspamd_http_message_set_body_from_fd(struct rspamd_http_message *msg,
 											  int fd);
 
+/**
+ * Moves the body of a message to a shared memory segment, so it could be
+ * passed to local peers without copying
+ * @param msg
+ * @return TRUE if a message's body is now in a shared memory segment
+ */
+gboolean rspamd_http_message_move_body_to_shmem(struct rspamd_http_message *msg);
+
 /**
  * Uses rspamd_fstring_t as message's body, string is consumed by this operation
  * @param msg
@@ -149,6 +157,23 @@ gboolean rspamd_http_message_set_body_from_fstring_copy(struct rspamd_http_messa
 gboolean rspamd_http_message_append_body(struct rspamd_http_message *msg,
 										 const char *data, gsize len);
 
+/**
+ * Sets external segment that is written right after message's body
+ * without copying; data must be alive until the message is written
+ * @param msg
+ * @param data
+ * @param len
+ */
+void rspamd_http_message_set_body_tail(struct rspamd_http_message *msg,
+									   const char *data, gsize len);
+
+/**
+ * Copies external body segment (if any) to the message's body
+ * @param msg
+ * @return TRUE if a message's body has been set
+ */
+gboolean rspamd_http_message_flatten_body_tail(struct rspamd_http_message *msg);
+
 /**
  * Append a header to http message
  * @param rep
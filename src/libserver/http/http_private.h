@@ -72,6 +72,12 @@ struct rspamd_http_message {
 		} c;
 	} body_buf;
 
+	/* External segment written after the body as is, not owned by a message */
+	struct {
+		const char *begin;
+		gsize len;
+	} body_tail;
+
 	struct rspamd_cryptobox_pubkey *peer_key;
 	time_t date;
 	time_t last_modified;
@@ -88,7 +94,18 @@ struct rspamd_keepalive_hash_key {
 	char *host;
 	gboolean is_ssl;
 	unsigned port;
-	GQueue conns;
+	GQueue conns;   /* idle connections, most recently used first */
+	GQueue waiters; /* requests waiting for a free slot, FIFO */
+	unsigned busy;
+	unsigned reserved;
+	struct {
+		uint64_t created;
+		uint64_t reused;
+		uint64_t evicted;
+		uint64_t expired;
+		uint64_t waited;
+		uint64_t wait_timeouts;
+	} stat;
 };
 
 int32_t rspamd_keep_alive_key_hash(struct rspamd_keepalive_hash_key *k);
@@ -32,6 +32,10 @@
 #include <glob.h>   /* for glob */
 #include <unistd.h> /* for unlink */
 #include <optional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
 #include <cstdlib> /* for std::getenv */
 #include "unix-std.h"
 #include "rspamd_control.h"
@@ -281,20 +285,43 @@ public:
 };
 
 
+/**
+ * Read only mapping of a sealed memory file with databases deserialized in place,
+ * it is unmapped when the last database that points to it is freed
+ */
+struct hs_bundle_mapping {
+	void *map = nullptr;
+	std::size_t size = 0;
+
+	hs_bundle_mapping(void *map, std::size_t size)
+		: map(map), size(size)
+	{
+	}
+	hs_bundle_mapping(const hs_bundle_mapping &other) = delete;
+
+	~hs_bundle_mapping()
+	{
+		if (map) {
+			(void) munmap(map, size);
+		}
+	}
+};
+
 /**
  * This is a higher level representation of the cached hyperscan file
  */
 struct hs_shared_database {
 	hs_database_t *db = nullptr; /**< internal database (might be in a shared memory) */
 	std::optional<raii_mmaped_file> maybe_map;
+	std::shared_ptr<hs_bundle_mapping> bundle;
 	std::string cached_path;
 
 	~hs_shared_database()
 	{
-		if (!maybe_map) {
+		if (!maybe_map && !bundle) {
 			hs_free_database(db);
 		}
-		// Otherwise, handled by maybe_map dtor
+		// Otherwise, handled by maybe_map or bundle dtor
 	}
 
 	explicit hs_shared_database(raii_mmaped_file &&map, hs_database_t *db)
@@ -302,6 +329,12 @@ struct hs_shared_database {
 	{
 		cached_path = maybe_map.value().get_file().get_name();
 	}
+	explicit hs_shared_database(std::shared_ptr<hs_bundle_mapping> bundle, hs_database_t *db)
+		: db(db), maybe_map(std::nullopt), bundle(std::move(bundle))
+	{
+		/* Not a file, so it is never deleted as invalid */
+		cached_path = "";
+	}
 	explicit hs_shared_database(hs_database_t *db, const char *fname)
 		: db(db), maybe_map(std::nullopt)
 	{
@@ -323,10 +356,122 @@ struct hs_shared_database {
 	{
 		std::swap(db, other.db);
 		std::swap(maybe_map, other.maybe_map);
+		std::swap(bundle, other.bundle);
 		return *this;
 	}
 };
 
+/*
+ * Scratch space shared by all hyperscan databases of a process: hyperscan
+ * can grow a scratch to fit another database, so a single prototype is kept
+ * and each thread clones it when needed (and again once the prototype grows).
+ * Each level of nested scans takes its own scratch from a thread local list
+ */
+class hs_scratch_pool {
+private:
+	struct thread_scratch {
+		hs_scratch_t *scratch;
+		unsigned int generation;
+		bool in_use;
+	};
+
+	struct thread_scratches {
+		std::vector<thread_scratch> scratches;
+
+		~thread_scratches()
+		{
+			for (auto &elt: scratches) {
+				hs_free_scratch(elt.scratch);
+			}
+		}
+	};
+
+	std::mutex mtx;
+	hs_scratch_t *prototype = nullptr;
+	std::atomic<unsigned int> generation{0};
+
+	static auto local_scratches() -> thread_scratches &
+	{
+		static thread_local thread_scratches scratches;
+
+		return scratches;
+	}
+
+	hs_scratch_pool() = default;
+
+public:
+	hs_scratch_pool(const hs_scratch_pool &) = delete;
+	hs_scratch_pool(hs_scratch_pool &&) = delete;
+
+	static auto get() -> hs_scratch_pool &
+	{
+		// Never destroyed, as threads can still hold scratches on exit
+		static auto *singleton = new hs_scratch_pool;
+
+		return *singleton;
+	}
+
+	auto reserve(const hs_database_t *db) -> bool
+	{
+		std::lock_guard<std::mutex> lock{mtx};
+		auto *old_prototype = prototype;
+
+		if (hs_alloc_scratch(db, &prototype) != HS_SUCCESS) {
+			return false;
+		}
+
+		if (prototype != old_prototype) {
+			// Scratch has been reallocated, so clones are too small
+			generation++;
+		}
+
+		return true;
+	}
+
+	auto acquire() -> hs_scratch_t *
+	{
+		auto &local = local_scratches();
+		auto cur_generation = generation.load();
+
+		for (auto it = local.scratches.begin(); it != local.scratches.end();) {
+			if (!it->in_use && it->generation != cur_generation) {
+				hs_free_scratch(it->scratch);
+				it = local.scratches.erase(it);
+			}
+			else if (!it->in_use) {
+				it->in_use = true;
+				return it->scratch;
+			}
+			else {
+				++it;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock{mtx};
+		hs_scratch_t *scratch = nullptr;
+
+		if (prototype == nullptr || hs_clone_scratch(prototype, &scratch) != HS_SUCCESS) {
+			return nullptr;
+		}
+
+		local.scratches.push_back({scratch, generation.load(), true});
+
+		return scratch;
+	}
+
+	auto release(hs_scratch_t *scratch) -> void
+	{
+		auto &local = local_scratches();
+
+		for (auto &elt: local.scratches) {
+			if (elt.scratch == scratch) {
+				elt.in_use = false;
+				break;
+			}
+		}
+	}
+};
+
 struct real_hs_db {
 	std::uint32_t magic;
 	std::uint32_t version;
@@ -533,6 +678,8 @@ auto load_cached_hs_file(const char *fname, std::int64_t offset = 0) -> tl::expe
 
 #define CXX_DB_FROM_C(obj) (reinterpret_cast<rspamd::util::hs_shared_database *>(obj))
 #define C_DB_FROM_CXX(obj) (reinterpret_cast<rspamd_hyperscan_t *>(obj))
+#define CXX_BUNDLE_FROM_C(obj) (reinterpret_cast<std::shared_ptr<rspamd::util::hs_bundle_mapping> *>(obj))
+#define C_BUNDLE_FROM_CXX(obj) (reinterpret_cast<rspamd_hyperscan_bundle_t *>(obj))
 
 rspamd_hyperscan_t *
 rspamd_hyperscan_maybe_load(const char *filename, goffset offset)
@@ -624,4 +771,97 @@ void rspamd_hyperscan_notice_loaded(void)
 	rspamd::util::hs_known_files_cache::get().notice_loaded();
 }
 
-#endif// WITH_HYPERSCAN
\ No newline at end of file
+bool rspamd_hyperscan_scratch_reserve(const hs_database_t *db)
+{
+	return rspamd::util::hs_scratch_pool::get().reserve(db);
+}
+
+hs_scratch_t *
+rspamd_hyperscan_scratch_acquire(void)
+{
+	return rspamd::util::hs_scratch_pool::get().acquire();
+}
+
+void rspamd_hyperscan_scratch_release(hs_scratch_t *scratch)
+{
+	rspamd::util::hs_scratch_pool::get().release(scratch);
+}
+
+#endif// WITH_HYPERSCAN
+
+rspamd_hyperscan_bundle_t *
+rspamd_hyperscan_bundle_map(int fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+	constexpr auto required_seals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+	auto seals = fcntl(fd, F_GET_SEALS);
+
+	/* Databases are used in place, so nobody must be able to modify them */
+	if (seals == -1 || (seals & required_seals) != required_seals) {
+		msg_err_hyperscan("cannot use hyperscan bundle: file is not sealed");
+		return nullptr;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		msg_err_hyperscan("cannot stat hyperscan bundle: %s", strerror(errno));
+		return nullptr;
+	}
+
+	auto *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_hyperscan("cannot mmap hyperscan bundle: %s", strerror(errno));
+		return nullptr;
+	}
+
+	auto *bundle = new std::shared_ptr<rspamd::util::hs_bundle_mapping>(
+		std::make_shared<rspamd::util::hs_bundle_mapping>(map, st.st_size));
+
+	return C_BUNDLE_FROM_CXX(bundle);
+#else
+	msg_err_hyperscan("cannot use hyperscan bundle: sealing is not supported");
+	return nullptr;
+#endif
+}
+
+const unsigned char *
+rspamd_hyperscan_bundle_data(rspamd_hyperscan_bundle_t *bundle, gsize *len)
+{
+	auto &mapping = *CXX_BUNDLE_FROM_C(bundle);
+
+	*len = mapping->size;
+
+	return (const unsigned char *) mapping->map;
+}
+
+rspamd_hyperscan_t *
+rspamd_hyperscan_from_bundle(rspamd_hyperscan_bundle_t *bundle, gsize offset, gsize len)
+{
+	auto &mapping = *CXX_BUNDLE_FROM_C(bundle);
+
+	if (offset + len > mapping->size || offset % 8 != 0) {
+		msg_err_hyperscan("invalid database in hyperscan bundle: "
+						  "offset %uz, length %uz, bundle size %uz",
+						  offset, len, mapping->size);
+		return nullptr;
+	}
+
+	auto *raw = (unsigned char *) mapping->map + offset;
+	auto is_valid = rspamd::util::hs_is_valid_database(raw, len, "bundle");
+
+	if (!is_valid) {
+		msg_err_hyperscan("%s", is_valid.error().c_str());
+		return nullptr;
+	}
+
+	auto *ndb = new rspamd::util::hs_shared_database{mapping, (hs_database_t *) raw};
+
+	return C_DB_FROM_CXX(ndb);
+}
+
+void rspamd_hyperscan_bundle_unref(rspamd_hyperscan_bundle_t *bundle)
+{
+	delete CXX_BUNDLE_FROM_C(bundle);
+}
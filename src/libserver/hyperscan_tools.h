@@ -70,6 +70,60 @@ void rspamd_hyperscan_notice_loaded(void);
  */
 void rspamd_hyperscan_cleanup_maybe(void);
 
+/**
+ * Opaque read only mapping of a sealed memory file with many databases
+ */
+typedef struct rspamd_hyperscan_bundle_s rspamd_hyperscan_bundle_t;
+
+/**
+ * Maps a bundle, the file must be sealed for writing; fd can be closed after this call
+ * @param fd
+ * @return bundle or NULL
+ */
+rspamd_hyperscan_bundle_t *rspamd_hyperscan_bundle_map(int fd);
+
+/**
+ * Returns the whole mapped bundle
+ */
+const unsigned char *rspamd_hyperscan_bundle_data(rspamd_hyperscan_bundle_t *bundle, gsize *len);
+
+/**
+ * Uses a database deserialized in place inside a bundle with no copying,
+ * the bundle mapping is kept while any such database is alive
+ * @param offset offset of the database, must be aligned to 8 bytes
+ * @param len length of the database
+ * @return database or NULL if it is invalid
+ */
+rspamd_hyperscan_t *rspamd_hyperscan_from_bundle(rspamd_hyperscan_bundle_t *bundle,
+												 gsize offset, gsize len);
+
+/**
+ * Releases a bundle reference, databases loaded from it are not affected
+ */
+void rspamd_hyperscan_bundle_unref(rspamd_hyperscan_bundle_t *bundle);
+
+/**
+ * Grows the scratch space shared by all databases so it fits `db`,
+ * can be called from any thread
+ * @param db
+ * @return false if scratch cannot be allocated for this database
+ */
+bool rspamd_hyperscan_scratch_reserve(const hs_database_t *db);
+
+/**
+ * Returns a scratch suitable for all reserved databases for the current thread,
+ * nested scans get distinct scratches. It must be returned by
+ * `rspamd_hyperscan_scratch_release` once scan is done
+ * @return scratch or NULL if nothing has been reserved
+ */
+hs_scratch_t *rspamd_hyperscan_scratch_acquire(void);
+
+/**
+ * Returns scratch to the thread local pool
+ * @param scratch
+ */
+void rspamd_hyperscan_scratch_release(hs_scratch_t *scratch);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "io_replay.h"
+#include "cfg_file.h"
+#include "libutil/str_util.h"
+#include "libcryptobox/cryptobox.h"
+
+#define msg_err_io_replay(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
+														   "io_replay", NULL,    \
+														   RSPAMD_LOG_FUNC,      \
+														   __VA_ARGS__)
+#define msg_info_io_replay(...) rspamd_default_log_function(G_LOG_LEVEL_INFO, \
+															"io_replay", NULL, \
+															RSPAMD_LOG_FUNC,   \
+															__VA_ARGS__)
+
+struct rspamd_io_replay_entry {
+	GPtrArray *replies;
+	GArray *latencies; /* negative if not recorded */
+	unsigned int cur;
+};
+
+struct rspamd_io_replay {
+	/* "proto request" -> struct rspamd_io_replay_entry */
+	GHashTable *entries;
+	double default_latency;
+	int record_fd;
+};
+
+static void
+rspamd_io_replay_entry_free(gpointer p)
+{
+	struct rspamd_io_replay_entry *entry = (struct rspamd_io_replay_entry *) p;
+
+	g_ptr_array_free(entry->replies, TRUE);
+	g_array_free(entry->latencies, TRUE);
+	g_free(entry);
+}
+
+static void
+rspamd_io_replay_dtor(gpointer p)
+{
+	struct rspamd_io_replay *replay = (struct rspamd_io_replay *) p;
+
+	g_hash_table_unref(replay->entries);
+
+	if (replay->record_fd != -1) {
+		close(replay->record_fd);
+	}
+
+	g_free(replay);
+}
+
+/*
+ * Loads replies from the file, dns replies (with no `proto`) are skipped
+ */
+static void
+rspamd_io_replay_load(struct rspamd_config *cfg,
+					  struct rspamd_io_replay *replay,
+					  const char *fname)
+{
+	FILE *fp;
+	char *linebuf = NULL;
+	gsize buflen = 0;
+	unsigned int nrecords = 0;
+
+	fp = fopen(fname, "r");
+
+	if (fp == NULL) {
+		msg_err_config("cannot open io replay file %s: %s", fname,
+					   strerror(errno));
+
+		return;
+	}
+
+	while (getline(&linebuf, &buflen, fp) > 0) {
+		struct ucl_parser *parser;
+		const ucl_object_t *proto, *request, *reply, *latency;
+		struct rspamd_io_replay_entry *entry;
+		ucl_object_t *obj;
+		char *key;
+		double lat = -1.0;
+
+		g_strchomp(linebuf);
+
+		if (linebuf[0] == '\0') {
+			continue;
+		}
+
+		parser = ucl_parser_new(UCL_PARSER_NO_FILEVARS);
+
+		if (!ucl_parser_add_string(parser, linebuf, 0)) {
+			msg_err_config("invalid record in io replay file %s: %s",
+						   fname, ucl_parser_get_error(parser));
+			ucl_parser_free(parser);
+			continue;
+		}
+
+		obj = ucl_parser_get_object(parser);
+		ucl_parser_free(parser);
+
+		proto = ucl_object_lookup(obj, "proto");
+
+		if (proto == NULL) {
+			/* DNS reply */
+			ucl_object_unref(obj);
+			continue;
+		}
+
+		request = ucl_object_lookup(obj, "request");
+		reply = ucl_object_lookup(obj, "reply");
+
+		if (ucl_object_type(proto) != UCL_STRING || request == NULL ||
+			ucl_object_type(request) != UCL_STRING || reply == NULL) {
+			msg_err_config("invalid record in io replay file %s: "
+						   "proto, request and reply are required",
+						   fname);
+			ucl_object_unref(obj);
+			continue;
+		}
+
+		latency = ucl_object_lookup(obj, "latency");
+
+		if (latency) {
+			lat = ucl_object_todouble(latency);
+		}
+
+		key = g_strdup_printf("%s %s", ucl_object_tostring(proto),
+							  ucl_object_tostring(request));
+		entry = g_hash_table_lookup(replay->entries, key);
+
+		if (entry == NULL) {
+			entry = g_malloc0(sizeof(*entry));
+			entry->replies = g_ptr_array_new_with_free_func(
+				(GDestroyNotify) ucl_object_unref);
+			entry->latencies = g_array_new(FALSE, FALSE, sizeof(double));
+			g_hash_table_insert(replay->entries, key, entry);
+		}
+		else {
+			g_free(key);
+		}
+
+		g_ptr_array_add(entry->replies, ucl_object_ref(reply));
+		g_array_append_val(entry->latencies, lat);
+		ucl_object_unref(obj);
+		nrecords++;
+	}
+
+	if (linebuf) {
+		free(linebuf);
+	}
+
+	fclose(fp);
+	msg_info_config("loaded %ud io replies to replay from %s",
+					nrecords, fname);
+}
+
+struct rspamd_io_replay *
+rspamd_io_replay_get(struct rspamd_config *cfg)
+{
+	struct rspamd_io_replay *replay;
+
+	if (cfg == NULL) {
+		return NULL;
+	}
+
+	if (cfg->io_replay_ctx) {
+		return cfg->io_replay_ctx;
+	}
+
+	if (cfg->io_record == NULL && cfg->io_replay == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * It is created lazily as workers are forked after the config is loaded,
+	 * so each of them opens its own record descriptor
+	 */
+	replay = g_malloc0(sizeof(*replay));
+	replay->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+											g_free, rspamd_io_replay_entry_free);
+	replay->default_latency = cfg->io_replay_latency;
+	replay->record_fd = -1;
+
+	if (cfg->io_replay) {
+		rspamd_io_replay_load(cfg, replay, cfg->io_replay);
+	}
+
+	if (cfg->io_record) {
+		replay->record_fd = open(cfg->io_record,
+								 O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+								 00644);
+
+		if (replay->record_fd == -1) {
+			msg_err_config("cannot open io record file %s: %s",
+						   cfg->io_record, strerror(errno));
+		}
+	}
+
+	rspamd_mempool_add_destructor(cfg->cfg_pool, rspamd_io_replay_dtor, replay);
+	cfg->io_replay_ctx = replay;
+
+	return replay;
+}
+
+gboolean
+rspamd_io_replay_is_recording(struct rspamd_io_replay *replay)
+{
+	return replay != NULL && replay->record_fd != -1;
+}
+
+char *
+rspamd_io_replay_key(const char *prefix, uint64_t hash)
+{
+	return g_strdup_printf("%s %016" G_GINT64_MODIFIER "x", prefix,
+						   (guint64) hash);
+}
+
+const ucl_object_t *
+rspamd_io_replay_lookup(struct rspamd_io_replay *replay,
+						const char *proto,
+						const char *request,
+						double *latency)
+{
+	struct rspamd_io_replay_entry *entry;
+	const ucl_object_t *reply;
+	double lat;
+	char *key;
+
+	if (replay == NULL || g_hash_table_size(replay->entries) == 0) {
+		return NULL;
+	}
+
+	key = g_strdup_printf("%s %s", proto, request);
+	entry = g_hash_table_lookup(replay->entries, key);
+	g_free(key);
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	reply = g_ptr_array_index(entry->replies, entry->cur);
+	lat = g_array_index(entry->latencies, double, entry->cur);
+
+	if (entry->cur + 1 < entry->replies->len) {
+		entry->cur++;
+	}
+
+	if (latency) {
+		*latency = lat >= 0 ? lat : replay->default_latency;
+	}
+
+	return reply;
+}
+
+void rspamd_io_replay_record(struct rspamd_io_replay *replay,
+							 const char *proto,
+							 const char *request,
+							 ucl_object_t *reply,
+							 double latency)
+{
+	ucl_object_t *top;
+	GString *line;
+	char *out;
+
+	if (!rspamd_io_replay_is_recording(replay)) {
+		ucl_object_unref(reply);
+
+		return;
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromstring(proto), "proto", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromstring(request),
+						  "request", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromdouble(latency),
+						  "latency", 0, false);
+	ucl_object_insert_key(top, reply, "reply", 0, false);
+
+	out = (char *) ucl_object_emit(top, UCL_EMIT_JSON_COMPACT);
+	ucl_object_unref(top);
+
+	if (out) {
+		line = g_string_new(out);
+		g_string_append_c(line, '\n');
+
+		/* Single write to an append only file is not interleaved by other workers */
+		if (write(replay->record_fd, line->str, line->len) == -1) {
+			msg_err_io_replay("cannot record %s reply for %s: %s",
+							  proto, request, strerror(errno));
+		}
+
+		g_string_free(line, TRUE);
+		free(out);
+	}
+}
+
+ucl_object_t *
+rspamd_io_replay_data_to_ucl(const void *data, gsize len)
+{
+	ucl_object_t *obj;
+	char *b64;
+	gsize outlen;
+
+	b64 = rspamd_encode_base64(data, len, 0, &outlen);
+
+	if (b64 == NULL) {
+		return ucl_object_fromstring("");
+	}
+
+	obj = ucl_object_fromlstring(b64, outlen);
+	g_free(b64);
+
+	return obj;
+}
+
+unsigned char *
+rspamd_io_replay_data_from_ucl(const ucl_object_t *obj, gsize *len)
+{
+	const char *b64;
+	unsigned char *out;
+	gsize inlen, outlen;
+
+	if (obj == NULL || ucl_object_type(obj) != UCL_STRING) {
+		return NULL;
+	}
+
+	b64 = ucl_object_tolstring(obj, &inlen);
+	outlen = inlen / 4 * 3 + 3;
+	out = g_malloc(outlen + 1);
+
+	if (!rspamd_cryptobox_base64_decode(b64, inlen, out, &outlen)) {
+		g_free(out);
+
+		return NULL;
+	}
+
+	out[outlen] = '\0';
+	*len = outlen;
+
+	return out;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_IO_REPLAY_H
+#define RSPAMD_IO_REPLAY_H
+
+#include "config.h"
+#include "ucl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_config;
+struct rspamd_io_replay;
+
+/*
+ * Replies of redis, http and tcp requests are stored in the same file as
+ * recorded dns replies, one JSON object per line:
+ * {"proto": "http", "request": "GET http://host/ 0123456789abcdef",
+ *  "latency": 0.01, "reply": {...}}
+ * Request is a readable prefix followed by the hash of the whole request,
+ * reply is protocol specific. Several replies of the same request are
+ * replayed in order, the last one is then repeated.
+ */
+
+/**
+ * Returns record/replay state of the config, it is created on the first call
+ * @return NULL if neither `io_record` nor `io_replay` is configured
+ */
+struct rspamd_io_replay *rspamd_io_replay_get(struct rspamd_config *cfg);
+
+/**
+ * Returns TRUE if replies should be recorded
+ */
+gboolean rspamd_io_replay_is_recording(struct rspamd_io_replay *replay);
+
+/**
+ * Builds request key from a readable prefix and a hash of the request data
+ * @return key that should be freed by g_free
+ */
+char *rspamd_io_replay_key(const char *prefix, uint64_t hash);
+
+/**
+ * Finds a recorded reply for the request
+ * @param latency output for the delay the reply should be delivered with
+ * @return reply owned by the replay state or NULL if request is not recorded
+ */
+const ucl_object_t *rspamd_io_replay_lookup(struct rspamd_io_replay *replay,
+											const char *proto,
+											const char *request,
+											double *latency);
+
+/**
+ * Appends the reply to the record file, `reply` is consumed
+ */
+void rspamd_io_replay_record(struct rspamd_io_replay *replay,
+							 const char *proto,
+							 const char *request,
+							 ucl_object_t *reply,
+							 double latency);
+
+/**
+ * Converts binary data to an object to be stored in a reply
+ */
+ucl_object_t *rspamd_io_replay_data_to_ucl(const void *data, gsize len);
+
+/**
+ * Extracts binary data stored by `rspamd_io_replay_data_to_ucl`
+ * @return data that should be freed by g_free or NULL if obj is invalid
+ */
+unsigned char *rspamd_io_replay_data_from_ucl(const ucl_object_t *obj,
+											  gsize *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
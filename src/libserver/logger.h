@@ -144,6 +144,22 @@ bool rspamd_common_logv(rspamd_logger_t *logger, int level_flags,
 						const char *module, const char *id, const char *function,
 						const char *fmt, va_list args);
 
+/**
+ * Returns true if a message with the specified level and module would be logged,
+ * allows to skip formatting of the arguments altogether
+ */
+bool rspamd_common_log_enabled(rspamd_logger_t *logger, int level_flags,
+							   const char *module);
+
+/**
+ * Logs an already formatted line of the specified length (escaping and
+ * encryption are still applied), lines longer than RSPAMD_LOGBUF_SIZE are
+ * truncated. The caller must check rspamd_common_log_enabled first
+ */
+bool rspamd_common_log_write(rspamd_logger_t *logger, int level_flags,
+							 const char *module, const char *id, const char *function,
+							 const char *line, gsize len);
+
 /**
  * Add new logging module, returns module ID
  * @param mod
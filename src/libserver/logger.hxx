@@ -0,0 +1,73 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_LOGGER_HXX
+#define RSPAMD_LOGGER_HXX
+#pragma once
+
+#include "config.h"
+#include "logger.h"
+#include "fmt/format.h"
+
+/***
+ * Logging helpers for C++ code: format strings are checked at compile time
+ * by fmt and arguments are formatted without parsing printf style specifiers
+ * at runtime. Nothing is formatted if the message is not going to be logged.
+ */
+namespace rspamd::logging {
+
+template<typename... T>
+inline auto log_fmt(rspamd_logger_t *logger, int level_flags,
+					const char *module, const char *id, const char *function,
+					fmt::format_string<T...> fmt, T &&...args) -> bool
+{
+	if (!rspamd_common_log_enabled(logger, level_flags, module)) {
+		return false;
+	}
+
+	/* Longer messages are truncated just like printf based ones */
+	char buf[RSPAMD_LOGBUF_SIZE];
+	auto res = fmt::format_to_n(buf, sizeof(buf) - 1, fmt, std::forward<T>(args)...);
+
+	return rspamd_common_log_write(logger, level_flags, module, id, function,
+								   buf, res.out - buf);
+}
+
+}// namespace rspamd::logging
+
+#define RSPAMD_LOG_FMT(level, module, id, ...) \
+	rspamd::logging::log_fmt(NULL, (level), (module), (id), RSPAMD_LOG_FUNC, __VA_ARGS__)
+
+#define msg_err_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_CRITICAL, NULL, NULL, __VA_ARGS__)
+#define msg_warn_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_WARNING, NULL, NULL, __VA_ARGS__)
+#define msg_info_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_INFO, NULL, NULL, __VA_ARGS__)
+#define msg_notice_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_MESSAGE, NULL, NULL, __VA_ARGS__)
+
+/* Use the following macros if you have `task` in the function */
+#define msg_err_task_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_CRITICAL,                                   \
+											 task->task_pool->tag.tagname, task->task_pool->tag.uid, \
+											 __VA_ARGS__)
+#define msg_warn_task_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_WARNING,                                    \
+											  task->task_pool->tag.tagname, task->task_pool->tag.uid, \
+											  __VA_ARGS__)
+#define msg_info_task_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_INFO,                                       \
+											  task->task_pool->tag.tagname, task->task_pool->tag.uid, \
+											  __VA_ARGS__)
+#define msg_notice_task_fmt(...) RSPAMD_LOG_FMT(G_LOG_LEVEL_MESSAGE,                                    \
+												task->task_pool->tag.tagname, task->task_pool->tag.uid, \
+												__VA_ARGS__)
+
+#endif//RSPAMD_LOGGER_HXX
@@ -423,99 +423,133 @@ rspamd_log_write_ringbuffer(rspamd_logger_t *rspamd_log,
 	g_atomic_int_set(&elt->completed, 1);
 }
 
-bool rspamd_common_logv(rspamd_logger_t *rspamd_log, int level_flags,
-						const char *module, const char *id, const char *function,
-						const char *fmt, va_list args)
+static inline int
+rspamd_log_module_id(int level_flags, const char *module)
 {
-	char *end;
-	int level = level_flags & (RSPAMD_LOG_LEVEL_MASK & G_LOG_LEVEL_MASK), mod_id;
+	int level = level_flags & (RSPAMD_LOG_LEVEL_MASK & G_LOG_LEVEL_MASK);
+
+	if (level == G_LOG_LEVEL_DEBUG) {
+		return rspamd_logger_add_debug_module(module);
+	}
+
+	return -1;
+}
+
+bool rspamd_common_log_enabled(rspamd_logger_t *rspamd_log, int level_flags,
+							   const char *module)
+{
+	if (G_UNLIKELY(rspamd_log == NULL)) {
+		rspamd_log = default_logger;
+	}
+
+	if (G_UNLIKELY(rspamd_log == NULL)) {
+		/* Messages are printed to stderr in this case */
+		return (level_flags & (RSPAMD_LOG_LEVEL_MASK & G_LOG_LEVEL_MASK)) >= G_LOG_LEVEL_INFO;
+	}
+
+	return rspamd_logger_need_log(rspamd_log, level_flags,
+								  rspamd_log_module_id(level_flags, module));
+}
+
+bool rspamd_common_log_write(rspamd_logger_t *rspamd_log, int level_flags,
+							 const char *module, const char *id, const char *function,
+							 const char *line, gsize len)
+{
+	int level = level_flags & (RSPAMD_LOG_LEVEL_MASK & G_LOG_LEVEL_MASK);
+	const char *log_line, *end;
 	bool ret = false;
-	char logbuf[RSPAMD_LOGBUF_SIZE], *log_line;
 	gsize nescaped;
 
+	/* Escaped line is allocated on stack, so it is bound as printf lines are */
+	if (len >= RSPAMD_LOGBUF_SIZE) {
+		len = RSPAMD_LOGBUF_SIZE - 1;
+	}
+
+	log_line = line;
+	end = line + len;
+
 	if (G_UNLIKELY(rspamd_log == NULL)) {
 		rspamd_log = default_logger;
 	}
 
-	log_line = logbuf;
-
 	if (G_UNLIKELY(rspamd_log == NULL)) {
 		/* Just fprintf message to stderr */
-		if (level >= G_LOG_LEVEL_INFO) {
-			end = rspamd_vsnprintf(logbuf, sizeof(logbuf), fmt, args);
-			rspamd_fprintf(stderr, "%*s\n", (int) (end - log_line),
-						   log_line);
-		}
+		rspamd_fprintf(stderr, "%*s\n", (int) len, line);
+
+		return false;
 	}
-	else {
-		if (level == G_LOG_LEVEL_DEBUG) {
-			mod_id = rspamd_logger_add_debug_module(module);
-		}
-		else {
-			mod_id = -1;
+
+	if (!(rspamd_log->flags & RSPAMD_LOG_FLAG_RSPAMADM)) {
+		if ((nescaped = rspamd_log_line_need_escape(line, len)) != 0) {
+			char *logbuf_escaped = g_alloca(len + nescaped * 4);
+			log_line = logbuf_escaped;
+
+			end = rspamd_log_line_hex_escape(line, len,
+											 logbuf_escaped, len + nescaped * 4);
 		}
+	}
 
-		if (rspamd_logger_need_log(rspamd_log, level_flags, mod_id)) {
-			end = rspamd_vsnprintf(logbuf, sizeof(logbuf), fmt, args);
+	if ((level_flags & RSPAMD_LOG_ENCRYPTED) && rspamd_log->pk) {
+		char *encrypted;
+		gsize enc_len;
+
+		encrypted = rspamd_log_encrypt_message(log_line, end, &enc_len,
+											   rspamd_log);
+		ret = rspamd_log->ops.log(module, id,
+								  function,
+								  level_flags,
+								  encrypted,
+								  enc_len,
+								  rspamd_log,
+								  rspamd_log->ops.specific);
+		g_free(encrypted);
+	}
+	else {
+		ret = rspamd_log->ops.log(module, id,
+								  function,
+								  level_flags,
+								  log_line,
+								  end - log_line,
+								  rspamd_log,
+								  rspamd_log->ops.specific);
+	}
 
-			if (!(rspamd_log->flags & RSPAMD_LOG_FLAG_RSPAMADM)) {
-				if ((nescaped = rspamd_log_line_need_escape(logbuf, end - logbuf)) != 0) {
-					gsize unescaped_len = end - logbuf;
-					char *logbuf_escaped = g_alloca(unescaped_len + nescaped * 4);
-					log_line = logbuf_escaped;
+	switch (level) {
+	case G_LOG_LEVEL_CRITICAL:
+		rspamd_log->log_cnt[0]++;
+		rspamd_log_write_ringbuffer(rspamd_log, module, id, log_line,
+									end - log_line);
+		break;
+	case G_LOG_LEVEL_WARNING:
+		rspamd_log->log_cnt[1]++;
+		break;
+	case G_LOG_LEVEL_INFO:
+		rspamd_log->log_cnt[2]++;
+		break;
+	case G_LOG_LEVEL_DEBUG:
+		rspamd_log->log_cnt[3]++;
+		break;
+	default:
+		break;
+	}
 
-					end = rspamd_log_line_hex_escape(logbuf, unescaped_len,
-													 logbuf_escaped, unescaped_len + nescaped * 4);
-				}
-			}
+	return ret;
+}
 
-			if ((level_flags & RSPAMD_LOG_ENCRYPTED) && rspamd_log->pk) {
-				char *encrypted;
-				gsize enc_len;
-
-				encrypted = rspamd_log_encrypt_message(log_line, end, &enc_len,
-													   rspamd_log);
-				ret = rspamd_log->ops.log(module, id,
-										  function,
-										  level_flags,
-										  encrypted,
-										  enc_len,
-										  rspamd_log,
-										  rspamd_log->ops.specific);
-				g_free(encrypted);
-			}
-			else {
-				ret = rspamd_log->ops.log(module, id,
-										  function,
-										  level_flags,
-										  log_line,
-										  end - log_line,
-										  rspamd_log,
-										  rspamd_log->ops.specific);
-			}
+bool rspamd_common_logv(rspamd_logger_t *rspamd_log, int level_flags,
+						const char *module, const char *id, const char *function,
+						const char *fmt, va_list args)
+{
+	char logbuf[RSPAMD_LOGBUF_SIZE], *end;
 
-			switch (level) {
-			case G_LOG_LEVEL_CRITICAL:
-				rspamd_log->log_cnt[0]++;
-				rspamd_log_write_ringbuffer(rspamd_log, module, id, log_line,
-											end - log_line);
-				break;
-			case G_LOG_LEVEL_WARNING:
-				rspamd_log->log_cnt[1]++;
-				break;
-			case G_LOG_LEVEL_INFO:
-				rspamd_log->log_cnt[2]++;
-				break;
-			case G_LOG_LEVEL_DEBUG:
-				rspamd_log->log_cnt[3]++;
-				break;
-			default:
-				break;
-			}
-		}
+	if (!rspamd_common_log_enabled(rspamd_log, level_flags, module)) {
+		return false;
 	}
 
-	return ret;
+	end = rspamd_vsnprintf(logbuf, sizeof(logbuf), fmt, args);
+
+	return rspamd_common_log_write(rspamd_log, level_flags, module, id, function,
+								   logbuf, end - logbuf);
 }
 
 /**
@@ -22,10 +22,37 @@
 
 #include "logger_private.h"
 
+#include <pthread.h>
+#include <signal.h>
+
 #define FILE_LOG_QUARK g_quark_from_static_string("file_logger")
 
+/*
+ * Single producer/single consumer ring of formatted log lines: a process
+ * appends lines without blocking and a writer thread drains them to the file
+ */
+struct rspamd_log_ring {
+	unsigned char *buf;
+	gsize size; /* power of two */
+	/* Written by producer only */
+	gsize head;
+	unsigned char __padding1[64 - sizeof(gsize)];
+	/* Written by writer thread only */
+	gsize tail;
+	unsigned char __padding2[64 - sizeof(gsize)];
+	uint64_t dropped;
+	int waiting;
+	int stop;
+	gboolean running;
+	pthread_t thr;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+};
+
 struct rspamd_file_logger_priv {
 	int fd;
+	rspamd_logger_t *logger;
+	struct rspamd_log_ring *ring;
 	struct {
 		uint32_t size;
 		uint32_t used;
@@ -185,6 +212,155 @@ rspamd_log_flush(rspamd_logger_t *rspamd_log, struct rspamd_file_logger_priv *pr
 	}
 }
 
+static void *
+rspamd_log_ring_writer(void *arg)
+{
+	struct rspamd_file_logger_priv *priv = (struct rspamd_file_logger_priv *) arg;
+	struct rspamd_log_ring *ring = priv->ring;
+	struct iovec iov[2];
+	gsize head, tail, pos, len;
+	int niov;
+
+	for (;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+		tail = ring->tail;
+
+		if (head != tail) {
+			pos = tail & (ring->size - 1);
+			len = head - tail;
+			iov[0].iov_base = ring->buf + pos;
+			iov[0].iov_len = MIN(len, ring->size - pos);
+			niov = 1;
+
+			if (len > iov[0].iov_len) {
+				iov[1].iov_base = ring->buf;
+				iov[1].iov_len = len - iov[0].iov_len;
+				niov = 2;
+			}
+
+			/* Data is consumed even on error, as in the synchronous mode */
+			direct_write_log_line(priv->logger, priv, iov, niov, TRUE, 0);
+			__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+			continue;
+		}
+
+		if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		pthread_mutex_lock(&ring->mtx);
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+		/* Producer signals us under the mutex, so no wakeup can be lost */
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+			!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&ring->cond, &ring->mtx);
+		}
+
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&ring->mtx);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_log_ring_wakeup(struct rspamd_log_ring *ring)
+{
+	pthread_mutex_lock(&ring->mtx);
+	pthread_cond_signal(&ring->cond);
+	pthread_mutex_unlock(&ring->mtx);
+}
+
+static gboolean
+rspamd_log_ring_start(struct rspamd_file_logger_priv *priv)
+{
+	struct rspamd_log_ring *ring = priv->ring;
+	sigset_t all, old;
+	int r;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+	ring->waiting = 0;
+	ring->stop = 0;
+	pthread_mutex_init(&ring->mtx, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	/* Signals must be delivered to the event loop thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r = pthread_create(&ring->thr, NULL, rspamd_log_ring_writer, priv);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ring->running = (r == 0);
+
+	if (r != 0) {
+		errno = r;
+	}
+
+	return ring->running;
+}
+
+static void
+rspamd_log_ring_stop(struct rspamd_file_logger_priv *priv)
+{
+	struct rspamd_log_ring *ring = priv->ring;
+
+	if (ring->running) {
+		/* Writer drains everything left before exiting */
+		__atomic_store_n(&ring->stop, 1, __ATOMIC_SEQ_CST);
+		rspamd_log_ring_wakeup(ring);
+		pthread_join(ring->thr, NULL);
+		ring->running = FALSE;
+		pthread_mutex_destroy(&ring->mtx);
+		pthread_cond_destroy(&ring->cond);
+	}
+}
+
+/*
+ * Appends a line to the ring, returns false if there is no space for it
+ */
+static bool
+rspamd_log_ring_push(struct rspamd_log_ring *ring,
+					 const struct iovec *iov, unsigned int iovcnt)
+{
+	gsize len = 0, head, tail, pos, chunk;
+	unsigned int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (len > ring->size - (head - tail)) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+
+		return false;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		const unsigned char *p = iov[i].iov_base;
+
+		pos = head & (ring->size - 1);
+		chunk = MIN(iov[i].iov_len, ring->size - pos);
+		memcpy(ring->buf + pos, p, chunk);
+		memcpy(ring->buf, p + chunk, iov[i].iov_len - chunk);
+		head += iov[i].iov_len;
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+		rspamd_log_ring_wakeup(ring);
+	}
+
+	return true;
+}
+
 /*
  * Write message to buffer or to file (using direct_write_log_line function)
  */
@@ -198,7 +374,30 @@ file_log_helper(rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	unsigned int i;
 
-	if (!priv->is_buffered) {
+	if (priv->ring && priv->ring->running) {
+		uint64_t dropped;
+
+		if (!rspamd_log_ring_push(priv->ring, iov, iovcnt)) {
+			return false;
+		}
+
+		dropped = __atomic_exchange_n(&priv->ring->dropped, 0, __ATOMIC_RELAXED);
+
+		if (G_UNLIKELY(dropped > 0)) {
+			char tmpbuf[256];
+			gssize r;
+
+			r = rspamd_snprintf(tmpbuf, sizeof(tmpbuf),
+								"%uL log messages have been dropped as log ring is full",
+								dropped);
+			rspamd_log_file_log(NULL, NULL, G_STRFUNC,
+								G_LOG_LEVEL_WARNING | RSPAMD_LOG_FORCED,
+								tmpbuf, r, rspamd_log, priv);
+		}
+
+		return true;
+	}
+	else if (!priv->is_buffered) {
 		/* Write string directly */
 		return direct_write_log_line(rspamd_log, priv, (void *) iov, iovcnt,
 									 TRUE, level_flags);
@@ -336,6 +535,7 @@ rspamd_log_file_init(rspamd_logger_t *logger, struct rspamd_config *cfg,
 		priv->log_file = g_strdup(cfg->log_file);
 	}
 
+	priv->logger = logger;
 	priv->log_severity = (logger->flags & RSPAMD_LOG_FLAG_SEVERITY);
 	priv->fd = rspamd_try_open_log_fd(logger, priv, uid, gid, err);
 
@@ -345,6 +545,25 @@ rspamd_log_file_init(rspamd_logger_t *logger, struct rspamd_config *cfg,
 		return NULL;
 	}
 
+	if (cfg->log_async) {
+		gsize size = 1;
+
+		while (size < (cfg->log_async_size ? cfg->log_async_size : LOG_RING_LEN)) {
+			size <<= 1;
+		}
+
+		priv->ring = g_malloc0(sizeof(*priv->ring));
+		priv->ring->size = size;
+		priv->ring->buf = g_malloc(size);
+
+		if (!rspamd_log_ring_start(priv)) {
+			/* Fallback to synchronous writes */
+			g_free(priv->ring->buf);
+			g_free(priv->ring);
+			priv->ring = NULL;
+		}
+	}
+
 	return priv;
 }
 
@@ -355,6 +574,12 @@ void rspamd_log_file_dtor(rspamd_logger_t *logger, gpointer arg)
 	rspamd_log_reset_repeated(logger, priv);
 	rspamd_log_flush(logger, priv);
 
+	if (priv->ring) {
+		rspamd_log_ring_stop(priv);
+		g_free(priv->ring->buf);
+		g_free(priv->ring);
+	}
+
 	if (priv->fd != -1) {
 		if (close(priv->fd) == -1) {
 			rspamd_fprintf(stderr, "cannot close log fd %d: %s; log file = %s\n",
@@ -502,9 +727,23 @@ bool rspamd_log_file_on_fork(rspamd_logger_t *logger, struct rspamd_config *cfg,
 							 gpointer arg, GError **err)
 {
 	struct rspamd_file_logger_priv *priv = (struct rspamd_file_logger_priv *) arg;
+	bool ret = true;
+
+	if (priv->ring && priv->ring->running) {
+		/*
+		 * Writer thread is not inherited by a child, lines pending in the
+		 * ring are written by the parent, so start with an empty ring
+		 */
+		if (!rspamd_log_ring_start(priv)) {
+			g_set_error(err, FILE_LOG_QUARK, errno,
+						"cannot start log writer thread: %s, log synchronously",
+						strerror(errno));
+			ret = false;
+		}
+	}
 
 	rspamd_log_reset_repeated(logger, priv);
 	rspamd_log_flush(logger, priv);
 
-	return true;
+	return ret;
 }
\ No newline at end of file
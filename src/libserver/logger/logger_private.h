@@ -22,6 +22,7 @@
 #define REPEATS_MIN 3
 #define REPEATS_MAX 300
 #define LOGBUF_LEN 8192
+#define LOG_RING_LEN (1024 * 1024)
 
 struct rspamd_log_module {
 	char *mname;
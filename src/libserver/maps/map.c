@@ -20,9 +20,12 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_helpers.h"
+#include "map_image.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "rspamd.h"
+#include "libutil/cxx/cpu_pool.h"
 #include "contrib/libev/ev.h"
 #include "contrib/uthash/utlist.h"
 
@@ -68,6 +71,20 @@ static gboolean read_map_file_chunks(struct rspamd_map *map,
 									 const char *fname,
 									 gsize len,
 									 goffset off);
+static gboolean read_map_zstd_chunks(struct rspamd_map *map,
+									struct map_cb_data *cbdata,
+									const char *src,
+									const unsigned char *in,
+									gsize inlen,
+									int fd,
+									gsize *outlen);
+static int rspamd_map_open_http_cached_file(struct rspamd_map *map,
+											struct rspamd_map_backend *bk,
+											struct http_map_data *htdata,
+											char *path, gsize pathlen);
+static void rspamd_map_close_http_cached_file(struct rspamd_map *map,
+											  struct rspamd_map_backend *bk,
+											  int fd, const char *path);
 static gboolean rspamd_map_save_http_cached_file(struct rspamd_map *map,
 												 struct rspamd_map_backend *bk,
 												 struct http_map_data *htdata,
@@ -83,6 +100,70 @@ RSPAMD_CONSTRUCTOR(rspamd_map_log_init)
 	rspamd_map_log_id = rspamd_logger_add_debug_module("map");
 }
 
+/* Read and fin callbacks are timed to report the cost of map data */
+static char *
+rspamd_map_call_read(struct rspamd_map *map, char *chunk, int len,
+					 struct map_cb_data *cbdata, gboolean final)
+{
+	double t1 = rspamd_get_ticks(FALSE);
+	char *ret;
+
+	ret = map->read_callback(chunk, len, cbdata, final);
+	cbdata->load_time += rspamd_get_ticks(FALSE) - t1;
+
+	return ret;
+}
+
+static void
+rspamd_map_call_fin(struct rspamd_map *map, struct map_cb_data *cbdata)
+{
+	double t1 = rspamd_get_ticks(FALSE);
+
+	if (cbdata->compile && cbdata->cur_data && !cbdata->errored) {
+		/* Not compiled in a helper thread */
+		cbdata->compile(cbdata->cur_data);
+	}
+
+	cbdata->compile = NULL;
+	map->fin_callback(cbdata, map->user_data);
+
+	if (!cbdata->errored) {
+		map->load_time = cbdata->load_time + rspamd_get_ticks(FALSE) - t1;
+	}
+}
+
+/*
+ * Delta updates: if a map has a single plain HTTP backend, we send a version
+ * of our data in `X-Map-Version` header. A server can reply with a full map
+ * with a new `X-Map-Version` or with `X-Map-Delta: <our version>`, and then
+ * the body contains records `+<map line>` and `-<key>` that are applied to
+ * the current data in place. Other processes read a full data and deltas
+ * since it from the shared cache.
+ */
+static gboolean
+rspamd_map_http_delta_enabled(struct rspamd_map *map,
+							  struct rspamd_map_backend *bk)
+{
+	return map->accept_deltas && map->backends->len == 1 &&
+		   !bk->is_compressed && !bk->is_signed;
+}
+
+static uint64_t
+rspamd_map_http_version_header(struct rspamd_http_message *msg,
+							   const char *name)
+{
+	const rspamd_ftok_t *hdr;
+	unsigned long version = 0;
+
+	hdr = rspamd_http_message_find_header(msg, name);
+
+	if (hdr && !rspamd_strtoul(hdr->begin, hdr->len, &version)) {
+		version = 0;
+	}
+
+	return version;
+}
+
 /**
  * Write HTTP request
  */
@@ -91,6 +172,7 @@ write_http_request(struct http_callback_data *cbd)
 {
 	char datebuf[128];
 	struct rspamd_http_message *msg;
+	struct http_map_data *data = cbd->data;
 
 	msg = rspamd_http_new_message(HTTP_REQUEST);
 	if (cbd->check) {
@@ -121,6 +203,15 @@ write_http_request(struct http_callback_data *cbd)
 									   cbd->data->userinfo);
 	}
 
+	/* Deltas are possible merely if other processes can follow them */
+	if (rspamd_map_http_delta_enabled(cbd->map, cbd->bk) && data->version != 0 &&
+		data->cur_cache_cbd != NULL &&
+		g_atomic_int_get(&data->cache->available) == 1 &&
+		data->cache->version == data->version) {
+		rspamd_snprintf(datebuf, sizeof(datebuf), "%uL", data->version);
+		rspamd_http_message_add_header(msg, "X-Map-Version", datebuf);
+	}
+
 	MAP_RETAIN(cbd, "http_callback_data");
 	rspamd_http_connection_write_message(cbd->conn,
 										 msg,
@@ -250,6 +341,11 @@ rspamd_map_cache_cb(struct ev_loop *loop, ev_timer *w, int revents)
 					 cache_cbd->gen, cache_cbd->data->gen, map->name, cache_cbd->shm->shm_name,
 					 cache_cbd->shm->ref.refcount);
 		MAP_RELEASE(cache_cbd->shm, "rspamd_http_map_cached_cbdata");
+
+		if (cache_cbd->delta_shm) {
+			MAP_RELEASE(cache_cbd->delta_shm, "rspamd_http_map_cached_cbdata");
+		}
+
 		ev_timer_stop(loop, &cache_cbd->timeout);
 		g_free(cache_cbd);
 	}
@@ -290,11 +386,144 @@ rspamd_map_cache_cb(struct ev_loop *loop, ev_timer *w, int revents)
 					 cache_cbd->shm->shm_name,
 					 cache_cbd->shm->ref.refcount);
 		MAP_RELEASE(cache_cbd->shm, "rspamd_http_map_cached_cbdata");
+
+		if (cache_cbd->delta_shm) {
+			MAP_RELEASE(cache_cbd->delta_shm, "rspamd_http_map_cached_cbdata");
+		}
+
 		ev_timer_stop(loop, &cache_cbd->timeout);
 		g_free(cache_cbd);
 	}
 }
 
+/*
+ * Forgets the current version, so the next request returns the full data
+ */
+static void
+rspamd_map_http_drop_version(struct http_map_data *data)
+{
+	data->version = 0;
+	data->last_modified = 0;
+
+	if (data->etag) {
+		rspamd_fstring_free(data->etag);
+		data->etag = NULL;
+	}
+
+	/* Other processes keep their data until the full version is cached */
+	g_atomic_int_set(&data->cache->available, 0);
+	data->cur_cache_cbd = NULL;
+}
+
+/*
+ * Stores deltas since the full data in a new shared memory segment
+ */
+static struct rspamd_storage_shmem *
+rspamd_map_http_append_delta(struct rspamd_map *map,
+							 struct http_map_data *data,
+							 const unsigned char *in, gsize len)
+{
+	struct rspamd_http_message *msg;
+	struct rspamd_storage_shmem *shm = NULL;
+	unsigned char *old = NULL;
+	gsize old_len = 0, mmap_len = 0;
+
+	if (data->cache->delta_len > 0) {
+		old = rspamd_shmem_xmap(data->cache->delta_shmem_name, PROT_READ, &mmap_len);
+
+		if (old == NULL || mmap_len < data->cache->delta_len) {
+			msg_err_map("cannot map deltas from %s: %s",
+						data->cache->delta_shmem_name,
+						old ? "truncated data" : strerror(errno));
+
+			if (old) {
+				munmap(old, mmap_len);
+			}
+
+			return NULL;
+		}
+
+		old_len = data->cache->delta_len;
+	}
+
+	/* Message storage is used to allocate a named shared memory segment */
+	msg = rspamd_http_new_message(HTTP_RESPONSE);
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM;
+
+	if (rspamd_http_message_set_body(msg, NULL, old_len + len + 1)) {
+		if (old_len > 0) {
+			memcpy(msg->body_buf.str, old, old_len);
+		}
+
+		memcpy(msg->body_buf.str + old_len, in, len);
+		/* Deltas may have no trailing newline */
+		msg->body_buf.str[old_len + len] = '\n';
+		shm = rspamd_http_message_shmem_ref(msg);
+	}
+	else {
+		msg_err_map("cannot allocate shared memory for deltas: %s", strerror(errno));
+	}
+
+	rspamd_http_message_unref(msg);
+
+	if (old) {
+		munmap(old, mmap_len);
+	}
+
+	return shm;
+}
+
+/*
+ * Applies delta to the current data and publishes it for other processes
+ */
+static gboolean
+rspamd_map_http_apply_delta(struct rspamd_map *map,
+							struct http_callback_data *cbd,
+							const unsigned char *in, gsize len,
+							uint64_t version)
+{
+	struct http_map_data *data = cbd->data;
+	struct rspamd_http_map_cached_cbdata *cache_cbd = data->cur_cache_cbd;
+	struct map_cb_data *cbdata = &cbd->periodic->cbdata;
+	struct rspamd_storage_shmem *shm;
+
+	cbdata->delta = true;
+	cbdata->state = 0;
+	rspamd_map_call_read(map, (char *) in, len, cbdata, TRUE);
+
+	if (cbdata->errored) {
+		/* Data is untouched, request the full version next time */
+		rspamd_map_http_drop_version(data);
+
+		return FALSE;
+	}
+
+	/* Data is modified in place since this point, so we cannot fail */
+	shm = cache_cbd ? rspamd_map_http_append_delta(map, data, in, len) : NULL;
+
+	if (shm == NULL) {
+		/* Other processes cannot follow, so they wait for the full version */
+		rspamd_map_http_drop_version(data);
+
+		return TRUE;
+	}
+
+	if (cache_cbd->delta_shm) {
+		MAP_RELEASE(cache_cbd->delta_shm, "rspamd_http_map_cached_cbdata");
+	}
+
+	cache_cbd->delta_shm = shm;
+	data->cache->delta_len += len + 1;
+	rspamd_strlcpy(data->cache->delta_shmem_name, shm->shm_name,
+				   sizeof(data->cache->delta_shmem_name));
+	data->cache->version = version;
+	data->cache->last_modified = data->last_modified;
+	data->version = version;
+	data->delta_off = data->cache->delta_len;
+
+	return TRUE;
+}
+
 static int
 http_map_finish(struct rspamd_http_connection *conn,
 				struct rspamd_http_message *msg)
@@ -308,6 +537,7 @@ http_map_finish(struct rspamd_http_connection *conn,
 	char next_check_date[128];
 	unsigned char *in = NULL;
 	gsize dlen = 0;
+	uint64_t version = 0, delta_base = 0;
 
 	map = cbd->map;
 	bk = cbd->bk;
@@ -402,6 +632,40 @@ http_map_finish(struct rspamd_http_connection *conn,
 			}
 		}
 
+		if (rspamd_map_http_delta_enabled(map, bk)) {
+			version = rspamd_map_http_version_header(msg, "X-Map-Version");
+			delta_base = rspamd_map_http_version_header(msg, "X-Map-Delta");
+		}
+
+		if (delta_base != 0) {
+			if (delta_base != cbd->data->version || version == 0) {
+				msg_err_map("%s(%s): got delta from version %uL, but our version is %uL",
+							cbd->bk->uri,
+							rspamd_inet_address_to_string_pretty(cbd->addr),
+							delta_base, cbd->data->version);
+				rspamd_map_http_drop_version(cbd->data);
+				munmap(in, dlen);
+				goto err;
+			}
+
+			if (!rspamd_map_http_apply_delta(map, cbd, in, cbd->data_len, version)) {
+				munmap(in, dlen);
+				goto err;
+			}
+
+			msg_info_map("%s(%s): applied map delta %z bytes, version %uL -> %uL",
+						 cbd->bk->uri,
+						 rspamd_inet_address_to_string_pretty(cbd->addr),
+						 cbd->data_len, delta_base, version);
+
+			cbd->periodic->cur_backend++;
+			munmap(in, dlen);
+			rspamd_map_process_periodic(cbd->periodic);
+			MAP_RELEASE(cbd, "http_callback_data");
+
+			return 0;
+		}
+
 		MAP_RETAIN(cbd->shmem_data, "shmem_data");
 		cbd->data->gen++;
 		/*
@@ -413,6 +677,14 @@ http_map_finish(struct rspamd_http_connection *conn,
 					   sizeof(data->cache->shmem_name));
 		data->cache->len = cbd->data_len;
 		data->cache->last_modified = cbd->data->last_modified;
+		/* Full data resets deltas */
+		data->cache->version = version;
+		data->cache->base_version = version;
+		data->cache->delta_len = 0;
+		data->cache->delta_shmem_name[0] = '\0';
+		cbd->data->version = version;
+		cbd->data->base_version = version;
+		cbd->data->delta_off = 0;
 		cache_cbd = g_malloc0(sizeof(*cache_cbd));
 		cache_cbd->shm = cbd->shmem_data;
 		cache_cbd->event_loop = cbd->event_loop;
@@ -441,60 +713,40 @@ http_map_finish(struct rspamd_http_connection *conn,
 
 
 		if (cbd->bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			unsigned char *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream();
-			ZSTD_initDStream(zstream);
+			char cache_path[PATH_MAX];
+			gsize outlen = 0;
+			int cache_fd;
+
+			/* Decompressed data goes to the parser and the cache file by chunks */
+			cache_fd = rspamd_map_open_http_cached_file(map, bk, cbd->data,
+														cache_path, sizeof(cache_path));
+
+			if (!read_map_zstd_chunks(map, &cbd->periodic->cbdata, cbd->bk->uri,
+									  in, cbd->data_len, cache_fd, &outlen)) {
+				if (cache_fd != -1) {
+					if (ftruncate(cache_fd, 0) == -1) {
+						msg_err_map("cannot truncate %s: %s", cache_path,
+									strerror(errno));
+					}
 
-			zin.pos = 0;
-			zin.src = in;
-			zin.size = dlen;
+					rspamd_file_unlock(cache_fd, FALSE);
+					close(cache_fd);
+				}
 
-			if ((outlen = ZSTD_getDecompressedSize(zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize();
+				MAP_RELEASE(cbd->shmem_data, "shmem_data");
+				munmap(in, dlen);
+				goto err;
 			}
 
-			out = g_malloc(outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream(zstream, &zout, &zin);
-
-				if (ZSTD_isError(r)) {
-					msg_err_map("%s(%s): cannot decompress data: %s",
-								cbd->bk->uri,
-								rspamd_inet_address_to_string_pretty(cbd->addr),
-								ZSTD_getErrorName(r));
-					ZSTD_freeDStream(zstream);
-					g_free(out);
-					MAP_RELEASE(cbd->shmem_data, "shmem_data");
-					goto err;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 2 + 1.0;
-					out = g_realloc(zout.dst, zout.size);
-					zout.dst = out;
-				}
+			if (cache_fd != -1) {
+				rspamd_map_close_http_cached_file(map, bk, cache_fd, cache_path);
 			}
 
-			ZSTD_freeDStream(zstream);
 			msg_info_map("%s(%s): read map data %z bytes compressed, "
 						 "%z uncompressed, next check at %s",
 						 cbd->bk->uri,
 						 rspamd_inet_address_to_string_pretty(cbd->addr),
-						 dlen, zout.pos, next_check_date);
-			map->read_callback(out, zout.pos, &cbd->periodic->cbdata, TRUE);
-			rspamd_map_save_http_cached_file(map, bk, cbd->data, out, zout.pos);
-			g_free(out);
+						 cbd->data_len, outlen, next_check_date);
 		}
 		else {
 			msg_info_map("%s(%s): read map data %z bytes, next check at %s",
@@ -502,7 +754,7 @@ http_map_finish(struct rspamd_http_connection *conn,
 						 rspamd_inet_address_to_string_pretty(cbd->addr),
 						 dlen, next_check_date);
 			rspamd_map_save_http_cached_file(map, bk, cbd->data, in, cbd->data_len);
-			map->read_callback(in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+			rspamd_map_call_read(map, in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
 		}
 
 		MAP_RELEASE(cbd->shmem_data, "shmem_data");
@@ -617,7 +869,7 @@ read_map_file_chunks(struct rspamd_map *map, struct map_cb_data *cbdata,
 		char *end = bytes + (pos - bytes) + r;
 		msg_debug_map("%s: read map chunk, %z bytes", fname,
 					  r);
-		pos = map->read_callback(bytes, end - bytes, cbdata, r == len);
+		pos = rspamd_map_call_read(map, bytes, end - bytes, cbdata, r == len);
 
 		if (pos && pos > bytes && pos < end) {
 			unsigned int remain = end - pos;
@@ -659,6 +911,104 @@ read_map_file_chunks(struct rspamd_map *map, struct map_cb_data *cbdata,
 	return TRUE;
 }
 
+/*
+ * Decompresses zstd data by windows of ZSTD_DStreamOutSize() bytes passing
+ * each one to the read callback as read_map_file_chunks does, so neither the
+ * decompressed data nor its copy is ever held in memory as a whole.
+ * Decompressed data is also written to `fd` unless it is -1
+ */
+static gboolean
+read_map_zstd_chunks(struct rspamd_map *map, struct map_cb_data *cbdata,
+					 const char *src, const unsigned char *in, gsize inlen,
+					 int fd, gsize *outlen)
+{
+	ZSTD_DStream *zstream;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	char *out, *pos, *end;
+	gsize buflen, r, prev, total = 0;
+	gboolean full;
+
+	zstream = ZSTD_createDStream();
+	ZSTD_initDStream(zstream);
+
+	buflen = ZSTD_DStreamOutSize();
+	out = g_malloc(buflen);
+
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+	zout.dst = out;
+	zout.pos = 0;
+	zout.size = buflen;
+
+	do {
+		prev = zout.pos;
+		r = ZSTD_decompressStream(zstream, &zout, &zin);
+
+		if (ZSTD_isError(r)) {
+			msg_err_map("%s: cannot decompress data: %s", src,
+						ZSTD_getErrorName(r));
+			ZSTD_freeDStream(zstream);
+			g_free(out);
+
+			return FALSE;
+		}
+
+		if (fd != -1 && zout.pos > prev) {
+			if (write(fd, out + prev, zout.pos - prev) != (gssize) (zout.pos - prev)) {
+				msg_err_map("%s: cannot write decompressed data: %s", src,
+							strerror(errno));
+
+				/* Do not leave truncated data */
+				if (ftruncate(fd, 0) == -1) {
+					msg_err_map("%s: cannot truncate output: %s", src,
+								strerror(errno));
+				}
+
+				fd = -1;
+			}
+		}
+
+		total += zout.pos - prev;
+		full = zout.pos == zout.size;
+
+		if (full) {
+			end = out + zout.pos;
+			pos = rspamd_map_call_read(map, out, zout.pos, cbdata, FALSE);
+
+			if (pos && pos >= out && pos < end) {
+				gsize remain = end - pos;
+
+				/* Need to preserve the remain */
+				memmove(out, pos, remain);
+				zout.pos = remain;
+
+				if (remain == buflen) {
+					/* Too large element, extend window */
+					buflen *= 2;
+					out = g_realloc(out, buflen);
+					zout.dst = out;
+					zout.size = buflen;
+				}
+			}
+			else {
+				zout.pos = 0;
+			}
+		}
+	} while (zin.pos < zin.size || full);
+
+	rspamd_map_call_read(map, out, zout.pos, cbdata, TRUE);
+	ZSTD_freeDStream(zstream);
+	g_free(out);
+
+	if (outlen) {
+		*outlen = total;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_map_check_sig_pk_mem(const unsigned char *sig,
 							gsize siglen,
@@ -821,11 +1171,13 @@ read_map_file(struct rspamd_map *map, struct file_map_data *data,
 	if (len > 0) {
 		if (map->no_file_read) {
 			/* We just call read callback with backend name */
-			map->read_callback(data->filename, strlen(data->filename),
-							   &periodic->cbdata, TRUE);
+			rspamd_map_call_read(map, data->filename, strlen(data->filename),
+								 &periodic->cbdata, TRUE);
 		}
 		else {
 			if (bk->is_compressed) {
+				gsize outlen = 0;
+
 				bytes = rspamd_file_xmap(data->filename, PROT_READ, &len, TRUE);
 
 				if (bytes == NULL) {
@@ -833,60 +1185,25 @@ read_map_file(struct rspamd_map *map, struct file_map_data *data,
 					return FALSE;
 				}
 
-				ZSTD_DStream *zstream;
-				ZSTD_inBuffer zin;
-				ZSTD_outBuffer zout;
-				unsigned char *out;
-				gsize outlen, r;
-
-				zstream = ZSTD_createDStream();
-				ZSTD_initDStream(zstream);
-
-				zin.pos = 0;
-				zin.src = bytes;
-				zin.size = len;
-
-				if ((outlen = ZSTD_getDecompressedSize(zin.src, zin.size)) == 0) {
-					outlen = ZSTD_DStreamOutSize();
-				}
-
-				out = g_malloc(outlen);
-
-				zout.dst = out;
-				zout.pos = 0;
-				zout.size = outlen;
-
-				while (zin.pos < zin.size) {
-					r = ZSTD_decompressStream(zstream, &zout, &zin);
-
-					if (ZSTD_isError(r)) {
-						msg_err_map("%s: cannot decompress data: %s",
-									data->filename,
-									ZSTD_getErrorName(r));
-						ZSTD_freeDStream(zstream);
-						g_free(out);
-						munmap(bytes, len);
-						return FALSE;
-					}
-
-					if (zout.pos == zout.size) {
-						/* We need to extend output buffer */
-						zout.size = zout.size * 2 + 1;
-						out = g_realloc(zout.dst, zout.size);
-						zout.dst = out;
-					}
+				if (!read_map_zstd_chunks(map, &periodic->cbdata, data->filename,
+										  bytes, len, -1, &outlen)) {
+					munmap(bytes, len);
+					return FALSE;
 				}
 
-				ZSTD_freeDStream(zstream);
 				msg_info_map("%s: read map data, %z bytes compressed, "
 							 "%z uncompressed)",
 							 data->filename,
-							 len, zout.pos);
-				map->read_callback(out, zout.pos, &periodic->cbdata, TRUE);
-				g_free(out);
-
+							 len, outlen);
 				munmap(bytes, len);
 			}
+			else if (map->accept_images && rspamd_map_image_probe(data->filename)) {
+				/* Precompiled image is used as is */
+				periodic->cbdata.image = true;
+				rspamd_map_call_read(map, data->filename, strlen(data->filename),
+									 &periodic->cbdata, TRUE);
+				periodic->cbdata.image = false;
+			}
 			else {
 				/* Perform buffered read: fail-safe */
 				if (!read_map_file_chunks(map, &periodic->cbdata, data->filename,
@@ -898,7 +1215,7 @@ read_map_file(struct rspamd_map *map, struct file_map_data *data,
 	}
 	else {
 		/* Empty map */
-		map->read_callback(NULL, 0, &periodic->cbdata, TRUE);
+		rspamd_map_call_read(map, NULL, 0, &periodic->cbdata, TRUE);
 	}
 
 	return TRUE;
@@ -922,66 +1239,26 @@ read_map_static(struct rspamd_map *map, struct static_map_data *data,
 
 	if (len > 0) {
 		if (bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			unsigned char *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream();
-			ZSTD_initDStream(zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize(zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize();
-			}
-
-			out = g_malloc(outlen);
+			gsize outlen = 0;
 
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
-
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream(zstream, &zout, &zin);
-
-				if (ZSTD_isError(r)) {
-					msg_err_map("%s: cannot decompress data: %s",
-								map->name,
-								ZSTD_getErrorName(r));
-					ZSTD_freeDStream(zstream);
-					g_free(out);
-
-					return FALSE;
-				}
-
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 2 + 1;
-					out = g_realloc(zout.dst, zout.size);
-					zout.dst = out;
-				}
+			if (!read_map_zstd_chunks(map, &periodic->cbdata, map->name,
+									  bytes, len, -1, &outlen)) {
+				return FALSE;
 			}
 
-			ZSTD_freeDStream(zstream);
 			msg_info_map("%s: read map data, %z bytes compressed, "
 						 "%z uncompressed)",
 						 map->name,
-						 len, zout.pos);
-			map->read_callback(out, zout.pos, &periodic->cbdata, TRUE);
-			g_free(out);
+						 len, outlen);
 		}
 		else {
 			msg_info_map("%s: read map data, %z bytes",
 						 map->name, len);
-			map->read_callback(bytes, len, &periodic->cbdata, TRUE);
+			rspamd_map_call_read(map, bytes, len, &periodic->cbdata, TRUE);
 		}
 	}
 	else {
-		map->read_callback(NULL, 0, &periodic->cbdata, TRUE);
+		rspamd_map_call_read(map, NULL, 0, &periodic->cbdata, TRUE);
 	}
 
 	data->processed = TRUE;
@@ -990,16 +1267,15 @@ read_map_static(struct rspamd_map *map, struct static_map_data *data,
 }
 
 static void
-rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
+rspamd_map_periodic_finish(struct map_periodic_cbdata *periodic)
 {
 	struct rspamd_map *map;
 
 	map = periodic->map;
-	msg_debug_map("periodic dtor %p; need_modify=%d", periodic, periodic->need_modify);
 
 	if (periodic->need_modify || periodic->cbdata.errored) {
 		/* Need to notify the real data structure */
-		periodic->map->fin_callback(&periodic->cbdata, periodic->map->user_data);
+		rspamd_map_call_fin(map, &periodic->cbdata);
 
 		if (map->on_load_function) {
 			map->on_load_function(map, map->on_load_ud);
@@ -1026,6 +1302,54 @@ rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
 	g_free(periodic);
 }
 
+static void
+rspamd_map_compile_work(void *ud)
+{
+	struct map_periodic_cbdata *periodic = (struct map_periodic_cbdata *) ud;
+
+	periodic->cbdata.compile(periodic->cbdata.cur_data);
+}
+
+static void
+rspamd_map_compile_done(void *ud)
+{
+	struct map_periodic_cbdata *periodic = (struct map_periodic_cbdata *) ud;
+	struct rspamd_map *map = periodic->map;
+
+	msg_debug_map("compiled new data for %s in a helper thread", map->name);
+	map->compiling = false;
+	periodic->cbdata.compile = NULL;
+	rspamd_map_periodic_finish(periodic);
+}
+
+static void
+rspamd_map_periodic_dtor(struct map_periodic_cbdata *periodic)
+{
+	struct rspamd_map *map;
+	struct map_cb_data *cbdata = &periodic->cbdata;
+
+	map = periodic->map;
+	msg_debug_map("periodic dtor %p; need_modify=%d", periodic, periodic->need_modify);
+
+	/*
+	 * New data is not visible to anyone until fin callback, so its heavy part
+	 * can be built in a helper thread while the event loop serves tasks, and
+	 * then it is swapped with the old data in the loop thread as usual
+	 */
+	if (periodic->need_modify && !cbdata->errored && !cbdata->delta &&
+		cbdata->compile && cbdata->cur_data &&
+		map->wrk && map->wrk->cpu_pool) {
+		if (rspamd_cpu_pool_push(map->wrk->cpu_pool, rspamd_map_compile_work,
+								 rspamd_map_compile_done, periodic)) {
+			map->compiling = true;
+
+			return;
+		}
+	}
+
+	rspamd_map_periodic_finish(periodic);
+}
+
 /* Called on timer execution */
 static void
 rspamd_map_periodic_callback(struct ev_loop *loop, ev_timer *w, int revents)
@@ -1326,6 +1650,56 @@ rspamd_map_dns_callback(struct rdns_reply *reply, void *arg)
 	MAP_RELEASE(cbd, "http_callback_data");
 }
 
+/*
+ * Applies cached deltas starting from the specified offset
+ */
+static gboolean
+rspamd_map_read_cached_delta(struct rspamd_map *map, struct rspamd_map_backend *bk,
+							 struct map_periodic_cbdata *periodic, gsize off)
+{
+	struct http_map_data *data = bk->data.hd;
+	unsigned char *in = NULL;
+	gsize mmap_len = 0, len = data->cache->delta_len;
+
+	if (len > off) {
+		in = rspamd_shmem_xmap(data->cache->delta_shmem_name, PROT_READ, &mmap_len);
+
+		if (in == NULL || mmap_len < len) {
+			msg_err_map("cannot map cached deltas from %s: %s",
+						data->cache->delta_shmem_name,
+						in ? "truncated data" : strerror(errno));
+
+			if (in) {
+				munmap(in, mmap_len);
+			}
+
+			return FALSE;
+		}
+	}
+
+	msg_info_map("%s: apply cached map delta %z bytes", bk->uri, len - off);
+	periodic->cbdata.delta = true;
+	periodic->cbdata.state = 0;
+	rspamd_map_call_read(map, in ? (char *) in + off : (char *) "", len - off,
+						 &periodic->cbdata, TRUE);
+
+	if (in) {
+		munmap(in, mmap_len);
+	}
+
+	if (periodic->cbdata.errored) {
+		/* Start from the full data next time */
+		data->version = 0;
+	}
+	else {
+		data->version = data->cache->version;
+		data->base_version = data->cache->base_version;
+		data->delta_off = len;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 					   struct map_periodic_cbdata *periodic, const char *host)
@@ -1333,8 +1707,17 @@ rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 	gsize mmap_len, len;
 	gpointer in;
 	struct http_map_data *data;
+	gboolean with_deltas;
 
 	data = bk->data.hd;
+	with_deltas = rspamd_map_http_delta_enabled(map, bk) && data->cache->version != 0;
+
+	if (with_deltas && data->version != 0 &&
+		data->base_version == data->cache->base_version &&
+		data->delta_off <= data->cache->delta_len) {
+		/* We have the full data already, so apply merely new deltas */
+		return rspamd_map_read_cached_delta(map, bk, periodic, data->delta_off);
+	}
 
 	in = rspamd_shmem_xmap(data->cache->shmem_name, PROT_READ, &mmap_len);
 
@@ -1363,65 +1746,36 @@ rspamd_map_read_cached(struct rspamd_map *map, struct rspamd_map_backend *bk,
 	len = data->cache->len;
 
 	if (bk->is_compressed) {
-		ZSTD_DStream *zstream;
-		ZSTD_inBuffer zin;
-		ZSTD_outBuffer zout;
-		unsigned char *out;
-		gsize outlen, r;
-
-		zstream = ZSTD_createDStream();
-		ZSTD_initDStream(zstream);
-
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = len;
-
-		if ((outlen = ZSTD_getDecompressedSize(zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize();
-		}
+		gsize outlen = 0;
 
-		out = g_malloc(outlen);
-
-		zout.dst = out;
-		zout.pos = 0;
-		zout.size = outlen;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream(zstream, &zout, &zin);
-
-			if (ZSTD_isError(r)) {
-				msg_err_map("%s: cannot decompress data: %s",
-							bk->uri,
-							ZSTD_getErrorName(r));
-				ZSTD_freeDStream(zstream);
-				g_free(out);
-				munmap(in, mmap_len);
-				return FALSE;
-			}
-
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 2 + 1;
-				out = g_realloc(zout.dst, zout.size);
-				zout.dst = out;
-			}
+		if (!read_map_zstd_chunks(map, &periodic->cbdata, bk->uri,
+								  in, len, -1, &outlen)) {
+			munmap(in, mmap_len);
+			return FALSE;
 		}
 
-		ZSTD_freeDStream(zstream);
 		msg_info_map("%s: read map data cached %z bytes compressed, "
 					 "%z uncompressed",
 					 bk->uri,
-					 len, zout.pos);
-		map->read_callback(out, zout.pos, &periodic->cbdata, TRUE);
-		g_free(out);
+					 len, outlen);
 	}
 	else {
 		msg_info_map("%s: read map data cached %z bytes", bk->uri, len);
-		map->read_callback(in, len, &periodic->cbdata, TRUE);
+		rspamd_map_call_read(map, in, len, &periodic->cbdata, TRUE);
 	}
 
 	munmap(in, mmap_len);
 
+	if (with_deltas) {
+		data->version = data->cache->base_version;
+		data->base_version = data->cache->base_version;
+		data->delta_off = 0;
+
+		if (data->cache->delta_len > 0) {
+			return rspamd_map_read_cached_delta(map, bk, periodic, 0);
+		}
+	}
+
 	return TRUE;
 }
 
@@ -1450,39 +1804,41 @@ rspamd_map_has_http_cached_file(struct rspamd_map *map,
 	return FALSE;
 }
 
-static gboolean
-rspamd_map_save_http_cached_file(struct rspamd_map *map,
+/*
+ * Creates a cached file with a header and returns its locked descriptor,
+ * data is written after it
+ */
+static int
+rspamd_map_open_http_cached_file(struct rspamd_map *map,
 								 struct rspamd_map_backend *bk,
 								 struct http_map_data *htdata,
-								 const unsigned char *data,
-								 gsize len)
+								 char *path, gsize pathlen)
 {
-	char path[PATH_MAX];
 	unsigned char digest[rspamd_cryptobox_HASHBYTES];
 	struct rspamd_config *cfg = map->cfg;
 	int fd;
 	struct rspamd_http_file_data header;
 
 	if (cfg->maps_cache_dir == NULL || cfg->maps_cache_dir[0] == '\0') {
-		return FALSE;
+		return -1;
 	}
 
 	rspamd_cryptobox_hash(digest, bk->uri, strlen(bk->uri), NULL, 0);
-	rspamd_snprintf(path, sizeof(path), "%s%c%*xs.map", cfg->maps_cache_dir,
+	rspamd_snprintf(path, pathlen, "%s%c%*xs.map", cfg->maps_cache_dir,
 					G_DIR_SEPARATOR, 20, digest);
 
 	fd = rspamd_file_xopen(path, O_WRONLY | O_TRUNC | O_CREAT,
 						   00600, FALSE);
 
 	if (fd == -1) {
-		return FALSE;
+		return -1;
 	}
 
 	if (!rspamd_file_lock(fd, FALSE)) {
 		msg_err_map("cannot lock file %s: %s", path, strerror(errno));
 		close(fd);
 
-		return FALSE;
+		return -1;
 	}
 
 	memcpy(header.magic, rspamd_http_file_magic, sizeof(rspamd_http_file_magic));
@@ -1503,7 +1859,7 @@ rspamd_map_save_http_cached_file(struct rspamd_map *map,
 		rspamd_file_unlock(fd, FALSE);
 		close(fd);
 
-		return FALSE;
+		return -1;
 	}
 
 	if (header.etag_len > 0) {
@@ -1513,10 +1869,45 @@ rspamd_map_save_http_cached_file(struct rspamd_map *map,
 			rspamd_file_unlock(fd, FALSE);
 			close(fd);
 
-			return FALSE;
+			return -1;
 		}
 	}
 
+	return fd;
+}
+
+static void
+rspamd_map_close_http_cached_file(struct rspamd_map *map,
+								  struct rspamd_map_backend *bk,
+								  int fd, const char *path)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != -1 && st.st_size > 0) {
+		msg_info_map("saved data from %s in %s, %z bytes", bk->uri, path,
+					 (gssize) st.st_size);
+	}
+
+	rspamd_file_unlock(fd, FALSE);
+	close(fd);
+}
+
+static gboolean
+rspamd_map_save_http_cached_file(struct rspamd_map *map,
+								 struct rspamd_map_backend *bk,
+								 struct http_map_data *htdata,
+								 const unsigned char *data,
+								 gsize len)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	fd = rspamd_map_open_http_cached_file(map, bk, htdata, path, sizeof(path));
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
 	/* Now write the rest */
 	if (write(fd, data, len) != len) {
 		msg_err_map("cannot write file %s (data stage): %s", path, strerror(errno));
@@ -1526,10 +1917,7 @@ rspamd_map_save_http_cached_file(struct rspamd_map *map,
 		return FALSE;
 	}
 
-	rspamd_file_unlock(fd, FALSE);
-	close(fd);
-
-	msg_info_map("saved data from %s in %s, %uz bytes", bk->uri, path, len + sizeof(header) + header.etag_len);
+	rspamd_map_close_http_cached_file(map, bk, fd, path);
 
 	return TRUE;
 }
@@ -1744,7 +2132,9 @@ rspamd_map_common_http_callback(struct rspamd_map *map,
 	if (g_atomic_int_get(&data->cache->available) == 1) {
 		/* Read cached data */
 		if (check) {
-			if (data->last_modified < data->cache->last_modified) {
+			if (data->last_modified < data->cache->last_modified ||
+				(rspamd_map_http_delta_enabled(map, bk) &&
+				 data->version != data->cache->version)) {
 				msg_info_map("need to reread cached map triggered by %s "
 							 "(%d our modify time, %d cached modify time)",
 							 bk->uri,
@@ -2009,6 +2399,16 @@ rspamd_map_process_periodic(struct map_periodic_cbdata *cbd)
 	map = cbd->map;
 	map->scheduled_check = NULL;
 
+	if (map->compiling) {
+		/* Previous data is not swapped yet */
+		msg_debug_map("don't try to reread map %s as its data is being compiled",
+					  map->name);
+		rspamd_map_schedule_periodic(map, RSPAMD_MAP_SCHEDULE_LOCKED);
+		MAP_RELEASE(cbd, "periodic");
+
+		return;
+	}
+
 	if (!map->file_only && !cbd->locked) {
 		if (!g_atomic_int_compare_and_exchange(cbd->map->locked,
 											   0, 1)) {
@@ -2314,7 +2714,7 @@ void rspamd_map_preload(struct rspamd_config *cfg)
 			}
 
 			if (succeed) {
-				map->fin_callback(&fake_cbd.cbdata, map->user_data);
+				rspamd_map_call_fin(map, &fake_cbd.cbdata);
 
 				if (map->on_load_function) {
 					map->on_load_function(map, map->on_load_ud);
@@ -2331,6 +2731,25 @@ void rspamd_map_preload(struct rspamd_config *cfg)
 	}
 }
 
+unsigned int
+rspamd_map_pending_count(struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_map *map;
+	unsigned int pending = 0;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next(cur)) {
+		map = cur->data;
+
+		if (map->seen && !(map->load_time > 0) &&
+			(map->user_data == NULL || *map->user_data == NULL)) {
+			pending++;
+		}
+	}
+
+	return pending;
+}
+
 void rspamd_map_remove_all(struct rspamd_config *cfg)
 {
 	struct rspamd_map *map;
@@ -2567,6 +2986,12 @@ rspamd_map_backend_dtor(struct rspamd_map_backend *bk)
 								 bk->uri);
 						MAP_RELEASE(data->cur_cache_cbd->shm,
 									"rspamd_http_map_cached_cbdata");
+
+						if (data->cur_cache_cbd->delta_shm) {
+							MAP_RELEASE(data->cur_cache_cbd->delta_shm,
+										"rspamd_http_map_cached_cbdata");
+						}
+
 						ev_timer_stop(data->cur_cache_cbd->event_loop,
 									  &data->cur_cache_cbd->timeout);
 						g_free(data->cur_cache_cbd);
@@ -2881,6 +3306,9 @@ rspamd_map_add(struct rspamd_config *cfg,
 	g_ptr_array_add(map->backends, bk);
 	map->name = rspamd_mempool_strdup(cfg->cfg_pool, map_line);
 	map->no_file_read = (flags & RSPAMD_MAP_FILE_NO_READ);
+	map->accept_images = (read_callback == rspamd_kv_list_read);
+	map->accept_deltas = (read_callback == rspamd_kv_list_read ||
+						  read_callback == rspamd_radix_read);
 
 	if (bk->protocol == MAP_PROTO_FILE) {
 		map->poll_timeout = (cfg->map_timeout * cfg->map_file_watch_multiplier);
@@ -2977,6 +3405,9 @@ rspamd_map_add_from_ucl(struct rspamd_config *cfg,
 	map->backends = g_ptr_array_new();
 	map->wrk = worker;
 	map->no_file_read = (flags & RSPAMD_MAP_FILE_NO_READ);
+	map->accept_images = (read_callback == rspamd_kv_list_read);
+	map->accept_deltas = (read_callback == rspamd_kv_list_read ||
+						  read_callback == rspamd_radix_read);
 	rspamd_mempool_add_destructor(cfg->cfg_pool, rspamd_ptr_array_free_hard,
 								  map->backends);
 	map->poll_timeout = cfg->map_timeout;
@@ -3188,6 +3619,18 @@ void rspamd_map_traverse(struct rspamd_map *map, rspamd_map_traverse_cb cb,
 	}
 }
 
+void rspamd_map_get_data_stat(struct rspamd_map *map,
+							  struct rspamd_map_data_stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->nelts = map->nelts;
+	st->load_time = map->load_time;
+
+	if (*map->user_data && map->stat_function) {
+		map->stat_function(*map->user_data, st);
+	}
+}
+
 void rspamd_map_set_on_load_function(struct rspamd_map *map, rspamd_map_on_load_function cb,
 									 gpointer cbdata, GDestroyNotify dtor)
 {
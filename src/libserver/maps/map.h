@@ -37,6 +37,13 @@ typedef void (*map_fin_cb_t)(struct map_cb_data *data, void **target);
 
 typedef void (*map_dtor_t)(struct map_cb_data *data);
 
+/*
+ * Optional heavy part of finalization for new data, it is called before the fin
+ * callback and might be called in a helper thread, so it must not log or use
+ * Lua, config or the event loop
+ */
+typedef void (*map_compile_cb_t)(void *data);
+
 typedef gboolean (*rspamd_map_traverse_cb)(gconstpointer key,
 										   gconstpointer value, gsize hits, gpointer ud);
 
@@ -45,6 +52,19 @@ typedef void (*rspamd_map_traverse_function)(void *data,
 											 gpointer cbdata, gboolean reset_hits);
 typedef void (*rspamd_map_on_load_function)(struct rspamd_map *map, gpointer ud);
 
+/**
+ * Cost of the current map data
+ */
+struct rspamd_map_data_stat {
+	gsize nelts;
+	gsize memory;     /* Bytes used by the data, including mapped files */
+	gsize hs_size;    /* Size of hyperscan database if any */
+	double load_time; /* Seconds spent to parse and build the data */
+};
+
+typedef void (*rspamd_map_stat_function)(void *data,
+										 struct rspamd_map_data_stat *st);
+
 /**
  * Callback data for async load
  */
@@ -52,8 +72,12 @@ struct map_cb_data {
 	struct rspamd_map *map;
 	int state;
 	bool errored;
+	bool image; /* Chunk is a path of a precompiled map image */
+	bool delta; /* Chunk is a delta applied to prev_data in place */
 	void *prev_data;
 	void *cur_data;
+	map_compile_cb_t compile; /* Set by a read callback for new data if needed */
+	double load_time;         /* Seconds spent in read callbacks */
 };
 
 /**
@@ -129,6 +153,12 @@ void rspamd_map_watch(struct rspamd_config *cfg,
  */
 void rspamd_map_preload(struct rspamd_config *cfg);
 
+/**
+ * Returns number of watched or preloaded maps that have no data loaded yet
+ * @param cfg
+ */
+unsigned int rspamd_map_pending_count(struct rspamd_config *cfg);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -152,6 +182,14 @@ rspamd_map_traverse_function rspamd_map_get_traverse_function(struct rspamd_map
 void rspamd_map_traverse(struct rspamd_map *map, rspamd_map_traverse_cb cb,
 						 gpointer cbdata, gboolean reset_hits);
 
+/**
+ * Fills cost of the current map data
+ * @param map
+ * @param st
+ */
+void rspamd_map_get_data_stat(struct rspamd_map *map,
+							  struct rspamd_map_data_stat *st);
+
 /**
  * Set map on load callback
  * @param map
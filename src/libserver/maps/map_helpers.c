@@ -23,6 +23,9 @@
 #include "mempool_vars_internal.h"
 #include "contrib/fastutf8/fastutf8.h"
 #include "contrib/cdb/cdb.h"
+#include "map_image.h"
+#include "multipattern.h"
+#include "libutil/domain_trie.h"
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
@@ -64,6 +67,28 @@ struct rspamd_hash_map_helper {
 	khash_t(rspamd_map_hash) * htb;
 	struct rspamd_map *map;
 	rspamd_cryptobox_fast_hash_state_t hst;
+	/* Read only image shared between processes, replaces htb if set */
+	struct rspamd_map_image *image;
+	/* Path of the image to attach or to save */
+	char *image_path;
+	/* Hash of the map data, used as digest when images are enabled */
+	uint64_t image_digest;
+	/* Image is created by rspamd in maps_cache_dir rather than by a user */
+	gboolean image_cached;
+	/* Keys as domain suffixes, built on the first domain lookup */
+	struct rspamd_domain_trie *domains;
+};
+
+/*
+ * Url lists are stored as hashes of hosts to their records `<path>\t<query>\t<data>`
+ * separated by newlines, so they are shared via images as hash maps
+ */
+struct rspamd_url_map_helper {
+	struct rspamd_hash_map_helper *hosts;
+	/* Lowercased host -> GString of records, while reading */
+	GHashTable *pending;
+	struct rspamd_map *map;
+	gsize nurls;
 };
 
 struct rspamd_cdb_map_helper {
@@ -82,15 +107,35 @@ struct rspamd_regexp_map_helper {
 	GPtrArray *values;
 	khash_t(rspamd_map_hash) * htb;
 	enum rspamd_regexp_map_flags map_flags;
+	/* Literal patterns are matched by these without regexp engine */
+	struct rspamd_multipattern *literals[2]; /* case sensitive and caseless */
+	GArray *literal_ids[2];                  /* struct rspamd_regexp_map_literal */
+	unsigned char *is_literal;               /* per regexp */
+	unsigned int nliterals;
 #ifdef WITH_HYPERSCAN
 	rspamd_hyperscan_t *hs_db;
-	hs_scratch_t *hs_scratch;
+	unsigned char hs_digest[rspamd_cryptobox_HASHBYTES];
 	char **patterns;
 	int *flags;
 	int *ids;
+	unsigned int npatterns;
+	/* Compiled in a helper thread, see rspamd_regexp_list_compile */
+	hs_database_t *hs_raw_db;
+	char *hs_compile_err;
+	double hs_compile_time;
 #endif
 };
 
+enum rspamd_regexp_map_literal_anchor {
+	RSPAMD_REGEXP_MAP_LITERAL_START = (1u << 0u),
+	RSPAMD_REGEXP_MAP_LITERAL_END = (1u << 1u),
+};
+
+struct rspamd_regexp_map_literal {
+	unsigned int id;
+	unsigned int anchors;
+};
+
 /**
  * FSM for parsing lists
  */
@@ -459,6 +504,92 @@ rspamd_parse_kv_list(
 	return c;
 }
 
+void rspamd_parse_kv_delta(
+	char *chunk,
+	int len,
+	struct map_cb_data *data,
+	rspamd_map_insert_func func,
+	rspamd_map_remove_func remove_func,
+	const char *default_value)
+{
+	struct rspamd_map *map = data->map;
+	char *p = chunk, *end = chunk + len, *eol, *key;
+	gsize klen;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		while (p < eol && g_ascii_isspace(*p)) {
+			p++;
+		}
+
+		if (p < eol && *p == '+') {
+			/* Parse the rest of line as a complete map */
+			data->state = 0;
+			rspamd_parse_kv_list(p + 1, eol - p - 1, data, func, default_value,
+								 TRUE);
+			data->state = 0;
+		}
+		else if (p < eol && *p == '-' && remove_func != NULL) {
+			p++;
+
+			while (p < eol && g_ascii_isspace(*p)) {
+				p++;
+			}
+
+			klen = 0;
+
+			while (p + klen < eol && !g_ascii_isspace(p[klen])) {
+				klen++;
+			}
+
+			if (klen > 0) {
+				key = g_strndup(p, klen);
+				remove_func(data->cur_data, key);
+				msg_debug_map("remove key: %s", key);
+				g_free(key);
+			}
+		}
+		else if (p < eol && *p != '#') {
+			msg_warn_map("invalid delta record for map %s: %*s", map->name,
+						 (int) (eol - p), p);
+		}
+
+		p = eol + 1;
+	}
+}
+
+/*
+ * Returns TRUE if a delta has any removals
+ */
+static gboolean
+rspamd_map_delta_has_removals(const char *chunk, gsize len)
+{
+	const char *p = chunk, *end = chunk + len;
+
+	while (p < end) {
+		while (p < end && g_ascii_isspace(*p)) {
+			p++;
+		}
+
+		if (p < end && *p == '-') {
+			return TRUE;
+		}
+
+		p = memchr(p, '\n', end - p);
+
+		if (p == NULL) {
+			break;
+		}
+	}
+
+	return FALSE;
+}
+
 /**
  * Radix tree helper function
  */
@@ -624,6 +755,22 @@ void rspamd_map_helper_insert_hash(gpointer st, gconstpointer key, gconstpointer
 	rspamd_cryptobox_fast_hash_update(&ht->hst, nk, tok.len);
 }
 
+void rspamd_map_helper_remove_hash(gpointer st, gconstpointer key)
+{
+	struct rspamd_hash_map_helper *ht = st;
+	rspamd_ftok_t tok;
+	khiter_t k;
+
+	tok.begin = key;
+	tok.len = strlen(key);
+	k = kh_get(rspamd_map_hash, ht->htb, tok);
+
+	/* Key and value are allocated in the pool and freed with the helper */
+	if (k != kh_end(ht->htb)) {
+		kh_del(rspamd_map_hash, ht->htb, k);
+	}
+}
+
 void rspamd_map_helper_insert_re(gpointer st, gconstpointer key, gconstpointer value)
 {
 	struct rspamd_regexp_map_helper *re_map = st;
@@ -718,6 +865,35 @@ void rspamd_map_helper_insert_re(gpointer st, gconstpointer key, gconstpointer v
 	g_ptr_array_add(re_map->values, val);
 }
 
+/* Keys, values and 2 bits of flags per bucket */
+static gsize
+rspamd_map_helper_htb_memory(khash_t(rspamd_map_hash) * htb)
+{
+	gsize nb = kh_n_buckets(htb);
+
+	return nb * (sizeof(rspamd_ftok_t) + sizeof(struct rspamd_map_helper_value *)) + nb / 4;
+}
+
+static void
+rspamd_map_helper_stat_regexp(void *data, struct rspamd_map_data_stat *st)
+{
+	struct rspamd_regexp_map_helper *re_map = data;
+
+	st->memory = rspamd_mempool_get_used_size(re_map->pool) +
+				 rspamd_map_helper_htb_memory(re_map->htb) +
+				 re_map->regexps->len * 2 * sizeof(gpointer);
+#ifdef WITH_HYPERSCAN
+	if (re_map->hs_db) {
+		size_t hs_size;
+
+		if (hs_database_size(rspamd_hyperscan_get_database(re_map->hs_db),
+							 &hs_size) == HS_SUCCESS) {
+			st->hs_size = hs_size;
+		}
+	}
+#endif
+}
+
 static void
 rspamd_map_helper_traverse_regexp(void *data,
 								  rspamd_map_traverse_cb cb,
@@ -739,6 +915,43 @@ rspamd_map_helper_traverse_regexp(void *data,
 	});
 }
 
+/*
+ * Hash map images (see map_image.h) in maps_cache_dir are named by hash of
+ * the map data: the first process that loads a map saves an image and all
+ * processes use it via mmap instead of building own hash tables.
+ */
+static gboolean
+rspamd_map_image_wanted(struct rspamd_map *map, gsize len)
+{
+	struct rspamd_config *cfg = map->cfg;
+
+	return cfg != NULL && cfg->map_image_min_size > 0 &&
+		   len >= cfg->map_image_min_size &&
+		   cfg->maps_cache_dir != NULL && cfg->maps_cache_dir[0] != '\0';
+}
+
+gboolean
+rspamd_map_helper_hash_save_image(struct rspamd_hash_map_helper *ht,
+								  const char *path, GError **err)
+{
+	struct rspamd_map_image_builder *b;
+	struct rspamd_map_helper_value *val;
+	rspamd_ftok_t tok;
+	gboolean ret;
+
+	b = rspamd_map_image_builder_new(kh_size(ht->htb));
+
+	kh_foreach(ht->htb, tok, val, {
+		rspamd_map_image_builder_add(b, tok.begin, tok.len,
+									 val->value, strlen(val->value));
+	});
+
+	ret = rspamd_map_image_builder_write(b, path, err);
+	rspamd_map_image_builder_free(b);
+
+	return ret;
+}
+
 struct rspamd_hash_map_helper *
 rspamd_map_helper_new_hash(struct rspamd_map *map)
 {
@@ -747,7 +960,7 @@ rspamd_map_helper_new_hash(struct rspamd_map *map)
 
 	if (map) {
 		pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
-								  map->tag, 0);
+								  map->tag, RSPAMD_MEMPOOL_HUGEPAGES);
 	}
 	else {
 		pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
@@ -770,11 +983,95 @@ void rspamd_map_helper_destroy_hash(struct rspamd_hash_map_helper *r)
 	}
 
 	rspamd_mempool_t *pool = r->pool;
+
+	if (r->image) {
+		rspamd_map_image_close(r->image);
+	}
+
+	if (r->domains) {
+		rspamd_domain_trie_destroy(r->domains);
+	}
+
 	kh_destroy(rspamd_map_hash, r->htb);
 	memset(r, 0, sizeof(*r));
 	rspamd_mempool_delete(pool);
 }
 
+/* Attaches an image saved by another process for the same map data */
+static gboolean
+rspamd_map_helper_hash_attach_cached(struct rspamd_hash_map_helper *htb,
+									 const char *chunk, gsize len,
+									 const char *ext)
+{
+	struct rspamd_map *map = htb->map;
+	uint64_t h = rspamd_cryptobox_fast_hash(chunk, len, map_hash_seed);
+	char path[PATH_MAX];
+
+	rspamd_snprintf(path, sizeof(path), "%s%c%016xL.%s",
+					map->cfg->maps_cache_dir, G_DIR_SEPARATOR, h, ext);
+	htb->image_path = rspamd_mempool_strdup(htb->pool, path);
+	htb->image_digest = h;
+	htb->image_cached = TRUE;
+	htb->image = rspamd_map_image_open(path, NULL);
+
+	if (htb->image) {
+		msg_info_map("attached shared image %s for %s", path, map->name);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Saves an image of the hash and returns a helper that uses it instead */
+static struct rspamd_hash_map_helper *
+rspamd_map_helper_hash_save_cached(struct rspamd_hash_map_helper *htb)
+{
+	struct rspamd_map *map = htb->map;
+	GError *err = NULL;
+
+	if (rspamd_map_helper_hash_save_image(htb, htb->image_path, &err)) {
+		/* Switch to the saved image and drop own hash table */
+		struct rspamd_hash_map_helper *nhtb = rspamd_map_helper_new_hash(map);
+
+		nhtb->image = rspamd_map_image_open(htb->image_path, &err);
+
+		if (nhtb->image) {
+			msg_info_map("saved shared image %s for %s", htb->image_path,
+						 map->name);
+			nhtb->image_path = rspamd_mempool_strdup(nhtb->pool, htb->image_path);
+			nhtb->image_digest = htb->image_digest;
+			nhtb->image_cached = TRUE;
+			rspamd_map_helper_destroy_hash(htb);
+			htb = nhtb;
+		}
+		else {
+			rspamd_map_helper_destroy_hash(nhtb);
+		}
+	}
+
+	if (err) {
+		msg_err_map("cannot use shared image for %s: %e", map->name, err);
+		g_error_free(err);
+	}
+
+	return htb;
+}
+
+/*
+ * Removes an outdated image: processes that still use it keep
+ * their mappings until they switch to the new one
+ */
+static void
+rspamd_map_helper_hash_drop_cached(struct rspamd_hash_map_helper *prev,
+								   struct rspamd_hash_map_helper *cur)
+{
+	if (prev->image && prev->image_cached && cur && cur->image_path &&
+		strcmp(prev->image_path, cur->image_path) != 0) {
+		unlink(prev->image_path);
+	}
+}
+
 static void
 rspamd_map_helper_traverse_hash(void *data,
 								rspamd_map_traverse_cb cb,
@@ -785,6 +1082,12 @@ rspamd_map_helper_traverse_hash(void *data,
 	struct rspamd_map_helper_value *val;
 	struct rspamd_hash_map_helper *ht = data;
 
+	if (ht->image) {
+		rspamd_map_image_foreach(ht->image, cb, cbdata, reset_hits);
+
+		return;
+	}
+
 	kh_foreach(ht->htb, tok, val, {
 		if (!cb(tok.begin, val->value, val->hits, cbdata)) {
 			break;
@@ -796,6 +1099,23 @@ rspamd_map_helper_traverse_hash(void *data,
 	});
 }
 
+static void
+rspamd_map_helper_stat_hash(void *data, struct rspamd_map_data_stat *st)
+{
+	struct rspamd_hash_map_helper *ht = data;
+
+	st->memory = rspamd_mempool_get_used_size(ht->pool) +
+				 rspamd_map_helper_htb_memory(ht->htb);
+
+	if (ht->image) {
+		st->memory += rspamd_map_image_size(ht->image);
+	}
+
+	if (ht->domains) {
+		st->memory += rspamd_domain_trie_memory(ht->domains);
+	}
+}
+
 struct rspamd_radix_map_helper *
 rspamd_map_helper_new_radix(struct rspamd_map *map)
 {
@@ -805,7 +1125,7 @@ rspamd_map_helper_new_radix(struct rspamd_map *map)
 
 	if (map) {
 		pool = rspamd_mempool_new(rspamd_mempool_suggest_size(),
-								  map->tag, 0);
+								  map->tag, RSPAMD_MEMPOOL_HUGEPAGES);
 		name = map->name;
 	}
 	else {
@@ -835,6 +1155,17 @@ void rspamd_map_helper_destroy_radix(struct rspamd_radix_map_helper *r)
 	rspamd_mempool_delete(pool);
 }
 
+static void
+rspamd_map_helper_stat_radix(void *data, struct rspamd_map_data_stat *st)
+{
+	struct rspamd_radix_map_helper *r = data;
+
+	/* Pool includes the trie itself */
+	st->memory = rspamd_mempool_get_used_size(r->pool) +
+				 rspamd_map_helper_htb_memory(r->htb) +
+				 radix_get_memory(r->trie);
+}
+
 static void
 rspamd_map_helper_traverse_radix(void *data,
 								 rspamd_map_traverse_cb cb,
@@ -889,9 +1220,6 @@ void rspamd_map_helper_destroy_regexp(struct rspamd_regexp_map_helper *re_map)
 	}
 
 #ifdef WITH_HYPERSCAN
-	if (re_map->hs_scratch) {
-		hs_free_scratch(re_map->hs_scratch);
-	}
 	if (re_map->hs_db) {
 		rspamd_hyperscan_free(re_map->hs_db, false);
 	}
@@ -908,8 +1236,27 @@ void rspamd_map_helper_destroy_regexp(struct rspamd_regexp_map_helper *re_map)
 	if (re_map->ids) {
 		g_free(re_map->ids);
 	}
+	if (re_map->hs_raw_db) {
+		hs_free_database(re_map->hs_raw_db);
+	}
+	if (re_map->hs_compile_err) {
+		g_free(re_map->hs_compile_err);
+	}
 #endif
 
+	for (i = 0; i < G_N_ELEMENTS(re_map->literals); i++) {
+		if (re_map->literals[i]) {
+			rspamd_multipattern_destroy(re_map->literals[i]);
+		}
+		if (re_map->literal_ids[i]) {
+			g_array_free(re_map->literal_ids[i], TRUE);
+		}
+	}
+
+	if (re_map->is_literal) {
+		g_free(re_map->is_literal);
+	}
+
 	for (i = 0; i < re_map->regexps->len; i++) {
 		re = g_ptr_array_index(re_map->regexps, i);
 		rspamd_regexp_unref(re);
@@ -931,8 +1278,61 @@ rspamd_kv_list_read(
 	struct map_cb_data *data,
 	gboolean final)
 {
+	struct rspamd_map *map = data->map;
+	struct rspamd_hash_map_helper *htb;
+
+	if (data->delta) {
+		htb = data->cur_data ? data->cur_data : data->prev_data;
+
+		if (htb && htb->image) {
+			/* Checked before taking prev_data, as errored data is destroyed */
+			msg_err_map("cannot apply delta to the read only image of %s", map->name);
+			data->errored = true;
+
+			return chunk + len;
+		}
+
+		if (data->cur_data == NULL) {
+			/* Modify the current data in place */
+			data->cur_data = data->prev_data ? data->prev_data : rspamd_map_helper_new_hash(map);
+			data->prev_data = NULL;
+		}
+
+		rspamd_parse_kv_delta(chunk, len, data, rspamd_map_helper_insert_hash,
+							  rspamd_map_helper_remove_hash, "");
+		map->digest = rspamd_cryptobox_fast_hash(chunk, len, map->digest);
+
+		return chunk + len;
+	}
+
 	if (data->cur_data == NULL) {
-		data->cur_data = rspamd_map_helper_new_hash(data->map);
+		htb = rspamd_map_helper_new_hash(map);
+		data->cur_data = htb;
+
+		if (data->image) {
+			/* Chunk is a path of a precompiled image */
+			GError *err = NULL;
+
+			htb->image = rspamd_map_image_open(chunk, &err);
+
+			if (htb->image == NULL) {
+				msg_err_map("cannot load map image for %s: %e", map->name, err);
+				g_error_free(err);
+				data->errored = true;
+			}
+			else {
+				htb->image_path = rspamd_mempool_strdup(htb->pool, chunk);
+				htb->image_digest = rspamd_map_image_digest(htb->image);
+			}
+
+			return chunk + len;
+		}
+
+		/* Images are used merely when the whole map data is available at once */
+		if (final && rspamd_map_image_wanted(map, len) &&
+			rspamd_map_helper_hash_attach_cached(htb, chunk, len, "hmap")) {
+			return chunk + len;
+		}
 	}
 
 	return rspamd_parse_kv_list(
@@ -962,11 +1362,33 @@ void rspamd_kv_list_fin(struct map_cb_data *data, void **target)
 	else {
 		if (data->cur_data) {
 			htb = (struct rspamd_hash_map_helper *) data->cur_data;
-			msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
-						 map->name);
+
+			if (htb->image_cached && htb->image == NULL) {
+				htb = rspamd_map_helper_hash_save_cached(htb);
+				data->cur_data = htb;
+			}
+
+			if (htb->image) {
+				data->map->nelts = rspamd_map_image_nelts(htb->image);
+				msg_info_map("use hash image of %uz elements for %s", data->map->nelts,
+							 map->name);
+				data->map->digest = htb->image_digest;
+			}
+			else if (data->delta) {
+				/* Digest has been updated with the delta */
+				msg_info_map("updated hash of %d elements from %s", kh_size(htb->htb),
+							 map->name);
+				data->map->nelts = kh_size(htb->htb);
+			}
+			else {
+				msg_info_map("read hash of %d elements from %s", kh_size(htb->htb),
+							 map->name);
+				data->map->nelts = kh_size(htb->htb);
+				data->map->digest = rspamd_cryptobox_fast_hash_final(&htb->hst);
+			}
+
 			data->map->traverse_function = rspamd_map_helper_traverse_hash;
-			data->map->nelts = kh_size(htb->htb);
-			data->map->digest = rspamd_cryptobox_fast_hash_final(&htb->hst);
+			data->map->stat_function = rspamd_map_helper_stat_hash;
 		}
 
 		if (target) {
@@ -975,6 +1397,7 @@ void rspamd_kv_list_fin(struct map_cb_data *data, void **target)
 
 		if (data->prev_data) {
 			htb = (struct rspamd_hash_map_helper *) data->prev_data;
+			rspamd_map_helper_hash_drop_cached(htb, data->cur_data);
 			rspamd_map_helper_destroy_hash(htb);
 		}
 	}
@@ -990,82 +1413,695 @@ void rspamd_kv_list_dtor(struct map_cb_data *data)
 	}
 }
 
-char *
-rspamd_radix_read(
-	char *chunk,
-	int len,
-	struct map_cb_data *data,
-	gboolean final)
+struct rspamd_url_map_helper *
+rspamd_map_helper_new_url(struct rspamd_map *map)
 {
-	struct rspamd_radix_map_helper *r;
-	struct rspamd_map *map = data->map;
+	struct rspamd_url_map_helper *um;
 
-	if (data->cur_data == NULL) {
-		r = rspamd_map_helper_new_radix(map);
-		data->cur_data = r;
-	}
+	um = g_malloc0(sizeof(*um));
+	um->map = map;
+	um->hosts = rspamd_map_helper_new_hash(map);
+	um->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+										g_free, rspamd_gstring_free_hard);
 
-	return rspamd_parse_kv_list(
-		chunk,
-		len,
-		data,
-		rspamd_map_helper_insert_radix,
-		hash_fill,
-		final);
+	return um;
 }
 
-void rspamd_radix_fin(struct map_cb_data *data, void **target)
+void rspamd_map_helper_destroy_url(struct rspamd_url_map_helper *um)
 {
-	struct rspamd_map *map = data->map;
-	struct rspamd_radix_map_helper *r;
-
-	if (data->errored) {
-		/* Clean up the current data and do not touch prev data */
-		if (data->cur_data) {
-			msg_info_map("cleanup unfinished new data as error occurred for %s",
-						 map->name);
-			r = (struct rspamd_radix_map_helper *) data->cur_data;
-			rspamd_map_helper_destroy_radix(r);
-			data->cur_data = NULL;
-		}
+	if (um == NULL) {
+		return;
 	}
-	else {
-		if (data->cur_data) {
-			r = (struct rspamd_radix_map_helper *) data->cur_data;
-			msg_info_map("read radix trie of %z elements: %s",
-						 radix_get_size(r->trie), radix_get_info(r->trie));
-			data->map->traverse_function = rspamd_map_helper_traverse_radix;
-			data->map->nelts = kh_size(r->htb);
-			data->map->digest = rspamd_cryptobox_fast_hash_final(&r->hst);
-		}
-
-		if (target) {
-			*target = data->cur_data;
-		}
 
-		if (data->prev_data) {
-			r = (struct rspamd_radix_map_helper *) data->prev_data;
-			rspamd_map_helper_destroy_radix(r);
-		}
+	if (um->pending) {
+		g_hash_table_unref(um->pending);
 	}
+
+	rspamd_map_helper_destroy_hash(um->hosts);
+	g_free(um);
 }
 
-void rspamd_radix_dtor(struct map_cb_data *data)
+static void
+rspamd_map_helper_traverse_url(void *data,
+							   rspamd_map_traverse_cb cb,
+							   gpointer cbdata,
+							   gboolean reset_hits)
+{
+	struct rspamd_url_map_helper *um = data;
+
+	rspamd_map_helper_traverse_hash(um->hosts, cb, cbdata, reset_hits);
+}
+
+static void
+rspamd_map_helper_stat_url(void *data, struct rspamd_map_data_stat *st)
+{
+	struct rspamd_url_map_helper *um = data;
+
+	rspamd_map_helper_stat_hash(um->hosts, st);
+}
+
+static gboolean
+rspamd_url_list_url_cb(struct rspamd_url *url, gsize start_offset,
+					   gsize end_offset, gpointer ud)
+{
+	struct rspamd_url **purl = ud;
+
+	*purl = url;
+
+	return TRUE;
+}
+
+/* Separators of records and fields must not appear in their values */
+static void
+rspamd_url_list_append_field(GString *rec, const char *field, gsize len)
+{
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		g_string_append_c(rec, (field[i] == '\t' || field[i] == '\n') ? ' ' : field[i]);
+	}
+}
+
+static void
+rspamd_url_list_parse_line(struct rspamd_url_map_helper *um,
+						   rspamd_mempool_t *pool,
+						   const char *line, gsize len)
+{
+	struct rspamd_map *map = um->map;
+	struct rspamd_url *url = NULL;
+	ucl_object_t *top = NULL;
+	const char *url_str, *data = NULL;
+	gsize url_len, data_len = 0;
+	GString *rec;
+	char *host;
+
+	while (len > 0 && g_ascii_isspace(*line)) {
+		line++;
+		len--;
+	}
+
+	while (len > 0 && g_ascii_isspace(line[len - 1])) {
+		len--;
+	}
+
+	if (len == 0 || *line == '#') {
+		return;
+	}
+
+	url_str = line;
+	url_len = len;
+
+	if (*line == '{') {
+		/* Json record (e.g. openphish premium feed) is kept as data */
+		struct ucl_parser *parser = ucl_parser_new(UCL_PARSER_NO_FILEVARS);
+		const ucl_object_t *elt = NULL;
+
+		if (ucl_parser_add_chunk(parser, (const unsigned char *) line, len)) {
+			top = ucl_parser_get_object(parser);
+			elt = ucl_object_lookup(top, "url");
+		}
+
+		ucl_parser_free(parser);
+
+		if (elt == NULL || ucl_object_type(elt) != UCL_STRING) {
+			msg_warn_map("invalid json record in %s: %*s", map->name, (int) len, line);
+
+			if (top) {
+				ucl_object_unref(top);
+			}
+
+			return;
+		}
+
+		url_str = ucl_object_tolstring(elt, &url_len);
+		data = line;
+		data_len = len;
+	}
+
+	rspamd_url_find_single(pool, url_str, url_len, RSPAMD_URL_FIND_ALL,
+						   rspamd_url_list_url_cb, &url);
+
+	if (url && url->hostlen > 0) {
+		host = g_ascii_strdown(rspamd_url_host_unsafe(url), url->hostlen);
+		rec = g_hash_table_lookup(um->pending, host);
+
+		if (rec == NULL) {
+			rec = g_string_new(NULL);
+			g_hash_table_insert(um->pending, host, rec);
+		}
+		else {
+			g_free(host);
+			g_string_append_c(rec, '\n');
+		}
+
+		rspamd_url_list_append_field(rec, rspamd_url_data_unsafe(url), url->datalen);
+		g_string_append_c(rec, '\t');
+		rspamd_url_list_append_field(rec, rspamd_url_query_unsafe(url), url->querylen);
+		g_string_append_c(rec, '\t');
+		rspamd_url_list_append_field(rec, data, data_len);
+		um->nurls++;
+	}
+
+	if (top) {
+		ucl_object_unref(top);
+	}
+}
+
+char *
+rspamd_url_list_read(
+	char *chunk,
+	int len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_url_map_helper *um;
+	rspamd_mempool_t *pool;
+	const char *p = chunk, *end = chunk + len, *eol;
+
+	if (data->cur_data == NULL) {
+		um = rspamd_map_helper_new_url(map);
+		data->cur_data = um;
+
+		if (final && rspamd_map_image_wanted(map, len) &&
+			rspamd_map_helper_hash_attach_cached(um->hosts, chunk, len, "umap")) {
+			return chunk + len;
+		}
+	}
+
+	um = data->cur_data;
+	/* Urls are not needed after parsing */
+	pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "url map", 0);
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			if (!final) {
+				/* Incomplete line is passed again with the next chunk */
+				break;
+			}
+
+			eol = end;
+		}
+
+		rspamd_url_list_parse_line(um, pool, p, eol - p);
+		p = eol + 1;
+	}
+
+	rspamd_mempool_delete(pool);
+
+	return (char *) MIN(p, end);
+}
+
+void rspamd_url_list_fin(struct map_cb_data *data, void **target)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_url_map_helper *um;
+	GHashTableIter it;
+	gpointer k, v;
+
+	if (data->errored) {
+		if (data->cur_data) {
+			msg_info_map("cleanup unfinished new data as error occurred for %s",
+						 map->name);
+			rspamd_map_helper_destroy_url(data->cur_data);
+			data->cur_data = NULL;
+		}
+
+		return;
+	}
+
+	if (data->cur_data) {
+		um = (struct rspamd_url_map_helper *) data->cur_data;
+
+		if (um->hosts->image == NULL) {
+			g_hash_table_iter_init(&it, um->pending);
+
+			while (g_hash_table_iter_next(&it, &k, &v)) {
+				rspamd_map_helper_insert_hash(um->hosts, k, ((GString *) v)->str);
+			}
+
+			if (um->hosts->image_cached) {
+				um->hosts = rspamd_map_helper_hash_save_cached(um->hosts);
+			}
+		}
+
+		g_hash_table_unref(um->pending);
+		um->pending = NULL;
+
+		if (um->hosts->image) {
+			data->map->nelts = rspamd_map_image_nelts(um->hosts->image);
+			data->map->digest = um->hosts->image_digest;
+			msg_info_map("use url image of %uz hosts for %s", data->map->nelts,
+						 map->name);
+		}
+		else {
+			data->map->nelts = kh_size(um->hosts->htb);
+			data->map->digest = rspamd_cryptobox_fast_hash_final(&um->hosts->hst);
+			msg_info_map("read %uz urls of %uz hosts from %s", um->nurls,
+						 data->map->nelts, map->name);
+		}
+
+		data->map->traverse_function = rspamd_map_helper_traverse_url;
+		data->map->stat_function = rspamd_map_helper_stat_url;
+	}
+
+	if (target) {
+		*target = data->cur_data;
+	}
+
+	if (data->prev_data) {
+		um = (struct rspamd_url_map_helper *) data->prev_data;
+		rspamd_map_helper_hash_drop_cached(um->hosts,
+										   data->cur_data ? ((struct rspamd_url_map_helper *) data->cur_data)->hosts : NULL);
+		rspamd_map_helper_destroy_url(um);
+	}
+}
+
+void rspamd_url_list_dtor(struct map_cb_data *data)
+{
+	if (data->cur_data) {
+		rspamd_map_helper_destroy_url(data->cur_data);
+	}
+}
+
+/* Heavy part of finalization, see map_compile_cb_t */
+static void
+rspamd_radix_compile(void *data)
+{
+	struct rspamd_radix_map_helper *r = (struct rspamd_radix_map_helper *) data;
+
+	radix_finalize_compressed(r->trie);
+}
+
+char *
+rspamd_radix_read(
+	char *chunk,
+	int len,
+	struct map_cb_data *data,
+	gboolean final)
 {
 	struct rspamd_radix_map_helper *r;
+	struct rspamd_map *map = data->map;
+
+	if (data->delta) {
+		/* Prefixes cannot be removed from the trie, so a full reload is needed */
+		if (rspamd_map_delta_has_removals(chunk, len)) {
+			msg_info_map("cannot remove elements from radix map %s, "
+						 "full reload is needed",
+						 map->name);
+			data->errored = true;
+
+			return chunk + len;
+		}
+
+		if (data->cur_data == NULL) {
+			/* Modify the current data in place */
+			data->cur_data = data->prev_data ? data->prev_data : rspamd_map_helper_new_radix(map);
+			data->prev_data = NULL;
+		}
+
+		rspamd_parse_kv_delta(chunk, len, data, rspamd_map_helper_insert_radix,
+							  NULL, hash_fill);
+		map->digest = rspamd_cryptobox_fast_hash(chunk, len, map->digest);
+
+		return chunk + len;
+	}
+
+	if (data->cur_data == NULL) {
+		r = rspamd_map_helper_new_radix(map);
+		data->cur_data = r;
+		data->compile = rspamd_radix_compile;
+	}
+
+	return rspamd_parse_kv_list(
+		chunk,
+		len,
+		data,
+		rspamd_map_helper_insert_radix,
+		hash_fill,
+		final);
+}
+
+void rspamd_radix_fin(struct map_cb_data *data, void **target)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_radix_map_helper *r;
+
+	if (data->errored) {
+		/* Clean up the current data and do not touch prev data */
+		if (data->cur_data) {
+			msg_info_map("cleanup unfinished new data as error occurred for %s",
+						 map->name);
+			r = (struct rspamd_radix_map_helper *) data->cur_data;
+			rspamd_map_helper_destroy_radix(r);
+			data->cur_data = NULL;
+		}
+	}
+	else {
+		if (data->cur_data) {
+			r = (struct rspamd_radix_map_helper *) data->cur_data;
+
+			if (data->delta) {
+				/* New data is compiled before fin, and deltas are applied in place */
+				radix_finalize_compressed(r->trie);
+			}
+
+			msg_info_map("read radix trie of %z elements: %s",
+						 radix_get_size(r->trie), radix_get_info(r->trie));
+			data->map->traverse_function = rspamd_map_helper_traverse_radix;
+			data->map->stat_function = rspamd_map_helper_stat_radix;
+			data->map->nelts = kh_size(r->htb);
+
+			if (!data->delta) {
+				data->map->digest = rspamd_cryptobox_fast_hash_final(&r->hst);
+			}
+		}
+
+		if (target) {
+			*target = data->cur_data;
+		}
+
+		if (data->prev_data) {
+			r = (struct rspamd_radix_map_helper *) data->prev_data;
+			rspamd_map_helper_destroy_radix(r);
+		}
+	}
+}
+
+void rspamd_radix_dtor(struct map_cb_data *data)
+{
+	struct rspamd_radix_map_helper *r;
+
+	if (data->cur_data) {
+		r = (struct rspamd_radix_map_helper *) data->cur_data;
+		rspamd_map_helper_destroy_radix(r);
+	}
+}
+
+/*
+ * Checks if a regexp is a plain literal, optionally anchored at the start
+ * and/or the end, and returns the literal if so
+ */
+static char *
+rspamd_regexp_map_get_literal(rspamd_regexp_t *re, gsize *plen,
+							  unsigned int *panchors, gboolean *picase)
+{
+	const char *p, *end;
+	char *res, *d;
+	unsigned int anchors = 0;
+	int pcre_flags;
+	gboolean icase;
+
+	p = rspamd_regexp_get_pattern(re);
+	end = p + strlen(p);
+	pcre_flags = rspamd_regexp_get_pcre_flags(re);
+	icase = !!(pcre_flags & PCRE_FLAG(CASELESS));
+
+	if ((pcre_flags & (PCRE_FLAG(EXTENDED) | PCRE_FLAG(MULTILINE))) ||
+		(rspamd_regexp_get_flags(re) & RSPAMD_REGEXP_FLAG_FULL_MATCH)) {
+		return NULL;
+	}
+
+	if (p < end && *p == '^') {
+		anchors |= RSPAMD_REGEXP_MAP_LITERAL_START;
+		p++;
+	}
+	else if (end - p > 2 && p[0] == '.' && p[1] == '*') {
+		/* Leading `.*` as produced from globs means nothing for search */
+		p += 2;
+	}
+
+	if (end - p > 2 && end[-2] == '.' && end[-1] == '*' && end[-3] != '\\') {
+		end -= 2;
+	}
+	else if (end - p > 1 && end[-1] == '$' && end[-2] != '\\') {
+		anchors |= RSPAMD_REGEXP_MAP_LITERAL_END;
+		end--;
+	}
+
+	if (p >= end) {
+		return NULL;
+	}
+
+	res = g_malloc(end - p + 1);
+	d = res;
+
+	while (p < end) {
+		unsigned char c = *p++;
+
+		switch (c) {
+		case '\\':
+			/* Escaped punctuation is a literal, anything else is a class */
+			if (p == end || g_ascii_isalnum(*p) || (*p & 0x80) || *p == '\0') {
+				g_free(res);
+				return NULL;
+			}
+			*d++ = *p++;
+			break;
+		case '.':
+		case '[':
+		case ']':
+		case '(':
+		case ')':
+		case '{':
+		case '}':
+		case '*':
+		case '+':
+		case '?':
+		case '|':
+		case '^':
+		case '$':
+			g_free(res);
+			return NULL;
+		default:
+			if (icase && (c & 0x80)) {
+				/* Case folding of non ASCII symbols needs the regexp engine */
+				g_free(res);
+				return NULL;
+			}
+			*d++ = c;
+			break;
+		}
+	}
+
+	*d = '\0';
+	*plen = d - res;
+	*panchors = anchors;
+	*picase = icase;
+
+	if (icase) {
+		rspamd_str_lc(res, *plen);
+	}
+
+	return res;
+}
+
+/*
+ * Moves literal patterns from regexp engine to multipattern (Aho-Corasick or
+ * hyperscan literals) that is much cheaper to build; this part does not
+ * compile anything and does not log, so it is safe to call in a helper thread
+ */
+static void
+rspamd_re_map_collect_literals(struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_regexp_map_literal lit;
+	rspamd_regexp_t *re;
+	unsigned int i, j;
+	gboolean icase;
+	char *literal;
+	gsize len;
+
+	re_map->is_literal = g_malloc0(re_map->regexps->len + 1);
+	re_map->nliterals = 0;
+
+	for (i = 0; i < re_map->regexps->len; i++) {
+		re = g_ptr_array_index(re_map->regexps, i);
+		literal = rspamd_regexp_map_get_literal(re, &len, &lit.anchors, &icase);
+
+		if (literal == NULL) {
+			continue;
+		}
+
+		j = icase ? 1 : 0;
+
+		if (re_map->literals[j] == NULL) {
+			re_map->literals[j] = rspamd_multipattern_create(
+				icase ? RSPAMD_MULTIPATTERN_ICASE : RSPAMD_MULTIPATTERN_DEFAULT);
+			re_map->literal_ids[j] = g_array_new(FALSE, FALSE,
+												 sizeof(struct rspamd_regexp_map_literal));
+		}
+
+		lit.id = i;
+		rspamd_multipattern_add_pattern_len(re_map->literals[j], literal, len, 0);
+		g_array_append_val(re_map->literal_ids[j], lit);
+		re_map->is_literal[i] = 1;
+		re_map->nliterals++;
+		g_free(literal);
+	}
+}
+
+static void rspamd_re_map_reset_patterns(struct rspamd_regexp_map_helper *re_map);
+
+static void
+rspamd_re_map_prepare_literals(struct rspamd_regexp_map_helper *re_map)
+{
+	struct rspamd_map *map = re_map->map;
+	struct rspamd_regexp_map_literal lit;
+	GError *err = NULL;
+	unsigned int i, j;
+
+	if (re_map->is_literal == NULL) {
+		rspamd_re_map_collect_literals(re_map);
+	}
+
+	for (j = 0; j < G_N_ELEMENTS(re_map->literals); j++) {
+		if (re_map->literals[j] == NULL) {
+			continue;
+		}
+
+		if (!rspamd_multipattern_compile(re_map->literals[j], 0, &err)) {
+			msg_err_map("cannot compile literals for map %s: %e, "
+						"use regular expressions instead",
+						map->name, err);
+			g_error_free(err);
+			err = NULL;
+
+			for (i = 0; i < re_map->literal_ids[j]->len; i++) {
+				lit = g_array_index(re_map->literal_ids[j],
+									struct rspamd_regexp_map_literal, i);
+				re_map->is_literal[lit.id] = 0;
+				re_map->nliterals--;
+			}
+
+			rspamd_multipattern_destroy(re_map->literals[j]);
+			g_array_free(re_map->literal_ids[j], TRUE);
+			re_map->literals[j] = NULL;
+			re_map->literal_ids[j] = NULL;
+			/* Regexp engine patterns compiled beforehand miss these ones */
+			rspamd_re_map_reset_patterns(re_map);
+		}
+	}
+
+	if (re_map->nliterals > 0) {
+		msg_info_map("matching %ud of %ud patterns from %s as literals",
+					 re_map->nliterals, re_map->regexps->len, map->name);
+	}
+}
+
+struct rspamd_regexp_map_literal_cbdata {
+	GArray *lits;
+	GArray *matched; /* NULL if we need just the first regexp */
+	unsigned int min_id;
+};
+
+static int
+rspamd_match_regexp_map_literal_cb(struct rspamd_multipattern *mp,
+								   unsigned int strnum,
+								   int match_start,
+								   int match_pos,
+								   const char *text,
+								   gsize len,
+								   void *context)
+{
+	struct rspamd_regexp_map_literal_cbdata *cbd = context;
+	struct rspamd_regexp_map_literal *lit;
+
+	lit = &g_array_index(cbd->lits, struct rspamd_regexp_map_literal, strnum);
+
+	if ((lit->anchors & RSPAMD_REGEXP_MAP_LITERAL_START) && match_start != 0) {
+		return 0;
+	}
+
+	if (lit->anchors & RSPAMD_REGEXP_MAP_LITERAL_END) {
+		gsize tail = len - match_pos;
+
+		/* `$` also matches before the final newline */
+		if (!(tail == 0 ||
+			  (tail == 1 && (text[match_pos] == '\n' || text[match_pos] == '\r')) ||
+			  (tail == 2 && text[match_pos] == '\r' && text[match_pos + 1] == '\n'))) {
+			return 0;
+		}
+	}
+
+	if (cbd->matched) {
+		g_array_append_val(cbd->matched, lit->id);
+	}
+	else if (lit->id < cbd->min_id) {
+		cbd->min_id = lit->id;
+	}
+
+	return 0;
+}
+
+static int
+rspamd_regexp_map_id_cmp(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int *) a, ib = *(const unsigned int *) b;
+
+	return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+/*
+ * Matches literal patterns; returns the lowest matched id (or G_MAXUINT) if
+ * `ret` is NULL or appends all matched values to `ret` otherwise
+ */
+static unsigned int
+rspamd_match_regexp_map_literals(struct rspamd_regexp_map_helper *map,
+								 const char *in, gsize len, GPtrArray *ret)
+{
+	struct rspamd_regexp_map_literal_cbdata cbd;
+	struct rspamd_map_helper_value *val;
+	unsigned int i, id, last = G_MAXUINT;
+
+	cbd.min_id = G_MAXUINT;
+	cbd.matched = NULL;
+
+	if (map->literals[0] == NULL && map->literals[1] == NULL) {
+		return G_MAXUINT;
+	}
+
+	if (ret) {
+		cbd.matched = g_array_new(FALSE, FALSE, sizeof(unsigned int));
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(map->literals); i++) {
+		if (map->literals[i]) {
+			cbd.lits = map->literal_ids[i];
+			rspamd_multipattern_lookup(map->literals[i], in, len,
+									   rspamd_match_regexp_map_literal_cb, &cbd, NULL);
+		}
+	}
 
-	if (data->cur_data) {
-		r = (struct rspamd_radix_map_helper *) data->cur_data;
-		rspamd_map_helper_destroy_radix(r);
+	if (ret) {
+		/* A literal can be found many times */
+		qsort(cbd.matched->data, cbd.matched->len, sizeof(unsigned int),
+			  rspamd_regexp_map_id_cmp);
+
+		for (i = 0; i < cbd.matched->len; i++) {
+			id = g_array_index(cbd.matched, unsigned int, i);
+
+			if (id != last) {
+				val = g_ptr_array_index(map->values, id);
+				val->hits++;
+				g_ptr_array_add(ret, val->value);
+				last = id;
+			}
+		}
+
+		g_array_free(cbd.matched, TRUE);
 	}
+
+	return cbd.min_id;
 }
 
 #ifdef WITH_HYPERSCAN
 
 static gboolean
-rspamd_try_load_re_map_cache(struct rspamd_regexp_map_helper *re_map)
+rspamd_re_map_cache_path(struct rspamd_regexp_map_helper *re_map,
+						 char *fp, gsize fplen)
 {
-	char fp[PATH_MAX];
 	struct rspamd_map *map;
 
 	map = re_map->map;
@@ -1074,9 +2110,21 @@ rspamd_try_load_re_map_cache(struct rspamd_regexp_map_helper *re_map)
 		return FALSE;
 	}
 
-	rspamd_snprintf(fp, sizeof(fp), "%s/%*xs.hsmc",
+	rspamd_snprintf(fp, fplen, "%s/%*xs.hsmc",
 					map->cfg->hs_cache_dir,
-					(int) rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+					(int) rspamd_cryptobox_HASHBYTES / 2, re_map->hs_digest);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_try_load_re_map_cache(struct rspamd_regexp_map_helper *re_map)
+{
+	char fp[PATH_MAX];
+
+	if (!rspamd_re_map_cache_path(re_map, fp, sizeof(fp))) {
+		return FALSE;
+	}
 
 	re_map->hs_db = rspamd_hyperscan_maybe_load(fp, 0);
 
@@ -1115,7 +2163,7 @@ rspamd_try_save_re_map_cache(struct rspamd_regexp_map_helper *re_map)
 
 				rspamd_snprintf(np, sizeof(np), "%s/%*xs.hsmc",
 								re_map->map->cfg->hs_cache_dir,
-								(int) rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+								(int) rspamd_cryptobox_HASHBYTES / 2, re_map->hs_digest);
 
 				if (rename(fp, np) == -1) {
 					msg_warn_map("cannot rename hyperscan cache from %s to %s: %s",
@@ -1144,41 +2192,46 @@ rspamd_try_save_re_map_cache(struct rspamd_regexp_map_helper *re_map)
 
 #endif
 
-static void
-rspamd_re_map_finalize(struct rspamd_regexp_map_helper *re_map)
-{
 #ifdef WITH_HYPERSCAN
-	unsigned int i;
-	hs_platform_info_t plt;
-	hs_compile_error_t *err;
-	struct rspamd_map *map;
-	rspamd_regexp_t *re;
-	int pcre_flags;
-
-	map = re_map->map;
-
+static gboolean
+rspamd_re_map_hs_supported(struct rspamd_regexp_map_helper *re_map)
+{
 #if !defined(__aarch64__) && !defined(__powerpc64__)
-	if (!(map->cfg->libs_ctx->crypto_ctx->cpu_config & CPUID_SSSE3)) {
-		msg_info_map("disable hyperscan for map %s, ssse3 instructions are not supported by CPU",
-					 map->name);
-		return;
+	if (!(re_map->map->cfg->libs_ctx->crypto_ctx->cpu_config & CPUID_SSSE3)) {
+		return FALSE;
 	}
 #endif
 
-	if (hs_populate_platform(&plt) != HS_SUCCESS) {
-		msg_err_map("cannot populate hyperscan platform");
-		return;
-	}
+	return TRUE;
+}
 
-	re_map->patterns = g_new(char *, re_map->regexps->len);
-	re_map->flags = g_new(int, re_map->regexps->len);
-	re_map->ids = g_new(int, re_map->regexps->len);
+/*
+ * Fills patterns for hyperscan and digest of the cached database,
+ * it must be thread safe as well as rspamd_re_map_compile_patterns
+ */
+static void
+rspamd_re_map_prepare_patterns(struct rspamd_regexp_map_helper *re_map)
+{
+	unsigned int i, npatterns = 0;
+	rspamd_cryptobox_hash_state_t hst;
+	rspamd_regexp_t *re;
+	int pcre_flags;
+
+	re_map->patterns = g_new0(char *, re_map->regexps->len);
+	re_map->flags = g_new0(int, re_map->regexps->len);
+	re_map->ids = g_new0(int, re_map->regexps->len);
+	rspamd_cryptobox_hash_init(&hst, NULL, 0);
 
 	for (i = 0; i < re_map->regexps->len; i++) {
 		const char *pat;
 		char *escaped;
-		int pat_flags;
+		int pat_flags, n;
 
+		if (re_map->is_literal[i]) {
+			continue;
+		}
+
+		n = npatterns++;
 		re = g_ptr_array_index(re_map->regexps, i);
 		pcre_flags = rspamd_regexp_get_pcre_flags(re);
 		pat = rspamd_regexp_get_pattern(re);
@@ -1187,92 +2240,211 @@ rspamd_re_map_finalize(struct rspamd_regexp_map_helper *re_map)
 		if (pat_flags & RSPAMD_REGEXP_FLAG_UTF) {
 			escaped = rspamd_str_regexp_escape(pat, strlen(pat), NULL,
 											   RSPAMD_REGEXP_ESCAPE_RE | RSPAMD_REGEXP_ESCAPE_UTF);
-			re_map->flags[i] |= HS_FLAG_UTF8;
+			re_map->flags[n] |= HS_FLAG_UTF8;
 		}
 		else {
 			escaped = rspamd_str_regexp_escape(pat, strlen(pat), NULL,
 											   RSPAMD_REGEXP_ESCAPE_RE);
 		}
 
-		re_map->patterns[i] = escaped;
-		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
+		re_map->patterns[n] = escaped;
+		re_map->flags[n] = HS_FLAG_SINGLEMATCH;
 
 #ifndef WITH_PCRE2
 		if (pcre_flags & PCRE_FLAG(UTF8)) {
-			re_map->flags[i] |= HS_FLAG_UTF8;
+			re_map->flags[n] |= HS_FLAG_UTF8;
 		}
 #else
 		if (pcre_flags & PCRE_FLAG(UTF)) {
-			re_map->flags[i] |= HS_FLAG_UTF8;
+			re_map->flags[n] |= HS_FLAG_UTF8;
 		}
 #endif
 		if (pcre_flags & PCRE_FLAG(CASELESS)) {
-			re_map->flags[i] |= HS_FLAG_CASELESS;
+			re_map->flags[n] |= HS_FLAG_CASELESS;
 		}
 		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-			re_map->flags[i] |= HS_FLAG_MULTILINE;
+			re_map->flags[n] |= HS_FLAG_MULTILINE;
 		}
 		if (pcre_flags & PCRE_FLAG(DOTALL)) {
-			re_map->flags[i] |= HS_FLAG_DOTALL;
+			re_map->flags[n] |= HS_FLAG_DOTALL;
 		}
 		if (rspamd_regexp_get_maxhits(re) == 1) {
-			re_map->flags[i] |= HS_FLAG_SINGLEMATCH;
+			re_map->flags[n] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		re_map->ids[n] = i;
+		rspamd_cryptobox_hash_update(&hst, (const unsigned char *) escaped,
+									 strlen(escaped));
+		rspamd_cryptobox_hash_update(&hst, (const unsigned char *) &re_map->flags[n],
+									 sizeof(re_map->flags[n]));
+	}
+
+	/* Cache file depends on what is actually compiled */
+	rspamd_cryptobox_hash_final(&hst, re_map->hs_digest);
+	re_map->npatterns = npatterns;
+}
+
+static void
+rspamd_re_map_compile_patterns(struct rspamd_regexp_map_helper *re_map,
+							   const hs_platform_info_t *plt)
+{
+	double ts1 = rspamd_get_ticks(FALSE);
+	hs_compile_error_t *err;
+
+	if (hs_compile_multi((const char **) re_map->patterns,
+						 re_map->flags,
+						 re_map->ids,
+						 re_map->npatterns,
+						 HS_MODE_BLOCK,
+						 plt,
+						 &re_map->hs_raw_db,
+						 &err) != HS_SUCCESS) {
+		re_map->hs_compile_err = g_strdup_printf("'%s': %s",
+												 err->expression >= 0 ? re_map->patterns[err->expression] : "unknown regexp",
+												 err->message);
+		re_map->hs_raw_db = NULL;
+		hs_free_compile_error(err);
+	}
+
+	re_map->hs_compile_time = rspamd_get_ticks(FALSE) - ts1;
+}
+#endif
+
+static void
+rspamd_re_map_reset_patterns(struct rspamd_regexp_map_helper *re_map)
+{
+#ifdef WITH_HYPERSCAN
+	unsigned int i;
+
+	if (re_map->patterns) {
+		for (i = 0; i < re_map->regexps->len; i++) {
+			g_free(re_map->patterns[i]);
 		}
 
-		re_map->ids[i] = i;
+		g_free(re_map->patterns);
+		re_map->patterns = NULL;
+	}
+
+	g_free(re_map->flags);
+	re_map->flags = NULL;
+	g_free(re_map->ids);
+	re_map->ids = NULL;
+	re_map->npatterns = 0;
+
+	if (re_map->hs_raw_db) {
+		hs_free_database(re_map->hs_raw_db);
+		re_map->hs_raw_db = NULL;
+	}
+
+	g_free(re_map->hs_compile_err);
+	re_map->hs_compile_err = NULL;
+#endif
+}
+
+/* Heavy part of finalization, see map_compile_cb_t */
+static void
+rspamd_regexp_list_compile(void *data)
+{
+	struct rspamd_regexp_map_helper *re_map = (struct rspamd_regexp_map_helper *) data;
+
+	rspamd_re_map_collect_literals(re_map);
+
+#ifdef WITH_HYPERSCAN
+	hs_platform_info_t plt;
+	char fp[PATH_MAX];
+
+	if (!rspamd_re_map_hs_supported(re_map) ||
+		hs_populate_platform(&plt) != HS_SUCCESS) {
+		return;
+	}
+
+	rspamd_re_map_prepare_patterns(re_map);
+
+	/* Cached database is loaded in the loop thread */
+	if (re_map->npatterns > 0 &&
+		!(rspamd_re_map_cache_path(re_map, fp, sizeof(fp)) && access(fp, R_OK) == 0)) {
+		rspamd_re_map_compile_patterns(re_map, &plt);
+	}
+#endif
+}
+
+static void
+rspamd_re_map_finalize(struct rspamd_regexp_map_helper *re_map)
+{
+#ifdef WITH_HYPERSCAN
+	hs_platform_info_t plt;
+	struct rspamd_map *map;
+
+	map = re_map->map;
+
+	if (!rspamd_re_map_hs_supported(re_map)) {
+		msg_info_map("disable hyperscan for map %s, ssse3 instructions are not supported by CPU",
+					 map->name);
+		return;
+	}
+
+	if (hs_populate_platform(&plt) != HS_SUCCESS) {
+		msg_err_map("cannot populate hyperscan platform");
+		return;
+	}
+
+	if (re_map->patterns == NULL) {
+		rspamd_re_map_prepare_patterns(re_map);
 	}
 
-	if (re_map->regexps->len > 0 && re_map->patterns) {
+	if (re_map->npatterns > 0) {
 
 		if (!rspamd_try_load_re_map_cache(re_map)) {
-			double ts1 = rspamd_get_ticks(FALSE);
-			hs_database_t *hs_db = NULL;
-
-			if (hs_compile_multi((const char **) re_map->patterns,
-								 re_map->flags,
-								 re_map->ids,
-								 re_map->regexps->len,
-								 HS_MODE_BLOCK,
-								 &plt,
-								 &hs_db,
-								 &err) != HS_SUCCESS) {
-
-				msg_err_map("cannot create tree of regexp when processing '%s': %s",
-							err->expression >= 0 ? re_map->patterns[err->expression] : "unknown regexp", err->message);
-				re_map->hs_db = NULL;
-				hs_free_compile_error(err);
+			hs_database_t *hs_db;
+
+			if (re_map->hs_raw_db == NULL && re_map->hs_compile_err == NULL) {
+				rspamd_re_map_compile_patterns(re_map, &plt);
+			}
+
+			if (re_map->hs_compile_err) {
+				msg_err_map("cannot create tree of regexp when processing %s",
+							re_map->hs_compile_err);
+				g_free(re_map->hs_compile_err);
+				re_map->hs_compile_err = NULL;
 
 				return;
 			}
 
+			hs_db = re_map->hs_raw_db;
+			re_map->hs_raw_db = NULL;
+
 			if (re_map->map->cfg->hs_cache_dir) {
 				char fpath[PATH_MAX];
-				rspamd_snprintf(fpath, sizeof(fpath), "%s/%*xs.hsmc",
-								re_map->map->cfg->hs_cache_dir,
-								(int) rspamd_cryptobox_HASHBYTES / 2, re_map->re_digest);
+				rspamd_re_map_cache_path(re_map, fpath, sizeof(fpath));
 				re_map->hs_db = rspamd_hyperscan_from_raw_db(hs_db, fpath);
 			}
 			else {
 				re_map->hs_db = rspamd_hyperscan_from_raw_db(hs_db, NULL);
 			}
 
-			ts1 = (rspamd_get_ticks(FALSE) - ts1) * 1000.0;
-			msg_info_map("hyperscan compiled %d regular expressions from %s in %.1f ms",
-						 re_map->regexps->len, re_map->map->name, ts1);
+			msg_info_map("hyperscan compiled %ud regular expressions from %s in %.1f ms",
+						 re_map->npatterns, re_map->map->name,
+						 re_map->hs_compile_time * 1000.0);
 			rspamd_try_save_re_map_cache(re_map);
 		}
 		else {
-			msg_info_map("hyperscan read %d cached regular expressions from %s",
-						 re_map->regexps->len, re_map->map->name);
+			if (re_map->hs_raw_db) {
+				/* Cache has appeared while we were compiling */
+				hs_free_database(re_map->hs_raw_db);
+				re_map->hs_raw_db = NULL;
+			}
+
+			msg_info_map("hyperscan read %ud cached regular expressions from %s",
+						 re_map->npatterns, re_map->map->name);
 		}
 
-		if (hs_alloc_scratch(rspamd_hyperscan_get_database(re_map->hs_db), &re_map->hs_scratch) != HS_SUCCESS) {
+		if (!rspamd_hyperscan_scratch_reserve(rspamd_hyperscan_get_database(re_map->hs_db))) {
 			msg_err_map("cannot allocate scratch space for hyperscan");
 			rspamd_hyperscan_free(re_map->hs_db, true);
 			re_map->hs_db = NULL;
 		}
 	}
-	else {
+	else if (re_map->regexps->len == 0) {
 		msg_err_map("regexp map is empty");
 	}
 #endif
@@ -1290,6 +2462,7 @@ rspamd_regexp_list_read_single(
 	if (data->cur_data == NULL) {
 		re_map = rspamd_map_helper_new_regexp(data->map, 0);
 		data->cur_data = re_map;
+		data->compile = rspamd_regexp_list_compile;
 	}
 
 	return rspamd_parse_kv_list(
@@ -1313,6 +2486,7 @@ rspamd_glob_list_read_single(
 	if (data->cur_data == NULL) {
 		re_map = rspamd_map_helper_new_regexp(data->map, RSPAMD_REGEXP_MAP_FLAG_GLOB);
 		data->cur_data = re_map;
+		data->compile = rspamd_regexp_list_compile;
 	}
 
 	return rspamd_parse_kv_list(
@@ -1337,6 +2511,7 @@ rspamd_regexp_list_read_multiple(
 		re_map = rspamd_map_helper_new_regexp(data->map,
 											  RSPAMD_REGEXP_MAP_FLAG_MULTIPLE);
 		data->cur_data = re_map;
+		data->compile = rspamd_regexp_list_compile;
 	}
 
 	return rspamd_parse_kv_list(
@@ -1361,6 +2536,7 @@ rspamd_glob_list_read_multiple(
 		re_map = rspamd_map_helper_new_regexp(data->map,
 											  RSPAMD_REGEXP_MAP_FLAG_GLOB | RSPAMD_REGEXP_MAP_FLAG_MULTIPLE);
 		data->cur_data = re_map;
+		data->compile = rspamd_regexp_list_compile;
 	}
 
 	return rspamd_parse_kv_list(
@@ -1393,10 +2569,12 @@ void rspamd_regexp_list_fin(struct map_cb_data *data, void **target)
 			re_map = data->cur_data;
 			rspamd_cryptobox_hash_final(&re_map->hst, re_map->re_digest);
 			memcpy(&data->map->digest, re_map->re_digest, sizeof(data->map->digest));
+			rspamd_re_map_prepare_literals(re_map);
 			rspamd_re_map_finalize(re_map);
 			msg_info_map("read regexp list of %ud elements",
 						 re_map->regexps->len);
 			data->map->traverse_function = rspamd_map_helper_traverse_regexp;
+			data->map->stat_function = rspamd_map_helper_stat_regexp;
 			data->map->nelts = kh_size(re_map->htb);
 		}
 
@@ -1436,7 +2614,7 @@ gconstpointer
 rspamd_match_regexp_map_single(struct rspamd_regexp_map_helper *map,
 							   const char *in, gsize len)
 {
-	unsigned int i;
+	unsigned int i, found;
 	rspamd_regexp_t *re;
 	int res = 0;
 	gpointer ret = NULL;
@@ -1449,6 +2627,9 @@ rspamd_match_regexp_map_single(struct rspamd_regexp_map_helper *map,
 		return NULL;
 	}
 
+	/* The first matching pattern wins, so regexps are checked up to it */
+	found = rspamd_match_regexp_map_literals(map, in, len, NULL);
+
 	if (map->map_flags & RSPAMD_REGEXP_MAP_FLAG_UTF) {
 		if (rspamd_fast_utf8_validate(in, len) == 0) {
 			validated = TRUE;
@@ -1459,42 +2640,48 @@ rspamd_match_regexp_map_single(struct rspamd_regexp_map_helper *map,
 	}
 
 #ifdef WITH_HYPERSCAN
-	if (map->hs_db && map->hs_scratch) {
+	if (map->hs_db) {
 
 		if (validated) {
+			hs_scratch_t *scratch = rspamd_hyperscan_scratch_acquire();
 
 			res = hs_scan(rspamd_hyperscan_get_database(map->hs_db), in, len, 0,
-						  map->hs_scratch,
+						  scratch,
 						  rspamd_match_hs_single_handler, (void *) &i);
+			rspamd_hyperscan_scratch_release(scratch);
 
-			if (res == HS_SCAN_TERMINATED) {
-				res = 1;
-				val = g_ptr_array_index(map->values, i);
-
-				ret = val->value;
-				val->hits++;
+			if (res == HS_SCAN_TERMINATED && i < found) {
+				found = i;
 			}
 
-			return ret;
+			res = 1;
 		}
 	}
 #endif
 
 	if (!res) {
 		/* PCRE version */
-		for (i = 0; i < map->regexps->len; i++) {
+		for (i = 0; i < map->regexps->len && i < found; i++) {
+			if (map->is_literal[i]) {
+				continue;
+			}
+
 			re = g_ptr_array_index(map->regexps, i);
 
 			if (rspamd_regexp_search(re, in, len, NULL, NULL, !validated, NULL)) {
-				val = g_ptr_array_index(map->values, i);
-
-				ret = val->value;
-				val->hits++;
+				found = i;
 				break;
 			}
 		}
 	}
 
+	if (found != G_MAXUINT) {
+		val = g_ptr_array_index(map->values, found);
+
+		ret = val->value;
+		val->hits++;
+	}
+
 	return ret;
 }
 
@@ -1551,21 +2738,25 @@ rspamd_match_regexp_map_all(struct rspamd_regexp_map_helper *map,
 	}
 
 	ret = g_ptr_array_new();
+	rspamd_match_regexp_map_literals(map, in, len, ret);
 
 #ifdef WITH_HYPERSCAN
-	if (map->hs_db && map->hs_scratch) {
+	if (map->hs_db) {
 
 		if (validated) {
 			struct rspamd_multiple_cbdata cbd;
+			hs_scratch_t *scratch = rspamd_hyperscan_scratch_acquire();
 
 			cbd.ar = ret;
 			cbd.map = map;
 
 			if (hs_scan(rspamd_hyperscan_get_database(map->hs_db), in, len,
-						0, map->hs_scratch,
+						0, scratch,
 						rspamd_match_hs_multiple_handler, &cbd) == HS_SUCCESS) {
 				res = 1;
 			}
+
+			rspamd_hyperscan_scratch_release(scratch);
 		}
 	}
 #endif
@@ -1573,6 +2764,10 @@ rspamd_match_regexp_map_all(struct rspamd_regexp_map_helper *map,
 	if (!res) {
 		/* PCRE version */
 		for (i = 0; i < map->regexps->len; i++) {
+			if (map->is_literal[i]) {
+				continue;
+			}
+
 			re = g_ptr_array_index(map->regexps, i);
 
 			if (rspamd_regexp_search(re, in, len, NULL, NULL,
@@ -1605,6 +2800,10 @@ rspamd_match_hash_map(struct rspamd_hash_map_helper *map, const char *in,
 		return NULL;
 	}
 
+	if (map->image) {
+		return rspamd_map_image_lookup(map->image, in, len);
+	}
+
 	tok.begin = in;
 	tok.len = len;
 
@@ -1620,6 +2819,170 @@ rspamd_match_hash_map(struct rspamd_hash_map_helper *map, const char *in,
 	return NULL;
 }
 
+static gboolean
+rspamd_map_helper_domains_image_cb(gconstpointer key,
+								   gconstpointer value, gsize hits, gpointer ud)
+{
+	struct rspamd_domain_trie *domains = ud;
+
+	/* Key stored in the image is used to count hits on match */
+	rspamd_domain_trie_add(domains, key, strlen(key),
+						   RSPAMD_DOMAIN_TRIE_DEFAULT, key);
+
+	return TRUE;
+}
+
+static struct rspamd_domain_trie *
+rspamd_map_helper_hash_domains(struct rspamd_hash_map_helper *map)
+{
+	rspamd_ftok_t tok;
+	struct rspamd_map_helper_value *val;
+
+	if (map->domains) {
+		return map->domains;
+	}
+
+	map->domains = rspamd_domain_trie_new();
+
+	if (map->image) {
+		/* Image keys are stored, values are looked up on match to count hits */
+		rspamd_map_image_foreach(map->image,
+								 rspamd_map_helper_domains_image_cb, map->domains,
+								 FALSE);
+	}
+	else {
+		kh_foreach(map->htb, tok, val, {
+			rspamd_domain_trie_add(map->domains, tok.begin, tok.len,
+								   RSPAMD_DOMAIN_TRIE_DEFAULT, val);
+		});
+	}
+
+	return map->domains;
+}
+
+gconstpointer
+rspamd_match_hash_map_domain(struct rspamd_hash_map_helper *map,
+							 const char *in, gsize len,
+							 gsize *matched_len)
+{
+	gconstpointer found;
+	struct rspamd_map_helper_value *val;
+
+	if (map == NULL || map->htb == NULL) {
+		return NULL;
+	}
+
+	found = rspamd_domain_trie_lookup(rspamd_map_helper_hash_domains(map),
+									  in, len, matched_len);
+
+	if (found == NULL) {
+		return NULL;
+	}
+
+	if (map->image) {
+		return rspamd_map_image_lookup(map->image, found, strlen(found));
+	}
+
+	val = (struct rspamd_map_helper_value *) found;
+	val->hits++;
+
+	return val->value;
+}
+
+enum rspamd_url_map_match
+rspamd_match_url_map(struct rspamd_url_map_helper *map,
+					 struct rspamd_url *url,
+					 gboolean domains,
+					 rspamd_ftok_t *data)
+{
+	enum rspamd_url_map_match ret = RSPAMD_URL_MAP_MATCH_NONE;
+	const char *records, *p, *end, *path, *query, *eol;
+	gsize plen, qlen;
+
+	if (data) {
+		data->begin = NULL;
+		data->len = 0;
+	}
+
+	if (map == NULL || url->hostlen == 0) {
+		return ret;
+	}
+
+	if (domains) {
+		records = rspamd_match_hash_map_domain(map->hosts, rspamd_url_host_unsafe(url),
+											   url->hostlen, NULL);
+	}
+	else {
+		records = rspamd_match_hash_map(map->hosts, rspamd_url_host_unsafe(url),
+										url->hostlen);
+	}
+
+	if (records == NULL) {
+		return ret;
+	}
+
+	ret = RSPAMD_URL_MAP_MATCH_HOST;
+	p = records;
+	end = records + strlen(records);
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		path = p;
+		query = memchr(path, '\t', eol - path);
+
+		if (query == NULL) {
+			/* Broken record */
+			break;
+		}
+
+		plen = query - path;
+		query++;
+		p = memchr(query, '\t', eol - query);
+
+		if (p == NULL) {
+			break;
+		}
+
+		qlen = p - query;
+		p++;
+
+		if (plen == url->datalen &&
+			memcmp(path, rspamd_url_data_unsafe(url), plen) == 0) {
+			enum rspamd_url_map_match cur;
+
+			if (qlen == 0 || (qlen == url->querylen &&
+							  memcmp(query, rspamd_url_query_unsafe(url), qlen) == 0)) {
+				cur = RSPAMD_URL_MAP_MATCH_QUERY;
+			}
+			else {
+				cur = RSPAMD_URL_MAP_MATCH_PATH;
+			}
+
+			if (cur > ret) {
+				ret = cur;
+
+				if (data) {
+					data->begin = p;
+					data->len = eol - p;
+				}
+
+				if (ret == RSPAMD_URL_MAP_MATCH_QUERY) {
+					break;
+				}
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	return ret;
+}
+
 gconstpointer
 rspamd_match_radix_map(struct rspamd_radix_map_helper *map,
 					   const unsigned char *in, gsize inlen)
@@ -1663,6 +3026,41 @@ rspamd_match_radix_map_addr(struct rspamd_radix_map_helper *map,
 	return NULL;
 }
 
+gsize rspamd_match_radix_map_addr_batch(struct rspamd_radix_map_helper *map,
+										const rspamd_inet_addr_t *const *addrs,
+										gsize naddrs,
+										gconstpointer *results)
+{
+	struct rspamd_map_helper_value *val;
+	uintptr_t found[64];
+	gsize i, j, n, nfound = 0;
+
+	if (map == NULL || map->trie == NULL) {
+		memset(results, 0, sizeof(*results) * naddrs);
+
+		return 0;
+	}
+
+	for (i = 0; i < naddrs; i += n) {
+		n = MIN(G_N_ELEMENTS(found), naddrs - i);
+		radix_find_compressed_addr_batch(map->trie, addrs + i, n, found);
+
+		for (j = 0; j < n; j++) {
+			if (found[j] != RADIX_NO_VALUE) {
+				val = (struct rspamd_map_helper_value *) found[j];
+				val->hits++;
+				results[i + j] = val->value;
+				nfound++;
+			}
+			else {
+				results[i + j] = NULL;
+			}
+		}
+	}
+
+	return nfound;
+}
+
 
 /*
  * CBD stuff
@@ -1770,6 +3168,14 @@ rspamd_cdb_list_read(char *chunk,
 	return chunk + len;
 }
 
+static void
+rspamd_map_helper_stat_cdb(void *data, struct rspamd_map_data_stat *st)
+{
+	struct rspamd_cdb_map_helper *cdb_data = data;
+
+	st->memory = cdb_data->total_size;
+}
+
 void rspamd_cdb_list_fin(struct map_cb_data *data, void **target)
 {
 	struct rspamd_map *map = data->map;
@@ -1790,6 +3196,7 @@ void rspamd_cdb_list_fin(struct map_cb_data *data, void **target)
 			cdb_data = (struct rspamd_cdb_map_helper *) data->cur_data;
 			msg_info_map("read cdb of %Hz size", cdb_data->total_size);
 			data->map->traverse_function = NULL;
+			data->map->stat_function = rspamd_map_helper_stat_cdb;
 			data->map->nelts = 0;
 			data->map->digest = rspamd_cryptobox_fast_hash_final(&cdb_data->hst);
 		}
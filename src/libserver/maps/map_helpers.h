@@ -39,7 +39,9 @@ struct rspamd_radix_map_helper;
 struct rspamd_hash_map_helper;
 struct rspamd_regexp_map_helper;
 struct rspamd_cdb_map_helper;
+struct rspamd_url_map_helper;
 struct rspamd_map_helper_value;
+struct rspamd_url;
 
 enum rspamd_regexp_map_flags {
 	RSPAMD_REGEXP_MAP_FLAG_UTF = (1u << 0),
@@ -47,8 +49,16 @@ enum rspamd_regexp_map_flags {
 	RSPAMD_REGEXP_MAP_FLAG_GLOB = (1u << 2),
 };
 
+enum rspamd_url_map_match {
+	RSPAMD_URL_MAP_MATCH_NONE = 0,
+	RSPAMD_URL_MAP_MATCH_HOST,  /* host matches, path does not */
+	RSPAMD_URL_MAP_MATCH_PATH,  /* host and path match, query does not */
+	RSPAMD_URL_MAP_MATCH_QUERY, /* host, path and query (if listed) match */
+};
+
 typedef void (*rspamd_map_insert_func)(gpointer st, gconstpointer key,
 									   gconstpointer value);
+typedef void (*rspamd_map_remove_func)(gpointer st, gconstpointer key);
 
 /**
  * Radix list is a list like ip/mask
@@ -88,6 +98,18 @@ char *rspamd_cdb_list_read(
 void rspamd_cdb_list_fin(struct map_cb_data *data, void **target);
 void rspamd_cdb_list_dtor(struct map_cb_data *data);
 
+/**
+ * Url list is a list of urls (e.g. phishing feeds) grouped by hosts, a line
+ * can also be a json object with `url` field that is then kept as data
+ */
+char *rspamd_url_list_read(
+	char *chunk,
+	int len,
+	struct map_cb_data *data,
+	gboolean final);
+void rspamd_url_list_fin(struct map_cb_data *data, void **target);
+void rspamd_url_list_dtor(struct map_cb_data *data);
+
 /**
  * Regexp list is a list of regular expressions
  */
@@ -132,6 +154,19 @@ rspamd_parse_kv_list(
 	const char *default_value,
 	gboolean final);
 
+/**
+ * Applies delta records to the current data: each line is either
+ * `+<line>` to insert a line in the usual map format or `-<key>` to remove
+ * a key. Deltas are always parsed as a whole.
+ */
+void rspamd_parse_kv_delta(
+	char *chunk,
+	int len,
+	struct map_cb_data *data,
+	rspamd_map_insert_func func,
+	rspamd_map_remove_func remove_func,
+	const char *default_value);
+
 /**
  * Find a single (any) matching regexp for the specified text or NULL if
  * no matches found
@@ -164,6 +199,29 @@ GPtrArray *rspamd_match_regexp_map_all(struct rspamd_regexp_map_helper *map,
 gconstpointer rspamd_match_hash_map(struct rspamd_hash_map_helper *map,
 									const char *in, gsize len);
 
+/**
+ * Find value of the longest key that is a domain suffix of `in` (or `in`
+ * itself), e.g. `example.com` key matches `www.example.com`. Labels are
+ * matched in a single pass, the index of suffixes is built on the first call
+ * @param matched_len if not NULL, then length of the matched key is stored here
+ * @return value or NULL
+ */
+gconstpointer rspamd_match_hash_map_domain(struct rspamd_hash_map_helper *map,
+										   const char *in, gsize len,
+										   gsize *matched_len);
+
+/**
+ * Matches url against url map by its host (or a parent domain of the host if
+ * `domains` is TRUE), path and query
+ * @param data if not NULL, then data of the matched record is stored here
+ * (empty if there is no data or no path matches)
+ * @return match level
+ */
+enum rspamd_url_map_match rspamd_match_url_map(struct rspamd_url_map_helper *map,
+											   struct rspamd_url *url,
+											   gboolean domains,
+											   rspamd_ftok_t *data);
+
 /**
  * Find value matching specific key in a cdb map
  * @param map
@@ -187,6 +245,19 @@ gconstpointer rspamd_match_radix_map(struct rspamd_radix_map_helper *map,
 gconstpointer rspamd_match_radix_map_addr(struct rspamd_radix_map_helper *map,
 										  const rspamd_inet_addr_t *addr);
 
+/**
+ * Find values for many addresses at once
+ * @param map
+ * @param addrs array of addresses
+ * @param naddrs number of addresses
+ * @param results array of `naddrs` values, NULL is set for not found
+ * @return number of addresses found
+ */
+gsize rspamd_match_radix_map_addr_batch(struct rspamd_radix_map_helper *map,
+										const rspamd_inet_addr_t *const *addrs,
+										gsize naddrs,
+										gconstpointer *results);
+
 /**
  * Creates radix map helper
  * @param map
@@ -233,12 +304,42 @@ struct rspamd_hash_map_helper *rspamd_map_helper_new_hash(struct rspamd_map *map
  */
 void rspamd_map_helper_insert_hash(gpointer st, gconstpointer key, gconstpointer value);
 
+/**
+ * Removes a value from a hash map
+ * @param st
+ * @param key
+ */
+void rspamd_map_helper_remove_hash(gpointer st, gconstpointer key);
+
 /**
  * Destroys hash map helper
  * @param r
  */
 void rspamd_map_helper_destroy_hash(struct rspamd_hash_map_helper *r);
 
+/**
+ * Saves hash map helper as a precompiled map image (see map_image.h)
+ * @param r
+ * @param path
+ * @param err
+ * @return TRUE if an image has been written
+ */
+gboolean rspamd_map_helper_hash_save_image(struct rspamd_hash_map_helper *r,
+										   const char *path, GError **err);
+
+/**
+ * Creates url map helper
+ * @param map
+ * @return
+ */
+struct rspamd_url_map_helper *rspamd_map_helper_new_url(struct rspamd_map *map);
+
+/**
+ * Destroys url map helper
+ * @param um
+ */
+void rspamd_map_helper_destroy_url(struct rspamd_url_map_helper *um);
+
 /**
  * Create new regexp map
  * @param map
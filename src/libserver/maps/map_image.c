@@ -0,0 +1,617 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "map_image.h"
+#include "cryptobox.h"
+#include "printf.h"
+#include "str_util.h"
+#include "util.h"
+#include "ottery.h"
+#include "unix-std.h"
+
+/*
+ * Image layout (native byte order):
+ *
+ * header
+ * uint32_t disp[nbuckets][2] - displacements of buckets
+ * uint64_t offsets[nslots] - offsets of entries in data, G_MAXUINT64 for empty slots
+ * data - entries: uint32_t klen, uint32_t vlen, key, '\0', value, '\0'
+ *
+ * Keys are hashed to buckets by one hash, and the second hash gives a pair
+ * (f1, f2); keys of a bucket are placed to slots (f1 + d0 * f2 + d1) % nslots,
+ * where (d0, d1) are found at build time (CHD algorithm). A lookup costs two
+ * hashes and one key comparison.
+ */
+static const unsigned char rspamd_map_image_magic[8] = "rsmapim1";
+
+#define RSPAMD_MAP_IMAGE_VERSION 1
+/* Average number of keys per bucket */
+#define RSPAMD_MAP_IMAGE_BUCKET_SIZE 4
+/* Displacements tried for a bucket before a new seed is chosen */
+#define RSPAMD_MAP_IMAGE_MAX_TRIES (1u << 20)
+#define RSPAMD_MAP_IMAGE_MAX_SEEDS 16
+#define RSPAMD_MAP_IMAGE_EMPTY G_MAXUINT64
+
+struct rspamd_map_image_hdr {
+	unsigned char magic[8];
+	uint32_t version;
+	uint32_t nbuckets;
+	uint64_t nelts;
+	uint64_t nslots;
+	uint64_t seed;
+	uint64_t data_len;
+};
+
+struct rspamd_map_image {
+	const unsigned char *map;
+	gsize len;
+	const struct rspamd_map_image_hdr *hdr;
+	const uint32_t *disp;
+	const uint64_t *offsets;
+	const unsigned char *data;
+	/* Image is read only and shared, so hits are counted per process */
+	gsize *hits;
+};
+
+struct rspamd_map_image_entry {
+	uint64_t offset;
+	/* Hash of the key is needed for every attempt, so it is cached */
+	uint64_t hk;
+	uint32_t bucket;
+	uint32_t klen;
+};
+
+struct rspamd_map_image_builder {
+	GArray *entries;
+	GByteArray *data;
+};
+
+GQuark
+rspamd_map_image_quark(void)
+{
+	return g_quark_from_static_string("map-image");
+}
+
+static inline void
+rspamd_map_image_hashes(const char *key, gsize keylen, uint64_t seed,
+						uint64_t *hb, uint64_t *hk)
+{
+	*hb = rspamd_cryptobox_fast_hash(key, keylen, seed);
+	*hk = rspamd_cryptobox_fast_hash(key, keylen, seed ^ 0x9e3779b97f4a7c15ULL);
+}
+
+static inline uint64_t
+rspamd_map_image_slot(uint64_t hk, uint32_t d0, uint32_t d1, uint64_t nslots)
+{
+	uint64_t f1 = (hk & 0xffffffffu) % nslots, f2 = (hk >> 32u) % nslots;
+
+	return (f1 + (uint64_t) d0 * f2 + d1) % nslots;
+}
+
+gboolean
+rspamd_map_image_probe(const char *path)
+{
+	unsigned char magic[sizeof(rspamd_map_image_magic)];
+	gboolean ret = FALSE;
+	int fd;
+
+	fd = rspamd_file_xopen(path, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		memcmp(magic, rspamd_map_image_magic, sizeof(magic)) == 0) {
+		ret = TRUE;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+struct rspamd_map_image *
+rspamd_map_image_open(const char *path, GError **err)
+{
+	struct rspamd_map_image *img;
+	const struct rspamd_map_image_hdr *hdr;
+	gsize len = 0, tables_len;
+	gpointer map;
+
+	map = rspamd_file_xmap(path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		g_set_error(err, rspamd_map_image_quark(), errno,
+					"cannot map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	hdr = map;
+
+	if (len < sizeof(*hdr) ||
+		memcmp(hdr->magic, rspamd_map_image_magic, sizeof(hdr->magic)) != 0 ||
+		hdr->version != RSPAMD_MAP_IMAGE_VERSION) {
+		g_set_error(err, rspamd_map_image_quark(), EINVAL,
+					"%s is not a map image", path);
+		munmap(map, len);
+
+		return NULL;
+	}
+
+	/* Sizes are bounded by the file length, so the sums cannot overflow */
+	if (hdr->nbuckets > len / (sizeof(uint32_t) * 2) ||
+		hdr->nslots > len / sizeof(uint64_t) ||
+		hdr->nelts > hdr->nslots ||
+		hdr->data_len > len ||
+		(hdr->nslots > 0 && hdr->nbuckets == 0)) {
+		g_set_error(err, rspamd_map_image_quark(), EINVAL,
+					"corrupted map image %s", path);
+		munmap(map, len);
+
+		return NULL;
+	}
+
+	tables_len = hdr->nbuckets * sizeof(uint32_t) * 2 + hdr->nslots * sizeof(uint64_t);
+
+	if (sizeof(*hdr) + tables_len + hdr->data_len != len) {
+		g_set_error(err, rspamd_map_image_quark(), EINVAL,
+					"truncated map image %s: %uz bytes, %uz expected",
+					path, len, (gsize) (sizeof(*hdr) + tables_len + hdr->data_len));
+		munmap(map, len);
+
+		return NULL;
+	}
+
+	img = g_malloc0(sizeof(*img));
+	img->map = map;
+	img->len = len;
+	img->hdr = hdr;
+	img->disp = (const uint32_t *) (img->map + sizeof(*hdr));
+	img->offsets = (const uint64_t *) (img->disp + hdr->nbuckets * 2);
+	img->data = (const unsigned char *) (img->offsets + hdr->nslots);
+	img->hits = g_malloc0(MAX(hdr->nslots, 1) * sizeof(gsize));
+
+	return img;
+}
+
+/*
+ * Returns key of an entry at the specified offset checking bounds
+ */
+static const char *
+rspamd_map_image_entry(struct rspamd_map_image *img, uint64_t offset,
+					   uint32_t *klen, const char **value)
+{
+	uint32_t lens[2];
+
+	if (offset > img->hdr->data_len || img->hdr->data_len - offset < sizeof(lens)) {
+		return NULL;
+	}
+
+	memcpy(lens, img->data + offset, sizeof(lens));
+
+	if ((uint64_t) lens[0] + lens[1] + 2 > img->hdr->data_len - offset - sizeof(lens)) {
+		return NULL;
+	}
+
+	*klen = lens[0];
+	*value = (const char *) img->data + offset + sizeof(lens) + lens[0] + 1;
+
+	return (const char *) img->data + offset + sizeof(lens);
+}
+
+const char *
+rspamd_map_image_lookup(struct rspamd_map_image *img,
+						const char *key, gsize keylen)
+{
+	char stbuf[256], *buf = stbuf;
+	const char *stored, *value = NULL;
+	uint64_t hb, hk, slot;
+	uint32_t bucket, klen;
+
+	if (img->hdr->nslots == 0) {
+		return NULL;
+	}
+
+	if (keylen > sizeof(stbuf)) {
+		buf = g_malloc(keylen);
+	}
+
+	memcpy(buf, key, keylen);
+	rspamd_str_lc(buf, keylen);
+
+	rspamd_map_image_hashes(buf, keylen, img->hdr->seed, &hb, &hk);
+	bucket = hb % img->hdr->nbuckets;
+	slot = rspamd_map_image_slot(hk, img->disp[bucket * 2],
+								 img->disp[bucket * 2 + 1], img->hdr->nslots);
+
+	if (img->offsets[slot] != RSPAMD_MAP_IMAGE_EMPTY) {
+		stored = rspamd_map_image_entry(img, img->offsets[slot], &klen, &value);
+
+		/* Perfect hash maps any key to some slot, so the key must be compared */
+		if (stored == NULL || klen != keylen || memcmp(stored, buf, keylen) != 0) {
+			value = NULL;
+		}
+		else {
+			img->hits[slot]++;
+		}
+	}
+
+	if (buf != stbuf) {
+		g_free(buf);
+	}
+
+	return value;
+}
+
+gsize rspamd_map_image_nelts(struct rspamd_map_image *img)
+{
+	return img->hdr->nelts;
+}
+
+gsize rspamd_map_image_size(struct rspamd_map_image *img)
+{
+	return img->len;
+}
+
+uint64_t
+rspamd_map_image_digest(struct rspamd_map_image *img)
+{
+	/* Header includes a random seed chosen for each build */
+	return rspamd_cryptobox_fast_hash(img->hdr, sizeof(*img->hdr), 0);
+}
+
+void rspamd_map_image_foreach(struct rspamd_map_image *img,
+							  rspamd_map_traverse_cb cb, gpointer ud,
+							  gboolean reset_hits)
+{
+	const char *key, *value;
+	uint64_t i;
+	uint32_t klen;
+
+	for (i = 0; i < img->hdr->nslots; i++) {
+		if (img->offsets[i] == RSPAMD_MAP_IMAGE_EMPTY) {
+			continue;
+		}
+
+		key = rspamd_map_image_entry(img, img->offsets[i], &klen, &value);
+
+		if (key && !cb(key, value, img->hits[i], ud)) {
+			break;
+		}
+
+		if (reset_hits) {
+			img->hits[i] = 0;
+		}
+	}
+}
+
+void rspamd_map_image_close(struct rspamd_map_image *img)
+{
+	if (img) {
+		munmap((gpointer) img->map, img->len);
+		g_free(img->hits);
+		g_free(img);
+	}
+}
+
+struct rspamd_map_image_builder *
+rspamd_map_image_builder_new(gsize nelts_hint)
+{
+	struct rspamd_map_image_builder *b;
+
+	b = g_malloc0(sizeof(*b));
+	b->entries = g_array_sized_new(FALSE, FALSE,
+								   sizeof(struct rspamd_map_image_entry), nelts_hint);
+	b->data = g_byte_array_new();
+
+	return b;
+}
+
+void rspamd_map_image_builder_add(struct rspamd_map_image_builder *b,
+								  const char *key, gsize keylen,
+								  const char *value, gsize vlen)
+{
+	struct rspamd_map_image_entry e;
+	uint32_t lens[2];
+	const unsigned char zero = 0;
+
+	memset(&e, 0, sizeof(e));
+	e.offset = b->data->len;
+	e.klen = keylen;
+	lens[0] = keylen;
+	lens[1] = vlen;
+
+	g_byte_array_append(b->data, (const guint8 *) lens, sizeof(lens));
+	g_byte_array_append(b->data, (const guint8 *) key, keylen);
+	rspamd_str_lc((char *) b->data->data + e.offset + sizeof(lens), keylen);
+	g_byte_array_append(b->data, &zero, 1);
+	g_byte_array_append(b->data, (const guint8 *) value, vlen);
+	g_byte_array_append(b->data, &zero, 1);
+
+	g_array_append_val(b->entries, e);
+}
+
+static inline const char *
+rspamd_map_image_builder_key(struct rspamd_map_image_builder *b,
+							 struct rspamd_map_image_entry *e)
+{
+	return (const char *) b->data->data + e->offset + sizeof(uint32_t) * 2;
+}
+
+struct rspamd_map_image_build_state {
+	uint32_t *counts;
+	uint32_t *starts;
+	uint32_t *items;
+	/* Buckets as count << 32 | bucket, to process the largest first */
+	uint64_t *order;
+	uint32_t *disp;
+	uint64_t *offsets;
+};
+
+static int
+rspamd_map_image_bucket_cmp(const void *a, const void *b)
+{
+	uint64_t oa = *(const uint64_t *) a, ob = *(const uint64_t *) b;
+
+	if (oa != ob) {
+		return oa > ob ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tries to place all keys with the specified seed, returns FALSE if some
+ * bucket cannot be placed
+ */
+static gboolean
+rspamd_map_image_build_seed(struct rspamd_map_image_builder *b,
+							struct rspamd_map_image_build_state *st,
+							uint64_t seed, uint32_t nbuckets, uint64_t nslots,
+							gboolean *duplicate)
+{
+	struct rspamd_map_image_entry *entries = (struct rspamd_map_image_entry *) b->entries->data;
+	uint32_t nelts = b->entries->len, i, j, k, bucket, cnt, tries;
+	uint64_t hb, slots[64], free_slot = 0;
+	gboolean found;
+
+	memset(st->counts, 0, sizeof(*st->counts) * nbuckets);
+
+	for (i = 0; i < nelts; i++) {
+		rspamd_map_image_hashes(rspamd_map_image_builder_key(b, &entries[i]),
+								entries[i].klen, seed, &hb, &entries[i].hk);
+		entries[i].bucket = hb % nbuckets;
+		st->counts[entries[i].bucket]++;
+	}
+
+	/* Group items by bucket */
+	for (i = 0, k = 0; i < nbuckets; i++) {
+		st->starts[i] = k;
+		k += st->counts[i];
+		st->order[i] = ((uint64_t) st->counts[i] << 32u) | i;
+	}
+
+	for (i = 0; i < nelts; i++) {
+		bucket = entries[i].bucket;
+		st->items[st->starts[bucket]++] = i;
+	}
+
+	for (i = 0; i < nbuckets; i++) {
+		st->starts[i] -= st->counts[i];
+	}
+
+	qsort(st->order, nbuckets, sizeof(*st->order), rspamd_map_image_bucket_cmp);
+
+	for (i = 0; i < nslots; i++) {
+		st->offsets[i] = RSPAMD_MAP_IMAGE_EMPTY;
+	}
+
+	memset(st->disp, 0, sizeof(*st->disp) * nbuckets * 2);
+
+	for (i = 0; i < nbuckets; i++) {
+		bucket = st->order[i] & 0xffffffffu;
+		cnt = st->counts[bucket];
+		uint32_t *items = &st->items[st->starts[bucket]];
+
+		if (cnt == 0) {
+			/* Buckets are sorted, so all the remaining buckets are empty */
+			break;
+		}
+
+		if (cnt > G_N_ELEMENTS(slots)) {
+			return FALSE;
+		}
+
+		if (cnt == 1) {
+			/* Single keys go to any free slot, d0 = 0 makes it direct */
+			struct rspamd_map_image_entry *e = &entries[items[0]];
+
+			while (st->offsets[free_slot] != RSPAMD_MAP_IMAGE_EMPTY) {
+				free_slot++;
+			}
+
+			st->disp[bucket * 2] = 0;
+			st->disp[bucket * 2 + 1] = (free_slot + nslots - (e->hk & 0xffffffffu) % nslots) % nslots;
+			st->offsets[free_slot] = e->offset;
+
+			continue;
+		}
+
+		/* The same key in a bucket can never be placed */
+		for (j = 0; j < cnt; j++) {
+			for (k = j + 1; k < cnt; k++) {
+				struct rspamd_map_image_entry *e1 = &entries[items[j]], *e2 = &entries[items[k]];
+
+				if (e1->hk == e2->hk && e1->klen == e2->klen &&
+					memcmp(rspamd_map_image_builder_key(b, e1),
+						   rspamd_map_image_builder_key(b, e2), e1->klen) == 0) {
+					*duplicate = TRUE;
+
+					return FALSE;
+				}
+			}
+		}
+
+		found = FALSE;
+
+		for (tries = 0; tries < RSPAMD_MAP_IMAGE_MAX_TRIES && !found; tries++) {
+			uint32_t d0 = tries / nslots, d1 = tries % nslots;
+
+			found = TRUE;
+
+			for (j = 0; j < cnt && found; j++) {
+				slots[j] = rspamd_map_image_slot(entries[items[j]].hk, d0, d1, nslots);
+
+				if (st->offsets[slots[j]] != RSPAMD_MAP_IMAGE_EMPTY) {
+					found = FALSE;
+				}
+
+				for (k = 0; k < j && found; k++) {
+					if (slots[k] == slots[j]) {
+						found = FALSE;
+					}
+				}
+			}
+
+			if (found) {
+				st->disp[bucket * 2] = d0;
+				st->disp[bucket * 2 + 1] = d1;
+
+				for (j = 0; j < cnt; j++) {
+					st->offsets[slots[j]] = entries[items[j]].offset;
+				}
+			}
+		}
+
+		if (!found) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_map_image_builder_write(struct rspamd_map_image_builder *b,
+							   const char *path, GError **err)
+{
+	struct rspamd_map_image_build_state st;
+	struct rspamd_map_image_hdr hdr;
+	char tmp_path[PATH_MAX];
+	gboolean duplicate = FALSE, built = FALSE;
+	uint32_t nelts = b->entries->len, nbuckets = 0;
+	uint64_t nslots = 0, seed = 0;
+	unsigned int i;
+	FILE *f;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&st, 0, sizeof(st));
+
+	if (nelts > 0) {
+		/* A few spare slots make the last buckets much easier to place */
+		nslots = nelts + nelts / 32 + 1;
+		nbuckets = nelts / RSPAMD_MAP_IMAGE_BUCKET_SIZE + 1;
+		st.counts = g_malloc(sizeof(*st.counts) * nbuckets);
+		st.starts = g_malloc(sizeof(*st.starts) * nbuckets);
+		st.order = g_malloc(sizeof(*st.order) * nbuckets);
+		st.disp = g_malloc(sizeof(*st.disp) * nbuckets * 2);
+		st.items = g_malloc(sizeof(*st.items) * nelts);
+		st.offsets = g_malloc(sizeof(*st.offsets) * nslots);
+
+		for (i = 0; i < RSPAMD_MAP_IMAGE_MAX_SEEDS && !built && !duplicate; i++) {
+			seed = ottery_rand_uint64();
+			built = rspamd_map_image_build_seed(b, &st, seed, nbuckets, nslots,
+												&duplicate);
+		}
+
+		if (!built) {
+			if (duplicate) {
+				g_set_error(err, rspamd_map_image_quark(), EINVAL,
+							"cannot build map image %s: duplicate keys", path);
+			}
+			else {
+				g_set_error(err, rspamd_map_image_quark(), EINVAL,
+							"cannot build map image %s: no perfect hash found", path);
+			}
+
+			goto err;
+		}
+	}
+
+	memcpy(hdr.magic, rspamd_map_image_magic, sizeof(hdr.magic));
+	hdr.version = RSPAMD_MAP_IMAGE_VERSION;
+	hdr.nbuckets = nbuckets;
+	hdr.nelts = nelts;
+	hdr.nslots = nslots;
+	hdr.seed = seed;
+	hdr.data_len = b->data->len;
+
+	rspamd_snprintf(tmp_path, sizeof(tmp_path), "%s.%P.tmp", path, getpid());
+
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		g_set_error(err, rspamd_map_image_quark(), errno,
+					"cannot open %s: %s", tmp_path, strerror(errno));
+		goto err;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+		(nbuckets > 0 && fwrite(st.disp, sizeof(*st.disp) * nbuckets * 2, 1, f) != 1) ||
+		(nslots > 0 && fwrite(st.offsets, sizeof(*st.offsets) * nslots, 1, f) != 1) ||
+		(b->data->len > 0 && fwrite(b->data->data, b->data->len, 1, f) != 1) ||
+		fflush(f) != 0) {
+		g_set_error(err, rspamd_map_image_quark(), errno,
+					"cannot write %s: %s", tmp_path, strerror(errno));
+		fclose(f);
+		unlink(tmp_path);
+
+		goto err;
+	}
+
+	fclose(f);
+
+	if (rename(tmp_path, path) == -1) {
+		g_set_error(err, rspamd_map_image_quark(), errno,
+					"cannot rename %s to %s: %s", tmp_path, path, strerror(errno));
+		unlink(tmp_path);
+
+		goto err;
+	}
+
+	built = TRUE;
+	goto out;
+
+err:
+	built = FALSE;
+out:
+	g_free(st.counts);
+	g_free(st.starts);
+	g_free(st.order);
+	g_free(st.disp);
+	g_free(st.items);
+	g_free(st.offsets);
+
+	return built;
+}
+
+void rspamd_map_image_builder_free(struct rspamd_map_image_builder *b)
+{
+	if (b) {
+		g_array_free(b->entries, TRUE);
+		g_byte_array_free(b->data, TRUE);
+		g_free(b);
+	}
+}
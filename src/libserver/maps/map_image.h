@@ -0,0 +1,94 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_MAP_IMAGE_H
+#define RSPAMD_MAP_IMAGE_H
+
+#include "config.h"
+#include "map.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Precompiled hash map: a minimal perfect hash over keys (hash and displace)
+ * with keys and values stored inline, so an image is used directly via mmap
+ * with no parsing. Keys are case insensitive as in hash maps.
+ */
+struct rspamd_map_image;
+struct rspamd_map_image_builder;
+
+GQuark rspamd_map_image_quark(void);
+
+/**
+ * Returns TRUE if a file looks like a map image
+ */
+gboolean rspamd_map_image_probe(const char *path);
+
+/**
+ * Maps an image read only
+ */
+struct rspamd_map_image *rspamd_map_image_open(const char *path, GError **err);
+
+/**
+ * Returns zero terminated value for a key or NULL, counts a hit if found
+ */
+const char *rspamd_map_image_lookup(struct rspamd_map_image *img,
+									const char *key, gsize keylen);
+
+gsize rspamd_map_image_nelts(struct rspamd_map_image *img);
+
+/**
+ * Returns size of the mapped image
+ */
+gsize rspamd_map_image_size(struct rspamd_map_image *img);
+
+/**
+ * Returns digest of an image, it changes on every rebuild
+ */
+uint64_t rspamd_map_image_digest(struct rspamd_map_image *img);
+
+/**
+ * Calls `cb` for each element with its hits, stops if it returns FALSE
+ */
+void rspamd_map_image_foreach(struct rspamd_map_image *img,
+							  rspamd_map_traverse_cb cb, gpointer ud,
+							  gboolean reset_hits);
+
+void rspamd_map_image_close(struct rspamd_map_image *img);
+
+struct rspamd_map_image_builder *rspamd_map_image_builder_new(gsize nelts_hint);
+
+/**
+ * Adds a new element, keys must be unique (ignoring case)
+ */
+void rspamd_map_image_builder_add(struct rspamd_map_image_builder *b,
+								  const char *key, gsize keylen,
+								  const char *value, gsize vlen);
+
+/**
+ * Builds a perfect hash and writes an image atomically (via a temporary file)
+ */
+gboolean rspamd_map_image_builder_write(struct rspamd_map_image_builder *b,
+										const char *path, GError **err);
+
+void rspamd_map_image_builder_free(struct rspamd_map_image_builder *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
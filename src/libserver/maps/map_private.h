@@ -70,6 +70,8 @@ struct rspamd_http_map_cached_cbdata {
 	ev_timer timeout;
 	struct ev_loop *event_loop;
 	struct rspamd_storage_shmem *shm;
+	/* Deltas received after the data in shm */
+	struct rspamd_storage_shmem *delta_shm;
 	struct rspamd_map *map;
 	struct http_map_data *data;
 	uint64_t gen;
@@ -81,6 +83,12 @@ struct rspamd_map_cachepoint {
 	gsize len;
 	time_t last_modified;
 	char shmem_name[256];
+	/* Version of the full data and the version after all deltas applied */
+	uint64_t base_version;
+	uint64_t version;
+	/* Deltas since the full data, concatenated */
+	gsize delta_len;
+	char delta_shmem_name[256];
 };
 
 /**
@@ -100,6 +108,11 @@ struct http_map_data {
 	time_t last_checked;
 	gboolean request_sent;
 	uint64_t gen;
+	/* Version of the loaded data, 0 if unknown */
+	uint64_t version;
+	/* Position in the cached data: full data version and the deltas length */
+	uint64_t base_version;
+	gsize delta_off;
 	uint16_t port;
 };
 
@@ -151,12 +164,14 @@ struct rspamd_map {
 	rspamd_map_tmp_dtor tmp_dtor;
 	gpointer tmp_dtor_data;
 	rspamd_map_traverse_function traverse_function;
+	rspamd_map_stat_function stat_function;
 	rspamd_map_on_load_function on_load_function;
 	gpointer on_load_ud;
 	GDestroyNotify on_load_ud_dtor;
 	gpointer lua_map;
 	gsize nelts;
 	uint64_t digest;
+	double load_time;
 	/* Should we check HTTP or just load cached data */
 	ev_tstamp timeout;
 	double poll_timeout;
@@ -166,7 +181,10 @@ struct rspamd_map {
 	bool file_only;    /* No HTTP backends found */
 	bool static_only;  /* No need to check */
 	bool no_file_read; /* Do not read files */
+	bool accept_images; /* Precompiled images can be loaded instead of text */
+	bool accept_deltas; /* Data can be updated in place by HTTP deltas */
 	bool seen;         /* This map has already been watched or pre-loaded */
+	bool compiling;    /* New data is being compiled in a helper thread */
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	int *locked;
 	char tag[MEMPOOL_UID_LEN];
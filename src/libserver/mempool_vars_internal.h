@@ -43,5 +43,7 @@
 #define RSPAMD_MEMPOOL_RE_MAPS_CACHE "re_maps_cache"
 #define RSPAMD_MEMPOOL_HTTP_STAT_BACKEND_RUNTIME "stat_http_runtime"
 #define RSPAMD_MEMPOOL_FUZZY_STAT "fuzzy_stat"
+#define RSPAMD_MEMPOOL_UCL_INCLUDE_MAP "ucl_include_map"
+#define RSPAMD_MEMPOOL_MIME_EXPR_MEMO "mime_expr_memo"
 
 #endif
@@ -153,6 +153,7 @@ rspamd_milter_session_reset(struct rspamd_milter_session *session,
 		}
 
 		priv->cur_hdr = 0;
+		priv->expected_size = 0;
 	}
 
 	if (how & RSPAMD_MILTER_RESET_ADDR) {
@@ -323,6 +324,61 @@ rspamd_milter_plan_io(struct rspamd_milter_session *session,
 		(var) = ntohs(var);                 \
 	} while (0)
 
+static void
+rspamd_milter_parse_esmtp_args(struct rspamd_milter_session *session,
+							   struct rspamd_milter_private *priv,
+							   const char *pos, const char *end)
+{
+	const char *zero;
+	gulong size;
+
+	while (pos < end) {
+		zero = memchr(pos, '\0', end - pos);
+
+		if (zero == NULL) {
+			zero = end;
+		}
+
+		if (zero - pos > (int) sizeof("SIZE=") - 1 &&
+			g_ascii_strncasecmp(pos, "SIZE=", sizeof("SIZE=") - 1) == 0) {
+			if (rspamd_strtoul(pos + sizeof("SIZE=") - 1,
+							   zero - pos - (sizeof("SIZE=") - 1), &size)) {
+				msg_debug_milter("got message size: %ul", size);
+				priv->expected_size = size;
+			}
+		}
+
+		pos = zero + 1;
+	}
+}
+
+/*
+ * Allocates message buffer for a new message, if MTA has announced the message
+ * size, then the whole message is stored without reallocations
+ */
+static void
+rspamd_milter_message_reserve(struct rspamd_milter_session *session,
+							  struct rspamd_milter_private *priv)
+{
+	gsize size = RSPAMD_MILTER_MESSAGE_CHUNK;
+
+	if (priv->expected_size > size) {
+		size = priv->expected_size;
+
+		if (milter_ctx->cfg && milter_ctx->cfg->max_message > 0 &&
+			size > milter_ctx->cfg->max_message) {
+			size = milter_ctx->cfg->max_message;
+		}
+	}
+
+	if (!session->message) {
+		session->message = rspamd_fstring_sized_new(size);
+	}
+	else if (session->message->len == 0 && session->message->allocated < size) {
+		session->message = rspamd_fstring_grow(session->message, size);
+	}
+}
+
 static gboolean
 rspamd_milter_process_command(struct rspamd_milter_session *session,
 							  struct rspamd_milter_private *priv)
@@ -344,10 +400,7 @@ rspamd_milter_process_command(struct rspamd_milter_session *session,
 		rspamd_milter_session_reset(session, RSPAMD_MILTER_RESET_ABORT);
 		break;
 	case RSPAMD_MILTER_CMD_BODY:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new(
-				RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_message_reserve(session, priv);
 
 		msg_debug_milter("got body chunk: %d bytes", (int) cmdlen);
 		session->message = rspamd_fstring_append(session->message,
@@ -591,10 +644,7 @@ rspamd_milter_process_command(struct rspamd_milter_session *session,
 		break;
 	case RSPAMD_MILTER_CMD_HEADER:
 		msg_debug_milter("got header command");
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new(
-				RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_message_reserve(session, priv);
 		zero = memchr(pos, '\0', cmdlen);
 
 		if (zero == NULL) {
@@ -658,7 +708,8 @@ rspamd_milter_process_command(struct rspamd_milter_session *session,
 					session->from = addr;
 				}
 
-				/* TODO: parse esmtp arguments */
+				/* ESMTP arguments follow the address */
+				rspamd_milter_parse_esmtp_args(session, priv, zero + 1, end);
 				break;
 			}
 			else {
@@ -680,13 +731,16 @@ rspamd_milter_process_command(struct rspamd_milter_session *session,
 	case RSPAMD_MILTER_CMD_EOH:
 		msg_debug_milter("got eoh command");
 
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new(
-				RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_message_reserve(session, priv);
 
 		session->message = rspamd_fstring_append(session->message,
 												 "\r\n", 2);
+
+		if (milter_ctx->eoh_cb) {
+			REF_RETAIN(session);
+			milter_ctx->eoh_cb(priv->fd, session, priv->ud);
+			REF_RELEASE(session);
+		}
 		break;
 	case RSPAMD_MILTER_CMD_OPTNEG:
 		if (cmdlen != sizeof(uint32_t) * 3) {
@@ -791,10 +845,7 @@ rspamd_milter_process_command(struct rspamd_milter_session *session,
 		}
 		break;
 	case RSPAMD_MILTER_CMD_DATA:
-		if (!session->message) {
-			session->message = rspamd_fstring_sized_new(
-				RSPAMD_MILTER_MESSAGE_CHUNK);
-		}
+		rspamd_milter_message_reserve(session, priv);
 		msg_debug_milter("got data command");
 		/* We do not need reply as specified */
 		break;
@@ -1588,6 +1639,23 @@ rspamd_milter_macro_http(struct rspamd_milter_session *session,
 
 struct rspamd_http_message *
 rspamd_milter_to_http(struct rspamd_milter_session *session)
+{
+	struct rspamd_http_message *msg;
+
+	g_assert(session != NULL);
+
+	msg = rspamd_milter_envelope_to_http(session);
+
+	if (session->message) {
+		rspamd_http_message_set_body_from_fstring_steal(msg, session->message);
+		session->message = NULL;
+	}
+
+	return msg;
+}
+
+struct rspamd_http_message *
+rspamd_milter_envelope_to_http(struct rspamd_milter_session *session)
 {
 	struct rspamd_http_message *msg;
 	unsigned int i;
@@ -1601,11 +1669,6 @@ rspamd_milter_to_http(struct rspamd_milter_session *session)
 	msg->url = rspamd_fstring_assign(msg->url, "/" MSG_CMD_CHECK_V2,
 									 sizeof("/" MSG_CMD_CHECK_V2) - 1);
 
-	if (session->message) {
-		rspamd_http_message_set_body_from_fstring_steal(msg, session->message);
-		session->message = NULL;
-	}
-
 	if (session->hostname && RSPAMD_FSTRING_LEN(session->hostname) > 0) {
 		if (!(session->hostname->len == sizeof("unknown") - 1 &&
 			  memcmp(RSPAMD_FSTRING_DATA(session->hostname), "unknown",
@@ -50,6 +50,10 @@ struct rspamd_email_address;
 struct ev_loop;
 struct rspamd_http_message;
 struct rspamd_config;
+struct rspamd_milter_session;
+
+typedef void (*rspamd_milter_finish)(int fd,
+									 struct rspamd_milter_session *session, void *ud);
 
 struct rspamd_milter_context {
 	const char *spam_header;
@@ -61,6 +65,8 @@ struct rspamd_milter_context {
 	struct rspamd_config *cfg;
 	gboolean discard_on_reject;
 	gboolean quarantine_on_reject;
+	/* Optional handler called when all message headers are received */
+	rspamd_milter_finish eoh_cb;
 };
 
 struct rspamd_milter_session {
@@ -75,9 +81,6 @@ struct rspamd_milter_session {
 	ref_entry_t ref;
 };
 
-typedef void (*rspamd_milter_finish)(int fd,
-									 struct rspamd_milter_session *session, void *ud);
-
 typedef void (*rspamd_milter_error)(int fd,
 									struct rspamd_milter_session *session,
 									void *ud, GError *err);
@@ -159,6 +162,15 @@ struct rspamd_milter_session *rspamd_milter_session_ref(
 struct rspamd_http_message *rspamd_milter_to_http(
 	struct rspamd_milter_session *session);
 
+/**
+ * Converts envelope of a milter session to HTTP message leaving the message
+ * itself in the session, so it can be used before the body is received
+ * @param session
+ * @return
+ */
+struct rspamd_http_message *rspamd_milter_envelope_to_http(
+	struct rspamd_milter_session *session);
+
 /**
  * Sends task results to the
  * @param session
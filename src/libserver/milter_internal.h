@@ -71,6 +71,8 @@ struct rspamd_milter_private {
 	rspamd_mempool_t *pool;
 	khash_t(milter_headers_hash_t) * headers;
 	int cur_hdr;
+	/* Message size announced by MTA in ESMTP SIZE argument */
+	gsize expected_size;
 	rspamd_milter_finish fin_cb;
 	rspamd_milter_error err_cb;
 	void *ud;
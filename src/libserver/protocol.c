@@ -407,6 +407,7 @@ rspamd_protocol_handle_flag(struct rspamd_task *task, const char *str,
 	CHECK_PROTOCOL_FLAG("ext_urls", RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS);
 	CHECK_PROTOCOL_FLAG("body_block", RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK);
 	CHECK_PROTOCOL_FLAG("groups", RSPAMD_TASK_PROTOCOL_FLAG_GROUPS);
+	CHECK_PROTOCOL_FLAG("compact", RSPAMD_TASK_PROTOCOL_FLAG_COMPACT);
 
 	if (!known) {
 		msg_warn_protocol("unknown flag: %*s", (int) len, str);
@@ -964,6 +965,36 @@ rspamd_protocol_extended_url(struct rspamd_task *task,
 	return obj;
 }
 
+static void
+rspamd_protocol_log_url(struct rspamd_task *task, struct rspamd_url *url,
+						const char *encoded, gsize enclen)
+{
+	const char *user_field = "unknown";
+	gboolean has_user = FALSE;
+	unsigned int len = 0;
+
+	if (task->auth_user) {
+		user_field = task->auth_user;
+		len = strlen(task->auth_user);
+		has_user = TRUE;
+	}
+	else if (task->from_envelope) {
+		user_field = task->from_envelope->addr;
+		len = task->from_envelope->addr_len;
+	}
+
+	if (!encoded) {
+		encoded = rspamd_url_encode(url, &enclen, task->task_pool);
+	}
+
+	msg_notice_task_encrypted("<%s> %s: %*s; ip: %s; URL: %*s",
+							  MESSAGE_FIELD_CHECK(task, message_id),
+							  has_user ? "user" : "from",
+							  len, user_field,
+							  rspamd_inet_address_to_string(task->from_addr),
+							  (int) enclen, encoded);
+}
+
 /*
  * Callback for writing urls
  */
@@ -972,9 +1003,7 @@ urls_protocol_cb(struct rspamd_url *url, struct tree_cb_data *cb)
 {
 	ucl_object_t *obj;
 	struct rspamd_task *task = cb->task;
-	const char *user_field = "unknown", *encoded = NULL;
-	gboolean has_user = FALSE;
-	unsigned int len = 0;
+	const char *encoded = NULL;
 	gsize enclen = 0;
 
 	if (!(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS)) {
@@ -990,10 +1019,14 @@ urls_protocol_cb(struct rspamd_url *url, struct tree_cb_data *cb)
 				obj = ucl_object_fromstring_common(rspamd_url_host_unsafe(url),
 												   url->hostlen, 0);
 			}
-			else {
+			else if (err_offset > 1) {
 				obj = ucl_object_fromstring_common(rspamd_url_host_unsafe(url),
 												   err_offset - 1, 0);
 			}
+			else {
+				/* Zero length means NUL terminated string for ucl */
+				obj = ucl_object_fromstring("");
+			}
 		}
 		else {
 			return;
@@ -1009,26 +1042,7 @@ urls_protocol_cb(struct rspamd_url *url, struct tree_cb_data *cb)
 	ucl_array_append(cb->top, obj);
 
 	if (cb->task->cfg->log_urls) {
-		if (task->auth_user) {
-			user_field = task->auth_user;
-			len = strlen(task->auth_user);
-			has_user = TRUE;
-		}
-		else if (task->from_envelope) {
-			user_field = task->from_envelope->addr;
-			len = task->from_envelope->addr_len;
-		}
-
-		if (!encoded) {
-			encoded = rspamd_url_encode(url, &enclen, task->task_pool);
-		}
-
-		msg_notice_task_encrypted("<%s> %s: %*s; ip: %s; URL: %*s",
-								  MESSAGE_FIELD_CHECK(task, message_id),
-								  has_user ? "user" : "from",
-								  len, user_field,
-								  rspamd_inet_address_to_string(task->from_addr),
-								  (int) enclen, encoded);
+		rspamd_protocol_log_url(task, url, encoded, enclen);
 	}
 }
 
@@ -1167,6 +1181,21 @@ rspamd_protocol_rewrite_subject(struct rspamd_task *task)
 	return res;
 }
 
+static void
+rspamd_protocol_passthrough_message(struct rspamd_task *task,
+									struct rspamd_passthrough_result *pr)
+{
+	if (pr->message && !(pr->flags & RSPAMD_PASSTHROUGH_NO_SMTP_MESSAGE)) {
+		/* Add smtp message if it does not exist: see #3269 for details */
+		if (ucl_object_lookup(task->messages, "smtp_message") == NULL) {
+			ucl_object_insert_key(task->messages,
+								  ucl_object_fromstring_common(pr->message, 0, UCL_STRING_RAW),
+								  "smtp_message", 0,
+								  false);
+		}
+	}
+}
+
 static ucl_object_t *
 rspamd_metric_symbol_ucl(struct rspamd_task *task, struct rspamd_symbol_result *sym)
 {
@@ -1182,7 +1211,11 @@ rspamd_metric_symbol_ucl(struct rspamd_task *task, struct rspamd_symbol_result *
 	ucl_object_insert_key(obj, ucl_object_fromstring(sym->name), "name", 0, false);
 	ucl_object_insert_key(obj, ucl_object_fromdouble(sym->score), "score", 0, false);
 
-	if (task->cmd == CMD_CHECK_V2) {
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPACT) {
+		/* Static metadata is the same for all replies, client knows it */
+		description = NULL;
+	}
+	else if (task->cmd == CMD_CHECK_V2) {
 		if (sym->sym) {
 			ucl_object_insert_key(obj, ucl_object_fromdouble(sym->sym->score), "metric_score", 0, false);
 		}
@@ -1255,16 +1288,7 @@ rspamd_scan_result_ucl(struct rspamd_task *task,
 	}
 
 	if (pr) {
-		if (pr->message && !(pr->flags & RSPAMD_PASSTHROUGH_NO_SMTP_MESSAGE)) {
-			/* Add smtp message if it does not exist: see #3269 for details */
-			if (ucl_object_lookup(task->messages, "smtp_message") == NULL) {
-				ucl_object_insert_key(task->messages,
-									  ucl_object_fromstring_common(pr->message, 0, UCL_STRING_RAW),
-									  "smtp_message", 0,
-									  false);
-			}
-		}
-
+		rspamd_protocol_passthrough_message(task, pr);
 		ucl_object_insert_key(obj,
 							  ucl_object_fromstring(pr->module),
 							  "passthrough_module", 0, false);
@@ -1492,6 +1516,17 @@ rspamd_protocol_output_profiling(struct rspamd_task *task,
 	ucl_object_insert_key(top, prof, "profile", 0, false);
 }
 
+static GString *
+rspamd_protocol_fold_dkim(struct rspamd_task *task, GString *dkim_sig,
+						  gboolean force_lf)
+{
+	return rspamd_header_value_fold("DKIM-Signature", strlen("DKIM-Signature"),
+									dkim_sig->str, dkim_sig->len,
+									80,
+									force_lf ? RSPAMD_TASK_NEWLINES_LF : MESSAGE_FIELD(task, nlines_type),
+									NULL);
+}
+
 ucl_object_t *
 rspamd_protocol_write_ucl(struct rspamd_task *task,
 						  enum rspamd_protocol_flags flags)
@@ -1572,22 +1607,9 @@ rspamd_protocol_write_ucl(struct rspamd_task *task,
 					GString *folded_header;
 					dkim_sig = (GString *) dkim_sigs->data;
 
-					if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER ||
-						!task->message) {
-
-						folded_header = rspamd_header_value_fold(
-							"DKIM-Signature", strlen("DKIM-Signature"),
-							dkim_sig->str, dkim_sig->len,
-							80, RSPAMD_TASK_NEWLINES_LF, NULL);
-					}
-					else {
-						folded_header = rspamd_header_value_fold(
-							"DKIM-Signature", strlen("DKIM-Signature"),
-							dkim_sig->str, dkim_sig->len,
-							80,
-							MESSAGE_FIELD(task, nlines_type),
-							NULL);
-					}
+					folded_header = rspamd_protocol_fold_dkim(task, dkim_sig,
+															  (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) ||
+																  !task->message);
 
 					ucl_array_append(ar,
 									 ucl_object_fromstring_common(folded_header->str,
@@ -1605,19 +1627,8 @@ rspamd_protocol_write_ucl(struct rspamd_task *task,
 				GString *folded_header;
 				dkim_sig = (GString *) dkim_sigs->data;
 
-				if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) {
-					folded_header = rspamd_header_value_fold(
-						"DKIM-Signature", strlen("DKIM-Signature"),
-						dkim_sig->str, dkim_sig->len,
-						80, RSPAMD_TASK_NEWLINES_LF, NULL);
-				}
-				else {
-					folded_header = rspamd_header_value_fold(
-						"DKIM-Signature", strlen("DKIM-Signature"),
-						dkim_sig->str, dkim_sig->len,
-						80, MESSAGE_FIELD(task, nlines_type),
-						NULL);
-				}
+				folded_header = rspamd_protocol_fold_dkim(task, dkim_sig,
+														  task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 
 				ucl_object_insert_key(top,
 									  ucl_object_fromstring_common(folded_header->str,
@@ -1647,6 +1658,516 @@ rspamd_protocol_write_ucl(struct rspamd_task *task,
 	return top;
 }
 
+/*
+ * Direct JSON writer for scan replies: produces the same output as the compact
+ * JSON emission of the `rspamd_protocol_write_ucl` tree, but the reply is
+ * written to the output buffer without building and walking ucl objects.
+ * Used for checkv2 replies that are not needed as ucl (e.g. for proxy or lua).
+ */
+#define RSPAMD_JSON_LIT(buf, lit) \
+	(*(buf) = rspamd_fstring_append(*(buf), (lit), sizeof(lit) - 1))
+
+static struct rspamd_printf_fmt_cache json_double_fmt = RSPAMD_PRINTF_FMT_INIT("%.6f");
+static struct rspamd_printf_fmt_cache json_integral_fmt = RSPAMD_PRINTF_FMT_INIT("%.1f");
+
+/* Must be kept in sync with `ucl_elt_string_write_json` */
+static void
+rspamd_protocol_json_string(rspamd_fstring_t **buf, const char *str, gsize len)
+{
+	const unsigned char *p = (const unsigned char *) str, *end = p + len, *c = p;
+
+	*buf = rspamd_fstring_append(*buf, "\"", 1);
+
+	while (p < end) {
+		if (G_LIKELY(*p >= 0x20 && *p != '"' && *p != '\\' && *p != 0x7f)) {
+			p++;
+			continue;
+		}
+
+		if (p > c) {
+			*buf = rspamd_fstring_append(*buf, (const char *) c, p - c);
+		}
+
+		switch (*p) {
+		case '\0':
+			RSPAMD_JSON_LIT(buf, "\\u0000");
+			break;
+		case '\n':
+			RSPAMD_JSON_LIT(buf, "\\n");
+			break;
+		case '\r':
+			RSPAMD_JSON_LIT(buf, "\\r");
+			break;
+		case '\b':
+			RSPAMD_JSON_LIT(buf, "\\b");
+			break;
+		case '\t':
+			RSPAMD_JSON_LIT(buf, "\\t");
+			break;
+		case '\f':
+			RSPAMD_JSON_LIT(buf, "\\f");
+			break;
+		case '\v':
+			RSPAMD_JSON_LIT(buf, "\\u000B");
+			break;
+		case '\\':
+			RSPAMD_JSON_LIT(buf, "\\\\");
+			break;
+		case '"':
+			RSPAMD_JSON_LIT(buf, "\\\"");
+			break;
+		default:
+			RSPAMD_JSON_LIT(buf, "\\uFFFD");
+			break;
+		}
+
+		c = ++p;
+	}
+
+	if (p > c) {
+		*buf = rspamd_fstring_append(*buf, (const char *) c, p - c);
+	}
+
+	*buf = rspamd_fstring_append(*buf, "\"", 1);
+}
+
+/* Must be kept in sync with the fstring ucl emitter */
+static void
+rspamd_protocol_json_double(rspamd_fstring_t **buf, double val)
+{
+	if (isfinite(val)) {
+		if (val == (double) ((int) val)) {
+			rspamd_printf_fstring_cached(buf, &json_integral_fmt, val);
+		}
+		else {
+			rspamd_printf_fstring_cached(buf, &json_double_fmt, val);
+		}
+	}
+	else {
+		RSPAMD_JSON_LIT(buf, "null");
+	}
+}
+
+static void
+rspamd_protocol_json_key(rspamd_fstring_t **buf, gboolean *first,
+						 const char *key)
+{
+	if (!*first) {
+		*buf = rspamd_fstring_append(*buf, ",", 1);
+	}
+
+	*first = FALSE;
+	rspamd_protocol_json_string(buf, key, strlen(key));
+	*buf = rspamd_fstring_append(*buf, ":", 1);
+}
+
+static void
+rspamd_protocol_json_symbol_prefix(rspamd_fstring_t **buf, const char *name)
+{
+	gsize nlen = strlen(name);
+
+	rspamd_protocol_json_string(buf, name, nlen);
+	RSPAMD_JSON_LIT(buf, ":{\"name\":");
+	rspamd_protocol_json_string(buf, name, nlen);
+	RSPAMD_JSON_LIT(buf, ",\"score\":");
+}
+
+static void
+rspamd_protocol_json_symbol(struct rspamd_task *task,
+							struct rspamd_symbol_result *sym,
+							rspamd_fstring_t **buf)
+{
+	struct rspamd_symbol *sdef = sym->sym;
+	struct rspamd_symbol_option *opt;
+
+	if (sdef != NULL) {
+		if (sdef->json_prefix == NULL) {
+			/* Symbol names are escaped once per config */
+			rspamd_fstring_t *tmp = rspamd_fstring_sized_new(strlen(sdef->name) * 2 + 32);
+
+			rspamd_protocol_json_symbol_prefix(&tmp, sdef->name);
+			sdef->json_prefix = rspamd_mempool_alloc(task->cfg->cfg_pool, tmp->len);
+			memcpy(sdef->json_prefix, tmp->str, tmp->len);
+			sdef->json_prefix_len = tmp->len;
+			rspamd_fstring_free(tmp);
+		}
+
+		*buf = rspamd_fstring_append(*buf, sdef->json_prefix, sdef->json_prefix_len);
+	}
+	else {
+		rspamd_protocol_json_symbol_prefix(buf, sym->name);
+	}
+
+	rspamd_protocol_json_double(buf, sym->score);
+
+	if (!(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_COMPACT)) {
+		RSPAMD_JSON_LIT(buf, ",\"metric_score\":");
+		rspamd_protocol_json_double(buf, sdef ? sdef->score : 0.0);
+
+		if (sdef && sdef->description) {
+			RSPAMD_JSON_LIT(buf, ",\"description\":");
+			rspamd_protocol_json_string(buf, sdef->description,
+										strlen(sdef->description));
+		}
+	}
+
+	if (sym->options != NULL) {
+		gboolean first = TRUE;
+
+		RSPAMD_JSON_LIT(buf, ",\"options\":[");
+
+		DL_FOREACH(sym->opts_head, opt)
+		{
+			if (!first) {
+				*buf = rspamd_fstring_append(*buf, ",", 1);
+			}
+
+			first = FALSE;
+			rspamd_protocol_json_string(buf, opt->option,
+										opt->optlen > 0 ? opt->optlen : strlen(opt->option));
+		}
+
+		*buf = rspamd_fstring_append(*buf, "]", 1);
+	}
+
+	*buf = rspamd_fstring_append(*buf, "}", 1);
+}
+
+static void
+rspamd_protocol_json_scan_result(struct rspamd_task *task,
+								 struct rspamd_scan_result *mres,
+								 rspamd_fstring_t **buf, gboolean *first)
+{
+	struct rspamd_symbol_result *sym;
+	struct rspamd_action *action;
+	struct rspamd_passthrough_result *pr = NULL;
+	const char *subject;
+	gboolean first_elt;
+
+	action = rspamd_check_action_metric(task, &pr, NULL);
+
+	if (pr) {
+		rspamd_protocol_passthrough_message(task, pr);
+
+		if (pr->module) {
+			rspamd_protocol_json_key(buf, first, "passthrough_module");
+			rspamd_protocol_json_string(buf, pr->module, strlen(pr->module));
+		}
+	}
+
+	rspamd_protocol_json_key(buf, first, "is_skipped");
+
+	if (RSPAMD_TASK_IS_SKIPPED(task)) {
+		RSPAMD_JSON_LIT(buf, "true");
+	}
+	else {
+		RSPAMD_JSON_LIT(buf, "false");
+	}
+
+	rspamd_protocol_json_key(buf, first, "score");
+	rspamd_protocol_json_double(buf, isnan(mres->score) ? 0.0 : mres->score);
+	rspamd_protocol_json_key(buf, first, "required_score");
+	rspamd_protocol_json_double(buf, rspamd_task_get_required_score(task, mres));
+	rspamd_protocol_json_key(buf, first, "action");
+	rspamd_protocol_json_string(buf, action->name, strlen(action->name));
+
+	if (action->action_type == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = rspamd_protocol_rewrite_subject(task);
+
+		if (subject) {
+			rspamd_protocol_json_key(buf, first, "subject");
+			rspamd_protocol_json_string(buf, subject, strlen(subject));
+		}
+	}
+
+	if (action->flags & RSPAMD_ACTION_MILTER) {
+		if (action->action_type == METRIC_ACTION_DISCARD) {
+			rspamd_protocol_json_key(buf, first, "reject");
+			RSPAMD_JSON_LIT(buf, "\"discard\"");
+		}
+		else if (action->action_type == METRIC_ACTION_QUARANTINE) {
+			rspamd_protocol_json_key(buf, first, "reject");
+			RSPAMD_JSON_LIT(buf, "\"quarantine\"");
+		}
+	}
+
+	rspamd_protocol_json_key(buf, first, "thresholds");
+	*buf = rspamd_fstring_append(*buf, "{", 1);
+	first_elt = TRUE;
+
+	for (int i = task->result->nactions - 1; i >= 0; i--) {
+		struct rspamd_action_config *action_lim = &task->result->actions_config[i];
+
+		if (!isnan(action_lim->cur_limit) &&
+			!(action_lim->action->flags & (RSPAMD_ACTION_NO_THRESHOLD | RSPAMD_ACTION_HAM))) {
+			rspamd_protocol_json_key(buf, &first_elt, action_lim->action->name);
+			rspamd_protocol_json_double(buf, action_lim->cur_limit);
+		}
+	}
+
+	*buf = rspamd_fstring_append(*buf, "}", 1);
+
+	rspamd_protocol_json_key(buf, first, "symbols");
+	*buf = rspamd_fstring_append(*buf, "{", 1);
+	first_elt = TRUE;
+
+	kh_foreach_value(mres->symbols, sym, {
+		if (!(sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+			if (!first_elt) {
+				*buf = rspamd_fstring_append(*buf, ",", 1);
+			}
+
+			first_elt = FALSE;
+			rspamd_protocol_json_symbol(task, sym, buf);
+		}
+	});
+
+	*buf = rspamd_fstring_append(*buf, "}", 1);
+
+	if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_GROUPS) {
+		struct rspamd_symbols_group *gr;
+		double gr_score;
+
+		rspamd_protocol_json_key(buf, first, "groups");
+		*buf = rspamd_fstring_append(*buf, "{", 1);
+		first_elt = TRUE;
+
+		kh_foreach(mres->sym_groups, gr, gr_score, {
+			if (task->cfg->public_groups_only &&
+				!(gr->flags & RSPAMD_SYMBOL_GROUP_PUBLIC)) {
+				continue;
+			}
+
+			rspamd_protocol_json_key(buf, &first_elt, gr->name);
+			RSPAMD_JSON_LIT(buf, "{\"score\":");
+			rspamd_protocol_json_double(buf, gr_score);
+
+			if (gr->description) {
+				RSPAMD_JSON_LIT(buf, ",\"description\":");
+				rspamd_protocol_json_string(buf, gr->description,
+											strlen(gr->description));
+			}
+
+			*buf = rspamd_fstring_append(*buf, "}", 1);
+		});
+
+		*buf = rspamd_fstring_append(*buf, "}", 1);
+	}
+}
+
+static void
+rspamd_protocol_json_urls(struct rspamd_task *task,
+						  khash_t(rspamd_url_hash) * set,
+						  rspamd_fstring_t **buf, gboolean *first)
+{
+	khash_t(rspamd_url_host_hash) *seen = NULL;
+	struct rspamd_url *u;
+	gboolean first_elt = TRUE;
+
+	if (!(task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_EXT_URLS)) {
+		seen = kh_init(rspamd_url_host_hash);
+	}
+
+	rspamd_protocol_json_key(buf, first, "urls");
+	*buf = rspamd_fstring_append(*buf, "[", 1);
+
+	kh_foreach_key(set, u, {
+		const char *encoded = NULL;
+		gsize enclen = 0;
+
+		if (u->protocol & PROTOCOL_MAILTO) {
+			continue;
+		}
+
+		if (seen) {
+			goffset err_offset;
+			gsize hlen = u->hostlen;
+
+			if (u->hostlen == 0 || rspamd_url_host_set_has(seen, u)) {
+				continue;
+			}
+
+			if ((err_offset = rspamd_fast_utf8_validate(rspamd_url_host_unsafe(u),
+														u->hostlen)) != 0) {
+				hlen = err_offset - 1;
+			}
+
+			rspamd_url_host_set_add(seen, u);
+
+			if (!first_elt) {
+				*buf = rspamd_fstring_append(*buf, ",", 1);
+			}
+
+			rspamd_protocol_json_string(buf, rspamd_url_host_unsafe(u), hlen);
+		}
+		else {
+			/* Extended urls are rare, so they are written using ucl */
+			ucl_object_t *obj;
+
+			encoded = rspamd_url_encode(u, &enclen, task->task_pool);
+			obj = rspamd_protocol_extended_url(task, u, encoded, enclen);
+
+			if (!first_elt) {
+				*buf = rspamd_fstring_append(*buf, ",", 1);
+			}
+
+			rspamd_ucl_emit_fstring(obj, UCL_EMIT_JSON_COMPACT, buf);
+			ucl_object_unref(obj);
+		}
+
+		first_elt = FALSE;
+
+		if (task->cfg->log_urls) {
+			rspamd_protocol_log_url(task, u, encoded, enclen);
+		}
+	});
+
+	*buf = rspamd_fstring_append(*buf, "]", 1);
+
+	if (seen) {
+		kh_destroy(rspamd_url_host_hash, seen);
+	}
+
+	rspamd_protocol_json_key(buf, first, "emails");
+	*buf = rspamd_fstring_append(*buf, "[", 1);
+	first_elt = TRUE;
+
+	kh_foreach_key(set, u, {
+		if ((u->protocol & PROTOCOL_MAILTO) && u->userlen > 0 && u->hostlen > 0) {
+			if (!first_elt) {
+				*buf = rspamd_fstring_append(*buf, ",", 1);
+			}
+
+			first_elt = FALSE;
+			rspamd_protocol_json_string(buf, rspamd_url_user_unsafe(u),
+										u->userlen + u->hostlen + 1);
+		}
+	});
+
+	*buf = rspamd_fstring_append(*buf, "]", 1);
+}
+
+static void
+rspamd_protocol_write_json(struct rspamd_task *task,
+						   enum rspamd_protocol_flags flags,
+						   rspamd_fstring_t **buf)
+{
+	gboolean first = TRUE;
+	GString *dkim_sig, *folded_header;
+	GList *dkim_sigs;
+	const ucl_object_t *milter_reply;
+
+	rspamd_task_set_finish_time(task);
+	*buf = rspamd_fstring_append(*buf, "{", 1);
+
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_protocol_json_scan_result(task, task->result, buf, &first);
+	}
+
+	if ((flags & RSPAMD_PROTOCOL_MESSAGES) && task->messages) {
+		rspamd_protocol_json_key(buf, &first, "messages");
+
+		if (G_UNLIKELY(task->cfg->compat_messages)) {
+			const ucl_object_t *cur;
+			ucl_object_iter_t iter = NULL;
+			gboolean first_elt = TRUE;
+
+			*buf = rspamd_fstring_append(*buf, "[", 1);
+
+			while ((cur = ucl_object_iterate(task->messages, &iter, true)) != NULL) {
+				if (cur->type == UCL_STRING) {
+					gsize slen;
+					const char *str = ucl_object_tolstring(cur, &slen);
+
+					if (!first_elt) {
+						*buf = rspamd_fstring_append(*buf, ",", 1);
+					}
+
+					first_elt = FALSE;
+					rspamd_protocol_json_string(buf, str, slen);
+				}
+			}
+
+			*buf = rspamd_fstring_append(*buf, "]", 1);
+		}
+		else {
+			rspamd_ucl_emit_fstring(task->messages, UCL_EMIT_JSON_COMPACT, buf);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS && task->message) {
+		if (kh_size(MESSAGE_FIELD(task, urls)) > 0) {
+			rspamd_protocol_json_urls(task, MESSAGE_FIELD(task, urls), buf, &first);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		const char *mid = MESSAGE_FIELD_CHECK(task, message_id);
+
+		if (mid) {
+			rspamd_protocol_json_key(buf, &first, "message-id");
+			rspamd_protocol_json_string(buf, mid, strlen(mid));
+		}
+
+		rspamd_protocol_json_key(buf, &first, "time_real");
+		rspamd_protocol_json_double(buf, task->time_real_finish - task->task_timestamp);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sigs = rspamd_mempool_get_variable(task->task_pool,
+												RSPAMD_MEMPOOL_DKIM_SIGNATURE);
+
+		if (dkim_sigs) {
+			gboolean multiple = dkim_sigs->next != NULL;
+
+			rspamd_protocol_json_key(buf, &first, "dkim-signature");
+
+			if (multiple) {
+				*buf = rspamd_fstring_append(*buf, "[", 1);
+			}
+
+			for (GList *cur = dkim_sigs; cur != NULL; cur = cur->next) {
+				dkim_sig = (GString *) cur->data;
+
+				if (multiple) {
+					folded_header = rspamd_protocol_fold_dkim(task, dkim_sig,
+															  (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER) ||
+																  !task->message);
+
+					if (cur != dkim_sigs) {
+						*buf = rspamd_fstring_append(*buf, ",", 1);
+					}
+				}
+				else {
+					folded_header = rspamd_protocol_fold_dkim(task, dkim_sig,
+															  task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
+				}
+
+				rspamd_protocol_json_string(buf, folded_header->str, folded_header->len);
+				g_string_free(folded_header, TRUE);
+			}
+
+			if (multiple) {
+				*buf = rspamd_fstring_append(*buf, "]", 1);
+			}
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		milter_reply = rspamd_mempool_get_variable(task->task_pool,
+												   RSPAMD_MEMPOOL_MILTER_REPLY);
+
+		if (milter_reply) {
+			rspamd_protocol_json_key(buf, &first, "milter");
+			rspamd_ucl_emit_fstring(milter_reply, UCL_EMIT_JSON_COMPACT, buf);
+		}
+	}
+
+	*buf = rspamd_fstring_append(*buf, "}", 1);
+}
+
+#undef RSPAMD_JSON_LIT
+
 void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 								struct rspamd_task *task, ucl_object_t **pobj, int how)
 {
@@ -1655,6 +2176,9 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
+	/* Body block is written from the task's message without copying */
+	const char *body_block = NULL;
+	gsize body_block_len = 0;
 	int flags = RSPAMD_PROTOCOL_DEFAULT;
 	struct rspamd_action *action;
 
@@ -1672,11 +2196,21 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 #endif
 
 	flags |= RSPAMD_PROTOCOL_URLS;
+	reply = rspamd_fstring_sized_new(1000);
 
-	top = rspamd_protocol_write_ucl(task, flags);
+	if (pobj == NULL && how == UCL_EMIT_JSON_COMPACT &&
+		task->cmd == CMD_CHECK_V2 && msg->method < HTTP_SYMBOLS &&
+		!RSPAMD_TASK_IS_PROFILING(task)) {
+		/* Nobody needs the reply as ucl, so it is written directly */
+		msg_debug_protocol("writing direct json reply");
+		rspamd_protocol_write_json(task, flags, &reply);
+	}
+	else {
+		top = rspamd_protocol_write_ucl(task, flags);
 
-	if (pobj) {
-		*pobj = top;
+		if (pobj) {
+			*pobj = top;
+		}
 	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
@@ -1695,30 +2229,34 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 		g_assert(restat != NULL);
 		msg_notice_task(
 			"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
-			" %ud regexps total, %ud regexps cached,"
+			" %ud regexps total, %ud regexps cached, %ud pcre scans skipped by literals,"
+			" %ud class inputs collected, %ud class inputs reused,"
 			" %HL scanned using pcre, %HL scanned total",
 			restat->regexp_checked,
 			restat->regexp_matched,
 			restat->regexp_total,
 			restat->regexp_fast_cached,
+			restat->regexp_prefiltered,
+			restat->inputs_collected,
+			restat->inputs_cached,
 			restat->bytes_scanned_pcre,
 			restat->bytes_scanned);
 	}
 
-	reply = rspamd_fstring_sized_new(1000);
-
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC(task)) {
-		msg_debug_protocol("writing json reply");
-		rspamd_ucl_emit_fstring(top, how, &reply);
-	}
-	else {
-		if (RSPAMD_TASK_IS_SPAMC(task)) {
-			msg_debug_protocol("writing spamc legacy reply to client");
-			rspamd_ucl_tospamc_output(top, &reply);
+	if (top != NULL) {
+		if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC(task)) {
+			msg_debug_protocol("writing json reply");
+			rspamd_ucl_emit_fstring(top, how, &reply);
 		}
 		else {
-			msg_debug_protocol("writing rspamc legacy reply to client");
-			rspamd_ucl_torspamc_output(top, &reply);
+			if (RSPAMD_TASK_IS_SPAMC(task)) {
+				msg_debug_protocol("writing spamc legacy reply to client");
+				rspamd_ucl_tospamc_output(top, &reply);
+			}
+			else {
+				msg_debug_protocol("writing rspamc legacy reply to client");
+				rspamd_ucl_torspamc_output(top, &reply);
+			}
 		}
 	}
 
@@ -1767,14 +2305,15 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 
 					msg_debug_protocol("milter version of body block size %d",
 									   (int) len);
-					reply = rspamd_fstring_append(reply, start, len);
+					body_block = start;
+					body_block_len = len;
 				}
 			}
 			else {
 				msg_debug_protocol("general version of body block size %d",
 								   (int) task->msg.len);
-				reply = rspamd_fstring_append(reply,
-											  task->msg.begin, task->msg.len);
+				body_block = task->msg.begin;
+				body_block_len = task->msg.len;
 			}
 		}
 	}
@@ -1786,27 +2325,42 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 		ZSTD_outBuffer zout;
 		ZSTD_CStream *zstream;
 		rspamd_fstring_t *compressed_reply;
-		gsize r;
+		gsize r, in_total = 0;
+		const struct {
+			const char *data;
+			gsize len;
+		} in_segs[] = {
+			{reply->str, reply->len},
+			{body_block, body_block_len},
+		};
 
 		zstream = task->cfg->libs_ctx->out_zstream;
-		compressed_reply = rspamd_fstring_sized_new(ZSTD_compressBound(reply->len));
-		zin.pos = 0;
-		zin.src = reply->str;
-		zin.size = reply->len;
+		compressed_reply = rspamd_fstring_sized_new(
+			ZSTD_compressBound(reply->len + body_block_len));
 		zout.pos = 0;
 		zout.dst = compressed_reply->str;
 		zout.size = compressed_reply->allocated;
 
-		while (zin.pos < zin.size) {
-			r = ZSTD_compressStream(zstream, &zout, &zin);
+		/* Both segments are fed to the same stream, so they are never concatenated */
+		for (unsigned int i = 0; i < G_N_ELEMENTS(in_segs); i++) {
+			zin.pos = 0;
+			zin.src = in_segs[i].data;
+			zin.size = in_segs[i].len;
+
+			while (zin.pos < zin.size) {
+				r = ZSTD_compressStream(zstream, &zout, &zin);
 
-			if (ZSTD_isError(r)) {
-				msg_err_protocol("cannot compress: %s", ZSTD_getErrorName(r));
-				rspamd_fstring_free(compressed_reply);
-				rspamd_http_message_set_body_from_fstring_steal(msg, reply);
+				if (ZSTD_isError(r)) {
+					msg_err_protocol("cannot compress: %s", ZSTD_getErrorName(r));
+					rspamd_fstring_free(compressed_reply);
+					rspamd_http_message_set_body_from_fstring_steal(msg, reply);
+					rspamd_http_message_set_body_tail(msg, body_block, body_block_len);
 
-				goto end;
+					goto end;
+				}
 			}
+
+			in_total += zin.pos;
 		}
 
 		ZSTD_flushStream(zstream, &zout);
@@ -1816,13 +2370,14 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 			msg_err_protocol("cannot finalize compress: %s", ZSTD_getErrorName(r));
 			rspamd_fstring_free(compressed_reply);
 			rspamd_http_message_set_body_from_fstring_steal(msg, reply);
+			rspamd_http_message_set_body_tail(msg, body_block, body_block_len);
 
 			goto end;
 		}
 
 		msg_info_protocol("writing compressed results: %z bytes before "
 						  "%z bytes after",
-						  zin.pos, zout.pos);
+						  in_total, zout.pos);
 		compressed_reply->len = zout.pos;
 		rspamd_fstring_free(reply);
 		rspamd_http_message_set_body_from_fstring_steal(msg, compressed_reply);
@@ -1839,6 +2394,7 @@ void rspamd_protocol_http_reply(struct rspamd_http_message *msg,
 	}
 	else {
 		rspamd_http_message_set_body_from_fstring_steal(msg, reply);
+		rspamd_http_message_set_body_tail(msg, body_block, body_block_len);
 	}
 
 end:
@@ -1847,6 +2403,8 @@ end:
 
 		msg_debug_protocol("skip stats update due to no_stat flag");
 		metric_res = task->result;
+		/* Every worker has its own statistics slot, so counters are not contended */
+		struct rspamd_stat *stat = rspamd_main_local_stat(task->worker->srv);
 
 		if (metric_res != NULL) {
 
@@ -1855,44 +2413,41 @@ end:
 			if (action->action_type == METRIC_ACTION_SOFT_REJECT &&
 				(task->flags & RSPAMD_TASK_FLAG_GREYLISTED)) {
 				/* Set stat action to greylist to display greylisted messages */
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST]++;
-#else
-				__atomic_add_fetch(&task->worker->srv->stat->actions_stat[METRIC_ACTION_GREYLIST],
-								   1, __ATOMIC_RELEASE);
-#endif
+				RSPAMD_STAT_INC(stat, actions_stat[METRIC_ACTION_GREYLIST]);
 			}
 			else if (action->action_type < METRIC_ACTION_MAX) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[action->action_type]++;
-#else
-				__atomic_add_fetch(&task->worker->srv->stat->actions_stat[action->action_type],
-								   1, __ATOMIC_RELEASE);
-#endif
+				RSPAMD_STAT_INC(stat, actions_stat[action->action_type]);
 			}
 		}
 
 		/* Increase counters */
-#ifndef HAVE_ATOMIC_BUILTINS
-		task->worker->srv->stat->messages_scanned++;
-#else
-		__atomic_add_fetch(&task->worker->srv->stat->messages_scanned,
-						   1, __ATOMIC_RELEASE);
-#endif
+		RSPAMD_STAT_INC(stat, messages_scanned);
+
+		if (task->flags & RSPAMD_TASK_FLAG_MEMORY_PRESSURE) {
+			RSPAMD_STAT_INC(stat, messages_degraded);
+		}
 
 		/* Set average processing time */
 		uint32_t slot;
 		float processing_time = task->time_real_finish - task->task_timestamp;
 
+		if (processing_time > 0) {
+			rspamd_stat_hist_add(stat, RSPAMD_STAT_HIST_TASK, processing_time * 1e6);
+		}
+
+		if (task->msg.len > 0) {
+			rspamd_stat_hist_add(stat, RSPAMD_STAT_HIST_MESSAGE_SIZE, task->msg.len);
+		}
+
 #ifndef HAVE_ATOMIC_BUILTINS
-		slot = task->worker->srv->stat->avg_time.cur_slot++;
+		slot = stat->avg_time.cur_slot++;
 #else
-		slot = __atomic_fetch_add(&task->worker->srv->stat->avg_time.cur_slot,
+		slot = __atomic_fetch_add(&stat->avg_time.cur_slot,
 								  1, __ATOMIC_RELEASE);
 #endif
 		slot = slot % MAX_AVG_TIME_SLOTS;
 		/* TODO: this should be atomic but it is not supported in C */
-		task->worker->srv->stat->avg_time.avg_time[slot] = processing_time;
+		stat->avg_time.avg_time[slot] = processing_time;
 	}
 }
 
@@ -2102,6 +2657,9 @@ void rspamd_protocol_write_log_pipe(struct rspamd_task *task)
 
 				g_free(ls);
 				break;
+			case RSPAMD_LOG_PIPE_EXPORT:
+				/* Export records are written by plugins */
+				break;
 			default:
 				msg_err_protocol("unknown log format %d", lp->type);
 				break;
@@ -2139,10 +2697,16 @@ void rspamd_protocol_write_reply(struct rspamd_task *task, ev_tstamp timeout, st
 	/* Compatibility */
 	if (task->cmd == CMD_CHECK_RSPAMC) {
 		msg->method = HTTP_SYMBOLS;
+		/* Legacy replies cannot tell that connection is kept */
+		task->protocol_flags &= ~RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE;
 	}
 	else if (task->cmd == CMD_CHECK_SPAMC) {
 		msg->method = HTTP_SYMBOLS;
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
+		task->protocol_flags &= ~RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE;
+	}
+	else if (task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEP_ALIVE;
 	}
 
 	if (task->err != NULL) {
@@ -2199,7 +2763,7 @@ void rspamd_protocol_write_reply(struct rspamd_task *task, ev_tstamp timeout, st
 		case CMD_METRICS:
 			msg_debug_protocol("writing metrics to client");
 
-			memcpy(&stat_copy, srv->stat, sizeof(stat_copy));
+			rspamd_main_stat_snapshot(srv, &stat_copy);
 			output = rspamd_metrics_to_prometheus_string(
 				rspamd_worker_metrics_object(srv->cfg, &stat_copy, now - srv->start_time));
 			rspamd_http_message_set_body_from_fstring_steal(msg, output);
@@ -20,8 +20,11 @@
 #include "libserver/url.h"
 #include "libserver/task.h"
 #include "libserver/cfg_file.h"
+#include "libserver/tracing.h"
 #include "libutil/util.h"
+#include "libutil/hash.h"
 #include "libutil/regexp.h"
+#include "libutil/multipattern.h"
 #include "lua/lua_common.h"
 #include "libstat/stat_api.h"
 #include "contrib/uthash/utlist.h"
@@ -32,6 +35,7 @@
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
 #include "hyperscan_tools.h"
+#include "libutil/cxx/cpu_pool.h"
 #endif
 
 #include "unix-std.h"
@@ -94,13 +98,41 @@ struct rspamd_re_class {
 
 	char hash[rspamd_cryptobox_HASHBYTES + 1];
 
+	/* Literals required by the expressions matched by PCRE (case sensitive and not) */
+	struct rspamd_multipattern *lits[2];
+	/* Cache ids of the expressions for each literal */
+	GArray *lit_ids[2];
+	unsigned int nlits;
+
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_class_shard *shards;
+	unsigned int nshards;
+#endif
+};
+
 #ifdef WITH_HYPERSCAN
+/*
+ * Hyperscan database for a part of the class expressions: regexps are split
+ * to shards by their ids (content hashes), so a changed expression invalidates
+ * just its own shard and the rest of them are reused from the cache dir
+ */
+struct rspamd_re_class_shard {
+	struct rspamd_re_class *re_class;
+	/* Regexps sorted by ids, hyperscan ids are indexes in this array */
+	GPtrArray *re;
+	char hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_hyperscan_t *hs_db;
-	hs_scratch_t *hs_scratch;
+	/* Cache ids of the expressions compiled to the database */
 	int *hs_ids;
 	unsigned int nhs;
-#endif
+	unsigned int idx;
+	/* Scans are counted in all tasks, time only in profiled ones */
+	uint64_t nscans;
+	uint64_t bytes_scanned;
+	uint64_t nprofiled;
+	double time_profiled;
 };
+#endif
 
 enum rspamd_re_cache_elt_match_type {
 	RSPAMD_RE_CACHE_PCRE = 0,
@@ -112,10 +144,22 @@ struct rspamd_re_cache_elt {
 	rspamd_regexp_t *re;
 	int lua_cbref;
 	enum rspamd_re_cache_elt_match_type match_type;
+	/* Index of the required literal in the class or -1 */
+	int lit_idx;
+	/* PCRE calls are counted in all tasks, time only in profiled ones */
+	uint64_t nchecked;
+	uint64_t nmatched;
+	uint64_t bytes_scanned;
+	uint64_t nprofiled;
+	double time_profiled;
 };
 
 KHASH_INIT(lua_selectors_hash, char *, int, 1, kh_str_hash_func, kh_str_hash_equal);
 
+/* Number of bodies which regexps results are kept for */
+#define RSPAMD_RE_BODY_RESULTS_MAX 1024
+#define RSPAMD_RE_BODY_KEY_LEN 32
+
 struct rspamd_re_cache {
 	GHashTable *re_classes;
 
@@ -124,8 +168,14 @@ struct rspamd_re_cache {
 	ref_entry_t ref;
 	unsigned int nre;
 	unsigned int max_re_data;
+	/* Incremented each time literals are collected */
+	unsigned int lits_gen;
+	double profile_rate;
+	double time_budget;
 	char hash[rspamd_cryptobox_HASHBYTES + 1];
 	lua_State *L;
+	/* Results of body regexps for recently seen bodies */
+	rspamd_lru_hash_t *body_results;
 #ifdef WITH_HYPERSCAN
 	enum rspamd_hyperscan_status hyperscan_loaded;
 	gboolean disable_hyperscan;
@@ -142,13 +192,64 @@ struct rspamd_re_selector_result {
 KHASH_INIT(selectors_results_hash, int, struct rspamd_re_selector_result, 1,
 		   kh_int_hash_func, kh_int_hash_equal);
 
+/* Texts of a class that are the same for all its regexps within a task */
+struct rspamd_re_class_inputs {
+	const unsigned char **scvec;
+	unsigned int *lenvec;
+	unsigned int cnt;
+	gboolean raw;
+};
+
+KHASH_INIT(class_inputs_hash, uint64_t, struct rspamd_re_class_inputs, 1,
+		   kh_int64_hash_func, kh_int64_hash_equal);
+
+/* Text scanned for the literals of a class */
+struct rspamd_re_literals_key {
+	const struct rspamd_re_class *re_class;
+	const unsigned char *in;
+	gsize len;
+};
+
+#define rspamd_re_literals_hash_func(k) \
+	((khint_t) rspamd_cryptobox_fast_hash(&(k), sizeof(k), 0xdeadbabe))
+#define rspamd_re_literals_hash_equal(a, b) \
+	((a).re_class == (b).re_class && (a).in == (b).in && (a).len == (b).len)
+
+KHASH_INIT(re_literals_hash, struct rspamd_re_literals_key, unsigned char *, 1,
+		   rspamd_re_literals_hash_func, rspamd_re_literals_hash_equal);
+
+/* Shorter literals are found too often to save anything */
+#define RSPAMD_RE_CACHE_MIN_LITERAL 3
+
 struct rspamd_re_runtime {
 	unsigned char *checked;
 	unsigned char *results;
 	khash_t(selectors_results_hash) * sel_cache;
+	/* Inputs collected for classes, empty ones are stored as well */
+	khash_t(class_inputs_hash) * inputs_cache;
+	/* Bitsets of the class literals found in a text */
+	khash_t(re_literals_hash) * lit_cache;
+	unsigned int lits_gen;
+	/* Time spent by each regexp if the task is profiled, NULL otherwise */
+	double *profile_times;
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
+	/* Key of the task body in the body results cache */
+	unsigned char body_key[RSPAMD_RE_BODY_KEY_LEN];
+	gboolean body_lookup_done;
+	gboolean has_body_key;
+	unsigned int body_nloaded;
+};
+
+/*
+ * Results of the regexps of body classes shared between tasks with the same
+ * body, ids are followed by their results
+ */
+struct rspamd_re_body_results {
+	unsigned char key[RSPAMD_RE_BODY_KEY_LEN];
+	unsigned int nids;
+	uint32_t ids[];
 };
 
 static GQuark
@@ -174,6 +275,44 @@ rspamd_re_cache_class_id(enum rspamd_re_type type,
 	return rspamd_cryptobox_fast_hash_final(&st);
 }
 
+static void
+rspamd_re_class_free_literals(struct rspamd_re_class *re_class)
+{
+	for (unsigned int i = 0; i < G_N_ELEMENTS(re_class->lits); i++) {
+		if (re_class->lits[i]) {
+			rspamd_multipattern_destroy(re_class->lits[i]);
+			g_array_free(re_class->lit_ids[i], TRUE);
+			re_class->lits[i] = NULL;
+			re_class->lit_ids[i] = NULL;
+		}
+	}
+
+	re_class->nlits = 0;
+}
+
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_class_free_shards(struct rspamd_re_class *re_class)
+{
+	for (unsigned int i = 0; i < re_class->nshards; i++) {
+		struct rspamd_re_class_shard *shard = &re_class->shards[i];
+
+		if (shard->hs_db) {
+			rspamd_hyperscan_free(shard->hs_db, false);
+		}
+		if (shard->hs_ids) {
+			g_free(shard->hs_ids);
+		}
+
+		g_ptr_array_free(shard->re, TRUE);
+	}
+
+	g_free(re_class->shards);
+	re_class->shards = NULL;
+	re_class->nshards = 0;
+}
+#endif
+
 static void
 rspamd_re_cache_destroy(struct rspamd_re_cache *cache)
 {
@@ -195,16 +334,10 @@ rspamd_re_cache_destroy(struct rspamd_re_cache *cache)
 			g_free(re_class->type_data);
 		}
 
+		rspamd_re_class_free_literals(re_class);
+
 #ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
-			rspamd_hyperscan_free(re_class->hs_db, false);
-		}
-		if (re_class->hs_scratch) {
-			hs_free_scratch(re_class->hs_scratch);
-		}
-		if (re_class->hs_ids) {
-			g_free(re_class->hs_ids);
-		}
+		rspamd_re_class_free_shards(re_class);
 #endif
 		g_free(re_class);
 	}
@@ -228,6 +361,10 @@ rspamd_re_cache_destroy(struct rspamd_re_cache *cache)
 
 	kh_destroy(lua_selectors_hash, cache->selectors);
 
+	if (cache->body_results) {
+		rspamd_lru_hash_destroy(cache->body_results);
+	}
+
 	g_hash_table_unref(cache->re_classes);
 	g_ptr_array_free(cache->re, TRUE);
 	g_free(cache);
@@ -242,6 +379,23 @@ rspamd_re_cache_elt_dtor(gpointer e)
 	g_free(elt);
 }
 
+static unsigned int
+rspamd_re_body_key_hash(gconstpointer key)
+{
+	unsigned int h;
+
+	/* Key is a cryptographic hash itself */
+	memcpy(&h, key, sizeof(h));
+
+	return h;
+}
+
+static gboolean
+rspamd_re_body_key_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, RSPAMD_RE_BODY_KEY_LEN) == 0;
+}
+
 struct rspamd_re_cache *
 rspamd_re_cache_new(void)
 {
@@ -252,6 +406,10 @@ rspamd_re_cache_new(void)
 	cache->nre = 0;
 	cache->re = g_ptr_array_new_full(256, rspamd_re_cache_elt_dtor);
 	cache->selectors = kh_init(lua_selectors_hash);
+	cache->body_results = rspamd_lru_hash_new_full(RSPAMD_RE_BODY_RESULTS_MAX,
+												   NULL, g_free,
+												   rspamd_re_body_key_hash,
+												   rspamd_re_body_key_equal);
 #ifdef WITH_HYPERSCAN
 	cache->hyperscan_loaded = RSPAMD_HYPERSCAN_UNKNOWN;
 #endif
@@ -319,6 +477,7 @@ rspamd_re_cache_add(struct rspamd_re_cache *cache,
 		g_ptr_array_add(cache->re, elt);
 		rspamd_regexp_set_class(re, re_class);
 		elt->lua_cbref = lua_cbref;
+		elt->lit_idx = -1;
 
 		g_hash_table_insert(re_class->re, rspamd_regexp_get_id(nre), nre);
 	}
@@ -368,6 +527,8 @@ void rspamd_re_cache_replace(struct rspamd_re_cache *cache,
 		rspamd_regexp_unref(elt->re);
 		elt->re = rspamd_regexp_ref(with);
 		/* XXX: do not touch match type here */
+		/* A literal of the old expression is not required by a new one */
+		elt->lit_idx = -1;
 	}
 }
 
@@ -380,6 +541,213 @@ rspamd_re_cache_sort_func(gconstpointer a, gconstpointer b)
 							 rspamd_regexp_get_id((*re2)->re));
 }
 
+#ifdef WITH_HYPERSCAN
+static inline struct rspamd_re_class_shard *
+rspamd_re_cache_get_shard(struct rspamd_re_class *re_class, rspamd_regexp_t *re)
+{
+	uint32_t h;
+
+	memcpy(&h, rspamd_regexp_get_id(re), sizeof(h));
+
+	return &re_class->shards[h & (re_class->nshards - 1)];
+}
+
+static void
+rspamd_re_cache_init_shards(struct rspamd_re_cache *cache, unsigned int shard_size)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_class_shard *shard;
+	struct rspamd_re_cache_elt *elt;
+	rspamd_cryptobox_hash_state_t st;
+	unsigned char hash_out[rspamd_cryptobox_HASHBYTES];
+	unsigned int i, j, n, fl;
+	rspamd_regexp_t *re;
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+		rspamd_re_class_free_shards(re_class);
+		n = g_hash_table_size(re_class->re);
+		re_class->nshards = 1;
+
+		/*
+		 * Number of shards is a power of two, so when a class grows,
+		 * each shard is split in two rather than all expressions are reshuffled
+		 */
+		while (shard_size > 0 && n > re_class->nshards * shard_size) {
+			re_class->nshards *= 2;
+		}
+
+		re_class->shards = g_new0(struct rspamd_re_class_shard, re_class->nshards);
+
+		for (i = 0; i < re_class->nshards; i++) {
+			re_class->shards[i].re_class = re_class;
+			re_class->shards[i].re = g_ptr_array_new_with_free_func(
+				(GDestroyNotify) rspamd_regexp_unref);
+			re_class->shards[i].idx = i;
+		}
+	}
+
+	/* Regexps are already sorted by ids, so are shards elements */
+	PTR_ARRAY_FOREACH(cache->re, i, elt)
+	{
+		re_class = rspamd_regexp_get_class(elt->re);
+		shard = rspamd_re_cache_get_shard(re_class, elt->re);
+		g_ptr_array_add(shard->re, rspamd_regexp_ref(elt->re));
+	}
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		for (i = 0; i < re_class->nshards; i++) {
+			shard = &re_class->shards[i];
+			/*
+			 * Unlike class hash, it does not depend on the order of regexps
+			 * in the cache, as hyperscan ids are local for a shard
+			 */
+			rspamd_cryptobox_hash_init(&st, NULL, 0);
+			rspamd_cryptobox_hash_update(&st, (gpointer) &re_class->id,
+										 sizeof(re_class->id));
+			rspamd_cryptobox_hash_update(&st, (gpointer) &re_class->nshards,
+										 sizeof(re_class->nshards));
+			rspamd_cryptobox_hash_update(&st, (gpointer) &i, sizeof(i));
+
+			PTR_ARRAY_FOREACH(shard->re, j, re)
+			{
+				rspamd_cryptobox_hash_update(&st, rspamd_regexp_get_id(re),
+											 rspamd_cryptobox_HASHBYTES);
+				fl = rspamd_regexp_get_pcre_flags(re);
+				rspamd_cryptobox_hash_update(&st, (const unsigned char *) &fl,
+											 sizeof(fl));
+				fl = rspamd_regexp_get_flags(re);
+				rspamd_cryptobox_hash_update(&st, (const unsigned char *) &fl,
+											 sizeof(fl));
+				fl = rspamd_regexp_get_maxhits(re);
+				rspamd_cryptobox_hash_update(&st, (const unsigned char *) &fl,
+											 sizeof(fl));
+			}
+
+			rspamd_cryptobox_hash_final(&st, hash_out);
+			rspamd_snprintf(shard->hash, sizeof(shard->hash), "%*xs",
+							(int) rspamd_cryptobox_HASHBYTES, hash_out);
+		}
+	}
+}
+#endif
+
+/*
+ * Collects literals required by the expressions matched by PCRE, so PCRE is
+ * not called for texts that have none of them. The set of such expressions
+ * changes when hyperscan is loaded, so this is called again then
+ */
+static void
+rspamd_re_cache_init_literals(struct rspamd_re_cache *cache)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt *elt;
+	GError *err = NULL;
+	unsigned int i, j, nlits = 0, npcre = 0;
+	gboolean icase;
+	char *literal;
+	gsize len;
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		rspamd_re_class_free_literals(v);
+	}
+
+	PTR_ARRAY_FOREACH(cache->re, i, elt)
+	{
+		elt->lit_idx = -1;
+
+		if (elt->match_type != RSPAMD_RE_CACHE_PCRE) {
+			continue;
+		}
+
+		npcre++;
+		re_class = rspamd_regexp_get_class(elt->re);
+
+		if (re_class->type == RSPAMD_RE_WORDS ||
+			re_class->type == RSPAMD_RE_STEMWORDS ||
+			re_class->type == RSPAMD_RE_RAWWORDS) {
+			/* Each word is a separate text, remembering literals for them costs more */
+			continue;
+		}
+
+		literal = rspamd_regexp_get_required_literal(elt->re, &len, &icase);
+
+		if (literal == NULL) {
+			continue;
+		}
+
+		if (len >= RSPAMD_RE_CACHE_MIN_LITERAL) {
+			j = icase ? 1 : 0;
+
+			if (re_class->lits[j] == NULL) {
+				re_class->lits[j] = rspamd_multipattern_create(
+					icase ? RSPAMD_MULTIPATTERN_ICASE : RSPAMD_MULTIPATTERN_DEFAULT);
+				re_class->lit_ids[j] = g_array_new(FALSE, FALSE, sizeof(int));
+			}
+
+			elt->lit_idx = re_class->nlits++;
+			rspamd_multipattern_add_pattern_len(re_class->lits[j], literal, len, 0);
+			g_array_append_val(re_class->lit_ids[j], i);
+		}
+
+		g_free(literal);
+	}
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		for (j = 0; j < G_N_ELEMENTS(re_class->lits); j++) {
+			if (re_class->lits[j] == NULL) {
+				continue;
+			}
+
+			if (!rspamd_multipattern_compile(re_class->lits[j],
+											 RSPAMD_MULTIPATTERN_COMPILE_NO_FS, &err)) {
+				msg_err_re_cache("cannot compile literals for class %s: %e",
+								 rspamd_re_cache_type_to_string(re_class->type), err);
+				g_error_free(err);
+				err = NULL;
+
+				for (i = 0; i < re_class->lit_ids[j]->len; i++) {
+					elt = g_ptr_array_index(cache->re,
+											g_array_index(re_class->lit_ids[j], int, i));
+					elt->lit_idx = -1;
+				}
+
+				rspamd_multipattern_destroy(re_class->lits[j]);
+				g_array_free(re_class->lit_ids[j], TRUE);
+				re_class->lits[j] = NULL;
+				re_class->lit_ids[j] = NULL;
+			}
+			else {
+				nlits += re_class->lit_ids[j]->len;
+			}
+		}
+	}
+
+	/* Runtimes created before do not use new literals */
+	cache->lits_gen++;
+
+	if (nlits > 0) {
+		msg_info_re_cache("prefilter %ud of %ud pcre expressions by required literals",
+						  nlits, npcre);
+	}
+}
+
 void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
 	unsigned int i, fl;
@@ -475,12 +843,20 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 	}
 
 	cache->L = cfg->lua_state;
+	cache->profile_rate = cfg->re_profile_rate;
+	cache->time_budget = cfg->re_time_budget;
 
 #ifdef WITH_HYPERSCAN
 	const char *platform = "generic";
 	rspamd_fstring_t *features = rspamd_fstring_new();
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
+	rspamd_re_cache_init_shards(cache, cfg->hs_shard_size);
+
+	if (cache->disable_hyperscan) {
+		/* Otherwise literals are collected once hyperscan is loaded */
+		rspamd_re_cache_init_literals(cache);
+	}
 
 	g_assert(hs_populate_platform(&cache->plt) == HS_SUCCESS);
 
@@ -507,11 +883,15 @@ void rspamd_re_cache_init(struct rspamd_re_cache *cache, struct rspamd_config *c
 	}
 
 	hs_set_allocator(g_malloc, g_free);
+	/* Databases are large and long-lived, so they could use huge pages */
+	hs_set_database_allocator(rspamd_hugepage_alloc, rspamd_hugepage_free);
 
 	msg_info_re_cache("loaded hyperscan engine with cpu tune '%s' and features '%V'",
 					  platform, features);
 
 	rspamd_fstring_free(features);
+#else
+	rspamd_re_cache_init_literals(cache);
 #endif
 }
 
@@ -527,6 +907,11 @@ rspamd_re_cache_runtime_new(struct rspamd_re_cache *cache)
 	rt->checked = ((unsigned char *) rt) + sizeof(*rt);
 	rt->results = rt->checked + NBYTES(cache->nre);
 	rt->stat.regexp_total = cache->nre;
+	rt->lits_gen = cache->lits_gen;
+
+	if (cache->profile_rate > 0 && rspamd_random_double_fast() < cache->profile_rate) {
+		rt->profile_times = g_malloc0(sizeof(double) * cache->nre);
+	}
 #ifdef WITH_HYPERSCAN
 	rt->has_hs = cache->hyperscan_loaded;
 #endif
@@ -580,6 +965,88 @@ rspamd_re_cache_check_lua_condition(struct rspamd_task *task,
 	return res;
 }
 
+struct rspamd_re_literals_cbdata {
+	struct rspamd_re_cache *cache;
+	GArray *ids;
+	unsigned char *found;
+};
+
+static int
+rspamd_re_cache_literal_cb(struct rspamd_multipattern *mp,
+						   unsigned int strnum,
+						   int match_start,
+						   int match_pos,
+						   const char *text,
+						   gsize len,
+						   void *context)
+{
+	struct rspamd_re_literals_cbdata *cbdata = context;
+	struct rspamd_re_cache_elt *elt;
+
+	elt = g_ptr_array_index(cbdata->cache->re,
+							g_array_index(cbdata->ids, int, strnum));
+
+	if (elt->lit_idx >= 0) {
+		setbit(cbdata->found, elt->lit_idx);
+	}
+
+	return 0;
+}
+
+/*
+ * Returns FALSE if a text lacks a literal required by a regexp; literals of
+ * all expressions in a class are found by a single scan of a text
+ */
+static gboolean
+rspamd_re_cache_has_literal(struct rspamd_re_runtime *rt,
+							struct rspamd_re_cache_elt *elt,
+							const unsigned char *in, gsize len)
+{
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_literals_key key;
+	struct rspamd_re_literals_cbdata cbdata;
+	unsigned char *found;
+	khiter_t k;
+	unsigned int i;
+	int r;
+
+	if (elt->lit_idx < 0 || rt->lits_gen != rt->cache->lits_gen) {
+		return TRUE;
+	}
+
+	re_class = rspamd_regexp_get_class(elt->re);
+	key.re_class = re_class;
+	key.in = in;
+	key.len = len;
+
+	if (rt->lit_cache == NULL) {
+		rt->lit_cache = kh_init(re_literals_hash);
+	}
+
+	k = kh_put(re_literals_hash, rt->lit_cache, key, &r);
+
+	if (r > 0) {
+		found = g_malloc0(NBYTES(re_class->nlits));
+		kh_value(rt->lit_cache, k) = found;
+		cbdata.cache = rt->cache;
+		cbdata.found = found;
+
+		for (i = 0; i < G_N_ELEMENTS(re_class->lits); i++) {
+			if (re_class->lits[i] != NULL) {
+				cbdata.ids = re_class->lit_ids[i];
+				rspamd_multipattern_lookup(re_class->lits[i],
+										   (const char *) in, len,
+										   rspamd_re_cache_literal_cb, &cbdata, NULL);
+			}
+		}
+	}
+	else {
+		found = kh_value(rt->lit_cache, k);
+	}
+
+	return isset(found, elt->lit_idx);
+}
+
 static unsigned int
 rspamd_re_cache_process_pcre(struct rspamd_re_runtime *rt,
 							 rspamd_regexp_t *re, struct rspamd_task *task,
@@ -591,8 +1058,8 @@ rspamd_re_cache_process_pcre(struct rspamd_re_runtime *rt,
 	const char *start = NULL, *end = NULL;
 	unsigned int max_hits = rspamd_regexp_get_maxhits(re);
 	uint64_t id = rspamd_regexp_get_cache_id(re);
-	double t1 = NAN, t2, pr;
-	const double slow_time = 1e8;
+	struct rspamd_re_cache_elt *elt = g_ptr_array_index(rt->cache->re, id);
+	double t1 = NAN, t2, budget = rt->cache->time_budget;
 
 	if (in == NULL) {
 		return rt->results[id];
@@ -609,10 +1076,14 @@ rspamd_re_cache_process_pcre(struct rspamd_re_runtime *rt,
 	r = rt->results[id];
 
 	if (max_hits == 0 || r < max_hits) {
-		pr = rspamd_random_double_fast();
+		if (!rspamd_re_cache_has_literal(rt, elt, in, len)) {
+			rt->stat.regexp_prefiltered++;
 
-		if (pr > 0.9) {
-			t1 = rspamd_get_ticks(TRUE);
+			return r;
+		}
+
+		if (rt->profile_times) {
+			t1 = rspamd_get_ticks(FALSE);
 		}
 
 		while (rspamd_regexp_search(re,
@@ -643,18 +1114,28 @@ rspamd_re_cache_process_pcre(struct rspamd_re_runtime *rt,
 		rt->stat.regexp_checked++;
 		rt->stat.bytes_scanned_pcre += len;
 		rt->stat.bytes_scanned += len;
+		elt->nchecked++;
+		elt->bytes_scanned += len;
 
 		if (r > 0) {
 			rt->stat.regexp_matched += r;
+			elt->nmatched += r;
 		}
 
 		if (!isnan(t1)) {
-			t2 = rspamd_get_ticks(TRUE);
-
-			if (t2 - t1 > slow_time) {
+			t2 = rspamd_get_ticks(FALSE) - t1;
+			elt->nprofiled++;
+			elt->time_profiled += t2;
+			rt->profile_times[id] += t2;
+
+			/* Warn just once per message when the budget is exceeded */
+			if (budget > 0 && rt->profile_times[id] >= budget &&
+				rt->profile_times[id] - t2 < budget) {
 				rspamd_symcache_enable_profile(task);
-				msg_info_task("regexp '%16s' took %.0f ticks to execute",
-							  rspamd_regexp_get_pattern(re), t2 - t1);
+				msg_warn_task("regexp '%16s' took %.3f ms for this message, "
+							  "more than %.3f ms budget",
+							  rspamd_regexp_get_pattern(re),
+							  rt->profile_times[id] * 1000.0, budget * 1000.0);
 			}
 		}
 	}
@@ -670,6 +1151,7 @@ struct rspamd_re_hyperscan_cbdata {
 	unsigned int count;
 	rspamd_regexp_t *re;
 	struct rspamd_task *task;
+	struct rspamd_re_class_shard *shard;
 };
 
 static int
@@ -687,6 +1169,8 @@ rspamd_re_cache_hyperscan_cb(unsigned int id,
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	/* Hyperscan ids are indexes of regexps in a shard */
+	id = rspamd_regexp_get_cache_id(g_ptr_array_index(cbdata->shard->re, id));
 	cache_elt = g_ptr_array_index(rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits(cache_elt->re);
 
@@ -772,7 +1256,10 @@ rspamd_re_cache_process_regexp_data(struct rspamd_re_runtime *rt,
 	setbit(rt->checked, re_id);
 #else
 	struct rspamd_re_class *re_class;
+	struct rspamd_re_class_shard *shard;
 	struct rspamd_re_hyperscan_cbdata cbdata;
+	hs_scratch_t *scratch;
+	double t1 = NAN;
 
 	cache_elt = g_ptr_array_index(rt->cache->re, re_id);
 	re_class = rspamd_regexp_get_class(re);
@@ -802,21 +1289,35 @@ rspamd_re_cache_process_regexp_data(struct rspamd_re_runtime *rt,
 			rt->stat.bytes_scanned += lens[i];
 		}
 
-		g_assert(re_class->hs_scratch != NULL);
-		g_assert(re_class->hs_db != NULL);
+		/* Only the shard of this regexp is scanned, others are left until needed */
+		shard = rspamd_re_cache_get_shard(re_class, re);
+		g_assert(shard->hs_db != NULL);
+		scratch = rspamd_hyperscan_scratch_acquire();
+		g_assert(scratch != NULL);
+
+		if (rt->profile_times) {
+			t1 = rspamd_get_ticks(FALSE);
+		}
 
 		/* Go through hyperscan API */
 		for (i = 0; i < count; i++) {
+			if (lens[i] == 0) {
+				/* Hyperscan expressions never match empty data */
+				*processed_hyperscan = TRUE;
+				continue;
+			}
+
 			cbdata.ins = &in[i];
 			cbdata.re = re;
 			cbdata.rt = rt;
 			cbdata.lens = &lens[i];
 			cbdata.count = 1;
 			cbdata.task = task;
+			cbdata.shard = shard;
 
-			if ((hs_scan(rspamd_hyperscan_get_database(re_class->hs_db),
+			if ((hs_scan(rspamd_hyperscan_get_database(shard->hs_db),
 						 in[i], lens[i], 0,
-						 re_class->hs_scratch,
+						 scratch,
 						 rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
 				ret = 0;
 			}
@@ -824,6 +1325,16 @@ rspamd_re_cache_process_regexp_data(struct rspamd_re_runtime *rt,
 				ret = rt->results[re_id];
 				*processed_hyperscan = TRUE;
 			}
+
+			shard->nscans++;
+			shard->bytes_scanned += lens[i];
+		}
+
+		rspamd_hyperscan_scratch_release(scratch);
+
+		if (!isnan(t1)) {
+			shard->nprofiled++;
+			shard->time_profiled += rspamd_get_ticks(FALSE) - t1;
 		}
 	}
 #endif
@@ -831,20 +1342,20 @@ rspamd_re_cache_process_regexp_data(struct rspamd_re_runtime *rt,
 	return ret;
 }
 
+#ifdef WITH_HYPERSCAN
 static void
-rspamd_re_cache_finish_class(struct rspamd_task *task,
+rspamd_re_cache_finish_shard(struct rspamd_task *task,
 							 struct rspamd_re_runtime *rt,
-							 struct rspamd_re_class *re_class,
+							 struct rspamd_re_class_shard *shard,
 							 const char *class_name)
 {
-#ifdef WITH_HYPERSCAN
 	unsigned int i;
 	uint64_t re_id;
 	unsigned int found = 0;
 
 	/* Set all bits that are not checked and included in hyperscan to 1 */
-	for (i = 0; i < re_class->nhs; i++) {
-		re_id = re_class->hs_ids[i];
+	for (i = 0; i < shard->nhs; i++) {
+		re_id = shard->hs_ids[i];
 
 		if (!isset(rt->checked, re_id)) {
 			g_assert(rt->results[re_id] == 0);
@@ -856,11 +1367,12 @@ rspamd_re_cache_finish_class(struct rspamd_task *task,
 		}
 	}
 
-	msg_debug_re_task("finished hyperscan for class %s; %d "
+	msg_debug_re_task("finished hyperscan for class %s (shard %ud of %ud); %d "
 					  "matches found; %d hyperscan supported regexps; %d total regexps",
-					  class_name, found, re_class->nhs, (int) g_hash_table_size(re_class->re));
-#endif
+					  class_name, shard->idx + 1, shard->re_class->nshards,
+					  found, shard->nhs, (int) shard->re->len);
 }
+#endif
 
 static gboolean
 rspamd_re_cache_process_selector(struct rspamd_task *task,
@@ -1052,25 +1564,24 @@ rspamd_process_words_vector(GArray *words,
 	return cnt;
 }
 
-static unsigned int
-rspamd_re_cache_process_headers_list(struct rspamd_task *task,
-									 struct rspamd_re_runtime *rt,
-									 rspamd_regexp_t *re,
-									 struct rspamd_re_class *re_class,
-									 struct rspamd_mime_header *rh,
-									 gboolean is_strong,
-									 gboolean *processed_hyperscan)
+/*
+ * Appends values of headers to inputs
+ */
+static void
+rspamd_re_cache_collect_headers(struct rspamd_re_class *re_class,
+								struct rspamd_mime_header *rh,
+								gboolean is_strong,
+								struct rspamd_re_class_inputs *inputs)
 {
 	const unsigned char **scvec, *in;
-	gboolean raw = FALSE;
 	unsigned int *lenvec;
 	struct rspamd_mime_header *cur;
-	unsigned int cnt = 0, i = 0, ret = 0;
+	unsigned int cnt = 0, i = inputs->cnt;
 
 	DL_COUNT(rh, cur, cnt);
 
-	scvec = g_malloc(sizeof(*scvec) * cnt);
-	lenvec = g_malloc(sizeof(*lenvec) * cnt);
+	scvec = g_realloc(inputs->scvec, sizeof(*scvec) * (i + cnt));
+	lenvec = g_realloc(inputs->lenvec, sizeof(*lenvec) * (i + cnt));
 
 	DL_FOREACH(rh, cur)
 	{
@@ -1085,11 +1596,11 @@ rspamd_re_cache_process_headers_list(struct rspamd_task *task,
 			lenvec[i] = strlen(cur->value);
 
 			if (rspamd_fast_utf8_validate(in, lenvec[i]) != 0) {
-				raw = TRUE;
+				inputs->raw = TRUE;
 			}
 		}
 		else {
-			in = (const unsigned char *) cur->decoded;
+			in = (const unsigned char *) rspamd_mime_header_get_decoded(cur);
 			/* Validate input^W^WNo need to validate as it is already valid */
 			if (!in) {
 				lenvec[i] = 0;
@@ -1105,75 +1616,73 @@ rspamd_re_cache_process_headers_list(struct rspamd_task *task,
 		i++;
 	}
 
-	if (i > 0) {
+	inputs->scvec = scvec;
+	inputs->lenvec = lenvec;
+	inputs->cnt = i;
+}
+
+static unsigned int
+rspamd_re_cache_process_headers_list(struct rspamd_task *task,
+									 struct rspamd_re_runtime *rt,
+									 rspamd_regexp_t *re,
+									 struct rspamd_re_class *re_class,
+									 struct rspamd_mime_header *rh,
+									 gboolean is_strong,
+									 gboolean *processed_hyperscan)
+{
+	struct rspamd_re_class_inputs inputs;
+	unsigned int ret = 0;
+
+	memset(&inputs, 0, sizeof(inputs));
+	rspamd_re_cache_collect_headers(re_class, rh, is_strong, &inputs);
+
+	if (inputs.cnt > 0) {
 		ret = rspamd_re_cache_process_regexp_data(rt, re,
-												  task, scvec, lenvec, i, raw, processed_hyperscan);
+												  task, inputs.scvec, inputs.lenvec, inputs.cnt,
+												  inputs.raw, processed_hyperscan);
 		msg_debug_re_task("checking header %s regexp: %s=%*s -> %d",
 						  re_class->type_data,
 						  rspamd_regexp_get_pattern(re),
-						  (int) lenvec[0], scvec[0], ret);
+						  (int) inputs.lenvec[0], inputs.scvec[0], ret);
 	}
 
-	g_free(scvec);
-	g_free(lenvec);
+	g_free(inputs.scvec);
+	g_free(inputs.lenvec);
 
 	return ret;
 }
 
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Collects texts of a class that do not depend on a specific regexp
  */
-static unsigned int
-rspamd_re_cache_exec_re(struct rspamd_task *task,
-						struct rspamd_re_runtime *rt,
-						rspamd_regexp_t *re,
-						struct rspamd_re_class *re_class,
-						gboolean is_strong)
+static void
+rspamd_re_cache_collect_class_inputs(struct rspamd_task *task,
+									 struct rspamd_re_class *re_class,
+									 struct rspamd_re_class_inputs *inputs)
 {
-	unsigned int ret = 0, i, re_id;
 	struct rspamd_mime_header *rh;
-	const char *in;
-	const unsigned char **scvec = NULL;
-	unsigned int *lenvec = NULL;
-	gboolean raw = FALSE, processed_hyperscan = FALSE;
 	struct rspamd_mime_text_part *text_part;
 	struct rspamd_mime_part *mime_part;
 	struct rspamd_url *url;
-	unsigned int len = 0, cnt = 0;
-	const char *class_name;
-
-	class_name = rspamd_re_cache_type_to_string(re_class->type);
-	msg_debug_re_task("start check re type: %s: /%s/",
-					  class_name,
-					  rspamd_regexp_get_pattern(re));
-	re_id = rspamd_regexp_get_cache_id(re);
+	const unsigned char **scvec = NULL;
+	unsigned int *lenvec = NULL;
+	const char *in;
+	unsigned int i, len, cnt = 0;
+	gboolean raw = FALSE;
 
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
-		/* Get list of specified headers */
 		rh = rspamd_message_get_header_array(task,
 											 re_class->type_data, FALSE);
 
 		if (rh) {
-			ret = rspamd_re_cache_process_headers_list(task, rt, re,
-													   re_class, rh, is_strong, &processed_hyperscan);
-			msg_debug_re_task("checked header(%s) regexp: %s -> %d",
-							  (const char *) re_class->type_data,
-							  rspamd_regexp_get_pattern(re),
-							  ret);
+			rspamd_re_cache_collect_headers(re_class, rh, FALSE, inputs);
 		}
-		break;
-	case RSPAMD_RE_ALLHEADER:
-		raw = TRUE;
-		in = MESSAGE_FIELD(task, raw_headers_content).begin;
-		len = MESSAGE_FIELD(task, raw_headers_content).len;
-		ret = rspamd_re_cache_process_regexp_data(rt, re,
-												  task, (const unsigned char **) &in, &len, 1, raw, &processed_hyperscan);
-		msg_debug_re_task("checked allheader regexp: %s -> %d",
-						  rspamd_regexp_get_pattern(re), ret);
-		break;
+
+		return;
 	case RSPAMD_RE_MIMEHEADER:
+		/* Headers of all parts are scanned at once */
 		PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, mime_part)
 		{
 			if (mime_part->parent_part == NULL ||
@@ -1182,126 +1691,88 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 				/* We filter parts that have no multipart parent or are a messages here */
 				continue;
 			}
+
 			rh = rspamd_message_get_header_from_hash(mime_part->raw_headers,
 													 re_class->type_data, FALSE);
 
 			if (rh) {
-				ret += rspamd_re_cache_process_headers_list(task, rt, re,
-															re_class, rh, is_strong, &processed_hyperscan);
+				rspamd_re_cache_collect_headers(re_class, rh, FALSE, inputs);
 			}
-			msg_debug_re_task("checked mime header(%s) regexp: %s -> %d",
-							  (const char *) re_class->type_data,
-							  rspamd_regexp_get_pattern(re),
-							  ret);
 		}
-		break;
+
+		return;
 	case RSPAMD_RE_MIME:
 	case RSPAMD_RE_RAWMIME:
 		/* Iterate through text parts */
-		if (MESSAGE_FIELD(task, text_parts)->len > 0) {
-			cnt = MESSAGE_FIELD(task, text_parts)->len;
-			scvec = g_malloc(sizeof(*scvec) * cnt);
-			lenvec = g_malloc(sizeof(*lenvec) * cnt);
+		if (MESSAGE_FIELD(task, text_parts)->len == 0) {
+			return;
+		}
 
-			PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
-			{
-				/* Select data for regexp */
-				if (re_class->type == RSPAMD_RE_RAWMIME) {
-					if (text_part->raw.len == 0) {
-						len = 0;
-						in = "";
-					}
-					else {
-						in = text_part->raw.begin;
-						len = text_part->raw.len;
-					}
+		cnt = MESSAGE_FIELD(task, text_parts)->len;
+		scvec = g_malloc(sizeof(*scvec) * cnt);
+		lenvec = g_malloc(sizeof(*lenvec) * cnt);
 
-					raw = TRUE;
+		PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
+		{
+			/* Select data for regexp */
+			if (re_class->type == RSPAMD_RE_RAWMIME) {
+				if (text_part->raw.len == 0) {
+					len = 0;
+					in = "";
 				}
 				else {
-					/* Skip empty parts */
-					if (IS_TEXT_PART_EMPTY(text_part)) {
-						len = 0;
-						in = "";
-					}
-					else {
-						/* Check raw flags */
-						if (!IS_TEXT_PART_UTF(text_part)) {
-							raw = TRUE;
-						}
+					in = text_part->raw.begin;
+					len = text_part->raw.len;
+				}
 
-						in = text_part->utf_content.begin;
-						len = text_part->utf_content.len;
-					}
+				raw = TRUE;
+			}
+			else {
+				/* Skip empty parts */
+				if (IS_TEXT_PART_EMPTY(text_part)) {
+					len = 0;
+					in = "";
 				}
+				else {
+					/* Check raw flags */
+					if (!IS_TEXT_PART_UTF(text_part)) {
+						raw = TRUE;
+					}
 
-				scvec[i] = (unsigned char *) in;
-				lenvec[i] = len;
+					in = text_part->utf_content.begin;
+					len = text_part->utf_content.len;
+				}
 			}
 
-			ret = rspamd_re_cache_process_regexp_data(rt, re,
-													  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-			msg_debug_re_task("checked mime regexp: %s -> %d",
-							  rspamd_regexp_get_pattern(re), ret);
-			g_free(scvec);
-			g_free(lenvec);
+			scvec[i] = (unsigned char *) in;
+			lenvec[i] = len;
 		}
 		break;
 	case RSPAMD_RE_URL:
-		cnt = kh_size(MESSAGE_FIELD(task, urls));
+	case RSPAMD_RE_EMAIL:
+		if (kh_size(MESSAGE_FIELD(task, urls)) == 0) {
+			return;
+		}
 
-		if (cnt > 0) {
-			scvec = g_malloc(sizeof(*scvec) * cnt);
-			lenvec = g_malloc(sizeof(*lenvec) * cnt);
-			i = 0;
-			raw = FALSE;
+		scvec = g_malloc(sizeof(*scvec) * kh_size(MESSAGE_FIELD(task, urls)));
+		lenvec = g_malloc(sizeof(*lenvec) * kh_size(MESSAGE_FIELD(task, urls)));
 
-			kh_foreach_key(MESSAGE_FIELD(task, urls), url, {
+		/* URL regexps do not include emails and vice versa */
+		kh_foreach_key(MESSAGE_FIELD(task, urls), url, {
+			if (re_class->type == RSPAMD_RE_URL) {
 				if ((url->protocol & PROTOCOL_MAILTO)) {
 					continue;
 				}
-				in = url->string;
-				len = url->urllen;
-
-				if (len > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
-					scvec[i] = (unsigned char *) in;
-					lenvec[i++] = len;
-				}
-			});
-
-			/* URL regexps do not include emails, that's why the code below is commented */
-#if 0
-			g_hash_table_iter_init (&it, MESSAGE_FIELD (task, emails));
 
-			while (g_hash_table_iter_next (&it, &k, &v)) {
-				url = v;
 				in = url->string;
 				len = url->urllen;
 
 				if (len > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
-					scvec[i] = (unsigned char *) in;
-					lenvec[i++] = len;
+					scvec[cnt] = (unsigned char *) in;
+					lenvec[cnt++] = len;
 				}
 			}
-#endif
-			ret = rspamd_re_cache_process_regexp_data(rt, re,
-													  task, scvec, lenvec, i, raw, &processed_hyperscan);
-			msg_debug_re_task("checked url regexp: %s -> %d",
-							  rspamd_regexp_get_pattern(re), ret);
-			g_free(scvec);
-			g_free(lenvec);
-		}
-		break;
-	case RSPAMD_RE_EMAIL:
-		cnt = kh_size(MESSAGE_FIELD(task, urls));
-
-		if (cnt > 0) {
-			scvec = g_malloc(sizeof(*scvec) * cnt);
-			lenvec = g_malloc(sizeof(*lenvec) * cnt);
-			i = 0;
-			raw = FALSE;
-
-			kh_foreach_key(MESSAGE_FIELD(task, urls), url, {
+			else {
 				if (!(url->protocol & PROTOCOL_MAILTO)) {
 					continue;
 				}
@@ -1311,27 +1782,10 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 
 				in = rspamd_url_user_unsafe(url);
 				len = url->userlen + 1 + url->hostlen;
-				scvec[i] = (unsigned char *) in;
-				lenvec[i++] = len;
-			});
-
-			ret = rspamd_re_cache_process_regexp_data(rt, re,
-													  task, scvec, lenvec, i, raw, &processed_hyperscan);
-			msg_debug_re_task("checked email regexp: %s -> %d",
-							  rspamd_regexp_get_pattern(re), ret);
-			g_free(scvec);
-			g_free(lenvec);
-		}
-		break;
-	case RSPAMD_RE_BODY:
-		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data(rt, re, task,
-												  (const unsigned char **) &in, &len, 1, raw, &processed_hyperscan);
-		msg_debug_re_task("checked rawbody regexp: %s -> %d",
-						  rspamd_regexp_get_pattern(re), ret);
+				scvec[cnt] = (unsigned char *) in;
+				lenvec[cnt++] = len;
+			}
+		});
 		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
@@ -1351,10 +1805,10 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 		 * of the body content.
 		 */
 
-		rh = rspamd_message_get_header_array(task, "Subject", FALSE);
+		rh = rspamd_message_get_header_array_by_id(task, RSPAMD_MIME_HEADER_SUBJECT, FALSE);
 
 		if (rh) {
-			scvec[0] = (unsigned char *) rh->decoded;
+			scvec[0] = (unsigned char *) rspamd_mime_header_get_decoded(rh);
 			lenvec[0] = strlen(rh->decoded);
 		}
 		else {
@@ -1377,13 +1831,6 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 				lenvec[i + 1] = 0;
 			}
 		}
-
-		ret = rspamd_re_cache_process_regexp_data(rt, re,
-												  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-		msg_debug_re_task("checked sa body regexp: %s -> %d",
-						  rspamd_regexp_get_pattern(re), ret);
-		g_free(scvec);
-		g_free(lenvec);
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -1393,1103 +1840,2644 @@ rspamd_re_cache_exec_re(struct rspamd_task *task,
 		 * Multiline expressions will need to be used to match strings that are
 		 * broken by line breaks.
 		 */
-		if (MESSAGE_FIELD(task, text_parts)->len > 0) {
-			cnt = MESSAGE_FIELD(task, text_parts)->len;
-			scvec = g_malloc(sizeof(*scvec) * cnt);
-			lenvec = g_malloc(sizeof(*lenvec) * cnt);
+		if (MESSAGE_FIELD(task, text_parts)->len == 0) {
+			return;
+		}
+
+		cnt = MESSAGE_FIELD(task, text_parts)->len;
+		scvec = g_malloc(sizeof(*scvec) * cnt);
+		lenvec = g_malloc(sizeof(*lenvec) * cnt);
 
-			for (i = 0; i < cnt; i++) {
-				text_part = g_ptr_array_index(MESSAGE_FIELD(task, text_parts), i);
+		for (i = 0; i < cnt; i++) {
+			text_part = g_ptr_array_index(MESSAGE_FIELD(task, text_parts), i);
 
-				if (text_part->parsed.len > 0) {
-					scvec[i] = (unsigned char *) text_part->parsed.begin;
-					lenvec[i] = text_part->parsed.len;
+			if (text_part->parsed.len > 0) {
+				scvec[i] = (unsigned char *) text_part->parsed.begin;
+				lenvec[i] = text_part->parsed.len;
 
-					if (!IS_TEXT_PART_UTF(text_part)) {
-						raw = TRUE;
-					}
-				}
-				else {
-					scvec[i] = (unsigned char *) "";
-					lenvec[i] = 0;
+				if (!IS_TEXT_PART_UTF(text_part)) {
+					raw = TRUE;
 				}
 			}
-
-			ret = rspamd_re_cache_process_regexp_data(rt, re,
-													  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-			msg_debug_re_task("checked sa rawbody regexp: %s -> %d",
-							  rspamd_regexp_get_pattern(re), ret);
-			g_free(scvec);
-			g_free(lenvec);
+			else {
+				scvec[i] = (unsigned char *) "";
+				lenvec[i] = 0;
+			}
 		}
 		break;
 	case RSPAMD_RE_WORDS:
 	case RSPAMD_RE_STEMWORDS:
 	case RSPAMD_RE_RAWWORDS:
-		if (MESSAGE_FIELD(task, text_parts)->len > 0) {
-			cnt = 0;
-			raw = FALSE;
-
-			PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
-			{
-				if (text_part->utf_words) {
-					cnt += text_part->utf_words->len;
-				}
-			}
-
-			if (task->meta_words && task->meta_words->len > 0) {
-				cnt += task->meta_words->len;
+		PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
+		{
+			if (text_part->utf_words) {
+				cnt += text_part->utf_words->len;
 			}
+		}
 
-			if (cnt > 0) {
-				scvec = g_malloc(sizeof(*scvec) * cnt);
-				lenvec = g_malloc(sizeof(*lenvec) * cnt);
-
-				cnt = 0;
+		if (task->meta_words && task->meta_words->len > 0) {
+			cnt += task->meta_words->len;
+		}
 
-				PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
-				{
-					if (text_part->utf_words) {
-						cnt = rspamd_process_words_vector(text_part->utf_words,
-														  scvec, lenvec, re_class, cnt, &raw);
-					}
-				}
+		if (cnt == 0) {
+			return;
+		}
 
-				if (task->meta_words) {
-					cnt = rspamd_process_words_vector(task->meta_words,
-													  scvec, lenvec, re_class, cnt, &raw);
-				}
+		scvec = g_malloc(sizeof(*scvec) * cnt);
+		lenvec = g_malloc(sizeof(*lenvec) * cnt);
 
-				ret = rspamd_re_cache_process_regexp_data(rt, re,
-														  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
+		cnt = 0;
 
-				msg_debug_re_task("checked sa words regexp: %s -> %d",
-								  rspamd_regexp_get_pattern(re), ret);
-				g_free(scvec);
-				g_free(lenvec);
+		PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, text_part)
+		{
+			if (text_part->utf_words) {
+				cnt = rspamd_process_words_vector(text_part->utf_words,
+												  scvec, lenvec, re_class, cnt, &raw);
 			}
 		}
-		break;
-	case RSPAMD_RE_SELECTOR:
-		if (rspamd_re_cache_process_selector(task, rt,
-											 re_class->type_data,
-											 (unsigned char ***) &scvec,
-											 &lenvec, &cnt)) {
-
-			ret = rspamd_re_cache_process_regexp_data(rt, re,
-													  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
-			msg_debug_re_task("checked selector(%s) regexp: %s -> %d",
-							  re_class->type_data,
-							  rspamd_regexp_get_pattern(re), ret);
 
-			/* Do not free vectors as they are managed by rt->sel_cache */
+		if (task->meta_words) {
+			cnt = rspamd_process_words_vector(task->meta_words,
+											  scvec, lenvec, re_class, cnt, &raw);
 		}
 		break;
-	case RSPAMD_RE_MAX:
-		msg_err_task("regexp of class invalid has been called: %s",
-					 rspamd_regexp_get_pattern(re));
-		break;
-	}
-
-#if WITH_HYPERSCAN
-	if (processed_hyperscan) {
-		rspamd_re_cache_finish_class(task, rt, re_class, class_name);
+	default:
+		return;
 	}
-#endif
 
-	setbit(rt->checked, re_id);
-
-	return rt->results[re_id];
+	inputs->scvec = scvec;
+	inputs->lenvec = lenvec;
+	inputs->cnt = cnt;
+	inputs->raw = raw;
 }
 
-int rspamd_re_cache_process(struct rspamd_task *task,
-							rspamd_regexp_t *re,
-							enum rspamd_re_type type,
-							gconstpointer type_data,
-							gsize datalen,
-							gboolean is_strong)
+/*
+ * Returns inputs of a class collecting them on the first call within a task,
+ * so e.g. all urls or words are not enumerated for each regexp of a class
+ */
+static const struct rspamd_re_class_inputs *
+rspamd_re_cache_get_class_inputs(struct rspamd_task *task,
+								 struct rspamd_re_runtime *rt,
+								 struct rspamd_re_class *re_class)
 {
-	uint64_t re_id;
-	struct rspamd_re_class *re_class;
-	struct rspamd_re_cache *cache;
-	struct rspamd_re_runtime *rt;
-
-	g_assert(task != NULL);
-	rt = task->re_rt;
-	g_assert(rt != NULL);
-	g_assert(re != NULL);
-
-	cache = rt->cache;
-	re_id = rspamd_regexp_get_cache_id(re);
+	struct rspamd_re_class_inputs inputs;
+	khiter_t k;
+	int r;
 
-	if (re_id == RSPAMD_INVALID_ID || re_id > cache->nre) {
-		msg_err_task("re '%s' has no valid id for the cache",
-					 rspamd_regexp_get_pattern(re));
-		return 0;
+	if (rt->inputs_cache == NULL) {
+		rt->inputs_cache = kh_init(class_inputs_hash);
 	}
 
-	if (isset(rt->checked, re_id)) {
-		/* Fast path */
-		rt->stat.regexp_fast_cached++;
-		return rt->results[re_id];
+	k = kh_get(class_inputs_hash, rt->inputs_cache, re_class->id);
+
+	if (k == kh_end(rt->inputs_cache)) {
+		memset(&inputs, 0, sizeof(inputs));
+		rspamd_re_cache_collect_class_inputs(task, re_class, &inputs);
+		k = kh_put(class_inputs_hash, rt->inputs_cache, re_class->id, &r);
+		kh_value(rt->inputs_cache, k) = inputs;
+		rt->stat.inputs_collected++;
 	}
 	else {
-		/* Slow path */
-		re_class = rspamd_regexp_get_class(re);
-
-		if (re_class == NULL) {
-			msg_err_task("cannot find re class for regexp '%s'",
-						 rspamd_regexp_get_pattern(re));
-			return 0;
-		}
-
-		return rspamd_re_cache_exec_re(task, rt, re, re_class,
-									   is_strong);
+		rt->stat.inputs_cached++;
 	}
 
-	return 0;
+	return &kh_value(rt->inputs_cache, k);
 }
 
-int rspamd_re_cache_process_ffi(void *ptask,
-								void *pre,
-								int type,
-								void *type_data,
-								int is_strong)
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static unsigned int
+rspamd_re_cache_exec_re(struct rspamd_task *task,
+						struct rspamd_re_runtime *rt,
+						rspamd_regexp_t *re,
+						struct rspamd_re_class *re_class,
+						gboolean is_strong)
 {
-	struct rspamd_lua_regexp **lua_re = pre;
-	struct rspamd_task **real_task = ptask;
-	gsize typelen = 0;
-
-	if (type_data) {
-		typelen = strlen(type_data);
-	}
+	unsigned int ret = 0, i, re_id;
+	struct rspamd_mime_header *rh;
+	const char *in;
+	const unsigned char **scvec = NULL;
+	unsigned int *lenvec = NULL;
+	gboolean raw = FALSE, processed_hyperscan = FALSE;
+	struct rspamd_mime_part *mime_part;
+	const struct rspamd_re_class_inputs *inputs;
+	unsigned int len = 0, cnt = 0;
+	const char *class_name;
 
-	return rspamd_re_cache_process(*real_task, (*lua_re)->re,
-								   type, type_data, typelen, is_strong);
-}
-
-void rspamd_re_cache_runtime_destroy(struct rspamd_re_runtime *rt)
-{
-	g_assert(rt != NULL);
-
-	if (rt->sel_cache) {
-		struct rspamd_re_selector_result sr;
+	class_name = rspamd_re_cache_type_to_string(re_class->type);
+	msg_debug_re_task("start check re type: %s: /%s/",
+					  class_name,
+					  rspamd_regexp_get_pattern(re));
+	re_id = rspamd_regexp_get_cache_id(re);
 
-		kh_foreach_value(rt->sel_cache, sr, {
-			for (unsigned int i = 0; i < sr.cnt; i++) {
-				g_free((gpointer) sr.scvec[i]);
+	switch (re_class->type) {
+	case RSPAMD_RE_HEADER:
+	case RSPAMD_RE_RAWHEADER:
+		if (!is_strong) {
+			/* Values of headers are shared by all regexps of a class */
+			inputs = rspamd_re_cache_get_class_inputs(task, rt, re_class);
+
+			if (inputs->cnt > 0) {
+				ret = rspamd_re_cache_process_regexp_data(rt, re, task,
+														  inputs->scvec, inputs->lenvec, inputs->cnt,
+														  inputs->raw, &processed_hyperscan);
 			}
 
-			g_free(sr.scvec);
-			g_free(sr.lenvec);
-		});
-		kh_destroy(selectors_results_hash, rt->sel_cache);
-	}
-
-	REF_RELEASE(rt->cache);
-	g_free(rt);
-}
-
-void rspamd_re_cache_unref(struct rspamd_re_cache *cache)
-{
-	if (cache) {
-		REF_RELEASE(cache);
-	}
-}
-
-struct rspamd_re_cache *
-rspamd_re_cache_ref(struct rspamd_re_cache *cache)
-{
-	if (cache) {
-		REF_RETAIN(cache);
-	}
-
-	return cache;
-}
+			msg_debug_re_task("checked header(%s) regexp: %s -> %d",
+							  (const char *) re_class->type_data,
+							  rspamd_regexp_get_pattern(re),
+							  ret);
+			break;
+		}
 
-unsigned int rspamd_re_cache_set_limit(struct rspamd_re_cache *cache, unsigned int limit)
-{
-	unsigned int old;
+		/* Get list of specified headers */
+		rh = rspamd_message_get_header_array(task,
+											 re_class->type_data, FALSE);
 
-	g_assert(cache != NULL);
+		if (rh) {
+			ret = rspamd_re_cache_process_headers_list(task, rt, re,
+													   re_class, rh, is_strong, &processed_hyperscan);
+			msg_debug_re_task("checked header(%s) regexp: %s -> %d",
+							  (const char *) re_class->type_data,
+							  rspamd_regexp_get_pattern(re),
+							  ret);
+		}
+		break;
+	case RSPAMD_RE_ALLHEADER:
+		raw = TRUE;
+		in = MESSAGE_FIELD(task, raw_headers_content).begin;
+		len = MESSAGE_FIELD(task, raw_headers_content).len;
+		ret = rspamd_re_cache_process_regexp_data(rt, re,
+												  task, (const unsigned char **) &in, &len, 1, raw, &processed_hyperscan);
+		msg_debug_re_task("checked allheader regexp: %s -> %d",
+						  rspamd_regexp_get_pattern(re), ret);
+		break;
+	case RSPAMD_RE_MIMEHEADER:
+		if (!is_strong) {
+			inputs = rspamd_re_cache_get_class_inputs(task, rt, re_class);
 
-	old = cache->max_re_data;
-	cache->max_re_data = limit;
+			if (inputs->cnt > 0) {
+				ret = rspamd_re_cache_process_regexp_data(rt, re, task,
+														  inputs->scvec, inputs->lenvec, inputs->cnt,
+														  inputs->raw, &processed_hyperscan);
+			}
 
-	return old;
-}
+			msg_debug_re_task("checked mime header(%s) regexp: %s -> %d",
+							  (const char *) re_class->type_data,
+							  rspamd_regexp_get_pattern(re),
+							  ret);
+			break;
+		}
 
-const char *
-rspamd_re_cache_type_to_string(enum rspamd_re_type type)
-{
-	const char *ret = "unknown";
+		PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, mime_part)
+		{
+			if (mime_part->parent_part == NULL ||
+				!IS_PART_MULTIPART(mime_part->parent_part) ||
+				IS_PART_MESSAGE(mime_part)) {
+				/* We filter parts that have no multipart parent or are a messages here */
+				continue;
+			}
+			rh = rspamd_message_get_header_from_hash(mime_part->raw_headers,
+													 re_class->type_data, FALSE);
 
-	switch (type) {
-	case RSPAMD_RE_HEADER:
-		ret = "header";
-		break;
-	case RSPAMD_RE_RAWHEADER:
-		ret = "raw header";
-		break;
-	case RSPAMD_RE_MIMEHEADER:
-		ret = "mime header";
-		break;
-	case RSPAMD_RE_ALLHEADER:
-		ret = "all headers";
+			if (rh) {
+				ret += rspamd_re_cache_process_headers_list(task, rt, re,
+															re_class, rh, is_strong, &processed_hyperscan);
+			}
+			msg_debug_re_task("checked mime header(%s) regexp: %s -> %d",
+							  (const char *) re_class->type_data,
+							  rspamd_regexp_get_pattern(re),
+							  ret);
+		}
 		break;
 	case RSPAMD_RE_MIME:
-		ret = "part";
-		break;
 	case RSPAMD_RE_RAWMIME:
-		ret = "raw part";
-		break;
-	case RSPAMD_RE_BODY:
-		ret = "rawbody";
-		break;
 	case RSPAMD_RE_URL:
-		ret = "url";
-		break;
 	case RSPAMD_RE_EMAIL:
-		ret = "email";
-		break;
 	case RSPAMD_RE_SABODY:
-		ret = "sa body";
-		break;
 	case RSPAMD_RE_SARAWBODY:
-		ret = "sa raw body";
-		break;
-	case RSPAMD_RE_SELECTOR:
-		ret = "selector";
-		break;
 	case RSPAMD_RE_WORDS:
-		ret = "words";
-		break;
+	case RSPAMD_RE_STEMWORDS:
 	case RSPAMD_RE_RAWWORDS:
-		ret = "raw_words";
+		inputs = rspamd_re_cache_get_class_inputs(task, rt, re_class);
+		ret = rspamd_re_cache_process_regexp_data(rt, re, task,
+												  inputs->scvec, inputs->lenvec, inputs->cnt,
+												  inputs->raw, &processed_hyperscan);
+		msg_debug_re_task("checked %s regexp: %s -> %d",
+						  class_name, rspamd_regexp_get_pattern(re), ret);
 		break;
-	case RSPAMD_RE_STEMWORDS:
-		ret = "stem_words";
+	case RSPAMD_RE_BODY:
+		raw = TRUE;
+		in = task->msg.begin;
+		len = task->msg.len;
+
+		ret = rspamd_re_cache_process_regexp_data(rt, re, task,
+												  (const unsigned char **) &in, &len, 1, raw, &processed_hyperscan);
+		msg_debug_re_task("checked rawbody regexp: %s -> %d",
+						  rspamd_regexp_get_pattern(re), ret);
+		break;
+	case RSPAMD_RE_SELECTOR:
+		if (rspamd_re_cache_process_selector(task, rt,
+											 re_class->type_data,
+											 (unsigned char ***) &scvec,
+											 &lenvec, &cnt)) {
+
+			ret = rspamd_re_cache_process_regexp_data(rt, re,
+													  task, scvec, lenvec, cnt, raw, &processed_hyperscan);
+			msg_debug_re_task("checked selector(%s) regexp: %s -> %d",
+							  re_class->type_data,
+							  rspamd_regexp_get_pattern(re), ret);
+
+			/* Do not free vectors as they are managed by rt->sel_cache */
+		}
 		break;
 	case RSPAMD_RE_MAX:
-	default:
-		ret = "invalid class";
+		msg_err_task("regexp of class invalid has been called: %s",
+					 rspamd_regexp_get_pattern(re));
 		break;
 	}
 
-	return ret;
+#if WITH_HYPERSCAN
+	if (processed_hyperscan) {
+		rspamd_re_cache_finish_shard(task, rt,
+									 rspamd_re_cache_get_shard(re_class, re), class_name);
+	}
+#endif
+
+	setbit(rt->checked, re_id);
+
+	return rt->results[re_id];
 }
 
-enum rspamd_re_type
-rspamd_re_cache_type_from_string(const char *str)
+/*
+ * Classes that depend merely on the decoded parts and the subject, so their
+ * results are the same for all messages with the same body
+ */
+static inline gboolean
+rspamd_re_cache_is_body_class(enum rspamd_re_type type)
 {
-	enum rspamd_re_type ret;
-	uint64_t h;
+	return type == RSPAMD_RE_MIME || type == RSPAMD_RE_SABODY;
+}
 
-	/*
-	 * To optimize this function, we apply hash to input string and
-	 * pre-select it from the values
-	 */
+static void
+rspamd_re_cache_load_body_results(struct rspamd_task *task,
+								  struct rspamd_re_runtime *rt)
+{
+	struct rspamd_re_body_results *res;
+	struct rspamd_mime_part *part;
+	rspamd_cryptobox_hash_state_t st;
+	unsigned char out[rspamd_cryptobox_HASHBYTES];
+	const unsigned char *results;
+	const char *subject;
+	unsigned int i;
 
-	if (str != NULL) {
-		h = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
-												str, strlen(str), 0xdeadbabe);
+	rt->body_lookup_done = TRUE;
 
-		switch (h) {
-		case G_GUINT64_CONSTANT(0x298b9c8a58887d44): /* header */
-			ret = RSPAMD_RE_HEADER;
-			break;
-		case G_GUINT64_CONSTANT(0x467bfb5cd7ddf890): /* rawheader */
-			ret = RSPAMD_RE_RAWHEADER;
-			break;
-		case G_GUINT64_CONSTANT(0xda081341fb600389): /* mime */
-			ret = RSPAMD_RE_MIME;
-			break;
-		case G_GUINT64_CONSTANT(0xc35831e067a8221d): /* rawmime */
-			ret = RSPAMD_RE_RAWMIME;
-			break;
-		case G_GUINT64_CONSTANT(0xc625e13dbe636de2): /* body */
-		case G_GUINT64_CONSTANT(0xCCDEBA43518F721C): /* message */
-			ret = RSPAMD_RE_BODY;
-			break;
-		case G_GUINT64_CONSTANT(0x286edbe164c791d2): /* url */
-		case G_GUINT64_CONSTANT(0x7D9ACDF6685661A1): /* uri */
-			ret = RSPAMD_RE_URL;
-			break;
-		case G_GUINT64_CONSTANT(0x7e232b0f60b571be): /* email */
-			ret = RSPAMD_RE_EMAIL;
-			break;
-		case G_GUINT64_CONSTANT(0x796d62205a8778c7): /* allheader */
-			ret = RSPAMD_RE_ALLHEADER;
-			break;
-		case G_GUINT64_CONSTANT(0xa3c6c153b3b00a5e): /* mimeheader */
-			ret = RSPAMD_RE_MIMEHEADER;
-			break;
-		case G_GUINT64_CONSTANT(0x7794501506e604e9): /* sabody */
-			ret = RSPAMD_RE_SABODY;
-			break;
-		case G_GUINT64_CONSTANT(0x28828962E7D2A05F): /* sarawbody */
-			ret = RSPAMD_RE_SARAWBODY;
-			break;
-		default:
-			ret = RSPAMD_RE_MAX;
-			break;
-		}
+	if (task->message == NULL || rt->cache->body_results == NULL) {
+		return;
 	}
-	else {
-		ret = RSPAMD_RE_MAX;
+
+	rspamd_cryptobox_hash_init(&st, NULL, 0);
+
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		rspamd_cryptobox_hash_update(&st, part->digest, sizeof(part->digest));
 	}
 
-	return ret;
-}
+	subject = MESSAGE_FIELD(task, subject);
+
+	if (subject) {
+		rspamd_cryptobox_hash_update(&st, subject, strlen(subject) + 1);
+	}
+
+	rspamd_cryptobox_hash_final(&st, out);
+	memcpy(rt->body_key, out, sizeof(rt->body_key));
+	rt->has_body_key = TRUE;
+
+	res = rspamd_lru_hash_lookup(rt->cache->body_results, rt->body_key,
+								 (time_t) task->task_timestamp);
+
+	if (res == NULL) {
+		return;
+	}
+
+	results = (const unsigned char *) (res->ids + res->nids);
+
+	for (i = 0; i < res->nids; i++) {
+		if (!isset(rt->checked, res->ids[i])) {
+			setbit(rt->checked, res->ids[i]);
+			rt->results[res->ids[i]] = results[i];
+		}
+	}
+
+	rt->body_nloaded = res->nids;
+	msg_debug_re_task("reused results of %ud body regexps", res->nids);
+}
+
+static void
+rspamd_re_cache_store_body_results(struct rspamd_re_runtime *rt)
+{
+	struct rspamd_re_cache *cache = rt->cache;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_body_results *res;
+	unsigned char *results;
+	unsigned int i, n = 0;
+
+	PTR_ARRAY_FOREACH(cache->re, i, elt)
+	{
+		re_class = rspamd_regexp_get_class(elt->re);
+
+		/* Lua conditions can use anything from a task */
+		if (isset(rt->checked, i) && elt->lua_cbref == -1 &&
+			re_class && rspamd_re_cache_is_body_class(re_class->type)) {
+			n++;
+		}
+	}
+
+	if (n <= rt->body_nloaded) {
+		/* Nothing new to remember */
+		return;
+	}
+
+	res = g_malloc(sizeof(*res) + n * (sizeof(uint32_t) + 1));
+	memcpy(res->key, rt->body_key, sizeof(res->key));
+	res->nids = 0;
+	results = (unsigned char *) (res->ids + n);
+
+	PTR_ARRAY_FOREACH(cache->re, i, elt)
+	{
+		re_class = rspamd_regexp_get_class(elt->re);
+
+		if (isset(rt->checked, i) && elt->lua_cbref == -1 &&
+			re_class && rspamd_re_cache_is_body_class(re_class->type)) {
+			results[res->nids] = rt->results[i];
+			res->ids[res->nids++] = i;
+		}
+	}
+
+	rspamd_lru_hash_insert(cache->body_results, res->key, res,
+						   (time_t) ev_time(), 0);
+}
+
+int rspamd_re_cache_process(struct rspamd_task *task,
+							rspamd_regexp_t *re,
+							enum rspamd_re_type type,
+							gconstpointer type_data,
+							gsize datalen,
+							gboolean is_strong)
+{
+	uint64_t re_id;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache *cache;
+	struct rspamd_re_runtime *rt;
+
+	g_assert(task != NULL);
+	rt = task->re_rt;
+	g_assert(rt != NULL);
+	g_assert(re != NULL);
+
+	cache = rt->cache;
+	re_id = rspamd_regexp_get_cache_id(re);
+
+	if (re_id == RSPAMD_INVALID_ID || re_id > cache->nre) {
+		msg_err_task("re '%s' has no valid id for the cache",
+					 rspamd_regexp_get_pattern(re));
+		return 0;
+	}
+
+	if (isset(rt->checked, re_id)) {
+		/* Fast path */
+		rt->stat.regexp_fast_cached++;
+		return rt->results[re_id];
+	}
+	else {
+		/* Slow path */
+		re_class = rspamd_regexp_get_class(re);
+
+		if (re_class == NULL) {
+			msg_err_task("cannot find re class for regexp '%s'",
+						 rspamd_regexp_get_pattern(re));
+			return 0;
+		}
+
+		if (!rt->body_lookup_done && rspamd_re_cache_is_body_class(re_class->type)) {
+			rspamd_re_cache_load_body_results(task, rt);
+
+			if (isset(rt->checked, re_id)) {
+				rt->stat.regexp_fast_cached++;
+				return rt->results[re_id];
+			}
+		}
+
+		if (G_UNLIKELY(task->trace) && rt->has_hs) {
+			/* With hyperscan it is normally a scan of the whole class */
+			unsigned int ret;
+
+			rspamd_tracing_span_begin(task->trace, RSPAMD_TRACE_SPAN_REGEXP,
+									  rspamd_re_cache_type_to_string(re_class->type),
+									  re_class);
+			ret = rspamd_re_cache_exec_re(task, rt, re, re_class, is_strong);
+			rspamd_tracing_span_end(task->trace, re_class);
+
+			return ret;
+		}
+
+		return rspamd_re_cache_exec_re(task, rt, re, re_class,
+									   is_strong);
+	}
+
+	return 0;
+}
+
+int rspamd_re_cache_process_ffi(void *ptask,
+								void *pre,
+								int type,
+								void *type_data,
+								int is_strong)
+{
+	struct rspamd_lua_regexp **lua_re = pre;
+	struct rspamd_task **real_task = ptask;
+	gsize typelen = 0;
+
+	if (type_data) {
+		typelen = strlen(type_data);
+	}
+
+	return rspamd_re_cache_process(*real_task, (*lua_re)->re,
+								   type, type_data, typelen, is_strong);
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Collects buffers of a task for the batched classes, returns number of buffers
+ */
+static unsigned int
+rspamd_re_cache_batch_collect(struct rspamd_task *task,
+							  struct rspamd_re_class *re_class,
+							  GArray *ins, GArray *lens)
+{
+	const unsigned char *in;
+	unsigned int len;
+	struct rspamd_url *url;
+
+	g_array_set_size(ins, 0);
+	g_array_set_size(lens, 0);
+
+	if (task->message == NULL) {
+		return 0;
+	}
+
+	switch (re_class->type) {
+	case RSPAMD_RE_ALLHEADER:
+		in = (const unsigned char *) MESSAGE_FIELD(task, raw_headers_content).begin;
+		len = MESSAGE_FIELD(task, raw_headers_content).len;
+
+		if (in && len > 0) {
+			g_array_append_val(ins, in);
+			g_array_append_val(lens, len);
+		}
+		break;
+	case RSPAMD_RE_BODY:
+		in = (const unsigned char *) task->msg.begin;
+		len = task->msg.len;
+
+		if (in && len > 0) {
+			g_array_append_val(ins, in);
+			g_array_append_val(lens, len);
+		}
+		break;
+	case RSPAMD_RE_URL:
+		kh_foreach_key(MESSAGE_FIELD(task, urls), url, {
+			if ((url->protocol & PROTOCOL_MAILTO)) {
+				continue;
+			}
+
+			if (url->urllen > 0 && !(url->flags & RSPAMD_URL_FLAG_IMAGE)) {
+				in = (const unsigned char *) url->string;
+				len = url->urllen;
+				g_array_append_val(ins, in);
+				g_array_append_val(lens, len);
+			}
+		});
+		break;
+	default:
+		break;
+	}
+
+	return ins->len;
+}
+#endif
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Returns TRUE if a shard has been already scanned for a task (e.g. by a regexp
+ * symbol or by a previous batch), as scanning it again would count hits twice
+ */
+static gboolean
+rspamd_re_cache_shard_checked(struct rspamd_re_runtime *rt,
+							  struct rspamd_re_class_shard *shard)
+{
+	unsigned int i;
+
+	for (i = 0; i < shard->nhs; i++) {
+		if (isset(rt->checked, shard->hs_ids[i])) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+#endif
+
+#ifdef WITH_HYPERSCAN
+/* Shard of a class to be scanned for a task of a batch */
+struct rspamd_re_cache_batch_elt {
+	struct rspamd_task *task;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_class_shard *shard;
+	/* Inputs of the task for this class in the batch arrays */
+	unsigned int ins_off;
+	unsigned int nins;
+	gboolean processed;
+};
+
+/* Hyperscan match found by a batch scan, it is applied by `batch_finish` */
+struct rspamd_re_cache_batch_match {
+	unsigned int elt;
+	unsigned int input;
+	unsigned int id;
+	unsigned long long from;
+	unsigned long long to;
+};
+
+struct rspamd_re_cache_batch_scan_cbdata {
+	struct rspamd_re_cache_batch *batch;
+	unsigned int elt;
+	unsigned int input;
+};
+#endif
+
+struct rspamd_re_cache_batch {
+	struct rspamd_re_cache *cache;
+	GArray *elts;
+	GArray *ins;
+	GArray *lens;
+	GArray *matches;
+};
+
+static void
+rspamd_re_cache_batch_free(struct rspamd_re_cache_batch *batch)
+{
+	g_array_free(batch->elts, TRUE);
+	g_array_free(batch->ins, TRUE);
+	g_array_free(batch->lens, TRUE);
+	g_array_free(batch->matches, TRUE);
+	rspamd_re_cache_unref(batch->cache);
+	g_free(batch);
+}
+
+struct rspamd_re_cache_batch *
+rspamd_re_cache_batch_new(struct rspamd_task **tasks, unsigned int ntasks)
+{
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_cache *cache = NULL;
+	struct rspamd_re_cache_batch *batch;
+	struct rspamd_re_cache_batch_elt elt;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_class_shard *shard;
+	struct rspamd_re_runtime *rt;
+	struct rspamd_task *task;
+	GHashTableIter it;
+	gpointer k, v;
+	GArray *ins, *lens;
+	unsigned int i, n, off, si;
+
+	if (ntasks == 0) {
+		return NULL;
+	}
+
+	/* All tasks must share the same cache, otherwise regexp ids are meaningless */
+	for (i = 0; i < ntasks; i++) {
+		g_assert(tasks[i] != NULL && tasks[i]->re_rt != NULL);
+
+		if (cache == NULL) {
+			cache = tasks[i]->re_rt->cache;
+		}
+		else if (tasks[i]->re_rt->cache != cache) {
+			msg_err_re_cache("cannot batch tasks that use different re caches");
+
+			return NULL;
+		}
+	}
+
+	if (cache->disable_hyperscan || !tasks[0]->re_rt->has_hs) {
+		return NULL;
+	}
+
+	batch = g_malloc0(sizeof(*batch));
+	batch->cache = cache;
+	REF_RETAIN(cache);
+	batch->elts = g_array_new(FALSE, FALSE, sizeof(struct rspamd_re_cache_batch_elt));
+	batch->ins = g_array_sized_new(FALSE, FALSE, sizeof(const unsigned char *), 16);
+	batch->lens = g_array_sized_new(FALSE, FALSE, sizeof(unsigned int), 16);
+	batch->matches = g_array_new(FALSE, FALSE, sizeof(struct rspamd_re_cache_batch_match));
+	ins = g_array_sized_new(FALSE, FALSE, sizeof(const unsigned char *), 16);
+	lens = g_array_sized_new(FALSE, FALSE, sizeof(unsigned int), 16);
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	/*
+	 * Elements are ordered class by class, so the database stays warm whilst
+	 * we walk over all tasks in the batch
+	 */
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->has_utf8) {
+			continue;
+		}
+
+		if (re_class->type != RSPAMD_RE_ALLHEADER &&
+			re_class->type != RSPAMD_RE_BODY &&
+			re_class->type != RSPAMD_RE_URL) {
+			continue;
+		}
+
+		for (i = 0; i < ntasks; i++) {
+			task = tasks[i];
+			rt = task->re_rt;
+			n = G_MAXUINT;
+			off = 0;
+
+			for (si = 0; si < re_class->nshards; si++) {
+				shard = &re_class->shards[si];
+
+				if (shard->hs_db == NULL || rspamd_re_cache_shard_checked(rt, shard)) {
+					continue;
+				}
+
+				if (n == G_MAXUINT) {
+					/* Buffers are collected once the first shard needs them */
+					n = rspamd_re_cache_batch_collect(task, re_class, ins, lens);
+					off = batch->ins->len;
+					g_array_append_vals(batch->ins, ins->data, n);
+					g_array_append_vals(batch->lens, lens->data, n);
+				}
+
+				elt.task = task;
+				elt.re_class = re_class;
+				elt.shard = shard;
+				elt.ins_off = off;
+				elt.nins = n;
+				elt.processed = FALSE;
+				g_array_append_val(batch->elts, elt);
+			}
+		}
+	}
+
+	g_array_free(ins, TRUE);
+	g_array_free(lens, TRUE);
+
+	if (batch->elts->len == 0) {
+		rspamd_re_cache_batch_free(batch);
+
+		return NULL;
+	}
+
+	return batch;
+#else
+	return NULL;
+#endif
+}
+
+#ifdef WITH_HYPERSCAN
+static int
+rspamd_re_cache_batch_scan_cb(unsigned int id,
+							  unsigned long long from,
+							  unsigned long long to,
+							  unsigned int flags,
+							  void *ud)
+{
+	struct rspamd_re_cache_batch_scan_cbdata *cbd = ud;
+	struct rspamd_re_cache_batch_match m;
+
+	/* Merely record a match, as runtimes and lua conditions belong to the loop thread */
+	m.elt = cbd->elt;
+	m.input = cbd->input;
+	m.id = id;
+	m.from = from;
+	m.to = to;
+	g_array_append_val(cbd->batch->matches, m);
+
+	return 0;
+}
+#endif
+
+void rspamd_re_cache_batch_scan(struct rspamd_re_cache_batch *batch)
+{
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_cache_batch_scan_cbdata cbd;
+	struct rspamd_re_cache_batch_elt *elt;
+	hs_scratch_t *scratch;
+	unsigned int i, j;
+
+	scratch = rspamd_hyperscan_scratch_acquire();
+
+	if (scratch == NULL) {
+		return;
+	}
+
+	cbd.batch = batch;
+
+	for (i = 0; i < batch->elts->len; i++) {
+		elt = &g_array_index(batch->elts, struct rspamd_re_cache_batch_elt, i);
+		cbd.elt = i;
+
+		for (j = 0; j < elt->nins; j++) {
+			cbd.input = elt->ins_off + j;
+
+			if (hs_scan(rspamd_hyperscan_get_database(elt->shard->hs_db),
+						(const char *) g_array_index(batch->ins, const unsigned char *, cbd.input),
+						g_array_index(batch->lens, unsigned int, cbd.input), 0,
+						scratch,
+						rspamd_re_cache_batch_scan_cb, &cbd) == HS_SUCCESS) {
+				elt->processed = TRUE;
+			}
+		}
+	}
+
+	rspamd_hyperscan_scratch_release(scratch);
+#endif
+}
+
+unsigned int
+rspamd_re_cache_batch_finish(struct rspamd_re_cache_batch *batch)
+{
+	unsigned int nscanned = 0;
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	struct rspamd_re_cache_batch_elt *elt;
+	struct rspamd_re_cache_batch_match *m;
+	struct rspamd_re_runtime *rt;
+	unsigned int i, j, mi = 0;
+	gboolean skip;
+
+	for (i = 0; i < batch->elts->len; i++) {
+		elt = &g_array_index(batch->elts, struct rspamd_re_cache_batch_elt, i);
+		rt = elt->task->re_rt;
+		/*
+		 * The task could scan the shard itself whilst the batch has been
+		 * running in a thread, so its results are already there
+		 */
+		skip = rspamd_re_cache_shard_checked(rt, elt->shard);
+
+		/* Matches are recorded in order of elements */
+		for (; mi < batch->matches->len; mi++) {
+			m = &g_array_index(batch->matches, struct rspamd_re_cache_batch_match, mi);
+
+			if (m->elt != i) {
+				break;
+			}
+
+			if (!skip) {
+				cbdata.ins = &g_array_index(batch->ins, const unsigned char *, m->input);
+				cbdata.lens = &g_array_index(batch->lens, unsigned int, m->input);
+				cbdata.count = 1;
+				cbdata.re = NULL;
+				cbdata.rt = rt;
+				cbdata.task = elt->task;
+				cbdata.shard = elt->shard;
+				rspamd_re_cache_hyperscan_cb(m->id, m->from, m->to, 0, &cbdata);
+			}
+		}
+
+		if (skip) {
+			continue;
+		}
+
+		for (j = 0; j < elt->nins; j++) {
+			rt->stat.bytes_scanned += g_array_index(batch->lens, unsigned int,
+													elt->ins_off + j);
+		}
+
+		if (elt->processed || elt->nins == 0) {
+			/* Absence of data is treated as no match, like in the per-task path */
+			rspamd_re_cache_finish_shard(elt->task, rt, elt->shard,
+										 rspamd_re_cache_type_to_string(elt->re_class->type));
+			nscanned++;
+		}
+	}
+#endif
+
+	rspamd_re_cache_batch_free(batch);
+
+	return nscanned;
+}
+
+unsigned int
+rspamd_re_cache_process_batch(struct rspamd_task **tasks, unsigned int ntasks)
+{
+	struct rspamd_re_cache_batch *batch;
+
+	batch = rspamd_re_cache_batch_new(tasks, ntasks);
+
+	if (batch == NULL) {
+		return 0;
+	}
+
+	rspamd_re_cache_batch_scan(batch);
+
+	return rspamd_re_cache_batch_finish(batch);
+}
+
+void rspamd_re_cache_runtime_destroy(struct rspamd_re_runtime *rt)
+{
+	g_assert(rt != NULL);
+
+	if (rt->has_body_key) {
+		rspamd_re_cache_store_body_results(rt);
+	}
+
+	if (rt->sel_cache) {
+		struct rspamd_re_selector_result sr;
+
+		kh_foreach_value(rt->sel_cache, sr, {
+			for (unsigned int i = 0; i < sr.cnt; i++) {
+				g_free((gpointer) sr.scvec[i]);
+			}
+
+			g_free(sr.scvec);
+			g_free(sr.lenvec);
+		});
+		kh_destroy(selectors_results_hash, rt->sel_cache);
+	}
+
+	if (rt->inputs_cache) {
+		struct rspamd_re_class_inputs inputs;
+
+		kh_foreach_value(rt->inputs_cache, inputs, {
+			g_free(inputs.scvec);
+			g_free(inputs.lenvec);
+		});
+		kh_destroy(class_inputs_hash, rt->inputs_cache);
+	}
+
+	if (rt->lit_cache) {
+		unsigned char *found;
+
+		kh_foreach_value(rt->lit_cache, found, {
+			g_free(found);
+		});
+		kh_destroy(re_literals_hash, rt->lit_cache);
+	}
+
+	if (rt->profile_times) {
+		g_free(rt->profile_times);
+	}
+
+	REF_RELEASE(rt->cache);
+	g_free(rt);
+}
+
+void rspamd_re_cache_unref(struct rspamd_re_cache *cache)
+{
+	if (cache) {
+		REF_RELEASE(cache);
+	}
+}
+
+struct rspamd_re_cache *
+rspamd_re_cache_ref(struct rspamd_re_cache *cache)
+{
+	if (cache) {
+		REF_RETAIN(cache);
+	}
+
+	return cache;
+}
+
+unsigned int rspamd_re_cache_set_limit(struct rspamd_re_cache *cache, unsigned int limit)
+{
+	unsigned int old;
+
+	g_assert(cache != NULL);
+
+	old = cache->max_re_data;
+	cache->max_re_data = limit;
+
+	return old;
+}
+
+static int
+rspamd_re_cache_elt_cost_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_re_cache_elt *e1 = *(const struct rspamd_re_cache_elt **) a,
+									 *e2 = *(const struct rspamd_re_cache_elt **) b;
+
+	/* Most expensive regexps first */
+	if (e1->time_profiled != e2->time_profiled) {
+		return e1->time_profiled > e2->time_profiled ? -1 : 1;
+	}
+
+	if (e1->bytes_scanned != e2->bytes_scanned) {
+		return e1->bytes_scanned > e2->bytes_scanned ? -1 : 1;
+	}
+
+	return 0;
+}
+
+ucl_object_t *
+rspamd_re_cache_stat_ucl(struct rspamd_re_cache *cache, unsigned int limit)
+{
+	ucl_object_t *top, *ar, *obj;
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	GPtrArray *sorted;
+	unsigned int i;
+
+	g_assert(cache != NULL);
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ar = ucl_object_typed_new(UCL_ARRAY);
+	sorted = g_ptr_array_sized_new(cache->re->len);
+
+	PTR_ARRAY_FOREACH(cache->re, i, elt)
+	{
+		if (elt->nchecked > 0) {
+			g_ptr_array_add(sorted, elt);
+		}
+	}
+
+	g_ptr_array_sort(sorted, rspamd_re_cache_elt_cost_cmp);
+
+	PTR_ARRAY_FOREACH(sorted, i, elt)
+	{
+		if (limit > 0 && i >= limit) {
+			break;
+		}
+
+		re_class = rspamd_regexp_get_class(elt->re);
+		obj = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(obj,
+							  ucl_object_fromstring(rspamd_regexp_get_pattern(elt->re)),
+							  "pattern", 0, false);
+		ucl_object_insert_key(obj,
+							  ucl_object_fromstring(rspamd_re_cache_type_to_string(re_class->type)),
+							  "class", 0, false);
+		ucl_object_insert_key(obj,
+							  ucl_object_fromstring(elt->match_type == RSPAMD_RE_CACHE_PCRE ? "pcre" : "hyperscan"),
+							  "engine", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(elt->nchecked), "checked", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(elt->nmatched), "matched", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(elt->bytes_scanned), "bytes", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(elt->nprofiled), "profiled", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromdouble(elt->time_profiled), "time", 0, false);
+		ucl_object_insert_key(obj,
+							  ucl_object_fromdouble(elt->nprofiled > 0 ? elt->time_profiled / elt->nprofiled : 0.0),
+							  "avg_time", 0, false);
+		ucl_array_append(ar, obj);
+	}
+
+	g_ptr_array_free(sorted, TRUE);
+	ucl_object_insert_key(top, ar, "regexps", 0, false);
+
+#ifdef WITH_HYPERSCAN
+	GHashTableIter it;
+	gpointer k, v;
+
+	ar = ucl_object_typed_new(UCL_ARRAY);
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		for (i = 0; i < re_class->nshards; i++) {
+			struct rspamd_re_class_shard *shard = &re_class->shards[i];
+
+			if (shard->nscans == 0) {
+				continue;
+			}
+
+			obj = ucl_object_typed_new(UCL_OBJECT);
+			ucl_object_insert_key(obj,
+								  ucl_object_fromstring(rspamd_re_cache_type_to_string(re_class->type)),
+								  "class", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromstring(shard->hash), "hash", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromint(shard->nhs), "regexps", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromint(shard->nscans), "scans", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromint(shard->bytes_scanned), "bytes", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromint(shard->nprofiled), "profiled", 0, false);
+			ucl_object_insert_key(obj, ucl_object_fromdouble(shard->time_profiled), "time", 0, false);
+			ucl_array_append(ar, obj);
+		}
+	}
+
+	ucl_object_insert_key(top, ar, "shards", 0, false);
+#endif
+
+	ucl_object_insert_key(top, ucl_object_fromdouble(cache->profile_rate),
+						  "profile_rate", 0, false);
+
+	return top;
+}
+
+const char *
+rspamd_re_cache_type_to_string(enum rspamd_re_type type)
+{
+	const char *ret = "unknown";
+
+	switch (type) {
+	case RSPAMD_RE_HEADER:
+		ret = "header";
+		break;
+	case RSPAMD_RE_RAWHEADER:
+		ret = "raw header";
+		break;
+	case RSPAMD_RE_MIMEHEADER:
+		ret = "mime header";
+		break;
+	case RSPAMD_RE_ALLHEADER:
+		ret = "all headers";
+		break;
+	case RSPAMD_RE_MIME:
+		ret = "part";
+		break;
+	case RSPAMD_RE_RAWMIME:
+		ret = "raw part";
+		break;
+	case RSPAMD_RE_BODY:
+		ret = "rawbody";
+		break;
+	case RSPAMD_RE_URL:
+		ret = "url";
+		break;
+	case RSPAMD_RE_EMAIL:
+		ret = "email";
+		break;
+	case RSPAMD_RE_SABODY:
+		ret = "sa body";
+		break;
+	case RSPAMD_RE_SARAWBODY:
+		ret = "sa raw body";
+		break;
+	case RSPAMD_RE_SELECTOR:
+		ret = "selector";
+		break;
+	case RSPAMD_RE_WORDS:
+		ret = "words";
+		break;
+	case RSPAMD_RE_RAWWORDS:
+		ret = "raw_words";
+		break;
+	case RSPAMD_RE_STEMWORDS:
+		ret = "stem_words";
+		break;
+	case RSPAMD_RE_MAX:
+	default:
+		ret = "invalid class";
+		break;
+	}
+
+	return ret;
+}
+
+enum rspamd_re_type
+rspamd_re_cache_type_from_string(const char *str)
+{
+	enum rspamd_re_type ret;
+	uint64_t h;
+
+	/*
+	 * To optimize this function, we apply hash to input string and
+	 * pre-select it from the values
+	 */
+
+	if (str != NULL) {
+		h = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+												str, strlen(str), 0xdeadbabe);
+
+		switch (h) {
+		case G_GUINT64_CONSTANT(0x298b9c8a58887d44): /* header */
+			ret = RSPAMD_RE_HEADER;
+			break;
+		case G_GUINT64_CONSTANT(0x467bfb5cd7ddf890): /* rawheader */
+			ret = RSPAMD_RE_RAWHEADER;
+			break;
+		case G_GUINT64_CONSTANT(0xda081341fb600389): /* mime */
+			ret = RSPAMD_RE_MIME;
+			break;
+		case G_GUINT64_CONSTANT(0xc35831e067a8221d): /* rawmime */
+			ret = RSPAMD_RE_RAWMIME;
+			break;
+		case G_GUINT64_CONSTANT(0xc625e13dbe636de2): /* body */
+		case G_GUINT64_CONSTANT(0xCCDEBA43518F721C): /* message */
+			ret = RSPAMD_RE_BODY;
+			break;
+		case G_GUINT64_CONSTANT(0x286edbe164c791d2): /* url */
+		case G_GUINT64_CONSTANT(0x7D9ACDF6685661A1): /* uri */
+			ret = RSPAMD_RE_URL;
+			break;
+		case G_GUINT64_CONSTANT(0x7e232b0f60b571be): /* email */
+			ret = RSPAMD_RE_EMAIL;
+			break;
+		case G_GUINT64_CONSTANT(0x796d62205a8778c7): /* allheader */
+			ret = RSPAMD_RE_ALLHEADER;
+			break;
+		case G_GUINT64_CONSTANT(0xa3c6c153b3b00a5e): /* mimeheader */
+			ret = RSPAMD_RE_MIMEHEADER;
+			break;
+		case G_GUINT64_CONSTANT(0x7794501506e604e9): /* sabody */
+			ret = RSPAMD_RE_SABODY;
+			break;
+		case G_GUINT64_CONSTANT(0x28828962E7D2A05F): /* sarawbody */
+			ret = RSPAMD_RE_SARAWBODY;
+			break;
+		default:
+			ret = RSPAMD_RE_MAX;
+			break;
+		}
+	}
+	else {
+		ret = RSPAMD_RE_MAX;
+	}
+
+	return ret;
+}
+
+#ifdef WITH_HYPERSCAN
+static char *
+rspamd_re_cache_hs_pattern_from_pcre(rspamd_regexp_t *re)
+{
+	/*
+	 * Workaround for bug in ragel 7.0.0.11
+	 * https://github.com/intel/hyperscan/issues/133
+	 */
+	const char *pat = rspamd_regexp_get_pattern(re);
+	unsigned int flags = rspamd_regexp_get_flags(re), esc_flags = RSPAMD_REGEXP_ESCAPE_RE;
+	char *escaped;
+	gsize esc_len;
+
+	if (flags & RSPAMD_REGEXP_FLAG_UTF) {
+		esc_flags |= RSPAMD_REGEXP_ESCAPE_UTF;
+	}
+
+	escaped = rspamd_str_regexp_escape(pat, strlen(pat), &esc_len, esc_flags);
+
+	return escaped;
+}
+
+static gboolean
+rspamd_re_cache_is_finite(struct rspamd_re_cache *cache,
+						  rspamd_regexp_t *re, int flags, double max_time)
+{
+	pid_t cld;
+	int status;
+	struct timespec ts;
+	hs_compile_error_t *hs_errors;
+	hs_database_t *test_db;
+	double wait_time;
+	const int max_tries = 10;
+	int tries = 0, rc;
+	void (*old_hdl)(int);
+
+	wait_time = max_time / max_tries;
+	/* We need to restore SIGCHLD processing */
+	old_hdl = signal(SIGCHLD, SIG_DFL);
+	cld = fork();
+
+	if (cld == 0) {
+		/* Try to compile pattern */
+
+		char *pat = rspamd_re_cache_hs_pattern_from_pcre(re);
+
+		if (hs_compile(pat,
+					   flags | HS_FLAG_PREFILTER,
+					   HS_MODE_BLOCK,
+					   &cache->plt,
+					   &test_db,
+					   &hs_errors) != HS_SUCCESS) {
+
+			msg_info_re_cache("cannot compile (prefilter mode) '%s' to hyperscan: '%s'",
+							  pat,
+							  hs_errors != NULL ? hs_errors->message : "unknown error");
+
+			hs_free_compile_error(hs_errors);
+			g_free(pat);
+
+			exit(EXIT_FAILURE);
+		}
+
+		g_free(pat);
+		exit(EXIT_SUCCESS);
+	}
+	else if (cld > 0) {
+		double_to_ts(wait_time, &ts);
+
+		while ((rc = waitpid(cld, &status, WNOHANG)) == 0 && tries++ < max_tries) {
+			(void) nanosleep(&ts, NULL);
+		}
+
+		/* Child has been terminated */
+		if (rc > 0) {
+			/* Forget about SIGCHLD after this point */
+			signal(SIGCHLD, old_hdl);
+
+			if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+				return TRUE;
+			}
+			else {
+				msg_err_re_cache(
+					"cannot approximate %s to hyperscan",
+					rspamd_regexp_get_pattern(re));
+
+				return FALSE;
+			}
+		}
+		else {
+			/* We consider that as timeout */
+			kill(cld, SIGKILL);
+			g_assert(waitpid(cld, &status, 0) != -1);
+			msg_err_re_cache(
+				"cannot approximate %s to hyperscan: timeout waiting",
+				rspamd_regexp_get_pattern(re));
+			signal(SIGCHLD, old_hdl);
+		}
+	}
+	else {
+		msg_err_re_cache(
+			"cannot approximate %s to hyperscan: fork failed: %s",
+			rspamd_regexp_get_pattern(re), strerror(errno));
+		signal(SIGCHLD, old_hdl);
+	}
+
+	return FALSE;
+}
+#endif
+
+#ifdef WITH_HYPERSCAN
+struct rspamd_re_cache_hs_compile_cbdata {
+	struct rspamd_re_cache *cache;
+	const char *cache_dir;
+	double max_time;
+	gboolean silent;
+	unsigned int total;
+	/* All shards of all classes, checked one by one */
+	GPtrArray *shards;
+	unsigned int cur_shard;
+	/* Shards being compiled */
+	unsigned int pending;
+	gboolean all_dispatched;
+	struct rspamd_cpu_pool *pool;
+	ev_timer *timer;
+	void (*cb)(unsigned int ncompiled, GError *err, void *cbd);
+	void *cbd;
+};
+
+/*
+ * Compilation of a single shard: hyperscan calls are done in the cpu pool
+ * threads if it is available, whilst logging, prefilter checks (they fork)
+ * and files manipulations are done in the event loop
+ */
+struct rspamd_re_cache_hs_shard_job {
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata;
+	struct rspamd_re_class_shard *shard;
+	unsigned int n;
+	char **pats;
+	unsigned int *flags;
+	/* Indexes of regexps in a shard */
+	unsigned int *ids;
+	/* Errors of the patterns that cannot be compiled as is */
+	char **pat_errors;
+	unsigned int nfailed;
+	gboolean tested;
+	char *serialized;
+	size_t serialized_len;
+	char *error;
+};
+
+static void
+rspamd_re_cache_compile_report(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+							   GError *err)
+{
+	cbdata->cb(cbdata->total, err, cbdata->cbd);
+	g_error_free(err);
+}
+
+static void
+rspamd_re_cache_compile_maybe_finish(struct rspamd_re_cache_hs_compile_cbdata *cbdata)
+{
+	if (cbdata->all_dispatched && cbdata->pending == 0) {
+		cbdata->cb(cbdata->total, NULL, cbdata->cbd);
+		g_ptr_array_free(cbdata->shards, TRUE);
+		g_free(cbdata->timer);
+		g_free(cbdata);
+	}
+}
+
+static void
+rspamd_re_cache_shard_job_free(struct rspamd_re_cache_hs_shard_job *job)
+{
+	for (unsigned int i = 0; i < job->n; i++) {
+		g_free(job->pats[i]);
+		g_free(job->pat_errors[i]);
+	}
+
+	g_free(job->pats);
+	g_free(job->flags);
+	g_free(job->ids);
+	g_free(job->pat_errors);
+	g_free(job->serialized);
+	g_free(job->error);
+	g_free(job);
+}
+
+static struct rspamd_re_cache_hs_shard_job *
+rspamd_re_cache_shard_job_new(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+							  struct rspamd_re_class_shard *shard)
+{
+	struct rspamd_re_cache_hs_shard_job *job;
+	struct rspamd_re_cache *cache = cbdata->cache;
+	rspamd_regexp_t *re;
+	int pcre_flags, re_flags;
+	unsigned int i, n;
+
+	job = g_malloc0(sizeof(*job));
+	job->cbdata = cbdata;
+	job->shard = shard;
+	job->pats = g_new0(char *, shard->re->len);
+	job->flags = g_new0(unsigned int, shard->re->len);
+	job->ids = g_new0(unsigned int, shard->re->len);
+	job->pat_errors = g_new0(char *, shard->re->len);
+	n = 0;
+
+	PTR_ARRAY_FOREACH(shard->re, i, re)
+	{
+		pcre_flags = rspamd_regexp_get_pcre_flags(re);
+		re_flags = rspamd_regexp_get_flags(re);
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			/* Do not try to compile bad regexp */
+			msg_info_re_cache(
+				"do not try compile %s to hyperscan as it is PCRE only",
+				rspamd_regexp_get_pattern(re));
+			continue;
+		}
+
+		job->flags[n] = 0;
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			job->flags[n] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			job->flags[n] |= HS_FLAG_UTF8;
+		}
+#endif
+		if (pcre_flags & PCRE_FLAG(CASELESS)) {
+			job->flags[n] |= HS_FLAG_CASELESS;
+		}
+		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
+			job->flags[n] |= HS_FLAG_MULTILINE;
+		}
+		if (pcre_flags & PCRE_FLAG(DOTALL)) {
+			job->flags[n] |= HS_FLAG_DOTALL;
+		}
+
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_LEFTMOST) {
+			job->flags[n] |= HS_FLAG_SOM_LEFTMOST;
+		}
+		else if (rspamd_regexp_get_maxhits(re) == 1) {
+			job->flags[n] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		job->pats[n] = rspamd_re_cache_hs_pattern_from_pcre(re);
+		job->ids[n] = i;
+		n++;
+	}
+
+	job->n = n;
+
+	return job;
+}
+
+/* Executed in a pool thread, so no logging here */
+static void
+rspamd_re_cache_compile_shard_work(void *ud)
+{
+	struct rspamd_re_cache_hs_shard_job *job = ud;
+	struct rspamd_re_cache *cache = job->cbdata->cache;
+	hs_database_t *test_db;
+	hs_compile_error_t *hs_errors = NULL;
+	unsigned int i;
+
+	if (!job->tested) {
+		job->tested = TRUE;
+
+		for (i = 0; i < job->n; i++) {
+			if (hs_compile(job->pats[i],
+						   job->flags[i],
+						   HS_MODE_BLOCK,
+						   &cache->plt,
+						   &test_db,
+						   &hs_errors) != HS_SUCCESS) {
+				job->pat_errors[i] = g_strdup(hs_errors != NULL ? hs_errors->message : "unknown error");
+				job->nfailed++;
+				hs_free_compile_error(hs_errors);
+				hs_errors = NULL;
+			}
+			else {
+				hs_free_database(test_db);
+			}
+		}
+
+		if (job->nfailed > 0) {
+			/* Prefilter approximation is checked in the main thread */
+			return;
+		}
+	}
+
+	if (job->n == 0) {
+		return;
+	}
+
+	/* Create the hs tree */
+	if (hs_compile_multi((const char **) job->pats,
+						 job->flags,
+						 job->ids,
+						 job->n,
+						 HS_MODE_BLOCK,
+						 &cache->plt,
+						 &test_db,
+						 &hs_errors) != HS_SUCCESS) {
+		job->error = g_strdup_printf("cannot create tree of regexp when processing '%s': %s",
+									 (hs_errors->expression >= 0 && (unsigned int) hs_errors->expression < job->n) ? job->pats[hs_errors->expression] : "unknown",
+									 hs_errors->message);
+		hs_free_compile_error(hs_errors);
+
+		return;
+	}
+
+	if (hs_serialize_database(test_db, &job->serialized,
+							  &job->serialized_len) != HS_SUCCESS) {
+		job->error = g_strdup_printf("cannot serialize tree of regexp for %s",
+									 job->shard->hash);
+		job->serialized = NULL;
+	}
+
+	hs_free_database(test_db);
+}
+
+static void rspamd_re_cache_compile_shard_done(void *ud);
+
+static void
+rspamd_re_cache_compile_shard_run(struct rspamd_re_cache_hs_shard_job *job)
+{
+	if (job->cbdata->pool == NULL ||
+		!rspamd_cpu_pool_push(job->cbdata->pool,
+							  rspamd_re_cache_compile_shard_work,
+							  rspamd_re_cache_compile_shard_done,
+							  job)) {
+		rspamd_re_cache_compile_shard_work(job);
+		rspamd_re_cache_compile_shard_done(job);
+	}
+}
+
+/*
+ * Patterns that cannot be compiled as is are either compiled in prefilter
+ * mode or removed
+ */
+static void
+rspamd_re_cache_compile_shard_prefilter(struct rspamd_re_cache_hs_shard_job *job)
+{
+	struct rspamd_re_cache *cache = job->cbdata->cache;
+	rspamd_regexp_t *re;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < job->n; i++) {
+		if (job->pat_errors[i] != NULL) {
+			msg_info_re_cache("cannot compile '%s' to hyperscan: '%s', try prefilter match",
+							  job->pats[i],
+							  job->pat_errors[i]);
+			g_free(job->pat_errors[i]);
+			job->pat_errors[i] = NULL;
+			re = g_ptr_array_index(job->shard->re, job->ids[i]);
+
+			/* The approximation operation might take a significant
+			 * amount of time, so we need to check if it's finite
+			 */
+			if (!rspamd_re_cache_is_finite(cache, re, job->flags[i], job->cbdata->max_time)) {
+				g_free(job->pats[i]); /* Avoid leak */
+				continue;
+			}
+
+			job->flags[i] |= HS_FLAG_PREFILTER;
+		}
+
+		job->pats[n] = job->pats[i];
+		job->flags[n] = job->flags[i];
+		job->ids[n] = job->ids[i];
+		n++;
+	}
+
+	job->n = n;
+	job->nfailed = 0;
+}
+
+static gboolean
+rspamd_re_cache_save_shard(struct rspamd_re_cache_hs_shard_job *job, GError **err)
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata = job->cbdata;
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class_shard *shard = job->shard;
+	char path[PATH_MAX], npath[PATH_MAX];
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	uint64_t crc;
+	struct iovec iov[7];
+	int fd, n = job->n;
+
+	rspamd_snprintf(path, sizeof(path), "%s%c%s%P-XXXXXXXXXX", cbdata->cache_dir,
+					G_DIR_SEPARATOR, shard->hash, getpid());
+	fd = g_mkstemp_full(path, O_CREAT | O_TRUNC | O_EXCL | O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error(err, rspamd_re_cache_quark(), errno,
+					"cannot open file %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	/*
+	 * Magic - 8 bytes
+	 * Platform - sizeof (platform)
+	 * n - number of regexps
+	 * n * <regexp ids in a shard>
+	 * n * <regexp flags>
+	 * crc - 8 bytes checksum
+	 * <hyperscan blob>
+	 */
+	rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
+	/* IDs -> Flags -> Hs blob */
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  job->ids, sizeof(*job->ids) * n);
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  job->flags, sizeof(*job->flags) * n);
+	rspamd_cryptobox_fast_hash_update(&crc_st,
+									  job->serialized, job->serialized_len);
+	crc = rspamd_cryptobox_fast_hash_final(&crc_st);
+
+	iov[0].iov_base = (void *) rspamd_hs_magic;
+	iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+	iov[1].iov_base = &cache->plt;
+	iov[1].iov_len = sizeof(cache->plt);
+	iov[2].iov_base = &n;
+	iov[2].iov_len = sizeof(n);
+	iov[3].iov_base = job->ids;
+	iov[3].iov_len = sizeof(*job->ids) * n;
+	iov[4].iov_base = job->flags;
+	iov[4].iov_len = sizeof(*job->flags) * n;
+	iov[5].iov_base = &crc;
+	iov[5].iov_len = sizeof(crc);
+	iov[6].iov_base = job->serialized;
+	iov[6].iov_len = job->serialized_len;
+
+	if (writev(fd, iov, G_N_ELEMENTS(iov)) == -1) {
+		g_set_error(err, rspamd_re_cache_quark(),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror(errno));
+		close(fd);
+		unlink(path);
+
+		return FALSE;
+	}
+
+	close(fd);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf(npath, sizeof(npath), "%s%c%s.hs", cbdata->cache_dir,
+					G_DIR_SEPARATOR, shard->hash);
+
+	if (rename(path, npath) == -1) {
+		g_set_error(err, rspamd_re_cache_quark(),
+					errno,
+					"cannot rename %s to %s: %s",
+					path, npath, strerror(errno));
+		unlink(path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_re_cache_compile_shard_done(void *ud)
+{
+	struct rspamd_re_cache_hs_shard_job *job = ud;
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata = job->cbdata;
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class_shard *shard = job->shard;
+	struct rspamd_re_class *re_class = shard->re_class;
+	GError *err = NULL;
+
+	if (job->nfailed > 0) {
+		rspamd_re_cache_compile_shard_prefilter(job);
+		/* Compile the tree now */
+		rspamd_re_cache_compile_shard_run(job);
+
+		return;
+	}
+
+	if (job->error) {
+		err = g_error_new(rspamd_re_cache_quark(), EINVAL, "%s", job->error);
+	}
+	else if (job->n == 0) {
+		err = g_error_new(rspamd_re_cache_quark(), EINVAL,
+						  "no suitable regular expressions %s (%d original)",
+						  rspamd_re_cache_type_to_string(re_class->type),
+						  (int) shard->re->len);
+	}
+	else if (rspamd_re_cache_save_shard(job, &err)) {
+		if (re_class->type_len > 0) {
+			msg_info_re_cache(
+				"compiled class %s(%*s) shard %ud/%ud to cache %6s, %ud/%ud regexps",
+				rspamd_re_cache_type_to_string(re_class->type),
+				(int) re_class->type_len - 1,
+				re_class->type_data,
+				shard->idx + 1,
+				re_class->nshards,
+				shard->hash,
+				job->n,
+				shard->re->len);
+		}
+		else {
+			msg_info_re_cache(
+				"compiled class %s shard %ud/%ud to cache %6s, %ud/%ud regexps",
+				rspamd_re_cache_type_to_string(re_class->type),
+				shard->idx + 1,
+				re_class->nshards,
+				shard->hash,
+				job->n,
+				shard->re->len);
+		}
+
+		cbdata->total += job->n;
+	}
+
+	rspamd_re_cache_shard_job_free(job);
+	cbdata->pending--;
+
+	if (err) {
+		rspamd_re_cache_compile_report(cbdata, err);
+	}
+
+	rspamd_re_cache_compile_maybe_finish(cbdata);
+}
+
+/*
+ * Returns FALSE if a shard has been skipped
+ */
+static gboolean
+rspamd_re_cache_compile_shard(struct rspamd_re_cache_hs_compile_cbdata *cbdata,
+							  struct rspamd_re_class_shard *shard)
+{
+	struct rspamd_re_cache *cache = cbdata->cache;
+	struct rspamd_re_class *re_class = shard->re_class;
+	struct rspamd_re_cache_hs_shard_job *job;
+	char path[PATH_MAX];
+	int fd, n;
+
+	rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cbdata->cache_dir,
+					G_DIR_SEPARATOR, shard->hash);
+
+	if (rspamd_re_cache_is_valid_hyperscan_file(cache, path, TRUE, TRUE, NULL)) {
+
+		fd = open(path, O_RDONLY, 00600);
+
+		/* Read number of regexps */
+		g_assert(fd != -1);
+		g_assert(lseek(fd, RSPAMD_HS_MAGIC_LEN + sizeof(cache->plt), SEEK_SET) != -1);
+		g_assert(read(fd, &n, sizeof(n)) == sizeof(n));
+		close(fd);
+
+		if (re_class->type_len > 0) {
+			if (!cbdata->silent) {
+				msg_info_re_cache(
+					"skip already valid class %s(%*s) shard %ud/%ud to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string(re_class->type),
+					(int) re_class->type_len - 1,
+					re_class->type_data,
+					shard->idx + 1,
+					re_class->nshards,
+					shard->hash,
+					n);
+			}
+		}
+		else {
+			if (!cbdata->silent) {
+				msg_info_re_cache(
+					"skip already valid class %s shard %ud/%ud to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string(re_class->type),
+					shard->idx + 1,
+					re_class->nshards,
+					shard->hash,
+					n);
+			}
+		}
+
+		return FALSE;
+	}
+
+	job = rspamd_re_cache_shard_job_new(cbdata, shard);
+	cbdata->pending++;
+	rspamd_re_cache_compile_shard_run(job);
+
+	return TRUE;
+}
+
+static void
+rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
+		(struct rspamd_re_cache_hs_compile_cbdata *) w->data;
+	struct rspamd_re_class_shard *shard;
 
-#ifdef WITH_HYPERSCAN
-static char *
-rspamd_re_cache_hs_pattern_from_pcre(rspamd_regexp_t *re)
-{
 	/*
-	 * Workaround for bug in ragel 7.0.0.11
-	 * https://github.com/intel/hyperscan/issues/133
+	 * Without threads we compile one shard per timer iteration, otherwise
+	 * we keep all threads busy
 	 */
-	const char *pat = rspamd_regexp_get_pattern(re);
-	unsigned int flags = rspamd_regexp_get_flags(re), esc_flags = RSPAMD_REGEXP_ESCAPE_RE;
-	char *escaped;
-	gsize esc_len;
+	while (cbdata->cur_shard < cbdata->shards->len) {
+		if (cbdata->pool &&
+			cbdata->pending >= rspamd_cpu_pool_nthreads(cbdata->pool)) {
+			break;
+		}
 
-	if (flags & RSPAMD_REGEXP_FLAG_UTF) {
-		esc_flags |= RSPAMD_REGEXP_ESCAPE_UTF;
+		shard = g_ptr_array_index(cbdata->shards, cbdata->cur_shard);
+		cbdata->cur_shard++;
+
+		if (rspamd_re_cache_compile_shard(cbdata, shard) && cbdata->pool == NULL) {
+			break;
+		}
 	}
 
-	escaped = rspamd_str_regexp_escape(pat, strlen(pat), &esc_len, esc_flags);
+	if (cbdata->cur_shard >= cbdata->shards->len) {
+		/* All done */
+		ev_timer_stop(EV_A_ w);
+		cbdata->all_dispatched = TRUE;
+		rspamd_re_cache_compile_maybe_finish(cbdata);
 
-	return escaped;
+		return;
+	}
+
+	/* Continue process */
+	ev_timer_again(EV_A_ w);
 }
 
-static gboolean
-rspamd_re_cache_is_finite(struct rspamd_re_cache *cache,
-						  rspamd_regexp_t *re, int flags, double max_time)
+#endif
+
+int rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
+									  const char *cache_dir,
+									  double max_time,
+									  gboolean silent,
+									  struct ev_loop *event_loop,
+									  struct rspamd_cpu_pool *pool,
+									  void (*cb)(unsigned int ncompiled, GError *err, void *cbd),
+									  void *cbd)
 {
-	pid_t cld;
-	int status;
-	struct timespec ts;
-	hs_compile_error_t *hs_errors;
-	hs_database_t *test_db;
-	double wait_time;
-	const int max_tries = 10;
-	int tries = 0, rc;
-	void (*old_hdl)(int);
+	g_assert(cache != NULL);
+	g_assert(cache_dir != NULL);
 
-	wait_time = max_time / max_tries;
-	/* We need to restore SIGCHLD processing */
-	old_hdl = signal(SIGCHLD, SIG_DFL);
-	cld = fork();
+#ifndef WITH_HYPERSCAN
+	return -1;
+#else
+	static const ev_tstamp timer_interval = 0.1;
+	struct rspamd_re_cache_hs_compile_cbdata *cbdata;
+	struct rspamd_re_class *re_class;
+	GHashTableIter it;
+	gpointer k, v;
+	unsigned int i;
 
-	if (cld == 0) {
-		/* Try to compile pattern */
+	cbdata = g_malloc0(sizeof(*cbdata));
+	cbdata->cache = cache;
+	cbdata->cache_dir = cache_dir;
+	cbdata->cb = cb;
+	cbdata->cbd = cbd;
+	cbdata->max_time = max_time;
+	cbdata->silent = silent;
+	cbdata->total = 0;
+	cbdata->pool = pool;
+	cbdata->shards = g_ptr_array_new();
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		for (i = 0; i < re_class->nshards; i++) {
+			if (re_class->shards[i].re->len > 0) {
+				g_ptr_array_add(cbdata->shards, &re_class->shards[i]);
+			}
+		}
+	}
+
+	cbdata->timer = g_malloc0(sizeof(*cbdata->timer));
+	cbdata->timer->data = (void *) cbdata;
+
+	ev_timer_init(cbdata->timer, rspamd_re_cache_compile_timer_cb,
+				  timer_interval, timer_interval);
+	ev_timer_start(event_loop, cbdata->timer);
+
+	return 0;
+#endif
+}
+
+#ifdef WITH_HYPERSCAN
+static struct rspamd_re_class_shard *
+rspamd_re_cache_find_shard(struct rspamd_re_cache *cache, const char *hash)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	unsigned int i;
+
+	g_hash_table_iter_init(&it, cache->re_classes);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		re_class = v;
+
+		for (i = 0; i < re_class->nshards; i++) {
+			if (memcmp(hash, re_class->shards[i].hash,
+					   sizeof(re_class->shards[i].hash) - 1) == 0) {
+				return &re_class->shards[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+gboolean
+rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
+										const char *path, gboolean silent, gboolean try_load, GError **err)
+{
+	g_assert(cache != NULL);
+	g_assert(path != NULL);
+
+#ifndef WITH_HYPERSCAN
+	return FALSE;
+#else
+	int fd, n, ret;
+	unsigned char magicbuf[RSPAMD_HS_MAGIC_LEN];
+	const unsigned char *mb;
+	struct rspamd_re_class_shard *shard;
+	gsize len;
+	const char *hash_pos;
+	hs_platform_info_t test_plt;
+	hs_database_t *test_db = NULL;
+	unsigned char *map, *p, *end;
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	uint64_t crc, valid_crc;
+
+	len = strlen(path);
+
+	if (len < sizeof(rspamd_cryptobox_HASHBYTES + 3)) {
+		if (!silent) {
+			msg_err_re_cache("cannot open hyperscan cache file %s: too short filename",
+							 path);
+		}
+		g_set_error(err, rspamd_re_cache_quark(), 0,
+					"too short filename");
+
+		return FALSE;
+	}
+
+	if (memcmp(path + len - 3, ".hs", 3) != 0) {
+		if (!silent) {
+			msg_err_re_cache("cannot open hyperscan cache file %s: not ending with .hs",
+							 path);
+		}
+		g_set_error(err, rspamd_re_cache_quark(), 0,
+					"not ending with .hs");
+		return FALSE;
+	}
+
+	hash_pos = path + len - 3 - (sizeof(shard->hash) - 1);
+	shard = rspamd_re_cache_find_shard(cache, hash_pos);
+
+	if (shard != NULL) {
+		/* Open file and check magic */
+		gssize r;
+
+		fd = open(path, O_RDONLY);
+
+		if (fd == -1) {
+			if (errno != ENOENT || !silent) {
+				msg_err_re_cache("cannot open hyperscan cache file %s: %s",
+								 path, strerror(errno));
+			}
+			g_set_error(err, rspamd_re_cache_quark(), 0,
+						"%s",
+						strerror(errno));
+			return FALSE;
+		}
+
+		if ((r = read(fd, magicbuf, sizeof(magicbuf))) != sizeof(magicbuf)) {
+			if (r == -1) {
+				msg_err_re_cache("cannot read magic from hyperscan "
+								 "cache file %s: %s",
+								 path, strerror(errno));
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"cannot read magic: %s",
+							strerror(errno));
+			}
+			else {
+				msg_err_re_cache("truncated read magic from hyperscan "
+								 "cache file %s: %z, %z wanted",
+								 path, r, (gsize) sizeof(magicbuf));
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"truncated read magic %zd, %zd wanted",
+							r, (gsize) sizeof(magicbuf));
+			}
+
+			close(fd);
+			return FALSE;
+		}
+
+		mb = rspamd_hs_magic;
+
+		if (memcmp(magicbuf, mb, sizeof(magicbuf)) != 0) {
+			msg_err_re_cache("cannot open hyperscan cache file %s: "
+							 "bad magic ('%*xs', '%*xs' expected)",
+							 path, (int) RSPAMD_HS_MAGIC_LEN, magicbuf,
+							 (int) RSPAMD_HS_MAGIC_LEN, mb);
+
+			close(fd);
+			g_set_error(err, rspamd_re_cache_quark(), 0, "invalid magic");
+			return FALSE;
+		}
+
+		if ((r = read(fd, &test_plt, sizeof(test_plt))) != sizeof(test_plt)) {
+			if (r == -1) {
+				msg_err_re_cache("cannot read platform data from hyperscan "
+								 "cache file %s: %s",
+								 path, strerror(errno));
+			}
+			else {
+				msg_err_re_cache("truncated read platform data from hyperscan "
+								 "cache file %s: %z, %z wanted",
+								 path, r, (gsize) sizeof(magicbuf));
+			}
+
+			g_set_error(err, rspamd_re_cache_quark(), 0,
+						"cannot read platform data: %s", strerror(errno));
+
+			close(fd);
+			return FALSE;
+		}
+
+		if (test_plt.cpu_features != cache->plt.cpu_features) {
+			msg_err_re_cache("cannot open hyperscan cache file %s: "
+							 "compiled for a different platform",
+							 path);
+			g_set_error(err, rspamd_re_cache_quark(), 0,
+						"compiled for a different platform");
+
+			close(fd);
+			return FALSE;
+		}
+
+		close(fd);
+
+		if (try_load) {
+			map = rspamd_file_xmap(path, PROT_READ, &len, TRUE);
 
-		char *pat = rspamd_re_cache_hs_pattern_from_pcre(re);
+			if (map == NULL) {
+				msg_err_re_cache("cannot mmap hyperscan cache file %s: "
+								 "%s",
+								 path, strerror(errno));
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"mmap error: %s", strerror(errno));
+				return FALSE;
+			}
 
-		if (hs_compile(pat,
-					   flags | HS_FLAG_PREFILTER,
-					   HS_MODE_BLOCK,
-					   &cache->plt,
-					   &test_db,
-					   &hs_errors) != HS_SUCCESS) {
+			p = map + RSPAMD_HS_MAGIC_LEN + sizeof(test_plt);
+			end = map + len;
+			memcpy(&n, p, sizeof(n));
+			p += sizeof(int);
 
-			msg_info_re_cache("cannot compile (prefilter mode) '%s' to hyperscan: '%s'",
-							  pat,
-							  hs_errors != NULL ? hs_errors->message : "unknown error");
+			if (n <= 0 || 2 * n * sizeof(int) +         /* IDs + flags */
+								  sizeof(uint64_t) +    /* crc */
+								  RSPAMD_HS_MAGIC_LEN + /* header */
+								  sizeof(cache->plt) >
+							  len) {
+				/* Some wrong amount of regexps */
+				msg_err_re_cache("bad number of expressions in %s: %d",
+								 path, n);
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"bad number of expressions: %d", n);
+				munmap(map, len);
+				return FALSE;
+			}
 
-			hs_free_compile_error(hs_errors);
-			g_free(pat);
+			/*
+			 * Magic - 8 bytes
+			 * Platform - sizeof (platform)
+			 * n - number of regexps
+			 * n * <regexp ids>
+			 * n * <regexp flags>
+			 * crc - 8 bytes checksum
+			 * <hyperscan blob>
+			 */
 
-			exit(EXIT_FAILURE);
-		}
+			memcpy(&crc, p + n * 2 * sizeof(int), sizeof(crc));
+			rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
+			/* IDs */
+			rspamd_cryptobox_fast_hash_update(&crc_st, p, n * sizeof(int));
+			/* Flags */
+			rspamd_cryptobox_fast_hash_update(&crc_st, p + n * sizeof(int),
+											  n * sizeof(int));
+			/* HS database */
+			p += n * sizeof(int) * 2 + sizeof(uint64_t);
+			rspamd_cryptobox_fast_hash_update(&crc_st, p, end - p);
+			valid_crc = rspamd_cryptobox_fast_hash_final(&crc_st);
+
+			if (crc != valid_crc) {
+				msg_warn_re_cache("outdated or invalid hs database in %s: "
+								  "crc read %xL, crc expected %xL",
+								  path, crc, valid_crc);
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"outdated or invalid hs database, crc check failure");
+				munmap(map, len);
 
-		g_free(pat);
-		exit(EXIT_SUCCESS);
-	}
-	else if (cld > 0) {
-		double_to_ts(wait_time, &ts);
+				return FALSE;
+			}
 
-		while ((rc = waitpid(cld, &status, WNOHANG)) == 0 && tries++ < max_tries) {
-			(void) nanosleep(&ts, NULL);
-		}
+			/* Ids are indexes of regexps in a shard */
+			for (int i = 0; i < n; i++) {
+				int id;
 
-		/* Child has been terminated */
-		if (rc > 0) {
-			/* Forget about SIGCHLD after this point */
-			signal(SIGCHLD, old_hdl);
+				memcpy(&id, map + RSPAMD_HS_MAGIC_LEN + sizeof(test_plt) + sizeof(int) * (i + 1),
+					   sizeof(id));
 
-			if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
-				return TRUE;
+				if (id < 0 || id >= (int) shard->re->len) {
+					msg_err_re_cache("bad expression id in %s: %d", path, id);
+					g_set_error(err, rspamd_re_cache_quark(), 0,
+								"bad expression id: %d", id);
+					munmap(map, len);
+
+					return FALSE;
+				}
 			}
-			else {
-				msg_err_re_cache(
-					"cannot approximate %s to hyperscan",
-					rspamd_regexp_get_pattern(re));
+
+			if ((ret = hs_deserialize_database(p, end - p, &test_db)) != HS_SUCCESS) {
+				msg_err_re_cache("bad hs database in %s: %d", path, ret);
+				g_set_error(err, rspamd_re_cache_quark(), 0,
+							"deserialize error: %d", ret);
+				munmap(map, len);
 
 				return FALSE;
 			}
+
+			hs_free_database(test_db);
+			munmap(map, len);
 		}
-		else {
-			/* We consider that as timeout */
-			kill(cld, SIGKILL);
-			g_assert(waitpid(cld, &status, 0) != -1);
-			msg_err_re_cache(
-				"cannot approximate %s to hyperscan: timeout waiting",
-				rspamd_regexp_get_pattern(re));
-			signal(SIGCHLD, old_hdl);
-		}
+
+		return TRUE;
 	}
-	else {
-		msg_err_re_cache(
-			"cannot approximate %s to hyperscan: fork failed: %s",
-			rspamd_regexp_get_pattern(re), strerror(errno));
-		signal(SIGCHLD, old_hdl);
+
+	if (!silent) {
+		msg_warn_re_cache("unknown hyperscan cache file %s", path);
 	}
 
+	g_set_error(err, rspamd_re_cache_quark(), 0,
+				"unknown hyperscan file");
+
 	return FALSE;
-}
 #endif
+}
 
-#ifdef WITH_HYPERSCAN
-struct rspamd_re_cache_hs_compile_cbdata {
-	GHashTableIter it;
-	struct rspamd_re_cache *cache;
-	const char *cache_dir;
-	double max_time;
-	gboolean silent;
-	unsigned int total;
-	void (*cb)(unsigned int ncompiled, GError *err, void *cbd);
-	void *cbd;
-};
 
+#ifdef WITH_HYPERSCAN
 static void
-rspamd_re_cache_compile_err(EV_P_ ev_timer *w, GError *err,
-							struct rspamd_re_cache_hs_compile_cbdata *cbdata, bool is_fatal)
+rspamd_re_cache_reset_shard(struct rspamd_re_cache *cache,
+							struct rspamd_re_class_shard *shard)
 {
-	cbdata->cb(cbdata->total, err, cbdata->cbd);
+	struct rspamd_re_cache_elt *elt;
+	rspamd_regexp_t *re;
+	unsigned int i;
 
-	if (is_fatal) {
-		ev_timer_stop(EV_A_ w);
-		g_free(w);
-		g_free(cbdata);
+	if (shard->hs_db != NULL) {
+		rspamd_hyperscan_free(shard->hs_db, false);
 	}
-	else {
-		/* Continue compilation */
-		ev_timer_again(EV_A_ w);
+
+	if (shard->hs_ids) {
+		g_free(shard->hs_ids);
+	}
+
+	shard->hs_ids = NULL;
+	shard->hs_db = NULL;
+	shard->nhs = 0;
+
+	/* Nothing is matched by hyperscan unless the database is loaded */
+	PTR_ARRAY_FOREACH(shard->re, i, re)
+	{
+		elt = g_ptr_array_index(cache->re, rspamd_regexp_get_cache_id(re));
+		elt->match_type = RSPAMD_RE_CACHE_PCRE;
 	}
-	g_error_free(err);
 }
 
-static void
-rspamd_re_cache_compile_timer_cb(EV_P_ ev_timer *w, int revents)
+/*
+ * Reads ids and flags from a shard file header (magic, platform, number
+ * of regexps, ids, flags and crc), returns number of regexps or -1
+ */
+static int
+rspamd_re_cache_read_shard_header(struct rspamd_re_cache *cache,
+								  const uint8_t *map, gsize len,
+								  int **phs_ids, int **phs_flags, gsize *phdr_len)
 {
-	struct rspamd_re_cache_hs_compile_cbdata *cbdata =
-		(struct rspamd_re_cache_hs_compile_cbdata *) w->data;
-	GHashTableIter cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	char path[PATH_MAX], npath[PATH_MAX];
-	hs_database_t *test_db;
-	int fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
-	rspamd_cryptobox_fast_hash_state_t crc_st;
-	uint64_t crc;
-	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors = NULL;
-	unsigned int *hs_flags = NULL;
-	const hs_expr_ext_t **hs_exts = NULL;
-	char **hs_pats = NULL;
-	char *hs_serialized = NULL;
-	gsize serialized_len;
-	struct iovec iov[7];
-	struct rspamd_re_cache *cache;
-	GError *err;
-	pid_t our_pid = getpid();
+	const uint8_t *p;
+	int n;
 
-	cache = cbdata->cache;
+	if (len < RSPAMD_HS_MAGIC_LEN + sizeof(cache->plt) + sizeof(n)) {
+		return -1;
+	}
 
-	if (!g_hash_table_iter_next(&cbdata->it, &k, &v)) {
-		/* All done */
-		ev_timer_stop(EV_A_ w);
-		cbdata->cb(cbdata->total, NULL, cbdata->cbd);
-		g_free(w);
-		g_free(cbdata);
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof(cache->plt);
+	memcpy(&n, p, sizeof(n));
 
-		return;
+	if (n <= 0 || 2 * n * sizeof(int) +         /* IDs + flags */
+						  sizeof(uint64_t) +    /* crc */
+						  RSPAMD_HS_MAGIC_LEN + /* header */
+						  sizeof(cache->plt) + sizeof(n) >
+					  len) {
+		return -1;
 	}
 
-	re_class = v;
-	rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cbdata->cache_dir,
-					G_DIR_SEPARATOR, re_class->hash);
+	p += sizeof(n);
+	*phs_ids = g_malloc(n * sizeof(int));
+	memcpy(*phs_ids, p, n * sizeof(int));
+	p += n * sizeof(int);
+	*phs_flags = g_malloc(n * sizeof(int));
+	memcpy(*phs_flags, p, n * sizeof(int));
 
-	if (rspamd_re_cache_is_valid_hyperscan_file(cache, path, TRUE, TRUE, NULL)) {
+	/* Skip crc */
+	p += n * sizeof(int) + sizeof(uint64_t);
+	*phdr_len = p - map;
 
-		fd = open(path, O_RDONLY, 00600);
+	return n;
+}
 
-		/* Read number of regexps */
-		g_assert(fd != -1);
-		g_assert(lseek(fd, RSPAMD_HS_MAGIC_LEN + sizeof(cache->plt), SEEK_SET) != -1);
-		g_assert(read(fd, &n, sizeof(n)) == sizeof(n));
-		close(fd);
+/*
+ * Switches shard expressions to the loaded `shard->hs_db`, takes ownership
+ * of ids and flags, returns number of expressions or -1 on error
+ */
+static int
+rspamd_re_cache_attach_shard(struct rspamd_re_cache *cache,
+							 struct rspamd_re_class_shard *shard,
+							 int n, int *hs_ids, int *hs_flags,
+							 const char *path, bool try_load)
+{
+	struct rspamd_re_cache_elt *elt;
+	rspamd_regexp_t *re;
+	int i;
 
-		if (re_class->type_len > 0) {
-			if (!cbdata->silent) {
-				msg_info_re_cache(
-					"skip already valid class %s(%*s) to cache %6s, %d regexps",
-					rspamd_re_cache_type_to_string(re_class->type),
-					(int) re_class->type_len - 1,
-					re_class->type_data,
-					re_class->hash,
-					n);
-			}
+	if (!rspamd_hyperscan_scratch_reserve(rspamd_hyperscan_get_database(shard->hs_db))) {
+		if (!try_load) {
+			msg_err_re_cache("bad hs database in %s; cannot allocate scratch", path);
 		}
 		else {
-			if (!cbdata->silent) {
-				msg_info_re_cache(
-					"skip already valid class %s to cache %6s, %d regexps",
-					rspamd_re_cache_type_to_string(re_class->type),
-					re_class->hash,
-					n);
-			}
+			msg_debug_re_cache("bad hs database in %s; cannot allocate scratch", path);
 		}
+		g_free(hs_ids);
+		g_free(hs_flags);
 
-		ev_timer_again(EV_A_ w);
-		return;
-	}
+		rspamd_hyperscan_free(shard->hs_db, true);
+		shard->hs_db = NULL;
 
-	rspamd_snprintf(path, sizeof(path), "%s%c%s%P-XXXXXXXXXX", cbdata->cache_dir,
-					G_DIR_SEPARATOR, re_class->hash, our_pid);
-	fd = g_mkstemp_full(path, O_CREAT | O_TRUNC | O_EXCL | O_WRONLY, 00600);
+		return -1;
+	}
 
-	if (fd == -1) {
-		err = g_error_new(rspamd_re_cache_quark(), errno,
-						  "cannot open file %s: %s", path, strerror(errno));
-		rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-		return;
+	/*
+	 * Now find hyperscan elts that are successfully compiled and
+	 * specify that they should be matched using hyperscan
+	 */
+	for (i = 0; i < n; i++) {
+		g_assert((int) shard->re->len > hs_ids[i] && hs_ids[i] >= 0);
+		re = g_ptr_array_index(shard->re, hs_ids[i]);
+		/* Ids in a file are local for a shard */
+		hs_ids[i] = rspamd_regexp_get_cache_id(re);
+		elt = g_ptr_array_index(cache->re, hs_ids[i]);
+
+		if (hs_flags[i] & HS_FLAG_PREFILTER) {
+			elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
+		}
+		else {
+			elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
+		}
 	}
 
-	g_hash_table_iter_init(&cit, re_class->re);
-	n = g_hash_table_size(re_class->re);
-	hs_flags = g_new0(unsigned int, n);
-	hs_ids = g_new0(unsigned int, n);
-	hs_pats = g_new0(char *, n);
-	hs_exts = g_new0(const hs_expr_ext_t *, n);
-	i = 0;
+	shard->hs_ids = hs_ids;
+	g_free(hs_flags);
+	shard->nhs = n;
 
-	while (g_hash_table_iter_next(&cit, &k, &v)) {
-		re = v;
+	return n;
+}
 
-		pcre_flags = rspamd_regexp_get_pcre_flags(re);
-		re_flags = rspamd_regexp_get_flags(re);
+/*
+ * Returns number of loaded expressions or -1 on error
+ */
+static int
+rspamd_re_cache_load_shard(struct rspamd_re_cache *cache,
+						   struct rspamd_re_class_shard *shard,
+						   const char *cache_dir, bool try_load)
+{
+	char path[PATH_MAX];
+	int fd, n, *hs_ids = NULL, *hs_flags = NULL;
+	uint8_t *map;
+	gsize hdr_len;
+	struct stat st;
 
-		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
-			/* Do not try to compile bad regexp */
-			msg_info_re_cache(
-				"do not try compile %s to hyperscan as it is PCRE only",
-				rspamd_regexp_get_pattern(re));
-			continue;
-		}
+	rspamd_re_cache_reset_shard(cache, shard);
 
-		hs_flags[i] = 0;
-		hs_exts[i] = NULL;
-#ifndef WITH_PCRE2
-		if (pcre_flags & PCRE_FLAG(UTF8)) {
-			hs_flags[i] |= HS_FLAG_UTF8;
-		}
-#else
-		if (pcre_flags & PCRE_FLAG(UTF)) {
-			hs_flags[i] |= HS_FLAG_UTF8;
+	rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cache_dir,
+					G_DIR_SEPARATOR, shard->hash);
+
+	if (!rspamd_re_cache_is_valid_hyperscan_file(cache, path, try_load, FALSE, NULL)) {
+		if (!try_load) {
+			msg_err_re_cache("invalid hyperscan hash file '%s'",
+							 path);
 		}
-#endif
-		if (pcre_flags & PCRE_FLAG(CASELESS)) {
-			hs_flags[i] |= HS_FLAG_CASELESS;
+		else {
+			msg_debug_re_cache("invalid hyperscan hash file '%s'",
+							   path);
 		}
-		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-			hs_flags[i] |= HS_FLAG_MULTILINE;
+
+		return -1;
+	}
+
+	msg_debug_re_cache("load hyperscan database from '%s'",
+					   shard->hash);
+
+	fd = open(path, O_RDONLY);
+
+	/* Read number of regexps */
+	g_assert(fd != -1);
+	fstat(fd, &st);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		if (!try_load) {
+			msg_err_re_cache("cannot mmap %s: %s", path, strerror(errno));
 		}
-		if (pcre_flags & PCRE_FLAG(DOTALL)) {
-			hs_flags[i] |= HS_FLAG_DOTALL;
+		else {
+			msg_debug_re_cache("cannot mmap %s: %s", path, strerror(errno));
 		}
 
+		close(fd);
 
-		if (re_flags & RSPAMD_REGEXP_FLAG_LEFTMOST) {
-			hs_flags[i] |= HS_FLAG_SOM_LEFTMOST;
+		return -1;
+	}
+
+	close(fd);
+	n = rspamd_re_cache_read_shard_header(cache, map, st.st_size,
+										  &hs_ids, &hs_flags, &hdr_len);
+	munmap(map, st.st_size);
+
+	if (n <= 0) {
+		/* Some wrong amount of regexps */
+		if (!try_load) {
+			msg_err_re_cache("bad number of expressions in %s: %d",
+							 path, n);
 		}
-		else if (rspamd_regexp_get_maxhits(re) == 1) {
-			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+		else {
+			msg_debug_re_cache("bad number of expressions in %s: %d",
+							   path, n);
 		}
 
-		char *pat = rspamd_re_cache_hs_pattern_from_pcre(re);
+		return -1;
+	}
 
-		if (hs_compile(pat,
-					   hs_flags[i],
-					   HS_MODE_BLOCK,
-					   &cache->plt,
-					   &test_db,
-					   &hs_errors) != HS_SUCCESS) {
-			msg_info_re_cache("cannot compile '%s' to hyperscan: '%s', try prefilter match",
-							  pat,
-							  hs_errors != NULL ? hs_errors->message : "unknown error");
-			hs_free_compile_error(hs_errors);
+	shard->hs_db = rspamd_hyperscan_maybe_load(path, hdr_len);
 
-			/* The approximation operation might take a significant
-			 * amount of time, so we need to check if it's finite
-			 */
-			if (rspamd_re_cache_is_finite(cache, re, hs_flags[i], cbdata->max_time)) {
-				hs_flags[i] |= HS_FLAG_PREFILTER;
-				hs_ids[i] = rspamd_regexp_get_cache_id(re);
-				hs_pats[i] = pat;
-				i++;
-			}
-			else {
-				g_free(pat); /* Avoid leak */
-			}
+	if (shard->hs_db == NULL) {
+		if (!try_load) {
+			msg_err_re_cache("bad hs database in %s", path);
 		}
 		else {
-			hs_ids[i] = rspamd_regexp_get_cache_id(re);
-			hs_pats[i] = pat;
-			i++;
-			hs_free_database(test_db);
+			msg_debug_re_cache("bad hs database in %s", path);
 		}
+		g_free(hs_ids);
+		g_free(hs_flags);
+
+		return -1;
+	}
+
+	return rspamd_re_cache_attach_shard(cache, shard, n, hs_ids, hs_flags,
+										path, try_load);
+}
+
+/*
+ * Bundle is a sealed memory file made by hs_helper after compilation:
+ * a header, an index of shards and then header of each shard file followed
+ * by its database deserialized in place, so processes use databases directly
+ * from the shared mapping with no disk reads and no deserialization
+ */
+#define RSPAMD_HS_BUNDLE_ALIGN 64
+#define RSPAMD_HS_BUNDLE_ALIGNED(x) (((x) + RSPAMD_HS_BUNDLE_ALIGN - 1) & ~((gsize) RSPAMD_HS_BUNDLE_ALIGN - 1))
+static const unsigned char rspamd_hs_bundle_magic[] = {'r', 's', 'h', 's', 'b', 'n', '0', '1'};
+
+struct rspamd_re_cache_bundle_hdr {
+	unsigned char magic[sizeof(rspamd_hs_bundle_magic)];
+	hs_platform_info_t plt;
+	uint32_t nshards;
+	uint32_t unused;
+};
+
+struct rspamd_re_cache_bundle_entry {
+	char hash[rspamd_cryptobox_HASHBYTES + 1];
+	uint64_t hdr_off;
+	uint64_t hdr_len;
+	uint64_t db_off;
+	uint64_t db_len;
+};
+
+static int
+rspamd_re_cache_load_bundle_shard(struct rspamd_re_cache *cache,
+								  struct rspamd_re_class_shard *shard,
+								  rspamd_hyperscan_bundle_t *bundle,
+								  const struct rspamd_re_cache_bundle_entry *entry,
+								  bool try_load)
+{
+	const unsigned char *data;
+	gsize len, hdr_len;
+	int n, *hs_ids = NULL, *hs_flags = NULL;
+
+	rspamd_re_cache_reset_shard(cache, shard);
+	data = rspamd_hyperscan_bundle_data(bundle, &len);
+
+	if (entry->hdr_off + entry->hdr_len > len) {
+		msg_err_re_cache("bad hyperscan bundle entry for %s", shard->hash);
+
+		return -1;
+	}
+
+	n = rspamd_re_cache_read_shard_header(cache, data + entry->hdr_off,
+										  entry->hdr_len, &hs_ids, &hs_flags, &hdr_len);
+
+	if (n <= 0) {
+		msg_err_re_cache("bad number of expressions in bundle for %s: %d",
+						 shard->hash, n);
+
+		return -1;
 	}
-	/* Adjust real re number */
-	n = i;
-
-#define CLEANUP_ALLOCATED(is_err)                            \
-	do {                                                     \
-		g_free(hs_flags);                                    \
-		g_free(hs_ids);                                      \
-		for (unsigned int j = 0; j < i; j++) {               \
-			g_free(hs_pats[j]);                              \
-		}                                                    \
-		g_free(hs_pats);                                     \
-		g_free(hs_exts);                                     \
-		if (is_err) {                                        \
-			close(fd);                                       \
-			unlink(path);                                    \
-			if (hs_errors) hs_free_compile_error(hs_errors); \
-		}                                                    \
-	} while (0)
-
-	if (n > 0) {
-		/* Create the hs tree */
-		hs_errors = NULL;
-		if (hs_compile_ext_multi((const char **) hs_pats,
-								 hs_flags,
-								 hs_ids,
-								 hs_exts,
-								 n,
-								 HS_MODE_BLOCK,
-								 &cache->plt,
-								 &test_db,
-								 &hs_errors) != HS_SUCCESS) {
-
-			err = g_error_new(rspamd_re_cache_quark(), EINVAL,
-							  "cannot create tree of regexp when processing '%s': %s",
-							  hs_pats[hs_errors->expression], hs_errors->message);
-			CLEANUP_ALLOCATED(true);
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
 
-			return;
-		}
+	shard->hs_db = rspamd_hyperscan_from_bundle(bundle, entry->db_off, entry->db_len);
 
-		if (hs_serialize_database(test_db, &hs_serialized,
-								  &serialized_len) != HS_SUCCESS) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot serialize tree of regexp for %s",
-							  re_class->hash);
+	if (shard->hs_db == NULL) {
+		msg_err_re_cache("bad hs database in bundle for %s", shard->hash);
+		g_free(hs_ids);
+		g_free(hs_flags);
 
-			CLEANUP_ALLOCATED(true);
-			hs_free_database(test_db);
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
-		}
+		return -1;
+	}
 
-		hs_free_database(test_db);
+	return rspamd_re_cache_attach_shard(cache, shard, n, hs_ids, hs_flags,
+										shard->hash, try_load);
+}
 
-		/*
-		 * Magic - 8 bytes
-		 * Platform - sizeof (platform)
-		 * n - number of regexps
-		 * n * <regexp ids>
-		 * n * <regexp flags>
-		 * crc - 8 bytes checksum
-		 * <hyperscan blob>
-		 */
-		rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
-		/* IDs -> Flags -> Hs blob */
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_ids, sizeof(*hs_ids) * n);
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_flags, sizeof(*hs_flags) * n);
-		rspamd_cryptobox_fast_hash_update(&crc_st,
-										  hs_serialized, serialized_len);
-		crc = rspamd_cryptobox_fast_hash_final(&crc_st);
-
-
-		iov[0].iov_base = (void *) rspamd_hs_magic;
-		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-		iov[1].iov_base = &cache->plt;
-		iov[1].iov_len = sizeof(cache->plt);
-		iov[2].iov_base = &n;
-		iov[2].iov_len = sizeof(n);
-		iov[3].iov_base = hs_ids;
-		iov[3].iov_len = sizeof(*hs_ids) * n;
-		iov[4].iov_base = hs_flags;
-		iov[4].iov_len = sizeof(*hs_flags) * n;
-		iov[5].iov_base = &crc;
-		iov[5].iov_len = sizeof(crc);
-		iov[6].iov_base = hs_serialized;
-		iov[6].iov_len = serialized_len;
-
-		if (writev(fd, iov, G_N_ELEMENTS(iov)) == -1) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot serialize tree of regexp to %s: %s",
-							  path, strerror(errno));
-
-			CLEANUP_ALLOCATED(true);
-			g_free(hs_serialized);
-
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
-		}
+/*
+ * Returns index of shards in a bundle: hash -> entry
+ */
+static GHashTable *
+rspamd_re_cache_bundle_index(struct rspamd_re_cache *cache,
+							 rspamd_hyperscan_bundle_t *bundle)
+{
+	const unsigned char *data;
+	const struct rspamd_re_cache_bundle_entry *entries;
+	struct rspamd_re_cache_bundle_hdr hdr;
+	GHashTable *index;
+	gsize len;
+	unsigned int i;
 
-		if (re_class->type_len > 0) {
-			msg_info_re_cache(
-				"compiled class %s(%*s) to cache %6s, %d/%d regexps",
-				rspamd_re_cache_type_to_string(re_class->type),
-				(int) re_class->type_len - 1,
-				re_class->type_data,
-				re_class->hash,
-				n,
-				(int) g_hash_table_size(re_class->re));
-		}
-		else {
-			msg_info_re_cache(
-				"compiled class %s to cache %6s, %d/%d regexps",
-				rspamd_re_cache_type_to_string(re_class->type),
-				re_class->hash,
-				n,
-				(int) g_hash_table_size(re_class->re));
-		}
+	data = rspamd_hyperscan_bundle_data(bundle, &len);
 
-		cbdata->total += n;
-		CLEANUP_ALLOCATED(false);
+	if (len < sizeof(hdr)) {
+		msg_err_re_cache("hyperscan bundle is too short: %uz", len);
 
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf(npath, sizeof(npath), "%s%c%s.hs", cbdata->cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
+		return NULL;
+	}
 
-		if (rename(path, npath) == -1) {
-			err = g_error_new(rspamd_re_cache_quark(),
-							  errno,
-							  "cannot rename %s to %s: %s",
-							  path, npath, strerror(errno));
-			unlink(path);
-			close(fd);
+	memcpy(&hdr, data, sizeof(hdr));
 
-			rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
-			return;
-		}
+	if (memcmp(hdr.magic, rspamd_hs_bundle_magic, sizeof(hdr.magic)) != 0) {
+		msg_err_re_cache("bad hyperscan bundle magic");
 
-		close(fd);
+		return NULL;
 	}
-	else {
-		err = g_error_new(rspamd_re_cache_quark(),
-						  errno,
-						  "no suitable regular expressions %s (%d original): "
-						  "remove temporary file %s",
-						  rspamd_re_cache_type_to_string(re_class->type),
-						  (int) g_hash_table_size(re_class->re),
-						  path);
 
-		CLEANUP_ALLOCATED(true);
-		rspamd_re_cache_compile_err(EV_A_ w, err, cbdata, false);
+	if (memcmp(&hdr.plt, &cache->plt, sizeof(hdr.plt)) != 0) {
+		msg_err_re_cache("hyperscan bundle is compiled for another platform");
 
-		return;
+		return NULL;
 	}
 
-	/* Continue process */
-	ev_timer_again(EV_A_ w);
-}
-
-#endif
+	if (sizeof(hdr) + (gsize) hdr.nshards * sizeof(*entries) > len) {
+		msg_err_re_cache("bad number of shards in hyperscan bundle: %ud", hdr.nshards);
 
-int rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
-									  const char *cache_dir,
-									  double max_time,
-									  gboolean silent,
-									  struct ev_loop *event_loop,
-									  void (*cb)(unsigned int ncompiled, GError *err, void *cbd),
-									  void *cbd)
-{
-	g_assert(cache != NULL);
-	g_assert(cache_dir != NULL);
+		return NULL;
+	}
 
-#ifndef WITH_HYPERSCAN
-	return -1;
-#else
-	static ev_timer *timer;
-	static const ev_tstamp timer_interval = 0.1;
-	struct rspamd_re_cache_hs_compile_cbdata *cbdata;
+	entries = (const struct rspamd_re_cache_bundle_entry *) (data + sizeof(hdr));
+	index = g_hash_table_new(rspamd_str_hash, rspamd_str_equal);
 
-	cbdata = g_malloc0(sizeof(*cbdata));
-	g_hash_table_iter_init(&cbdata->it, cache->re_classes);
-	cbdata->cache = cache;
-	cbdata->cache_dir = cache_dir;
-	cbdata->cb = cb;
-	cbdata->cbd = cbd;
-	cbdata->max_time = max_time;
-	cbdata->silent = silent;
-	cbdata->total = 0;
-	timer = g_malloc0(sizeof(*timer));
-	timer->data = (void *) cbdata; /* static */
+	for (i = 0; i < hdr.nshards; i++) {
+		if (entries[i].hash[rspamd_cryptobox_HASHBYTES] == '\0') {
+			g_hash_table_insert(index, (gpointer) entries[i].hash, (gpointer) &entries[i]);
+		}
+	}
 
-	ev_timer_init(timer, rspamd_re_cache_compile_timer_cb,
-				  timer_interval, timer_interval);
-	ev_timer_start(event_loop, timer);
+	return index;
+}
 
-	return 0;
+#ifdef HAVE_MEMFD_CREATE
+struct rspamd_re_cache_bundle_shard {
+	struct rspamd_re_class_shard *shard;
+	char *content;
+	gsize len;
+	gsize hdr_len;
+	gsize db_len;
+};
+#endif
 #endif
-}
 
-gboolean
-rspamd_re_cache_is_valid_hyperscan_file(struct rspamd_re_cache *cache,
-										const char *path, gboolean silent, gboolean try_load, GError **err)
+int rspamd_re_cache_hyperscan_bundle(struct rspamd_re_cache *cache,
+									 const char *cache_dir, GError **err)
 {
 	g_assert(cache != NULL);
-	g_assert(path != NULL);
+	g_assert(cache_dir != NULL);
 
-#ifndef WITH_HYPERSCAN
-	return FALSE;
+#if !defined(WITH_HYPERSCAN) || !defined(HAVE_MEMFD_CREATE)
+	g_set_error(err, rspamd_re_cache_quark(), ENOTSUP,
+				"hyperscan bundles are not supported on this platform");
+
+	return -1;
 #else
-	int fd, n, ret;
-	unsigned char magicbuf[RSPAMD_HS_MAGIC_LEN];
-	const unsigned char *mb;
+	GArray *shards;
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
-	gsize len;
-	const char *hash_pos;
-	hs_platform_info_t test_plt;
-	hs_database_t *test_db = NULL;
-	unsigned char *map, *p, *end;
-	rspamd_cryptobox_fast_hash_state_t crc_st;
-	uint64_t crc, valid_crc;
-
-	len = strlen(path);
-
-	if (len < sizeof(rspamd_cryptobox_HASHBYTES + 3)) {
-		if (!silent) {
-			msg_err_re_cache("cannot open hyperscan cache file %s: too short filename",
-							 path);
-		}
-		g_set_error(err, rspamd_re_cache_quark(), 0,
-					"too short filename");
-
-		return FALSE;
-	}
-
-	if (memcmp(path + len - 3, ".hs", 3) != 0) {
-		if (!silent) {
-			msg_err_re_cache("cannot open hyperscan cache file %s: not ending with .hs",
-							 path);
-		}
-		g_set_error(err, rspamd_re_cache_quark(), 0,
-					"not ending with .hs");
-		return FALSE;
-	}
+	struct rspamd_re_cache_bundle_shard *bs;
+	struct rspamd_re_cache_bundle_hdr hdr;
+	struct rspamd_re_cache_bundle_entry *entry;
+	char path[PATH_MAX];
+	unsigned char *map;
+	gsize total, off;
+	int fd = -1, *hs_ids, *hs_flags;
+	unsigned int i;
+	hs_error_t hs_ret;
 
-	hash_pos = path + len - 3 - (sizeof(re_class->hash) - 1);
+	shards = g_array_new(FALSE, TRUE, sizeof(*bs));
 	g_hash_table_iter_init(&it, cache->re_classes);
 
 	while (g_hash_table_iter_next(&it, &k, &v)) {
 		re_class = v;
 
-		if (memcmp(hash_pos, re_class->hash, sizeof(re_class->hash) - 1) == 0) {
-			/* Open file and check magic */
-			gssize r;
+		for (i = 0; i < re_class->nshards; i++) {
+			struct rspamd_re_cache_bundle_shard cur;
 
-			fd = open(path, O_RDONLY);
+			memset(&cur, 0, sizeof(cur));
+			cur.shard = &re_class->shards[i];
 
-			if (fd == -1) {
-				if (errno != ENOENT || !silent) {
-					msg_err_re_cache("cannot open hyperscan cache file %s: %s",
-									 path, strerror(errno));
-				}
-				g_set_error(err, rspamd_re_cache_quark(), 0,
-							"%s",
-							strerror(errno));
-				return FALSE;
+			if (cur.shard->re->len == 0) {
+				continue;
 			}
 
-			if ((r = read(fd, magicbuf, sizeof(magicbuf))) != sizeof(magicbuf)) {
-				if (r == -1) {
-					msg_err_re_cache("cannot read magic from hyperscan "
-									 "cache file %s: %s",
-									 path, strerror(errno));
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"cannot read magic: %s",
-								strerror(errno));
-				}
-				else {
-					msg_err_re_cache("truncated read magic from hyperscan "
-									 "cache file %s: %z, %z wanted",
-									 path, r, (gsize) sizeof(magicbuf));
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"truncated read magic %zd, %zd wanted",
-								r, (gsize) sizeof(magicbuf));
-				}
+			rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cache_dir,
+							G_DIR_SEPARATOR, cur.shard->hash);
 
-				close(fd);
-				return FALSE;
+			/* Shards that failed to compile are matched by PCRE */
+			if (!rspamd_re_cache_is_valid_hyperscan_file(cache, path, TRUE, FALSE, NULL) ||
+				!g_file_get_contents(path, &cur.content, &cur.len, NULL)) {
+				continue;
 			}
 
-			mb = rspamd_hs_magic;
+			if (rspamd_re_cache_read_shard_header(cache, (const uint8_t *) cur.content,
+												  cur.len, &hs_ids, &hs_flags, &cur.hdr_len) <= 0) {
+				g_free(cur.content);
+				continue;
+			}
 
-			if (memcmp(magicbuf, mb, sizeof(magicbuf)) != 0) {
-				msg_err_re_cache("cannot open hyperscan cache file %s: "
-								 "bad magic ('%*xs', '%*xs' expected)",
-								 path, (int) RSPAMD_HS_MAGIC_LEN, magicbuf,
-								 (int) RSPAMD_HS_MAGIC_LEN, mb);
+			g_free(hs_ids);
+			g_free(hs_flags);
 
-				close(fd);
-				g_set_error(err, rspamd_re_cache_quark(), 0, "invalid magic");
-				return FALSE;
+			if (hs_serialized_database_size(cur.content + cur.hdr_len,
+											cur.len - cur.hdr_len, &cur.db_len) != HS_SUCCESS) {
+				msg_info_re_cache("cannot get unserialized size of %s", path);
+				g_free(cur.content);
+				continue;
 			}
 
-			if ((r = read(fd, &test_plt, sizeof(test_plt))) != sizeof(test_plt)) {
-				if (r == -1) {
-					msg_err_re_cache("cannot read platform data from hyperscan "
-									 "cache file %s: %s",
-									 path, strerror(errno));
-				}
-				else {
-					msg_err_re_cache("truncated read platform data from hyperscan "
-									 "cache file %s: %z, %z wanted",
-									 path, r, (gsize) sizeof(magicbuf));
-				}
+			g_array_append_val(shards, cur);
+		}
+	}
 
-				g_set_error(err, rspamd_re_cache_quark(), 0,
-							"cannot read platform data: %s", strerror(errno));
+	/* Header, index and then aligned shards */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, rspamd_hs_bundle_magic, sizeof(hdr.magic));
+	memcpy(&hdr.plt, &cache->plt, sizeof(hdr.plt));
+	hdr.nshards = shards->len;
+	total = sizeof(hdr) + shards->len * sizeof(*entry);
+
+	for (i = 0; i < shards->len; i++) {
+		bs = &g_array_index(shards, struct rspamd_re_cache_bundle_shard, i);
+		total += bs->hdr_len;
+		total = RSPAMD_HS_BUNDLE_ALIGNED(total);
+		total += bs->db_len;
+	}
 
-				close(fd);
-				return FALSE;
-			}
+	fd = memfd_create("rspamd-hs-bundle", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 
-			if (test_plt.cpu_features != cache->plt.cpu_features) {
-				msg_err_re_cache("cannot open hyperscan cache file %s: "
-								 "compiled for a different platform",
-								 path);
-				g_set_error(err, rspamd_re_cache_quark(), 0,
-							"compiled for a different platform");
+	if (fd == -1 || ftruncate(fd, total) == -1) {
+		g_set_error(err, rspamd_re_cache_quark(), errno,
+					"cannot create memory file: %s", strerror(errno));
+		goto err;
+	}
 
-				close(fd);
-				return FALSE;
-			}
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-			close(fd);
+	if (map == MAP_FAILED) {
+		g_set_error(err, rspamd_re_cache_quark(), errno,
+					"cannot mmap memory file: %s", strerror(errno));
+		goto err;
+	}
 
-			if (try_load) {
-				map = rspamd_file_xmap(path, PROT_READ, &len, TRUE);
+	memcpy(map, &hdr, sizeof(hdr));
+	entry = (struct rspamd_re_cache_bundle_entry *) (map + sizeof(hdr));
+	off = sizeof(hdr) + shards->len * sizeof(*entry);
+
+	for (i = 0; i < shards->len; i++, entry++) {
+		bs = &g_array_index(shards, struct rspamd_re_cache_bundle_shard, i);
+		rspamd_strlcpy(entry->hash, bs->shard->hash, sizeof(entry->hash));
+		entry->hdr_off = off;
+		entry->hdr_len = bs->hdr_len;
+		memcpy(map + off, bs->content, bs->hdr_len);
+		off = RSPAMD_HS_BUNDLE_ALIGNED(off + bs->hdr_len);
+		entry->db_off = off;
+		entry->db_len = bs->db_len;
+
+		if ((hs_ret = hs_deserialize_database_at(bs->content + bs->hdr_len,
+												 bs->len - bs->hdr_len,
+												 (hs_database_t *) (map + off))) != HS_SUCCESS) {
+			g_set_error(err, rspamd_re_cache_quark(), EINVAL,
+						"cannot deserialize %s: %d", bs->shard->hash, hs_ret);
+			munmap(map, total);
+			goto err;
+		}
 
-				if (map == NULL) {
-					msg_err_re_cache("cannot mmap hyperscan cache file %s: "
-									 "%s",
-									 path, strerror(errno));
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"mmap error: %s", strerror(errno));
-					return FALSE;
-				}
+		off += bs->db_len;
+	}
 
-				p = map + RSPAMD_HS_MAGIC_LEN + sizeof(test_plt);
-				end = map + len;
-				memcpy(&n, p, sizeof(n));
-				p += sizeof(int);
-
-				if (n <= 0 || 2 * n * sizeof(int) +         /* IDs + flags */
-									  sizeof(uint64_t) +    /* crc */
-									  RSPAMD_HS_MAGIC_LEN + /* header */
-									  sizeof(cache->plt) >
-								  len) {
-					/* Some wrong amount of regexps */
-					msg_err_re_cache("bad number of expressions in %s: %d",
-									 path, n);
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"bad number of expressions: %d", n);
-					munmap(map, len);
-					return FALSE;
-				}
+	/* Writable mappings must be gone before sealing */
+	munmap(map, total);
 
-				/*
-				 * Magic - 8 bytes
-				 * Platform - sizeof (platform)
-				 * n - number of regexps
-				 * n * <regexp ids>
-				 * n * <regexp flags>
-				 * crc - 8 bytes checksum
-				 * <hyperscan blob>
-				 */
-
-				memcpy(&crc, p + n * 2 * sizeof(int), sizeof(crc));
-				rspamd_cryptobox_fast_hash_init(&crc_st, 0xdeadbabe);
-				/* IDs */
-				rspamd_cryptobox_fast_hash_update(&crc_st, p, n * sizeof(int));
-				/* Flags */
-				rspamd_cryptobox_fast_hash_update(&crc_st, p + n * sizeof(int),
-												  n * sizeof(int));
-				/* HS database */
-				p += n * sizeof(int) * 2 + sizeof(uint64_t);
-				rspamd_cryptobox_fast_hash_update(&crc_st, p, end - p);
-				valid_crc = rspamd_cryptobox_fast_hash_final(&crc_st);
-
-				if (crc != valid_crc) {
-					msg_warn_re_cache("outdated or invalid hs database in %s: "
-									  "crc read %xL, crc expected %xL",
-									  path, crc, valid_crc);
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"outdated or invalid hs database, crc check failure");
-					munmap(map, len);
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		g_set_error(err, rspamd_re_cache_quark(), errno,
+					"cannot seal memory file: %s", strerror(errno));
+		goto err;
+	}
 
-					return FALSE;
-				}
+	msg_info_re_cache("created hyperscan bundle of %ud shards, %uz bytes",
+					  shards->len, total);
 
-				if ((ret = hs_deserialize_database(p, end - p, &test_db)) != HS_SUCCESS) {
-					msg_err_re_cache("bad hs database in %s: %d", path, ret);
-					g_set_error(err, rspamd_re_cache_quark(), 0,
-								"deserialize error: %d", ret);
-					munmap(map, len);
+	for (i = 0; i < shards->len; i++) {
+		g_free(g_array_index(shards, struct rspamd_re_cache_bundle_shard, i).content);
+	}
 
-					return FALSE;
-				}
+	g_array_free(shards, TRUE);
 
-				hs_free_database(test_db);
-				munmap(map, len);
-			}
-			/* XXX: add crc check */
+	return fd;
 
-			return TRUE;
-		}
+err:
+	for (i = 0; i < shards->len; i++) {
+		g_free(g_array_index(shards, struct rspamd_re_cache_bundle_shard, i).content);
 	}
 
-	if (!silent) {
-		msg_warn_re_cache("unknown hyperscan cache file %s", path);
-	}
+	g_array_free(shards, TRUE);
 
-	g_set_error(err, rspamd_re_cache_quark(), 0,
-				"unknown hyperscan file");
+	if (fd != -1) {
+		close(fd);
+	}
 
-	return FALSE;
+	return -1;
 #endif
 }
 
-
 enum rspamd_hyperscan_status
-rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
-							   const char *cache_dir, bool try_load)
+rspamd_re_cache_load_hyperscan_bundle(struct rspamd_re_cache *cache,
+									  const char *cache_dir, int fd,
+									  bool try_load)
 {
 	g_assert(cache != NULL);
 	g_assert(cache_dir != NULL);
@@ -2497,186 +4485,79 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 #ifndef WITH_HYPERSCAN
 	return RSPAMD_HYPERSCAN_UNSUPPORTED;
 #else
-	char path[PATH_MAX];
-	int fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	int n, total = 0;
+	unsigned int i, nloaded = 0, nshards = 0, nbundled = 0;
 	GHashTableIter it;
 	gpointer k, v;
-	uint8_t *map, *p;
 	struct rspamd_re_class *re_class;
-	struct rspamd_re_cache_elt *elt;
-	struct stat st;
-	gboolean has_valid = FALSE, all_valid = FALSE;
+	struct rspamd_re_class_shard *shard;
+	rspamd_hyperscan_bundle_t *bundle = NULL;
+	GHashTable *index = NULL;
+	const struct rspamd_re_cache_bundle_entry *entry;
+
+	if (fd != -1) {
+		bundle = rspamd_hyperscan_bundle_map(fd);
+
+		if (bundle) {
+			index = rspamd_re_cache_bundle_index(cache, bundle);
+		}
+	}
 
 	g_hash_table_iter_init(&it, cache->re_classes);
 
 	while (g_hash_table_iter_next(&it, &k, &v)) {
 		re_class = v;
-		rspamd_snprintf(path, sizeof(path), "%s%c%s.hs", cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
-
-		if (rspamd_re_cache_is_valid_hyperscan_file(cache, path, try_load, FALSE, NULL)) {
-			msg_debug_re_cache("load hyperscan database from '%s'",
-							   re_class->hash);
 
-			fd = open(path, O_RDONLY);
+		for (i = 0; i < re_class->nshards; i++) {
+			shard = &re_class->shards[i];
 
-			/* Read number of regexps */
-			g_assert(fd != -1);
-			fstat(fd, &st);
-
-			map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-
-			if (map == MAP_FAILED) {
-				if (!try_load) {
-					msg_err_re_cache("cannot mmap %s: %s", path, strerror(errno));
-				}
-				else {
-					msg_debug_re_cache("cannot mmap %s: %s", path, strerror(errno));
-				}
-
-				close(fd);
-				all_valid = FALSE;
-				continue;
-			}
-
-			close(fd);
-			p = map + RSPAMD_HS_MAGIC_LEN + sizeof(cache->plt);
-			n = *(int *) p;
-
-			if (n <= 0 || 2 * n * sizeof(int) +         /* IDs + flags */
-								  sizeof(uint64_t) +    /* crc */
-								  RSPAMD_HS_MAGIC_LEN + /* header */
-								  sizeof(cache->plt) >
-							  (gsize) st.st_size) {
-				/* Some wrong amount of regexps */
-				if (!try_load) {
-					msg_err_re_cache("bad number of expressions in %s: %d",
-									 path, n);
-				}
-				else {
-					msg_debug_re_cache("bad number of expressions in %s: %d",
-									   path, n);
-				}
-
-				munmap(map, st.st_size);
-				all_valid = FALSE;
+			if (shard->re->len == 0) {
 				continue;
 			}
 
-			total += n;
-			p += sizeof(n);
-			hs_ids = g_malloc(n * sizeof(*hs_ids));
-			memcpy(hs_ids, p, n * sizeof(*hs_ids));
-			p += n * sizeof(*hs_ids);
-			hs_flags = g_malloc(n * sizeof(*hs_flags));
-			memcpy(hs_flags, p, n * sizeof(*hs_flags));
-
-			/* Skip crc */
-			p += n * sizeof(*hs_ids) + sizeof(uint64_t);
-
-			/* Cleanup */
-			if (re_class->hs_scratch != NULL) {
-				hs_free_scratch(re_class->hs_scratch);
-			}
-
-			if (re_class->hs_db != NULL) {
-				rspamd_hyperscan_free(re_class->hs_db, false);
-			}
-
-			if (re_class->hs_ids) {
-				g_free(re_class->hs_ids);
-			}
+			nshards++;
+			entry = index ? g_hash_table_lookup(index, shard->hash) : NULL;
 
-			re_class->hs_ids = NULL;
-			re_class->hs_scratch = NULL;
-			re_class->hs_db = NULL;
-			munmap(map, st.st_size);
+			if (entry) {
+				n = rspamd_re_cache_load_bundle_shard(cache, shard, bundle,
+													  entry, try_load);
 
-			re_class->hs_db = rspamd_hyperscan_maybe_load(path, p - map);
-			if (re_class->hs_db == NULL) {
-				if (!try_load) {
-					msg_err_re_cache("bad hs database in %s", path);
-				}
-				else {
-					msg_debug_re_cache("bad hs database in %s", path);
+				if (n > 0) {
+					nbundled++;
 				}
-				g_free(hs_ids);
-				g_free(hs_flags);
-
-				re_class->hs_ids = NULL;
-				re_class->hs_scratch = NULL;
-				re_class->hs_db = NULL;
-				all_valid = FALSE;
-
-				continue;
 			}
-
-			if ((ret = hs_alloc_scratch(rspamd_hyperscan_get_database(re_class->hs_db),
-										&re_class->hs_scratch)) != HS_SUCCESS) {
-				if (!try_load) {
-					msg_err_re_cache("bad hs database in %s; error code: %d", path, ret);
-				}
-				else {
-					msg_debug_re_cache("bad hs database in %s; error code: %d", path, ret);
-				}
-				g_free(hs_ids);
-				g_free(hs_flags);
-
-				rspamd_hyperscan_free(re_class->hs_db, true);
-				re_class->hs_ids = NULL;
-				re_class->hs_scratch = NULL;
-				re_class->hs_db = NULL;
-				all_valid = FALSE;
-
-				continue;
+			else {
+				/* Not in the bundle (e.g. another config), try the cache dir */
+				n = rspamd_re_cache_load_shard(cache, shard, cache_dir, try_load);
 			}
 
-			/*
-			 * Now find hyperscan elts that are successfully compiled and
-			 * specify that they should be matched using hyperscan
-			 */
-			for (i = 0; i < n; i++) {
-				g_assert((int) cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
-				elt = g_ptr_array_index(cache->re, hs_ids[i]);
-
-				if (hs_flags[i] & HS_FLAG_PREFILTER) {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
-				}
-				else {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
-				}
+			if (n > 0) {
+				total += n;
+				nloaded++;
 			}
+		}
+	}
 
-			re_class->hs_ids = hs_ids;
-			g_free(hs_flags);
-			re_class->nhs = n;
+	if (index) {
+		g_hash_table_unref(index);
+	}
 
-			if (!has_valid) {
-				has_valid = TRUE;
-				all_valid = TRUE;
-			}
-		}
-		else {
-			if (!try_load) {
-				msg_err_re_cache("invalid hyperscan hash file '%s'",
-								 path);
-			}
-			else {
-				msg_debug_re_cache("invalid hyperscan hash file '%s'",
-								   path);
-			}
-			all_valid = FALSE;
-			continue;
-		}
+	if (bundle) {
+		/* Loaded databases keep the mapping */
+		rspamd_hyperscan_bundle_unref(bundle);
 	}
 
-	if (has_valid) {
-		if (all_valid) {
-			msg_info_re_cache("full hyperscan database of %d regexps has been loaded", total);
+	if (nloaded > 0) {
+		if (nloaded == nshards) {
+			msg_info_re_cache("full hyperscan database of %d regexps (%ud shards, "
+							  "%ud from bundle) has been loaded",
+							  total, nloaded, nbundled);
 			cache->hyperscan_loaded = RSPAMD_HYPERSCAN_LOADED_FULL;
 		}
 		else {
-			msg_info_re_cache("partial hyperscan database of %d regexps has been loaded", total);
+			msg_info_re_cache("partial hyperscan database of %d regexps (%ud of %ud shards, "
+							  "%ud from bundle) has been loaded",
+							  total, nloaded, nshards, nbundled);
 			cache->hyperscan_loaded = RSPAMD_HYPERSCAN_LOADED_PARTIAL;
 		}
 	}
@@ -2685,11 +4566,20 @@ rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
 		cache->hyperscan_loaded = RSPAMD_HYPERSCAN_LOAD_ERROR;
 	}
 
+	/* Match types have been changed */
+	rspamd_re_cache_init_literals(cache);
 
 	return cache->hyperscan_loaded;
 #endif
 }
 
+enum rspamd_hyperscan_status
+rspamd_re_cache_load_hyperscan(struct rspamd_re_cache *cache,
+							   const char *cache_dir, bool try_load)
+{
+	return rspamd_re_cache_load_hyperscan_bundle(cache, cache_dir, -1, try_load);
+}
+
 void rspamd_re_cache_add_selector(struct rspamd_re_cache *cache,
 								  const char *sname,
 								  int ref)
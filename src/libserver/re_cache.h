@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "libutil/regexp.h"
+#include "ucl.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,6 +55,9 @@ struct rspamd_re_cache_stat {
 	unsigned int regexp_matched;
 	unsigned int regexp_total;
 	unsigned int regexp_fast_cached;
+	unsigned int regexp_prefiltered;
+	unsigned int inputs_collected;
+	unsigned int inputs_cached;
 };
 
 /**
@@ -141,6 +145,45 @@ int rspamd_re_cache_process_ffi(void *ptask,
 								void *type_data,
 								int is_strong);
 
+/**
+ * Scans hyperscan classes that do not depend on type data (raw headers, body
+ * and urls) for several tasks at once, class by class, so the databases and
+ * scratch space are reused across the whole batch. Results are stored in the
+ * runtime of each task, so subsequent calls of `rspamd_re_cache_process` hit
+ * the fast path. Shards already scanned for a task are skipped, so the batch
+ * can be run at any point of processing. All tasks must share the same re cache.
+ * @param tasks array of tasks
+ * @param ntasks number of tasks
+ * @return number of (task, class shard) pairs processed
+ */
+unsigned int rspamd_re_cache_process_batch(struct rspamd_task **tasks,
+										   unsigned int ntasks);
+
+struct rspamd_re_cache_batch;
+
+/**
+ * Splits `rspamd_re_cache_process_batch` so the scan can be executed in another
+ * thread: collects inputs of shards that are not scanned yet for the tasks.
+ * Tasks memory must stay alive until `rspamd_re_cache_batch_finish` is called.
+ * @return new batch or NULL if there is nothing to scan
+ */
+struct rspamd_re_cache_batch *rspamd_re_cache_batch_new(struct rspamd_task **tasks,
+														unsigned int ntasks);
+
+/**
+ * Scans inputs of a batch, matches are merely recorded. It touches neither
+ * tasks nor lua, so it is safe to call it from a thread; hyperscan databases
+ * must not be reloaded until the batch is finished
+ */
+void rspamd_re_cache_batch_scan(struct rspamd_re_cache_batch *batch);
+
+/**
+ * Applies matches of a scanned batch to the runtimes of its tasks and destroys
+ * the batch, must be called in the thread of the tasks
+ * @return number of (task, class shard) pairs processed
+ */
+unsigned int rspamd_re_cache_batch_finish(struct rspamd_re_cache_batch *batch);
+
 /**
  * Destroy runtime data
  */
@@ -161,6 +204,15 @@ struct rspamd_re_cache *rspamd_re_cache_ref(struct rspamd_re_cache *cache);
  */
 unsigned int rspamd_re_cache_set_limit(struct rspamd_re_cache *cache, unsigned int limit);
 
+/**
+ * Returns cost statistics of the regexps checked by this process: the most
+ * expensive regexps first (by time in profiled tasks, then by scanned bytes)
+ * and hyperscan shards scans
+ * @param limit maximum number of regexps or 0 for all
+ */
+ucl_object_t *rspamd_re_cache_stat_ucl(struct rspamd_re_cache *cache,
+									   unsigned int limit);
+
 /**
  * Convert re type to a human readable string (constant one)
  */
@@ -172,14 +224,19 @@ const char *rspamd_re_cache_type_to_string(enum rspamd_re_type type);
 enum rspamd_re_type rspamd_re_cache_type_from_string(const char *str);
 
 struct ev_loop;
+struct rspamd_cpu_pool;
 /**
- * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * Compile expressions to the hyperscan tree and store in the `cache_dir`.
+ * Each class is compiled by shards, so only the shards with changed expressions
+ * are recompiled
+ * @param pool if not NULL, shards are compiled in parallel in the pool threads
  */
 int rspamd_re_cache_compile_hyperscan(struct rspamd_re_cache *cache,
 									  const char *cache_dir,
 									  double max_time,
 									  gboolean silent,
 									  struct ev_loop *event_loop,
+									  struct rspamd_cpu_pool *pool,
 									  void (*cb)(unsigned int ncompiled, GError *err, void *cbd),
 									  void *cbd);
 
@@ -199,6 +256,23 @@ enum rspamd_hyperscan_status rspamd_re_cache_load_hyperscan(
 	struct rspamd_re_cache *cache,
 	const char *cache_dir, bool try_load);
 
+/**
+ * Loads hyperscan regexps from a bundle made by `rspamd_re_cache_hyperscan_bundle`,
+ * shards missing in the bundle are loaded from the cache dir
+ * @param fd bundle descriptor or -1 to use the cache dir only, it is not closed
+ */
+enum rspamd_hyperscan_status rspamd_re_cache_load_hyperscan_bundle(
+	struct rspamd_re_cache *cache,
+	const char *cache_dir, int fd, bool try_load);
+
+/**
+ * Puts all compiled shards from the cache dir to a sealed memory file with
+ * databases deserialized in place, so they are shared between processes
+ * @return descriptor or -1 if bundles are not supported or on error
+ */
+int rspamd_re_cache_hyperscan_bundle(struct rspamd_re_cache *cache,
+									 const char *cache_dir, GError **err);
+
 /**
  * Registers lua selector in the cache
  */
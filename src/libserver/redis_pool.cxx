@@ -42,7 +42,8 @@ INIT_LOG_MODULE(redis_pool)
 enum class rspamd_redis_pool_connection_state : std::uint8_t {
 	RSPAMD_REDIS_POOL_CONN_INACTIVE = 0,
 	RSPAMD_REDIS_POOL_CONN_ACTIVE,
-	RSPAMD_REDIS_POOL_CONN_FINALISING
+	RSPAMD_REDIS_POOL_CONN_FINALISING,
+	RSPAMD_REDIS_POOL_CONN_SHARED
 };
 
 struct redis_pool_connection {
@@ -55,6 +56,8 @@ struct redis_pool_connection {
 	ev_timer timeout;
 	char tag[MEMPOOL_UID_LEN];
 	rspamd_redis_pool_connection_state state;
+	unsigned nusers = 0;  /* for shared connections */
+	bool retired = false; /* shared connection is not given to new users */
 
 	auto schedule_timeout() -> void;
 	~redis_pool_connection();
@@ -86,6 +89,8 @@ class redis_pool_elt {
 	std::list<redis_pool_connection_ptr> active;
 	std::list<redis_pool_connection_ptr> inactive;
 	std::list<redis_pool_connection_ptr> terminating;
+	/* Connections multiplexed between many users */
+	std::list<redis_pool_connection_ptr> shared;
 	std::string ip;
 	std::string db;
 	std::string username;
@@ -122,6 +127,7 @@ public:
 	}
 
 	auto new_connection() -> redisAsyncContext *;
+	auto new_shared_connection() -> redisAsyncContext *;
 
 	auto release_connection(const redis_pool_connection *conn) -> void
 	{
@@ -135,6 +141,9 @@ public:
 		case rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_FINALISING:
 			terminating.erase(conn->elt_pos);
 			break;
+		case rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED:
+			shared.erase(conn->elt_pos);
+			break;
 		}
 	}
 
@@ -146,7 +155,8 @@ public:
 
 	auto move_to_terminating(redis_pool_connection *conn) -> void
 	{
-		terminating.splice(std::end(terminating), inactive, conn->elt_pos);
+		auto &from = conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED ? shared : inactive;
+		terminating.splice(std::end(terminating), from, conn->elt_pos);
 		conn->elt_pos = std::prev(std::end(terminating));
 	}
 
@@ -224,6 +234,8 @@ class redis_pool final {
 public:
 	double timeout = default_timeout;
 	unsigned max_conns = default_max_conns;
+	/* Shared connections per server, 0 disables multiplexing */
+	unsigned max_shared_conns = 0;
 	struct ev_loop *event_loop;
 	struct rspamd_config *cfg;
 
@@ -239,10 +251,12 @@ public:
 	{
 		event_loop = _loop;
 		cfg = _cfg;
+		max_shared_conns = cfg->redis_shared_conns;
 	}
 
 	auto new_connection(const char *db, const char *username,
-						const char *password, const char *ip, int port) -> redisAsyncContext *;
+						const char *password, const char *ip, int port,
+						bool is_shared = false) -> redisAsyncContext *;
 
 	auto release_connection(redisAsyncContext *ctx,
 							enum rspamd_redis_pool_release_type how) -> void;
@@ -336,13 +350,14 @@ auto redis_pool_connection::redis_conn_timeout_cb(EV_P_ ev_timer *w, int revents
 
 	g_assert(conn->state != rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
-	if (conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_INACTIVE) {
+	if (conn->state != rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_FINALISING) {
+		/* Inactive or idle shared connection */
 		msg_debug_rpool("scheduled soft removal of connection %p",
 						conn->ctx);
+		conn->elt->move_to_terminating(conn);
 		conn->state = rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_FINALISING;
 		ev_timer_again(EV_A_ w);
 		redisAsyncCommand(conn->ctx, redis_pool_connection::redis_quit_cb, conn, "QUIT");
-		conn->elt->move_to_terminating(conn);
 	}
 	else {
 		/* Finalising by timeout */
@@ -417,6 +432,7 @@ redis_pool_connection::redis_pool_connection(redis_pool *_pool,
 
 	pool->register_context(ctx, this);
 	ctx->data = this;
+	memset(&timeout, 0, sizeof(timeout));
 	memset(tag, 0, sizeof(tag));
 	rspamd_random_hex(tag, sizeof(tag) - 1);
 
@@ -504,8 +520,59 @@ auto redis_pool_elt::new_connection() -> redisAsyncContext *
 	RSPAMD_UNREACHABLE;
 }
 
+/*
+ * Shared connections are used by many users at the same time: hiredis
+ * buffers all commands issued in the same loop iteration and writes them
+ * at once, so they are pipelined, and replies are dispatched in order
+ */
+auto redis_pool_elt::new_shared_connection() -> redisAsyncContext *
+{
+	redis_pool_connection *conn = nullptr;
+	unsigned nalive = 0;
+
+	for (auto &cur: shared) {
+		if (cur->retired || cur->ctx->err != REDIS_OK) {
+			continue;
+		}
+
+		nalive++;
+
+		if (conn == nullptr || cur->nusers < conn->nusers) {
+			conn = cur.get();
+		}
+	}
+
+	/* Open one more connection if all of them are busy */
+	if (conn == nullptr || (conn->nusers > 0 && nalive < pool->max_shared_conns)) {
+		auto *nctx = redis_async_new();
+
+		if (nctx) {
+			shared.emplace_back(std::make_unique<redis_pool_connection>(pool, this,
+																		db.c_str(), username.c_str(), password.c_str(), nctx));
+			conn = shared.back().get();
+			conn->elt_pos = std::prev(std::end(shared));
+			conn->state = rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED;
+			msg_debug_rpool("opened shared connection to %s:%d: %p, %d connections",
+							ip.c_str(), port, conn->ctx, (int) nalive + 1);
+		}
+		else if (conn == nullptr) {
+			return nullptr;
+		}
+	}
+
+	if (conn->nusers == 0) {
+		/* Stop cleanup of an idle connection */
+		ev_timer_stop(pool->event_loop, &conn->timeout);
+	}
+
+	conn->nusers++;
+
+	return conn->ctx;
+}
+
 auto redis_pool::new_connection(const char *db, const char *username,
-								const char *password, const char *ip, int port) -> redisAsyncContext *
+								const char *password, const char *ip, int port,
+								bool is_shared) -> redisAsyncContext *
 {
 
 	if (!wanna_die) {
@@ -515,14 +582,15 @@ auto redis_pool::new_connection(const char *db, const char *username,
 		if (found_elt != elts_by_key.end()) {
 			auto &elt = found_elt->second;
 
-			return elt.new_connection();
+			return is_shared ? elt.new_shared_connection() : elt.new_connection();
 		}
 		else {
 			/* Need to create a pool */
 			auto nelt = elts_by_key.try_emplace(key,
 												this, db, username, password, ip, port);
+			auto &elt = nelt.first->second;
 
-			return nelt.first->second.new_connection();
+			return is_shared ? elt.new_shared_connection() : elt.new_connection();
 		}
 	}
 
@@ -536,6 +604,31 @@ auto redis_pool::release_connection(redisAsyncContext *ctx,
 		auto conn_it = conns_by_ctx.find(ctx);
 		if (conn_it != conns_by_ctx.end()) {
 			auto *conn = conn_it->second;
+
+			if (conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_SHARED) {
+				g_assert(conn->nusers > 0);
+				conn->nusers--;
+
+				if (ctx->err != REDIS_OK || how != RSPAMD_REDIS_RELEASE_DEFAULT) {
+					/* Let other users finish their commands */
+					msg_debug_rpool("retire shared connection %p", conn->ctx);
+					conn->retired = true;
+				}
+
+				if (conn->nusers == 0) {
+					if (conn->retired) {
+						msg_debug_rpool("closed retired shared connection %p", conn->ctx);
+						conn->elt->release_connection(conn);
+					}
+					else {
+						conn->schedule_timeout();
+						msg_debug_rpool("shared connection %p is idle", conn->ctx);
+					}
+				}
+
+				return;
+			}
+
 			g_assert(conn->state == rspamd_redis_pool_connection_state::RSPAMD_REDIS_POOL_CONN_ACTIVE);
 
 			if (ctx->err != REDIS_OK) {
@@ -612,6 +705,31 @@ rspamd_redis_pool_connect(void *p,
 }
 
 
+struct redisAsyncContext *
+rspamd_redis_pool_connect_shared(void *p,
+								 const char *db, const char *username,
+								 const char *password, const char *ip, int port)
+{
+	g_assert(p != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+
+	if (pool->max_shared_conns == 0) {
+		return pool->new_connection(db, username, password, ip, port);
+	}
+
+	return pool->new_connection(db, username, password, ip, port, true);
+}
+
+gboolean
+rspamd_redis_pool_is_multiplexed(void *p)
+{
+	g_assert(p != NULL);
+	auto *pool = reinterpret_cast<class rspamd::redis_pool *>(p);
+
+	return pool->max_shared_conns > 0;
+}
+
+
 void rspamd_redis_pool_release_connection(void *p,
 										  struct redisAsyncContext *ctx, enum rspamd_redis_pool_release_type how)
 {
@@ -661,3 +779,33 @@ rspamd_redis_type_to_string(int type)
 
 	return ret;
 }
+
+unsigned int
+rspamd_redis_key_slot(const char *key, gsize keylen)
+{
+	const char *p = key, *end = key + keylen;
+	uint16_t crc = 0;
+
+	/* Only {hashtag} is hashed if it is not empty */
+	auto *lbrace = (const char *) memchr(key, '{', keylen);
+
+	if (lbrace != nullptr) {
+		auto *rbrace = (const char *) memchr(lbrace + 1, '}', end - lbrace - 1);
+
+		if (rbrace != nullptr && rbrace > lbrace + 1) {
+			p = lbrace + 1;
+			end = rbrace;
+		}
+	}
+
+	/* CRC16-CCITT (XMODEM) as used by Redis Cluster */
+	while (p < end) {
+		crc ^= ((uint16_t) (unsigned char) *p++) << 8;
+
+		for (auto i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc & (RSPAMD_REDIS_CLUSTER_SLOTS - 1);
+}
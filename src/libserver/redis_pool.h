@@ -56,6 +56,32 @@ struct redisAsyncContext *rspamd_redis_pool_connect(
 	const char *db, const char *username, const char *password,
 	const char *ip, int port);
 
+/**
+ * Get a connection shared with other users of the same server, commands
+ * issued in the same event loop iteration are pipelined.
+ * Users must not change the connection state (e.g. SELECT, SUBSCRIBE, MULTI)
+ * and should release it as soon as their commands are replied.
+ * Falls back to `rspamd_redis_pool_connect` if multiplexing is disabled
+ * @param pool
+ * @param db
+ * @param username
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect_shared(
+	void *pool,
+	const char *db, const char *username, const char *password,
+	const char *ip, int port);
+
+/**
+ * Returns TRUE if shared connections are enabled in the pool
+ * @param pool
+ * @return
+ */
+gboolean rspamd_redis_pool_is_multiplexed(void *pool);
+
 enum rspamd_redis_pool_release_type {
 	RSPAMD_REDIS_RELEASE_DEFAULT = 0,
 	RSPAMD_REDIS_RELEASE_FATAL = 1,
@@ -77,6 +103,16 @@ void rspamd_redis_pool_release_connection(void *pool,
  */
 void rspamd_redis_pool_destroy(void *pool);
 
+#define RSPAMD_REDIS_CLUSTER_SLOTS 16384
+
+/**
+ * Returns Redis Cluster hash slot for a key, taking {hashtag} into account
+ * @param key
+ * @param keylen
+ * @return slot number in range [0, RSPAMD_REDIS_CLUSTER_SLOTS)
+ */
+unsigned int rspamd_redis_key_slot(const char *key, gsize keylen);
+
 /**
  * Missing in hiredis
  * @param type
@@ -19,9 +19,33 @@
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "cfg_file_private.h"
+#include "libcryptobox/cryptobox.h"
 
 static const char rspamd_history_magic_old[] = {'r', 's', 'h', '1'};
 
+#define HISTORY_DICT_SLOTS 4096
+#define HISTORY_DICT_ARENA (HISTORY_DICT_SLOTS * 32)
+
+enum roll_history_slot_state {
+	HISTORY_SLOT_EMPTY = 0,
+	HISTORY_SLOT_BUSY,
+	HISTORY_SLOT_READY,
+};
+
+struct roll_history_dict_slot {
+	uint32_t state;
+	uint32_t hash;
+	uint32_t off;
+	uint32_t len;
+};
+
+/* Interned symbol names shared by all processes */
+struct roll_history_dict {
+	struct roll_history_dict_slot slots[HISTORY_DICT_SLOTS];
+	uint32_t arena_used;
+	char arena[HISTORY_DICT_ARENA];
+};
+
 /**
  * Returns new roll history
  * @param pool pool for shared memory
@@ -59,17 +83,320 @@ rspamd_roll_history_new(rspamd_mempool_t *pool, unsigned int max_rows,
 	lua_pop(L, 1);
 
 	if (!history->disabled) {
-		history->rows = rspamd_mempool_alloc0_shared(pool,
-													 sizeof(struct roll_history_row) * max_rows);
+#define HISTORY_COLUMN(name) history->name = rspamd_mempool_alloc0_shared(pool, \
+																		   sizeof(*history->name) * max_rows)
+		HISTORY_COLUMN(timestamp);
+		HISTORY_COLUMN(score);
+		HISTORY_COLUMN(required_score);
+		HISTORY_COLUMN(scan_time);
+		HISTORY_COLUMN(len);
+		HISTORY_COLUMN(action);
+		HISTORY_COLUMN(seq);
+		HISTORY_COLUMN(blob_off);
+		HISTORY_COLUMN(blob_len);
+#undef HISTORY_COLUMN
+		history->blob_size = MAX((uint64_t) max_rows * HISTORY_BLOB_PER_ROW,
+								 HISTORY_MAX_BLOB * 4);
+		history->blob = rspamd_mempool_alloc0_shared(pool, history->blob_size);
+		history->symbols = rspamd_mempool_alloc0_shared(pool,
+														sizeof(*history->symbols));
 		history->nrows = max_rows;
 	}
 
 	return history;
 }
 
+/*
+ * Returns symbol id in the dictionary starting from 1 or 0 if a dictionary is full
+ */
+static unsigned int
+rspamd_roll_history_intern(struct roll_history_dict *dict,
+						   const char *name, gsize len)
+{
+	uint32_t h, state, off;
+	unsigned int i, probe;
+	struct roll_history_dict_slot *slot;
+
+	h = (uint32_t) rspamd_cryptobox_fast_hash(name, len, rspamd_hash_seed());
+
+	for (probe = 0; probe < HISTORY_DICT_SLOTS; probe++) {
+		i = (h + probe) & (HISTORY_DICT_SLOTS - 1);
+		slot = &dict->slots[i];
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (state == HISTORY_SLOT_EMPTY) {
+			if (!__atomic_compare_exchange_n(&slot->state, &state, HISTORY_SLOT_BUSY,
+											 FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				/* Lost race, check what has been inserted here */
+				probe--;
+				continue;
+			}
+
+			off = __atomic_fetch_add(&dict->arena_used, len + 1, __ATOMIC_RELAXED);
+
+			if (off + len + 1 > sizeof(dict->arena)) {
+				__atomic_store_n(&slot->state, HISTORY_SLOT_EMPTY, __ATOMIC_RELEASE);
+
+				return 0;
+			}
+
+			memcpy(dict->arena + off, name, len);
+			dict->arena[off + len] = '\0';
+			slot->hash = h;
+			slot->off = off;
+			slot->len = len;
+			__atomic_store_n(&slot->state, HISTORY_SLOT_READY, __ATOMIC_RELEASE);
+
+			return i + 1;
+		}
+		else if (state == HISTORY_SLOT_READY) {
+			if (slot->hash == h && slot->len == len &&
+				memcmp(dict->arena + slot->off, name, len) == 0) {
+				return i + 1;
+			}
+		}
+		/* Slot that is being filled is skipped, a duplicate is harmless */
+	}
+
+	return 0;
+}
+
+static const char *
+rspamd_roll_history_symbol_name(struct roll_history_dict *dict, unsigned int id)
+{
+	struct roll_history_dict_slot *slot;
+
+	if (id == 0 || id > HISTORY_DICT_SLOTS) {
+		return NULL;
+	}
+
+	slot = &dict->slots[id - 1];
+
+	if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != HISTORY_SLOT_READY) {
+		return NULL;
+	}
+
+	return dict->arena + slot->off;
+}
+
+static unsigned char *
+rspamd_roll_history_put_str(unsigned char *p, const char *str, gsize maxlen)
+{
+	gsize len = str ? strlen(str) : 0;
+
+	len = MIN(len, maxlen);
+	*p++ = len;
+
+	if (len > 0) {
+		memcpy(p, str, len);
+		p += len;
+	}
+
+	*p++ = '\0';
+
+	return p;
+}
+
+static const char *
+rspamd_roll_history_get_str(const unsigned char **pp, const unsigned char *end)
+{
+	const unsigned char *p = *pp;
+	gsize len;
+
+	if (p >= end || end - p < *p + 2) {
+		return NULL;
+	}
+
+	len = *p++;
+
+	if (p[len] != '\0') {
+		return NULL;
+	}
+
+	*pp = p + len + 1;
+
+	return (const char *) p;
+}
+
+/*
+ * Writes a row, data is placed in a blob with the following layout:
+ * message id, from address, user (u8 length + string + zero byte),
+ * u16 number of symbols, followed by u16 symbol id + float score
+ */
+static void
+rspamd_roll_history_write_row(struct roll_history *history,
+							  double timestamp, double score, double required_score,
+							  double scan_time, gsize len, int action,
+							  const char *message_id, const char *from_addr,
+							  const char *user,
+							  const uint16_t *sym_ids, const float *sym_scores,
+							  unsigned int nsyms)
+{
+	unsigned char blob[HISTORY_MAX_BLOB], *p = blob;
+	unsigned int row_num, i;
+	uint32_t seq, nseq;
+	uint64_t off, pos;
+	gsize blen, chunk;
+	uint16_t n16;
+
+	row_num = __atomic_fetch_add(&history->cur_row, 1, __ATOMIC_RELAXED) % history->nrows;
+	seq = __atomic_load_n(&history->seq[row_num], __ATOMIC_RELAXED);
+
+	/* Another writer has wrapped around the whole history, give up */
+	if ((seq & 1u) ||
+		!__atomic_compare_exchange_n(&history->seq[row_num], &seq, seq + 1, FALSE,
+									 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	p = rspamd_roll_history_put_str(p, message_id, HISTORY_MAX_ID);
+	p = rspamd_roll_history_put_str(p, from_addr, HISTORY_MAX_ADDR);
+	p = rspamd_roll_history_put_str(p, user, HISTORY_MAX_USER);
+	nsyms = MIN(nsyms, HISTORY_MAX_SYMBOLS);
+	n16 = nsyms;
+	memcpy(p, &n16, sizeof(n16));
+	p += sizeof(n16);
+
+	for (i = 0; i < nsyms; i++) {
+		memcpy(p, &sym_ids[i], sizeof(uint16_t));
+		p += sizeof(uint16_t);
+		memcpy(p, &sym_scores[i], sizeof(float));
+		p += sizeof(float);
+	}
+
+	blen = p - blob;
+	off = __atomic_fetch_add(&history->blob_pos, blen, __ATOMIC_RELAXED);
+	pos = off % history->blob_size;
+	chunk = MIN(blen, history->blob_size - pos);
+	memcpy(history->blob + pos, blob, chunk);
+	memcpy(history->blob, blob + chunk, blen - chunk);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	history->timestamp[row_num] = timestamp;
+	history->score[row_num] = score;
+	history->required_score[row_num] = required_score;
+	history->scan_time[row_num] = scan_time;
+	history->len[row_num] = MIN(len, G_MAXUINT32);
+	history->action[row_num] = action;
+	history->blob_off[row_num] = off;
+	history->blob_len[row_num] = blen;
+
+	/* Even and non zero */
+	nseq = seq + 2;
+
+	if (nseq == 0) {
+		nseq = 2;
+	}
+
+	__atomic_store_n(&history->seq[row_num], nseq, __ATOMIC_RELEASE);
+}
+
+gboolean
+rspamd_roll_history_get_row(struct roll_history *history,
+							unsigned int idx,
+							struct roll_history_row *row)
+{
+	uint32_t s1, s2;
+	uint64_t off, pos;
+	gsize blen, chunk;
+	const unsigned char *p, *end;
+	uint16_t n16, id;
+	unsigned int i;
+
+	if (idx >= history->nrows) {
+		return FALSE;
+	}
+
+	s1 = __atomic_load_n(&history->seq[idx], __ATOMIC_ACQUIRE);
+
+	if (s1 == 0 || (s1 & 1u)) {
+		return FALSE;
+	}
+
+	row->timestamp = history->timestamp[idx];
+	row->score = history->score[idx];
+	row->required_score = history->required_score[idx];
+	row->scan_time = history->scan_time[idx];
+	row->len = history->len[idx];
+	row->action = history->action[idx];
+	off = history->blob_off[idx];
+	blen = MIN(history->blob_len[idx], sizeof(row->blob));
+
+	pos = off % history->blob_size;
+	chunk = MIN(blen, history->blob_size - pos);
+	memcpy(row->blob, history->blob + pos, chunk);
+	memcpy(row->blob + chunk, history->blob, blen - chunk);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(&history->seq[idx], __ATOMIC_RELAXED);
+
+	if (s1 != s2) {
+		return FALSE;
+	}
+
+	/* Variable length data has been overwritten by newer rows */
+	if (__atomic_load_n(&history->blob_pos, __ATOMIC_ACQUIRE) > off + history->blob_size) {
+		return FALSE;
+	}
+
+	p = row->blob;
+	end = row->blob + blen;
+	row->message_id = rspamd_roll_history_get_str(&p, end);
+	row->from_addr = rspamd_roll_history_get_str(&p, end);
+	row->user = rspamd_roll_history_get_str(&p, end);
+
+	if (row->message_id == NULL || row->from_addr == NULL || row->user == NULL ||
+		end - p < (gssize) sizeof(n16)) {
+		return FALSE;
+	}
+
+	memcpy(&n16, p, sizeof(n16));
+	p += sizeof(n16);
+	row->nsymbols = 0;
+
+	for (i = 0; i < n16 && end - p >= (gssize) (sizeof(id) + sizeof(float)); i++) {
+		memcpy(&id, p, sizeof(id));
+		p += sizeof(id);
+		row->symbols[row->nsymbols].name = rspamd_roll_history_symbol_name(history->symbols, id);
+		memcpy(&row->symbols[row->nsymbols].score, p, sizeof(float));
+		p += sizeof(float);
+
+		if (row->symbols[row->nsymbols].name) {
+			row->nsymbols++;
+		}
+	}
+
+	return TRUE;
+}
+
+unsigned int
+rspamd_roll_history_reset(struct roll_history *history)
+{
+	unsigned int i, cleared = 0;
+	uint32_t seq;
+
+	for (i = 0; i < history->nrows; i++) {
+		seq = __atomic_load_n(&history->seq[i], __ATOMIC_RELAXED);
+
+		/* Rows that are being written now are left as is */
+		if (seq != 0 && !(seq & 1u) &&
+			__atomic_compare_exchange_n(&history->seq[i], &seq, 0, FALSE,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			cleared++;
+		}
+	}
+
+	/* Sequence numbers start over, so readers must drop rows they have cached */
+	__atomic_add_fetch(&history->generation, 1, __ATOMIC_RELEASE);
+
+	return cleared;
+}
+
 struct history_metric_callback_data {
-	char *pos;
-	int remain;
+	struct roll_history *history;
+	uint16_t ids[HISTORY_MAX_SYMBOLS];
+	float scores[HISTORY_MAX_SYMBOLS];
+	unsigned int nsyms;
 };
 
 static void
@@ -77,16 +404,21 @@ roll_history_symbols_callback(gpointer key, gpointer value, void *user_data)
 {
 	struct history_metric_callback_data *cb = user_data;
 	struct rspamd_symbol_result *s = value;
-	unsigned int wr;
+	unsigned int id;
 
 	if (s->flags & RSPAMD_SYMBOL_RESULT_IGNORED) {
 		return;
 	}
 
-	if (cb->remain > 0) {
-		wr = rspamd_snprintf(cb->pos, cb->remain, "%s, ", s->name);
-		cb->pos += wr;
-		cb->remain -= wr;
+	if (cb->nsyms < G_N_ELEMENTS(cb->ids)) {
+		id = rspamd_roll_history_intern(cb->history->symbols, s->name,
+										strlen(s->name));
+
+		if (id != 0) {
+			cb->ids[cb->nsyms] = id;
+			cb->scores[cb->nsyms] = s->score;
+			cb->nsyms++;
+		}
 	}
 }
 
@@ -98,86 +430,47 @@ roll_history_symbols_callback(gpointer key, gpointer value, void *user_data)
 void rspamd_roll_history_update(struct roll_history *history,
 								struct rspamd_task *task)
 {
-	unsigned int row_num;
-	struct roll_history_row *row;
 	struct rspamd_scan_result *metric_res;
 	struct history_metric_callback_data cbdata;
 	struct rspamd_action *action;
+	const char *from_addr = "unknown", *message_id = NULL;
+	double score = 0, required_score = 0;
+	int action_type = METRIC_ACTION_NOACTION;
 
 	if (history->disabled) {
 		return;
 	}
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange(&history->cur_row, history->nrows, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add(&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add(&history->cur_row, 1);
-#endif
-
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set(&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
-		return;
-	}
-
 	/* Add information from task to roll history */
 	if (task->from_addr) {
-		rspamd_strlcpy(row->from_addr,
-					   rspamd_inet_address_to_string(task->from_addr),
-					   sizeof(row->from_addr));
-	}
-	else {
-		rspamd_strlcpy(row->from_addr, "unknown", sizeof(row->from_addr));
+		from_addr = rspamd_inet_address_to_string(task->from_addr);
 	}
 
-	row->timestamp = task->task_timestamp;
-
-	/* Strings */
 	if (task->message) {
-		rspamd_strlcpy(row->message_id, MESSAGE_FIELD(task, message_id),
-					   sizeof(row->message_id));
-	}
-	if (task->auth_user) {
-		rspamd_strlcpy(row->user, task->auth_user, sizeof(row->user));
-	}
-	else {
-		row->user[0] = '\0';
+		message_id = MESSAGE_FIELD(task, message_id);
 	}
 
 	/* Get default metric */
 	metric_res = task->result;
+	cbdata.history = history;
+	cbdata.nsyms = 0;
 
-	if (metric_res == NULL) {
-		row->symbols[0] = '\0';
-		row->action = METRIC_ACTION_NOACTION;
-	}
-	else {
-		row->score = metric_res->score;
+	if (metric_res != NULL) {
+		score = metric_res->score;
 		action = rspamd_check_action_metric(task, NULL, NULL);
-		row->action = action->action_type;
-		row->required_score = rspamd_task_get_required_score(task, metric_res);
-		cbdata.pos = row->symbols;
-		cbdata.remain = sizeof(row->symbols);
+		action_type = action->action_type;
+		required_score = rspamd_task_get_required_score(task, metric_res);
 		rspamd_task_symbol_result_foreach(task, NULL,
 										  roll_history_symbols_callback,
 										  &cbdata);
-		if (cbdata.remain > 0) {
-			/* Remove last whitespace and comma */
-			*cbdata.pos-- = '\0';
-			*cbdata.pos-- = '\0';
-			*cbdata.pos = '\0';
-		}
 	}
 
-	row->scan_time = task->time_real_finish - task->task_timestamp;
-	row->len = task->msg.len;
-	g_atomic_int_set(&row->completed, TRUE);
+	rspamd_roll_history_write_row(history, task->task_timestamp,
+								  score, required_score,
+								  task->time_real_finish - task->task_timestamp,
+								  task->msg.len, action_type,
+								  message_id, from_addr, task->auth_user,
+								  cbdata.ids, cbdata.scores, cbdata.nsyms);
 }
 
 /**
@@ -195,7 +488,7 @@ rspamd_roll_history_load(struct roll_history *history, const char *filename)
 	ucl_object_t *top;
 	const ucl_object_t *cur, *elt;
 	struct ucl_parser *parser;
-	struct roll_history_row *row;
+	struct history_metric_callback_data cbdata;
 	unsigned int n, i;
 
 	g_assert(history != NULL);
@@ -280,81 +573,116 @@ rspamd_roll_history_load(struct roll_history *history, const char *filename)
 		cur = ucl_array_find_index(top, i);
 
 		if (cur != NULL && ucl_object_type(cur) == UCL_OBJECT) {
-			row = &history->rows[i];
-			memset(row, 0, sizeof(*row));
+			double timestamp = 0, scan_time = 0, score = 0, required_score = 0;
+			gsize len = 0;
+			int action = METRIC_ACTION_NOACTION;
+			const char *message_id = NULL, *user = NULL, *from_addr = NULL;
+
+			cbdata.nsyms = 0;
 
 			elt = ucl_object_lookup(cur, "time");
 
 			if (elt && ucl_object_type(elt) == UCL_FLOAT) {
-				row->timestamp = ucl_object_todouble(elt);
+				timestamp = ucl_object_todouble(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "id");
 
 			if (elt && ucl_object_type(elt) == UCL_STRING) {
-				rspamd_strlcpy(row->message_id, ucl_object_tostring(elt),
-							   sizeof(row->message_id));
+				message_id = ucl_object_tostring(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "symbols");
 
-			if (elt && ucl_object_type(elt) == UCL_STRING) {
-				rspamd_strlcpy(row->symbols, ucl_object_tostring(elt),
-							   sizeof(row->symbols));
+			if (elt && ucl_object_type(elt) == UCL_OBJECT) {
+				const ucl_object_t *sym;
+				ucl_object_iter_t it = NULL;
+
+				while ((sym = ucl_object_iterate(elt, &it, true)) != NULL &&
+					   cbdata.nsyms < G_N_ELEMENTS(cbdata.ids)) {
+					unsigned int id = rspamd_roll_history_intern(history->symbols,
+																 ucl_object_key(sym), sym->keylen);
+
+					if (id != 0) {
+						cbdata.ids[cbdata.nsyms] = id;
+						cbdata.scores[cbdata.nsyms] = ucl_object_todouble(sym);
+						cbdata.nsyms++;
+					}
+				}
+			}
+			else if (elt && ucl_object_type(elt) == UCL_STRING) {
+				/* Old format: comma separated names */
+				char **syms = g_strsplit_set(ucl_object_tostring(elt), ", ", -1);
+
+				for (char **psym = syms; *psym != NULL &&
+										 cbdata.nsyms < G_N_ELEMENTS(cbdata.ids);
+					 psym++) {
+					if (**psym != '\0') {
+						unsigned int id = rspamd_roll_history_intern(history->symbols,
+																	 *psym, strlen(*psym));
+
+						if (id != 0) {
+							cbdata.ids[cbdata.nsyms] = id;
+							cbdata.scores[cbdata.nsyms] = 0;
+							cbdata.nsyms++;
+						}
+					}
+				}
+
+				g_strfreev(syms);
 			}
 
 			elt = ucl_object_lookup(cur, "user");
 
 			if (elt && ucl_object_type(elt) == UCL_STRING) {
-				rspamd_strlcpy(row->user, ucl_object_tostring(elt),
-							   sizeof(row->user));
+				user = ucl_object_tostring(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "from");
 
 			if (elt && ucl_object_type(elt) == UCL_STRING) {
-				rspamd_strlcpy(row->from_addr, ucl_object_tostring(elt),
-							   sizeof(row->from_addr));
+				from_addr = ucl_object_tostring(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "len");
 
 			if (elt && ucl_object_type(elt) == UCL_INT) {
-				row->len = ucl_object_toint(elt);
+				len = ucl_object_toint(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "scan_time");
 
 			if (elt && ucl_object_type(elt) == UCL_FLOAT) {
-				row->scan_time = ucl_object_todouble(elt);
+				scan_time = ucl_object_todouble(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "score");
 
 			if (elt && ucl_object_type(elt) == UCL_FLOAT) {
-				row->score = ucl_object_todouble(elt);
+				score = ucl_object_todouble(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "required_score");
 
 			if (elt && ucl_object_type(elt) == UCL_FLOAT) {
-				row->required_score = ucl_object_todouble(elt);
+				required_score = ucl_object_todouble(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "action");
 
 			if (elt && ucl_object_type(elt) == UCL_INT) {
-				row->action = ucl_object_toint(elt);
+				action = ucl_object_toint(elt);
 			}
 
-			row->completed = TRUE;
+			rspamd_roll_history_write_row(history, timestamp, score, required_score,
+										  scan_time, len, action,
+										  message_id, from_addr, user,
+										  cbdata.ids, cbdata.scores, cbdata.nsyms);
 		}
 	}
 
 	ucl_object_unref(top);
 
-	history->cur_row = n;
-
 	return TRUE;
 }
 
@@ -369,8 +697,8 @@ rspamd_roll_history_save(struct roll_history *history, const char *filename)
 {
 	int fd;
 	FILE *fp;
-	ucl_object_t *obj, *elt;
-	unsigned int i;
+	ucl_object_t *obj, *elt, *syms;
+	unsigned int i, j, row_num;
 	struct roll_history_row *row;
 	struct ucl_emitter_functions *emitter_func;
 
@@ -387,11 +715,12 @@ rspamd_roll_history_save(struct roll_history *history, const char *filename)
 
 	fp = fdopen(fd, "w");
 	obj = ucl_object_typed_new(UCL_ARRAY);
+	row = g_malloc(sizeof(*row));
+	/* Start from the oldest row, so the order is preserved on load */
+	row_num = history->cur_row % history->nrows;
 
-	for (i = 0; i < history->nrows; i++) {
-		row = &history->rows[i];
-
-		if (!row->completed) {
+	for (i = 0; i < history->nrows; i++, row_num = (row_num + 1) % history->nrows) {
+		if (!rspamd_roll_history_get_row(history, row_num, row)) {
 			continue;
 		}
 
@@ -401,8 +730,15 @@ rspamd_roll_history_save(struct roll_history *history, const char *filename)
 							  "time", 0, false);
 		ucl_object_insert_key(elt, ucl_object_fromstring(row->message_id),
 							  "id", 0, false);
-		ucl_object_insert_key(elt, ucl_object_fromstring(row->symbols),
-							  "symbols", 0, false);
+
+		syms = ucl_object_typed_new(UCL_OBJECT);
+
+		for (j = 0; j < row->nsymbols; j++) {
+			ucl_object_insert_key(syms, ucl_object_fromdouble(row->symbols[j].score),
+								  row->symbols[j].name, 0, true);
+		}
+
+		ucl_object_insert_key(elt, syms, "symbols", 0, false);
 		ucl_object_insert_key(elt, ucl_object_fromstring(row->user),
 							  "user", 0, false);
 		ucl_object_insert_key(elt, ucl_object_fromstring(row->from_addr),
@@ -421,6 +757,8 @@ rspamd_roll_history_save(struct roll_history *history, const char *filename)
 		ucl_array_append(obj, elt);
 	}
 
+	g_free(row);
+
 	emitter_func = ucl_object_emit_file_funcs(fp);
 	ucl_object_emit_full(obj, UCL_EMIT_JSON_COMPACT, emitter_func, NULL);
 	ucl_object_emit_funcs_free(emitter_func);
@@ -25,36 +25,67 @@ extern "C" {
 
 /*
  * Roll history is a special cycled buffer for checked messages, it is designed for writing history messages
- * and displaying them in webui
+ * and displaying them in webui.
+ *
+ * It is placed in shared memory and stored by columns, so queries that filter
+ * by score or action do not touch other data. Variable length data (ids,
+ * addresses and symbols) is written to a shared ring of bytes, and symbol
+ * names are interned in a shared dictionary, so a row costs just
+ * a few bytes per symbol. Each row is protected by a sequence counter:
+ * writers never wait and readers skip rows that are being modified.
  */
 
-#define HISTORY_MAX_ID 256
+#define HISTORY_MAX_ID 255
 #define HISTORY_MAX_SYMBOLS 256
 #define HISTORY_MAX_USER 32
-#define HISTORY_MAX_ADDR 32
+#define HISTORY_MAX_ADDR 64
+/* Average space for variable length data per row */
+#define HISTORY_BLOB_PER_ROW 256
+#define HISTORY_MAX_BLOB (3 * (HISTORY_MAX_ID + 2) + 2 + HISTORY_MAX_SYMBOLS * 6)
 
 struct rspamd_task;
 struct rspamd_config;
+struct roll_history_dict;
 
+/* Row as returned to readers */
 struct roll_history_row {
 	ev_tstamp timestamp;
-	char message_id[HISTORY_MAX_ID];
-	char symbols[HISTORY_MAX_SYMBOLS];
-	char user[HISTORY_MAX_USER];
-	char from_addr[HISTORY_MAX_ADDR];
+	const char *message_id;
+	const char *user;
+	const char *from_addr;
 	gsize len;
 	double scan_time;
 	double score;
 	double required_score;
 	int action;
-	unsigned int completed;
+	unsigned int nsymbols;
+	struct {
+		const char *name;
+		float score;
+	} symbols[HISTORY_MAX_SYMBOLS];
+	unsigned char blob[HISTORY_MAX_BLOB];
 };
 
 struct roll_history {
-	struct roll_history_row *rows;
+	/* Columns */
+	double *timestamp;
+	float *score;
+	float *required_score;
+	float *scan_time;
+	uint32_t *len;
+	uint8_t *action;
+	uint32_t *seq; /* odd whilst a row is written, zero for an empty row */
+	uint64_t *blob_off;
+	uint16_t *blob_len;
+	/* Variable length data */
+	unsigned char *blob;
+	uint64_t blob_size;
+	uint64_t blob_pos;
+	struct roll_history_dict *symbols;
 	gboolean disabled;
 	unsigned int nrows;
 	unsigned int cur_row;
+	unsigned int generation; /* incremented on each reset */
 };
 
 /**
@@ -91,6 +122,35 @@ gboolean rspamd_roll_history_load(struct roll_history *history,
 gboolean rspamd_roll_history_save(struct roll_history *history,
 								  const char *filename);
 
+/**
+ * Reads a row, returns FALSE if a row is empty or is being modified
+ * @param history roll history object
+ * @param idx row index
+ * @param row output row, its strings are valid until the next call
+ * @return TRUE if a row has been read
+ */
+gboolean rspamd_roll_history_get_row(struct roll_history *history,
+									 unsigned int idx,
+									 struct roll_history_row *row);
+
+/**
+ * Returns TRUE if a row is completed
+ */
+static inline gboolean
+rspamd_roll_history_row_completed(struct roll_history *history, unsigned int idx)
+{
+	uint32_t seq = __atomic_load_n(&history->seq[idx], __ATOMIC_ACQUIRE);
+
+	return seq != 0 && !(seq & 1u);
+}
+
+/**
+ * Clears all rows
+ * @param history roll history object
+ * @return number of rows cleared
+ */
+unsigned int rspamd_roll_history_reset(struct roll_history *history);
+
 #ifdef __cplusplus
 }
 #endif
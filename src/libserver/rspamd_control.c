@@ -20,6 +20,7 @@
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "libutil/libev_helper.h"
+#include "libserver/re_cache.h"
 #include "unix-std.h"
 #include "utlist.h"
 
@@ -38,6 +39,8 @@
 
 static ev_tstamp io_timeout = 30.0;
 static ev_tstamp worker_io_timeout = 0.5;
+/* Number of the most expensive regexps reported by each worker */
+static const unsigned int re_stat_limit = 100;
 
 struct rspamd_control_session;
 
@@ -82,6 +85,8 @@ static const struct rspamd_control_cmd_match {
 	{.name = {.begin = "/recompile", .len = sizeof("/recompile") - 1}, .type = RSPAMD_CONTROL_RECOMPILE},
 	{.name = {.begin = "/fuzzystat", .len = sizeof("/fuzzystat") - 1}, .type = RSPAMD_CONTROL_FUZZY_STAT},
 	{.name = {.begin = "/fuzzysync", .len = sizeof("/fuzzysync") - 1}, .type = RSPAMD_CONTROL_FUZZY_SYNC},
+	{.name = {.begin = "/mempoolstat", .len = sizeof("/mempoolstat") - 1}, .type = RSPAMD_CONTROL_MEMPOOL_STAT},
+	{.name = {.begin = "/restat", .len = sizeof("/restat") - 1}, .type = RSPAMD_CONTROL_RE_STAT},
 };
 
 static void rspamd_control_ignore_io_handler(int fd, short what, void *ud);
@@ -259,6 +264,46 @@ rspamd_control_write_reply(struct rspamd_control_session *session)
 		case RSPAMD_CONTROL_FUZZY_SYNC:
 			ucl_object_insert_key(cur, ucl_object_fromint(elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_MEMPOOL_STAT:
+			ucl_object_insert_key(cur, ucl_object_fromint(elt->reply.reply.mempool_stat.status), "status", 0, false);
+
+			if (elt->attached_fd != -1) {
+				parser = ucl_parser_new(0);
+
+				if (ucl_parser_add_fd(parser, elt->attached_fd)) {
+					ucl_object_insert_key(cur, ucl_parser_get_object(parser),
+										  "entries", 0, false);
+				}
+				else {
+					ucl_object_insert_key(cur, ucl_object_fromstring(ucl_parser_get_error(parser)), "error", 0, false);
+				}
+
+				ucl_parser_free(parser);
+			}
+			else {
+				ucl_object_insert_key(cur, ucl_object_fromstring("missing file"), "error", 0, false);
+			}
+			break;
+		case RSPAMD_CONTROL_RE_STAT:
+			ucl_object_insert_key(cur, ucl_object_fromint(elt->reply.reply.re_stat.status), "status", 0, false);
+
+			if (elt->attached_fd != -1) {
+				parser = ucl_parser_new(0);
+
+				if (ucl_parser_add_fd(parser, elt->attached_fd)) {
+					ucl_object_insert_key(cur, ucl_parser_get_object(parser),
+										  "data", 0, false);
+				}
+				else {
+					ucl_object_insert_key(cur, ucl_object_fromstring(ucl_parser_get_error(parser)), "error", 0, false);
+				}
+
+				ucl_parser_free(parser);
+			}
+			else {
+				ucl_object_insert_key(cur, ucl_object_fromstring("missing file"), "error", 0, false);
+			}
+			break;
 		default:
 			break;
 		}
@@ -683,6 +728,48 @@ struct rspamd_worker_control_data {
 	} handlers[RSPAMD_CONTROL_MAX];
 };
 
+/*
+ * Dumps statistics object to a temporary file and returns its descriptor,
+ * the object is consumed
+ */
+static int
+rspamd_control_stat_fd(struct rspamd_main *rspamd_main,
+					   const char *name,
+					   ucl_object_t *obj,
+					   unsigned int *status)
+{
+	struct ucl_emitter_functions *emit_subr;
+	char tmppath[PATH_MAX];
+	int outfd;
+
+	rspamd_snprintf(tmppath, sizeof(tmppath), "%s%c%s-XXXXXXXXXX",
+					rspamd_main->cfg->temp_dir, G_DIR_SEPARATOR, name);
+
+	if ((outfd = mkstemp(tmppath)) == -1) {
+		*status = errno;
+		msg_info_main("cannot make temporary stat file for %s: %s",
+					  name, strerror(errno));
+		ucl_object_unref(obj);
+
+		return -1;
+	}
+
+	emit_subr = ucl_object_emit_fd_funcs(outfd);
+	ucl_object_emit_full(obj, UCL_EMIT_JSON_COMPACT, emit_subr, NULL);
+	ucl_object_emit_funcs_free(emit_subr);
+	ucl_object_unref(obj);
+	/* Rewind output file */
+	close(outfd);
+	outfd = open(tmppath, O_RDONLY);
+	unlink(tmppath);
+
+	if (outfd == -1) {
+		*status = errno;
+	}
+
+	return outfd;
+}
+
 static void
 rspamd_control_default_cmd_handler(int fd,
 								   int attached_fd,
@@ -694,6 +781,7 @@ rspamd_control_default_cmd_handler(int fd,
 	struct rusage rusg;
 	struct rspamd_config *cfg;
 	struct rspamd_main *rspamd_main;
+	int outfd = -1;
 
 	memset(&rep, 0, sizeof(rep));
 	rep.type = cmd->type;
@@ -741,11 +829,52 @@ rspamd_control_default_cmd_handler(int fd,
 			rep.reply.reresolve.status = EINVAL;
 		}
 		break;
+	case RSPAMD_CONTROL_MEMPOOL_STAT:
+		outfd = rspamd_control_stat_fd(rspamd_main, "mempool-stat",
+									   rspamd_mempool_entries_ucl(),
+									   &rep.reply.mempool_stat.status);
+		break;
+	case RSPAMD_CONTROL_RE_STAT:
+		if (rspamd_main->cfg && rspamd_main->cfg->re_cache) {
+			outfd = rspamd_control_stat_fd(rspamd_main, "re-stat",
+										   rspamd_re_cache_stat_ucl(rspamd_main->cfg->re_cache,
+																	re_stat_limit),
+										   &rep.reply.re_stat.status);
+		}
+		else {
+			rep.reply.re_stat.status = EINVAL;
+		}
+		break;
 	default:
 		break;
 	}
 
-	r = write(fd, &rep, sizeof(rep));
+	if (outfd != -1) {
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		unsigned char fdspace[CMSG_SPACE(sizeof(int))];
+
+		memset(&msg, 0, sizeof(msg));
+		memset(fdspace, 0, sizeof(fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof(fdspace);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &outfd, sizeof(int));
+		iov.iov_base = &rep;
+		iov.iov_len = sizeof(rep);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		r = sendmsg(fd, &msg, 0);
+		close(outfd);
+	}
+	else {
+		r = write(fd, &rep, sizeof(rep));
+	}
 
 	if (r != sizeof(rep)) {
 		msg_err_main("cannot write reply to the control socket: %s",
@@ -1067,9 +1196,10 @@ rspamd_srv_handler(EV_P_ ev_io *w, int revents)
 				/* Load RE cache to provide it for new forks */
 				if (rspamd_re_cache_is_hs_loaded(rspamd_main->cfg->re_cache) != RSPAMD_HYPERSCAN_LOADED_FULL ||
 					cmd.cmd.hs_loaded.forced) {
-					rspamd_re_cache_load_hyperscan(
+					rspamd_re_cache_load_hyperscan_bundle(
 						rspamd_main->cfg->re_cache,
 						cmd.cmd.hs_loaded.cache_dir,
+						rfd,
 						false);
 				}
 
@@ -1080,7 +1210,7 @@ rspamd_srv_handler(EV_P_ ev_io *w, int revents)
 				msg_info_main("received hyperscan cache loaded from %s",
 							  cmd.cmd.hs_loaded.cache_dir);
 
-				/* Broadcast command to all workers */
+				/* Broadcast command to all workers, the bundle is passed to them as well */
 				memset(&wcmd, 0, sizeof(wcmd));
 				wcmd.type = RSPAMD_CONTROL_HYPERSCAN_LOADED;
 				rspamd_strlcpy(wcmd.cmd.hs_loaded.cache_dir,
@@ -1137,6 +1267,20 @@ rspamd_srv_handler(EV_P_ ev_io *w, int revents)
 				rspamd_control_broadcast_cmd(rspamd_main, &wcmd, rfd,
 											 rspamd_control_ignore_io_handler, NULL, worker->pid);
 				break;
+			case RSPAMD_SRV_WARMED_UP:
+				/* Main process kills old workers once no new ones are warming */
+				worker->flags &= ~RSPAMD_WORKER_WARMING;
+
+				if (cmd.cmd.warmed_up.timed_out) {
+					msg_warn_main("worker %P has not warmed up in time, %ud maps are not loaded",
+								  worker->pid, cmd.cmd.warmed_up.pending_maps);
+				}
+				else {
+					msg_info_main("worker %P has warmed up", worker->pid);
+				}
+
+				rdata->rep.reply.warmed_up.unused = 0;
+				break;
 			default:
 				msg_err_main("unknown command type: %d", cmd.type);
 				break;
@@ -1390,6 +1534,12 @@ rspamd_control_command_from_string(const char *str)
 	else if (g_ascii_strcasecmp(str, "child_change") == 0) {
 		ret = RSPAMD_CONTROL_CHILD_CHANGE;
 	}
+	else if (g_ascii_strcasecmp(str, "mempool_stat") == 0) {
+		ret = RSPAMD_CONTROL_MEMPOOL_STAT;
+	}
+	else if (g_ascii_strcasecmp(str, "re_stat") == 0) {
+		ret = RSPAMD_CONTROL_RE_STAT;
+	}
 
 	return ret;
 }
@@ -1430,6 +1580,12 @@ rspamd_control_command_to_string(enum rspamd_control_type cmd)
 	case RSPAMD_CONTROL_CHILD_CHANGE:
 		reply = "child_change";
 		break;
+	case RSPAMD_CONTROL_MEMPOOL_STAT:
+		reply = "mempool_stat";
+		break;
+	case RSPAMD_CONTROL_RE_STAT:
+		reply = "re_stat";
+		break;
 	default:
 		break;
 	}
@@ -1469,6 +1625,9 @@ const char *rspamd_srv_command_to_string(enum rspamd_srv_type cmd)
 	case RSPAMD_SRV_FUZZY_BLOCKED:
 		reply = "fuzzy_blocked";
 		break;
+	case RSPAMD_SRV_WARMED_UP:
+		reply = "warmed_up";
+		break;
 	}
 
 	return reply;
@@ -37,6 +37,8 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_MONITORED_CHANGE,
 	RSPAMD_CONTROL_CHILD_CHANGE,
 	RSPAMD_CONTROL_FUZZY_BLOCKED,
+	RSPAMD_CONTROL_MEMPOOL_STAT,
+	RSPAMD_CONTROL_RE_STAT,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -50,10 +52,12 @@ enum rspamd_srv_type {
 	RSPAMD_SRV_HEALTH,
 	RSPAMD_SRV_NOTICE_HYPERSCAN_CACHE,
 	RSPAMD_SRV_FUZZY_BLOCKED, /* Used to notify main process about a blocked ip */
+	RSPAMD_SRV_WARMED_UP,     /* Worker has started to accept connections after warm-up */
 };
 
 enum rspamd_log_pipe_type {
 	RSPAMD_LOG_PIPE_SYMBOLS = 0,
+	RSPAMD_LOG_PIPE_EXPORT, /* Datagram socket of the exporter worker */
 };
 #define CONTROL_PATHLEN MIN(PATH_MAX, PIPE_BUF - sizeof(int) * 2 - sizeof(int64_t) * 2)
 struct rspamd_control_command {
@@ -106,6 +110,12 @@ struct rspamd_control_command {
 			} addr;
 			sa_family_t af;
 		} fuzzy_blocked;
+		struct {
+			unsigned int unused;
+		} mempool_stat;
+		struct {
+			unsigned int unused;
+		} re_stat;
 	} cmd;
 };
 
@@ -147,6 +157,12 @@ struct rspamd_control_reply {
 		struct {
 			unsigned int status;
 		} fuzzy_blocked;
+		struct {
+			unsigned int status;
+		} mempool_stat;
+		struct {
+			unsigned int status;
+		} re_stat;
 	} reply;
 };
 
@@ -201,6 +217,16 @@ struct rspamd_srv_command {
 			} addr;
 			sa_family_t af;
 		} fuzzy_blocked;
+		struct {
+			unsigned int unused;
+		} mempool_stat;
+		struct {
+			unsigned int unused;
+		} re_stat;
+		struct {
+			unsigned int pending_maps;
+			gboolean timed_out;
+		} warmed_up;
 	} cmd;
 };
 
@@ -238,6 +264,9 @@ struct rspamd_srv_reply {
 		struct {
 			int unused;
 		} fuzzy_blocked;
+		struct {
+			int unused;
+		} warmed_up;
 	} reply;
 };
 
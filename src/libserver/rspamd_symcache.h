@@ -60,6 +60,7 @@ enum rspamd_symbol_type {
 	SYMBOL_TYPE_IGNORE_PASSTHROUGH = (1u << 17u), /* Symbol ignores passthrough result */
 	SYMBOL_TYPE_EXPLICIT_ENABLE = (1u << 18u),    /* Symbol should be enabled explicitly only */
 	SYMBOL_TYPE_USE_CORO = (1u << 19u),           /* Symbol uses lua coroutines */
+	SYMBOL_TYPE_HEADERS_ONLY = (1u << 20u),       /* Prefilter needs message headers only */
 };
 
 /**
@@ -169,6 +170,14 @@ gboolean rspamd_symcache_add_condition_delayed(struct rspamd_symcache *cache,
 int rspamd_symcache_find_symbol(struct rspamd_symcache *cache,
 								const char *name);
 
+/**
+ * Returns name of a symbol by its id, the name is owned by the cache
+ * @param cache
+ * @param id
+ * @return symbol name or NULL if there is no such symbol
+ */
+const char *rspamd_symcache_symbol_by_id(struct rspamd_symcache *cache, int id);
+
 /**
  * Get statistics for a specific symbol
  * @param cache
@@ -191,6 +200,13 @@ gboolean rspamd_symcache_stat_symbol(struct rspamd_symcache *cache,
  */
 unsigned int rspamd_symcache_stats_symbols_count(struct rspamd_symcache *cache);
 
+/**
+ * Returns number of items in the cache; item ids are dense and less than this value
+ * @param cache
+ * @return
+ */
+unsigned int rspamd_symcache_items_count(struct rspamd_symcache *cache);
+
 /**
  * Validate cache items against theirs weights defined in metrics
  * @param cache symbols cache
@@ -227,6 +243,16 @@ void *rspamd_symcache_start_refresh(struct rspamd_symcache *cache,
 									struct ev_loop *ev_base,
 									struct rspamd_worker *w);
 
+/**
+ * Marks a symbol and the currently processed item as having a score that
+ * cannot be bound by the static weight (e.g. inserted with a multiplier
+ * greater than one), so filters are never stopped while they are pending
+ * @param task
+ * @param item symbol definition cache item (may be NULL)
+ */
+void rspamd_symcache_set_dynamic_score(struct rspamd_task *task,
+									   struct rspamd_symcache_item *item);
+
 /**
  * Increases counter for a specific symbol
  * @param cache
@@ -519,6 +545,13 @@ int rspamd_symcache_dyn_item_flags(struct rspamd_task *task,
 								   struct rspamd_symcache_dynamic_item *dyn_item);
 int rspamd_symcache_item_flags(struct rspamd_symcache_item *item);
 
+/**
+ * Returns cache item id
+ * @param item
+ * @return
+ */
+int rspamd_symcache_item_id(struct rspamd_symcache_item *item);
+
 /**
  * Returns cache item name
  * @param item
@@ -528,6 +561,17 @@ const char *rspamd_symcache_dyn_item_name(struct rspamd_task *task,
 										  struct rspamd_symcache_dynamic_item *dyn_item);
 const char *rspamd_symcache_item_name(struct rspamd_symcache_item *item);
 
+typedef void (*rspamd_symcache_child_cb)(const char *symbol, void *ud);
+/**
+ * Calls `func` for each virtual child of an item that is allowed to be inserted
+ * for a task (e.g. not disabled by settings)
+ * @return number of children passed to `func`
+ */
+unsigned int rspamd_symcache_dyn_item_foreach_child(struct rspamd_task *task,
+													struct rspamd_symcache_dynamic_item *dyn_item,
+													rspamd_symcache_child_cb func,
+													void *ud);
+
 /**
  * Returns the current item stat
  * @param item
@@ -21,6 +21,7 @@
 #include "message.h"
 #include "utlist.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libutil/shm_cache.h"
 #include "contrib/librdns/rdns.h"
 #include "contrib/mumhash/mum.h"
 
@@ -71,8 +72,14 @@ struct rspamd_spf_library_ctx {
 	unsigned int min_cache_ttl;
 	gboolean disable_ipv6;
 	rspamd_lru_hash_t *spf_hash;
+	/* Flattened records shared between all processes */
+	rspamd_shm_cache_t *shared_cache;
+	double shared_cache_refresh;
 };
 
+#define SPF_SHARED_CACHE_MAX_RECORD (16 * 1024)
+#define SPF_SHARED_CACHE_REFRESH 0.1
+
 struct rspamd_spf_library_ctx *spf_lib_ctx = NULL;
 
 /**
@@ -159,6 +166,7 @@ RSPAMD_CONSTRUCTOR(rspamd_spf_lib_ctx_ctor)
 	spf_lib_ctx->max_dns_requests = SPF_MAX_DNS_REQUESTS;
 	spf_lib_ctx->min_cache_ttl = SPF_MIN_CACHE_TTL;
 	spf_lib_ctx->disable_ipv6 = FALSE;
+	spf_lib_ctx->shared_cache_refresh = SPF_SHARED_CACHE_REFRESH;
 }
 
 RSPAMD_DESTRUCTOR(rspamd_spf_lib_ctx_dtor)
@@ -166,6 +174,7 @@ RSPAMD_DESTRUCTOR(rspamd_spf_lib_ctx_dtor)
 	if (spf_lib_ctx->spf_hash) {
 		rspamd_lru_hash_destroy(spf_lib_ctx->spf_hash);
 	}
+	rspamd_shm_cache_destroy(spf_lib_ctx->shared_cache);
 	g_free(spf_lib_ctx);
 	spf_lib_ctx = NULL;
 }
@@ -232,6 +241,45 @@ void spf_library_config(const ucl_object_t *obj)
 			g_free,
 			spf_record_cached_unref_dtor);
 	}
+
+	/*
+	 * Shared cache must be created before workers are forked, it is fine as
+	 * the library is configured when plugins are loaded by the main process
+	 */
+	if (spf_lib_ctx->shared_cache) {
+		rspamd_shm_cache_destroy(spf_lib_ctx->shared_cache);
+		spf_lib_ctx->shared_cache = NULL;
+	}
+
+	if ((value = ucl_object_find_key(obj, "shared_cache_refresh")) != NULL) {
+		double dval;
+
+		if (ucl_object_todouble_safe(value, &dval) && dval >= 0 && dval < 1.0) {
+			spf_lib_ctx->shared_cache_refresh = dval;
+		}
+	}
+
+	if ((value = ucl_object_find_key(obj, "shared_cache_size")) != NULL) {
+		if (ucl_object_toint_safe(value, &ival) && ival > 0) {
+			gsize max_record = SPF_SHARED_CACHE_MAX_RECORD;
+
+			if ((value = ucl_object_find_key(obj, "shared_cache_max_record")) != NULL) {
+				int64_t mval;
+
+				if (ucl_object_toint_safe(value, &mval) && mval > 0) {
+					max_record = mval;
+				}
+			}
+
+			spf_lib_ctx->shared_cache = rspamd_shm_cache_new("spf", ival, max_record,
+															 spf_lib_ctx->shared_cache_refresh);
+
+			if (spf_lib_ctx->shared_cache == NULL) {
+				msg_err("cannot allocate shared SPF cache of %L elements: %s",
+						ival, strerror(errno));
+			}
+		}
+	}
 }
 
 static gboolean start_spf_parse(struct spf_record *rec,
@@ -603,6 +651,190 @@ rspamd_spf_record_postprocess(struct spf_resolved *rec, struct rspamd_task *task
 	}
 }
 
+/*
+ * Flattened record in the shared cache: header, top record and elements each
+ * followed by its spf string; it is read by processes of the same binary, so
+ * native layout is used
+ */
+struct spf_shared_hdr {
+	uint64_t digest;
+	int32_t flags;
+	uint32_t nelts;
+	uint32_t top_len;
+};
+
+struct spf_shared_addr {
+	unsigned char addr6[sizeof(struct in6_addr)];
+	unsigned char addr4[sizeof(struct in_addr)];
+	uint32_t m;
+	uint32_t flags;
+	uint32_t mech;
+	uint32_t slen;
+};
+
+static gsize
+rspamd_spf_shared_serialize(struct spf_resolved *flat, unsigned char *buf, gsize buflen)
+{
+	struct spf_shared_hdr hdr;
+	struct spf_shared_addr saddr;
+	unsigned char *p = buf, *end = buf + buflen;
+
+	hdr.digest = flat->digest;
+	hdr.flags = flat->flags;
+	hdr.nelts = flat->elts->len;
+	hdr.top_len = flat->top_record ? strlen(flat->top_record) : 0;
+
+	if (p + sizeof(hdr) + hdr.top_len > end) {
+		return 0;
+	}
+
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+
+	if (hdr.top_len > 0) {
+		memcpy(p, flat->top_record, hdr.top_len);
+		p += hdr.top_len;
+	}
+
+	for (unsigned int i = 0; i < flat->elts->len; i++) {
+		struct spf_addr *addr = &g_array_index(flat->elts, struct spf_addr, i);
+
+		memcpy(saddr.addr6, addr->addr6, sizeof(saddr.addr6));
+		memcpy(saddr.addr4, addr->addr4, sizeof(saddr.addr4));
+		saddr.m = addr->m.idx;
+		saddr.flags = addr->flags;
+		saddr.mech = addr->mech;
+		saddr.slen = addr->spf_string ? strlen(addr->spf_string) : 0;
+
+		if (p + sizeof(saddr) + saddr.slen > end) {
+			return 0;
+		}
+
+		memcpy(p, &saddr, sizeof(saddr));
+		p += sizeof(saddr);
+
+		if (saddr.slen > 0) {
+			memcpy(p, addr->spf_string, saddr.slen);
+			p += saddr.slen;
+		}
+	}
+
+	return p - buf;
+}
+
+static struct spf_resolved *
+rspamd_spf_shared_deserialize(const char *domain, const unsigned char *buf, gsize len,
+							  double inserted, double expire)
+{
+	struct spf_shared_hdr hdr;
+	struct spf_shared_addr saddr;
+	struct spf_addr addr;
+	struct spf_resolved *res;
+	const unsigned char *p = buf, *end = buf + len;
+
+	if (len < sizeof(hdr)) {
+		return NULL;
+	}
+
+	memcpy(&hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+
+	if (p + hdr.top_len > end) {
+		return NULL;
+	}
+
+	res = g_malloc0(sizeof(*res));
+	res->domain = g_strdup(domain);
+	res->timestamp = inserted;
+	res->ttl = expire - inserted;
+	res->digest = hdr.digest;
+	res->flags = hdr.flags;
+	res->top_record = hdr.top_len > 0 ? g_strndup((const char *) p, hdr.top_len) : NULL;
+	res->elts = g_array_sized_new(FALSE, FALSE, sizeof(struct spf_addr), hdr.nelts);
+	REF_INIT_RETAIN(res, rspamd_flatten_record_dtor);
+	p += hdr.top_len;
+
+	for (unsigned int i = 0; i < hdr.nelts; i++) {
+		if (p + sizeof(saddr) > end) {
+			REF_RELEASE(res);
+			return NULL;
+		}
+
+		memcpy(&saddr, p, sizeof(saddr));
+		p += sizeof(saddr);
+
+		if (p + saddr.slen > end) {
+			REF_RELEASE(res);
+			return NULL;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		memcpy(addr.addr6, saddr.addr6, sizeof(addr.addr6));
+		memcpy(addr.addr4, saddr.addr4, sizeof(addr.addr4));
+		addr.m.idx = saddr.m;
+		addr.flags = saddr.flags;
+		addr.mech = saddr.mech;
+		addr.spf_string = saddr.slen > 0 ? g_strndup((const char *) p, saddr.slen) : NULL;
+		p += saddr.slen;
+		g_array_append_val(res->elts, addr);
+	}
+
+	return res;
+}
+
+static void
+rspamd_spf_shared_store(struct spf_resolved *flat, struct rspamd_task *task)
+{
+	rspamd_shm_cache_t *cache = spf_lib_ctx->shared_cache;
+	unsigned char *buf;
+	gsize len;
+
+	buf = g_malloc(rspamd_shm_cache_max_value(cache));
+	len = rspamd_spf_shared_serialize(flat, buf, rspamd_shm_cache_max_value(cache));
+
+	if (len == 0) {
+		msg_info_task("SPF record for %s has %d elements and it is too large "
+					  "for the shared cache",
+					  flat->domain, flat->elts->len);
+	}
+	else if (rspamd_shm_cache_insert(cache, flat->domain, strlen(flat->domain),
+									 buf, len, flat->timestamp, flat->ttl)) {
+		msg_debug_task("stored SPF record for %s (0x%xuL) in the shared cache",
+					   flat->domain, flat->digest);
+	}
+
+	g_free(buf);
+}
+
+/*
+ * Returns a record from the shared cache (with a new reference); `refresh`
+ * is set if the caller has to resolve the record again before it expires
+ */
+static struct spf_resolved *
+rspamd_spf_shared_lookup(struct rspamd_task *task, const char *domain,
+						 gboolean *refresh)
+{
+	rspamd_shm_cache_t *cache = spf_lib_ctx->shared_cache;
+	struct spf_resolved *res = NULL;
+	enum rspamd_shm_cache_result ret;
+	unsigned char *buf;
+	double inserted, expire;
+	gsize len;
+
+	buf = g_malloc(rspamd_shm_cache_max_value(cache));
+	ret = rspamd_shm_cache_lookup(cache, domain, strlen(domain),
+								  task->task_timestamp, buf, &len, &inserted, &expire);
+
+	if (ret != RSPAMD_SHM_CACHE_MISS) {
+		res = rspamd_spf_shared_deserialize(domain, buf, len, inserted, expire);
+		*refresh = (ret == RSPAMD_SHM_CACHE_HIT_REFRESH);
+	}
+
+	g_free(buf);
+
+	return res;
+}
+
 static void
 rspamd_spf_maybe_return(struct spf_record *rec)
 {
@@ -631,6 +863,10 @@ rspamd_spf_maybe_return(struct spf_record *rec)
 							  rspamd_lru_hash_capacity(spf_lib_ctx->spf_hash));
 				cached = true;
 			}
+
+			if (spf_lib_ctx->shared_cache) {
+				rspamd_spf_shared_store(flat, task);
+			}
 		}
 
 		if (!cached) {
@@ -2624,39 +2860,34 @@ rspamd_spf_get_domain(struct rspamd_task *task)
 	return domain;
 }
 
-gboolean
-rspamd_spf_resolve(struct rspamd_task *task, spf_cb_t callback,
-				   gpointer cbdata, struct rspamd_spf_cred *cred)
+static void
+rspamd_spf_return_cached(struct rspamd_task *task, struct spf_resolved *cached,
+						 spf_cb_t callback, gpointer cbdata)
 {
-	struct spf_record *rec;
+	cached->flags |= RSPAMD_SPF_FLAG_CACHED;
 
-	if (!cred || !cred->domain) {
-		return FALSE;
+	if (cached->top_record) {
+		rspamd_mempool_set_variable(task->task_pool,
+									RSPAMD_MEMPOOL_SPF_RECORD,
+									rspamd_mempool_strdup(task->task_pool,
+														  cached->top_record),
+									NULL);
 	}
 
-	/* First lookup in the hash */
-	if (spf_lib_ctx->spf_hash) {
-		struct spf_resolved *cached;
-
-		cached = rspamd_lru_hash_lookup(spf_lib_ctx->spf_hash, cred->domain,
-										task->task_timestamp);
-
-		if (cached) {
-			cached->flags |= RSPAMD_SPF_FLAG_CACHED;
-
-			if (cached->top_record) {
-				rspamd_mempool_set_variable(task->task_pool,
-											RSPAMD_MEMPOOL_SPF_RECORD,
-											rspamd_mempool_strdup(task->task_pool,
-																  cached->top_record),
-											NULL);
-			}
-			callback(cached, task, cbdata);
+	callback(cached, task, cbdata);
+}
 
-			return TRUE;
-		}
-	}
+static void
+spf_refresh_cb(struct spf_resolved *record, struct rspamd_task *task, gpointer cbdata)
+{
+	/* Record is stored in caches by rspamd_spf_maybe_return */
+}
 
+static gboolean
+rspamd_spf_resolve_uncached(struct rspamd_task *task, spf_cb_t callback,
+							gpointer cbdata, struct rspamd_spf_cred *cred)
+{
+	struct spf_record *rec;
 
 	rec = rspamd_mempool_alloc0(task->task_pool, sizeof(struct spf_record));
 	rec->task = task;
@@ -2685,6 +2916,74 @@ rspamd_spf_resolve(struct rspamd_task *task, spf_cb_t callback,
 	return FALSE;
 }
 
+gboolean
+rspamd_spf_resolve(struct rspamd_task *task, spf_cb_t callback,
+				   gpointer cbdata, struct rspamd_spf_cred *cred)
+{
+	struct spf_resolved *cached = NULL, *shared;
+	gboolean refresh = FALSE;
+
+	if (!cred || !cred->domain) {
+		return FALSE;
+	}
+
+	/* First lookup in the hash */
+	if (spf_lib_ctx->spf_hash) {
+		cached = rspamd_lru_hash_lookup(spf_lib_ctx->spf_hash, cred->domain,
+										task->task_timestamp);
+
+		if (cached && (spf_lib_ctx->shared_cache == NULL ||
+					   cached->timestamp + cached->ttl - task->task_timestamp >=
+						   cached->ttl * spf_lib_ctx->shared_cache_refresh)) {
+			rspamd_spf_return_cached(task, cached, callback, cbdata);
+
+			return TRUE;
+		}
+	}
+
+	/*
+	 * Either a local record is missing or it is about to expire: another process
+	 * might have resolved it already, otherwise one of processes refreshes it
+	 * whilst the others still use the old record
+	 */
+	if (spf_lib_ctx->shared_cache) {
+		shared = rspamd_spf_shared_lookup(task, cred->domain, &refresh);
+
+		if (shared) {
+			if (cached == NULL || shared->timestamp > cached->timestamp) {
+				if (spf_lib_ctx->spf_hash) {
+					rspamd_lru_hash_insert(spf_lib_ctx->spf_hash,
+										   g_strdup(shared->domain),
+										   spf_record_ref(shared),
+										   shared->timestamp, shared->ttl);
+				}
+
+				rspamd_spf_return_cached(task, shared, callback, cbdata);
+			}
+			else {
+				rspamd_spf_return_cached(task, cached, callback, cbdata);
+			}
+
+			spf_record_unref(shared);
+
+			if (refresh) {
+				msg_info_task("refresh SPF record for %s before it expires",
+							  cred->domain);
+				rspamd_spf_resolve_uncached(task, spf_refresh_cb, NULL, cred);
+			}
+
+			return TRUE;
+		}
+		else if (cached) {
+			rspamd_spf_return_cached(task, cached, callback, cbdata);
+
+			return TRUE;
+		}
+	}
+
+	return rspamd_spf_resolve_uncached(task, callback, cbdata, cred);
+}
+
 struct spf_resolved *
 _spf_record_ref(struct spf_resolved *flat, const char *loc)
 {
@@ -424,6 +424,16 @@ rspamd_tls_set_error(int retcode, const char *stage, GError **err)
 	g_string_free(reason, TRUE);
 }
 
+static inline gboolean
+rspamd_ssl_ktls_send(struct rspamd_ssl_connection *conn)
+{
+#ifdef BIO_get_ktls_send
+	return BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? TRUE : FALSE;
+#else
+	return FALSE;
+#endif
+}
+
 static void
 rspamd_ssl_connection_dtor(struct rspamd_ssl_connection *conn)
 {
@@ -573,7 +583,9 @@ rspamd_ssl_event_handler(int fd, short what, gpointer ud)
 			rspamd_ev_watcher_stop(conn->event_loop, conn->ev);
 			/* Verify certificate */
 			if ((!conn->verify_peer) || rspamd_ssl_peer_verify(conn)) {
-				msg_debug_ssl("ssl connect: connected");
+				msg_debug_ssl("ssl connect: connected; session reused=%s, ktls=%s",
+							  SSL_session_reused(conn->ssl) ? "true" : "false",
+							  rspamd_ssl_ktls_send(conn) ? "true" : "false");
 				conn->state = ssl_conn_connected;
 				conn->handler(fd, EV_WRITE, conn->handler_data);
 			}
@@ -674,6 +686,12 @@ rspamd_ssl_connect_fd(struct rspamd_ssl_connection *conn, int fd,
 	if (hostname) {
 		session = rspamd_lru_hash_lookup(conn->ssl_ctx->sessions, hostname,
 										 ev_now(conn->event_loop));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+		if (session && !SSL_SESSION_is_resumable(session)) {
+			rspamd_lru_hash_remove(conn->ssl_ctx->sessions, hostname);
+			session = NULL;
+		}
+#endif
 	}
 
 	if (session) {
@@ -681,8 +699,8 @@ rspamd_ssl_connect_fd(struct rspamd_ssl_connection *conn, int fd,
 	}
 
 	SSL_set_app_data(conn->ssl, conn);
-	msg_debug_ssl("new ssl connection %p; session reused=%s",
-				  conn->ssl, SSL_session_reused(conn->ssl) ? "true" : "false");
+	msg_debug_ssl("new ssl connection %p; cached session=%s",
+				  conn->ssl, session ? "true" : "false");
 
 	if (conn->state != ssl_conn_reset) {
 		return FALSE;
@@ -721,7 +739,9 @@ rspamd_ssl_connect_fd(struct rspamd_ssl_connection *conn, int fd,
 	if (ret == 1) {
 		conn->state = ssl_conn_connected;
 
-		msg_debug_ssl("connected, start write event");
+		msg_debug_ssl("connected, start write event; session reused=%s, ktls=%s",
+					  SSL_session_reused(conn->ssl) ? "true" : "false",
+					  rspamd_ssl_ktls_send(conn) ? "true" : "false");
 		rspamd_ev_watcher_stop(conn->event_loop, ev);
 		rspamd_ev_watcher_init(ev, nfd, EV_WRITE, rspamd_ssl_event_handler, conn);
 		rspamd_ev_watcher_start(conn->event_loop, ev, timeout);
@@ -932,6 +952,47 @@ rspamd_ssl_writev(struct rspamd_ssl_connection *conn, struct iovec *iov,
 	struct iovec *cur;
 	gsize i, remain;
 
+	if (conn->state == ssl_conn_connected && rspamd_ssl_ktls_send(conn)) {
+		/* Records are framed by the kernel, so we can write iovec as is */
+		gssize r = writev(conn->fd, iov, iovlen);
+
+		if (r == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				rspamd_ev_watcher_reschedule(conn->event_loop, conn->ev, EV_WRITE);
+				errno = EAGAIN;
+			}
+			else {
+				GError *err = NULL;
+				int saved_errno = errno;
+
+				conn->shut = ssl_shut_unclean;
+				g_set_error(&err, rspamd_ssl_quark(), 500,
+							"ssl write error: ktls writev fail: %s", strerror(saved_errno));
+				conn->err_handler(conn->handler_data, err);
+				g_error_free(err);
+				errno = saved_errno;
+			}
+		}
+
+		msg_debug_ssl("ktls writev: ret=%z, iovlen=%z", r, iovlen);
+
+		return r;
+	}
+
+	for (i = 0; i < iovlen; i++) {
+		if (iov[i].iov_len > 0) {
+			if (iov[i].iov_len >= sizeof(ssl_buf)) {
+				/*
+				 * Large chunk: write it directly, the same iovec is passed
+				 * on retry, so SSL_write gets the same arguments
+				 */
+				return rspamd_ssl_write(conn, iov[i].iov_base, iov[i].iov_len);
+			}
+
+			break;
+		}
+	}
+
 	remain = sizeof(ssl_buf);
 	p = ssl_buf;
 
@@ -985,10 +1046,13 @@ rspamd_ssl_new_client_session(SSL *ssl, SSL_SESSION *sess)
 	conn = SSL_get_app_data(ssl);
 
 	if (conn->hostname) {
+		/* We take ownership of the session by returning 1 */
 		rspamd_lru_hash_insert(conn->ssl_ctx->sessions,
-							   g_strdup(conn->hostname), SSL_get1_session(ssl),
-							   ev_now(conn->event_loop), SSL_CTX_get_timeout(conn->ssl_ctx->s));
+							   g_strdup(conn->hostname), sess,
+							   ev_now(conn->event_loop), SSL_SESSION_get_timeout(sess));
 		msg_debug_ssl("saved new session for %s: %p", conn->hostname, conn);
+
+		return 1;
 	}
 
 	return 0;
@@ -1121,6 +1185,14 @@ void rspamd_ssl_ctx_config(struct rspamd_config *cfg, gpointer ssl_ctx)
 			SSL_CTX_set_cipher_list(ctx->s, default_secure_ciphers);
 		}
 	}
+
+	if (cfg->ssl_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx->s, SSL_OP_ENABLE_KTLS);
+#else
+		msg_warn_config("kernel TLS is not supported by the ssl library, ignore ssl_ktls");
+#endif
+	}
 }
 
 void rspamd_ssl_ctx_free(gpointer ssl_ctx)
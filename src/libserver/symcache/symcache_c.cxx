@@ -18,6 +18,7 @@
 #include "symcache_periodic.hxx"
 #include "symcache_item.hxx"
 #include "symcache_runtime.hxx"
+#include "libserver/logger.hxx"
 
 /**
  * C API for symcache
@@ -147,6 +148,20 @@ int rspamd_symcache_find_symbol(struct rspamd_symcache *cache,
 	return -1;
 }
 
+const char *
+rspamd_symcache_symbol_by_id(struct rspamd_symcache *cache, int id)
+{
+	auto *real_cache = C_API_SYMCACHE(cache);
+
+	auto sym_maybe = real_cache->get_item_by_id(id, false);
+
+	if (sym_maybe != nullptr) {
+		return sym_maybe->symbol.c_str();
+	}
+
+	return nullptr;
+}
+
 gboolean
 rspamd_symcache_stat_symbol(struct rspamd_symcache *cache,
 							const char *name,
@@ -181,6 +196,12 @@ unsigned int rspamd_symcache_stats_symbols_count(struct rspamd_symcache *cache)
 	return real_cache->get_stats_symbols_count();
 }
 
+unsigned int rspamd_symcache_items_count(struct rspamd_symcache *cache)
+{
+	auto *real_cache = C_API_SYMCACHE(cache);
+	return real_cache->get_items_count();
+}
+
 uint64_t
 rspamd_symcache_get_cksum(struct rspamd_symcache *cache)
 {
@@ -224,6 +245,29 @@ void rspamd_symcache_inc_frequency(struct rspamd_symcache *cache, struct rspamd_
 	}
 }
 
+void rspamd_symcache_set_dynamic_score(struct rspamd_task *task,
+									   struct rspamd_symcache_item *item)
+{
+	auto *real_cache = C_API_SYMCACHE(task->cfg->cache);
+	auto *cache_runtime = C_API_SYMCACHE_RUNTIME(task->symcache_runtime);
+
+	auto mark_item = [&](rspamd::symcache::cache_item *real_item) -> void {
+		while (real_item != nullptr && !real_item->has_dynamic_score()) {
+			msg_info_task_fmt("symbol {} has dynamic score, do not stop filters while it is pending",
+							  real_item->get_name());
+			real_item->internal_flags |= rspamd::symcache::cache_item::bit_dynamic_score;
+			/* Virtual symbols are inserted by their parents */
+			real_item = real_item->get_parent_mut(*real_cache);
+		}
+	};
+
+	mark_item(C_API_SYMCACHE_ITEM(item));
+
+	if (cache_runtime != nullptr && cache_runtime->get_cur_item() != nullptr) {
+		mark_item(cache_runtime->get_item_by_dynamic_item(cache_runtime->get_cur_item()));
+	}
+}
+
 void rspamd_symcache_add_delayed_dependency(struct rspamd_symcache *cache,
 											const char *from, const char *to)
 {
@@ -273,6 +317,17 @@ int rspamd_symcache_item_flags(struct rspamd_symcache_item *item)
 	return real_item->get_flags();
 }
 
+int rspamd_symcache_item_id(struct rspamd_symcache_item *item)
+{
+	auto *real_item = C_API_SYMCACHE_ITEM(item);
+
+	if (real_item == nullptr) {
+		return -1;
+	}
+
+	return real_item->id;
+}
+
 
 const char *
 rspamd_symcache_dyn_item_name(struct rspamd_task *task,
@@ -290,6 +345,38 @@ rspamd_symcache_dyn_item_name(struct rspamd_task *task,
 	return static_item->get_name().c_str();
 }
 
+unsigned int
+rspamd_symcache_dyn_item_foreach_child(struct rspamd_task *task,
+									   struct rspamd_symcache_dynamic_item *dyn_item,
+									   rspamd_symcache_child_cb func,
+									   void *ud)
+{
+	auto *cache_runtime = C_API_SYMCACHE_RUNTIME(task->symcache_runtime);
+	auto *real_dyn_item = C_API_SYMCACHE_DYN_ITEM(dyn_item);
+	unsigned int nchildren = 0;
+
+	if (cache_runtime == nullptr || real_dyn_item == nullptr) {
+		return 0;
+	}
+
+	auto static_item = cache_runtime->get_item_by_dynamic_item(real_dyn_item);
+	const auto *children = static_item->get_children();
+
+	if (children == nullptr) {
+		return 0;
+	}
+
+	for (const auto *child: *children) {
+		/* Children that cannot be inserted (e.g. due to settings) are skipped */
+		if (child->is_allowed(task, false)) {
+			func(child->get_name().c_str(), ud);
+			nchildren++;
+		}
+	}
+
+	return nchildren;
+}
+
 int rspamd_symcache_item_flags(struct rspamd_task *task,
 							   struct rspamd_symcache_dynamic_item *dyn_item)
 {
@@ -374,6 +461,8 @@ bool rspamd_symcache_set_allowed_settings_ids(struct rspamd_symcache *cache,
 	}
 
 	item->allowed_ids.set_ids(ids, nids);
+	real_cache->invalidate_settings_masks();
+
 	return true;
 }
 
@@ -391,6 +480,8 @@ bool rspamd_symcache_set_forbidden_settings_ids(struct rspamd_symcache *cache,
 	}
 
 	item->forbidden_ids.set_ids(ids, nids);
+	real_cache->invalidate_settings_masks();
+
 	return true;
 }
 
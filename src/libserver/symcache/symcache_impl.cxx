@@ -23,6 +23,8 @@
 #include "libutil/cxx/util.hxx"
 #include "fmt/core.h"
 #include "contrib/t1ha/t1ha.h"
+#include "libcryptobox/cryptobox.h"
+#include "libserver/composites/composites.h"
 
 #ifdef __has_include
 #if __has_include(<version>)
@@ -109,6 +111,25 @@ auto symcache::init() -> bool
 		}
 	}
 
+	/* Symbols with execution time histograms */
+	auto hist_idx = 0;
+	for (auto *cur = cfg->histogram_symbols; cur != nullptr; cur = g_list_next(cur), hist_idx++) {
+		if (hist_idx >= RSPAMD_STAT_HIST_MAX_SYMBOLS) {
+			msg_warn_cache("too many symbols for histograms, %d at most are allowed",
+						   RSPAMD_STAT_HIST_MAX_SYMBOLS);
+			break;
+		}
+
+		auto *hist_item = get_item_by_name_mut((const char *) cur->data, true);
+
+		if (hist_item == nullptr) {
+			msg_warn_cache("cannot find symbol %s for histogram", (const char *) cur->data);
+			continue;
+		}
+
+		hist_item->hist_id = RSPAMD_STAT_HIST_SYMBOL + hist_idx;
+	}
+
 	/* Deal with the delayed dependencies */
 	msg_debug_cache("resolving delayed dependencies: %d in list", (int) delayed_deps->size());
 	for (const auto &delayed_dep: *delayed_deps) {
@@ -243,6 +264,11 @@ auto symcache::init() -> bool
 	return res;
 }
 
+static constexpr auto profile_padded_len(std::size_t len) -> std::size_t
+{
+	return (len + 7u) & ~7u;
+}
+
 auto symcache::load_items() -> bool
 {
 	auto cached_map = util::raii_mmaped_file::mmap_shared(cfg->cache_filename,
@@ -266,18 +292,114 @@ auto symcache::load_items() -> bool
 	}
 
 	const auto *hdr = (struct symcache_header *) cached_map->get_map();
+	const auto *p = (const unsigned char *) (hdr + 1);
+	auto remain = cached_map->get_size() - sizeof(*hdr);
 
 	if (memcmp(hdr->magic, symcache_magic,
-			   sizeof(symcache_magic)) != 0) {
-		msg_info_cache("cannot use file %s, bad magic", cfg->cache_filename);
+			   sizeof(symcache_magic)) == 0) {
+		return load_items_binary(p, remain, hdr->nitems, hdr->checksum);
+	}
+	else if (memcmp(hdr->magic, symcache_magic_ucl,
+					sizeof(symcache_magic_ucl)) == 0) {
+		return load_items_ucl(p, remain);
+	}
+
+	msg_info_cache("cannot use file %s, bad magic", cfg->cache_filename);
+
+	return false;
+}
+
+auto symcache::apply_saved_stat(cache_item *item, double avg_time, double avg_frequency,
+								double stddev_frequency, std::uint64_t saved_hits) -> void
+{
+	/*
+	 * XXX: don't save or load weight, it should be obtained from the
+	 * metric
+	 */
+	item->st->avg_time = avg_time;
+	item->st->total_hits = saved_hits;
+	item->last_count = item->st->total_hits;
+	item->st->avg_frequency = avg_frequency;
+	item->st->stddev_frequency = stddev_frequency;
+
+	if (item->is_virtual() && !item->is_ghost()) {
+		const auto &parent = item->get_parent(*this);
+
+		if (parent) {
+			if (parent->st->weight < item->st->weight) {
+				parent->st->weight = item->st->weight;
+			}
+			/*
+			 * We maintain avg_time for virtual symbols equal to the
+			 * parent item avg_time
+			 */
+			item->st->avg_time = parent->st->avg_time;
+		}
+	}
+
+	total_weight += fabs(item->st->weight);
+	total_hits += item->st->total_hits;
+}
+
+auto symcache::load_items_binary(const unsigned char *data, std::size_t len, unsigned int nitems,
+								 const std::uint8_t *checksum) -> bool
+{
+	unsigned char digest[rspamd_cryptobox_HASHBYTES];
+
+	static_assert(sizeof(digest) <= sizeof(symcache_header::checksum));
+	rspamd_cryptobox_hash(digest, data, len, nullptr, 0);
+
+	if (memcmp(digest, checksum, sizeof(digest)) != 0) {
+		msg_info_cache("cannot use file %s, bad checksum", cfg->cache_filename);
 
 		return false;
 	}
 
+	const auto *p = data;
+	const auto *end = data + len;
+	auto nloaded = 0u;
+
+	for (auto i = 0u; i < nitems; i++) {
+		if (end - p < (std::ptrdiff_t) sizeof(symcache_profile_record)) {
+			msg_info_cache("cannot use file %s, truncated record %ud", cfg->cache_filename, i);
+
+			return false;
+		}
+
+		symcache_profile_record rec;
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		auto padded_len = profile_padded_len(rec.name_len);
+
+		if (end - p < (std::ptrdiff_t) padded_len) {
+			msg_info_cache("cannot use file %s, truncated record %ud", cfg->cache_filename, i);
+
+			return false;
+		}
+
+		auto name = std::string_view{(const char *) p, rec.name_len};
+		p += padded_len;
+
+		auto item_it = items_by_symbol.find(name);
+
+		if (item_it != items_by_symbol.end()) {
+			apply_saved_stat(item_it->second, rec.avg_time, rec.avg_frequency,
+							 rec.stddev_frequency, rec.total_hits);
+			nloaded++;
+		}
+	}
+
+	msg_info_cache("loaded profile for %ud symbols out of %ud saved from %s",
+				   nloaded, nitems, cfg->cache_filename);
+
+	return true;
+}
+
+auto symcache::load_items_ucl(const unsigned char *data, std::size_t len) -> bool
+{
 	auto *parser = ucl_parser_new(0);
-	const auto *p = (const std::uint8_t *) (hdr + 1);
 
-	if (!ucl_parser_add_chunk(parser, p, cached_map->get_size() - sizeof(*hdr))) {
+	if (!ucl_parser_add_chunk(parser, data, len)) {
 		msg_info_cache("cannot use file %s, cannot parse: %s", cfg->cache_filename,
 					   ucl_parser_get_error(parser));
 		ucl_parser_free(parser);
@@ -302,30 +424,18 @@ auto symcache::load_items() -> bool
 
 		if (item_it != items_by_symbol.end()) {
 			auto item = item_it->second;
-			/* Copy saved info */
-			/*
-			 * XXX: don't save or load weight, it should be obtained from the
-			 * metric
-			 */
-#if 0
-			elt = ucl_object_lookup (cur, "weight");
+			auto avg_time = item->st->avg_time, avg_freq = item->st->avg_frequency,
+				 stddev_freq = item->st->stddev_frequency;
+			std::uint64_t saved_hits = item->st->total_hits;
 
-			if (elt) {
-				w = ucl_object_todouble (elt);
-				if (w != 0) {
-					item->weight = w;
-				}
-			}
-#endif
 			const auto *elt = ucl_object_lookup(cur, "time");
 			if (elt) {
-				item->st->avg_time = ucl_object_todouble(elt);
+				avg_time = ucl_object_todouble(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "count");
 			if (elt) {
-				item->st->total_hits = ucl_object_toint(elt);
-				item->last_count = item->st->total_hits;
+				saved_hits = ucl_object_toint(elt);
 			}
 
 			elt = ucl_object_lookup(cur, "frequency");
@@ -335,32 +445,16 @@ auto symcache::load_items() -> bool
 				freq_elt = ucl_object_lookup(elt, "avg");
 
 				if (freq_elt) {
-					item->st->avg_frequency = ucl_object_todouble(freq_elt);
+					avg_freq = ucl_object_todouble(freq_elt);
 				}
 				freq_elt = ucl_object_lookup(elt, "stddev");
 
 				if (freq_elt) {
-					item->st->stddev_frequency = ucl_object_todouble(freq_elt);
+					stddev_freq = ucl_object_todouble(freq_elt);
 				}
 			}
 
-			if (item->is_virtual() && !item->is_ghost()) {
-				const auto &parent = item->get_parent(*this);
-
-				if (parent) {
-					if (parent->st->weight < item->st->weight) {
-						parent->st->weight = item->st->weight;
-					}
-				}
-				/*
-				 * We maintain avg_time for virtual symbols equal to the
-				 * parent item avg_time
-				 */
-				item->st->avg_time = parent->st->avg_time;
-			}
-
-			total_weight += fabs(item->st->weight);
-			total_hits += item->st->total_hits;
+			apply_saved_stat(item, avg_time, avg_freq, stddev_freq, saved_hits);
 		}
 	}
 
@@ -370,12 +464,6 @@ auto symcache::load_items() -> bool
 	return true;
 }
 
-template<typename T>
-static constexpr auto round_to_hundreds(T x)
-{
-	return (::floor(x) * 100.0) / 100.0;
-}
-
 bool symcache::save_items() const
 {
 	if (cfg->cache_filename == nullptr) {
@@ -396,51 +484,56 @@ bool symcache::save_items() const
 		return false;
 	}
 
+	/* Serialise all records to a buffer first, as we need a checksum in the header */
+	std::vector<unsigned char> payload;
+	payload.reserve(items_by_symbol.size() * (sizeof(symcache_profile_record) + 16));
+
+	for (const auto &it: items_by_symbol) {
+		auto item = it.second;
+		symcache_profile_record rec{};
+
+		rec.avg_time = item->st->time_counter.mean;
+		rec.avg_frequency = item->st->frequency_counter.mean;
+		rec.stddev_frequency = item->st->frequency_counter.stddev;
+		rec.total_hits = item->st->total_hits;
+		rec.name_len = it.first.size();
+
+		const auto *rec_ptr = (const unsigned char *) &rec;
+		payload.insert(payload.end(), rec_ptr, rec_ptr + sizeof(rec));
+		payload.insert(payload.end(), it.first.begin(), it.first.end());
+		payload.resize(payload.size() + (profile_padded_len(rec.name_len) - rec.name_len), 0);
+	}
+
 	struct symcache_header hdr;
 	memset(&hdr, 0, sizeof(hdr));
 	memcpy(hdr.magic, symcache_magic, sizeof(symcache_magic));
+	hdr.nitems = items_by_symbol.size();
+	rspamd_cryptobox_hash(hdr.checksum, payload.data(), payload.size(), nullptr, 0);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = payload.data();
+	iov[1].iov_len = payload.size();
 
-	if (write(file_sink->get_fd(), &hdr, sizeof(hdr)) == -1) {
+	if (writev(file_sink->get_fd(), iov, G_N_ELEMENTS(iov)) != (ssize_t) (sizeof(hdr) + payload.size())) {
 		msg_err_cache("cannot write to file %s, error %d, %s", cfg->cache_filename,
 					  errno, strerror(errno));
 
 		return false;
 	}
 
-	auto *top = ucl_object_typed_new(UCL_OBJECT);
+	/* Atomically replace the previous profile */
+	if (!file_sink->write_output()) {
+		msg_err_cache("cannot rename profile to %s, error %d, %s", cfg->cache_filename,
+					  errno, strerror(errno));
 
-	for (const auto &it: items_by_symbol) {
-		auto item = it.second;
-		auto elt = ucl_object_typed_new(UCL_OBJECT);
-		ucl_object_insert_key(elt,
-							  ucl_object_fromdouble(round_to_hundreds(item->st->weight)),
-							  "weight", 0, false);
-		ucl_object_insert_key(elt,
-							  ucl_object_fromdouble(round_to_hundreds(item->st->time_counter.mean)),
-							  "time", 0, false);
-		ucl_object_insert_key(elt, ucl_object_fromint(item->st->total_hits),
-							  "count", 0, false);
-
-		auto *freq = ucl_object_typed_new(UCL_OBJECT);
-		ucl_object_insert_key(freq,
-							  ucl_object_fromdouble(round_to_hundreds(item->st->frequency_counter.mean)),
-							  "avg", 0, false);
-		ucl_object_insert_key(freq,
-							  ucl_object_fromdouble(round_to_hundreds(item->st->frequency_counter.stddev)),
-							  "stddev", 0, false);
-		ucl_object_insert_key(elt, freq, "frequency", 0, false);
-
-		ucl_object_insert_key(top, elt, it.first.data(), 0, true);
-	}
-
-	auto fp = fdopen(file_sink->get_fd(), "a");
-	auto *efunc = ucl_object_emit_file_funcs(fp);
-	auto ret = ucl_object_emit_full(top, UCL_EMIT_JSON_COMPACT, efunc, nullptr);
-	ucl_object_emit_funcs_free(efunc);
-	ucl_object_unref(top);
-	fclose(fp);
+		return false;
+	}
 
-	return ret;
+	msg_debug_cache("saved profile for %d symbols to %s", (int) hdr.nitems, cfg->cache_filename);
+
+	return true;
 }
 
 auto symcache::metric_connect_cb(void *k, void *v, void *ud) -> void
@@ -458,6 +551,38 @@ auto symcache::metric_connect_cb(void *k, void *v, void *ud) -> void
 }
 
 
+auto symcache::get_score_potential(cache_item *item) const -> double
+{
+	auto *sdef = (struct rspamd_symbol *) g_hash_table_lookup(cfg->symbols, item->symbol.c_str());
+
+	if (sdef == nullptr || (item->flags & SYMBOL_TYPE_SKIPPED)) {
+		/* No score can be inserted for this symbol */
+		return 0.0;
+	}
+
+	auto nshots = sdef->nshots;
+	unsigned int i;
+	struct rspamd_symbols_group *gr;
+
+	PTR_ARRAY_FOREACH(sdef->groups, i, gr)
+	{
+		if (gr->flags & RSPAMD_SYMBOL_GROUP_ONE_SHOT) {
+			nshots = 1;
+		}
+	}
+
+	/*
+	 * Unlimited shots and zero static weight (the score is likely to be set
+	 * in runtime) cannot be bound at all
+	 */
+	if (nshots <= 0 || *sdef->weight_ptr == 0) {
+		item->internal_flags |= cache_item::bit_dynamic_score;
+		nshots = 1;
+	}
+
+	return *sdef->weight_ptr * nshots;
+}
+
 auto symcache::get_item_by_id(int id, bool resolve_parent) const -> const cache_item *
 {
 	if (id < 0 || id >= items_by_id.size()) {
@@ -676,6 +801,31 @@ auto symcache::resort() -> void
 	}
 
 
+	/* Score potential is used by the cost based scheduling */
+	for (const auto &it: ord->d) {
+		auto potential = get_score_potential(it.get());
+		it->score_potential_pos = std::max(potential, 0.0);
+		it->score_potential_neg = std::max(-potential, 0.0);
+	}
+
+	for (const auto &[id, it]: items_by_id) {
+		if (it->is_virtual() && !it->is_ghost()) {
+			auto *parent = it->get_parent_mut(*this);
+
+			if (parent && parent->is_filter()) {
+				auto potential = get_score_potential(it.get());
+				parent->score_potential_pos += std::max(potential, 0.0);
+				parent->score_potential_neg += std::max(-potential, 0.0);
+
+				if (it->has_dynamic_score()) {
+					parent->internal_flags |= cache_item::bit_dynamic_score;
+				}
+			}
+		}
+	}
+
+	const auto cost_scheduling = cfg->cache_cost_scheduling;
+
 	/* Main sorting comparator */
 	constexpr auto score_functor = [](auto w, auto f, auto t) -> auto {
 		auto time_alpha = 1.0, weight_alpha = 0.1, freq_alpha = 0.01;
@@ -702,6 +852,12 @@ auto symcache::resort() -> void
 		auto f2 = (double) it2->st->total_hits / avg_freq;
 		auto weight1 = std::fabs(it1->st->weight) / avg_weight;
 		auto weight2 = std::fabs(it2->st->weight) / avg_weight;
+
+		if (cost_scheduling) {
+			/* Expected score contribution includes all virtual symbols of a callback */
+			weight1 = (it1->score_potential_pos + it1->score_potential_neg) / avg_weight;
+			weight2 = (it2->score_potential_pos + it2->score_potential_neg) / avg_weight;
+		}
 		auto t1 = it1->st->avg_time;
 		auto t2 = it2->st->avg_time;
 		w1 += score_functor(weight1, f1, t1);
@@ -742,6 +898,41 @@ auto symcache::resort() -> void
 	append_items_vec(composites, ord->d, "composites");
 	append_items_vec(classifiers, ord->d, "classifiers");
 
+	/*
+	 * Late stages run even if filters are stopped early, but they depend on
+	 * symbols of the skipped filters, so their scores are included in the bound
+	 */
+	for (const auto &it: ord->d) {
+		if (it->type == symcache_item_type::POSTFILTER ||
+			it->type == symcache_item_type::CLASSIFIER ||
+			it->type == symcache_item_type::COMPOSITE) {
+			auto potential = get_score_potential(it.get());
+			ord->late_potential_pos += std::max(potential, 0.0);
+			ord->late_potential_neg += std::max(-potential, 0.0);
+		}
+	}
+
+	for (const auto &[id, it]: items_by_id) {
+		if (it->is_virtual() && !it->is_ghost()) {
+			auto *parent = it->get_parent_mut(*this);
+
+			if (parent && parent->type == symcache_item_type::POSTFILTER) {
+				auto potential = get_score_potential(it.get());
+				ord->late_potential_pos += std::max(potential, 0.0);
+				ord->late_potential_neg += std::max(-potential, 0.0);
+
+				if (it->has_dynamic_score()) {
+					parent->internal_flags |= cache_item::bit_dynamic_score;
+				}
+			}
+		}
+	}
+
+	double removal_pos, removal_neg;
+	rspamd_composites_removal_potential(cfg, &removal_pos, &removal_neg);
+	ord->late_potential_pos += removal_pos;
+	ord->late_potential_neg += removal_neg;
+
 	/* After sorting is done, we can assign all elements in the by_symbol hash */
 	for (const auto [i, it]: rspamd::enumerate(ord->d)) {
 		ord->by_symbol.emplace(it->get_name(), i);
@@ -1223,6 +1414,75 @@ auto symcache::process_settings_elt(struct rspamd_config_settings_elt *elt) -> v
 			}
 		}
 	}
+
+	settings_masks.erase(id);
+}
+
+auto symcache::get_settings_mask(const struct rspamd_config_settings_elt *elt) const -> std::shared_ptr<const settings_mask>
+{
+	auto found = settings_masks.find(elt->id);
+
+	if (found != settings_masks.end() && found->second->verdicts.size() == items_by_id.size()) {
+		return found->second;
+	}
+
+	auto mask = std::make_shared<settings_mask>();
+	mask->id = elt->id;
+	mask->verdicts.resize(items_by_id.size(), 0);
+
+	for (const auto &[id, item]: items_by_id) {
+		if (id < 0 || id >= (int) mask->verdicts.size()) {
+			continue;
+		}
+
+		std::uint8_t verdict = 0;
+
+		if (item->is_allowed_by_settings(elt, true)) {
+			verdict |= settings_mask::allow_exec;
+		}
+		if (item->is_allowed_by_settings(elt, false)) {
+			verdict |= settings_mask::allow_insert;
+		}
+
+		mask->verdicts[id] = verdict;
+	}
+
+	msg_debug_cache("compiled settings mask for settings id %ud (%s), %d items",
+					elt->id, elt->name, (int) mask->verdicts.size());
+	settings_masks[elt->id] = mask;
+
+	return mask;
+}
+
+auto symcache::get_group_item_ids(const struct rspamd_symbols_group *gr) const -> const std::vector<int> &
+{
+	if (group_items_nitems != items_by_id.size()) {
+		group_items.clear();
+		group_items_nitems = items_by_id.size();
+	}
+
+	auto found = group_items.find(gr);
+
+	if (found != group_items.end()) {
+		return found->second;
+	}
+
+	std::vector<int> ids;
+	GHashTableIter it;
+	void *k, *v;
+
+	ids.reserve(g_hash_table_size(gr->symbols));
+	g_hash_table_iter_init(&it, gr->symbols);
+
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		const auto *item = get_item_by_name((const char *) k, true);
+
+		if (item != nullptr) {
+			ids.push_back(item->id);
+		}
+	}
+
+	return group_items.emplace(gr, std::move(ids)).first->second;
 }
 
 auto symcache::get_max_timeout(std::vector<std::pair<double, const cache_item *>> &elts) const -> double
@@ -84,7 +84,10 @@ namespace rspamd::symcache {
 /* Defined in symcache_impl.cxx */
 extern int rspamd_symcache_log_id;
 
-static const std::uint8_t symcache_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0};
+/* Version 2 is the legacy format: header followed by an UCL object */
+static const std::uint8_t symcache_magic_ucl[8] = {'r', 's', 'c', 2, 0, 0, 0, 0};
+/* Version 3 is the binary profile: header followed by `nitems` records */
+static const std::uint8_t symcache_magic[8] = {'r', 's', 'c', 3, 0, 0, 0, 0};
 
 struct symcache_header {
 	std::uint8_t magic[8];
@@ -93,6 +96,19 @@ struct symcache_header {
 	std::uint8_t unused[128];
 };
 
+/*
+ * Binary profile record, the symbol name of `name_len` bytes follows each record;
+ * all records are padded to 8 bytes boundary
+ */
+struct symcache_profile_record {
+	double avg_time;
+	double avg_frequency;
+	double stddev_frequency;
+	std::uint64_t total_hits;
+	std::uint32_t name_len;
+	std::uint32_t flags; /* reserved */
+};
+
 struct cache_item;
 using cache_item_ptr = std::shared_ptr<cache_item>;
 
@@ -114,6 +130,12 @@ struct order_generation {
 	ankerl::unordered_dense::map<unsigned int, unsigned int> by_cache_id;
 	/* It matches cache->generation_id; if not, a fresh ordering is required */
 	unsigned int generation_id;
+	/*
+	 * Maximum score that can be added or subtracted after filters: by
+	 * postfilters, classifiers and composites (including removal of atoms)
+	 */
+	double late_potential_pos = 0.0;
+	double late_potential_neg = 0.0;
 
 	explicit order_generation(std::size_t nelts, unsigned id)
 		: generation_id(id)
@@ -255,6 +277,28 @@ struct delayed_symbol_elt_hash {
 	}
 };
 
+/*
+ * Precompiled outcome of the settings id checks for all cache items, indexed
+ * by item id, so a task with a static settings id can resolve them in O(1)
+ */
+struct settings_mask {
+	static constexpr const std::uint8_t allow_exec = (1u << 0u);
+	static constexpr const std::uint8_t allow_insert = (1u << 1u);
+
+	std::uint32_t id;
+	std::vector<std::uint8_t> verdicts;
+
+	auto covers(int item_id) const -> bool
+	{
+		return item_id >= 0 && item_id < (int) verdicts.size();
+	}
+
+	auto is_allowed(int item_id, bool exec_only) const -> bool
+	{
+		return verdicts[item_id] & (exec_only ? allow_exec : allow_insert);
+	}
+};
+
 class symcache {
 private:
 	using items_ptr_vec = std::vector<cache_item *>;
@@ -285,6 +329,12 @@ private:
 	std::unique_ptr<delayed_symbol_names> disabled_symbols;
 	std::unique_ptr<delayed_symbol_names> enabled_symbols;
 
+	/* Lazily compiled settings masks indexed by settings id */
+	mutable ankerl::unordered_dense::map<std::uint32_t, std::shared_ptr<const settings_mask>> settings_masks;
+	/* Lazily resolved item ids of the symbols groups */
+	mutable ankerl::unordered_dense::map<const struct rspamd_symbols_group *, std::vector<int>> group_items;
+	mutable std::size_t group_items_nitems = 0;
+
 	rspamd_mempool_t *static_pool;
 	std::uint64_t cksum;
 	double total_weight;
@@ -305,7 +355,13 @@ private:
 private:
 	/* Internal methods */
 	auto load_items() -> bool;
+	auto load_items_binary(const unsigned char *data, std::size_t len, unsigned int nitems,
+						   const std::uint8_t *checksum) -> bool;
+	auto load_items_ucl(const unsigned char *data, std::size_t len) -> bool;
+	auto apply_saved_stat(cache_item *item, double avg_time, double avg_frequency,
+						  double stddev_frequency, std::uint64_t saved_hits) -> void;
 	auto resort() -> void;
+	auto get_score_potential(cache_item *item) const -> double;
 	auto get_item_specific_vector(const cache_item &) -> items_ptr_vec &;
 	/* Helper for g_hash_table_foreach */
 	static auto metric_connect_cb(void *k, void *v, void *ud) -> void;
@@ -491,6 +547,11 @@ public:
 		return stats_symbols_count;
 	}
 
+	auto get_items_count() const
+	{
+		return items_by_id.size();
+	}
+
 	/**
 	 * Returns a checksum for the cache
 	 * @return
@@ -639,6 +700,29 @@ public:
 	 */
 	auto process_settings_elt(struct rspamd_config_settings_elt *elt) -> void;
 
+	/**
+	 * Returns a compiled settings mask for the specific settings element,
+	 * building it on the first use
+	 * @param elt
+	 * @return
+	 */
+	auto get_settings_mask(const struct rspamd_config_settings_elt *elt) const -> std::shared_ptr<const settings_mask>;
+
+	/**
+	 * Drops all compiled settings masks, must be called when settings ids of any item are changed
+	 */
+	auto invalidate_settings_masks() -> void
+	{
+		settings_masks.clear();
+	}
+
+	/**
+	 * Returns ids of the (parent) items for all symbols in a group
+	 * @param gr
+	 * @return
+	 */
+	auto get_group_item_ids(const struct rspamd_symbols_group *gr) const -> const std::vector<int> &;
+
 	/**
 	 * Returns maximum timeout that is requested by all rules
 	 * @return
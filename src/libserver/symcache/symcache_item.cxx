@@ -17,6 +17,7 @@
 #include "lua/lua_common.h"
 #include "symcache_internal.hxx"
 #include "symcache_item.hxx"
+#include "symcache_runtime.hxx"
 #include "fmt/core.h"
 #include "libserver/task.h"
 #include "libutil/cxx/util.hxx"
@@ -35,20 +36,23 @@ struct augmentation_info {
 	int weight = 0;
 	int implied_flags = 0;
 	augmentation_value_type value_type = augmentation_value_type::NO_VALUE;
+	/* Symbol waits for network replies */
+	bool network = false;
 };
 
 /* A list of internal augmentations that are known to Rspamd with their weight */
 static const auto known_augmentations =
 	ankerl::unordered_dense::map<std::string, augmentation_info, rspamd::smart_str_hash, rspamd::smart_str_equal>{
 		{"passthrough", {.weight = 10, .implied_flags = SYMBOL_TYPE_IGNORE_PASSTHROUGH}},
-		{"single_network", {.weight = 1, .implied_flags = 0}},
+		{"single_network", {.weight = 1, .implied_flags = 0, .network = true}},
 		{"no_network", {.weight = 0, .implied_flags = 0}},
-		{"many_network", {.weight = 1, .implied_flags = 0}},
+		{"many_network", {.weight = 1, .implied_flags = 0, .network = true}},
 		{"important", {.weight = 5, .implied_flags = SYMBOL_TYPE_FINE}},
 		{"timeout", {
 						.weight = 0,
 						.implied_flags = 0,
 						.value_type = augmentation_value_type::NUMBER_VALUE,
+						.network = true,
 					}}};
 
 auto cache_item::get_parent(const symcache &cache) const -> const cache_item *
@@ -361,51 +365,24 @@ auto cache_item::is_allowed(struct rspamd_task *task, bool exec_only) const -> b
 
 	/* Settings checks */
 	if (task->settings_elt != nullptr) {
-		if (forbidden_ids.check_id(task->settings_elt->id)) {
-			msg_debug_cache_task("deny %s of %s as it is forbidden for "
-								 "settings id %ud",
-								 what,
-								 symbol.c_str(),
-								 task->settings_elt->id);
-
-			return false;
-		}
-
-		if (!(flags & SYMBOL_TYPE_EXPLICIT_DISABLE)) {
-			if (!allowed_ids.check_id(task->settings_elt->id)) {
-
-				if (task->settings_elt->policy == RSPAMD_SETTINGS_POLICY_IMPLICIT_ALLOW) {
-					msg_debug_cache_task("allow execution of %s settings id %ud "
-										 "allows implicit execution of the symbols;",
-										 symbol.c_str(),
-										 id);
+		auto *runtime = (symcache_runtime *) task->symcache_runtime;
+		const auto *mask = runtime ? runtime->get_settings_mask(task) : nullptr;
+		bool allowed;
 
-					return true;
-				}
-
-				if (exec_only) {
-					/*
-					 * Special case if any of our virtual children are enabled
-					 */
-					if (exec_only_ids.check_id(task->settings_elt->id)) {
-						return true;
-					}
-				}
-
-				msg_debug_cache_task("deny %s of %s as it is not listed "
-									 "as allowed for settings id %ud",
-									 what,
-									 symbol.c_str(),
-									 task->settings_elt->id);
-				return false;
-			}
+		if (mask && mask->covers(id)) {
+			allowed = mask->is_allowed(id, exec_only);
 		}
 		else {
-			msg_debug_cache_task("allow %s of %s for "
-								 "settings id %ud as it can be only disabled explicitly",
+			allowed = is_allowed_by_settings(task->settings_elt, exec_only);
+		}
+
+		if (!allowed) {
+			msg_debug_cache_task("deny %s of %s for settings id %ud",
 								 what,
 								 symbol.c_str(),
 								 task->settings_elt->id);
+
+			return false;
 		}
 	}
 	else if (flags & SYMBOL_TYPE_EXPLICIT_ENABLE) {
@@ -419,6 +396,25 @@ auto cache_item::is_allowed(struct rspamd_task *task, bool exec_only) const -> b
 	return true;
 }
 
+auto cache_item::is_allowed_by_settings(const struct rspamd_config_settings_elt *elt, bool exec_only) const -> bool
+{
+	if (forbidden_ids.check_id(elt->id)) {
+		return false;
+	}
+
+	/* Symbols that can be only disabled explicitly are allowed otherwise */
+	if (!(flags & SYMBOL_TYPE_EXPLICIT_DISABLE) && !allowed_ids.check_id(elt->id)) {
+		if (elt->policy == RSPAMD_SETTINGS_POLICY_IMPLICIT_ALLOW) {
+			return true;
+		}
+
+		/* Special case if any of our virtual children are enabled */
+		return exec_only && exec_only_ids.check_id(elt->id);
+	}
+
+	return true;
+}
+
 auto cache_item::add_augmentation(const symcache &cache, std::string_view augmentation,
 								  std::optional<std::string_view> value) -> bool
 {
@@ -443,6 +439,10 @@ auto cache_item::add_augmentation(const symcache &cache, std::string_view augmen
 			}
 		}
 
+		if (known_info.network) {
+			internal_flags |= cache_item::bit_network;
+		}
+
 		if (known_info.value_type == augmentation_value_type::NO_VALUE) {
 			if (value.has_value()) {
 				msg_err_cache("value specified for augmentation %s, that has no value",
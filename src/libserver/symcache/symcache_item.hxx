@@ -225,6 +225,8 @@ struct cache_item : std::enable_shared_from_this<cache_item> {
 	static constexpr const auto bit_enabled = 0b0001;
 	static constexpr const auto bit_sync = 0b0010;
 	static constexpr const auto bit_slow = 0b0100;
+	static constexpr const auto bit_network = 0b1000;
+	static constexpr const auto bit_dynamic_score = 0b10000;
 	int internal_flags = bit_enabled | bit_sync;
 
 	/* Priority */
@@ -232,6 +234,11 @@ struct cache_item : std::enable_shared_from_this<cache_item> {
 	/* Topological order */
 	unsigned int order = 0;
 	int frequency_peaks = 0;
+	/* Index of execution time histogram or -1 */
+	int hist_id = -1;
+	/* Maximum positive and negative score this item (with its virtual children) can add */
+	double score_potential_pos = 0.0;
+	double score_potential_neg = 0.0;
 
 	/* Specific data for virtual and callback symbols */
 	std::variant<normal_item, virtual_item> specific;
@@ -320,6 +327,27 @@ public:
 		return std::holds_alternative<virtual_item>(specific);
 	}
 
+	/**
+	 * Returns true if an item is known to wait for network: either it has
+	 * a network augmentation or it has registered async events before
+	 * @return
+	 */
+	auto is_network() const -> bool
+	{
+		return (internal_flags & bit_network) || !(internal_flags & bit_sync);
+	}
+
+	/**
+	 * Returns true if the score of an item cannot be bound by its static weight:
+	 * it has no limit on shots, zero static weight or it has been seen to
+	 * insert results with multipliers greater than one
+	 * @return
+	 */
+	auto has_dynamic_score() const -> bool
+	{
+		return internal_flags & bit_dynamic_score;
+	}
+
 	auto is_filter() const -> bool
 	{
 		return std::holds_alternative<normal_item>(specific) &&
@@ -396,6 +424,14 @@ public:
 	 */
 	auto is_allowed(struct rspamd_task *task, bool exec_only) const -> bool;
 
+	/**
+	 * Check if an item is allowed by a specific settings element only
+	 * @param elt
+	 * @param exec_only
+	 * @return
+	 */
+	auto is_allowed_by_settings(const struct rspamd_config_settings_elt *elt, bool exec_only) const -> bool;
+
 	/**
 	 * Returns callback data
 	 * @return
@@ -75,6 +75,11 @@ public:
 			auto cur_time = rspamd_get_ticks(FALSE);
 			cbdata->cache->periodic_resort(cbdata->event_loop, cur_time, cbdata->last_resort);
 			cbdata->last_resort = cur_time;
+			/*
+			 * Persist the learned profile, so restarted or newly spawned
+			 * processes start with the informed order
+			 */
+			cbdata->cache->save_items();
 		}
 	}
 
@@ -22,7 +22,10 @@
 #include "libmime/scan_result.h"
 #include "utlist.h"
 #include "libserver/worker_util.h"
+#include "libserver/tracing.h"
+#include "libserver/logger.hxx"
 #include <limits>
+#include <algorithm>
 #include <cmath>
 
 namespace rspamd::symcache {
@@ -34,6 +37,28 @@ constexpr static const auto PROFILE_MESSAGE_SIZE_THRESHOLD = 1024ul * 1024 * 2;
 /* Enable profile at least once per this amount of messages processed */
 constexpr static const auto PROFILE_PROBABILITY = 0.01;
 
+/*
+ * Settings override scores of symbols either in the `scores` object or,
+ * in the legacy form, as numeric top level elements
+ */
+static auto settings_override_scores(const ucl_object_t *settings) -> bool
+{
+	if (ucl_object_lookup(settings, "scores") != nullptr) {
+		return true;
+	}
+
+	ucl_object_iter_t it = nullptr;
+	const ucl_object_t *cur;
+
+	while ((cur = ucl_iterate_object(settings, &it, true)) != nullptr) {
+		if (ucl_object_type(cur) == UCL_INT || ucl_object_type(cur) == UCL_FLOAT) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 auto symcache_runtime::create(struct rspamd_task *task, symcache &cache) -> symcache_runtime *
 {
 	cache.maybe_resort();
@@ -54,11 +79,13 @@ auto symcache_runtime::create(struct rspamd_task *task, symcache &cache) -> symc
 
 	/*
 	 * We enable profiling if the following conditions are met:
+	 * - profiling is requested for the task
 	 * - we have not profiled for a long time
 	 * - message is large
 	 * - random probability
 	 */
-	if ((cache.get_last_profile() == 0.0 || now > cache.get_last_profile() + PROFILE_MAX_TIME) ||
+	if (RSPAMD_TASK_IS_PROFILING(task) ||
+		(cache.get_last_profile() == 0.0 || now > cache.get_last_profile() + PROFILE_MAX_TIME) ||
 		(task->msg.len >= PROFILE_MESSAGE_SIZE_THRESHOLD) ||
 		(rspamd_random_double_fast() >= (1 - PROFILE_PROBABILITY))) {
 		msg_debug_cache_task("enable profiling of symbols for task");
@@ -81,12 +108,14 @@ auto symcache_runtime::process_settings(struct rspamd_task *task, const symcache
 	const auto *wl = ucl_object_lookup(task->settings, "whitelist");
 
 	if (wl != nullptr) {
-		msg_info_task("task is whitelisted");
+		msg_info_task_fmt("task is whitelisted");
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		return true;
 	}
 
 	auto already_disabled = false;
+	/* Settings can enable already finished filters */
+	pending_filters = nullptr;
 
 	auto process_group = [&](const ucl_object_t *gr_obj, auto functor) -> void {
 		ucl_object_iter_t it = nullptr;
@@ -100,12 +129,8 @@ auto symcache_runtime::process_settings(struct rspamd_task *task, const symcache
 											ucl_object_tostring(cur));
 
 					if (gr) {
-						GHashTableIter gr_it;
-						void *k, *v;
-						g_hash_table_iter_init(&gr_it, gr->symbols);
-
-						while (g_hash_table_iter_next(&gr_it, &k, &v)) {
-							functor((const char *) k);
+						for (auto id: cache.get_group_item_ids(gr)) {
+							functor(id);
 						}
 					}
 				}
@@ -135,8 +160,12 @@ auto symcache_runtime::process_settings(struct rspamd_task *task, const symcache
 	if (enabled && !already_disabled) {
 		disable_all_symbols(SYMBOL_TYPE_EXPLICIT_DISABLE);
 	}
-	process_group(enabled, [&](const char *sym) {
-		enable_symbol(task, cache, sym);
+	process_group(enabled, [&](int id) {
+		auto *dyn_item = get_dynamic_item(id);
+
+		if (dyn_item) {
+			dyn_item->status = cache_item_status::not_started;
+		}
 	});
 
 	const auto *disabled = ucl_object_lookup(task->settings, "symbols_disabled");
@@ -151,8 +180,12 @@ auto symcache_runtime::process_settings(struct rspamd_task *task, const symcache
 
 	/* Disable groups of symbols */
 	disabled = ucl_object_lookup(task->settings, "groups_disabled");
-	process_group(disabled, [&](const char *sym) {
-		disable_symbol(task, cache, sym);
+	process_group(disabled, [&](int id) {
+		auto *dyn_item = get_dynamic_item(id);
+
+		if (dyn_item) {
+			dyn_item->status = cache_item_status::finished;
+		}
 	});
 
 	/* Update required limit */
@@ -166,6 +199,21 @@ auto symcache_runtime::savepoint_dtor(struct rspamd_task *task) -> void
 	msg_debug_cache_task("destroying savepoint");
 	/* Drop shared ownership */
 	order.reset();
+	settings.reset();
+}
+
+auto symcache_runtime::get_settings_mask(struct rspamd_task *task) -> const settings_mask *
+{
+	if (task->settings_elt == nullptr) {
+		return nullptr;
+	}
+
+	if (!settings || settings->id != task->settings_elt->id) {
+		auto *cache = (symcache *) task->cfg->cache;
+		settings = cache->get_settings_mask(task->settings_elt);
+	}
+
+	return settings.get();
 }
 
 auto symcache_runtime::disable_all_symbols(int skip_mask) -> void
@@ -214,6 +262,8 @@ auto symcache_runtime::enable_symbol(struct rspamd_task *task, const symcache &c
 
 		if (dyn_item) {
 			dyn_item->status = cache_item_status::not_started;
+			/* Finished filters might be dropped from the pending list */
+			pending_filters = nullptr;
 			msg_debug_cache_task("enable execution of %s", name.data());
 
 			return true;
@@ -322,9 +372,13 @@ auto symcache_runtime::process_pre_postfilters(struct rspamd_task *task,
 											   unsigned int stage) -> bool
 {
 	auto saved_priority = std::numeric_limits<int>::min();
+	auto deferred_priority = std::numeric_limits<int>::min();
 	auto all_done = true;
 	auto log_func = RSPAMD_LOG_FUNC;
 	auto compare_functor = +[](int a, int b) { return a < b; };
+	/* Body is still being received, so only prefilters that need headers can run */
+	auto headers_only = stage == RSPAMD_TASK_STAGE_PRE_FILTERS &&
+						(task->flags & RSPAMD_TASK_FLAG_BODY_PENDING);
 
 	auto proc_func = [&](cache_item *item) {
 		/*
@@ -347,6 +401,23 @@ auto symcache_runtime::process_pre_postfilters(struct rspamd_task *task,
 				return false;
 			}
 
+			if (headers_only) {
+				if (deferred_priority != std::numeric_limits<int>::min() &&
+					compare_functor(item->priority, deferred_priority)) {
+					/* Keep the order: nothing below the deferred priority runs early */
+					return false;
+				}
+
+				if (!(item->flags & SYMBOL_TYPE_HEADERS_ONLY)) {
+					msg_debug_cache_task_lambda("delay %s till the message body is received",
+												item->symbol.c_str());
+					deferred_priority = item->priority;
+					all_done = false;
+
+					return true;
+				}
+			}
+
 			if (saved_priority == std::numeric_limits<int>::min()) {
 				saved_priority = item->priority;
 			}
@@ -373,7 +444,7 @@ auto symcache_runtime::process_pre_postfilters(struct rspamd_task *task,
 		all_done = cache.connfilters_foreach(proc_func);
 		break;
 	case RSPAMD_TASK_STAGE_PRE_FILTERS:
-		all_done = cache.prefilters_foreach(proc_func);
+		all_done = cache.prefilters_foreach(proc_func) && all_done;
 		break;
 	case RSPAMD_TASK_STAGE_POST_FILTERS:
 		compare_functor = +[](int a, int b) { return a > b; };
@@ -396,17 +467,41 @@ auto symcache_runtime::process_filters(struct rspamd_task *task, symcache &cache
 	auto all_done = true;
 	auto log_func = RSPAMD_LOG_FUNC;
 	auto has_passtrough = false;
+	/* How many filters are started before we recheck if the action is decided */
+	constexpr const auto decision_batch = 16u;
+	auto cost_scheduling = task->cfg->cache_cost_scheduling;
+	auto started_in_batch = 0u;
+	auto action_decided = cost_scheduling && check_action_decided(task);
+
+	if (pending_filters == nullptr) {
+		build_pending_filters(task);
+	}
 
-	for (const auto [idx, item]: rspamd::enumerate(order->d)) {
-		/* Exclude all non filters */
-		if (item->type != symcache_item_type::FILTER) {
-			/*
-			 * We use breaking the loop as we append non-filters to the end of the list
-			 * so, it is safe to stop processing immediately
-			 */
-			break;
+	if (task->cfg->cache_network_concurrency > 0 && !action_decided && !check_metric_limit(task)) {
+		start_network_filters(task, cache);
+
+		if (slow_status == slow_status::enabled) {
+			return false;
+		}
+	}
+
+	/*
+	 * Walk merely over filters that are not finished yet and drop finished
+	 * ones from the list as we go, so the subsequent passes are cheaper
+	 */
+	auto nkept = 0u;
+
+	for (auto i = 0u; i < npending_filters; i++) {
+		auto idx = pending_filters[i];
+		const auto &item = order->d[idx];
+		auto *dyn_item = &dynamic_items[idx];
+
+		if (dyn_item->status == cache_item_status::finished) {
+			continue;
 		}
 
+		pending_filters[nkept++] = idx;
+
 		if (!(item->flags & (SYMBOL_TYPE_FINE | SYMBOL_TYPE_IGNORE_PASSTHROUGH))) {
 			if (has_passtrough || check_metric_limit(task)) {
 				msg_debug_cache_task_lambda("task has already the result being set, ignore further checks");
@@ -414,9 +509,13 @@ auto symcache_runtime::process_filters(struct rspamd_task *task, symcache &cache
 				/* Skip this item */
 				continue;
 			}
-		}
 
-		auto dyn_item = &dynamic_items[idx];
+			if (action_decided) {
+				msg_debug_cache_task_lambda("action cannot be changed by the remaining filters, skip %s",
+											item->symbol.c_str());
+				continue;
+			}
+		}
 
 		if (dyn_item->status == cache_item_status::not_started) {
 			all_done = false;
@@ -433,14 +532,111 @@ auto symcache_runtime::process_filters(struct rspamd_task *task, symcache &cache
 			process_symbol(task, cache, item.get(), dyn_item);
 
 			if (slow_status == slow_status::enabled) {
+				/* Keep the rest of the list intact */
+				for (auto j = i + 1; j < npending_filters; j++) {
+					pending_filters[nkept++] = pending_filters[j];
+				}
+
+				npending_filters = nkept;
+
 				return false;
 			}
+
+			if (cost_scheduling && ++started_in_batch >= decision_batch) {
+				started_in_batch = 0;
+				action_decided = check_action_decided(task);
+			}
 		}
 	}
 
+	npending_filters = nkept;
+
 	return all_done;
 }
 
+auto symcache_runtime::build_pending_filters(struct rspamd_task *task) -> void
+{
+	const auto *mask = get_settings_mask(task);
+
+	pending_filters = rspamd_mempool_alloc_array_type(task->task_pool,
+													  std::max(order->d.size(), std::size_t{1}),
+													  std::uint32_t);
+	npending_filters = 0;
+
+	for (const auto [idx, item]: rspamd::enumerate(order->d)) {
+		/*
+		 * We use breaking the loop as we append non-filters to the end of the list
+		 * so, it is safe to stop processing immediately
+		 */
+		if (item->type != symcache_item_type::FILTER) {
+			break;
+		}
+
+		auto *dyn_item = &dynamic_items[idx];
+
+		if (dyn_item->status == cache_item_status::finished) {
+			continue;
+		}
+
+		if (mask && mask->covers(item->id) && !mask->is_allowed(item->id, true) &&
+			dyn_item->status == cache_item_status::not_started) {
+			/* The same as `process_symbol` would do once it is reached */
+			msg_debug_cache_task("do not check %s, %d", item->symbol.data(),
+								 item->id);
+			dyn_item->status = cache_item_status::finished;
+			continue;
+		}
+
+		pending_filters[npending_filters++] = idx;
+	}
+}
+
+auto symcache_runtime::start_network_filters(struct rspamd_task *task, symcache &cache) -> void
+{
+	auto max_inflight = task->cfg->cache_network_concurrency;
+	auto inflight = 0u;
+
+	/* Network filters that are still waiting for replies */
+	for (auto i = 0u; i < npending_filters; i++) {
+		auto idx = pending_filters[i];
+		auto status = dynamic_items[idx].status;
+
+		if ((status == cache_item_status::started || status == cache_item_status::pending) &&
+			order->d[idx]->is_network()) {
+			inflight++;
+		}
+	}
+
+	/*
+	 * Start network filters with no unresolved dependencies regardless of their
+	 * position, so their network waits overlap instead of forming chains
+	 * interleaved with CPU bound filters
+	 */
+	for (auto i = 0u; i < npending_filters && inflight < max_inflight; i++) {
+		auto idx = pending_filters[i];
+		const auto &item = order->d[idx];
+		auto *dyn_item = &dynamic_items[idx];
+
+		if (dyn_item->status != cache_item_status::not_started || !item->is_network()) {
+			continue;
+		}
+
+		if (!check_item_deps(task, cache, item.get(), dyn_item, true)) {
+			continue;
+		}
+
+		msg_debug_cache_task("start network filter %s(%d) early", item->symbol.c_str(), item->id);
+
+		if (!process_symbol(task, cache, item.get(), dyn_item)) {
+			inflight++;
+		}
+
+		if (slow_status == slow_status::enabled) {
+			return;
+		}
+	}
+}
+
 auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache, cache_item *item,
 									  cache_dynamic_item *dyn_item) -> bool
 {
@@ -488,10 +684,21 @@ auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache,
 		dyn_item->async_events = 0;
 		cur_item = dyn_item;
 		items_inflight++;
+
+		if (G_UNLIKELY(task->trace)) {
+			rspamd_tracing_span_begin(task->trace, RSPAMD_TRACE_SPAN_SYMBOL,
+									  item->symbol.c_str(), dyn_item);
+		}
 		/* Callback now must finalize itself */
 
 
-		if (item->call(task, dyn_item)) {
+		auto called = item->call(task, dyn_item);
+
+		if (G_UNLIKELY(task->trace)) {
+			rspamd_tracing_symbol_leave(task->trace);
+		}
+
+		if (called) {
 			cur_item = nullptr;
 
 			if (items_inflight == 0) {
@@ -519,6 +726,11 @@ auto symcache_runtime::process_symbol(struct rspamd_task *task, symcache &cache,
 			msg_debug_cache_task("cannot call %s, %d; symbol type = %s", item->symbol.data(),
 								 item->id, item_type_to_str(item->type));
 			dyn_item->status = cache_item_status::finished;
+
+			if (G_UNLIKELY(task->trace)) {
+				rspamd_tracing_span_end(task->trace, dyn_item);
+			}
+
 			return true;
 		}
 	}
@@ -570,6 +782,95 @@ auto symcache_runtime::check_metric_limit(struct rspamd_task *task) -> bool
 	return false;
 }
 
+auto symcache_runtime::check_action_decided(struct rspamd_task *task) -> bool
+{
+	if (task->flags & RSPAMD_TASK_FLAG_PASS_ALL) {
+		return false;
+	}
+
+	if (task->settings && settings_override_scores(task->settings)) {
+		/* Any symbol can have an arbitrary score */
+		return false;
+	}
+
+	auto *res = task->result;
+	auto remain_pos = order->late_potential_pos, remain_neg = order->late_potential_neg;
+
+	/* Sum what is still possible to get from the filters that are not yet finished */
+	for (const auto [idx, item]: rspamd::enumerate(order->d)) {
+		if (item->type == symcache_item_type::FILTER) {
+			if (dynamic_items[idx].status == cache_item_status::finished) {
+				continue;
+			}
+
+			remain_pos += item->score_potential_pos;
+			remain_neg += item->score_potential_neg;
+		}
+		else if (item->type != symcache_item_type::POSTFILTER &&
+				 item->type != symcache_item_type::CLASSIFIER &&
+				 item->type != symcache_item_type::COMPOSITE) {
+			continue;
+		}
+
+		if (item->has_dynamic_score()) {
+			return false;
+		}
+	}
+
+	auto lower = -std::numeric_limits<double>::infinity(),
+		 upper = std::numeric_limits<double>::infinity();
+
+	for (auto i = 0u; i < res->nactions; i++) {
+		const auto *act_config = &res->actions_config[i];
+
+		if (std::isnan(act_config->cur_limit) ||
+			(act_config->flags & (RSPAMD_ACTION_RESULT_DISABLED | RSPAMD_ACTION_RESULT_NO_THRESHOLD))) {
+			continue;
+		}
+
+		if (act_config->cur_limit <= res->score) {
+			lower = std::max(lower, act_config->cur_limit);
+		}
+		else {
+			upper = std::min(upper, act_config->cur_limit);
+		}
+	}
+
+	if (std::isinf(lower) && std::isinf(upper)) {
+		/* No thresholds at all, nothing to decide */
+		return false;
+	}
+
+	if (task->cfg->grow_factor > 1.0) {
+		/*
+		 * Grow factor multiplies all positive scores by
+		 * prod(1 + (grow_factor - 1) * score / max_limit), which is bound by
+		 * exp((grow_factor - 1) * positive_sum / max_limit)
+		 */
+		auto max_limit = G_MINDOUBLE, positive_sum = remain_pos;
+		const char *kk;
+		struct rspamd_symbol_result *sres;
+
+		for (auto i = 0u; i < res->nactions; i++) {
+			if (res->actions_config[i].cur_limit > max_limit) {
+				max_limit = res->actions_config[i].cur_limit;
+			}
+		}
+
+		kh_foreach(res->symbols, kk, sres, {
+			if (sres->score > 0) {
+				positive_sum += sres->score;
+			}
+		});
+
+		remain_pos += positive_sum *
+					  (std::exp((task->cfg->grow_factor - 1.0) * positive_sum / max_limit) - 1.0);
+	}
+
+	/* Action is decided if no threshold can be crossed in any direction */
+	return res->score + remain_pos < upper && res->score - remain_neg >= lower;
+}
+
 auto symcache_runtime::check_item_deps(struct rspamd_task *task, symcache &cache, cache_item *item,
 									   cache_dynamic_item *dyn_item, bool check_only) -> bool
 {
@@ -737,6 +1038,10 @@ auto symcache_runtime::finalize_item(struct rspamd_task *task, cache_dynamic_ite
 	items_inflight--;
 	cur_item = nullptr;
 
+	if (G_UNLIKELY(task->trace)) {
+		rspamd_tracing_span_end(task->trace, dyn_item);
+	}
+
 	auto enable_slow_timer = [&]() -> bool {
 		auto *cbd = rspamd_mempool_alloc0_type(task->task_pool, rspamd_symcache_delayed_cbdata);
 		/* Add timer to allow something else to be executed */
@@ -772,11 +1077,15 @@ auto symcache_runtime::finalize_item(struct rspamd_task *task, cache_dynamic_ite
 	};
 
 	/* Check if we need to profile symbol (always profile when we have seen this item to be slow */
-	if (profile || item->flags & cache_item::bit_slow) {
+	if (profile || item->flags & cache_item::bit_slow || item->hist_id >= 0) {
 		ev_now_update_if_cheap(task->event_loop);
 		auto diff = ((ev_now(task->event_loop) - profile_start) * 1e3 -
 					 dyn_item->start_msec);
 
+		if (item->hist_id >= 0) {
+			rspamd_worker_stat_hist_time(item->hist_id, diff / 1e3);
+		}
+
 		if (G_UNLIKELY(RSPAMD_TASK_IS_PROFILING(task))) {
 			rspamd_task_profile_set(task, item->symbol.c_str(), diff);
 		}
@@ -818,23 +1127,23 @@ auto symcache_runtime::finalize_item(struct rspamd_task *task, cache_dynamic_ite
 				if (need_slow && slow_status != slow_status::enabled) {
 					slow_status = slow_status::enabled;
 
-					msg_info_task("slow synchronous rule: %s(%d): %.2f ms; enable 100ms idle timer to allow other rules to be finished",
-								  item->symbol.c_str(), item->id,
-								  diff);
+					msg_info_task_fmt("slow synchronous rule: {}({}): {:.2f} ms; enable 100ms idle timer to allow other rules to be finished",
+									  item->symbol, item->id,
+									  diff);
 					if (enable_slow_timer()) {
 						return;
 					}
 				}
 				else {
-					msg_info_task("slow synchronous rule: %s(%d): %.2f ms; idle timer has already been activated for this scan",
-								  item->symbol.c_str(), item->id,
-								  diff);
+					msg_info_task_fmt("slow synchronous rule: {}({}): {:.2f} ms; idle timer has already been activated for this scan",
+									  item->symbol, item->id,
+									  diff);
 				}
 			}
 			else {
-				msg_notice_task("slow asynchronous rule: %s(%d): %.2f ms; no idle timer is needed",
-								item->symbol.c_str(), item->id,
-								diff);
+				msg_notice_task_fmt("slow asynchronous rule: {}({}): {:.2f} ms; no idle timer is needed",
+									item->symbol, item->id,
+									diff);
 			}
 		}
 		else {
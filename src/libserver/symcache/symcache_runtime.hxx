@@ -67,6 +67,11 @@ class symcache_runtime {
 
 	struct cache_dynamic_item *cur_item;
 	order_generation_ptr order;
+	/* Compiled mask for the settings id of the task */
+	std::shared_ptr<const settings_mask> settings;
+	/* Positions of filters that are not finished yet, built on the first filters pass */
+	std::uint32_t *pending_filters;
+	std::uint32_t npending_filters;
 	/* Dynamically expanded as needed */
 	mutable struct cache_dynamic_item dynamic_items[];
 	/* We allocate this structure merely in memory pool, so destructor is absent */
@@ -77,7 +82,10 @@ class symcache_runtime {
 	/* Specific stages of the processing */
 	auto process_pre_postfilters(struct rspamd_task *task, symcache &cache, int start_events, unsigned int stage) -> bool;
 	auto process_filters(struct rspamd_task *task, symcache &cache, int start_events) -> bool;
+	auto build_pending_filters(struct rspamd_task *task) -> void;
+	auto start_network_filters(struct rspamd_task *task, symcache &cache) -> void;
 	auto check_metric_limit(struct rspamd_task *task) -> bool;
+	auto check_action_decided(struct rspamd_task *task) -> bool;
 	auto check_item_deps(struct rspamd_task *task, symcache &cache, cache_item *item,
 						 cache_dynamic_item *dyn_item, bool check_only) -> bool;
 
@@ -98,6 +106,13 @@ public:
 	 */
 	auto process_settings(struct rspamd_task *task, const symcache &cache) -> bool;
 
+	/**
+	 * Returns a compiled mask for the current settings id of the task
+	 * @param task
+	 * @return nullptr if a task has no settings id
+	 */
+	auto get_settings_mask(struct rspamd_task *task) -> const settings_mask *;
+
 	/**
 	 * Disable all symbols but not touching ones that are in the specific mask
 	 * @param skip_mask
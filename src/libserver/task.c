@@ -30,6 +30,12 @@
 #include "libmime/lang_detection.h"
 #include "libmime/scan_result_private.h"
 #include "lua/lua_classnames.h"
+#include "libutil/cxx/cpu_pool.h"
+#include "libserver/tracing.h"
+#include "libserver/dkim.h"
+#include "libserver/spf.h"
+#include "libserver/task_binlog.h"
+#include "libserver/worker_util.h"
 
 #ifdef WITH_JEMALLOC
 #include <jemalloc/jemalloc.h>
@@ -103,6 +109,12 @@ rspamd_task_new(struct rspamd_worker *worker,
 		if (new_task->lang_det == NULL && cfg->lang_det != NULL) {
 			new_task->lang_det = cfg->lang_det;
 		}
+
+		new_task->lua_mem_start = rspamd_lua_gc_task_start(cfg);
+	}
+
+	if (worker && worker->memory_pressure) {
+		new_task->flags |= RSPAMD_TASK_FLAG_MEMORY_PRESSURE;
 	}
 
 	new_task->event_loop = event_loop;
@@ -118,6 +130,7 @@ rspamd_task_new(struct rspamd_worker *worker,
 	new_task->queue_id = "undef";
 	new_task->messages = ucl_object_typed_new(UCL_OBJECT);
 	kh_static_init(rspamd_task_lua_cache, &new_task->lua_cache);
+	new_task->trace = rspamd_tracing_sample(new_task);
 
 	return new_task;
 }
@@ -177,8 +190,19 @@ void rspamd_task_free(struct rspamd_task *task)
 	unsigned int i;
 
 	if (task) {
+		if (task->holds > 0) {
+			/* Memory is used by a job, the last release frees the task */
+			task->free_pending = TRUE;
+
+			return;
+		}
+
 		debug_task("free pointer %p", task);
 
+		if (task->trace) {
+			rspamd_tracing_finish(task);
+		}
+
 		if (task->rcpt_envelope) {
 			for (i = 0; i < task->rcpt_envelope->len; i++) {
 				addr = g_ptr_array_index(task->rcpt_envelope, i);
@@ -282,6 +306,9 @@ void rspamd_task_free(struct rspamd_task *task)
 				free_iters = rspamd_time_jitter(0,
 												(double) task->cfg->full_gc_iters / 2);
 			}
+			else {
+				rspamd_lua_gc_task_finish(task->cfg, task->lua_mem_start);
+			}
 
 			REF_RELEASE(task->cfg);
 		}
@@ -363,11 +390,28 @@ rspamd_task_load_message(struct rspamd_task *task,
 		else {
 			fp = &filepath[0];
 		}
+		fd = -1;
+
+		if (task->http_conn &&
+			rspamd_task_get_request_header(task, "shm-fd") != NULL) {
+			/* Segment has been passed via unix socket, no need to open it */
+			fd = rspamd_http_connection_steal_received_fd(task->http_conn);
+
+			if (fd == -1) {
+				msg_info_task("no descriptor has been passed for shm "
+							  "segment %s, open it by name",
+							  fp);
+			}
+		}
+
+		if (fd == -1) {
 #ifdef HAVE_SANE_SHMEM
-		fd = shm_open(fp, O_RDONLY, 00600);
+			fd = shm_open(fp, O_RDONLY, 00600);
 #else
-		fd = open(fp, O_RDONLY, 00600);
+			fd = open(fp, O_RDONLY, 00600);
 #endif
+		}
+
 		if (fd == -1) {
 			g_set_error(&task->err, rspamd_task_quark(), RSPAMD_PROTOCOL_ERROR,
 						"Cannot open %s segment (%s): %s", ft, fp, strerror(errno));
@@ -695,11 +739,150 @@ rspamd_task_select_processing_stage(struct rspamd_task *task, unsigned int stage
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+#define RSPAMD_TASK_PREFETCH_MAX_SIGS 5
+
+/*
+ * Extracts a value of DKIM signature tag, e.g. `d=`, returns NULL if it is missing
+ */
+static char *
+rspamd_task_dkim_tag(struct rspamd_task *task, const char *sig, char tag)
+{
+	const char *p = sig, *end, *vbegin, *vend;
+
+	while (*p) {
+		while (*p && g_ascii_isspace(*p)) {
+			p++;
+		}
+
+		end = strchr(p, ';');
+
+		if (end == NULL) {
+			end = p + strlen(p);
+		}
+
+		if (*p == tag) {
+			vbegin = p + 1;
+
+			while (vbegin < end && g_ascii_isspace(*vbegin)) {
+				vbegin++;
+			}
+
+			if (vbegin < end && *vbegin == '=') {
+				vbegin++;
+
+				while (vbegin < end && g_ascii_isspace(*vbegin)) {
+					vbegin++;
+				}
+
+				vend = end;
+
+				while (vend > vbegin && g_ascii_isspace(*(vend - 1))) {
+					vend--;
+				}
+
+				if (vend > vbegin) {
+					return rspamd_mempool_strdup_len(task->task_pool, vbegin,
+													 vend - vbegin);
+				}
+
+				return NULL;
+			}
+		}
+
+		if (*end == '\0') {
+			break;
+		}
+
+		p = end + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts DNS requests that are likely needed by DKIM, SPF, DMARC and MX
+ * checks as soon as the message headers are known, so these requests run
+ * while the message is processed
+ */
+static void
+rspamd_task_dns_prefetch(struct rspamd_task *task)
+{
+	struct rspamd_mime_header *rh, *rh_cur;
+	struct rspamd_email_address *addr;
+	const char *spf_domain;
+	char *selector, *domain, name[256];
+	unsigned int nsigs = 0;
+
+	rh = rspamd_message_get_header_array_by_id(task, RSPAMD_MIME_HEADER_DKIM_SIGNATURE, FALSE);
+
+	DL_FOREACH(rh, rh_cur)
+	{
+		if (rspamd_mime_header_get_decoded(rh_cur) == NULL || nsigs >= RSPAMD_TASK_PREFETCH_MAX_SIGS) {
+			continue;
+		}
+
+		selector = rspamd_task_dkim_tag(task, rh_cur->decoded, 's');
+		domain = rspamd_task_dkim_tag(task, rh_cur->decoded, 'd');
+
+		if (selector && domain &&
+			(gsize) rspamd_snprintf(name, sizeof(name), "%s._domainkey.%s",
+									selector, domain) < sizeof(name) - 1) {
+			rspamd_dns_resolver_prefetch_task(task, RDNS_REQUEST_TXT, name);
+			nsigs++;
+		}
+	}
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_NO_IP)) {
+		spf_domain = rspamd_spf_get_domain(task);
+
+		if (spf_domain) {
+			rspamd_dns_resolver_prefetch_task(task, RDNS_REQUEST_TXT, spf_domain);
+		}
+	}
+
+	if (MESSAGE_FIELD(task, from_mime) && MESSAGE_FIELD(task, from_mime)->len > 0) {
+		addr = g_ptr_array_index(MESSAGE_FIELD(task, from_mime), 0);
+
+		if (addr->domain_len > 0 &&
+			addr->domain_len < sizeof(name) - sizeof("_dmarc.")) {
+			rspamd_snprintf(name, sizeof(name), "_dmarc.%*s",
+							(int) addr->domain_len, addr->domain);
+			rspamd_dns_resolver_prefetch_task(task, RDNS_REQUEST_TXT, name);
+		}
+	}
+
+	addr = task->from_envelope;
+
+	if (addr && addr->domain_len > 0 && addr->domain_len < sizeof(name)) {
+		rspamd_strlcpy(name, addr->domain, addr->domain_len + 1);
+		rspamd_dns_resolver_prefetch_task(task, RDNS_REQUEST_MX, name);
+	}
+}
+
+/* Disables symbols that the worker is configured to shed under memory pressure */
+static void
+rspamd_task_shed_symbols(struct rspamd_task *task)
+{
+	GList *cur;
+
+	if (task->worker == NULL || task->worker->cf == NULL) {
+		return;
+	}
+
+	for (cur = task->worker->cf->memory_pressure_disable; cur != NULL; cur = g_list_next(cur)) {
+		const char *symbol = (const char *) cur->data;
+
+		if (rspamd_symcache_disable_symbol(task, task->cfg->cache, symbol)) {
+			msg_debug_task("disabled %s due to memory pressure", symbol);
+		}
+	}
+}
+
 gboolean
 rspamd_task_process(struct rspamd_task *task, unsigned int stages)
 {
 	unsigned int st;
-	gboolean ret = TRUE, all_done = TRUE;
+	gboolean ret = TRUE, all_done = TRUE, stage_entered = FALSE;
 	GError *stat_error = NULL;
 
 	/* Avoid nested calls */
@@ -715,6 +898,32 @@ rspamd_task_process(struct rspamd_task *task, unsigned int stages)
 
 	st = rspamd_task_select_processing_stage(task, stages);
 
+	if ((task->flags & RSPAMD_TASK_FLAG_BODY_PENDING) &&
+		st >= RSPAMD_TASK_STAGE_READ_MESSAGE) {
+		/* Message is still being received, processing is resumed when it is complete */
+		msg_debug_task("suspend processing before stage %s: message body is pending",
+					   rspamd_task_stage_name(st));
+		task->flags &= ~RSPAMD_TASK_FLAG_PROCESSING;
+
+		return TRUE;
+	}
+
+	if (G_UNLIKELY(task->trace)) {
+		rspamd_tracing_stage(task->trace, rspamd_task_stage_name(st));
+	}
+
+	if (task->timed_stage != st) {
+		/* A stage can be entered several times if it has pending events */
+		task->timed_stage = st;
+		task->stage_start = ev_time();
+		stage_entered = TRUE;
+
+		if (st == RSPAMD_TASK_STAGE_PRE_FILTERS &&
+			(task->flags & RSPAMD_TASK_FLAG_MEMORY_PRESSURE)) {
+			rspamd_task_shed_symbols(task);
+		}
+	}
+
 	switch (st) {
 	case RSPAMD_TASK_STAGE_CONNFILTERS:
 		all_done = rspamd_symcache_process_symbols(task, task->cfg->cache, st);
@@ -724,11 +933,19 @@ rspamd_task_process(struct rspamd_task *task, unsigned int stages)
 		if (!rspamd_message_parse(task)) {
 			ret = FALSE;
 		}
+		else if (task->resolver && task->resolver->prefetch) {
+			rspamd_task_dns_prefetch(task);
+		}
 		break;
 
 	case RSPAMD_TASK_STAGE_PROCESS_MESSAGE:
-		if (!(task->flags & RSPAMD_TASK_FLAG_SKIP_PROCESS)) {
+		/* Stage is entered again if the callback has added events */
+		if (stage_entered && !(task->flags & RSPAMD_TASK_FLAG_SKIP_PROCESS)) {
 			rspamd_message_process(task);
+
+			if (task->processed_callback) {
+				task->processed_callback(task, task->processed_arg);
+			}
 		}
 		break;
 
@@ -868,6 +1085,11 @@ rspamd_task_process(struct rspamd_task *task, unsigned int stages)
 				/* Mark the current stage as done and go to the next stage */
 				msg_debug_task("completed stage %d", st);
 				task->processed_stages |= st;
+
+				if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
+					rspamd_worker_stat_hist_time(RSPAMD_STAT_HIST_STAGE + __builtin_ctz(st),
+												 ev_time() - task->stage_start);
+				}
 			}
 			else {
 				msg_debug_task("need more processing on stage %d", st);
@@ -1076,6 +1298,13 @@ rspamd_task_compare_log_group(gconstpointer a, gconstpointer b)
 	return strcmp(s1->name, s2->name);
 }
 
+/* Formats used for each logged task, parsed once */
+static struct rspamd_printf_fmt_cache scores_fmt = RSPAMD_PRINTF_FMT_INIT("%.2f/%.2f");
+static struct rspamd_printf_fmt_cache score_fmt = RSPAMD_PRINTF_FMT_INIT("(%.2f)");
+static struct rspamd_printf_fmt_cache size_fmt = RSPAMD_PRINTF_FMT_INIT("%uz");
+static struct rspamd_printf_fmt_cache uint32_fmt = RSPAMD_PRINTF_FMT_INIT("%uD");
+static struct rspamd_printf_fmt_cache digest_fmt = RSPAMD_PRINTF_FMT_INIT("%*xs");
+static struct rspamd_printf_fmt_cache humanized_size_fmt = RSPAMD_PRINTF_FMT_INIT("%Hz");
 
 static rspamd_ftok_t
 rspamd_task_log_metric_res(struct rspamd_task *task,
@@ -1117,8 +1346,8 @@ rspamd_task_log_metric_res(struct rspamd_task *task,
 			res.len = strlen(res.begin);
 			break;
 		case RSPAMD_LOG_SCORES:
-			res.len = rspamd_snprintf(scorebuf, sizeof(scorebuf), "%.2f/%.2f",
-									  mres->score, rspamd_task_get_required_score(task, mres));
+			res.len = rspamd_snprintf_cached(scorebuf, sizeof(scorebuf), &scores_fmt,
+											 mres->score, rspamd_task_get_required_score(task, mres));
 			res.begin = scorebuf;
 			break;
 		case RSPAMD_LOG_SYMBOLS:
@@ -1136,19 +1365,18 @@ rspamd_task_log_metric_res(struct rspamd_task *task,
 			for (i = 0; i < sorted_symbols->len; i++) {
 				sym = g_ptr_array_index(sorted_symbols, i);
 
-				if (first) {
-					rspamd_printf_fstring(&symbuf, "%s", sym->name);
-				}
-				else {
-					rspamd_printf_fstring(&symbuf, ",%s", sym->name);
+				if (!first) {
+					symbuf = rspamd_fstring_append(symbuf, ",", 1);
 				}
 
+				symbuf = rspamd_fstring_append(symbuf, sym->name, strlen(sym->name));
+
 				if (lf->flags & RSPAMD_LOG_FMT_FLAG_SYMBOLS_SCORES) {
-					rspamd_printf_fstring(&symbuf, "(%.2f)", sym->score);
+					rspamd_printf_fstring_cached(&symbuf, &score_fmt, sym->score);
 				}
 
 				if (lf->flags & RSPAMD_LOG_FMT_FLAG_SYMBOLS_PARAMS) {
-					rspamd_printf_fstring(&symbuf, "{");
+					symbuf = rspamd_fstring_append(symbuf, "{", 1);
 
 					if (sym->options) {
 						struct rspamd_symbol_option *opt;
@@ -1157,11 +1385,11 @@ rspamd_task_log_metric_res(struct rspamd_task *task,
 
 						DL_FOREACH(sym->opts_head, opt)
 						{
-							rspamd_printf_fstring(&symbuf, "%*s;",
-												  (int) opt->optlen, opt->option);
+							symbuf = rspamd_fstring_append(symbuf, opt->option, opt->optlen);
+							symbuf = rspamd_fstring_append(symbuf, ";", 1);
 
 							if (j >= max_log_elts && opt->next) {
-								rspamd_printf_fstring(&symbuf, "...;");
+								symbuf = rspamd_fstring_append(symbuf, "...;", 4);
 								break;
 							}
 
@@ -1169,7 +1397,7 @@ rspamd_task_log_metric_res(struct rspamd_task *task,
 						}
 					}
 
-					rspamd_printf_fstring(&symbuf, "}");
+					symbuf = rspamd_fstring_append(symbuf, "}", 1);
 				}
 
 				first = FALSE;
@@ -1206,17 +1434,16 @@ rspamd_task_log_metric_res(struct rspamd_task *task,
 			for (i = 0; i < sorted_symbols->len; i++) {
 				gr = g_ptr_array_index(sorted_symbols, i);
 
-				if (first) {
-					rspamd_printf_fstring(&symbuf, "%s", gr->name);
-				}
-				else {
-					rspamd_printf_fstring(&symbuf, ",%s", gr->name);
+				if (!first) {
+					symbuf = rspamd_fstring_append(symbuf, ",", 1);
 				}
 
+				symbuf = rspamd_fstring_append(symbuf, gr->name, strlen(gr->name));
+
 				k = kh_get(rspamd_symbols_group_hash, mres->sym_groups, gr);
 
-				rspamd_printf_fstring(&symbuf, "(%.2f)",
-									  kh_value(mres->sym_groups, k));
+				rspamd_printf_fstring_cached(&symbuf, &score_fmt,
+											 kh_value(mres->sym_groups, k));
 
 				first = FALSE;
 			}
@@ -1449,13 +1676,13 @@ rspamd_task_log_variable(struct rspamd_task *task,
 		break;
 	/* Numeric vars */
 	case RSPAMD_LOG_LEN:
-		var.len = rspamd_snprintf(numbuf, sizeof(numbuf), "%uz",
-								  task->msg.len);
+		var.len = rspamd_snprintf_cached(numbuf, sizeof(numbuf), &size_fmt,
+										 task->msg.len);
 		var.begin = numbuf;
 		break;
 	case RSPAMD_LOG_DNS_REQ:
-		var.len = rspamd_snprintf(numbuf, sizeof(numbuf), "%uD",
-								  task->dns_requests);
+		var.len = rspamd_snprintf_cached(numbuf, sizeof(numbuf), &uint32_fmt,
+										 task->dns_requests);
 		var.begin = numbuf;
 		break;
 	case RSPAMD_LOG_TIME_REAL:
@@ -1513,9 +1740,9 @@ rspamd_task_log_variable(struct rspamd_task *task,
 		break;
 	case RSPAMD_LOG_DIGEST:
 		if (task->message) {
-			var.len = rspamd_snprintf(numbuf, sizeof(numbuf), "%*xs",
-									  (int) sizeof(MESSAGE_FIELD(task, digest)),
-									  MESSAGE_FIELD(task, digest));
+			var.len = rspamd_snprintf_cached(numbuf, sizeof(numbuf), &digest_fmt,
+											 (int) sizeof(MESSAGE_FIELD(task, digest)),
+											 MESSAGE_FIELD(task, digest));
 			var.begin = numbuf;
 		}
 		else {
@@ -1570,15 +1797,13 @@ rspamd_task_log_variable(struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_LOG_MEMPOOL_SIZE:
-		var.len = rspamd_snprintf(numbuf, sizeof(numbuf),
-								  "%Hz",
-								  rspamd_mempool_get_used_size(task->task_pool));
+		var.len = rspamd_snprintf_cached(numbuf, sizeof(numbuf), &humanized_size_fmt,
+										 rspamd_mempool_get_used_size(task->task_pool));
 		var.begin = numbuf;
 		break;
 	case RSPAMD_LOG_MEMPOOL_WASTE:
-		var.len = rspamd_snprintf(numbuf, sizeof(numbuf),
-								  "%Hz",
-								  rspamd_mempool_get_wasted_size(task->task_pool));
+		var.len = rspamd_snprintf_cached(numbuf, sizeof(numbuf), &humanized_size_fmt,
+										 rspamd_mempool_get_wasted_size(task->task_pool));
 		var.begin = numbuf;
 		break;
 	default:
@@ -1611,6 +1836,14 @@ void rspamd_task_write_log(struct rspamd_task *task)
 		return;
 	}
 
+	if (task->cfg->log_binary_file) {
+		rspamd_task_write_binary_log(task);
+
+		if (task->cfg->log_binary_only) {
+			return;
+		}
+	}
+
 	logbuf = rspamd_fstring_sized_new(1000);
 
 	DL_FOREACH(task->cfg->log_format, lf)
@@ -1874,6 +2107,27 @@ rspamd_task_stage_name(enum rspamd_task_stage stg)
 	return ret;
 }
 
+/* Time reserved to finish a task after its async requests have timed out */
+#define RSPAMD_TASK_DEADLINE_MARGIN 0.1
+
+double
+rspamd_task_adjust_timeout(struct rspamd_task *task, double timeout)
+{
+	double remain;
+
+	if (task == NULL || task->deadline <= 0) {
+		return timeout;
+	}
+
+	remain = task->deadline - ev_now(task->event_loop) - RSPAMD_TASK_DEADLINE_MARGIN;
+
+	if (remain <= 0) {
+		return 0.0;
+	}
+
+	return MIN(timeout, remain);
+}
+
 void rspamd_task_timeout(EV_P_ ev_timer *w, int revents)
 {
 	struct rspamd_task *task = (struct rspamd_task *) w->data;
@@ -1980,3 +2234,205 @@ void rspamd_worker_guard_handler(EV_P_ ev_io *w, int revents)
 		}
 	}
 }
+
+void rspamd_task_hold(struct rspamd_task *task)
+{
+	task->holds++;
+}
+
+void rspamd_task_release(struct rspamd_task *task)
+{
+	g_assert(task->holds > 0);
+	task->holds--;
+
+	if (task->holds == 0 && task->free_pending) {
+		task->free_pending = FALSE;
+		rspamd_task_free(task);
+	}
+}
+
+struct rspamd_task_offload_cbdata {
+	struct rspamd_task *task;
+	rspamd_task_offload_work_t work;
+	rspamd_task_offload_done_t done;
+	void *ud;
+	gboolean finished;
+	gboolean session_gone;
+};
+
+static void
+rspamd_task_offload_fin(gpointer ud)
+{
+	struct rspamd_task_offload_cbdata *cbd = ud;
+
+	if (!cbd->finished) {
+		/* Session is finished whilst the job is still running, task is held */
+		cbd->session_gone = TRUE;
+	}
+}
+
+static void
+rspamd_task_offload_work(void *ud)
+{
+	struct rspamd_task_offload_cbdata *cbd = ud;
+
+	cbd->work(cbd->ud);
+}
+
+static void
+rspamd_task_offload_done(void *ud)
+{
+	struct rspamd_task_offload_cbdata *cbd = ud;
+	struct rspamd_task *task = cbd->task;
+
+	cbd->finished = TRUE;
+
+	if (cbd->session_gone) {
+		cbd->done(NULL, cbd->ud);
+	}
+	else {
+		cbd->done(task, cbd->ud);
+		rspamd_session_remove_event(task->s, rspamd_task_offload_fin, cbd);
+	}
+
+	g_free(cbd);
+	/* Task can be freed here */
+	rspamd_task_release(task);
+}
+
+gboolean
+rspamd_task_offload(struct rspamd_task *task,
+					rspamd_task_offload_work_t work,
+					rspamd_task_offload_done_t done,
+					void *ud)
+{
+	struct rspamd_task_offload_cbdata *cbd;
+	struct rspamd_cpu_pool *pool = task->worker ? task->worker->cpu_pool : NULL;
+
+	if (pool != NULL && !rspamd_session_blocked(task->s)) {
+		cbd = g_malloc0(sizeof(*cbd));
+		cbd->task = task;
+		cbd->work = work;
+		cbd->done = done;
+		cbd->ud = ud;
+
+		if (rspamd_cpu_pool_push(pool, rspamd_task_offload_work,
+								 rspamd_task_offload_done, cbd)) {
+			rspamd_task_hold(task);
+			rspamd_session_add_event(task->s, rspamd_task_offload_fin, cbd,
+									 "rspamd cpu pool");
+
+			return TRUE;
+		}
+
+		g_free(cbd);
+	}
+
+	work(ud);
+	done(task, ud);
+
+	return FALSE;
+}
+
+/*
+ * FFI accessors: `ptask` is a pointer to the Lua task userdata, i.e.
+ * `struct rspamd_task **`, as in `rspamd_re_cache_process_ffi`
+ */
+int rspamd_task_has_symbol_ffi(void *ptask, const char *symbol)
+{
+	struct rspamd_task *task = *(struct rspamd_task **) ptask;
+	struct rspamd_symbol_result *s;
+
+	s = rspamd_task_find_symbol_result(task, symbol, NULL);
+
+	return s != NULL && !(s->flags & RSPAMD_SYMBOL_RESULT_IGNORED);
+}
+
+double
+rspamd_task_get_symbol_score_ffi(void *ptask, const char *symbol, int *found)
+{
+	struct rspamd_task *task = *(struct rspamd_task **) ptask;
+	struct rspamd_symbol_result *s;
+
+	s = rspamd_task_find_symbol_result(task, symbol, NULL);
+
+	if (s != NULL && !(s->flags & RSPAMD_SYMBOL_RESULT_IGNORED)) {
+		*found = 1;
+
+		return s->score;
+	}
+
+	*found = 0;
+
+	return 0.0;
+}
+
+int rspamd_task_insert_result_ffi(void *ptask, const char *symbol,
+								  double weight, const char *opt, size_t optlen)
+{
+	struct rspamd_task *task = *(struct rspamd_task **) ptask;
+	struct rspamd_symbol_result *s;
+
+	s = rspamd_task_insert_result_full(task,
+									   rspamd_mempool_strdup(task->task_pool, symbol),
+									   weight, NULL, RSPAMD_SYMBOL_INSERT_DEFAULT, NULL);
+
+	if (s == NULL) {
+		return 0;
+	}
+
+	if (opt != NULL) {
+		rspamd_task_add_result_option(task, s, opt, optlen);
+	}
+
+	return 1;
+}
+
+const char *
+rspamd_task_get_header_ffi(void *ptask, const char *name, int strong)
+{
+	struct rspamd_task *task = *(struct rspamd_task **) ptask;
+	struct rspamd_mime_header *rh, *cur;
+
+	rh = rspamd_message_get_header_array(task, name, FALSE);
+
+	DL_FOREACH(rh, cur)
+	{
+		if (!strong || strcmp(cur->name, name) == 0) {
+			return rspamd_mime_header_get_decoded(cur);
+		}
+	}
+
+	return NULL;
+}
+
+unsigned int
+rspamd_task_get_urls_ffi(void *ptask, const char **urls, unsigned int *lens,
+						 unsigned int max)
+{
+	struct rspamd_task *task = *(struct rspamd_task **) ptask;
+	struct rspamd_url *u;
+	unsigned int n = 0;
+
+	if (task->message == NULL) {
+		return 0;
+	}
+
+	kh_foreach_key(MESSAGE_FIELD(task, urls), u, {
+		if (n >= max) {
+			break;
+		}
+
+		/* Same defaults as `task:get_urls()` */
+		if (!(u->protocol & (PROTOCOL_HTTP | PROTOCOL_HTTPS | PROTOCOL_FILE | PROTOCOL_FTP)) ||
+			(u->flags & (RSPAMD_URL_FLAG_CONTENT | RSPAMD_URL_FLAG_IMAGE))) {
+			continue;
+		}
+
+		urls[n] = u->string;
+		lens[n] = u->urllen;
+		n++;
+	});
+
+	return n;
+}
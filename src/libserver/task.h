@@ -113,7 +113,9 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_SSL (1u << 22u)
 #define RSPAMD_TASK_FLAG_BAD_UNICODE (1u << 23u)
 #define RSPAMD_TASK_FLAG_MESSAGE_REWRITE (1u << 24u)
-#define RSPAMD_TASK_FLAG_MAX_SHIFT (24u)
+#define RSPAMD_TASK_FLAG_BODY_PENDING (1u << 25u)
+#define RSPAMD_TASK_FLAG_MEMORY_PRESSURE (1u << 26u)
+#define RSPAMD_TASK_FLAG_MAX_SHIFT (26u)
 
 
 /* Request has a JSON control block */
@@ -130,7 +132,11 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_PROTOCOL_FLAG_BODY_BLOCK (1u << 5u)
 /* Emit groups information */
 #define RSPAMD_TASK_PROTOCOL_FLAG_GROUPS (1u << 6u)
-#define RSPAMD_TASK_PROTOCOL_FLAG_MAX_SHIFT (6u)
+/* Skip static symbols metadata (descriptions, metric scores) in reply */
+#define RSPAMD_TASK_PROTOCOL_FLAG_COMPACT (1u << 7u)
+/* Client wants to send more requests over the same connection */
+#define RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE (1u << 8u)
+#define RSPAMD_TASK_PROTOCOL_FLAG_MAX_SHIFT (8u)
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (G_UNLIKELY((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_SPAMC(task) (G_UNLIKELY((task)->cmd == CMD_CHECK_SPAMC))
@@ -176,6 +182,8 @@ struct rspamd_task {
 	uint32_t flags;               /**< Bit flags										*/
 	uint32_t protocol_flags;
 	uint32_t processed_stages;                          /**< bits of stages that are processed			*/
+	uint32_t timed_stage;                               /**< stage that is being timed					*/
+	double stage_start;                                 /**< when the timed stage has been started		*/
 	char *helo;                                         /**< helo header value								*/
 	char *queue_id;                                     /**< queue id if specified							*/
 	rspamd_inet_addr_t *from_addr;                      /**< from addr for a task							*/
@@ -205,10 +213,16 @@ struct rspamd_task {
 	rspamd_mempool_t *task_pool; /**< memory pool for task							*/
 	double time_real_finish;
 	ev_tstamp task_timestamp;
+	ev_tstamp deadline; /**< time when the task must be finished, 0 if unlimited		*/
 
 	gboolean (*fin_callback)(struct rspamd_task *task, void *arg);
 	/**< callback for filters finalizing					*/
 	void *fin_arg; /**< argument for fin callback						*/
+	void (*processed_callback)(struct rspamd_task *task, void *arg);
+	/**< called once message is processed, it can add async events to delay filters */
+	void *processed_arg; /**< argument for processed callback					*/
+	unsigned int holds;   /**< jobs that still use task memory, see rspamd_task_hold */
+	gboolean free_pending; /**< task has been freed whilst being held				*/
 
 	struct rspamd_dns_resolver *resolver; /**< DNS resolver									*/
 	struct ev_loop *event_loop;           /**< Event base										*/
@@ -222,6 +236,8 @@ struct rspamd_task {
 	const char *classifier;                /**< Classifier to learn (if needed)				*/
 	struct rspamd_lang_detector *lang_det; /**< Languages detector								*/
 	struct rspamd_message *message;
+	struct rspamd_task_trace *trace; /**< Spans recorded if the task is sampled for tracing	*/
+	gsize lua_mem_start;             /**< Lua memory (kb) when the task has been created		*/
 };
 
 /**
@@ -239,6 +255,19 @@ struct rspamd_task *rspamd_task_new(struct rspamd_worker *worker,
  */
 void rspamd_task_free(struct rspamd_task *task);
 
+/**
+ * Keeps task memory (including its pool) alive: `rspamd_task_free` called for a
+ * held task is postponed until the last `rspamd_task_release`. It is intended
+ * for jobs running outside of the event loop, as they cannot be cancelled
+ */
+void rspamd_task_hold(struct rspamd_task *task);
+
+/**
+ * Releases a hold of the task, frees it if `rspamd_task_free` has been called
+ * whilst the task was held
+ */
+void rspamd_task_release(struct rspamd_task *task);
+
 /**
  * Called if all filters are processed
  * @return TRUE if session should be terminated
@@ -376,11 +405,54 @@ gboolean rspamd_task_set_finish_time(struct rspamd_task *task);
  */
 const char *rspamd_task_stage_name(enum rspamd_task_stage stg);
 
+/**
+ * Executed in a cpu pool thread, must use merely data from `ud`
+ */
+typedef void (*rspamd_task_offload_work_t)(void *ud);
+/**
+ * Executed in the event loop thread, `task` is NULL if the task session has been
+ * finished while the job was running; callback must release `ud` in both cases
+ */
+typedef void (*rspamd_task_offload_done_t)(struct rspamd_task *task, void *ud);
+
+/**
+ * Runs cpu bound job in the worker's cpu pool (if configured), task is kept
+ * pending via an async session event until the job is done. If there is no
+ * pool or it is saturated, the job is executed inline.
+ * Task is held whilst the job runs, so the job can use task memory even if
+ * the session is destroyed in the meantime.
+ * @return TRUE if the job has been offloaded, FALSE if executed inline
+ */
+gboolean rspamd_task_offload(struct rspamd_task *task,
+							 rspamd_task_offload_work_t work,
+							 rspamd_task_offload_done_t done,
+							 void *ud);
+
+/*
+ * Fast paths for the hot task accessors used via LuaJIT FFI (see lua_ffi/task.lua),
+ * `ptask` is a pointer to the Lua task userdata. The signatures must be kept stable.
+ */
+int rspamd_task_has_symbol_ffi(void *ptask, const char *symbol);
+double rspamd_task_get_symbol_score_ffi(void *ptask, const char *symbol, int *found);
+int rspamd_task_insert_result_ffi(void *ptask, const char *symbol,
+								  double weight, const char *opt, size_t optlen);
+/* Returns decoded value of the first header with the specified name or NULL */
+const char *rspamd_task_get_header_ffi(void *ptask, const char *name, int strong);
+/* Fills at most `max` urls (the same set as `task:get_urls()` by default), returns their number */
+unsigned int rspamd_task_get_urls_ffi(void *ptask, const char **urls, unsigned int *lens,
+									  unsigned int max);
+
 /*
  * Called on forced timeout
  */
 void rspamd_task_timeout(EV_P_ ev_timer *w, int revents);
 
+/*
+ * Limits timeout of an async request made on behalf of a task by the time
+ * left till the task deadline, returns 0 if the task has no time left
+ */
+double rspamd_task_adjust_timeout(struct rspamd_task *task, double timeout);
+
 /*
  * Called on unexpected IO error (e.g. ECONNRESET)
  */
@@ -0,0 +1,302 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "task_binlog.h"
+#include "task.h"
+#include "cfg_file.h"
+#include "scan_result.h"
+#include "message.h"
+#include "email_addr.h"
+#include "libmime/scan_result_private.h"
+#include "unix-std.h"
+#include "utlist.h"
+
+/* How often we check if the log file has been rotated */
+#define BINLOG_CHECK_INTERVAL 1.0
+
+/* Log file is opened by each worker on demand */
+static struct {
+	char *path;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	double last_check;
+	double last_error;
+} binlog = {
+	.path = NULL,
+	.fd = -1,
+};
+
+static inline void
+rspamd_binlog_u8(rspamd_fstring_t **buf, uint8_t v)
+{
+	*buf = rspamd_fstring_append(*buf, (const char *) &v, sizeof(v));
+}
+
+static inline void
+rspamd_binlog_u16(rspamd_fstring_t **buf, uint16_t v)
+{
+	v = GUINT16_TO_LE(v);
+	*buf = rspamd_fstring_append(*buf, (const char *) &v, sizeof(v));
+}
+
+static inline void
+rspamd_binlog_u32(rspamd_fstring_t **buf, uint32_t v)
+{
+	v = GUINT32_TO_LE(v);
+	*buf = rspamd_fstring_append(*buf, (const char *) &v, sizeof(v));
+}
+
+static inline void
+rspamd_binlog_u64(rspamd_fstring_t **buf, uint64_t v)
+{
+	v = GUINT64_TO_LE(v);
+	*buf = rspamd_fstring_append(*buf, (const char *) &v, sizeof(v));
+}
+
+static inline void
+rspamd_binlog_double(rspamd_fstring_t **buf, double d)
+{
+	uint64_t v;
+
+	memcpy(&v, &d, sizeof(v));
+	rspamd_binlog_u64(buf, v);
+}
+
+static inline void
+rspamd_binlog_str(rspamd_fstring_t **buf, const char *s, gsize len)
+{
+	len = MIN(len, G_MAXUINT16);
+	rspamd_binlog_u16(buf, len);
+	*buf = rspamd_fstring_append(*buf, s, len);
+}
+
+static void
+rspamd_binlog_field_str(rspamd_fstring_t **buf, enum rspamd_binlog_field tag,
+						const char *s, gsize len)
+{
+	if (s != NULL) {
+		rspamd_binlog_u8(buf, tag);
+		rspamd_binlog_str(buf, s, len);
+	}
+}
+
+static void
+rspamd_binlog_field_double(rspamd_fstring_t **buf, enum rspamd_binlog_field tag,
+						   double d)
+{
+	rspamd_binlog_u8(buf, tag);
+	rspamd_binlog_double(buf, d);
+}
+
+static int
+rspamd_binlog_get_fd(struct rspamd_task *task)
+{
+	const char *path = task->cfg->log_binary_file;
+	double now = rspamd_get_calendar_ticks();
+	struct stat st;
+
+	if (binlog.fd != -1) {
+		if (strcmp(binlog.path, path) != 0) {
+			/* Config has been reloaded with another path */
+			close(binlog.fd);
+			binlog.fd = -1;
+		}
+		else if (now - binlog.last_check > BINLOG_CHECK_INTERVAL) {
+			binlog.last_check = now;
+
+			/* Reopen file if it has been rotated */
+			if (stat(path, &st) == -1 || st.st_ino != binlog.ino ||
+				st.st_dev != binlog.dev) {
+				close(binlog.fd);
+				binlog.fd = -1;
+			}
+		}
+	}
+
+	if (binlog.fd == -1) {
+		if (now - binlog.last_error < BINLOG_CHECK_INTERVAL) {
+			/* Do not try to open file on each task */
+			return -1;
+		}
+
+		binlog.fd = open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC,
+						 S_IWUSR | S_IRUSR | S_IRGRP);
+
+		if (binlog.fd == -1) {
+			msg_err_task("cannot open binary log %s: %s", path, strerror(errno));
+			binlog.last_error = now;
+
+			return -1;
+		}
+
+		if (fstat(binlog.fd, &st) != -1) {
+			binlog.dev = st.st_dev;
+			binlog.ino = st.st_ino;
+		}
+
+		g_free(binlog.path);
+		binlog.path = g_strdup(path);
+		binlog.last_check = now;
+	}
+
+	return binlog.fd;
+}
+
+gboolean
+rspamd_task_write_binary_log(struct rspamd_task *task)
+{
+	rspamd_fstring_t *buf;
+	struct rspamd_scan_result *mres = task->result;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_symbol_option *opt;
+	struct rspamd_email_address *addr;
+	struct rspamd_action *act;
+	unsigned int i, nopts, max_opts = task->cfg->log_task_max_elts;
+	uint32_t hdr[2];
+	int fd;
+	gboolean ret = TRUE;
+
+	if (mres == NULL) {
+		return FALSE;
+	}
+
+	/* Leave space for header, it is filled when the length is known */
+	buf = rspamd_fstring_sized_new(512);
+	buf = rspamd_fstring_append(buf, (const char *) hdr, sizeof(hdr));
+
+	rspamd_binlog_field_double(&buf, RSPAMD_BINLOG_TS, task->task_timestamp);
+
+	if (MESSAGE_FIELD_CHECK(task, message_id)) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_MID,
+								MESSAGE_FIELD(task, message_id),
+								strlen(MESSAGE_FIELD(task, message_id)));
+	}
+
+	if (task->queue_id) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_QID,
+								task->queue_id, strlen(task->queue_id));
+	}
+
+	if (task->from_addr && rspamd_ip_is_valid(task->from_addr)) {
+		const char *ip = rspamd_inet_address_to_string(task->from_addr);
+
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_IP, ip, strlen(ip));
+	}
+
+	if (task->auth_user) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_USER,
+								task->auth_user, strlen(task->auth_user));
+	}
+
+	if (task->from_envelope) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_SMTP_FROM,
+								task->from_envelope->addr,
+								task->from_envelope->addr_len);
+	}
+
+	if (task->rcpt_envelope) {
+		PTR_ARRAY_FOREACH(task->rcpt_envelope, i, addr)
+		{
+			rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_SMTP_RCPT,
+									addr->addr, addr->addr_len);
+		}
+	}
+
+	act = rspamd_check_action_metric(task, NULL, NULL);
+
+	if (act) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_ACTION,
+								act->name, strlen(act->name));
+	}
+
+	rspamd_binlog_field_double(&buf, RSPAMD_BINLOG_SCORE, mres->score);
+	rspamd_binlog_field_double(&buf, RSPAMD_BINLOG_REQUIRED,
+							   rspamd_task_get_required_score(task, mres));
+
+	kh_foreach_value(mres->symbols, sym, {
+		if (sym->flags & RSPAMD_SYMBOL_RESULT_IGNORED) {
+			continue;
+		}
+
+		rspamd_binlog_u8(&buf, RSPAMD_BINLOG_SYMBOL);
+		rspamd_binlog_double(&buf, sym->score);
+		rspamd_binlog_str(&buf, sym->name, strlen(sym->name));
+
+		nopts = 0;
+
+		if (sym->options) {
+			nopts = MIN(kh_size(sym->options), max_opts);
+		}
+
+		rspamd_binlog_u16(&buf, nopts);
+
+		if (nopts > 0) {
+			unsigned int j = 0;
+
+			DL_FOREACH(sym->opts_head, opt)
+			{
+				if (j++ >= nopts) {
+					break;
+				}
+
+				rspamd_binlog_str(&buf, opt->option, opt->optlen);
+			}
+		}
+	});
+
+	rspamd_binlog_field_double(&buf, RSPAMD_BINLOG_TIME,
+							   task->time_real_finish - task->task_timestamp);
+	rspamd_binlog_u8(&buf, RSPAMD_BINLOG_LEN);
+	rspamd_binlog_u64(&buf, task->msg.len);
+	rspamd_binlog_u8(&buf, RSPAMD_BINLOG_DNS_REQ);
+	rspamd_binlog_u32(&buf, task->dns_requests);
+
+	if (task->message) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_DIGEST,
+								(const char *) MESSAGE_FIELD(task, digest),
+								sizeof(MESSAGE_FIELD(task, digest)));
+	}
+
+	if (task->settings_elt) {
+		rspamd_binlog_field_str(&buf, RSPAMD_BINLOG_SETTINGS_ID,
+								task->settings_elt->name,
+								strlen(task->settings_elt->name));
+	}
+
+	hdr[0] = GUINT32_TO_LE(RSPAMD_BINLOG_MAGIC);
+	hdr[1] = GUINT32_TO_LE(buf->len - sizeof(hdr));
+	memcpy(buf->str, hdr, sizeof(hdr));
+
+	fd = rspamd_binlog_get_fd(task);
+
+	/* A single append keeps records from different workers intact */
+	if (fd == -1 || write(fd, buf->str, buf->len) != (gssize) buf->len) {
+		if (fd != -1) {
+			msg_err_task("cannot write binary log %s: %s",
+						 binlog.path, strerror(errno));
+			close(binlog.fd);
+			binlog.fd = -1;
+			binlog.last_error = rspamd_get_calendar_ticks();
+		}
+
+		ret = FALSE;
+	}
+
+	rspamd_fstring_free(buf);
+
+	return ret;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TASK_BINLOG_H
+#define RSPAMD_TASK_BINLOG_H
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary task log is a sequence of records written with a single append each:
+ *
+ * u32 magic, u32 length of fields, fields...
+ *
+ * Every field starts with u8 tag, strings are prefixed with u16 length,
+ * all numbers are little endian. Symbol field consists of a double score,
+ * a string name, u16 number of options and the options as strings.
+ * Records are rendered offline by `rspamadm binlog`.
+ */
+#define RSPAMD_BINLOG_MAGIC 0x4c425352u /* "RSBL" */
+
+enum rspamd_binlog_field {
+	RSPAMD_BINLOG_TS = 1,        /* double */
+	RSPAMD_BINLOG_MID = 2,       /* string */
+	RSPAMD_BINLOG_QID = 3,       /* string */
+	RSPAMD_BINLOG_IP = 4,        /* string */
+	RSPAMD_BINLOG_USER = 5,      /* string */
+	RSPAMD_BINLOG_SMTP_FROM = 6, /* string */
+	RSPAMD_BINLOG_SMTP_RCPT = 7, /* string, repeated */
+	RSPAMD_BINLOG_ACTION = 8,    /* string */
+	RSPAMD_BINLOG_SCORE = 9,     /* double */
+	RSPAMD_BINLOG_REQUIRED = 10, /* double */
+	RSPAMD_BINLOG_SYMBOL = 11,   /* symbol, repeated */
+	RSPAMD_BINLOG_TIME = 12,     /* double, real time of processing */
+	RSPAMD_BINLOG_LEN = 13,      /* u64 */
+	RSPAMD_BINLOG_DNS_REQ = 14,  /* u32 */
+	RSPAMD_BINLOG_DIGEST = 15,   /* string, raw bytes */
+	RSPAMD_BINLOG_SETTINGS_ID = 16, /* string */
+};
+
+struct rspamd_task;
+
+/**
+ * Appends task record to the binary log configured by `logging.binary_log`
+ * @param task
+ * @return TRUE if a record has been written
+ */
+gboolean rspamd_task_write_binary_log(struct rspamd_task *task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,560 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "tracing.h"
+#include "task.h"
+#include "cfg_file.h"
+#include "async_session.h"
+#include "libmime/message.h"
+#include "libutil/util.h"
+#include "libutil/str_util.h"
+#include "libutil/upstream.h"
+#include "libserver/http/http_connection.h"
+#include "libserver/http/http_private.h"
+#include "contrib/libev/ev.h"
+
+#define msg_err_tracing(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
+														 "tracing", NULL,      \
+														 RSPAMD_LOG_FUNC,      \
+														 __VA_ARGS__)
+#define msg_info_tracing(...) rspamd_default_log_function(G_LOG_LEVEL_INFO, \
+														  "tracing", NULL,  \
+														  RSPAMD_LOG_FUNC,  \
+														  __VA_ARGS__)
+#define msg_debug_tracing(...) rspamd_conditional_debug_fast(NULL, NULL,                      \
+															 rspamd_tracing_log_id, "tracing", \
+															 NULL,                            \
+															 RSPAMD_LOG_FUNC,                 \
+															 __VA_ARGS__)
+
+INIT_LOG_MODULE(tracing)
+
+/* OTLP span kinds */
+#define OTLP_SPAN_KIND_INTERNAL 1
+#define OTLP_SPAN_KIND_SERVER 2
+#define OTLP_SPAN_KIND_CLIENT 3
+
+/* How many spans can be queued (in batches) when the collector is slow */
+#define TRACING_MAX_QUEUED_BATCHES 4
+
+static const double default_export_timeout = 5.0;
+
+struct rspamd_trace_span {
+	uint64_t span_id;
+	const char *name;
+	gconstpointer key;
+	double start;
+	double end;
+	int parent; /* index of parent span, -1 for the root */
+	enum rspamd_trace_span_type type;
+};
+
+struct rspamd_task_trace {
+	struct rspamd_task *task;
+	uint64_t trace_id[2];
+	GArray *spans;
+	/* Indexes of spans that are not yet closed */
+	GArray *open;
+	int stage_span;
+	int symbol_span;
+	const char *stage;
+	gboolean session_attached;
+};
+
+struct rspamd_tracing_exporter {
+	struct rspamd_config *cfg;
+	struct ev_loop *event_loop;
+	struct upstream_list *collectors;
+	ucl_object_t *spans;
+	ev_timer flush_ev;
+	double sample_rate;
+	unsigned int batch_size;
+	unsigned int nspans;
+	uint64_t dropped;
+	gboolean inflight;
+};
+
+struct rspamd_tracing_request {
+	struct rspamd_tracing_exporter *exporter;
+	struct upstream *up;
+	struct rspamd_http_connection *conn;
+};
+
+/* Exporter is per process, as workers are single threaded */
+static struct rspamd_tracing_exporter *exporter = NULL;
+
+static void rspamd_tracing_flush(struct rspamd_tracing_exporter *exp);
+
+static void
+rspamd_tracing_request_free(struct rspamd_tracing_request *req)
+{
+	req->exporter->inflight = FALSE;
+	rspamd_http_connection_unref(req->conn);
+	g_free(req);
+}
+
+static void
+rspamd_tracing_error_handler(struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamd_tracing_request *req = (struct rspamd_tracing_request *) conn->ud;
+
+	msg_info_tracing("cannot export spans to %s: %e",
+					 rspamd_upstream_name(req->up), err);
+	rspamd_upstream_fail(req->up, FALSE, err ? err->message : "unknown error");
+	rspamd_tracing_request_free(req);
+}
+
+static int
+rspamd_tracing_finish_handler(struct rspamd_http_connection *conn,
+							  struct rspamd_http_message *msg)
+{
+	struct rspamd_tracing_request *req = (struct rspamd_tracing_request *) conn->ud;
+
+	if (msg->code / 100 == 2) {
+		rspamd_upstream_ok(req->up);
+	}
+	else {
+		msg_info_tracing("cannot export spans to %s: bad reply code %d",
+						 rspamd_upstream_name(req->up), msg->code);
+		rspamd_upstream_fail(req->up, FALSE, "bad reply code");
+	}
+
+	rspamd_tracing_request_free(req);
+
+	return 0;
+}
+
+static void
+rspamd_tracing_flush_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_tracing_exporter *exp = (struct rspamd_tracing_exporter *) w->data;
+
+	rspamd_tracing_flush(exp);
+	ev_timer_again(EV_A_ w);
+}
+
+void rspamd_tracing_init(struct rspamd_config *cfg, struct ev_loop *event_loop)
+{
+	struct rspamd_tracing_exporter *exp;
+
+	if (exporter != NULL || cfg->trace_sample_rate <= 0 || cfg->trace_collector == NULL) {
+		return;
+	}
+
+	exp = g_malloc0(sizeof(*exp));
+	exp->cfg = cfg;
+	exp->event_loop = event_loop;
+	exp->sample_rate = MIN(cfg->trace_sample_rate, 1.0);
+	exp->batch_size = cfg->trace_batch_size > 0 ? cfg->trace_batch_size : 512;
+	exp->collectors = rspamd_upstreams_create(cfg->ups_ctx);
+
+	if (!rspamd_upstreams_parse_line(exp->collectors, cfg->trace_collector,
+									 4318, NULL)) {
+		msg_err_tracing("cannot parse trace collectors: %s, tracing is disabled",
+						cfg->trace_collector);
+		rspamd_upstreams_destroy(exp->collectors);
+		g_free(exp);
+
+		return;
+	}
+
+	exp->spans = ucl_object_typed_new(UCL_ARRAY);
+	exp->flush_ev.data = exp;
+	ev_timer_init(&exp->flush_ev, rspamd_tracing_flush_cb,
+				  cfg->trace_flush_interval, cfg->trace_flush_interval);
+	ev_timer_start(event_loop, &exp->flush_ev);
+	/* Flush timer should not keep the loop alive */
+	ev_unref(event_loop);
+
+	exporter = exp;
+	msg_info_tracing("enabled tracing of %.2f%% of tasks, collectors: %s",
+					 exp->sample_rate * 100.0, cfg->trace_collector);
+}
+
+static void
+rspamd_tracing_trace_dtor(gpointer p)
+{
+	struct rspamd_task_trace *trace = (struct rspamd_task_trace *) p;
+
+	g_array_free(trace->spans, TRUE);
+	g_array_free(trace->open, TRUE);
+}
+
+struct rspamd_task_trace *
+rspamd_tracing_sample(struct rspamd_task *task)
+{
+	struct rspamd_task_trace *trace;
+	struct rspamd_trace_span root;
+
+	if (G_LIKELY(exporter == NULL)) {
+		return NULL;
+	}
+
+	if (rspamd_random_double_fast() >= exporter->sample_rate) {
+		return NULL;
+	}
+
+	trace = rspamd_mempool_alloc0_type(task->task_pool, struct rspamd_task_trace);
+	trace->task = task;
+	trace->trace_id[0] = rspamd_random_uint64_fast();
+	trace->trace_id[1] = rspamd_random_uint64_fast();
+	trace->spans = g_array_sized_new(FALSE, FALSE, sizeof(struct rspamd_trace_span), 64);
+	trace->open = g_array_sized_new(FALSE, FALSE, sizeof(int), 16);
+	trace->stage_span = -1;
+	trace->symbol_span = -1;
+	rspamd_mempool_add_destructor(task->task_pool, rspamd_tracing_trace_dtor, trace);
+
+	memset(&root, 0, sizeof(root));
+	root.span_id = rspamd_random_uint64_fast();
+	root.name = "task";
+	root.type = RSPAMD_TRACE_SPAN_TASK;
+	root.parent = -1;
+	root.start = rspamd_get_calendar_ticks();
+	g_array_append_val(trace->spans, root);
+
+	return trace;
+}
+
+void rspamd_tracing_span_begin(struct rspamd_task_trace *trace,
+							   enum rspamd_trace_span_type type,
+							   const char *name,
+							   gconstpointer key)
+{
+	struct rspamd_trace_span span;
+	int idx;
+
+	span.span_id = rspamd_random_uint64_fast();
+	span.name = name;
+	span.key = key;
+	span.type = type;
+	span.start = rspamd_get_calendar_ticks();
+	span.end = 0;
+
+	switch (type) {
+	case RSPAMD_TRACE_SPAN_STAGE:
+		span.parent = 0;
+		break;
+	case RSPAMD_TRACE_SPAN_SYMBOL:
+		span.parent = trace->stage_span >= 0 ? trace->stage_span : 0;
+		break;
+	default:
+		/* Events and regexps are attributed to the symbol being executed */
+		if (trace->symbol_span >= 0) {
+			span.parent = trace->symbol_span;
+		}
+		else {
+			span.parent = trace->stage_span >= 0 ? trace->stage_span : 0;
+		}
+		break;
+	}
+
+	idx = trace->spans->len;
+	g_array_append_val(trace->spans, span);
+	g_array_append_val(trace->open, idx);
+
+	if (type == RSPAMD_TRACE_SPAN_SYMBOL) {
+		trace->symbol_span = idx;
+	}
+}
+
+void rspamd_tracing_span_end(struct rspamd_task_trace *trace, gconstpointer key)
+{
+	struct rspamd_trace_span *span;
+	int i, idx;
+
+	for (i = (int) trace->open->len - 1; i >= 0; i--) {
+		idx = g_array_index(trace->open, int, i);
+		span = &g_array_index(trace->spans, struct rspamd_trace_span, idx);
+
+		if (span->key == key) {
+			span->end = rspamd_get_calendar_ticks();
+			g_array_remove_index_fast(trace->open, i);
+
+			if (idx == trace->symbol_span) {
+				trace->symbol_span = -1;
+			}
+
+			return;
+		}
+	}
+}
+
+void rspamd_tracing_stage(struct rspamd_task_trace *trace, const char *stage)
+{
+	if (!trace->session_attached && trace->task->s) {
+		rspamd_session_set_trace(trace->task->s, trace);
+		trace->session_attached = TRUE;
+	}
+
+	if (trace->stage == stage) {
+		return;
+	}
+
+	if (trace->stage != NULL) {
+		rspamd_tracing_span_end(trace, trace->stage);
+	}
+
+	trace->stage = stage;
+	rspamd_tracing_span_begin(trace, RSPAMD_TRACE_SPAN_STAGE, stage, stage);
+	trace->stage_span = trace->spans->len - 1;
+}
+
+void rspamd_tracing_symbol_leave(struct rspamd_task_trace *trace)
+{
+	trace->symbol_span = -1;
+}
+
+static const char *
+rspamd_tracing_span_type_to_string(enum rspamd_trace_span_type type)
+{
+	switch (type) {
+	case RSPAMD_TRACE_SPAN_TASK:
+		return "task";
+	case RSPAMD_TRACE_SPAN_STAGE:
+		return "stage";
+	case RSPAMD_TRACE_SPAN_SYMBOL:
+		return "symbol";
+	case RSPAMD_TRACE_SPAN_EVENT:
+		return "event";
+	case RSPAMD_TRACE_SPAN_REGEXP:
+		return "re_class";
+	}
+
+	return "unknown";
+}
+
+static void
+rspamd_tracing_add_attr(ucl_object_t *attrs, const char *key, const char *value)
+{
+	ucl_object_t *attr, *val;
+
+	attr = ucl_object_typed_new(UCL_OBJECT);
+	val = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(attr, ucl_object_fromstring(key), "key", 0, false);
+	ucl_object_insert_key(val, ucl_object_fromstring(value), "stringValue", 0, false);
+	ucl_object_insert_key(attr, val, "value", 0, false);
+	ucl_array_append(attrs, attr);
+}
+
+/*
+ * Converts span to OTLP JSON representation: ids are hex encoded and
+ * timestamps are in nanoseconds since epoch
+ */
+static ucl_object_t *
+rspamd_tracing_span_to_ucl(struct rspamd_task_trace *trace,
+						   struct rspamd_trace_span *span,
+						   const char *trace_id)
+{
+	ucl_object_t *obj, *attrs;
+	char idbuf[17], namebuf[256];
+	struct rspamd_task *task = trace->task;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromstring(trace_id), "traceId", 0, false);
+	rspamd_snprintf(idbuf, sizeof(idbuf), "%016xL", span->span_id);
+	ucl_object_insert_key(obj, ucl_object_fromstring(idbuf), "spanId", 0, false);
+
+	if (span->parent >= 0) {
+		rspamd_snprintf(idbuf, sizeof(idbuf), "%016xL",
+						g_array_index(trace->spans, struct rspamd_trace_span, span->parent).span_id);
+		ucl_object_insert_key(obj, ucl_object_fromstring(idbuf), "parentSpanId", 0, false);
+	}
+
+	if (span->type == RSPAMD_TRACE_SPAN_TASK) {
+		ucl_object_insert_key(obj, ucl_object_fromstring("rspamd task"), "name", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(OTLP_SPAN_KIND_SERVER), "kind", 0, false);
+	}
+	else {
+		rspamd_snprintf(namebuf, sizeof(namebuf), "%s %s",
+						rspamd_tracing_span_type_to_string(span->type), span->name);
+		ucl_object_insert_key(obj, ucl_object_fromstring(namebuf), "name", 0, false);
+		ucl_object_insert_key(obj,
+							  ucl_object_fromint(span->type == RSPAMD_TRACE_SPAN_EVENT ? OTLP_SPAN_KIND_CLIENT : OTLP_SPAN_KIND_INTERNAL),
+							  "kind", 0, false);
+	}
+
+	ucl_object_insert_key(obj, ucl_object_fromint((int64_t) (span->start * 1e9)),
+						  "startTimeUnixNano", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint((int64_t) (span->end * 1e9)),
+						  "endTimeUnixNano", 0, false);
+
+	attrs = ucl_object_typed_new(UCL_ARRAY);
+	rspamd_tracing_add_attr(attrs, "rspamd.span.type",
+							rspamd_tracing_span_type_to_string(span->type));
+
+	if (span->type == RSPAMD_TRACE_SPAN_TASK) {
+		const char *mid = MESSAGE_FIELD_CHECK(task, message_id);
+
+		rspamd_tracing_add_attr(attrs, "rspamd.task.id", task->task_pool->tag.uid);
+
+		if (mid) {
+			rspamd_tracing_add_attr(attrs, "rspamd.message_id", mid);
+		}
+		if (task->queue_id) {
+			rspamd_tracing_add_attr(attrs, "rspamd.queue_id", task->queue_id);
+		}
+		if (task->client_addr) {
+			rspamd_tracing_add_attr(attrs, "client.address",
+									rspamd_inet_address_to_string(task->client_addr));
+		}
+	}
+
+	ucl_object_insert_key(obj, attrs, "attributes", 0, false);
+
+	return obj;
+}
+
+void rspamd_tracing_finish(struct rspamd_task *task)
+{
+	struct rspamd_task_trace *trace = task->trace;
+	struct rspamd_trace_span *span;
+	char trace_id[33];
+	double now;
+	unsigned int i;
+
+	if (trace == NULL || exporter == NULL) {
+		return;
+	}
+
+	task->trace = NULL;
+
+	if (exporter->nspans + trace->spans->len >
+		exporter->batch_size * TRACING_MAX_QUEUED_BATCHES) {
+		/* Collector cannot cope with our load, drop this trace completely */
+		exporter->dropped += trace->spans->len;
+		msg_debug_tracing("drop %ud spans, %uL dropped in total",
+						  trace->spans->len, exporter->dropped);
+
+		return;
+	}
+
+	now = rspamd_get_calendar_ticks();
+	rspamd_snprintf(trace_id, sizeof(trace_id), "%016xL%016xL",
+					trace->trace_id[0], trace->trace_id[1]);
+
+	for (i = 0; i < trace->spans->len; i++) {
+		span = &g_array_index(trace->spans, struct rspamd_trace_span, i);
+
+		if (span->end == 0) {
+			/* Unfinished spans (including root) end with the task */
+			span->end = now;
+		}
+
+		ucl_array_append(exporter->spans,
+						 rspamd_tracing_span_to_ucl(trace, span, trace_id));
+		exporter->nspans++;
+	}
+
+	if (exporter->nspans >= exporter->batch_size) {
+		rspamd_tracing_flush(exporter);
+	}
+}
+
+static ucl_object_t *
+rspamd_tracing_make_request_body(ucl_object_t *spans)
+{
+	ucl_object_t *top, *rspans, *rspan, *resource, *attrs, *sspans, *sspan, *scope;
+	char pidbuf[32];
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	rspans = ucl_object_typed_new(UCL_ARRAY);
+	rspan = ucl_object_typed_new(UCL_OBJECT);
+	resource = ucl_object_typed_new(UCL_OBJECT);
+	attrs = ucl_object_typed_new(UCL_ARRAY);
+
+	rspamd_tracing_add_attr(attrs, "service.name", "rspamd");
+	rspamd_tracing_add_attr(attrs, "service.version", RVERSION);
+	rspamd_tracing_add_attr(attrs, "host.name", g_get_host_name());
+	rspamd_snprintf(pidbuf, sizeof(pidbuf), "%P", getpid());
+	rspamd_tracing_add_attr(attrs, "process.pid", pidbuf);
+	ucl_object_insert_key(resource, attrs, "attributes", 0, false);
+	ucl_object_insert_key(rspan, resource, "resource", 0, false);
+
+	sspans = ucl_object_typed_new(UCL_ARRAY);
+	sspan = ucl_object_typed_new(UCL_OBJECT);
+	scope = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(scope, ucl_object_fromstring("rspamd"), "name", 0, false);
+	ucl_object_insert_key(sspan, scope, "scope", 0, false);
+	ucl_object_insert_key(sspan, spans, "spans", 0, false);
+	ucl_array_append(sspans, sspan);
+	ucl_object_insert_key(rspan, sspans, "scopeSpans", 0, false);
+
+	ucl_array_append(rspans, rspan);
+	ucl_object_insert_key(top, rspans, "resourceSpans", 0, false);
+
+	return top;
+}
+
+static void
+rspamd_tracing_flush(struct rspamd_tracing_exporter *exp)
+{
+	struct upstream *up;
+	struct rspamd_tracing_request *req;
+	struct rspamd_http_message *msg;
+	struct rspamd_http_connection *conn;
+	rspamd_fstring_t *body;
+	ucl_object_t *top;
+	const char *path;
+
+	if (exp->nspans == 0 || exp->inflight) {
+		return;
+	}
+
+	up = rspamd_upstream_get(exp->collectors, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (up == NULL) {
+		msg_debug_tracing("no collectors alive, keep %ud spans queued", exp->nspans);
+		return;
+	}
+
+	conn = rspamd_http_connection_new_client(NULL,
+											 NULL,
+											 rspamd_tracing_error_handler,
+											 rspamd_tracing_finish_handler,
+											 RSPAMD_HTTP_CLIENT_SIMPLE,
+											 rspamd_upstream_addr_next(up));
+
+	if (conn == NULL) {
+		rspamd_upstream_fail(up, TRUE, strerror(errno));
+		return;
+	}
+
+	top = rspamd_tracing_make_request_body(exp->spans);
+	body = rspamd_fstring_sized_new(exp->nspans * 256);
+	rspamd_ucl_emit_fstring(top, UCL_EMIT_JSON_COMPACT, &body);
+	ucl_object_unref(top);
+
+	msg_debug_tracing("export %ud spans to %s", exp->nspans, rspamd_upstream_name(up));
+	exp->spans = ucl_object_typed_new(UCL_ARRAY);
+	exp->nspans = 0;
+
+	path = exp->cfg->trace_collector_path ? exp->cfg->trace_collector_path : "/v1/traces";
+	msg = rspamd_http_new_message(HTTP_REQUEST);
+	msg->method = HTTP_POST;
+	msg->url = rspamd_fstring_new_init(path, strlen(path));
+	rspamd_http_message_set_body_from_fstring_steal(msg, body);
+
+	req = g_malloc0(sizeof(*req));
+	req->exporter = exp;
+	req->up = up;
+	req->conn = conn;
+	exp->inflight = TRUE;
+
+	rspamd_http_connection_write_message(conn, msg, rspamd_upstream_name(up),
+										 "application/json", req,
+										 default_export_timeout);
+}
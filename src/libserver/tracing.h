@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_TRACING_H
+#define RSPAMD_TRACING_H
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rspamd_task;
+struct rspamd_config;
+struct ev_loop;
+struct rspamd_task_trace;
+
+enum rspamd_trace_span_type {
+	RSPAMD_TRACE_SPAN_TASK = 0,
+	RSPAMD_TRACE_SPAN_STAGE,
+	RSPAMD_TRACE_SPAN_SYMBOL,
+	RSPAMD_TRACE_SPAN_EVENT,
+	RSPAMD_TRACE_SPAN_REGEXP,
+};
+
+/**
+ * Initialise spans exporter for the current process, does nothing if tracing
+ * is not configured
+ * @param cfg config
+ * @param event_loop loop used for periodic flushes
+ */
+void rspamd_tracing_init(struct rspamd_config *cfg, struct ev_loop *event_loop);
+
+/**
+ * Decides whether a task should be traced
+ * @return new trace allocated in the task pool or NULL if task is not sampled
+ */
+struct rspamd_task_trace *rspamd_tracing_sample(struct rspamd_task *task);
+
+/**
+ * Opens a new span, `name` must live as long as the task.
+ * Span is identified by `key` that is then used to close it.
+ */
+void rspamd_tracing_span_begin(struct rspamd_task_trace *trace,
+							   enum rspamd_trace_span_type type,
+							   const char *name,
+							   gconstpointer key);
+
+/**
+ * Closes the most recent open span registered with the `key`
+ */
+void rspamd_tracing_span_end(struct rspamd_task_trace *trace, gconstpointer key);
+
+/**
+ * Notifies that task processing is in the stage specified, the span of the
+ * previous stage is closed if the stage has been changed
+ */
+void rspamd_tracing_stage(struct rspamd_task_trace *trace, const char *stage);
+
+/**
+ * Called when symbol callback returns (symbol span is left open if the symbol
+ * has pending async events), so spans opened later are no longer its children
+ */
+void rspamd_tracing_symbol_leave(struct rspamd_task_trace *trace);
+
+/**
+ * Closes all spans of the task and queues them for export
+ */
+void rspamd_tracing_finish(struct rspamd_task *task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,8 @@
 #include "rspamd.h"
 #include "message.h"
 #include "multipattern.h"
+#include "libutil/domain_trie.h"
+#include "libutil/hash.h"
 #include "contrib/uthash/utlist.h"
 #include "contrib/http-parser/http_parser.h"
 #include <unicode/utf8.h>
@@ -242,7 +244,13 @@ struct url_match_scanner {
 	GArray *matchers_strict;
 	struct rspamd_multipattern *search_trie_full;
 	struct rspamd_multipattern *search_trie_strict;
+	/* Public suffixes for eSLD detection, labels are looked up from the right */
+	struct rspamd_domain_trie *tld_trie;
 	bool has_tld_file;
+	/* Parsed urls shared between tasks, two generations, see rspamd_url_parse_cached */
+	GHashTable *intern_cur;
+	GHashTable *intern_prev;
+	unsigned int intern_max;
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -472,6 +480,9 @@ rspamd_url_parse_tld_file(const char *fname,
 													rspamd_multipattern_get_npatterns(url_scanner->search_trie_full) - 1);
 
 		g_array_append_val(url_scanner->matchers_full, m);
+		rspamd_domain_trie_add(scanner->tld_trie, p, strlen(p),
+							   (flags & URL_MATCHER_FLAG_STAR_MATCH) ? RSPAMD_DOMAIN_TRIE_WILDCARD : RSPAMD_DOMAIN_TRIE_DEFAULT,
+							   NULL);
 	}
 
 	free(linebuf);
@@ -527,8 +538,20 @@ void rspamd_url_deinit(void)
 			g_array_free(url_scanner->matchers_full, TRUE);
 		}
 
+		if (url_scanner->tld_trie) {
+			rspamd_domain_trie_destroy(url_scanner->tld_trie);
+		}
+
 		rspamd_multipattern_destroy(url_scanner->search_trie_strict);
 		g_array_free(url_scanner->matchers_strict, TRUE);
+
+		if (url_scanner->intern_cur) {
+			g_hash_table_unref(url_scanner->intern_cur);
+		}
+		if (url_scanner->intern_prev) {
+			g_hash_table_unref(url_scanner->intern_prev);
+		}
+
 		g_free(url_scanner);
 
 		url_scanner = NULL;
@@ -545,7 +568,7 @@ void rspamd_url_init(const char *tld_file)
 		rspamd_url_deinit();
 	}
 
-	url_scanner = g_malloc(sizeof(struct url_match_scanner));
+	url_scanner = g_malloc0(sizeof(struct url_match_scanner));
 
 	url_scanner->matchers_strict = g_array_sized_new(FALSE, TRUE,
 													 sizeof(struct url_matcher), G_N_ELEMENTS(static_matchers));
@@ -559,10 +582,12 @@ void rspamd_url_init(const char *tld_file)
 													   sizeof(struct url_matcher), 13000);
 		url_scanner->search_trie_full = rspamd_multipattern_create_sized(13000,
 																		 RSPAMD_MULTIPATTERN_ICASE | RSPAMD_MULTIPATTERN_UTF8);
+		url_scanner->tld_trie = rspamd_domain_trie_new();
 	}
 	else {
 		url_scanner->matchers_full = NULL;
 		url_scanner->search_trie_full = NULL;
+		url_scanner->tld_trie = NULL;
 		url_scanner->has_tld_file = false;
 		mp_compile_flags |= RSPAMD_MULTIPATTERN_COMPILE_NO_FS;
 	}
@@ -1651,73 +1676,6 @@ out:
 
 #undef SET_U
 
-static int
-rspamd_tld_trie_callback(struct rspamd_multipattern *mp,
-						 unsigned int strnum,
-						 int match_start,
-						 int match_pos,
-						 const char *text,
-						 gsize len,
-						 void *context)
-{
-	struct url_matcher *matcher;
-	const char *start, *pos, *p;
-	struct rspamd_url *url = context;
-	int ndots;
-
-	matcher = &g_array_index(url_scanner->matchers_full, struct url_matcher,
-							 strnum);
-	ndots = 1;
-
-	if (matcher->flags & URL_MATCHER_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots++;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = rspamd_url_host_unsafe(url);
-
-	if (*pos != '.' || match_pos != (int) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (int) url->hostlen - 1) {
-			pos = rspamd_url_host_unsafe(url) + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-		else {
-			pos = p;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-		url->tldlen < rspamd_url_host_unsafe(url) + url->hostlen - pos) {
-		url->tldshift = (pos - url->string);
-		url->tldlen = rspamd_url_host_unsafe(url) + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static void
 rspamd_url_regen_from_inet_addr(struct rspamd_url *uri, const void *addr, int af,
 								rspamd_mempool_t *pool)
@@ -1746,9 +1704,7 @@ rspamd_url_regen_from_inet_addr(struct rspamd_url *uri, const void *addr, int af
 
 	uri->hostshift = r;
 	uri->tldshift = r;
-	start_offset = strbuf + r;
-	inet_ntop(af, addr, strbuf + r, slen - r + 1);
-	uri->hostlen = strlen(start_offset);
+	uri->hostlen = rspamd_inet_ntop(af, addr, strbuf + r, slen - r + 1);
 	r += uri->hostlen;
 	uri->tldlen = uri->hostlen;
 	uri->flags |= RSPAMD_URL_FLAG_NUMERIC;
@@ -2186,6 +2142,138 @@ rspamd_url_remove_dots(struct rspamd_url *uri)
 	return ret;
 }
 
+struct rspamd_url_nameprep_elt {
+	int len; /* -1 if nameprep has failed */
+	char data[];
+};
+
+/* Guards the cache, as urls could be parsed outside of the main thread */
+G_LOCK_DEFINE_STATIC(nameprep_cache);
+static rspamd_lru_hash_t *nameprep_cache = NULL;
+static const int nameprep_cache_size = 1024;
+
+static gboolean
+rspamd_url_nameprep_host_uncached(struct rspamd_url *uri, rspamd_mempool_t *pool)
+{
+	/* Apply nameprep algorithm */
+	static UStringPrepProfile *nameprep = NULL;
+	UErrorCode uc_err = U_ZERO_ERROR;
+
+	if (nameprep == NULL) {
+		/* Open and cache profile */
+		nameprep = usprep_openByType(USPREP_RFC3491_NAMEPREP, &uc_err);
+
+		g_assert(U_SUCCESS(uc_err));
+	}
+
+	UChar *utf16_hostname, *norm_utf16;
+	int32_t utf16_len, norm_utf16_len, norm_utf8_len;
+	UParseError parse_error;
+
+	utf16_hostname = rspamd_mempool_alloc(pool, uri->hostlen * sizeof(UChar));
+	struct UConverter *utf8_conv = rspamd_get_utf8_converter();
+
+	utf16_len = ucnv_toUChars(utf8_conv, utf16_hostname, uri->hostlen,
+							  rspamd_url_host_unsafe(uri), uri->hostlen, &uc_err);
+
+	if (!U_SUCCESS(uc_err)) {
+
+		return FALSE;
+	}
+
+	norm_utf16 = rspamd_mempool_alloc(pool, utf16_len * sizeof(UChar));
+	norm_utf16_len = usprep_prepare(nameprep, utf16_hostname, utf16_len,
+									norm_utf16, utf16_len, USPREP_DEFAULT, &parse_error, &uc_err);
+
+	if (!U_SUCCESS(uc_err)) {
+
+		return FALSE;
+	}
+
+	/* Convert back to utf8, sigh... */
+	norm_utf8_len = ucnv_fromUChars(utf8_conv,
+									rspamd_url_host_unsafe(uri), uri->hostlen,
+									norm_utf16, norm_utf16_len, &uc_err);
+
+	if (!U_SUCCESS(uc_err)) {
+
+		return FALSE;
+	}
+
+	/* Final shift of lengths */
+	rspamd_url_shift(uri, norm_utf8_len, UF_HOST);
+
+	return TRUE;
+}
+
+/*
+ * Applies nameprep to the hostname of a url in place, recent results are
+ * cached as the same non-ascii hostnames are usually repeated in many messages
+ */
+static gboolean
+rspamd_url_nameprep_host(struct rspamd_url *uri, rspamd_mempool_t *pool)
+{
+	struct rspamd_url_nameprep_elt *elt;
+	char *host = rspamd_url_host_unsafe(uri);
+	char *key;
+	gboolean ret;
+	time_t now;
+
+	if (memchr(host, '\0', uri->hostlen) != NULL) {
+		/* Cannot be a string key */
+		return rspamd_url_nameprep_host_uncached(uri, pool);
+	}
+
+	now = time(NULL);
+	key = g_malloc(uri->hostlen + 1);
+	memcpy(key, host, uri->hostlen);
+	key[uri->hostlen] = '\0';
+
+	G_LOCK(nameprep_cache);
+
+	if (nameprep_cache == NULL) {
+		nameprep_cache = rspamd_lru_hash_new_full(nameprep_cache_size, g_free,
+												  g_free, rspamd_str_hash, rspamd_str_equal);
+	}
+
+	elt = rspamd_lru_hash_lookup(nameprep_cache, key, now);
+
+	if (elt) {
+		ret = elt->len >= 0;
+
+		if (ret) {
+			memcpy(host, elt->data, elt->len);
+			rspamd_url_shift(uri, elt->len, UF_HOST);
+		}
+
+		G_UNLOCK(nameprep_cache);
+		g_free(key);
+
+		return ret;
+	}
+
+	G_UNLOCK(nameprep_cache);
+
+	ret = rspamd_url_nameprep_host_uncached(uri, pool);
+
+	if (ret) {
+		elt = g_malloc(sizeof(*elt) + uri->hostlen);
+		elt->len = uri->hostlen;
+		memcpy(elt->data, rspamd_url_host_unsafe(uri), uri->hostlen);
+	}
+	else {
+		elt = g_malloc(sizeof(*elt));
+		elt->len = -1;
+	}
+
+	G_LOCK(nameprep_cache);
+	rspamd_lru_hash_insert(nameprep_cache, key, elt, now, 0);
+	G_UNLOCK(nameprep_cache);
+
+	return ret;
+}
+
+
 enum uri_errno
 rspamd_url_parse(struct rspamd_url *uri,
 				 char *uristring, gsize len,
@@ -2197,6 +2285,7 @@ rspamd_url_parse(struct rspamd_url *uri,
 	const char *end;
 	unsigned int complen, ret, flags = 0;
 	gsize unquoted_len = 0;
+	gboolean host_8bit;
 
 	memset(uri, 0, sizeof(*uri));
 	memset(&u, 0, sizeof(u));
@@ -2351,54 +2440,17 @@ rspamd_url_parse(struct rspamd_url *uri,
 		}
 	}
 
-	/* Apply nameprep algorithm */
-	static UStringPrepProfile *nameprep = NULL;
-	UErrorCode uc_err = U_ZERO_ERROR;
-
-	if (nameprep == NULL) {
-		/* Open and cache profile */
-		nameprep = usprep_openByType(USPREP_RFC3491_NAMEPREP, &uc_err);
-
-		g_assert(U_SUCCESS(uc_err));
-	}
-
-	UChar *utf16_hostname, *norm_utf16;
-	int32_t utf16_len, norm_utf16_len, norm_utf8_len;
-	UParseError parse_error;
-
-	utf16_hostname = rspamd_mempool_alloc(pool, uri->hostlen * sizeof(UChar));
-	struct UConverter *utf8_conv = rspamd_get_utf8_converter();
-
-	utf16_len = ucnv_toUChars(utf8_conv, utf16_hostname, uri->hostlen,
-							  rspamd_url_host_unsafe(uri), uri->hostlen, &uc_err);
-
-	if (!U_SUCCESS(uc_err)) {
-
-		return URI_ERRNO_BAD_FORMAT;
-	}
-
-	norm_utf16 = rspamd_mempool_alloc(pool, utf16_len * sizeof(UChar));
-	norm_utf16_len = usprep_prepare(nameprep, utf16_hostname, utf16_len,
-									norm_utf16, utf16_len, USPREP_DEFAULT, &parse_error, &uc_err);
-
-	if (!U_SUCCESS(uc_err)) {
-
-		return URI_ERRNO_BAD_FORMAT;
-	}
-
-	/* Convert back to utf8, sigh... */
-	norm_utf8_len = ucnv_fromUChars(utf8_conv,
-									rspamd_url_host_unsafe(uri), uri->hostlen,
-									norm_utf16, norm_utf16_len, &uc_err);
-
-	if (!U_SUCCESS(uc_err)) {
+	/*
+	 * Nameprep of an ascii hostname is just lowercasing that is done below
+	 * anyway, so ICU is used for 8bit hostnames only
+	 */
+	host_8bit = rspamd_str_has_8bit((const unsigned char *) rspamd_url_host_unsafe(uri),
+									uri->hostlen);
 
+	if (host_8bit && !rspamd_url_nameprep_host(uri, pool)) {
 		return URI_ERRNO_BAD_FORMAT;
 	}
 
-	/* Final shift of lengths */
-	rspamd_url_shift(uri, norm_utf8_len, UF_HOST);
-
 	/* Process data part */
 	if (uri->datalen) {
 		unquoted_len = rspamd_url_decode(rspamd_url_data_unsafe(uri),
@@ -2435,8 +2487,15 @@ rspamd_url_parse(struct rspamd_url *uri,
 	}
 
 	rspamd_str_lc(uri->string, uri->protocollen);
-	unquoted_len = rspamd_str_lc_utf8(rspamd_url_host_unsafe(uri), uri->hostlen);
-	rspamd_url_shift(uri, unquoted_len, UF_HOST);
+
+	if (host_8bit) {
+		unquoted_len = rspamd_str_lc_utf8(rspamd_url_host_unsafe(uri), uri->hostlen);
+		rspamd_url_shift(uri, unquoted_len, UF_HOST);
+	}
+	else {
+		rspamd_str_copy_lc(rspamd_url_host_unsafe(uri), rspamd_url_host_unsafe(uri),
+						   uri->hostlen);
+	}
 
 	if (uri->protocol == PROTOCOL_UNKNOWN) {
 		for (int i = 0; i < G_N_ELEMENTS(rspamd_url_protocols); i++) {
@@ -2452,10 +2511,20 @@ rspamd_url_parse(struct rspamd_url *uri,
 
 	if (uri->protocol & (PROTOCOL_HTTP | PROTOCOL_HTTPS | PROTOCOL_MAILTO | PROTOCOL_FTP | PROTOCOL_FILE)) {
 		/* Find TLD part */
-		if (url_scanner->search_trie_full) {
-			rspamd_multipattern_lookup(url_scanner->search_trie_full,
-									   rspamd_url_host_unsafe(uri), uri->hostlen,
-									   rspamd_tld_trie_callback, uri, NULL);
+		if (url_scanner->tld_trie && uri->hostlen > 0) {
+			const char *host = rspamd_url_host_unsafe(uri);
+			gsize tldlen = rspamd_domain_trie_esld(url_scanner->tld_trie,
+												   host, uri->hostlen);
+
+			if (tldlen > 0) {
+				if (host[uri->hostlen - 1] == '.') {
+					/* This is dot at the end of domain */
+					uri->hostlen--;
+				}
+
+				uri->tldshift = (host + uri->hostlen - tldlen) - uri->string;
+				uri->tldlen = tldlen;
+			}
 		}
 
 		if (uri->tldlen == 0) {
@@ -2582,88 +2651,225 @@ rspamd_url_parse(struct rspamd_url *uri,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const char *begin;
-	gsize len;
-	rspamd_ftok_t *out;
+struct rspamd_url_parse_memo {
+	enum uri_errno rc;
+	struct rspamd_url url;
 };
 
-static int
-rspamd_tld_trie_find_callback(struct rspamd_multipattern *mp,
-							  unsigned int strnum,
-							  int match_start,
-							  int match_pos,
-							  const char *text,
-							  gsize len,
-							  void *context)
+static const char *url_parse_memo_var = "url_parse_memo";
+/* Do not grow memo for inputs with absurd amount of urls */
+static const unsigned int url_parse_memo_max = 8192;
+
+struct rspamd_url_intern_elt {
+	struct rspamd_url url; /* string points to data, no ext */
+	uint16_t port;
+	char data[];
+};
+
+/* Guards interned urls, as urls could be parsed outside of the main thread */
+G_LOCK_DEFINE_STATIC(url_intern);
+
+void rspamd_url_set_intern_size(unsigned int nelts)
 {
-	struct url_matcher *matcher;
-	const char *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	int ndots = 1;
+	g_assert(url_scanner != NULL);
 
-	matcher = &g_array_index(url_scanner->matchers_full, struct url_matcher,
-							 strnum);
+	G_LOCK(url_intern);
+	url_scanner->intern_max = nelts;
+
+	if (nelts == 0) {
+		if (url_scanner->intern_cur) {
+			g_hash_table_unref(url_scanner->intern_cur);
+			url_scanner->intern_cur = NULL;
+		}
+		if (url_scanner->intern_prev) {
+			g_hash_table_unref(url_scanner->intern_prev);
+			url_scanner->intern_prev = NULL;
+		}
+	}
+	G_UNLOCK(url_intern);
+}
+
+/*
+ * Copies an interned url to the pool, returns FALSE if it is not interned
+ */
+static gboolean
+rspamd_url_intern_lookup(const char *key, struct rspamd_url *uri,
+						 char *uristring, rspamd_mempool_t *pool)
+{
+	struct rspamd_url_intern_elt *elt = NULL;
+	gpointer orig_key;
 
-	if (matcher->flags & URL_MATCHER_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
+	G_LOCK(url_intern);
+
+	if (url_scanner->intern_cur) {
+		elt = g_hash_table_lookup(url_scanner->intern_cur, key);
+
+		if (elt == NULL && url_scanner->intern_prev &&
+			g_hash_table_lookup_extended(url_scanner->intern_prev, key,
+										 &orig_key, (gpointer *) &elt)) {
+			/* Promote to the current generation */
+			g_hash_table_steal(url_scanner->intern_prev, key);
+			g_hash_table_insert(url_scanner->intern_cur, orig_key, elt);
+		}
 	}
 
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
+	if (elt) {
+		memcpy(uri, &elt->url, sizeof(*uri));
+		uri->string = rspamd_mempool_alloc(pool, uri->urllen + 1);
+		memcpy(uri->string, elt->data, uri->urllen + 1);
 
-	if (*pos != '.' || match_pos != (int) cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (int) cbdata->len - 1) {
-			/* Search more */
-			return 0;
+		if (elt->port != 0) {
+			uri->ext = rspamd_mempool_alloc0_type(pool, struct rspamd_url_ext);
+			uri->ext->port = elt->port;
 		}
 	}
 
-	/* Now we need to find top level domain */
-	pos = start;
+	G_UNLOCK(url_intern);
+
+	if (elt) {
+		uri->raw = uristring;
+
+		return TRUE;
+	}
 
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
+	return FALSE;
+}
+
+static void
+rspamd_url_intern_insert(const char *key, const struct rspamd_url *uri)
+{
+	struct rspamd_url_intern_elt *elt;
+
+	elt = g_malloc(sizeof(*elt) + uri->urllen + 1);
+	memcpy(&elt->url, uri, sizeof(*uri));
+	elt->url.string = elt->data;
+	elt->url.raw = NULL;
+	elt->url.ext = NULL;
+	elt->port = uri->ext ? uri->ext->port : 0;
+	memcpy(elt->data, uri->string, uri->urllen);
+	elt->data[uri->urllen] = '\0';
+
+	G_LOCK(url_intern);
+
+	if (url_scanner->intern_max > 0) {
+		if (url_scanner->intern_cur == NULL) {
+			url_scanner->intern_cur = g_hash_table_new_full(g_str_hash, g_str_equal,
+															g_free, g_free);
 		}
-		else {
-			pos = p;
+
+		g_hash_table_replace(url_scanner->intern_cur, g_strdup(key), elt);
+		elt = NULL;
+
+		if (g_hash_table_size(url_scanner->intern_cur) >= url_scanner->intern_max / 2 + 1) {
+			/* Drop the oldest generation */
+			if (url_scanner->intern_prev) {
+				g_hash_table_unref(url_scanner->intern_prev);
+			}
+
+			url_scanner->intern_prev = url_scanner->intern_cur;
+			url_scanner->intern_cur = g_hash_table_new_full(g_str_hash, g_str_equal,
+															g_free, g_free);
 		}
+	}
 
-		p--;
+	G_UNLOCK(url_intern);
+
+	g_free(elt);
+}
+
+static void
+rspamd_url_copy_ext(struct rspamd_url *uri, rspamd_mempool_t *pool)
+{
+	if (uri->ext) {
+		struct rspamd_url_ext *ext = rspamd_mempool_alloc_type(pool, struct rspamd_url_ext);
+
+		memcpy(ext, uri->ext, sizeof(*ext));
+		uri->ext = ext;
+	}
+}
+
+enum uri_errno
+rspamd_url_parse_cached(struct rspamd_url *uri,
+						char *uristring, gsize len,
+						rspamd_mempool_t *pool,
+						enum rspamd_url_parse_flags parse_flags)
+{
+	GHashTable *memo;
+	struct rspamd_url_parse_memo *elt;
+	char *key;
+
+	if (memchr(uristring, '\0', len) != NULL) {
+		/* Cannot be a string key */
+		return rspamd_url_parse(uri, uristring, len, pool, parse_flags);
+	}
+
+	memo = rspamd_mempool_get_variable(pool, url_parse_memo_var);
+
+	if (memo == NULL) {
+		memo = g_hash_table_new(g_str_hash, g_str_equal);
+		rspamd_mempool_set_variable(pool, url_parse_memo_var, memo,
+									(rspamd_mempool_destruct_t) g_hash_table_unref);
+	}
+
+	/* Flags are prepended to the key as parsing depends on them */
+	key = rspamd_mempool_alloc(pool, len + 2);
+	key[0] = 'a' + parse_flags;
+	memcpy(key + 1, uristring, len);
+	key[len + 1] = '\0';
+
+	elt = g_hash_table_lookup(memo, key);
+
+	if (elt) {
+		memcpy(uri, &elt->url, sizeof(*uri));
+		rspamd_url_copy_ext(uri, pool);
+
+		return elt->rc;
+	}
+
+	elt = rspamd_mempool_alloc_type(pool, struct rspamd_url_parse_memo);
+
+	if (url_scanner && url_scanner->intern_max > 0 &&
+		rspamd_url_intern_lookup(key, uri, uristring, pool)) {
+		elt->rc = URI_ERRNO_OK;
 	}
+	else {
+		elt->rc = rspamd_url_parse(uri, uristring, len, pool, parse_flags);
 
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
+		/* Only successfully parsed urls are shared, errors are cheap */
+		if (elt->rc == URI_ERRNO_OK && url_scanner && url_scanner->intern_max > 0) {
+			rspamd_url_intern_insert(key, uri);
 		}
 	}
 
-	return 0;
+	if (g_hash_table_size(memo) < url_parse_memo_max) {
+		/* Callers modify urls, so memo keeps its own copy */
+		memcpy(&elt->url, uri, sizeof(*uri));
+		rspamd_url_copy_ext(&elt->url, pool);
+		g_hash_table_insert(memo, key, elt);
+	}
+
+	return elt->rc;
 }
 
 gboolean
 rspamd_url_find_tld(const char *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
-
 	g_assert(in != NULL);
 	g_assert(out != NULL);
 	g_assert(url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	if (url_scanner->search_trie_full) {
-		rspamd_multipattern_lookup(url_scanner->search_trie_full, in, inlen,
-								   rspamd_tld_trie_find_callback, &cbdata, NULL);
+	if (url_scanner->tld_trie) {
+		out->len = rspamd_domain_trie_esld(url_scanner->tld_trie, in, inlen);
+
+		if (out->len > 0) {
+			if (in[inlen - 1] == '.') {
+				inlen--;
+			}
+
+			out->begin = in + inlen - out->len;
+		}
 	}
 
 	if (out->len > 0) {
@@ -3388,9 +3594,9 @@ rspamd_url_trie_generic_callback_common(struct rspamd_multipattern *mp,
 
 		url = rspamd_mempool_alloc0(pool, sizeof(struct rspamd_url));
 		g_strstrip(cb->url_str);
-		rc = rspamd_url_parse(url, cb->url_str,
-							  strlen(cb->url_str), pool,
-							  RSPAMD_URL_PARSE_TEXT);
+		rc = rspamd_url_parse_cached(url, cb->url_str,
+									 strlen(cb->url_str), pool,
+									 RSPAMD_URL_PARSE_TEXT);
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
 			if (cb->prefix_added) {
@@ -3728,11 +3934,11 @@ rspamd_url_task_subject_callback(struct rspamd_url *url, gsize start_offset,
 
 			query_url = rspamd_mempool_alloc0(task->task_pool,
 											  sizeof(struct rspamd_url));
-			rc = rspamd_url_parse(query_url,
-								  url_str,
-								  strlen(url_str),
-								  task->task_pool,
-								  RSPAMD_URL_PARSE_TEXT);
+			rc = rspamd_url_parse_cached(query_url,
+										 url_str,
+										 strlen(url_str),
+										 task->task_pool,
+										 RSPAMD_URL_PARSE_TEXT);
 
 			if (rc == URI_ERRNO_OK &&
 				url->hostlen > 0) {
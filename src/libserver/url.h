@@ -192,6 +192,24 @@ enum uri_errno rspamd_url_parse(struct rspamd_url *uri,
 								rspamd_mempool_t *pool,
 								enum rspamd_url_parse_flags flags);
 
+/*
+ * Same as rspamd_url_parse but results are memoized in the pool, so the same
+ * url found in many places of a task (text and html parts, queries) is parsed
+ * and normalised once; hot urls could also be shared between tasks,
+ * see rspamd_url_set_intern_size
+ */
+enum uri_errno rspamd_url_parse_cached(struct rspamd_url *uri,
+									   char *uristring,
+									   gsize len,
+									   rspamd_mempool_t *pool,
+									   enum rspamd_url_parse_flags flags);
+
+/*
+ * Sets maximum number of successfully parsed urls shared between all tasks of
+ * a process by rspamd_url_parse_cached (0 disables sharing)
+ */
+void rspamd_url_set_intern_size(unsigned int nelts);
+
 /*
  * Try to extract url from a text
  * @param pool memory pool
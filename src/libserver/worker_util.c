@@ -16,6 +16,7 @@
 #include "config.h"
 #include "rspamd.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "worker_util.h"
 #include "unix-std.h"
 #include "utlist.h"
@@ -26,6 +27,10 @@
 #include "libserver/http/http_private.h"
 #include "libserver/http/http_router.h"
 #include "libutil/rrd.h"
+#include "libutil/timer_wheel.h"
+#include "libutil/cxx/cpu_pool.h"
+#include "libserver/tracing.h"
+#include "libcryptobox/cryptobox.h"
 
 /* sys/resource.h */
 #ifdef HAVE_SYS_RESOURCE_H
@@ -58,11 +63,20 @@
 #include "contrib/libev/ev.h"
 #include "libstat/stat_api.h"
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 struct rspamd_worker *rspamd_current_worker = NULL;
+/* Statistics for tasks processed outside of workers */
+static struct rspamd_stat *standalone_stat = NULL;
 
 /* Forward declaration */
 static void rspamd_worker_heartbeat_start(struct rspamd_worker *,
 										  struct ev_loop *);
+static void rspamd_worker_memory_watch_start(struct rspamd_worker *,
+											 struct ev_loop *);
 
 static void rspamd_worker_ignore_signal(struct rspamd_worker_signal_handler *);
 /**
@@ -166,7 +180,8 @@ static void
 rspamd_worker_terminate_handlers(struct rspamd_worker *w)
 {
 	if (w->nconns == 0 &&
-		(!(w->flags & RSPAMD_WORKER_SCANNER) || w->srv->cfg->on_term_scripts == NULL)) {
+		(!(w->flags & (RSPAMD_WORKER_SCANNER | RSPAMD_WORKER_EXPORTER)) ||
+		 w->srv->cfg->on_term_scripts == NULL)) {
 		/*
 		 * We are here either:
 		 * - No active connections are represented
@@ -189,7 +204,7 @@ rspamd_worker_terminate_handlers(struct rspamd_worker *w)
 			if (w->state != rspamd_worker_wait_final_scripts) {
 				w->state = rspamd_worker_wait_final_scripts;
 
-				if ((w->flags & RSPAMD_WORKER_SCANNER) &&
+				if ((w->flags & (RSPAMD_WORKER_SCANNER | RSPAMD_WORKER_EXPORTER)) &&
 					rspamd_worker_call_finish_handlers(w)) {
 					msg_info("performing async finishing actions");
 					w->state = rspamd_worker_wait_final_scripts;
@@ -509,6 +524,76 @@ void rspamd_worker_init_signals(struct rspamd_worker *worker,
 }
 
 
+/* How often a worker spawned on reload checks whether it is warmed up */
+#define WARMUP_CHECK_INTERVAL 0.5
+
+static void
+rspamd_worker_start_accept(struct rspamd_worker *worker)
+{
+	struct rspamd_worker_accept_event *cur;
+
+	DL_FOREACH(worker->accept_events, cur)
+	{
+		if (!ev_is_active(&cur->accept_ev)) {
+			ev_io_start(cur->event_loop, &cur->accept_ev);
+		}
+	}
+}
+
+static void
+rspamd_worker_warmup_check(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
+	struct rspamd_main *rspamd_main = worker->srv;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_srv_command cmd;
+	unsigned int pending_maps;
+	gboolean hs_ready = TRUE, timed_out;
+	double elapsed;
+
+	if (worker->state != rspamd_worker_state_running) {
+		/* Worker is terminating, it will never accept anything */
+		ev_timer_stop(EV_A_ w);
+		return;
+	}
+
+	pending_maps = rspamd_map_pending_count(cfg);
+#ifdef WITH_HYPERSCAN
+	if (!cfg->disable_hyperscan) {
+		enum rspamd_hyperscan_status hs_status = rspamd_re_cache_is_hs_loaded(cfg->re_cache);
+
+		hs_ready = hs_status == RSPAMD_HYPERSCAN_LOADED_FULL ||
+				   hs_status == RSPAMD_HYPERSCAN_UNSUPPORTED;
+	}
+#endif
+	elapsed = rspamd_get_calendar_ticks() - worker->start_time;
+	timed_out = elapsed >= cfg->reload_warmup_timeout;
+
+	if ((pending_maps > 0 || !hs_ready) && !timed_out) {
+		return;
+	}
+
+	ev_timer_stop(EV_A_ w);
+	worker->flags &= ~RSPAMD_WORKER_WARMING;
+	rspamd_worker_start_accept(worker);
+
+	if (timed_out) {
+		msg_warn_main("start accepting connections without warm-up: %ud maps are not loaded, "
+					  "hyperscan is %s",
+					  pending_maps, hs_ready ? "ready" : "not ready");
+	}
+	else {
+		msg_info_main("warmed up in %.2f sec, start accepting connections", elapsed);
+	}
+
+	/* Let the main process stop old workers */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = RSPAMD_SRV_WARMED_UP;
+	cmd.cmd.warmed_up.pending_maps = pending_maps;
+	cmd.cmd.warmed_up.timed_out = timed_out;
+	rspamd_srv_send_command(worker, EV_A, &cmd, -1, NULL, NULL);
+}
+
 struct ev_loop *
 rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 					  rspamd_accept_handler hdl)
@@ -522,12 +607,15 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 												  NULL, rspamd_sigh_free);
 
 	event_loop = ev_loop_new(rspamd_config_ev_backend_get(worker->srv->cfg));
+	/* IO timeouts of the worker are served by a single timer */
+	rspamd_timer_wheel_attach(event_loop);
 
 	worker->srv->event_loop = event_loop;
 
 	rspamd_worker_init_signals(worker, event_loop);
 	rspamd_control_worker_add_default_cmd_handlers(worker, event_loop);
 	rspamd_worker_heartbeat_start(worker, event_loop);
+	rspamd_worker_memory_watch_start(worker, event_loop);
 	rspamd_redis_pool_config(worker->srv->cfg->redis_pool,
 							 worker->srv->cfg, event_loop);
 
@@ -543,7 +631,10 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 				accept_ev->event_loop = event_loop;
 				accept_ev->accept_ev.data = worker;
 				ev_io_init(&accept_ev->accept_ev, hdl, ls->fd, EV_READ);
-				ev_io_start(event_loop, &accept_ev->accept_ev);
+
+				if (!(worker->flags & RSPAMD_WORKER_WARMING)) {
+					ev_io_start(event_loop, &accept_ev->accept_ev);
+				}
 
 				DL_APPEND(worker->accept_events, accept_ev);
 			}
@@ -552,6 +643,16 @@ rspamd_prepare_worker(struct rspamd_worker *worker, const char *name,
 		}
 	}
 
+	if (worker->flags & RSPAMD_WORKER_WARMING) {
+		/* Listen sockets are shared, so old workers accept until we are ready */
+		static ev_timer warmup_ev;
+
+		warmup_ev.data = worker;
+		ev_timer_init(&warmup_ev, rspamd_worker_warmup_check,
+					  WARMUP_CHECK_INTERVAL, WARMUP_CHECK_INTERVAL);
+		ev_timer_start(event_loop, &warmup_ev);
+	}
+
 	return event_loop;
 }
 
@@ -717,6 +818,47 @@ void rspamd_controller_send_ucl(struct rspamd_http_connection_entry *entry,
 	entry->is_reply = TRUE;
 }
 
+void rspamd_controller_send_cached_json(struct rspamd_http_connection_entry *entry,
+										struct rspamd_http_message *req,
+										const rspamd_fstring_t *body)
+{
+	struct rspamd_http_message *msg;
+	const rspamd_ftok_t *inm;
+	char etag[32];
+	int r;
+
+	r = rspamd_snprintf(etag, sizeof(etag), "\"%xL\"",
+						rspamd_cryptobox_fast_hash(body->str, body->len, 0));
+	inm = rspamd_http_message_find_header(req, "If-None-Match");
+
+	msg = rspamd_http_new_message(HTTP_RESPONSE);
+	msg->date = time(NULL);
+	rspamd_http_message_add_header(msg, "ETag", etag);
+
+	if (inm && inm->len == r && memcmp(inm->begin, etag, r) == 0) {
+		/* Client already has this version */
+		msg->code = 304;
+		msg->status = rspamd_fstring_new_init("Not Modified", sizeof("Not Modified") - 1);
+	}
+	else {
+		msg->code = 200;
+		msg->status = rspamd_fstring_new_init("OK", 2);
+		rspamd_http_message_set_body_from_fstring_steal(msg,
+														rspamd_controller_maybe_compress(entry,
+																						 rspamd_fstring_new_init(body->str, body->len), msg));
+	}
+
+	rspamd_http_connection_reset(entry->conn);
+	rspamd_http_router_insert_headers(entry->rt, msg);
+	rspamd_http_connection_write_message(entry->conn,
+										 msg,
+										 NULL,
+										 "application/json",
+										 entry,
+										 entry->rt->timeout);
+	entry->is_reply = TRUE;
+}
+
 static void
 rspamd_worker_drop_priv(struct rspamd_main *rspamd_main)
 {
@@ -887,6 +1029,255 @@ rspamd_worker_heartbeat_start(struct rspamd_worker *wrk, struct ev_loop *event_l
 	ev_timer_start(event_loop, &wrk->hb.heartbeat_ev);
 }
 
+#define MEMORY_CHECK_INTERVAL 1.0
+/* Degraded mode is left when memory usage drops this much below the threshold */
+#define MEMORY_PRESSURE_HYSTERESIS 0.05
+/* cgroup v1 reports a huge number when there is no limit */
+#define MEMORY_CGROUP_UNLIMITED (1ULL << 60)
+
+struct rspamd_worker_memory_watch {
+	struct rspamd_worker *worker;
+	ev_timer ev;
+	uint64_t limit;  /* limit for the worker itself, 0 if not set */
+	char *cg_dir;    /* memory cgroup directory, NULL if there is no limit */
+	uint64_t cg_limit;
+	gboolean cg_v2;
+};
+
+static gboolean
+rspamd_worker_read_uint64(const char *path, uint64_t *val)
+{
+	char buf[64], *end;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (r <= 0) {
+		return FALSE;
+	}
+
+	buf[r] = '\0';
+	/* cgroup v2 uses `max` when there is no limit, so it is not a number */
+	*val = strtoull(buf, &end, 10);
+
+	return end != buf;
+}
+
+static gboolean
+rspamd_worker_cgroup_try(struct rspamd_worker_memory_watch *mw,
+						 const char *dir, gboolean v2)
+{
+	char path[PATH_MAX];
+	uint64_t limit;
+
+	rspamd_snprintf(path, sizeof(path), "%s/%s", dir,
+					v2 ? "memory.max" : "memory.limit_in_bytes");
+
+	if (!rspamd_worker_read_uint64(path, &limit) || limit == 0 ||
+		limit >= MEMORY_CGROUP_UNLIMITED) {
+		return FALSE;
+	}
+
+	mw->cg_dir = g_strdup(dir);
+	mw->cg_limit = limit;
+	mw->cg_v2 = v2;
+
+	return TRUE;
+}
+
+/* Finds memory cgroup of the process if it has a limit set */
+static gboolean
+rspamd_worker_cgroup_find(struct rspamd_worker_memory_watch *mw)
+{
+	char line[PATH_MAX], dir[PATH_MAX], *cgpath, *controllers;
+	gboolean found = FALSE;
+	FILE *fp;
+
+	fp = fopen("/proc/self/cgroup", "r");
+
+	if (fp == NULL) {
+		return FALSE;
+	}
+
+	/* Lines look like `id:controllers:path`, controllers are empty for cgroup v2 */
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		g_strchomp(line);
+		controllers = strchr(line, ':');
+
+		if (controllers == NULL || (cgpath = strchr(controllers + 1, ':')) == NULL) {
+			continue;
+		}
+
+		*cgpath++ = '\0';
+		controllers++;
+
+		if (*controllers == '\0') {
+			rspamd_snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", cgpath);
+			/* Inside of a container the own cgroup is usually mounted as root */
+			found = rspamd_worker_cgroup_try(mw, dir, TRUE) ||
+					rspamd_worker_cgroup_try(mw, "/sys/fs/cgroup", TRUE);
+		}
+		else if (strstr(controllers, "memory") != NULL) {
+			rspamd_snprintf(dir, sizeof(dir), "/sys/fs/cgroup/memory%s", cgpath);
+			found = rspamd_worker_cgroup_try(mw, dir, FALSE) ||
+					rspamd_worker_cgroup_try(mw, "/sys/fs/cgroup/memory", FALSE);
+		}
+	}
+
+	fclose(fp);
+
+	return found;
+}
+
+/* Memory of the cgroup without inactive page cache, as the kernel can reclaim it */
+static gboolean
+rspamd_worker_cgroup_usage(struct rspamd_worker_memory_watch *mw, uint64_t *usage)
+{
+	char path[PATH_MAX], line[256];
+	const char *inactive_key = mw->cg_v2 ? "inactive_file " : "total_inactive_file ";
+	uint64_t inactive = 0;
+	FILE *fp;
+
+	rspamd_snprintf(path, sizeof(path), "%s/%s", mw->cg_dir,
+					mw->cg_v2 ? "memory.current" : "memory.usage_in_bytes");
+
+	if (!rspamd_worker_read_uint64(path, usage)) {
+		return FALSE;
+	}
+
+	rspamd_snprintf(path, sizeof(path), "%s/memory.stat", mw->cg_dir);
+	fp = fopen(path, "r");
+
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if (g_str_has_prefix(line, inactive_key)) {
+				inactive = strtoull(line + strlen(inactive_key), NULL, 10);
+				break;
+			}
+		}
+
+		fclose(fp);
+	}
+
+	*usage = *usage > inactive ? *usage - inactive : 0;
+
+	return TRUE;
+}
+
+/* Resident memory of the process, Lua heap is used where it is not available */
+static uint64_t
+rspamd_worker_memory_usage(struct rspamd_worker *wrk)
+{
+	lua_State *L = (lua_State *) wrk->srv->cfg->lua_state;
+#ifdef __linux__
+	char buf[128];
+	unsigned long long size, resident;
+	ssize_t r;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY);
+
+	if (fd != -1) {
+		r = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+
+		if (r > 0) {
+			buf[r] = '\0';
+
+			if (sscanf(buf, "%llu %llu", &size, &resident) == 2) {
+				return (uint64_t) resident * getpagesize();
+			}
+		}
+	}
+#endif
+
+	return L ? (uint64_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024 : 0;
+}
+
+static void
+rspamd_worker_memory_check(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_memory_watch *mw = (struct rspamd_worker_memory_watch *) w->data;
+	struct rspamd_worker *wrk = mw->worker;
+	struct rspamd_main *rspamd_main = wrk->srv;
+	struct rspamd_stat *stat = rspamd_main_local_stat(rspamd_main);
+	double threshold = wrk->cf->memory_pressure, used = 0.0;
+	uint64_t usage;
+
+	if (mw->limit > 0) {
+		used = rspamd_worker_memory_usage(wrk) / (double) mw->limit;
+	}
+
+	if (mw->cg_dir && rspamd_worker_cgroup_usage(mw, &usage)) {
+		used = MAX(used, usage / (double) mw->cg_limit);
+	}
+
+	if (!wrk->memory_pressure && used >= threshold) {
+		lua_State *L = (lua_State *) rspamd_main->cfg->lua_state;
+
+		wrk->memory_pressure = TRUE;
+		wrk->pressure_conns = wrk->nconns;
+		stat->workers_degraded = 1;
+		RSPAMD_STAT_INC(stat, memory_pressure_events);
+		msg_warn_main("memory usage is %.1f%% of the limit, skip optional checks "
+					  "and reduce concurrency until it drops",
+					  used * 100.0);
+
+		/* Garbage is returned at once, so the recovery is faster */
+		if (L) {
+			lua_gc(L, LUA_GCCOLLECT, 0);
+		}
+	}
+	else if (wrk->memory_pressure && used < threshold - MEMORY_PRESSURE_HYSTERESIS) {
+		wrk->memory_pressure = FALSE;
+		stat->workers_degraded = 0;
+		msg_info_main("memory usage is %.1f%% of the limit, leave degraded mode",
+					  used * 100.0);
+	}
+}
+
+static void
+rspamd_worker_memory_watch_start(struct rspamd_worker *wrk, struct ev_loop *event_loop)
+{
+	static struct rspamd_worker_memory_watch mw;
+	struct rspamd_main *rspamd_main = wrk->srv;
+
+	if (wrk->cf == NULL || wrk->cf->memory_pressure <= 0) {
+		return;
+	}
+
+	memset(&mw, 0, sizeof(mw));
+	mw.worker = wrk;
+	mw.limit = wrk->cf->max_memory;
+
+	if (mw.limit == 0 && !rspamd_worker_cgroup_find(&mw)) {
+		/* Nothing to watch for */
+		return;
+	}
+
+	if (mw.cg_dir) {
+		msg_info_main("degrade at %.1f%% of the memory limit of cgroup %s: %HL",
+					  wrk->cf->memory_pressure * 100.0, mw.cg_dir, mw.cg_limit);
+	}
+	else {
+		msg_info_main("degrade at %.1f%% of the memory limit: %HL",
+					  wrk->cf->memory_pressure * 100.0, mw.limit);
+	}
+
+	mw.ev.data = &mw;
+	ev_timer_init(&mw.ev, rspamd_worker_memory_check,
+				  MEMORY_CHECK_INTERVAL, MEMORY_CHECK_INTERVAL);
+	ev_timer_start(event_loop, &mw.ev);
+}
+
 static void
 rspamd_main_heartbeat_cb(EV_P_ ev_timer *w, int revents)
 {
@@ -992,8 +1383,174 @@ rspamd_main_heartbeat_start(struct rspamd_worker *wrk, struct ev_loop *event_loo
 	ev_timer_start(event_loop, &wrk->hb.heartbeat_ev);
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Appends allowed cpus from a sysfs cpulist, e.g. `0-7,16-23` */
+static void
+rspamd_worker_parse_cpulist(const char *str, const cpu_set_t *allowed,
+							GArray *out)
+{
+	char *end;
+	unsigned long first, last, cpu;
+
+	while (*str) {
+		first = strtoul(str, &end, 10);
+
+		if (end == str) {
+			break;
+		}
+
+		last = first;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 10);
+
+			if (end == str) {
+				break;
+			}
+		}
+
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, allowed)) {
+				int icpu = cpu;
+				g_array_append_val(out, icpu);
+			}
+		}
+
+		if (*end != ',') {
+			break;
+		}
+
+		str = end + 1;
+	}
+}
+
+/*
+ * Returns cpus allowed for the process interleaved over NUMA nodes, so
+ * consequent workers are spread over all nodes
+ */
+static GArray *
+rspamd_worker_numa_cpus(void)
+{
+	cpu_set_t allowed;
+	GPtrArray *nodes = g_ptr_array_new_full(2, (GDestroyNotify) rspamd_array_free_hard);
+	GArray *res = g_array_new(FALSE, FALSE, sizeof(int));
+	GArray *node_cpus;
+	char path[PATH_MAX], *contents;
+	unsigned int i, round;
+	gboolean added;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		g_ptr_array_free(nodes, TRUE);
+
+		return res;
+	}
+
+	for (i = 0;; i++) {
+		rspamd_snprintf(path, sizeof(path),
+						"/sys/devices/system/node/node%ud/cpulist", i);
+
+		if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+			break;
+		}
+
+		node_cpus = g_array_new(FALSE, FALSE, sizeof(int));
+		rspamd_worker_parse_cpulist(contents, &allowed, node_cpus);
+		g_free(contents);
+		g_ptr_array_add(nodes, node_cpus);
+	}
+
+	if (nodes->len == 0) {
+		/* No NUMA information, use all allowed cpus */
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &allowed)) {
+				int icpu = i;
+				g_array_append_val(res, icpu);
+			}
+		}
+	}
+	else {
+		for (round = 0;; round++) {
+			added = FALSE;
+
+			PTR_ARRAY_FOREACH(nodes, i, node_cpus)
+			{
+				if (round < node_cpus->len) {
+					g_array_append_val(res, g_array_index(node_cpus, int, round));
+					added = TRUE;
+				}
+			}
+
+			if (!added) {
+				break;
+			}
+		}
+	}
+
+	g_ptr_array_free(nodes, TRUE);
+
+	return res;
+}
+#endif
+
+/*
+ * Pins a worker to a single cpu and makes its memory allocations local to
+ * the NUMA node of that cpu, returns the cpu or -1
+ */
+static int
+rspamd_worker_set_affinity(struct rspamd_main *rspamd_main,
+						   struct rspamd_worker *wrk,
+						   struct rspamd_worker_conf *cf)
+{
+	if (!cf->cpu_affinity) {
+		return -1;
+	}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	GArray *cpus = rspamd_worker_numa_cpus();
+	cpu_set_t set;
+	int cpu;
+
+	if (cpus->len == 0) {
+		msg_warn_main("cannot get cpus to pin %s worker to", cf->worker->name);
+		g_array_free(cpus, TRUE);
+
+		return -1;
+	}
+
+	cpu = g_array_index(cpus, int, wrk->index % cpus->len);
+	g_array_free(cpus, TRUE);
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		msg_warn_main("cannot pin %s worker to cpu %d: %s",
+					  cf->worker->name, cpu, strerror(errno));
+
+		return -1;
+	}
+
+#if defined(SYS_set_mempolicy)
+	/* MPOL_LOCAL: allocate on the node of the cpu we are running on */
+	if (syscall(SYS_set_mempolicy, 4, NULL, 0) == -1) {
+		msg_info_main("cannot set local memory policy: %s", strerror(errno));
+	}
+#endif
+
+	msg_info_main("pinned %s worker %ud to cpu %d", cf->worker->name,
+				  wrk->index, cpu);
+
+	return cpu;
+#else
+	msg_warn_main("cpu affinity is not supported on this platform");
+
+	return -1;
+#endif
+}
+
 static bool
-rspamd_maybe_reuseport_socket(struct rspamd_worker_listen_socket *ls)
+rspamd_maybe_reuseport_socket(struct rspamd_worker_listen_socket *ls, int cpu)
 {
 	if (ls->is_systemd) {
 		/* No need to reuseport */
@@ -1030,6 +1587,14 @@ rspamd_maybe_reuseport_socket(struct rspamd_worker_listen_socket *ls)
 			}
 			ls->fd = nfd;
 			nfd = -1;
+
+#ifdef SO_INCOMING_CPU
+			if (cpu >= 0 &&
+				setsockopt(ls->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+				msg_info("cannot set SO_INCOMING_CPU for %d: %s",
+						 ls->fd, strerror(errno));
+			}
+#endif
 		}
 	}
 	else {
@@ -1076,6 +1641,10 @@ rspamd_handle_child_fork(struct rspamd_worker *wrk,
 	rspamd_log_on_fork(cf->type, rspamd_main->cfg, rspamd_main->logger);
 	wrk->pid = getpid();
 
+	if (wrk->stat_slot >= 0) {
+		rspamd_main->local_stat = &rspamd_main->stat_slots[wrk->stat_slot].st;
+	}
+
 	/* Init PRNG after fork */
 	rc = ottery_init(rspamd_main->cfg->libs_ctx->ottery_cfg);
 	if (rc != OTTERY_ERR_NONE) {
@@ -1136,6 +1705,9 @@ rspamd_handle_child_fork(struct rspamd_worker *wrk,
 		}
 	}
 
+	/* Pin a worker before creating reuseport sockets to steer them to its cpu */
+	int cpu = rspamd_worker_set_affinity(rspamd_main, wrk, cf);
+
 	/* Reuseport before dropping privs */
 	GList *cur = cf->listen_socks;
 
@@ -1143,7 +1715,7 @@ rspamd_handle_child_fork(struct rspamd_worker *wrk,
 		struct rspamd_worker_listen_socket *ls =
 			(struct rspamd_worker_listen_socket *) cur->data;
 
-		if (!rspamd_maybe_reuseport_socket(ls)) {
+		if (!rspamd_maybe_reuseport_socket(ls, cpu)) {
 			msg_err("cannot listen on socket %s: %s",
 					rspamd_inet_address_to_string_pretty(ls->addr),
 					strerror(errno));
@@ -1323,10 +1895,18 @@ rspamd_fork_worker(struct rspamd_main *rspamd_main,
 	wrk->type = cf->type;
 	wrk->cf = cf;
 	wrk->flags = cf->worker->flags;
+
+	if (rspamd_main->spawn_warming &&
+		(wrk->flags & (RSPAMD_WORKER_HAS_SOCKET | RSPAMD_WORKER_SCANNER)) ==
+			(RSPAMD_WORKER_HAS_SOCKET | RSPAMD_WORKER_SCANNER)) {
+		wrk->flags |= RSPAMD_WORKER_WARMING;
+	}
+
 	REF_RETAIN(cf);
 	wrk->index = index;
 	wrk->ctx = cf->ctx;
 	wrk->ppid = getpid();
+	wrk->stat_slot = rspamd_main_stat_acquire_slot(rspamd_main);
 	wrk->pid = fork();
 	wrk->cores_throttled = rspamd_main->cores_throttling;
 	wrk->term_handler = term_handler;
@@ -1348,6 +1928,10 @@ rspamd_fork_worker(struct rspamd_main *rspamd_main,
 		rspamd_hard_terminate(rspamd_main);
 		break;
 	default:
+		if (wrk->stat_slot >= 0) {
+			rspamd_main->stat_slots[wrk->stat_slot].pid = wrk->pid;
+		}
+
 		rspamd_handle_main_fork(wrk, rspamd_main, cf, ev_base);
 		break;
 	}
@@ -1789,6 +2373,8 @@ rspamd_check_termination_clause(struct rspamd_main *rspamd_main,
 {
 	gboolean need_refork = TRUE;
 
+	rspamd_main_stat_release_slot(rspamd_main, wrk);
+
 	if (wrk->state != rspamd_worker_state_running || rspamd_main->wanna_die ||
 		(wrk->flags & RSPAMD_WORKER_OLD_CONFIG)) {
 		/* Do not refork workers that are intended to be terminated */
@@ -1913,8 +2499,20 @@ rspamd_worker_hyperscan_ready(struct rspamd_main *rspamd_main,
 		msg_info("loading hyperscan expressions after receiving compilation "
 				 "notice: %s",
 				 (rspamd_re_cache_is_hs_loaded(cache) != RSPAMD_HYPERSCAN_LOADED_FULL) ? "new db" : "forced update");
-		rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan(
-			worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir, false);
+
+		if (worker->cpu_pool) {
+			/* Batched scans in threads use the current databases */
+			rspamd_cpu_pool_wait(worker->cpu_pool);
+		}
+
+		rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan_bundle(
+			worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir,
+			attached_fd, false);
+	}
+
+	if (attached_fd != -1) {
+		/* Loaded databases keep their own mapping of the bundle */
+		close(attached_fd);
 	}
 
 	if (write(fd, &rep, sizeof(rep)) != sizeof(rep)) {
@@ -1949,12 +2547,27 @@ rspamd_worker_log_pipe_handler(struct rspamd_main *rspamd_main,
 	rep.type = RSPAMD_CONTROL_LOG_PIPE;
 
 	if (attached_fd != -1) {
-		lp = g_malloc0(sizeof(*lp));
-		lp->fd = attached_fd;
-		lp->type = cmd->cmd.log_pipe.type;
+		/* A restarted peer sends a new pipe that replaces the old one */
+		DL_FOREACH(cfg->log_pipes, lp)
+		{
+			if (lp->type == cmd->cmd.log_pipe.type) {
+				break;
+			}
+		}
+
+		if (lp != NULL) {
+			close(lp->fd);
+			lp->fd = attached_fd;
+			msg_info("replaced log pipe");
+		}
+		else {
+			lp = g_malloc0(sizeof(*lp));
+			lp->fd = attached_fd;
+			lp->type = cmd->cmd.log_pipe.type;
 
-		DL_APPEND(cfg->log_pipes, lp);
-		msg_info("added new log pipe");
+			DL_APPEND(cfg->log_pipes, lp);
+			msg_info("added new log pipe");
+		}
 	}
 	else {
 		rep.reply.log_pipe.status = ENOENT;
@@ -1969,6 +2582,62 @@ rspamd_worker_log_pipe_handler(struct rspamd_main *rspamd_main,
 	return TRUE;
 }
 
+static struct rspamd_worker_log_pipe *
+rspamd_worker_export_pipe(struct rspamd_config *cfg)
+{
+	struct rspamd_worker_log_pipe *lp;
+
+	DL_FOREACH(cfg->log_pipes, lp)
+	{
+		if (lp->type == RSPAMD_LOG_PIPE_EXPORT && lp->fd != -1) {
+			return lp;
+		}
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_worker_has_exporter(struct rspamd_config *cfg)
+{
+	return rspamd_worker_export_pipe(cfg) != NULL;
+}
+
+gboolean
+rspamd_worker_export_record(struct rspamd_config *cfg,
+							const char *name,
+							const void *data, gsize len)
+{
+	struct rspamd_worker_log_pipe *lp;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	lp = rspamd_worker_export_pipe(cfg);
+
+	if (lp == NULL) {
+		return FALSE;
+	}
+
+	/* Each record is a single datagram: zero terminated name followed by data */
+	iov[0].iov_base = (void *) name;
+	iov[0].iov_len = strlen(name) + 1;
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = G_N_ELEMENTS(iov);
+
+	if (sendmsg(lp->fd, &msg, MSG_DONTWAIT) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+			msg_info_config("cannot send export record: %s", strerror(errno));
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_worker_monitored_handler(struct rspamd_main *rspamd_main,
 								struct rspamd_worker *worker, int fd,
@@ -2029,14 +2698,193 @@ void rspamd_worker_init_scanner(struct rspamd_worker *worker,
 										  RSPAMD_CONTROL_MONITORED_CHANGE,
 										  rspamd_worker_monitored_handler,
 										  worker->srv->cfg);
+	rspamd_tracing_init(worker->srv->cfg, ev_base);
+
+	rspamd_lua_gc_scheduler_init(worker->srv->cfg, ev_base);
+
+	if (worker->srv->cfg->lua_thread_pool && worker->srv->cfg->lua_threads_prewarm > 0) {
+		lua_thread_pool_prewarm((struct lua_thread_pool *) worker->srv->cfg->lua_thread_pool,
+								worker->srv->cfg->lua_threads_prewarm);
+	}
 
 	*plang_det = worker->srv->cfg->lang_det;
 }
 
+/* Applies `op` to every counter of statistics, average times are not counters */
+#define RSPAMD_STAT_FOREACH_COUNTER(dst, src, op)                               \
+	do {                                                                        \
+		op((dst)->messages_scanned, (src)->messages_scanned);                   \
+		op((dst)->connections_count, (src)->connections_count);                 \
+		op((dst)->control_connections_count, (src)->control_connections_count); \
+		op((dst)->messages_learned, (src)->messages_learned);                   \
+		op((dst)->messages_degraded, (src)->messages_degraded);                 \
+		op((dst)->memory_pressure_events, (src)->memory_pressure_events);       \
+		for (unsigned int _k = 0; _k < METRIC_ACTION_MAX; _k++) {               \
+			op((dst)->actions_stat[_k], (src)->actions_stat[_k]);               \
+		}                                                                       \
+		for (unsigned int _k = 0; _k < RSPAMD_STAT_HIST_MAX; _k++) {            \
+			op((dst)->hist[_k].sum, (src)->hist[_k].sum);                       \
+			for (unsigned int _b = 0; _b < RSPAMD_STAT_HIST_BUCKETS; _b++) {    \
+				op((dst)->hist[_k].buckets[_b], (src)->hist[_k].buckets[_b]);   \
+			}                                                                   \
+		}                                                                       \
+	} while (0)
+
+#define RSPAMD_STAT_PLAIN_ADD(dst, src) (dst) += (src)
+#define RSPAMD_STAT_PLAIN_SUB(dst, src) (dst) -= (src)
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_STAT_ATOMIC_ADD(dst, src) __atomic_add_fetch(&(dst), (src), __ATOMIC_RELAXED)
+#define RSPAMD_STAT_ATOMIC_SUB(dst, src) __atomic_sub_fetch(&(dst), (src), __ATOMIC_RELAXED)
+#else
+#define RSPAMD_STAT_ATOMIC_ADD(dst, src) (dst) += (src)
+#define RSPAMD_STAT_ATOMIC_SUB(dst, src) (dst) -= (src)
+#endif
+
+struct rspamd_stat *
+rspamd_main_local_stat(struct rspamd_main *rspamd_main)
+{
+	if (rspamd_main->local_stat) {
+		return rspamd_main->local_stat;
+	}
+
+	return rspamd_main->stat;
+}
+
+static void
+rspamd_main_stat_merge_avg(struct rspamd_avg_time *out,
+						   const struct rspamd_avg_time **srcs,
+						   unsigned int nsrcs)
+{
+	unsigned int filled = 0;
+
+	/* Take the most recent samples from all sources in turn */
+	for (unsigned int k = 0; k < MAX_AVG_TIME_SLOTS && filled < MAX_AVG_TIME_SLOTS; k++) {
+		for (unsigned int i = 0; i < nsrcs && filled < MAX_AVG_TIME_SLOTS; i++) {
+			uint32_t cur = __atomic_load_n(&srcs[i]->cur_slot, __ATOMIC_RELAXED);
+			float v;
+
+			if (k >= cur) {
+				continue;
+			}
+
+			v = srcs[i]->avg_time[(cur - 1 - k) % MAX_AVG_TIME_SLOTS];
+
+			if (!isnan(v)) {
+				out->avg_time[filled++] = v;
+			}
+		}
+	}
+
+	out->cur_slot = filled;
+
+	for (; filled < MAX_AVG_TIME_SLOTS; filled++) {
+		out->avg_time[filled] = NAN;
+	}
+}
+
+void rspamd_main_stat_snapshot(struct rspamd_main *rspamd_main,
+							   struct rspamd_stat *out)
+{
+	const struct rspamd_avg_time *avgs[RSPAMD_STAT_MAX_SLOTS + 1];
+	unsigned int navgs = 0;
+
+	memcpy(out, rspamd_main->stat, sizeof(*out));
+
+	if (rspamd_main->stat_slots == NULL) {
+		return;
+	}
+
+	avgs[navgs++] = &rspamd_main->stat->avg_time;
+
+	for (unsigned int i = 0; i < RSPAMD_STAT_MAX_SLOTS; i++) {
+		const struct rspamd_stat_slot *slot = &rspamd_main->stat_slots[i];
+
+		if (slot->pid == 0) {
+			continue;
+		}
+
+		RSPAMD_STAT_FOREACH_COUNTER(out, &slot->st, RSPAMD_STAT_PLAIN_ADD);
+		out->workers_degraded += slot->st.workers_degraded;
+		avgs[navgs++] = &slot->st.avg_time;
+	}
+
+	rspamd_main_stat_merge_avg(&out->avg_time, avgs, navgs);
+}
+
+void rspamd_main_stat_reset(struct rspamd_main *rspamd_main,
+							const struct rspamd_stat *seen)
+{
+	/*
+	 * Workers own their slots, so instead of clearing them we move the common
+	 * part below zero by the totals that have been observed
+	 */
+	RSPAMD_STAT_FOREACH_COUNTER(rspamd_main->stat, seen, RSPAMD_STAT_ATOMIC_SUB);
+}
+
+int rspamd_main_stat_acquire_slot(struct rspamd_main *rspamd_main)
+{
+	if (rspamd_main->stat_slots == NULL) {
+		return -1;
+	}
+
+	for (int i = 0; i < RSPAMD_STAT_MAX_SLOTS; i++) {
+		if (rspamd_main->stat_slots[i].pid == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void rspamd_main_stat_release_slot(struct rspamd_main *rspamd_main,
+								   struct rspamd_worker *wrk)
+{
+	struct rspamd_stat_slot *slot;
+
+	if (rspamd_main->stat_slots == NULL || wrk->stat_slot < 0) {
+		return;
+	}
+
+	slot = &rspamd_main->stat_slots[wrk->stat_slot];
+	/* The owner is dead, so its counters are moved to the common part */
+	RSPAMD_STAT_FOREACH_COUNTER(rspamd_main->stat, &slot->st, RSPAMD_STAT_ATOMIC_ADD);
+	memset(&slot->st, 0, sizeof(slot->st));
+
+	for (unsigned int i = 0; i < MAX_AVG_TIME_SLOTS; i++) {
+		slot->st.avg_time.avg_time[i] = NAN;
+	}
+
+	slot->pid = 0;
+	wrk->stat_slot = -1;
+}
+
+void rspamd_worker_stat_hist_time(unsigned int type, double seconds)
+{
+	if (!(seconds > 0)) {
+		return;
+	}
+
+	if (rspamd_current_worker == NULL) {
+		if (standalone_stat != NULL) {
+			rspamd_stat_hist_add(standalone_stat, type, seconds * 1e6);
+		}
+
+		return;
+	}
+
+	rspamd_stat_hist_add(rspamd_main_local_stat(rspamd_current_worker->srv),
+						 type, seconds * 1e6);
+}
+
+void rspamd_worker_stat_set_standalone(struct rspamd_stat *stat)
+{
+	standalone_stat = stat;
+}
+
 void rspamd_controller_store_saved_stats(struct rspamd_main *rspamd_main,
 										 struct rspamd_config *cfg)
 {
-	struct rspamd_stat *stat;
+	struct rspamd_stat *stat, stat_copy;
 	ucl_object_t *top, *sub;
 	struct ucl_emitter_functions *efuncs;
 	int i, fd;
@@ -2057,7 +2905,8 @@ void rspamd_controller_store_saved_stats(struct rspamd_main *rspamd_main,
 	}
 
 	fp = fdopen(fd, "w");
-	stat = rspamd_main->stat;
+	rspamd_main_stat_snapshot(rspamd_main, &stat_copy);
+	stat = &stat_copy;
 
 	top = ucl_object_typed_new(UCL_OBJECT);
 	ucl_object_insert_key(top, ucl_object_fromint(stat->messages_scanned), "scanned", 0, false);
@@ -2124,7 +2973,7 @@ rspamd_controller_load_saved_stats(struct rspamd_main *rspamd_main,
 	struct ucl_parser *parser;
 	ucl_object_t *obj;
 	const ucl_object_t *elt, *subelt;
-	struct rspamd_stat *stat, stat_copy;
+	struct rspamd_stat *stat, stat_copy, cur;
 	int i;
 
 	if (cfg->stats_file == NULL) {
@@ -2151,7 +3000,8 @@ rspamd_controller_load_saved_stats(struct rspamd_main *rspamd_main,
 	ucl_parser_free(parser);
 
 	stat = rspamd_main->stat;
-	memcpy(&stat_copy, stat, sizeof(stat_copy));
+	rspamd_main_stat_snapshot(rspamd_main, &cur);
+	memcpy(&stat_copy, &cur, sizeof(stat_copy));
 
 	elt = ucl_object_lookup(obj, "scanned");
 
@@ -2190,13 +3040,14 @@ rspamd_controller_load_saved_stats(struct rspamd_main *rspamd_main,
 	}
 
 	ucl_object_unref(obj);
-	memcpy(stat, &stat_copy, sizeof(stat_copy));
+	/* Slots of running workers are kept, so the common part absorbs the difference */
+	RSPAMD_STAT_FOREACH_COUNTER(&stat_copy, &cur, RSPAMD_STAT_PLAIN_SUB);
+	RSPAMD_STAT_FOREACH_COUNTER(stat, &stat_copy, RSPAMD_STAT_ATOMIC_ADD);
 }
 
 struct rspamd_controller_periodics_cbdata {
 	struct rspamd_worker *worker;
 	struct rspamd_rrd_file *rrd;
-	struct rspamd_stat *stat;
 	ev_timer save_stats_event;
 };
 
@@ -2205,14 +3056,15 @@ rspamd_controller_rrd_update(EV_P_ ev_timer *w, int revents)
 {
 	struct rspamd_controller_periodics_cbdata *cbd =
 		(struct rspamd_controller_periodics_cbdata *) w->data;
-	struct rspamd_stat *stat;
+	struct rspamd_stat stat_copy, *stat;
 	GArray ar;
 	double points[METRIC_ACTION_MAX];
 	GError *err = NULL;
 	unsigned int i;
 
 	g_assert(cbd->rrd != NULL);
-	stat = cbd->stat;
+	rspamd_main_stat_snapshot(cbd->worker->srv, &stat_copy);
+	stat = &stat_copy;
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i++) {
 		points[i] = stat->actions_stat[i];
@@ -2258,7 +3110,6 @@ void rspamd_worker_init_controller(struct rspamd_worker *worker,
 		memset(&cbd, 0, sizeof(cbd));
 		cbd.save_stats_event.data = &cbd;
 		cbd.worker = worker;
-		cbd.stat = worker->srv->stat;
 
 		ev_timer_init(&cbd.save_stats_event,
 					  rspamd_controller_stats_save_periodic,
@@ -2355,6 +3206,208 @@ rspamd_worker_check_and_adjust_timeout(struct rspamd_config *cfg, double timeout
 	return timeout;
 }
 
+static void
+rspamd_mempool_entry_to_ucl(const struct rspamd_mempool_entry_stat *st, void *ud)
+{
+	ucl_object_t *top = (ucl_object_t *) ud, *elt, *hist;
+	unsigned int i;
+
+	elt = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(elt, ucl_object_fromint(st->cur_suggestion), "suggestion", 0, false);
+	ucl_object_insert_key(elt, ucl_object_fromint(st->pools), "pools", 0, false);
+	ucl_object_insert_key(elt, ucl_object_fromint(st->chains), "chains", 0, false);
+	ucl_object_insert_key(elt, ucl_object_fromint(st->wasted), "wasted", 0, false);
+	ucl_object_insert_key(elt, ucl_object_fromint(st->peak), "peak", 0, false);
+
+	hist = ucl_object_typed_new(UCL_ARRAY);
+
+	for (i = 0; i < RSPAMD_MEMPOOL_HIST_BUCKETS; i++) {
+		ucl_array_append(hist, ucl_object_fromint(st->size_hist[i]));
+	}
+
+	ucl_object_insert_key(elt, hist, "size_hist", 0, false);
+	ucl_object_insert_key(top, elt, st->src, 0, true);
+}
+
+ucl_object_t *
+rspamd_mempool_entries_ucl(void)
+{
+	ucl_object_t *top = ucl_object_typed_new(UCL_OBJECT);
+
+	rspamd_mempool_entries_foreach(rspamd_mempool_entry_to_ucl, top);
+
+	return top;
+}
+
+static void
+rspamd_metrics_add_mempool_entries(rspamd_fstring_t **output,
+								   const ucl_object_t *entries)
+{
+	static const struct {
+		const char *name;
+		const char *type;
+		const char *description;
+		const char *key;
+	} entry_metrics[] = {
+		{"rspamd_mempool_entry_suggested_bytes", "gauge",
+		 "Memory pools: suggested size of the first chain per entry point.", "suggestion"},
+		{"rspamd_mempool_entry_pools_total", "counter",
+		 "Memory pools: pools destroyed per entry point.", "pools"},
+		{"rspamd_mempool_entry_chains_total", "counter",
+		 "Memory pools: chains allocated per entry point.", "chains"},
+		{"rspamd_mempool_entry_wasted_bytes_total", "counter",
+		 "Memory pools: bytes wasted per entry point.", "wasted"},
+		{"rspamd_mempool_entry_peak_bytes", "gauge",
+		 "Memory pools: maximum memory used by a single pool per entry point.", "peak"},
+	};
+	const ucl_object_t *cur, *hist;
+	ucl_object_iter_t it;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(entry_metrics); i++) {
+		rspamd_printf_fstring(output, "# HELP %s %s\n", entry_metrics[i].name,
+							  entry_metrics[i].description);
+		rspamd_printf_fstring(output, "# TYPE %s %s\n", entry_metrics[i].name,
+							  entry_metrics[i].type);
+		it = NULL;
+
+		while ((cur = ucl_object_iterate(entries, &it, true)) != NULL) {
+			rspamd_printf_fstring(output, "%s{loc=\"%s\"} %L\n",
+								  entry_metrics[i].name,
+								  ucl_object_key(cur),
+								  ucl_object_toint(ucl_object_lookup(cur, entry_metrics[i].key)));
+		}
+	}
+
+	rspamd_printf_fstring(output, "# HELP rspamd_mempool_entry_size Memory pools: "
+								  "memory used by pools per entry point.\n");
+	rspamd_printf_fstring(output, "# TYPE rspamd_mempool_entry_size histogram\n");
+	it = NULL;
+
+	while ((cur = ucl_object_iterate(entries, &it, true)) != NULL) {
+		int64_t cumulative = 0;
+
+		hist = ucl_object_lookup(cur, "size_hist");
+
+		for (i = 0; i < ucl_array_size(hist); i++) {
+			cumulative += ucl_object_toint(ucl_array_find_index(hist, i));
+
+			if (i == ucl_array_size(hist) - 1) {
+				rspamd_printf_fstring(output,
+									  "rspamd_mempool_entry_size_bucket{loc=\"%s\",le=\"+Inf\"} %L\n",
+									  ucl_object_key(cur), cumulative);
+			}
+			else {
+				rspamd_printf_fstring(output,
+									  "rspamd_mempool_entry_size_bucket{loc=\"%s\",le=\"%z\"} %L\n",
+									  ucl_object_key(cur),
+									  (gsize) RSPAMD_MEMPOOL_HIST_MIN << i,
+									  cumulative);
+			}
+		}
+
+		rspamd_printf_fstring(output, "rspamd_mempool_entry_size_count{loc=\"%s\"} %L\n",
+							  ucl_object_key(cur), cumulative);
+	}
+}
+
+static ucl_object_t *
+rspamd_worker_histogram_ucl(const struct rspamd_stat_hist *hist,
+							const char *metric,
+							const char *label,
+							const char *value,
+							double scale)
+{
+	ucl_object_t *obj, *buckets;
+	unsigned int last = 0;
+	uint64_t count = 0;
+
+	for (unsigned int i = 0; i < RSPAMD_STAT_HIST_BUCKETS; i++) {
+		if (hist->buckets[i] > 0) {
+			count += hist->buckets[i];
+			last = i;
+		}
+	}
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	buckets = ucl_object_typed_new(UCL_ARRAY);
+
+	/* Empty buckets at the tail are implied by the +Inf bucket */
+	for (unsigned int i = 0; i <= last; i++) {
+		ucl_array_append(buckets, ucl_object_fromint(hist->buckets[i]));
+	}
+
+	ucl_object_insert_key(obj, ucl_object_fromstring(metric), "metric", 0, false);
+
+	if (label) {
+		ucl_object_insert_key(obj, ucl_object_fromstring(label), "label", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromstring(value), "value", 0, false);
+	}
+
+	ucl_object_insert_key(obj, ucl_object_fromdouble(scale), "scale", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(count), "count", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromdouble(hist->sum * scale), "sum", 0, false);
+	ucl_object_insert_key(obj, buckets, "buckets", 0, false);
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_worker_histograms_ucl(struct rspamd_config *cfg, struct rspamd_stat *stat)
+{
+	ucl_object_t *top = ucl_object_typed_new(UCL_ARRAY), *elt;
+	static const struct {
+		unsigned int type;
+		const char *metric;
+		double scale;
+	} plain_hists[] = {
+		{RSPAMD_STAT_HIST_TASK, "rspamd_scan_time_seconds", 1e-6},
+		{RSPAMD_STAT_HIST_DNS, "rspamd_dns_latency_seconds", 1e-6},
+		{RSPAMD_STAT_HIST_REDIS, "rspamd_redis_latency_seconds", 1e-6},
+		{RSPAMD_STAT_HIST_HTTP, "rspamd_http_latency_seconds", 1e-6},
+		{RSPAMD_STAT_HIST_MESSAGE_SIZE, "rspamd_message_size_bytes", 1.0},
+	};
+	unsigned int i;
+	GList *cur;
+
+	for (i = 0; i < G_N_ELEMENTS(plain_hists); i++) {
+		elt = rspamd_worker_histogram_ucl(&stat->hist[plain_hists[i].type],
+										  plain_hists[i].metric, NULL, NULL,
+										  plain_hists[i].scale);
+
+		if (elt) {
+			ucl_array_append(top, elt);
+		}
+	}
+
+	for (i = 0; i < RSPAMD_STAT_HIST_STAGES; i++) {
+		elt = rspamd_worker_histogram_ucl(&stat->hist[RSPAMD_STAT_HIST_STAGE + i],
+										  "rspamd_stage_time_seconds", "stage",
+										  rspamd_task_stage_name(1u << i), 1e-6);
+
+		if (elt) {
+			ucl_array_append(top, elt);
+		}
+	}
+
+	for (i = 0, cur = cfg->histogram_symbols; cur != NULL && i < RSPAMD_STAT_HIST_MAX_SYMBOLS;
+		 cur = g_list_next(cur), i++) {
+		elt = rspamd_worker_histogram_ucl(&stat->hist[RSPAMD_STAT_HIST_SYMBOL + i],
+										  "rspamd_symbol_time_seconds", "symbol",
+										  (const char *) cur->data, 1e-6);
+
+		if (elt) {
+			ucl_array_append(top, elt);
+		}
+	}
+
+	return top;
+}
+
 ucl_object_t *
 rspamd_worker_metrics_object(struct rspamd_config *cfg, struct rspamd_stat *stat, ev_tstamp uptime)
 {
@@ -2394,6 +3447,7 @@ rspamd_worker_metrics_object(struct rspamd_config *cfg, struct rspamd_stat *stat
 		ucl_object_insert_key(top, sub, "actions", 0, false);
 	}
 
+	ucl_object_insert_key(top, rspamd_worker_histograms_ucl(cfg, stat), "histograms", 0, false);
 	ucl_object_insert_key(top, ucl_object_fromint(spam), "spam_count", 0, false);
 	ucl_object_insert_key(top, ucl_object_fromint(ham), "ham_count", 0, false);
 	ucl_object_insert_key(top,
@@ -2401,6 +3455,13 @@ rspamd_worker_metrics_object(struct rspamd_config *cfg, struct rspamd_stat *stat
 	ucl_object_insert_key(top,
 						  ucl_object_fromint(stat->control_connections_count),
 						  "control_connections", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromint(stat->messages_degraded), "degraded", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromint(stat->memory_pressure_events),
+						  "memory_pressure_events", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromint(stat->workers_degraded), "workers_degraded", 0, false);
 
 	ucl_object_insert_key(top,
 						  ucl_object_fromint(mem_st.pools_allocated), "pools_allocated", 0,
@@ -2425,10 +3486,81 @@ rspamd_worker_metrics_object(struct rspamd_config *cfg, struct rspamd_stat *stat
 						  "chunks_oversized", 0, false);
 	ucl_object_insert_key(top,
 						  ucl_object_fromint(mem_st.fragmented_size), "fragmented", 0, false);
+	ucl_object_insert_key(top,
+						  ucl_object_fromint(mem_st.hugepage_bytes), "hugepage_bytes", 0, false);
+	ucl_object_insert_key(top, rspamd_mempool_entries_ucl(), "mempool_entries", 0, false);
 
 	return top;
 }
 
+static void
+rspamd_metrics_add_histograms(rspamd_fstring_t **output, const ucl_object_t *hists)
+{
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	const char *last_metric = NULL;
+
+	/* Histograms of the same metric go one after another */
+	while ((cur = ucl_object_iterate(hists, &it, true)) != NULL) {
+		const char *metric = ucl_object_tostring(ucl_object_lookup(cur, "metric"));
+		const char *label = ucl_object_tostring(ucl_object_lookup(cur, "label"));
+		const char *value = ucl_object_tostring(ucl_object_lookup(cur, "value"));
+		double scale = ucl_object_todouble(ucl_object_lookup(cur, "scale"));
+		const ucl_object_t *buckets = ucl_object_lookup(cur, "buckets");
+		ucl_object_iter_t bit = NULL;
+		char labels[256];
+		int64_t cumulative = 0;
+		unsigned int i = 0;
+
+		if (metric == NULL || buckets == NULL) {
+			continue;
+		}
+
+		if (last_metric == NULL || strcmp(last_metric, metric) != 0) {
+			rspamd_printf_fstring(output, "# HELP %s Distribution of %s.\n", metric, metric + sizeof("rspamd_") - 1);
+			rspamd_printf_fstring(output, "# TYPE %s histogram\n", metric);
+			last_metric = metric;
+		}
+
+		if (label && value) {
+			rspamd_snprintf(labels, sizeof(labels), "%s=\"%s\",", label, value);
+		}
+		else {
+			labels[0] = '\0';
+		}
+
+		while ((elt = ucl_object_iterate(buckets, &bit, true)) != NULL) {
+			cumulative += ucl_object_toint(elt);
+
+			if (i < RSPAMD_STAT_HIST_BUCKETS - 1) {
+				rspamd_printf_fstring(output, "%s_bucket{%sle=\"%g\"} %L\n",
+									  metric, labels,
+									  (double) (rspamd_stat_hist_bucket_bound(i) + 1) * scale,
+									  cumulative);
+			}
+
+			i++;
+		}
+
+		rspamd_printf_fstring(output, "%s_bucket{%sle=\"+Inf\"} %L\n",
+							  metric, labels, ucl_object_toint(ucl_object_lookup(cur, "count")));
+		/* Strip the trailing comma */
+		if (labels[0]) {
+			labels[strlen(labels) - 1] = '\0';
+			rspamd_printf_fstring(output, "%s_sum{%s} %f\n", metric, labels,
+								  ucl_object_todouble(ucl_object_lookup(cur, "sum")));
+			rspamd_printf_fstring(output, "%s_count{%s} %L\n", metric, labels,
+								  ucl_object_toint(ucl_object_lookup(cur, "count")));
+		}
+		else {
+			rspamd_printf_fstring(output, "%s_sum %f\n", metric,
+								  ucl_object_todouble(ucl_object_lookup(cur, "sum")));
+			rspamd_printf_fstring(output, "%s_count %L\n", metric,
+								  ucl_object_toint(ucl_object_lookup(cur, "count")));
+		}
+	}
+}
+
 rspamd_fstring_t *
 rspamd_metrics_to_prometheus_string(const ucl_object_t *top)
 {
@@ -2491,6 +3623,21 @@ rspamd_metrics_to_prometheus_string(const ucl_object_t *top)
 							   "gauge",
 							   "Control connections.",
 							   "control_connections");
+	rspamd_metrics_add_integer(&output, top,
+							   "rspamd_degraded_total",
+							   "counter",
+							   "Messages scanned with optional checks skipped due to memory pressure.",
+							   "degraded");
+	rspamd_metrics_add_integer(&output, top,
+							   "rspamd_memory_pressure_events_total",
+							   "counter",
+							   "Times workers entered degraded mode due to memory pressure.",
+							   "memory_pressure_events");
+	rspamd_metrics_add_integer(&output, top,
+							   "rspamd_workers_degraded",
+							   "gauge",
+							   "Workers in degraded mode due to memory pressure.",
+							   "workers_degraded");
 	rspamd_metrics_add_integer(&output, top,
 							   "rspamd_pools_allocated",
 							   "gauge",
@@ -2532,6 +3679,12 @@ rspamd_metrics_to_prometheus_string(const ucl_object_t *top)
 							   "Memory pools: fragmented memory waste.",
 							   "fragmented");
 
+	const ucl_object_t *entries_obj = ucl_object_lookup(top, "mempool_entries");
+
+	if (entries_obj) {
+		rspamd_metrics_add_mempool_entries(&output, entries_obj);
+	}
+
 	const ucl_object_t *acts_obj = ucl_object_lookup(top, "actions");
 
 	if (acts_obj) {
@@ -2553,6 +3706,12 @@ rspamd_metrics_to_prometheus_string(const ucl_object_t *top)
 		}
 	}
 
+	const ucl_object_t *hists_obj = ucl_object_lookup(top, "histograms");
+
+	if (hists_obj) {
+		rspamd_metrics_add_histograms(&output, hists_obj);
+	}
+
 	/* Must be finalized and freed by caller */
 	return output;
 }
\ No newline at end of file
@@ -96,6 +96,7 @@ struct rspamd_custom_controller_command {
 };
 
 struct rspamd_controller_worker_ctx;
+struct rspamd_controller_learn_fwd;
 struct rspamd_lang_detector;
 
 struct rspamd_controller_session {
@@ -107,6 +108,7 @@ struct rspamd_controller_session {
 	rspamd_inet_addr_t *from_addr;
 	struct rspamd_config *cfg;
 	struct rspamd_lang_detector *lang_det;
+	struct rspamd_controller_learn_fwd *learn_fwd;
 	gboolean is_spam;
 	gboolean is_read_only;
 };
@@ -144,6 +146,17 @@ void rspamd_controller_send_string(struct rspamd_http_connection_entry *entry,
 void rspamd_controller_send_ucl(struct rspamd_http_connection_entry *entry,
 								ucl_object_t *obj);
 
+/**
+ * Send a copy of JSON reply with an ETag, replies with 304 if the request
+ * has a matching If-None-Match header
+ * @param entry router entry
+ * @param req request message
+ * @param body JSON body, it is not modified
+ */
+void rspamd_controller_send_cached_json(struct rspamd_http_connection_entry *entry,
+										struct rspamd_http_message *req,
+										const rspamd_fstring_t *body);
+
 /**
  * Return worker's control structure by its type
  * @param type
@@ -274,6 +287,26 @@ gboolean rspamd_check_termination_clause(struct rspamd_main *rspamd_main,
  */
 gboolean rspamd_worker_call_finish_handlers(struct rspamd_worker *worker);
 
+/**
+ * Returns TRUE if this process has got a socket of the exporter worker
+ * @param cfg
+ * @return
+ */
+gboolean rspamd_worker_has_exporter(struct rspamd_config *cfg);
+
+/**
+ * Sends a record for the named consumer to the exporter worker. Never blocks:
+ * returns FALSE if there is no exporter or its queue is full
+ * @param cfg
+ * @param name consumer name (e.g. plugin name)
+ * @param data serialized record
+ * @param len length of the record
+ * @return TRUE if a record has been queued
+ */
+gboolean rspamd_worker_export_record(struct rspamd_config *cfg,
+									 const char *name,
+									 const void *data, gsize len);
+
 struct rspamd_rrd_file;
 /**
  * Terminate controller worker
@@ -299,11 +332,56 @@ void rspamd_worker_init_controller(struct rspamd_worker *worker,
 void rspamd_controller_store_saved_stats(struct rspamd_main *rspamd_main,
 										 struct rspamd_config *cfg);
 
+/**
+ * Returns statistics that should be updated by the current process
+ */
+struct rspamd_stat *rspamd_main_local_stat(struct rspamd_main *rspamd_main);
+
+/**
+ * Collects statistics of all workers into `out`
+ */
+void rspamd_main_stat_snapshot(struct rspamd_main *rspamd_main,
+							   struct rspamd_stat *out);
+
+/**
+ * Resets counters that have been observed in a snapshot `seen`
+ */
+void rspamd_main_stat_reset(struct rspamd_main *rspamd_main,
+							const struct rspamd_stat *seen);
+
+/**
+ * Finds a free statistics slot for a new worker, returns -1 if none is free
+ */
+int rspamd_main_stat_acquire_slot(struct rspamd_main *rspamd_main);
+
+/**
+ * Moves counters of a terminated worker to the common part and frees its slot
+ */
+void rspamd_main_stat_release_slot(struct rspamd_main *rspamd_main,
+								   struct rspamd_worker *wrk);
+
+/**
+ * Adds a time in seconds to a histogram of the current worker, outside of
+ * workers the time is added to the standalone statistics if they are set
+ */
+void rspamd_worker_stat_hist_time(unsigned int type, double seconds);
+
+/**
+ * Sets statistics for tasks processed outside of workers (e.g. by rspamadm)
+ * @param stat statistics to update or NULL to disable
+ */
+void rspamd_worker_stat_set_standalone(struct rspamd_stat *stat);
+
 /**
  * Get metrics object for a worker
  */
 ucl_object_t *rspamd_worker_metrics_object(struct rspamd_config *cfg, struct rspamd_stat *stat, ev_tstamp uptime);
 
+/**
+ * Get statistics of memory pools entry points of the current process
+ */
+ucl_object_t *rspamd_mempool_entries_ucl(void);
+
 
 static inline void
 rspamd_metrics_add_integer(rspamd_fstring_t **output,
@@ -0,0 +1,675 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read only statistics backend over an immutable memory mapped model,
+ * exported from Redis by `rspamadm statistics_dump dump --model`.
+ *
+ * The model is a sorted array of token hashes split into blocks of a fixed
+ * size, the first token of each block is stored in a separate index that is
+ * small enough to stay in the CPU cache. A lookup is a binary search over the
+ * index followed by a search within a single block:
+ *
+ * header | uint64 block_index[nblocks] | uint64 tokens[ntokens] |
+ *          counters[ntokens][2] (spam, ham; 2 or 4 bytes each)
+ *
+ * All numbers are little endian. The file is loaded through the maps
+ * subsystem, so a new model is swapped in as soon as the file is replaced.
+ */
+
+#include "config.h"
+#include "stat_internal.h"
+#include "libserver/maps/map.h"
+#include "unix-std.h"
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "contrib/expected/expected.hpp"
+#include "fmt/core.h"
+
+namespace rspamd::stat::compact {
+
+static const unsigned char model_magic[8] = {'r', 's', 'b', 'a', 'y', 'e', 's', '1'};
+static constexpr const std::uint32_t model_version = 1;
+
+struct model_header {
+	unsigned char magic[8];
+	std::uint32_t version;
+	/* Size of a single counter: 2 or 4 */
+	std::uint32_t counter_bytes;
+	std::uint64_t ntokens;
+	std::uint64_t learns_spam;
+	std::uint64_t learns_ham;
+	std::uint32_t block_size;
+	std::uint32_t reserved;
+	std::uint64_t nblocks;
+	std::uint64_t reserved2;
+};
+
+static_assert(sizeof(model_header) == 64, "model header must be packed");
+
+class compact_model final {
+public:
+	compact_model(const compact_model &) = delete;
+	compact_model &operator=(const compact_model &) = delete;
+	~compact_model()
+	{
+		if (map) {
+			munmap(map, len);
+		}
+	}
+
+	static auto open(const char *path) -> tl::expected<std::unique_ptr<compact_model>, std::string>;
+
+	auto lookup(std::uint64_t token) const -> std::optional<std::pair<float, float>>
+	{
+		if (hdr->ntokens == 0) {
+			return std::nullopt;
+		}
+
+		/* Last block whose first token is not greater than the token */
+		const auto *index_end = index + hdr->nblocks;
+		const auto *blk = std::upper_bound(index, index_end, token);
+
+		if (blk == index) {
+			return std::nullopt;
+		}
+
+		auto start = (std::uint64_t) (blk - index - 1) * hdr->block_size;
+		auto end = std::min(start + hdr->block_size, hdr->ntokens);
+		const auto *found = std::lower_bound(tokens + start, tokens + end, token);
+
+		if (found == tokens + end || *found != token) {
+			return std::nullopt;
+		}
+
+		auto pos = (std::size_t) (found - tokens) * 2;
+
+		if (hdr->counter_bytes == sizeof(std::uint16_t)) {
+			const auto *cnt = reinterpret_cast<const std::uint16_t *>(counters);
+
+			return std::make_pair((float) cnt[pos], (float) cnt[pos + 1]);
+		}
+
+		const auto *cnt = reinterpret_cast<const std::uint32_t *>(counters);
+
+		return std::make_pair((float) cnt[pos], (float) cnt[pos + 1]);
+	}
+
+	auto learns_spam() const -> std::uint64_t
+	{
+		return hdr->learns_spam;
+	}
+	auto learns_ham() const -> std::uint64_t
+	{
+		return hdr->learns_ham;
+	}
+	auto ntokens() const -> std::uint64_t
+	{
+		return hdr->ntokens;
+	}
+	auto token_at(std::size_t i) const -> std::uint64_t
+	{
+		return tokens[i];
+	}
+	auto size() const -> std::size_t
+	{
+		return len;
+	}
+
+private:
+	compact_model() = default;
+
+	void *map = nullptr;
+	std::size_t len = 0;
+	const model_header *hdr = nullptr;
+	const std::uint64_t *index = nullptr;
+	const std::uint64_t *tokens = nullptr;
+	const void *counters = nullptr;
+};
+
+auto compact_model::open(const char *path) -> tl::expected<std::unique_ptr<compact_model>, std::string>
+{
+	gsize len;
+	auto *map = rspamd_file_xmap(path, PROT_READ, &len, TRUE);
+
+	if (map == nullptr) {
+		return tl::make_unexpected(fmt::format("cannot mmap {}: {}", path, strerror(errno)));
+	}
+
+	std::unique_ptr<compact_model> model{new compact_model};
+	model->map = map;
+	model->len = len;
+
+	if (len < sizeof(model_header)) {
+		return tl::make_unexpected(fmt::format("{} is too short to be a model", path));
+	}
+
+	const auto *hdr = reinterpret_cast<const model_header *>(map);
+
+	if (memcmp(hdr->magic, model_magic, sizeof(model_magic)) != 0) {
+		return tl::make_unexpected(fmt::format("{} is not a model file", path));
+	}
+
+	if (hdr->version != model_version) {
+		return tl::make_unexpected(fmt::format("{} has unsupported version {}", path, hdr->version));
+	}
+
+	if ((hdr->counter_bytes != sizeof(std::uint16_t) && hdr->counter_bytes != sizeof(std::uint32_t)) ||
+		hdr->block_size == 0 ||
+		hdr->nblocks != (hdr->ntokens + hdr->block_size - 1) / hdr->block_size) {
+		return tl::make_unexpected(fmt::format("{} has invalid header", path));
+	}
+
+	/* Overflow safe size check */
+	auto avail = (len - sizeof(model_header)) / sizeof(std::uint64_t);
+
+	if (hdr->nblocks > avail || hdr->ntokens > avail - hdr->nblocks) {
+		return tl::make_unexpected(fmt::format("{} is truncated", path));
+	}
+
+	auto counters_offset = sizeof(model_header) + (hdr->nblocks + hdr->ntokens) * sizeof(std::uint64_t);
+
+	if ((len - counters_offset) / 2 / hdr->counter_bytes < hdr->ntokens) {
+		return tl::make_unexpected(fmt::format("{} is truncated", path));
+	}
+
+	model->hdr = hdr;
+	model->index = reinterpret_cast<const std::uint64_t *>(hdr + 1);
+	model->tokens = model->index + hdr->nblocks;
+	model->counters = reinterpret_cast<const unsigned char *>(map) + counters_offset;
+
+	return model;
+}
+
+/*
+ * Model slot is shared by all statfiles using the same file and is updated
+ * by the map on each file change
+ */
+struct model_slot {
+	compact_model *model;
+};
+
+class ro_backend final {
+public:
+	explicit ro_backend(struct rspamd_statfile *_st, struct model_slot *_slot)
+		: st(_st), slot(_slot)
+	{
+	}
+
+	auto process_token(const rspamd_token_t *tok) const -> std::optional<float>
+	{
+		if (!slot->model) {
+			return std::nullopt;
+		}
+
+		auto maybe_value = slot->model->lookup(tok->data);
+
+		if (maybe_value) {
+			auto [spam_count, ham_count] = maybe_value.value();
+
+			return is_spam() ? spam_count : ham_count;
+		}
+
+		return std::nullopt;
+	}
+	constexpr auto is_spam() const -> bool
+	{
+		return st->stcf->is_spam;
+	}
+	auto get_learns() const -> std::uint64_t
+	{
+		if (!slot->model) {
+			return 0;
+		}
+
+		return is_spam() ? slot->model->learns_spam() : slot->model->learns_ham();
+	}
+	auto get_total_learns() const -> std::uint64_t
+	{
+		if (!slot->model) {
+			return 0;
+		}
+
+		return slot->model->learns_spam() + slot->model->learns_ham();
+	}
+	auto get_stat() const -> ucl_object_t *;
+
+private:
+	struct rspamd_statfile *st;
+	struct model_slot *slot;
+};
+
+auto ro_backend::get_stat() const -> ucl_object_t *
+{
+	auto *res = ucl_object_typed_new(UCL_OBJECT);
+
+	ucl_object_insert_key(res, ucl_object_fromint(get_learns()), "revision", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromint(slot->model ? slot->model->size() : 0),
+						  "size", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromint(slot->model ? slot->model->ntokens() : 0),
+						  "total", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromint(slot->model ? slot->model->ntokens() : 0),
+						  "used", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromstring(st->stcf->symbol), "symbol", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromstring("compact"), "type", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromint(0), "languages", 0, false);
+	ucl_object_insert_key(res, ucl_object_fromint(0), "users", 0, false);
+
+	return res;
+}
+
+/* Map callbacks, the map passes a file name instead of its content */
+static char *
+model_map_read(char *chunk, int len, struct map_cb_data *data, gboolean final)
+{
+	auto maybe_model = compact_model::open(chunk);
+
+	if (!maybe_model) {
+		msg_err("cannot load bayes model: %s", maybe_model.error().c_str());
+
+		return nullptr;
+	}
+
+	const auto &model = maybe_model.value();
+	msg_info("loaded bayes model from %s: %L tokens, %L spam and %L ham learns",
+			 chunk, (int64_t) model->ntokens(),
+			 (int64_t) model->learns_spam(), (int64_t) model->learns_ham());
+
+	delete reinterpret_cast<compact_model *>(data->cur_data);
+	data->cur_data = maybe_model.value().release();
+
+	return chunk + len;
+}
+
+static void
+model_map_fin(struct map_cb_data *data, void **target)
+{
+	if (data->errored) {
+		/* Keep the current model */
+		delete reinterpret_cast<compact_model *>(data->cur_data);
+		data->cur_data = nullptr;
+
+		return;
+	}
+
+	if (target) {
+		*target = data->cur_data;
+	}
+
+	delete reinterpret_cast<compact_model *>(data->prev_data);
+}
+
+static void
+model_map_dtor(struct map_cb_data *data)
+{
+	delete reinterpret_cast<compact_model *>(data->cur_data);
+}
+
+static auto
+model_filename(struct rspamd_statfile *st) -> const char *
+{
+	const auto *stf = st->stcf;
+
+	auto get_filename = [](const ucl_object_t *obj) -> const char * {
+		const auto *filename = ucl_object_lookup_any(obj,
+													 "filename", "path", "model", nullptr);
+
+		if (filename && ucl_object_type(filename) == UCL_STRING) {
+			return ucl_object_tostring(filename);
+		}
+
+		return nullptr;
+	};
+
+	const char *path = nullptr;
+	/* First search in backend configuration */
+	const auto *obj = ucl_object_lookup(st->classifier->cfg->opts, "backend");
+	if (obj != nullptr && ucl_object_type(obj) == UCL_OBJECT) {
+		path = get_filename(obj);
+	}
+
+	/* Now try statfiles config */
+	if (!path && stf->opts) {
+		path = get_filename(stf->opts);
+	}
+
+	/* Now try classifier config */
+	if (!path && st->classifier->cfg->opts) {
+		path = get_filename(st->classifier->cfg->opts);
+	}
+
+	return path;
+}
+
+static void
+model_slot_dtor(gpointer p)
+{
+	auto *slot = reinterpret_cast<model_slot *>(p);
+	delete slot;
+}
+
+auto open_model(struct rspamd_config *cfg, struct rspamd_statfile *st) -> tl::expected<ro_backend, std::string>
+{
+	const auto *path = model_filename(st);
+
+	if (!path) {
+		return tl::make_unexpected("missing/malformed filename attribute");
+	}
+
+	/* Spam and ham statfiles share the same model and the same map */
+	auto var_name = fmt::format("compact_model_{}", path);
+	auto *slot = reinterpret_cast<model_slot *>(rspamd_mempool_get_variable(cfg->cfg_pool,
+																			var_name.c_str()));
+
+	if (slot == nullptr) {
+		slot = new model_slot{nullptr};
+		rspamd_mempool_set_variable(cfg->cfg_pool, var_name.c_str(), slot, model_slot_dtor);
+
+		auto map_line = fmt::format("file://{}", path);
+
+		if (rspamd_map_add(cfg, map_line.c_str(), "bayes compact model",
+						   model_map_read, model_map_fin, model_map_dtor,
+						   reinterpret_cast<void **>(&slot->model), nullptr,
+						   RSPAMD_MAP_FILE_ONLY | RSPAMD_MAP_FILE_NO_READ) == nullptr) {
+			return tl::make_unexpected(fmt::format("cannot add map for {}", path));
+		}
+	}
+
+	return ro_backend{st, slot};
+}
+
+/*
+ * Bloom filter of tokens present in a model, used to drop unknown tokens
+ * before they are sent to other backends. Tokens are hashes already, so
+ * bits are derived from the token value directly
+ */
+class token_bloom final {
+public:
+	explicit token_bloom(const compact_model &model)
+	{
+		std::uint64_t nbits = 64;
+
+		while (nbits < model.ntokens() * bits_per_elt) {
+			nbits <<= 1;
+		}
+
+		mask = nbits - 1;
+		bits.resize(nbits / 64);
+
+		for (auto i = 0ull; i < model.ntokens(); i++) {
+			auto tok = model.token_at(i);
+			auto step = step_hash(tok);
+
+			for (auto j = 0u; j < nhashes; j++) {
+				auto bit = (tok + j * step) & mask;
+				bits[bit / 64] |= 1ULL << (bit % 64);
+			}
+		}
+	}
+
+	auto maybe_contains(std::uint64_t tok) const -> bool
+	{
+		auto step = step_hash(tok);
+
+		for (auto j = 0u; j < nhashes; j++) {
+			auto bit = (tok + j * step) & mask;
+
+			if (!(bits[bit / 64] & (1ULL << (bit % 64)))) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	auto size() const -> std::size_t
+	{
+		return bits.size() * sizeof(std::uint64_t);
+	}
+
+private:
+	/* ~1% of false positives */
+	static constexpr const auto bits_per_elt = 10u;
+	static constexpr const auto nhashes = 7u;
+
+	std::vector<std::uint64_t> bits;
+	std::uint64_t mask;
+
+	static auto step_hash(std::uint64_t tok) -> std::uint64_t
+	{
+		return ((tok >> 32) | (tok << 32)) * 0x9E3779B97F4A7C15ULL | 1ULL;
+	}
+};
+
+static char *
+filter_map_read(char *chunk, int len, struct map_cb_data *data, gboolean final)
+{
+	auto maybe_model = compact_model::open(chunk);
+
+	if (!maybe_model) {
+		msg_err("cannot load tokens filter: %s", maybe_model.error().c_str());
+
+		return nullptr;
+	}
+
+	/* The model itself is not needed once bits are set */
+	auto *bloom = new token_bloom(*maybe_model.value());
+	msg_info("loaded tokens filter from %s: %L tokens, %uz bytes",
+			 chunk, (int64_t) maybe_model.value()->ntokens(), bloom->size());
+
+	delete reinterpret_cast<token_bloom *>(data->cur_data);
+	data->cur_data = bloom;
+
+	return chunk + len;
+}
+
+static void
+filter_map_fin(struct map_cb_data *data, void **target)
+{
+	if (data->errored) {
+		delete reinterpret_cast<token_bloom *>(data->cur_data);
+		data->cur_data = nullptr;
+
+		return;
+	}
+
+	if (target) {
+		*target = data->cur_data;
+	}
+
+	delete reinterpret_cast<token_bloom *>(data->prev_data);
+}
+
+static void
+filter_map_dtor(struct map_cb_data *data)
+{
+	delete reinterpret_cast<token_bloom *>(data->cur_data);
+}
+
+}// namespace rspamd::stat::compact
+
+struct rspamd_stat_token_filter {
+	rspamd::stat::compact::token_bloom *bloom;
+};
+
+struct rspamd_stat_token_filter *
+rspamd_stat_token_filter_new(struct rspamd_config *cfg, const char *path)
+{
+	auto *filter = rspamd_mempool_alloc0_type(cfg->cfg_pool, struct rspamd_stat_token_filter);
+	auto map_line = fmt::format("file://{}", path);
+
+	if (rspamd_map_add(cfg, map_line.c_str(), "bayes tokens filter",
+					   rspamd::stat::compact::filter_map_read,
+					   rspamd::stat::compact::filter_map_fin,
+					   rspamd::stat::compact::filter_map_dtor,
+					   reinterpret_cast<void **>(&filter->bloom), nullptr,
+					   RSPAMD_MAP_FILE_ONLY | RSPAMD_MAP_FILE_NO_READ) == nullptr) {
+		msg_err_config("cannot add tokens filter map for %s", path);
+
+		return nullptr;
+	}
+
+	return filter;
+}
+
+gboolean
+rspamd_stat_token_filter_check(struct rspamd_stat_token_filter *filter, uint64_t token)
+{
+	/* Pass everything until the filter is loaded */
+	if (filter->bloom == nullptr) {
+		return TRUE;
+	}
+
+	return filter->bloom->maybe_contains(token);
+}
+
+#define COMPACT_FROM_RAW(p) (reinterpret_cast<rspamd::stat::compact::ro_backend *>(p))
+
+/* C exports */
+gpointer
+rspamd_compact_init(struct rspamd_stat_ctx *ctx,
+					struct rspamd_config *cfg,
+					struct rspamd_statfile *st)
+{
+	auto maybe_backend = rspamd::stat::compact::open_model(cfg, st);
+
+	if (maybe_backend) {
+		return new rspamd::stat::compact::ro_backend(std::move(maybe_backend.value()));
+	}
+	else {
+		msg_err_config("cannot load compact backend: %s", maybe_backend.error().c_str());
+	}
+
+	return nullptr;
+}
+gpointer
+rspamd_compact_runtime(struct rspamd_task *task,
+					   struct rspamd_statfile_config *stcf,
+					   gboolean learn,
+					   gpointer ctx,
+					   int _id)
+{
+	/* Model is immutable, so there is no runtime state */
+	return ctx;
+}
+
+gboolean
+rspamd_compact_process_tokens(struct rspamd_task *task,
+							  GPtrArray *tokens,
+							  int id,
+							  gpointer runtime)
+{
+	auto *bk = COMPACT_FROM_RAW(runtime);
+	bool seen_values = false;
+
+	for (auto i = 0u; i < tokens->len; i++) {
+		auto *tok = reinterpret_cast<rspamd_token_t *>(g_ptr_array_index(tokens, i));
+		auto res = bk->process_token(tok);
+
+		if (res) {
+			tok->values[id] = res.value();
+			seen_values = true;
+		}
+		else {
+			tok->values[id] = 0;
+		}
+	}
+
+	if (seen_values) {
+		if (bk->is_spam()) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
+	}
+
+	return true;
+}
+gboolean
+rspamd_compact_finalize_process(struct rspamd_task *task,
+								gpointer runtime,
+								gpointer ctx)
+{
+	return true;
+}
+gboolean
+rspamd_compact_learn_tokens(struct rspamd_task *task,
+							GPtrArray *tokens,
+							int id,
+							gpointer ctx)
+{
+	return false;
+}
+gboolean
+rspamd_compact_finalize_learn(struct rspamd_task *task,
+							  gpointer runtime,
+							  gpointer ctx,
+							  GError **err)
+{
+	return false;
+}
+
+gulong rspamd_compact_total_learns(struct rspamd_task *task,
+								   gpointer runtime,
+								   gpointer ctx)
+{
+	auto *bk = COMPACT_FROM_RAW(ctx);
+	return bk->get_total_learns();
+}
+gulong
+rspamd_compact_inc_learns(struct rspamd_task *task,
+						  gpointer runtime,
+						  gpointer ctx)
+{
+	return (gulong) -1;
+}
+gulong
+rspamd_compact_dec_learns(struct rspamd_task *task,
+						  gpointer runtime,
+						  gpointer ctx)
+{
+	return (gulong) -1;
+}
+gulong
+rspamd_compact_learns(struct rspamd_task *task,
+					  gpointer runtime,
+					  gpointer ctx)
+{
+	auto *bk = COMPACT_FROM_RAW(ctx);
+	return bk->get_learns();
+}
+ucl_object_t *
+rspamd_compact_get_stat(gpointer runtime, gpointer ctx)
+{
+	auto *bk = COMPACT_FROM_RAW(ctx);
+	return bk->get_stat();
+}
+gpointer
+rspamd_compact_load_tokenizer_config(gpointer runtime, gsize *len)
+{
+	return nullptr;
+}
+void rspamd_compact_close(gpointer ctx)
+{
+	auto *bk = COMPACT_FROM_RAW(ctx);
+	delete bk;
+}
@@ -17,10 +17,17 @@
 #include "config.h"
 #include "stat_internal.h"
 #include "libserver/http/http_connection.h"
+#include "libserver/http/http_private.h"
 #include "libserver/mempool_vars_internal.h"
 #include "upstream.h"
+#include "libutil/cxx/error.hxx"
 #include "contrib/ankerl/unordered_dense.h"
+#include "fmt/core.h"
 #include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 namespace rspamd::stat::http {
@@ -70,6 +77,11 @@ public:
 
 	upstream *get_upstream(bool is_learn);
 
+	auto get_timeout() const -> double
+	{
+		return timeout;
+	}
+
 private:
 	http_backends_collection() = default;
 	auto first_init(struct rspamd_stat_ctx *ctx,
@@ -78,7 +90,58 @@ private:
 };
 
 /*
- * Created one per each task
+ * Protocol:
+ *
+ * Requests are sent as `POST /classify` or `POST /learn` with msgpack body:
+ * classify: {"statfiles": [symbol, ...], "tokens": [uint64, ...]}
+ * learn: {"statfile": symbol, "delta": int, "tokens": [uint64, ...]}
+ *
+ * Classify reply is a binary body with a record per requested statfile,
+ * in the order of request: uint64 LE number of learns followed by float LE
+ * value for each token. Learn reply is an optional uint64 LE number of
+ * learns of the statfile.
+ *
+ * Connections are kept alive and shared between tasks via the http context.
+ */
+class http_backend_runtime;
+
+class http_request final {
+public:
+	http_request(http_backend_runtime *rt, struct upstream *up, std::vector<int> &&ids, bool learn)
+		: rt(rt), up(rspamd_upstream_ref(up)), ids(std::move(ids)), learn(learn)
+	{
+	}
+	~http_request()
+	{
+		if (conn) {
+			rspamd_http_connection_unref(conn);
+		}
+
+		rspamd_upstream_unref(up);
+	}
+
+	auto send(struct rspamd_task *task, const char *path, std::vector<std::uint8_t> &&body) -> bool;
+
+private:
+	http_backend_runtime *rt;
+	struct upstream *up;
+	struct rspamd_http_connection *conn = nullptr;
+	struct rspamd_task *task = nullptr;
+	std::vector<int> ids;
+	bool learn;
+
+	static auto fin(void *ud) -> void
+	{
+		delete (http_request *) ud;
+	}
+	static auto error_handler(struct rspamd_http_connection *conn, GError *err) -> void;
+	static auto finish_handler(struct rspamd_http_connection *conn,
+							   struct rspamd_http_message *msg) -> int;
+};
+
+/*
+ * Created one per each task, all statfiles with http backend share it to
+ * send a single classify request
  */
 class http_backend_runtime final {
 public:
@@ -86,18 +149,52 @@ public:
 	/* Add a new statfile with a specific id to the list of statfiles */
 	auto notice_statfile(int id, const struct rspamd_statfile_config *st) -> void
 	{
-		seen_statfiles[id] = st;
+		seen_statfiles[id] = statfile_state{st, 0};
 	}
 
 	auto process_tokens(struct rspamd_task *task,
 						GPtrArray *tokens,
 						int id,
 						bool learn) -> bool;
+	/* Called from a request with a reply body */
+	auto process_reply(struct rspamd_task *task, const std::vector<int> &ids,
+					   bool learn, const char *body, std::size_t len) -> void;
+	auto set_error(const char *err, int code) -> void
+	{
+		if (!error) {
+			error = rspamd::util::error(err, code);
+		}
+	}
+
+	auto learns(int id) const -> std::uint64_t
+	{
+		auto it = seen_statfiles.find(id);
+
+		return it != seen_statfiles.end() ? it->second.learns : 0;
+	}
+	auto get_error() const -> const std::optional<rspamd::util::error> &
+	{
+		return error;
+	}
+
+	auto timeout() const -> double
+	{
+		return all_backends->get_timeout();
+	}
 
 private:
+	struct statfile_state {
+		const struct rspamd_statfile_config *stcf;
+		std::uint64_t learns;
+	};
+
 	http_backends_collection *all_backends;
-	ankerl::unordered_dense::map<int, const struct rspamd_statfile_config *> seen_statfiles;
+	ankerl::unordered_dense::map<int, statfile_state> seen_statfiles;
 	struct upstream *selected;
+	/* Tokens used for the classify request and number of statfiles processed */
+	GPtrArray *tokens = nullptr;
+	std::size_t nprocessed = 0;
+	std::optional<rspamd::util::error> error;
 
 private:
 	http_backend_runtime(struct rspamd_task *task, bool is_learn)
@@ -105,25 +202,67 @@ private:
 	{
 		selected = all_backends->get_upstream(is_learn);
 	}
-	~http_backend_runtime() = default;
+	~http_backend_runtime()
+	{
+		if (tokens) {
+			g_ptr_array_unref(tokens);
+		}
+	}
 	static auto dtor(void *p) -> void
 	{
 		((http_backend_runtime *) p)->~http_backend_runtime();
 	}
 };
 
+/* Statfile specific handle, as libstat calls backends per statfile */
+struct http_statfile_runtime {
+	http_backend_runtime *rt;
+	int id;
+};
+
 /*
  * Efficient way to make a messagepack payload from stat tokens,
  * avoiding any intermediate libraries, as we would send many tokens
  * all together
  */
-static auto
-stat_tokens_to_msgpack(GPtrArray *tokens) -> std::vector<std::uint8_t>
-{
-	std::vector<std::uint8_t> ret;
-	rspamd_token_t *cur;
-	int i;
+class msgpack_writer {
+public:
+	auto map(std::uint32_t n) -> msgpack_writer &
+	{
+		g_assert(n < 16);
+		buf.push_back(0x80 | n);
+
+		return *this;
+	}
+	auto array(std::uint32_t n) -> msgpack_writer &
+	{
+		buf.push_back(0xdd);
+		be(n);
+
+		return *this;
+	}
+	auto str(std::string_view s) -> msgpack_writer &
+	{
+		buf.push_back(0xdb);
+		be((std::uint32_t) s.size());
+		buf.insert(buf.end(), s.begin(), s.end());
 
+		return *this;
+	}
+	auto uint(std::uint64_t v) -> msgpack_writer &
+	{
+		buf.push_back(0xcf);
+		be(v);
+
+		return *this;
+	}
+	auto integer(std::int64_t v) -> msgpack_writer &
+	{
+		buf.push_back(0xd3);
+		be((std::uint64_t) v);
+
+		return *this;
+	}
 	/*
 	 * We define array, it's size and N elements each is uint64_t
 	 * Layout:
@@ -131,21 +270,49 @@ stat_tokens_to_msgpack(GPtrArray *tokens) -> std::vector<std::uint8_t>
 	 * [4 bytes be] - size of the array
 	 * [ 0xcf + <8 bytes BE integer>] * N - array elements
 	 */
-	ret.resize(tokens->len * (sizeof(std::uint64_t) + 1) + 5);
-	ret.push_back('\xdd');
-	std::uint32_t ulen = GUINT32_TO_BE(tokens->len);
-	std::copy((const std::uint8_t *) &ulen,
-			  ((const std::uint8_t *) &ulen) + sizeof(ulen), std::back_inserter(ret));
+	auto tokens(GPtrArray *tokens) -> msgpack_writer &
+	{
+		rspamd_token_t *cur;
+		int i;
+
+		buf.reserve(buf.size() + tokens->len * (sizeof(std::uint64_t) + 1) + 5);
+		array(tokens->len);
+
+		PTR_ARRAY_FOREACH(tokens, i, cur)
+		{
+			uint(cur->data);
+		}
 
-	PTR_ARRAY_FOREACH(tokens, i, cur)
+		return *this;
+	}
+	auto release() -> std::vector<std::uint8_t>
 	{
-		ret.push_back('\xcf');
-		std::uint64_t val = GUINT64_TO_BE(cur->data);
-		std::copy((const std::uint8_t *) &val,
-				  ((const std::uint8_t *) &val) + sizeof(val), std::back_inserter(ret));
+		return std::move(buf);
 	}
 
-	return ret;
+private:
+	std::vector<std::uint8_t> buf;
+
+	template<class T>
+	auto be(T v) -> void
+	{
+		for (auto i = sizeof(T); i > 0; i--) {
+			buf.push_back((v >> ((i - 1) * 8)) & 0xff);
+		}
+	}
+};
+
+template<class T>
+static inline auto
+read_le(const char *p) -> T
+{
+	T v = 0;
+
+	for (auto i = 0u; i < sizeof(T); i++) {
+		v |= ((T) (unsigned char) p[i]) << (i * 8);
+	}
+
+	return v;
 }
 
 auto http_backend_runtime::create(struct rspamd_task *task, bool is_learn) -> http_backend_runtime *
@@ -160,23 +327,187 @@ auto http_backend_runtime::create(struct rspamd_task *task, bool is_learn) -> ht
 
 auto http_backend_runtime::process_tokens(struct rspamd_task *task, GPtrArray *tokens, int id, bool learn) -> bool
 {
+	if (selected == nullptr) {
+		msg_err_task("no http servers defined for statistics");
+
+		return false;
+	}
+
 	if (!learn) {
-		if (id == seen_statfiles.size() - 1) {
+		/*
+		 * Classifiers might filter tokens, but values are stored in tokens
+		 * themselves, so we ask for the widest set of tokens once
+		 */
+		if (tokens && (this->tokens == nullptr || this->tokens->len < tokens->len)) {
+			if (this->tokens) {
+				g_ptr_array_unref(this->tokens);
+			}
+
+			this->tokens = g_ptr_array_ref(tokens);
+		}
+
+		if (++nprocessed < seen_statfiles.size()) {
 			/* Emit http request on the last statfile */
+			return true;
+		}
+
+		if (this->tokens == nullptr || this->tokens->len == 0) {
+			return false;
 		}
+
+		std::vector<int> ids;
+		msgpack_writer writer;
+
+		ids.reserve(seen_statfiles.size());
+		writer.map(2).str("statfiles").array(seen_statfiles.size());
+
+		for (const auto &[st_id, st]: seen_statfiles) {
+			ids.push_back(st_id);
+			writer.str(st.stcf->symbol);
+		}
+
+		writer.str("tokens").tokens(this->tokens);
+
+		auto *req = new http_request(this, selected, std::move(ids), false);
+
+		return req->send(task, "/classify", writer.release());
 	}
 	else {
 		/* On learn we need to learn all statfiles that we were requested to learn */
-		if (seen_statfiles.empty()) {
-			/* Request has been already set, or nothing to learn */
-			return true;
+		auto it = seen_statfiles.find(id);
+
+		if (tokens == nullptr || tokens->len == 0 || it == seen_statfiles.end()) {
+			return false;
 		}
-		else {
-			seen_statfiles.clear();
+
+		auto *tok = (rspamd_token_t *) g_ptr_array_index(tokens, 0);
+		msgpack_writer writer;
+
+		writer.map(3)
+			.str("statfile")
+			.str(it->second.stcf->symbol)
+			.str("delta")
+			.integer(tok->values[id] > 0 ? 1 : -1)
+			.str("tokens")
+			.tokens(tokens);
+
+		auto *req = new http_request(this, selected, std::vector<int>{id}, true);
+
+		return req->send(task, "/learn", writer.release());
+	}
+}
+
+auto http_backend_runtime::process_reply(struct rspamd_task *task, const std::vector<int> &ids,
+										 bool learn, const char *body, std::size_t len) -> void
+{
+	if (learn) {
+		if (len >= sizeof(std::uint64_t)) {
+			seen_statfiles[ids.front()].learns = read_le<std::uint64_t>(body);
 		}
+
+		return;
 	}
 
-	return true;
+	auto record_len = sizeof(std::uint64_t) + sizeof(float) * tokens->len;
+
+	if (len != record_len * ids.size()) {
+		msg_err_task("invalid reply from http statistics server: %uz bytes, %uz expected",
+					 len, record_len * ids.size());
+		set_error("invalid reply", 500);
+
+		return;
+	}
+
+	for (auto st_id: ids) {
+		auto &st = seen_statfiles[st_id];
+		rspamd_token_t *tok;
+		int i;
+
+		st.learns = read_le<std::uint64_t>(body);
+		body += sizeof(std::uint64_t);
+
+		PTR_ARRAY_FOREACH(tokens, i, tok)
+		{
+			auto bits = read_le<std::uint32_t>(body);
+			float val;
+
+			memcpy(&val, &bits, sizeof(val));
+			tok->values[st_id] = val;
+			body += sizeof(float);
+		}
+
+		task->flags |= st.stcf->is_spam ? RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS : RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
+}
+
+auto http_request::send(struct rspamd_task *task, const char *path, std::vector<std::uint8_t> &&body) -> bool
+{
+	auto *addr = rspamd_upstream_addr_next(up);
+	auto *host = rspamd_upstream_name(up);
+
+	this->task = task;
+	conn = rspamd_http_connection_new_client_keepalive(nullptr,
+													   nullptr,
+													   http_request::error_handler,
+													   http_request::finish_handler,
+													   RSPAMD_HTTP_CLIENT_SIMPLE,
+													   addr,
+													   host);
+
+	if (conn == nullptr) {
+		msg_err_task("cannot connect to http statistics server %s", host);
+		rspamd_upstream_fail(up, TRUE, "cannot connect");
+		delete this;
+
+		return false;
+	}
+
+	auto *msg = rspamd_http_new_message(HTTP_REQUEST);
+	msg->method = HTTP_POST;
+	msg->url = rspamd_fstring_append(msg->url, path, strlen(path));
+	rspamd_http_message_set_body(msg, (const char *) body.data(), body.size());
+
+	conn->log_tag = task->task_pool->tag.uid;
+	rspamd_session_add_event(task->s, http_request::fin, this, "stat_http");
+
+	return rspamd_http_connection_write_message(conn, msg, host, "application/msgpack",
+												this, rt->timeout());
+}
+
+auto http_request::error_handler(struct rspamd_http_connection *conn, GError *err) -> void
+{
+	auto *req = (http_request *) conn->ud;
+	auto *task = req->task;
+
+	msg_info_task("http statistics request to %s failed: %e", rspamd_upstream_name(req->up), err);
+	rspamd_upstream_fail(req->up, FALSE, err ? err->message : "unknown error");
+	req->rt->set_error(err ? err->message : "unknown error", 500);
+	rspamd_session_remove_event(task->s, http_request::fin, req);
+}
+
+auto http_request::finish_handler(struct rspamd_http_connection *conn,
+								  struct rspamd_http_message *msg) -> int
+{
+	auto *req = (http_request *) conn->ud;
+	auto *task = req->task;
+
+	rspamd_upstream_ok(req->up);
+
+	if (msg->code != 200) {
+		msg_info_task("http statistics server %s replied with code %d",
+					  rspamd_upstream_name(req->up), msg->code);
+		req->rt->set_error("bad reply code", msg->code);
+	}
+	else {
+		gsize body_len;
+		const auto *body = rspamd_http_message_get_body(msg, &body_len);
+
+		req->rt->process_reply(task, req->ids, req->learn, body, body_len);
+	}
+
+	rspamd_session_remove_event(task->s, http_request::fin, req);
+
+	return 0;
 }
 
 auto http_backends_collection::add_backend(struct rspamd_stat_ctx *ctx,
@@ -226,7 +557,7 @@ auto http_backends_collection::first_init(struct rspamd_stat_ctx *ctx,
 				return false;
 			}
 
-			if (!rspamd_upstreams_from_ucl(write_servers, rs, 80, this)) {
+			if (!rspamd_upstreams_from_ucl(write_servers, ws, 80, this)) {
 				rspamd_upstreams_destroy(write_servers);
 				return false;
 			}
@@ -325,35 +656,36 @@ rspamd_http_runtime(struct rspamd_task *task,
 					int id)
 {
 	auto maybe_existing = rspamd_mempool_get_variable(task->task_pool, RSPAMD_MEMPOOL_HTTP_STAT_BACKEND_RUNTIME);
+	auto *real_runtime = (rspamd::stat::http::http_backend_runtime *) maybe_existing;
 
-	if (maybe_existing != nullptr) {
-		auto real_runtime = (rspamd::stat::http::http_backend_runtime *) maybe_existing;
-		real_runtime->notice_statfile(id, stcf);
-
-		return maybe_existing;
+	if (real_runtime == nullptr) {
+		real_runtime = rspamd::stat::http::http_backend_runtime::create(task, learn);
+		rspamd_mempool_set_variable(task->task_pool, RSPAMD_MEMPOOL_HTTP_STAT_BACKEND_RUNTIME,
+									(void *) real_runtime, nullptr);
 	}
 
-	auto runtime = rspamd::stat::http::http_backend_runtime::create(task, learn);
+	real_runtime->notice_statfile(id, stcf);
 
-	if (runtime) {
-		runtime->notice_statfile(id, stcf);
-		rspamd_mempool_set_variable(task->task_pool, RSPAMD_MEMPOOL_HTTP_STAT_BACKEND_RUNTIME,
-									(void *) runtime, nullptr);
-	}
+	auto *st_runtime = rspamd_mempool_alloc_type(task->task_pool,
+												 rspamd::stat::http::http_statfile_runtime);
+	st_runtime->rt = real_runtime;
+	st_runtime->id = id;
 
-	return (void *) runtime;
+	return (void *) st_runtime;
 }
 
+#define HTTP_RUNTIME(p) ((rspamd::stat::http::http_statfile_runtime *) (p))
+
 gboolean
 rspamd_http_process_tokens(struct rspamd_task *task,
 						   GPtrArray *tokens,
 						   int id,
 						   gpointer runtime)
 {
-	auto real_runtime = (rspamd::stat::http::http_backend_runtime *) runtime;
+	auto *rt = HTTP_RUNTIME(runtime);
 
-	if (real_runtime) {
-		return real_runtime->process_tokens(task, tokens, id, false);
+	if (rt) {
+		return rt->rt->process_tokens(task, tokens, id, false);
 	}
 
 
@@ -364,8 +696,9 @@ rspamd_http_finalize_process(struct rspamd_task *task,
 							 gpointer runtime,
 							 gpointer ctx)
 {
-	/* Not needed */
-	return true;
+	auto *rt = HTTP_RUNTIME(runtime);
+
+	return !rt->rt->get_error().has_value();
 }
 
 gboolean
@@ -374,10 +707,10 @@ rspamd_http_learn_tokens(struct rspamd_task *task,
 						 int id,
 						 gpointer runtime)
 {
-	auto real_runtime = (rspamd::stat::http::http_backend_runtime *) runtime;
+	auto *rt = HTTP_RUNTIME(runtime);
 
-	if (real_runtime) {
-		return real_runtime->process_tokens(task, tokens, id, true);
+	if (rt) {
+		return rt->rt->process_tokens(task, tokens, id, true);
 	}
 
 
@@ -389,39 +722,54 @@ rspamd_http_finalize_learn(struct rspamd_task *task,
 						   gpointer ctx,
 						   GError **err)
 {
-	return false;
+	auto *rt = HTTP_RUNTIME(runtime);
+	const auto &maybe_err = rt->rt->get_error();
+
+	if (maybe_err.has_value()) {
+		maybe_err->into_g_error_set(rspamd_stat_quark(), err);
+
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 gulong rspamd_http_total_learns(struct rspamd_task *task,
 								gpointer runtime,
 								gpointer ctx)
 {
-	/* TODO */
-	return 0;
+	auto *rt = HTTP_RUNTIME(runtime);
+
+	return rt->rt->learns(rt->id);
 }
 gulong
 rspamd_http_inc_learns(struct rspamd_task *task,
 					   gpointer runtime,
 					   gpointer ctx)
 {
-	/* TODO */
-	return 0;
+	auto *rt = HTTP_RUNTIME(runtime);
+
+	/* Server increases learns itself */
+	return rt->rt->learns(rt->id) + 1;
 }
 gulong
 rspamd_http_dec_learns(struct rspamd_task *task,
 					   gpointer runtime,
 					   gpointer ctx)
 {
-	/* TODO */
-	return (gulong) -1;
+	auto *rt = HTTP_RUNTIME(runtime);
+	auto learns = rt->rt->learns(rt->id);
+
+	return learns > 0 ? learns - 1 : 0;
 }
 gulong
 rspamd_http_learns(struct rspamd_task *task,
 				   gpointer runtime,
 				   gpointer ctx)
 {
-	/* TODO */
-	return 0;
+	auto *rt = HTTP_RUNTIME(runtime);
+
+	return rt->rt->learns(rt->id);
 }
 ucl_object_t *
 rspamd_http_get_stat(gpointer runtime, gpointer ctx)
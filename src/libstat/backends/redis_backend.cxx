@@ -22,11 +22,15 @@
 #include "fmt/core.h"
 
 #include "libutil/cxx/error.hxx"
+#include "contrib/ankerl/unordered_dense.h"
+#include "contrib/libev/ev.h"
 
 #include <string>
 #include <cstdint>
 #include <vector>
 #include <optional>
+#include <memory>
+#include <tuple>
 
 #define msg_debug_stat_redis(...) rspamd_conditional_debug_fast(nullptr, nullptr,                                                 \
 																rspamd_stat_redis_log_id, "stat_redis", task->task_pool->tag.uid, \
@@ -42,6 +46,10 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_MAX_USERS 1000
+#define REDIS_DEFAULT_HOT_CACHE_TTL 60.0
+#define REDIS_DEFAULT_LEARN_BATCH_TIMEOUT 1.0
+
+class redis_learn_queue;
 
 struct redis_stat_ctx {
 	lua_State *L;
@@ -51,9 +59,17 @@ struct redis_stat_ctx {
 	bool store_tokens = false;
 	bool enable_signatures = false;
 	int cbref_user = -1;
+	/* Local cache of frequent tokens, disabled if size is zero */
+	std::size_t hot_cache_size = 0;
+	double hot_cache_ttl = REDIS_DEFAULT_HOT_CACHE_TTL;
+	/* Learns coalescing, disabled if size is zero */
+	std::size_t learn_batch_size = 0;
+	double learn_batch_timeout = REDIS_DEFAULT_LEARN_BATCH_TIMEOUT;
+	redis_learn_queue *learn_queue = nullptr;
 
 	int cbref_classify = -1;
 	int cbref_learn = -1;
+	int cbref_learn_batch = -1;
 
 	ucl_object_t *cur_stat = nullptr;
 
@@ -75,10 +91,187 @@ struct redis_stat_ctx {
 		if (cbref_learn != -1) {
 			luaL_unref(L, LUA_REGISTRYINDEX, cbref_learn);
 		}
+
+		if (cbref_learn_batch != -1) {
+			luaL_unref(L, LUA_REGISTRYINDEX, cbref_learn_batch);
+		}
 	}
 };
 
 
+/*
+ * Direct mapped cache of token values (both classes) fetched from Redis.
+ * Tokens frequencies are heavily skewed, so a small table serves most of
+ * lookups; values are used for `ttl` seconds at most and tokens learned by
+ * this process are invalidated immediately.
+ */
+class redis_hot_tokens {
+	struct entry {
+		std::uint64_t token;
+		float spam;
+		float ham;
+		double ts;
+	};
+
+	std::vector<entry> slots;
+	double ttl;
+	std::uint64_t learned_spam = 0;
+	std::uint64_t learned_ham = 0;
+	double learns_ts = 0;
+
+	auto slot(std::uint64_t token) -> entry &
+	{
+		/* Tokens are hashes already */
+		return slots[token % slots.size()];
+	}
+
+public:
+	redis_hot_tokens(std::size_t size, double ttl)
+		: slots(size, entry{0, 0, 0, 0}), ttl(ttl)
+	{
+	}
+
+	auto lookup(std::uint64_t token, double now) -> std::optional<std::pair<float, float>>
+	{
+		const auto &e = slot(token);
+
+		if (e.ts > 0 && e.token == token && now - e.ts < ttl) {
+			return std::make_pair(e.spam, e.ham);
+		}
+
+		return std::nullopt;
+	}
+
+	auto store(std::uint64_t token, float spam, float ham, double now) -> void
+	{
+		slot(token) = entry{token, spam, ham, now};
+	}
+
+	auto invalidate(std::uint64_t token) -> void
+	{
+		auto &e = slot(token);
+
+		if (e.token == token) {
+			e.ts = 0;
+		}
+	}
+
+	auto learns(double now) const -> std::optional<std::pair<std::uint64_t, std::uint64_t>>
+	{
+		if (learns_ts > 0 && now - learns_ts < ttl) {
+			return std::make_pair(learned_spam, learned_ham);
+		}
+
+		return std::nullopt;
+	}
+
+	auto store_learns(std::uint64_t spam, std::uint64_t ham, double now) -> void
+	{
+		learned_spam = spam;
+		learned_ham = ham;
+		learns_ts = now;
+	}
+
+	auto invalidate_learns() -> void
+	{
+		learns_ts = 0;
+	}
+};
+
+/*
+ * Both classes of the same classifier are stored under the same Redis object,
+ * whilst they have different backend contexts, so caches are per object
+ */
+static auto
+redis_get_hot_tokens(struct redis_stat_ctx *ctx, const char *object) -> redis_hot_tokens *
+{
+	static ankerl::unordered_dense::map<std::string, std::unique_ptr<redis_hot_tokens>> caches;
+
+	if (ctx->hot_cache_size == 0 || ctx->enable_users) {
+		return nullptr;
+	}
+
+	auto it = caches.find(object);
+
+	if (it == caches.end()) {
+		it = caches.emplace(object,
+							std::make_unique<redis_hot_tokens>(ctx->hot_cache_size, ctx->hot_cache_ttl))
+				 .first;
+	}
+
+	return it->second.get();
+}
+
+/*
+ * Coalesces learns of a single class: token increments of many messages are
+ * summed in memory and written by a single script call per Redis object when
+ * the number of pending tokens reaches the limit or on a timer.
+ * Pending increments are lost if a worker terminates before a flush.
+ */
+class redis_learn_queue {
+public:
+	explicit redis_learn_queue(struct redis_stat_ctx *_ctx, struct ev_loop *_loop)
+		: ctx(_ctx), loop(_loop)
+	{
+		ev_timer_init(&timer, redis_learn_queue::timer_cb, 0.0, 0.0);
+		timer.data = this;
+	}
+	redis_learn_queue(const redis_learn_queue &) = delete;
+	~redis_learn_queue()
+	{
+		ev_timer_stop(loop, &timer);
+	}
+
+	auto push(const char *object, GPtrArray *tokens, bool unlearn) -> void
+	{
+		auto &batch = batches[object];
+		auto delta = unlearn ? -1 : 1;
+		rspamd_token_t *tok;
+		int i;
+
+		batch.learns += delta;
+
+		PTR_ARRAY_FOREACH(tokens, i, tok)
+		{
+			auto [it, inserted] = batch.deltas.try_emplace(tok->data, 0);
+			it->second += delta;
+
+			if (inserted) {
+				pending++;
+			}
+		}
+
+		if (pending >= ctx->learn_batch_size) {
+			flush();
+		}
+		else if (!ev_is_active(&timer)) {
+			ev_timer_set(&timer, ctx->learn_batch_timeout, 0.0);
+			ev_timer_start(loop, &timer);
+		}
+	}
+
+	auto flush() -> void;
+
+private:
+	struct object_batch {
+		std::int64_t learns = 0;
+		ankerl::unordered_dense::map<std::uint64_t, std::int64_t> deltas;
+	};
+
+	struct redis_stat_ctx *ctx;
+	struct ev_loop *loop;
+	ev_timer timer;
+	ankerl::unordered_dense::map<std::string, object_batch> batches;
+	std::size_t pending = 0;
+
+	static void timer_cb(EV_P_ ev_timer *w, int revents)
+	{
+		auto *queue = reinterpret_cast<redis_learn_queue *>(w->data);
+
+		queue->flush();
+	}
+};
+
 template<class T, std::enable_if_t<std::is_convertible_v<T, float>, bool> = true>
 struct redis_stat_runtime {
 	struct redis_stat_ctx *ctx;
@@ -91,6 +284,12 @@ struct redis_stat_runtime {
 	std::vector<std::pair<int, T>> *results = nullptr;
 	bool need_redis_call = true;
 	std::optional<rspamd::util::error> err;
+	/* Tokens sent to Redis when some are served by the hot cache */
+	GPtrArray *cold_tokens = nullptr;
+	/* Index of a cold token in the tokens array */
+	std::vector<int> cold_map;
+	/* Index, spam and ham values of tokens found in the hot cache */
+	std::vector<std::tuple<int, float, float>> hot_hits;
 
 	using result_type = std::vector<std::pair<int, T>>;
 
@@ -110,6 +309,10 @@ private:
 			g_ptr_array_unref(tokens);
 		}
 
+		if (cold_tokens) {
+			g_ptr_array_free(cold_tokens, TRUE);
+		}
+
 		delete results;
 	}
 
@@ -510,6 +713,34 @@ rspamd_redis_parse_classifier_opts(struct redis_stat_ctx *backend,
 	else {
 		backend->enable_signatures = FALSE;
 	}
+
+	elt = ucl_object_lookup(classifier_obj, "hot_cache_size");
+	if (elt && ucl_object_toint(elt) > 0) {
+		backend->hot_cache_size = ucl_object_toint(elt);
+
+		if (backend->enable_users) {
+			msg_warn_config("hot tokens cache is not supported for per user statistics");
+		}
+	}
+
+	elt = ucl_object_lookup(classifier_obj, "hot_cache_ttl");
+	if (elt) {
+		backend->hot_cache_ttl = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_lookup(classifier_obj, "learn_batch_size");
+	if (elt && ucl_object_toint(elt) > 0) {
+		backend->learn_batch_size = ucl_object_toint(elt);
+
+		if (backend->store_tokens) {
+			msg_warn_config("learns batching is not supported when tokens are stored");
+		}
+	}
+
+	elt = ucl_object_lookup(classifier_obj, "learn_batch_timeout");
+	if (elt && ucl_object_todouble(elt) > 0) {
+		backend->learn_batch_timeout = ucl_object_todouble(elt);
+	}
 }
 
 gpointer
@@ -562,7 +793,7 @@ rspamd_redis_init(struct rspamd_stat_ctx *ctx,
 	lua_pushstring(L, cookie);
 	lua_pushcclosure(L, &rspamd_redis_stat_cb, 1);
 
-	if (lua_pcall(L, 6, 2, err_idx) != 0) {
+	if (lua_pcall(L, 6, 3, err_idx) != 0) {
 		msg_err("call to lua_bayes_init_classifier "
 				"script failed: %s",
 				lua_tostring(L, -1));
@@ -572,16 +803,22 @@ rspamd_redis_init(struct rspamd_stat_ctx *ctx,
 	}
 
 	/* Results are in the stack:
-	 * top - 1 - classifier function (idx = -2)
-	 * top - learn function (idx = -1)
+	 * top - 2 - classifier function (idx = -3)
+	 * top - 1 - learn function (idx = -2)
+	 * top - batch learn function (idx = -1), optional
 	 */
 
-	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -3);
 	backend->cbref_classify = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	lua_pushvalue(L, -1);
+	lua_pushvalue(L, -2);
 	backend->cbref_learn = luaL_ref(L, LUA_REGISTRYINDEX);
 
+	if (lua_type(L, -1) == LUA_TFUNCTION) {
+		lua_pushvalue(L, -1);
+		backend->cbref_learn_batch = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
 	lua_settop(L, err_idx - 1);
 
 	return backend.release();
@@ -649,6 +886,7 @@ rspamd_redis_runtime(struct rspamd_task *task,
 void rspamd_redis_close(gpointer p)
 {
 	struct redis_stat_ctx *ctx = REDIS_CTX(p);
+	delete ctx->learn_queue;
 	delete ctx;
 }
 
@@ -704,6 +942,76 @@ msgpack_str_len(std::size_t len) -> std::size_t
 	}
 }
 
+static int
+rspamd_redis_batch_learned(lua_State *L)
+{
+	auto *symbol = lua_tostring(L, lua_upvalueindex(1));
+
+	if (!lua_toboolean(L, 1)) {
+		msg_err("cannot write batched learns for %s: %s", symbol, lua_tostring(L, 2));
+	}
+
+	return 0;
+}
+
+/*
+ * Batch is serialised as a message pack array of token keys interleaved with
+ * their increments
+ */
+auto redis_learn_queue::flush() -> void
+{
+	auto *L = ctx->L;
+	char max_int64_str[] = "18446744073709551615", numbuf[64];
+
+	ev_timer_stop(loop, &timer);
+
+	for (auto &[object, batch]: batches) {
+		std::string buf;
+		auto numbuf_len = sizeof(max_int64_str) + object.size() + 1;
+		auto *keybuf = (char *) g_alloca(numbuf_len);
+		std::uint32_t nelts = batch.deltas.size() * 2;
+
+		buf.resize(5 + batch.deltas.size() *
+						   (msgpack_str_len(numbuf_len) + msgpack_str_len(sizeof(numbuf))));
+		auto *p = buf.data();
+		*p++ = (char) 0xdd;
+		*p++ = (char) ((nelts >> 24) & 0xff);
+		*p++ = (char) ((nelts >> 16) & 0xff);
+		*p++ = (char) ((nelts >> 8) & 0xff);
+		*p++ = (char) (nelts & 0xff);
+
+		for (const auto &[token, delta]: batch.deltas) {
+			std::size_t r = rspamd_snprintf(keybuf, numbuf_len, "%s_%uL", object.c_str(), token);
+			p += msgpack_emit_str({keybuf, r}, p);
+			r = rspamd_snprintf(numbuf, sizeof(numbuf), "%L", delta);
+			p += msgpack_emit_str({numbuf, r}, p);
+		}
+
+		buf.resize(p - buf.data());
+
+		lua_pushcfunction(L, &rspamd_lua_traceback);
+		auto err_idx = lua_gettop(L);
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->cbref_learn_batch);
+		lua_pushstring(L, object.c_str());
+		lua_pushboolean(L, ctx->stcf->is_spam);
+		lua_pushstring(L, ctx->stcf->symbol);
+		lua_pushinteger(L, batch.learns);
+		lua_new_text(L, buf.data(), buf.size(), TRUE);
+		lua_pushstring(L, ctx->stcf->symbol);
+		lua_pushcclosure(L, &rspamd_redis_batch_learned, 1);
+
+		if (lua_pcall(L, 6, 0, err_idx) != 0) {
+			msg_err("call to batch learn script failed: %s", lua_tostring(L, -1));
+		}
+
+		lua_settop(L, err_idx - 1);
+	}
+
+	batches.clear();
+	pending = 0;
+}
+
 /*
  * Serialise stat tokens to message pack
  */
@@ -833,7 +1141,8 @@ rspamd_redis_classified(lua_State *L)
 		/*
 		 * We need to fill our runtime AND the opposite runtime
 		 */
-		auto filler_func = [](redis_stat_runtime<float> *rt, lua_State *L, unsigned learned, int tokens_pos) {
+		const auto &cold_map = rt->cold_map;
+		auto filler_func = [&cold_map](redis_stat_runtime<float> *rt, lua_State *L, unsigned learned, int tokens_pos) {
 			rt->learned = learned;
 			redis_stat_runtime<float>::result_type *res;
 
@@ -844,6 +1153,15 @@ rspamd_redis_classified(lua_State *L)
 				auto idx = lua_tointeger(L, -1);
 				lua_pop(L, 1);
 
+				if (!cold_map.empty()) {
+					if (idx < 1 || idx > (int) cold_map.size()) {
+						continue;
+					}
+
+					/* Back to the index in the full tokens array */
+					idx = cold_map[idx - 1];
+				}
+
 				lua_rawgeti(L, -1, 2);
 				auto value = lua_tonumber(L, -1);
 				lua_pop(L, 1);
@@ -873,6 +1191,37 @@ rspamd_redis_classified(lua_State *L)
 			filler_func(opposite_rt_maybe.value(), L, lua_tointeger(L, 4), 6);
 		}
 
+		auto *hot = redis_get_hot_tokens(rt->ctx, rt->redis_object_expanded);
+
+		if (hot) {
+			auto *spam_rt = rt->stcf->is_spam ? rt : opposite_rt_maybe.value();
+			auto *ham_rt = rt->stcf->is_spam ? opposite_rt_maybe.value() : rt;
+			auto now = task->task_timestamp;
+			/* Both values of tokens found in Redis, indexed as the tokens array */
+			std::vector<std::pair<float, float>> values(rt->tokens->len, {0.0f, 0.0f});
+
+			for (auto [idx, val]: *spam_rt->results) {
+				values[idx - 1].first = val;
+			}
+			for (auto [idx, val]: *ham_rt->results) {
+				values[idx - 1].second = val;
+			}
+
+			for (auto i = 0u; i < rt->tokens->len; i++) {
+				if (values[i].first > 0 || values[i].second > 0) {
+					auto *tok = (rspamd_token_t *) g_ptr_array_index(rt->tokens, i);
+					hot->store(tok->data, values[i].first, values[i].second, now);
+				}
+			}
+
+			hot->store_learns(spam_rt->learned, ham_rt->learned, now);
+
+			for (const auto &[idx, spam, ham]: rt->hot_hits) {
+				spam_rt->results->emplace_back(idx, spam);
+				ham_rt->results->emplace_back(idx, ham);
+			}
+		}
+
 		/* Mark task as being processed */
 		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS | RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
 
@@ -913,14 +1262,91 @@ rspamd_redis_process_tokens(struct rspamd_task *task,
 		/* However, we need to store id as it is needed for further tokens processing */
 		rt->id = id;
 		rt->tokens = g_ptr_array_ref(tokens);
+		/* Results might be already available from the hot tokens cache */
+		rt->process_tokens(tokens);
 
 		return TRUE;
 	}
 
-	gsize tokens_len;
-	char *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens, &tokens_len);
 	rt->id = id;
 
+	auto *hot = redis_get_hot_tokens(rt->ctx, rt->redis_object_expanded);
+	GPtrArray *query_tokens = tokens;
+
+	if (hot) {
+		auto now = task->task_timestamp;
+		rspamd_token_t *tok;
+		int i;
+
+		rt->cold_tokens = g_ptr_array_sized_new(tokens->len);
+
+		PTR_ARRAY_FOREACH(tokens, i, tok)
+		{
+			auto cached = hot->lookup(tok->data, now);
+
+			if (cached) {
+				rt->hot_hits.emplace_back(i + 1, cached->first, cached->second);
+			}
+			else {
+				g_ptr_array_add(rt->cold_tokens, tok);
+				rt->cold_map.push_back(i + 1);
+			}
+		}
+
+		auto learns = hot->learns(now);
+
+		if (rt->cold_tokens->len == 0 && learns) {
+			/* Everything is in the cache, no need to ask Redis */
+			auto opposite_rt_maybe = redis_stat_runtime<float>::maybe_recover_from_mempool(task,
+																						   rt->redis_object_expanded,
+																						   !rt->stcf->is_spam);
+
+			if (opposite_rt_maybe) {
+				auto *spam_rt = rt->stcf->is_spam ? rt : opposite_rt_maybe.value();
+				auto *ham_rt = rt->stcf->is_spam ? opposite_rt_maybe.value() : rt;
+				auto *spam_res = new redis_stat_runtime<float>::result_type();
+				auto *ham_res = new redis_stat_runtime<float>::result_type();
+
+				for (const auto &[idx, spam, ham]: rt->hot_hits) {
+					spam_res->emplace_back(idx, spam);
+					ham_res->emplace_back(idx, ham);
+				}
+
+				spam_rt->learned = learns->first;
+				ham_rt->learned = learns->second;
+				spam_rt->set_results(spam_res);
+				ham_rt->set_results(ham_res);
+
+				task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS | RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				rt->tokens = g_ptr_array_ref(tokens);
+				rt->process_tokens(rt->tokens);
+
+				if (opposite_rt_maybe.value()->tokens) {
+					/* Opposite class has been already processed */
+					opposite_rt_maybe.value()->process_tokens(tokens);
+				}
+
+				msg_debug_stat_redis("all %d tokens are found in the hot cache", tokens->len);
+
+				return TRUE;
+			}
+		}
+
+		if (rt->cold_tokens->len > 0) {
+			msg_debug_stat_redis("%d of %d tokens are found in the hot cache",
+								 (int) rt->hot_hits.size(), tokens->len);
+			query_tokens = rt->cold_tokens;
+		}
+		else {
+			/* Learns are stale, so query all tokens to refresh them */
+			rt->hot_hits.clear();
+			rt->cold_map.clear();
+		}
+	}
+
+	gsize tokens_len;
+	char *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, query_tokens, &tokens_len);
+
 	lua_pushcfunction(L, &rspamd_lua_traceback);
 	int err_idx = lua_gettop(L);
 
@@ -1007,11 +1433,41 @@ rspamd_redis_learn_tokens(struct rspamd_task *task,
 		return FALSE;
 	}
 
+	rt->id = id;
+
+	auto *hot = redis_get_hot_tokens(rt->ctx, rt->redis_object_expanded);
+
+	if (hot) {
+		rspamd_token_t *hot_tok;
+		int i;
+
+		PTR_ARRAY_FOREACH(tokens, i, hot_tok)
+		{
+			hot->invalidate(hot_tok->data);
+		}
+
+		hot->invalidate_learns();
+	}
+
+	/* Detect unlearn */
+	auto *tok = (rspamd_token_t *) g_ptr_array_index(task->tokens, 0);
+	bool unlearn = !(tok->values[id] > 0);
+
+	if (rt->ctx->learn_batch_size > 0 && rt->ctx->cbref_learn_batch != -1 &&
+		!rt->ctx->store_tokens) {
+		/* Increments are written later, learn itself is done */
+		if (rt->ctx->learn_queue == nullptr) {
+			rt->ctx->learn_queue = new redis_learn_queue(rt->ctx, task->event_loop);
+		}
+
+		rt->ctx->learn_queue->push(rt->redis_object_expanded, tokens, unlearn);
+
+		return TRUE;
+	}
+
 	gsize tokens_len;
 	char *tokens_buf = rspamd_redis_serialize_tokens(task, rt->redis_object_expanded, tokens, &tokens_len);
 
-	rt->id = id;
-
 	gsize text_tokens_len = 0;
 	char *text_tokens_buf = nullptr;
 
@@ -1031,15 +1487,7 @@ rspamd_redis_learn_tokens(struct rspamd_task *task,
 	lua_pushboolean(L, rt->stcf->is_spam);
 	lua_pushstring(L, rt->stcf->symbol);
 
-	/* Detect unlearn */
-	auto *tok = (rspamd_token_t *) g_ptr_array_index(task->tokens, 0);
-
-	if (tok->values[id] > 0) {
-		lua_pushboolean(L, FALSE);// Learn
-	}
-	else {
-		lua_pushboolean(L, TRUE);// Unlearn
-	}
+	lua_pushboolean(L, unlearn);
 	lua_new_text(L, tokens_buf, tokens_len, false);
 
 	/* Store rt in random cookie */
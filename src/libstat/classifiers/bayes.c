@@ -20,6 +20,7 @@
 #include "rspamd.h"
 #include "stat_internal.h"
 #include "math.h"
+#include <float.h>
 
 #define msg_err_bayes(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL,              \
 													   "bayes", task->task_pool->tag.uid, \
@@ -83,13 +84,21 @@ inv_chi_square(struct rspamd_task *task, double value, int freedom_deg)
 	 * prob is e ^ x (small value since x is normally less than zero
 	 * So we integrate over degrees of freedom and produce the total result
 	 * from 1.0 (no confidence) to 0.0 (full confidence)
+	 *
+	 * All terms are positive, so we can stop as soon as the sum reaches 1.0,
+	 * or when terms start to decrease (i > m) and no longer change the sum
 	 */
-	for (i = 1; i < freedom_deg; i++) {
+	for (i = 1; i < freedom_deg && sum < 1.0; i++) {
 		prob *= m / (double) i;
 		sum += prob;
-		msg_debug_bayes("i=%d, probability: %g, sum: %g", i, prob, sum);
+
+		if (i > m && prob < sum * DBL_EPSILON) {
+			break;
+		}
 	}
 
+	msg_debug_bayes("%d of %d terms, sum: %g", i, freedom_deg, sum);
+
 	return MIN(1.0, sum);
 }
 
@@ -110,12 +119,37 @@ struct bayes_task_closure {
 static const double feature_weight[] = {0, 3125, 256, 27, 1, 0, 0, 0};
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Tokens that have passed the initial checks in the structure of arrays form,
+ * so the scoring loop has no per token branches and can be vectorized
+ */
+struct bayes_tokens_batch {
+	double *spam_count;
+	double *ham_count;
+	/* Feature weight of a token */
+	double *fw;
+	/* 1.0 for text tokens and 0.0 for meta tokens */
+	double *is_text;
+	unsigned int n;
+};
+
+/*
+ * Number of independent accumulators in the scoring loop and the number of
+ * rounds after which they are normalised. The lowest token probability is
+ * about 0.5 / (1 + count), so even with 32 bit counts 16 products cannot
+ * underflow
+ */
+#define BAYES_LANES 4
+#define BAYES_RENORM_ROUNDS 16
+
+/*
+ * In this callback we collect counts of a token from all statfiles
  */
 static void
-bayes_classify_token(struct rspamd_classifier *ctx,
-					 rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_collect_token(struct rspamd_classifier *ctx,
+					rspamd_token_t *tok, struct bayes_task_closure *cl,
+					struct bayes_tokens_batch *batch)
 {
 	unsigned int i;
 	int id;
@@ -123,8 +157,7 @@ bayes_classify_token(struct rspamd_classifier *ctx,
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
 	const char *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, val;
+	double fw, val;
 
 	task = cl->task;
 
@@ -170,84 +203,131 @@ bayes_classify_token(struct rspamd_classifier *ctx,
 		}
 	}
 
-	/* Probability for this token */
-	if (total_count >= ctx->cfg->min_token_hits) {
-		spam_freq = ((double) spam_count / MAX(1., (double) ctx->spam_learns));
-		ham_freq = ((double) ham_count / MAX(1., (double) ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-
-		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			fw = 1.0;
-		}
-		else {
-			fw = feature_weight[tok->window_idx %
-								G_N_ELEMENTS(feature_weight)];
-		}
+	if (total_count < ctx->cfg->min_token_hits) {
+		return;
+	}
 
+	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
+		fw = 1.0;
+	}
+	else {
+		fw = feature_weight[tok->window_idx %
+							G_N_ELEMENTS(feature_weight)];
+	}
 
-		w = (fw * total_count) / (1.0 + fw * total_count);
+	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) {
+		token_type = "meta";
+	}
 
-		bayes_spam_prob = PROB_COMBINE(spam_prob, total_count, w, 0.5);
+	batch->spam_count[batch->n] = spam_count;
+	batch->ham_count[batch->n] = ham_count;
+	batch->fw[batch->n] = fw;
+	batch->is_text[batch->n] = (tok->flags & RSPAMD_STAT_TOKEN_FLAG_META) ? 0.0 : 1.0;
+	batch->n++;
+
+	if (tok->t1 && tok->t2) {
+		msg_debug_bayes("token(%s) %uL <%*s:%*s>: weight: %f, "
+						"total_count: %ud, "
+						"spam_count: %ud, ham_count: %ud",
+						token_type,
+						tok->data,
+						(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
+						(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
+						fw, total_count, spam_count, ham_count);
+	}
+	else {
+		msg_debug_bayes("token(%s) %uL <?:?>: weight: %f, "
+						"total_count: %ud, "
+						"spam_count: %ud, ham_count: %ud",
+						token_type,
+						tok->data,
+						fw, total_count, spam_count, ham_count);
+	}
+}
 
-		if ((bayes_spam_prob > 0.5 && bayes_spam_prob < 0.5 + ctx->cfg->min_prob_strength) ||
-			(bayes_spam_prob < 0.5 && bayes_spam_prob > 0.5 - ctx->cfg->min_prob_strength)) {
-			msg_debug_bayes(
-				"token %uL <%*s:%*s> skipped, probability not in range: %f",
-				tok->data,
-				(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
-				(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-				bayes_spam_prob);
+/*
+ * Calculates local probabilities of all collected tokens and combines them.
+ * Instead of a log call per token we multiply probabilities in several lanes,
+ * keeping mantissas and exponents apart, and take logarithms once per lane
+ */
+static void
+bayes_score_tokens(struct rspamd_classifier *ctx,
+				   const struct bayes_tokens_batch *batch,
+				   struct bayes_task_closure *cl)
+{
+	struct rspamd_task *task = cl->task;
+	double spam_acc[BAYES_LANES], ham_acc[BAYES_LANES],
+		processed[BAYES_LANES], text[BAYES_LANES];
+	double spam_learns = MAX(1., (double) ctx->spam_learns),
+		   ham_learns = MAX(1., (double) ctx->ham_learns),
+		   min_strength = ctx->cfg->min_prob_strength;
+	int64_t spam_exp = 0, ham_exp = 0;
+	unsigned int i, j, rounds = 0;
+	int e;
+
+	for (j = 0; j < BAYES_LANES; j++) {
+		spam_acc[j] = 1.0;
+		ham_acc[j] = 1.0;
+		processed[j] = 0;
+		text[j] = 0;
+	}
 
-			return;
+	for (i = 0; i < batch->n; i += BAYES_LANES) {
+		for (j = 0; j < BAYES_LANES; j++) {
+			/* Tail lanes repeat the first token of the round and are masked */
+			unsigned int k = i + j < batch->n ? i + j : i;
+			double valid = i + j < batch->n ? 1.0 : 0.0;
+			double spam_count = batch->spam_count[k],
+				   ham_count = batch->ham_count[k],
+				   total_count = spam_count + ham_count;
+			double spam_freq = spam_count / spam_learns,
+				   ham_freq = ham_count / ham_learns;
+			double spam_prob = spam_freq / (spam_freq + ham_freq),
+				   ham_prob = ham_freq / (spam_freq + ham_freq);
+			double w = (batch->fw[k] * total_count) / (1.0 + batch->fw[k] * total_count);
+			double bayes_spam_prob = PROB_COMBINE(spam_prob, total_count, w, 0.5),
+				   bayes_ham_prob = PROB_COMBINE(ham_prob, total_count, w, 0.5);
+			double dist = fabs(bayes_spam_prob - 0.5), keep;
+
+			/* Tokens with probability too close to 0.5 are skipped */
+			keep = (dist == 0 || dist >= min_strength) ? valid : 0.0;
+			processed[j] += keep;
+			text[j] += keep * batch->is_text[k];
+			/* Skipped tokens are multiplied by 1.0 */
+			spam_acc[j] *= keep * bayes_spam_prob + (1.0 - keep);
+			ham_acc[j] *= keep * bayes_ham_prob + (1.0 - keep);
 		}
 
-		bayes_ham_prob = PROB_COMBINE(ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log(bayes_spam_prob);
-		cl->ham_prob += log(bayes_ham_prob);
-		cl->processed_tokens++;
+		if (++rounds == BAYES_RENORM_ROUNDS) {
+			for (j = 0; j < BAYES_LANES; j++) {
+				spam_acc[j] = frexp(spam_acc[j], &e);
+				spam_exp += e;
+				ham_acc[j] = frexp(ham_acc[j], &e);
+				ham_exp += e;
+			}
 
-		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
-			cl->text_tokens++;
-		}
-		else {
-			token_type = "meta";
+			rounds = 0;
 		}
+	}
 
-		if (tok->t1 && tok->t2) {
-			msg_debug_bayes("token(%s) %uL <%*s:%*s>: weight: %f, cf: %f, "
-							"total_count: %ud, "
-							"spam_count: %ud, ham_count: %ud,"
-							"spam_prob: %.3f, ham_prob: %.3f, "
-							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-							"current spam probability: %.3f, current ham probability: %.3f",
-							token_type,
-							tok->data,
-							(int) tok->t1->stemmed.len, tok->t1->stemmed.begin,
-							(int) tok->t2->stemmed.len, tok->t2->stemmed.begin,
-							fw, w, total_count, spam_count, ham_count,
-							spam_prob, ham_prob,
-							bayes_spam_prob, bayes_ham_prob,
-							cl->spam_prob, cl->ham_prob);
-		}
-		else {
-			msg_debug_bayes("token(%s) %uL <?:?>: weight: %f, cf: %f, "
-							"total_count: %ud, "
-							"spam_count: %ud, ham_count: %ud,"
-							"spam_prob: %.3f, ham_prob: %.3f, "
-							"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-							"current spam probability: %.3f, current ham probability: %.3f",
-							token_type,
-							tok->data,
-							fw, w, total_count, spam_count, ham_count,
-							spam_prob, ham_prob,
-							bayes_spam_prob, bayes_ham_prob,
-							cl->spam_prob, cl->ham_prob);
-		}
+	for (j = 0; j < BAYES_LANES; j++) {
+		spam_acc[j] = frexp(spam_acc[j], &e);
+		spam_exp += e;
+		ham_acc[j] = frexp(ham_acc[j], &e);
+		ham_exp += e;
+		cl->spam_prob += log(spam_acc[j]);
+		cl->ham_prob += log(ham_acc[j]);
+		cl->processed_tokens += processed[j];
+		cl->text_tokens += text[j];
 	}
-}
 
+	cl->spam_prob += (double) spam_exp * M_LN2;
+	cl->ham_prob += (double) ham_exp * M_LN2;
+
+	msg_debug_bayes("scored %uL of %ud tokens: spam probability: %.3f, "
+					"ham probability: %.3f",
+					cl->processed_tokens, batch->n, cl->spam_prob, cl->ham_prob);
+}
 
 gboolean
 bayes_init(struct rspamd_config *cfg,
@@ -272,6 +352,7 @@ bayes_classify(struct rspamd_classifier *ctx,
 	char sumbuf[32];
 	struct rspamd_statfile *st = NULL;
 	struct bayes_task_closure cl;
+	struct bayes_tokens_batch batch;
 	rspamd_token_t *tok;
 	unsigned int i, text_tokens = 0;
 	int id;
@@ -325,12 +406,20 @@ bayes_classify(struct rspamd_classifier *ctx,
 		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
 	}
 
+	batch.n = 0;
+	batch.spam_count = rspamd_mempool_alloc(task->task_pool,
+											sizeof(double) * tokens->len * 4);
+	batch.ham_count = batch.spam_count + tokens->len;
+	batch.fw = batch.ham_count + tokens->len;
+	batch.is_text = batch.fw + tokens->len;
+
 	for (i = 0; i < tokens->len; i++) {
 		tok = g_ptr_array_index(tokens, i);
-
-		bayes_classify_token(ctx, tok, &cl);
+		bayes_collect_token(ctx, tok, &cl, &batch);
 	}
 
+	bayes_score_tokens(ctx, &batch, &cl);
+
 	if (cl.processed_tokens == 0) {
 		msg_info_bayes("no tokens found in bayes database "
 					   "(%ud total tokens, %ud text tokens), ignore stats",
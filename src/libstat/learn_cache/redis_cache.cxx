@@ -23,14 +23,202 @@
 #include "cryptobox.h"
 #include "ucl.h"
 #include "libmime/message.h"
+#include "unix-std.h"
 
 #include <memory>
+#include <string>
+#include "contrib/expected/expected.hpp"
+#include "fmt/core.h"
+
+/*
+ * Bloom filter of learned ids, that allows to skip Redis checks for messages
+ * that have never been learned: Redis is asked only on positive matches to
+ * filter false positives out. There are two generations of bits, checks use
+ * both and learns set bits in the current one; when the current generation
+ * is full, the older one is cleared and becomes current.
+ * If a file is specified, the filter is mapped from it, so it is shared by
+ * all workers of a host and survives restarts. Ids learned by other hosts or
+ * before the filter has been enabled are not known to it.
+ */
+class learn_bloom {
+public:
+	learn_bloom(const learn_bloom &) = delete;
+	~learn_bloom()
+	{
+		munmap(map, map_len);
+	}
+
+	static auto open(std::size_t nelts, const char *path) -> tl::expected<std::unique_ptr<learn_bloom>, std::string>;
+
+	auto maybe_contains(const char *id) const -> bool
+	{
+		std::uint64_t h1, h2;
+		hashes(id, h1, h2);
+
+		for (auto gen = 0; gen < 2; gen++) {
+			const auto *bits = gen_bits(gen);
+			auto found = true;
+
+			for (auto i = 0u; i < nhashes; i++) {
+				auto bit = (h1 + i * h2) & (hdr->nbits - 1);
+
+				if (!(__atomic_load_n(&bits[bit / 64], __ATOMIC_RELAXED) & (1ULL << (bit % 64)))) {
+					found = false;
+					break;
+				}
+			}
+
+			if (found) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	auto insert(const char *id) -> void
+	{
+		std::uint64_t h1, h2;
+		hashes(id, h1, h2);
+		auto gen = __atomic_load_n(&hdr->cur_gen, __ATOMIC_ACQUIRE);
+		auto *bits = gen_bits(gen);
+
+		for (auto i = 0u; i < nhashes; i++) {
+			auto bit = (h1 + i * h2) & (hdr->nbits - 1);
+			__atomic_fetch_or(&bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+		}
+
+		if (__atomic_add_fetch(&hdr->inserted[gen], 1, __ATOMIC_RELAXED) >= hdr->capacity) {
+			auto next_gen = gen ^ 1u;
+
+			/* Only one process rotates generations */
+			if (__atomic_compare_exchange_n(&hdr->cur_gen, &gen, next_gen, false,
+											__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				memset(gen_bits(next_gen), 0, hdr->nbits / 8);
+				__atomic_store_n(&hdr->inserted[next_gen], 0, __ATOMIC_RELEASE);
+			}
+		}
+	}
+
+private:
+	struct bloom_header {
+		unsigned char magic[8];
+		std::uint64_t nbits;
+		std::uint64_t capacity;
+		std::uint32_t cur_gen;
+		std::uint32_t reserved;
+		std::uint64_t inserted[2];
+	};
+
+	/* With 10 bits per element, 7 hashes give ~1% of false positives */
+	static constexpr const auto bits_per_elt = 10u;
+	static constexpr const auto nhashes = 7u;
+	static constexpr const unsigned char bloom_magic[8] = {'r', 's', 'l', 'r', 'n', 'b', 'f', '1'};
+
+	learn_bloom() = default;
+
+	void *map = nullptr;
+	std::size_t map_len = 0;
+	bloom_header *hdr = nullptr;
+
+	auto gen_bits(unsigned int gen) const -> std::uint64_t *
+	{
+		return reinterpret_cast<std::uint64_t *>(hdr + 1) + gen * (hdr->nbits / 64);
+	}
+
+	static auto hashes(const char *id, std::uint64_t &h1, std::uint64_t &h2) -> void
+	{
+		auto len = strlen(id);
+
+		h1 = rspamd_cryptobox_fast_hash(id, len, 0xb10f0f17ULL);
+		/* Odd step visits different bits for any h1 */
+		h2 = rspamd_cryptobox_fast_hash(id, len, h1) | 1ULL;
+	}
+};
+
+auto learn_bloom::open(std::size_t nelts, const char *path) -> tl::expected<std::unique_ptr<learn_bloom>, std::string>
+{
+	std::uint64_t nbits = 64;
+
+	while (nbits < (std::uint64_t) nelts * bits_per_elt) {
+		nbits <<= 1;
+	}
+
+	auto map_len = sizeof(bloom_header) + 2 * nbits / 8;
+	void *map;
+
+	if (path) {
+		auto fd = rspamd_file_xopen(path, O_RDWR | O_CREAT, 00600, 0);
+
+		if (fd == -1) {
+			return tl::make_unexpected(fmt::format("cannot open {}: {}", path, strerror(errno)));
+		}
+
+		/* Workers can start concurrently, so one of them initialises the file */
+		rspamd_file_lock(fd, FALSE);
+
+		struct stat st;
+		bloom_header cur;
+		bool valid = fstat(fd, &st) != -1 && (std::size_t) st.st_size == map_len &&
+					 pread(fd, &cur, sizeof(cur), 0) == sizeof(cur) &&
+					 memcmp(cur.magic, bloom_magic, sizeof(bloom_magic)) == 0 &&
+					 cur.nbits == nbits && cur.cur_gen < 2;
+
+		if (!valid) {
+			bloom_header init{};
+
+			memcpy(init.magic, bloom_magic, sizeof(bloom_magic));
+			init.nbits = nbits;
+			init.capacity = nelts;
+
+			if (ftruncate(fd, 0) == -1 || ftruncate(fd, map_len) == -1 ||
+				pwrite(fd, &init, sizeof(init), 0) != sizeof(init)) {
+				auto err = fmt::format("cannot init {}: {}", path, strerror(errno));
+				rspamd_file_unlock(fd, FALSE);
+				close(fd);
+
+				return tl::make_unexpected(err);
+			}
+		}
+
+		map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		rspamd_file_unlock(fd, FALSE);
+		close(fd);
+
+		if (map == MAP_FAILED) {
+			return tl::make_unexpected(fmt::format("cannot mmap {}: {}", path, strerror(errno)));
+		}
+	}
+	else {
+		map = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+
+		if (map == MAP_FAILED) {
+			return tl::make_unexpected(fmt::format("cannot allocate bloom filter: {}", strerror(errno)));
+		}
+
+		auto *hdr = reinterpret_cast<bloom_header *>(map);
+		memcpy(hdr->magic, bloom_magic, sizeof(bloom_magic));
+		hdr->nbits = nbits;
+		hdr->capacity = nelts;
+	}
+
+	std::unique_ptr<learn_bloom> bloom{new learn_bloom};
+	bloom->map = map;
+	bloom->map_len = map_len;
+	bloom->hdr = reinterpret_cast<bloom_header *>(map);
+	/* The file could have been created with a different capacity */
+	bloom->hdr->capacity = nelts;
+
+	return bloom;
+}
 
 struct rspamd_redis_cache_ctx {
 	lua_State *L;
 	struct rspamd_statfile_config *stcf;
 	int check_ref = -1;
 	int learn_ref = -1;
+	/* Optional filter of learned ids */
+	std::unique_ptr<learn_bloom> bloom;
 
 	rspamd_redis_cache_ctx() = delete;
 	explicit rspamd_redis_cache_ctx(lua_State *L)
@@ -131,6 +319,23 @@ rspamd_stat_cache_redis_init(struct rspamd_stat_ctx *ctx,
 
 	lua_settop(L, err_idx - 1);
 
+	if (cf && ucl_object_type(cf) == UCL_OBJECT) {
+		const auto *bloom_size = ucl_object_lookup(cf, "bloom_size");
+
+		if (bloom_size && ucl_object_toint(bloom_size) > 0) {
+			const auto *bloom_file = ucl_object_lookup(cf, "bloom_file");
+			auto maybe_bloom = learn_bloom::open(ucl_object_toint(bloom_size),
+												 bloom_file ? ucl_object_tostring(bloom_file) : nullptr);
+
+			if (maybe_bloom) {
+				cache_ctx->bloom = std::move(maybe_bloom.value());
+			}
+			else {
+				msg_err_config("cannot init learned ids filter: %s", maybe_bloom.error().c_str());
+			}
+		}
+	}
+
 	return (gpointer) cache_ctx.release();
 }
 
@@ -192,6 +397,11 @@ int rspamd_stat_cache_redis_check(struct rspamd_task *task,
 		return RSPAMD_LEARN_IGNORE;
 	}
 
+	if (ctx->bloom && !ctx->bloom->maybe_contains(h)) {
+		/* Never learned, no need to ask Redis */
+		return RSPAMD_LEARN_OK;
+	}
+
 	auto *L = ctx->L;
 
 	lua_pushcfunction(L, &rspamd_lua_traceback);
@@ -228,6 +438,10 @@ int rspamd_stat_cache_redis_learn(struct rspamd_task *task,
 	g_assert(h != nullptr);
 	auto *L = ctx->L;
 
+	if (ctx->bloom) {
+		ctx->bloom->insert(h);
+	}
+
 	lua_pushcfunction(L, &rspamd_lua_traceback);
 	int err_idx = lua_gettop(L);
 
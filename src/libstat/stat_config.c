@@ -92,6 +92,7 @@ static struct rspamd_stat_backend stat_backends[] = {
 	RSPAMD_STAT_BACKEND_ELT(mmap, mmaped_file),
 	RSPAMD_STAT_BACKEND_ELT(sqlite3, sqlite3),
 	RSPAMD_STAT_BACKEND_ELT_READONLY(cdb, cdb),
+	RSPAMD_STAT_BACKEND_ELT_READONLY(compact, compact),
 	RSPAMD_STAT_BACKEND_ELT(redis, redis)};
 
 #define RSPAMD_STAT_CACHE_ELT(nam, eltn)               \
@@ -294,6 +295,16 @@ void rspamd_stat_init(struct rspamd_config *cfg, struct ev_loop *ev_base)
 															 clf->tokenizer, NULL);
 		}
 
+		if (clf->opts) {
+			const ucl_object_t *filter_obj = ucl_object_lookup(clf->opts,
+															   "token_filter");
+
+			if (filter_obj && ucl_object_type(filter_obj) == UCL_STRING) {
+				cl->token_filter = rspamd_stat_token_filter_new(cfg,
+																ucl_object_tostring(filter_obj));
+			}
+		}
+
 		/* Init classifier cache */
 		cache_name = NULL;
 
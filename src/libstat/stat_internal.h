@@ -36,6 +36,8 @@ struct rspamd_statfile_runtime {
 };
 
 /* Common classifier structure */
+struct rspamd_stat_token_filter;
+
 struct rspamd_classifier {
 	struct rspamd_stat_ctx *ctx;
 	GArray *statfiles_ids; /* int */
@@ -46,6 +48,8 @@ struct rspamd_classifier {
 	int autolearn_cbref;
 	struct rspamd_classifier_config *cfg;
 	struct rspamd_stat_classifier *subrs;
+	/* Drops tokens unknown to the model before backends lookups */
+	struct rspamd_stat_token_filter *token_filter;
 	gpointer specific;
 };
 
@@ -122,6 +126,19 @@ struct rspamd_stat_async_elt *rspamd_stat_ctx_register_async(
 	rspamd_stat_async_handler handler, rspamd_stat_async_cleanup cleanup,
 	gpointer d, double timeout);
 
+/**
+ * Creates tokens filter from the compact model file, the filter is reloaded
+ * with the model
+ */
+struct rspamd_stat_token_filter *rspamd_stat_token_filter_new(
+	struct rspamd_config *cfg, const char *path);
+
+/**
+ * Returns TRUE if token might be in the model (or if the filter is not loaded yet)
+ */
+gboolean rspamd_stat_token_filter_check(struct rspamd_stat_token_filter *filter,
+										uint64_t token);
+
 static GQuark rspamd_stat_quark(void)
 {
 	return g_quark_from_static_string("rspamd-statistics");
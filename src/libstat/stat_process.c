@@ -23,6 +23,7 @@
 #include "lua/lua_common.h"
 #include "lua/lua_classnames.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/worker_util.h"
 #include "utlist.h"
 #include <math.h>
 
@@ -31,6 +32,8 @@
 #define RSPAMD_UNLEARN_OP 2
 
 static const double similarity_threshold = 80.0;
+/* Words of a part that are tokenized when a worker is under memory pressure */
+static const unsigned int memory_pressure_max_words = 2048;
 
 static void
 rspamd_stat_tokenize_parts_metadata(struct rspamd_stat_ctx *st_ctx,
@@ -119,12 +122,14 @@ void rspamd_stat_process_tokenize(struct rspamd_stat_ctx *st_ctx,
 								  struct rspamd_task *task)
 {
 	struct rspamd_mime_text_part *part;
+	struct rspamd_sample_range ranges[RSPAMD_SAMPLE_MAX_RANGES];
 	rspamd_cryptobox_hash_state_t hst;
 	rspamd_token_t *st_tok;
-	unsigned int i, reserved_len = 0;
+	unsigned int i, j, nranges, reserved_len = 0, max_words;
 	double *pdiff;
 	unsigned char hout[rspamd_cryptobox_HASHBYTES];
 	char *b32_hout;
+	GArray sample;
 
 	if (st_ctx == NULL) {
 		st_ctx = rspamd_stat_get_ctx();
@@ -132,10 +137,16 @@ void rspamd_stat_process_tokenize(struct rspamd_stat_ctx *st_ctx,
 
 	g_assert(st_ctx != NULL);
 
+	max_words = task->cfg ? task->cfg->max_stat_words : 0;
+
+	if (task->flags & RSPAMD_TASK_FLAG_MEMORY_PRESSURE) {
+		max_words = max_words > 0 ? MIN(max_words, memory_pressure_max_words) : memory_pressure_max_words;
+	}
+
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, part)
 	{
 		if (!IS_TEXT_PART_EMPTY(part) && part->utf_words != NULL) {
-			reserved_len += part->utf_words->len;
+			reserved_len += max_words > 0 ? MIN(part->utf_words->len, max_words) : part->utf_words->len;
 		}
 		/* XXX: normal window size */
 		reserved_len += 5;
@@ -150,9 +161,26 @@ void rspamd_stat_process_tokenize(struct rspamd_stat_ctx *st_ctx,
 	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, text_parts), i, part)
 	{
 		if (!IS_TEXT_PART_EMPTY(part) && part->utf_words != NULL) {
-			st_ctx->tokenizer->tokenize_func(st_ctx, task,
-											 part->utf_words, IS_TEXT_PART_UTF(part),
-											 NULL, task->tokens);
+			if (max_words > 0 && part->utf_words->len > max_words) {
+				nranges = rspamd_sample_ranges(part->utf_words->len, max_words, ranges);
+				msg_debug_bayes("tokenize %ud of %ud words in %ud samples",
+								max_words, part->utf_words->len, nranges);
+
+				/* Tokenizers access words by index only, so views of the array are enough */
+				for (j = 0; j < nranges; j++) {
+					sample.data = (char *) &g_array_index(part->utf_words,
+														  rspamd_stat_token_t, ranges[j].off);
+					sample.len = ranges[j].len;
+					st_ctx->tokenizer->tokenize_func(st_ctx, task,
+													 &sample, IS_TEXT_PART_UTF(part),
+													 NULL, task->tokens);
+				}
+			}
+			else {
+				st_ctx->tokenizer->tokenize_func(st_ctx, task,
+												 part->utf_words, IS_TEXT_PART_UTF(part),
+												 NULL, task->tokens);
+			}
 		}
 
 
@@ -359,18 +387,49 @@ static void
 rspamd_stat_backends_process(struct rspamd_stat_ctx *st_ctx,
 							 struct rspamd_task *task)
 {
-	unsigned int i;
+	unsigned int i, j, id;
+	struct rspamd_classifier *cl;
 	struct rspamd_statfile *st;
+	rspamd_token_t *tok;
+	GPtrArray *tokens;
 	gpointer bk_run;
 
 	g_assert(task->stat_runtimes != NULL);
 
-	for (i = 0; i < st_ctx->statfiles->len; i++) {
-		st = g_ptr_array_index(st_ctx->statfiles, i);
-		bk_run = g_ptr_array_index(task->stat_runtimes, i);
+	for (i = 0; i < st_ctx->classifiers->len; i++) {
+		cl = g_ptr_array_index(st_ctx->classifiers, i);
+		tokens = task->tokens;
+
+		if (cl->token_filter) {
+			/*
+			 * Tokens unknown to the model are not sent to backends, their
+			 * values are left zero, so classifier skips them as unseen
+			 */
+			tokens = g_ptr_array_sized_new(task->tokens->len);
+			rspamd_mempool_add_destructor(task->task_pool,
+										  (rspamd_mempool_destruct_t) g_ptr_array_unref,
+										  tokens);
+
+			PTR_ARRAY_FOREACH(task->tokens, j, tok)
+			{
+				if (rspamd_stat_token_filter_check(cl->token_filter, tok->data)) {
+					g_ptr_array_add(tokens, tok);
+				}
+			}
 
-		if (bk_run != NULL) {
-			st->backend->process_tokens(task, task->tokens, i, bk_run);
+			msg_debug_bayes("filtered %ud of %ud tokens for classifier %s",
+							task->tokens->len - tokens->len, task->tokens->len,
+							cl->cfg->name);
+		}
+
+		for (j = 0; j < cl->statfiles_ids->len; j++) {
+			id = g_array_index(cl->statfiles_ids, int, j);
+			st = g_ptr_array_index(st_ctx->statfiles, id);
+			bk_run = g_ptr_array_index(task->stat_runtimes, id);
+
+			if (bk_run != NULL) {
+				st->backend->process_tokens(task, tokens, id, bk_run);
+			}
 		}
 	}
 }
@@ -447,6 +506,8 @@ rspamd_stat_classifiers_process(struct rspamd_stat_ctx *st_ctx,
 
 			if (bk_run != NULL) {
 				if (!st->backend->finalize_process(task, bk_run, st_ctx)) {
+					msg_info_task("skip classifier %s: backend %s failed for symbol %s",
+								  cl->cfg->name, st->backend->name, st->stcf->symbol);
 					skip = TRUE;
 					break;
 				}
@@ -862,7 +923,7 @@ rspamd_stat_backends_post_learn(struct rspamd_stat_ctx *st_ctx,
 		}
 	}
 
-	g_atomic_int_add(&task->worker->srv->stat->messages_learned, 1);
+	RSPAMD_STAT_INC(rspamd_main_local_stat(task->worker->srv), messages_learned);
 
 	return res;
 }
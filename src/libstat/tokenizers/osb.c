@@ -279,7 +279,8 @@ int rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 	uint64_t cur, seed;
 	struct token_pipe_entry *hashpipe;
 	uint32_t h1, h2;
-	gsize token_size;
+	gsize token_size, max_tokens, old_len;
+	unsigned char *slab, *slab_end;
 	unsigned int processed = 0, i, w, window_size, token_flags = 0;
 
 	if (words == NULL) {
@@ -304,8 +305,28 @@ int rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 	}
 	token_size = sizeof(rspamd_token_t) +
 				 sizeof(RSPAMD_TOKEN_VALUE_TYPE) * ctx->statfiles->len;
+	/* Keep tokens in the slab aligned */
+	token_size = (token_size + RSPAMD_ALIGNOF(rspamd_token_t) - 1) & ~(RSPAMD_ALIGNOF(rspamd_token_t) - 1);
 	g_assert(token_size > 0);
 
+	/*
+	 * Each word produces at most `window_size - 1` tokens (or a single
+	 * unigram), so we allocate all tokens at once in a contiguous slab and
+	 * reserve pointers in the result array
+	 */
+	max_tokens = words->len * (window_size > 1 ? window_size - 1 : 1);
+
+	if (max_tokens == 0) {
+		return TRUE;
+	}
+
+	slab = rspamd_mempool_alloc0(task->task_pool, token_size * max_tokens);
+	slab_end = slab + token_size * max_tokens;
+	/* Shrinking keeps the allocated space, so there are no reallocations below */
+	old_len = result->len;
+	g_ptr_array_set_size(result, old_len + max_tokens);
+	g_ptr_array_set_size(result, old_len);
+
 	for (w = 0; w < words->len; w++) {
 		token = &g_array_index(words, rspamd_stat_token_t, w);
 		token_flags = token->flags;
@@ -351,7 +372,8 @@ int rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 		}
 
 		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0(task->task_pool, token_size);
+			new_tok = (rspamd_token_t *) slab;
+			slab += token_size;
 			new_tok->flags = token_flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
@@ -364,7 +386,9 @@ int rspamd_tokenizer_osb(struct rspamd_stat_ctx *ctx,
 
 #define ADD_TOKEN                                                                       \
 	do {                                                                                \
-		new_tok = rspamd_mempool_alloc0(task->task_pool, token_size);                   \
+		g_assert(slab < slab_end);                                                      \
+		new_tok = (rspamd_token_t *) slab;                                              \
+		slab += token_size;                                                             \
 		new_tok->flags = token_flags;                                                   \
 		new_tok->t1 = hashpipe[0].t;                                                    \
 		new_tok->t2 = hashpipe[i].t;                                                    \
@@ -23,6 +23,8 @@
 #include "contrib/mumhash/mum.h"
 #include "libmime/lang_detection.h"
 #include "libstemmer.h"
+#include "libcryptobox/cryptobox.h"
+#include "contrib/libucl/khash.h"
 
 #include <unicode/utf8.h>
 #include <unicode/uchar.h>
@@ -230,6 +232,386 @@ rspamd_utf_word_valid(const unsigned char *text, const unsigned char *end,
 
 	return FALSE;
 }
+/*
+ * Word break classes (UAX #29) for the scripts that do not need dictionaries
+ * or special rules, so boundaries can be found without ICU break iterator
+ */
+enum rspamd_word_break_class {
+	RSPAMD_WB_OTHER = 0,
+	RSPAMD_WB_ALETTER,
+	RSPAMD_WB_NUMERIC,
+	RSPAMD_WB_MIDLETTER,
+	RSPAMD_WB_MIDNUM,
+	RSPAMD_WB_MIDNUMLET,
+	RSPAMD_WB_SQUOTE,
+	RSPAMD_WB_EXTENDNUMLET,
+	RSPAMD_WB_EXTEND, /* Extend and Format */
+	RSPAMD_WB_CR,
+	RSPAMD_WB_LF,
+	RSPAMD_WB_NEWLINE,
+	RSPAMD_WB_WSEGSPACE,
+	RSPAMD_WB_ATTACHED, /* Extend or Format that belongs to the previous character */
+	RSPAMD_WB_COMPLEX,  /* Requires ICU */
+};
+
+/*
+ * ICU tailors full stop and colon differently in different versions,
+ * so these classes are checked against the real break iterator
+ */
+static unsigned char rspamd_wb_full_stop = RSPAMD_WB_MIDNUMLET;
+static unsigned char rspamd_wb_colon = RSPAMD_WB_MIDLETTER;
+
+static inline enum rspamd_word_break_class
+rspamd_word_break_ascii(unsigned char c)
+{
+	if (g_ascii_isalpha(c)) {
+		return RSPAMD_WB_ALETTER;
+	}
+	else if (g_ascii_isdigit(c)) {
+		return RSPAMD_WB_NUMERIC;
+	}
+
+	switch (c) {
+	case '\n':
+		return RSPAMD_WB_LF;
+	case '\r':
+		return RSPAMD_WB_CR;
+	case '\v':
+	case '\f':
+		return RSPAMD_WB_NEWLINE;
+	case ' ':
+		return RSPAMD_WB_WSEGSPACE;
+	case '\'':
+		return RSPAMD_WB_SQUOTE;
+	case ',':
+	case ';':
+		return RSPAMD_WB_MIDNUM;
+	case '.':
+		return rspamd_wb_full_stop;
+	case ':':
+		return rspamd_wb_colon;
+	case '_':
+		return RSPAMD_WB_EXTENDNUMLET;
+	default:
+		return RSPAMD_WB_OTHER;
+	}
+}
+
+static inline enum rspamd_word_break_class
+rspamd_word_break_class_of(UChar32 c)
+{
+	/*
+	 * Latin, Greek, Cyrillic and general punctuation, other scripts
+	 * might use dictionaries (e.g. CJK or Thai) or special rules
+	 */
+	if (c < 0 || !(c < 0x530 || (c >= 0x1E00 && c < 0x20D0))) {
+		return RSPAMD_WB_COMPLEX;
+	}
+
+	switch (u_getIntPropertyValue(c, UCHAR_WORD_BREAK)) {
+	case U_WB_OTHER:
+	case U_WB_DOUBLE_QUOTE:
+		return RSPAMD_WB_OTHER;
+#if U_ICU_VERSION_MAJOR_NUM >= 62
+	case U_WB_WSEGSPACE:
+		return RSPAMD_WB_WSEGSPACE;
+#endif
+	case U_WB_ALETTER:
+		return RSPAMD_WB_ALETTER;
+	case U_WB_NUMERIC:
+		return RSPAMD_WB_NUMERIC;
+	case U_WB_MIDLETTER:
+		return RSPAMD_WB_MIDLETTER;
+	case U_WB_MIDNUM:
+		return RSPAMD_WB_MIDNUM;
+	case U_WB_MIDNUMLET:
+		return RSPAMD_WB_MIDNUMLET;
+	case U_WB_SINGLE_QUOTE:
+		return RSPAMD_WB_SQUOTE;
+	case U_WB_EXTENDNUMLET:
+		return RSPAMD_WB_EXTENDNUMLET;
+	case U_WB_EXTEND:
+	case U_WB_FORMAT:
+		return RSPAMD_WB_EXTEND;
+	case U_WB_CR:
+		return RSPAMD_WB_CR;
+	case U_WB_LF:
+		return RSPAMD_WB_LF;
+	case U_WB_NEWLINE:
+		return RSPAMD_WB_NEWLINE;
+	default:
+		/* ZWJ, regional indicators, Katakana, Hebrew etc */
+		return RSPAMD_WB_COMPLEX;
+	}
+}
+
+#define WB_IS_AHLETTER(c) ((c) == RSPAMD_WB_ALETTER)
+#define WB_IS_MIDLETTERQ(c) ((c) == RSPAMD_WB_MIDLETTER || \
+							 (c) == RSPAMD_WB_MIDNUMLET || (c) == RSPAMD_WB_SQUOTE)
+#define WB_IS_MIDNUMQ(c) ((c) == RSPAMD_WB_MIDNUM || \
+						  (c) == RSPAMD_WB_MIDNUMLET || (c) == RSPAMD_WB_SQUOTE)
+#define WB_IS_NEWLINE(c) ((c) == RSPAMD_WB_CR || (c) == RSPAMD_WB_LF || \
+						  (c) == RSPAMD_WB_NEWLINE)
+
+/*
+ * Finds word boundaries as ICU word break iterator does (rules WB3-WB13b
+ * of UAX #29). Returns NULL if text has
+ * characters that are not covered by the fast path or invalid utf8.
+ * Offsets array starts from 0 and ends with `len` and must be freed by g_free
+ */
+static int32_t *
+rspamd_tokenizer_word_boundaries(const unsigned char *text, gsize len,
+								 gsize *nbounds)
+{
+	unsigned char *cls;
+	int32_t *offs;
+	int32_t i = 0, n = 0, j, k, tlen;
+	gsize nb = 0;
+
+	if (len >= G_MAXINT32) {
+		return NULL;
+	}
+
+	tlen = (int32_t) len;
+	cls = g_malloc(len + 1);
+	offs = g_malloc((len + 1) * sizeof(*offs));
+
+	while (i < tlen) {
+		unsigned char t;
+
+		offs[n] = i;
+
+		if (text[i] < 0x80) {
+			t = rspamd_word_break_ascii(text[i]);
+			i++;
+		}
+		else {
+			UChar32 c;
+
+			U8_NEXT(text, i, tlen, c);
+			t = rspamd_word_break_class_of(c);
+
+			if (t == RSPAMD_WB_COMPLEX) {
+				g_free(cls);
+				g_free(offs);
+
+				return NULL;
+			}
+		}
+
+		/* WB4: ignore Extend and Format except after line breaks and sot */
+		if (t == RSPAMD_WB_EXTEND) {
+			t = (n > 0 && !WB_IS_NEWLINE(cls[n - 1])) ? RSPAMD_WB_ATTACHED : RSPAMD_WB_OTHER;
+		}
+
+		cls[n++] = t;
+	}
+
+	offs[n] = tlen;
+	/* Reuse offsets array for boundaries as nb <= i */
+	offs[nb++] = 0;
+
+	for (i = 1; i < n; i++) {
+		unsigned char l, r = cls[i], ll, rr;
+
+		if (r == RSPAMD_WB_ATTACHED) {
+			continue;
+		}
+
+		for (j = i - 1; cls[j] == RSPAMD_WB_ATTACHED; j--)
+			;
+		l = cls[j];
+
+		if (l == RSPAMD_WB_CR && r == RSPAMD_WB_LF) {
+			continue; /* WB3 */
+		}
+
+		if (j == i - 1 && l == RSPAMD_WB_WSEGSPACE && r == RSPAMD_WB_WSEGSPACE) {
+			continue; /* WB3d */
+		}
+
+		if (WB_IS_NEWLINE(l) || WB_IS_NEWLINE(r)) {
+			offs[nb++] = offs[i]; /* WB3a, WB3b */
+			continue;
+		}
+
+		for (j = j - 1; j >= 0 && cls[j] == RSPAMD_WB_ATTACHED; j--)
+			;
+		ll = j >= 0 ? cls[j] : RSPAMD_WB_OTHER;
+
+		for (k = i + 1; k < n && cls[k] == RSPAMD_WB_ATTACHED; k++)
+			;
+		rr = k < n ? cls[k] : RSPAMD_WB_OTHER;
+
+		if (WB_IS_AHLETTER(l) && WB_IS_AHLETTER(r)) {
+			continue; /* WB5 */
+		}
+		if (WB_IS_AHLETTER(l) && WB_IS_MIDLETTERQ(r) && WB_IS_AHLETTER(rr)) {
+			continue; /* WB6 */
+		}
+		if (WB_IS_AHLETTER(ll) && WB_IS_MIDLETTERQ(l) && WB_IS_AHLETTER(r)) {
+			continue; /* WB7 */
+		}
+		if ((l == RSPAMD_WB_NUMERIC || WB_IS_AHLETTER(l)) &&
+			(r == RSPAMD_WB_NUMERIC || WB_IS_AHLETTER(r))) {
+			continue; /* WB8, WB9, WB10 */
+		}
+		if (ll == RSPAMD_WB_NUMERIC && WB_IS_MIDNUMQ(l) && r == RSPAMD_WB_NUMERIC) {
+			continue; /* WB11 */
+		}
+		if (l == RSPAMD_WB_NUMERIC && WB_IS_MIDNUMQ(r) && rr == RSPAMD_WB_NUMERIC) {
+			continue; /* WB12 */
+		}
+		if ((WB_IS_AHLETTER(l) || l == RSPAMD_WB_NUMERIC ||
+			 l == RSPAMD_WB_EXTENDNUMLET) &&
+			r == RSPAMD_WB_EXTENDNUMLET) {
+			continue; /* WB13a */
+		}
+		if (l == RSPAMD_WB_EXTENDNUMLET &&
+			(WB_IS_AHLETTER(r) || r == RSPAMD_WB_NUMERIC)) {
+			continue; /* WB13b */
+		}
+
+		offs[nb++] = offs[i]; /* WB999 */
+	}
+
+	if (n > 0) {
+		offs[nb++] = tlen;
+	}
+
+	g_free(cls);
+	*nbounds = nb;
+
+	return offs;
+}
+
+#undef WB_IS_AHLETTER
+#undef WB_IS_MIDLETTERQ
+#undef WB_IS_MIDNUMQ
+#undef WB_IS_NEWLINE
+
+static gboolean
+rspamd_icu_word_boundaries_equal(UBreakIterator *bi, const char *str,
+								 const int32_t *bounds, gsize nbounds)
+{
+	UErrorCode uc_err = U_ZERO_ERROR;
+	UText *ut;
+	int32_t p;
+	gsize i = 0;
+	gboolean ret = TRUE;
+
+	ut = utext_openUTF8(NULL, str, strlen(str), &uc_err);
+
+	if (!U_SUCCESS(uc_err)) {
+		return FALSE;
+	}
+
+	ubrk_setUText(bi, ut, &uc_err);
+
+	for (p = ubrk_first(bi); p != UBRK_DONE; p = ubrk_next(bi)) {
+		if (i >= nbounds || bounds[i] != p) {
+			ret = FALSE;
+			break;
+		}
+
+		i++;
+	}
+
+	if (i != nbounds) {
+		ret = FALSE;
+	}
+
+	utext_close(ut);
+
+	return ret;
+}
+
+/*
+ * Adjusts tailored classes to the linked ICU and checks that both ways give
+ * the same boundaries, otherwise the fast path is disabled
+ */
+static gboolean
+rspamd_tokenizer_check_word_boundaries(UBreakIterator *bi)
+{
+	static const char *probes[] = {
+		"e.g. don't 3.14 1,000 a:b 10:30",
+		"foo_bar 12_34 x1y2 __init__",
+		"\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, "
+		"\xd0\xbc\xd0\xb8\xd1\x80! "
+		"\xce\xb3\xce\xb5\xce\xb9\xce\xac \xcf\x83\xce\xbf\xcf\x85",
+		"cafe\xcc\x81 soft\xc2\xadhyphen l\xe2\x80\x99\xc3\xa9t\xc3\xa9",
+		"line\r\nbreak\x0bnext   spaces\xc2\xa0nbsp \xe2\x82\xac" "10",
+	};
+	static const int32_t one_token[] = {0, 3};
+	int32_t *bounds;
+	gsize nbounds, i;
+	gboolean ret = TRUE;
+
+	if (rspamd_icu_word_boundaries_equal(bi, "a.a", one_token, 2)) {
+		rspamd_wb_full_stop = RSPAMD_WB_MIDNUMLET;
+	}
+	else if (rspamd_icu_word_boundaries_equal(bi, "1.1", one_token, 2)) {
+		rspamd_wb_full_stop = RSPAMD_WB_MIDNUM;
+	}
+	else {
+		rspamd_wb_full_stop = RSPAMD_WB_OTHER;
+	}
+
+	if (rspamd_icu_word_boundaries_equal(bi, "a:a", one_token, 2)) {
+		rspamd_wb_colon = RSPAMD_WB_MIDLETTER;
+	}
+	else {
+		rspamd_wb_colon = RSPAMD_WB_OTHER;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(probes) && ret; i++) {
+		bounds = rspamd_tokenizer_word_boundaries((const unsigned char *) probes[i],
+												  strlen(probes[i]), &nbounds);
+
+		if (bounds == NULL ||
+			!rspamd_icu_word_boundaries_equal(bi, probes[i], bounds, nbounds)) {
+			ret = FALSE;
+		}
+
+		g_free(bounds);
+	}
+
+	return ret;
+}
+
+struct rspamd_word_boundaries {
+	UBreakIterator *bi; /* NULL if boundaries are precomputed */
+	int32_t *bounds;
+	gsize nbounds;
+	gsize cur;
+};
+
+static inline int32_t
+rspamd_word_boundaries_first(struct rspamd_word_boundaries *wb)
+{
+	if (wb->bi) {
+		return ubrk_first(wb->bi);
+	}
+
+	wb->cur = 1;
+
+	return wb->bounds[0];
+}
+
+static inline int32_t
+rspamd_word_boundaries_next(struct rspamd_word_boundaries *wb)
+{
+	if (wb->bi) {
+		return ubrk_next(wb->bi);
+	}
+
+	if (wb->cur < wb->nbounds) {
+		return wb->bounds[wb->cur++];
+	}
+
+	return UBRK_DONE;
+}
+
 #define SHIFT_EX                                                \
 	do {                                                        \
 		cur = g_list_next(cur);                                 \
@@ -297,6 +679,8 @@ rspamd_tokenize_text(const char *text, gsize len,
 	gboolean decay = FALSE, long_text_mode = FALSE;
 	uint64_t prob = 0;
 	static UBreakIterator *bi = NULL;
+	static gboolean fast_boundaries = FALSE;
+	struct rspamd_word_boundaries wb = {NULL, NULL, 0, 0};
 	static const gsize long_text_limit = 1 * 1024 * 1024;
 	static const ev_tstamp max_exec_time = 0.2; /* 200 ms */
 	ev_tstamp start;
@@ -394,10 +778,26 @@ rspamd_tokenize_text(const char *text, gsize len,
 			bi = ubrk_open(UBRK_WORD, NULL, NULL, 0, &uc_err);
 
 			g_assert(U_SUCCESS(uc_err));
+
+			fast_boundaries = rspamd_tokenizer_check_word_boundaries(bi);
+
+			if (!fast_boundaries) {
+				msg_info("ICU word boundaries differ from the built-in rules, "
+						 "use ICU only for tokenization");
+			}
+		}
+
+		if (fast_boundaries) {
+			wb.bounds = rspamd_tokenizer_word_boundaries((const unsigned char *) text,
+														 len, &wb.nbounds);
+		}
+
+		if (wb.bounds == NULL) {
+			ubrk_setUText(bi, (UText *) utxt, &uc_err);
+			wb.bi = bi;
 		}
 
-		ubrk_setUText(bi, (UText *) utxt, &uc_err);
-		last = ubrk_first(bi);
+		last = rspamd_word_boundaries_first(&wb);
 		p = last;
 
 		if (cur) {
@@ -423,7 +823,7 @@ rspamd_tokenize_text(const char *text, gsize len,
 								/* Exception spread over the boundaries */
 								while (last > p && p != UBRK_DONE) {
 									int32_t old_p = p;
-									p = ubrk_next(bi);
+									p = rspamd_word_boundaries_next(&wb);
 
 									if (p != UBRK_DONE && p <= old_p) {
 										msg_warn_pool_check(
@@ -463,7 +863,7 @@ rspamd_tokenize_text(const char *text, gsize len,
 								/* Exception spread over the boundaries */
 								while (last > p && p != UBRK_DONE) {
 									int32_t old_p = p;
-									p = ubrk_next(bi);
+									p = rspamd_word_boundaries_next(&wb);
 									if (p != UBRK_DONE && p <= old_p) {
 										msg_warn_pool_check(
 											"tokenization reversed back on position %d,"
@@ -568,7 +968,7 @@ rspamd_tokenize_text(const char *text, gsize len,
 			}
 
 			last = p;
-			p = ubrk_next(bi);
+			p = rspamd_word_boundaries_next(&wb);
 
 			if (p != UBRK_DONE && p <= last) {
 				msg_warn_pool_check("tokenization reversed back on position %d,"
@@ -581,6 +981,10 @@ rspamd_tokenize_text(const char *text, gsize len,
 	}
 
 end:
+	if (wb.bounds) {
+		g_free(wb.bounds);
+	}
+
 	if (!decay) {
 		hv = mum_hash_finish(hv);
 	}
@@ -858,15 +1262,72 @@ void rspamd_normalize_single_word(rspamd_stat_token_t *tok, rspamd_mempool_t *po
 	}
 }
 
+/*
+ * Words are repeated a lot in a text, so normalisation and stemming are
+ * done once per unique word and results are shared by all equal tokens
+ */
+#define RSPAMD_WORD_KIND_FLAGS (RSPAMD_STAT_TOKEN_FLAG_UTF | RSPAMD_STAT_TOKEN_FLAG_TEXT)
+
+static inline khint_t
+rspamd_original_word_hash(const rspamd_stat_token_t *tok)
+{
+	return (khint_t) rspamd_cryptobox_fast_hash(tok->original.begin, tok->original.len,
+												tok->flags & RSPAMD_WORD_KIND_FLAGS);
+}
+
+static inline bool
+rspamd_original_word_equal(const rspamd_stat_token_t *t1, const rspamd_stat_token_t *t2)
+{
+	return (t1->flags & RSPAMD_WORD_KIND_FLAGS) == (t2->flags & RSPAMD_WORD_KIND_FLAGS) &&
+		   rspamd_ftok_equal(&t1->original, &t2->original);
+}
+
+static inline khint_t
+rspamd_normalized_word_hash(const rspamd_stat_token_t *tok)
+{
+	return (khint_t) rspamd_cryptobox_fast_hash(tok->normalized.begin, tok->normalized.len, 0);
+}
+
+static inline bool
+rspamd_normalized_word_equal(const rspamd_stat_token_t *t1, const rspamd_stat_token_t *t2)
+{
+	return rspamd_ftok_equal(&t1->normalized, &t2->normalized);
+}
+
+KHASH_INIT(rspamd_original_words, const rspamd_stat_token_t *, char, 0,
+		   rspamd_original_word_hash, rspamd_original_word_equal);
+KHASH_INIT(rspamd_normalized_words, const rspamd_stat_token_t *, char, 0,
+		   rspamd_normalized_word_hash, rspamd_normalized_word_equal);
+
 void rspamd_normalize_words(GArray *words, rspamd_mempool_t *pool)
 {
 	rspamd_stat_token_t *tok;
+	const rspamd_stat_token_t *seen;
+	khash_t(rspamd_original_words) *uniq;
+	khiter_t k;
 	unsigned int i;
+	int r;
+
+	uniq = kh_init(rspamd_original_words);
+	kh_resize(rspamd_original_words, uniq, MIN(words->len, 1024));
 
 	for (i = 0; i < words->len; i++) {
 		tok = &g_array_index(words, rspamd_stat_token_t, i);
-		rspamd_normalize_single_word(tok, pool);
+		k = kh_put(rspamd_original_words, uniq, tok, &r);
+
+		if (r == 0) {
+			seen = kh_key(uniq, k);
+			tok->unicode = seen->unicode;
+			tok->normalized = seen->normalized;
+			tok->flags |= seen->flags & (RSPAMD_STAT_TOKEN_FLAG_BROKEN_UNICODE |
+										 RSPAMD_STAT_TOKEN_FLAG_NORMALISED);
+		}
+		else {
+			rspamd_normalize_single_word(tok, pool);
+		}
 	}
+
+	kh_destroy(rspamd_original_words, uniq);
 }
 
 void rspamd_stem_words(GArray *words, rspamd_mempool_t *pool,
@@ -877,8 +1338,12 @@ void rspamd_stem_words(GArray *words, rspamd_mempool_t *pool,
 	struct sb_stemmer *stem = NULL;
 	unsigned int i;
 	rspamd_stat_token_t *tok;
+	const rspamd_stat_token_t *seen;
+	khash_t(rspamd_normalized_words) *uniq;
+	khiter_t k;
 	char *dest;
 	gsize dlen;
+	int r;
 
 	if (!stemmers) {
 		stemmers = g_hash_table_new(rspamd_strcase_hash,
@@ -909,10 +1374,22 @@ void rspamd_stem_words(GArray *words, rspamd_mempool_t *pool,
 			stem = NULL;
 		}
 	}
+	uniq = kh_init(rspamd_normalized_words);
+
 	for (i = 0; i < words->len; i++) {
 		tok = &g_array_index(words, rspamd_stat_token_t, i);
 
 		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UTF) {
+			k = kh_put(rspamd_normalized_words, uniq, tok, &r);
+
+			if (r == 0) {
+				seen = kh_key(uniq, k);
+				tok->stemmed = seen->stemmed;
+				tok->flags |= seen->flags & (RSPAMD_STAT_TOKEN_FLAG_STEMMED |
+											 RSPAMD_STAT_TOKEN_FLAG_STOP_WORD);
+				continue;
+			}
+
 			if (stem) {
 				const char *stemmed = NULL;
 
@@ -952,4 +1429,6 @@ void rspamd_stem_words(GArray *words, rspamd_mempool_t *pool,
 			}
 		}
 	}
+
+	kh_destroy(rspamd_normalized_words, uniq);
 }
\ No newline at end of file
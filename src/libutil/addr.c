@@ -200,16 +200,34 @@ rspamd_ip_is_valid(const rspamd_inet_addr_t *addr)
 	return ret;
 }
 
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+#define RSPAMD_ACCEPT4_FLAGS (SOCK_NONBLOCK | SOCK_CLOEXEC)
+#endif
+
 int rspamd_accept_from_socket(int sock, rspamd_inet_addr_t **target,
 							  rspamd_accept_throttling_handler hdl,
 							  void *hdl_data)
 {
-	int nfd, serrno;
+	int nfd;
+#ifndef RSPAMD_ACCEPT4_FLAGS
+	int serrno;
+#endif
 	union sa_union su;
 	socklen_t len = sizeof(su);
 	rspamd_inet_addr_t *addr = NULL;
 
-	if ((nfd = accept(sock, &su.sa, &len)) == -1) {
+#ifdef RSPAMD_ACCEPT4_FLAGS
+	/*
+	 * Saves fcntl calls for each accepted connection. Connections are still
+	 * accepted one per libev readiness event: there is no io_uring (multishot)
+	 * accept and no completion based I/O for the accepted sockets
+	 */
+	nfd = accept4(sock, &su.sa, &len, RSPAMD_ACCEPT4_FLAGS);
+#else
+	nfd = accept(sock, &su.sa, &len);
+#endif
+
+	if (nfd == -1) {
 		if (target) {
 			*target = NULL;
 		}
@@ -278,6 +296,7 @@ int rspamd_accept_from_socket(int sock, rspamd_inet_addr_t **target,
 		}
 	}
 
+#ifndef RSPAMD_ACCEPT4_FLAGS
 	if (rspamd_socket_nonblocking(nfd) < 0) {
 		goto out;
 	}
@@ -287,6 +306,7 @@ int rspamd_accept_from_socket(int sock, rspamd_inet_addr_t **target,
 		msg_warn("fcntl failed: %d, '%s'", errno, strerror(errno));
 		goto out;
 	}
+#endif
 
 	if (target) {
 		*target = addr;
@@ -298,6 +318,7 @@ int rspamd_accept_from_socket(int sock, rspamd_inet_addr_t **target,
 
 	return (nfd);
 
+#ifndef RSPAMD_ACCEPT4_FLAGS
 out:
 	serrno = errno;
 	close(nfd);
@@ -305,6 +326,7 @@ out:
 	rspamd_inet_address_free(addr);
 
 	return (-1);
+#endif
 }
 
 static gboolean
@@ -455,6 +477,77 @@ err:
 	return FALSE;
 }
 
+/*
+ * Returns 0x80 in each byte of `w` that is not an ASCII digit:
+ * (c ^ '0') is in range [0, 9] for digits only, and adding 0x76 to the
+ * lower 7 bits sets the high bit for any value above 9 with no carry
+ */
+static inline uint32_t
+rspamd_swar_nondigits(uint32_t w)
+{
+	uint32_t x = w ^ 0x30303030u;
+
+	return (((x & 0x7f7f7f7fu) + 0x76767676u) | x) & 0x80808080u;
+}
+
+/*
+ * Parses the canonical dotted quad form with 1-3 digits per octet, other
+ * inputs are left for the generic parser
+ */
+static inline gboolean
+rspamd_parse_inet_address_ip4_fast(const unsigned char *text, gsize len,
+								   uint32_t *res)
+{
+	unsigned char buf[sizeof("255.255.255.255") + 4];
+	const unsigned char *p = buf, *end = buf + len;
+	uint32_t addr = 0;
+	unsigned int i;
+
+	if (len < sizeof("0.0.0.0") - 1 || len > sizeof("255.255.255.255") - 1) {
+		return FALSE;
+	}
+
+	/* Padding allows to load 4 bytes for any octet */
+	memcpy(buf, text, len);
+	memset(buf + len, 0, sizeof(buf) - len);
+
+	for (i = 0; i < 4; i++) {
+		uint32_t w = (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+					 ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+		uint32_t nondigits = rspamd_swar_nondigits(w), digits, val;
+		unsigned int ndigits;
+
+		if (nondigits == 0) {
+			return FALSE;
+		}
+
+		ndigits = __builtin_ctz(nondigits) >> 3;
+
+		if (ndigits == 0 || p[ndigits] != (i == 3 ? '\0' : '.')) {
+			return FALSE;
+		}
+
+		/* Align digits to the third byte, so the leading ones are zeroes */
+		digits = ((w ^ 0x30303030u) << (8 * (3 - ndigits))) & 0xffffffu;
+		val = (digits & 0xff) * 100 + ((digits >> 8) & 0xff) * 10 + (digits >> 16);
+
+		if (val > 255) {
+			return FALSE;
+		}
+
+		addr = (addr << 8) | val;
+		p += ndigits + 1;
+	}
+
+	if (p - 1 != end) {
+		return FALSE;
+	}
+
+	*res = htonl(addr);
+
+	return TRUE;
+}
+
 gboolean
 rspamd_parse_inet_address_ip4(const unsigned char *text, gsize len, gpointer target)
 {
@@ -470,6 +563,11 @@ rspamd_parse_inet_address_ip4(const unsigned char *text, gsize len, gpointer tar
 		len = strlen(text);
 	}
 
+	if (rspamd_parse_inet_address_ip4_fast(text, len, addrptr)) {
+		return TRUE;
+	}
+
+	/* Generic parser for the rest, e.g. with leading zeroes */
 	for (p = text; p < text + len; p++) {
 		c = *p;
 
@@ -503,6 +601,25 @@ rspamd_parse_inet_address_ip4(const unsigned char *text, gsize len, gpointer tar
 	return FALSE;
 }
 
+/* Values of hex digits, 0xff for other characters */
+static const unsigned char rspamd_ip6_hex_values[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
 gboolean
 rspamd_parse_inet_address_ip6(const unsigned char *text, gsize len, gpointer target)
 {
@@ -594,19 +711,13 @@ rspamd_parse_inet_address_ip6(const unsigned char *text, gsize len, gpointer tar
 		}
 
 		/* Restore from hex */
-		if (t >= '0' && t <= '9') {
-			word = word * 16 + (t - '0');
-			continue;
-		}
-
-		t |= 0x20;
+		t = rspamd_ip6_hex_values[t];
 
-		if (t >= 'a' && t <= 'f') {
-			word = word * 16 + (t - 'a') + 10;
-			continue;
+		if (t == 0xff) {
+			return FALSE;
 		}
 
-		return FALSE;
+		word = (word << 4) | t;
 	}
 
 	if (nibbles == 0 && zero == NULL) {
@@ -859,6 +970,10 @@ rspamd_parse_inet_address_ip(const char *src, gsize srclen,
 	g_assert(target != NULL);
 	g_assert(src != NULL);
 
+	if (srclen == 0) {
+		return FALSE;
+	}
+
 	if (src[0] == '[') {
 		/* Ipv6 address in format [::1]:port or just [::1] */
 		end = memchr(src + 1, ']', srclen - 1);
@@ -939,6 +1054,144 @@ rspamd_parse_inet_address_ip(const char *src, gsize srclen,
 	return ret;
 }
 
+static inline char *
+rspamd_inet_ntop4(const unsigned char *a, char *p)
+{
+	unsigned int i, v;
+
+	for (i = 0; i < 4; i++) {
+		v = a[i];
+
+		if (v >= 100) {
+			*p++ = '0' + v / 100;
+			v %= 100;
+			*p++ = '0' + v / 10;
+		}
+		else if (v >= 10) {
+			*p++ = '0' + v / 10;
+		}
+
+		*p++ = '0' + v % 10;
+		*p++ = '.';
+	}
+
+	return p - 1;
+}
+
+/* Follows RFC 5952 and glibc inet_ntop in choosing embedded ipv4 forms */
+static inline char *
+rspamd_inet_ntop6(const unsigned char *a, char *p)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	unsigned int words[8], i;
+	int best_base = -1, best_len = 0, cur_base = -1, cur_len = 0;
+
+	for (i = 0; i < 8; i++) {
+		words[i] = (a[i * 2] << 8) | a[i * 2 + 1];
+
+		if (words[i] == 0) {
+			if (cur_base == -1) {
+				cur_base = i;
+				cur_len = 0;
+			}
+
+			cur_len++;
+
+			if (cur_len > best_len) {
+				best_base = cur_base;
+				best_len = cur_len;
+			}
+		}
+		else {
+			cur_base = -1;
+		}
+	}
+
+	if (best_len < 2) {
+		best_base = -1;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (best_base != -1 && (int) i >= best_base && (int) i < best_base + best_len) {
+			if ((int) i == best_base) {
+				*p++ = ':';
+			}
+
+			continue;
+		}
+
+		if (i != 0) {
+			*p++ = ':';
+		}
+
+		if (i == 6 && best_base == 0 &&
+			(best_len == 6 || (best_len == 7 && words[7] != 0x0001) ||
+			 (best_len == 5 && words[5] == 0xffff))) {
+			return rspamd_inet_ntop4(a + 12, p);
+		}
+
+		if (words[i] >= 0x1000) {
+			*p++ = hexdigits[words[i] >> 12];
+		}
+		if (words[i] >= 0x100) {
+			*p++ = hexdigits[(words[i] >> 8) & 0xf];
+		}
+		if (words[i] >= 0x10) {
+			*p++ = hexdigits[(words[i] >> 4) & 0xf];
+		}
+
+		*p++ = hexdigits[words[i] & 0xf];
+	}
+
+	if (best_base != -1 && best_base + best_len == 8) {
+		*p++ = ':';
+	}
+
+	return p;
+}
+
+gsize rspamd_inet_ntop(int af, const void *addr, char *buf, gsize buflen)
+{
+	char tmp[INET6_ADDRSTRLEN + 1], *end;
+	gsize len;
+
+	if (af == AF_INET) {
+		end = rspamd_inet_ntop4(addr, tmp);
+	}
+	else if (af == AF_INET6) {
+		end = rspamd_inet_ntop6(addr, tmp);
+	}
+	else {
+		return 0;
+	}
+
+	len = end - tmp;
+
+	if (len >= buflen) {
+		return 0;
+	}
+
+	memcpy(buf, tmp, len);
+	buf[len] = '\0';
+
+	return len;
+}
+
+gsize rspamd_inet_address_to_string_buf(const rspamd_inet_addr_t *addr,
+										char *buf, gsize buflen)
+{
+	switch (addr->af) {
+	case AF_INET:
+		return rspamd_inet_ntop(AF_INET, &addr->u.in.addr.s4.sin_addr, buf, buflen);
+	case AF_INET6:
+		return rspamd_inet_ntop(AF_INET6, &addr->u.in.addr.s6.sin6_addr, buf, buflen);
+	case AF_UNIX:
+		return rspamd_strlcpy(buf, addr->u.un->addr.sun_path, buflen);
+	}
+
+	return 0;
+}
+
 /*
  * This is used to allow rspamd_inet_address_to_string to be used several times
  * at the same function invocation, like printf("%s -> %s", f(ip1), f(ip2));
@@ -958,15 +1211,13 @@ rspamd_inet_address_to_string(const rspamd_inet_addr_t *addr)
 		return "<empty inet address>";
 	}
 
-	addr_buf = addr_str[cur_addr++ % NADDR_BUFS];
-
 	switch (addr->af) {
 	case AF_INET:
-		return inet_ntop(addr->af, &addr->u.in.addr.s4.sin_addr, addr_buf,
-						 INET6_ADDRSTRLEN + 1);
 	case AF_INET6:
-		return inet_ntop(addr->af, &addr->u.in.addr.s6.sin6_addr, addr_buf,
-						 INET6_ADDRSTRLEN + 1);
+		addr_buf = addr_str[cur_addr++ % NADDR_BUFS];
+		rspamd_inet_address_to_string_buf(addr, addr_buf, INET6_ADDRSTRLEN + 1);
+
+		return addr_buf;
 	case AF_UNIX:
 		return addr->u.un->addr.sun_path;
 	}
@@ -154,6 +154,26 @@ rspamd_inet_addr_t *rspamd_parse_inet_address_pool(const char *src,
  */
 const char *rspamd_inet_address_to_string(const rspamd_inet_addr_t *addr);
 
+/**
+ * Writes string representation of inet address to `buf` without allocations
+ * @param addr
+ * @param buf target buffer (INET6_ADDRSTRLEN + 1 is enough for ipv4 and ipv6)
+ * @param buflen length of `buf`
+ * @return length of the zero terminated string written or 0 if `buf` is too short
+ */
+gsize rspamd_inet_address_to_string_buf(const rspamd_inet_addr_t *addr,
+										char *buf, gsize buflen);
+
+/**
+ * Writes string representation of a raw ipv4 or ipv6 address (like inet_ntop)
+ * @param af AF_INET or AF_INET6
+ * @param addr in_addr or in6_addr
+ * @param buf target buffer
+ * @param buflen length of `buf`
+ * @return length of the zero terminated string written or 0 on error
+ */
+gsize rspamd_inet_ntop(int af, const void *addr, char *buf, gsize buflen);
+
 /**
  * Returns pretty string representation of inet address
  * @param addr
@@ -0,0 +1,467 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpu_pool.h"
+#include "lockfree.hxx"
+#include "contrib/libev/ev.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
+#include "doctest/doctest.h"
+
+namespace rspamd::util {
+
+struct cpu_pool_job {
+	rspamd_cpu_pool_work_t work;
+	rspamd_cpu_pool_done_t done;
+	void *ud;
+};
+
+class cpu_pool {
+	struct thread_ctx {
+		work_stealing_deque<cpu_pool_job *> deque;
+		std::thread thr;
+
+		explicit thread_ctx(std::size_t capacity)
+			: deque(capacity)
+		{
+		}
+	};
+
+	/* How many jobs a thread takes from the shared queue at once */
+	static constexpr const auto take_batch = 8u;
+
+	struct ev_loop *event_loop;
+	ev_async done_ev;
+	std::size_t max_jobs;
+	/* Jobs submitted by the event loop thread */
+	mpmc_bounded_queue<cpu_pool_job *> incoming;
+	/* Jobs executed, waiting for the completion in the event loop thread */
+	mpmc_bounded_queue<cpu_pool_job *> completed;
+	std::vector<std::unique_ptr<thread_ctx>> threads;
+
+	std::atomic<unsigned int> inflight{0};
+	/* Jobs that are queued and not yet started (in any queue) */
+	std::atomic<unsigned int> queued{0};
+	std::atomic<unsigned int> sleepers{0};
+	std::atomic<bool> stop{false};
+	std::mutex sleep_mtx;
+	std::condition_variable sleep_cv;
+
+	auto find_job(std::size_t own_idx) -> cpu_pool_job *
+	{
+		auto &own = threads[own_idx]->deque;
+
+		if (auto job = own.pop(); job) {
+			return job.value();
+		}
+
+		/* Refill own deque from the shared queue, the rest of the batch can be stolen */
+		if (auto job = incoming.pop(); job) {
+			for (auto i = 1u; i < take_batch; i++) {
+				auto next = incoming.pop();
+
+				if (!next) {
+					break;
+				}
+
+				if (!own.push(next.value())) {
+					/* Cannot happen as deques can hold all jobs in flight */
+					run_job(next.value());
+				}
+			}
+
+			return job.value();
+		}
+
+		/* Steal from siblings */
+		for (auto i = 1u; i < threads.size(); i++) {
+			auto victim = (own_idx + i) % threads.size();
+
+			if (auto job = threads[victim]->deque.steal(); job) {
+				return job.value();
+			}
+		}
+
+		return nullptr;
+	}
+
+	auto run_job(cpu_pool_job *job) -> void
+	{
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		job->work(job->ud);
+
+		/* Completed queue can hold all jobs in flight */
+		while (!completed.push(job)) {
+			std::this_thread::yield();
+		}
+
+		ev_async_send(event_loop, &done_ev);
+	}
+
+	auto thread_loop(std::size_t idx) -> void
+	{
+		for (;;) {
+			auto *job = find_job(idx);
+
+			if (job) {
+				run_job(job);
+				continue;
+			}
+
+			std::unique_lock lk{sleep_mtx};
+			sleepers.fetch_add(1, std::memory_order_seq_cst);
+
+			while (queued.load(std::memory_order_seq_cst) == 0 &&
+				   !stop.load(std::memory_order_relaxed)) {
+				sleep_cv.wait(lk);
+			}
+
+			sleepers.fetch_sub(1, std::memory_order_relaxed);
+
+			if (stop.load(std::memory_order_relaxed) &&
+				queued.load(std::memory_order_seq_cst) == 0) {
+				return;
+			}
+		}
+	}
+
+	static auto done_cb(EV_P_ ev_async *w, int revents) -> void
+	{
+		auto *pool = (cpu_pool *) w->data;
+
+		pool->drain_completed();
+	}
+
+public:
+	cpu_pool(struct ev_loop *loop, unsigned int nthreads, unsigned int max_jobs)
+		: event_loop(loop), max_jobs(lockfree_capacity(max_jobs)),
+		  incoming(max_jobs), completed(max_jobs)
+	{
+		ev_async_init(&done_ev, cpu_pool::done_cb);
+		done_ev.data = (void *) this;
+		ev_async_start(event_loop, &done_ev);
+		/* Do not keep the loop alive merely because of the pool */
+		ev_unref(event_loop);
+
+		threads.reserve(nthreads);
+
+		for (auto i = 0u; i < nthreads; i++) {
+			threads.emplace_back(std::make_unique<thread_ctx>(this->max_jobs));
+		}
+
+		for (auto i = 0u; i < nthreads; i++) {
+			threads[i]->thr = std::thread([this, i]() { thread_loop(i); });
+		}
+	}
+
+	~cpu_pool()
+	{
+		stop.store(true);
+		{
+			std::lock_guard lk{sleep_mtx};
+			sleep_cv.notify_all();
+		}
+
+		for (auto &th: threads) {
+			if (th->thr.joinable()) {
+				th->thr.join();
+			}
+		}
+
+		drain_completed();
+		ev_ref(event_loop);
+		ev_async_stop(event_loop, &done_ev);
+	}
+
+	auto push(rspamd_cpu_pool_work_t work, rspamd_cpu_pool_done_t done, void *ud) -> bool
+	{
+		if (threads.empty() || inflight.load(std::memory_order_relaxed) >= max_jobs) {
+			return false;
+		}
+
+		auto *job = new cpu_pool_job{work, done, ud};
+
+		if (!incoming.push(job)) {
+			delete job;
+
+			return false;
+		}
+
+		inflight.fetch_add(1, std::memory_order_relaxed);
+		queued.fetch_add(1, std::memory_order_seq_cst);
+
+		if (sleepers.load(std::memory_order_seq_cst) > 0) {
+			std::lock_guard lk{sleep_mtx};
+			sleep_cv.notify_one();
+		}
+
+		return true;
+	}
+
+	auto drain_completed() -> void
+	{
+		while (auto job = completed.pop()) {
+			auto *j = job.value();
+
+			inflight.fetch_sub(1, std::memory_order_relaxed);
+
+			if (j->done) {
+				j->done(j->ud);
+			}
+
+			delete j;
+		}
+	}
+
+	auto wait() -> void
+	{
+		/* Completions can schedule new jobs, so wait until nothing is left */
+		for (;;) {
+			drain_completed();
+
+			if (inflight.load(std::memory_order_relaxed) == 0) {
+				break;
+			}
+
+			std::this_thread::yield();
+		}
+	}
+
+	auto get_inflight() const -> unsigned int
+	{
+		return inflight.load(std::memory_order_relaxed);
+	}
+
+	auto get_nthreads() const -> unsigned int
+	{
+		return threads.size();
+	}
+};
+
+}// namespace rspamd::util
+
+struct rspamd_cpu_pool *
+rspamd_cpu_pool_new(struct ev_loop *event_loop, unsigned int nthreads,
+					unsigned int max_jobs)
+{
+	if (max_jobs == 0) {
+		max_jobs = 1024;
+	}
+
+	auto *pool = new rspamd::util::cpu_pool(event_loop, nthreads, max_jobs);
+
+	return (struct rspamd_cpu_pool *) pool;
+}
+
+gboolean
+rspamd_cpu_pool_push(struct rspamd_cpu_pool *pool,
+					 rspamd_cpu_pool_work_t work,
+					 rspamd_cpu_pool_done_t done,
+					 void *ud)
+{
+	auto *real_pool = (rspamd::util::cpu_pool *) pool;
+
+	return real_pool->push(work, done, ud);
+}
+
+unsigned int
+rspamd_cpu_pool_inflight(struct rspamd_cpu_pool *pool)
+{
+	auto *real_pool = (rspamd::util::cpu_pool *) pool;
+
+	return real_pool->get_inflight();
+}
+
+unsigned int
+rspamd_cpu_pool_nthreads(struct rspamd_cpu_pool *pool)
+{
+	auto *real_pool = (rspamd::util::cpu_pool *) pool;
+
+	return real_pool->get_nthreads();
+}
+
+void rspamd_cpu_pool_wait(struct rspamd_cpu_pool *pool)
+{
+	auto *real_pool = (rspamd::util::cpu_pool *) pool;
+
+	real_pool->wait();
+}
+
+void rspamd_cpu_pool_destroy(struct rspamd_cpu_pool *pool)
+{
+	auto *real_pool = (rspamd::util::cpu_pool *) pool;
+
+	delete real_pool;
+}
+
+TEST_SUITE("lockfree containers")
+{
+	using namespace rspamd::util;
+
+	TEST_CASE("mpmc queue")
+	{
+		mpmc_bounded_queue<int> q{3};
+
+		CHECK(q.capacity() == 4);
+
+		for (auto i = 0; i < 4; i++) {
+			CHECK(q.push(i));
+		}
+
+		CHECK(!q.push(100));
+
+		for (auto i = 0; i < 4; i++) {
+			auto v = q.pop();
+			REQUIRE(v.has_value());
+			CHECK(v.value() == i);
+		}
+
+		CHECK(!q.pop().has_value());
+	}
+
+	TEST_CASE("work stealing deque")
+	{
+		work_stealing_deque<int> dq{8};
+
+		for (auto i = 0; i < 8; i++) {
+			CHECK(dq.push(i));
+		}
+
+		CHECK(!dq.push(100));
+		/* Owner takes from the bottom, thieves from the top */
+		CHECK(dq.pop().value() == 7);
+		CHECK(dq.steal().value() == 0);
+		CHECK(dq.steal().value() == 1);
+		CHECK(dq.pop().value() == 6);
+
+		auto cnt = 0;
+
+		while (dq.pop()) {
+			cnt++;
+		}
+
+		CHECK(cnt == 4);
+		CHECK(dq.empty());
+		CHECK(!dq.steal().has_value());
+	}
+
+	TEST_CASE("concurrent stealing")
+	{
+		constexpr auto nitems = 10000;
+		work_stealing_deque<int> dq{nitems};
+		std::atomic<long> sum{0};
+		std::atomic<bool> done{false};
+
+		auto thief = [&]() {
+			while (!done.load() || !dq.empty()) {
+				if (auto v = dq.steal(); v) {
+					sum += v.value();
+				}
+			}
+		};
+
+		std::thread t1{thief}, t2{thief};
+
+		for (auto i = 1; i <= nitems; i++) {
+			REQUIRE(dq.push(i));
+
+			if (i % 3 == 0) {
+				if (auto v = dq.pop(); v) {
+					sum += v.value();
+				}
+			}
+		}
+
+		done.store(true);
+		t1.join();
+		t2.join();
+
+		while (auto v = dq.pop()) {
+			sum += v.value();
+		}
+
+		CHECK(sum.load() == (long) nitems * (nitems + 1) / 2);
+	}
+
+	TEST_CASE("cpu pool")
+	{
+		struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+		auto *pool = rspamd_cpu_pool_new(loop, 4, 64);
+		struct test_job {
+			int input;
+			int output;
+			int *ndone;
+		};
+		std::vector<test_job> jobs(32);
+		int ndone = 0;
+
+		for (auto i = 0u; i < jobs.size(); i++) {
+			jobs[i] = test_job{(int) i, 0, &ndone};
+			CHECK(rspamd_cpu_pool_push(
+				pool, [](void *ud) {
+				auto *j = (test_job *) ud;
+				j->output = j->input * 2; }, [](void *ud) {
+				auto *j = (test_job *) ud;
+				(*j->ndone)++; }, &jobs[i]));
+		}
+
+		while (ndone < (int) jobs.size()) {
+			ev_run(loop, EVRUN_ONCE);
+		}
+
+		for (auto i = 0u; i < jobs.size(); i++) {
+			CHECK(jobs[i].output == (int) i * 2);
+		}
+
+		CHECK(rspamd_cpu_pool_inflight(pool) == 0);
+		rspamd_cpu_pool_destroy(pool);
+		ev_loop_destroy(loop);
+	}
+
+	TEST_CASE("cpu pool wait")
+	{
+		struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+		auto *pool = rspamd_cpu_pool_new(loop, 2, 16);
+		std::atomic<int> nworked{0};
+		int ndone = 0;
+		struct test_job {
+			std::atomic<int> *nworked;
+			int *ndone;
+		} job{&nworked, &ndone};
+
+		for (auto i = 0; i < 8; i++) {
+			CHECK(rspamd_cpu_pool_push(
+				pool, [](void *ud) {
+				auto *j = (test_job *) ud;
+				(*j->nworked)++; }, [](void *ud) {
+				auto *j = (test_job *) ud;
+				(*j->ndone)++; }, &job));
+		}
+
+		/* Completions are called without running the loop */
+		rspamd_cpu_pool_wait(pool);
+		CHECK(nworked.load() == 8);
+		CHECK(ndone == 8);
+		CHECK(rspamd_cpu_pool_inflight(pool) == 0);
+		rspamd_cpu_pool_destroy(pool);
+		ev_loop_destroy(loop);
+	}
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef RSPAMD_CPU_POOL_H
+#define RSPAMD_CPU_POOL_H
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ev_loop;
+struct rspamd_cpu_pool;
+
+/**
+ * Job executed in a pool thread: it must not touch Lua, logger, event loop or any
+ * other non thread safe state, only the data passed via `ud`
+ */
+typedef void (*rspamd_cpu_pool_work_t)(void *ud);
+/**
+ * Completion callback, always executed in the event loop thread
+ */
+typedef void (*rspamd_cpu_pool_done_t)(void *ud);
+
+/**
+ * Creates a pool of threads for cpu bound jobs, jobs are distributed using
+ * lock-free queue and work stealing deques; completions are delivered to the
+ * specified event loop
+ * @param event_loop loop where completions are executed
+ * @param nthreads number of threads
+ * @param max_jobs maximum number of jobs in flight
+ * @return new pool
+ */
+struct rspamd_cpu_pool *rspamd_cpu_pool_new(struct ev_loop *event_loop,
+											unsigned int nthreads,
+											unsigned int max_jobs);
+
+/**
+ * Schedules a job in the pool
+ * @return FALSE if the pool is saturated (caller should then execute the job inline)
+ */
+gboolean rspamd_cpu_pool_push(struct rspamd_cpu_pool *pool,
+							  rspamd_cpu_pool_work_t work,
+							  rspamd_cpu_pool_done_t done,
+							  void *ud);
+
+/**
+ * Returns number of jobs that are scheduled but whose completion has not been called yet
+ */
+unsigned int rspamd_cpu_pool_inflight(struct rspamd_cpu_pool *pool);
+
+/**
+ * Returns number of threads in the pool
+ */
+unsigned int rspamd_cpu_pool_nthreads(struct rspamd_cpu_pool *pool);
+
+/**
+ * Blocks until all jobs in flight are done and calls their completions, e.g.
+ * before replacing data that jobs may read
+ */
+void rspamd_cpu_pool_wait(struct rspamd_cpu_pool *pool);
+
+/**
+ * Waits for all jobs, calls pending completions and destroys the pool
+ */
+void rspamd_cpu_pool_destroy(struct rspamd_cpu_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_LOCKFREE_HXX
+#define RSPAMD_LOCKFREE_HXX
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+/*
+ * Lock-free containers used to pass work between threads
+ */
+namespace rspamd::util {
+
+/*
+ * Rounds capacity to the next power of two, so we can use masks for indexing
+ */
+constexpr inline auto lockfree_capacity(std::size_t sz) -> std::size_t
+{
+	std::size_t cap = 2;
+
+	while (cap < sz) {
+		cap <<= 1u;
+	}
+
+	return cap;
+}
+
+/**
+ * Bounded multi-producer multi-consumer queue (D. Vyukov's algorithm)
+ * Each cell has a sequence number that tells whether it is ready to be written
+ * or to be read, so producers and consumers synchronise merely on the cells
+ */
+template<class T>
+class mpmc_bounded_queue {
+	struct cell {
+		std::atomic<std::size_t> seq;
+		T data;
+	};
+
+	std::size_t mask;
+	std::unique_ptr<cell[]> cells;
+	alignas(64) std::atomic<std::size_t> enqueue_pos{0};
+	alignas(64) std::atomic<std::size_t> dequeue_pos{0};
+
+public:
+	explicit mpmc_bounded_queue(std::size_t capacity)
+		: mask(lockfree_capacity(capacity) - 1),
+		  cells(new cell[mask + 1])
+	{
+		for (std::size_t i = 0; i <= mask; i++) {
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	mpmc_bounded_queue(const mpmc_bounded_queue &) = delete;
+	mpmc_bounded_queue &operator=(const mpmc_bounded_queue &) = delete;
+
+	auto capacity() const -> std::size_t
+	{
+		return mask + 1;
+	}
+
+	/**
+	 * Pushes an element to the queue
+	 * @return false if the queue is full
+	 */
+	auto push(T value) -> bool
+	{
+		auto pos = enqueue_pos.load(std::memory_order_relaxed);
+		cell *c;
+
+		for (;;) {
+			c = &cells[pos & mask];
+			auto seq = c->seq.load(std::memory_order_acquire);
+			auto diff = (std::intptr_t) seq - (std::intptr_t) pos;
+
+			if (diff == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		c->data = std::move(value);
+		c->seq.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	/**
+	 * Pops an element from the queue
+	 * @return std::nullopt if the queue is empty
+	 */
+	auto pop() -> std::optional<T>
+	{
+		auto pos = dequeue_pos.load(std::memory_order_relaxed);
+		cell *c;
+
+		for (;;) {
+			c = &cells[pos & mask];
+			auto seq = c->seq.load(std::memory_order_acquire);
+			auto diff = (std::intptr_t) seq - (std::intptr_t) (pos + 1);
+
+			if (diff == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return std::nullopt;
+			}
+			else {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		auto ret = std::make_optional<T>(std::move(c->data));
+		c->seq.store(pos + mask + 1, std::memory_order_release);
+
+		return ret;
+	}
+};
+
+/**
+ * Bounded work stealing deque (Chase-Lev, with the memory orders from
+ * "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al.)
+ * The owner thread pushes and pops from the bottom, other threads steal from the top.
+ * T must be trivially copyable (normally it is a pointer).
+ */
+template<class T>
+class work_stealing_deque {
+	static_assert(std::is_trivially_copyable_v<T>);
+
+	std::int64_t mask;
+	std::unique_ptr<std::atomic<T>[]> buf;
+	alignas(64) std::atomic<std::int64_t> top{0};
+	alignas(64) std::atomic<std::int64_t> bottom{0};
+
+public:
+	explicit work_stealing_deque(std::size_t capacity)
+		: mask((std::int64_t) lockfree_capacity(capacity) - 1),
+		  buf(new std::atomic<T>[mask + 1])
+	{
+	}
+
+	work_stealing_deque(const work_stealing_deque &) = delete;
+	work_stealing_deque &operator=(const work_stealing_deque &) = delete;
+
+	/**
+	 * Owner only: push an element to the bottom
+	 * @return false if there is no space left
+	 */
+	auto push(T value) -> bool
+	{
+		auto b = bottom.load(std::memory_order_relaxed);
+		auto t = top.load(std::memory_order_acquire);
+
+		if (b - t > mask) {
+			return false;
+		}
+
+		buf[b & mask].store(value, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+
+		return true;
+	}
+
+	/**
+	 * Owner only: pop an element from the bottom
+	 */
+	auto pop() -> std::optional<T>
+	{
+		auto b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto t = top.load(std::memory_order_relaxed);
+
+		if (t <= b) {
+			auto value = buf[b & mask].load(std::memory_order_relaxed);
+
+			if (t == b) {
+				/* The last element, race with thieves */
+				auto won = top.compare_exchange_strong(t, t + 1,
+													   std::memory_order_seq_cst,
+													   std::memory_order_relaxed);
+				bottom.store(b + 1, std::memory_order_relaxed);
+
+				if (!won) {
+					return std::nullopt;
+				}
+			}
+
+			return value;
+		}
+
+		/* Empty */
+		bottom.store(b + 1, std::memory_order_relaxed);
+
+		return std::nullopt;
+	}
+
+	/**
+	 * Any thread: steal an element from the top
+	 */
+	auto steal() -> std::optional<T>
+	{
+		auto t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		auto b = bottom.load(std::memory_order_acquire);
+
+		if (t < b) {
+			auto value = buf[t & mask].load(std::memory_order_relaxed);
+
+			if (!top.compare_exchange_strong(t, t + 1,
+											 std::memory_order_seq_cst,
+											 std::memory_order_relaxed)) {
+				/* Lost the race */
+				return std::nullopt;
+			}
+
+			return value;
+		}
+
+		return std::nullopt;
+	}
+
+	auto empty() const -> bool
+	{
+		return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+	}
+};
+
+}// namespace rspamd::util
+
+#endif//RSPAMD_LOCKFREE_HXX
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_MEMPOOL_ALLOCATOR_HXX
+#define RSPAMD_MEMPOOL_ALLOCATOR_HXX
+
+#pragma once
+
+#include "config.h"
+#include "libutil/mem_pool.h"
+#include "contrib/ankerl/unordered_dense.h"
+
+#include <memory>
+#include <new>
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdlib>
+
+namespace rspamd {
+
+/**
+ * Allocator that takes memory from rspamd_mempool_t: deallocation is a no-op,
+ * memory is returned merely when the pool is destroyed.
+ * Hence, containers using this allocator must not outlive their pool (normally,
+ * they live in objects whose destructors are registered in the same pool).
+ * Allocator with no pool falls back to the heap, so the same container types
+ * can be used outside of a task.
+ */
+template<class T>
+class mempool_allocator {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+	using is_always_equal = std::false_type;
+
+	constexpr mempool_allocator() noexcept = default;
+	constexpr explicit mempool_allocator(rspamd_mempool_t *pool) noexcept
+		: pool(pool)
+	{
+	}
+	template<class U>
+	constexpr mempool_allocator(const mempool_allocator<U> &other) noexcept
+		: pool(other.get_pool())
+	{
+	}
+
+	auto allocate(std::size_t n) -> T *
+	{
+		if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+
+		constexpr auto align = alignof(T) > MIN_MEM_ALIGNMENT ? alignof(T) : MIN_MEM_ALIGNMENT;
+
+		if (pool == nullptr) {
+			if constexpr (alignof(T) > alignof(std::max_align_t)) {
+				return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{align}));
+			}
+			else {
+				return static_cast<T *>(::operator new(n * sizeof(T)));
+			}
+		}
+
+		return static_cast<T *>(rspamd_mempool_alloc_array_(pool, n, sizeof(T), align, G_STRLOC));
+	}
+
+	auto deallocate(T *p, std::size_t n) noexcept -> void
+	{
+		if (pool == nullptr) {
+			if constexpr (alignof(T) > alignof(std::max_align_t)) {
+				constexpr auto align = alignof(T) > MIN_MEM_ALIGNMENT ? alignof(T) : MIN_MEM_ALIGNMENT;
+				::operator delete(p, std::align_val_t{align});
+			}
+			else {
+				::operator delete(p);
+			}
+		}
+		/* Pool memory is released with the pool itself */
+	}
+
+	constexpr auto get_pool() const noexcept -> rspamd_mempool_t *
+	{
+		return pool;
+	}
+
+	template<class U>
+	constexpr auto operator==(const mempool_allocator<U> &other) const noexcept -> bool
+	{
+		return pool == other.get_pool();
+	}
+	template<class U>
+	constexpr auto operator!=(const mempool_allocator<U> &other) const noexcept -> bool
+	{
+		return pool != other.get_pool();
+	}
+
+private:
+	rspamd_mempool_t *pool = nullptr;
+};
+
+/*
+ * Pool aware containers, e.g. `pool_vector<int> v{mempool_allocator<int>{task->task_pool}}`
+ */
+template<class T>
+using pool_vector = std::vector<T, mempool_allocator<T>>;
+
+using pool_string = std::basic_string<char, std::char_traits<char>, mempool_allocator<char>>;
+
+template<class K, class V, class Hash = ankerl::unordered_dense::hash<K>, class Eq = std::equal_to<K>>
+using pool_map = ankerl::unordered_dense::map<K, V, Hash, Eq, mempool_allocator<std::pair<K, V>>>;
+
+template<class K, class Hash = ankerl::unordered_dense::hash<K>, class Eq = std::equal_to<K>>
+using pool_set = ankerl::unordered_dense::set<K, Hash, Eq, mempool_allocator<K>>;
+
+}// namespace rspamd
+
+#endif//RSPAMD_MEMPOOL_ALLOCATOR_HXX
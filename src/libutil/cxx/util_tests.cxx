@@ -15,6 +15,7 @@
  */
 
 #include "util.hxx"
+#include "mempool_allocator.hxx"
 
 #define DOCTEST_CONFIG_IMPLEMENTATION_IN_DLL
 #include "doctest/doctest.h"
@@ -79,4 +80,41 @@ TEST_SUITE("cxx utils")
 			compare_vec(res, std::get<2>(c).second);
 		}
 	}
+
+	TEST_CASE("mempool allocator")
+	{
+		auto *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "test", 0);
+		{
+			pool_vector<int> v{mempool_allocator<int>{pool}};
+
+			for (auto i = 0; i < 1000; i++) {
+				v.push_back(i);
+			}
+
+			CHECK(v.size() == 1000);
+			CHECK(v[999] == 999);
+			CHECK(v.get_allocator().get_pool() == pool);
+
+			pool_string str{"long enough string to avoid small string optimisation",
+							mempool_allocator<char>{pool}};
+			str += str;
+			CHECK(str.size() == 106);
+
+			pool_map<int, int> m{mempool_allocator<std::pair<int, int>>{pool}};
+
+			for (auto i = 0; i < 100; i++) {
+				m[i] = i * 2;
+			}
+
+			CHECK(m.size() == 100);
+			CHECK(m[50] == 100);
+
+			/* No pool means heap */
+			pool_vector<int> heap_v;
+			heap_v.assign(v.begin(), v.end());
+			CHECK(heap_v.get_allocator().get_pool() == nullptr);
+			CHECK(std::equal(heap_v.begin(), heap_v.end(), v.begin(), v.end()));
+		}
+		rspamd_mempool_delete(pool);
+	}
 }
\ No newline at end of file
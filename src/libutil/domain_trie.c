@@ -0,0 +1,308 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "domain_trie.h"
+#include "mem_pool.h"
+#include "str_util.h"
+#include "khash.h"
+
+/* Hostnames are limited by 253 characters, so it is more than enough */
+#define DOMAIN_TRIE_MAX_LABELS 128
+#define DOMAIN_TRIE_NO_NODE G_MAXUINT32
+
+enum rspamd_domain_trie_node_flags {
+	DOMAIN_TRIE_NODE_SUFFIX = (1u << 0u),
+	DOMAIN_TRIE_NODE_WILDCARD = (1u << 1u),
+};
+
+struct rspamd_domain_trie_node {
+	gconstpointer value;
+	unsigned int flags;
+};
+
+/*
+ * Children of all nodes are stored in a single hash keyed by a parent node
+ * and a label, so a node itself is tiny
+ */
+struct rspamd_domain_trie_key {
+	const char *label;
+	uint32_t len;
+	uint32_t parent;
+};
+
+static inline khint_t
+rspamd_domain_trie_key_hash(struct rspamd_domain_trie_key k)
+{
+	return (khint_t) rspamd_icase_hash(k.label, k.len, k.parent);
+}
+
+static inline bool
+rspamd_domain_trie_key_equal(struct rspamd_domain_trie_key k1,
+							 struct rspamd_domain_trie_key k2)
+{
+	return k1.parent == k2.parent && k1.len == k2.len &&
+		   rspamd_lc_cmp(k1.label, k2.label, k1.len) == 0;
+}
+
+KHASH_INIT(rspamd_domain_trie_children, struct rspamd_domain_trie_key, uint32_t,
+		   1, rspamd_domain_trie_key_hash, rspamd_domain_trie_key_equal);
+
+struct rspamd_domain_trie {
+	GArray *nodes; /* node 0 is the root */
+	khash_t(rspamd_domain_trie_children) * children;
+	rspamd_mempool_t *pool; /* labels */
+	gsize nsuffixes;
+};
+
+/*
+ * Splits a hostname to labels starting from the rightmost one
+ */
+static unsigned int
+rspamd_domain_trie_split(const char *host, gsize len,
+						 const char **starts, uint32_t *lens)
+{
+	const char *end = host + len, *p = end;
+	unsigned int n = 0;
+
+	while (p > host && n < DOMAIN_TRIE_MAX_LABELS - 1) {
+		p--;
+
+		if (*p == '.') {
+			starts[n] = p + 1;
+			lens[n] = end - (p + 1);
+			n++;
+			end = p;
+		}
+	}
+
+	starts[n] = host;
+	lens[n] = end - host;
+
+	return n + 1;
+}
+
+static inline uint32_t
+rspamd_domain_trie_child(struct rspamd_domain_trie *trie, uint32_t parent,
+						 const char *label, uint32_t len)
+{
+	struct rspamd_domain_trie_key key;
+	khiter_t k;
+
+	key.label = label;
+	key.len = len;
+	key.parent = parent;
+	k = kh_get(rspamd_domain_trie_children, trie->children, key);
+
+	if (k == kh_end(trie->children)) {
+		return DOMAIN_TRIE_NO_NODE;
+	}
+
+	return kh_value(trie->children, k);
+}
+
+struct rspamd_domain_trie *
+rspamd_domain_trie_new(void)
+{
+	struct rspamd_domain_trie *trie;
+	struct rspamd_domain_trie_node root;
+
+	trie = g_malloc0(sizeof(*trie));
+	trie->nodes = g_array_new(FALSE, FALSE, sizeof(struct rspamd_domain_trie_node));
+	trie->children = kh_init(rspamd_domain_trie_children);
+	trie->pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "domain_trie", 0);
+
+	memset(&root, 0, sizeof(root));
+	g_array_append_val(trie->nodes, root);
+
+	return trie;
+}
+
+void rspamd_domain_trie_add(struct rspamd_domain_trie *trie,
+							const char *suffix, gsize len,
+							enum rspamd_domain_trie_flags flags,
+							gconstpointer value)
+{
+	const char *starts[DOMAIN_TRIE_MAX_LABELS];
+	uint32_t lens[DOMAIN_TRIE_MAX_LABELS];
+	struct rspamd_domain_trie_node node, *cur_node;
+	struct rspamd_domain_trie_key key;
+	unsigned int i, n;
+	uint32_t cur = 0, child;
+	khiter_t k;
+	int r;
+
+	g_assert(trie != NULL);
+
+	if (len > 0 && suffix[len - 1] == '.') {
+		len--;
+	}
+
+	if (len == 0) {
+		return;
+	}
+
+	n = rspamd_domain_trie_split(suffix, len, starts, lens);
+	memset(&node, 0, sizeof(node));
+
+	for (i = 0; i < n; i++) {
+		child = rspamd_domain_trie_child(trie, cur, starts[i], lens[i]);
+
+		if (child == DOMAIN_TRIE_NO_NODE) {
+			char *label = rspamd_mempool_alloc(trie->pool, lens[i] + 1);
+
+			rspamd_strlcpy(label, starts[i], lens[i] + 1);
+			rspamd_str_lc(label, lens[i]);
+			key.label = label;
+			key.len = lens[i];
+			key.parent = cur;
+
+			child = trie->nodes->len;
+			g_array_append_val(trie->nodes, node);
+			k = kh_put(rspamd_domain_trie_children, trie->children, key, &r);
+			kh_value(trie->children, k) = child;
+		}
+
+		cur = child;
+	}
+
+	cur_node = &g_array_index(trie->nodes, struct rspamd_domain_trie_node, cur);
+
+	if (!(cur_node->flags & (DOMAIN_TRIE_NODE_SUFFIX | DOMAIN_TRIE_NODE_WILDCARD))) {
+		trie->nsuffixes++;
+	}
+
+	cur_node->flags |= (flags & RSPAMD_DOMAIN_TRIE_WILDCARD) ? DOMAIN_TRIE_NODE_WILDCARD : DOMAIN_TRIE_NODE_SUFFIX;
+	cur_node->value = value;
+}
+
+gconstpointer
+rspamd_domain_trie_lookup(struct rspamd_domain_trie *trie,
+						  const char *host, gsize len,
+						  gsize *suffix_len)
+{
+	const char *starts[DOMAIN_TRIE_MAX_LABELS];
+	uint32_t lens[DOMAIN_TRIE_MAX_LABELS];
+	struct rspamd_domain_trie_node *node;
+	gconstpointer found = NULL;
+	gsize found_len = 0;
+	unsigned int i, n;
+	uint32_t cur = 0;
+
+	g_assert(trie != NULL);
+
+	if (len > 0 && host[len - 1] == '.') {
+		len--;
+	}
+
+	if (len == 0) {
+		return NULL;
+	}
+
+	n = rspamd_domain_trie_split(host, len, starts, lens);
+
+	for (i = 0; i < n; i++) {
+		cur = rspamd_domain_trie_child(trie, cur, starts[i], lens[i]);
+
+		if (cur == DOMAIN_TRIE_NO_NODE) {
+			break;
+		}
+
+		node = &g_array_index(trie->nodes, struct rspamd_domain_trie_node, cur);
+
+		if (node->flags & DOMAIN_TRIE_NODE_SUFFIX) {
+			found = node->value;
+			found_len = host + len - starts[i];
+		}
+	}
+
+	if (suffix_len) {
+		*suffix_len = found_len;
+	}
+
+	return found;
+}
+
+gsize rspamd_domain_trie_esld(struct rspamd_domain_trie *trie,
+							  const char *host, gsize len)
+{
+	const char *starts[DOMAIN_TRIE_MAX_LABELS];
+	uint32_t lens[DOMAIN_TRIE_MAX_LABELS];
+	struct rspamd_domain_trie_node *node;
+	unsigned int i, n, want = 0;
+	uint32_t cur = 0;
+
+	g_assert(trie != NULL);
+
+	if (len > 0 && host[len - 1] == '.') {
+		len--;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	n = rspamd_domain_trie_split(host, len, starts, lens);
+
+	/* A public suffix must be preceded by some label */
+	for (i = 0; i + 1 < n; i++) {
+		cur = rspamd_domain_trie_child(trie, cur, starts[i], lens[i]);
+
+		if (cur == DOMAIN_TRIE_NO_NODE) {
+			break;
+		}
+
+		node = &g_array_index(trie->nodes, struct rspamd_domain_trie_node, cur);
+
+		/* Number of labels in the suffix and the next label(s) */
+		if (node->flags & DOMAIN_TRIE_NODE_WILDCARD) {
+			want = MAX(want, i + 3);
+		}
+		if (node->flags & DOMAIN_TRIE_NODE_SUFFIX) {
+			want = MAX(want, i + 2);
+		}
+	}
+
+	if (want == 0) {
+		return 0;
+	}
+
+	want = MIN(want, n);
+
+	return host + len - starts[want - 1];
+}
+
+gsize rspamd_domain_trie_size(struct rspamd_domain_trie *trie)
+{
+	return trie->nsuffixes;
+}
+
+gsize rspamd_domain_trie_memory(struct rspamd_domain_trie *trie)
+{
+	return sizeof(*trie) +
+		   trie->nodes->len * sizeof(struct rspamd_domain_trie_node) +
+		   kh_n_buckets(trie->children) * (sizeof(struct rspamd_domain_trie_key) + sizeof(uint32_t)) +
+		   rspamd_mempool_get_used_size(trie->pool);
+}
+
+void rspamd_domain_trie_destroy(struct rspamd_domain_trie *trie)
+{
+	if (trie) {
+		kh_destroy(rspamd_domain_trie_children, trie->children);
+		g_array_free(trie->nodes, TRUE);
+		rspamd_mempool_delete(trie->pool);
+		g_free(trie);
+	}
+}
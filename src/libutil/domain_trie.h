@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_DOMAIN_TRIE_H
+#define RSPAMD_DOMAIN_TRIE_H
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Trie of domain labels in reversed order (`com` -> `example` -> `www`), so
+ * the longest matching suffix of a hostname is found in a single pass over
+ * its labels from the right. Labels are compared ignoring ASCII case.
+ */
+struct rspamd_domain_trie;
+
+enum rspamd_domain_trie_flags {
+	RSPAMD_DOMAIN_TRIE_DEFAULT = 0,
+	/* Suffix is `*.<suffix>`, so any label on the left is a part of it */
+	RSPAMD_DOMAIN_TRIE_WILDCARD = (1u << 0u),
+};
+
+struct rspamd_domain_trie *rspamd_domain_trie_new(void);
+
+/**
+ * Adds a suffix, e.g. `co.uk`, the previous value is replaced
+ * @param suffix suffix without wildcard prefix and trailing dot
+ * @param flags
+ * @param value opaque value returned by lookups
+ */
+void rspamd_domain_trie_add(struct rspamd_domain_trie *trie,
+							const char *suffix, gsize len,
+							enum rspamd_domain_trie_flags flags,
+							gconstpointer value);
+
+/**
+ * Finds the longest suffix of a hostname (or the whole hostname) added to
+ * the trie, suffixes are matched on labels boundaries only, a trailing dot
+ * is ignored
+ * @param suffix_len if not NULL, length of the matched suffix is stored here
+ * @return value of the suffix or NULL
+ */
+gconstpointer rspamd_domain_trie_lookup(struct rspamd_domain_trie *trie,
+										const char *host, gsize len,
+										gsize *suffix_len);
+
+/**
+ * Returns length of the effective second level domain of a hostname, i.e.
+ * the longest public suffix (that must be preceded by some label) plus one
+ * more label (two for wildcard suffixes) if a hostname has them. A trailing
+ * dot is ignored and is not included in the result.
+ * @return length of the domain at the tail of `host` or 0 if nothing matches
+ */
+gsize rspamd_domain_trie_esld(struct rspamd_domain_trie *trie,
+							  const char *host, gsize len);
+
+/**
+ * Number of suffixes in the trie
+ */
+gsize rspamd_domain_trie_size(struct rspamd_domain_trie *trie);
+
+/**
+ * Bytes used by the trie
+ */
+gsize rspamd_domain_trie_memory(struct rspamd_domain_trie *trie);
+
+void rspamd_domain_trie_destroy(struct rspamd_domain_trie *trie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -64,11 +64,33 @@ struct rspamd_expression_elt {
 	double value;
 };
 
+enum rspamd_expression_insn_type {
+	INSN_ATOM = 0,
+	INSN_LIMIT,
+	INSN_UNARY,
+	INSN_BINARY,
+	INSN_NARY_INIT,
+	INSN_NARY_STEP,
+};
+
+/*
+ * AST is compiled to a flat postfix program that is executed with no recursion:
+ * n-ary operations push an accumulator, and each of their children is followed
+ * by a step that folds it and jumps past the operation once the result is known
+ */
+struct rspamd_expression_insn {
+	enum rspamd_expression_insn_type type;
+	unsigned int jump;
+	struct rspamd_expression_elt *elt;
+};
+
 struct rspamd_expression {
 	const struct rspamd_atom_subr *subr;
 	GArray *expressions;
 	GPtrArray *expression_stack;
 	GNode *ast;
+	GArray *program;
+	unsigned int max_stack;
 	char *log_id;
 	unsigned int next_resort;
 	unsigned int evals;
@@ -564,6 +586,9 @@ rspamd_expression_destroy(struct rspamd_expression *expr)
 		if (expr->ast) {
 			g_node_destroy(expr->ast);
 		}
+		if (expr->program) {
+			g_array_free(expr->program, TRUE);
+		}
 		if (expr->log_id) {
 			g_free(expr->log_id);
 		}
@@ -807,6 +832,84 @@ rspamd_ast_resort_traverse(GNode *node, gpointer unused)
 	return FALSE;
 }
 
+static void
+rspamd_ast_compile_node(struct rspamd_expression *e, GNode *node,
+						unsigned int depth)
+{
+	struct rspamd_expression_elt *elt = node->data;
+	struct rspamd_expression_insn insn;
+	GNode *cld;
+	unsigned int first_step, i;
+
+	insn.elt = elt;
+	insn.jump = 0;
+
+	switch (elt->type) {
+	case ELT_ATOM:
+	case ELT_LIMIT:
+		insn.type = elt->type == ELT_ATOM ? INSN_ATOM : INSN_LIMIT;
+		g_array_append_val(e->program, insn);
+		e->max_stack = MAX(e->max_stack, depth + 1);
+		break;
+	case ELT_OP:
+		g_assert(node->children != NULL);
+
+		if (elt->p.op.op_flags & RSPAMD_EXPRESSION_NARY) {
+			insn.type = INSN_NARY_INIT;
+			g_array_append_val(e->program, insn);
+			e->max_stack = MAX(e->max_stack, depth + 1);
+			first_step = e->program->len;
+
+			DL_FOREACH(node->children, cld)
+			{
+				rspamd_ast_compile_node(e, cld, depth + 1);
+				insn.type = INSN_NARY_STEP;
+				g_array_append_val(e->program, insn);
+			}
+
+			/* All steps jump to the end of the operation */
+			for (i = first_step; i < e->program->len; i++) {
+				struct rspamd_expression_insn *cur = &g_array_index(e->program,
+																	struct rspamd_expression_insn, i);
+
+				if (cur->type == INSN_NARY_STEP && cur->elt == elt) {
+					cur->jump = e->program->len;
+				}
+			}
+		}
+		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_BINARY) {
+			g_assert(node->children->next != NULL && node->children->next->next == NULL);
+			rspamd_ast_compile_node(e, node->children, depth);
+			rspamd_ast_compile_node(e, node->children->next, depth + 1);
+			insn.type = INSN_BINARY;
+			g_array_append_val(e->program, insn);
+		}
+		else {
+			g_assert(node->children->next == NULL);
+			rspamd_ast_compile_node(e, node->children, depth);
+			insn.type = INSN_UNARY;
+			g_array_append_val(e->program, insn);
+		}
+		break;
+	}
+}
+
+/*
+ * Program follows the order of AST, so it is rebuilt each time AST is resorted
+ */
+static void
+rspamd_ast_compile(struct rspamd_expression *e)
+{
+	if (e->program == NULL) {
+		e->program = g_array_sized_new(FALSE, FALSE,
+									   sizeof(struct rspamd_expression_insn), e->expressions->len * 2);
+	}
+
+	g_array_set_size(e->program, 0);
+	e->max_stack = 0;
+	rspamd_ast_compile_node(e, e->ast, 0);
+}
+
 static struct rspamd_expression_elt *
 rspamd_expr_dup_elt(rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 {
@@ -1170,6 +1273,7 @@ rspamd_parse_expression(const char *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse(e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 					rspamd_ast_resort_traverse, NULL);
+	rspamd_ast_compile(e);
 
 	if (target) {
 		*target = e;
@@ -1330,131 +1434,96 @@ rspamd_ast_do_nary_op(struct rspamd_expression_elt *elt, double val, double acc)
 }
 
 static double
-rspamd_ast_process_node(struct rspamd_expression *e, GNode *node,
+rspamd_ast_process_atom(struct rspamd_expression *e,
+						struct rspamd_expression_elt *elt,
 						struct rspamd_expr_process_data *process_data)
 {
-	struct rspamd_expression_elt *elt;
-	GNode *cld;
-	double acc = NAN;
 	float t1, t2;
-	double val;
 	gboolean calc_ticks = FALSE;
-	__attribute__((unused)) const char *op_name = NULL;
-
-	elt = node->data;
-
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
-			/*
-			 * Check once per 256 evaluations approx
-			 */
-			calc_ticks = (rspamd_random_uint64_fast() & 0xff) == 0xff;
-			if (calc_ticks) {
-				t1 = rspamd_get_ticks(TRUE);
-			}
 
-			elt->value = process_data->process_closure(process_data->ud, elt->p.atom);
+	if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
+		/*
+		 * Check once per 256 evaluations approx
+		 */
+		calc_ticks = (rspamd_random_uint64_fast() & 0xff) == 0xff;
+		if (calc_ticks) {
+			t1 = rspamd_get_ticks(TRUE);
+		}
 
-			if (fabs(elt->value) > DBL_EPSILON) {
-				elt->p.atom->hits++;
+		elt->value = process_data->process_closure(process_data->ud, elt->p.atom);
 
-				if (process_data->trace) {
-					g_ptr_array_add(process_data->trace, elt->p.atom);
-				}
-			}
+		if (fabs(elt->value) > DBL_EPSILON) {
+			elt->p.atom->hits++;
 
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks(TRUE);
-				rspamd_set_counter_ema(&elt->p.atom->exec_time, (t2 - t1), 0.5f);
+			if (process_data->trace) {
+				g_ptr_array_add(process_data->trace, elt->p.atom);
 			}
+		}
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+		if (calc_ticks) {
+			t2 = rspamd_get_ticks(TRUE);
+			rspamd_set_counter_ema(&elt->p.atom->exec_time, (t2 - t1), 0.5f);
 		}
 
-		acc = elt->value;
-		msg_debug_expression_verbose("atom: elt=%s; acc=%.1f", elt->p.atom->str, acc);
-		break;
-	case ELT_LIMIT:
+		elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+	}
 
-		acc = elt->p.lim;
-		msg_debug_expression_verbose("limit: lim=%.1f; acc=%.1f;", elt->p.lim, acc);
-		break;
-	case ELT_OP:
-		g_assert(node->children != NULL);
-#ifdef DEBUG_EXPRESSIONS
-		op_name = rspamd_expr_op_to_str(elt->p.op.op);
-#endif
+	msg_debug_expression_verbose("atom: elt=%s; acc=%.1f", elt->p.atom->str, elt->value);
 
-		if (elt->p.op.op_flags & RSPAMD_EXPRESSION_NARY) {
-			msg_debug_expression_verbose("proceed nary operation %s", op_name);
-			/* Proceed all ops in chain */
-			DL_FOREACH(node->children, cld)
-			{
-				val = rspamd_ast_process_node(e, cld, process_data);
-				msg_debug_expression_verbose("before op: op=%s; acc=%.1f; val = %.2f", op_name,
-											 acc, val);
-				acc = rspamd_ast_do_nary_op(elt, val, acc);
-				msg_debug_expression_verbose("after op: op=%s; acc=%.1f; val = %.2f", op_name,
-											 acc, val);
-
-				/* Check if we need to process further */
-				if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-					if (rspamd_ast_node_done(elt, acc)) {
-						msg_debug_expression_verbose("optimizer: done");
-						return acc;
-					}
-				}
-			}
-		}
-		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_BINARY) {
-			GNode *c1 = node->children, *c2;
-
-			c2 = c1->next;
-			g_assert(c2->next == NULL);
-			double val1, val2;
-
-			msg_debug_expression_verbose("proceed binary operation %s",
-										 op_name);
-			val1 = rspamd_ast_process_node(e, c1, process_data);
-			val2 = rspamd_ast_process_node(e, c2, process_data);
-
-			msg_debug_expression_verbose("before op: op=%s; op1 = %.1f, op2 = %.1f",
-										 op_name, val1, val2);
-			acc = rspamd_ast_do_binary_op(elt, val1, val2);
-			msg_debug_expression_verbose("after op: op=%s; res=%.1f",
-										 op_name, acc);
-		}
-		else if (elt->p.op.op_flags & RSPAMD_EXPRESSION_UNARY) {
-			GNode *c1 = node->children;
+	return elt->value;
+}
+
+static double
+rspamd_ast_execute(struct rspamd_expression *e,
+				   struct rspamd_expr_process_data *process_data)
+{
+	const struct rspamd_expression_insn *insns, *insn;
+	unsigned int ip = 0, sp = 0, ninsns;
+	double *stack;
 
-			g_assert(c1->next == NULL);
+	insns = (const struct rspamd_expression_insn *) e->program->data;
+	ninsns = e->program->len;
+	/* Atoms can evaluate other expressions, so the stack is not shared */
+	stack = g_alloca(sizeof(double) * e->max_stack);
 
-			msg_debug_expression_verbose("proceed unary operation %s",
-										 op_name);
-			val = rspamd_ast_process_node(e, c1, process_data);
+	while (ip < ninsns) {
+		insn = &insns[ip++];
 
-			msg_debug_expression_verbose("before op: op=%s; op1 = %.1f",
-										 op_name, val);
-			acc = rspamd_ast_do_unary_op(elt, val);
-			msg_debug_expression_verbose("after op: op=%s; res=%.1f",
-										 op_name, acc);
+		switch (insn->type) {
+		case INSN_ATOM:
+			stack[sp++] = rspamd_ast_process_atom(e, insn->elt, process_data);
+			break;
+		case INSN_LIMIT:
+			stack[sp++] = insn->elt->p.lim;
+			msg_debug_expression_verbose("limit: lim=%.1f", insn->elt->p.lim);
+			break;
+		case INSN_UNARY:
+			stack[sp - 1] = rspamd_ast_do_unary_op(insn->elt, stack[sp - 1]);
+			break;
+		case INSN_BINARY:
+			sp--;
+			stack[sp - 1] = rspamd_ast_do_binary_op(insn->elt, stack[sp - 1], stack[sp]);
+			break;
+		case INSN_NARY_INIT:
+			stack[sp++] = NAN;
+			break;
+		case INSN_NARY_STEP:
+			sp--;
+			stack[sp - 1] = rspamd_ast_do_nary_op(insn->elt, stack[sp], stack[sp - 1]);
+
+			/* Check if we need to process further */
+			if (!(process_data->flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+				rspamd_ast_node_done(insn->elt, stack[sp - 1])) {
+				msg_debug_expression_verbose("optimizer: done");
+				ip = insn->jump;
+			}
+			break;
 		}
-		break;
 	}
 
-	return acc;
-}
-
-static gboolean
-rspamd_ast_cleanup_traverse(GNode *n, gpointer d)
-{
-	struct rspamd_expression_elt *elt = n->data;
-
-	elt->value = 0;
-	elt->flags = 0;
+	g_assert(sp == 1);
 
-	return FALSE;
+	return stack[0];
 }
 
 double
@@ -1483,11 +1552,17 @@ rspamd_process_expression_closure(struct rspamd_expression *expr,
 		*track = pd.trace;
 	}
 
-	ret = rspamd_ast_process_node(expr, expr->ast, &pd);
+	ret = rspamd_ast_execute(expr, &pd);
 
 	/* Cleanup */
-	g_node_traverse(expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-					rspamd_ast_cleanup_traverse, NULL);
+	for (unsigned int i = 0; i < expr->program->len; i++) {
+		struct rspamd_expression_elt *elt = g_array_index(expr->program,
+														  struct rspamd_expression_insn, i)
+												.elt;
+
+		elt->value = 0;
+		elt->flags = 0;
+	}
 
 	/* Check if we need to resort */
 	if (expr->evals % expr->next_resort == 0) {
@@ -1500,6 +1575,7 @@ rspamd_process_expression_closure(struct rspamd_expression *expr,
 		/* Now set less expensive branches to be evaluated first */
 		g_node_traverse(expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 						rspamd_ast_resort_traverse, NULL);
+		rspamd_ast_compile(expr);
 	}
 
 	return ret;
@@ -0,0 +1,249 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "leaky_sketch.h"
+#include "cryptobox.h"
+#include "printf.h"
+#include "ottery.h"
+#include "unix-std.h"
+
+#define LEAKY_SKETCH_MAX_DEPTH 8
+
+static const unsigned char rspamd_leaky_sketch_magic[8] = "rslksk1";
+
+struct rspamd_leaky_sketch_cell {
+	float cur;
+	/* Time of the last leak in seconds */
+	uint32_t last;
+};
+
+struct rspamd_leaky_sketch_hdr {
+	unsigned char magic[8];
+	uint32_t width;
+	uint32_t depth;
+	uint64_t seed;
+};
+
+struct rspamd_leaky_sketch {
+	struct rspamd_leaky_sketch_cell *cells;
+	unsigned int width;
+	unsigned int depth;
+	double rate;
+	uint64_t seed;
+};
+
+GQuark
+rspamd_leaky_sketch_quark(void)
+{
+	return g_quark_from_static_string("leaky-sketch");
+}
+
+struct rspamd_leaky_sketch *
+rspamd_leaky_sketch_new(unsigned int width, unsigned int depth, double rate)
+{
+	struct rspamd_leaky_sketch *sk;
+
+	g_assert(width > 0);
+	sk = g_malloc0(sizeof(*sk));
+	sk->width = width;
+	sk->depth = MIN(MAX(depth, 1), LEAKY_SKETCH_MAX_DEPTH);
+	sk->rate = rate;
+	sk->seed = ottery_rand_uint64();
+	sk->cells = g_malloc0(sizeof(*sk->cells) * sk->width * sk->depth);
+
+	return sk;
+}
+
+/*
+ * Double hashing: a single hash gives the counter index in all rows
+ */
+static inline void
+rspamd_leaky_sketch_indexes(struct rspamd_leaky_sketch *sk,
+							const void *key, gsize keylen,
+							gsize *idx)
+{
+	uint64_t h = rspamd_cryptobox_fast_hash(key, keylen, sk->seed);
+	uint32_t h1 = h & 0xffffffffu, h2 = (h >> 32u) | 1u;
+	unsigned int i;
+
+	for (i = 0; i < sk->depth; i++) {
+		idx[i] = (gsize) i * sk->width + (h1 + (uint64_t) i * h2) % sk->width;
+	}
+}
+
+double
+rspamd_leaky_sketch_estimate(struct rspamd_leaky_sketch *sk,
+							 const void *key, gsize keylen,
+							 double now)
+{
+	gsize idx[LEAKY_SKETCH_MAX_DEPTH];
+	struct rspamd_leaky_sketch_cell *cell;
+	uint32_t now_sec = now;
+	double res = G_MAXDOUBLE;
+	unsigned int i;
+
+	rspamd_leaky_sketch_indexes(sk, key, keylen, idx);
+
+	for (i = 0; i < sk->depth; i++) {
+		cell = &sk->cells[idx[i]];
+
+		if (cell->last < now_sec) {
+			if (cell->cur > 0) {
+				cell->cur -= sk->rate * (now_sec - cell->last);
+
+				if (cell->cur < 0) {
+					cell->cur = 0;
+				}
+			}
+
+			cell->last = now_sec;
+		}
+
+		if (cell->cur < res) {
+			res = cell->cur;
+		}
+	}
+
+	return res;
+}
+
+void rspamd_leaky_sketch_raise(struct rspamd_leaky_sketch *sk,
+							   const void *key, gsize keylen,
+							   double value)
+{
+	gsize idx[LEAKY_SKETCH_MAX_DEPTH];
+	struct rspamd_leaky_sketch_cell *cell;
+	unsigned int i;
+
+	rspamd_leaky_sketch_indexes(sk, key, keylen, idx);
+
+	for (i = 0; i < sk->depth; i++) {
+		cell = &sk->cells[idx[i]];
+
+		if (cell->cur < value) {
+			cell->cur = value;
+		}
+	}
+}
+
+gsize rspamd_leaky_sketch_bytes(struct rspamd_leaky_sketch *sk)
+{
+	return sizeof(*sk->cells) * sk->width * sk->depth;
+}
+
+gboolean
+rspamd_leaky_sketch_save(struct rspamd_leaky_sketch *sk,
+						 const char *path,
+						 GError **err)
+{
+	struct rspamd_leaky_sketch_hdr hdr;
+	char tmp_path[PATH_MAX];
+	FILE *f;
+
+	rspamd_snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+
+	if ((f = fopen(tmp_path, "w")) == NULL) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), errno,
+					"cannot open %s: %s", tmp_path, strerror(errno));
+		return FALSE;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, rspamd_leaky_sketch_magic, sizeof(hdr.magic));
+	hdr.width = sk->width;
+	hdr.depth = sk->depth;
+	hdr.seed = sk->seed;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+		fwrite(sk->cells, rspamd_leaky_sketch_bytes(sk), 1, f) != 1 ||
+		fflush(f) != 0) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), errno,
+					"cannot write %s: %s", tmp_path, strerror(errno));
+		fclose(f);
+		unlink(tmp_path);
+
+		return FALSE;
+	}
+
+	fclose(f);
+
+	if (rename(tmp_path, path) == -1) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), errno,
+					"cannot rename %s to %s: %s", tmp_path, path, strerror(errno));
+		unlink(tmp_path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_leaky_sketch_load(struct rspamd_leaky_sketch *sk,
+						 const char *path,
+						 GError **err)
+{
+	struct rspamd_leaky_sketch_hdr hdr;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), errno,
+					"cannot open %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+		memcmp(hdr.magic, rspamd_leaky_sketch_magic, sizeof(hdr.magic)) != 0) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), EINVAL,
+					"invalid sketch file %s", path);
+		fclose(f);
+
+		return FALSE;
+	}
+
+	if (hdr.width != sk->width || hdr.depth != sk->depth) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), EINVAL,
+					"sketch in %s has different dimensions: %u x %u, %u x %u expected",
+					path, hdr.depth, hdr.width, sk->depth, sk->width);
+		fclose(f);
+
+		return FALSE;
+	}
+
+	if (fread(sk->cells, rspamd_leaky_sketch_bytes(sk), 1, f) != 1) {
+		g_set_error(err, rspamd_leaky_sketch_quark(), EINVAL,
+					"truncated sketch file %s", path);
+		/* Do not keep partially loaded counters */
+		memset(sk->cells, 0, rspamd_leaky_sketch_bytes(sk));
+		fclose(f);
+
+		return FALSE;
+	}
+
+	/* Counters are only meaningful with the same hash seed */
+	sk->seed = hdr.seed;
+	fclose(f);
+
+	return TRUE;
+}
+
+void rspamd_leaky_sketch_destroy(struct rspamd_leaky_sketch *sk)
+{
+	if (sk) {
+		g_free(sk->cells);
+		g_free(sk);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_LEAKY_SKETCH_H_
+#define SRC_LIBUTIL_LEAKY_SKETCH_H_
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Count-min sketch of leaky buckets: a fixed size table of `depth` rows,
+ * each key is mapped to a single counter in every row and its value is the
+ * minimum of those counters. Counters leak with the specified rate, so the
+ * sketch approximates per key leaky buckets using a constant amount of memory.
+ * Collisions can only overestimate a value.
+ */
+struct rspamd_leaky_sketch;
+
+GQuark rspamd_leaky_sketch_quark(void);
+
+/**
+ * Creates new sketch
+ * @param width number of counters in a row
+ * @param depth number of rows
+ * @param rate leak rate per second
+ * @return new sketch
+ */
+struct rspamd_leaky_sketch *rspamd_leaky_sketch_new(unsigned int width,
+													unsigned int depth,
+													double rate);
+
+/**
+ * Leaks counters of the key and returns its current value
+ */
+double rspamd_leaky_sketch_estimate(struct rspamd_leaky_sketch *sk,
+									const void *key, gsize keylen,
+									double now);
+
+/**
+ * Raises counters of the key to at least `value` (conservative update)
+ */
+void rspamd_leaky_sketch_raise(struct rspamd_leaky_sketch *sk,
+							   const void *key, gsize keylen,
+							   double value);
+
+/**
+ * Returns size of the counters table in bytes
+ */
+gsize rspamd_leaky_sketch_bytes(struct rspamd_leaky_sketch *sk);
+
+/**
+ * Writes sketch to the file atomically (via `path.new`)
+ */
+gboolean rspamd_leaky_sketch_save(struct rspamd_leaky_sketch *sk,
+								  const char *path,
+								  GError **err);
+
+/**
+ * Loads counters saved by `rspamd_leaky_sketch_save`, dimensions must match
+ */
+gboolean rspamd_leaky_sketch_load(struct rspamd_leaky_sketch *sk,
+								  const char *path,
+								  GError **err);
+
+void rspamd_leaky_sketch_destroy(struct rspamd_leaky_sketch *sk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -36,6 +36,40 @@ rspamd_ev_watcher_timer_cb(EV_P_ struct ev_timer *w, int revents)
 	ev->cb(ev->io.fd, EV_TIMER, ev->ud);
 }
 
+static void
+rspamd_ev_watcher_wheel_cb(struct rspamd_timer_wheel_entry *ent, void *ud)
+{
+	struct rspamd_io_ev *ev = (struct rspamd_io_ev *) ud;
+
+	ev->cb(ev->io.fd, EV_TIMER, ev->ud);
+}
+
+static inline gboolean
+rspamd_ev_watcher_timer_active(struct rspamd_io_ev *ev)
+{
+	return ev_can_stop(&ev->tm) || rspamd_timer_wheel_entry_active(&ev->tw);
+}
+
+static void
+rspamd_ev_watcher_timer_start(struct ev_loop *loop,
+							  struct rspamd_io_ev *ev,
+							  ev_tstamp timeout)
+{
+	struct rspamd_timer_wheel *wheel = rspamd_timer_wheel_get(loop);
+
+	/* Update timestamp to avoid timers running early */
+	ev_now_update_if_cheap(loop);
+
+	if (wheel) {
+		rspamd_timer_wheel_add(wheel, &ev->tw, timeout);
+	}
+	else {
+		ev->tm.data = ev;
+		ev_timer_init(&ev->tm, rspamd_ev_watcher_timer_cb, timeout, 0.0);
+		ev_timer_start(EV_A, &ev->tm);
+	}
+}
+
 
 void rspamd_ev_watcher_init(struct rspamd_io_ev *ev,
 							int fd,
@@ -47,6 +81,7 @@ void rspamd_ev_watcher_init(struct rspamd_io_ev *ev,
 	ev->io.data = ev;
 	ev_init(&ev->tm, rspamd_ev_watcher_timer_cb);
 	ev->tm.data = ev;
+	rspamd_timer_wheel_entry_init(&ev->tw, rspamd_ev_watcher_wheel_cb, ev);
 	ev->ud = ud;
 	ev->cb = cb;
 }
@@ -60,12 +95,8 @@ void rspamd_ev_watcher_start(struct ev_loop *loop,
 	ev_io_start(EV_A, &ev->io);
 
 	if (timeout > 0) {
-		/* Update timestamp to avoid timers running early */
-		ev_now_update_if_cheap(loop);
-
 		ev->timeout = timeout;
-		ev_timer_set(&ev->tm, timeout, 0.0);
-		ev_timer_start(EV_A, &ev->tm);
+		rspamd_ev_watcher_timer_start(loop, ev, timeout);
 	}
 }
 
@@ -78,6 +109,10 @@ void rspamd_ev_watcher_stop(struct ev_loop *loop,
 
 	if (ev->timeout > 0) {
 		ev_timer_stop(EV_A, &ev->tm);
+
+		if (rspamd_timer_wheel_entry_active(&ev->tw)) {
+			rspamd_timer_wheel_remove(rspamd_timer_wheel_get(loop), &ev->tw);
+		}
 	}
 }
 
@@ -99,13 +134,8 @@ void rspamd_ev_watcher_reschedule(struct ev_loop *loop,
 	}
 
 	if (ev->timeout > 0) {
-		if (!(ev_can_stop(&ev->tm))) {
-			/* Update timestamp to avoid timers running early */
-			ev_now_update_if_cheap(loop);
-
-			ev->tm.data = ev;
-			ev_timer_init(&ev->tm, rspamd_ev_watcher_timer_cb, ev->timeout, 0.0);
-			ev_timer_start(EV_A, &ev->tm);
+		if (!rspamd_ev_watcher_timer_active(ev)) {
+			rspamd_ev_watcher_timer_start(loop, ev, ev->timeout);
 		}
 	}
 }
@@ -129,13 +159,8 @@ void rspamd_ev_watcher_reschedule_at(struct ev_loop *loop,
 	}
 
 	if (at > 0) {
-		if (!(ev_can_stop(&ev->tm))) {
-			/* Update timestamp to avoid timers running early */
-			ev_now_update_if_cheap(loop);
-
-			ev->tm.data = ev;
-			ev_timer_init(&ev->tm, rspamd_ev_watcher_timer_cb, at, 0.0);
-			ev_timer_start(EV_A, &ev->tm);
+		if (!rspamd_ev_watcher_timer_active(ev)) {
+			rspamd_ev_watcher_timer_start(loop, ev, at);
 		}
 	}
 }
\ No newline at end of file
@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "contrib/libev/ev.h"
+#include "timer_wheel.h"
 
 
 #ifdef __cplusplus
@@ -27,7 +28,9 @@ extern "C" {
 
 /*
  * This module is a little helper to simplify libevent->libev transition
- * It allows to create timed IO watchers utilising both
+ * It allows to create timed IO watchers utilising both.
+ * Timeouts are placed to the timer wheel if it is attached to the loop
+ * (see `rspamd_timer_wheel_attach`) and use libev timers otherwise.
  */
 
 typedef void (*rspamd_ev_cb)(int fd, short what, void *ud);
@@ -35,6 +38,7 @@ typedef void (*rspamd_ev_cb)(int fd, short what, void *ud);
 struct rspamd_io_ev {
 	ev_io io;
 	ev_timer tm;
+	struct rspamd_timer_wheel_entry tw;
 	rspamd_ev_cb cb;
 	void *ud;
 	ev_tstamp timeout;
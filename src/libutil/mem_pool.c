@@ -86,6 +86,16 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
+/* Percentile of the recent pool sizes used to adjust suggestions */
+static double suggestion_percentile = RSPAMD_MEMPOOL_DEFAULT_PERCENTILE;
+/* Transparent huge pages for long-lived pools, set from the config */
+static gboolean use_hugepages = FALSE;
+
+#define RSPAMD_HUGEPAGE_SIZE (2UL * 1024UL * 1024UL)
+
+KHASH_INIT(hugepage_allocs, gpointer, gsize, 1, g_direct_hash, g_direct_equal)
+/* Advised sizes of the allocations made by rspamd_hugepage_alloc */
+static khash_t(hugepage_allocs) *hugepage_allocs = NULL;
 
 /**
  * Function that return free space in pool page
@@ -171,7 +181,8 @@ rspamd_mempool_get_entry(const char *loc)
 }
 
 static struct _pool_chain *
-rspamd_mempool_chain_new(gsize size, gsize alignment, enum rspamd_mempool_chain_type pool_type)
+rspamd_mempool_chain_new(gsize size, gsize alignment, enum rspamd_mempool_chain_type pool_type,
+						 int flags)
 {
 	struct _pool_chain *chain;
 	gsize total_size = size + sizeof(struct _pool_chain) + alignment,
@@ -226,7 +237,15 @@ rspamd_mempool_chain_new(gsize size, gsize alignment, enum rspamd_mempool_chain_
 		optimal_size = sys_alloc_size(total_size);
 #endif
 		total_size = MAX(total_size, optimal_size);
-		int ret = posix_memalign(&map, alignment, total_size);
+		gsize map_alignment = alignment;
+
+		if ((flags & RSPAMD_MEMPOOL_HUGEPAGES) && use_hugepages &&
+			total_size >= RSPAMD_HUGEPAGE_SIZE) {
+			/* Align large chunks so the whole chunk could use huge pages */
+			map_alignment = RSPAMD_HUGEPAGE_SIZE;
+		}
+
+		int ret = posix_memalign(&map, map_alignment, total_size);
 
 		if (ret != 0 || map == NULL) {
 			g_error("%s: failed to allocate %" G_GSIZE_FORMAT " bytes: %d - %s",
@@ -360,7 +379,14 @@ rspamd_mempool_new_(gsize size, const char *tag, int flags, const char *loc)
 	 * memory chunk
 	 */
 	unsigned char *mem_chunk;
-	int ret = posix_memalign((void **) &mem_chunk, MIN_MEM_ALIGNMENT,
+	gsize map_alignment = MIN_MEM_ALIGNMENT;
+
+	if ((flags & RSPAMD_MEMPOOL_HUGEPAGES) && use_hugepages &&
+		total_size >= RSPAMD_HUGEPAGE_SIZE) {
+		map_alignment = RSPAMD_HUGEPAGE_SIZE;
+	}
+
+	int ret = posix_memalign((void **) &mem_chunk, map_alignment,
 							 total_size);
 	gsize priv_offset;
 
@@ -428,6 +454,10 @@ rspamd_mempool_new_(gsize size, const char *tag, int flags, const char *loc)
 	new_pool->priv->pools[RSPAMD_MEMPOOL_NORMAL] = nchain;
 	new_pool->priv->used_memory = size;
 
+	if (flags & RSPAMD_MEMPOOL_HUGEPAGES) {
+		new_pool->priv->hugepage_bytes = rspamd_madvise_hugepages(mem_chunk, total_size);
+	}
+
 	/* Adjust stats */
 	g_atomic_int_add(&mem_pool_stat->bytes_allocated,
 					 (int) size);
@@ -515,7 +545,7 @@ memory_pool_alloc_common(rspamd_mempool_t *pool, gsize size, gsize alignment,
 			if (pool->priv->elt_len >= size + alignment) {
 				pool->priv->entry->elts[pool->priv->entry->cur_elts].fragmentation += size;
 				new = rspamd_mempool_chain_new(pool->priv->elt_len, alignment,
-											   pool_type);
+											   pool_type, pool->priv->flags);
 			}
 			else {
 				mem_pool_stat->oversized_chunks++;
@@ -523,7 +553,13 @@ memory_pool_alloc_common(rspamd_mempool_t *pool, gsize size, gsize alignment,
 								 free);
 				pool->priv->entry->elts[pool->priv->entry->cur_elts].fragmentation += free;
 				new = rspamd_mempool_chain_new(size + pool->priv->elt_len, alignment,
-											   pool_type);
+											   pool_type, pool->priv->flags);
+			}
+
+			if ((pool->priv->flags & RSPAMD_MEMPOOL_HUGEPAGES) &&
+				pool_type == RSPAMD_MEMPOOL_NORMAL) {
+				pool->priv->hugepage_bytes += rspamd_madvise_hugepages(new,
+																	   new->slice_size + sizeof(*new));
 			}
 
 			/* Connect to pool subsystem */
@@ -696,7 +732,7 @@ cmp_int(gconstpointer a, gconstpointer b)
 static void
 rspamd_mempool_adjust_entry(struct rspamd_mempool_entry_point *e)
 {
-	int sz[G_N_ELEMENTS(e->elts)], sel_pos, sel_neg;
+	int sz[G_N_ELEMENTS(e->elts)], sel_pos, sel_neg, pos_idx;
 	unsigned int i, jitter;
 
 	for (i = 0; i < G_N_ELEMENTS(sz); i++) {
@@ -706,9 +742,12 @@ rspamd_mempool_adjust_entry(struct rspamd_mempool_entry_point *e)
 	qsort(sz, G_N_ELEMENTS(sz), sizeof(int), cmp_int);
 	jitter = rspamd_random_uint64_fast() % 10;
 	/*
-	 * Take stochastic quantiles
+	 * Take stochastic quantiles, the upper one is configurable
 	 */
-	sel_pos = sz[50 + jitter];
+	pos_idx = (int) (suggestion_percentile * (G_N_ELEMENTS(sz) - 1) + 0.5) +
+			  (int) jitter - 5;
+	pos_idx = CLAMP(pos_idx, 0, (int) G_N_ELEMENTS(sz) - 1);
+	sel_pos = sz[pos_idx];
 	sel_neg = sz[4 + jitter];
 
 	if (-sel_neg > sel_pos) {
@@ -869,6 +908,30 @@ void rspamd_mempool_delete(rspamd_mempool_t *pool)
 	}
 
 	if (cur && mempool_entries) {
+		struct rspamd_mempool_entry_point *entry = pool->priv->entry;
+		struct _pool_chain *chain;
+		unsigned int nchains = 0, bucket = 0;
+
+		LL_FOREACH(cur, chain)
+		{
+			nchains++;
+		}
+
+		entry->pools_destroyed++;
+		entry->chains_allocated += nchains;
+		entry->wasted_bytes += pool->priv->wasted_memory;
+
+		if (pool->priv->used_memory > entry->peak_size) {
+			entry->peak_size = pool->priv->used_memory;
+		}
+
+		while (bucket < RSPAMD_MEMPOOL_HIST_BUCKETS - 1 &&
+			   pool->priv->used_memory >= ((gsize) RSPAMD_MEMPOOL_HIST_MIN << bucket)) {
+			bucket++;
+		}
+
+		entry->size_hist[bucket]++;
+
 		pool->priv->entry->elts[pool->priv->entry->cur_elts].leftover =
 			pool_chain_free(cur);
 
@@ -923,6 +986,11 @@ void rspamd_mempool_delete(rspamd_mempool_t *pool)
 		}
 	}
 
+	if (pool->priv->hugepage_bytes > 0) {
+		g_atomic_int_add(&mem_pool_stat->hugepage_bytes,
+						 -((int) pool->priv->hugepage_bytes));
+	}
+
 	g_atomic_int_inc(&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK();
 	free(pool); /* allocated by posix_memalign */
@@ -938,9 +1006,112 @@ void rspamd_mempool_stat(rspamd_mempool_stat_t *st)
 		st->chunks_allocated = mem_pool_stat->chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->hugepage_bytes = mem_pool_stat->hugepage_bytes;
 	}
 }
 
+void rspamd_mempool_set_hugepages(gboolean enable)
+{
+#ifdef MADV_HUGEPAGE
+	use_hugepages = enable;
+#else
+	use_hugepages = FALSE;
+#endif
+}
+
+gsize rspamd_madvise_hugepages(void *ptr, gsize len)
+{
+#ifdef MADV_HUGEPAGE
+	uintptr_t start, end;
+
+	if (!use_hugepages || ptr == NULL) {
+		return 0;
+	}
+
+	/* Only the huge page aligned part of the region can use huge pages */
+	start = ((uintptr_t) ptr + RSPAMD_HUGEPAGE_SIZE - 1) & ~(RSPAMD_HUGEPAGE_SIZE - 1);
+	end = ((uintptr_t) ptr + len) & ~(RSPAMD_HUGEPAGE_SIZE - 1);
+
+	if (end <= start) {
+		return 0;
+	}
+
+	if (madvise((void *) start, end - start, MADV_HUGEPAGE) == -1) {
+		return 0;
+	}
+
+	if (mem_pool_stat != NULL) {
+		g_atomic_int_add(&mem_pool_stat->hugepage_bytes, (int) (end - start));
+	}
+
+	return end - start;
+#else
+	return 0;
+#endif
+}
+
+void rspamd_mempool_advise_hugepages(rspamd_mempool_t *pool)
+{
+	struct _pool_chain *cur;
+
+	if (pool == NULL || !(pool->priv->flags & RSPAMD_MEMPOOL_HUGEPAGES) ||
+		pool->priv->hugepage_bytes > 0) {
+		return;
+	}
+
+	LL_FOREACH(pool->priv->pools[RSPAMD_MEMPOOL_NORMAL], cur)
+	{
+		pool->priv->hugepage_bytes += rspamd_madvise_hugepages(cur,
+															   cur->slice_size + sizeof(*cur));
+	}
+}
+
+void *
+rspamd_hugepage_alloc(gsize size)
+{
+	void *ptr;
+
+	if (use_hugepages && size >= RSPAMD_HUGEPAGE_SIZE) {
+		if (posix_memalign(&ptr, RSPAMD_HUGEPAGE_SIZE, size) == 0 && ptr != NULL) {
+			gsize advised = rspamd_madvise_hugepages(ptr, size);
+
+			if (advised > 0) {
+				int r;
+				khiter_t k;
+
+				if (hugepage_allocs == NULL) {
+					hugepage_allocs = kh_init(hugepage_allocs);
+				}
+
+				k = kh_put(hugepage_allocs, hugepage_allocs, ptr, &r);
+				kh_value(hugepage_allocs, k) = advised;
+			}
+
+			return ptr;
+		}
+	}
+
+	return malloc(size);
+}
+
+void rspamd_hugepage_free(void *ptr)
+{
+	if (ptr != NULL && hugepage_allocs != NULL) {
+		khiter_t k = kh_get(hugepage_allocs, hugepage_allocs, ptr);
+
+		if (k != kh_end(hugepage_allocs)) {
+			if (mem_pool_stat != NULL) {
+				g_atomic_int_add(&mem_pool_stat->hugepage_bytes,
+								 -((int) kh_value(hugepage_allocs, k)));
+			}
+
+			kh_del(hugepage_allocs, hugepage_allocs, k);
+		}
+	}
+
+	free(ptr);
+}
+
 void rspamd_mempool_stat_reset(void)
 {
 	if (mem_pool_stat != NULL) {
@@ -953,6 +1124,35 @@ gsize rspamd_mempool_suggest_size_(const char *loc)
 	return 0;
 }
 
+void rspamd_mempool_entries_foreach(rspamd_mempool_entry_cb cb, void *ud)
+{
+	struct rspamd_mempool_entry_point *elt;
+	struct rspamd_mempool_entry_stat st;
+
+	if (mempool_entries == NULL) {
+		return;
+	}
+
+	kh_foreach_value(mempool_entries, elt, {
+		st.src = elt->src;
+		st.cur_suggestion = elt->cur_suggestion;
+		st.pools = elt->pools_destroyed;
+		st.chains = elt->chains_allocated;
+		st.wasted = elt->wasted_bytes;
+		st.peak = elt->peak_size;
+		st.size_hist = elt->size_hist;
+
+		cb(&st, ud);
+	});
+}
+
+void rspamd_mempool_set_suggestion_percentile(double percentile)
+{
+	if (percentile > 0 && percentile < 1.0) {
+		suggestion_percentile = percentile;
+	}
+}
+
 #if !defined(HAVE_PTHREAD_PROCESS_SHARED) || defined(DISABLE_PTHREAD_MUTEX)
 /*
  * Own emulation
@@ -111,6 +111,7 @@ struct rspamd_mempool_tag {
 
 enum rspamd_mempool_flags {
 	RSPAMD_MEMPOOL_DEBUG = (1u << 0u),
+	RSPAMD_MEMPOOL_HUGEPAGES = (1u << 1u), /**< long-lived pool, large chunks are backed by huge pages */
 };
 
 /**
@@ -136,6 +137,7 @@ typedef struct memory_pool_stat_s {
 	unsigned int chunks_freed;            /**< chunks freed										*/
 	unsigned int oversized_chunks;        /**< oversized chunks									*/
 	unsigned int fragmented_size;         /**< fragmentation size								*/
+	unsigned int hugepage_bytes;          /**< bytes advised to be backed by huge pages			*/
 } rspamd_mempool_stat_t;
 
 
@@ -358,6 +360,43 @@ void rspamd_mempool_stat(rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset(void);
 
+/**
+ * Enable or disable huge pages for pools created with `RSPAMD_MEMPOOL_HUGEPAGES`
+ * and for `rspamd_hugepage_alloc`, disabled by default
+ * @param enable
+ */
+void rspamd_mempool_set_hugepages(gboolean enable);
+
+/**
+ * Advise the kernel to back the huge page aligned part of the region with
+ * transparent huge pages
+ * @param ptr start of the region
+ * @param len length of the region
+ * @return number of bytes advised
+ */
+gsize rspamd_madvise_hugepages(void *ptr, gsize len);
+
+/**
+ * Advise the existing chains of a pool created with `RSPAMD_MEMPOOL_HUGEPAGES`,
+ * used when huge pages are enabled after the pool has been created
+ * @param pool
+ */
+void rspamd_mempool_advise_hugepages(rspamd_mempool_t *pool);
+
+/**
+ * Allocate memory for a large long-lived structure, huge page aligned and
+ * advised if huge pages are enabled
+ * @param size
+ * @return memory that must be freed by `rspamd_hugepage_free`
+ */
+void *rspamd_hugepage_alloc(gsize size);
+
+/**
+ * Free memory allocated by `rspamd_hugepage_alloc`
+ * @param ptr
+ */
+void rspamd_hugepage_free(void *ptr);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
@@ -366,6 +405,44 @@ void rspamd_mempool_stat_reset(void);
 
 gsize rspamd_mempool_suggest_size_(const char *loc);
 
+/*
+ * Histogram of the memory used by pools: bucket `i` counts pools that have used
+ * less than `RSPAMD_MEMPOOL_HIST_MIN << i` bytes, the last bucket counts the rest
+ */
+#define RSPAMD_MEMPOOL_HIST_BUCKETS 12
+#define RSPAMD_MEMPOOL_HIST_MIN 4096
+#define RSPAMD_MEMPOOL_DEFAULT_PERCENTILE 0.85
+
+/**
+ * Statistics for pools created at some specific place in the code
+ */
+struct rspamd_mempool_entry_stat {
+	const char *src;         /**< source location of the pool creation		*/
+	gsize cur_suggestion;    /**< current suggested size of the first chain	*/
+	uint64_t pools;          /**< number of pools destroyed					*/
+	uint64_t chains;         /**< number of chains allocated					*/
+	uint64_t wasted;         /**< bytes wasted in the chains' tails			*/
+	uint64_t peak;           /**< maximum memory used by a single pool		*/
+	const uint64_t *size_hist; /**< RSPAMD_MEMPOOL_HIST_BUCKETS elements	*/
+};
+
+typedef void (*rspamd_mempool_entry_cb)(const struct rspamd_mempool_entry_stat *st,
+										void *ud);
+
+/**
+ * Iterates over all entry points known in this process
+ * @param cb callback
+ * @param ud opaque data for callback
+ */
+void rspamd_mempool_entries_foreach(rspamd_mempool_entry_cb cb, void *ud);
+
+/**
+ * Sets the percentile of the recently used sizes that is used to adjust the
+ * suggested size of the first chain for each entry point
+ * @param percentile value in range (0, 1)
+ */
+void rspamd_mempool_set_suggestion_percentile(double percentile);
+
 gsize rspamd_mempool_get_used_size(rspamd_mempool_t *pool);
 gsize rspamd_mempool_get_wasted_size(rspamd_mempool_t *pool);
 
@@ -43,6 +43,12 @@ struct rspamd_mempool_entry_point {
 	uint32_t cur_elts;
 	uint32_t cur_vars;
 	struct entry_elt elts[ENTRY_NELTS];
+	/* Cumulative statistics for pools created at this entry point */
+	uint64_t pools_destroyed;
+	uint64_t chains_allocated;
+	uint64_t wasted_bytes;
+	uint64_t peak_size;
+	uint64_t size_hist[RSPAMD_MEMPOOL_HIST_BUCKETS];
 };
 
 /**
@@ -75,6 +81,7 @@ struct rspamd_mempool_specific {
 	gsize elt_len; /**< size of an element						*/
 	gsize used_memory;
 	unsigned int wasted_memory;
+	gsize hugepage_bytes; /**< bytes of chains advised for huge pages	*/
 	int flags;
 };
 
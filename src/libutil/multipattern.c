@@ -18,6 +18,7 @@
 #include "libutil/multipattern.h"
 #include "libutil/str_util.h"
 #include "libcryptobox/cryptobox.h"
+#include "libcryptobox/platform_config.h"
 
 #ifdef WITH_HYPERSCAN
 #include "logger.h"
@@ -29,7 +30,14 @@
 #include "libutil/regexp.h"
 #include <stdalign.h>
 
-#define MAX_SCRATCH 4
+#ifdef __x86_64__
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+extern unsigned cpu_config;
+
 
 enum rspamd_hs_check_state {
 	RSPAMD_HS_UNCHECKED = 0,
@@ -45,21 +53,31 @@ struct RSPAMD_ALIGNED(64) rspamd_multipattern {
 #ifdef WITH_HYPERSCAN
 	rspamd_cryptobox_hash_state_t hash_state;
 	rspamd_hyperscan_t *hs_db;
-	hs_scratch_t *scratch[MAX_SCRATCH];
 	GArray *hs_pats;
 	GArray *hs_ids;
 	GArray *hs_flags;
-	unsigned int scratch_used;
 #endif
 	ac_trie_t *t;
 	GArray *pats;
 	GArray *res;
 
 	gboolean compiled;
+	gboolean has_prefilter;
 	unsigned int cnt;
 	enum rspamd_multipattern_flags flags;
+	/*
+	 * Literal prefilter for acism: nibble masks of 8 buckets for the first
+	 * two bytes of patterns (lo0, hi0, lo1, hi1) and a map of the first bytes
+	 */
+	alignas(16) unsigned char prefilter_masks[4][16];
+	unsigned char prefilter_start[256];
 };
 
+/* Prefilter is useless if almost every byte could start some pattern */
+#define RSPAMD_MULTIPATTERN_PREFILTER_MAX_START 64
+/* Amount of input passed to acism after a candidate position is found */
+#define RSPAMD_MULTIPATTERN_PREFILTER_CHUNK 64
+
 static GQuark
 rspamd_multipattern_quark(void)
 {
@@ -465,6 +483,73 @@ rspamd_multipattern_try_save_hs(struct rspamd_multipattern *mp,
 }
 #endif
 
+static void
+rspamd_multipattern_prefilter_add(struct rspamd_multipattern *mp,
+								  unsigned int pos, unsigned char c,
+								  unsigned char bucket)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		if (i == c ||
+			((mp->flags & RSPAMD_MULTIPATTERN_ICASE) && lc_map[i] == lc_map[c])) {
+			mp->prefilter_masks[pos * 2][i & 0xf] |= bucket;
+			mp->prefilter_masks[pos * 2 + 1][i >> 4] |= bucket;
+
+			if (pos == 0) {
+				mp->prefilter_start[i] = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Builds a Teddy-like prefilter: position `i` is a candidate if some
+ * bucket contains a pattern whose first byte matches in[i] and whose second
+ * byte matches in[i + 1]. While acism is in the root state, all positions
+ * that are not candidates can be skipped as no pattern could start there.
+ */
+static void
+rspamd_multipattern_prefilter_init(struct rspamd_multipattern *mp)
+{
+	unsigned int i, nstart = 0;
+
+	memset(mp->prefilter_masks, 0, sizeof(mp->prefilter_masks));
+	memset(mp->prefilter_start, 0, sizeof(mp->prefilter_start));
+	mp->has_prefilter = FALSE;
+
+	for (i = 0; i < mp->cnt; i++) {
+		const ac_trie_pat_t *pat = &g_array_index(mp->pats, ac_trie_pat_t, i);
+		const unsigned char *p = (const unsigned char *) pat->ptr;
+		unsigned char bucket;
+
+		if (pat->len == 0) {
+			return;
+		}
+
+		/* Patterns with the same first byte share a bucket */
+		bucket = 1u << ((lc_map[p[0]] ^ (lc_map[p[0]] >> 3)) & 7);
+		rspamd_multipattern_prefilter_add(mp, 0, p[0], bucket);
+
+		if (pat->len > 1) {
+			rspamd_multipattern_prefilter_add(mp, 1, p[1], bucket);
+		}
+		else {
+			/* Any second byte is fine */
+			for (unsigned int j = 0; j < 16; j++) {
+				mp->prefilter_masks[2][j] |= bucket;
+				mp->prefilter_masks[3][j] |= bucket;
+			}
+		}
+	}
+
+	for (i = 0; i < 256; i++) {
+		nstart += mp->prefilter_start[i];
+	}
+
+	mp->has_prefilter = nstart <= RSPAMD_MULTIPATTERN_PREFILTER_MAX_START;
+}
+
 gboolean
 rspamd_multipattern_compile(struct rspamd_multipattern *mp, int flags, GError **err)
 {
@@ -473,7 +558,6 @@ rspamd_multipattern_compile(struct rspamd_multipattern *mp, int flags, GError **
 
 #ifdef WITH_HYPERSCAN
 	if (rspamd_hs_check()) {
-		unsigned int i;
 		hs_platform_info_t plt;
 		hs_compile_error_t *hs_errors;
 		unsigned char hash[rspamd_cryptobox_HASHBYTES];
@@ -523,30 +607,16 @@ rspamd_multipattern_compile(struct rspamd_multipattern *mp, int flags, GError **
 				}
 			}
 
-			for (i = 0; i < MAX_SCRATCH; i++) {
-				mp->scratch[i] = NULL;
-			}
-
-			for (i = 0; i < MAX_SCRATCH; i++) {
-				int ret;
+			/* Scratch space is shared by all databases */
+			if (!rspamd_hyperscan_scratch_reserve(rspamd_hyperscan_get_database(mp->hs_db))) {
+				msg_err("cannot allocate scratch space for hyperscan");
+				g_set_error(err, rspamd_multipattern_quark(), EINVAL,
+							"cannot allocate scratch space for hyperscan");
 
-				if ((ret = hs_alloc_scratch(rspamd_hyperscan_get_database(mp->hs_db), &mp->scratch[i])) != HS_SUCCESS) {
-					msg_err("cannot allocate scratch space for hyperscan: error code %d", ret);
+				rspamd_hyperscan_free(mp->hs_db, true);
+				mp->hs_db = NULL;
 
-					/* Clean all scratches that are non-NULL */
-					for (int ii = 0; ii < MAX_SCRATCH; ii++) {
-						if (mp->scratch[ii] != NULL) {
-							hs_free_scratch(mp->scratch[ii]);
-						}
-					}
-					g_set_error(err, rspamd_multipattern_quark(), EINVAL,
-								"cannot allocate scratch space for hyperscan: error code %d", ret);
-
-					rspamd_hyperscan_free(mp->hs_db, true);
-					mp->hs_db = NULL;
-
-					return FALSE;
-				}
+				return FALSE;
 			}
 		}
 
@@ -584,6 +654,7 @@ rspamd_multipattern_compile(struct rspamd_multipattern *mp, int flags, GError **
 		}
 		else {
 			mp->t = acism_create((const ac_trie_pat_t *) mp->pats->data, mp->cnt);
+			rspamd_multipattern_prefilter_init(mp);
 		}
 	}
 
@@ -598,6 +669,8 @@ struct rspamd_multipattern_cbdata {
 	gsize len;
 	rspamd_multipattern_cb_t cb;
 	gpointer ud;
+	/* Offset of the text passed to acism within `in` */
+	gsize offset;
 	unsigned int nfound;
 	int ret;
 };
@@ -637,6 +710,7 @@ rspamd_multipattern_acism_cb(int strnum, int textpos, void *context)
 	ac_trie_pat_t pat;
 
 	pat = g_array_index(cbd->mp->pats, ac_trie_pat_t, strnum);
+	textpos += cbd->offset;
 	ret = cbd->cb(cbd->mp, strnum, textpos - pat.len,
 				  textpos, cbd->in, cbd->len, cbd->ud);
 
@@ -646,6 +720,192 @@ rspamd_multipattern_acism_cb(int strnum, int textpos, void *context)
 	return ret;
 }
 
+static inline gsize
+rspamd_multipattern_skip_scalar(const struct rspamd_multipattern *mp,
+								const unsigned char *in, gsize pos, gsize len)
+{
+	while (pos < len && !mp->prefilter_start[in[pos]]) {
+		pos++;
+	}
+
+	return pos;
+}
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+static gsize
+rspamd_multipattern_skip_avx2(const struct rspamd_multipattern *mp,
+							  const unsigned char *in, gsize pos, gsize len) __attribute__((__target__("avx2")));
+
+static gsize
+rspamd_multipattern_skip_avx2(const struct rspamd_multipattern *mp,
+							  const unsigned char *in, gsize pos, gsize len)
+{
+	const __m256i lo0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) mp->prefilter_masks[0])),
+				  hi0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) mp->prefilter_masks[1])),
+				  lo1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) mp->prefilter_masks[2])),
+				  hi1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) mp->prefilter_masks[3])),
+				  nib = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256();
+
+	/* One more byte is needed for the second position */
+	while (pos + 33 <= len) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *) (in + pos)),
+				v1 = _mm256_loadu_si256((const __m256i *) (in + pos + 1));
+		__m256i m0 = _mm256_and_si256(
+			_mm256_shuffle_epi8(lo0, _mm256_and_si256(v0, nib)),
+			_mm256_shuffle_epi8(hi0, _mm256_and_si256(_mm256_srli_epi16(v0, 4), nib)));
+		__m256i m1 = _mm256_and_si256(
+			_mm256_shuffle_epi8(lo1, _mm256_and_si256(v1, nib)),
+			_mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(v1, 4), nib)));
+		uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(m0, m1), zero));
+
+		if (mask) {
+			return pos + __builtin_ctz(mask);
+		}
+
+		pos += 32;
+	}
+
+	return rspamd_multipattern_skip_scalar(mp, in, pos, len);
+}
+#endif
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_SSSE3) && defined(__x86_64__)
+static gsize
+rspamd_multipattern_skip_ssse3(const struct rspamd_multipattern *mp,
+							   const unsigned char *in, gsize pos, gsize len) __attribute__((__target__("ssse3")));
+
+static gsize
+rspamd_multipattern_skip_ssse3(const struct rspamd_multipattern *mp,
+							   const unsigned char *in, gsize pos, gsize len)
+{
+	const __m128i lo0 = _mm_load_si128((const __m128i *) mp->prefilter_masks[0]),
+				  hi0 = _mm_load_si128((const __m128i *) mp->prefilter_masks[1]),
+				  lo1 = _mm_load_si128((const __m128i *) mp->prefilter_masks[2]),
+				  hi1 = _mm_load_si128((const __m128i *) mp->prefilter_masks[3]),
+				  nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+
+	while (pos + 17 <= len) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *) (in + pos)),
+				v1 = _mm_loadu_si128((const __m128i *) (in + pos + 1));
+		__m128i m0 = _mm_and_si128(
+			_mm_shuffle_epi8(lo0, _mm_and_si128(v0, nib)),
+			_mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nib)));
+		__m128i m1 = _mm_and_si128(
+			_mm_shuffle_epi8(lo1, _mm_and_si128(v1, nib)),
+			_mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nib)));
+		unsigned int mask = _mm_movemask_epi8(
+								_mm_cmpeq_epi8(_mm_and_si128(m0, m1), zero)) ^
+							0xffff;
+
+		if (mask) {
+			return pos + __builtin_ctz(mask);
+		}
+
+		pos += 16;
+	}
+
+	return rspamd_multipattern_skip_scalar(mp, in, pos, len);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static gsize
+rspamd_multipattern_skip_neon(const struct rspamd_multipattern *mp,
+							  const unsigned char *in, gsize pos, gsize len)
+{
+	const uint8x16_t lo0 = vld1q_u8(mp->prefilter_masks[0]),
+					 hi0 = vld1q_u8(mp->prefilter_masks[1]),
+					 lo1 = vld1q_u8(mp->prefilter_masks[2]),
+					 hi1 = vld1q_u8(mp->prefilter_masks[3]),
+					 nib = vdupq_n_u8(0x0f);
+
+	while (pos + 17 <= len) {
+		uint8x16_t v0 = vld1q_u8(in + pos), v1 = vld1q_u8(in + pos + 1);
+		uint8x16_t m = vandq_u8(
+			vandq_u8(vqtbl1q_u8(lo0, vandq_u8(v0, nib)),
+					 vqtbl1q_u8(hi0, vshrq_n_u8(v0, 4))),
+			vandq_u8(vqtbl1q_u8(lo1, vandq_u8(v1, nib)),
+					 vqtbl1q_u8(hi1, vshrq_n_u8(v1, 4))));
+
+		if (vmaxvq_u8(m) != 0) {
+			/* Narrow to 4 bits per byte to find the first candidate */
+			uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+											  vshrn_n_u16(vreinterpretq_u16_u8(vtstq_u8(m, m)), 4)),
+										  0);
+
+			return pos + (__builtin_ctzll(bits) >> 2);
+		}
+
+		pos += 16;
+	}
+
+	return rspamd_multipattern_skip_scalar(mp, in, pos, len);
+}
+#endif
+
+/*
+ * Returns the next position in `in` where some pattern could start or `len`
+ */
+static inline gsize
+rspamd_multipattern_skip(const struct rspamd_multipattern *mp,
+						 const unsigned char *in, gsize pos, gsize len)
+{
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (len - pos >= 64 && (cpu_config & CPUID_AVX2)) {
+		return rspamd_multipattern_skip_avx2(mp, in, pos, len);
+	}
+#endif
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_SSSE3) && defined(__x86_64__)
+	if (len - pos >= 32 && (cpu_config & CPUID_SSSE3)) {
+		return rspamd_multipattern_skip_ssse3(mp, in, pos, len);
+	}
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	return rspamd_multipattern_skip_neon(mp, in, pos, len);
+#else
+	return rspamd_multipattern_skip_scalar(mp, in, pos, len);
+#endif
+}
+
+/*
+ * Runs acism only from the candidate positions found by the prefilter.
+ * Acism state is preserved between chunks, so matches and their order are
+ * the same as for the plain trie lookup.
+ */
+static int
+rspamd_multipattern_lookup_prefiltered(struct rspamd_multipattern *mp,
+									   struct rspamd_multipattern_cbdata *cbd)
+{
+	const unsigned char *in = (const unsigned char *) cbd->in;
+	gsize pos = 0, len = cbd->len, chunk;
+	int state = 0, ret = 0;
+
+	while (pos < len) {
+		if (state == 0) {
+			pos = rspamd_multipattern_skip(mp, in, pos, len);
+
+			if (pos >= len) {
+				break;
+			}
+		}
+
+		chunk = MIN(len - pos, RSPAMD_MULTIPATTERN_PREFILTER_CHUNK);
+		cbd->offset = pos;
+		ret = acism_lookup(mp->t, cbd->in + pos, chunk,
+						   rspamd_multipattern_acism_cb, cbd,
+						   &state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+
+		if (ret != 0) {
+			break;
+		}
+
+		pos += chunk;
+	}
+
+	return ret;
+}
+
 int rspamd_multipattern_lookup(struct rspamd_multipattern *mp,
 							   const char *in, gsize len, rspamd_multipattern_cb_t cb,
 							   gpointer ud, unsigned int *pnfound)
@@ -664,28 +924,20 @@ int rspamd_multipattern_lookup(struct rspamd_multipattern *mp,
 	cbd.len = len;
 	cbd.cb = cb;
 	cbd.ud = ud;
+	cbd.offset = 0;
 	cbd.nfound = 0;
 	cbd.ret = 0;
 
 #ifdef WITH_HYPERSCAN
 	if (rspamd_hs_check()) {
-		hs_scratch_t *scr = NULL;
-		unsigned int i;
-
-		for (i = 0; i < MAX_SCRATCH; i++) {
-			if (!(mp->scratch_used & (1 << i))) {
-				mp->scratch_used |= (1 << i);
-				scr = mp->scratch[i];
-				break;
-			}
-		}
+		hs_scratch_t *scr = rspamd_hyperscan_scratch_acquire();
 
 		g_assert(scr != NULL);
 
 		ret = hs_scan(rspamd_hyperscan_get_database(mp->hs_db), in, len, 0, scr,
 					  rspamd_multipattern_hs_cb, &cbd);
 
-		mp->scratch_used &= ~(1 << i);
+		rspamd_hyperscan_scratch_release(scr);
 
 		if (ret == HS_SUCCESS) {
 			ret = 0;
@@ -733,6 +985,13 @@ int rspamd_multipattern_lookup(struct rspamd_multipattern *mp,
 			*pnfound = cbd.nfound;
 		}
 	}
+	else if (mp->has_prefilter) {
+		ret = rspamd_multipattern_lookup_prefiltered(mp, &cbd);
+
+		if (pnfound) {
+			*pnfound = cbd.nfound;
+		}
+	}
 	else {
 		/* Plain trie */
 		ret = acism_lookup(mp->t, in, len, rspamd_multipattern_acism_cb, &cbd,
@@ -757,10 +1016,6 @@ void rspamd_multipattern_destroy(struct rspamd_multipattern *mp)
 			char *p;
 
 			if (mp->compiled && mp->cnt > 0) {
-				for (i = 0; i < MAX_SCRATCH; i++) {
-					hs_free_scratch(mp->scratch[i]);
-				}
-
 				if (mp->hs_db) {
 					rspamd_hyperscan_free(mp->hs_db, false);
 				}
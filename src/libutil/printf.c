@@ -598,488 +598,562 @@ glong rspamd_vprintf_fstring(rspamd_fstring_t **s, const char *fmt, va_list args
 	return rspamd_vprintf_common(rspamd_printf_append_fstring, s, fmt, args);
 }
 
-#define RSPAMD_PRINTF_APPEND(buf, len)      \
-	do {                                    \
-		RSPAMD_PRINTF_APPEND_BUF(buf, len); \
-		fmt++;                              \
-		buf_start = fmt;                    \
-	} while (0)
+/* Pre-parsed conversion specification */
+struct rspamd_printf_spec {
+	char conv;
+	char zero;
+	unsigned char sign;
+	unsigned char hex;
+	unsigned char b32;
+	unsigned char b64;
+	unsigned char humanize;
+	unsigned char bytes;
+	unsigned char len_star;
+	unsigned char frac_star;
+	unsigned int width;
+	unsigned int frac_width;
+};
+
+/* Literal part followed by an optional conversion (`spec.conv` is zero otherwise) */
+struct rspamd_printf_fmt_seg {
+	const char *lit;
+	glong lit_len;
+	struct rspamd_printf_spec spec;
+};
+
+struct rspamd_printf_fmt {
+	unsigned int nsegs;
+	struct rspamd_printf_fmt_seg segs[];
+};
+
+/*
+ * Parses flags after '%' and returns a pointer to the conversion character,
+ * which is zero if the format ends prematurely
+ */
+static const char *
+rspamd_printf_parse_spec(const char *fmt, struct rspamd_printf_spec *spec)
+{
+	memset(spec, 0, sizeof(*spec));
+	spec->zero = (char) ((*fmt == '0') ? '0' : ' ');
+	spec->sign = 1;
+
+	while (*fmt >= '0' && *fmt <= '9') {
+		spec->width = spec->width * 10 + *fmt++ - '0';
+	}
+
+	for (;;) {
+		switch (*fmt) {
+
+		case 'u':
+			spec->sign = 0;
+			fmt++;
+			continue;
+
+		case 'm':
+			fmt++;
+			continue;
+
+		case 'X':
+			spec->hex = 2;
+			spec->sign = 0;
+			fmt++;
+			continue;
+
+		case 'x':
+			spec->hex = 1;
+			spec->sign = 0;
+			fmt++;
+			continue;
+		case 'b':
+			spec->b32 = 1;
+			spec->sign = 0;
+			fmt++;
+			continue;
+		case 'B':
+			spec->b64 = 1;
+			spec->sign = 0;
+			fmt++;
+			continue;
+		case 'H':
+			spec->humanize = 1;
+			spec->bytes = 1;
+			spec->sign = 0;
+			fmt++;
+			continue;
+		case 'h':
+			spec->humanize = 1;
+			spec->sign = 0;
+			fmt++;
+			continue;
+		case '.':
+			fmt++;
+
+			if (*fmt == '*') {
+				spec->frac_star = 1;
+				fmt++;
+			}
+			else {
+				while (*fmt >= '0' && *fmt <= '9') {
+					spec->frac_width = spec->frac_width * 10 + *fmt++ - '0';
+				}
+			}
+
+			break;
+
+		case '*':
+			spec->len_star = 1;
+			fmt++;
+			continue;
 
-#define RSPAMD_PRINTF_APPEND_BUF(buf, len) \
-	do {                                   \
-		wr = func((buf), (len), apd);      \
-		if (wr < (__typeof(wr)) (len)) {   \
-			goto oob;                      \
-		}                                  \
-		written += wr;                     \
+		default:
+			break;
+		}
+
+		break;
+	}
+
+	spec->conv = *fmt;
+
+	return fmt;
+}
+
+#define RSPAMD_PRINTF_APPEND(buf, len)    \
+	do {                                  \
+		wr = func((buf), (len), apd);     \
+		if (wr < (__typeof(wr)) (len)) {  \
+			return 0;                     \
+		}                                 \
+		*pwritten += wr;                  \
 	} while (0)
 
-glong rspamd_vprintf_common(rspamd_printf_append_func func,
-							gpointer apd,
-							const char *fmt,
-							va_list args)
+/*
+ * Writes a single conversion consuming its arguments, returns 1 on success,
+ * 0 if output is exhausted and -1 for invalid arguments
+ */
+static int
+rspamd_printf_write_spec(rspamd_printf_append_func func,
+						 gpointer apd,
+						 const struct rspamd_printf_spec *spec,
+						 va_list *args,
+						 glong *pwritten)
 {
-	char zero, numbuf[G_ASCII_DTOSTR_BUF_SIZE], dtoabuf[32], *p, *last;
+	char zero = spec->zero, numbuf[G_ASCII_DTOSTR_BUF_SIZE], dtoabuf[32], *p, *last;
 	unsigned char c;
-	const char *buf_start = fmt;
 	int d;
 	double f;
-	glong written = 0, wr, slen;
-	int64_t i64;
-	uint64_t ui64;
-	unsigned int width, sign, hex, humanize, bytes, frac_width, b32, b64;
+	glong wr, slen = -1;
+	int64_t i64 = 0;
+	uint64_t ui64 = 0;
+	unsigned int width = spec->width, sign = spec->sign, hex = spec->hex,
+				 frac_width = spec->frac_width;
 	rspamd_fstring_t *v;
 	rspamd_ftok_t *tok;
 	GString *gs;
 	GError *err;
 
-	while (*fmt) {
+	if (spec->len_star) {
+		d = (int) va_arg(*args, int);
+		if (G_UNLIKELY(d < 0)) {
+			return -1;
+		}
+		slen = (glong) d;
+	}
 
-		/*
-		 * "buf < last" means that we could copy at least one character:
-		 * the plain character, "%%", "%c", and minus without the checking
-		 */
+	if (spec->frac_star) {
+		d = (int) va_arg(*args, int);
+		if (G_UNLIKELY(d < 0)) {
+			return -1;
+		}
+		frac_width = (unsigned int) d;
+	}
 
-		if (*fmt == '%') {
+	switch (spec->conv) {
 
-			/* Append what we have in buf */
-			if (fmt > buf_start) {
-				wr = func(buf_start, fmt - buf_start, apd);
-				if (wr <= 0) {
-					goto oob;
-				}
-				written += wr;
+	case 'V':
+		v = va_arg(*args, rspamd_fstring_t *);
+
+		if (v) {
+			slen = v->len;
+
+			if (G_UNLIKELY(width != 0)) {
+				slen = MIN(v->len, width);
 			}
 
-			i64 = 0;
-			ui64 = 0;
-
-			zero = (char) ((*++fmt == '0') ? '0' : ' ');
-			width = 0;
-			sign = 1;
-			hex = 0;
-			b32 = 0;
-			b64 = 0;
-			bytes = 0;
-			humanize = 0;
-			frac_width = 0;
-			slen = -1;
-
-			while (*fmt >= '0' && *fmt <= '9') {
-				width = width * 10 + *fmt++ - '0';
+			RSPAMD_PRINTF_APPEND(v->str, slen);
+		}
+		else {
+			RSPAMD_PRINTF_APPEND("(NULL)", 6);
+		}
+
+		return 1;
+
+	case 'T':
+		tok = va_arg(*args, rspamd_ftok_t *);
+
+		if (tok) {
+			slen = tok->len;
+
+			if (G_UNLIKELY(width != 0)) {
+				slen = MIN(tok->len, width);
 			}
+			RSPAMD_PRINTF_APPEND(tok->begin, slen);
+		}
+		else {
+			RSPAMD_PRINTF_APPEND("(NULL)", 6);
+		}
 
+		return 1;
 
-			for (;;) {
-				switch (*fmt) {
-
-				case 'u':
-					sign = 0;
-					fmt++;
-					continue;
-
-				case 'm':
-					fmt++;
-					continue;
-
-				case 'X':
-					hex = 2;
-					sign = 0;
-					fmt++;
-					continue;
-
-				case 'x':
-					hex = 1;
-					sign = 0;
-					fmt++;
-					continue;
-				case 'b':
-					b32 = 1;
-					sign = 0;
-					fmt++;
-					continue;
-				case 'B':
-					b64 = 1;
-					sign = 0;
-					fmt++;
-					continue;
-				case 'H':
-					humanize = 1;
-					bytes = 1;
-					sign = 0;
-					fmt++;
-					continue;
-				case 'h':
-					humanize = 1;
-					sign = 0;
-					fmt++;
-					continue;
-				case '.':
-					fmt++;
-
-					if (*fmt == '*') {
-						d = (int) va_arg(args, int);
-						if (G_UNLIKELY(d < 0)) {
-							return 0;
-						}
-						frac_width = (unsigned int) d;
-						fmt++;
-					}
-					else {
-						while (*fmt >= '0' && *fmt <= '9') {
-							frac_width = frac_width * 10 + *fmt++ - '0';
-						}
-					}
-
-					break;
-
-				case '*':
-					d = (int) va_arg(args, int);
-					if (G_UNLIKELY(d < 0)) {
-						return 0;
-					}
-					slen = (glong) d;
-					fmt++;
-					continue;
-
-				default:
-					break;
-				}
+	case 'v':
+		gs = va_arg(*args, GString *);
 
-				break;
+		if (gs) {
+			slen = gs->len;
+
+			if (G_UNLIKELY(width != 0)) {
+				slen = MIN(gs->len, width);
 			}
 
+			RSPAMD_PRINTF_APPEND(gs->str, slen);
+		}
+		else {
+			RSPAMD_PRINTF_APPEND("(NULL)", 6);
+		}
 
-			switch (*fmt) {
+		return 1;
 
-			case 'V':
-				v = va_arg(args, rspamd_fstring_t *);
+	case 'e':
+		err = va_arg(*args, GError *);
 
-				if (v) {
-					slen = v->len;
+		if (err) {
+			p = err->message;
 
-					if (G_UNLIKELY(width != 0)) {
-						slen = MIN(v->len, width);
-					}
+			if (p == NULL) {
+				p = "(NULL)";
+			}
+		}
+		else {
+			p = "unknown error";
+		}
 
-					RSPAMD_PRINTF_APPEND(v->str, slen);
-				}
-				else {
-					RSPAMD_PRINTF_APPEND("(NULL)", 6);
-				}
+		slen = strlen(p);
+		RSPAMD_PRINTF_APPEND(p, slen);
 
-				continue;
+		return 1;
 
-			case 'T':
-				tok = va_arg(args, rspamd_ftok_t *);
+	case 's':
+		p = va_arg(*args, char *);
+		if (p == NULL) {
+			p = "(NULL)";
+			slen = sizeof("(NULL)") - 1;
+		}
 
-				if (tok) {
-					slen = tok->len;
+		if (G_UNLIKELY(spec->b32)) {
+			char *b32buf;
 
-					if (G_UNLIKELY(width != 0)) {
-						slen = MIN(tok->len, width);
-					}
-					RSPAMD_PRINTF_APPEND(tok->begin, slen);
+			if (G_UNLIKELY(slen == -1)) {
+				if (G_LIKELY(width != 0)) {
+					slen = width;
 				}
 				else {
-					RSPAMD_PRINTF_APPEND("(NULL)", 6);
+					/* NULL terminated string */
+					slen = strlen(p);
 				}
-				continue;
-
-			case 'v':
-				gs = va_arg(args, GString *);
+			}
 
-				if (gs) {
-					slen = gs->len;
+			b32buf = rspamd_encode_base32(p, slen, RSPAMD_BASE32_DEFAULT);
 
-					if (G_UNLIKELY(width != 0)) {
-						slen = MIN(gs->len, width);
-					}
+			if (b32buf) {
+				wr = func(b32buf, strlen(b32buf), apd);
+				if (wr < (glong) strlen(b32buf)) {
+					g_free(b32buf);
+					return 0;
+				}
+				*pwritten += wr;
+				g_free(b32buf);
+			}
+			else {
+				RSPAMD_PRINTF_APPEND("(NULL)", sizeof("(NULL)") - 1);
+			}
+		}
+		else if (G_UNLIKELY(hex)) {
+			char hexbuf[2];
 
-					RSPAMD_PRINTF_APPEND(gs->str, slen);
+			if (G_UNLIKELY(slen == -1)) {
+				if (G_LIKELY(width != 0)) {
+					slen = width;
 				}
 				else {
-					RSPAMD_PRINTF_APPEND("(NULL)", 6);
+					/* NULL terminated string */
+					slen = strlen(p);
 				}
+			}
 
-				continue;
-
-			case 'e':
-				err = va_arg(args, GError *);
-
-				if (err) {
-					p = err->message;
+			while (slen) {
+				hexbuf[0] = hex == 2 ? _HEX[(*p >> 4u) & 0xfu] : _hex[(*p >> 4u) & 0xfu];
+				hexbuf[1] = hex == 2 ? _HEX[*p & 0xfu] : _hex[*p & 0xfu];
+				RSPAMD_PRINTF_APPEND(hexbuf, 2);
+				p++;
+				slen--;
+			}
+		}
+		else if (G_UNLIKELY(spec->b64)) {
+			char *b64buf;
+			gsize olen = 0;
 
-					if (p == NULL) {
-						p = "(NULL)";
-					}
+			if (G_UNLIKELY(slen == -1)) {
+				if (G_LIKELY(width != 0)) {
+					slen = width;
 				}
 				else {
-					p = "unknown error";
+					/* NULL terminated string */
+					slen = strlen(p);
 				}
+			}
+
+			b64buf = rspamd_encode_base64(p, slen, 0, &olen);
 
+			if (b64buf) {
+				wr = func(b64buf, olen, apd);
+				if (wr < (glong) olen) {
+					g_free(b64buf);
+					return 0;
+				}
+				*pwritten += wr;
+				g_free(b64buf);
+			}
+			else {
+				RSPAMD_PRINTF_APPEND("(NULL)", sizeof("(NULL)") - 1);
+			}
+		}
+		else {
+			if (slen == -1) {
+				/* NULL terminated string */
 				slen = strlen(p);
-				RSPAMD_PRINTF_APPEND(p, slen);
+			}
 
-				continue;
+			if (G_UNLIKELY(width != 0)) {
+				slen = MIN(slen, width);
+			}
 
-			case 's':
-				p = va_arg(args, char *);
-				if (p == NULL) {
-					p = "(NULL)";
-					slen = sizeof("(NULL)") - 1;
-				}
+			RSPAMD_PRINTF_APPEND(p, slen);
+		}
 
-				if (G_UNLIKELY(b32)) {
-					char *b32buf;
-
-					if (G_UNLIKELY(slen == -1)) {
-						if (G_LIKELY(width != 0)) {
-							slen = width;
-						}
-						else {
-							/* NULL terminated string */
-							slen = strlen(p);
-						}
-					}
-
-					b32buf = rspamd_encode_base32(p, slen, RSPAMD_BASE32_DEFAULT);
-
-					if (b32buf) {
-						RSPAMD_PRINTF_APPEND(b32buf, strlen(b32buf));
-						g_free(b32buf);
-					}
-					else {
-						RSPAMD_PRINTF_APPEND("(NULL)", sizeof("(NULL)") - 1);
-					}
-				}
-				else if (G_UNLIKELY(hex)) {
-					char hexbuf[2];
-
-					if (G_UNLIKELY(slen == -1)) {
-						if (G_LIKELY(width != 0)) {
-							slen = width;
-						}
-						else {
-							/* NULL terminated string */
-							slen = strlen(p);
-						}
-					}
-
-					while (slen) {
-						hexbuf[0] = hex == 2 ? _HEX[(*p >> 4u) & 0xfu] : _hex[(*p >> 4u) & 0xfu];
-						hexbuf[1] = hex == 2 ? _HEX[*p & 0xfu] : _hex[*p & 0xfu];
-						RSPAMD_PRINTF_APPEND_BUF(hexbuf, 2);
-						p++;
-						slen--;
-					}
-
-					fmt++;
-					buf_start = fmt;
-				}
-				else if (G_UNLIKELY(b64)) {
-					char *b64buf;
-					gsize olen = 0;
-
-					if (G_UNLIKELY(slen == -1)) {
-						if (G_LIKELY(width != 0)) {
-							slen = width;
-						}
-						else {
-							/* NULL terminated string */
-							slen = strlen(p);
-						}
-					}
-
-					b64buf = rspamd_encode_base64(p, slen, 0, &olen);
-
-					if (b64buf) {
-						RSPAMD_PRINTF_APPEND(b64buf, olen);
-						g_free(b64buf);
-					}
-					else {
-						RSPAMD_PRINTF_APPEND("(NULL)", sizeof("(NULL)") - 1);
-					}
-				}
-				else {
-					if (slen == -1) {
-						/* NULL terminated string */
-						slen = strlen(p);
-					}
+		return 1;
 
-					if (G_UNLIKELY(width != 0)) {
-						slen = MIN(slen, width);
-					}
+	case 'O':
+		i64 = (int64_t) va_arg(*args, off_t);
+		sign = 1;
+		break;
 
-					RSPAMD_PRINTF_APPEND(p, slen);
-				}
+	case 'P':
+		i64 = (int64_t) va_arg(*args, pid_t);
+		sign = 1;
+		break;
 
-				continue;
+	case 't':
+		i64 = (int64_t) va_arg(*args, time_t);
+		sign = 1;
+		break;
 
-			case 'O':
-				i64 = (int64_t) va_arg(args, off_t);
-				sign = 1;
-				break;
+	case 'z':
+		if (sign) {
+			i64 = (int64_t) va_arg(*args, ssize_t);
+		}
+		else {
+			ui64 = (uint64_t) va_arg(*args, size_t);
+		}
+		break;
 
-			case 'P':
-				i64 = (int64_t) va_arg(args, pid_t);
-				sign = 1;
-				break;
+	case 'd':
+		if (sign) {
+			i64 = (int64_t) va_arg(*args, int);
+		}
+		else {
+			ui64 = (uint64_t) va_arg(*args, unsigned int);
+		}
+		break;
 
-			case 't':
-				i64 = (int64_t) va_arg(args, time_t);
-				sign = 1;
-				break;
+	case 'l':
+		if (sign) {
+			i64 = (int64_t) va_arg(*args, glong);
+		}
+		else {
+			ui64 = (uint64_t) va_arg(*args, gulong);
+		}
+		break;
 
-			case 'z':
-				if (sign) {
-					i64 = (int64_t) va_arg(args, ssize_t);
-				}
-				else {
-					ui64 = (uint64_t) va_arg(args, size_t);
-				}
-				break;
+	case 'D':
+		if (sign) {
+			i64 = (int64_t) va_arg(*args, int32_t);
+		}
+		else {
+			ui64 = (uint64_t) va_arg(*args, uint32_t);
+		}
+		break;
 
-			case 'd':
-				if (sign) {
-					i64 = (int64_t) va_arg(args, int);
-				}
-				else {
-					ui64 = (uint64_t) va_arg(args, unsigned int);
-				}
-				break;
+	case 'L':
+		if (sign) {
+			i64 = va_arg(*args, int64_t);
+		}
+		else {
+			ui64 = va_arg(*args, uint64_t);
+		}
+		break;
 
-			case 'l':
-				if (sign) {
-					i64 = (int64_t) va_arg(args, glong);
-				}
-				else {
-					ui64 = (uint64_t) va_arg(args, gulong);
-				}
-				break;
 
-			case 'D':
-				if (sign) {
-					i64 = (int64_t) va_arg(args, int32_t);
-				}
-				else {
-					ui64 = (uint64_t) va_arg(args, uint32_t);
-				}
-				break;
+	case 'f':
+		f = (double) va_arg(*args, double);
+		slen = fpconv_dtoa(f, dtoabuf, frac_width, false);
 
-			case 'L':
-				if (sign) {
-					i64 = va_arg(args, int64_t);
-				}
-				else {
-					ui64 = va_arg(args, uint64_t);
-				}
-				break;
+		RSPAMD_PRINTF_APPEND(dtoabuf, slen);
 
+		return 1;
 
-			case 'f':
-				f = (double) va_arg(args, double);
-				slen = fpconv_dtoa(f, dtoabuf, frac_width, false);
+	case 'g':
+		f = (double) va_arg(*args, double);
+		slen = fpconv_dtoa(f, dtoabuf, 0, true);
+		RSPAMD_PRINTF_APPEND(dtoabuf, slen);
 
-				RSPAMD_PRINTF_APPEND(dtoabuf, slen);
+		return 1;
 
-				continue;
+	case 'F':
+		f = (double) va_arg(*args, long double);
+		slen = fpconv_dtoa(f, dtoabuf, frac_width, false);
 
-			case 'g':
-				f = (double) va_arg(args, double);
-				slen = fpconv_dtoa(f, dtoabuf, 0, true);
-				RSPAMD_PRINTF_APPEND(dtoabuf, slen);
+		RSPAMD_PRINTF_APPEND(dtoabuf, slen);
 
-				continue;
+		return 1;
 
-			case 'F':
-				f = (double) va_arg(args, long double);
-				slen = fpconv_dtoa(f, dtoabuf, frac_width, false);
+	case 'G':
+		f = (double) va_arg(*args, long double);
+		slen = fpconv_dtoa(f, dtoabuf, 0, true);
+		RSPAMD_PRINTF_APPEND(dtoabuf, slen);
 
-				RSPAMD_PRINTF_APPEND(dtoabuf, slen);
+		return 1;
 
-				continue;
+	case 'p':
+		ui64 = (uintptr_t) va_arg(*args, void *);
+		hex = 2;
+		sign = 0;
+		zero = '0';
+		width = sizeof(void *) * 2;
+		break;
 
-			case 'G':
-				f = (double) va_arg(args, long double);
-				slen = fpconv_dtoa(f, dtoabuf, 0, true);
-				RSPAMD_PRINTF_APPEND(dtoabuf, slen);
+	case 'c':
+		c = va_arg(*args, int);
+		c &= 0xffu;
+		if (G_UNLIKELY(hex)) {
+			char hexbuf[2];
+			hexbuf[0] = hex == 2 ? _HEX[(c >> 4u) & 0xfu] : _hex[(c >> 4u) & 0xfu];
+			hexbuf[1] = hex == 2 ? _HEX[c & 0xfu] : _hex[c & 0xfu];
 
-				continue;
+			RSPAMD_PRINTF_APPEND(hexbuf, 2);
+		}
+		else {
+			RSPAMD_PRINTF_APPEND(&c, 1);
+		}
 
-			case 'p':
-				ui64 = (uintptr_t) va_arg(args, void *);
-				hex = 2;
-				sign = 0;
-				zero = '0';
-				width = sizeof(void *) * 2;
-				break;
+		return 1;
 
-			case 'c':
-				c = va_arg(args, int);
-				c &= 0xffu;
-				if (G_UNLIKELY(hex)) {
-					char hexbuf[2];
-					hexbuf[0] = hex == 2 ? _HEX[(c >> 4u) & 0xfu] : _hex[(c >> 4u) & 0xfu];
-					hexbuf[1] = hex == 2 ? _HEX[c & 0xfu] : _hex[c & 0xfu];
+	case 'Z':
+		c = '\0';
+		RSPAMD_PRINTF_APPEND(&c, 1);
 
-					RSPAMD_PRINTF_APPEND(hexbuf, 2);
-				}
-				else {
-					RSPAMD_PRINTF_APPEND(&c, 1);
-				}
+		return 1;
 
-				continue;
+	case 'N':
+		c = '\n';
+		RSPAMD_PRINTF_APPEND(&c, 1);
 
-			case 'Z':
-				c = '\0';
-				RSPAMD_PRINTF_APPEND(&c, 1);
+		return 1;
 
-				continue;
+	default:
+		/* Including `%%` */
+		c = spec->conv;
+		RSPAMD_PRINTF_APPEND(&c, 1);
 
-			case 'N':
-				c = '\n';
-				RSPAMD_PRINTF_APPEND(&c, 1);
+		return 1;
+	}
 
-				continue;
+	/* Print number */
+	p = numbuf;
+	last = p + sizeof(numbuf);
+	if (sign) {
+		if (i64 < 0) {
+			*p++ = '-';
+			ui64 = (uint64_t) -i64;
+		}
+		else {
+			ui64 = (uint64_t) i64;
+		}
+	}
 
-			case '%':
-				c = '%';
-				RSPAMD_PRINTF_APPEND(&c, 1);
+	if (!spec->humanize) {
+		p = rspamd_sprintf_num(p, last, ui64, zero, hex, spec->b64 + spec->b32, width);
+	}
+	else {
+		p = rspamd_humanize_number(p, last, ui64, spec->bytes);
+	}
+	slen = p - numbuf;
+	RSPAMD_PRINTF_APPEND(numbuf, slen);
 
-				continue;
+	return 1;
+}
 
-			default:
-				c = *fmt;
-				RSPAMD_PRINTF_APPEND(&c, 1);
+#undef RSPAMD_PRINTF_APPEND
 
-				continue;
-			}
+glong rspamd_vprintf_common(rspamd_printf_append_func func,
+							gpointer apd,
+							const char *fmt,
+							va_list args)
+{
+	const char *buf_start = fmt, *next;
+	glong written = 0, wr;
+	struct rspamd_printf_spec spec;
+	va_list ap;
+	int r;
 
-			/* Print number */
-			p = numbuf;
-			last = p + sizeof(numbuf);
-			if (sign) {
-				if (i64 < 0) {
-					*p++ = '-';
-					ui64 = (uint64_t) -i64;
-				}
-				else {
-					ui64 = (uint64_t) i64;
+	va_copy(ap, args);
+
+	while (*fmt) {
+
+		if (*fmt == '%') {
+
+			/* Append what we have in buf */
+			if (fmt > buf_start) {
+				wr = func(buf_start, fmt - buf_start, apd);
+				if (wr <= 0) {
+					goto oob;
 				}
+				written += wr;
 			}
 
-			if (!humanize) {
-				p = rspamd_sprintf_num(p, last, ui64, zero, hex, b64 + b32, width);
+			fmt = rspamd_printf_parse_spec(fmt + 1, &spec);
+
+			if (G_UNLIKELY(spec.conv == '\0')) {
+				/* Trailing '%' is ignored */
+				buf_start = fmt;
+				break;
 			}
-			else {
-				p = rspamd_humanize_number(p, last, ui64, bytes);
+
+			r = rspamd_printf_write_spec(func, apd, &spec, &ap, &written);
+
+			if (r <= 0) {
+				if (r < 0) {
+					written = 0;
+				}
+
+				goto oob;
 			}
-			slen = p - numbuf;
-			RSPAMD_PRINTF_APPEND(numbuf, slen);
+
+			fmt++;
+			buf_start = fmt;
 		}
 		else {
-			fmt++;
+			/* Skip literal characters up to the next conversion */
+			next = strchr(fmt, '%');
+			fmt = next ? next : fmt + strlen(fmt);
 		}
 	}
 
@@ -1093,5 +1167,140 @@ glong rspamd_vprintf_common(rspamd_printf_append_func func,
 	}
 
 oob:
+	va_end(ap);
+
+	return written;
+}
+
+static struct rspamd_printf_fmt *
+rspamd_printf_fmt_compile(const char *fmt)
+{
+	struct rspamd_printf_fmt *compiled;
+	struct rspamd_printf_fmt_seg *seg;
+	const char *p = fmt, *next;
+	unsigned int nsegs = 1;
+
+	for (next = strchr(p, '%'); next != NULL; next = strchr(next + 1, '%')) {
+		nsegs++;
+	}
+
+	compiled = g_malloc0(sizeof(*compiled) + sizeof(*seg) * nsegs);
+
+	while (*p) {
+		seg = &compiled->segs[compiled->nsegs++];
+		seg->lit = p;
+		next = strchr(p, '%');
+
+		if (next == NULL) {
+			seg->lit_len = strlen(p);
+			break;
+		}
+
+		seg->lit_len = next - p;
+		p = rspamd_printf_parse_spec(next + 1, &seg->spec);
+
+		if (seg->spec.conv == '\0') {
+			break;
+		}
+
+		p++;
+	}
+
+	return compiled;
+}
+
+static const struct rspamd_printf_fmt *
+rspamd_printf_fmt_get(struct rspamd_printf_fmt_cache *cache)
+{
+	struct rspamd_printf_fmt *compiled, *expected = NULL;
+
+	compiled = __atomic_load_n(&cache->compiled, __ATOMIC_ACQUIRE);
+
+	if (G_UNLIKELY(compiled == NULL)) {
+		compiled = rspamd_printf_fmt_compile(cache->fmt);
+
+		if (!__atomic_compare_exchange_n(&cache->compiled, &expected, compiled,
+										 FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			/* Another thread has been faster */
+			g_free(compiled);
+			compiled = expected;
+		}
+	}
+
+	return compiled;
+}
+
+glong rspamd_vprintf_cached(rspamd_printf_append_func func,
+							gpointer apd,
+							struct rspamd_printf_fmt_cache *cache,
+							va_list args)
+{
+	const struct rspamd_printf_fmt *compiled = rspamd_printf_fmt_get(cache);
+	const struct rspamd_printf_fmt_seg *seg;
+	glong written = 0, wr;
+	unsigned int i;
+	va_list ap;
+	int r;
+
+	va_copy(ap, args);
+
+	for (i = 0; i < compiled->nsegs; i++) {
+		seg = &compiled->segs[i];
+
+		if (seg->lit_len > 0) {
+			wr = func(seg->lit, seg->lit_len, apd);
+			if (wr <= 0) {
+				goto oob;
+			}
+			written += wr;
+		}
+
+		if (seg->spec.conv != '\0') {
+			r = rspamd_printf_write_spec(func, apd, &seg->spec, &ap, &written);
+
+			if (r <= 0) {
+				if (r < 0) {
+					written = 0;
+				}
+
+				goto oob;
+			}
+		}
+	}
+
+oob:
+	va_end(ap);
+
 	return written;
 }
+
+glong rspamd_snprintf_cached(char *buf, glong max,
+							 struct rspamd_printf_fmt_cache *cache, ...)
+{
+	struct rspamd_printf_char_buf dst;
+	va_list args;
+
+	dst.begin = buf;
+	dst.pos = dst.begin;
+	dst.remain = max - 1;
+
+	va_start(args, cache);
+	(void) rspamd_vprintf_cached(rspamd_printf_append_char, &dst, cache, args);
+	va_end(args);
+	*dst.pos = '\0';
+
+	return dst.pos - buf;
+}
+
+glong rspamd_printf_fstring_cached(rspamd_fstring_t **s,
+								   struct rspamd_printf_fmt_cache *cache, ...)
+{
+	va_list args;
+	glong r;
+
+	va_start(args, cache);
+	r = rspamd_vprintf_cached(rspamd_printf_append_fstring, s, cache, args);
+	va_end(args);
+
+	return r;
+}
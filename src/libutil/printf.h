@@ -89,6 +89,37 @@ glong rspamd_vprintf_common(rspamd_printf_append_func func,
 							const char *fmt,
 							va_list args);
 
+/*
+ * Format string that is parsed once on the first use, intended for formats used
+ * in hot paths (e.g. task log). Should be declared with a static storage and
+ * a string literal, as format string is referenced and not copied:
+ *
+ * static struct rspamd_printf_fmt_cache score_fmt = RSPAMD_PRINTF_FMT_INIT("%.2f");
+ * rspamd_printf_fstring_cached(&buf, &score_fmt, score);
+ */
+struct rspamd_printf_fmt;
+
+struct rspamd_printf_fmt_cache {
+	const char *fmt;
+	struct rspamd_printf_fmt *compiled;
+};
+
+#define RSPAMD_PRINTF_FMT_INIT(fmt) \
+	{                               \
+		(fmt), NULL                 \
+	}
+
+glong rspamd_vprintf_cached(rspamd_printf_append_func func,
+							gpointer apd,
+							struct rspamd_printf_fmt_cache *cache,
+							va_list args);
+
+glong rspamd_snprintf_cached(char *buf, glong max,
+							 struct rspamd_printf_fmt_cache *cache, ...);
+
+glong rspamd_printf_fstring_cached(rspamd_fstring_t **s,
+								   struct rspamd_printf_fmt_cache *cache, ...);
+
 #ifdef __cplusplus
 }
 #endif
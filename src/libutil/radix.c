@@ -38,15 +38,201 @@
 
 INIT_LOG_MODULE(radix)
 
+#if defined(__GNUC__) || defined(__clang__)
+#define radix_prefetch(p) __builtin_prefetch(p)
+#else
+#define radix_prefetch(p) (void) (p)
+#endif
+
+/* Smaller trees are fast enough and are not worth 256Kb of a table */
+#define RADIX_IPV4_TABLE_MIN_PREFIXES 1024
+#define RADIX_IPV4_EXT (1u << 31u)
+#define RADIX_IPV4_BLOCK 256
+#define RADIX_IPV4_ROOT G_MAXUINT
+
+/*
+ * Read optimized layout for IPv4 addresses (DIR-16-8-8): the first 16 bits
+ * of an address index the root table, entries either refer to a value or to
+ * a block of 256 entries for the next 8 bits. Lookup is at most 3 memory
+ * accesses with no branches on the prefix structure.
+ */
+struct radix_ipv4_table {
+	uint32_t root[1u << 16u];
+	uint32_t *blocks;
+	unsigned int nblocks;
+	unsigned int blocks_allocated;
+	/* Element 0 means no value */
+	uintptr_t *values;
+	unsigned int nvalues;
+};
+
 struct radix_tree_compressed {
 	rspamd_mempool_t *pool;
 	struct btrie *tree;
+	struct radix_ipv4_table *ipv4;
 	const char *name;
 	size_t size;
 	unsigned int duplicates;
 	gboolean own_pool;
 };
 
+static void
+radix_ipv4_table_free(struct radix_ipv4_table *t)
+{
+	if (t) {
+		g_free(t->blocks);
+		g_free(t->values);
+		g_free(t);
+	}
+}
+
+static void
+radix_ipv4_table_dtor(gpointer p)
+{
+	radix_compressed_t *tree = p;
+
+	radix_ipv4_table_free(tree->ipv4);
+	tree->ipv4 = NULL;
+}
+
+static inline uint32_t *
+radix_ipv4_entry(struct radix_ipv4_table *t, unsigned int blk, unsigned int off)
+{
+	if (blk == RADIX_IPV4_ROOT) {
+		return &t->root[off];
+	}
+
+	return &t->blocks[blk * RADIX_IPV4_BLOCK + off];
+}
+
+/* Returns a block for an entry, creating it from the entry value if needed */
+static unsigned int
+radix_ipv4_extend(struct radix_ipv4_table *t, unsigned int blk, unsigned int off)
+{
+	uint32_t e = *radix_ipv4_entry(t, blk, off);
+	unsigned int i, nb;
+
+	if (e & RADIX_IPV4_EXT) {
+		return e & ~RADIX_IPV4_EXT;
+	}
+
+	if (t->nblocks == t->blocks_allocated) {
+		t->blocks_allocated = MAX(16, t->blocks_allocated * 2);
+		t->blocks = g_realloc(t->blocks,
+							  sizeof(uint32_t) * RADIX_IPV4_BLOCK * t->blocks_allocated);
+	}
+
+	nb = t->nblocks++;
+
+	for (i = 0; i < RADIX_IPV4_BLOCK; i++) {
+		t->blocks[nb * RADIX_IPV4_BLOCK + i] = e;
+	}
+
+	*radix_ipv4_entry(t, blk, off) = nb | RADIX_IPV4_EXT;
+
+	return nb;
+}
+
+static void
+radix_ipv4_fill(struct radix_ipv4_table *t, unsigned int blk,
+				unsigned int off, unsigned int n, uint32_t value)
+{
+	unsigned int i;
+	uint32_t *e;
+
+	for (i = off; i < off + n; i++) {
+		e = radix_ipv4_entry(t, blk, i);
+
+		if (*e & RADIX_IPV4_EXT) {
+			/* More specific prefixes are inside */
+			radix_ipv4_fill(t, *e & ~RADIX_IPV4_EXT, 0, RADIX_IPV4_BLOCK, value);
+		}
+		else {
+			*e = value;
+		}
+	}
+}
+
+static void
+radix_ipv4_insert(struct radix_ipv4_table *t, uint32_t addr, unsigned int plen,
+				  uint32_t value)
+{
+	unsigned int blk;
+
+	if (plen <= 16) {
+		radix_ipv4_fill(t, RADIX_IPV4_ROOT, addr >> 16u, 1u << (16 - plen), value);
+	}
+	else {
+		blk = radix_ipv4_extend(t, RADIX_IPV4_ROOT, addr >> 16u);
+
+		if (plen <= 24) {
+			radix_ipv4_fill(t, blk, (addr >> 8u) & 0xffu, 1u << (24 - plen), value);
+		}
+		else {
+			blk = radix_ipv4_extend(t, blk, (addr >> 8u) & 0xffu);
+			radix_ipv4_fill(t, blk, addr & 0xffu, 1u << (32 - plen), value);
+		}
+	}
+}
+
+static inline uintptr_t
+radix_ipv4_lookup(const struct radix_ipv4_table *t, uint32_t addr)
+{
+	uint32_t e = t->root[addr >> 16u];
+
+	if (e & RADIX_IPV4_EXT) {
+		e = t->blocks[(e & ~RADIX_IPV4_EXT) * RADIX_IPV4_BLOCK + ((addr >> 8u) & 0xffu)];
+
+		if (e & RADIX_IPV4_EXT) {
+			e = t->blocks[(e & ~RADIX_IPV4_EXT) * RADIX_IPV4_BLOCK + (addr & 0xffu)];
+		}
+	}
+
+	return e ? t->values[e] : RADIX_NO_VALUE;
+}
+
+static inline uint32_t
+radix_ipv4_key(const unsigned char *key)
+{
+	return ((uint32_t) key[0] << 24u) | ((uint32_t) key[1] << 16u) |
+		   ((uint32_t) key[2] << 8u) | (uint32_t) key[3];
+}
+
+static const unsigned char radix_ipv4_mapped_prefix[12] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+struct radix_ipv4_prefix {
+	uint32_t addr;
+	unsigned int plen;
+	uintptr_t value;
+};
+
+static void
+radix_ipv4_collect_cb(const btrie_oct_t *prefix, unsigned len,
+					  const void *data, int post, void *user_data)
+{
+	GArray *prefixes = user_data;
+	struct radix_ipv4_prefix pfx;
+
+	if (post || len < 96 ||
+		memcmp(prefix, radix_ipv4_mapped_prefix, sizeof(radix_ipv4_mapped_prefix)) != 0) {
+		return;
+	}
+
+	pfx.addr = radix_ipv4_key(prefix + 12);
+	pfx.plen = len - 96;
+	pfx.value = data ? (uintptr_t) data : RADIX_NO_VALUE;
+	g_array_append_val(prefixes, pfx);
+}
+
+static int
+radix_ipv4_prefix_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct radix_ipv4_prefix *pa = a, *pb = b;
+
+	return (int) pa->plen - (int) pb->plen;
+}
+
 uintptr_t
 radix_find_compressed(radix_compressed_t *tree, const uint8_t *key, gsize keylen)
 {
@@ -84,6 +270,12 @@ radix_insert_compressed(radix_compressed_t *tree,
 
 	old = radix_find_compressed(tree, key, keylen);
 
+	if (tree->ipv4) {
+		/* Reverted to the trie until the next radix_finalize_compressed */
+		radix_ipv4_table_free(tree->ipv4);
+		tree->ipv4 = NULL;
+	}
+
 	ret = btrie_add_prefix(tree->tree, key, keybits - masklen,
 						   (gconstpointer) value);
 
@@ -145,6 +337,8 @@ radix_create_compressed(const char *tree_name)
 	tree->tree = btrie_init(tree->pool);
 	tree->own_pool = TRUE;
 	tree->name = tree_name;
+	tree->ipv4 = NULL;
+	rspamd_mempool_add_destructor(tree->pool, radix_ipv4_table_dtor, tree);
 
 	return tree;
 }
@@ -161,6 +355,8 @@ radix_create_compressed_with_pool(rspamd_mempool_t *pool, const char *tree_name)
 	tree->tree = btrie_init(tree->pool);
 	tree->own_pool = FALSE;
 	tree->name = tree_name;
+	tree->ipv4 = NULL;
+	rspamd_mempool_add_destructor(tree->pool, radix_ipv4_table_dtor, tree);
 
 	return tree;
 }
@@ -191,6 +387,10 @@ radix_find_compressed_addr(radix_compressed_t *tree,
 
 	if (key && klen) {
 		if (klen == 4) {
+			if (tree->ipv4) {
+				return radix_ipv4_lookup(tree->ipv4, radix_ipv4_key(key));
+			}
+
 			/* Map to ipv6 */
 			memset(buf, 0, 10);
 			buf[10] = 0xffu;
@@ -207,6 +407,110 @@ radix_find_compressed_addr(radix_compressed_t *tree,
 	return RADIX_NO_VALUE;
 }
 
+void radix_find_compressed_addr_batch(radix_compressed_t *tree,
+									  const rspamd_inet_addr_t *const *addrs,
+									  gsize naddrs,
+									  uintptr_t *results)
+{
+	const struct radix_ipv4_table *t;
+	const unsigned char *key;
+	unsigned int klen;
+	uint32_t keys[16];
+	gboolean is_ipv4[G_N_ELEMENTS(keys)];
+	gsize i, j, n;
+
+	g_assert(tree != NULL);
+	t = tree->ipv4;
+
+	if (t == NULL) {
+		for (i = 0; i < naddrs; i++) {
+			results[i] = radix_find_compressed_addr(tree, addrs[i]);
+		}
+
+		return;
+	}
+
+	for (i = 0; i < naddrs; i += n) {
+		n = MIN(G_N_ELEMENTS(keys), naddrs - i);
+
+		/* Start loading all root entries and resolve them afterwards */
+		for (j = 0; j < n; j++) {
+			klen = 0;
+			key = NULL;
+
+			if (addrs[i + j] != NULL) {
+				key = rspamd_inet_address_get_hash_key(addrs[i + j], &klen);
+			}
+
+			is_ipv4[j] = key != NULL && klen == 4;
+
+			if (is_ipv4[j]) {
+				keys[j] = radix_ipv4_key(key);
+				radix_prefetch(&t->root[keys[j] >> 16u]);
+			}
+		}
+
+		for (j = 0; j < n; j++) {
+			if (is_ipv4[j]) {
+				results[i + j] = radix_ipv4_lookup(t, keys[j]);
+			}
+			else {
+				results[i + j] = radix_find_compressed_addr(tree, addrs[i + j]);
+			}
+		}
+	}
+}
+
+void radix_finalize_compressed(radix_compressed_t *tree)
+{
+	struct radix_ipv4_table *t;
+	struct radix_ipv4_prefix *pfx;
+	GArray *prefixes;
+	unsigned char key[16];
+	const void *def;
+	unsigned int i;
+
+	g_assert(tree != NULL);
+
+	radix_ipv4_table_free(tree->ipv4);
+	tree->ipv4 = NULL;
+
+	prefixes = g_array_new(FALSE, FALSE, sizeof(struct radix_ipv4_prefix));
+	btrie_walk(tree->tree, radix_ipv4_collect_cb, prefixes);
+
+	if (prefixes->len < RADIX_IPV4_TABLE_MIN_PREFIXES) {
+		g_array_free(prefixes, TRUE);
+
+		return;
+	}
+
+	/* More specific prefixes must override less specific ones */
+	g_array_sort(prefixes, radix_ipv4_prefix_cmp);
+	t = g_malloc0(sizeof(*t));
+	t->values = g_new(uintptr_t, prefixes->len + 2);
+	t->values[0] = RADIX_NO_VALUE;
+	t->nvalues = 1;
+
+	/* Shorter prefixes above ::ffff:0:0/96 match all IPv4 addresses */
+	memset(key, 0, sizeof(key));
+	memcpy(key, radix_ipv4_mapped_prefix, sizeof(radix_ipv4_mapped_prefix));
+	def = btrie_lookup(tree->tree, key, 96);
+
+	if (def != NULL) {
+		t->values[t->nvalues] = (uintptr_t) def;
+		radix_ipv4_insert(t, 0, 0, t->nvalues++);
+	}
+
+	for (i = 0; i < prefixes->len; i++) {
+		pfx = &g_array_index(prefixes, struct radix_ipv4_prefix, i);
+		t->values[t->nvalues] = pfx->value;
+		radix_ipv4_insert(t, pfx->addr, pfx->plen, t->nvalues++);
+	}
+
+	g_array_free(prefixes, TRUE);
+	tree->ipv4 = t;
+}
+
 int rspamd_radix_add_iplist(const char *list, const char *separators,
 							radix_compressed_t *tree, gconstpointer value,
 							gboolean resolve, const char *tree_name)
@@ -423,6 +727,27 @@ radix_get_pool(radix_compressed_t *tree)
 	return NULL;
 }
 
+gsize radix_get_memory(radix_compressed_t *tree)
+{
+	gsize ret = 0;
+
+	if (tree == NULL) {
+		return 0;
+	}
+
+	if (tree->own_pool) {
+		ret += rspamd_mempool_get_used_size(tree->pool);
+	}
+
+	if (tree->ipv4) {
+		ret += sizeof(*tree->ipv4) +
+			   tree->ipv4->blocks_allocated * RADIX_IPV4_BLOCK * sizeof(uint32_t) +
+			   tree->ipv4->nvalues * sizeof(uintptr_t);
+	}
+
+	return ret;
+}
+
 const char *
 radix_get_info(radix_compressed_t *tree)
 {
@@ -62,6 +62,27 @@ uintptr_t radix_find_compressed(radix_compressed_t *tree, const uint8_t *key,
 uintptr_t radix_find_compressed_addr(radix_compressed_t *tree,
 									 const rspamd_inet_addr_t *addr);
 
+/**
+ * Find many addresses at once, it is faster than separate lookups for IPv4
+ * addresses if a tree has been finalized
+ * @param tree
+ * @param addrs array of addresses (NULL elements are allowed)
+ * @param naddrs number of addresses
+ * @param results array of `naddrs` values, `RADIX_NO_VALUE` is set for not found
+ */
+void radix_find_compressed_addr_batch(radix_compressed_t *tree,
+									  const rspamd_inet_addr_t *const *addrs,
+									  gsize naddrs,
+									  uintptr_t *results);
+
+/**
+ * Builds read optimized lookup table for IPv4 addresses in a large tree;
+ * the table is dropped on the next insertion until the tree is finalized again;
+ * it does not log, so new trees can be finalized in a helper thread
+ * @param tree
+ */
+void radix_finalize_compressed(radix_compressed_t *tree);
+
 /**
  * Destroy the complete radix trie
  * @param tree
@@ -104,6 +125,13 @@ radix_add_generic_iplist(const char *ip_list,
  */
 gsize radix_get_size(radix_compressed_t *tree);
 
+/**
+ * Returns memory used by the tree: its own pool if any and IPv4 table
+ * @param tree
+ * @return
+ */
+gsize radix_get_memory(radix_compressed_t *tree);
+
 /**
  * Return string that describes this radix tree (memory, nodes, compression etc)
  * @param tree
@@ -37,6 +37,10 @@
 #endif
 
 #include <pcre2.h>
+#ifdef WITH_HYPERSCAN
+#include "hs.h"
+#include "libserver/hyperscan_tools.h"
+#endif
 #define PCRE_T pcre2_code
 #define PCRE_JIT_T pcre2_jit_stack
 #define PCRE_FREE pcre2_code_free
@@ -60,6 +64,11 @@ struct rspamd_regexp_s {
 #else
 	pcre2_match_context *mcontext;
 	pcre2_match_context *raw_mcontext;
+#ifdef WITH_HYPERSCAN
+	/* Database used to find where captures search should start */
+	hs_database_t *hs_db;
+	int hs_state;
+#endif
 #endif
 	regexp_id_t id;
 	ref_entry_t ref;
@@ -75,7 +84,7 @@ struct rspamd_regexp_s {
 
 struct rspamd_regexp_cache {
 	GHashTable *tbl;
-#ifdef HAVE_PCRE_JIT
+#if defined(HAVE_PCRE_JIT) && !defined(WITH_PCRE2)
 	PCRE_JIT_T *jstack;
 #endif
 };
@@ -87,6 +96,111 @@ static const int max_re_cache_size = 8192;
 
 #ifdef WITH_PCRE2
 static pcre2_compile_context *pcre2_ctx = NULL;
+
+#define RSPAMD_REGEXP_JIT_STACK_START (32 * 1024)
+#define RSPAMD_REGEXP_JIT_STACK_INITIAL (1024 * 1024)
+#define RSPAMD_REGEXP_JIT_STACK_MAX (64 * 1024 * 1024)
+
+/*
+ * Match data and JIT stack are reused by all searches in a thread: match data
+ * is sized for the largest number of captures among compiled regexps and JIT
+ * stack is doubled each time a pattern runs out of it
+ */
+struct rspamd_regexp_tls {
+	pcre2_match_data *match_data;
+	unsigned int match_pairs;
+#ifdef HAVE_PCRE_JIT
+	pcre2_jit_stack *jstack;
+	gsize jstack_size;
+#endif
+};
+
+static unsigned int max_match_pairs = 1;
+
+static void
+rspamd_regexp_tls_free(gpointer p)
+{
+	struct rspamd_regexp_tls *tls = (struct rspamd_regexp_tls *) p;
+
+	if (tls->match_data) {
+		pcre2_match_data_free(tls->match_data);
+	}
+#ifdef HAVE_PCRE_JIT
+	if (tls->jstack) {
+		pcre2_jit_stack_free(tls->jstack);
+	}
+#endif
+	g_free(tls);
+}
+
+static GPrivate regexp_tls = G_PRIVATE_INIT(rspamd_regexp_tls_free);
+
+static struct rspamd_regexp_tls *
+rspamd_regexp_get_tls(void)
+{
+	struct rspamd_regexp_tls *tls = g_private_get(&regexp_tls);
+
+	if (G_UNLIKELY(tls == NULL)) {
+		tls = g_malloc0(sizeof(*tls));
+#ifdef HAVE_PCRE_JIT
+		tls->jstack_size = RSPAMD_REGEXP_JIT_STACK_INITIAL;
+#endif
+		g_private_set(&regexp_tls, tls);
+	}
+
+	return tls;
+}
+
+static pcre2_match_data *
+rspamd_regexp_get_match_data(struct rspamd_regexp_tls *tls, unsigned int npairs)
+{
+	if (G_UNLIKELY(tls->match_data == NULL || tls->match_pairs < npairs)) {
+		if (tls->match_data) {
+			pcre2_match_data_free(tls->match_data);
+		}
+
+		tls->match_pairs = MAX(npairs, max_match_pairs);
+		tls->match_data = pcre2_match_data_create(tls->match_pairs, NULL);
+		g_assert(tls->match_data != NULL);
+	}
+
+	return tls->match_data;
+}
+
+#ifdef HAVE_PCRE_JIT
+static pcre2_jit_stack *
+rspamd_regexp_jit_stack_cb(void *unused)
+{
+	struct rspamd_regexp_tls *tls = rspamd_regexp_get_tls();
+
+	if (G_UNLIKELY(tls->jstack == NULL)) {
+		tls->jstack = pcre2_jit_stack_create(RSPAMD_REGEXP_JIT_STACK_START,
+											 tls->jstack_size, NULL);
+	}
+
+	/* NULL means the default 32K stack on the machine stack */
+	return tls->jstack;
+}
+
+static gboolean
+rspamd_regexp_grow_jit_stack(struct rspamd_regexp_tls *tls, const char *pattern)
+{
+	if (tls->jstack_size >= RSPAMD_REGEXP_JIT_STACK_MAX) {
+		return FALSE;
+	}
+
+	if (tls->jstack) {
+		pcre2_jit_stack_free(tls->jstack);
+		tls->jstack = NULL;
+	}
+
+	tls->jstack_size *= 2;
+	msg_info("increase jit stack to %uz bytes for pattern \"%s\"",
+			 tls->jstack_size, pattern);
+
+	return TRUE;
+}
+#endif
 #endif
 
 static GQuark
@@ -149,6 +263,12 @@ rspamd_regexp_dtor(rspamd_regexp_t *re)
 			PCRE_FREE(re->re);
 		}
 
+#if defined(WITH_PCRE2) && defined(WITH_HYPERSCAN)
+		if (re->hs_db) {
+			hs_free_database(re->hs_db);
+		}
+#endif
+
 		if (re->pattern) {
 			g_free(re->pattern);
 		}
@@ -209,7 +329,7 @@ rspamd_regexp_post_process(rspamd_regexp_t *r)
 	}
 
 	if (!(r->flags & RSPAMD_REGEXP_FLAG_DISABLE_JIT)) {
-		pcre2_jit_stack_assign(r->mcontext, NULL, global_re_cache->jstack);
+		pcre2_jit_stack_assign(r->mcontext, rspamd_regexp_jit_stack_cb, NULL);
 	}
 
 	if (r->raw_re && r->re != r->raw_re && !(r->flags & RSPAMD_REGEXP_FLAG_DISABLE_JIT)) {
@@ -224,7 +344,7 @@ rspamd_regexp_post_process(rspamd_regexp_t *r)
 			}
 			else if (!(r->flags & RSPAMD_REGEXP_FLAG_DISABLE_JIT)) {
 				g_assert(r->raw_mcontext != NULL);
-				pcre2_jit_stack_assign(r->raw_mcontext, NULL, global_re_cache->jstack);
+				pcre2_jit_stack_assign(r->raw_mcontext, rspamd_regexp_jit_stack_cb, NULL);
 			}
 		}
 	}
@@ -534,6 +654,10 @@ fin:
 	if (pcre2_pattern_info(res->raw_re, PCRE2_INFO_CAPTURECOUNT,
 						   &ncaptures) == 0) {
 		res->ncaptures = ncaptures;
+
+		if ((unsigned int) ncaptures + 1 > max_match_pairs) {
+			max_match_pairs = ncaptures + 1;
+		}
 	}
 #endif
 
@@ -709,6 +833,132 @@ rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
 	return FALSE;
 }
 #else
+#ifdef WITH_HYPERSCAN
+enum rspamd_regexp_hs_state {
+	RSPAMD_REGEXP_HS_UNKNOWN = 0,
+	RSPAMD_REGEXP_HS_READY,
+	RSPAMD_REGEXP_HS_UNSUPPORTED,
+};
+
+static int
+rspamd_regexp_hs_start_cb(unsigned int id, unsigned long long from,
+						  unsigned long long to, unsigned int flags, void *ud)
+{
+	unsigned long long *pstart = (unsigned long long *) ud;
+
+	if (from < *pstart) {
+		*pstart = from;
+	}
+
+	/* Matches are reported by their ends, so the leftmost start can be anywhere */
+	return 0;
+}
+
+static gboolean
+rspamd_regexp_hs_compile(rspamd_regexp_t *re)
+{
+	hs_compile_error_t *hs_errors = NULL;
+	unsigned int hs_flags = HS_FLAG_SOM_LEFTMOST;
+	char *escaped;
+	gsize esc_len;
+
+	if (re->flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+		return FALSE;
+	}
+
+	if (re->pcre_flags & PCRE_FLAG(UTF)) {
+		hs_flags |= HS_FLAG_UTF8;
+	}
+	if (re->pcre_flags & PCRE_FLAG(CASELESS)) {
+		hs_flags |= HS_FLAG_CASELESS;
+	}
+	if (re->pcre_flags & PCRE_FLAG(MULTILINE)) {
+		hs_flags |= HS_FLAG_MULTILINE;
+	}
+	if (re->pcre_flags & PCRE_FLAG(DOTALL)) {
+		hs_flags |= HS_FLAG_DOTALL;
+	}
+
+	escaped = rspamd_str_regexp_escape(re->pattern, strlen(re->pattern), &esc_len,
+									   RSPAMD_REGEXP_ESCAPE_RE |
+										   ((re->flags & RSPAMD_REGEXP_FLAG_UTF) ? RSPAMD_REGEXP_ESCAPE_UTF : 0));
+
+	if (hs_compile(escaped, hs_flags, HS_MODE_BLOCK, NULL, &re->hs_db,
+				   &hs_errors) != HS_SUCCESS) {
+		msg_debug("cannot use hyperscan for captures of \"%s\": %s",
+				  re->pattern, hs_errors ? hs_errors->message : "unknown error");
+
+		if (hs_errors) {
+			hs_free_compile_error(hs_errors);
+		}
+
+		re->hs_db = NULL;
+		g_free(escaped);
+
+		return FALSE;
+	}
+
+	g_free(escaped);
+
+	if (!rspamd_hyperscan_scratch_reserve(re->hs_db)) {
+		hs_free_database(re->hs_db);
+		re->hs_db = NULL;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Captures require PCRE, but most texts do not match at all:
+ * hyperscan finds the leftmost start of a match (if any) and PCRE starts from
+ * there with the whole subject, so anchors and lookbehinds are not affected.
+ * Returns FALSE if hyperscan cannot be used for this regexp
+ */
+static gboolean
+rspamd_regexp_hs_start(const rspamd_regexp_t *re, const char *text, gsize len,
+					   gboolean *matched, PCRE2_SIZE *start)
+{
+	rspamd_regexp_t *mre = (rspamd_regexp_t *) re;
+	unsigned long long leftmost = G_MAXUINT64;
+	hs_scratch_t *scratch;
+	hs_error_t rc;
+
+	if (G_UNLIKELY(re->hs_state == RSPAMD_REGEXP_HS_UNKNOWN)) {
+		mre->hs_state = rspamd_regexp_hs_compile(mre) ? RSPAMD_REGEXP_HS_READY : RSPAMD_REGEXP_HS_UNSUPPORTED;
+	}
+
+	if (re->hs_state != RSPAMD_REGEXP_HS_READY) {
+		return FALSE;
+	}
+
+	/* Hyperscan behaviour is undefined for invalid utf8 in utf8 mode */
+	if ((re->pcre_flags & PCRE_FLAG(UTF)) && rspamd_fast_utf8_validate(text, len) != 0) {
+		return FALSE;
+	}
+
+	scratch = rspamd_hyperscan_scratch_acquire();
+
+	if (scratch == NULL) {
+		return FALSE;
+	}
+
+	rc = hs_scan(re->hs_db, text, len, 0, scratch, rspamd_regexp_hs_start_cb,
+				 &leftmost);
+	rspamd_hyperscan_scratch_release(scratch);
+
+	if (rc != HS_SUCCESS) {
+		return FALSE;
+	}
+
+	*matched = (leftmost != G_MAXUINT64);
+	*start = *matched ? leftmost : 0;
+
+	return TRUE;
+}
+#endif
+
 /* PCRE 2 version */
 gboolean
 rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
@@ -717,9 +967,10 @@ rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
 {
 	pcre2_match_data *match_data;
 	pcre2_match_context *mcontext;
+	struct rspamd_regexp_tls *tls;
 	PCRE_T *r;
 	const char *mt;
-	PCRE2_SIZE remain = 0, *ovec;
+	PCRE2_SIZE remain = 0, *ovec, start_offset = 0;
 	const PCRE2_SIZE junk = 0xdeadbabeeeeeeeeULL;
 	int rc, match_flags, novec, i;
 	gboolean ret = FALSE;
@@ -769,8 +1020,21 @@ rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
 		return FALSE;
 	}
 
-	match_data = pcre2_match_data_create(re->ncaptures + 1, NULL);
-	novec = pcre2_get_ovector_count(match_data);
+#ifdef WITH_HYPERSCAN
+	if (captures != NULL && mt == text && r == re->re) {
+		gboolean hs_matched;
+
+		if (rspamd_regexp_hs_start(re, mt, remain, &hs_matched, &start_offset) &&
+			!hs_matched) {
+			return FALSE;
+		}
+	}
+#endif
+
+	tls = rspamd_regexp_get_tls();
+	match_data = rspamd_regexp_get_match_data(tls, re->ncaptures + 1);
+	/* Pooled match data can be larger than this regexp needs */
+	novec = MIN(pcre2_get_ovector_count(match_data), re->ncaptures + 1);
 	ovec = pcre2_get_ovector_pointer(match_data);
 
 	/* Fill ovec with crap, so we can stop if actual matches is less than announced */
@@ -786,15 +1050,18 @@ rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
 			return FALSE;
 		}
 
-		rc = pcre2_jit_match(r, mt, remain, 0, match_flags, match_data,
-							 mcontext);
+		do {
+			rc = pcre2_jit_match(r, mt, remain, start_offset, match_flags, match_data,
+								 mcontext);
+		} while (rc == PCRE2_ERROR_JIT_STACKLIMIT &&
+				 rspamd_regexp_grow_jit_stack(tls, re->pattern));
 	}
 	else {
-		rc = pcre2_match(r, mt, remain, 0, match_flags, match_data,
+		rc = pcre2_match(r, mt, remain, start_offset, match_flags, match_data,
 						 mcontext);
 	}
 #else
-	rc = pcre2_match(r, mt, remain, 0, match_flags, match_data,
+	rc = pcre2_match(r, mt, remain, start_offset, match_flags, match_data,
 					 mcontext);
 #endif
 
@@ -846,8 +1113,6 @@ rspamd_regexp_search(const rspamd_regexp_t *re, const char *text, gsize len,
 		}
 	}
 
-	pcre2_match_data_free(match_data);
-
 	return ret;
 }
 #endif
@@ -1024,12 +1289,8 @@ rspamd_regexp_cache_new(void)
 	ncache = g_malloc0(sizeof(*ncache));
 	ncache->tbl = g_hash_table_new_full(rspamd_regexp_hash, rspamd_regexp_equal,
 										NULL, (GDestroyNotify) rspamd_regexp_unref);
-#ifdef HAVE_PCRE_JIT
-#ifdef WITH_PCRE2
-	ncache->jstack = pcre2_jit_stack_create(32 * 1024, 1024 * 1024, NULL);
-#else
+#if defined(HAVE_PCRE_JIT) && !defined(WITH_PCRE2)
 	ncache->jstack = pcre_jit_stack_alloc(32 * 1024, 1024 * 1024);
-#endif
 #endif
 	return ncache;
 }
@@ -1111,16 +1372,10 @@ void rspamd_regexp_cache_destroy(struct rspamd_regexp_cache *cache)
 {
 	if (cache != NULL) {
 		g_hash_table_destroy(cache->tbl);
-#ifdef HAVE_PCRE_JIT
-#ifdef WITH_PCRE2
-		if (cache->jstack) {
-			pcre2_jit_stack_free(cache->jstack);
-		}
-#else
+#if defined(HAVE_PCRE_JIT) && !defined(WITH_PCRE2)
 		if (cache->jstack) {
 			pcre_jit_stack_free(cache->jstack);
 		}
-#endif
 #endif
 		g_free(cache);
 	}
@@ -1351,3 +1606,321 @@ rspamd_regexp_from_glob(const char *gl, gsize sz, GError **err)
 
 	return re;
 }
+
+/*
+ * Skips an escape sequence that is not a literal, `p` points after the backslash
+ */
+static const char *
+rspamd_regexp_skip_escape(const char *p, const char *end)
+{
+	const char *t;
+	char c, term;
+
+	if (p >= end) {
+		return end;
+	}
+
+	c = *p++;
+
+	if (g_ascii_isdigit(c)) {
+		/* Back reference or octal code */
+		while (p < end && g_ascii_isdigit(*p)) {
+			p++;
+		}
+	}
+	else if (c == 'c') {
+		if (p < end) {
+			p++;
+		}
+	}
+	else if (strchr("xopPgkN", c) != NULL && p < end &&
+			 (*p == '{' || *p == '<' || *p == '\'')) {
+		/* Argument as in \x{...}, \p{...}, \k<name> or \g'name' */
+		term = *p == '{' ? '}' : (*p == '<' ? '>' : '\'');
+		t = memchr(p, term, end - p);
+		p = t ? t + 1 : end;
+	}
+	else if (c == 'x') {
+		for (t = p + 2; p < end && p < t && g_ascii_isxdigit(*p); p++) {}
+	}
+	else if (c == 'p' || c == 'P') {
+		if (p < end) {
+			p++;
+		}
+	}
+
+	return p;
+}
+
+/*
+ * Skips a character class, `p` points after the opening bracket
+ */
+static const char *
+rspamd_regexp_skip_class(const char *p, const char *end)
+{
+	if (p < end && *p == '^') {
+		p++;
+	}
+
+	if (p < end && *p == ']') {
+		/* Leading bracket is a literal */
+		p++;
+	}
+
+	while (p < end) {
+		if (*p == '\\') {
+			p += 2;
+		}
+		else if (*p == '[' && p + 1 < end && p[1] == ':') {
+			/* POSIX class like [:alpha:] */
+			p += 2;
+
+			while (p + 1 < end && !(p[0] == ':' && p[1] == ']')) {
+				p++;
+			}
+
+			p += 2;
+		}
+		else if (*p == ']') {
+			return p + 1;
+		}
+		else {
+			p++;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Skips a group, `p` points after the opening parenthesis
+ */
+static const char *
+rspamd_regexp_skip_group(const char *p, const char *end)
+{
+	int depth = 1;
+
+	while (p < end) {
+		if (*p == '\\') {
+			p += 2;
+			continue;
+		}
+		else if (*p == '[') {
+			p = rspamd_regexp_skip_class(p + 1, end);
+
+			if (p == NULL) {
+				return NULL;
+			}
+
+			continue;
+		}
+		else if (*p == '(') {
+			depth++;
+		}
+		else if (*p == ')') {
+			if (--depth == 0) {
+				return p + 1;
+			}
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Skips a quantifier if any and sets `optional` if it allows zero repeats
+ */
+static const char *
+rspamd_regexp_skip_quantifier(const char *p, const char *end, gboolean *optional)
+{
+	const char *t;
+
+	*optional = FALSE;
+
+	if (p >= end) {
+		return p;
+	}
+
+	switch (*p) {
+	case '*':
+	case '?':
+		*optional = TRUE;
+		p++;
+		break;
+	case '+':
+		p++;
+		break;
+	case '{':
+		if (p + 1 < end && (g_ascii_isdigit(p[1]) || p[1] == ',')) {
+			*optional = strtoul(p + 1, NULL, 10) == 0;
+			t = memchr(p, '}', end - p);
+			p = t ? t + 1 : end;
+		}
+		else {
+			/* Not a quantifier */
+			return p;
+		}
+		break;
+	default:
+		return p;
+	}
+
+	/* Lazy or possessive quantifier */
+	if (p < end && (*p == '?' || *p == '+')) {
+		p++;
+	}
+
+	return p;
+}
+
+char *
+rspamd_regexp_get_required_literal(const rspamd_regexp_t *re, gsize *plen,
+								   gboolean *picase)
+{
+	const char *p, *end, *t;
+	char *cur, *best;
+	gsize curlen = 0, bestlen = 0;
+	gboolean icase, is_char, optional;
+
+	g_assert(re != NULL);
+
+	p = re->pattern;
+	end = p + strlen(p);
+	icase = !!(re->pcre_flags & PCRE_FLAG(CASELESS));
+
+	if (re->pcre_flags & PCRE_FLAG(EXTENDED)) {
+		return NULL;
+	}
+
+	/* Inline options are applied to the whole pattern for simplicity */
+	for (t = p; t < end; t++) {
+		if (*t == '\\') {
+			if (t + 1 < end && (t[1] == 'Q' || t[1] == 'E')) {
+				return NULL;
+			}
+
+			t++;
+		}
+		else if (*t == '(' && t + 1 < end && t[1] == '?') {
+			for (t += 2; t < end && (g_ascii_isalpha(*t) || *t == '-' || *t == '^'); t++) {
+				if (*t == 'x') {
+					return NULL;
+				}
+				else if (*t == 'i') {
+					icase = TRUE;
+				}
+			}
+
+			if (t < end && *t == '#') {
+				/* Comments can contain anything */
+				return NULL;
+			}
+
+			t--;
+		}
+	}
+
+	cur = g_malloc(end - p + 1);
+	best = g_malloc(end - p + 1);
+
+	while (p < end) {
+		is_char = FALSE;
+
+		switch (*p) {
+		case '\\':
+			if (p + 1 < end && !g_ascii_isalnum(p[1]) && !(p[1] & 0x80)) {
+				/* Escaped punctuation */
+				cur[curlen++] = p[1];
+				is_char = TRUE;
+				p += 2;
+			}
+			else {
+				p = rspamd_regexp_skip_escape(p + 1, end);
+			}
+			break;
+		case '[':
+			p = rspamd_regexp_skip_class(p + 1, end);
+			break;
+		case '(':
+			p = rspamd_regexp_skip_group(p + 1, end);
+			break;
+		case '|':
+		case ')':
+			/* Top level alternation or broken pattern, nothing is required */
+			p = NULL;
+			break;
+		case '.':
+		case '^':
+		case '$':
+		case ']':
+		case '{':
+		case '}':
+		case '*':
+		case '+':
+		case '?':
+			p++;
+			break;
+		default:
+			if (*p & 0x80) {
+				/* Quantifiers are applied to the whole UTF8 character */
+				p++;
+			}
+			else {
+				cur[curlen++] = *p++;
+				is_char = TRUE;
+			}
+			break;
+		}
+
+		if (p == NULL) {
+			g_free(cur);
+			g_free(best);
+
+			return NULL;
+		}
+
+		t = rspamd_regexp_skip_quantifier(p, end, &optional);
+
+		if (is_char && t != p && optional) {
+			curlen--;
+		}
+
+		/* Characters after a quantifier are not adjacent to the previous ones */
+		if (!is_char || t != p) {
+			if (curlen > bestlen) {
+				memcpy(best, cur, curlen);
+				bestlen = curlen;
+			}
+
+			curlen = 0;
+		}
+
+		p = t;
+	}
+
+	if (curlen > bestlen) {
+		memcpy(best, cur, curlen);
+		bestlen = curlen;
+	}
+
+	g_free(cur);
+
+	if (bestlen == 0) {
+		g_free(best);
+
+		return NULL;
+	}
+
+	best[bestlen] = '\0';
+
+	if (icase) {
+		rspamd_str_lc(best, bestlen);
+	}
+
+	*plen = bestlen;
+	*picase = icase;
+
+	return best;
+}
@@ -269,6 +269,17 @@ void rspamd_regexp_library_init(struct rspamd_config *cfg);
  */
 rspamd_regexp_t *rspamd_regexp_from_glob(const char *gl, gsize sz, GError **err);
 
+/**
+ * Returns the longest literal that must be present in any text matched
+ * by the regexp (lowercased if the match is case insensitive) or NULL
+ * @param re regexp
+ * @param plen output length of the literal
+ * @param picase output TRUE if the literal should be matched ignoring case
+ * @return allocated string to be freed with g_free
+ */
+char *rspamd_regexp_get_required_literal(const rspamd_regexp_t *re, gsize *plen,
+										 gboolean *picase);
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,10 +18,19 @@
 #include "cryptobox.h"
 #include "images.h"
 #include "libstat/stat_api.h"
+#include "shingles_private.h"
+#define XXH_INLINE_ALL
+#define XXH_PRIVATE_API
+#include "xxhash.h"
 
-#define SHINGLES_WINDOW 3
 #define SHINGLES_KEY_SIZE rspamd_cryptobox_SIPKEYBYTES
 
+extern unsigned cpu_config;
+
+#define SHINGLES_LANES_SUFFIX ref
+#define SHINGLES_LANES_TARGET
+#include "shingles_lanes.inc"
+
 static unsigned int
 rspamd_shingles_keys_hash(gconstpointer k)
 {
@@ -111,6 +120,60 @@ rspamd_shingles_get_keys_cached(const unsigned char key[SHINGLES_KEY_SIZE])
 	return keys;
 }
 
+/* There is no lanes version of mum hash, so it just iterates over seeds */
+static void
+rspamd_shingles_mum_lanes(struct rspamd_shingles_lanes *l,
+						  const unsigned char *data, gsize len)
+{
+	uint64_t h[RSPAMD_SHINGLE_SIZE];
+	unsigned int i;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		h[i] = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_MUMHASH,
+												   data, len, l->seeds[i]);
+	}
+
+	shingles_lanes_push_ref(l, h);
+}
+
+static rspamd_shingles_lanes_func
+rspamd_shingles_lanes_init(struct rspamd_shingles_lanes *l,
+						   unsigned char **keys,
+						   unsigned int window_len,
+						   enum rspamd_shingle_alg alg)
+{
+	unsigned int i;
+
+	memset(l, 0, sizeof(*l));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		memcpy(&l->seeds[i], keys[i], sizeof(l->seeds[i]));
+		l->min[i] = G_MAXUINT64;
+	}
+
+	l->secret = XXH3_kSecret;
+	l->window_len = window_len;
+
+	switch (alg) {
+	case RSPAMD_SHINGLES_XXHASH:
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+		if (cpu_config & CPUID_AVX2) {
+			return rspamd_shingles_xxh64_lanes_avx2;
+		}
+#endif
+		return rspamd_shingles_xxh64_lanes_ref;
+	case RSPAMD_SHINGLES_MUMHASH:
+		return rspamd_shingles_mum_lanes;
+	default:
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+		if (cpu_config & CPUID_AVX2) {
+			return rspamd_shingles_xxh3_lanes_avx2;
+		}
+#endif
+		return rspamd_shingles_xxh3_lanes_ref;
+	}
+}
+
 struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 	rspamd_shingles_from_text(GArray *input,
 							  const unsigned char key[16],
@@ -120,14 +183,19 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 							  enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *res;
-	uint64_t **hashes;
+	uint64_t **hashes = NULL;
 	unsigned char **keys;
 	rspamd_fstring_t *row;
 	rspamd_stat_token_t *word;
 	uint64_t val;
-	int i, j, k;
+	int i, j;
 	gsize hlen, ilen = 0, beg = 0, widx = 0;
-	enum rspamd_cryptobox_fast_hash_type ht;
+	/*
+	 * With the default filter there is no need to store all hashes, as
+	 * lanes kernels keep the minimum of each shingle
+	 */
+	gboolean keep_hashes = alg == RSPAMD_SHINGLES_OLD ||
+						   filter != rspamd_shingles_default_filter;
 
 	if (pool != NULL) {
 		res = rspamd_mempool_alloc(pool, sizeof(*res));
@@ -147,12 +215,15 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 	}
 
 	/* Init hashes pipes and keys */
-	hashes = g_malloc(sizeof(*hashes) * RSPAMD_SHINGLE_SIZE);
 	hlen = ilen > SHINGLES_WINDOW ? (ilen - SHINGLES_WINDOW + 1) : 1;
 	keys = rspamd_shingles_get_keys_cached(key);
 
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		hashes[i] = g_malloc(hlen * sizeof(uint64_t));
+	if (keep_hashes) {
+		hashes = g_malloc(sizeof(*hashes) * RSPAMD_SHINGLE_SIZE);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			hashes[i] = g_malloc(hlen * sizeof(uint64_t));
+		}
 	}
 
 	/* Now parse input words into a vector of hashes using rolling window */
@@ -210,90 +281,76 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 		}
 	}
 	else {
-		uint64_t window[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
-
-		switch (alg) {
-		case RSPAMD_SHINGLES_XXHASH:
-			ht = RSPAMD_CRYPTOBOX_XXHASH64;
-			break;
-		case RSPAMD_SHINGLES_MUMHASH:
-			ht = RSPAMD_CRYPTOBOX_MUMHASH;
-			break;
-		default:
-			ht = RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT;
-			break;
-		}
+		struct rspamd_shingles_lanes lanes;
+		rspamd_shingles_lanes_func lanes_func;
+
+		lanes_func = rspamd_shingles_lanes_init(&lanes, keys, SHINGLES_WINDOW, alg);
 
-		memset(window, 0, sizeof(window));
 		for (i = 0; i <= ilen; i++) {
 			if (i - beg >= SHINGLES_WINDOW || i == ilen) {
+				word = NULL;
 
-				for (j = 0; j < RSPAMD_SHINGLE_SIZE; j++) {
-					/* Shift hashes window to right */
-					for (k = 0; k < SHINGLES_WINDOW - 1; k++) {
-						window[j * SHINGLES_WINDOW + k] =
-							window[j * SHINGLES_WINDOW + k + 1];
-					}
-
-					word = NULL;
-
-					while (widx < input->len) {
-						word = &g_array_index(input, rspamd_stat_token_t, widx);
+				while (widx < input->len) {
+					word = &g_array_index(input, rspamd_stat_token_t, widx);
 
-						if ((word->flags & RSPAMD_STAT_TOKEN_FLAG_SKIPPED) || word->stemmed.len == 0) {
-							widx++;
-						}
-						else {
-							break;
-						}
+					if ((word->flags & RSPAMD_STAT_TOKEN_FLAG_SKIPPED) || word->stemmed.len == 0) {
+						widx++;
 					}
+					else {
+						break;
+					}
+				}
 
-					if (word == NULL) {
-						/* Nothing but exceptions */
+				if (word == NULL) {
+					/* Nothing but exceptions */
+					if (hashes) {
 						for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
 							g_free(hashes[i]);
 						}
 
-						if (pool == NULL) {
-							g_free(res);
-						}
-
 						g_free(hashes);
-						rspamd_fstring_free(row);
-
-						return NULL;
 					}
 
-					/* Insert the last element to the pipe */
-					memcpy(&seed, keys[j], sizeof(seed));
-					window[j * SHINGLES_WINDOW + SHINGLES_WINDOW - 1] =
-						rspamd_cryptobox_fast_hash_specific(ht,
-															word->stemmed.begin, word->stemmed.len,
-															seed);
-					val = 0;
-					for (k = 0; k < SHINGLES_WINDOW; k++) {
-						val ^= window[j * SHINGLES_WINDOW + k] >>
-							   (8 * (SHINGLES_WINDOW - k - 1));
+					if (pool == NULL) {
+						g_free(res);
 					}
 
-					g_assert(hlen > beg);
-					hashes[j][beg] = val;
+					rspamd_fstring_free(row);
+
+					return NULL;
+				}
+
+				/* Hash the word with all keys and shift all windows at once */
+				lanes_func(&lanes, (const unsigned char *) word->stemmed.begin,
+						   word->stemmed.len);
+				g_assert(hlen > beg);
+
+				if (hashes) {
+					for (j = 0; j < RSPAMD_SHINGLE_SIZE; j++) {
+						hashes[j][beg] = lanes.val[j];
+					}
 				}
 
 				beg++;
 				widx++;
 			}
 		}
+
+		if (!hashes) {
+			memcpy(res->hashes, lanes.min, sizeof(res->hashes));
+		}
 	}
 
 	/* Now we need to filter all hashes and make a shingles result */
-	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-		res->hashes[i] = filter(hashes[i], hlen,
-								i, key, filterd);
-		g_free(hashes[i]);
-	}
+	if (hashes) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			res->hashes[i] = filter(hashes[i], hlen,
+									i, key, filterd);
+			g_free(hashes[i]);
+		}
 
-	g_free(hashes);
+		g_free(hashes);
+	}
 
 	rspamd_fstring_free(row);
 
@@ -309,14 +366,13 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 							   enum rspamd_shingle_alg alg)
 {
 	struct rspamd_shingle *shingle;
+	struct rspamd_shingles_lanes lanes;
+	rspamd_shingles_lanes_func lanes_func;
 	uint64_t **hashes;
 	unsigned char **keys;
 	uint64_t d;
-	uint64_t val;
 	int i, j;
 	gsize hlen, beg = 0;
-	enum rspamd_cryptobox_fast_hash_type ht;
-	uint64_t res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
 
 	if (pool != NULL) {
 		shingle = rspamd_mempool_alloc(pool, sizeof(*shingle));
@@ -334,40 +390,21 @@ struct rspamd_shingle *RSPAMD_OPTIMIZE("unroll-loops")
 		hashes[i] = g_malloc(hlen * sizeof(uint64_t));
 	}
 
-	switch (alg) {
-	case RSPAMD_SHINGLES_OLD:
-		ht = RSPAMD_CRYPTOBOX_MUMHASH;
-		break;
-	case RSPAMD_SHINGLES_XXHASH:
-		ht = RSPAMD_CRYPTOBOX_XXHASH64;
-		break;
-	case RSPAMD_SHINGLES_MUMHASH:
-		ht = RSPAMD_CRYPTOBOX_MUMHASH;
-		break;
-	default:
-		ht = RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT;
-		break;
-	}
+	/* Old algorithm used mum hash for images */
+	lanes_func = rspamd_shingles_lanes_init(&lanes, keys, 1,
+											alg == RSPAMD_SHINGLES_OLD ? RSPAMD_SHINGLES_MUMHASH : alg);
 
-	memset(res, 0, sizeof(res));
-#define INNER_CYCLE_SHINGLES(s, e)                               \
-	for (j = (s); j < (e); j++) {                                \
-		d = dct[beg];                                            \
-		memcpy(&seed, keys[j], sizeof(seed));                    \
-		val = rspamd_cryptobox_fast_hash_specific(ht,            \
-												  &d, sizeof(d), \
-												  seed);         \
-		hashes[j][beg] = val;                                    \
-	}
 	for (i = 0; i < RSPAMD_DCT_LEN / NBBY; i++) {
-		INNER_CYCLE_SHINGLES(0, RSPAMD_SHINGLE_SIZE / 4);
-		INNER_CYCLE_SHINGLES(RSPAMD_SHINGLE_SIZE / 4, RSPAMD_SHINGLE_SIZE / 2);
-		INNER_CYCLE_SHINGLES(RSPAMD_SHINGLE_SIZE / 2, 3 * RSPAMD_SHINGLE_SIZE / 4);
-		INNER_CYCLE_SHINGLES(3 * RSPAMD_SHINGLE_SIZE / 4, RSPAMD_SHINGLE_SIZE);
+		d = dct[beg];
+		lanes_func(&lanes, (const unsigned char *) &d, sizeof(d));
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j++) {
+			hashes[j][beg] = lanes.val[j];
+		}
 
 		beg++;
 	}
-#undef INNER_CYCLE_SHINGLES
+
 	/* Now we need to filter all hashes and make a shingles result */
 	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
 		shingle->hashes[i] = filter(hashes[i], hlen,
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "shingles_private.h"
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+/* 4 lanes per ymm register, 32 lanes are 8 registers per operation */
+#define SHINGLES_LANES_SUFFIX avx2
+#define SHINGLES_LANES_TARGET __attribute__((__target__("avx2")))
+#include "shingles_lanes.inc"
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RSPAMD_SHINGLES_PRIVATE_H
+#define RSPAMD_SHINGLES_PRIVATE_H
+
+#include "config.h"
+#include "shingles.h"
+#include "cryptobox.h"
+/* HAVE_AVX2 is defined there, it guards the lanes kernels declared below */
+#include "platform_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHINGLES_WINDOW 3
+
+/*
+ * State of the lanes kernels: every lane corresponds to a single shingle
+ * (and a single seed), all arrays are lane major so that each step over
+ * all shingles is a set of plain vector operations
+ */
+struct rspamd_shingles_lanes {
+	uint64_t seeds[RSPAMD_SHINGLE_SIZE];
+	uint64_t window[SHINGLES_WINDOW][RSPAMD_SHINGLE_SIZE];
+	/* Value of the current window */
+	uint64_t val[RSPAMD_SHINGLE_SIZE];
+	/* Running minimum of all window values */
+	uint64_t min[RSPAMD_SHINGLE_SIZE];
+	/* XXH3 default secret */
+	const unsigned char *secret;
+	/* Number of hashes in a window, 1 means no window */
+	unsigned int window_len;
+};
+
+/*
+ * Hashes data with all seeds, pushes hashes to the window and updates
+ * `val` and `min` of each lane
+ */
+typedef void (*rspamd_shingles_lanes_func)(struct rspamd_shingles_lanes *l,
+										   const unsigned char *data, gsize len);
+
+void rspamd_shingles_xxh64_lanes_ref(struct rspamd_shingles_lanes *l,
+									 const unsigned char *data, gsize len);
+void rspamd_shingles_xxh3_lanes_ref(struct rspamd_shingles_lanes *l,
+									const unsigned char *data, gsize len);
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+void rspamd_shingles_xxh64_lanes_avx2(struct rspamd_shingles_lanes *l,
+									  const unsigned char *data, gsize len);
+void rspamd_shingles_xxh3_lanes_avx2(struct rspamd_shingles_lanes *l,
+									 const unsigned char *data, gsize len);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
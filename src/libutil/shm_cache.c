@@ -0,0 +1,483 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "shm_cache.h"
+#include "cryptobox.h"
+#include "ottery.h"
+#include "unix-std.h"
+#include "contrib/uthash/utlist.h"
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+/* Slots per bucket, the first one is the admission window */
+#define SHM_CACHE_WAYS 4
+#define SHM_CACHE_MAX_READ_RETRIES 64
+/* A refresh claim that has not been followed by an insert expires after this time */
+#define SHM_CACHE_REFRESH_TIMEOUT 10
+/* Frequency sketch: rows, saturation value and number of additions per entry before aging */
+#define SHM_CACHE_SKETCH_ROWS 4
+#define SHM_CACHE_SKETCH_MAX 15
+#define SHM_CACHE_SKETCH_SAMPLE 10
+
+struct rspamd_shm_cache_slot {
+	uint32_t seq;     /* odd whilst the slot is being modified */
+	uint32_t refresh; /* time when refresh has been claimed, zero if not claimed */
+	uint64_t hash;
+	double inserted;
+	double expire;
+	uint32_t keylen;
+	uint32_t valuelen;
+	/* Key and value follow */
+};
+
+/* Placed in the beginning of the shared map */
+struct rspamd_shm_cache_hdr {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	uint64_t rejects;
+	uint64_t additions;
+};
+
+struct rspamd_shm_cache_s {
+	unsigned char *map;
+	struct rspamd_shm_cache_hdr *hdr;
+	uint8_t *sketch;
+	unsigned char *slots;
+	gsize len;
+	gsize stride;
+	gsize max_value;
+	unsigned int nbuckets;
+	unsigned int sketch_mask;
+	double refresh_ratio;
+	uint64_t seed;
+	char *name;
+	struct rspamd_shm_cache_s *prev, *next;
+};
+
+/* All caches of the process, they are inherited by workers on fork */
+static rspamd_shm_cache_t *shm_caches = NULL;
+
+static inline struct rspamd_shm_cache_slot *
+rspamd_shm_cache_slot(rspamd_shm_cache_t *c, unsigned int bucket, unsigned int way)
+{
+	return (struct rspamd_shm_cache_slot *) (c->slots +
+											 ((gsize) bucket * SHM_CACHE_WAYS + way) * c->stride);
+}
+
+static inline unsigned char *
+rspamd_shm_cache_slot_data(struct rspamd_shm_cache_slot *slot)
+{
+	return ((unsigned char *) slot) + sizeof(*slot);
+}
+
+/*
+ * TinyLFU frequency sketch: count-min of small saturating counters shared by
+ * all processes. Updates are relaxed and might be lost on races, which is
+ * fine for an estimation. All counters are halved once there have been
+ * enough additions, so the sketch follows recent popularity.
+ */
+static inline unsigned int
+rspamd_shm_cache_sketch_idx(rspamd_shm_cache_t *c, uint64_t h, unsigned int row)
+{
+	uint64_t x = h + (uint64_t) row * 0x9E3779B97F4A7C15ULL;
+
+	x ^= x >> 29;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 32;
+
+	return row * (c->sketch_mask + 1) + (unsigned int) (x & c->sketch_mask);
+}
+
+static unsigned int
+rspamd_shm_cache_sketch_estimate(rspamd_shm_cache_t *c, uint64_t h)
+{
+	unsigned int i, cnt, res = SHM_CACHE_SKETCH_MAX;
+
+	for (i = 0; i < SHM_CACHE_SKETCH_ROWS; i++) {
+		cnt = __atomic_load_n(&c->sketch[rspamd_shm_cache_sketch_idx(c, h, i)],
+							  __ATOMIC_RELAXED);
+		res = MIN(res, cnt);
+	}
+
+	return res;
+}
+
+static void
+rspamd_shm_cache_sketch_add(rspamd_shm_cache_t *c, uint64_t h)
+{
+	unsigned int i, idx, min = rspamd_shm_cache_sketch_estimate(c, h);
+	uint64_t additions;
+
+	if (min >= SHM_CACHE_SKETCH_MAX) {
+		return;
+	}
+
+	/* Conservative update: increase only the minimal counters */
+	for (i = 0; i < SHM_CACHE_SKETCH_ROWS; i++) {
+		idx = rspamd_shm_cache_sketch_idx(c, h, i);
+
+		if (__atomic_load_n(&c->sketch[idx], __ATOMIC_RELAXED) == min) {
+			__atomic_store_n(&c->sketch[idx], min + 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	additions = __atomic_add_fetch(&c->hdr->additions, 1, __ATOMIC_RELAXED);
+
+	if (additions == (uint64_t) rspamd_shm_cache_capacity(c) * SHM_CACHE_SKETCH_SAMPLE) {
+		gsize j, nctrs = (gsize) (c->sketch_mask + 1) * SHM_CACHE_SKETCH_ROWS;
+
+		for (j = 0; j < nctrs; j++) {
+			__atomic_store_n(&c->sketch[j],
+							 __atomic_load_n(&c->sketch[j], __ATOMIC_RELAXED) >> 1,
+							 __ATOMIC_RELAXED);
+		}
+
+		__atomic_store_n(&c->hdr->additions, 0, __ATOMIC_RELAXED);
+	}
+}
+
+static inline gboolean
+rspamd_shm_cache_slot_lock(struct rspamd_shm_cache_slot *slot, uint32_t *pseq)
+{
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	/* Another process is writing this slot */
+	if ((seq & 1u) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq | 1u, FALSE,
+												   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return FALSE;
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	*pseq = seq;
+
+	return TRUE;
+}
+
+static inline void
+rspamd_shm_cache_slot_unlock(struct rspamd_shm_cache_slot *slot, uint32_t seq)
+{
+	__atomic_store_n(&slot->seq, (seq | 1u) + 1, __ATOMIC_RELEASE);
+}
+
+rspamd_shm_cache_t *
+rspamd_shm_cache_new(const char *name, unsigned int nelts, gsize max_value,
+					 double refresh_ratio)
+{
+	rspamd_shm_cache_t *c;
+	void *map;
+	gsize stride, len, hdr_len, sketch_len;
+	unsigned int nbuckets, sketch_width;
+
+	g_assert(nelts > 0 && max_value > 0);
+
+	nbuckets = (nelts + SHM_CACHE_WAYS - 1) / SHM_CACHE_WAYS;
+	stride = sizeof(struct rspamd_shm_cache_slot) + RSPAMD_SHM_CACHE_MAX_KEY + max_value;
+	stride = (stride + 7) & ~((gsize) 7);
+
+	/* One counter per entry in each row, rounded up to the power of two */
+	sketch_width = 1;
+	while (sketch_width < nbuckets * SHM_CACHE_WAYS) {
+		sketch_width <<= 1;
+	}
+
+	hdr_len = (sizeof(struct rspamd_shm_cache_hdr) + 63) & ~((gsize) 63);
+	sketch_len = ((gsize) sketch_width * SHM_CACHE_SKETCH_ROWS + 63) & ~((gsize) 63);
+	len = hdr_len + sketch_len + stride * nbuckets * SHM_CACHE_WAYS;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* Anonymous mapping is zero filled, so all slots and counters are empty */
+	c = g_malloc0(sizeof(*c));
+	c->map = map;
+	c->hdr = map;
+	c->sketch = c->map + hdr_len;
+	c->slots = c->map + hdr_len + sketch_len;
+	c->sketch_mask = sketch_width - 1;
+	c->len = len;
+	c->stride = stride;
+	c->max_value = max_value;
+	c->nbuckets = nbuckets;
+	c->refresh_ratio = refresh_ratio;
+	c->seed = ottery_rand_uint64();
+	c->name = g_strdup(name);
+	DL_APPEND(shm_caches, c);
+
+	return c;
+}
+
+enum rspamd_shm_cache_result
+rspamd_shm_cache_lookup(rspamd_shm_cache_t *c,
+						const void *key, gsize keylen,
+						double now,
+						void *value, gsize *valuelen,
+						double *inserted, double *expire)
+{
+	struct rspamd_shm_cache_slot *slot, cur;
+	uint64_t h;
+	uint32_t s1, s2;
+	unsigned int bucket, i, j;
+	gboolean found;
+
+	if (keylen > RSPAMD_SHM_CACHE_MAX_KEY) {
+		return RSPAMD_SHM_CACHE_MISS;
+	}
+
+	h = rspamd_cryptobox_fast_hash(key, keylen, c->seed);
+	bucket = h % c->nbuckets;
+	rspamd_shm_cache_sketch_add(c, h);
+
+	for (i = 0; i < SHM_CACHE_WAYS; i++) {
+		slot = rspamd_shm_cache_slot(c, bucket, i);
+
+		if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != h) {
+			continue;
+		}
+
+		found = FALSE;
+
+		for (j = 0; j < SHM_CACHE_MAX_READ_RETRIES; j++) {
+			s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+			if (s1 & 1u) {
+				continue;
+			}
+
+			memcpy(&cur, slot, sizeof(cur));
+			found = cur.hash == h && cur.keylen == keylen &&
+					cur.valuelen <= c->max_value && cur.expire > now &&
+					memcmp(rspamd_shm_cache_slot_data(slot), key, keylen) == 0;
+
+			if (found) {
+				memcpy(value, rspamd_shm_cache_slot_data(slot) + RSPAMD_SHM_CACHE_MAX_KEY,
+					   cur.valuelen);
+			}
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+			if (s1 == s2) {
+				break;
+			}
+
+			found = FALSE;
+		}
+
+		if (!found) {
+			continue;
+		}
+
+		*valuelen = cur.valuelen;
+		__atomic_add_fetch(&c->hdr->hits, 1, __ATOMIC_RELAXED);
+
+		if (inserted) {
+			*inserted = cur.inserted;
+		}
+		if (expire) {
+			*expire = cur.expire;
+		}
+
+		if (c->refresh_ratio > 0 &&
+			cur.expire - now < (cur.expire - cur.inserted) * c->refresh_ratio) {
+			uint32_t claim = __atomic_load_n(&slot->refresh, __ATOMIC_RELAXED);
+			uint32_t ts = (uint32_t) now;
+
+			if ((claim == 0 || ts - claim > SHM_CACHE_REFRESH_TIMEOUT) &&
+				__atomic_compare_exchange_n(&slot->refresh, &claim, ts, FALSE,
+											__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				return RSPAMD_SHM_CACHE_HIT_REFRESH;
+			}
+		}
+
+		return RSPAMD_SHM_CACHE_HIT;
+	}
+
+	__atomic_add_fetch(&c->hdr->misses, 1, __ATOMIC_RELAXED);
+
+	return RSPAMD_SHM_CACHE_MISS;
+}
+
+static void
+rspamd_shm_cache_slot_fill(struct rspamd_shm_cache_slot *slot,
+						   uint64_t h,
+						   const void *key, gsize keylen,
+						   const void *value, gsize valuelen,
+						   double now, unsigned int ttl)
+{
+	slot->hash = h;
+	slot->inserted = now;
+	slot->expire = now + ttl;
+	slot->keylen = keylen;
+	slot->valuelen = valuelen;
+	memcpy(rspamd_shm_cache_slot_data(slot), key, keylen);
+	memcpy(rspamd_shm_cache_slot_data(slot) + RSPAMD_SHM_CACHE_MAX_KEY, value, valuelen);
+	__atomic_store_n(&slot->refresh, 0, __ATOMIC_RELAXED);
+}
+
+gboolean
+rspamd_shm_cache_insert(rspamd_shm_cache_t *c,
+						const void *key, gsize keylen,
+						const void *value, gsize valuelen,
+						double now, unsigned int ttl)
+{
+	struct rspamd_shm_cache_slot *slot, *victim = NULL, *window;
+	uint64_t h;
+	uint32_t seq, victim_seq;
+	unsigned int bucket, i, freq, victim_freq = 0;
+
+	if (keylen > RSPAMD_SHM_CACHE_MAX_KEY || valuelen > c->max_value || ttl == 0) {
+		return FALSE;
+	}
+
+	h = rspamd_cryptobox_fast_hash(key, keylen, c->seed);
+	bucket = h % c->nbuckets;
+
+	/*
+	 * Prefer a slot with the same hash, then any expired one; the choice is
+	 * racy but any slot is fine for a cache
+	 */
+	for (i = 0; i < SHM_CACHE_WAYS; i++) {
+		slot = rspamd_shm_cache_slot(c, bucket, i);
+
+		if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == h) {
+			victim = slot;
+			break;
+		}
+
+		if (victim == NULL && slot->expire <= now) {
+			victim = slot;
+		}
+	}
+
+	if (victim != NULL) {
+		if (!rspamd_shm_cache_slot_lock(victim, &seq)) {
+			return FALSE;
+		}
+
+		rspamd_shm_cache_slot_fill(victim, h, key, keylen, value, valuelen, now, ttl);
+		rspamd_shm_cache_slot_unlock(victim, seq);
+		__atomic_add_fetch(&c->hdr->inserts, 1, __ATOMIC_RELAXED);
+
+		return TRUE;
+	}
+
+	/*
+	 * Bucket is full of live entries (W-TinyLFU): a new entry always goes to
+	 * the window slot, and the entry it replaces is promoted to the main slots
+	 * only if it is used more often than the least frequent main entry there
+	 */
+	window = rspamd_shm_cache_slot(c, bucket, 0);
+
+	for (i = 1; i < SHM_CACHE_WAYS; i++) {
+		slot = rspamd_shm_cache_slot(c, bucket, i);
+		freq = rspamd_shm_cache_sketch_estimate(c,
+												__atomic_load_n(&slot->hash, __ATOMIC_RELAXED));
+
+		if (victim == NULL || freq < victim_freq ||
+			(freq == victim_freq && slot->expire < victim->expire)) {
+			victim = slot;
+			victim_freq = freq;
+		}
+	}
+
+	if (!rspamd_shm_cache_slot_lock(window, &seq)) {
+		return FALSE;
+	}
+
+	freq = rspamd_shm_cache_sketch_estimate(c, window->hash);
+
+	if (freq > victim_freq) {
+		if (!rspamd_shm_cache_slot_lock(victim, &victim_seq)) {
+			rspamd_shm_cache_slot_unlock(window, seq);
+
+			return FALSE;
+		}
+
+		victim->hash = window->hash;
+		victim->inserted = window->inserted;
+		victim->expire = window->expire;
+		victim->keylen = window->keylen;
+		victim->valuelen = window->valuelen;
+		memcpy(rspamd_shm_cache_slot_data(victim), rspamd_shm_cache_slot_data(window),
+			   window->keylen);
+		memcpy(rspamd_shm_cache_slot_data(victim) + RSPAMD_SHM_CACHE_MAX_KEY,
+			   rspamd_shm_cache_slot_data(window) + RSPAMD_SHM_CACHE_MAX_KEY,
+			   window->valuelen);
+		__atomic_store_n(&victim->refresh, 0, __ATOMIC_RELAXED);
+		rspamd_shm_cache_slot_unlock(victim, victim_seq);
+	}
+	else {
+		/* Window entry is not popular enough to replace anything */
+		__atomic_add_fetch(&c->hdr->rejects, 1, __ATOMIC_RELAXED);
+	}
+
+	rspamd_shm_cache_slot_fill(window, h, key, keylen, value, valuelen, now, ttl);
+	rspamd_shm_cache_slot_unlock(window, seq);
+	__atomic_add_fetch(&c->hdr->inserts, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->hdr->evictions, 1, __ATOMIC_RELAXED);
+
+	return TRUE;
+}
+
+void rspamd_shm_cache_stat(rspamd_shm_cache_t *c, struct rspamd_shm_cache_stat *st)
+{
+	st->hits = __atomic_load_n(&c->hdr->hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&c->hdr->misses, __ATOMIC_RELAXED);
+	st->inserts = __atomic_load_n(&c->hdr->inserts, __ATOMIC_RELAXED);
+	st->evictions = __atomic_load_n(&c->hdr->evictions, __ATOMIC_RELAXED);
+	st->rejects = __atomic_load_n(&c->hdr->rejects, __ATOMIC_RELAXED);
+}
+
+void rspamd_shm_cache_foreach(rspamd_shm_cache_foreach_cb cb, void *ud)
+{
+	rspamd_shm_cache_t *c;
+
+	DL_FOREACH(shm_caches, c)
+	{
+		cb(c->name, c, ud);
+	}
+}
+
+gsize
+rspamd_shm_cache_max_value(rspamd_shm_cache_t *c)
+{
+	return c->max_value;
+}
+
+unsigned int
+rspamd_shm_cache_capacity(rspamd_shm_cache_t *c)
+{
+	return c->nbuckets * SHM_CACHE_WAYS;
+}
+
+void rspamd_shm_cache_destroy(rspamd_shm_cache_t *c)
+{
+	if (c) {
+		DL_DELETE(shm_caches, c);
+		munmap(c->map, c->len);
+		g_free(c->name);
+		g_free(c);
+	}
+}
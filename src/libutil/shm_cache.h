@@ -0,0 +1,124 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_SHM_CACHE_H_
+#define SRC_LIBUTIL_SHM_CACHE_H_
+
+#include "config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Fixed size cache of opaque values placed in anonymous shared memory.
+ * It must be created before workers are forked, then all of them see the
+ * same entries. Slots are grouped in small buckets with their own eviction
+ * of expired or the oldest entries; every slot is protected by a sequence
+ * counter, so readers never block. A writer that cannot lock a slot just
+ * skips insertion as it is merely a cache.
+ *
+ * When an entry is close to its expiry (a fraction of its ttl is left), the
+ * first process that looks it up is told to refresh it, others continue to
+ * use the existing value until it is replaced.
+ *
+ * Admission follows W-TinyLFU: the first slot of a bucket is a window where
+ * new entries are always placed, and an entry leaving the window replaces a
+ * main one only if it is more frequent according to a shared count-min
+ * sketch. So one-off keys cannot wash out popular entries.
+ */
+typedef struct rspamd_shm_cache_s rspamd_shm_cache_t;
+
+#define RSPAMD_SHM_CACHE_MAX_KEY 255
+
+enum rspamd_shm_cache_result {
+	RSPAMD_SHM_CACHE_MISS = 0,
+	RSPAMD_SHM_CACHE_HIT,
+	/* Entry is found and the caller is responsible for its refresh */
+	RSPAMD_SHM_CACHE_HIT_REFRESH,
+};
+
+struct rspamd_shm_cache_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t inserts;
+	uint64_t evictions;
+	/* Entries that have left the window without being admitted */
+	uint64_t rejects;
+};
+
+typedef void (*rspamd_shm_cache_foreach_cb)(const char *name,
+											rspamd_shm_cache_t *c, void *ud);
+
+/**
+ * Creates new cache
+ * @param name name of the cache used to report its counters
+ * @param nelts number of entries
+ * @param max_value maximum size of a value
+ * @param refresh_ratio fraction of ttl when an entry should be refreshed (0 to disable)
+ * @return new cache or NULL if memory cannot be mapped
+ */
+rspamd_shm_cache_t *rspamd_shm_cache_new(const char *name,
+										 unsigned int nelts, gsize max_value,
+										 double refresh_ratio);
+
+/**
+ * Lookups a key
+ * @param value buffer of `max_value` bytes to copy value into
+ * @param valuelen output length of the value
+ * @param inserted output time when an entry has been inserted (can be NULL)
+ * @param expire output time when an entry expires (can be NULL)
+ */
+enum rspamd_shm_cache_result rspamd_shm_cache_lookup(rspamd_shm_cache_t *c,
+													 const void *key, gsize keylen,
+													 double now,
+													 void *value, gsize *valuelen,
+													 double *inserted, double *expire);
+
+/**
+ * Inserts or replaces a value, returns FALSE if value is too large or a slot is busy
+ */
+gboolean rspamd_shm_cache_insert(rspamd_shm_cache_t *c,
+								 const void *key, gsize keylen,
+								 const void *value, gsize valuelen,
+								 double now, unsigned int ttl);
+
+/**
+ * Returns counters shared by all processes
+ */
+void rspamd_shm_cache_stat(rspamd_shm_cache_t *c, struct rspamd_shm_cache_stat *st);
+
+/**
+ * Calls `cb` for all caches created by this process or its parent
+ */
+void rspamd_shm_cache_foreach(rspamd_shm_cache_foreach_cb cb, void *ud);
+
+/**
+ * Returns maximum size of a value
+ */
+gsize rspamd_shm_cache_max_value(rspamd_shm_cache_t *c);
+
+/**
+ * Returns number of entries in the cache
+ */
+unsigned int rspamd_shm_cache_capacity(rspamd_shm_cache_t *c);
+
+void rspamd_shm_cache_destroy(rspamd_shm_cache_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,7 @@
 #include "config.h"
 #include "util.h"
 #include "cryptobox.h"
+#include "platform_config.h"
 #include "url.h"
 #include "str_util.h"
 #include "logger.h"
@@ -29,10 +30,14 @@
 
 #ifdef __x86_64__
 #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
 #endif
 
 #include "contrib/fastutf8/fastutf8.h"
 
+extern unsigned cpu_config;
+
 const unsigned char lc_map[256] = {
 	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
@@ -67,34 +72,102 @@ const unsigned char lc_map[256] = {
 	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
 	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
 
-unsigned int rspamd_str_lc(char *str, unsigned int size)
+#ifdef __x86_64__
+/* Lowercases ASCII letters: A-Z are the only bytes that are below -128 + 26 after the shift */
+static inline __m128i
+rspamd_lc_sse2(__m128i sv)
 {
-	unsigned int leftover = size % 4;
-	unsigned int fp, i;
-	const uint8_t *s = (const uint8_t *) str;
-	char *dest = str;
-	unsigned char c1, c2, c3, c4;
+	__m128i rangeshift = _mm_sub_epi8(sv, _mm_set1_epi8((char) ('A' + 128)));
+	__m128i nomodify = _mm_cmpgt_epi8(rangeshift, _mm_set1_epi8(-128 + 25));
 
-	fp = size - leftover;
+	return _mm_xor_si128(sv, _mm_andnot_si128(nomodify, _mm_set1_epi8(0x20)));
+}
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2)
+static inline __m256i rspamd_lc_avx2(__m256i sv) __attribute__((__target__("avx2")));
 
-	for (i = 0; i != fp; i += 4) {
-		c1 = s[i], c2 = s[i + 1], c3 = s[i + 2], c4 = s[i + 3];
-		dest[0] = lc_map[c1];
-		dest[1] = lc_map[c2];
-		dest[2] = lc_map[c3];
-		dest[3] = lc_map[c4];
-		dest += 4;
+static inline __m256i
+rspamd_lc_avx2(__m256i sv)
+{
+	__m256i rangeshift = _mm256_sub_epi8(sv, _mm256_set1_epi8((char) ('A' + 128)));
+	__m256i nomodify = _mm256_cmpgt_epi8(rangeshift, _mm256_set1_epi8(-128 + 25));
+
+	return _mm256_xor_si256(sv, _mm256_andnot_si256(nomodify, _mm256_set1_epi8(0x20)));
+}
+
+static gsize rspamd_str_lc_avx2(char *str, gsize size) __attribute__((__target__("avx2")));
+
+static gsize
+rspamd_str_lc_avx2(char *str, gsize size)
+{
+	gsize i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (str + i));
+		_mm256_storeu_si256((__m256i *) (str + i), rspamd_lc_avx2(v));
 	}
 
-	switch (leftover) {
-	case 3:
-		*dest++ = lc_map[(unsigned char) str[i++]];
-		/* FALLTHRU */
-	case 2:
-		*dest++ = lc_map[(unsigned char) str[i++]];
-		/* FALLTHRU */
-	case 1:
-		*dest = lc_map[(unsigned char) str[i]];
+	return i;
+}
+
+/* Returns length of the prefix that is equal in both strings in 32 bytes blocks */
+static gsize rspamd_lc_cmp_prefix_avx2(const char *s, const char *d, gsize l) __attribute__((__target__("avx2")));
+
+static gsize
+rspamd_lc_cmp_prefix_avx2(const char *s, const char *d, gsize l)
+{
+	gsize i;
+
+	for (i = 0; i + 32 <= l; i += 32) {
+		__m256i v1 = rspamd_lc_avx2(_mm256_loadu_si256((const __m256i *) (s + i))),
+				v2 = rspamd_lc_avx2(_mm256_loadu_si256((const __m256i *) (d + i)));
+
+		if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2)) != 0xffffffffu) {
+			break;
+		}
+	}
+
+	return i;
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint8x16_t
+rspamd_lc_neon(uint8x16_t v)
+{
+	uint8x16_t upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+
+	return vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+
+/* Packs a comparison result to 4 bits per byte */
+static inline uint64_t
+rspamd_neon_mask(uint8x16_t m)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+#endif
+
+unsigned int rspamd_str_lc(char *str, unsigned int size)
+{
+	gsize i = 0;
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (size >= 64 && (cpu_config & CPUID_AVX2)) {
+		i = rspamd_str_lc_avx2(str, size);
+	}
+#endif
+#ifdef __x86_64__
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (str + i));
+		_mm_storeu_si128((__m128i *) (str + i), rspamd_lc_sse2(v));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 16 <= size; i += 16) {
+		vst1q_u8((uint8_t *) (str + i), rspamd_lc_neon(vld1q_u8((const uint8_t *) (str + i))));
+	}
+#endif
+
+	for (; i < size; i++) {
+		str[i] = lc_map[(unsigned char) str[i]];
 	}
 
 	return size;
@@ -114,14 +187,14 @@ gsize rspamd_str_copy_lc(const char *src, char *dst, gsize size)
 #ifdef __x86_64__
 	while (size >= 16) {
 		__m128i sv = _mm_load_si128((const __m128i *) src);
-		/* From A */
-		__m128i rangeshift = _mm_sub_epi8(sv, _mm_set1_epi8((char) ('A' + 128)));
-		/* To Z */
-		__m128i nomodify = _mm_cmpgt_epi8(rangeshift, _mm_set1_epi8(-128 + 25));
-		/* ^ ' ' */
-		__m128i flip = _mm_andnot_si128(nomodify, _mm_set1_epi8(0x20));
-		__m128i uc = _mm_xor_si128(sv, flip);
-		_mm_storeu_si128((__m128i *) d, uc);
+		_mm_storeu_si128((__m128i *) d, rspamd_lc_sse2(sv));
+		d += 16;
+		src += 16;
+		size -= 16;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	while (size >= 16) {
+		vst1q_u8((uint8_t *) d, rspamd_lc_neon(vld1q_u8((const uint8_t *) src)));
 		d += 16;
 		src += 16;
 		size -= 16;
@@ -137,6 +210,49 @@ gsize rspamd_str_copy_lc(const char *src, char *dst, gsize size)
 	return (d - dst);
 }
 
+/*
+ * Returns length of the prefix equal in both strings ignoring case, the
+ * length is a multiple of 16, so the result of the scalar comparison of the
+ * rest is the same as for the whole strings
+ */
+static inline gsize
+rspamd_lc_cmp_prefix(const char *s, const char *d, gsize l)
+{
+	gsize i = 0;
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (l >= 64 && (cpu_config & CPUID_AVX2)) {
+		i = rspamd_lc_cmp_prefix_avx2(s, d, l);
+
+		if (i + 32 <= l) {
+			/* Difference is found */
+			return i;
+		}
+	}
+#endif
+#ifdef __x86_64__
+	for (; i + 16 <= l; i += 16) {
+		__m128i v1 = rspamd_lc_sse2(_mm_loadu_si128((const __m128i *) (s + i))),
+				v2 = rspamd_lc_sse2(_mm_loadu_si128((const __m128i *) (d + i)));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) != 0xffff) {
+			break;
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 16 <= l; i += 16) {
+		uint8x16_t v1 = rspamd_lc_neon(vld1q_u8((const uint8_t *) (s + i))),
+				   v2 = rspamd_lc_neon(vld1q_u8((const uint8_t *) (d + i)));
+
+		if (vminvq_u8(vceqq_u8(v1, v2)) != 0xff) {
+			break;
+		}
+	}
+#endif
+
+	return i;
+}
+
 int rspamd_lc_cmp(const char *s, const char *d, gsize l)
 {
 	gsize fp, i;
@@ -145,9 +261,17 @@ int rspamd_lc_cmp(const char *s, const char *d, gsize l)
 		unsigned char c[4];
 		uint32_t n;
 	} cmp1, cmp2;
-	gsize leftover = l % 4;
+	gsize leftover;
 	int ret = 0;
 
+	if (l >= 16) {
+		i = rspamd_lc_cmp_prefix(s, d, l);
+		s += i;
+		d += i;
+		l -= i;
+	}
+
+	leftover = l % 4;
 	fp = l - leftover;
 
 	for (i = 0; i != fp; i += 4) {
@@ -1662,6 +1786,99 @@ rspamd_encode_qp_fold(const unsigned char *in, gsize inlen, int str_len,
 
 #define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
+/*
+ * Bit-parallel optimal string alignment distance (Hyyro 2003), the pattern
+ * must be shorter than 65 characters
+ */
+static int
+rspamd_strings_osa_distance_bp(const char *s1, gsize s1len,
+							   const char *s2, gsize s2len)
+{
+	uint64_t pm[256], vp, vn, d0 = 0, hp, hn, tr, eq, prev_eq = 0, last;
+	int dist = s1len;
+
+	memset(pm, 0, sizeof(pm));
+
+	for (gsize i = 0; i < s1len; i++) {
+		pm[(unsigned char) s1[i]] |= 1ULL << i;
+	}
+
+	vp = ~0ULL;
+	vn = 0;
+	last = 1ULL << (s1len - 1);
+
+	for (gsize i = 0; i < s2len; i++) {
+		eq = pm[(unsigned char) s2[i]];
+		tr = (((~d0) & eq) << 1) & prev_eq;
+		d0 = (((eq & vp) + vp) ^ vp) | eq | vn | tr;
+		hp = vn | ~(d0 | vp);
+		hn = d0 & vp;
+
+		if (hp & last) {
+			dist++;
+		}
+		else if (hn & last) {
+			dist--;
+		}
+
+		hp = (hp << 1) | 1;
+		hn = hn << 1;
+		vp = hn | ~(d0 | hp);
+		vn = hp & d0;
+		prev_eq = eq;
+	}
+
+	return dist;
+}
+
+/*
+ * Bit-parallel longest common subsequence (Allison-Dix, Hyyro), works
+ * for patterns of any length in O(n * m / 64)
+ */
+static int
+rspamd_strings_lcs_bp(const char *s1, gsize s1len,
+					  const char *s2, gsize s2len)
+{
+	gsize nblocks = (s1len + 63) / 64;
+	uint64_t *pm, *v, *eq, cur, u, sum, carry, valid;
+	int lcs = 0;
+
+	pm = g_malloc0(256 * nblocks * sizeof(*pm));
+	v = g_malloc(nblocks * sizeof(*v));
+
+	for (gsize i = 0; i < s1len; i++) {
+		pm[(unsigned char) s1[i] * nblocks + i / 64] |= 1ULL << (i & 63);
+	}
+
+	memset(v, 0xff, nblocks * sizeof(*v));
+
+	for (gsize i = 0; i < s2len; i++) {
+		eq = &pm[(unsigned char) s2[i] * nblocks];
+		carry = 0;
+
+		for (gsize b = 0; b < nblocks; b++) {
+			/* V' = (V + (V & M)) | (V & ~M) */
+			cur = v[b];
+			u = cur & eq[b];
+			sum = cur + carry;
+			carry = sum < carry;
+			sum += u;
+			carry |= sum < u;
+			v[b] = sum | (cur & ~eq[b]);
+		}
+	}
+
+	for (gsize b = 0; b < nblocks; b++) {
+		valid = (b == nblocks - 1 && (s1len & 63)) ? (1ULL << (s1len & 63)) - 1 : ~0ULL;
+		lcs += __builtin_popcountll(~v[b] & valid);
+	}
+
+	g_free(pm);
+	g_free(v);
+
+	return lcs;
+}
+
 int rspamd_strings_levenshtein_distance(const char *s1, gsize s1len,
 										const char *s2, gsize s2len,
 										unsigned int replace_cost)
@@ -1701,6 +1918,18 @@ int rspamd_strings_levenshtein_distance(const char *s1, gsize s1len,
 		s1len = tmplen;
 	}
 
+	if (s1len == 0) {
+		return s2len;
+	}
+
+	if (replace_cost == 1 && s1len <= 64) {
+		return rspamd_strings_osa_distance_bp(s1, s1len, s2, s2len);
+	}
+	else if (replace_cost >= 2) {
+		/* Replace and transposition are never cheaper than remove + insert */
+		return s1len + s2len - 2 * rspamd_strings_lcs_bp(s1, s1len, s2, s2len);
+	}
+
 	/* Adjust static space */
 	if (current_row == NULL) {
 		current_row = g_array_sized_new(FALSE, FALSE, sizeof(int), s1len + 1);
@@ -2119,7 +2348,7 @@ rspamd_substring_search_preprocessed(const char *in, gsize inlen,
 {
 	goffset i, j, k, ell;
 
-	for (ell = 1; f(srch[ell - 1], srch[ell]); ell++) {}
+	for (ell = 1; ell < srchlen && f(srch[ell - 1], srch[ell]); ell++) {}
 	if (ell == srchlen) {
 		ell = 0;
 	}
@@ -2163,28 +2392,266 @@ rspamd_substring_search_preprocessed(const char *in, gsize inlen,
 	return -1;
 }
 
+/*
+ * Checks the middle of a candidate whose first and last characters are
+ * already matched
+ */
+static inline gboolean
+rspamd_substring_verify(const char *p, const char *srch, gsize srchlen,
+						gboolean caseless)
+{
+	if (srchlen <= 2) {
+		return TRUE;
+	}
+
+	if (caseless) {
+		return rspamd_lc_cmp(p + 1, srch + 1, srchlen - 2) == 0;
+	}
+
+	return memcmp(p + 1, srch + 1, srchlen - 2) == 0;
+}
+
+/*
+ * Vectorized search compares the first and the last characters of the
+ * needle with 16 or 32 positions at once and verifies candidates.
+ * As there is no linear time guarantee, search gives up when there are too
+ * many false candidates (e.g. on periodic inputs); in this case, or when the
+ * input tail is shorter than a vector, `*pskip` is set to the number of
+ * positions checked and the caller should continue with KMP.
+ */
+#define RSPAMD_SUBSTRING_MAX_FAILS(pos) (64 + ((pos) >> 3))
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+static goffset rspamd_substring_search_avx2(const char *in, gsize inlen,
+											const char *srch, gsize srchlen,
+											gboolean caseless, gsize *pskip) __attribute__((__target__("avx2")));
+
+static goffset
+rspamd_substring_search_avx2(const char *in, gsize inlen,
+							 const char *srch, gsize srchlen,
+							 gboolean caseless, gsize *pskip)
+{
+	const __m256i first = _mm256_set1_epi8(caseless ? lc_map[(unsigned char) srch[0]] : srch[0]),
+				  last = _mm256_set1_epi8(caseless ? lc_map[(unsigned char) srch[srchlen - 1]] : srch[srchlen - 1]);
+	gsize i = 0, nfail = 0;
+
+	while (i + srchlen + 31 <= inlen) {
+		__m256i vf = _mm256_loadu_si256((const __m256i *) (in + i)),
+				vl = _mm256_loadu_si256((const __m256i *) (in + i + srchlen - 1));
+
+		if (caseless) {
+			vf = rspamd_lc_avx2(vf);
+			vl = rspamd_lc_avx2(vl);
+		}
+
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(vf, first),
+															  _mm256_cmpeq_epi8(vl, last)));
+
+		while (mask) {
+			unsigned int bit = __builtin_ctz(mask);
+
+			if (rspamd_substring_verify(in + i + bit, srch, srchlen, caseless)) {
+				return i + bit;
+			}
+
+			nfail++;
+			mask &= mask - 1;
+		}
+
+		if (nfail > RSPAMD_SUBSTRING_MAX_FAILS(i)) {
+			break;
+		}
+
+		i += 32;
+	}
+
+	*pskip = i;
+
+	return -1;
+}
+#endif
+
+#ifdef __x86_64__
+static goffset
+rspamd_substring_search_sse2(const char *in, gsize inlen,
+							 const char *srch, gsize srchlen,
+							 gboolean caseless, gsize *pskip)
+{
+	const __m128i first = _mm_set1_epi8(caseless ? lc_map[(unsigned char) srch[0]] : srch[0]),
+				  last = _mm_set1_epi8(caseless ? lc_map[(unsigned char) srch[srchlen - 1]] : srch[srchlen - 1]);
+	gsize i = 0, nfail = 0;
+
+	while (i + srchlen + 15 <= inlen) {
+		__m128i vf = _mm_loadu_si128((const __m128i *) (in + i)),
+				vl = _mm_loadu_si128((const __m128i *) (in + i + srchlen - 1));
+
+		if (caseless) {
+			vf = rspamd_lc_sse2(vf);
+			vl = rspamd_lc_sse2(vl);
+		}
+
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(vf, first),
+															_mm_cmpeq_epi8(vl, last)));
+
+		while (mask) {
+			unsigned int bit = __builtin_ctz(mask);
+
+			if (rspamd_substring_verify(in + i + bit, srch, srchlen, caseless)) {
+				return i + bit;
+			}
+
+			nfail++;
+			mask &= mask - 1;
+		}
+
+		if (nfail > RSPAMD_SUBSTRING_MAX_FAILS(i)) {
+			break;
+		}
+
+		i += 16;
+	}
+
+	*pskip = i;
+
+	return -1;
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static goffset
+rspamd_substring_search_neon(const char *in, gsize inlen,
+							 const char *srch, gsize srchlen,
+							 gboolean caseless, gsize *pskip)
+{
+	const uint8x16_t first = vdupq_n_u8(caseless ? lc_map[(unsigned char) srch[0]] : srch[0]),
+					 last = vdupq_n_u8(caseless ? lc_map[(unsigned char) srch[srchlen - 1]] : srch[srchlen - 1]);
+	gsize i = 0, nfail = 0;
+
+	while (i + srchlen + 15 <= inlen) {
+		uint8x16_t vf = vld1q_u8((const uint8_t *) (in + i)),
+				   vl = vld1q_u8((const uint8_t *) (in + i + srchlen - 1));
+
+		if (caseless) {
+			vf = rspamd_lc_neon(vf);
+			vl = rspamd_lc_neon(vl);
+		}
+
+		uint8x16_t m = vandq_u8(vceqq_u8(vf, first), vceqq_u8(vl, last));
+
+		if (vmaxvq_u8(m) != 0) {
+			/* 4 bits per position */
+			uint64_t mask = rspamd_neon_mask(m);
+
+			while (mask) {
+				unsigned int bit = __builtin_ctzll(mask) >> 2;
+
+				if (rspamd_substring_verify(in + i + bit, srch, srchlen, caseless)) {
+					return i + bit;
+				}
+
+				nfail++;
+				mask &= ~(0xfULL << (bit * 4));
+			}
+
+			if (nfail > RSPAMD_SUBSTRING_MAX_FAILS(i)) {
+				break;
+			}
+		}
+
+		i += 16;
+	}
+
+	*pskip = i;
+
+	return -1;
+}
+#endif
+
+static inline goffset
+rspamd_substring_search_simd(const char *in, gsize inlen,
+							 const char *srch, gsize srchlen,
+							 gboolean caseless, gsize *pskip)
+{
+	*pskip = 0;
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (inlen >= srchlen + 64 && (cpu_config & CPUID_AVX2)) {
+		return rspamd_substring_search_avx2(in, inlen, srch, srchlen, caseless, pskip);
+	}
+#endif
+#ifdef __x86_64__
+	return rspamd_substring_search_sse2(in, inlen, srch, srchlen, caseless, pskip);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	return rspamd_substring_search_neon(in, inlen, srch, srchlen, caseless, pskip);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Searches for `srch` (at least 2 characters) using vectors and then
+ * continues with KMP if needed; `pfsm` is KMP table if it has been already
+ * computed for this needle
+ */
 static inline goffset
 rspamd_substring_search_common(const char *in, gsize inlen,
-							   const char *srch, gsize srchlen, rspamd_cmpchar_func_t f)
+							   const char *srch, gsize srchlen,
+							   gboolean caseless, const goffset *pfsm)
 {
 	static goffset st_fsm[128];
 	goffset *fsm, ret;
+	gsize skip;
+	rspamd_cmpchar_func_t f = caseless ? rspamd_substring_casecmp_func : rspamd_substring_cmp_func;
 
-	if (G_LIKELY(srchlen < G_N_ELEMENTS(st_fsm))) {
-		fsm = st_fsm;
+	ret = rspamd_substring_search_simd(in, inlen, srch, srchlen, caseless, &skip);
+
+	if (ret != -1 || inlen - skip < srchlen) {
+		return ret;
+	}
+
+	in += skip;
+	inlen -= skip;
+
+	if (pfsm) {
+		ret = rspamd_substring_search_preprocessed(in, inlen, srch, srchlen, pfsm, f);
 	}
 	else {
-		fsm = g_malloc((srchlen + 1) * sizeof(*fsm));
+		if (G_LIKELY(srchlen < G_N_ELEMENTS(st_fsm))) {
+			fsm = st_fsm;
+		}
+		else {
+			fsm = g_malloc((srchlen + 1) * sizeof(*fsm));
+		}
+
+		rspamd_substring_preprocess_kmp(srch, srchlen, fsm, f);
+		ret = rspamd_substring_search_preprocessed(in, inlen, srch, srchlen, fsm, f);
+
+		if (G_UNLIKELY(srchlen >= G_N_ELEMENTS(st_fsm))) {
+			g_free(fsm);
+		}
 	}
 
-	rspamd_substring_preprocess_kmp(srch, srchlen, fsm, f);
-	ret = rspamd_substring_search_preprocessed(in, inlen, srch, srchlen, fsm, f);
+	return ret == -1 ? -1 : ret + skip;
+}
+
+static goffset
+rspamd_substring_search_caseless_char(const char *in, gsize inlen, char c)
+{
+	gsize i = 0;
+	goffset ret;
+	unsigned char s = lc_map[(unsigned char) c];
+
+	ret = rspamd_substring_search_simd(in, inlen, (const char *) &s, 1, TRUE, &i);
 
-	if (G_UNLIKELY(srchlen >= G_N_ELEMENTS(st_fsm))) {
-		g_free(fsm);
+	if (ret != -1) {
+		return ret;
 	}
 
-	return ret;
+	for (; i < inlen; i++) {
+		if (lc_map[(unsigned char) in[i]] == s) {
+			return i;
+		}
+	}
+
+	return (-1);
 }
 
 goffset
@@ -2208,7 +2675,7 @@ rspamd_substring_search(const char *in, gsize inlen,
 		}
 
 		return rspamd_substring_search_common(in, inlen, srch, srchlen,
-											  rspamd_substring_cmp_func);
+											  FALSE, NULL);
 	}
 	else if (inlen == srchlen) {
 		return (rspamd_lc_cmp(srch, in, srchlen) == 0 ? 0 : -1);
@@ -2226,20 +2693,11 @@ rspamd_substring_search_caseless(const char *in, gsize inlen,
 {
 	if (inlen > srchlen) {
 		if (G_UNLIKELY(srchlen == 1)) {
-			goffset i;
-			char s = lc_map[(unsigned char) srch[0]];
-
-			for (i = 0; i < inlen; i++) {
-				if (lc_map[(unsigned char) in[i]] == s) {
-					return i;
-				}
-			}
-
-			return (-1);
+			return rspamd_substring_search_caseless_char(in, inlen, srch[0]);
 		}
 
 		return rspamd_substring_search_common(in, inlen, srch, srchlen,
-											  rspamd_substring_casecmp_func);
+											  TRUE, NULL);
 	}
 	else if (inlen == srchlen) {
 		return rspamd_lc_cmp(srch, in, srchlen) == 0 ? 0 : (-1);
@@ -2248,6 +2706,71 @@ rspamd_substring_search_caseless(const char *in, gsize inlen,
 	return (-1);
 }
 
+struct rspamd_substring_needle {
+	char *srch;
+	gsize len;
+	gboolean caseless;
+	goffset fsm[];
+};
+
+struct rspamd_substring_needle *
+rspamd_substring_needle_new(const char *srch, gsize srchlen, gboolean caseless)
+{
+	struct rspamd_substring_needle *n;
+
+	n = g_malloc(sizeof(*n) + (srchlen + 1) * sizeof(goffset));
+	/* Zero terminated as KMP preprocessing could look at the next character */
+	n->srch = g_malloc(srchlen + 1);
+	memcpy(n->srch, srch, srchlen);
+	n->srch[srchlen] = '\0';
+	n->len = srchlen;
+	n->caseless = caseless;
+
+	if (caseless) {
+		rspamd_str_lc(n->srch, srchlen);
+	}
+
+	if (srchlen > 1) {
+		rspamd_substring_preprocess_kmp(n->srch, srchlen, n->fsm,
+										caseless ? rspamd_substring_casecmp_func : rspamd_substring_cmp_func);
+	}
+
+	return n;
+}
+
+goffset
+rspamd_substring_needle_search(const struct rspamd_substring_needle *n,
+							   const char *in, gsize inlen)
+{
+	if (n->len == 0) {
+		return 0;
+	}
+	else if (inlen < n->len) {
+		return (-1);
+	}
+	else if (n->len == 1) {
+		if (n->caseless) {
+			return rspamd_substring_search_caseless_char(in, inlen, n->srch[0]);
+		}
+		else {
+			const char *p = memchr(in, n->srch[0], inlen);
+
+			return p ? p - in : (-1);
+		}
+	}
+
+	return rspamd_substring_search_common(in, inlen, n->srch, n->len,
+										  n->caseless, n->fsm);
+}
+
+void rspamd_substring_needle_free(struct rspamd_substring_needle *n)
+{
+	if (n) {
+		g_free(n->srch);
+		g_free(n);
+	}
+}
+
 goffset
 rspamd_string_find_eoh(GString *input, goffset *body_start)
 {
@@ -2613,161 +3136,290 @@ rspamd_decode_hex(const char *in, gsize inlen)
 	return NULL;
 }
 
-gssize
-rspamd_decode_qp_buf(const char *in, gsize inlen,
-					 char *out, gsize outlen)
+/*
+ * Returns length of the prefix of `s` that has no `c1` and `c2` characters,
+ * these are escape characters of quoted-printable encodings
+ */
+static inline gsize
+rspamd_qp_clean_run_scalar(const char *s, gsize len, char c1, char c2)
 {
-	char *o, *end, *pos, c;
-	const char *p;
-	unsigned char ret;
-	gssize remain, processed;
+	const char *p = s, *end = s + len;
 
-	p = in;
-	o = out;
-	end = out + outlen;
-	remain = inlen;
+	while (p < end && *p != c1 && *p != c2) {
+		p++;
+	}
 
-	while (remain > 0 && o < end) {
-		if (*p == '=') {
-			remain--;
+	return p - s;
+}
 
-			if (remain == 0) {
-				/* Last '=' character, bugon */
-				if (end - o > 0) {
-					*o++ = *p;
-				}
-				else {
-					/* Buffer overflow */
-					return (-1);
-				}
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+static gsize
+rspamd_qp_clean_run_avx2(const char *s, gsize len, char c1, char c2) __attribute__((__target__("avx2")));
 
-				break;
-			}
+static gsize
+rspamd_qp_clean_run_avx2(const char *s, gsize len, char c1, char c2)
+{
+	const __m256i v1 = _mm256_set1_epi8(c1), v2 = _mm256_set1_epi8(c2);
+	gsize i = 0;
 
-			p++;
-		decode:
-			/* Decode character after '=' */
-			c = *p++;
-			remain--;
-			ret = 0;
+	while (i + 32 <= len) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, v1),
+															 _mm256_cmpeq_epi8(v, v2)));
 
-			if (c >= '0' && c <= '9') {
-				ret = c - '0';
-			}
-			else if (c >= 'A' && c <= 'F') {
-				ret = c - 'A' + 10;
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+
+		i += 32;
+	}
+
+	return i + rspamd_qp_clean_run_scalar(s + i, len - i, c1, c2);
+}
+#endif
+
+static inline gsize
+rspamd_qp_clean_run(const char *s, gsize len, char c1, char c2)
+{
+	gsize i = 0;
+
+	/* Escapes are frequent in short runs, so vectors are not worth it there */
+	if (len < 16) {
+		return rspamd_qp_clean_run_scalar(s, len, c1, c2);
+	}
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+	if (len >= 64 && (cpu_config & CPUID_AVX2)) {
+		return rspamd_qp_clean_run_avx2(s, len, c1, c2);
+	}
+#endif
+#ifdef __x86_64__
+	/* SSE2 is always available on x86_64 */
+	const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, v1),
+														   _mm_cmpeq_epi8(v, v2)));
+
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+
+		i += 16;
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t v1 = vdupq_n_u8(c1), v2 = vdupq_n_u8(c2);
+
+	while (i + 16 <= len) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) (s + i));
+		uint8x16_t m = vorrq_u8(vceqq_u8(v, v1), vceqq_u8(v, v2));
+
+		if (vmaxvq_u8(m) != 0) {
+			break;
+		}
+
+		i += 16;
+	}
+#endif
+
+	return i + rspamd_qp_clean_run_scalar(s + i, len - i, c1, c2);
+}
+
+static inline int
+rspamd_qp_hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	return -1;
+}
+
+/*
+ * Decodes quoted-printable data, unless `final` is set it stops before
+ * an escape sequence that might be continued in the next chunk of input
+ */
+static gssize
+rspamd_decode_qp_chunk(const char *in, gsize inlen,
+					   char *out, gsize outlen,
+					   gboolean final, gsize *consumed)
+{
+	const char *p = in, *pend = in + inlen;
+	char *o = out, *end = out + outlen;
+	int hi, lo;
+
+	while (p < pend && o < end) {
+		if (*p != '=') {
+			/* Copy clean run at once */
+			gsize run = rspamd_qp_clean_run(p, pend - p, '=', '=');
+
+			if ((gsize) (end - o) < run) {
+				/* Buffer overflow */
+				return (-1);
 			}
-			else if (c >= 'a' && c <= 'f') {
-				ret = c - 'a' + 10;
+
+			memcpy(o, p, run);
+			o += run;
+			p += run;
+
+			continue;
+		}
+
+		if (!final && pend - p < 3) {
+			/* '=', '=<hex>' and '=\r' can be continued in the next chunk */
+			if (pend - p == 1 || p[1] == '\r' || rspamd_qp_hex_value(p[1]) != -1) {
+				break;
 			}
-			else if (c == '\r') {
+		}
+
+		if (pend - p == 1) {
+			/* Last '=' character, bugon */
+			*o++ = *p++;
+			break;
+		}
+
+		/* Decode character after '=' */
+		p++;
+		hi = rspamd_qp_hex_value(*p);
+
+		if (hi == -1) {
+			if (*p == '\r') {
 				/* Eat one more endline */
-				if (remain > 0 && *p == '\n') {
+				p++;
+
+				if (p < pend && *p == '\n') {
 					p++;
-					remain--;
 				}
-
-				continue;
 			}
-			else if (c == '\n') {
+			else if (*p == '\n') {
 				/* Soft line break */
-				continue;
+				p++;
 			}
 			else {
 				/* Hack, hack, hack, treat =<garbage> as =<garbage> */
 				if (end - o > 1) {
 					*o++ = '=';
-					*o++ = *(p - 1);
+					*o++ = *p++;
 				}
 				else {
 					return (-1);
 				}
-
-				continue;
 			}
 
-			if (remain > 0) {
-				c = *p++;
-				ret *= 16;
-				remain--;
-
-				if (c >= '0' && c <= '9') {
-					ret += c - '0';
-				}
-				else if (c >= 'A' && c <= 'F') {
-					ret += c - 'A' + 10;
-				}
-				else if (c >= 'a' && c <= 'f') {
-					ret += c - 'a' + 10;
-				}
-				else {
-					/* Treat =<good><rubbish> as =<good><rubbish> */
-					if (end - o > 2) {
-						*o++ = '=';
-						*o++ = *(p - 2);
-						*o++ = *(p - 1);
-					}
-					else {
-						return (-1);
-					}
+			continue;
+		}
 
-					continue;
-				}
+		p++;
 
-				if (end - o > 0) {
-					*o++ = (char) ret;
-				}
-				else {
-					return (-1);
-				}
-			}
+		if (p == pend) {
+			/* Truncated escape is ignored */
+			break;
 		}
-		else {
-			if (end - o >= remain) {
-				if ((pos = memccpy(o, p, '=', remain)) == NULL) {
-					/* All copied */
-					o += remain;
-					break;
-				}
-				else {
-					processed = pos - o;
-					remain -= processed;
-					p += processed;
 
-					if (remain > 0) {
-						o = pos - 1;
-						/*
-						 * Skip comparison and jump inside decode branch,
-						 * as we know that we have found match
-						 */
-						goto decode;
-					}
-					else {
-						/* Last '=' character, bugon */
-						o = pos;
+		lo = rspamd_qp_hex_value(*p);
 
-						if (end - o > 0) {
-							*o = '=';
-						}
-						else {
-							/* Buffer overflow */
-							return (-1);
-						}
-
-						break;
-					}
-				}
+		if (lo == -1) {
+			/* Treat =<good><rubbish> as =<good><rubbish> */
+			if (end - o > 2) {
+				*o++ = '=';
+				*o++ = *(p - 1);
+				*o++ = *p++;
 			}
 			else {
-				/* Buffer overflow */
 				return (-1);
 			}
+
+			continue;
 		}
+
+		*o++ = (char) (hi * 16 + lo);
+		p++;
+	}
+
+	if (consumed) {
+		*consumed = p - in;
 	}
 
 	return (o - out);
 }
 
+gssize
+rspamd_decode_qp_buf(const char *in, gsize inlen,
+					 char *out, gsize outlen)
+{
+	return rspamd_decode_qp_chunk(in, inlen, out, outlen, TRUE, NULL);
+}
+
+void rspamd_qp_decoder_init(struct rspamd_qp_decoder *dec)
+{
+	dec->npending = 0;
+}
+
+gssize
+rspamd_qp_decoder_feed(struct rspamd_qp_decoder *dec,
+					   const char *in, gsize inlen,
+					   char *out, gsize outlen,
+					   gboolean final)
+{
+	gsize consumed, skip = 0;
+	gssize r, total = 0;
+
+	if (dec->npending > 0) {
+		/* Any escape sequence is complete with three more characters */
+		char tmp[sizeof(dec->pending) + 3];
+		gsize take = MIN(inlen, 3), tlen = dec->npending + take;
+
+		memcpy(tmp, dec->pending, dec->npending);
+
+		if (take > 0) {
+			memcpy(tmp + dec->npending, in, take);
+		}
+		r = rspamd_decode_qp_chunk(tmp, tlen, out, outlen,
+								   final && take == inlen, &consumed);
+
+		if (r == -1) {
+			return (-1);
+		}
+
+		total = r;
+
+		if (consumed < dec->npending) {
+			/* Still not enough input to finish the escape */
+			dec->npending = tlen - consumed;
+			memmove(dec->pending, tmp + consumed, dec->npending);
+
+			return total;
+		}
+
+		skip = consumed - dec->npending;
+		dec->npending = 0;
+	}
+
+	r = rspamd_decode_qp_chunk(in + skip, inlen - skip, out + total,
+							   outlen - total, final, &consumed);
+
+	if (r == -1) {
+		return (-1);
+	}
+
+	total += r;
+	skip += consumed;
+
+	if (!final && skip < inlen) {
+		dec->npending = inlen - skip;
+		memcpy(dec->pending, in + skip, dec->npending);
+	}
+
+	return total;
+}
+
 gssize
 rspamd_decode_uue_buf(const char *in, gsize inlen,
 					  char *out, gsize outlen)
@@ -3044,7 +3696,7 @@ rspamd_decode_qp2047_buf(const char *in, gsize inlen,
 		}
 		else {
 			if (end - o >= remain) {
-				processed = rspamd_memcspn(p, "=_", remain);
+				processed = rspamd_qp_clean_run(p, remain, '=', '_');
 				memcpy(o, p, processed);
 				o += processed;
 
@@ -307,6 +307,33 @@ char *rspamd_encode_qp_fold(const unsigned char *in, gsize inlen, int str_len,
 gssize rspamd_decode_qp_buf(const char *in, gsize inlen,
 							char *out, gsize outlen);
 
+/**
+ * Streaming quoted-printable decoder, it keeps escape sequences split
+ * between chunks of input
+ */
+struct rspamd_qp_decoder {
+	char pending[2];
+	unsigned int npending;
+};
+
+void rspamd_qp_decoder_init(struct rspamd_qp_decoder *dec);
+
+/**
+ * Decode a chunk of quoted-printable encoded data, the result of decoding
+ * of all chunks is the same as of rspamd_decode_qp_buf for the whole input
+ * @param dec decoder
+ * @param in input
+ * @param inlen length of input
+ * @param out output, it needs up to `inlen + 2` bytes
+ * @param outlen length of output
+ * @param final TRUE for the last chunk
+ * @return size of decoded output or (-1) if outlen is not enough
+ */
+gssize rspamd_qp_decoder_feed(struct rspamd_qp_decoder *dec,
+							  const char *in, gsize inlen,
+							  char *out, gsize outlen,
+							  gboolean final);
+
 /**
  * Decode uuencode encoded buffer, input and output must not overlap
  * @param in input
@@ -373,7 +400,8 @@ GString *rspamd_header_value_fold(const char *name,
 								  const char *fold_on_chars);
 
 /**
- * Search for a substring `srch` in the text `in` using Apostolico-Crochemore algorithm
+ * Search for a substring `srch` in the text `in` using SIMD filtering by the
+ * first and the last characters of `srch` and Apostolico-Crochemore algorithm
  * http://www-igm.univ-mlv.fr/~lecroq/string/node12.html#SECTION00120
  * @param in input
  * @param inlen input len
@@ -396,6 +424,31 @@ goffset rspamd_substring_search(const char *in, gsize inlen,
 goffset rspamd_substring_search_caseless(const char *in, gsize inlen,
 										 const char *srch, gsize srchlen);
 
+struct rspamd_substring_needle;
+
+/**
+ * Preprocesses a needle for repeated searches with `rspamd_substring_needle_search`
+ * @param srch search string
+ * @param srchlen length of the search string
+ * @param caseless perform caseless (ASCII only) search
+ * @return new needle, must be freed by `rspamd_substring_needle_free`
+ */
+struct rspamd_substring_needle *rspamd_substring_needle_new(const char *srch,
+															gsize srchlen,
+															gboolean caseless);
+
+/**
+ * Search for a preprocessed needle in the text `in`
+ * @return position of the first substring match or (-1) if not found
+ */
+goffset rspamd_substring_needle_search(const struct rspamd_substring_needle *n,
+									   const char *in, gsize inlen);
+
+/**
+ * Frees a preprocessed needle
+ */
+void rspamd_substring_needle_free(struct rspamd_substring_needle *n);
+
 /**
  * Search for end-of-headers mark in the input string. Returns position just after
  * the last header in message (but before the last newline character).
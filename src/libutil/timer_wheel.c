@@ -0,0 +1,382 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer_wheel.h"
+#include <math.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+/* 4 levels with 10ms resolution cover ~46 hours, longer timers are cascaded again */
+#define WHEEL_LEVELS 4
+
+struct rspamd_timer_wheel {
+	struct ev_loop *loop;
+	ev_timer tm;
+	/* Last processed tick */
+	uint64_t now;
+	/* Tick when `tm` is going to fire */
+	uint64_t wakeup;
+	gsize count;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct rspamd_timer_wheel_entry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static inline uint64_t
+rspamd_timer_wheel_tick(ev_tstamp ts)
+{
+	return (uint64_t) (ts / RSPAMD_TIMER_WHEEL_RESOLUTION);
+}
+
+static inline void
+rspamd_timer_wheel_link(struct rspamd_timer_wheel_entry **head,
+						struct rspamd_timer_wheel_entry *ent)
+{
+	ent->next = *head;
+
+	if (ent->next) {
+		ent->next->pprev = &ent->next;
+	}
+
+	ent->pprev = head;
+	*head = ent;
+}
+
+static inline void
+rspamd_timer_wheel_unlink(struct rspamd_timer_wheel *wheel,
+						  struct rspamd_timer_wheel_entry *ent)
+{
+	*ent->pprev = ent->next;
+
+	if (ent->next) {
+		ent->next->pprev = ent->pprev;
+	}
+
+	/* Entries being processed are not in the slots */
+	if (ent->level >= 0 && wheel->slots[ent->level][ent->slot] == NULL) {
+		wheel->occupied[ent->level] &= ~(1ULL << ent->slot);
+	}
+
+	ent->next = NULL;
+	ent->pprev = NULL;
+	ent->level = -1;
+}
+
+static void
+rspamd_timer_wheel_place(struct rspamd_timer_wheel *wheel,
+						 struct rspamd_timer_wheel_entry *ent)
+{
+	int level, slot = 0;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = level * WHEEL_BITS;
+
+		if ((ent->expire >> shift) - (wheel->now >> shift) < WHEEL_SLOTS) {
+			slot = (ent->expire >> shift) & WHEEL_MASK;
+			break;
+		}
+	}
+
+	if (level == WHEEL_LEVELS) {
+		/* Too far in future, the farthest slot is cascaded again */
+		level = WHEEL_LEVELS - 1;
+		slot = ((wheel->now >> (level * WHEEL_BITS)) + WHEEL_MASK) & WHEEL_MASK;
+	}
+
+	rspamd_timer_wheel_link(&wheel->slots[level][slot], ent);
+	ent->level = level;
+	ent->slot = slot;
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+/* Number of ticks (>= 1) until the wheel has something to do */
+static uint64_t
+rspamd_timer_wheel_next_delta(struct rspamd_timer_wheel *wheel)
+{
+	unsigned int pos = (wheel->now + 1) & WHEEL_MASK;
+	uint64_t to_boundary = WHEEL_SLOTS - (wheel->now & WHEEL_MASK), delta = to_boundary;
+	uint64_t bits = wheel->occupied[0];
+	int level;
+
+	if (bits) {
+		/* Rotate, so the next slot becomes the lowest bit */
+		if (pos) {
+			bits = (bits >> pos) | (bits << (WHEEL_SLOTS - pos));
+		}
+
+		delta = __builtin_ctzll(bits) + 1;
+	}
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (wheel->occupied[level]) {
+			/* Upper levels are cascaded at the level 0 boundary */
+			return MIN(delta, to_boundary);
+		}
+	}
+
+	return delta;
+}
+
+static void
+rspamd_timer_wheel_schedule(struct rspamd_timer_wheel *wheel)
+{
+	uint64_t wakeup;
+	ev_tstamp after;
+
+	if (wheel->count == 0) {
+		if (ev_is_active(&wheel->tm)) {
+			ev_timer_stop(wheel->loop, &wheel->tm);
+		}
+
+		return;
+	}
+
+	wakeup = wheel->now + rspamd_timer_wheel_next_delta(wheel);
+
+	if (ev_is_active(&wheel->tm)) {
+		if (wheel->wakeup <= wakeup) {
+			return;
+		}
+
+		ev_timer_stop(wheel->loop, &wheel->tm);
+	}
+
+	/* Small bias to be sure that the target tick is reached */
+	after = wakeup * RSPAMD_TIMER_WHEEL_RESOLUTION - ev_now(wheel->loop) + 1e-6;
+	wheel->wakeup = wakeup;
+	ev_timer_set(&wheel->tm, MAX(after, 0.0), 0.0);
+	ev_timer_start(wheel->loop, &wheel->tm);
+}
+
+static void
+rspamd_timer_wheel_cascade(struct rspamd_timer_wheel *wheel, int level)
+{
+	unsigned int slot = (wheel->now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	struct rspamd_timer_wheel_entry *cur = wheel->slots[level][slot], *next;
+
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~(1ULL << slot);
+
+	while (cur) {
+		next = cur->next;
+		rspamd_timer_wheel_place(wheel, cur);
+		cur = next;
+	}
+}
+
+static void
+rspamd_timer_wheel_advance(struct rspamd_timer_wheel *wheel, uint64_t to)
+{
+	struct rspamd_timer_wheel_entry *pending, *ent;
+	unsigned int slot;
+	int level;
+
+	while (wheel->now < to) {
+		if (wheel->count == 0) {
+			wheel->now = to;
+			break;
+		}
+
+		if (wheel->occupied[0] == 0) {
+			/* Nothing to fire until the next boundary */
+			wheel->now = MIN(wheel->now | WHEEL_MASK, to);
+
+			if (wheel->now == to) {
+				break;
+			}
+		}
+
+		wheel->now++;
+
+		if ((wheel->now & WHEEL_MASK) == 0) {
+			/* Cascade levels from the top one that has its boundary crossed */
+			for (level = 1; level < WHEEL_LEVELS; level++) {
+				if ((wheel->now >> (level * WHEEL_BITS)) & WHEEL_MASK) {
+					break;
+				}
+			}
+
+			for (level = MIN(level, WHEEL_LEVELS - 1); level > 0; level--) {
+				rspamd_timer_wheel_cascade(wheel, level);
+			}
+		}
+
+		slot = wheel->now & WHEEL_MASK;
+
+		if (wheel->slots[0][slot] == NULL) {
+			continue;
+		}
+
+		/*
+		 * Move entries to a local list, so callbacks could freely add or
+		 * remove any timers including ones from this list
+		 */
+		pending = NULL;
+		wheel->slots[0][slot]->pprev = &pending;
+		pending = wheel->slots[0][slot];
+		wheel->slots[0][slot] = NULL;
+		wheel->occupied[0] &= ~(1ULL << slot);
+
+		for (ent = pending; ent != NULL; ent = ent->next) {
+			ent->level = -1;
+		}
+
+		while ((ent = pending) != NULL) {
+			rspamd_timer_wheel_unlink(wheel, ent);
+
+			if (ent->expire > wheel->now) {
+				/* Clamped timer */
+				rspamd_timer_wheel_place(wheel, ent);
+				continue;
+			}
+
+			wheel->count--;
+			ent->cb(ent, ent->ud);
+		}
+	}
+}
+
+static void
+rspamd_timer_wheel_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_timer_wheel *wheel = (struct rspamd_timer_wheel *) w->data;
+
+	rspamd_timer_wheel_advance(wheel, rspamd_timer_wheel_tick(ev_now(EV_A)));
+	rspamd_timer_wheel_schedule(wheel);
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_new(struct ev_loop *loop)
+{
+	struct rspamd_timer_wheel *wheel;
+
+	wheel = g_malloc0(sizeof(*wheel));
+	wheel->loop = loop;
+	wheel->now = rspamd_timer_wheel_tick(ev_now(loop));
+	wheel->tm.data = wheel;
+	ev_init(&wheel->tm, rspamd_timer_wheel_timer_cb);
+
+	return wheel;
+}
+
+void rspamd_timer_wheel_destroy(struct rspamd_timer_wheel *wheel)
+{
+	int level, slot;
+	struct rspamd_timer_wheel_entry *ent;
+
+	if (wheel) {
+		if (ev_is_active(&wheel->tm)) {
+			ev_timer_stop(wheel->loop, &wheel->tm);
+		}
+
+		/* Make pending entries inactive so their owners could still stop them */
+		for (level = 0; level < WHEEL_LEVELS; level++) {
+			for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+				while ((ent = wheel->slots[level][slot]) != NULL) {
+					rspamd_timer_wheel_unlink(wheel, ent);
+				}
+			}
+		}
+
+		g_free(wheel);
+	}
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_attach(struct ev_loop *loop)
+{
+	struct rspamd_timer_wheel *wheel = rspamd_timer_wheel_get(loop);
+
+	if (wheel == NULL) {
+		wheel = rspamd_timer_wheel_new(loop);
+		ev_set_userdata(loop, wheel);
+	}
+
+	return wheel;
+}
+
+void rspamd_timer_wheel_detach(struct ev_loop *loop)
+{
+	struct rspamd_timer_wheel *wheel = rspamd_timer_wheel_get(loop);
+
+	if (wheel) {
+		ev_set_userdata(loop, NULL);
+		rspamd_timer_wheel_destroy(wheel);
+	}
+}
+
+struct rspamd_timer_wheel *
+rspamd_timer_wheel_get(struct ev_loop *loop)
+{
+	return (struct rspamd_timer_wheel *) ev_userdata(loop);
+}
+
+void rspamd_timer_wheel_entry_init(struct rspamd_timer_wheel_entry *ent,
+								   rspamd_timer_wheel_cb cb, void *ud)
+{
+	memset(ent, 0, sizeof(*ent));
+	ent->cb = cb;
+	ent->ud = ud;
+	ent->level = -1;
+}
+
+void rspamd_timer_wheel_add(struct rspamd_timer_wheel *wheel,
+							struct rspamd_timer_wheel_entry *ent,
+							ev_tstamp timeout)
+{
+	uint64_t expire;
+
+	g_assert(ent->cb != NULL);
+
+	if (rspamd_timer_wheel_entry_active(ent)) {
+		rspamd_timer_wheel_remove(wheel, ent);
+	}
+
+	if (wheel->count == 0 && !ev_is_active(&wheel->tm)) {
+		/* Nothing to process, so just catch up with the current time */
+		wheel->now = MAX(wheel->now, rspamd_timer_wheel_tick(ev_now(wheel->loop)));
+	}
+
+	/* Round up to never fire early */
+	expire = (uint64_t) ceil((ev_now(wheel->loop) + MAX(timeout, 0.0)) /
+							 RSPAMD_TIMER_WHEEL_RESOLUTION);
+	ent->expire = MAX(expire, wheel->now + 1);
+	rspamd_timer_wheel_place(wheel, ent);
+	wheel->count++;
+	rspamd_timer_wheel_schedule(wheel);
+}
+
+void rspamd_timer_wheel_remove(struct rspamd_timer_wheel *wheel,
+							   struct rspamd_timer_wheel_entry *ent)
+{
+	if (rspamd_timer_wheel_entry_active(ent)) {
+		rspamd_timer_wheel_unlink(wheel, ent);
+		wheel->count--;
+
+		/*
+		 * Otherwise the driving timer is left as is, as a spurious wakeup is
+		 * cheaper than rearming on each removal
+		 */
+		if (wheel->count == 0 && ev_is_active(&wheel->tm)) {
+			ev_timer_stop(wheel->loop, &wheel->tm);
+		}
+	}
+}
+
+gsize rspamd_timer_wheel_count(struct rspamd_timer_wheel *wheel)
+{
+	return wheel->count;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RSPAMD_TIMER_WHEEL_H
+#define RSPAMD_TIMER_WHEEL_H
+
+#include "config.h"
+#include "contrib/libev/ev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hierarchical timer wheel for coarse timeouts (network IO, DNS, redis and so on):
+ * adding and removing of a timer is O(1) and the whole wheel is driven by a single
+ * libev timer. Timers are never fired early but could be fired up to
+ * RSPAMD_TIMER_WHEEL_RESOLUTION later than requested.
+ */
+#define RSPAMD_TIMER_WHEEL_RESOLUTION 0.01
+
+struct rspamd_timer_wheel;
+struct rspamd_timer_wheel_entry;
+
+typedef void (*rspamd_timer_wheel_cb)(struct rspamd_timer_wheel_entry *ent, void *ud);
+
+/* Embedded in the owner's structure, all fields are private */
+struct rspamd_timer_wheel_entry {
+	struct rspamd_timer_wheel_entry *next;
+	struct rspamd_timer_wheel_entry **pprev;
+	uint64_t expire;
+	rspamd_timer_wheel_cb cb;
+	void *ud;
+	int level;
+	int slot;
+};
+
+/**
+ * Creates a timer wheel for the specified loop
+ * @param loop
+ * @return
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_new(struct ev_loop *loop);
+
+/**
+ * Destroys timer wheel, pending timers are not fired
+ * @param wheel
+ */
+void rspamd_timer_wheel_destroy(struct rspamd_timer_wheel *wheel);
+
+/**
+ * Creates a timer wheel and attaches it to the loop (using libev userdata),
+ * so it can be found by `rspamd_timer_wheel_get`
+ * @param loop
+ * @return
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_attach(struct ev_loop *loop);
+
+/**
+ * Detaches and destroys the wheel attached to the loop (if any)
+ * @param loop
+ */
+void rspamd_timer_wheel_detach(struct ev_loop *loop);
+
+/**
+ * Returns a wheel attached to the loop or NULL
+ * @param loop
+ * @return
+ */
+struct rspamd_timer_wheel *rspamd_timer_wheel_get(struct ev_loop *loop);
+
+/**
+ * Initialises timer wheel entry, must be called before other operations
+ * @param ent
+ * @param cb
+ * @param ud
+ */
+void rspamd_timer_wheel_entry_init(struct rspamd_timer_wheel_entry *ent,
+								   rspamd_timer_wheel_cb cb, void *ud);
+
+/**
+ * Arms timer to fire after `timeout` seconds, rearms it if it is already active
+ * @param wheel
+ * @param ent
+ * @param timeout
+ */
+void rspamd_timer_wheel_add(struct rspamd_timer_wheel *wheel,
+							struct rspamd_timer_wheel_entry *ent,
+							ev_tstamp timeout);
+
+/**
+ * Disarms timer, it is safe to call it for an inactive entry
+ * @param wheel
+ * @param ent
+ */
+void rspamd_timer_wheel_remove(struct rspamd_timer_wheel *wheel,
+							   struct rspamd_timer_wheel_entry *ent);
+
+/**
+ * Returns TRUE if timer is armed
+ * @param ent
+ * @return
+ */
+static inline gboolean
+rspamd_timer_wheel_entry_active(const struct rspamd_timer_wheel_entry *ent)
+{
+	return ent->pprev != NULL;
+}
+
+/**
+ * Returns number of armed timers
+ * @param wheel
+ * @return
+ */
+gsize rspamd_timer_wheel_count(struct rspamd_timer_wheel *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
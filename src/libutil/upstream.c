@@ -57,8 +57,10 @@ struct upstream {
 	unsigned int dns_requests;
 	int active_idx;
 	unsigned int ttl;
+	unsigned int inflight; /* requests sent with latency or bounded hash rotation */
 	char *name;
 	ev_timer ev;
+	double latency; /* moving average of response time */
 	double last_fail;
 	double last_resolve;
 	gpointer ud;
@@ -92,11 +94,18 @@ struct upstream_limits {
 	unsigned int dns_retransmits;
 };
 
+struct upstream_ring_point {
+	uint64_t hash;
+	struct upstream *up;
+};
+
 struct upstream_list {
 	char *ups_line;
 	struct upstream_ctx *ctx;
 	GPtrArray *ups;
 	GPtrArray *alive;
+	struct upstream_ring_point *ring; /* lazily built for bounded hash rotation */
+	unsigned int ring_len;
 	struct upstream_list_watcher *watchers;
 	uint64_t hash_seed;
 	const struct upstream_limits *limits;
@@ -176,6 +185,16 @@ static const struct upstream_limits default_limits = {
 
 static void rspamd_upstream_lazy_resolve_cb(struct ev_loop *, ev_timer *, int);
 
+static inline void
+rspamd_upstreams_ring_invalidate(struct upstream_list *ups)
+{
+	if (ups->ring) {
+		g_free(ups->ring);
+		ups->ring = NULL;
+		ups->ring_len = 0;
+	}
+}
+
 void rspamd_upstreams_library_config(struct rspamd_config *cfg,
 									 struct upstream_ctx *ctx,
 									 struct ev_loop *event_loop,
@@ -822,6 +841,10 @@ void rspamd_upstream_fail(struct upstream *upstream,
 					   upstream->name,
 					   reason);
 
+	if (upstream->inflight > 0) {
+		upstream->inflight--;
+	}
+
 	if (upstream->ctx && upstream->active_idx != -1 && upstream->ls) {
 		sec_cur = rspamd_get_ticks(FALSE);
 
@@ -927,12 +950,37 @@ void rspamd_upstream_fail(struct upstream *upstream,
 	}
 }
 
+/* Weight of a new sample in the response time average */
+static const double upstream_latency_alpha = 0.25;
+
+void rspamd_upstream_ok_latency(struct upstream *upstream, double latency)
+{
+	RSPAMD_UPSTREAM_LOCK(upstream);
+
+	if (latency >= 0) {
+		if (upstream->latency > 0) {
+			upstream->latency += upstream_latency_alpha * (latency - upstream->latency);
+		}
+		else {
+			upstream->latency = latency;
+		}
+	}
+
+	RSPAMD_UPSTREAM_UNLOCK(upstream);
+	rspamd_upstream_ok(upstream);
+}
+
 void rspamd_upstream_ok(struct upstream *upstream)
 {
 	struct upstream_addr_elt *addr_elt;
 	struct upstream_list_watcher *w;
 
 	RSPAMD_UPSTREAM_LOCK(upstream);
+
+	if (upstream->inflight > 0) {
+		upstream->inflight--;
+	}
+
 	if (upstream->errors > 0 && upstream->active_idx != -1 && upstream->ls) {
 		/* We touch upstream if and only if it is active */
 		msg_debug_upstream("reset errors on upstream %s (was %ud)", upstream->name, upstream->errors);
@@ -959,6 +1007,11 @@ void rspamd_upstream_set_weight(struct upstream *up, unsigned int weight)
 	RSPAMD_UPSTREAM_LOCK(up);
 	up->weight = weight;
 	RSPAMD_UPSTREAM_UNLOCK(up);
+
+	if (up->ls) {
+		/* Virtual nodes depend on weights */
+		rspamd_upstreams_ring_invalidate(up->ls);
+	}
 }
 
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
@@ -1197,6 +1250,7 @@ rspamd_upstreams_add_upstream(struct upstream_list *ups, const char *str,
 	}
 
 	g_ptr_array_add(ups->ups, upstream);
+	rspamd_upstreams_ring_invalidate(ups);
 	upstream->ud = data;
 	upstream->cur_weight = upstream->weight;
 	upstream->ls = ups;
@@ -1279,10 +1333,18 @@ rspamd_upstreams_parse_line_len(struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_ROUND_ROBIN;
 		p += sizeof("round-robin:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "bounded-hash:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_HASHED_BOUNDED;
+		p += sizeof("bounded-hash:") - 1;
+	}
 	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "hash:")) {
 		ups->rot_alg = RSPAMD_UPSTREAM_HASHED;
 		p += sizeof("hash:") - 1;
 	}
+	else if (RSPAMD_LEN_CHECK_STARTS_WITH(p, len, "latency:")) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof("latency:") - 1;
+	}
 
 	while (p < end) {
 		span_len = rspamd_memcspn(p, separators, end - p);
@@ -1370,6 +1432,7 @@ void rspamd_upstreams_destroy(struct upstream_list *ups)
 		}
 
 		g_free(ups->ups_line);
+		g_free(ups->ring);
 		g_ptr_array_free(ups->ups, TRUE);
 #ifdef UPSTREAMS_THREAD_SAFE
 		rspamd_mutex_free(ups->lock);
@@ -1497,6 +1560,55 @@ rspamd_upstream_get_round_robin(struct upstream_list *ups,
 	return selected;
 }
 
+/* Upstreams with no samples are preferred until they have requests in flight */
+static const double upstream_latency_min = 0.001;
+
+static inline double
+rspamd_upstream_latency_score(struct upstream *up)
+{
+	return (up->latency + upstream_latency_min) * (up->inflight + 1) *
+		   (up->errors + 1);
+}
+
+/*
+ * Power of two choices: select two random upstreams and use one with the
+ * lower expected response time, so slow upstreams get less load while
+ * fast ones are not overloaded as with selection of the fastest one
+ */
+static struct upstream *
+rspamd_upstream_get_latency(struct upstream_list *ups,
+							struct upstream *except)
+{
+	struct upstream *first, *second, *selected;
+	unsigned int navail = ups->alive->len;
+
+	if (except != NULL && except->active_idx >= 0) {
+		navail--;
+	}
+
+	first = rspamd_upstream_get_random(ups, except);
+
+	if (navail < 2) {
+		selected = first;
+	}
+	else {
+		do {
+			second = rspamd_upstream_get_random(ups, except);
+		} while (second == first);
+
+		selected = rspamd_upstream_latency_score(second) <
+						   rspamd_upstream_latency_score(first)
+					   ? second
+					   : first;
+	}
+
+	RSPAMD_UPSTREAM_LOCK(selected);
+	selected->inflight++;
+	RSPAMD_UPSTREAM_UNLOCK(selected);
+
+	return selected;
+}
+
 /*
  * The key idea of this function is obtained from the following paper:
  * A Fast, Minimal Memory, Consistent Hash Algorithm
@@ -1562,6 +1674,152 @@ rspamd_upstream_get_hashed(struct upstream_list *ups,
 	return up;
 }
 
+/* Virtual nodes per unit of weight, upstreams with zero weight have weight 1 */
+static const unsigned int upstream_ring_vnodes = 40;
+/* Upstream may have up to (1 + eps) of the average load in flight */
+static const double upstream_bounded_load_eps = 0.25;
+
+static int
+rspamd_upstream_ring_cmp(const void *a, const void *b)
+{
+	const struct upstream_ring_point *p1 = a, *p2 = b;
+
+	if (p1->hash < p2->hash) {
+		return -1;
+	}
+	else if (p1->hash > p2->hash) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_upstreams_ring_build(struct upstream_list *ups)
+{
+	struct upstream *up;
+	unsigned int i, j, npoints = 0, nvnodes;
+	uint64_t h;
+
+	for (i = 0; i < ups->ups->len; i++) {
+		up = g_ptr_array_index(ups->ups, i);
+		npoints += upstream_ring_vnodes * MAX(up->weight, 1);
+	}
+
+	ups->ring = g_malloc(sizeof(*ups->ring) * npoints);
+	ups->ring_len = 0;
+
+	for (i = 0; i < ups->ups->len; i++) {
+		up = g_ptr_array_index(ups->ups, i);
+		nvnodes = upstream_ring_vnodes * MAX(up->weight, 1);
+		/* Points depend on name only to keep keys affinity when list changes */
+		h = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+												up->name, strlen(up->name),
+												ups->hash_seed);
+
+		for (j = 0; j < nvnodes; j++) {
+			ups->ring[ups->ring_len].hash = mum_hash_step(h, j);
+			ups->ring[ups->ring_len].up = up;
+			ups->ring_len++;
+		}
+	}
+
+	qsort(ups->ring, ups->ring_len, sizeof(*ups->ring), rspamd_upstream_ring_cmp);
+}
+
+/*
+ * Consistent hashing with bounded loads:
+ * Vahab Mirrokni, Mikkel Thorup, Morteza Zadimoghaddam
+ *
+ * https://arxiv.org/abs/1608.01350
+ *
+ * A key is mapped to the next point on a ring of virtual nodes, if the
+ * upstream of that point has more than (1 + eps) of the average requests in
+ * flight, then the key spills to the next point clockwise
+ */
+static struct upstream *
+rspamd_upstream_get_hashed_bounded(struct upstream_list *ups,
+								   struct upstream *except,
+								   const uint8_t *key, unsigned int keylen)
+{
+	uint64_t k;
+	unsigned int i, lo, hi, mid, total_inflight = 0, nalive = 0;
+	double max_load;
+	struct upstream *up, *selected = NULL, *fallback = NULL;
+
+	k = rspamd_cryptobox_fast_hash_specific(RSPAMD_CRYPTOBOX_XXHASH64,
+											key, keylen, ups->hash_seed);
+
+	RSPAMD_UPSTREAM_LOCK(ups);
+
+	if (ups->ring == NULL) {
+		rspamd_upstreams_ring_build(ups);
+	}
+
+	for (i = 0; i < ups->alive->len; i++) {
+		up = g_ptr_array_index(ups->alive, i);
+
+		if (up != except) {
+			total_inflight += up->inflight;
+			nalive++;
+		}
+	}
+
+	/* Take the current request into account */
+	max_load = ceil((1.0 + upstream_bounded_load_eps) * (total_inflight + 1) /
+					MAX(nalive, 1));
+
+	/* Find the first point with hash >= k */
+	lo = 0;
+	hi = ups->ring_len;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (ups->ring[mid].hash < k) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (i = 0; i < ups->ring_len; i++) {
+		up = ups->ring[(lo + i) % ups->ring_len].up;
+
+		if (up->active_idx < 0 || up == except) {
+			continue;
+		}
+
+		if (fallback == NULL) {
+			fallback = up;
+		}
+
+		if (up->inflight + 1 <= max_load) {
+			selected = up;
+			break;
+		}
+	}
+
+	if (selected == NULL) {
+		selected = fallback;
+	}
+	RSPAMD_UPSTREAM_UNLOCK(ups);
+
+	if (selected == NULL) {
+		/* We failed to find any active upstream */
+		selected = rspamd_upstream_get_random(ups, except);
+		msg_info("failed to find hashed upstream for %s, fallback to random: %s",
+				 ups->ups_line, selected->name);
+	}
+
+	RSPAMD_UPSTREAM_LOCK(selected);
+	selected->inflight++;
+	RSPAMD_UPSTREAM_UNLOCK(selected);
+
+	return selected;
+}
+
 static struct upstream *
 rspamd_upstream_get_common(struct upstream_list *ups,
 						   struct upstream *except,
@@ -1594,7 +1852,8 @@ rspamd_upstream_get_common(struct upstream_list *ups,
 		type = default_type != RSPAMD_UPSTREAM_UNDEF ? default_type : ups->rot_alg;
 	}
 
-	if (type == RSPAMD_UPSTREAM_HASHED && (keylen == 0 || key == NULL)) {
+	if ((type == RSPAMD_UPSTREAM_HASHED || type == RSPAMD_UPSTREAM_HASHED_BOUNDED) &&
+		(keylen == 0 || key == NULL)) {
 		/* Cannot use hashed rotation when no key is specified, switch to random */
 		type = RSPAMD_UPSTREAM_RANDOM;
 	}
@@ -1607,12 +1866,18 @@ rspamd_upstream_get_common(struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_HASHED:
 		up = rspamd_upstream_get_hashed(ups, except, key, keylen);
 		break;
+	case RSPAMD_UPSTREAM_HASHED_BOUNDED:
+		up = rspamd_upstream_get_hashed_bounded(ups, except, key, keylen);
+		break;
 	case RSPAMD_UPSTREAM_ROUND_ROBIN:
 		up = rspamd_upstream_get_round_robin(ups, except, TRUE);
 		break;
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin(ups, except, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency(ups, except);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
@@ -35,6 +35,8 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
+	RSPAMD_UPSTREAM_HASHED_BOUNDED,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -86,6 +88,14 @@ void rspamd_upstream_fail(struct upstream *upstream, gboolean addr_failure, cons
  */
 void rspamd_upstream_ok(struct upstream *up);
 
+/**
+ * Same as `rspamd_upstream_ok` but also updates response time of an upstream
+ * used by latency rotation
+ * @param up upstream
+ * @param latency time spent for a request in seconds
+ */
+void rspamd_upstream_ok_latency(struct upstream *up, double latency);
+
 /**
  * Set weight for an upstream
  * @param up
@@ -292,7 +302,7 @@ gpointer rspamd_upstream_get_data(struct upstream *up);
 /**
  * Get new upstream from the list
  * @param ups upstream list
- * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments
+ * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` and `RSPAMD_UPSTREAM_HASHED_BOUNDED` it is required to specify `key` and `keylen` as arguments
  * @return
  */
 struct upstream *rspamd_upstream_get(struct upstream_list *ups,
@@ -302,7 +312,7 @@ struct upstream *rspamd_upstream_get(struct upstream_list *ups,
 /**
  * Get new upstream from the list
  * @param ups upstream list
- * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments
+ * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` and `RSPAMD_UPSTREAM_HASHED_BOUNDED` it is required to specify `key` and `keylen` as arguments
  * @return
  */
 struct upstream *rspamd_upstream_get_forced(struct upstream_list *ups,
@@ -312,7 +322,7 @@ struct upstream *rspamd_upstream_get_forced(struct upstream_list *ups,
 /**
  * Get new upstream from the list excepting the upstream specified
  * @param ups upstream list
- * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` it is required to specify `key` and `keylen` as arguments
+ * @param type type of rotation algorithm, for `RSPAMD_UPSTREAM_HASHED` and `RSPAMD_UPSTREAM_HASHED_BOUNDED` it is required to specify `key` and `keylen` as arguments
  * @return
  */
 struct upstream *rspamd_upstream_get_except(struct upstream_list *ups,
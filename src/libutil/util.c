@@ -2744,3 +2744,43 @@ void rspamd_normalize_path_inplace(char *path, unsigned int len, gsize *nlen)
 		*nlen = (o - path);
 	}
 }
+
+unsigned int
+rspamd_sample_ranges(gsize total, gsize budget,
+					 struct rspamd_sample_range *ranges)
+{
+	const unsigned int npieces = RSPAMD_SAMPLE_MAX_RANGES - 2;
+	gsize head, tail, piece, slice;
+	unsigned int i, n = 0;
+
+	if (budget == 0 || total <= budget) {
+		ranges[0].off = 0;
+		ranges[0].len = total;
+
+		return 1;
+	}
+
+	head = budget / 2;
+	tail = budget / 4;
+	piece = (budget - head - tail) / npieces;
+	/* Middle is longer than npieces * piece, so pieces never overlap */
+	slice = (total - head - tail) / npieces;
+
+	ranges[n].off = 0;
+	ranges[n++].len = head;
+
+	if (piece > 0) {
+		for (i = 0; i < npieces; i++) {
+			/* Each piece is centered in its slice of the middle */
+			ranges[n].off = head + i * slice + (slice - piece) / 2;
+			ranges[n++].len = piece;
+		}
+	}
+
+	if (tail > 0) {
+		ranges[n].off = total - tail;
+		ranges[n++].len = tail;
+	}
+
+	return n;
+}
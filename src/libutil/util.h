@@ -574,6 +574,25 @@ float rspamd_sum_floats(float *ar, gsize *nelts);
  */
 void rspamd_normalize_path_inplace(char *path, unsigned int len, gsize *nlen);
 
+#define RSPAMD_SAMPLE_MAX_RANGES 10
+
+struct rspamd_sample_range {
+	gsize off;
+	gsize len;
+};
+
+/**
+ * Selects ranges to process at most `budget` of `total` elements deterministically:
+ * the head (half of the budget), the tail (a quarter) and evenly strided pieces of
+ * the middle. A single range is returned if everything fits the budget
+ * @param total
+ * @param budget
+ * @param ranges array of RSPAMD_SAMPLE_MAX_RANGES elements, ranges are sorted
+ * @return number of ranges
+ */
+unsigned int rspamd_sample_ranges(gsize total, gsize budget,
+								  struct rspamd_sample_range *ranges);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,6 +39,7 @@ const char *rspamd_int64_classname = "rspamd{int64}";
 const char *rspamd_ip_classname = "rspamd{ip}";
 const char *rspamd_kann_node_classname = "rspamd{kann_node}";
 const char *rspamd_kann_classname = "rspamd{kann}";
+const char *rspamd_kann_q8_classname = "rspamd{kann_q8}";
 const char *rspamd_map_classname = "rspamd{map}";
 const char *rspamd_mempool_classname = "rspamd{mempool}";
 const char *rspamd_mimepart_classname = "rspamd{mimepart}";
@@ -49,6 +50,7 @@ const char *rspamd_resolver_classname = "rspamd{resolver}";
 const char *rspamd_rsa_privkey_classname = "rspamd{rsa_privkey}";
 const char *rspamd_rsa_pubkey_classname = "rspamd{rsa_pubkey}";
 const char *rspamd_rsa_signature_classname = "rspamd{rsa_signature}";
+const char *rspamd_rowbinary_classname = "rspamd{rowbinary}";
 const char *rspamd_session_classname = "rspamd{session}";
 const char *rspamd_spf_record_classname = "rspamd{spf_record}";
 const char *rspamd_sqlite3_stmt_classname = "rspamd{sqlite3_stmt}";
@@ -105,6 +107,7 @@ RSPAMD_CONSTRUCTOR(rspamd_lua_init_classnames)
 	CLASS_PUT_STR(ip);
 	CLASS_PUT_STR(kann_node);
 	CLASS_PUT_STR(kann);
+	CLASS_PUT_STR(kann_q8);
 	CLASS_PUT_STR(map);
 	CLASS_PUT_STR(mempool);
 	CLASS_PUT_STR(mimepart);
@@ -115,6 +118,7 @@ RSPAMD_CONSTRUCTOR(rspamd_lua_init_classnames)
 	CLASS_PUT_STR(rsa_privkey);
 	CLASS_PUT_STR(rsa_pubkey);
 	CLASS_PUT_STR(rsa_signature);
+	CLASS_PUT_STR(rowbinary);
 	CLASS_PUT_STR(session);
 	CLASS_PUT_STR(spf_record);
 	CLASS_PUT_STR(sqlite3_stmt);
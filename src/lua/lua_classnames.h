@@ -42,6 +42,7 @@ extern const char *rspamd_int64_classname;
 extern const char *rspamd_ip_classname;
 extern const char *rspamd_kann_node_classname;
 extern const char *rspamd_kann_classname;
+extern const char *rspamd_kann_q8_classname;
 extern const char *rspamd_map_classname;
 extern const char *rspamd_mempool_classname;
 extern const char *rspamd_mimepart_classname;
@@ -52,6 +53,7 @@ extern const char *rspamd_resolver_classname;
 extern const char *rspamd_rsa_privkey_classname;
 extern const char *rspamd_rsa_pubkey_classname;
 extern const char *rspamd_rsa_signature_classname;
+extern const char *rspamd_rowbinary_classname;
 extern const char *rspamd_session_classname;
 extern const char *rspamd_spf_record_classname;
 extern const char *rspamd_sqlite3_stmt_classname;
@@ -72,7 +74,7 @@ extern const char *rspamd_zstd_compress_classname;
 extern const char *rspamd_zstd_decompress_classname;
 
 /* Keep it consistent when adding new classes */
-#define RSPAMD_MAX_LUA_CLASSES 48
+#define RSPAMD_MAX_LUA_CLASSES 50
 
 /*
  * Return a static class name for a given name (only for known classes) or NULL
@@ -285,6 +285,16 @@ void rspamd_lua_set_path(lua_State *L, const ucl_object_t *cfg_obj, GHashTable *
 
 	char path_buf[PATH_MAX];
 
+	if (cfg_obj) {
+		opts = ucl_object_lookup_path(cfg_obj, "options.lua_bytecode_cache");
+
+		if (opts != NULL && ucl_object_type(opts) == UCL_STRING) {
+			rspamd_lua_set_bytecode_cache(L, ucl_object_tostring(opts));
+		}
+
+		opts = NULL;
+	}
+
 	lua_getglobal(L, "package");
 	lua_getfield(L, -1, "path");
 	old_path = luaL_checkstring(L, -1);
@@ -546,6 +556,217 @@ rspamd_lua_rspamd_version(lua_State *L)
 	return 1;
 }
 
+/* Directory with compiled chunks, shared by all lua states of the process */
+static char *lua_bytecode_cache_dir = NULL;
+
+#ifdef WITH_LUAJIT
+static int
+rspamd_lua_bytecode_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	GByteArray *out = (GByteArray *) ud;
+
+	g_byte_array_append(out, (const uint8_t *) p, sz);
+
+	return 0;
+}
+
+static void
+rspamd_lua_bytecode_store(lua_State *L, const char *path)
+{
+	GByteArray *out = g_byte_array_new();
+	char tmp_path[PATH_MAX];
+	int fd;
+
+	if (lua_dump(L, rspamd_lua_bytecode_writer, out) != 0 || out->len == 0) {
+		g_byte_array_free(out, TRUE);
+		return;
+	}
+
+	rspamd_snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = g_mkstemp_full(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 00644);
+
+	if (fd == -1) {
+		msg_debug("cannot create %s: %s", tmp_path, strerror(errno));
+		g_byte_array_free(out, TRUE);
+		return;
+	}
+
+	/* Rename is atomic, so concurrent loaders see either nothing or a complete chunk */
+	if (write(fd, out->data, out->len) != (ssize_t) out->len ||
+		rename(tmp_path, path) == -1) {
+		msg_debug("cannot store %s: %s", path, strerror(errno));
+		unlink(tmp_path);
+	}
+
+	close(fd);
+	g_byte_array_free(out, TRUE);
+}
+#endif
+
+int rspamd_lua_load_buffer_cached(lua_State *L, const char *data, gsize len,
+								  const char *chunkname)
+{
+#ifdef WITH_LUAJIT
+	rspamd_cryptobox_hash_state_t st;
+	unsigned char digest[rspamd_cryptobox_HASHBYTES];
+	char hexbuf[33], path[PATH_MAX];
+	gpointer map;
+	gsize map_len;
+	int ret;
+
+	if (lua_bytecode_cache_dir == NULL || len == 0 || data[0] == LUA_SIGNATURE[0]) {
+		return luaL_loadbuffer(L, data, len, chunkname);
+	}
+
+	/*
+	 * Chunk name is stored in the bytecode as debug info, and bytecode format
+	 * depends on the LuaJIT build, so both are a part of the key
+	 */
+	rspamd_cryptobox_hash_init(&st, NULL, 0);
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) LUAJIT_VERSION,
+								 sizeof(LUAJIT_VERSION));
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) RVERSION,
+								 sizeof(RVERSION));
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) chunkname,
+								 strlen(chunkname) + 1);
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) data, len);
+	rspamd_cryptobox_hash_final(&st, digest);
+	rspamd_encode_hex_buf(digest, 16, hexbuf, sizeof(hexbuf));
+	hexbuf[32] = '\0';
+	rspamd_snprintf(path, sizeof(path), "%s/%s.luac", lua_bytecode_cache_dir,
+					hexbuf);
+
+	map = rspamd_file_xmap(path, PROT_READ, &map_len, FALSE);
+
+	if (map != NULL) {
+		ret = luaL_loadbuffer(L, map, map_len, chunkname);
+		munmap(map, map_len);
+
+		if (ret == 0) {
+			return 0;
+		}
+
+		/* Damaged entry, it is overwritten below */
+		lua_pop(L, 1);
+	}
+
+	ret = luaL_loadbuffer(L, data, len, chunkname);
+
+	if (ret == 0) {
+		rspamd_lua_bytecode_store(L, path);
+	}
+
+	return ret;
+#else
+	return luaL_loadbuffer(L, data, len, chunkname);
+#endif
+}
+
+int rspamd_lua_load_file_cached(lua_State *L, const char *fname)
+{
+	gpointer map;
+	gsize map_len;
+	char *chunkname;
+	int ret;
+
+	if (lua_bytecode_cache_dir == NULL) {
+		return luaL_loadfile(L, fname);
+	}
+
+	map = rspamd_file_xmap(fname, PROT_READ, &map_len, TRUE);
+
+	if (map == NULL || map_len == 0 || ((const char *) map)[0] == '#') {
+		/* Let lua deal with errors and shebang lines */
+		if (map != NULL) {
+			munmap(map, map_len);
+		}
+
+		return luaL_loadfile(L, fname);
+	}
+
+	chunkname = g_strconcat("@", fname, NULL);
+	ret = rspamd_lua_load_buffer_cached(L, map, map_len, chunkname);
+	g_free(chunkname);
+	munmap(map, map_len);
+
+	return ret;
+}
+
+#ifdef WITH_LUAJIT
+/*
+ * Searcher for `require` that goes before the standard lua files searcher,
+ * so lualib modules are loaded from the bytecode cache as well
+ */
+static int
+rspamd_lua_cached_searcher(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1), *fname;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchpath");
+
+	if (!lua_isfunction(L, -1)) {
+		return 0;
+	}
+
+	lua_pushstring(L, name);
+	lua_getfield(L, -3, "path");
+	lua_call(L, 2, 1);
+
+	if (!lua_isstring(L, -1)) {
+		/* Not found, the standard searcher will report it */
+		return 0;
+	}
+
+	fname = lua_tostring(L, -1);
+
+	if (rspamd_lua_load_file_cached(L, fname) != 0) {
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+						  name, fname, lua_tostring(L, -1));
+	}
+
+	return 1;
+}
+#endif
+
+void rspamd_lua_set_bytecode_cache(lua_State *L, const char *dir)
+{
+#ifdef WITH_LUAJIT
+	if (dir == NULL) {
+		return;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		msg_err("cannot create lua bytecode cache %s: %s", dir, strerror(errno));
+		return;
+	}
+
+	if (lua_bytecode_cache_dir == NULL || strcmp(lua_bytecode_cache_dir, dir) != 0) {
+		g_free(lua_bytecode_cache_dir);
+		lua_bytecode_cache_dir = g_strdup(dir);
+	}
+
+	lua_getfield(L, LUA_REGISTRYINDEX, "rspamd_cached_searcher");
+
+	if (lua_isnil(L, -1)) {
+		lua_getglobal(L, "table");
+		lua_getfield(L, -1, "insert");
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "loaders");
+		lua_remove(L, -2);
+		/* After preload searcher, before the lua files one */
+		lua_pushinteger(L, 2);
+		lua_pushcfunction(L, rspamd_lua_cached_searcher);
+		lua_call(L, 3, 0);
+		lua_pop(L, 1); /* table */
+		lua_pushboolean(L, true);
+		lua_setfield(L, LUA_REGISTRYINDEX, "rspamd_cached_searcher");
+	}
+
+	lua_pop(L, 1);
+#endif
+}
+
 static gboolean
 rspamd_lua_load_env(lua_State *L, const char *fname, int tbl_pos, GError **err)
 {
@@ -555,7 +776,7 @@ rspamd_lua_load_env(lua_State *L, const char *fname, int tbl_pos, GError **err)
 	lua_pushcfunction(L, &rspamd_lua_traceback);
 	err_idx = lua_gettop(L);
 
-	if (luaL_loadfile(L, fname) != 0) {
+	if (rspamd_lua_load_file_cached(L, fname) != 0) {
 		g_set_error(err, g_quark_from_static_string("lua_env"), errno,
 					"cannot load lua file %s: %s",
 					fname,
@@ -985,6 +1206,7 @@ rspamd_lua_init(bool wipe_mem)
 	luaopen_tensor(L);
 	luaopen_parsers(L);
 	luaopen_compress(L);
+	luaopen_rowbinary(L);
 #ifndef WITH_LUAJIT
 	rspamd_lua_add_preload(L, "bit", luaopen_bit);
 	lua_settop(L, 0);
@@ -1091,6 +1313,98 @@ void rspamd_lua_start_gc(struct rspamd_config *cfg)
 	lua_gc(L, LUA_GCRESTART, 0);
 }
 
+/* Size of an incremental step performed when the event loop is idle */
+#define RSPAMD_LUA_GC_IDLE_STEP_KB 64
+
+/*
+ * Garbage produced by tasks is collected between them: small steps are done
+ * when the event loop has nothing else to do, and a larger step is forced
+ * once a finished task leaves too much garbage behind. The collector itself
+ * is still running, so it remains a safety net for huge tasks.
+ */
+static struct rspamd_lua_gc_scheduler {
+	lua_State *L;
+	struct ev_loop *event_loop;
+	ev_idle idle_ev;
+	gsize budget_kb;
+	gsize debt_kb; /* allocated by finished tasks and not processed by steps */
+} lua_gc_sched;
+
+static void
+rspamd_lua_gc_idle_cb(EV_P_ ev_idle *w, int revents)
+{
+	struct rspamd_lua_gc_scheduler *sched = (struct rspamd_lua_gc_scheduler *) w->data;
+	int finished;
+
+	finished = lua_gc(sched->L, LUA_GCSTEP, RSPAMD_LUA_GC_IDLE_STEP_KB);
+
+	if (sched->debt_kb > RSPAMD_LUA_GC_IDLE_STEP_KB) {
+		sched->debt_kb -= RSPAMD_LUA_GC_IDLE_STEP_KB;
+	}
+	else {
+		sched->debt_kb = 0;
+	}
+
+	/* Idle watcher prevents loop from sleeping, so stop it as soon as possible */
+	if (finished || sched->debt_kb == 0) {
+		ev_idle_stop(EV_A_ w);
+	}
+}
+
+void rspamd_lua_gc_scheduler_init(struct rspamd_config *cfg,
+								  struct ev_loop *event_loop)
+{
+	if (cfg->lua_gc_budget == 0 || cfg->lua_state == NULL) {
+		return;
+	}
+
+	lua_gc_sched.L = (lua_State *) cfg->lua_state;
+	lua_gc_sched.event_loop = event_loop;
+	lua_gc_sched.budget_kb = MAX(cfg->lua_gc_budget / 1024, 1);
+	lua_gc_sched.debt_kb = 0;
+	ev_idle_init(&lua_gc_sched.idle_ev, rspamd_lua_gc_idle_cb);
+	ev_set_priority(&lua_gc_sched.idle_ev, EV_MINPRI);
+	lua_gc_sched.idle_ev.data = &lua_gc_sched;
+}
+
+gsize rspamd_lua_gc_task_start(struct rspamd_config *cfg)
+{
+	if (lua_gc_sched.L == NULL || lua_gc_sched.L != cfg->lua_state) {
+		return 0;
+	}
+
+	return lua_gc(lua_gc_sched.L, LUA_GCCOUNT, 0);
+}
+
+void rspamd_lua_gc_task_finish(struct rspamd_config *cfg, gsize start_kb)
+{
+	gsize cur_kb;
+
+	if (lua_gc_sched.L == NULL || lua_gc_sched.L != cfg->lua_state) {
+		return;
+	}
+
+	/*
+	 * Concurrent tasks and collector work are mixed in this difference, but
+	 * it is precise enough to estimate garbage produced by a task
+	 */
+	cur_kb = lua_gc(lua_gc_sched.L, LUA_GCCOUNT, 0);
+
+	if (cur_kb > start_kb) {
+		lua_gc_sched.debt_kb += cur_kb - start_kb;
+	}
+
+	if (lua_gc_sched.debt_kb > lua_gc_sched.budget_kb) {
+		/* Over budget: do the pending work now, but still between tasks */
+		lua_gc(lua_gc_sched.L, LUA_GCSTEP, lua_gc_sched.debt_kb);
+		lua_gc_sched.debt_kb = 0;
+		ev_idle_stop(lua_gc_sched.event_loop, &lua_gc_sched.idle_ev);
+	}
+	else if (lua_gc_sched.debt_kb > 0) {
+		ev_idle_start(lua_gc_sched.event_loop, &lua_gc_sched.idle_ev);
+	}
+}
+
 
 void rspamd_plugins_table_push_elt(lua_State *L, const char *field_name,
 								   const char *new_elt)
@@ -1173,7 +1487,7 @@ rspamd_init_lua_filters(struct rspamd_config *cfg, bool force_load, bool strict)
 			rspamd_snprintf(lua_fname, strlen(module->path) + 2, "@%s",
 							module->path);
 
-			if (luaL_loadbuffer(L, data, fsize, lua_fname) != 0) {
+			if (rspamd_lua_load_buffer_cached(L, (const char *) data, fsize, lua_fname) != 0) {
 				msg_err_config("load of %s failed: %s", module->path,
 							   lua_tostring(L, -1));
 				lua_settop(L, err_idx - 1); /*  Error function */
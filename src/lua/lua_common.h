@@ -143,6 +143,7 @@ enum rspamd_lua_map_type {
 	RSPAMD_LUA_MAP_REGEXP_MULTIPLE,
 	RSPAMD_LUA_MAP_CALLBACK,
 	RSPAMD_LUA_MAP_CDB,
+	RSPAMD_LUA_MAP_URL,
 	RSPAMD_LUA_MAP_UNKNOWN,
 };
 
@@ -156,6 +157,7 @@ struct rspamd_lua_map {
 		struct rspamd_hash_map_helper *hash;
 		struct rspamd_regexp_map_helper *re_map;
 		struct rspamd_cdb_map_helper *cdb_map;
+		struct rspamd_url_map_helper *url_map;
 		struct lua_map_callback_data *cbdata;
 	} data;
 };
@@ -230,6 +232,25 @@ void rspamd_lua_close(lua_State *L);
 
 void rspamd_lua_start_gc(struct rspamd_config *cfg);
 
+/**
+ * Enables Lua GC scheduling between tasks if `lua_gc_budget` is set
+ * @param cfg
+ * @param event_loop worker's event loop used for idle steps
+ */
+void rspamd_lua_gc_scheduler_init(struct rspamd_config *cfg,
+								  struct ev_loop *event_loop);
+
+/**
+ * Returns Lua memory in kilobytes when a task starts (0 if scheduling is disabled)
+ */
+gsize rspamd_lua_gc_task_start(struct rspamd_config *cfg);
+
+/**
+ * Accounts memory allocated by a finished task and schedules GC work for it
+ * @param start_kb value returned by rspamd_lua_gc_task_start
+ */
+void rspamd_lua_gc_task_finish(struct rspamd_config *cfg, gsize start_kb);
+
 /**
 * Sets field in a global variable
 * @param L
@@ -310,6 +331,7 @@ enum rspamd_lua_task_header_type {
 	RSPAMD_TASK_HEADER_PUSH_FULL,
 	RSPAMD_TASK_HEADER_PUSH_COUNT,
 	RSPAMD_TASK_HEADER_PUSH_HAS,
+	RSPAMD_TASK_HEADER_PUSH_TEXT,
 };
 
 int rspamd_lua_push_header(lua_State *L,
@@ -422,6 +444,8 @@ void luaopen_tensor(lua_State *L);
 
 void luaopen_parsers(lua_State *L);
 
+void luaopen_rowbinary(lua_State *L);
+
 void rspamd_lua_dostring(const char *line);
 
 double rspamd_lua_normalize(struct rspamd_config *cfg,
@@ -437,6 +461,33 @@ void rspamd_lua_dumpstack(lua_State *L);
 void rspamd_lua_set_path(lua_State *L, const ucl_object_t *cfg_obj,
 						 GHashTable *vars);
 
+/**
+ * Enables cache of compiled lua chunks in the specified directory (LuaJIT only),
+ * entries are keyed by the source hash, so changed sources are recompiled
+ * @param L lua state, `require` of this state starts to use the cache as well
+ * @param dir cache directory, must be writable by rspamd user only
+ */
+void rspamd_lua_set_bytecode_cache(lua_State *L, const char *dir);
+
+/**
+ * Same as `luaL_loadbuffer` but uses bytecode cache if it is enabled
+ * @param L
+ * @param data
+ * @param len
+ * @param chunkname
+ * @return
+ */
+int rspamd_lua_load_buffer_cached(lua_State *L, const char *data, gsize len,
+								  const char *chunkname);
+
+/**
+ * Same as `luaL_loadfile` but uses bytecode cache if it is enabled
+ * @param L
+ * @param fname
+ * @return
+ */
+int rspamd_lua_load_file_cached(lua_State *L, const char *fname);
+
 /* Set some lua globals */
 gboolean rspamd_lua_set_env(lua_State *L, GHashTable *vars, char **lua_env,
 							GError **err);
@@ -19,6 +19,8 @@
 #include "src/libserver/composites/composites.h"
 #include "libserver/cfg_file_private.h"
 #include "libmime/lang_detection.h"
+#include "libserver/maps/map.h"
+#include "libserver/worker_util.h"
 #include "lua/lua_map.h"
 #include "lua/lua_thread_pool.h"
 #include "utlist.h"
@@ -217,7 +219,11 @@ LUA_FUNCTION_DEF(config, get_classifier);
  *   + `trivial` symbol is trivial (e.g. no network requests)
  *   + `explicit_disable` requires explicit disabling (e.g. via settings)
  *   + `ignore_passthrough` executed even if passthrough result has been set
+ *   + `headers_only` prefilter uses message headers only, so it can be executed before the whole body is received
  * - `parent`: id of parent symbol (useful for virtual symbols)
+ * - `vectorized`: callback is called as `callback(task, symbols)`, where `symbols` is
+ *   a list of virtual children that can be inserted for this task (e.g. not disabled by
+ *   settings); the callback is not called at all if this list is empty
  *
  * @return {number} id of symbol registered
  */
@@ -448,6 +454,14 @@ LUA_FUNCTION_DEF(config, disable_symbol);
  */
 LUA_FUNCTION_DEF(config, get_symbol_parent);
 
+/***
+ * @method rspamd_config:get_symbol_id(symbol)
+ * Returns numeric id of a registered symbol, it can be used in `task:insert_result_bulk`
+ * @param {string} symbol symbol's name
+ * @return {number} symbol id or nil if a symbol is not registered
+ */
+LUA_FUNCTION_DEF(config, get_symbol_id);
+
 /***
  * @method rspamd_config:get_group_symbols(group)
  * Returns list of symbols for a specific group
@@ -563,6 +577,17 @@ LUA_FUNCTION_DEF(config, replace_regexp);
  */
 LUA_FUNCTION_DEF(config, register_worker_script);
 
+/***
+ * @method rspamd_config:export_record(name, data)
+ * Sends a record to the exporter worker, which passes it to
+ * `rspamd_plugins[name].export_callback(data)`. This function never blocks.
+ * Tables are serialized to msgpack only if the exporter is available.
+ * @param {string} name consumer name (e.g. plugin name)
+ * @param {string|text|table} data record
+ * @return {boolean} `true` if a record has been queued, `false` if there is no exporter or it is overloaded
+ */
+LUA_FUNCTION_DEF(config, export_record);
+
 /***
  * @method rspamd_config:add_on_load(function(cfg, ev_base, worker) ... end)
  * Registers the following script to be executed when configuration is completely loaded
@@ -634,6 +659,14 @@ LUA_FUNCTION_DEF(config, get_symbols_cksum);
  */
 LUA_FUNCTION_DEF(config, get_symbols_counters);
 
+/***
+ * @method rspamd_config:get_lua_threads_stat()
+ * Returns usage statistics of Lua coroutines pool of the current process
+ * @return {table} table with fields `created`, `reused`, `freed`, `in_flight`,
+ * `peak_in_flight`, `available` and `max_items`
+ */
+LUA_FUNCTION_DEF(config, get_lua_threads_stat);
+
 /***
  * @method rspamd_config:get_symbols()
  * Returns table of all scores defined in config. From version 2.0 returns table:
@@ -826,6 +859,7 @@ LUA_FUNCTION_DEF(config, init_modules);
  * - `modules` - init modules
  * - `langdet` - language detector
  * - `dns` - DNS resolver
+ * - `maps` - synchronously read maps that are available locally
  * - TODO: add more
  */
 LUA_FUNCTION_DEF(config, init_subsystem);
@@ -893,12 +927,14 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF(config, register_regexp),
 	LUA_INTERFACE_DEF(config, replace_regexp),
 	LUA_INTERFACE_DEF(config, register_worker_script),
+	LUA_INTERFACE_DEF(config, export_record),
 	LUA_INTERFACE_DEF(config, register_re_selector),
 	LUA_INTERFACE_DEF(config, add_on_load),
 	LUA_INTERFACE_DEF(config, add_periodic),
 	LUA_INTERFACE_DEF(config, add_post_init),
 	LUA_INTERFACE_DEF(config, add_config_unload),
 	LUA_INTERFACE_DEF(config, get_symbols_count),
+	LUA_INTERFACE_DEF(config, get_lua_threads_stat),
 	LUA_INTERFACE_DEF(config, get_symbols_cksum),
 	LUA_INTERFACE_DEF(config, get_symbols_counters),
 	{"get_symbols_scores", lua_config_get_symbols},
@@ -909,6 +945,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF(config, set_symbol_callback),
 	LUA_INTERFACE_DEF(config, get_symbol_stat),
 	LUA_INTERFACE_DEF(config, get_symbol_parent),
+	LUA_INTERFACE_DEF(config, get_symbol_id),
 	LUA_INTERFACE_DEF(config, get_group_symbols),
 	LUA_INTERFACE_DEF(config, register_finish_script),
 	LUA_INTERFACE_DEF(config, register_monitored),
@@ -1180,6 +1217,8 @@ struct lua_callback_data {
 		int ref;
 	} callback;
 	gboolean cb_is_ref;
+	/* Callback receives a list of its enabled virtual symbols */
+	gboolean vectorized;
 
 	/* Dynamic data */
 	int stack_level;
@@ -1216,6 +1255,46 @@ rspamd_compare_order_func(gconstpointer a, gconstpointer b)
 	return cb2->order - cb1->order;
 }
 
+struct lua_metric_children_cbdata {
+	lua_State *L;
+	int idx;
+};
+
+static void
+lua_metric_push_child(const char *symbol, void *ud)
+{
+	struct lua_metric_children_cbdata *cbd = ud;
+
+	lua_pushstring(cbd->L, symbol);
+	lua_rawseti(cbd->L, -2, ++cbd->idx);
+}
+
+/*
+ * Pushes a table of virtual children of an item that are allowed for a task
+ * and returns their number; if there are none, nothing is pushed and the item
+ * is finalized, as a vectorized callback has nothing to check
+ */
+static unsigned int
+lua_metric_push_children(lua_State *L, struct rspamd_task *task,
+						 struct rspamd_symcache_dynamic_item *item)
+{
+	struct lua_metric_children_cbdata cbd;
+
+	cbd.L = L;
+	cbd.idx = 0;
+	lua_newtable(L);
+
+	if (rspamd_symcache_dyn_item_foreach_child(task, item,
+											   lua_metric_push_child, &cbd) == 0) {
+		lua_pop(L, 1);
+		rspamd_symcache_finalize_item(task, item);
+
+		return 0;
+	}
+
+	return cbd.idx;
+}
+
 static void
 lua_metric_symbol_callback(struct rspamd_task *task,
 						   struct rspamd_symcache_dynamic_item *item,
@@ -1227,6 +1306,10 @@ lua_metric_symbol_callback(struct rspamd_task *task,
 	lua_State *L = cd->L;
 	struct rspamd_symbol_result *s;
 
+	if (cd->vectorized && lua_metric_push_children(L, task, item) == 0) {
+		return;
+	}
+
 	cd->item = item;
 	rspamd_symcache_item_async_inc(task, item, "lua symbol");
 	lua_pushcfunction(L, &rspamd_lua_traceback);
@@ -1245,7 +1328,14 @@ lua_metric_symbol_callback(struct rspamd_task *task,
 	rspamd_lua_setclass(L, rspamd_task_classname, -1);
 	*ptask = task;
 
-	if ((ret = lua_pcall(L, 1, LUA_MULTRET, err_idx)) != 0) {
+	if (cd->vectorized) {
+		/* Move children table, pushed before the error function, after the task */
+		lua_pushvalue(L, err_idx - 1);
+		lua_remove(L, err_idx - 1);
+		err_idx--;
+	}
+
+	if ((ret = lua_pcall(L, cd->vectorized ? 2 : 1, LUA_MULTRET, err_idx)) != 0) {
 		msg_err_task("call to (%s) failed (%d): %s", cd->symbol, ret,
 					 lua_tostring(L, -1));
 		lua_settop(L, err_idx); /* Not -1 here, as err_func is popped below */
@@ -1364,6 +1454,10 @@ lua_metric_symbol_callback_coro(struct rspamd_task *task,
 	struct rspamd_task **ptask;
 	struct thread_entry *thread_entry;
 
+	if (cd->vectorized && lua_metric_push_children(cd->L, task, item) == 0) {
+		return;
+	}
+
 	cd->item = item;
 	rspamd_symcache_item_async_inc(task, item, "lua coro symbol");
 	thread_entry = lua_thread_pool_get_for_task(task);
@@ -1385,10 +1479,15 @@ lua_metric_symbol_callback_coro(struct rspamd_task *task,
 	rspamd_lua_setclass(thread, rspamd_task_classname, -1);
 	*ptask = task;
 
+	if (cd->vectorized) {
+		/* Children table has been built in the main state */
+		lua_xmove(cd->L, thread, 1);
+	}
+
 	thread_entry->finish_callback = lua_metric_symbol_callback_return;
 	thread_entry->error_callback = lua_metric_symbol_callback_error;
 
-	lua_thread_call(thread_entry, 1);
+	lua_thread_call(thread_entry, cd->vectorized ? 2 : 1);
 }
 
 static void
@@ -1785,6 +1884,9 @@ lua_parse_symbol_flags(const char *str)
 		if (strstr(str, "coro") != NULL) {
 			ret |= SYMBOL_TYPE_USE_CORO;
 		}
+		if (strstr(str, "headers_only") != NULL) {
+			ret |= SYMBOL_TYPE_HEADERS_ONLY;
+		}
 	}
 
 	return ret;
@@ -1907,6 +2009,10 @@ lua_push_symbol_flags(lua_State *L, unsigned int flags, enum lua_push_symbol_fla
 		LUA_OPTION_PUSH(ignore_passthrough);
 	}
 
+	if (flags & SYMBOL_TYPE_HEADERS_ONLY) {
+		LUA_OPTION_PUSH(headers_only);
+	}
+
 	if (flags & SYMBOL_TYPE_NOSTAT) {
 		LUA_OPTION_PUSH(nostat);
 	}
@@ -1965,7 +2071,7 @@ lua_config_register_symbol(lua_State *L)
 	const char *name = NULL, *type_str = NULL,
 			   *description = NULL, *group = NULL;
 	double weight = 0, score = NAN, parent_float = NAN;
-	gboolean one_shot = FALSE;
+	gboolean one_shot = FALSE, vectorized = FALSE;
 	int ret = -1, cbref = -1;
 	unsigned int type = 0, flags = 0;
 	int64_t parent = 0, priority = 0, nshots = 0;
@@ -1977,10 +2083,12 @@ lua_config_register_symbol(lua_State *L)
 		if (!rspamd_lua_parse_table_arguments(L, 2, &err,
 											  RSPAMD_LUA_PARSE_ARGUMENTS_DEFAULT,
 											  "name=S;weight=N;callback=F;type=S;priority=I;parent=D;"
-											  "score=D;description=S;group=S;one_shot=B;nshots=I",
+											  "score=D;description=S;group=S;one_shot=B;nshots=I;"
+											  "vectorized=B",
 											  &name, &weight, &cbref, &type_str,
 											  &priority, &parent_float,
-											  &score, &description, &group, &one_shot, &nshots)) {
+											  &score, &description, &group, &one_shot, &nshots,
+											  &vectorized)) {
 			msg_err_config("bad arguments: %e", err);
 			g_error_free(err);
 			lua_settop(L, prev_top);
@@ -2045,6 +2153,10 @@ lua_config_register_symbol(lua_State *L)
 			lua_settop(L, prev_top);
 			return luaL_error(L, "no callback for symbol %s", name);
 		}
+		else if (vectorized && (!name || (type & SYMBOL_TYPE_VIRTUAL))) {
+			lua_settop(L, prev_top);
+			return luaL_error(L, "vectorized callback requires a named non virtual symbol");
+		}
 
 		if (isnan(parent_float)) {
 			parent = -1;
@@ -2073,6 +2185,16 @@ lua_config_register_symbol(lua_State *L)
 		}
 
 		if (ret != -1) {
+			if (vectorized) {
+				struct lua_callback_data *cd;
+
+				cd = (struct lua_callback_data *) rspamd_symcache_get_cbdata(cfg->cache, name);
+
+				if (cd && cd->magic == rspamd_lua_callback_magic) {
+					cd->vectorized = TRUE;
+				}
+			}
+
 			if (!isnan(score) || group) {
 				if (one_shot) {
 					nshots = 1;
@@ -3195,6 +3317,51 @@ lua_config_register_worker_script(lua_State *L)
 	return 1;
 }
 
+static int
+lua_config_export_record(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	struct rspamd_lua_text *t;
+
+	if (cfg == NULL || name == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (lua_type(L, 3) == LUA_TTABLE) {
+		ucl_object_t *obj;
+		unsigned char *data;
+		size_t len;
+		gboolean ret = FALSE;
+
+		if (rspamd_worker_has_exporter(cfg)) {
+			obj = ucl_object_lua_import(L, 3);
+			data = ucl_object_emit_len(obj, UCL_EMIT_MSGPACK, &len);
+			ucl_object_unref(obj);
+
+			if (data) {
+				ret = rspamd_worker_export_record(cfg, name, data, len);
+				free(data);
+			}
+		}
+
+		lua_pushboolean(L, ret);
+
+		return 1;
+	}
+
+	t = lua_check_text_or_string(L, 3);
+
+	if (t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushboolean(L, rspamd_worker_export_record(cfg, name, t->start, t->len));
+
+	return 1;
+}
+
 static int
 lua_config_add_on_load(lua_State *L)
 {
@@ -3516,6 +3683,44 @@ lua_config_get_symbols_count(lua_State *L)
 	return 1;
 }
 
+static int
+lua_config_get_lua_threads_stat(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	struct lua_thread_pool_stat st;
+
+	if (cfg == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (cfg->lua_thread_pool == NULL) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	lua_thread_pool_get_stat((struct lua_thread_pool *) cfg->lua_thread_pool, &st);
+
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, st.created);
+	lua_setfield(L, -2, "created");
+	lua_pushinteger(L, st.reused);
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, st.freed);
+	lua_setfield(L, -2, "freed");
+	lua_pushinteger(L, st.in_flight);
+	lua_setfield(L, -2, "in_flight");
+	lua_pushinteger(L, st.peak_in_flight);
+	lua_setfield(L, -2, "peak_in_flight");
+	lua_pushinteger(L, st.available);
+	lua_setfield(L, -2, "available");
+	lua_pushinteger(L, st.max_items);
+	lua_setfield(L, -2, "max_items");
+
+	return 1;
+}
+
 static int
 lua_config_get_symbols_cksum(lua_State *L)
 {
@@ -3865,6 +4070,31 @@ lua_config_get_symbol_parent(lua_State *L)
 	return 1;
 }
 
+static int
+lua_config_get_symbol_id(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_config *cfg = lua_check_config(L, 1);
+	const char *sym = luaL_checkstring(L, 2);
+	int id;
+
+	if (cfg != NULL && sym != NULL) {
+		id = rspamd_symcache_find_symbol(cfg->cache, sym);
+
+		if (id >= 0) {
+			lua_pushinteger(L, id);
+		}
+		else {
+			lua_pushnil(L);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static int
 lua_config_get_group_symbols(lua_State *L)
 {
@@ -4523,6 +4753,9 @@ lua_config_init_subsystem(lua_State *L)
 			else if (strcmp(parts[i], "symcache") == 0) {
 				rspamd_symcache_init(cfg->cache);
 			}
+			else if (strcmp(parts[i], "maps") == 0) {
+				rspamd_map_preload(cfg);
+			}
 			else {
 				int ret = luaL_error(L, "invalid param: %s", parts[i]);
 				g_strfreev(parts);
@@ -96,7 +96,9 @@ LUA_FUNCTION_DEF(cryptobox_hash, base32);
 LUA_FUNCTION_DEF(cryptobox_hash, base64);
 LUA_FUNCTION_DEF(cryptobox_hash, bin);
 LUA_FUNCTION_DEF(cryptobox_hash, gc);
+LUA_FUNCTION_DEF(cryptobox_hash, hash_multi);
 LUA_FUNCTION_DEF(cryptobox, verify_memory);
+LUA_FUNCTION_DEF(cryptobox, verify_memory_many);
 LUA_FUNCTION_DEF(cryptobox, verify_file);
 LUA_FUNCTION_DEF(cryptobox, sign_file);
 LUA_FUNCTION_DEF(cryptobox, sign_memory);
@@ -117,6 +119,7 @@ LUA_FUNCTION_DEF(cryptobox_secretbox, gc);
 
 static const struct luaL_reg cryptoboxlib_f[] = {
 	LUA_INTERFACE_DEF(cryptobox, verify_memory),
+	LUA_INTERFACE_DEF(cryptobox, verify_memory_many),
 	LUA_INTERFACE_DEF(cryptobox, verify_file),
 	LUA_INTERFACE_DEF(cryptobox, sign_memory),
 	LUA_INTERFACE_DEF(cryptobox, sign_file),
@@ -177,6 +180,7 @@ static const struct luaL_reg cryptoboxhashlib_f[] = {
 	LUA_INTERFACE_DEF(cryptobox_hash, create_keyed),
 	LUA_INTERFACE_DEF(cryptobox_hash, create_specific),
 	LUA_INTERFACE_DEF(cryptobox_hash, create_specific_keyed),
+	LUA_INTERFACE_DEF(cryptobox_hash, hash_multi),
 	{NULL, NULL}};
 
 static const struct luaL_reg cryptoboxhashlib_m[] = {
@@ -1373,6 +1377,84 @@ lua_cryptobox_hash_create_specific_keyed(lua_State *L)
 	return 1;
 }
 
+/* Like lua_check_text_or_string but returns NULL instead of raising an error */
+static struct rspamd_lua_text *
+lua_cryptobox_maybe_text(lua_State *L, int pos)
+{
+	if (lua_type(L, pos) == LUA_TSTRING) {
+		return lua_check_text_or_string(L, pos);
+	}
+	else if (lua_type(L, pos) == LUA_TUSERDATA) {
+		return rspamd_lua_check_udata_maybe(L, pos, rspamd_text_classname);
+	}
+
+	return NULL;
+}
+
+/***
+ * @function rspamd_cryptobox_hash.hash_multi(inputs, [key])
+ * Computes blake2b hashes of many strings at once, independent inputs are
+ * hashed in parallel if SIMD implementation is available
+ * @param {table} inputs array of strings or texts
+ * @param {string} key optional key for keyed hashing
+ * @return {table} array of binary hashes (64 bytes each) in the same order as inputs
+ */
+static int
+lua_cryptobox_hash_hash_multi(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_cryptobox_segment *segments;
+	struct rspamd_lua_text *t;
+	const char *key = NULL;
+	unsigned char *out;
+	gsize n, i, keylen = 0;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		key = lua_tolstring(L, 2, &keylen);
+
+		if (keylen > rspamd_cryptobox_HASHKEYBYTES) {
+			return luaL_error(L, "invalid key length: %d", (int) keylen);
+		}
+	}
+
+	n = rspamd_lua_table_size(L, 1);
+	segments = g_new0(struct rspamd_cryptobox_segment, MAX(n, 1));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		t = lua_cryptobox_maybe_text(L, lua_gettop(L));
+
+		if (t == NULL) {
+			g_free(segments);
+
+			return luaL_error(L, "invalid arguments: element %d is not a string", (int) (i + 1));
+		}
+
+		/* Strings are referenced by the input table */
+		segments[i].data = (unsigned char *) t->start;
+		segments[i].len = t->len;
+		lua_pop(L, 1);
+	}
+
+	out = g_malloc(MAX(n, 1) * rspamd_cryptobox_HASHBYTES);
+	rspamd_cryptobox_hash_multi(out, segments, n, key, keylen);
+
+	lua_createtable(L, n, 0);
+
+	for (i = 0; i < n; i++) {
+		lua_pushlstring(L, (const char *) out + i * rspamd_cryptobox_HASHBYTES,
+						rspamd_cryptobox_HASHBYTES);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	g_free(segments);
+	g_free(out);
+
+	return 1;
+}
+
 /***
  * @method cryptobox_hash:update(data)
  * Updates hash with the specified data (hash should not be finalized using `hex` or `bin` methods)
@@ -1791,6 +1873,100 @@ lua_cryptobox_verify_memory(lua_State *L)
 	return 1;
 }
 
+/***
+ * @function rspamd_cryptobox.verify_memory_many(items, [alg = 'curve25519'])
+ * Check many signatures in a single call
+ * @param {table} items array of tables `{pk, sig, data}`, where `data` is a string or text
+ * @param {string} alg algorithm to use
+ * @return {table} array of booleans, `true` if the corresponding signature is valid
+ */
+static int
+lua_cryptobox_verify_memory_many(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_cryptobox_verify_req *reqs;
+	struct rspamd_cryptobox_pubkey *pk;
+	rspamd_fstring_t *signature;
+	struct rspamd_lua_text *t;
+	enum rspamd_cryptobox_mode alg = RSPAMD_CRYPTOBOX_MODE_25519;
+	bool *results;
+	gsize n, i;
+	void *ud;
+	int top;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	if (lua_isstring(L, 2)) {
+		const char *str = lua_tostring(L, 2);
+
+		if (strcmp(str, "nist") == 0 || strcmp(str, "openssl") == 0) {
+			alg = RSPAMD_CRYPTOBOX_MODE_NIST;
+		}
+		else if (strcmp(str, "curve25519") == 0 || strcmp(str, "default") == 0) {
+			alg = RSPAMD_CRYPTOBOX_MODE_25519;
+		}
+		else {
+			return luaL_error(L, "invalid algorithm: %s", str);
+		}
+	}
+
+	n = rspamd_lua_table_size(L, 1);
+	reqs = g_new0(struct rspamd_cryptobox_verify_req, MAX(n, 1));
+	results = g_new0(bool, MAX(n, 1));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			g_free(reqs);
+			g_free(results);
+
+			return luaL_error(L, "invalid arguments: element %d is not a table", (int) (i + 1));
+		}
+
+		/* All objects are referenced by the input table, so pointers stay valid */
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		lua_rawgeti(L, -3, 3);
+		top = lua_gettop(L);
+
+		ud = rspamd_lua_check_udata_maybe(L, top - 2, rspamd_cryptobox_pubkey_classname);
+		pk = ud ? *((struct rspamd_cryptobox_pubkey **) ud) : NULL;
+		ud = rspamd_lua_check_udata_maybe(L, top - 1, rspamd_cryptobox_signature_classname);
+		signature = ud ? *((rspamd_fstring_t **) ud) : NULL;
+		t = lua_cryptobox_maybe_text(L, top);
+
+		if (pk == NULL || signature == NULL || t == NULL) {
+			g_free(reqs);
+			g_free(results);
+
+			return luaL_error(L, "invalid arguments: element %d must be {pubkey, signature, data}",
+							  (int) (i + 1));
+		}
+
+		reqs[i].sig = signature->str;
+		reqs[i].siglen = signature->len;
+		reqs[i].m = t->start;
+		reqs[i].mlen = t->len;
+		reqs[i].pk = rspamd_pubkey_get_pk(pk, NULL);
+		lua_pop(L, 4);
+	}
+
+	rspamd_cryptobox_verify_many(reqs, n, results, alg);
+
+	lua_createtable(L, n, 0);
+
+	for (i = 0; i < n; i++) {
+		lua_pushboolean(L, results[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	g_free(reqs);
+	g_free(results);
+
+	return 1;
+}
+
 /***
  * @function rspamd_cryptobox.verify_file(pk, sig, file, [alg = 'curve25519'])
  * Check file using specified cryptobox key and signature
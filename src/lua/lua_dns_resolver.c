@@ -52,6 +52,8 @@ LUA_FUNCTION_DEF(dns_resolver, resolve_mx);
 LUA_FUNCTION_DEF(dns_resolver, resolve_ns);
 LUA_FUNCTION_DEF(dns_resolver, resolve);
 LUA_FUNCTION_DEF(dns_resolver, idna_convert_utf8);
+LUA_FUNCTION_DEF(dns_resolver, get_cache_stats);
+LUA_FUNCTION_DEF(dns_resolver, prefetch);
 
 void lua_push_dns_reply(lua_State *L, const struct rdns_reply *reply);
 
@@ -67,6 +69,8 @@ static const struct luaL_reg dns_resolverlib_m[] = {
 	LUA_INTERFACE_DEF(dns_resolver, resolve_ns),
 	LUA_INTERFACE_DEF(dns_resolver, resolve),
 	LUA_INTERFACE_DEF(dns_resolver, idna_convert_utf8),
+	LUA_INTERFACE_DEF(dns_resolver, get_cache_stats),
+	LUA_INTERFACE_DEF(dns_resolver, prefetch),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}};
 
@@ -723,6 +727,74 @@ lua_dns_resolver_idna_convert_utf8(lua_State *L)
 	return 1;
 }
 
+/***
+ * @method resolver:get_cache_stats()
+ * Returns statistics of the answers cache in the current process
+ * @return {table} with `hits`, `misses`, `size` and `capacity` fields or nil if cache is disabled
+ */
+static int
+lua_dns_resolver_get_cache_stats(lua_State *L)
+{
+	struct rspamd_dns_resolver *dns_resolver = lua_check_dns_resolver(L, 1);
+
+	if (dns_resolver == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (dns_resolver->answers_cache == NULL) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, dns_resolver->answers_cache_hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, dns_resolver->answers_cache_misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, rspamd_lru_hash_size(dns_resolver->answers_cache));
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, rspamd_lru_hash_capacity(dns_resolver->answers_cache));
+	lua_setfield(L, -2, "capacity");
+
+	return 1;
+}
+
+/***
+ * @method resolver:prefetch(task, name[, type])
+ * Starts a request for the name on behalf of a task with no callback. Requests for
+ * the same name and type issued later for this task (e.g. by `resolve_a`) are
+ * attached to the prefetched one instead of being sent again.
+ * @param {rspamd_task} task task object
+ * @param {string} name name to resolve
+ * @param {string} type request type (`a` by default)
+ * @return {boolean} `true` if the name is being resolved or already known
+ */
+static int
+lua_dns_resolver_prefetch(lua_State *L)
+{
+	struct rspamd_dns_resolver *dns_resolver = lua_check_dns_resolver(L, 1);
+	struct rspamd_task *task = lua_check_task(L, 2);
+	const char *name = luaL_checkstring(L, 3);
+	int type = RDNS_REQUEST_A;
+
+	if (dns_resolver == NULL || task == NULL || name == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (lua_type(L, 4) == LUA_TSTRING) {
+		type = rdns_type_fromstr(lua_tostring(L, 4));
+
+		if (type == RDNS_REQUEST_INVALID) {
+			return luaL_error(L, "invalid request type: %s", lua_tostring(L, 4));
+		}
+	}
+
+	lua_pushboolean(L, rspamd_dns_resolver_prefetch_task(task, type, name));
+
+	return 1;
+}
+
 static int
 lua_load_dns_resolver(lua_State *L)
 {
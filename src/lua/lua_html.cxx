@@ -72,6 +72,7 @@ LUA_FUNCTION_DEF(html, has_tag);
  * - `unknown_element` - part has some unknown elements
  * - `duplicate_element` - part has some duplicate elements that should be unique (namely, `title` tag)
  * - `unbalanced` - part has unbalanced tags
+ * - `too_deep` - part has tags nested deeper than the parser allows, they are flattened
  * @param {string} name name of property
  * @return {boolean} true if the part has the specified property
  */
@@ -243,6 +244,7 @@ constexpr const auto prop_map = frozen::make_unordered_map<frozen::string, int>(
 	{"duplicate_elements", RSPAMD_HTML_FLAG_DUPLICATE_ELEMENTS},
 	{"unbalanced", RSPAMD_HTML_FLAG_UNBALANCED},
 	{"data_urls", RSPAMD_HTML_FLAG_HAS_DATA_URLS},
+	{"too_deep", RSPAMD_HTML_FLAG_TOO_DEEP},
 });
 
 static int
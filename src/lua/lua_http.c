@@ -17,6 +17,8 @@
 #include "lua_thread_pool.h"
 #include "libserver/http/http_private.h"
 #include "libutil/upstream.h"
+#include "libserver/worker_util.h"
+#include "libserver/io_replay.h"
 #include "ref.h"
 #include "unix-std.h"
 #include "zlib.h"
@@ -51,9 +53,11 @@ local function symbol_callback(task)
 static const char *M = "rspamd lua http";
 
 LUA_FUNCTION_DEF(http, request);
+LUA_FUNCTION_DEF(http, keepalive_stat);
 
 static const struct luaL_reg httplib_m[] = {
 	LUA_INTERFACE_DEF(http, request),
+	LUA_INTERFACE_DEF(http, keepalive_stat),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}};
 
@@ -62,6 +66,9 @@ static const struct luaL_reg httplib_m[] = {
 #define RSPAMD_LUA_HTTP_FLAG_RESOLVED (1 << 2)
 #define RSPAMD_LUA_HTTP_FLAG_KEEP_ALIVE (1 << 3)
 #define RSPAMD_LUA_HTTP_FLAG_YIELDED (1 << 4)
+#define RSPAMD_LUA_HTTP_FLAG_REGISTERED (1 << 5)
+#define RSPAMD_LUA_HTTP_FLAG_QUEUED (1 << 6)
+#define RSPAMD_LUA_HTTP_FLAG_REPLAYED (1 << 7)
 
 struct lua_http_cbdata {
 	struct rspamd_http_connection *conn;
@@ -72,6 +79,7 @@ struct lua_http_cbdata {
 	struct rspamd_config *cfg;
 	struct rspamd_task *task;
 	ev_tstamp timeout;
+	ev_tstamp start;
 	struct rspamd_cryptobox_keypair *local_kp;
 	struct rspamd_cryptobox_pubkey *peer_pk;
 	rspamd_inet_addr_t *addr;
@@ -79,12 +87,18 @@ struct lua_http_cbdata {
 	char *host;
 	char *auth;
 	struct upstream *up;
+	struct rspamd_http_keepalive_waiter *waiter;
 	const char *url;
 	gsize max_size;
 	int flags;
 	int fd;
 	int cbref;
 	struct thread_entry *thread;
+	/* Record/replay of replies, key is set only if it is configured */
+	struct rspamd_io_replay *replay;
+	char *replay_key;
+	struct rspamd_http_message *replay_msg;
+	ev_timer replay_ev;
 	ref_entry_t ref;
 };
 
@@ -107,6 +121,24 @@ lua_http_fin(gpointer arg)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) arg;
 
+	if (cbd->waiter) {
+		/* Still waiting for a free keepalive slot */
+		rspamd_http_context_cancel_wait(cbd->waiter);
+		cbd->waiter = NULL;
+	}
+
+	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_REPLAYED) {
+		/* Session is terminated before a replayed reply is due */
+		ev_timer_stop(cbd->event_loop, &cbd->replay_ev);
+		cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_REPLAYED;
+	}
+
+	if (cbd->replay_msg) {
+		rspamd_http_message_unref(cbd->replay_msg);
+	}
+
+	g_free(cbd->replay_key);
+
 	if (cbd->cbref != -1) {
 		luaL_unref(cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->cbref);
 	}
@@ -200,42 +232,48 @@ lua_http_push_error(struct lua_http_cbdata *cbd, const char *err)
 	lua_thread_pool_restore_callback(&lcbd);
 }
 
-static void lua_http_resume_handler(struct rspamd_http_connection *conn,
+static void lua_http_resume_handler(struct lua_http_cbdata *cbd,
 									struct rspamd_http_message *msg, const char *err);
+static void lua_http_register_event(struct lua_http_cbdata *cbd);
 
 static void
-lua_http_error_handler(struct rspamd_http_connection *conn, GError *err)
+lua_http_report_error(struct lua_http_cbdata *cbd, const char *err)
 {
-	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) conn->ud;
-
-	if (cbd->up) {
-		rspamd_upstream_fail(cbd->up, false, err ? err->message : "unknown error");
-	}
-
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
-			lua_http_resume_handler(conn, NULL, err->message);
+			lua_http_resume_handler(cbd, NULL, err);
 		}
 		else {
 			/* TODO: kill me please */
 			msg_info("lost HTTP error from %s in coroutines mess: %s",
 					 rspamd_inet_address_to_string_pretty(cbd->addr),
-					 err->message);
+					 err);
 		}
 	}
 	else {
-		lua_http_push_error(cbd, err->message);
+		lua_http_push_error(cbd, err);
 	}
+}
+
+static void
+lua_http_error_handler(struct rspamd_http_connection *conn, GError *err)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) conn->ud;
+
+	if (cbd->up) {
+		rspamd_upstream_fail(cbd->up, false, err ? err->message : "unknown error");
+	}
+
+	lua_http_report_error(cbd, err->message);
 
 	REF_RELEASE(cbd);
 }
 
-static int
-lua_http_finish_handler(struct rspamd_http_connection *conn,
-						struct rspamd_http_message *msg)
+static void
+lua_http_process_reply(struct lua_http_cbdata *cbd,
+					   struct rspamd_http_message *msg)
 {
-	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) conn->ud;
 	struct rspamd_http_header *h;
 	const char *body;
 	gsize body_len;
@@ -243,10 +281,13 @@ lua_http_finish_handler(struct rspamd_http_connection *conn,
 	struct lua_callback_state lcbd;
 	lua_State *L;
 
+	rspamd_worker_stat_hist_time(RSPAMD_STAT_HIST_HTTP,
+								 ev_now(cbd->event_loop) - cbd->start);
+
 	if (cbd->cbref == -1) {
 		if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_YIELDED) {
 			cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_YIELDED;
-			lua_http_resume_handler(conn, msg, NULL);
+			lua_http_resume_handler(cbd, msg, NULL);
 		}
 		else {
 			/* TODO: kill me please */
@@ -256,12 +297,12 @@ lua_http_finish_handler(struct rspamd_http_connection *conn,
 
 		REF_RELEASE(cbd);
 
-		return 0;
+		return;
 	}
 	lua_thread_pool_prepare_callback(cbd->cfg->lua_thread_pool, &lcbd);
 
 	if (cbd->up) {
-		rspamd_upstream_ok(cbd->up);
+		rspamd_upstream_ok_latency(cbd->up, ev_now(cbd->event_loop) - cbd->start);
 	}
 
 	L = lcbd.L;
@@ -317,18 +358,121 @@ lua_http_finish_handler(struct rspamd_http_connection *conn,
 	REF_RELEASE(cbd);
 
 	lua_thread_pool_restore_callback(&lcbd);
+}
+
+/*
+ * Appends the reply to the io record file, so it could be replayed later
+ */
+static void
+lua_http_record_reply(struct lua_http_cbdata *cbd,
+					  struct rspamd_http_message *msg)
+{
+	struct rspamd_http_header *h;
+	ucl_object_t *reply, *headers;
+	const char *body;
+	gsize body_len;
+
+	reply = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(reply, ucl_object_fromint(msg->code), "code", 0, false);
+	headers = ucl_object_typed_new(UCL_OBJECT);
+
+	kh_foreach_value(msg->headers, h, {
+		ucl_object_insert_key(headers,
+							  ucl_object_fromlstring(h->value.begin, h->value.len),
+							  h->name.begin, h->name.len, true);
+	});
+
+	ucl_object_insert_key(reply, headers, "headers", 0, false);
+	body = rspamd_http_message_get_body(msg, &body_len);
+	ucl_object_insert_key(reply, rspamd_io_replay_data_to_ucl(body, body_len),
+						  "body", 0, false);
+
+	rspamd_io_replay_record(cbd->replay, "http", cbd->replay_key, reply,
+							ev_now(cbd->event_loop) - cbd->start);
+}
+
+static int
+lua_http_finish_handler(struct rspamd_http_connection *conn,
+						struct rspamd_http_message *msg)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) conn->ud;
+
+	if (cbd->replay_key && rspamd_io_replay_is_recording(cbd->replay)) {
+		lua_http_record_reply(cbd, msg);
+	}
+
+	lua_http_process_reply(cbd, msg);
 
 	return 0;
 }
 
+static void
+lua_http_replay_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) w->data;
+
+	cbd->flags &= ~RSPAMD_LUA_HTTP_FLAG_REPLAYED;
+	/* Releases the reference of the request like a real connection does */
+	lua_http_process_reply(cbd, cbd->replay_msg);
+}
+
+/*
+ * Serves the request with a recorded reply if there is one
+ */
+static gboolean
+lua_http_maybe_replay(struct lua_http_cbdata *cbd)
+{
+	struct rspamd_http_message *msg;
+	const ucl_object_t *reply, *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	unsigned char *body;
+	gsize body_len;
+	double latency;
+
+	reply = rspamd_io_replay_lookup(cbd->replay, "http", cbd->replay_key,
+									&latency);
+
+	if (reply == NULL) {
+		return FALSE;
+	}
+
+	msg = rspamd_http_new_message(HTTP_RESPONSE);
+	elt = ucl_object_lookup(reply, "code");
+	msg->code = elt ? ucl_object_toint(elt) : 200;
+	elt = ucl_object_lookup(reply, "headers");
+
+	while ((cur = ucl_object_iterate(elt, &it, true)) != NULL) {
+		if (ucl_object_type(cur) == UCL_STRING) {
+			rspamd_http_message_add_header(msg, ucl_object_key(cur),
+										   ucl_object_tostring(cur));
+		}
+	}
+
+	body = rspamd_io_replay_data_from_ucl(ucl_object_lookup(reply, "body"),
+										  &body_len);
+
+	if (body) {
+		rspamd_http_message_set_body(msg, body, body_len);
+		g_free(body);
+	}
+
+	cbd->replay_msg = msg;
+	cbd->flags |= RSPAMD_LUA_HTTP_FLAG_REPLAYED;
+	lua_http_register_event(cbd);
+	ev_timer_init(&cbd->replay_ev, lua_http_replay_cb, latency, 0.0);
+	cbd->replay_ev.data = cbd;
+	ev_timer_start(cbd->event_loop, &cbd->replay_ev);
+
+	return TRUE;
+}
+
 /*
  * resumes yielded thread
  */
 static void
-lua_http_resume_handler(struct rspamd_http_connection *conn,
+lua_http_resume_handler(struct lua_http_cbdata *cbd,
 						struct rspamd_http_message *msg, const char *err)
 {
-	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) conn->ud;
 	lua_State *L = cbd->thread->lua_state;
 	const char *body;
 	gsize body_len;
@@ -403,6 +547,72 @@ lua_http_resume_handler(struct rspamd_http_connection *conn,
 	lua_thread_resume(cbd->thread, 2);
 }
 
+static void
+lua_http_register_event(struct lua_http_cbdata *cbd)
+{
+	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_REGISTERED) {
+		return;
+	}
+
+	cbd->flags |= RSPAMD_LUA_HTTP_FLAG_REGISTERED;
+
+	if (cbd->session) {
+		if (cbd->item) {
+			rspamd_session_add_event_full(cbd->session,
+										  (event_finalizer_t) lua_http_fin, cbd,
+										  M,
+										  rspamd_symcache_dyn_item_name(cbd->task, cbd->item));
+		}
+		else {
+			rspamd_session_add_event(cbd->session,
+									 (event_finalizer_t) lua_http_fin, cbd,
+									 M);
+		}
+		cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
+	}
+
+	if (cbd->task && cbd->item) {
+		rspamd_symcache_item_async_inc(cbd->task, cbd->item, M);
+	}
+}
+
+static gboolean lua_http_make_connection(struct lua_http_cbdata *cbd);
+
+static void
+lua_http_keepalive_ready(gboolean ready, gpointer ud)
+{
+	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *) ud;
+
+	cbd->waiter = NULL;
+
+	if (!ready) {
+		if (cbd->up) {
+			rspamd_upstream_fail(cbd->up, false, "no free keepalive connections");
+		}
+
+		lua_http_report_error(cbd, "timeout while waiting for a free keepalive connection");
+		REF_RELEASE(cbd);
+
+		return;
+	}
+
+	REF_RETAIN(cbd);
+
+	if (!lua_http_make_connection(cbd)) {
+		lua_http_report_error(cbd, "unable to make connection to the host");
+
+		if (cbd->ref.refcount > 1) {
+			REF_RELEASE(cbd);
+		}
+
+		REF_RELEASE(cbd);
+
+		return;
+	}
+
+	REF_RELEASE(cbd);
+}
+
 static gboolean
 lua_http_make_connection(struct lua_http_cbdata *cbd)
 {
@@ -413,6 +623,24 @@ lua_http_make_connection(struct lua_http_cbdata *cbd)
 		http_opts |= RSPAMD_HTTP_CLIENT_SSL;
 	}
 
+	if ((cbd->flags & RSPAMD_LUA_HTTP_FLAG_KEEP_ALIVE) &&
+		!(cbd->flags & RSPAMD_LUA_HTTP_FLAG_QUEUED) &&
+		rspamd_http_context_keepalive_saturated(NULL, cbd->addr, cbd->host,
+												http_opts & RSPAMD_HTTP_CLIENT_SSL)) {
+		/* Too many connections to this peer, wait for a free one in order */
+		cbd->waiter = rspamd_http_context_wait_keepalive(NULL, cbd->addr, cbd->host,
+														 http_opts & RSPAMD_HTTP_CLIENT_SSL,
+														 cbd->timeout,
+														 lua_http_keepalive_ready, cbd);
+
+		if (cbd->waiter) {
+			cbd->flags |= RSPAMD_LUA_HTTP_FLAG_QUEUED;
+			lua_http_register_event(cbd);
+
+			return TRUE;
+		}
+	}
+
 	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_KEEP_ALIVE) {
 		cbd->fd = -1; /* FD is owned by keepalive connection */
 		cbd->conn = rspamd_http_connection_new_client_keepalive(
@@ -457,27 +685,10 @@ lua_http_make_connection(struct lua_http_cbdata *cbd)
 										   cbd->auth);
 		}
 
-		if (cbd->session) {
-			if (cbd->item) {
-				rspamd_session_add_event_full(cbd->session,
-											  (event_finalizer_t) lua_http_fin, cbd,
-											  M,
-											  rspamd_symcache_dyn_item_name(cbd->task, cbd->item));
-			}
-			else {
-				rspamd_session_add_event(cbd->session,
-										 (event_finalizer_t) lua_http_fin, cbd,
-										 M);
-			}
-			cbd->flags |= RSPAMD_LUA_HTTP_FLAG_RESOLVED;
-		}
+		lua_http_register_event(cbd);
 
 		if (cbd->task) {
 			cbd->conn->log_tag = cbd->task->task_pool->tag.uid;
-
-			if (cbd->item) {
-				rspamd_symcache_item_async_inc(cbd->task, cbd->item, M);
-			}
 		}
 		else if (cbd->cfg) {
 			cbd->conn->log_tag = cbd->cfg->cfg_pool->tag.uid;
@@ -608,7 +819,7 @@ lua_http_push_headers(lua_State *L, struct rspamd_http_message *msg)
  * @param {resolver} resolver to perform DNS-requests. Usually got from either `task` or `config`
  * @param {boolean} gzip if true, body of the requests will be compressed
  * @param {boolean} no_ssl_verify disable SSL peer checks
- * @param {boolean} keepalive enable keep-alive pool
+ * @param {boolean} keepalive enable keep-alive pool; if `http.client.keepalive_max_conns` is set, requests to a busy peer are queued until a connection is free or `timeout` expires
  * @param {string} user for HTTP authentication
  * @param {string} password for HTTP authentication, only if "user" present
  * @return {boolean} `true`, in **async** mode, if a request has been successfully scheduled. If this value is `false` then some error occurred, the callback thus will not be called.
@@ -1046,6 +1257,27 @@ lua_http_request(lua_State *L)
 
 		return 1;
 	}
+	if (task) {
+		timeout = rspamd_task_adjust_timeout(task, timeout);
+
+		if (timeout <= 0) {
+			msg_info_task("do not send http request to %s: task has no time left",
+						  url);
+			lua_pushboolean(L, FALSE);
+
+			g_free(auth);
+			rspamd_http_message_unref(msg);
+			if (body) {
+				rspamd_fstring_free(body);
+			}
+			if (local_kp) {
+				rspamd_keypair_unref(local_kp);
+			}
+
+			return 1;
+		}
+	}
+
 	if (task == NULL && cfg == NULL) {
 		g_free(auth);
 		rspamd_http_message_unref(msg);
@@ -1090,6 +1322,8 @@ lua_http_request(lua_State *L)
 	cbd->auth = auth;
 	cbd->task = task;
 
+	cbd->start = ev_now(ev_base);
+
 	if (up) {
 		cbd->up = rspamd_upstream_ref(up);
 	}
@@ -1119,6 +1353,34 @@ lua_http_request(lua_State *L)
 		cbd->session = session;
 	}
 
+	cbd->replay = rspamd_io_replay_get(cfg);
+
+	if (cbd->replay) {
+		rspamd_cryptobox_fast_hash_state_t st;
+		const char *method = http_method_str(msg->method), *req_body;
+		gsize req_len;
+		char *prefix;
+
+		/* Request is identified by method, url and body */
+		rspamd_cryptobox_fast_hash_init_specific(&st, RSPAMD_CRYPTOBOX_XXHASH64, 0);
+		rspamd_cryptobox_fast_hash_update(&st, method, strlen(method));
+		rspamd_cryptobox_fast_hash_update(&st, url, strlen(url));
+		req_body = rspamd_http_message_get_body(msg, &req_len);
+
+		if (req_len > 0) {
+			rspamd_cryptobox_fast_hash_update(&st, req_body, req_len);
+		}
+
+		prefix = g_strdup_printf("%s %s", method, url);
+		cbd->replay_key = rspamd_io_replay_key(prefix,
+											   rspamd_cryptobox_fast_hash_final(&st));
+		g_free(prefix);
+
+		if (lua_http_maybe_replay(cbd)) {
+			goto done;
+		}
+	}
+
 	bool numeric_ip = false;
 
 	/* Check if we can skip resolving */
@@ -1242,6 +1504,7 @@ lua_http_request(lua_State *L)
 		}
 	}
 
+done:
 	if (cbd->cbref == -1) {
 		cbd->thread = lua_thread_pool_get_running_entry(cfg->lua_thread_pool);
 		cbd->flags |= RSPAMD_LUA_HTTP_FLAG_YIELDED;
@@ -1255,6 +1518,26 @@ lua_http_request(lua_State *L)
 	return 1;
 }
 
+/***
+ * @function rspamd_http.keepalive_stat()
+ * Returns statistics of the keep-alive pool: a list of tables per peer with
+ * `addr`, `host`, `ssl`, `idle`, `busy`, `waiting` and counters `created`,
+ * `reused`, `evicted`, `expired`, `waited` and `wait_timeouts`
+ * @return {table} list of peers statistics
+ */
+static int
+lua_http_keepalive_stat(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	ucl_object_t *stat;
+
+	stat = rspamd_http_context_keepalive_stat(NULL);
+	ucl_object_push_lua(L, stat, true);
+	ucl_object_unref(stat);
+
+	return 1;
+}
+
 static int
 lua_load_http(lua_State *L)
 {
@@ -346,7 +346,16 @@ lua_ip_to_string(lua_State *L)
 			lua_pushstring(L, rspamd_inet_address_to_string_pretty(ip->addr));
 		}
 		else {
-			lua_pushstring(L, rspamd_inet_address_to_string(ip->addr));
+			char buf[INET6_ADDRSTRLEN + 1];
+			gsize len = rspamd_inet_address_to_string_buf(ip->addr, buf, sizeof(buf));
+
+			if (len > 0) {
+				lua_pushlstring(L, buf, len);
+			}
+			else {
+				/* E.g. a long unix socket path */
+				lua_pushstring(L, rspamd_inet_address_to_string(ip->addr));
+			}
 		}
 	}
 	else {
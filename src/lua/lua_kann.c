@@ -16,8 +16,21 @@
 
 #include "lua_common.h"
 #include "lua_tensor.h"
+#include "libcryptobox/cryptobox.h"
+#include "libcryptobox/platform_config.h"
 #include "contrib/kann/kann.h"
 
+#include <math.h>
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2) && defined(__x86_64__)
+#include <immintrin.h>
+#define KANN_Q8_HAVE_AVX2 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KANN_Q8_HAVE_NEON 1
+#endif
+
 /***
  * @module rspamd_kann
  * `rspamd_kann` is a Lua interface to kann library
@@ -158,15 +171,31 @@ LUA_FUNCTION_DEF(kann, destroy);
 LUA_FUNCTION_DEF(kann, save);
 LUA_FUNCTION_DEF(kann, train1);
 LUA_FUNCTION_DEF(kann, apply1);
+LUA_FUNCTION_DEF(kann, apply);
+LUA_FUNCTION_DEF(kann, quantize);
 
 static luaL_reg rspamd_kann_m[] = {
 	LUA_INTERFACE_DEF(kann, save),
 	LUA_INTERFACE_DEF(kann, train1),
 	LUA_INTERFACE_DEF(kann, apply1),
+	LUA_INTERFACE_DEF(kann, apply),
+	LUA_INTERFACE_DEF(kann, quantize),
 	{"__gc", lua_kann_destroy},
 	{NULL, NULL},
 };
 
+LUA_FUNCTION_DEF(kann_q8, load);
+LUA_FUNCTION_DEF(kann_q8, save);
+LUA_FUNCTION_DEF(kann_q8, apply1);
+LUA_FUNCTION_DEF(kann_q8, destroy);
+
+static luaL_reg rspamd_kann_q8_m[] = {
+	LUA_INTERFACE_DEF(kann_q8, save),
+	LUA_INTERFACE_DEF(kann_q8, apply1),
+	{"__gc", lua_kann_q8_destroy},
+	{NULL, NULL},
+};
+
 static int
 rspamd_kann_table_to_flags(lua_State *L, int table_pos)
 {
@@ -259,6 +288,11 @@ lua_load_kann(lua_State *L)
 	lua_pushcfunction(L, lua_kann_load);
 	lua_settable(L, -3);
 
+	/* Load quantized ann from memory */
+	lua_pushstring(L, "load_q8");
+	lua_pushcfunction(L, lua_kann_q8_load);
+	lua_settable(L, -3);
+
 	return 1;
 }
 
@@ -285,6 +319,8 @@ void luaopen_kann(lua_State *L)
 	lua_pop(L, 1);                                  /* No need in metatable... */
 	rspamd_lua_new_class(L, KANN_NETWORK_CLASS, rspamd_kann_m);
 	lua_pop(L, 1); /* No need in metatable... */
+	rspamd_lua_new_class(L, rspamd_kann_q8_classname, rspamd_kann_q8_m);
+	lua_pop(L, 1);
 	rspamd_lua_add_preload(L, "rspamd_kann", lua_load_kann);
 	lua_settop(L, 0);
 }
@@ -1056,6 +1092,7 @@ lua_kann_train1(lua_State *L)
 	int64_t max_epoch = 25;
 	int64_t max_drop_streak = 10;
 	double frac_val = 0.1;
+	int64_t nthreads = 1;
 	int cbref = -1;
 
 	if (k && lua_istable(L, 2) && lua_istable(L, 3)) {
@@ -1081,8 +1118,10 @@ lua_kann_train1(lua_State *L)
 
 			if (!rspamd_lua_parse_table_arguments(L, 4, &err,
 												  RSPAMD_LUA_PARSE_ARGUMENTS_IGNORE_MISSING,
-												  "lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor}",
-												  &lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca)) {
+												  "lr=N;mini_size=I;max_epoch=I;max_drop_streak=I;frac_val=N;cb=F;pca=u{tensor};"
+												  "threads=I",
+												  &lr, &mini_size, &max_epoch, &max_drop_streak, &frac_val, &cbref, &pca,
+												  &nthreads)) {
 				n = luaL_error(L, "invalid params: %s",
 							   err ? err->message : "unknown error");
 				g_error_free(err);
@@ -1165,6 +1204,8 @@ lua_kann_train1(lua_State *L)
 					lua_pop(L, 1);
 				}
 
+				/* sgemm accumulates into the output, so it must be zeroed */
+				memset(x[s], 0, sizeof(float) * n_in);
 				kad_sgemm_simple(0, 1, 1, n_in,
 								 pca->dim[1], tmp_row, pca->data,
 								 x[s]);
@@ -1208,10 +1249,19 @@ lua_kann_train1(lua_State *L)
 		cbd.k = k;
 		cbd.L = L;
 
+		if (nthreads > 1) {
+			/* Each minibatch is split between threads */
+			kann_mt(k, nthreads, mini_size);
+		}
+
 		int niters = kann_train_fnn1(k, lr,
 									 mini_size, max_epoch, max_drop_streak,
 									 frac_val, n, x, y, lua_kann_train_cb, &cbd);
 
+		if (nthreads > 1) {
+			kann_mt(k, 0, 0);
+		}
+
 		lua_pushinteger(L, niters);
 
 		FREE_VEC(x, n);
@@ -1290,7 +1340,8 @@ lua_kann_apply1(lua_State *L)
 
 			kann_set_batch_size(k, 1);
 			if (pca) {
-				pca_out = g_malloc(sizeof(float) * n_in);
+				/* sgemm accumulates into the output, so it must be zeroed */
+				pca_out = g_malloc0(sizeof(float) * n_in);
 
 				kad_sgemm_simple(0, 1, 1, n_in,
 								 vec_len, vec, pca->data,
@@ -1358,4 +1409,756 @@ lua_kann_apply1(lua_State *L)
 	}
 
 	return 1;
-}
\ No newline at end of file
+}
+
+/***
+ * @method kann:apply(inputs[, pca])
+ * Applies ANN to a batch of inputs using a single forward pass, which is
+ * much cheaper than calling `apply1` for each input
+ * @param {table|tensor} inputs list of input vectors or a matrix with an input per row
+ * @param {tensor} pca optional PCA matrix
+ * @return {table} list of output vectors in the same order as inputs
+ */
+static int
+lua_kann_apply(lua_State *L)
+{
+	kann_t *k = lua_check_kann(L, 1);
+	struct rspamd_lua_tensor *pca = NULL, *t = NULL;
+	float *x, *in, *pca_out = NULL;
+	gsize nrows, vec_len, outlen, row_len;
+	int i_out, n_in;
+
+	if (k == NULL) {
+		return luaL_error(L, "invalid arguments: rspamd{kann} expected");
+	}
+
+	n_in = kann_dim_in(k);
+
+	if (n_in <= 0) {
+		return luaL_error(L, "invalid inputs count: %d", n_in);
+	}
+
+	i_out = kann_find(k, KANN_F_OUT, 0);
+
+	if (i_out <= 0) {
+		return luaL_error(L, "invalid ANN: output layer is missing or is "
+							 "at the input pos");
+	}
+
+	if (lua_isuserdata(L, 3)) {
+		pca = lua_check_tensor(L, 3);
+
+		if (pca == NULL || pca->ndims != 2) {
+			return luaL_error(L, "invalid params: pca matrix expected");
+		}
+
+		if (pca->dim[0] != n_in) {
+			return luaL_error(L, "invalid pca tensor: "
+								 "matrix must have %d rows and it has %d rows instead",
+							  n_in, pca->dim[0]);
+		}
+
+		vec_len = pca->dim[1];
+	}
+	else {
+		vec_len = n_in;
+	}
+
+	if (lua_istable(L, 2)) {
+		nrows = rspamd_lua_table_size(L, 2);
+
+		if (nrows == 0) {
+			lua_newtable(L);
+
+			return 1;
+		}
+
+		x = g_malloc(sizeof(float) * nrows * vec_len);
+
+		for (gsize i = 0; i < nrows; i++) {
+			lua_rawgeti(L, 2, i + 1);
+
+			if (!lua_istable(L, -1) || rspamd_lua_table_size(L, -1) != vec_len) {
+				g_free(x);
+
+				return luaL_error(L, "invalid params: bad input %d; vector of %d elements expected",
+								  (int) (i + 1), (int) vec_len);
+			}
+
+			for (gsize j = 0; j < vec_len; j++) {
+				lua_rawgeti(L, -1, j + 1);
+				x[i * vec_len + j] = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+			}
+
+			lua_pop(L, 1);
+		}
+	}
+	else if (lua_isuserdata(L, 2)) {
+		t = lua_check_tensor(L, 2);
+
+		if (t == NULL || t->ndims != 2 || t->dim[1] != vec_len) {
+			return luaL_error(L, "invalid params: matrix with %d columns expected",
+							  (int) vec_len);
+		}
+
+		nrows = t->dim[0];
+		x = t->data;
+	}
+	else {
+		return luaL_error(L, "invalid arguments: table or rspamd{tensor} expected");
+	}
+
+	if (pca) {
+		/* sgemm accumulates into the output, so it must be zeroed */
+		pca_out = g_malloc0(sizeof(float) * nrows * n_in);
+		kad_sgemm_simple(0, 1, nrows, n_in, vec_len, x, pca->data, pca_out);
+		in = pca_out;
+	}
+	else {
+		in = x;
+	}
+
+	kann_set_batch_size(k, nrows);
+	kann_feed_bind(k, KANN_F_IN, 0, &in);
+	kad_eval_at(k->n, k->v, i_out);
+
+	outlen = kad_len(k->v[i_out]);
+	row_len = outlen / nrows;
+	lua_createtable(L, nrows, 0);
+
+	for (gsize i = 0; i < nrows; i++) {
+		lua_createtable(L, row_len, 0);
+
+		for (gsize j = 0; j < row_len; j++) {
+			lua_pushnumber(L, k->v[i_out]->x[i * row_len + j]);
+			lua_rawseti(L, -2, j + 1);
+		}
+
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	if (t == NULL) {
+		g_free(x);
+	}
+
+	g_free(pca_out);
+
+	return 1;
+}
+
+/*
+ * Quantized networks: a chain of dense layers and activations, weights are
+ * stored as int8 with a float scale per output row, inputs of each dense
+ * layer are quantized dynamically with a single scale
+ */
+#define KANN_Q8_MAGIC "RKQ8"
+
+enum lua_kann_q8_op {
+	KANN_Q8_OP_DENSE = 0,
+	KANN_Q8_OP_BIAS,
+	KANN_Q8_OP_RELU,
+	KANN_Q8_OP_TANH,
+	KANN_Q8_OP_SIGM,
+	KANN_Q8_OP_MAX,
+};
+
+struct lua_kann_q8_layer {
+	uint32_t op;
+	uint32_t n_in;
+	uint32_t n_out;
+	float *scales; /* dense: scale per output row */
+	float *bias;   /* bias: values */
+	int8_t *w;     /* dense: n_out rows of n_in weights */
+};
+
+typedef int32_t (*lua_kann_q8_dot_func)(const int8_t *a, const int8_t *b, unsigned int n);
+
+struct rspamd_kann_q8 {
+	uint32_t n_in;
+	uint32_t nlayers;
+	uint32_t max_width;
+	lua_kann_q8_dot_func dot;
+	struct lua_kann_q8_layer *layers;
+};
+
+extern unsigned cpu_config;
+
+static int32_t
+lua_kann_q8_dot_ref(const int8_t *a, const int8_t *b, unsigned int n)
+{
+	int32_t res = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		res += (int32_t) a[i] * (int32_t) b[i];
+	}
+
+	return res;
+}
+
+#ifdef KANN_Q8_HAVE_AVX2
+__attribute__((__target__("avx2"))) static int32_t
+lua_kann_q8_dot_avx2(const int8_t *a, const int8_t *b, unsigned int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+	unsigned int i = 0;
+	int32_t res;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (a + i)));
+		__m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (b + i)));
+
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+	}
+
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_hadd_epi32(sum, sum);
+	sum = _mm_hadd_epi32(sum, sum);
+	res = _mm_cvtsi128_si32(sum);
+
+	for (; i < n; i++) {
+		res += (int32_t) a[i] * (int32_t) b[i];
+	}
+
+	return res;
+}
+#endif
+
+#ifdef KANN_Q8_HAVE_NEON
+static int32_t
+lua_kann_q8_dot_neon(const int8_t *a, const int8_t *b, unsigned int n)
+{
+	int32x4_t acc = vdupq_n_s32(0);
+	unsigned int i = 0;
+	int32_t res;
+
+	for (; i + 16 <= n; i += 16) {
+		int8x16_t va = vld1q_s8(a + i), vb = vld1q_s8(b + i);
+
+		/* Values are within [-127, 127], so products fit int16 */
+		acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+		acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+	}
+
+	res = vaddvq_s32(acc);
+
+	for (; i < n; i++) {
+		res += (int32_t) a[i] * (int32_t) b[i];
+	}
+
+	return res;
+}
+#endif
+
+static lua_kann_q8_dot_func
+lua_kann_q8_select_dot(void)
+{
+#ifdef KANN_Q8_HAVE_AVX2
+	if (cpu_config & CPUID_AVX2) {
+		return lua_kann_q8_dot_avx2;
+	}
+#endif
+#ifdef KANN_Q8_HAVE_NEON
+	return lua_kann_q8_dot_neon;
+#endif
+
+	return lua_kann_q8_dot_ref;
+}
+
+static void
+lua_kann_q8_free(struct rspamd_kann_q8 *q)
+{
+	if (q) {
+		for (unsigned int i = 0; i < q->nlayers; i++) {
+			g_free(q->layers[i].scales);
+			g_free(q->layers[i].bias);
+			g_free(q->layers[i].w);
+		}
+
+		g_free(q->layers);
+		g_free(q);
+	}
+}
+
+static struct rspamd_kann_q8 *
+lua_check_kann_q8(lua_State *L, int pos)
+{
+	void *ud = rspamd_lua_check_udata(L, pos, rspamd_kann_q8_classname);
+	luaL_argcheck(L, ud != NULL, pos, "'kann_q8' expected");
+	return ud ? *((struct rspamd_kann_q8 **) ud) : NULL;
+}
+
+static void
+lua_kann_q8_push(lua_State *L, struct rspamd_kann_q8 *q)
+{
+	struct rspamd_kann_q8 **pq;
+
+	q->max_width = q->n_in;
+
+	for (unsigned int i = 0; i < q->nlayers; i++) {
+		q->max_width = MAX(q->max_width, q->layers[i].n_out);
+	}
+
+	q->dot = lua_kann_q8_select_dot();
+	pq = lua_newuserdata(L, sizeof(*pq));
+	*pq = q;
+	rspamd_lua_setclass(L, rspamd_kann_q8_classname, -1);
+}
+
+static void
+lua_kann_q8_quantize_dense(struct lua_kann_q8_layer *layer, const float *w)
+{
+	layer->scales = g_malloc(sizeof(float) * layer->n_out);
+	layer->w = g_malloc(layer->n_out * layer->n_in);
+
+	for (unsigned int j = 0; j < layer->n_out; j++) {
+		const float *row = w + (gsize) j * layer->n_in;
+		float maxabs = 0, inv;
+
+		for (unsigned int i = 0; i < layer->n_in; i++) {
+			maxabs = MAX(maxabs, fabsf(row[i]));
+		}
+
+		layer->scales[j] = maxabs > 0 ? maxabs / 127.0f : 1.0f;
+		inv = 1.0f / layer->scales[j];
+
+		for (unsigned int i = 0; i < layer->n_in; i++) {
+			layer->w[(gsize) j * layer->n_in + i] = (int8_t) lrintf(row[i] * inv);
+		}
+	}
+}
+
+/***
+ * @method kann:quantize()
+ * Converts a trained network to the int8 quantized form (`kann_q8`) that uses
+ * about 4 times less memory. Only networks built from dense layers and
+ * relu/tanh/sigm transforms are supported.
+ * @return {kann_q8} quantized network or nil and error string
+ */
+static int
+lua_kann_quantize(lua_State *L)
+{
+	kann_t *k = lua_check_kann(L, 1);
+	kad_node_t *cur, *path[64];
+	struct rspamd_kann_q8 *q;
+	int i_out, npath = 0;
+	uint32_t width;
+
+	if (k == NULL) {
+		return luaL_error(L, "invalid arguments: rspamd{kann} expected");
+	}
+
+	i_out = kann_find(k, KANN_F_OUT, 0);
+
+	if (i_out <= 0) {
+		return luaL_error(L, "invalid ANN: output layer is missing or is "
+							 "at the input pos");
+	}
+
+	/* Go from the output to the input collecting operations */
+	cur = k->v[i_out];
+
+	while (!kad_is_feed(cur)) {
+		if (npath >= (int) G_N_ELEMENTS(path) || cur->n_child == 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, "unsupported network structure");
+
+			return 2;
+		}
+
+		path[npath++] = cur;
+		cur = cur->child[0];
+	}
+
+	if (!(cur->ext_flag & KANN_F_IN)) {
+		lua_pushnil(L);
+		lua_pushstring(L, "unsupported network structure: no input");
+
+		return 2;
+	}
+
+	q = g_malloc0(sizeof(*q));
+	q->n_in = kann_dim_in(k);
+	q->layers = g_new0(struct lua_kann_q8_layer, npath);
+	width = q->n_in;
+
+	for (int i = npath - 1; i >= 0; i--) {
+		struct lua_kann_q8_layer *layer = &q->layers[q->nlayers++];
+		kad_node_t *n = path[i], *arg = n->n_child > 1 ? n->child[1] : NULL;
+
+		layer->n_in = width;
+		layer->n_out = width;
+
+		switch (n->op) {
+		case 3: /* cmul */
+			if (arg == NULL || !kad_is_var(arg) || arg->n_d != 2 || arg->d[1] != width) {
+				goto unsupported;
+			}
+			layer->op = KANN_Q8_OP_DENSE;
+			layer->n_out = arg->d[0];
+			lua_kann_q8_quantize_dense(layer, arg->x);
+			break;
+		case 1: /* add */
+			if (arg == NULL || !kad_is_var(arg) || kad_len(arg) != width) {
+				goto unsupported;
+			}
+			layer->op = KANN_Q8_OP_BIAS;
+			layer->bias = g_malloc(sizeof(float) * width);
+			memcpy(layer->bias, arg->x, sizeof(float) * width);
+			break;
+		case 8:
+			layer->op = KANN_Q8_OP_RELU;
+			break;
+		case 7:
+			layer->op = KANN_Q8_OP_TANH;
+			break;
+		case 6:
+			layer->op = KANN_Q8_OP_SIGM;
+			break;
+		default:
+			goto unsupported;
+		}
+
+		if (layer->op >= KANN_Q8_OP_RELU && n->n_child != 1) {
+			goto unsupported;
+		}
+
+		width = layer->n_out;
+	}
+
+	lua_kann_q8_push(L, q);
+
+	return 1;
+
+unsupported:
+	lua_kann_q8_free(q);
+	lua_pushnil(L);
+	lua_pushstring(L, "unsupported operation in the network");
+
+	return 2;
+}
+
+/***
+ * @method kann_q8:apply1(vector[, pca])
+ * Applies quantized ANN to a single input
+ * @param {table|tensor} vector input vector
+ * @param {tensor} pca optional PCA matrix
+ * @return {table} output vector
+ */
+static int
+lua_kann_q8_apply1(lua_State *L)
+{
+	struct rspamd_kann_q8 *q = lua_check_kann_q8(L, 1);
+	struct rspamd_lua_tensor *pca = NULL, *t = NULL;
+	float *raw = NULL, *cur, *next, *tmp;
+	int8_t *qin;
+	gsize vec_len;
+
+	if (q == NULL) {
+		return luaL_error(L, "invalid arguments: rspamd{kann_q8} expected");
+	}
+
+	if (lua_isuserdata(L, 3)) {
+		pca = lua_check_tensor(L, 3);
+
+		if (pca == NULL || pca->ndims != 2 || pca->dim[0] != q->n_in) {
+			return luaL_error(L, "invalid params: pca matrix with %d rows expected",
+							  (int) q->n_in);
+		}
+
+		vec_len = pca->dim[1];
+	}
+	else {
+		vec_len = q->n_in;
+	}
+
+	if (lua_istable(L, 2)) {
+		if (rspamd_lua_table_size(L, 2) != vec_len) {
+			return luaL_error(L, "invalid params: bad input dimension %d; %d expected",
+							  (int) rspamd_lua_table_size(L, 2), (int) vec_len);
+		}
+	}
+	else if (lua_isuserdata(L, 2)) {
+		t = lua_check_tensor(L, 2);
+
+		if (t == NULL || t->ndims != 1 || t->dim[0] != vec_len) {
+			return luaL_error(L, "invalid params: 1D tensor of %d elements expected",
+							  (int) vec_len);
+		}
+	}
+	else {
+		return luaL_error(L, "invalid arguments: table or rspamd{tensor} expected");
+	}
+
+	cur = g_malloc0(sizeof(float) * q->max_width);
+	next = g_malloc(sizeof(float) * q->max_width);
+	qin = g_malloc(q->max_width);
+
+	if (pca) {
+		raw = g_malloc(sizeof(float) * vec_len);
+
+		for (gsize i = 0; i < vec_len; i++) {
+			if (t) {
+				raw[i] = t->data[i];
+			}
+			else {
+				lua_rawgeti(L, 2, i + 1);
+				raw[i] = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+			}
+		}
+
+		/* sgemm accumulates into the output, which is zeroed */
+		kad_sgemm_simple(0, 1, 1, q->n_in, vec_len, raw, pca->data, cur);
+		g_free(raw);
+	}
+	else {
+		for (gsize i = 0; i < vec_len; i++) {
+			if (t) {
+				cur[i] = t->data[i];
+			}
+			else {
+				lua_rawgeti(L, 2, i + 1);
+				cur[i] = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+			}
+		}
+	}
+
+	for (unsigned int l = 0; l < q->nlayers; l++) {
+		const struct lua_kann_q8_layer *layer = &q->layers[l];
+
+		switch (layer->op) {
+		case KANN_Q8_OP_DENSE: {
+			float maxabs = 0, in_scale, inv;
+
+			for (unsigned int i = 0; i < layer->n_in; i++) {
+				maxabs = MAX(maxabs, fabsf(cur[i]));
+			}
+
+			in_scale = maxabs > 0 ? maxabs / 127.0f : 1.0f;
+			inv = 1.0f / in_scale;
+
+			for (unsigned int i = 0; i < layer->n_in; i++) {
+				qin[i] = (int8_t) lrintf(cur[i] * inv);
+			}
+
+			for (unsigned int j = 0; j < layer->n_out; j++) {
+				int32_t acc = q->dot(qin, layer->w + (gsize) j * layer->n_in, layer->n_in);
+
+				next[j] = (float) acc * in_scale * layer->scales[j];
+			}
+
+			tmp = cur;
+			cur = next;
+			next = tmp;
+			break;
+		}
+		case KANN_Q8_OP_BIAS:
+			for (unsigned int i = 0; i < layer->n_out; i++) {
+				cur[i] += layer->bias[i];
+			}
+			break;
+		case KANN_Q8_OP_RELU:
+			for (unsigned int i = 0; i < layer->n_out; i++) {
+				cur[i] = cur[i] > 0 ? cur[i] : 0;
+			}
+			break;
+		case KANN_Q8_OP_TANH:
+			for (unsigned int i = 0; i < layer->n_out; i++) {
+				cur[i] = tanhf(cur[i]);
+			}
+			break;
+		case KANN_Q8_OP_SIGM:
+			for (unsigned int i = 0; i < layer->n_out; i++) {
+				cur[i] = 1.0f / (1.0f + expf(-cur[i]));
+			}
+			break;
+		}
+	}
+
+	unsigned int outlen = q->nlayers > 0 ? q->layers[q->nlayers - 1].n_out : q->n_in;
+	lua_createtable(L, outlen, 0);
+
+	for (unsigned int i = 0; i < outlen; i++) {
+		lua_pushnumber(L, cur[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	g_free(cur);
+	g_free(next);
+	g_free(qin);
+
+	return 1;
+}
+
+/***
+ * @method kann_q8:save()
+ * Serializes quantized ANN to rspamd_text
+ * @return {text} serialized ANN
+ */
+static int
+lua_kann_q8_save(lua_State *L)
+{
+	struct rspamd_kann_q8 *q = lua_check_kann_q8(L, 1);
+	GByteArray *ba;
+	struct rspamd_lua_text *t;
+	uint32_t hdr[2];
+
+	if (q == NULL) {
+		return luaL_error(L, "invalid arguments: rspamd{kann_q8} expected");
+	}
+
+	ba = g_byte_array_new();
+	g_byte_array_append(ba, (const uint8_t *) KANN_Q8_MAGIC, sizeof(KANN_Q8_MAGIC) - 1);
+	hdr[0] = q->n_in;
+	hdr[1] = q->nlayers;
+	g_byte_array_append(ba, (const uint8_t *) hdr, sizeof(hdr));
+
+	for (unsigned int i = 0; i < q->nlayers; i++) {
+		const struct lua_kann_q8_layer *layer = &q->layers[i];
+		uint32_t lhdr[3] = {layer->op, layer->n_in, layer->n_out};
+
+		g_byte_array_append(ba, (const uint8_t *) lhdr, sizeof(lhdr));
+
+		if (layer->op == KANN_Q8_OP_DENSE) {
+			g_byte_array_append(ba, (const uint8_t *) layer->scales,
+								sizeof(float) * layer->n_out);
+			g_byte_array_append(ba, (const uint8_t *) layer->w,
+								(gsize) layer->n_out * layer->n_in);
+		}
+		else if (layer->op == KANN_Q8_OP_BIAS) {
+			g_byte_array_append(ba, (const uint8_t *) layer->bias,
+								sizeof(float) * layer->n_out);
+		}
+	}
+
+	t = lua_newuserdata(L, sizeof(*t));
+	rspamd_lua_setclass(L, rspamd_text_classname, -1);
+	t->flags = RSPAMD_TEXT_FLAG_OWN;
+	t->len = ba->len;
+	t->start = (const char *) g_byte_array_free(ba, FALSE);
+
+	return 1;
+}
+
+/***
+ * @function kann.load_q8(data)
+ * Loads quantized ANN saved by `kann_q8:save()`
+ * @param {string|text} data serialized ANN
+ * @return {kann_q8} quantized ANN or nil
+ */
+static int
+lua_kann_q8_load(lua_State *L)
+{
+	struct rspamd_kann_q8 *q;
+	const unsigned char *p, *end;
+	gsize len;
+	uint32_t hdr[2];
+
+	if (lua_isstring(L, 1)) {
+		p = (const unsigned char *) lua_tolstring(L, 1, &len);
+	}
+	else {
+		struct rspamd_lua_text *t = lua_check_text(L, 1);
+
+		if (t == NULL) {
+			return luaL_error(L, "invalid arguments");
+		}
+
+		p = (const unsigned char *) t->start;
+		len = t->len;
+	}
+
+	end = p + len;
+
+#define KANN_Q8_READ(dst, sz)                  \
+	do {                                       \
+		if ((gsize) (end - p) < (gsize) (sz)) { \
+			goto err;                          \
+		}                                      \
+		memcpy((dst), p, (sz));                \
+		p += (sz);                             \
+	} while (0)
+
+	if (len < sizeof(KANN_Q8_MAGIC) - 1 + sizeof(hdr) ||
+		memcmp(p, KANN_Q8_MAGIC, sizeof(KANN_Q8_MAGIC) - 1) != 0) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	p += sizeof(KANN_Q8_MAGIC) - 1;
+	q = g_malloc0(sizeof(*q));
+	KANN_Q8_READ(hdr, sizeof(hdr));
+	q->n_in = hdr[0];
+
+	if (hdr[1] > 64) {
+		goto err;
+	}
+
+	q->layers = g_new0(struct lua_kann_q8_layer, hdr[1]);
+
+	for (unsigned int i = 0; i < hdr[1]; i++) {
+		struct lua_kann_q8_layer *layer = &q->layers[q->nlayers++];
+		uint32_t lhdr[3];
+		gsize wlen;
+
+		KANN_Q8_READ(lhdr, sizeof(lhdr));
+		layer->op = lhdr[0];
+		layer->n_in = lhdr[1];
+		layer->n_out = lhdr[2];
+
+		if (layer->op >= KANN_Q8_OP_MAX ||
+			layer->n_in > G_MAXINT32 / 2 || layer->n_out > G_MAXINT32 / 2 ||
+			(i == 0 && layer->n_in != q->n_in) ||
+			(i > 0 && layer->n_in != q->layers[i - 1].n_out) ||
+			(layer->op != KANN_Q8_OP_DENSE && layer->n_in != layer->n_out)) {
+			goto err;
+		}
+
+		if (layer->op == KANN_Q8_OP_DENSE) {
+			wlen = (gsize) layer->n_out * layer->n_in;
+
+			if ((gsize) (end - p) < sizeof(float) * layer->n_out + wlen) {
+				goto err;
+			}
+
+			layer->scales = g_malloc(sizeof(float) * layer->n_out);
+			KANN_Q8_READ(layer->scales, sizeof(float) * layer->n_out);
+			layer->w = g_malloc(wlen);
+			KANN_Q8_READ(layer->w, wlen);
+		}
+		else if (layer->op == KANN_Q8_OP_BIAS) {
+			if ((gsize) (end - p) < sizeof(float) * layer->n_out) {
+				goto err;
+			}
+
+			layer->bias = g_malloc(sizeof(float) * layer->n_out);
+			KANN_Q8_READ(layer->bias, sizeof(float) * layer->n_out);
+		}
+	}
+
+#undef KANN_Q8_READ
+
+	lua_kann_q8_push(L, q);
+
+	return 1;
+
+err:
+	lua_kann_q8_free(q);
+	lua_pushnil(L);
+
+	return 1;
+}
+
+static int
+lua_kann_q8_destroy(lua_State *L)
+{
+	struct rspamd_kann_q8 *q = lua_check_kann_q8(L, 1);
+
+	lua_kann_q8_free(q);
+
+	return 0;
+}
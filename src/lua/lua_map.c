@@ -64,13 +64,32 @@ rspamd_config:register_symbol{
  *
  * - For hash maps it returns boolean and accepts string
  * - For kv maps it returns string (or nil) and accepts string
- * - For radix maps it returns boolean and accepts IP address (as object, string or number)
+ * - For radix maps it returns boolean and accepts IP address (as object, string or number);
+ *   for a table of addresses it returns a table of values (`false` if not found) matched at once
+ * - For url maps it returns boolean and accepts host (see also `map:get_url`)
  *
  * @param {vary} in input to check
  * @return {bool|string} if a value is found then this function returns string or `True` if not - then it returns `nil` or `False`
  */
 LUA_FUNCTION_DEF(map, get_key);
 
+/***
+ * @method map:get_domain(host)
+ * Finds the longest key of a hash or set map that is a domain suffix of
+ * `host` or `host` itself, so `example.com` matches `www.example.com`
+ * @param {string} host hostname to check
+ * @return {string|bool,string} value (or `true` for sets) and the matched key, or `nil`
+ */
+LUA_FUNCTION_DEF(map, get_domain);
+
+/***
+ * @method map:get_url(url[, domains])
+ * Matches url against url map (e.g. a phishing feed) by host, path and query
+ * @param {rspamd_url} url url to check
+ * @param {boolean} domains if true, then parent domains of the url host are matched as well
+ * @return {string,string} match level (`host`, `path` or `query`) and data of the matched record (if any), or `nil`
+ */
+LUA_FUNCTION_DEF(map, get_url);
 
 /***
  * @method map:is_signed()
@@ -156,8 +175,17 @@ LUA_FUNCTION_DEF(map, get_data_digest);
  */
 LUA_FUNCTION_DEF(map, get_nelts);
 
+/***
+ * @method map:get_data_stats()
+ * Get cost of the current map data
+ * @return {table} table with `type`, `elements`, `memory` and `hs_size` (in bytes) and `load_time` (in seconds)
+ */
+LUA_FUNCTION_DEF(map, get_data_stats);
+
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF(map, get_key),
+	LUA_INTERFACE_DEF(map, get_domain),
+	LUA_INTERFACE_DEF(map, get_url),
 	LUA_INTERFACE_DEF(map, is_signed),
 	LUA_INTERFACE_DEF(map, get_proto),
 	LUA_INTERFACE_DEF(map, get_sign_key),
@@ -169,6 +197,7 @@ static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF(map, on_load),
 	LUA_INTERFACE_DEF(map, get_data_digest),
 	LUA_INTERFACE_DEF(map, get_nelts),
+	LUA_INTERFACE_DEF(map, get_data_stats),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}};
 
@@ -771,6 +800,24 @@ int lua_config_add_map(lua_State *L)
 			}
 			m->lua_map = map;
 		}
+		else if (strcmp(type, "url") == 0) {
+			map = rspamd_mempool_alloc0(cfg->cfg_pool, sizeof(*map));
+			map->data.url_map = NULL;
+			map->type = RSPAMD_LUA_MAP_URL;
+
+			if ((m = rspamd_map_add_from_ucl(cfg, map_obj, description,
+											 rspamd_url_list_read,
+											 rspamd_url_list_fin,
+											 rspamd_url_list_dtor,
+											 (void **) &map->data.url_map,
+											 NULL, RSPAMD_MAP_DEFAULT)) == NULL) {
+				lua_pushnil(L);
+				ucl_object_unref(map_obj);
+
+				return 1;
+			}
+			m->lua_map = map;
+		}
 		else {
 			ret = luaL_error(L, "invalid arguments: unknown type '%s'", type);
 			ucl_object_unref(map_obj);
@@ -823,6 +870,10 @@ int lua_config_get_maps(lua_State *L)
 					map->type = RSPAMD_LUA_MAP_HASH;
 					map->data.hash = *m->user_data;
 				}
+				else if (m->read_callback == rspamd_url_list_read) {
+					map->type = RSPAMD_LUA_MAP_URL;
+					map->data.url_map = *m->user_data;
+				}
 				else {
 					map->type = RSPAMD_LUA_MAP_UNKNOWN;
 				}
@@ -868,6 +919,69 @@ lua_map_process_string_key(lua_State *L, int pos, gsize *len)
 }
 
 /* Radix and hash table functions */
+/* Matches a table of addresses with a single batch lookup */
+static int
+lua_map_get_key_radix_batch(lua_State *L, struct rspamd_radix_map_helper *radix)
+{
+	gsize naddrs = rspamd_lua_table_size(L, 2), i;
+	rspamd_inet_addr_t **addrs, **owned;
+	gconstpointer *results;
+
+	addrs = g_new0(rspamd_inet_addr_t *, naddrs + 1);
+	owned = g_new0(rspamd_inet_addr_t *, naddrs + 1);
+	results = g_new0(gconstpointer, naddrs + 1);
+
+	for (i = 0; i < naddrs; i++) {
+		lua_rawgeti(L, 2, i + 1);
+
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			gsize len;
+			const char *addr_str = lua_tolstring(L, -1, &len);
+
+			if (rspamd_parse_inet_address(&owned[i], addr_str, len,
+										  RSPAMD_INET_ADDRESS_PARSE_NO_UNIX)) {
+				addrs[i] = owned[i];
+			}
+		}
+		else if (lua_type(L, -1) == LUA_TUSERDATA) {
+			gpointer ud = rspamd_lua_check_udata(L, -1, rspamd_ip_classname);
+
+			if (ud != NULL) {
+				addrs[i] = (*((struct rspamd_lua_ip **) ud))->addr;
+			}
+		}
+
+		lua_pop(L, 1);
+	}
+
+	/* Unparsed addresses are NULL and are not found */
+	rspamd_match_radix_map_addr_batch(radix,
+									  (const rspamd_inet_addr_t *const *) addrs,
+									  naddrs, results);
+	lua_createtable(L, naddrs, 0);
+
+	for (i = 0; i < naddrs; i++) {
+		if (results[i] != NULL) {
+			lua_pushstring(L, (const char *) results[i]);
+		}
+		else {
+			lua_pushboolean(L, false);
+		}
+
+		lua_rawseti(L, -2, i + 1);
+
+		if (owned[i] != NULL) {
+			rspamd_inet_address_free(owned[i]);
+		}
+	}
+
+	g_free(addrs);
+	g_free(owned);
+	g_free(results);
+
+	return 1;
+}
+
 static int
 lua_map_get_key(lua_State *L)
 {
@@ -885,6 +999,10 @@ lua_map_get_key(lua_State *L)
 		if (map->type == RSPAMD_LUA_MAP_RADIX) {
 			radix = map->data.radix;
 
+			if (lua_type(L, 2) == LUA_TTABLE) {
+				return lua_map_get_key_radix_batch(L, radix);
+			}
+
 			if (lua_type(L, 2) == LUA_TSTRING) {
 				const char *addr_str;
 
@@ -1017,6 +1135,20 @@ lua_map_get_key(lua_State *L)
 				return 1;
 			}
 		}
+		else if (map->type == RSPAMD_LUA_MAP_URL) {
+			/* url map is checked for a host */
+			key = lua_map_process_string_key(L, 2, &len);
+
+			if (key && len <= G_MAXUINT16 && map->data.url_map) {
+				struct rspamd_url u;
+
+				memset(&u, 0, sizeof(u));
+				u.string = (char *) key;
+				u.hostlen = len;
+				ret = rspamd_match_url_map(map->data.url_map, &u, FALSE, NULL) !=
+					  RSPAMD_URL_MAP_MATCH_NONE;
+			}
+		}
 		else {
 			/* callback map or unknown type map */
 			lua_pushnil(L);
@@ -1031,6 +1163,92 @@ lua_map_get_key(lua_State *L)
 	return 1;
 }
 
+static int
+lua_map_get_domain(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map(L, 1);
+	const char *key, *value = NULL;
+	gsize len, matched_len = 0;
+
+	if (map == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (map->type != RSPAMD_LUA_MAP_SET && map->type != RSPAMD_LUA_MAP_HASH) {
+		return luaL_error(L, "domain lookups are supported for hash and set maps only");
+	}
+
+	key = lua_map_process_string_key(L, 2, &len);
+
+	if (key && map->data.hash) {
+		value = rspamd_match_hash_map_domain(map->data.hash, key, len,
+											 &matched_len);
+	}
+
+	if (value == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (map->type == RSPAMD_LUA_MAP_SET) {
+		lua_pushboolean(L, true);
+	}
+	else {
+		lua_pushstring(L, value);
+	}
+
+	if (key[len - 1] == '.') {
+		len--;
+	}
+
+	lua_pushlstring(L, key + len - matched_len, matched_len);
+
+	return 2;
+}
+
+static int
+lua_map_get_url(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map(L, 1);
+	struct rspamd_lua_url *url = lua_check_url(L, 2);
+	enum rspamd_url_map_match match;
+	rspamd_ftok_t data;
+	static const char *levels[] = {
+		[RSPAMD_URL_MAP_MATCH_HOST] = "host",
+		[RSPAMD_URL_MAP_MATCH_PATH] = "path",
+		[RSPAMD_URL_MAP_MATCH_QUERY] = "query",
+	};
+
+	if (map == NULL || url == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (map->type != RSPAMD_LUA_MAP_URL) {
+		return luaL_error(L, "url lookups are supported for url maps only");
+	}
+
+	match = rspamd_match_url_map(map->data.url_map, url->url,
+								 lua_toboolean(L, 3), &data);
+
+	if (match == RSPAMD_URL_MAP_MATCH_NONE) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushstring(L, levels[match]);
+
+	if (data.len > 0) {
+		lua_pushlstring(L, data.begin, data.len);
+	}
+	else {
+		lua_pushnil(L);
+	}
+
+	return 2;
+}
+
 static gboolean
 lua_map_traverse_cb(gconstpointer key,
 					gconstpointer value, gsize hits, gpointer ud)
@@ -1177,6 +1395,45 @@ lua_map_get_nelts(lua_State *L)
 	return 1;
 }
 
+static int
+lua_map_get_data_stats(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_map *map = lua_check_map(L, 1);
+	struct rspamd_map_data_stat st;
+	static const char *type_names[] = {
+		[RSPAMD_LUA_MAP_RADIX] = "radix",
+		[RSPAMD_LUA_MAP_SET] = "set",
+		[RSPAMD_LUA_MAP_HASH] = "hash",
+		[RSPAMD_LUA_MAP_REGEXP] = "regexp",
+		[RSPAMD_LUA_MAP_REGEXP_MULTIPLE] = "regexp_multi",
+		[RSPAMD_LUA_MAP_CALLBACK] = "callback",
+		[RSPAMD_LUA_MAP_CDB] = "cdb",
+		[RSPAMD_LUA_MAP_URL] = "url",
+		[RSPAMD_LUA_MAP_UNKNOWN] = "unknown",
+	};
+
+	if (map != NULL) {
+		rspamd_map_get_data_stat(map->map, &st);
+		lua_createtable(L, 0, 5);
+		lua_pushstring(L, type_names[map->type]);
+		lua_setfield(L, -2, "type");
+		lua_pushinteger(L, st.nelts);
+		lua_setfield(L, -2, "elements");
+		lua_pushinteger(L, st.memory);
+		lua_setfield(L, -2, "memory");
+		lua_pushinteger(L, st.hs_size);
+		lua_setfield(L, -2, "hs_size");
+		lua_pushnumber(L, st.load_time);
+		lua_setfield(L, -2, "load_time");
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static int
 lua_map_is_signed(lua_State *L)
 {
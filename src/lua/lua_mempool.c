@@ -53,6 +53,11 @@ LUA_FUNCTION_DEF(mempool, add_destructor);
  * Destroys memory pool cleaning all variables and calling all destructors registered (both C and Lua ones)
  */
 LUA_FUNCTION_DEF(mempool, delete);
+/***
+ * @method mempool:stat()
+ * Returns global statistics of all memory pools (counters are process wide)
+ * @return {table} table with `pools_allocated`, `pools_freed`, `bytes_allocated`, `chunks_allocated`, `shared_chunks_allocated`, `chunks_freed`, `oversized_chunks` and `hugepage_bytes`
+ */
 LUA_FUNCTION_DEF(mempool, stat);
 LUA_FUNCTION_DEF(mempool, suggest_size);
 /***
@@ -243,6 +248,28 @@ lua_mempool_stat(lua_State *L)
 	struct memory_pool_s *mempool = rspamd_lua_check_mempool(L, 1);
 
 	if (mempool) {
+		rspamd_mempool_stat_t st;
+
+		memset(&st, 0, sizeof(st));
+		rspamd_mempool_stat(&st);
+
+		lua_createtable(L, 0, 8);
+		lua_pushinteger(L, st.pools_allocated);
+		lua_setfield(L, -2, "pools_allocated");
+		lua_pushinteger(L, st.pools_freed);
+		lua_setfield(L, -2, "pools_freed");
+		lua_pushinteger(L, st.bytes_allocated);
+		lua_setfield(L, -2, "bytes_allocated");
+		lua_pushinteger(L, st.chunks_allocated);
+		lua_setfield(L, -2, "chunks_allocated");
+		lua_pushinteger(L, st.shared_chunks_allocated);
+		lua_setfield(L, -2, "shared_chunks_allocated");
+		lua_pushinteger(L, st.chunks_freed);
+		lua_setfield(L, -2, "chunks_freed");
+		lua_pushinteger(L, st.oversized_chunks);
+		lua_setfield(L, -2, "oversized_chunks");
+		lua_pushinteger(L, st.hugepage_bytes);
+		lua_setfield(L, -2, "hugepage_bytes");
 	}
 	else {
 		lua_pushnil(L);
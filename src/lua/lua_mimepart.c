@@ -17,6 +17,7 @@
 #include "lua_common.h"
 #include "lua_url.h"
 #include "libmime/message.h"
+#include "libmime/mime_parser.h"
 #include "libmime/lang_detection.h"
 #include "libstat/stat_api.h"
 #include "libcryptobox/cryptobox.h"
@@ -179,6 +180,13 @@ LUA_FUNCTION_DEF(textpart, is_empty);
  * @return {bool} whether a part is HTML part
  */
 LUA_FUNCTION_DEF(textpart, is_html);
+/***
+ * @method text_part:is_sampled()
+ * Returns `true` if the part is too long, so its words are extracted from the head,
+ * the tail and regular pieces of the middle of the text (see `max_text_part_len` option)
+ * @return {bool} whether words of a part are sampled
+ */
+LUA_FUNCTION_DEF(textpart, is_sampled);
 /***
  * @method text_part:get_html()
  * Returns html content of the specified part
@@ -238,6 +246,7 @@ static const struct luaL_reg textpartlib_m[] = {
 	LUA_INTERFACE_DEF(textpart, filter_words),
 	LUA_INTERFACE_DEF(textpart, is_empty),
 	LUA_INTERFACE_DEF(textpart, is_html),
+	LUA_INTERFACE_DEF(textpart, is_sampled),
 	LUA_INTERFACE_DEF(textpart, get_html),
 	LUA_INTERFACE_DEF(textpart, get_language),
 	LUA_INTERFACE_DEF(textpart, get_charset),
@@ -288,6 +297,14 @@ LUA_FUNCTION_DEF(mimepart, get_header);
  * @return {string} raw value of a header
  */
 LUA_FUNCTION_DEF(mimepart, get_header_raw);
+/***
+ * @method mime_part:get_header_text(name[, case_sensitive])
+ * Get decoded value of a header as a text view bound to the task lifetime.
+ * @param {string} name name of header to get
+ * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @return {rspamd_text} decoded value of a header
+ */
+LUA_FUNCTION_DEF(mimepart, get_header_text);
 /***
  * @method mime_part:get_header_full(name[, case_sensitive])
  * Get raw value of a header specified with optional case_sensitive flag.
@@ -341,6 +358,15 @@ LUA_FUNCTION_DEF(mimepart, get_headers);
  * @return {text} opaque text object (zero-copy if not casted to lua string)
  */
 LUA_FUNCTION_DEF(mimepart, get_content);
+/***
+ * @method mime_part:get_content_span(start[, len])
+ * Get a span of the parsed content of part, unlike `get_content():span()` it
+ * does not decode the whole part if it has not been decoded yet
+ * @param {integer} start start offset (starting from 1)
+ * @param {integer} len length of the span (up to the end of content by default)
+ * @return {text} opaque text object or nil if start is beyond the content
+ */
+LUA_FUNCTION_DEF(mimepart, get_content_span);
 /***
  * @method mime_part:get_raw_content()
  * Get the raw content of part
@@ -566,6 +592,7 @@ LUA_FUNCTION_DEF(mimepart, get_urls);
 
 static const struct luaL_reg mimepartlib_m[] = {
 	LUA_INTERFACE_DEF(mimepart, get_content),
+	LUA_INTERFACE_DEF(mimepart, get_content_span),
 	LUA_INTERFACE_DEF(mimepart, get_raw_content),
 	LUA_INTERFACE_DEF(mimepart, get_length),
 	LUA_INTERFACE_DEF(mimepart, get_type),
@@ -579,6 +606,7 @@ static const struct luaL_reg mimepartlib_m[] = {
 	LUA_INTERFACE_DEF(mimepart, get_enclosing_boundary),
 	LUA_INTERFACE_DEF(mimepart, get_header),
 	LUA_INTERFACE_DEF(mimepart, get_header_raw),
+	LUA_INTERFACE_DEF(mimepart, get_header_text),
 	LUA_INTERFACE_DEF(mimepart, get_header_full),
 	LUA_INTERFACE_DEF(mimepart, get_header_count),
 	LUA_INTERFACE_DEF(mimepart, get_raw_headers),
@@ -1083,6 +1111,22 @@ lua_textpart_is_html(lua_State *L)
 	return 1;
 }
 
+static int
+lua_textpart_is_sampled(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_mime_text_part *part = lua_check_textpart(L);
+
+	if (part == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushboolean(L, IS_TEXT_PART_SAMPLED(part));
+
+	return 1;
+}
+
 static int
 lua_textpart_get_html(lua_State *L)
 {
@@ -1402,6 +1446,7 @@ lua_mimepart_get_content(lua_State *L)
 {
 	LUA_TRACE_POINT;
 	struct rspamd_mime_part *part = lua_check_mimepart(L);
+	const rspamd_ftok_t *content;
 	struct rspamd_lua_text *t;
 
 	if (part == NULL) {
@@ -1409,10 +1454,11 @@ lua_mimepart_get_content(lua_State *L)
 		return 1;
 	}
 
+	content = rspamd_mime_part_get_content(part);
 	t = lua_newuserdata(L, sizeof(*t));
 	rspamd_lua_setclass(L, rspamd_text_classname, -1);
-	t->start = part->parsed_data.begin;
-	t->len = part->parsed_data.len;
+	t->start = content->begin;
+	t->len = content->len;
 	t->flags = 0;
 
 	if (lua_is_text_binary(t)) {
@@ -1422,6 +1468,41 @@ lua_mimepart_get_content(lua_State *L)
 	return 1;
 }
 
+static int
+lua_mimepart_get_content_span(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_mime_part *part = lua_check_mimepart(L);
+	int64_t start = luaL_checkinteger(L, 2), len = -1;
+	rspamd_ftok_t span;
+
+	if (part == NULL || start < 1) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (lua_isnumber(L, 3)) {
+		len = lua_tointeger(L, 3);
+
+		if (len < 0) {
+			return luaL_error(L, "invalid length");
+		}
+	}
+
+	if (len == -1) {
+		len = part->parsed_data.len;
+	}
+
+	if (len == 0 ||
+		!rspamd_mime_part_get_content_span(part, start - 1, len, &span)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_new_text(L, span.begin, span.len, FALSE);
+
+	return 1;
+}
+
 static int
 lua_mimepart_get_raw_content(lua_State *L)
 {
@@ -1717,6 +1798,13 @@ lua_mimepart_get_header_raw(lua_State *L)
 	return lua_mimepart_get_header_common(L, RSPAMD_TASK_HEADER_PUSH_RAW);
 }
 
+static int
+lua_mimepart_get_header_text(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	return lua_mimepart_get_header_common(L, RSPAMD_TASK_HEADER_PUSH_TEXT);
+}
+
 static int
 lua_mimepart_get_header_count(lua_State *L)
 {
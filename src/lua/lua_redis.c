@@ -16,6 +16,8 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "utlist.h"
+#include "libserver/worker_util.h"
+#include "libserver/io_replay.h"
 
 #include "contrib/hiredis/hiredis.h"
 #include "contrib/hiredis/async.h"
@@ -53,6 +55,7 @@ LUA_FUNCTION_DEF(redis, make_request);
 LUA_FUNCTION_DEF(redis, make_request_sync);
 LUA_FUNCTION_DEF(redis, connect);
 LUA_FUNCTION_DEF(redis, connect_sync);
+LUA_FUNCTION_DEF(redis, key_slot);
 LUA_FUNCTION_DEF(redis, add_cmd);
 LUA_FUNCTION_DEF(redis, exec);
 LUA_FUNCTION_DEF(redis, gc);
@@ -62,6 +65,7 @@ static const struct luaL_reg redislib_f[] = {
 	LUA_INTERFACE_DEF(redis, make_request_sync),
 	LUA_INTERFACE_DEF(redis, connect),
 	LUA_INTERFACE_DEF(redis, connect_sync),
+	LUA_INTERFACE_DEF(redis, key_slot),
 	{NULL, NULL}};
 
 static const struct luaL_reg redislib_m[] = {
@@ -118,11 +122,16 @@ INIT_LOG_MODULE(lua_redis)
 #define LUA_REDIS_SPECIFIC_REPLIED (1 << 0)
 /* session was finished */
 #define LUA_REDIS_SPECIFIC_FINISHED (1 << 1)
+/* command is sent and its hiredis callback has not been called yet */
+#define LUA_REDIS_SPECIFIC_PENDING (1 << 2)
+/* request is destroyed, hiredis callback just frees it */
+#define LUA_REDIS_SPECIFIC_ORPHANED (1 << 3)
 #define LUA_REDIS_ASYNC (1 << 0)
 #define LUA_REDIS_TEXTDATA (1 << 1)
 #define LUA_REDIS_TERMINATED (1 << 2)
 #define LUA_REDIS_NO_POOL (1 << 3)
 #define LUA_REDIS_SUBSCRIBED (1 << 4)
+#define LUA_REDIS_SHARED (1 << 5)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
 
 struct lua_redis_request_specific_userdata {
@@ -134,6 +143,7 @@ struct lua_redis_request_specific_userdata {
 	struct lua_redis_ctx *ctx;
 	struct lua_redis_request_specific_userdata *next;
 	ev_timer timeout_ev;
+	ev_tstamp start;
 	unsigned int flags;
 };
 
@@ -145,6 +155,11 @@ struct lua_redis_ctx {
 	GQueue *replies;             /* for sync connection only */
 	GQueue *events_cleanup;      /* for sync connection only */
 	struct thread_entry *thread; /* for sync mode, set only if there was yield */
+	/* Record/replay of a single request, key is set only if it is configured */
+	struct rspamd_io_replay *replay;
+	char *replay_key;
+	const ucl_object_t *replay_reply;
+	double replay_latency;
 };
 
 struct lua_redis_result {
@@ -209,7 +224,12 @@ lua_redis_dtor(struct lua_redis_ctx *ctx)
 		ac = ud->ctx;
 		ud->ctx = NULL;
 
-		if (!is_successful) {
+		if (ctx->flags & LUA_REDIS_SHARED) {
+			/* Other users still need this connection, late replies are orphaned */
+			rspamd_redis_pool_release_connection(ud->pool, ac,
+												 RSPAMD_REDIS_RELEASE_DEFAULT);
+		}
+		else if (!is_successful) {
 			rspamd_redis_pool_release_connection(ud->pool, ac,
 												 RSPAMD_REDIS_RELEASE_FATAL);
 		}
@@ -227,7 +247,16 @@ lua_redis_dtor(struct lua_redis_ctx *ctx)
 			luaL_unref(ud->cfg->lua_state, LUA_REGISTRYINDEX, cur->cbref);
 		}
 
-		g_free(cur);
+		if (cur->flags & LUA_REDIS_SPECIFIC_PENDING) {
+			/* Shared connection is alive, so the callback will be called later */
+			cur->flags |= LUA_REDIS_SPECIFIC_ORPHANED;
+			cur->args = NULL;
+			cur->c = NULL;
+			cur->ctx = NULL;
+		}
+		else {
+			g_free(cur);
+		}
 	}
 
 	if (ctx->events_cleanup) {
@@ -239,6 +268,7 @@ lua_redis_dtor(struct lua_redis_ctx *ctx)
 		ctx->replies = NULL;
 	}
 
+	g_free(ctx->replay_key);
 	g_free(ctx);
 }
 
@@ -442,6 +472,159 @@ lua_redis_push_data(const redisReply *r, struct lua_redis_ctx *ctx,
 	}
 }
 
+/*
+ * Converts redis reply to an object stored in the io record file
+ */
+static ucl_object_t *
+lua_redis_reply_to_ucl(const redisReply *r)
+{
+	ucl_object_t *obj, *elts;
+	unsigned int i;
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+
+	switch (r->type) {
+	case REDIS_REPLY_INTEGER:
+		ucl_object_insert_key(obj, ucl_object_fromstring("integer"), "type", 0, false);
+		ucl_object_insert_key(obj, ucl_object_fromint(r->integer), "value", 0, false);
+		break;
+	case REDIS_REPLY_ARRAY:
+		ucl_object_insert_key(obj, ucl_object_fromstring("array"), "type", 0, false);
+		elts = ucl_object_typed_new(UCL_ARRAY);
+
+		for (i = 0; i < r->elements; i++) {
+			ucl_array_append(elts, lua_redis_reply_to_ucl(r->element[i]));
+		}
+
+		ucl_object_insert_key(obj, elts, "elements", 0, false);
+		break;
+	case REDIS_REPLY_STRING:
+		ucl_object_insert_key(obj, ucl_object_fromstring("string"), "type", 0, false);
+		ucl_object_insert_key(obj, rspamd_io_replay_data_to_ucl(r->str, r->len),
+							  "data", 0, false);
+		break;
+	case REDIS_REPLY_STATUS:
+		ucl_object_insert_key(obj, ucl_object_fromstring("status"), "type", 0, false);
+		ucl_object_insert_key(obj, rspamd_io_replay_data_to_ucl(r->str, r->len),
+							  "data", 0, false);
+		break;
+	case REDIS_REPLY_ERROR:
+		ucl_object_insert_key(obj, ucl_object_fromstring("error"), "type", 0, false);
+		ucl_object_insert_key(obj, rspamd_io_replay_data_to_ucl(r->str, r->len),
+							  "data", 0, false);
+		break;
+	default:
+		ucl_object_insert_key(obj, ucl_object_fromstring("nil"), "type", 0, false);
+		break;
+	}
+
+	return obj;
+}
+
+/*
+ * Builds redis reply from a recorded object, it must be freed by
+ * `lua_redis_replayed_reply_free`
+ */
+static redisReply *
+lua_redis_reply_from_ucl(const ucl_object_t *obj)
+{
+	redisReply *r;
+	const ucl_object_t *elt, *cur;
+	const char *type = "nil";
+	ucl_object_iter_t it = NULL;
+	gsize len;
+
+	r = g_malloc0(sizeof(*r));
+	elt = ucl_object_lookup(obj, "type");
+
+	if (elt && ucl_object_type(elt) == UCL_STRING) {
+		type = ucl_object_tostring(elt);
+	}
+
+	if (strcmp(type, "integer") == 0) {
+		r->type = REDIS_REPLY_INTEGER;
+		r->integer = ucl_object_toint(ucl_object_lookup(obj, "value"));
+	}
+	else if (strcmp(type, "array") == 0) {
+		r->type = REDIS_REPLY_ARRAY;
+		elt = ucl_object_lookup(obj, "elements");
+		r->element = g_malloc0(sizeof(redisReply *) * (elt ? elt->len + 1 : 1));
+
+		while ((cur = ucl_object_iterate(elt, &it, true)) != NULL) {
+			r->element[r->elements++] = lua_redis_reply_from_ucl(cur);
+		}
+	}
+	else if (strcmp(type, "string") == 0 || strcmp(type, "status") == 0 ||
+			 strcmp(type, "error") == 0) {
+		if (strcmp(type, "string") == 0) {
+			r->type = REDIS_REPLY_STRING;
+		}
+		else if (strcmp(type, "status") == 0) {
+			r->type = REDIS_REPLY_STATUS;
+		}
+		else {
+			r->type = REDIS_REPLY_ERROR;
+		}
+
+		r->str = (char *) rspamd_io_replay_data_from_ucl(
+			ucl_object_lookup(obj, "data"), &len);
+
+		if (r->str == NULL) {
+			r->str = g_strdup("");
+			len = 0;
+		}
+
+		r->len = len;
+	}
+	else {
+		r->type = REDIS_REPLY_NIL;
+	}
+
+	return r;
+}
+
+static void
+lua_redis_replayed_reply_free(redisReply *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->elements; i++) {
+		lua_redis_replayed_reply_free(r->element[i]);
+	}
+
+	g_free(r->element);
+	g_free(r->str);
+	g_free(r);
+}
+
+static void
+lua_redis_replay(EV_P_ ev_timer *w, int revents)
+{
+	struct lua_redis_request_specific_userdata *sp_ud =
+		(struct lua_redis_request_specific_userdata *) w->data;
+	struct lua_redis_ctx *ctx;
+	redisReply *reply;
+
+	if (sp_ud->flags & LUA_REDIS_SPECIFIC_FINISHED) {
+		return;
+	}
+
+	ctx = sp_ud->ctx;
+	REDIS_RETAIN(ctx);
+	reply = lua_redis_reply_from_ucl(ctx->replay_reply);
+
+	if (reply->type != REDIS_REPLY_ERROR) {
+		lua_redis_push_data(reply, ctx, sp_ud);
+	}
+	else {
+		lua_redis_push_error(reply->str, ctx, sp_ud, TRUE);
+	}
+
+	lua_redis_replayed_reply_free(reply);
+	ctx->cmds_pending--;
+	REDIS_RELEASE(ctx);
+}
+
 /**
  * Callback for redis replies
  * @param c context of redis connection
@@ -457,6 +640,13 @@ lua_redis_callback(redisAsyncContext *c, gpointer r, gpointer priv)
 	struct lua_redis_userdata *ud;
 	redisAsyncContext *ac;
 
+	if (sp_ud->flags & LUA_REDIS_SPECIFIC_ORPHANED) {
+		/* Reply for a destroyed request on a shared connection */
+		g_free(sp_ud);
+		return;
+	}
+
+	sp_ud->flags &= ~LUA_REDIS_SPECIFIC_PENDING;
 	ctx = sp_ud->ctx;
 	ud = sp_ud->c;
 
@@ -467,6 +657,8 @@ lua_redis_callback(redisAsyncContext *c, gpointer r, gpointer priv)
 
 	msg_debug_lua_redis("got reply from redis %p for query %p", sp_ud->c->ctx,
 						sp_ud);
+	rspamd_worker_stat_hist_time(RSPAMD_STAT_HIST_REDIS,
+								 ev_now(ud->event_loop) - sp_ud->start);
 
 	REDIS_RETAIN(ctx);
 
@@ -475,6 +667,12 @@ lua_redis_callback(redisAsyncContext *c, gpointer r, gpointer priv)
 		(sp_ud->flags & LUA_REDIS_SUBSCRIBED)) {
 		if (c->err == 0) {
 			if (r != NULL) {
+				if (ctx->replay_key && rspamd_io_replay_is_recording(ctx->replay)) {
+					rspamd_io_replay_record(ctx->replay, "redis", ctx->replay_key,
+											lua_redis_reply_to_ucl(reply),
+											ev_now(ud->event_loop) - sp_ud->start);
+				}
+
 				if (reply->type != REDIS_REPLY_ERROR) {
 					lua_redis_push_data(reply, ctx, sp_ud);
 				}
@@ -596,6 +794,8 @@ lua_redis_callback_sync(redisAsyncContext *ac, gpointer r, gpointer priv)
 	lua_State *L = ctx->async.cfg->lua_state;
 
 	sp_ud->flags |= LUA_REDIS_SPECIFIC_REPLIED;
+	rspamd_worker_stat_hist_time(RSPAMD_STAT_HIST_REDIS,
+								 ev_now(ud->event_loop) - sp_ud->start);
 
 	if (ud->terminated) {
 		/* We are already at the termination stage, just go out */
@@ -756,11 +956,14 @@ lua_redis_timeout(EV_P_ ev_timer *w, int revents)
 		ac = sp_ud->c->ctx;
 		/* Set to NULL to avoid double free in dtor */
 		sp_ud->c->ctx = NULL;
-		ac->err = REDIS_ERR_IO;
-		errno = ETIMEDOUT;
+
+		if (!(ctx->flags & LUA_REDIS_SHARED)) {
+			ac->err = REDIS_ERR_IO;
+			errno = ETIMEDOUT;
+		}
 		/*
 		 * This will call all callbacks pending so the entire context
-		 * will be destructed
+		 * will be destructed, shared connection is just retired
 		 */
 		rspamd_redis_pool_release_connection(sp_ud->c->pool, ac,
 											 RSPAMD_REDIS_RELEASE_FATAL);
@@ -866,8 +1069,79 @@ lua_redis_parse_args(lua_State *L, int idx, const char *cmd,
 	*nargs = top;
 }
 
+/*
+ * Commands that change connection state or block it cannot be sent over
+ * a shared connection
+ */
+static gboolean
+lua_redis_cmd_can_share(const char *cmd)
+{
+	static const char *exclusive_cmds[] = {
+		"subscribe", "psubscribe", "ssubscribe", "monitor",
+		"multi", "watch", "select", "auth", "client", "quit", "reset",
+		"blpop", "brpop", "brpoplpush", "blmove", "blmpop",
+		"bzpopmin", "bzpopmax", "bzmpop", "xread", "xreadgroup", "wait"};
+
+	if (cmd == NULL) {
+		return FALSE;
+	}
+
+	for (unsigned int i = 0; i < G_N_ELEMENTS(exclusive_cmds); i++) {
+		if (g_ascii_strcasecmp(cmd, exclusive_cmds[i]) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Request is identified by server, database, command and its arguments
+ */
+static char *
+lua_redis_replay_key(lua_State *L, const char *host, const char *dbname)
+{
+	rspamd_cryptobox_fast_hash_state_t st;
+	char **args, *prefix, *key;
+	gsize *arglens;
+	unsigned int nargs, i;
+	uint64_t len;
+
+	lua_getfield(L, 1, "cmd");
+
+	if (lua_type(L, -1) != LUA_TSTRING) {
+		lua_pop(L, 1);
+
+		return NULL;
+	}
+
+	lua_getfield(L, 1, "args");
+	lua_redis_parse_args(L, -1, lua_tostring(L, -2), &args, &arglens, &nargs);
+	rspamd_cryptobox_fast_hash_init_specific(&st, RSPAMD_CRYPTOBOX_XXHASH64, 0);
+	rspamd_cryptobox_fast_hash_update(&st, host, strlen(host) + 1);
+
+	if (dbname) {
+		rspamd_cryptobox_fast_hash_update(&st, dbname, strlen(dbname));
+	}
+
+	for (i = 0; i < nargs; i++) {
+		len = arglens[i];
+		rspamd_cryptobox_fast_hash_update(&st, &len, sizeof(len));
+		rspamd_cryptobox_fast_hash_update(&st, args[i], arglens[i]);
+	}
+
+	prefix = g_strdup_printf("%s %s", host, lua_tostring(L, -2));
+	key = rspamd_io_replay_key(prefix, rspamd_cryptobox_fast_hash_final(&st));
+	g_free(prefix);
+	lua_redis_free_args(args, arglens, nargs);
+	lua_pop(L, 2);
+
+	return key;
+}
+
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async)
+rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async,
+									gboolean allow_shared, gboolean can_replay)
 {
 	struct lua_redis_ctx *ctx = NULL;
 	rspamd_inet_addr_t *ip = NULL;
@@ -1059,10 +1333,42 @@ rspamd_lua_redis_prepare_connection(lua_State *L, int *pcbref, gboolean is_async
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect(ud->pool,
-											dbname, username, password,
-											rspamd_inet_address_to_string(addr->addr),
-											rspamd_inet_address_get_port(addr->addr));
+
+		if (can_replay && (ctx->replay = rspamd_io_replay_get(cfg)) != NULL) {
+			ctx->replay_key = lua_redis_replay_key(L,
+												   rspamd_inet_address_to_string_pretty(addr->addr),
+												   dbname);
+
+			if (ctx->replay_key) {
+				ctx->replay_reply = rspamd_io_replay_lookup(ctx->replay, "redis",
+															ctx->replay_key,
+															&ctx->replay_latency);
+			}
+
+			if (ctx->replay_reply) {
+				/* Recorded reply is served with no connection */
+				if (ip) {
+					rspamd_inet_address_free(ip);
+				}
+
+				return ctx;
+			}
+		}
+
+		if (allow_shared && !(ctx->flags & LUA_REDIS_NO_POOL) &&
+			rspamd_redis_pool_is_multiplexed(ud->pool)) {
+			ctx->flags |= LUA_REDIS_SHARED;
+			ud->ctx = rspamd_redis_pool_connect_shared(ud->pool,
+													   dbname, username, password,
+													   rspamd_inet_address_to_string(addr->addr),
+													   rspamd_inet_address_get_port(addr->addr));
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect(ud->pool,
+												dbname, username, password,
+												rspamd_inet_address_to_string(addr->addr),
+												rspamd_inet_address_get_port(addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_free(ip);
@@ -1120,13 +1426,21 @@ lua_redis_make_request(lua_State *L)
 	const char *cmd = NULL;
 	double timeout = REDIS_DEFAULT_TIMEOUT;
 	int cbref = -1;
-	gboolean ret = FALSE;
+	gboolean ret = FALSE, allow_shared = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, &cbref, TRUE);
+	if (lua_istable(L, 1)) {
+		/* Single commands can be pipelined with commands of other requests */
+		lua_getfield(L, 1, "cmd");
+		allow_shared = lua_redis_cmd_can_share(lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+
+	ctx = rspamd_lua_redis_prepare_connection(L, &cbref, TRUE, allow_shared, TRUE);
 
 	if (ctx) {
 		ud = &ctx->async;
 		sp_ud = g_malloc0(sizeof(*sp_ud));
+		sp_ud->start = ev_now(ud->event_loop);
 		sp_ud->cbref = cbref;
 		sp_ud->c = ud;
 		sp_ud->ctx = ctx;
@@ -1142,6 +1456,7 @@ lua_redis_make_request(lua_State *L)
 			timeout = lua_tonumber(L, -1);
 		}
 		lua_pop(L, 1);
+		timeout = rspamd_task_adjust_timeout(ud->task, timeout);
 		ud->timeout = timeout;
 
 
@@ -1152,12 +1467,22 @@ lua_redis_make_request(lua_State *L)
 		lua_pop(L, 1);
 		LL_PREPEND(ud->specific, sp_ud);
 
-		ret = redisAsyncCommandArgv(ud->ctx,
-									lua_redis_callback,
-									sp_ud,
-									sp_ud->nargs,
-									(const char **) sp_ud->args,
-									sp_ud->arglens);
+		if (ctx->replay_reply) {
+			/* Recorded reply is delivered by a timer with no connection */
+			ret = REDIS_OK;
+		}
+		else if (timeout > 0) {
+			ret = redisAsyncCommandArgv(ud->ctx,
+										lua_redis_callback,
+										sp_ud,
+										sp_ud->nargs,
+										(const char **) sp_ud->args,
+										sp_ud->arglens);
+		}
+		else {
+			/* Task has no time left, fail fast */
+			ret = REDIS_ERR;
+		}
 
 		if (ret == REDIS_OK) {
 			if (ud->s) {
@@ -1173,22 +1498,35 @@ lua_redis_make_request(lua_State *L)
 			REDIS_RETAIN(ctx); /* Cleared by fin event */
 			ctx->cmds_pending++;
 
-			if (ud->ctx->c.flags & REDIS_SUBSCRIBED) {
+			if (ctx->flags & LUA_REDIS_SHARED) {
+				sp_ud->flags |= LUA_REDIS_SPECIFIC_PENDING;
+			}
+
+			if (ud->ctx && (ud->ctx->c.flags & REDIS_SUBSCRIBED)) {
 				msg_debug_lua_redis("subscribe command, never unref/timeout");
 				sp_ud->flags |= LUA_REDIS_SUBSCRIBED;
 			}
 
 			sp_ud->timeout_ev.data = sp_ud;
 			ev_now_update_if_cheap((struct ev_loop *) ud->event_loop);
-			ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout, timeout, 0.0);
+
+			if (ctx->replay_reply && ctx->replay_latency < timeout) {
+				ev_timer_init(&sp_ud->timeout_ev, lua_redis_replay,
+							  ctx->replay_latency, 0.0);
+			}
+			else {
+				ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout, timeout, 0.0);
+			}
+
 			ev_timer_start(ud->event_loop, &sp_ud->timeout_ev);
 
 			ret = TRUE;
 		}
 		else {
-			msg_info("call to redis failed: %s", ud->ctx->errstr);
+			msg_info("call to redis failed: %s",
+					 timeout > 0 ? ud->ctx->errstr : "task has no time left");
 			rspamd_redis_pool_release_connection(ud->pool, ud->ctx,
-												 RSPAMD_REDIS_RELEASE_FATAL);
+												 timeout > 0 ? RSPAMD_REDIS_RELEASE_FATAL : RSPAMD_REDIS_RELEASE_DEFAULT);
 			ud->ctx = NULL;
 			REDIS_RELEASE(ctx);
 			ret = FALSE;
@@ -1378,7 +1716,7 @@ lua_redis_connect(lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	double timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, NULL, TRUE);
+	ctx = rspamd_lua_redis_prepare_connection(L, NULL, TRUE, FALSE, FALSE);
 
 	if (ctx) {
 		ud = &ctx->async;
@@ -1421,7 +1759,7 @@ lua_redis_connect_sync(lua_State *L)
 	double timeout = REDIS_DEFAULT_TIMEOUT;
 	struct lua_redis_ctx *ctx, **pctx;
 
-	ctx = rspamd_lua_redis_prepare_connection(L, NULL, FALSE);
+	ctx = rspamd_lua_redis_prepare_connection(L, NULL, FALSE, FALSE, FALSE);
 
 	if (ctx) {
 		if (lua_istable(L, 1)) {
@@ -1449,6 +1787,27 @@ lua_redis_connect_sync(lua_State *L)
 	return 2;
 }
 
+/***
+ * @function rspamd_redis.key_slot(key)
+ * Returns Redis Cluster hash slot of a key, only {hashtag} part is hashed if present
+ * @param {string|text} key redis key
+ * @return {number} slot number from 0 to 16383
+ */
+static int
+lua_redis_key_slot(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_lua_text *t = lua_check_text_or_string(L, 1);
+
+	if (t == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, rspamd_redis_key_slot(t->start, t->len));
+
+	return 1;
+}
+
 /***
  * @method rspamd_redis:add_cmd(cmd, {args})
  * Append new cmd to redis pipeline
@@ -1466,6 +1825,7 @@ lua_redis_add_cmd(lua_State *L)
 	const char *cmd = NULL;
 	int args_pos = 2;
 	int cbref = -1, ret;
+	double timeout;
 
 	if (ctx) {
 		if (ctx->flags & LUA_REDIS_TERMINATED) {
@@ -1492,6 +1852,7 @@ lua_redis_add_cmd(lua_State *L)
 		}
 
 		sp_ud = g_malloc0(sizeof(*sp_ud));
+		sp_ud->start = ev_now(ctx->async.event_loop);
 		if (IS_ASYNC(ctx)) {
 			sp_ud->c = &ctx->async;
 			ud = &ctx->async;
@@ -1515,6 +1876,15 @@ lua_redis_add_cmd(lua_State *L)
 			return 2;
 		}
 
+		timeout = rspamd_task_adjust_timeout(ud->task, sp_ud->c->timeout);
+
+		if (timeout <= 0) {
+			lua_pushboolean(L, 0);
+			lua_pushstring(L, "task has no time left");
+
+			return 2;
+		}
+
 		if (IS_ASYNC(ctx)) {
 			ret = redisAsyncCommandArgv(sp_ud->c->ctx,
 										lua_redis_callback,
@@ -1548,11 +1918,11 @@ lua_redis_add_cmd(lua_State *L)
 
 			if (IS_ASYNC(ctx)) {
 				ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout,
-							  sp_ud->c->timeout, 0.0);
+							  timeout, 0.0);
 			}
 			else {
 				ev_timer_init(&sp_ud->timeout_ev, lua_redis_timeout_sync,
-							  sp_ud->c->timeout, 0.0);
+							  timeout, 0.0);
 			}
 
 			ev_timer_start(ud->event_loop, &sp_ud->timeout_ev);
@@ -0,0 +1,824 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lua_common.h"
+
+/***
+ * @module rspamd_rowbinary
+ * `rspamd_rowbinary` is a buffer of typed rows serialized to the ClickHouse
+ * `RowBinaryWithNamesAndTypes` format as soon as they are appended, so no
+ * intermediate strings are built in Lua
+ * @example
+local rspamd_rowbinary = require "rspamd_rowbinary"
+local buf = rspamd_rowbinary.create({'TS', 'Score', 'Symbols'},
+    {'DateTime', 'Float32', 'Array(LowCardinality(String))'})
+buf:append({os.time(), 1.5, {'SYM1', 'SYM2'}})
+local body = buf:flush() -- rspamd_text suitable for `INSERT ... FORMAT RowBinaryWithNamesAndTypes`
+ */
+
+/***
+ * @function rowbinary.create(names, types)
+ * Creates a new rows buffer for the specified columns
+ * @param {table} names column names
+ * @param {table} types ClickHouse types of columns, e.g. `Array(String)`, `Enum8('a' = 0, 'b' = 1)`
+ * @return {rowbinary} new buffer or nil + error
+ */
+LUA_FUNCTION_DEF(rowbinary, create);
+/***
+ * @method rowbinary:append(row)
+ * Serializes a row, which is an array of values in the columns order
+ * @param {table} row values
+ * @return {boolean} true or false + error; a failed row is not added
+ */
+LUA_FUNCTION_DEF(rowbinary, append);
+/***
+ * @method rowbinary:flush()
+ * Returns serialized rows including the header and resets the buffer
+ * @return {text} serialized data or nil if there are no rows
+ */
+LUA_FUNCTION_DEF(rowbinary, flush);
+/***
+ * @method rowbinary:rows()
+ * @return {number} number of rows in the buffer
+ */
+LUA_FUNCTION_DEF(rowbinary, rows);
+/***
+ * @method rowbinary:size()
+ * @return {number} number of bytes in the buffer
+ */
+LUA_FUNCTION_DEF(rowbinary, size);
+LUA_FUNCTION_DEF(rowbinary, gc);
+
+static const struct luaL_reg rowbinary_f[] = {
+	LUA_INTERFACE_DEF(rowbinary, create),
+	{NULL, NULL}};
+
+static const struct luaL_reg rowbinary_m[] = {
+	LUA_INTERFACE_DEF(rowbinary, append),
+	LUA_INTERFACE_DEF(rowbinary, flush),
+	LUA_INTERFACE_DEF(rowbinary, rows),
+	LUA_INTERFACE_DEF(rowbinary, size),
+	{"__gc", lua_rowbinary_gc},
+	{NULL, NULL}};
+
+enum rspamd_rowbinary_kind {
+	RSPAMD_ROWBINARY_INT8 = 0,
+	RSPAMD_ROWBINARY_INT16,
+	RSPAMD_ROWBINARY_INT32,
+	RSPAMD_ROWBINARY_INT64,
+	RSPAMD_ROWBINARY_UINT8,
+	RSPAMD_ROWBINARY_UINT16,
+	RSPAMD_ROWBINARY_UINT32,
+	RSPAMD_ROWBINARY_UINT64,
+	RSPAMD_ROWBINARY_FLOAT32,
+	RSPAMD_ROWBINARY_FLOAT64,
+	RSPAMD_ROWBINARY_STRING,
+	RSPAMD_ROWBINARY_FIXED_STRING,
+	RSPAMD_ROWBINARY_DATE,
+	RSPAMD_ROWBINARY_DATETIME,
+	RSPAMD_ROWBINARY_ENUM8,
+	RSPAMD_ROWBINARY_ENUM16,
+	RSPAMD_ROWBINARY_ARRAY,
+	RSPAMD_ROWBINARY_NULLABLE,
+};
+
+struct rspamd_rowbinary_type {
+	enum rspamd_rowbinary_kind kind;
+	unsigned int fixed_len;
+	GHashTable *enum_values; /* name -> value for enums */
+	struct rspamd_rowbinary_type *nested;
+};
+
+struct rspamd_rowbinary {
+	GByteArray *buf;
+	GPtrArray *names;
+	GPtrArray *type_names;
+	struct rspamd_rowbinary_type **types;
+	unsigned int ncols;
+	unsigned int nrows;
+};
+
+static const struct {
+	const char *name;
+	enum rspamd_rowbinary_kind kind;
+} rowbinary_simple_types[] = {
+	{"Int8", RSPAMD_ROWBINARY_INT8},
+	{"Int16", RSPAMD_ROWBINARY_INT16},
+	{"Int32", RSPAMD_ROWBINARY_INT32},
+	{"Int64", RSPAMD_ROWBINARY_INT64},
+	{"UInt8", RSPAMD_ROWBINARY_UINT8},
+	{"Bool", RSPAMD_ROWBINARY_UINT8},
+	{"UInt16", RSPAMD_ROWBINARY_UINT16},
+	{"UInt32", RSPAMD_ROWBINARY_UINT32},
+	{"UInt64", RSPAMD_ROWBINARY_UINT64},
+	{"Float32", RSPAMD_ROWBINARY_FLOAT32},
+	{"Float64", RSPAMD_ROWBINARY_FLOAT64},
+	{"String", RSPAMD_ROWBINARY_STRING},
+	{"Date", RSPAMD_ROWBINARY_DATE},
+};
+
+static void
+rspamd_rowbinary_type_free(struct rspamd_rowbinary_type *t)
+{
+	if (t) {
+		if (t->enum_values) {
+			g_hash_table_unref(t->enum_values);
+		}
+
+		rspamd_rowbinary_type_free(t->nested);
+		g_free(t);
+	}
+}
+
+static const char *
+rspamd_rowbinary_skip_spaces(const char *p, const char *end)
+{
+	while (p < end && g_ascii_isspace(*p)) {
+		p++;
+	}
+
+	return p;
+}
+
+/* Parses `'name' = value, ...)` */
+static const char *
+rspamd_rowbinary_parse_enum(struct rspamd_rowbinary_type *t,
+							const char *p, const char *end)
+{
+	t->enum_values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (;;) {
+		GString *name;
+		char *endptr;
+		long value;
+
+		p = rspamd_rowbinary_skip_spaces(p, end);
+
+		if (p >= end || *p != '\'') {
+			return NULL;
+		}
+
+		p++;
+		name = g_string_new(NULL);
+
+		while (p < end && *p != '\'') {
+			if (*p == '\\' && p + 1 < end) {
+				p++;
+			}
+
+			g_string_append_c(name, *p);
+			p++;
+		}
+
+		if (p >= end) {
+			g_string_free(name, TRUE);
+			return NULL;
+		}
+
+		p = rspamd_rowbinary_skip_spaces(p + 1, end);
+
+		if (p >= end || *p != '=') {
+			g_string_free(name, TRUE);
+			return NULL;
+		}
+
+		value = strtol(p + 1, &endptr, 10);
+
+		if (endptr == p + 1 || endptr > end) {
+			g_string_free(name, TRUE);
+			return NULL;
+		}
+
+		g_hash_table_insert(t->enum_values, g_string_free(name, FALSE),
+							GINT_TO_POINTER((int) value));
+		p = rspamd_rowbinary_skip_spaces(endptr, end);
+
+		if (p < end && *p == ',') {
+			p++;
+		}
+		else if (p < end && *p == ')') {
+			return p + 1;
+		}
+		else {
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Parses a type from `p` and sets `*pend` to the first character after it
+ */
+static struct rspamd_rowbinary_type *
+rspamd_rowbinary_parse_type(const char *p, const char *end, const char **pend)
+{
+	struct rspamd_rowbinary_type *t;
+	const char *name_start, *args;
+	gsize namelen;
+
+	p = rspamd_rowbinary_skip_spaces(p, end);
+	name_start = p;
+
+	while (p < end && (g_ascii_isalnum(*p) || *p == '_')) {
+		p++;
+	}
+
+	namelen = p - name_start;
+	args = (p < end && *p == '(') ? p + 1 : NULL;
+	t = g_malloc0(sizeof(*t));
+
+#define TYPE_IS(s) (namelen == sizeof(s) - 1 && memcmp(name_start, s, namelen) == 0)
+	if (TYPE_IS("LowCardinality") && args) {
+		/* Serialized just as the nested type */
+		g_free(t);
+		t = rspamd_rowbinary_parse_type(args, end, &p);
+
+		if (t == NULL || p >= end || *p != ')') {
+			rspamd_rowbinary_type_free(t);
+			return NULL;
+		}
+
+		p++;
+	}
+	else if ((TYPE_IS("Array") || TYPE_IS("Nullable")) && args) {
+		t->kind = TYPE_IS("Array") ? RSPAMD_ROWBINARY_ARRAY : RSPAMD_ROWBINARY_NULLABLE;
+		t->nested = rspamd_rowbinary_parse_type(args, end, &p);
+
+		if (t->nested == NULL || p >= end || *p != ')') {
+			rspamd_rowbinary_type_free(t);
+			return NULL;
+		}
+
+		p++;
+	}
+	else if (TYPE_IS("FixedString") && args) {
+		char *endptr;
+
+		t->kind = RSPAMD_ROWBINARY_FIXED_STRING;
+		t->fixed_len = strtoul(args, &endptr, 10);
+		p = rspamd_rowbinary_skip_spaces(endptr, end);
+
+		if (t->fixed_len == 0 || p >= end || *p != ')') {
+			rspamd_rowbinary_type_free(t);
+			return NULL;
+		}
+
+		p++;
+	}
+	else if ((TYPE_IS("Enum8") || TYPE_IS("Enum16")) && args) {
+		t->kind = TYPE_IS("Enum8") ? RSPAMD_ROWBINARY_ENUM8 : RSPAMD_ROWBINARY_ENUM16;
+		p = rspamd_rowbinary_parse_enum(t, args, end);
+
+		if (p == NULL) {
+			rspamd_rowbinary_type_free(t);
+			return NULL;
+		}
+	}
+	else if (TYPE_IS("DateTime")) {
+		t->kind = RSPAMD_ROWBINARY_DATETIME;
+
+		if (args) {
+			/* Timezone argument does not change serialization */
+			p = memchr(args, ')', end - args);
+
+			if (p == NULL) {
+				rspamd_rowbinary_type_free(t);
+				return NULL;
+			}
+
+			p++;
+		}
+	}
+	else {
+		unsigned int i;
+		gboolean found = FALSE;
+
+		for (i = 0; i < G_N_ELEMENTS(rowbinary_simple_types); i++) {
+			if (TYPE_IS(rowbinary_simple_types[i].name)) {
+				t->kind = rowbinary_simple_types[i].kind;
+				found = TRUE;
+				break;
+			}
+		}
+
+		if (!found || args) {
+			rspamd_rowbinary_type_free(t);
+			return NULL;
+		}
+	}
+#undef TYPE_IS
+
+	*pend = rspamd_rowbinary_skip_spaces(p, end);
+
+	return t;
+}
+
+static void
+rspamd_rowbinary_write_varint(GByteArray *buf, guint64 value)
+{
+	guint8 tmp[10];
+	unsigned int len = 0;
+
+	do {
+		tmp[len] = value & 0x7f;
+		value >>= 7;
+
+		if (value != 0) {
+			tmp[len] |= 0x80;
+		}
+
+		len++;
+	} while (value != 0);
+
+	g_byte_array_append(buf, tmp, len);
+}
+
+static void
+rspamd_rowbinary_write_string(GByteArray *buf, const char *s, gsize len)
+{
+	rspamd_rowbinary_write_varint(buf, len);
+	g_byte_array_append(buf, (const guint8 *) s, len);
+}
+
+#define ROWBINARY_WRITE_LE(buf, type, conv, v) \
+	do {                                       \
+		type _v = conv(v);                     \
+		g_byte_array_append((buf), (const guint8 *) &_v, sizeof(_v)); \
+	} while (0)
+
+/* Days since epoch for a proleptic Gregorian date */
+static gint64
+rspamd_rowbinary_days_from_civil(gint64 y, unsigned int m, unsigned int d)
+{
+	gint64 era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/* Converts numbers, `YYYY-MM-DD` or `YYYY-MM-DD hh:mm:ss` strings to seconds */
+static gboolean
+rspamd_rowbinary_get_time(lua_State *L, int idx, gint64 *res)
+{
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		const char *s = lua_tostring(L, idx);
+		int y, m, d, hh = 0, mm = 0, ss = 0;
+
+		if (sscanf(s, "%d-%d-%d %d:%d:%d", &y, &m, &d, &hh, &mm, &ss) < 3) {
+			return FALSE;
+		}
+
+		*res = rspamd_rowbinary_days_from_civil(y, m, d) * 86400 +
+			   hh * 3600 + mm * 60 + ss;
+	}
+	else {
+		*res = lua_tonumber(L, idx);
+	}
+
+	return TRUE;
+}
+
+/* Returns string representation of any value or NULL */
+static const char *
+rspamd_rowbinary_get_string(lua_State *L, int idx, gsize *len)
+{
+	struct rspamd_lua_text *t;
+
+	switch (lua_type(L, idx)) {
+	case LUA_TSTRING:
+	case LUA_TNUMBER:
+		return lua_tolstring(L, idx, len);
+	case LUA_TUSERDATA:
+		t = rspamd_lua_check_udata_maybe(L, idx, rspamd_text_classname);
+
+		if (t) {
+			*len = t->len;
+			return t->start;
+		}
+
+		/* Leaves the result on stack, it is cleaned by the caller */
+		if (luaL_callmeta(L, idx, "__tostring")) {
+			lua_replace(L, idx);
+			return lua_tolstring(L, idx, len);
+		}
+		break;
+	default:
+		break;
+	}
+
+	*len = 0;
+
+	return "";
+}
+
+/*
+ * Serializes value at `idx` (absolute index), nil values are serialized as
+ * defaults
+ */
+static gboolean
+rspamd_rowbinary_write_value(lua_State *L, int idx,
+							 struct rspamd_rowbinary_type *t,
+							 GByteArray *buf, GError **err)
+{
+	lua_Number num = 0;
+	gint64 ts;
+	const char *s;
+	gsize len;
+	gpointer value;
+
+	if (t->kind <= RSPAMD_ROWBINARY_FLOAT64) {
+		if (lua_type(L, idx) == LUA_TBOOLEAN) {
+			num = lua_toboolean(L, idx);
+		}
+		else {
+			num = lua_tonumber(L, idx);
+		}
+	}
+
+	switch (t->kind) {
+	case RSPAMD_ROWBINARY_INT8:
+	case RSPAMD_ROWBINARY_UINT8:
+		ROWBINARY_WRITE_LE(buf, guint8, (guint8), (gint64) num);
+		break;
+	case RSPAMD_ROWBINARY_INT16:
+	case RSPAMD_ROWBINARY_UINT16:
+		ROWBINARY_WRITE_LE(buf, guint16, GUINT16_TO_LE, (gint64) num);
+		break;
+	case RSPAMD_ROWBINARY_INT32:
+	case RSPAMD_ROWBINARY_UINT32:
+		ROWBINARY_WRITE_LE(buf, guint32, GUINT32_TO_LE, (gint64) num);
+		break;
+	case RSPAMD_ROWBINARY_INT64:
+		ROWBINARY_WRITE_LE(buf, guint64, GUINT64_TO_LE, (gint64) num);
+		break;
+	case RSPAMD_ROWBINARY_UINT64:
+		ROWBINARY_WRITE_LE(buf, guint64, GUINT64_TO_LE, (guint64) num);
+		break;
+	case RSPAMD_ROWBINARY_FLOAT32: {
+		union {
+			float f;
+			guint32 u;
+		} c;
+
+		c.f = num;
+		ROWBINARY_WRITE_LE(buf, guint32, GUINT32_TO_LE, c.u);
+		break;
+	}
+	case RSPAMD_ROWBINARY_FLOAT64: {
+		union {
+			double f;
+			guint64 u;
+		} c;
+
+		c.f = num;
+		ROWBINARY_WRITE_LE(buf, guint64, GUINT64_TO_LE, c.u);
+		break;
+	}
+	case RSPAMD_ROWBINARY_STRING:
+		s = rspamd_rowbinary_get_string(L, idx, &len);
+		rspamd_rowbinary_write_string(buf, s, len);
+		break;
+	case RSPAMD_ROWBINARY_FIXED_STRING: {
+		static const guint8 zeroes[64];
+		gsize padding;
+
+		s = rspamd_rowbinary_get_string(L, idx, &len);
+		len = MIN(len, t->fixed_len);
+		g_byte_array_append(buf, (const guint8 *) s, len);
+
+		for (padding = t->fixed_len - len; padding > 0;) {
+			gsize cur = MIN(padding, sizeof(zeroes));
+
+			g_byte_array_append(buf, zeroes, cur);
+			padding -= cur;
+		}
+		break;
+	}
+	case RSPAMD_ROWBINARY_DATE:
+	case RSPAMD_ROWBINARY_DATETIME:
+		if (lua_isnil(L, idx)) {
+			ts = 0;
+		}
+		else if (!rspamd_rowbinary_get_time(L, idx, &ts)) {
+			g_set_error(err, g_quark_from_static_string("rowbinary"), EINVAL,
+						"invalid date: %s", lua_tostring(L, idx));
+			return FALSE;
+		}
+
+		if (t->kind == RSPAMD_ROWBINARY_DATE) {
+			ROWBINARY_WRITE_LE(buf, guint16, GUINT16_TO_LE, ts / 86400);
+		}
+		else {
+			ROWBINARY_WRITE_LE(buf, guint32, GUINT32_TO_LE, ts);
+		}
+		break;
+	case RSPAMD_ROWBINARY_ENUM8:
+	case RSPAMD_ROWBINARY_ENUM16:
+		if (lua_type(L, idx) == LUA_TNUMBER) {
+			value = GINT_TO_POINTER((int) lua_tointeger(L, idx));
+		}
+		else if (!g_hash_table_lookup_extended(t->enum_values,
+											   lua_tostring(L, idx) ? lua_tostring(L, idx) : "",
+											   NULL, &value)) {
+			g_set_error(err, g_quark_from_static_string("rowbinary"), EINVAL,
+						"invalid enum value: %s", lua_tostring(L, idx));
+			return FALSE;
+		}
+
+		if (t->kind == RSPAMD_ROWBINARY_ENUM8) {
+			ROWBINARY_WRITE_LE(buf, guint8, (guint8), GPOINTER_TO_INT(value));
+		}
+		else {
+			ROWBINARY_WRITE_LE(buf, guint16, GUINT16_TO_LE, GPOINTER_TO_INT(value));
+		}
+		break;
+	case RSPAMD_ROWBINARY_ARRAY: {
+		gsize nelts = 0, i;
+
+		if (lua_type(L, idx) == LUA_TTABLE) {
+			nelts = rspamd_lua_table_size(L, idx);
+		}
+
+		rspamd_rowbinary_write_varint(buf, nelts);
+
+		for (i = 1; i <= nelts; i++) {
+			lua_rawgeti(L, idx, i);
+
+			if (!rspamd_rowbinary_write_value(L, lua_gettop(L), t->nested, buf, err)) {
+				lua_pop(L, 1);
+				return FALSE;
+			}
+
+			lua_pop(L, 1);
+		}
+		break;
+	}
+	case RSPAMD_ROWBINARY_NULLABLE: {
+		guint8 is_null = lua_isnil(L, idx);
+
+		g_byte_array_append(buf, &is_null, 1);
+
+		if (!is_null) {
+			return rspamd_rowbinary_write_value(L, idx, t->nested, buf, err);
+		}
+		break;
+	}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_rowbinary_write_header(struct rspamd_rowbinary *rb)
+{
+	unsigned int i;
+
+	rspamd_rowbinary_write_varint(rb->buf, rb->ncols);
+
+	for (i = 0; i < rb->ncols; i++) {
+		const char *name = g_ptr_array_index(rb->names, i);
+		rspamd_rowbinary_write_string(rb->buf, name, strlen(name));
+	}
+
+	for (i = 0; i < rb->ncols; i++) {
+		const char *type = g_ptr_array_index(rb->type_names, i);
+		rspamd_rowbinary_write_string(rb->buf, type, strlen(type));
+	}
+}
+
+static struct rspamd_rowbinary *
+lua_check_rowbinary(lua_State *L, int pos)
+{
+	void *ud = rspamd_lua_check_udata(L, pos, rspamd_rowbinary_classname);
+	luaL_argcheck(L, ud != NULL, pos, "'rowbinary' expected");
+	return ud ? *((struct rspamd_rowbinary **) ud) : NULL;
+}
+
+static int
+lua_rowbinary_create(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_rowbinary *rb, **prb;
+	unsigned int ncols, i;
+
+	if (lua_type(L, 1) != LUA_TTABLE || lua_type(L, 2) != LUA_TTABLE) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	ncols = rspamd_lua_table_size(L, 1);
+
+	if (ncols == 0 || ncols != rspamd_lua_table_size(L, 2)) {
+		return luaL_error(L, "invalid arguments: names and types mismatch");
+	}
+
+	rb = g_malloc0(sizeof(*rb));
+	rb->ncols = ncols;
+	rb->names = g_ptr_array_new_full(ncols, g_free);
+	rb->type_names = g_ptr_array_new_full(ncols, g_free);
+	rb->types = g_new0(struct rspamd_rowbinary_type *, ncols);
+	rb->buf = g_byte_array_new();
+
+	for (i = 0; i < ncols; i++) {
+		const char *name, *type, *end;
+		gsize typelen;
+
+		lua_rawgeti(L, 1, i + 1);
+		lua_rawgeti(L, 2, i + 1);
+		name = lua_tostring(L, -2);
+		type = lua_tolstring(L, -1, &typelen);
+
+		if (name && type) {
+			g_ptr_array_add(rb->names, g_strdup(name));
+			g_ptr_array_add(rb->type_names, g_strdup(type));
+			rb->types[i] = rspamd_rowbinary_parse_type(type, type + typelen, &end);
+		}
+
+		if (!name || !type || rb->types[i] == NULL || end != type + typelen) {
+			char errbuf[256];
+
+			rspamd_snprintf(errbuf, sizeof(errbuf), "invalid type for column %s: %s",
+							name ? name : "?", type ? type : "?");
+			lua_pop(L, 2);
+			lua_pushnil(L);
+			lua_pushstring(L, errbuf);
+
+			goto err;
+		}
+
+		lua_pop(L, 2);
+	}
+
+	rspamd_rowbinary_write_header(rb);
+	prb = lua_newuserdata(L, sizeof(*prb));
+	*prb = rb;
+	rspamd_lua_setclass(L, rspamd_rowbinary_classname, -1);
+
+	return 1;
+
+err:
+	for (i = 0; i < rb->ncols; i++) {
+		rspamd_rowbinary_type_free(rb->types[i]);
+	}
+
+	g_free(rb->types);
+	g_ptr_array_free(rb->names, TRUE);
+	g_ptr_array_free(rb->type_names, TRUE);
+	g_byte_array_free(rb->buf, TRUE);
+	g_free(rb);
+
+	return 2;
+}
+
+static int
+lua_rowbinary_append(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_rowbinary *rb = lua_check_rowbinary(L, 1);
+	unsigned int i, old_len;
+	GError *err = NULL;
+	int top;
+
+	if (rb == NULL || lua_type(L, 2) != LUA_TTABLE) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	old_len = rb->buf->len;
+	top = lua_gettop(L);
+
+	for (i = 0; i < rb->ncols; i++) {
+		lua_rawgeti(L, 2, i + 1);
+
+		if (!rspamd_rowbinary_write_value(L, lua_gettop(L), rb->types[i],
+										  rb->buf, &err)) {
+			lua_settop(L, top);
+			/* Drop partially written row */
+			g_byte_array_set_size(rb->buf, old_len);
+			lua_pushboolean(L, false);
+			lua_pushfstring(L, "column %s: %s",
+							(const char *) g_ptr_array_index(rb->names, i),
+							err->message);
+			g_error_free(err);
+
+			return 2;
+		}
+
+		lua_settop(L, top);
+	}
+
+	rb->nrows++;
+	lua_pushboolean(L, true);
+
+	return 1;
+}
+
+static int
+lua_rowbinary_flush(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_rowbinary *rb = lua_check_rowbinary(L, 1);
+	gsize len;
+
+	if (rb == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (rb->nrows == 0) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	/* Pass data ownership to the text */
+	len = rb->buf->len;
+	lua_new_text(L, (const char *) g_byte_array_free(rb->buf, FALSE), len, TRUE);
+	rb->buf = g_byte_array_sized_new(len);
+	rb->nrows = 0;
+	rspamd_rowbinary_write_header(rb);
+
+	return 1;
+}
+
+static int
+lua_rowbinary_rows(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_rowbinary *rb = lua_check_rowbinary(L, 1);
+
+	if (rb == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, rb->nrows);
+
+	return 1;
+}
+
+static int
+lua_rowbinary_size(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_rowbinary *rb = lua_check_rowbinary(L, 1);
+
+	if (rb == NULL) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	lua_pushinteger(L, rb->buf->len);
+
+	return 1;
+}
+
+static int
+lua_rowbinary_gc(lua_State *L)
+{
+	struct rspamd_rowbinary *rb = lua_check_rowbinary(L, 1);
+	unsigned int i;
+
+	if (rb) {
+		for (i = 0; i < rb->ncols; i++) {
+			rspamd_rowbinary_type_free(rb->types[i]);
+		}
+
+		g_free(rb->types);
+		g_ptr_array_free(rb->names, TRUE);
+		g_ptr_array_free(rb->type_names, TRUE);
+		g_byte_array_free(rb->buf, TRUE);
+		g_free(rb);
+	}
+
+	return 0;
+}
+
+static int
+lua_load_rowbinary(lua_State *L)
+{
+	lua_newtable(L);
+	luaL_register(L, NULL, rowbinary_f);
+
+	return 1;
+}
+
+void luaopen_rowbinary(lua_State *L)
+{
+	rspamd_lua_new_class(L, rspamd_rowbinary_classname, rowbinary_m);
+	lua_pop(L, 1);
+
+	rspamd_lua_add_preload(L, "rspamd_rowbinary", lua_load_rowbinary);
+}
@@ -159,6 +159,29 @@ LUA_FUNCTION_DEF(task, insert_result);
  * @param {string} options list of optional options attached to a symbol inserted
  */
 LUA_FUNCTION_DEF(task, insert_result_named);
+/***
+ * @method task:insert_result_bulk(symbol, weight, options[, enforce_symbol])
+ * Insert symbol with many options at once. Symbol can be specified by its
+ * numeric id (as returned by `rspamd_config:register_symbol` or
+ * `rspamd_config:get_symbol_id`), so its name is not copied for each
+ * insertion. Duplicate options are ignored.
+ * @param {string|number} symbol symbol name or id
+ * @param {number} weight initial weight (this weight is multiplied by the metric weight)
+ * @param {table} options array of strings or rspamd_text options
+ * @param {boolean} enforce_symbol if true, then insert symbol even if it is not registered in the metric
+ * @return {number} number of options added or nil if a symbol has not been inserted
+@example
+local sym_id = rspamd_config:register_symbol{
+  name = 'SOME_URLS',
+  callback = function(task)
+    local urls = task:get_urls()
+    if #urls > 0 then
+      task:insert_result_bulk(sym_id, 1.0, fun.totable(fun.map(tostring, urls)))
+    end
+  end
+}
+ */
+LUA_FUNCTION_DEF(task, insert_result_bulk);
 
 /***
  * @method task:adjust_result(symbol, score[, option1, ...])
@@ -383,6 +406,16 @@ LUA_FUNCTION_DEF(task, has_header);
  * @return {string} raw value of a header
  */
 LUA_FUNCTION_DEF(task, get_header_raw);
+/***
+ * @method task:get_header_text(name[, case_sensitive[, need_modified]])
+ * Get decoded value of a header as a text view bound to the task lifetime,
+ * so no Lua string is created. Use `text:str()` when a string is really needed.
+ * @param {string} name name of header to get
+ * @param {boolean} case_sensitive case sensitiveness flag to search for a header
+ * @param {boolean} need_modified return a modified value of a header if presented
+ * @return {rspamd_text} decoded value of a header
+ */
+LUA_FUNCTION_DEF(task, get_header_text);
 /***
  * @method task:get_header_full(name[, case_sensitive[, need_modified]])
  * Get raw value of a header specified with optional case_sensitive flag.
@@ -802,6 +835,14 @@ LUA_FUNCTION_DEF(task, enable_symbol);
  * @return {boolean} `true` if symbol has been found
  */
 LUA_FUNCTION_DEF(task, disable_symbol);
+/***
+ * @method task:is_symbol_enabled(name)
+ * Checks if the specified symbol is going to be processed for this particular task:
+ * it has not been checked yet, is not disabled by settings and its conditions are true
+ * @param {string} name symbol's name
+ * @return {boolean} `true` if symbol is enabled
+ */
+LUA_FUNCTION_DEF(task, is_symbol_enabled);
 /***
  * @method task:get_date(type[, gmt])
  * Returns timestamp for a connection or for a MIME message. This function can be called with a
@@ -1054,6 +1095,7 @@ LUA_FUNCTION_DEF(task, set_flag);
  * - `learn_spam`: learn message as spam
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
+ * - `memory_pressure`: worker is short of memory, so optional checks should be skipped
  * @param {string} flag to check
  * @return {boolean} true if flags is set
  */
@@ -1073,6 +1115,8 @@ LUA_FUNCTION_DEF(task, has_flag);
  * - `learn_ham`: learn message as ham
  * - `broken_headers`: header data is broken for a message
  * - `milter`: task is initiated by milter connection
+ * - `body_pending`: message body is still being received (streaming scan mode)
+ * - `memory_pressure`: worker is short of memory, so optional checks should be skipped
  * @return {array of strings} table with all flags as strings
  */
 LUA_FUNCTION_DEF(task, get_flags);
@@ -1133,6 +1177,7 @@ LUA_FUNCTION_DEF(task, get_protocol_reply);
  * Params could be as following:
  *
  * - `full`: header value is full table of all attributes @see task:get_header_full for details
+ * - `text`: header value is a decoded value as rspamd_text view (no copy)
  * - `regexp`: return headers that satisfies the specified regexp
  * @param {function} callback function from header name and header value
  * @param {table} params optional parameters
@@ -1241,6 +1286,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF(task, get_worker),
 	LUA_INTERFACE_DEF(task, insert_result),
 	LUA_INTERFACE_DEF(task, insert_result_named),
+	LUA_INTERFACE_DEF(task, insert_result_bulk),
 	LUA_INTERFACE_DEF(task, adjust_result),
 	LUA_INTERFACE_DEF(task, remove_result),
 	LUA_INTERFACE_DEF(task, set_pre_result),
@@ -1261,6 +1307,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF(task, get_header),
 	LUA_INTERFACE_DEF(task, has_header),
 	LUA_INTERFACE_DEF(task, get_header_raw),
+	LUA_INTERFACE_DEF(task, get_header_text),
 	LUA_INTERFACE_DEF(task, get_header_full),
 	LUA_INTERFACE_DEF(task, get_header_count),
 	LUA_INTERFACE_DEF(task, get_raw_headers),
@@ -1308,6 +1355,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF(task, has_symbol),
 	LUA_INTERFACE_DEF(task, enable_symbol),
 	LUA_INTERFACE_DEF(task, disable_symbol),
+	LUA_INTERFACE_DEF(task, is_symbol_enabled),
 	LUA_INTERFACE_DEF(task, get_date),
 	LUA_INTERFACE_DEF(task, get_message_id),
 	LUA_INTERFACE_DEF(task, get_timeval),
@@ -2134,6 +2182,105 @@ lua_task_insert_result_named(lua_State *L)
 	return luaL_error(L, "invalid arguments");
 }
 
+static int
+lua_task_insert_result_bulk(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+	const char *symbol_name;
+	double weight;
+	struct rspamd_symbol_result *s;
+	enum rspamd_symbol_insert_flags flags = RSPAMD_SYMBOL_INSERT_DEFAULT;
+	rspamd_ftok_t *opts;
+	unsigned int nopts, nadded;
+
+	if (task == NULL || !lua_istable(L, 4)) {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		/* Name is owned by the symbols cache, so no need to copy it */
+		symbol_name = rspamd_symcache_symbol_by_id(task->cfg->cache,
+												   lua_tointeger(L, 2));
+
+		if (symbol_name == NULL) {
+			return luaL_error(L, "invalid symbol id: %d", (int) lua_tointeger(L, 2));
+		}
+	}
+	else {
+		symbol_name = rspamd_mempool_strdup(task->task_pool,
+											luaL_checkstring(L, 2));
+	}
+
+	weight = luaL_checknumber(L, 3);
+
+	if (lua_toboolean(L, 5)) {
+		flags |= RSPAMD_SYMBOL_INSERT_ENFORCE;
+	}
+
+	s = rspamd_task_insert_result_full(task, symbol_name, weight,
+									   NULL, flags, NULL);
+
+	if (s == NULL) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	if (s->sym == NULL) {
+		lua_pushfstring(L, "unknown symbol %s", symbol_name);
+		rspamd_lua_traceback(L);
+
+		msg_info_task("symbol insertion issue: %s", lua_tostring(L, -1));
+
+		lua_pop(L, 2); /* Traceback string + error string */
+	}
+
+	nopts = rspamd_lua_table_size(L, 4);
+
+	if (nopts == 0) {
+		lua_pushinteger(L, 0);
+
+		return 1;
+	}
+
+	opts = rspamd_mempool_alloc(task->task_pool, sizeof(*opts) * nopts);
+
+	for (unsigned int i = 0; i < nopts; i++) {
+		lua_rawgeti(L, 4, i + 1);
+
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			gsize optlen;
+
+			opts[i].begin = lua_tolstring(L, -1, &optlen);
+			opts[i].len = optlen;
+		}
+		else {
+			struct rspamd_lua_text *t = lua_check_text(L, -1);
+
+			if (t == NULL) {
+				const char *tname = lua_typename(L, lua_type(L, -1));
+				lua_pop(L, 1);
+
+				return luaL_error(L, "not a string option in a table "
+									 "when adding symbol %s: %s type",
+								  s->name, tname);
+			}
+
+			opts[i].begin = t->start;
+			opts[i].len = t->len;
+		}
+
+		/* Strings are still referenced from the options table */
+		lua_pop(L, 1);
+	}
+
+	nadded = rspamd_task_add_result_options(task, s, opts, nopts);
+	lua_pushinteger(L, nadded);
+
+	return 1;
+}
+
 static int
 lua_task_adjust_result(lua_State *L)
 {
@@ -3005,7 +3152,7 @@ int rspamd_lua_push_header(lua_State *L, struct rspamd_mime_header *rh,
 			lua_settable(L, -3);
 		}
 
-		if (rh->decoded) {
+		if (rspamd_mime_header_get_decoded(rh)) {
 			rspamd_lua_table_set(L, "decoded", rh->decoded);
 		}
 
@@ -3029,13 +3176,22 @@ int rspamd_lua_push_header(lua_State *L, struct rspamd_mime_header *rh,
 		}
 		break;
 	case RSPAMD_TASK_HEADER_PUSH_SIMPLE:
-		if (rh->decoded) {
+		if (rspamd_mime_header_get_decoded(rh)) {
 			lua_pushstring(L, rh->decoded);
 		}
 		else {
 			lua_pushnil(L);
 		}
 		break;
+	case RSPAMD_TASK_HEADER_PUSH_TEXT:
+		/* Decoded value is allocated in the task pool */
+		if (rspamd_mime_header_get_decoded(rh)) {
+			lua_new_text(L, rh->decoded, strlen(rh->decoded), FALSE);
+		}
+		else {
+			lua_pushnil(L);
+		}
+		break;
 	case RSPAMD_TASK_HEADER_PUSH_COUNT:
 	default:
 		g_assert_not_reached();
@@ -3177,6 +3333,12 @@ lua_task_get_header_raw(lua_State *L)
 	return lua_task_get_header_common(L, RSPAMD_TASK_HEADER_PUSH_RAW);
 }
 
+static int
+lua_task_get_header_text(lua_State *L)
+{
+	return lua_task_get_header_common(L, RSPAMD_TASK_HEADER_PUSH_TEXT);
+}
+
 static int
 lua_task_get_header_count(lua_State *L)
 {
@@ -4181,13 +4343,15 @@ lua_task_get_reply_sender(lua_State *L)
 
 	if (task) {
 
-		rh = rspamd_message_get_header_array(task, "Reply-To", FALSE);
+		rh = rspamd_message_get_header_array_by_id(task, RSPAMD_MIME_HEADER_REPLY_TO, FALSE);
 
 		if (rh) {
 			GPtrArray *addrs;
 
-			addrs = rspamd_email_address_from_mime(task->task_pool, rh->decoded,
-												   strlen(rh->decoded), NULL, -1);
+			const char *decoded = rspamd_mime_header_get_decoded(rh);
+
+			addrs = rspamd_email_address_from_mime(task->task_pool, decoded,
+												   strlen(decoded), NULL, -1);
 
 			if (addrs == NULL || addrs->len == 0) {
 				lua_pushnil(L);
@@ -4878,6 +5042,26 @@ lua_task_disable_symbol(lua_State *L)
 	return 1;
 }
 
+static int
+lua_task_is_symbol_enabled(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task(L, 1);
+	const char *symbol;
+
+	symbol = luaL_checkstring(L, 2);
+
+	if (task && symbol) {
+		lua_pushboolean(L, rspamd_symcache_is_symbol_enabled(task, task->cfg->cache,
+															 symbol));
+	}
+	else {
+		return luaL_error(L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static int
 lua_task_get_symbols(lua_State *L)
 {
@@ -5297,14 +5481,16 @@ lua_task_get_date(lua_State *L)
 			}
 		}
 		else {
-			h = rspamd_message_get_header_array(task, "Date", FALSE);
+			h = rspamd_message_get_header_array_by_id(task, RSPAMD_MIME_HEADER_DATE, FALSE);
 
 			if (h) {
 				time_t tt;
 				struct tm t;
 				GError *err = NULL;
 
-				tt = rspamd_parse_smtp_date(h->decoded, strlen(h->decoded),
+				const char *decoded = rspamd_mime_header_get_decoded(h);
+
+				tt = rspamd_parse_smtp_date(decoded, strlen(decoded),
 											&err);
 
 				if (err == NULL) {
@@ -5543,6 +5729,8 @@ lua_task_has_flag(lua_State *L)
 						  RSPAMD_TASK_FLAG_MIME);
 		LUA_TASK_GET_FLAG(flag, "message_rewrite",
 						  RSPAMD_TASK_FLAG_MESSAGE_REWRITE);
+		LUA_TASK_GET_FLAG(flag, "memory_pressure",
+						  RSPAMD_TASK_FLAG_MEMORY_PRESSURE);
 		LUA_TASK_GET_PROTOCOL_FLAG(flag, "milter",
 								   RSPAMD_TASK_PROTOCOL_FLAG_MILTER);
 
@@ -5616,6 +5804,14 @@ lua_task_get_flags(lua_State *L)
 					lua_pushstring(L, "message_rewrite");
 					lua_rawseti(L, -2, idx++);
 					break;
+				case RSPAMD_TASK_FLAG_BODY_PENDING:
+					lua_pushstring(L, "body_pending");
+					lua_rawseti(L, -2, idx++);
+					break;
+				case RSPAMD_TASK_FLAG_MEMORY_PRESSURE:
+					lua_pushstring(L, "memory_pressure");
+					lua_rawseti(L, -2, idx++);
+					break;
 				default:
 					break;
 				}
@@ -6767,6 +6963,15 @@ lua_task_headers_foreach(lua_State *L)
 
 				lua_pop(L, 1);
 
+				lua_pushstring(L, "text");
+				lua_gettable(L, 3);
+
+				if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
+					how = RSPAMD_TASK_HEADER_PUSH_TEXT;
+				}
+
+				lua_pop(L, 1);
+
 				lua_pushstring(L, "regexp");
 				lua_gettable(L, 3);
 
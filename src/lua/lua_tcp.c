@@ -16,6 +16,7 @@
 #include "lua_common.h"
 #include "lua_thread_pool.h"
 #include "libserver/ssl_util.h"
+#include "libserver/io_replay.h"
 #include "utlist.h"
 #include "unix-std.h"
 #include <math.h>
@@ -303,6 +304,7 @@ struct lua_tcp_dtor {
 #define LUA_TCP_FLAG_RESOLVED (1u << 6u)
 #define LUA_TCP_FLAG_SSL (1u << 7u)
 #define LUA_TCP_FLAG_SSL_NOVERIFY (1u << 8u)
+#define LUA_TCP_FLAG_REPLAYED (1u << 9u)
 
 #undef TCP_DEBUG_REFS
 #ifdef TCP_DEBUG_REFS
@@ -345,6 +347,15 @@ struct lua_tcp_cbdata {
 	char *hostname;
 	struct upstream *up;
 	gboolean eof;
+	/* Record/replay of replies, key is set only if it is configured */
+	struct rspamd_io_replay *replay;
+	char *replay_key;
+	/* Data read from the peer when recording or recorded data when replaying */
+	GByteArray *replay_data;
+	gsize replay_pos;
+	double replay_latency;
+	ev_tstamp start;
+	ev_timer replay_ev;
 };
 
 #define IS_SYNC(c) (((c)->flags & LUA_TCP_FLAG_SYNC) != 0)
@@ -360,6 +371,7 @@ static void lua_tcp_handler(int fd, short what, gpointer ud);
 static void lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd,
 									   gboolean can_read, gboolean can_write);
 static void lua_tcp_unregister_event(struct lua_tcp_cbdata *cbd);
+static void lua_tcp_record_reply(struct lua_tcp_cbdata *cbd);
 
 static void
 lua_tcp_void_finalyser(gpointer arg)
@@ -444,6 +456,21 @@ lua_tcp_fin(gpointer arg)
 
 	msg_debug_tcp("finishing TCP %s connection", IS_SYNC(cbd) ? "sync" : "async");
 
+	if (cbd->flags & LUA_TCP_FLAG_REPLAYED) {
+		/* Session is terminated before the replayed reply is processed */
+		ev_timer_stop(cbd->event_loop, &cbd->replay_ev);
+	}
+	else if (cbd->replay_data &&
+			 (cbd->replay_data->len > 0 || (cbd->flags & LUA_TCP_FLAG_CONNECTED))) {
+		lua_tcp_record_reply(cbd);
+	}
+
+	if (cbd->replay_data) {
+		g_byte_array_unref(cbd->replay_data);
+	}
+
+	g_free(cbd->replay_key);
+
 	if (cbd->connect_cb != -1) {
 		luaL_unref(cbd->cfg->lua_state, LUA_REGISTRYINDEX, cbd->connect_cb);
 	}
@@ -773,10 +800,30 @@ lua_tcp_resume_thread(struct lua_tcp_cbdata *cbd, const uint8_t *str, gsize len)
 	TCP_RELEASE(cbd);
 }
 
+/*
+ * Waits for the connection to become ready, replayed connection has no socket
+ * so its handlers are called by a timer
+ */
+static void
+lua_tcp_plan_io(struct lua_tcp_cbdata *cbd, short what)
+{
+	if (cbd->flags & LUA_TCP_FLAG_REPLAYED) {
+		if (!ev_is_active(&cbd->replay_ev)) {
+			/* Recorded latency is applied once */
+			ev_timer_set(&cbd->replay_ev, cbd->replay_latency, 0.0);
+			cbd->replay_latency = 0;
+			ev_timer_start(cbd->event_loop, &cbd->replay_ev);
+		}
+	}
+	else {
+		rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, what);
+	}
+}
+
 static void
 lua_tcp_plan_read(struct lua_tcp_cbdata *cbd)
 {
-	rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev, EV_READ);
+	lua_tcp_plan_io(cbd, EV_READ);
 }
 
 static void
@@ -1017,6 +1064,14 @@ lua_tcp_process_read(struct lua_tcp_cbdata *cbd,
 	rh = &hdl->h.r;
 
 	if (r > 0) {
+		if (cbd->replay_data && !(cbd->flags & LUA_TCP_FLAG_REPLAYED)) {
+			if (cbd->replay_data->len == 0) {
+				cbd->replay_latency = ev_now(cbd->event_loop) - cbd->start;
+			}
+
+			g_byte_array_append(cbd->replay_data, in, r);
+		}
+
 		if (cbd->flags & LUA_TCP_FLAG_PARTIAL) {
 			lua_tcp_push_data(cbd, in, r);
 			/* Plan next event */
@@ -1085,6 +1140,46 @@ lua_tcp_process_read(struct lua_tcp_cbdata *cbd,
 	}
 }
 
+static void
+lua_tcp_connected(struct lua_tcp_cbdata *cbd)
+{
+	struct lua_callback_state cbs;
+	lua_State *L;
+
+	if (cbd->connect_cb != -1) {
+		struct lua_tcp_cbdata **pcbd;
+		int top;
+
+		lua_thread_pool_prepare_callback(cbd->cfg->lua_thread_pool, &cbs);
+		L = cbs.L;
+
+		top = lua_gettop(L);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, cbd->connect_cb);
+		pcbd = lua_newuserdata(L, sizeof(*pcbd));
+		*pcbd = cbd;
+		TCP_RETAIN(cbd);
+		rspamd_lua_setclass(L, rspamd_tcp_classname, -1);
+
+		if (cbd->item) {
+			rspamd_symcache_set_cur_item(cbd->task, cbd->item);
+		}
+
+		if (lua_pcall(L, 1, 0, 0) != 0) {
+			msg_info("callback call failed: %s", lua_tostring(L, -1));
+		}
+
+		lua_settop(L, top);
+		TCP_RELEASE(cbd);
+		lua_thread_pool_restore_callback(&cbs);
+
+		if ((cbd->flags & (LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) ==
+			(LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) {
+			/* A callback has called `close` method, so we need to release a refcount */
+			TCP_RELEASE(cbd);
+		}
+	}
+}
+
 static void
 lua_tcp_handler(int fd, short what, gpointer ud)
 {
@@ -1093,8 +1188,6 @@ lua_tcp_handler(int fd, short what, gpointer ud)
 	gssize r;
 	int so_error = 0;
 	socklen_t so_len = sizeof(so_error);
-	struct lua_callback_state cbs;
-	lua_State *L;
 	enum lua_tcp_handler_type event_type;
 	TCP_RETAIN(cbd);
 
@@ -1132,39 +1225,7 @@ lua_tcp_handler(int fd, short what, gpointer ud)
 			}
 			else {
 				cbd->flags |= LUA_TCP_FLAG_CONNECTED;
-
-				if (cbd->connect_cb != -1) {
-					struct lua_tcp_cbdata **pcbd;
-					int top;
-
-					lua_thread_pool_prepare_callback(cbd->cfg->lua_thread_pool, &cbs);
-					L = cbs.L;
-
-					top = lua_gettop(L);
-					lua_rawgeti(L, LUA_REGISTRYINDEX, cbd->connect_cb);
-					pcbd = lua_newuserdata(L, sizeof(*pcbd));
-					*pcbd = cbd;
-					TCP_RETAIN(cbd);
-					rspamd_lua_setclass(L, rspamd_tcp_classname, -1);
-
-					if (cbd->item) {
-						rspamd_symcache_set_cur_item(cbd->task, cbd->item);
-					}
-
-					if (lua_pcall(L, 1, 0, 0) != 0) {
-						msg_info("callback call failed: %s", lua_tostring(L, -1));
-					}
-
-					lua_settop(L, top);
-					TCP_RELEASE(cbd);
-					lua_thread_pool_restore_callback(&cbs);
-
-					if ((cbd->flags & (LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) ==
-						(LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) {
-						/* A callback has called `close` method, so we need to release a refcount */
-						TCP_RELEASE(cbd);
-					}
-				}
+				lua_tcp_connected(cbd);
 			}
 		}
 
@@ -1193,6 +1254,68 @@ out:
 	TCP_RELEASE(cbd);
 }
 
+/*
+ * Replayed connection: nothing is sent and the recorded reply is read at once,
+ * then the peer closes the connection
+ */
+static void
+lua_tcp_replay_handler(EV_P_ ev_timer *w, int revents)
+{
+	struct lua_tcp_cbdata *cbd = (struct lua_tcp_cbdata *) w->data;
+	struct lua_tcp_handler *hdl;
+	gsize remain;
+
+	hdl = g_queue_peek_head(cbd->handlers);
+
+	if (hdl == NULL) {
+		return;
+	}
+
+	TCP_RETAIN(cbd);
+
+	if (hdl->type == LUA_WANT_READ) {
+		remain = cbd->replay_data->len - cbd->replay_pos;
+		cbd->replay_pos += remain;
+		lua_tcp_process_read(cbd, cbd->replay_data->data + cbd->replay_pos - remain,
+							 remain);
+	}
+	else if (hdl->type == LUA_WANT_WRITE) {
+		if (!(cbd->flags & LUA_TCP_FLAG_CONNECTED)) {
+			cbd->flags |= LUA_TCP_FLAG_CONNECTED;
+			lua_tcp_connected(cbd);
+		}
+
+		hdl->h.w.pos = hdl->h.w.total_bytes;
+		lua_tcp_write_helper(cbd);
+
+		if ((cbd->flags & (LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) ==
+			(LUA_TCP_FLAG_FINISHED | LUA_TCP_FLAG_CONNECTED)) {
+			/* A callback has called `close` method, so we need to release a refcount */
+			TCP_RELEASE(cbd);
+		}
+	}
+
+	TCP_RELEASE(cbd);
+}
+
+static void
+lua_tcp_record_reply(struct lua_tcp_cbdata *cbd)
+{
+	ucl_object_t *reply;
+
+	if (!rspamd_io_replay_is_recording(cbd->replay)) {
+		return;
+	}
+
+	reply = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(reply,
+						  rspamd_io_replay_data_to_ucl(cbd->replay_data->data,
+													   cbd->replay_data->len),
+						  "data", 0, false);
+	rspamd_io_replay_record(cbd->replay, "tcp", cbd->replay_key, reply,
+							cbd->replay_latency);
+}
+
 static void
 lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd, gboolean can_read,
 						   gboolean can_write)
@@ -1226,8 +1349,7 @@ lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd, gboolean can_read,
 				if (can_read) {
 					/* We need to plan a new event */
 					msg_debug_tcp("plan new read");
-					rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev,
-												 EV_READ);
+					lua_tcp_plan_io(cbd, EV_READ);
 				}
 				else {
 					/* Cannot read more */
@@ -1249,8 +1371,7 @@ lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd, gboolean can_read,
 			if (hdl->h.w.pos < hdl->h.w.total_bytes) {
 				msg_debug_tcp("plan new write");
 				if (can_write) {
-					rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev,
-												 EV_WRITE);
+					lua_tcp_plan_io(cbd, EV_WRITE);
 				}
 				else {
 					/* Cannot write more */
@@ -1268,8 +1389,7 @@ lua_tcp_plan_handler_event(struct lua_tcp_cbdata *cbd, gboolean can_read,
 		}
 		else { /* LUA_WANT_CONNECT */
 			msg_debug_tcp("plan new connect");
-			rspamd_ev_watcher_reschedule(cbd->event_loop, &cbd->ev,
-										 EV_WRITE);
+			lua_tcp_plan_io(cbd, EV_WRITE);
 		}
 	}
 }
@@ -1304,6 +1424,42 @@ lua_tcp_register_watcher(struct lua_tcp_cbdata *cbd)
 	}
 }
 
+/*
+ * Serves the request with a recorded reply if there is one
+ */
+static gboolean
+lua_tcp_maybe_replay(struct lua_tcp_cbdata *cbd)
+{
+	const ucl_object_t *reply;
+	unsigned char *data;
+	gsize len = 0;
+
+	reply = rspamd_io_replay_lookup(cbd->replay, "tcp", cbd->replay_key,
+									&cbd->replay_latency);
+
+	if (reply == NULL) {
+		if (rspamd_io_replay_is_recording(cbd->replay)) {
+			cbd->replay_data = g_byte_array_new();
+		}
+
+		return FALSE;
+	}
+
+	data = rspamd_io_replay_data_from_ucl(ucl_object_lookup(reply, "data"), &len);
+	cbd->replay_data = data ? g_byte_array_new_take(data, len) : g_byte_array_new();
+	cbd->flags |= LUA_TCP_FLAG_REPLAYED;
+	/* There is no socket to shut down */
+	cbd->flags &= ~LUA_TCP_FLAG_SHUTDOWN;
+	ev_timer_init(&cbd->replay_ev, lua_tcp_replay_handler, 0.0, 0.0);
+	cbd->replay_ev.data = cbd;
+
+	lua_tcp_register_watcher(cbd);
+	lua_tcp_register_event(cbd);
+	lua_tcp_plan_handler_event(cbd, TRUE, TRUE);
+
+	return TRUE;
+}
+
 static void
 lua_tcp_ssl_on_error(gpointer ud, GError *err)
 {
@@ -1786,6 +1942,19 @@ lua_tcp_request(lua_State *L)
 							 "{resolver,task,config} should be set");
 	}
 
+	if (task) {
+		timeout = rspamd_task_adjust_timeout(task, timeout);
+
+		if (timeout <= 0) {
+			msg_info_task("do not connect to %s: task has no time left", host);
+			lua_pushboolean(L, FALSE);
+			g_free(cbd);
+			g_free(iov);
+
+			return 1;
+		}
+	}
+
 	cbd->task = task;
 
 	if (task) {
@@ -1882,6 +2051,35 @@ lua_tcp_request(lua_State *L)
 		}
 	}
 
+	cbd->start = ev_now(event_loop);
+	cbd->replay = rspamd_io_replay_get(cfg);
+
+	if (cbd->replay) {
+		rspamd_cryptobox_fast_hash_state_t st;
+		char *prefix;
+		unsigned int i;
+
+		/* Request is identified by peer and the data sent at once */
+		rspamd_cryptobox_fast_hash_init_specific(&st, RSPAMD_CRYPTOBOX_XXHASH64, 0);
+		rspamd_cryptobox_fast_hash_update(&st, host, strlen(host));
+		rspamd_cryptobox_fast_hash_update(&st, &port, sizeof(port));
+
+		for (i = 0; i < niov && total_out > 0; i++) {
+			rspamd_cryptobox_fast_hash_update(&st, iov[i].iov_base, iov[i].iov_len);
+		}
+
+		prefix = g_strdup_printf("%s:%u", host, port);
+		cbd->replay_key = rspamd_io_replay_key(prefix,
+											   rspamd_cryptobox_fast_hash_final(&st));
+		g_free(prefix);
+
+		if (lua_tcp_maybe_replay(cbd)) {
+			lua_pushboolean(L, TRUE);
+
+			return 1;
+		}
+	}
+
 	if (cbd->up) {
 		/* Use upstream to get addr */
 		cbd->addr = rspamd_inet_address_copy(rspamd_upstream_addr_next(cbd->up), NULL);
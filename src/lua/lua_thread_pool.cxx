@@ -37,19 +37,81 @@ static void thread_entry_free(lua_State *L, struct thread_entry *ent);
 struct lua_thread_pool {
 	std::vector<struct thread_entry *> available_items;
 	lua_State *L;
+	/* Number of idle threads kept, adapted to the observed demand */
 	int max_items;
 	struct thread_entry *running_entry;
+	struct lua_thread_pool_stat stat;
+	/* Peak of threads in use during the current adaptation window */
+	unsigned int window_peak;
+	unsigned int window_gets;
 	static const int default_max_items = 100;
+	/* Upper bound for the adaptive size */
+	static const int max_items_limit = 4096;
+	/* Number of threads acquired before the size could shrink */
+	static const unsigned int adapt_window = 1024;
 
 	lua_thread_pool(lua_State *L, int max_items = default_max_items)
 		: L(L), max_items(max_items)
 	{
 		running_entry = nullptr;
+		memset(&stat, 0, sizeof(stat));
+		window_peak = 0;
+		window_gets = 0;
 		available_items.reserve(max_items);
 
 		for (auto i = 0; i < MAX(2, max_items / 10); i++) {
 			auto *ent = thread_entry_new(L);
 			available_items.push_back(ent);
+			stat.created++;
+		}
+	}
+
+	/*
+	 * Grows the pool as soon as more threads are used at the same time and
+	 * shrinks it back when a whole window has passed with lower demand, so
+	 * bursts of async rules do not create and collect threads repeatedly
+	 */
+	auto adapt_size() -> void
+	{
+		if (stat.in_flight > window_peak) {
+			window_peak = stat.in_flight;
+		}
+
+		if (stat.in_flight > stat.peak_in_flight) {
+			stat.peak_in_flight = stat.in_flight;
+		}
+
+		if ((int) stat.in_flight > max_items) {
+			max_items = MIN((int) stat.in_flight, max_items_limit);
+		}
+
+		if (++window_gets >= adapt_window) {
+			auto nsize = MAX((int) window_peak, default_max_items);
+
+			if (nsize < max_items) {
+				msg_debug_lua_threads("shrink threads pool from %d to %d items",
+									  max_items, nsize);
+				max_items = nsize;
+			}
+
+			window_gets = 0;
+			window_peak = stat.in_flight;
+		}
+	}
+
+	auto prewarm(unsigned int nthreads) -> void
+	{
+		nthreads = MIN(nthreads, (unsigned int) max_items_limit);
+
+		if ((int) nthreads > max_items) {
+			max_items = nthreads;
+		}
+
+		available_items.reserve(nthreads);
+
+		while (available_items.size() < nthreads) {
+			available_items.push_back(thread_entry_new(L));
+			stat.created++;
 		}
 	}
 
@@ -67,12 +129,16 @@ struct lua_thread_pool {
 		if (!available_items.empty()) {
 			ent = available_items.back();
 			available_items.pop_back();
+			stat.reused++;
 		}
 		else {
 			ent = thread_entry_new(L);
+			stat.created++;
 		}
 
 		running_entry = ent;
+		stat.in_flight++;
+		adapt_size();
 
 		return ent;
 	}
@@ -86,7 +152,11 @@ struct lua_thread_pool {
 			running_entry = NULL;
 		}
 
-		if (available_items.size() <= max_items) {
+		if (stat.in_flight > 0) {
+			stat.in_flight--;
+		}
+
+		if (available_items.size() < max_items) {
 			thread_entry->cd = NULL;
 			thread_entry->finish_callback = NULL;
 			thread_entry->error_callback = NULL;
@@ -104,6 +174,7 @@ struct lua_thread_pool {
 								  loc,
 								  available_items.size());
 			thread_entry_free(L, thread_entry);
+			stat.freed++;
 		}
 	}
 
@@ -125,10 +196,16 @@ struct lua_thread_pool {
 
 		msg_debug_lua_threads("%s: terminated thread entry", loc);
 		thread_entry_free(L, thread_entry);
+		stat.freed++;
 
-		if (available_items.size() <= max_items) {
+		if (stat.in_flight > 0) {
+			stat.in_flight--;
+		}
+
+		if (available_items.size() < max_items) {
 			ent = thread_entry_new(L);
 			available_items.push_back(ent);
+			stat.created++;
 		}
 	}
 
@@ -175,6 +252,19 @@ void lua_thread_pool_free(struct lua_thread_pool *pool)
 	delete pool;
 }
 
+void lua_thread_pool_prewarm(struct lua_thread_pool *pool, unsigned int nthreads)
+{
+	pool->prewarm(nthreads);
+}
+
+void lua_thread_pool_get_stat(struct lua_thread_pool *pool,
+							  struct lua_thread_pool_stat *st)
+{
+	*st = pool->stat;
+	st->available = pool->available_items.size();
+	st->max_items = pool->max_items;
+}
+
 
 struct thread_entry *
 lua_thread_pool_get_for_task(struct rspamd_task *task)
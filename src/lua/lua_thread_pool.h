@@ -28,6 +28,16 @@ struct thread_entry {
 	struct rspamd_config *cfg;
 };
 
+struct lua_thread_pool_stat {
+	uint64_t created;             /* threads created */
+	uint64_t reused;              /* threads taken from the pool */
+	uint64_t freed;               /* threads freed instead of returning to the pool */
+	unsigned int in_flight;       /* threads currently in use (running or yielded) */
+	unsigned int peak_in_flight;  /* maximum of threads used at the same time */
+	unsigned int available;       /* idle threads in the pool */
+	unsigned int max_items;       /* current adaptive size of the pool */
+};
+
 struct lua_callback_state {
 	lua_State *L;
 	struct thread_entry *my_thread;
@@ -50,6 +60,22 @@ lua_thread_pool_new(lua_State *L);
  */
 void lua_thread_pool_free(struct lua_thread_pool *pool);
 
+/**
+ * Creates idle threads in advance, e.g. on a worker start, so the first
+ * bursts of async rules do not need to create them
+ * @param pool
+ * @param nthreads number of idle threads to have in the pool
+ */
+void lua_thread_pool_prewarm(struct lua_thread_pool *pool, unsigned int nthreads);
+
+/**
+ * Returns usage statistics of the pool
+ * @param pool
+ * @param st output
+ */
+void lua_thread_pool_get_stat(struct lua_thread_pool *pool,
+							  struct lua_thread_pool_stat *st);
+
 /**
  * Extracts a thread from the list of available ones.
  * It immediately becomes the running one and should be used to run a Lua script/function straight away.
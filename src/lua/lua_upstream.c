@@ -196,8 +196,9 @@ lua_upstream_fail(lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional time spent for a request in seconds, used by latency rotation
  */
 static int
 lua_upstream_ok(lua_State *L)
@@ -206,7 +207,12 @@ lua_upstream_ok(lua_State *L)
 	struct rspamd_lua_upstream *up = lua_check_upstream(L, 1);
 
 	if (up) {
-		rspamd_upstream_ok(up->up);
+		if (lua_type(L, 2) == LUA_TNUMBER) {
+			rspamd_upstream_ok_latency(up->up, lua_tonumber(L, 2));
+		}
+		else {
+			rspamd_upstream_ok(up->up);
+		}
 	}
 
 	return 0;
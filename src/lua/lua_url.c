@@ -288,9 +288,10 @@ lua_url_get_fragment(lua_State *L)
 }
 
 /***
- * @method url:get_text()
+ * @method url:get_text([as_text])
  * Get full content of the url
- * @return {string} url string
+ * @param {boolean} as_text return a text view instead of a string (no copy)
+ * @return {string|rspamd_text} url string
  */
 static int
 lua_url_get_text(lua_State *L)
@@ -299,7 +300,13 @@ lua_url_get_text(lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url(L, 1);
 
 	if (url != NULL) {
-		lua_pushlstring(L, url->url->string, url->url->urllen);
+		if (lua_toboolean(L, 2)) {
+			/* Url string has the same lifetime as the url itself */
+			lua_new_text(L, url->url->string, url->url->urllen, FALSE);
+		}
+		else {
+			lua_pushlstring(L, url->url->string, url->url->urllen);
+		}
 	}
 	else {
 		lua_pushnil(L);
@@ -429,9 +436,10 @@ lua_url_to_http(lua_State *L)
 }
 
 /***
- * @method url:get_raw()
+ * @method url:get_raw([as_text])
  * Get full content of the url as it was parsed (e.g. with urldecode)
- * @return {string} url string
+ * @param {boolean} as_text return a text view instead of a string (no copy)
+ * @return {string|rspamd_text} url string
  */
 static int
 lua_url_get_raw(lua_State *L)
@@ -440,7 +448,12 @@ lua_url_get_raw(lua_State *L)
 	struct rspamd_lua_url *url = lua_check_url(L, 1);
 
 	if (url != NULL) {
-		lua_pushlstring(L, url->url->raw, url->url->rawlen);
+		if (lua_toboolean(L, 2)) {
+			lua_new_text(L, url->url->raw, url->url->rawlen, FALSE);
+		}
+		else {
+			lua_pushlstring(L, url->url->raw, url->url->rawlen);
+		}
 	}
 	else {
 		lua_pushnil(L);
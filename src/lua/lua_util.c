@@ -29,6 +29,7 @@
 
 #include <math.h>
 #include <glob.h>
+#include <pthread.h>
 
 #include "unicode/uspoof.h"
 #include "unicode/uscript.h"
@@ -198,6 +199,16 @@ LUA_FUNCTION_DEF(util, get_tld);
  */
 LUA_FUNCTION_DEF(util, glob);
 
+/***
+ * @function util.read_files(paths)
+ * Reads the specified files using helper threads, so large sets of rules or
+ * lists can be loaded at once during configuration
+ *
+ * @param {table} paths list of files
+ * @return {table,table} list of rspamd_text objects (or false) in the order of paths and a table of errors indexed in the same way
+ */
+LUA_FUNCTION_DEF(util, read_files);
+
 /***
  * @function util.parse_mail_address(str, [pool])
  * Parses email address and returns a table of tables in the following format:
@@ -690,6 +701,7 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF(util, humanize_number),
 	LUA_INTERFACE_DEF(util, get_tld),
 	LUA_INTERFACE_DEF(util, glob),
+	LUA_INTERFACE_DEF(util, read_files),
 	{"parse_addr", lua_util_parse_mail_address},
 	LUA_INTERFACE_DEF(util, parse_mail_address),
 	LUA_INTERFACE_DEF(util, strlen_utf8),
@@ -1533,6 +1545,168 @@ lua_util_glob(lua_State *L)
 	return 1;
 }
 
+/* Files are read by at most this number of threads */
+#define LUA_UTIL_READ_FILES_THREADS 8
+
+struct lua_util_read_file {
+	const char *path;
+	char *data;
+	gsize len;
+	int err;
+};
+
+struct lua_util_read_files_ctx {
+	struct lua_util_read_file *files;
+	unsigned int nfiles;
+	unsigned int next;
+};
+
+static void
+lua_util_read_one_file(struct lua_util_read_file *f)
+{
+	struct stat st;
+	gsize cap, off = 0;
+	ssize_t r;
+	int fd;
+
+	fd = open(f->path, O_RDONLY);
+
+	if (fd == -1) {
+		f->err = errno;
+		return;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		f->err = errno;
+		close(fd);
+		return;
+	}
+
+	/* Size is only a hint, files can grow whilst we are reading them */
+	cap = st.st_size > 0 ? st.st_size : BUFSIZ;
+	f->data = g_malloc(cap);
+
+	for (;;) {
+		if (off == cap) {
+			cap *= 2;
+			f->data = g_realloc(f->data, cap);
+		}
+
+		r = read(fd, f->data + off, cap - off);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			f->err = errno;
+			g_free(f->data);
+			f->data = NULL;
+			break;
+		}
+		else if (r == 0) {
+			break;
+		}
+
+		off += r;
+	}
+
+	f->len = off;
+	close(fd);
+}
+
+static void *
+lua_util_read_files_thread(void *ud)
+{
+	struct lua_util_read_files_ctx *ctx = (struct lua_util_read_files_ctx *) ud;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->nfiles) {
+		lua_util_read_one_file(&ctx->files[i]);
+	}
+
+	return NULL;
+}
+
+static int
+lua_util_read_files(lua_State *L)
+{
+	LUA_TRACE_POINT;
+	struct lua_util_read_files_ctx ctx;
+	pthread_t thrs[LUA_UTIL_READ_FILES_THREADS];
+	unsigned int i, nthrs, nstarted = 0;
+	sigset_t all, old;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.nfiles = rspamd_lua_table_size(L, 1);
+	ctx.files = g_new0(struct lua_util_read_file, ctx.nfiles + 1);
+
+	for (i = 0; i < ctx.nfiles; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		ctx.files[i].path = lua_tostring(L, -1);
+		lua_pop(L, 1);
+
+		if (ctx.files[i].path == NULL) {
+			g_free(ctx.files);
+
+			return luaL_error(L, "invalid path at position %d", (int) (i + 1));
+		}
+	}
+
+	nthrs = MIN(ctx.nfiles, LUA_UTIL_READ_FILES_THREADS);
+
+	if (nthrs > 1) {
+		/* Signals must be delivered to the main thread only */
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+
+		for (i = 0; i < nthrs; i++) {
+			if (pthread_create(&thrs[i], NULL, lua_util_read_files_thread, &ctx) != 0) {
+				break;
+			}
+
+			nstarted++;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	/* Help the threads or read everything if none could be started */
+	lua_util_read_files_thread(&ctx);
+
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(thrs[i], NULL);
+	}
+
+	lua_createtable(L, ctx.nfiles, 0);
+	lua_createtable(L, 0, 0);
+
+	for (i = 0; i < ctx.nfiles; i++) {
+		struct lua_util_read_file *f = &ctx.files[i];
+
+		if (f->data) {
+			struct rspamd_lua_text *t;
+
+			t = lua_new_text(L, NULL, 0, FALSE);
+			t->start = f->data;
+			t->len = f->len;
+			t->flags = RSPAMD_TEXT_FLAG_OWN;
+			lua_rawseti(L, -3, i + 1);
+		}
+		else {
+			lua_pushboolean(L, false);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushstring(L, strerror(f->err));
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+
+	g_free(ctx.files);
+
+	return 2;
+}
+
 static int
 lua_util_parse_mail_address(lua_State *L)
 {
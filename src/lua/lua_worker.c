@@ -82,7 +82,7 @@ lua_worker_get_stat(lua_State *L)
 
 		memset(&mem_st, 0, sizeof(mem_st));
 		rspamd_mempool_stat(&mem_st);
-		memcpy(&stat_copy, w->srv->stat, sizeof(stat_copy));
+		rspamd_main_stat_snapshot(w->srv, &stat_copy);
 		stat = &stat_copy;
 		top = ucl_object_typed_new(UCL_OBJECT);
 		ucl_object_insert_key(top, ucl_object_fromint(stat->messages_scanned), "scanned", 0, false);
@@ -139,6 +139,9 @@ lua_worker_get_stat(lua_State *L)
 							  ucl_object_fromint(
 								  mem_st.oversized_chunks),
 							  "chunks_oversized", 0, false);
+		ucl_object_insert_key(top,
+							  ucl_object_fromint(mem_st.hugepage_bytes),
+							  "hugepage_bytes", 0, false);
 
 		ucl_object_push_lua(L, top, true);
 		ucl_object_unref(top);
@@ -305,6 +308,11 @@ lua_worker_control_handler(struct rspamd_main *rspamd_main,
 	cbd->session = session;
 	cbd->fd = fd;
 
+	/* Attached descriptors (e.g. hyperscan bundle) are not passed to Lua */
+	if (attached_fd != -1) {
+		close(attached_fd);
+	}
+
 	lua_pushcfunction(L, &rspamd_lua_traceback);
 	err_idx = lua_gettop(L);
 	lua_rawgeti(L, LUA_REGISTRYINDEX, cbd->cbref);
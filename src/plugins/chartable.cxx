@@ -33,6 +33,8 @@
 #include "unicode/uchar.h"
 #include "contrib/ankerl/unordered_dense.h"
 
+#include <array>
+
 #define DEFAULT_SYMBOL "R_MIXED_CHARSET"
 #define DEFAULT_URL_SYMBOL "R_MIXED_CHARSET_URL"
 #define DEFAULT_THRESHOLD 0.1
@@ -84,6 +86,8 @@ static void chartable_url_symbol_callback(struct rspamd_task *task,
 										  struct rspamd_symcache_dynamic_item *item,
 										  void *unused);
 
+static void rspamd_chartable_classes_init();
+
 int chartable_module_init(struct rspamd_config *cfg, struct module_ctx **ctx)
 {
 	struct chartable_ctx *chartable_module_ctx;
@@ -155,6 +159,8 @@ int chartable_module_config(struct rspamd_config *cfg, bool _)
 							   SYMBOL_TYPE_NORMAL,
 							   -1);
 
+	/* Build classes table in the main process, so workers share it */
+	rspamd_chartable_classes_init();
 	msg_info_config("init internal chartable module");
 
 	return res;
@@ -1694,6 +1700,120 @@ rspamd_can_alias_latin(int ch)
 	return latin_confusable.contains(ch);
 }
 
+/* Properties of a codepoint used to classify words */
+enum rspamd_chartable_class : std::uint8_t {
+	CHARTABLE_CLASS_ALPHA = 1u << 0u,
+	CHARTABLE_CLASS_DIGIT = 1u << 1u,
+	CHARTABLE_CLASS_UPPER = 1u << 2u,
+	/* Latin, IPA, diacritic and space modifiers characters */
+	CHARTABLE_CLASS_LATIN = 1u << 3u,
+	/* Diacritic */
+	CHARTABLE_CLASS_SPECIAL = 1u << 4u,
+	CHARTABLE_CLASS_CONFUSABLE = 1u << 5u,
+};
+
+static unsigned int
+rspamd_chartable_class_icu(UChar32 uc)
+{
+	auto sc = ublock_getCode(uc);
+	auto cat = u_charType(uc);
+	unsigned int cls = 0;
+
+	if (cat == U_NON_SPACING_MARK ||
+		(sc == UBLOCK_LATIN_1_SUPPLEMENT) ||
+		(sc == UBLOCK_LATIN_EXTENDED_A) ||
+		(sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) ||
+		(sc == UBLOCK_LATIN_EXTENDED_B) ||
+		(sc == UBLOCK_COMBINING_DIACRITICAL_MARKS)) {
+		cls |= CHARTABLE_CLASS_SPECIAL;
+	}
+
+	if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
+		sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
+		cls |= CHARTABLE_CLASS_LATIN;
+	}
+
+	if (u_isalpha(uc)) {
+		cls |= CHARTABLE_CLASS_ALPHA;
+	}
+	else if (u_isdigit(uc)) {
+		cls |= CHARTABLE_CLASS_DIGIT;
+	}
+
+	if (u_isupper(uc)) {
+		cls |= CHARTABLE_CLASS_UPPER;
+	}
+
+	if (rspamd_can_alias_latin(uc)) {
+		cls |= CHARTABLE_CLASS_CONFUSABLE;
+	}
+
+	return cls;
+}
+
+/* Classes of BMP codepoints, so we do not call ICU for each character */
+static const std::array<std::uint8_t, 0x10000> &
+rspamd_chartable_classes()
+{
+	static const auto classes = [] {
+		std::array<std::uint8_t, 0x10000> res{};
+
+		for (UChar32 uc = 0; uc < (UChar32) res.size(); uc++) {
+			res[uc] = rspamd_chartable_class_icu(uc);
+		}
+
+		return res;
+	}();
+
+	return classes;
+}
+
+static void
+rspamd_chartable_classes_init()
+{
+	(void) rspamd_chartable_classes();
+}
+
+static inline unsigned int
+rspamd_chartable_class(UChar32 uc)
+{
+	if (uc < 0x10000) {
+		return rspamd_chartable_classes()[uc];
+	}
+
+	return rspamd_chartable_class_icu(uc);
+}
+
+/*
+ * Pure ASCII words have no script changes and no diacritics, so they have
+ * zero badness; the loops are simple enough to be vectorised
+ */
+static inline bool
+rspamd_chartable_utf_word_is_ascii(const UChar32 *p, gsize len)
+{
+	UChar32 acc = 0;
+
+	for (gsize i = 0; i < len; i++) {
+		acc |= p[i];
+	}
+
+	return (acc & ~0x7f) == 0;
+}
+
+static inline bool
+rspamd_chartable_ascii_word_is_clean(const unsigned char *p, gsize len, gboolean is_url)
+{
+	unsigned int high = 0, digits = 0;
+
+	for (gsize i = 0; i < len; i++) {
+		high |= p[i] & 0x80;
+		digits |= (unsigned char) (p[i] - '0') < 10;
+	}
+
+	/* Only digit to alpha transitions are penalised in ASCII words */
+	return high == 0 && (digits == 0 || is_url);
+}
+
 static double
 rspamd_chartable_process_word_utf(struct rspamd_task *task,
 								  rspamd_stat_token_t *w,
@@ -1705,8 +1825,8 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 	const UChar32 *p, *end;
 	double badness = 0.0;
 	UChar32 uc;
-	UBlockCode sc;
-	unsigned int cat;
+	unsigned int cls;
+	bool is_latin;
 	int last_is_latin = -1;
 	unsigned int same_script_count = 0, nsym = 0, nspecial = 0;
 	enum {
@@ -1720,6 +1840,10 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 	p = w->unicode.begin;
 	end = p + w->unicode.len;
 
+	if (rspamd_chartable_utf_word_is_ascii(p, w->unicode.len)) {
+		return 0.0;
+	}
+
 	/* We assume that w is normalized */
 
 	while (p < end) {
@@ -1729,32 +1853,22 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 			break;
 		}
 
-		sc = ublock_getCode(uc);
-		cat = u_charType(uc);
+		cls = rspamd_chartable_class(uc);
 
 		if (!ignore_diacritics) {
-			if (cat == U_NON_SPACING_MARK ||
-				(sc == UBLOCK_LATIN_1_SUPPLEMENT) ||
-				(sc == UBLOCK_LATIN_EXTENDED_A) ||
-				(sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) ||
-				(sc == UBLOCK_LATIN_EXTENDED_B) ||
-				(sc == UBLOCK_COMBINING_DIACRITICAL_MARKS)) {
+			if (cls & CHARTABLE_CLASS_SPECIAL) {
 				nspecial++;
 			}
 		}
 
-		if (u_isalpha(uc)) {
-
-			if (sc <= UBLOCK_COMBINING_DIACRITICAL_MARKS ||
-				sc == UBLOCK_LATIN_EXTENDED_ADDITIONAL) {
-				/*
-				 * Assume all latin, IPA, diacritic and space modifiers
-				 * characters as basic latin
-				 */
-				sc = UBLOCK_BASIC_LATIN;
-			}
+		if (cls & CHARTABLE_CLASS_ALPHA) {
+			/*
+			 * Assume all latin, IPA, diacritic and space modifiers
+			 * characters as basic latin
+			 */
+			is_latin = cls & CHARTABLE_CLASS_LATIN;
 
-			if (sc != UBLOCK_BASIC_LATIN && u_isupper(uc)) {
+			if (!is_latin && (cls & CHARTABLE_CLASS_UPPER)) {
 				if (ncap) {
 					(*ncap)++;
 				}
@@ -1762,7 +1876,7 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 
 			if (state == got_digit) {
 				/* Penalize digit -> alpha translations */
-				if (!is_url && sc != UBLOCK_BASIC_LATIN &&
+				if (!is_url && !is_latin &&
 					prev_state != start_process) {
 					badness += 0.25;
 				}
@@ -1770,9 +1884,9 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 			else if (state == got_alpha) {
 				/* Check script */
 				if (same_script_count > 0) {
-					if (sc != UBLOCK_BASIC_LATIN && last_is_latin) {
+					if (!is_latin && last_is_latin) {
 
-						if (rspamd_can_alias_latin(uc)) {
+						if (cls & CHARTABLE_CLASS_CONFUSABLE) {
 							badness += 1.0 / (double) same_script_count;
 						}
 
@@ -1784,7 +1898,7 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 					}
 				}
 				else {
-					last_is_latin = sc == UBLOCK_BASIC_LATIN;
+					last_is_latin = is_latin;
 					same_script_count = 1;
 				}
 			}
@@ -1792,7 +1906,7 @@ rspamd_chartable_process_word_utf(struct rspamd_task *task,
 			prev_state = state;
 			state = got_alpha;
 		}
-		else if (u_isdigit(uc)) {
+		else if (cls & CHARTABLE_CLASS_DIGIT) {
 			if (state != got_digit) {
 				prev_state = state;
 			}
@@ -1864,7 +1978,8 @@ rspamd_chartable_process_word_ascii(struct rspamd_task *task,
 	const auto *end = p + w->normalized.len;
 	last_sc = non_ascii;
 
-	if (w->normalized.len > chartable_module_ctx->max_word_len) {
+	if (w->normalized.len > chartable_module_ctx->max_word_len ||
+		rspamd_chartable_ascii_word_is_clean(p, w->normalized.len, is_url)) {
 		return 0.0;
 	}
 
@@ -34,6 +34,7 @@
 #include "libmime/message.h"
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
+#include "libutil/shm_cache.h"
 #include "libserver/maps/map.h"
 #include "libserver/maps/map_helpers.h"
 #include "rspamd.h"
@@ -50,6 +51,9 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_TIME_JITTER 60
 #define DEFAULT_MAX_SIGS 5
+#define DEFAULT_SHARED_CACHE_REFRESH 0.1
+/* Key type and base64 encoded key, enough for 8192 bits RSA keys */
+#define SHARED_CACHE_MAX_KEY 1500
 
 static const char *M = "rspamd dkim plugin";
 
@@ -81,6 +85,9 @@ struct dkim_ctx {
 	unsigned int time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
 	rspamd_lru_hash_t *dkim_sign_hash;
+	/* Keys shared between all processes */
+	rspamd_shm_cache_t *shared_hash;
+	double shared_cache_refresh;
 	const char *sign_headers;
 	const char *arc_sign_headers;
 	unsigned int max_sigs;
@@ -97,6 +104,7 @@ struct dkim_check_result {
 	double mult_allow;
 	double mult_deny;
 	struct rspamd_symcache_dynamic_item *item;
+	gboolean verifying; /* signature is being verified in a cpu pool thread */
 	struct dkim_check_result *next, *prev, *first;
 };
 
@@ -138,6 +146,156 @@ dkim_module_key_dtor(gpointer k)
 	rspamd_dkim_key_unref(key);
 }
 
+/*
+ * With the shared cache, local entries expire when a key enters its refresh
+ * window, so one process refreshes it and others pick it from the shared cache
+ */
+static unsigned int
+dkim_module_local_ttl(struct dkim_ctx *dkim_module_ctx,
+					  double inserted, double expire, double now)
+{
+	double left = expire - now;
+
+	if (dkim_module_ctx->shared_hash) {
+		left -= (expire - inserted) * dkim_module_ctx->shared_cache_refresh;
+	}
+
+	return left > 0 ? (unsigned int) left : 0;
+}
+
+/*
+ * Takes ownership of a key with refcount = 1
+ */
+static void
+dkim_module_cache_key(struct rspamd_task *task,
+					  struct dkim_ctx *dkim_module_ctx,
+					  rspamd_dkim_context_t *ctx,
+					  rspamd_dkim_key_t *key,
+					  double inserted, double expire,
+					  gboolean store_shared)
+{
+	/* Zero ttl means that a key never expires in the LRU cache */
+	gboolean persistent = expire <= inserted;
+	unsigned int ttl = 0;
+
+	if (!persistent) {
+		ttl = dkim_module_local_ttl(dkim_module_ctx, inserted, expire,
+									task->task_timestamp);
+	}
+
+	if (store_shared && !persistent && dkim_module_ctx->shared_hash) {
+		unsigned char buf[SHARED_CACHE_MAX_KEY];
+		const char *raw;
+		gsize rawlen;
+
+		raw = rspamd_dkim_key_get_raw(key, &rawlen);
+
+		if (rawlen + 1 <= sizeof(buf)) {
+			buf[0] = rspamd_dkim_key_get_type(key);
+			memcpy(buf + 1, raw, rawlen);
+			rspamd_shm_cache_insert(dkim_module_ctx->shared_hash,
+									rspamd_dkim_get_dns_key(ctx),
+									strlen(rspamd_dkim_get_dns_key(ctx)),
+									buf, rawlen + 1,
+									inserted, expire - inserted);
+		}
+	}
+
+	if (dkim_module_ctx->dkim_hash && (persistent || ttl > 0)) {
+		rspamd_lru_hash_insert(dkim_module_ctx->dkim_hash,
+							   g_strdup(rspamd_dkim_get_dns_key(ctx)),
+							   key, task->task_timestamp, ttl);
+
+		msg_info_task("stored DKIM key for %s in LRU cache for %d seconds, "
+					  "%d/%d elements in the cache",
+					  rspamd_dkim_get_dns_key(ctx),
+					  ttl,
+					  rspamd_lru_hash_size(dkim_module_ctx->dkim_hash),
+					  rspamd_lru_hash_capacity(dkim_module_ctx->dkim_hash));
+	}
+	else {
+		rspamd_mempool_add_destructor(task->task_pool,
+									  dkim_module_key_dtor, key);
+	}
+}
+
+static void
+dkim_module_refresh_key_handler(rspamd_dkim_key_t *key,
+								gsize keylen,
+								rspamd_dkim_context_t *ctx,
+								gpointer ud,
+								GError *err)
+{
+	struct rspamd_task *task = ud;
+	struct dkim_ctx *dkim_module_ctx = dkim_get_context(task->cfg);
+
+	if (key != NULL) {
+		dkim_module_cache_key(task, dkim_module_ctx, ctx, key,
+							  task->task_timestamp,
+							  task->task_timestamp + rspamd_dkim_key_get_ttl(key),
+							  TRUE);
+	}
+	else {
+		msg_info_task("cannot refresh key for domain %s: %e",
+					  rspamd_dkim_get_dns_key(ctx), err);
+	}
+
+	if (err) {
+		g_error_free(err);
+	}
+}
+
+/*
+ * Returns a cached key (owned by caches or by the task pool) or NULL
+ */
+static rspamd_dkim_key_t *
+dkim_module_lookup_key(struct rspamd_task *task,
+					   struct dkim_ctx *dkim_module_ctx,
+					   rspamd_dkim_context_t *ctx)
+{
+	rspamd_dkim_key_t *key = NULL;
+	const char *dns_key = rspamd_dkim_get_dns_key(ctx);
+	unsigned char buf[SHARED_CACHE_MAX_KEY];
+	enum rspamd_shm_cache_result ret;
+	double inserted, expire;
+	gsize len;
+
+	if (dkim_module_ctx->dkim_hash) {
+		key = rspamd_lru_hash_lookup(dkim_module_ctx->dkim_hash,
+									 dns_key,
+									 task->task_timestamp);
+	}
+
+	if (key != NULL || dkim_module_ctx->shared_hash == NULL) {
+		return key;
+	}
+
+	ret = rspamd_shm_cache_lookup(dkim_module_ctx->shared_hash,
+								  dns_key, strlen(dns_key),
+								  task->task_timestamp, buf, &len,
+								  &inserted, &expire);
+
+	if (ret == RSPAMD_SHM_CACHE_MISS || len < 2) {
+		return NULL;
+	}
+
+	key = rspamd_dkim_make_key((const char *) buf + 1, len - 1, buf[0], NULL);
+
+	if (key == NULL) {
+		return NULL;
+	}
+
+	msg_debug_task("got DKIM key for %s from the shared cache", dns_key);
+	dkim_module_cache_key(task, dkim_module_ctx, ctx, key, inserted, expire, FALSE);
+
+	if (ret == RSPAMD_SHM_CACHE_HIT_REFRESH) {
+		msg_info_task("refresh DKIM key for %s before it expires", dns_key);
+		rspamd_get_dkim_key(ctx, task, dkim_module_refresh_key_handler, task);
+	}
+
+	return key;
+}
+
 static void
 dkim_module_free_list(gpointer k)
 {
@@ -228,6 +386,24 @@ int dkim_module_init(struct rspamd_config *cfg, struct module_ctx **ctx)
 							   0,
 							   G_STRINGIFY(DEFAULT_CACHE_SIZE),
 							   0);
+	rspamd_rcl_add_doc_by_path(cfg,
+							   "dkim",
+							   "Size of DKIM keys cache shared between all worker processes (0 to disable)",
+							   "shared_cache_size",
+							   UCL_INT,
+							   NULL,
+							   0,
+							   "0",
+							   0);
+	rspamd_rcl_add_doc_by_path(cfg,
+							   "dkim",
+							   "Fraction of a key TTL when a key in the shared cache is refreshed in background",
+							   "shared_cache_refresh",
+							   UCL_FLOAT,
+							   NULL,
+							   0,
+							   G_STRINGIFY(DEFAULT_SHARED_CACHE_REFRESH),
+							   0);
 	rspamd_rcl_add_doc_by_path(cfg,
 							   "dkim",
 							   "Allow this time difference when checking DKIM signature time validity",
@@ -308,7 +484,7 @@ int dkim_module_config(struct rspamd_config *cfg, bool validate)
 {
 	const ucl_object_t *value;
 	int res = TRUE, cb_id = -1;
-	unsigned int cache_size, sign_cache_size;
+	unsigned int cache_size, sign_cache_size, shared_cache_size = 0;
 	gboolean got_trusted = FALSE;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context(cfg);
 
@@ -416,6 +592,21 @@ int dkim_module_config(struct rspamd_config *cfg, bool validate)
 		sign_cache_size = 128;
 	}
 
+	if ((value =
+			 rspamd_config_get_module_opt(cfg, "dkim",
+										  "shared_cache_size")) != NULL) {
+		shared_cache_size = ucl_object_toint(value);
+	}
+
+	if ((value =
+			 rspamd_config_get_module_opt(cfg, "dkim",
+										  "shared_cache_refresh")) != NULL) {
+		dkim_module_ctx->shared_cache_refresh = ucl_object_todouble(value);
+	}
+	else {
+		dkim_module_ctx->shared_cache_refresh = DEFAULT_SHARED_CACHE_REFRESH;
+	}
+
 	if ((value =
 			 rspamd_config_get_module_opt(cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_object_todouble(value);
@@ -511,6 +702,23 @@ int dkim_module_config(struct rspamd_config *cfg, bool validate)
 									  dkim_module_ctx->dkim_hash);
 	}
 
+	if (shared_cache_size > 0 && cache_size > 0) {
+		/* Module is configured by the main process, so workers share the same memory */
+		dkim_module_ctx->shared_hash = rspamd_shm_cache_new("dkim", shared_cache_size,
+															SHARED_CACHE_MAX_KEY,
+															dkim_module_ctx->shared_cache_refresh);
+
+		if (dkim_module_ctx->shared_hash) {
+			rspamd_mempool_add_destructor(cfg->cfg_pool,
+										  (rspamd_mempool_destruct_t) rspamd_shm_cache_destroy,
+										  dkim_module_ctx->shared_hash);
+		}
+		else {
+			msg_err_config("cannot allocate shared DKIM keys cache: %s",
+						   strerror(errno));
+		}
+	}
+
 	if (sign_cache_size > 0) {
 		dkim_module_ctx->dkim_sign_hash = rspamd_lru_hash_new(
 			sign_cache_size,
@@ -933,11 +1141,48 @@ dkim_module_parse_strict(const char *value, double *allow, double *deny)
 	return FALSE;
 }
 
+static void dkim_module_check(struct dkim_check_result *res);
+
+static void
+dkim_module_check_strict(struct dkim_ctx *dkim_module_ctx,
+						 struct dkim_check_result *cur)
+{
+	const char *strict_value;
+
+	if (dkim_module_ctx->dkim_domains != NULL) {
+		/* Perform strict check */
+		const char *domain = rspamd_dkim_get_domain(cur->ctx);
+
+		if ((strict_value =
+				 rspamd_match_hash_map(dkim_module_ctx->dkim_domains,
+									   domain,
+									   strlen(domain))) != NULL) {
+			if (!dkim_module_parse_strict(strict_value, &cur->mult_allow,
+										  &cur->mult_deny)) {
+				cur->mult_allow = dkim_module_ctx->strict_multiplier;
+				cur->mult_deny = dkim_module_ctx->strict_multiplier;
+			}
+		}
+	}
+}
+
+static void
+dkim_module_verify_done(struct rspamd_dkim_check_result *check_res, gpointer ud)
+{
+	struct dkim_check_result *cur = ud;
+	struct rspamd_task *task = cur->task;
+
+	cur->verifying = FALSE;
+	cur->res = check_res;
+	dkim_module_check_strict(dkim_get_context(task->cfg), cur);
+	dkim_module_check(cur);
+	rspamd_symcache_item_async_dec_check(task, cur->item, M);
+}
+
 static void
 dkim_module_check(struct dkim_check_result *res)
 {
 	gboolean all_done = TRUE;
-	const char *strict_value;
 	struct dkim_check_result *first, *cur = NULL;
 	struct dkim_ctx *dkim_module_ctx = dkim_get_context(res->task->cfg);
 	struct rspamd_task *task = res->task;
@@ -950,24 +1195,18 @@ dkim_module_check(struct dkim_check_result *res)
 			continue;
 		}
 
-		if (cur->key != NULL && cur->res == NULL) {
-			cur->res = rspamd_dkim_check(cur->ctx, cur->key, task);
+		if (cur->key != NULL && cur->res == NULL && !cur->verifying) {
+			cur->res = rspamd_dkim_check_async(cur->ctx, cur->key, task,
+											   dkim_module_verify_done, cur);
 
-			if (dkim_module_ctx->dkim_domains != NULL) {
-				/* Perform strict check */
-				const char *domain = rspamd_dkim_get_domain(cur->ctx);
-
-				if ((strict_value =
-						 rspamd_match_hash_map(dkim_module_ctx->dkim_domains,
-											   domain,
-											   strlen(domain))) != NULL) {
-					if (!dkim_module_parse_strict(strict_value, &cur->mult_allow,
-												  &cur->mult_deny)) {
-						cur->mult_allow = dkim_module_ctx->strict_multiplier;
-						cur->mult_deny = dkim_module_ctx->strict_multiplier;
-					}
-				}
+			if (cur->res == NULL) {
+				/* Result is delivered to dkim_module_verify_done */
+				cur->verifying = TRUE;
+				rspamd_symcache_item_async_inc(task, cur->item, M);
+				continue;
 			}
+
+			dkim_module_check_strict(dkim_module_ctx, cur);
 		}
 	}
 
@@ -1084,18 +1323,10 @@ dkim_module_key_handler(rspamd_dkim_key_t *key,
 		rspamd_mempool_add_destructor(res->task->task_pool,
 									  dkim_module_key_dtor, res->key);
 
-		if (dkim_module_ctx->dkim_hash) {
-			rspamd_lru_hash_insert(dkim_module_ctx->dkim_hash,
-								   g_strdup(rspamd_dkim_get_dns_key(ctx)),
-								   key, res->task->task_timestamp, rspamd_dkim_key_get_ttl(key));
-
-			msg_info_task("stored DKIM key for %s in LRU cache for %d seconds, "
-						  "%d/%d elements in the cache",
-						  rspamd_dkim_get_dns_key(ctx),
-						  rspamd_dkim_key_get_ttl(key),
-						  rspamd_lru_hash_size(dkim_module_ctx->dkim_hash),
-						  rspamd_lru_hash_capacity(dkim_module_ctx->dkim_hash));
-		}
+		dkim_module_cache_key(task, dkim_module_ctx, ctx, key,
+							  task->task_timestamp,
+							  task->task_timestamp + rspamd_dkim_key_get_ttl(key),
+							  TRUE);
 	}
 	else {
 		/* Insert tempfail symbol */
@@ -1171,13 +1402,13 @@ dkim_symbol_callback(struct rspamd_task *task,
 	rspamd_symcache_item_async_inc(task, item, M);
 
 	/* Now check if a message has its signature */
-	rh = rspamd_message_get_header_array(task, RSPAMD_DKIM_SIGNHEADER, FALSE);
+	rh = rspamd_message_get_header_array_by_id(task, RSPAMD_MIME_HEADER_DKIM_SIGNATURE, FALSE);
 	if (rh) {
 		msg_debug_task("dkim signature found");
 
 		DL_FOREACH(rh, rh_cur)
 		{
-			if (rh_cur->decoded == NULL || rh_cur->decoded[0] == '\0') {
+			if (rspamd_mime_header_get_decoded(rh_cur) == NULL || rh_cur->decoded[0] == '\0') {
 				msg_info_task("cannot load empty DKIM signature");
 				continue;
 			}
@@ -1235,14 +1466,7 @@ dkim_symbol_callback(struct rspamd_task *task,
 					continue;
 				}
 
-				if (dkim_module_ctx->dkim_hash) {
-					key = rspamd_lru_hash_lookup(dkim_module_ctx->dkim_hash,
-												 rspamd_dkim_get_dns_key(ctx),
-												 task->task_timestamp);
-				}
-				else {
-					key = NULL;
-				}
+				key = dkim_module_lookup_key(task, dkim_module_ctx, ctx);
 
 				if (key != NULL) {
 					cur->key = rspamd_dkim_key_ref(key);
@@ -1290,6 +1514,7 @@ struct rspamd_dkim_lua_verify_cbdata {
 	struct rspamd_task *task;
 	lua_State *L;
 	rspamd_dkim_key_t *key;
+	struct rspamd_symcache_dynamic_item *item;
 	int cbref;
 };
 
@@ -1409,6 +1634,41 @@ dkim_module_lua_push_verify_result(struct rspamd_dkim_lua_verify_cbdata *cbd,
 	luaL_unref(cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 }
 
+static void
+dkim_module_lua_verify_done(struct rspamd_dkim_check_result *res, gpointer ud)
+{
+	struct rspamd_dkim_lua_verify_cbdata *cbd = ud;
+	struct rspamd_task *task = cbd->task;
+	struct rspamd_symcache_dynamic_item *item = cbd->item;
+
+	dkim_module_lua_push_verify_result(cbd, res, NULL);
+
+	if (item) {
+		rspamd_symcache_item_async_dec_check(task, item, M);
+	}
+}
+
+static void
+dkim_module_lua_check(struct rspamd_dkim_lua_verify_cbdata *cbd)
+{
+	struct rspamd_dkim_check_result *res;
+
+	res = rspamd_dkim_check_async(cbd->ctx, cbd->key, cbd->task,
+								  dkim_module_lua_verify_done, cbd);
+
+	if (res != NULL) {
+		dkim_module_lua_push_verify_result(cbd, res, NULL);
+	}
+	else {
+		/* Keep the calling symbol pending until the signature is verified */
+		cbd->item = rspamd_symcache_get_cur_item(cbd->task);
+
+		if (cbd->item) {
+			rspamd_symcache_item_async_inc(cbd->task, cbd->item, M);
+		}
+	}
+}
+
 static void
 dkim_module_lua_on_key(rspamd_dkim_key_t *key,
 					   gsize keylen,
@@ -1432,11 +1692,10 @@ dkim_module_lua_on_key(rspamd_dkim_key_t *key,
 		 * lru hash owns this object now
 		 */
 
-		if (dkim_module_ctx->dkim_hash) {
-			rspamd_lru_hash_insert(dkim_module_ctx->dkim_hash,
-								   g_strdup(rspamd_dkim_get_dns_key(ctx)),
-								   key, cbd->task->task_timestamp, rspamd_dkim_key_get_ttl(key));
-		}
+		dkim_module_cache_key(task, dkim_module_ctx, ctx, key,
+							  task->task_timestamp,
+							  task->task_timestamp + rspamd_dkim_key_get_ttl(key),
+							  TRUE);
 		/* Release key when task is processed */
 		rspamd_mempool_add_destructor(cbd->task->task_pool,
 									  dkim_module_key_dtor, cbd->key);
@@ -1470,8 +1729,7 @@ dkim_module_lua_on_key(rspamd_dkim_key_t *key,
 		return;
 	}
 
-	res = rspamd_dkim_check(cbd->ctx, cbd->key, cbd->task);
-	dkim_module_lua_push_verify_result(cbd, res, NULL);
+	dkim_module_lua_check(cbd);
 }
 
 static int
@@ -1482,7 +1740,6 @@ lua_dkim_verify_handler(lua_State *L)
 	rspamd_dkim_context_t *ctx;
 	struct rspamd_dkim_lua_verify_cbdata *cbd;
 	rspamd_dkim_key_t *key;
-	struct rspamd_dkim_check_result *ret;
 	GError *err = NULL;
 	const char *type_str = NULL;
 	enum rspamd_dkim_type type = RSPAMD_DKIM_NORMAL;
@@ -1540,23 +1797,16 @@ lua_dkim_verify_handler(lua_State *L)
 		cbd->cbref = luaL_ref(L, LUA_REGISTRYINDEX);
 		cbd->ctx = ctx;
 		cbd->key = NULL;
+		cbd->item = NULL;
 
-		if (dkim_module_ctx->dkim_hash) {
-			key = rspamd_lru_hash_lookup(dkim_module_ctx->dkim_hash,
-										 rspamd_dkim_get_dns_key(ctx),
-										 task->task_timestamp);
-		}
-		else {
-			key = NULL;
-		}
+		key = dkim_module_lookup_key(task, dkim_module_ctx, ctx);
 
 		if (key != NULL) {
 			cbd->key = rspamd_dkim_key_ref(key);
 			/* Release key when task is processed */
 			rspamd_mempool_add_destructor(task->task_pool,
 										  dkim_module_key_dtor, cbd->key);
-			ret = rspamd_dkim_check(cbd->ctx, cbd->key, cbd->task);
-			dkim_module_lua_push_verify_result(cbd, ret, NULL);
+			dkim_module_lua_check(cbd);
 		}
 		else {
 			rspamd_get_dkim_key(ctx,
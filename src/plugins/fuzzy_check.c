@@ -47,6 +47,7 @@
 #include "libstat/stat_api.h"
 #include <math.h>
 #include "libutil/libev_helper.h"
+#include "libutil/hash.h"
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
 
@@ -55,6 +56,7 @@
 #define DEFAULT_MAX_ERRORS 4
 #define DEFAULT_REVIVE_TIME 60
 #define DEFAULT_PORT 11335
+#define DEFAULT_CACHE_SIZE 8192
 
 #define RSPAMD_FUZZY_PLUGIN_VERSION RSPAMD_FUZZY_VERSION
 
@@ -91,6 +93,10 @@ struct fuzzy_rule {
 	int learn_condition_cb;
 	uint32_t retransmits;
 	struct rspamd_hash_map_helper *skip_map;
+	/* Replies cache: digest -> struct rspamd_fuzzy_reply */
+	rspamd_lru_hash_t *cache;
+	unsigned int cache_ttl;
+	unsigned int cache_negative_ttl;
 	struct fuzzy_ctx *ctx;
 	int lua_id;
 };
@@ -349,6 +355,27 @@ fuzzy_free_rule(gpointer r)
 	if (rule->peer_key) {
 		rspamd_pubkey_unref(rule->peer_key);
 	}
+
+	if (rule->cache) {
+		rspamd_lru_hash_destroy(rule->cache);
+	}
+}
+
+static unsigned int
+fuzzy_cache_digest_hash(gconstpointer key)
+{
+	unsigned int ret;
+
+	/* Digests are already uniformly distributed */
+	memcpy(&ret, key, sizeof(ret));
+
+	return ret;
+}
+
+static gboolean
+fuzzy_cache_digest_equal(gconstpointer k1, gconstpointer k2)
+{
+	return memcmp(k1, k2, rspamd_cryptobox_HASHBYTES) == 0;
 }
 
 static int
@@ -445,6 +472,31 @@ fuzzy_parse_rule(struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->io_timeout = fuzzy_module_ctx->io_timeout;
 	}
 
+	if ((value = ucl_object_lookup(obj, "cache_ttl")) != NULL) {
+		rule->cache_ttl = ucl_obj_todouble(value);
+	}
+
+	if ((value = ucl_object_lookup(obj, "cache_negative_ttl")) != NULL) {
+		rule->cache_negative_ttl = ucl_obj_todouble(value);
+	}
+	else {
+		rule->cache_negative_ttl = rule->cache_ttl;
+	}
+
+	if (rule->cache_ttl > 0 || rule->cache_negative_ttl > 0) {
+		int cache_size = DEFAULT_CACHE_SIZE;
+
+		if ((value = ucl_object_lookup(obj, "cache_size")) != NULL) {
+			cache_size = ucl_obj_toint(value);
+		}
+
+		if (cache_size > 0) {
+			rule->cache = rspamd_lru_hash_new_full(cache_size, g_free, g_free,
+												   fuzzy_cache_digest_hash,
+												   fuzzy_cache_digest_equal);
+		}
+	}
+
 	if ((value = ucl_object_lookup(obj, "symbol")) != NULL) {
 		rule->symbol = ucl_obj_tostring(value);
 	}
@@ -888,6 +940,33 @@ int fuzzy_check_module_init(struct rspamd_config *cfg, struct module_ctx **ctx)
 							   0,
 							   NULL,
 							   0);
+	rspamd_rcl_add_doc_by_path(cfg,
+							   "fuzzy_check.rule",
+							   "Cache replies for found hashes in each worker for this time (0 to disable)",
+							   "cache_ttl",
+							   UCL_TIME,
+							   NULL,
+							   0,
+							   NULL,
+							   0);
+	rspamd_rcl_add_doc_by_path(cfg,
+							   "fuzzy_check.rule",
+							   "Cache replies for unknown hashes for this time (same as cache_ttl by default)",
+							   "cache_negative_ttl",
+							   UCL_TIME,
+							   NULL,
+							   0,
+							   NULL,
+							   0);
+	rspamd_rcl_add_doc_by_path(cfg,
+							   "fuzzy_check.rule",
+							   "Maximum number of cached replies in each worker",
+							   "cache_size",
+							   UCL_INT,
+							   NULL,
+							   0,
+							   NULL,
+							   0);
 	rspamd_rcl_add_doc_by_path(cfg,
 							   "fuzzy_check.rule",
 							   "Default symbol for rule (if no flags defined or matched)",
@@ -2423,6 +2502,89 @@ fuzzy_insert_result(struct fuzzy_client_session *session,
 	}
 }
 
+static void
+fuzzy_cache_store(struct fuzzy_rule *rule,
+				  const struct rspamd_fuzzy_cmd *cmd,
+				  const struct rspamd_fuzzy_reply *rep,
+				  time_t now)
+{
+	unsigned int ttl;
+	unsigned char *key;
+	struct rspamd_fuzzy_reply *cached;
+
+	if (rep->v1.prob > 0.5) {
+		ttl = rule->cache_ttl;
+	}
+	else if (rep->v1.value == 0) {
+		/* Hash is not found */
+		ttl = rule->cache_negative_ttl;
+	}
+	else {
+		/* Errors, blocks and so on are never cached */
+		return;
+	}
+
+	if (ttl == 0) {
+		return;
+	}
+
+	key = g_malloc(sizeof(cmd->digest));
+	memcpy(key, cmd->digest, sizeof(cmd->digest));
+	cached = g_malloc(sizeof(*cached));
+	memcpy(cached, rep, sizeof(*cached));
+	rspamd_lru_hash_insert(rule->cache, key, cached, now, ttl);
+}
+
+/*
+ * Marks commands which replies are cached as replied and inserts their results
+ * @return number of commands found in the cache
+ */
+static unsigned int
+fuzzy_cache_apply(struct fuzzy_client_session *session)
+{
+	struct fuzzy_cmd_io *io;
+	const struct rspamd_fuzzy_reply *rep;
+	struct rspamd_task *task = session->task;
+	unsigned int i, nfound = 0;
+
+	PTR_ARRAY_FOREACH(session->commands, i, io)
+	{
+		if (io->cmd.cmd != FUZZY_CHECK) {
+			continue;
+		}
+
+		rep = rspamd_lru_hash_lookup(session->rule->cache, io->cmd.digest,
+									 (time_t) task->task_timestamp);
+
+		if (rep) {
+			io->flags |= FUZZY_CMD_FLAG_REPLIED;
+			nfound++;
+
+			if (rep->v1.prob > 0.5) {
+				fuzzy_insert_result(session, rep, &io->cmd, io, rep->v1.flag);
+			}
+		}
+	}
+
+	return nfound;
+}
+
+static void
+fuzzy_cache_invalidate(struct fuzzy_rule *rule, GPtrArray *commands)
+{
+	struct fuzzy_cmd_io *io;
+	unsigned int i;
+
+	if (rule->cache == NULL) {
+		return;
+	}
+
+	PTR_ARRAY_FOREACH(commands, i, io)
+	{
+		rspamd_lru_hash_remove(rule->cache, io->cmd.digest);
+	}
+}
+
 static int
 fuzzy_check_try_read(struct fuzzy_client_session *session)
 {
@@ -2450,6 +2612,11 @@ fuzzy_check_try_read(struct fuzzy_client_session *session)
 
 		while ((rep = fuzzy_process_reply(&p, &r,
 										  session->commands, session->rule, &cmd, &io)) != NULL) {
+			if (session->rule->cache && cmd->cmd == FUZZY_CHECK) {
+				fuzzy_cache_store(session->rule, cmd, rep,
+								  (time_t) task->task_timestamp);
+			}
+
 			if (rep->v1.prob > 0.5) {
 				if (cmd->cmd == FUZZY_CHECK) {
 					fuzzy_insert_result(session, rep, cmd, io, rep->v1.flag);
@@ -3321,6 +3488,27 @@ register_fuzzy_client_call(struct rspamd_task *task,
 	int sock;
 
 	if (!rspamd_session_blocked(task->s)) {
+		session =
+			rspamd_mempool_alloc0(task->task_pool,
+								  sizeof(struct fuzzy_client_session));
+		session->state = 0;
+		session->commands = commands;
+		session->task = task;
+		session->rule = rule;
+		session->results = g_ptr_array_sized_new(32);
+		session->event_loop = task->event_loop;
+
+		if (rule->cache && fuzzy_cache_apply(session) == commands->len) {
+			/* Everything is cached, no need to ask servers */
+			msg_debug_fuzzy_check("all %ud hashes are cached for rule %s",
+								  commands->len, rule->name);
+			fuzzy_insert_metric_results(task, rule, session->results);
+			g_ptr_array_free(session->results, TRUE);
+			g_ptr_array_free(commands, TRUE);
+
+			return;
+		}
+
 		/* Get upstream */
 		selected = rspamd_upstream_get(rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN,
 									   NULL, 0);
@@ -3333,21 +3521,13 @@ register_fuzzy_client_call(struct rspamd_task *task,
 							  errno,
 							  strerror(errno));
 				rspamd_upstream_fail(selected, TRUE, strerror(errno));
+				g_ptr_array_free(session->results, TRUE);
 				g_ptr_array_free(commands, TRUE);
 			}
 			else {
 				/* Create session for a socket */
-				session =
-					rspamd_mempool_alloc0(task->task_pool,
-										  sizeof(struct fuzzy_client_session));
-				session->state = 0;
-				session->commands = commands;
-				session->task = task;
 				session->fd = sock;
 				session->server = selected;
-				session->rule = rule;
-				session->results = g_ptr_array_sized_new(32);
-				session->event_loop = task->event_loop;
 
 				rspamd_ev_watcher_init(&session->ev,
 									   sock,
@@ -3365,6 +3545,9 @@ register_fuzzy_client_call(struct rspamd_task *task,
 				}
 			}
 		}
+		else {
+			g_ptr_array_free(session->results, TRUE);
+		}
 	}
 }
 
@@ -3446,6 +3629,9 @@ register_fuzzy_controller_call(struct rspamd_http_connection_entry *entry,
 	int sock;
 	int ret = -1;
 
+	/* Cached replies are no longer valid after learning */
+	fuzzy_cache_invalidate(rule, commands);
+
 	/* Get upstream */
 
 	while ((selected = rspamd_upstream_get_forced(rule->servers,
@@ -3816,6 +4002,8 @@ fuzzy_check_send_lua_learn(struct fuzzy_rule *rule,
 	int sock;
 	int ret = -1;
 
+	fuzzy_cache_invalidate(rule, commands);
+
 	/* Get upstream */
 	if (!rspamd_session_blocked(task->s)) {
 		while ((selected = rspamd_upstream_get(rule->servers,
@@ -4104,6 +4292,7 @@ fuzzy_lua_gen_hashes_handler(lua_State *L)
 	GPtrArray *commands;
 	int cmd = FUZZY_WRITE;
 	int i;
+	gboolean plain;
 
 	if (lua_type(L, 2) == LUA_TNUMBER) {
 		flag = lua_tonumber(L, 2);
@@ -4179,6 +4368,9 @@ fuzzy_lua_gen_hashes_handler(lua_State *L)
 		}
 	}
 
+	/* Plain commands, e.g. to write them directly to the storage backend */
+	plain = lua_toboolean(L, 6);
+
 	lua_createtable(L, 0, fuzzy_module_ctx->fuzzy_rules->len);
 
 	PTR_ARRAY_FOREACH(fuzzy_module_ctx->fuzzy_rules, i, rule)
@@ -4196,8 +4388,18 @@ fuzzy_lua_gen_hashes_handler(lua_State *L)
 			continue;
 		}
 
-		commands = fuzzy_generate_commands(task, rule, cmd, flag,
-										   weight, send_flags);
+		if (plain) {
+			struct rspamd_cryptobox_pubkey *peer_key = rule->peer_key;
+
+			rule->peer_key = NULL;
+			commands = fuzzy_generate_commands(task, rule, cmd, flag,
+											   weight, send_flags);
+			rule->peer_key = peer_key;
+		}
+		else {
+			commands = fuzzy_generate_commands(task, rule, cmd, flag,
+											   weight, send_flags);
+		}
 
 		if (commands != NULL) {
 			struct fuzzy_cmd_io *io;
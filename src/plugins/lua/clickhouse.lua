@@ -20,6 +20,7 @@ local lua_util = require "lua_util"
 local lua_clickhouse = require "lua_clickhouse"
 local lua_settings = require "lua_settings"
 local fun = require "fun"
+local ucl = require "ucl"
 
 local N = "clickhouse"
 
@@ -28,6 +29,7 @@ if confighelp then
 end
 
 local data_rows = {}
+local rows_buffer -- binary rows buffer if `use_rowbinary` is enabled
 local custom_rows = {}
 local nrows = 0
 local used_memory = 0
@@ -93,6 +95,7 @@ local settings = {
     run_every = '7d',
   },
   extra_columns = {},
+  use_rowbinary = false, -- Serialize rows in C and insert them in RowBinaryWithNamesAndTypes format
 }
 
 --- @language SQL
@@ -160,6 +163,58 @@ ORDER BY TS
                             { [[INSERT INTO rspamd_version (Version) Values (${SCHEMA_VERSION})]], true },
 }
 
+-- Types of `rspamd` table columns, required for binary inserts
+local column_types = {
+  ['Date'] = 'Date',
+  ['TS'] = 'DateTime',
+  ['From'] = 'String',
+  ['MimeFrom'] = 'String',
+  ['IP'] = 'String',
+  ['Helo'] = 'String',
+  ['Score'] = 'Float32',
+  ['NRcpt'] = 'UInt8',
+  ['Size'] = 'UInt32',
+  ['IsWhitelist'] = "Enum8('blacklist' = 0, 'whitelist' = 1, 'unknown' = 2)",
+  ['IsBayes'] = "Enum8('ham' = 0, 'spam' = 1, 'unknown' = 2)",
+  ['IsFuzzy'] = "Enum8('whitelist' = 0, 'deny' = 1, 'unknown' = 2)",
+  ['IsFann'] = "Enum8('ham' = 0, 'spam' = 1, 'unknown' = 2)",
+  ['IsDkim'] = "Enum8('reject' = 0, 'allow' = 1, 'unknown' = 2, 'dnsfail' = 3, 'na' = 4)",
+  ['IsDmarc'] = "Enum8('reject' = 0, 'allow' = 1, 'unknown' = 2, 'softfail' = 3, 'na' = 4, 'quarantine' = 5)",
+  ['IsSpf'] = "Enum8('reject' = 0, 'allow' = 1, 'neutral' = 2, 'dnsfail' = 3, 'na' = 4, 'unknown' = 5)",
+  ['NUrls'] = 'Int32',
+  ['Action'] = "Enum8('reject' = 0, 'rewrite subject' = 1, 'add header' = 2, 'greylist' = 3, 'no action' = 4, 'soft reject' = 5, 'custom' = 6)",
+  ['CustomAction'] = 'LowCardinality(String)',
+  ['FromUser'] = 'String',
+  ['MimeUser'] = 'String',
+  ['RcptUser'] = 'String',
+  ['RcptDomain'] = 'String',
+  ['SMTPRecipients'] = 'Array(String)',
+  ['MimeRecipients'] = 'Array(String)',
+  ['MessageId'] = 'String',
+  ['ListId'] = 'String',
+  ['Subject'] = 'String',
+  ['Attachments.FileName'] = 'Array(String)',
+  ['Attachments.ContentType'] = 'Array(String)',
+  ['Attachments.Length'] = 'Array(UInt32)',
+  ['Attachments.Digest'] = 'Array(FixedString(16))',
+  ['Urls.Tld'] = 'Array(String)',
+  ['Urls.Url'] = 'Array(String)',
+  ['Urls.Flags'] = 'Array(UInt32)',
+  ['Emails'] = 'Array(String)',
+  ['ASN'] = 'UInt32',
+  ['Country'] = 'FixedString(2)',
+  ['IPNet'] = 'String',
+  ['Symbols.Names'] = 'Array(LowCardinality(String))',
+  ['Symbols.Scores'] = 'Array(Float32)',
+  ['Symbols.Options'] = 'Array(String)',
+  ['Groups.Names'] = 'Array(LowCardinality(String))',
+  ['Groups.Scores'] = 'Array(Float32)',
+  ['ScanTimeReal'] = 'UInt32',
+  ['AuthUser'] = 'String',
+  ['SettingsId'] = 'LowCardinality(String)',
+  ['Digest'] = 'FixedString(32)',
+}
+
 -- This describes SQL queries to migrate between versions
 local migrations = {
   [1] = {
@@ -381,6 +436,27 @@ local function clickhouse_extra_columns(res)
   end
 end
 
+-- Returns names of columns in the same order as rows are built
+local function clickhouse_fields()
+  local fields = {}
+  clickhouse_main_row(fields)
+  clickhouse_attachments_row(fields)
+  clickhouse_urls_row(fields)
+  clickhouse_emails_row(fields)
+  clickhouse_asn_row(fields)
+
+  if settings.enable_symbols then
+    clickhouse_symbols_row(fields)
+    clickhouse_groups_row(fields)
+  end
+
+  if #settings.extra_columns > 0 then
+    clickhouse_extra_columns(fields)
+  end
+
+  return fields
+end
+
 local function today(ts)
   return os.date('!%Y-%m-%d', ts)
 end
@@ -407,12 +483,12 @@ local function clickhouse_check_symbol(task, settings_field_name, fields_table,
   return false
 end
 
-local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
+local function clickhouse_send_data(task, ev_base, why, gen_rows, gen_nrows, cust_rows)
   local log_object = task or rspamd_config
   local upstream = settings.upstream:get_upstream_round_robin()
   local ip_addr = upstream:get_addr():to_string(true)
   rspamd_logger.infox(log_object, "trying to send %s rows to clickhouse server %s; started as %s",
-      #gen_rows + #cust_rows, ip_addr, why)
+      gen_nrows + #cust_rows, ip_addr, why)
 
   local function gen_success_cb(what, how_many)
     return function(_, _)
@@ -430,7 +506,7 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
     end
   end
 
-  local function send_data(what, tbl, query)
+  local function send_data(what, tbl, how_many, query)
     local ch_params = {}
     if task then
       ch_params.task = task
@@ -441,40 +517,88 @@ local function clickhouse_send_data(task, ev_base, why, gen_rows, cust_rows)
 
     local ret = lua_clickhouse.insert(upstream, settings, ch_params,
         query, tbl,
-        gen_success_cb(what, #tbl),
-        gen_fail_cb(what, #tbl))
+        gen_success_cb(what, how_many),
+        gen_fail_cb(what, how_many))
     if not ret then
       rspamd_logger.errx(log_object, "cannot send %s rows of %s data to clickhouse server %s: %s",
-          #tbl, what, ip_addr, 'cannot make HTTP request')
+          how_many, what, ip_addr, 'cannot make HTTP request')
     end
   end
 
-  local fields = {}
-  clickhouse_main_row(fields)
-  clickhouse_attachments_row(fields)
-  clickhouse_urls_row(fields)
-  clickhouse_emails_row(fields)
-  clickhouse_asn_row(fields)
+  if gen_rows then
+    send_data('generic data', gen_rows, gen_nrows,
+        string.format('INSERT INTO rspamd (%s)',
+            table.concat(clickhouse_fields(), ',')))
+  end
 
-  if settings.enable_symbols then
-    clickhouse_symbols_row(fields)
-    clickhouse_groups_row(fields)
+  for k, crows in pairs(cust_rows) do
+    if #crows > 1 then
+      send_data('custom data (' .. k .. ')', crows, #crows,
+          settings.custom_rules[k].first_row())
+    end
   end
+end
 
-  if #settings.extra_columns > 0 then
-    clickhouse_extra_columns(fields)
+-- Atomically takes all collected rows
+local function clickhouse_take_rows()
+  local saved_rows = data_rows
+  local saved_nrows = nrows
+  local saved_custom = custom_rows
+
+  if rows_buffer then
+    saved_rows = rows_buffer:flush()
   end
 
-  send_data('generic data', gen_rows,
-      string.format('INSERT INTO rspamd (%s)',
-          table.concat(fields, ',')))
+  nrows = 0
+  used_memory = 0
+  data_rows = {}
+  custom_rows = {}
 
-  for k, crows in pairs(cust_rows) do
-    if #crows > 1 then
-      send_data('custom data (' .. k .. ')', crows,
-          settings.custom_rules[k].first_row())
+  return saved_rows, saved_nrows, saved_custom
+end
+
+-- Adds row to the local buffer, `custom` is a table of TSV rows for custom rules
+local function clickhouse_push_row(log_obj, row, custom)
+  for k, tsv_row in pairs(custom) do
+    if not custom_rows[k] then
+      custom_rows[k] = {}
     end
+    table.insert(custom_rows[k], tsv_row)
   end
+
+  if rows_buffer then
+    local ok, err = rows_buffer:append(row)
+
+    if not ok then
+      rspamd_logger.errx(log_obj, 'cannot add clickhouse row: %s', err)
+      return
+    end
+
+    used_memory = rows_buffer:size()
+  else
+    local tsv_row = lua_clickhouse.row_to_tsv(row)
+    used_memory = used_memory + #tsv_row
+    data_rows[#data_rows + 1] = tsv_row
+  end
+  nrows = nrows + 1
+  lua_util.debugm(N, log_obj,
+      "add clickhouse row %s / %s; used memory: %s / %s",
+      nrows, settings.limits.max_rows,
+      used_memory, settings.limits.max_memory)
+end
+
+-- Rows received by the exporter worker from scanners
+local function clickhouse_export_callback(data)
+  local parser = ucl.parser()
+  local ok, err = parser:parse_text(data, 'msgpack')
+
+  if not ok then
+    rspamd_logger.errx(rspamd_config, 'cannot parse exported clickhouse row: %s', err)
+    return
+  end
+
+  local obj = parser:get_object()
+  clickhouse_push_row(rspamd_config, obj.row, obj.custom or {})
 end
 
 local function clickhouse_collect(task)
@@ -915,21 +1039,17 @@ local function clickhouse_collect(task)
   end
 
   -- Custom data
+  local custom = {}
   for k, rule in pairs(settings.custom_rules) do
-    if not custom_rows[k] then
-      custom_rows[k] = {}
-    end
-    table.insert(custom_rows[k], lua_clickhouse.row_to_tsv(rule.get_row(task)))
+    custom[k] = lua_clickhouse.row_to_tsv(rule.get_row(task))
   end
 
-  local tsv_row = lua_clickhouse.row_to_tsv(row)
-  used_memory = used_memory + #tsv_row
-  data_rows[#data_rows + 1] = tsv_row
-  nrows = nrows + 1
-  lua_util.debugm(N, task,
-      "add clickhouse row %s / %s; used memory: %s / %s",
-      nrows, settings.limits.max_rows,
-      used_memory, settings.limits.max_memory)
+  -- Send row to the exporter worker if it is running and not overloaded
+  if rspamd_config:export_record(N, { row = row, custom = custom }) then
+    return
+  end
+
+  clickhouse_push_row(task, row, custom)
 end
 
 local function do_remove_partition(ev_base, cfg, table_name, partition)
@@ -1062,15 +1182,10 @@ local function clickhouse_maybe_send_data_periodic(cfg, ev_base, now)
 
   if need_collect then
     -- Do it atomic
-    local saved_rows = data_rows
-    local saved_custom = custom_rows
-    nrows = 0
+    local saved_rows, saved_nrows, saved_custom = clickhouse_take_rows()
     last_collection = now
-    used_memory = 0
-    data_rows = {}
-    custom_rows = {}
 
-    clickhouse_send_data(nil, ev_base, reason, saved_rows, saved_custom)
+    clickhouse_send_data(nil, ev_base, reason, saved_rows, saved_nrows, saved_custom)
 
     if settings.collect_garbage then
       collectgarbage()
@@ -1483,6 +1598,28 @@ if opts then
       settings.extra_columns = columns_transformed
     end
 
+    if settings.use_rowbinary then
+      local rspamd_rowbinary = require "rspamd_rowbinary"
+      local fields = clickhouse_fields()
+      local types = {}
+      local extra_types = {}
+
+      for _, col in ipairs(settings.extra_columns) do
+        extra_types[col.name] = col.type
+      end
+
+      for i, f in ipairs(fields) do
+        types[i] = column_types[f] or extra_types[f]
+      end
+
+      local err
+      rows_buffer, err = rspamd_rowbinary.create(fields, types)
+
+      if not rows_buffer then
+        rspamd_logger.errx(rspamd_config, 'cannot use binary rows, fallback to TSV: %s', err)
+      end
+    end
+
     rspamd_config:register_symbol({
       name = 'CLICKHOUSE_COLLECT',
       type = 'idempotent',
@@ -1493,16 +1630,10 @@ if opts then
     rspamd_config:register_finish_script(function(task)
       if nrows > 0 then
         final_call = true
-        local saved_rows = data_rows
-        local saved_custom = custom_rows
-
-        nrows = 0
-        data_rows = {}
-        used_memory = 0
-        custom_rows = {}
+        local saved_rows, saved_nrows, saved_custom = clickhouse_take_rows()
 
         clickhouse_send_data(task, nil, 'final collection',
-            saved_rows, saved_custom)
+            saved_rows, saved_nrows, saved_custom)
 
         if settings.collect_garbage then
           collectgarbage()
@@ -1510,8 +1641,11 @@ if opts then
       end
     end)
     -- Create tables on load
+    rspamd_plugins[N] = {
+      export_callback = clickhouse_export_callback,
+    }
     rspamd_config:add_on_load(function(cfg, ev_base, worker)
-      if worker:is_scanner() then
+      if worker:is_scanner() or worker:get_type() == 'exporter' then
         rspamd_config:add_periodic(ev_base, 0,
             clickhouse_maybe_send_data_periodic, true)
       end
@@ -211,23 +211,52 @@ local function greylist_message(task, end_time, why)
   task:set_flag('greylisted')
 end
 
-local function greylist_check(task)
+-- Returns true and a reason if greylisting should not be checked
+local function greylist_skip_check(task)
   local ip = task:get_ip()
 
   if ((not settings.check_authed and task:get_user()) or
       (not settings.check_local and ip and ip:is_local())) then
-    rspamd_logger.infox(task, "skip greylisting for local networks and/or authorized users");
-    return
+    return true, 'local networks and/or authorized users'
   end
 
   if ip and ip:is_valid() and whitelisted_ip then
     if whitelisted_ip:get_key(ip) then
       -- Do not check whitelisted ip
-      rspamd_logger.infox(task, 'skip greylisting for whitelisted IP')
-      return
+      return true, 'whitelisted IP'
     end
   end
 
+  return false
+end
+
+-- Prefetches greylisting keys in the same redis round trip as other plugins
+local function greylist_batch_prepare(task)
+  if greylist_skip_check(task) then
+    return nil
+  end
+
+  local body_key = data_key(task)
+
+  if not body_key then
+    return nil
+  end
+
+  local meta_key = envelope_key(task)
+
+  return {
+    { key = body_key .. meta_key, cmd = 'MGET', args = { body_key, meta_key } },
+  }
+end
+
+local function greylist_check(task)
+  local skip, why = greylist_skip_check(task)
+
+  if skip then
+    rspamd_logger.infox(task, "skip greylisting for %s", why)
+    return
+  end
+
   local body_key = data_key(task)
   local meta_key = envelope_key(task)
   local hash_key = body_key .. meta_key
@@ -294,7 +323,7 @@ local function greylist_check(task)
     end
   end
 
-  local ret = lua_redis.redis_make_request(task,
+  local ret = lua_redis.redis_make_request_batched(task,
       redis_params, -- connect params
       hash_key, -- hash key
       false, -- is write
@@ -535,5 +564,11 @@ if opts then
       parent = id,
       score = 0,
     })
+    lua_redis.register_batch_read(rspamd_config, redis_params, {
+      name = N,
+      stage = 'prefilter',
+      priority = lua_util.symbols_priorities.medium,
+      prepare = greylist_batch_prepare,
+    })
   end
 end
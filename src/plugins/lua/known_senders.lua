@@ -116,6 +116,15 @@ local function configure_scripts(_, _, _)
   zscore_script_id = lua_redis.add_redis_script(redis_zscore_script, redis_params)
 end
 
+-- Returns a read command and its arguments to check the key
+local function check_key_request(key)
+  if settings.use_bloom then
+    return 'BF.EXISTS', { settings.redis_key, key }
+  end
+
+  return 'ZSCORE', { settings.redis_key, key }
+end
+
 local function check_redis_key(task, key, key_ty)
   lua_util.debugm(N, task, 'check key %s, type: %s', key, key_ty)
   local function redis_zset_callback(err, data)
@@ -188,28 +197,24 @@ local function check_redis_key(task, key, key_ty)
     end
   end
 
-  if settings.use_bloom then
-    lua_redis.redis_make_request(task,
-        redis_params, -- connect params
-        key, -- hash key
-        false, -- is write
-        redis_bloom_callback, --callback
-        'BF.EXISTS', -- command
-        { settings.redis_key, key } -- arguments
-    )
-  else
-    lua_redis.redis_make_request(task,
-        redis_params, -- connect params
-        key, -- hash key
-        false, -- is write
-        redis_zset_callback, --callback
-        'ZSCORE', -- command
-        { settings.redis_key, key } -- arguments
-    )
-  end
+  local cmd, args = check_key_request(key)
+  lua_redis.redis_make_request_batched(task,
+      redis_params, -- connect params
+      key, -- hash key
+      false, -- is write
+      settings.use_bloom and redis_bloom_callback or redis_zset_callback, --callback
+      cmd, -- command
+      args -- arguments
+  )
 end
 
-local function known_senders_callback(task)
+-- Returns a list of {key, type} pairs to check
+local function known_senders_keys(task)
+  local cached = task:cache_get('known_senders_keys')
+  if cached then
+    return cached
+  end
+
   local mime_from = (task:get_from('mime') or {})[1]
   local smtp_from = (task:get_from('smtp') or {})[1]
   local mime_key, smtp_key
@@ -228,16 +233,37 @@ local function known_senders_callback(task)
     end
   end
 
+  local keys = {}
   if mime_key and smtp_key and mime_key ~= smtp_key then
     -- Check both keys
-    check_redis_key(task, mime_key, 'mime')
-    check_redis_key(task, smtp_key, 'smtp')
+    keys = { { mime_key, 'mime' }, { smtp_key, 'smtp' } }
   elseif mime_key then
     -- Check mime key
-    check_redis_key(task, mime_key, 'mime')
+    keys = { { mime_key, 'mime' } }
   elseif smtp_key then
     -- Check smtp key
-    check_redis_key(task, smtp_key, 'smtp')
+    keys = { { smtp_key, 'smtp' } }
+  end
+
+  task:cache_set('known_senders_keys', keys)
+  return keys
+end
+
+-- Prefetches senders in the same redis round trip as other plugins
+local function known_senders_batch_prepare(task)
+  local reqs = {}
+
+  for _, k in ipairs(known_senders_keys(task)) do
+    local cmd, args = check_key_request(k[1])
+    table.insert(reqs, { key = k[1], cmd = cmd, args = args })
+  end
+
+  return reqs
+end
+
+local function known_senders_callback(task)
+  for _, k in ipairs(known_senders_keys(task)) do
+    check_redis_key(task, k[1], k[2])
   end
 end
 
@@ -359,6 +385,12 @@ if opts then
       score = -1.0,
       augmentations = { string.format("timeout=%f", redis_params.timeout or 0.0) }
     })
+    lua_redis.register_batch_read(rspamd_config, redis_params, {
+      name = N,
+      stage = 'filter',
+      symbols = { settings.symbol },
+      prepare = known_senders_batch_prepare,
+    })
 
     rspamd_config:register_symbol({
       name = settings.symbol_check_mail_local,
@@ -86,6 +86,10 @@ end
 
 -- ANN filter function, used to insert scores based on the existing symbols
 local function ann_scores_filter(task)
+  if task:has_flag('memory_pressure') then
+    lua_util.debugm(N, task, 'do not apply ANN due to memory pressure')
+    return
+  end
 
   for _, rule in pairs(settings.rules) do
     local sid = task:get_settings_id() or -1
@@ -461,6 +465,17 @@ local function load_new_ann(rule, ev_base, set, profile, min_diff)
           else
             ann = rspamd_kann.load(ann_data)
 
+            if ann and rule.quantize then
+              local qann, qerr = ann:quantize()
+
+              if qann then
+                ann = qann
+              else
+                rspamd_logger.warnx(rspamd_config, 'cannot quantize ANN for %s from Redis key %s: %s',
+                    rule.prefix .. ':' .. set.name, ann_key, qerr)
+              end
+            end
+
             if ann then
               set.ann = {
                 digest = profile.digest,
@@ -843,6 +858,10 @@ local function ann_push_vector(task)
     lua_util.debugm(N, task, 'do not push data for skipped task')
     return
   end
+  if task:has_flag('memory_pressure') then
+    lua_util.debugm(N, task, 'do not push data due to memory pressure')
+    return
+  end
   if not settings.allow_local and lua_util.is_rspamc_or_controller(task) then
     lua_util.debugm(N, task, 'do not push data for manual scan')
     return
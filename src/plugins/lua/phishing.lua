@@ -45,12 +45,10 @@ local phishtank_suffix = 'phishtank.rspamd.com'
 local openphish_premium = false
 -- Published via DNS
 local phishtank_enabled = false
+-- Feeds are url maps, matched natively by host, path and query
 local phishing_feed_exclusion_hash
 local generic_service_hash
 local openphish_hash
-local phishing_feed_exclusion_data = {}
-local generic_service_data = {}
-local openphish_data = {}
 
 local opts = rspamd_config:get_all_opt(N)
 if not (opts and type(opts) == 'table') then
@@ -58,100 +56,67 @@ if not (opts and type(opts) == 'table') then
   return
 end
 
-local function is_host_excluded(exclusion_map, host)
-  if exclusion_map and host then
-    local excluded = exclusion_map[host]
-    if excluded then
-      return true
-    end
-    return false
+local function is_url_excluded(url)
+  if phishing_feed_exclusion_hash then
+    return phishing_feed_exclusion_hash:get_url(url) ~= nil
   end
+
+  return false
 end
 
 local function phishing_cb(task)
-  local function check_phishing_map(table)
-    local phishing_data = {}
-    for k,v in pairs(table) do
-      phishing_data[k] = v
-    end
-    local url = phishing_data.url
+  local function check_phishing_map(url, map, phish_symbol)
     local host = url:get_host()
 
-    if is_host_excluded(phishing_data.exclusion_map, host) then
-      task:insert_result(phishing_data.excl_symbol, 1.0, host)
+    if not host then
       return
     end
 
-    if host then
-      local elt = phishing_data.map[host]
-      local found_path = false
-      local found_query = false
-      local data = nil
-
-      if elt then
-        local path = url:get_path()
-        local query = url:get_query()
-
-        if path then
-          for _, d in ipairs(elt) do
-            if d['path'] == path then
-              found_path = true
-              data = d['data']
-
-              if query and d['query'] and query == d['query'] then
-                found_query = true
-              elseif not d['query'] then
-                found_query = true
-              end
-            end
-          end
-        else
-          for _, d in ipairs(elt) do
-            if not d['path'] then
-              found_path = true
-            end
+    if is_url_excluded(url) then
+      task:insert_result(phishing_feed_exclusion_symbol, 1.0, host)
+      return
+    end
 
-            if query and d['query'] and query == d['query'] then
-              found_query = true
-            elseif not d['query'] then
-              found_query = true
-            end
-          end
-        end
+    local match, data = map:get_url(url)
 
-        if found_path then
-          local args
-
-          if type(data) == 'table' then
-            args = {
-              data['tld'],
-              data['sector'],
-              data['brand'],
-            }
-          elseif type(data) == 'string' then
-            args = data
-          else
-            args = host
-          end
+    if not match then
+      return
+    end
 
-          if found_query then
-            -- Query + path match
-            task:insert_result(phishing_data.phish_symbol, 1.0, args)
-          else
-            -- Host + path match
-            if path then
-              task:insert_result(phishing_data.phish_symbol, 0.3, args)
-            end
-            -- No path, no symbol
-          end
-        else
-          if url:is_phished() then
-            -- Only host matches
-            task:insert_result(phishing_data.phish_symbol, 0.1, host)
-          end
-        end
+    if match == 'host' then
+      if url:is_phished() then
+        -- Only host matches
+        task:insert_result(phish_symbol, 0.1, host)
+      end
+
+      return
+    end
+
+    local args = host
+
+    if data then
+      -- Json record of a premium feed
+      local ucl = require "ucl"
+      local parser = ucl.parser()
+
+      if parser:parse_string(data) then
+        local obj = parser:get_object()
+        args = {
+          obj['tld'],
+          obj['sector'],
+          obj['brand'],
+        }
       end
     end
+
+    if match == 'query' then
+      -- Query + path match
+      task:insert_result(phish_symbol, 1.0, args)
+    elseif url:get_path() then
+      -- Host + path match
+      task:insert_result(phish_symbol, 0.3, args)
+    end
+    -- No path, no symbol
   end
 
   local function check_phishing_dns(table)
@@ -162,8 +127,8 @@ local function phishing_cb(task)
     local url = phishing_data.url
     local host = url:get_host()
 
-    if is_host_excluded(phishing_data.exclusion_map, host) then
-      task:insert_result(phishing_data.excl_symbol, 1.0, host)
+    if host and is_url_excluded(url) then
+      task:insert_result(phishing_feed_exclusion_symbol, 1.0, host)
       return
     end
 
@@ -233,26 +198,20 @@ local function phishing_cb(task)
     local function do_loop_iter()
       -- to emulate continue
       local url = url_iter
-      local phishing_data = {}
-      phishing_data.url = url
-      phishing_data.exclusion_map = phishing_feed_exclusion_data
-      phishing_data.excl_symbol = phishing_feed_exclusion_symbol
       if generic_service_hash then
-        phishing_data.map = generic_service_data
-        phishing_data.phish_symbol = generic_service_symbol
-        check_phishing_map(phishing_data)
+        check_phishing_map(url, generic_service_hash, generic_service_symbol)
       end
 
       if openphish_hash then
-        phishing_data.map = openphish_data
-        phishing_data.phish_symbol = openphish_symbol
-        check_phishing_map(phishing_data)
+        check_phishing_map(url, openphish_hash, openphish_symbol)
       end
 
       if phishtank_enabled then
-        phishing_data.dns_suffix = phishtank_suffix
-        phishing_data.phish_symbol = phishtank_symbol
-        check_phishing_dns(phishing_data)
+        check_phishing_dns({
+          url = url,
+          dns_suffix = phishtank_suffix,
+          phish_symbol = phishtank_symbol,
+        })
       end
 
       if url:is_phished() then
@@ -410,140 +369,6 @@ local function phishing_map(mapname, phishmap, id)
   end
 end
 
-local function rspamd_str_split_fun(s, sep, func)
-  local lpeg = require "lpeg"
-  sep = lpeg.P(sep)
-  local elem = lpeg.P((1 - sep) ^ 0 / func)
-  local p = lpeg.P(elem * (sep * elem) ^ 0)
-  return p:match(s)
-end
-
-local function insert_url_from_string(pool, tbl, str, data)
-  local rspamd_url = require "rspamd_url"
-
-  local u = rspamd_url.create(pool, str)
-
-  if u then
-    local host = u:get_host()
-    if host then
-      local elt = {
-        data = data,
-        path = u:get_path(),
-        query = u:get_query()
-      }
-
-      if tbl[host] then
-        table.insert(tbl[host], elt)
-      else
-        tbl[host] = { elt }
-      end
-
-      return true
-    end
-  end
-
-  return false
-end
-
-local function phishing_feed_exclusion_plain_cb(string)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function phishing_feed_exclusion_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(string, '\n', phishing_feed_exclusion_elt_parser)
-
-  phishing_feed_exclusion_data = new_data
-  rspamd_logger.infox(phishing_feed_exclusion_hash, "parsed %s elements from phishing feed exclusions",
-      nelts)
-  pool:destroy()
-end
-
-local function generic_service_plain_cb(string)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function generic_service_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(string, '\n', generic_service_elt_parser)
-
-  generic_service_data = new_data
-  rspamd_logger.infox(generic_service_hash, "parsed %s elements from %s feed",
-      nelts, generic_service_name)
-  pool:destroy()
-end
-
-local function openphish_json_cb(string)
-  local ucl = require "ucl"
-  local rspamd_mempool = require "rspamd_mempool"
-  local nelts = 0
-  local new_json_map = {}
-  local valid = true
-
-  local pool = rspamd_mempool.create()
-
-  local function openphish_elt_parser(cap)
-    if valid then
-      local parser = ucl.parser()
-      local res, err = parser:parse_string(cap)
-      if not res then
-        valid = false
-        rspamd_logger.warnx(openphish_hash, 'cannot parse openphish map: ' .. err)
-      else
-        local obj = parser:get_object()
-
-        if obj['url'] then
-          if insert_url_from_string(pool, new_json_map, obj['url'], obj) then
-            nelts = nelts + 1
-          end
-        end
-      end
-    end
-  end
-
-  rspamd_str_split_fun(string, '\n', openphish_elt_parser)
-
-  if valid then
-    openphish_data = new_json_map
-    rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
-        nelts)
-  end
-
-  pool:destroy()
-end
-
-local function openphish_plain_cb(s)
-  local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
-
-  local function openphish_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
-      nelts = nelts + 1
-    end
-  end
-
-  rspamd_str_split_fun(s, '\n', openphish_elt_parser)
-
-  openphish_data = new_data
-  rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
-      nelts)
-  pool:destroy()
-end
-
 if opts then
   local id
   if opts['symbol'] then
@@ -566,9 +391,8 @@ if opts then
 
     if opts['phishing_feed_exclusion_enabled'] then
       phishing_feed_exclusion_hash = rspamd_config:add_map({
-        type = 'callback',
+        type = 'url',
         url = phishing_feed_exclusion_map,
-        callback = phishing_feed_exclusion_plain_cb,
         description = 'Phishing feed exclusions'
       })
     end
@@ -588,10 +412,9 @@ if opts then
 
     if opts['generic_service_enabled'] then
       generic_service_hash = rspamd_config:add_map({
-        type = 'callback',
+        type = 'url',
         url = generic_service_map,
-        callback = generic_service_plain_cb,
-        description = 'Generic feed'
+        description = 'Generic feed: ' .. generic_service_name
       })
     end
 
@@ -607,23 +430,18 @@ if opts then
     end
 
     if opts['openphish_enabled'] then
-      if not openphish_premium then
-        openphish_hash = rspamd_config:add_map({
-          type = 'callback',
-          url = openphish_map,
-          callback = openphish_plain_cb,
-          description = 'Open phishing feed map (see https://www.openphish.com for details)',
-          opaque_data = true,
-        })
-      else
-        openphish_hash = rspamd_config:add_map({
-          type = 'callback',
-          url = openphish_map,
-          callback = openphish_json_cb,
-          opaque_data = true,
-          description = 'Open phishing premium feed map (see https://www.openphish.com for details)'
-        })
+      -- Premium feed has json records, they are recognised by the map itself
+      local description = 'Open phishing feed map (see https://www.openphish.com for details)'
+
+      if openphish_premium then
+        description = 'Open phishing premium feed map (see https://www.openphish.com for details)'
       end
+
+      openphish_hash = rspamd_config:add_map({
+        type = 'url',
+        url = openphish_map,
+        description = description,
+      })
     end
 
     if opts['phishtank_enabled'] then
@@ -52,6 +52,12 @@ local settings = {
   limits = {},
   allow_local = false,
   prefilter = true,
+  -- Approximate buckets in each worker, reconciled with Redis asynchronously
+  local_buckets = false,
+  local_sync_interval = 1.0, -- seconds between reconciliations
+  local_sync_messages = 100, -- reconcile a bucket after this number of local hits
+  local_strict_threshold = 0.8, -- check in Redis when a bucket is filled more than this
+  local_max_buckets = 8192, -- maximum number of buckets kept by a worker
 }
 
 local bucket_check_script = "ratelimit_check.lua"
@@ -63,6 +69,13 @@ local bucket_update_id
 local bucket_cleanup_script = "ratelimit_cleanup_pending.lua"
 local bucket_cleanup_id
 
+local bucket_reconcile_script = "ratelimit_reconcile.lua"
+local bucket_reconcile_id
+
+-- Local buckets state indexed by hash (if `local_buckets` are enabled)
+local local_buckets = {}
+local nlocal_buckets = 0
+
 -- message_func(task, limit_type, prefix, bucket, limit_key)
 local message_func = function(_, limit_type, _, _, _)
   return string.format('Ratelimit "%s" exceeded', limit_type)
@@ -72,6 +85,9 @@ local function load_scripts(_, _)
   bucket_check_id = lua_redis.load_redis_script_from_file(bucket_check_script, redis_params)
   bucket_update_id = lua_redis.load_redis_script_from_file(bucket_update_script, redis_params)
   bucket_cleanup_id = lua_redis.load_redis_script_from_file(bucket_cleanup_script, redis_params)
+  if settings.local_buckets then
+    bucket_reconcile_id = lua_redis.load_redis_script_from_file(bucket_reconcile_script, redis_params)
+  end
 end
 
 local limit_parser
@@ -417,6 +433,117 @@ local function limit_to_prefixes(task, k, v, prefixes)
   return n
 end
 
+-- Local buckets are refreshed from Redis replies and accumulate hits that
+-- are sent to Redis in batches. The estimate misses hits of other workers
+-- since the last reconciliation, so buckets near the limit are always
+-- checked in Redis.
+local function local_bucket_refresh(hash, bucket, now, burst, dynr, dynb)
+  local st = local_buckets[hash]
+
+  if not st then
+    if nlocal_buckets >= settings.local_max_buckets then
+      return
+    end
+    st = {
+      delta = 0, -- hits to be sent to Redis
+      pending = 0, -- hits accepted locally but not yet updated
+      syncing = 0, -- hits being sent to Redis
+      hits = 0,
+      mult_rate = 1.0,
+      mult_burst = 1.0,
+      dynr = 1.0,
+      dynb = 1.0,
+    }
+    local_buckets[hash] = st
+    nlocal_buckets = nlocal_buckets + 1
+  end
+
+  st.bucket = bucket
+  st.time = now
+  st.burst = tonumber(burst) or 0
+  dynr, dynb = tonumber(dynr), tonumber(dynb)
+  -- Zero multipliers mean that Redis has not read them
+  if dynr and dynr > 0 then
+    st.dynr = dynr
+  end
+  if dynb and dynb > 0 then
+    st.dynb = dynb
+  end
+end
+
+-- Returns true if a message can be accepted without asking Redis
+local function local_bucket_check(hash, now, bincr)
+  local st = local_buckets[hash]
+
+  if not st or not st.time or now - st.time > settings.local_sync_interval * 2000.0 then
+    -- Unknown or stale bucket
+    return false
+  end
+
+  local bucket = st.bucket
+  local leaked = (now - st.time) * bucket.rate / 1000.0 * st.dynr
+  local level = math.max(st.burst - leaked, 0) + st.delta + st.syncing + st.pending + bincr
+
+  if level > bucket.burst * st.dynb * settings.local_strict_threshold then
+    return false
+  end
+
+  st.pending = st.pending + bincr
+
+  return true
+end
+
+local function local_bucket_reconcile(hash, st, params)
+  if st.delta <= 0 or st.syncing > 0 then
+    return
+  end
+
+  local bucket = st.bucket
+  local hits, mult_rate, mult_burst = st.delta, st.mult_rate, st.mult_burst
+  local now = lua_util.round(rspamd_util.get_time() * 1000.0)
+  st.syncing = hits
+  st.delta = 0
+  st.hits = 0
+  st.mult_rate, st.mult_burst = 1.0, 1.0
+
+  local function reconcile_cb(err, data)
+    st.syncing = 0
+    if err or type(data) ~= 'table' then
+      rspamd_logger.errx(rspamd_config, 'cannot reconcile limit %s: %s', hash, err)
+      -- Try again later
+      st.delta = st.delta + hits
+      st.mult_rate = st.mult_rate * mult_rate
+      st.mult_burst = st.mult_burst * mult_burst
+    else
+      lua_util.debugm(N, rspamd_config, 'reconciled limit %s: %s hits, burst: %s, dyn_rate: %s, dyn_burst: %s',
+          hash, hits, data[1], data[2], data[3])
+      local_bucket_refresh(hash, bucket, now, data[1], data[2], data[3])
+    end
+  end
+
+  params.key = hash
+  params.is_write = true
+  lua_redis.exec_redis_script(bucket_reconcile_id, params, reconcile_cb,
+      { hash, tostring(now), tostring(bucket.rate / 1000.0),
+        tostring(mult_rate), tostring(mult_burst),
+        tostring(settings.max_rate_mult), tostring(settings.max_bucket_mult),
+        tostring(settings.expire), tostring(hits) })
+end
+
+local function local_buckets_periodic(ev_base)
+  local now = lua_util.round(rspamd_util.get_time() * 1000.0)
+  local max_idle = settings.local_sync_interval * 10000.0
+
+  for hash, st in pairs(local_buckets) do
+    if st.delta > 0 then
+      local_bucket_reconcile(hash, st, { ev_base = ev_base })
+    elseif st.pending == 0 and st.syncing == 0 and now - st.time > max_idle then
+      local_buckets[hash] = nil
+      nlocal_buckets = nlocal_buckets - 1
+    end
+  end
+end
+
 local function ratelimit_cb(task)
   if not settings.allow_local and
       rspamd_lua_utils.is_rspamc_or_controller(task) then
@@ -481,7 +608,7 @@ local function ratelimit_cb(task)
     end
   end
 
-  local function gen_check_cb(prefix, bucket, lim_name, lim_key)
+  local function gen_check_cb(prefix, bucket, lim_name, lim_key, now)
     return function(err, data)
       if err then
         rspamd_logger.errx('cannot check limit %s: %s %s', prefix, err, data)
@@ -491,6 +618,10 @@ local function ratelimit_cb(task)
             prefix, bucket.burst, bucket.rate,
             data[2], data[3], data[4], data[5])
 
+        if settings.local_buckets then
+          local_bucket_refresh(lim_key, bucket, now, data[2], data[3], data[4])
+        end
+
         task:cache_set('ratelimit_bucket_touched', true)
         if data[1] == 1 then
           -- set symbol only and do NOT soft reject
@@ -551,13 +682,20 @@ local function ratelimit_cb(task)
         bincr = 1
       end
 
-      lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
-          value.name, pr, value.hash, bucket.burst, bucket.rate)
-      lua_redis.exec_redis_script(bucket_check_id,
-          { key = value.hash, task = task, is_write = true },
-          gen_check_cb(pr, bucket, value.name, value.hash),
-          { value.hash, tostring(now), tostring(rate), tostring(bucket.burst),
-            tostring(settings.expire), tostring(bincr) })
+      if settings.local_buckets and local_bucket_check(value.hash, now, bincr) then
+        lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s) locally",
+            value.name, pr, value.hash, bucket.burst, bucket.rate)
+        value.is_local = true
+        task:cache_set('ratelimit_bucket_touched', true)
+      else
+        lua_util.debugm(N, task, "check limit %s:%s -> %s (%s/%s)",
+            value.name, pr, value.hash, bucket.burst, bucket.rate)
+        lua_redis.exec_redis_script(bucket_check_id,
+            { key = value.hash, task = task, is_write = true },
+            gen_check_cb(pr, bucket, value.name, value.hash, now),
+            { value.hash, tostring(now), tostring(rate), tostring(bucket.burst),
+              tostring(settings.expire), tostring(bincr) })
+      end
     end
   end
 end
@@ -573,6 +711,7 @@ local function maybe_cleanup_pending(task)
     if prefixes then
       for k, v in pairs(prefixes) do
         local bucket = v.bucket
+        local st = v.is_local and local_buckets[v.hash]
         local function cleanup_cb(err, data)
           if err then
             rspamd_logger.errx('cannot cleanup limit %s: %s %s', k, err, data)
@@ -588,12 +727,17 @@ local function maybe_cleanup_pending(task)
         if bucket.skip_recipients then
           bincr = 1
         end
-        local now = task:get_timeval(true)
-        now = lua_util.round(now * 1000.0) -- Get milliseconds
-        lua_redis.exec_redis_script(bucket_cleanup_id,
-            { key = v.hash, task = task, is_write = true },
-            cleanup_cb,
-            { v.hash, tostring(now), tostring(settings.expire), tostring(bincr) })
+        if st then
+          -- Accepted locally, so Redis has nothing pending
+          st.pending = math.max(st.pending - bincr, 0)
+        elseif not v.is_local then
+          local now = task:get_timeval(true)
+          now = lua_util.round(now * 1000.0) -- Get milliseconds
+          lua_redis.exec_redis_script(bucket_cleanup_id,
+              { key = v.hash, task = task, is_write = true },
+              cleanup_cb,
+              { v.hash, tostring(now), tostring(settings.expire), tostring(bincr) })
+        end
       end
     end
   end
@@ -657,12 +801,28 @@ local function ratelimit_update_cb(task)
         bincr = 1
       end
 
-      lua_redis.exec_redis_script(bucket_update_id,
-          { key = v.hash, task = task, is_write = true },
-          update_bucket_cb,
-          { v.hash, tostring(now), tostring(mult_rate), tostring(mult_burst),
-            tostring(settings.max_rate_mult), tostring(settings.max_bucket_mult),
-            tostring(settings.expire), tostring(bincr) })
+      if v.is_local then
+        local st = local_buckets[v.hash]
+
+        if st then
+          st.pending = math.max(st.pending - bincr, 0)
+          st.delta = st.delta + bincr
+          st.mult_rate = st.mult_rate * mult_rate
+          st.mult_burst = st.mult_burst * mult_burst
+          st.hits = st.hits + 1
+
+          if st.hits >= settings.local_sync_messages then
+            local_bucket_reconcile(v.hash, st, { task = task })
+          end
+        end
+      else
+          lua_redis.exec_redis_script(bucket_update_id,
+            { key = v.hash, task = task, is_write = true },
+            update_bucket_cb,
+            { v.hash, tostring(now), tostring(mult_rate), tostring(mult_burst),
+              tostring(settings.max_rate_mult), tostring(settings.max_bucket_mult),
+              tostring(settings.expire), tostring(bincr) })
+      end
     end
   end
 end
@@ -676,6 +836,10 @@ if opts then
     rspamd_logger.errx(rspamd_config, 'Legacy ratelimit config format no longer supported')
   end
 
+  if type(settings.local_sync_interval) == 'string' then
+    settings.local_sync_interval = lua_util.parse_time_interval(settings.local_sync_interval) or 1.0
+  end
+
   if opts['rates'] and type(opts['rates']) == 'table' then
     -- new way of setting limits
     fun.each(function(t, lim)
@@ -860,9 +1024,27 @@ if opts then
       callback = ratelimit_update_cb,
       augmentations = { string.format("timeout=%f", redis_params.timeout or 0.0) },
     }
+
+    if settings.local_buckets then
+      rspamd_logger.infox(rspamd_config, 'use local buckets reconciled each %s seconds or %s messages',
+          settings.local_sync_interval, settings.local_sync_messages)
+      -- Send hits that are left on termination
+      rspamd_config:register_finish_script(function(task)
+        for hash, st in pairs(local_buckets) do
+          local_bucket_reconcile(hash, st, { task = task })
+        end
+      end)
+    end
   end
 end
 
-rspamd_config:add_on_load(function(cfg, ev_base, _)
+rspamd_config:add_on_load(function(cfg, ev_base, worker)
   load_scripts(cfg, ev_base)
+
+  if settings.local_buckets and redis_params and worker:is_scanner() then
+    rspamd_config:add_periodic(ev_base, settings.local_sync_interval, function()
+      local_buckets_periodic(ev_base)
+      return true
+    end)
+  end
 end)
@@ -42,6 +42,10 @@ local N = 'rbl'
 local local_exclusions
 local white_symbols = {}
 local black_symbols = {}
+-- Rules whose requests are planned and sent at once in RBL_CALLBACK_WHITE
+local planners = {}
+-- Rules that are checked after all other rules and only if the result is not decided
+local decided_symbols = {}
 local monitored_addresses = {}
 local known_selectors = {} -- map from selector string to selector id
 local url_flag_bits = rspamd_url.flags
@@ -348,6 +352,25 @@ local function rbl_dns_process(task, rbl, to_resolve, results, err, resolve_tabl
 
 end
 
+-- Returns true if the further checks cannot change the result of a task
+local function is_decided(task)
+  if task:has_pre_result() then
+    return true
+  end
+
+  local reject_score = task:get_metric_threshold('reject')
+
+  if reject_score then
+    local score = task:get_metric_score()[1]
+
+    if score and score >= reject_score then
+      return true
+    end
+  end
+
+  return false
+end
+
 local function gen_rbl_callback(rule)
   local function is_whitelisted(task, req, req_str, whitelist, what)
     if rule.ignore_whitelist then
@@ -897,24 +920,48 @@ local function gen_rbl_callback(rule)
   end
   local match = matchers[rule.returncodes_matcher]
 
-  local callback_f = function(task)
-    -- DNS requests to issue (might be hashed afterwards)
+  -- Executes functions pipeline and returns DNS requests to issue (might be hashed afterwards)
+  local function plan_requests(task)
     local dns_req = {}
     local whitelist = task:cache_get('rbl_whitelisted') or {}
 
-    local function gen_rbl_dns_callback(resolve_table_elt)
-      return function(_, to_resolve, results, err)
-        rbl_dns_process(task, rule, to_resolve, results, err, resolve_table_elt, match)
-      end
-    end
-
-    -- Execute functions pipeline
     for i, f in ipairs(pipeline) do
       if not f(task, dns_req, whitelist) then
         lua_util.debugm(N, task,
             "skip rbl check: %s; pipeline condition %s returned false",
             rule.symbol, i)
-        return
+        return nil
+      end
+    end
+
+    return dns_req
+  end
+
+  local callback_f = function(task)
+    if rule.skip_decided and is_decided(task) then
+      lua_util.debugm(N, task,
+          "skip rbl check: %s; result is already decided",
+          rule.symbol)
+      return
+    end
+
+    local dns_req
+    -- Requests might have been planned for all rules at once
+    local planned = task:cache_get('rbl_planned')
+
+    if planned and planned[rule.symbol] ~= nil then
+      dns_req = planned[rule.symbol]
+    else
+      dns_req = plan_requests(task)
+    end
+
+    if not dns_req then
+      return
+    end
+
+    local function gen_rbl_dns_callback(resolve_table_elt)
+      return function(_, to_resolve, results, err)
+        rbl_dns_process(task, rule, to_resolve, results, err, resolve_table_elt, match)
       end
     end
 
@@ -1008,7 +1055,14 @@ local function gen_rbl_callback(rule)
     end
   end
 
-  return callback_f, string.format('checks: %s', table.concat(description, ','))
+  -- Rules that depend on other symbols cannot be planned before they are processed
+  local plan_f
+  if not (rule.require_symbols or rule.dkim or rule.skip_decided or
+      rule.is_whitelist or rule.ignore_whitelist) then
+    plan_f = plan_requests
+  end
+
+  return callback_f, string.format('checks: %s', table.concat(description, ',')), plan_f
 end
 
 local map_match_types = {
@@ -1127,7 +1181,7 @@ local function add_rbl(key, rbl, global_opts)
         rbl.symbol)
   end
 
-  local callback, description = gen_rbl_callback(rbl)
+  local callback, description, planner = gen_rbl_callback(rbl)
 
   if callback then
     local id
@@ -1194,6 +1248,16 @@ local function add_rbl(key, rbl, global_opts)
       end
     end
 
+    if rbl.skip_decided then
+      table.insert(decided_symbols, check_sym)
+    elseif planner and global_opts.plan_requests ~= false then
+      table.insert(planners, {
+        symbol = rbl.symbol,
+        check_symbol = check_sym,
+        plan = planner,
+      })
+    end
+
     -- Failure symbol
     rspamd_config:register_symbol {
       type = 'virtual',
@@ -1390,6 +1454,46 @@ local function rbl_callback_white(task)
   task:cache_set('rbl_whitelisted', whitelisted_elements)
 
   lua_util.debugm(N, task, "finished rbl whitelists processing")
+
+  if #planners == 0 then
+    return
+  end
+
+  -- Collect requests of all rules, so the same names are resolved once and
+  -- all requests are sent without waiting for the rules to be scheduled
+  local planned = {}
+  local names = {}
+  local nplanned = 0
+
+  for _, p in ipairs(planners) do
+    if task:is_symbol_enabled(p.check_symbol) then
+      local dns_req = p.plan(task)
+      planned[p.symbol] = dns_req or false
+
+      if dns_req then
+        nplanned = nplanned + 1
+        for _, req in pairs(dns_req) do
+          -- Names are resolved first for resolve_ip requests, so we cannot know the final one
+          if not req.resolve_ip and validate_dns(req.n) then
+            names[req.n] = true
+          end
+        end
+      end
+    end
+  end
+
+  task:cache_set('rbl_planned', planned)
+
+  local r = task:get_resolver()
+  local nnames = 0
+  for name, _ in pairs(names) do
+    if r:prefetch(task, name) then
+      nnames = nnames + 1
+    end
+  end
+
+  lua_util.debugm(N, task, "planned %s rbl rules, prefetched %s unique names",
+      nplanned, nnames)
 end
 
 local function rbl_callback_fin(task)
@@ -1423,3 +1527,13 @@ for _, b in ipairs(black_symbols) do
   rspamd_config:register_dependency(b, 'RBL_CALLBACK_WHITE')
   rspamd_config:register_dependency('RBL_CALLBACK', b)
 end
+
+-- Low value rules are checked when the results of all other rules are known
+local decided_set = lua_util.list_to_hash(decided_symbols)
+for _, d in ipairs(decided_symbols) do
+  for _, b in ipairs(black_symbols) do
+    if not decided_set[b] then
+      rspamd_config:register_dependency(d, b)
+    end
+  end
+end
@@ -665,7 +665,7 @@ local function process_replace(words, tbl)
   tbl[words[2]] = re
 end
 
-local function process_sa_conf(f)
+local function process_sa_conf(content)
   local cur_rule = {}
   local valid_rule = false
 
@@ -711,7 +711,7 @@ local function process_sa_conf(f)
 
   local skip_to_endif = false
   local if_nested = 0
-  for l in f:lines() do
+  for l in content:lines(true) do
     (function()
       l = lua_util.rspamd_str_trim(l)
       -- Replace bla=~/re/ with bla =~ /re/ (#2372)
@@ -1719,6 +1719,20 @@ if type(section) == "table" then
     end },
   }
 
+  local sa_files = {}
+
+  local function add_sa_files(pattern)
+    local files = util.glob(pattern)
+
+    if not files or #files == 0 then
+      rspamd_logger.errx(rspamd_config, "cannot find any files matching pattern %s", pattern)
+    else
+      for _, matched in ipairs(files) do
+        table.insert(sa_files, matched)
+      end
+    end
+  end
+
   for k, fn in pairs(section) do
     local kw = keywords[k]
     if kw and type(fn) == kw[1] then
@@ -1727,44 +1741,27 @@ if type(section) == "table" then
       -- SA rule file
       if type(fn) == 'table' then
         for _, elt in ipairs(fn) do
-          local files = util.glob(elt)
-
-          if not files or #files == 0 then
-            rspamd_logger.errx(rspamd_config, "cannot find any files matching pattern %s", elt)
-          else
-            for _, matched in ipairs(files) do
-              local f = io.open(matched, "r")
-              if f then
-                rspamd_logger.infox(rspamd_config, 'loading SA rules from %s', matched)
-                process_sa_conf(f)
-                has_rules = true
-              else
-                rspamd_logger.errx(rspamd_config, "cannot open %1", matched)
-              end
-            end
-          end
+          add_sa_files(elt)
         end
       else
         -- assume string
-        local files = util.glob(fn)
-
-        if not files or #files == 0 then
-          rspamd_logger.errx(rspamd_config, "cannot find any files matching pattern %s", fn)
-        else
-          for _, matched in ipairs(files) do
-            local f = io.open(matched, "r")
-            if f then
-              rspamd_logger.infox(rspamd_config, 'loading SA rules from %s', matched)
-              process_sa_conf(f)
-              has_rules = true
-            else
-              rspamd_logger.errx(rspamd_config, "cannot open %1", matched)
-            end
-          end
-        end
+        add_sa_files(fn)
       end
     end
   end
+
+  -- Files are read in parallel, but rules are processed in the original order
+  local contents, errors = util.read_files(sa_files)
+
+  for i, matched in ipairs(sa_files) do
+    if contents[i] then
+      rspamd_logger.infox(rspamd_config, 'loading SA rules from %s', matched)
+      process_sa_conf(contents[i])
+      has_rules = true
+    else
+      rspamd_logger.errx(rspamd_config, "cannot open %1: %2", matched, errors[i])
+    end
+  end
 end
 
 if has_rules then
@@ -31,6 +31,10 @@ spf {
   spf_cache_size = 2048;
   # Default max expire for an element in this cache
   spf_cache_expire = 1d;
+  # Number of flattened SPF records shared between all worker processes (0 to disable)
+  shared_cache_size = 0;
+  # Refresh shared records when this fraction of their TTL is left
+  shared_cache_refresh = 0.1;
   # Whitelist IPs from checks
   whitelist = "/path/to/some/file";
   # Maximum number of recursive DNS subrequests (e.g. includes chanin length)
@@ -60,6 +64,7 @@ local symbols = {
 
 local default_config = {
   spf_cache_size = 2048,
+  shared_cache_size = 0,
   max_dns_nesting = 10,
   max_dns_requests = 30,
   whitelist = nil,
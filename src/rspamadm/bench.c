@@ -0,0 +1,799 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libserver/dns.h"
+#include "libserver/maps/map.h"
+#include "libserver/worker_util.h"
+#include "libserver/rspamd_symcache.h"
+#include "libmime/scan_result.h"
+#include "libstat/stat_api.h"
+#include "libutil/util.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static char *config = NULL;
+static int nworkers = 1;
+static int repeats = 1;
+static double task_timeout = 8.0;
+static double warmup = 1.0;
+static int nsymbols_out = 20;
+static char *disable_symbols = NULL;
+static gboolean compact = FALSE;
+static gboolean skip_template = FALSE;
+static char *replay_file = NULL;
+static char *record_file = NULL;
+static double replay_latency = -1.0;
+extern struct rspamd_main *rspamd_main;
+/* Defined in modules.c */
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static void rspamadm_bench(int argc, char **argv,
+						   const struct rspamadm_command *cmd);
+static const char *rspamadm_bench_help(gboolean full_help,
+									   const struct rspamadm_command *cmd);
+
+struct rspamadm_command bench_command = {
+	.name = "bench",
+	.flags = 0,
+	.help = rspamadm_bench_help,
+	.run = rspamadm_bench,
+	.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+	{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+	 "Config file to use", NULL},
+	{"workers", 'j', 0, G_OPTION_ARG_INT, &nworkers,
+	 "Number of processes to scan messages (1 by default)", NULL},
+	{"repeat", 'n', 0, G_OPTION_ARG_INT, &repeats,
+	 "Number of passes over the corpus (1 by default)", NULL},
+	{"timeout", 't', 0, G_OPTION_ARG_DOUBLE, &task_timeout,
+	 "Timeout for a message (8 seconds by default)", NULL},
+	{"warmup", 'w', 0, G_OPTION_ARG_DOUBLE, &warmup,
+	 "Time to load maps before scanning (1 second by default)", NULL},
+	{"symbols", 's', 0, G_OPTION_ARG_INT, &nsymbols_out,
+	 "Number of the most expensive symbols to show (20 by default, 0 to show all)", NULL},
+	{"disable", 'd', 0, G_OPTION_ARG_STRING, &disable_symbols,
+	 "Comma separated list of symbols to disable (e.g. network rules)", NULL},
+	{"compact", 'C', 0, G_OPTION_ARG_NONE, &compact,
+	 "Compact JSON output", NULL},
+	{"skip-template", 'T', 0, G_OPTION_ARG_NONE, &skip_template,
+	 "Do not apply Jinja templates", NULL},
+	{"replay", 'r', 0, G_OPTION_ARG_FILENAME, &replay_file,
+	 "Replay dns, redis, http and tcp replies recorded to this file", NULL},
+	{"record", 'R', 0, G_OPTION_ARG_FILENAME, &record_file,
+	 "Record dns, redis, http and tcp replies to this file", NULL},
+	{"replay-latency", 'l', 0, G_OPTION_ARG_DOUBLE, &replay_latency,
+	 "Delay of replayed replies with no recorded latency (from config by default)", NULL},
+	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+struct rspamadm_bench_message {
+	const char *begin;
+	gsize len;
+};
+
+struct rspamadm_bench_symbol {
+	uint64_t count;
+	uint64_t usec;
+};
+
+/* Shared by all scanning processes */
+struct rspamadm_bench_shared {
+	struct rspamd_stat stat;
+	uint64_t failed;
+	uint64_t bytes;
+	uint64_t pool_bytes;
+	uint64_t pool_peak;
+	double elapsed[RSPAMD_STAT_MAX_SLOTS]; /* scanning time of each process */
+	unsigned int nsymbols;
+	struct rspamadm_bench_symbol symbols[];
+};
+
+struct rspamadm_bench_ctx {
+	struct rspamd_config *cfg;
+	struct ev_loop *event_loop;
+	struct rspamd_dns_resolver *resolver;
+	GArray *messages;
+	struct rspamadm_bench_shared *shared;
+	gboolean done;
+};
+
+static const char *
+rspamadm_bench_help(gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Measure scan throughput of the configuration on a corpus of messages\n\n"
+				   "Usage: rspamadm bench [-c <config_name>] [-j <workers>] <file|dir|mbox>...\n"
+				   "Where options are:\n\n"
+				   "-c: config file to use\n"
+				   "-j: number of processes to scan messages\n"
+				   "-n: number of passes over the corpus\n"
+				   "-t: timeout for a message\n"
+				   "-w: time to load maps before scanning\n"
+				   "-s: number of the most expensive symbols to show\n"
+				   "-d: comma separated list of symbols to disable\n"
+				   "-C: compact JSON output\n"
+				   "-r: replay network replies recorded to a file\n"
+				   "-R: record network replies to a file\n"
+				   "-l: delay of replayed replies with no recorded latency\n"
+				   "--help: shows available options and commands\n\n"
+				   "Directories (including maildirs) are scanned recursively,\n"
+				   "files starting with `From ` are split as mboxes.\n"
+				   "Replies recorded with `-R` are replayed with `-r` to scan\n"
+				   "the corpus without network access.\n"
+				   "Results are printed as JSON.";
+	}
+	else {
+		help_str = "Measure scan throughput on a corpus of messages";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger(rspamd_mempool_t *pool, gpointer ud)
+{
+}
+
+static void
+rspamadm_bench_add_mbox(GArray *messages, const char *data, gsize len)
+{
+	const char *p = data, *end = data + len, *msg_start = NULL, *eol;
+	struct rspamadm_bench_message msg;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+
+		if (eol - p > 5 && memcmp(p, "From ", 5) == 0) {
+			/* Separator line is not a part of a message */
+			if (msg_start && p > msg_start) {
+				msg.begin = msg_start;
+				msg.len = p - msg_start;
+				g_array_append_val(messages, msg);
+			}
+
+			msg_start = eol;
+		}
+
+		p = eol;
+	}
+
+	if (msg_start && end > msg_start) {
+		msg.begin = msg_start;
+		msg.len = end - msg_start;
+		g_array_append_val(messages, msg);
+	}
+}
+
+static gboolean
+rspamadm_bench_add_path(GArray *messages, GPtrArray *buffers, const char *path)
+{
+	struct stat st;
+	struct rspamadm_bench_message msg;
+
+	if (stat(path, &st) == -1) {
+		rspamd_fprintf(stderr, "cannot stat %s: %s\n", path, strerror(errno));
+		return FALSE;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		GDir *dir;
+		GError *err = NULL;
+		const char *name;
+
+		dir = g_dir_open(path, 0, &err);
+
+		if (dir == NULL) {
+			rspamd_fprintf(stderr, "cannot open %s: %e\n", path, err);
+			g_error_free(err);
+			return FALSE;
+		}
+
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *fpath = g_build_filename(path, name, NULL);
+
+			rspamadm_bench_add_path(messages, buffers, fpath);
+			g_free(fpath);
+		}
+
+		g_dir_close(dir);
+	}
+	else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		char *data;
+		gsize len;
+		GError *err = NULL;
+
+		if (!g_file_get_contents(path, &data, &len, &err)) {
+			rspamd_fprintf(stderr, "cannot read %s: %e\n", path, err);
+			g_error_free(err);
+			return FALSE;
+		}
+
+		g_ptr_array_add(buffers, data);
+
+		if (len > 5 && memcmp(data, "From ", 5) == 0) {
+			rspamadm_bench_add_mbox(messages, data, len);
+		}
+		else {
+			msg.begin = data;
+			msg.len = len;
+			g_array_append_val(messages, msg);
+		}
+	}
+
+	return TRUE;
+}
+
+static void
+rspamadm_bench_warmup_cb(EV_P_ ev_timer *w, int revents)
+{
+	ev_break(EV_A_ EVBREAK_ONE);
+}
+
+static gboolean
+rspamadm_bench_task_fin(struct rspamd_task *task, void *ud)
+{
+	struct rspamadm_bench_ctx *ctx = (struct rspamadm_bench_ctx *) ud;
+	struct rspamadm_bench_shared *shared = ctx->shared;
+	struct rspamd_stat *stat = &shared->stat;
+	struct rspamd_action *action;
+	GHashTable *profile;
+	GHashTableIter it;
+	gpointer k, v;
+	gsize pool_bytes;
+	int id;
+
+	rspamd_task_set_finish_time(task);
+
+	if (task->result != NULL) {
+		action = rspamd_check_action_metric(task, NULL, NULL);
+
+		if (action->action_type < METRIC_ACTION_MAX) {
+			RSPAMD_STAT_INC(stat, actions_stat[action->action_type]);
+		}
+	}
+
+	RSPAMD_STAT_INC(stat, messages_scanned);
+	rspamd_stat_hist_add(stat, RSPAMD_STAT_HIST_TASK,
+						 (task->time_real_finish - task->task_timestamp) * 1e6);
+	rspamd_stat_hist_add(stat, RSPAMD_STAT_HIST_MESSAGE_SIZE, task->msg.len);
+	RSPAMD_STAT_ADD(shared, bytes, task->msg.len);
+
+	pool_bytes = rspamd_mempool_get_used_size(task->task_pool);
+	RSPAMD_STAT_ADD(shared, pool_bytes, pool_bytes);
+
+	if (pool_bytes > shared->pool_peak) {
+		/* Approximate, processes could race here */
+		shared->pool_peak = pool_bytes;
+	}
+
+	profile = rspamd_mempool_get_variable(task->task_pool, "profile");
+
+	if (profile) {
+		g_hash_table_iter_init(&it, profile);
+
+		while (g_hash_table_iter_next(&it, &k, &v)) {
+			id = rspamd_symcache_find_symbol(task->cfg->cache, (const char *) k);
+
+			if (id >= 0 && id < shared->nsymbols) {
+				RSPAMD_STAT_INC(shared, symbols[id].count);
+				RSPAMD_STAT_ADD(shared, symbols[id].usec,
+								(uint64_t) (*(double *) v * 1e3));
+			}
+		}
+	}
+
+	ctx->done = TRUE;
+
+	return TRUE;
+}
+
+static void
+rspamadm_bench_scan(struct rspamadm_bench_ctx *ctx,
+					const struct rspamadm_bench_message *msg)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new(NULL, ctx->cfg, NULL, ctx->cfg->lang_det,
+						   ctx->event_loop, FALSE);
+	/* Per symbol timings are taken from the task profile */
+	task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+	task->resolver = ctx->resolver;
+	task->fin_callback = rspamadm_bench_task_fin;
+	task->fin_arg = ctx;
+	task->s = rspamd_session_create(task->task_pool, rspamd_task_fin,
+									NULL, (event_finalizer_t) rspamd_task_free, task);
+
+	if (!rspamd_task_load_message(task, NULL, msg->begin, msg->len)) {
+		RSPAMD_STAT_INC(ctx->shared, failed);
+		rspamd_session_destroy(task->s);
+
+		return;
+	}
+
+	if (task_timeout > 0) {
+		task->timeout_ev.data = task;
+		ev_timer_init(&task->timeout_ev, rspamd_task_timeout,
+					  task_timeout, task_timeout);
+		ev_set_priority(&task->timeout_ev, EV_MAXPRI);
+		ev_timer_start(ctx->event_loop, &task->timeout_ev);
+		task->deadline = ev_now(ctx->event_loop) + task_timeout;
+	}
+
+	ctx->done = FALSE;
+
+	if (!rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL)) {
+		RSPAMD_STAT_INC(ctx->shared, failed);
+	}
+
+	if (!ctx->done) {
+		/* Calls finaliser if there are no pending events */
+		rspamd_session_pending(task->s);
+	}
+
+	while (!ctx->done) {
+		ev_run(ctx->event_loop, EVRUN_ONCE);
+	}
+
+	rspamd_session_destroy(task->s);
+}
+
+static void
+rspamadm_bench_process(struct rspamadm_bench_ctx *ctx, int idx)
+{
+	struct rspamd_config *cfg = ctx->cfg;
+	ev_timer warmup_ev;
+	double start;
+	unsigned int i;
+	int rep;
+
+	ctx->resolver = rspamd_dns_resolver_init(rspamd_main->logger,
+											 ctx->event_loop, cfg);
+
+	if (replay_latency >= 0) {
+		ctx->resolver->replay_latency = replay_latency;
+	}
+
+	/* Each scanning process loads replies and opens the record file itself */
+	rspamd_dns_resolver_replay(ctx->resolver, cfg, replay_file, record_file);
+	rspamd_upstreams_library_config(cfg, cfg->ups_ctx, ctx->event_loop,
+									ctx->resolver->r);
+	rspamd_stat_init(cfg, ctx->event_loop);
+	rspamd_map_watch(cfg, ctx->event_loop, ctx->resolver, NULL,
+					 RSPAMD_MAP_WATCH_PRIMARY_CONTROLLER);
+	rspamd_lua_run_postloads(RSPAMD_LUA_CFG_STATE(cfg), cfg, ctx->event_loop, NULL);
+
+	if (warmup > 0) {
+		ev_timer_init(&warmup_ev, rspamadm_bench_warmup_cb, warmup, 0.0);
+		ev_timer_start(ctx->event_loop, &warmup_ev);
+		ev_run(ctx->event_loop, 0);
+		ev_timer_stop(ctx->event_loop, &warmup_ev);
+	}
+
+	start = rspamd_get_ticks(FALSE);
+
+	for (rep = 0; rep < repeats; rep++) {
+		for (i = idx; i < ctx->messages->len; i += nworkers) {
+			rspamadm_bench_scan(ctx,
+								&g_array_index(ctx->messages, struct rspamadm_bench_message, i));
+		}
+	}
+
+	ctx->shared->elapsed[idx] = rspamd_get_ticks(FALSE) - start;
+}
+
+/* Returns the upper bound of a quantile in seconds */
+static double
+rspamadm_bench_hist_quantile(const struct rspamd_stat_hist *hist, uint64_t count,
+							 double q)
+{
+	uint64_t target = q * count, seen = 0;
+
+	for (unsigned int i = 0; i < RSPAMD_STAT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+
+		if (seen > target) {
+			return rspamd_stat_hist_bucket_bound(i) * 1e-6;
+		}
+	}
+
+	return rspamd_stat_hist_bucket_bound(RSPAMD_STAT_HIST_BUCKETS - 1) * 1e-6;
+}
+
+static ucl_object_t *
+rspamadm_bench_hist_ucl(const struct rspamd_stat_hist *hist)
+{
+	ucl_object_t *obj;
+	uint64_t count = 0;
+
+	for (unsigned int i = 0; i < RSPAMD_STAT_HIST_BUCKETS; i++) {
+		count += hist->buckets[i];
+	}
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	obj = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(obj, ucl_object_fromint(count), "count", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromdouble(hist->sum * 1e-6 / count),
+						  "mean", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromdouble(rspamadm_bench_hist_quantile(hist, count, 0.5)),
+						  "p50", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromdouble(rspamadm_bench_hist_quantile(hist, count, 0.9)),
+						  "p90", 0, false);
+	ucl_object_insert_key(obj,
+						  ucl_object_fromdouble(rspamadm_bench_hist_quantile(hist, count, 0.99)),
+						  "p99", 0, false);
+
+	return obj;
+}
+
+static int
+rspamadm_bench_symbols_cmp(const void *a, const void *b, gpointer ud)
+{
+	const struct rspamadm_bench_shared *shared = (const struct rspamadm_bench_shared *) ud;
+	uint64_t t1 = shared->symbols[*(const unsigned int *) a].usec,
+			 t2 = shared->symbols[*(const unsigned int *) b].usec;
+
+	return (t1 < t2) - (t1 > t2);
+}
+
+static ucl_object_t *
+rspamadm_bench_result_ucl(struct rspamd_config *cfg,
+						  struct rspamadm_bench_shared *shared,
+						  const rspamd_mempool_stat_t *mem_start)
+{
+	struct rspamd_stat *stat = &shared->stat;
+	ucl_object_t *top, *sub, *elt;
+	rspamd_mempool_stat_t mem_st;
+	struct rusage ru;
+	unsigned int i, nscanned = stat->messages_scanned;
+	double elapsed = 0;
+	static const struct {
+		unsigned int type;
+		const char *name;
+	} latency_hists[] = {
+		{RSPAMD_STAT_HIST_DNS, "dns"},
+		{RSPAMD_STAT_HIST_REDIS, "redis"},
+		{RSPAMD_STAT_HIST_HTTP, "http"},
+	};
+
+	/* Throughput is limited by the slowest process */
+	for (i = 0; i < nworkers; i++) {
+		elapsed = MAX(elapsed, shared->elapsed[i]);
+	}
+
+	top = ucl_object_typed_new(UCL_OBJECT);
+	ucl_object_insert_key(top, ucl_object_fromstring(RVERSION), "version", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromstring(cfg->checksum), "config_id", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(nworkers), "workers", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(nscanned), "messages", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromint(shared->failed), "failed", 0, false);
+	ucl_object_insert_key(top, ucl_object_fromdouble(elapsed), "elapsed", 0, false);
+
+	if (elapsed > 0) {
+		ucl_object_insert_key(top, ucl_object_fromdouble(nscanned / elapsed),
+							  "messages_per_second", 0, false);
+		ucl_object_insert_key(top, ucl_object_fromdouble(shared->bytes / elapsed),
+							  "bytes_per_second", 0, false);
+	}
+
+	elt = rspamadm_bench_hist_ucl(&stat->hist[RSPAMD_STAT_HIST_TASK]);
+
+	if (elt) {
+		ucl_object_insert_key(top, elt, "scan_time", 0, false);
+	}
+
+	sub = ucl_object_typed_new(UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_STAT_HIST_STAGES; i++) {
+		elt = rspamadm_bench_hist_ucl(&stat->hist[RSPAMD_STAT_HIST_STAGE + i]);
+
+		if (elt) {
+			ucl_object_insert_key(sub, elt, rspamd_task_stage_name(1u << i), 0, true);
+		}
+	}
+
+	ucl_object_insert_key(top, sub, "stages", 0, false);
+
+	sub = ucl_object_typed_new(UCL_OBJECT);
+
+	for (i = 0; i < G_N_ELEMENTS(latency_hists); i++) {
+		elt = rspamadm_bench_hist_ucl(&stat->hist[latency_hists[i].type]);
+
+		if (elt) {
+			ucl_object_insert_key(sub, elt, latency_hists[i].name, 0, false);
+		}
+	}
+
+	ucl_object_insert_key(top, sub, "latency", 0, false);
+
+	sub = ucl_object_typed_new(UCL_OBJECT);
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i++) {
+		if (stat->actions_stat[i] > 0) {
+			ucl_object_insert_key(sub, ucl_object_fromint(stat->actions_stat[i]),
+								  rspamd_action_to_str(i), 0, false);
+		}
+	}
+
+	ucl_object_insert_key(top, sub, "actions", 0, false);
+
+	/* Symbols sorted by the total time spent */
+	GArray *ids = g_array_sized_new(FALSE, FALSE, sizeof(unsigned int), shared->nsymbols);
+
+	for (i = 0; i < shared->nsymbols; i++) {
+		if (shared->symbols[i].count > 0) {
+			g_array_append_val(ids, i);
+		}
+	}
+
+	g_array_sort_with_data(ids, rspamadm_bench_symbols_cmp, shared);
+	sub = ucl_object_typed_new(UCL_ARRAY);
+
+	for (i = 0; i < ids->len && (nsymbols_out <= 0 || i < nsymbols_out); i++) {
+		unsigned int id = g_array_index(ids, unsigned int, i);
+		const struct rspamadm_bench_symbol *sym = &shared->symbols[id];
+
+		elt = ucl_object_typed_new(UCL_OBJECT);
+		ucl_object_insert_key(elt,
+							  ucl_object_fromstring(rspamd_symcache_symbol_by_id(cfg->cache, id)),
+							  "symbol", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromint(sym->count), "count", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromdouble(sym->usec * 1e-6),
+							  "total", 0, false);
+		ucl_object_insert_key(elt, ucl_object_fromdouble(sym->usec * 1e-6 / sym->count),
+							  "mean", 0, false);
+		ucl_array_append(sub, elt);
+	}
+
+	g_array_free(ids, TRUE);
+	ucl_object_insert_key(top, sub, "symbols", 0, false);
+
+	memset(&mem_st, 0, sizeof(mem_st));
+	rspamd_mempool_stat(&mem_st);
+	sub = ucl_object_typed_new(UCL_OBJECT);
+
+	if (nscanned > 0) {
+		ucl_object_insert_key(sub,
+							  ucl_object_fromdouble((double) shared->pool_bytes / nscanned),
+							  "task_pool_bytes", 0, false);
+		ucl_object_insert_key(sub,
+							  ucl_object_fromdouble((double) (mem_st.pools_allocated - mem_start->pools_allocated) / nscanned),
+							  "pools_per_message", 0, false);
+		ucl_object_insert_key(sub,
+							  ucl_object_fromdouble((double) (mem_st.chunks_allocated - mem_start->chunks_allocated) / nscanned),
+							  "chunks_per_message", 0, false);
+	}
+
+	ucl_object_insert_key(sub, ucl_object_fromint(shared->pool_peak),
+						  "task_pool_peak", 0, false);
+	ucl_object_insert_key(sub,
+						  ucl_object_fromint(mem_st.oversized_chunks - mem_start->oversized_chunks),
+						  "oversized_chunks", 0, false);
+
+	if (getrusage(nworkers > 1 ? RUSAGE_CHILDREN : RUSAGE_SELF, &ru) != -1) {
+		/* Kilobytes on Linux and bytes on BSD */
+		ucl_object_insert_key(sub, ucl_object_fromint(ru.ru_maxrss), "max_rss", 0, false);
+	}
+
+	ucl_object_insert_key(top, sub, "memory", 0, false);
+
+	return top;
+}
+
+static void
+rspamadm_bench(int argc, char **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const char *confdir;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamadm_bench_ctx ctx;
+	struct rspamadm_bench_shared *shared;
+	rspamd_mempool_stat_t mem_start;
+	GPtrArray *buffers;
+	gsize shared_size;
+	worker_t **pworker;
+	ucl_object_t *res;
+	unsigned char *out;
+	int i;
+
+	context = g_option_context_new(
+		"bench - measure scan throughput on a corpus of messages");
+	g_option_context_set_summary(context,
+								 "Summary:\n  Rspamd administration utility version " RVERSION
+								 "\n  Release id: " RID);
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "option parsing failed: %s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (argc < 2) {
+		rspamd_fprintf(stderr, "no messages to scan specified\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (nworkers < 1) {
+		nworkers = 1;
+	}
+	else if (nworkers > RSPAMD_STAT_MAX_SLOTS) {
+		nworkers = RSPAMD_STAT_MAX_SLOTS;
+	}
+
+	if (repeats < 1) {
+		repeats = 1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.messages = g_array_new(FALSE, FALSE, sizeof(struct rspamadm_bench_message));
+	buffers = g_ptr_array_new_with_free_func(g_free);
+
+	for (i = 1; i < argc; i++) {
+		rspamadm_bench_add_path(ctx.messages, buffers, argv[i]);
+	}
+
+	if (ctx.messages->len == 0) {
+		rspamd_fprintf(stderr, "no messages found\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (config == NULL) {
+		static char fbuf[PATH_MAX];
+
+		if ((confdir = g_hash_table_lookup(ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		rspamd_snprintf(fbuf, sizeof(fbuf), "%s%c%s",
+						confdir, G_DIR_SEPARATOR,
+						"rspamd.conf");
+		config = fbuf;
+	}
+
+	pworker = &workers[0];
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string((*pworker)->name);
+		pworker++;
+	}
+
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read(cfg, cfg->cfg_name, config_logger, rspamd_main,
+							ucl_vars, skip_template, lua_env)) {
+		rspamd_fprintf(stderr, "cannot load config %s\n", config);
+		exit(EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config(cfg);
+
+	if (!rspamd_init_filters(cfg, false, false)) {
+		rspamd_fprintf(stderr, "cannot init filters from %s\n", config);
+		exit(EXIT_FAILURE);
+	}
+
+	if (disable_symbols) {
+		/* Must be done before symcache is initialised */
+		char **syms = g_strsplit_set(disable_symbols, ",; ", -1);
+
+		for (char **psym = syms; *psym; psym++) {
+			if (**psym) {
+				rspamd_symcache_disable_symbol_static(cfg->cache, *psym);
+			}
+		}
+
+		g_strfreev(syms);
+	}
+
+	if (!rspamd_config_post_load(cfg, RSPAMD_CONFIG_LOAD_ALL & ~RSPAMD_CONFIG_INIT_VALIDATE)) {
+		rspamd_fprintf(stderr, "cannot init config %s\n", config);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Redis, http and tcp replies are replayed by lua modules */
+	if (replay_file) {
+		cfg->io_replay = replay_file;
+	}
+
+	if (record_file) {
+		cfg->io_record = record_file;
+	}
+
+	if (replay_latency >= 0) {
+		cfg->io_replay_latency = replay_latency;
+	}
+
+	/* Counters are updated by all scanning processes */
+	shared_size = sizeof(*shared) +
+				  sizeof(struct rspamadm_bench_symbol) * rspamd_symcache_items_count(cfg->cache);
+	shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+				  MAP_ANON | MAP_SHARED, -1, 0);
+
+	if (shared == MAP_FAILED) {
+		rspamd_fprintf(stderr, "cannot allocate %z bytes: %s\n", shared_size,
+					   strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(shared, 0, shared_size);
+	shared->nsymbols = rspamd_symcache_items_count(cfg->cache);
+	/* Stage and network latencies are collected as if we were a worker */
+	rspamd_worker_stat_set_standalone(&shared->stat);
+
+	ctx.cfg = cfg;
+	ctx.event_loop = rspamd_main->event_loop;
+	ctx.shared = shared;
+
+	memset(&mem_start, 0, sizeof(mem_start));
+	rspamd_mempool_stat(&mem_start);
+
+	if (nworkers == 1) {
+		rspamadm_bench_process(&ctx, 0);
+	}
+	else {
+		for (i = 0; i < nworkers; i++) {
+			pid_t pid = fork();
+
+			if (pid == 0) {
+				ev_loop_fork(ctx.event_loop);
+				rspamadm_bench_process(&ctx, i);
+				_exit(EXIT_SUCCESS);
+			}
+			else if (pid == -1) {
+				rspamd_fprintf(stderr, "cannot fork: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		while (wait(NULL) > 0 || errno == EINTR) {
+			/* Wait for all scanning processes */
+		}
+	}
+
+	rspamd_worker_stat_set_standalone(NULL);
+	res = rspamadm_bench_result_ucl(cfg, shared, &mem_start);
+	out = ucl_object_emit(res, compact ? UCL_EMIT_JSON_COMPACT : UCL_EMIT_JSON);
+	rspamd_printf("%s\n", out);
+	free(out);
+	ucl_object_unref(res);
+
+	munmap(shared, shared_size);
+	g_array_free(ctx.messages, TRUE);
+	g_ptr_array_free(buffers, TRUE);
+}
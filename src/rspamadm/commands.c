@@ -26,8 +26,11 @@ extern struct rspamadm_command control_command;
 extern struct rspamadm_command confighelp_command;
 extern struct rspamadm_command statconvert_command;
 extern struct rspamadm_command fuzzyconvert_command;
+extern struct rspamadm_command fuzzyload_command;
+extern struct rspamadm_command mapcompile_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
+extern struct rspamadm_command bench_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -38,8 +41,11 @@ const struct rspamadm_command *commands[] = {
 	&confighelp_command,
 	&statconvert_command,
 	&fuzzyconvert_command,
+	&fuzzyload_command,
+	&mapcompile_command,
 	&signtool_command,
 	&lua_command,
+	&bench_command,
 	NULL};
 
 
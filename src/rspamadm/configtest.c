@@ -24,6 +24,7 @@ static gboolean quiet = FALSE;
 static char *config = NULL;
 static gboolean strict = FALSE;
 static gboolean skip_template = FALSE;
+static char *cfg_snapshot = NULL;
 extern struct rspamd_main *rspamd_main;
 /* Defined in modules.c */
 extern module_t *modules[];
@@ -51,6 +52,8 @@ static GOptionEntry entries[] = {
 	 "Stop on any error in config", NULL},
 	{"skip-template", 'T', 0, G_OPTION_ARG_NONE, &skip_template,
 	 "Do not apply Jinja templates", NULL},
+	{"config-snapshot", '\0', 0, G_OPTION_ARG_FILENAME, &cfg_snapshot,
+	 "Store parsed config in the specified file and load it when config files are unchanged", NULL},
 	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 static const char *
@@ -128,6 +131,7 @@ rspamadm_configtest(int argc, char **argv, const struct rspamadm_command *cmd)
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
 	cfg->cfg_name = config;
+	cfg->cfg_snapshot = cfg_snapshot;
 
 	if (!rspamd_config_read(cfg, cfg->cfg_name, config_logger, rspamd_main,
 							ucl_vars, skip_template, lua_env)) {
@@ -84,7 +84,9 @@ rspamadm_control_help(gboolean full_help, const struct rspamadm_command *cmd)
 				   "reresolve - resolve upstreams addresses\n"
 				   "recompile - recompile hyperscan regexes\n"
 				   "fuzzystat - show fuzzy statistics\n"
-				   "fuzzysync - immediately sync fuzzy database to storage\n";
+				   "fuzzysync - immediately sync fuzzy database to storage\n"
+				   "mempoolstat - show memory pools statistics per entry point\n"
+				   "restat - show the most expensive regexps\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -215,6 +217,14 @@ rspamadm_control(int argc, char **argv, const struct rspamadm_command *_cmd)
 			 g_ascii_strcasecmp(cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp(cmd, "mempoolstat") == 0 ||
+			 g_ascii_strcasecmp(cmd, "mempool_stat") == 0) {
+		path = "/mempoolstat";
+	}
+	else if (g_ascii_strcasecmp(cmd, "restat") == 0 ||
+			 g_ascii_strcasecmp(cmd, "re_stat") == 0) {
+		path = "/restat";
+	}
 	else {
 		rspamd_fprintf(stderr, "unknown command: %s\n", cmd);
 		exit(EXIT_FAILURE);
@@ -40,6 +40,9 @@ static char *redis_db = NULL;
 static char *redis_username = NULL;
 static char *redis_password = NULL;
 static int64_t fuzzy_expiry = 0;
+static int connections = 4;
+static int batch = 50;
+static char *checkpoint = NULL;
 
 static void rspamadm_fuzzyconvert(int argc, char **argv,
 								  const struct rspamadm_command *cmd);
@@ -67,6 +70,12 @@ static GOptionEntry entries[] = {
 	 "Username to connect to redis", NULL},
 	{"password", 'p', 0, G_OPTION_ARG_STRING, &redis_password,
 	 "Password to connect to redis", NULL},
+	{"connections", 'j', 0, G_OPTION_ARG_INT, &connections,
+	 "Number of redis connections with batches in flight (4 by default)", NULL},
+	{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+	 "Number of digests per batch (50 by default)", NULL},
+	{"checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &checkpoint,
+	 "Store progress in this file and resume from it", NULL},
 	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 
@@ -83,7 +92,10 @@ rspamadm_fuzzyconvert_help(gboolean full_help, const struct rspamadm_command *cm
 				   "-h: output redis ip (in format ip:port)\n"
 				   "-D: output redis database\n"
 				   "-u: redis username\n"
-				   "-p: redis password\n";
+				   "-p: redis password\n"
+				   "-j: number of redis connections with batches in flight\n"
+				   "-b: number of digests per batch\n"
+				   "--checkpoint: store progress in this file and resume from it\n";
 	}
 	else {
 		help_str = "Convert fuzzy hashes from sqlite3 to redis";
@@ -151,6 +163,16 @@ rspamadm_fuzzyconvert(int argc, char **argv, const struct rspamadm_command *cmd)
 							  "redis_db", 0, false);
 	}
 
+	ucl_object_insert_key(obj, ucl_object_fromint(connections),
+						  "connections", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(batch),
+						  "batch", 0, false);
+
+	if (checkpoint) {
+		ucl_object_insert_key(obj, ucl_object_fromstring(checkpoint),
+							  "checkpoint", 0, false);
+	}
+
 	rspamadm_execute_lua_ucl_subr(argc,
 								  argv,
 								  obj,
@@ -0,0 +1,739 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "rspamd.h"
+#include "task.h"
+#include "libmime/message.h"
+#include "lua/lua_common.h"
+#include "fuzzy_wire.h"
+#include "libserver/fuzzy_backend/fuzzy_backend.h"
+#include "unix-std.h"
+#include <sys/wait.h>
+#include <poll.h>
+
+/*
+ * Bulk load of hashes into the fuzzy storage backend: messages are hashed by
+ * the fuzzy_check plugin in several processes and the resulting commands are
+ * sent to the parent via pipes, parent writes them to the backend in batches
+ */
+
+static char *config = NULL;
+static char *flag_str = NULL;
+static char *rule_name = NULL;
+static int weight = 1;
+static int jobs = 0;
+static int batch_size = 1000;
+static gboolean digests_mode = FALSE;
+static gboolean delete_mode = FALSE;
+
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static void rspamadm_fuzzyload(int argc, char **argv,
+							   const struct rspamadm_command *cmd);
+static const char *rspamadm_fuzzyload_help(gboolean full_help,
+										   const struct rspamadm_command *cmd);
+
+struct rspamadm_command fuzzyload_command = {
+	.name = "fuzzyload",
+	.flags = 0,
+	.help = rspamadm_fuzzyload_help,
+	.run = rspamadm_fuzzyload,
+	.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+	{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+	 "Config file to use", NULL},
+	{"flag", 'f', 0, G_OPTION_ARG_STRING, &flag_str,
+	 "Flag (or symbol) to learn", NULL},
+	{"weight", 'w', 0, G_OPTION_ARG_INT, &weight,
+	 "Weight of hashes", NULL},
+	{"rule", 'r', 0, G_OPTION_ARG_STRING, &rule_name,
+	 "Fuzzy check rule used to generate hashes", NULL},
+	{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+	 "Number of processes used to hash messages (number of CPUs by default)", NULL},
+	{"batch", 'b', 0, G_OPTION_ARG_INT, &batch_size,
+	 "Number of hashes written to the backend at once", NULL},
+	{"digests", 'd', 0, G_OPTION_ARG_NONE, &digests_mode,
+	 "Input contains precomputed digests instead of messages", NULL},
+	{"delete", 'D', 0, G_OPTION_ARG_NONE, &delete_mode,
+	 "Delete hashes instead of adding them", NULL},
+	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+struct rspamadm_fuzzy_loader {
+	struct rspamd_fuzzy_backend *backend;
+	struct ev_loop *event_loop;
+	GArray *pending;
+	gboolean in_flight;
+	uint64_t nwritten;
+	uint64_t nadded;
+	uint64_t ndeleted;
+	uint64_t nextended;
+	uint64_t nignored;
+	uint64_t nfailed;
+};
+
+static const char *
+rspamadm_fuzzyload_help(gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Load hashes to the fuzzy storage backend\n\n"
+				   "Usage: rspamadm fuzzyload -f <flag> [-r <rule>] [<file|dir> ...]\n"
+				   "Where options are:\n\n"
+				   "-c: config file to use\n"
+				   "-f: flag or symbol to learn\n"
+				   "-w: weight of hashes (1 by default)\n"
+				   "-r: fuzzy_check rule to generate hashes\n"
+				   "-j: number of hashing processes\n"
+				   "-b: number of hashes in a single backend write\n"
+				   "-d: input is digests, one per line: <hex digest> [<flag> [<weight> [<32 shingles>]]]\n"
+				   "-D: delete hashes\n\n"
+				   "Messages (or digest files) are read from the arguments, "
+				   "file names are read from stdin if there are none\n";
+	}
+	else {
+		help_str = "Load hashes to the fuzzy storage backend";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger(rspamd_mempool_t *pool, gpointer ud)
+{
+}
+
+static void
+rspamadm_fuzzyload_update_cb(gboolean success,
+							 unsigned int nadded,
+							 unsigned int ndeleted,
+							 unsigned int nextended,
+							 unsigned int nignored,
+							 void *ud)
+{
+	struct rspamadm_fuzzy_loader *ld = ud;
+
+	if (success) {
+		ld->nadded += nadded;
+		ld->ndeleted += ndeleted;
+		ld->nextended += nextended;
+		ld->nignored += nignored;
+	}
+	else {
+		ld->nfailed++;
+		rspamd_fprintf(stderr, "cannot write batch to the fuzzy backend\n");
+	}
+
+	ld->in_flight = FALSE;
+}
+
+static void
+rspamadm_fuzzyload_flush(struct rspamadm_fuzzy_loader *ld)
+{
+	GArray *updates;
+
+	if (ld->pending->len == 0) {
+		return;
+	}
+
+	updates = ld->pending;
+	ld->pending = g_array_sized_new(FALSE, FALSE, sizeof(struct fuzzy_peer_cmd),
+									batch_size);
+	ld->nwritten += updates->len;
+	ld->in_flight = TRUE;
+	/* Sqlite calls back immediately, redis needs the event loop running */
+	rspamd_fuzzy_backend_process_updates(ld->backend, updates, "local",
+										 rspamadm_fuzzyload_update_cb, ld);
+
+	while (ld->in_flight) {
+		ev_run(ld->event_loop, EVRUN_ONCE);
+	}
+
+	g_array_free(updates, TRUE);
+}
+
+static void
+rspamadm_fuzzyload_push(struct rspamadm_fuzzy_loader *ld,
+						const struct fuzzy_peer_cmd *pcmd)
+{
+	g_array_append_val(ld->pending, *pcmd);
+
+	if (ld->pending->len >= batch_size) {
+		rspamadm_fuzzyload_flush(ld);
+	}
+}
+
+static void
+rspamadm_fuzzyload_add_path(GPtrArray *dest, const char *path)
+{
+	GDir *dir;
+	const char *name;
+
+	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		if ((dir = g_dir_open(path, 0, NULL)) == NULL) {
+			rspamd_fprintf(stderr, "cannot open directory %s\n", path);
+			return;
+		}
+
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *full = g_build_filename(path, name, NULL);
+
+			if (g_file_test(full, G_FILE_TEST_IS_REGULAR)) {
+				g_ptr_array_add(dest, full);
+			}
+			else {
+				g_free(full);
+			}
+		}
+
+		g_dir_close(dir);
+	}
+	else {
+		g_ptr_array_add(dest, g_strdup(path));
+	}
+}
+
+static GPtrArray *
+rspamadm_fuzzyload_inputs(int argc, char **argv)
+{
+	GPtrArray *res = g_ptr_array_new_with_free_func(g_free);
+	char buf[PATH_MAX + 1];
+	int i;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			rspamadm_fuzzyload_add_path(res, argv[i]);
+		}
+	}
+	else {
+		while (fgets(buf, sizeof(buf), stdin) != NULL) {
+			g_strchomp(buf);
+
+			if (buf[0] != '\0') {
+				rspamadm_fuzzyload_add_path(res, buf);
+			}
+		}
+	}
+
+	return res;
+}
+
+static gboolean
+rspamadm_fuzzyload_parse_digest(const char *line, int default_flag,
+								struct fuzzy_peer_cmd *pcmd)
+{
+	char **elts;
+	struct rspamd_fuzzy_cmd *cmd;
+	unsigned int nelts, i;
+	gboolean ret = FALSE;
+
+	elts = g_strsplit_set(line, " \t", -1);
+	nelts = 0;
+
+	/* Compact empty elements */
+	for (i = 0; elts[i] != NULL; i++) {
+		if (elts[i][0] != '\0') {
+			elts[nelts++] = elts[i];
+		}
+		else {
+			g_free(elts[i]);
+		}
+	}
+
+	elts[nelts] = NULL;
+
+	memset(pcmd, 0, sizeof(*pcmd));
+	cmd = &pcmd->cmd.normal;
+
+	if (nelts == 0 || elts[0][0] == '#') {
+		goto end;
+	}
+
+	if (strlen(elts[0]) != sizeof(cmd->digest) * 2 ||
+		rspamd_decode_hex_buf(elts[0], sizeof(cmd->digest) * 2,
+							  cmd->digest, sizeof(cmd->digest)) == -1) {
+		rspamd_fprintf(stderr, "bad digest: %s\n", elts[0]);
+		goto end;
+	}
+
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd = delete_mode ? FUZZY_DEL : FUZZY_WRITE;
+	cmd->flag = nelts > 1 ? strtoul(elts[1], NULL, 10) : default_flag;
+	cmd->value = nelts > 2 ? strtol(elts[2], NULL, 10) : weight;
+
+	if (nelts == 3 + RSPAMD_SHINGLE_SIZE) {
+		pcmd->is_shingle = TRUE;
+		cmd->shingles_count = RSPAMD_SHINGLE_SIZE;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+			pcmd->cmd.shingle.sgl.hashes[i] = g_ascii_strtoull(elts[3 + i],
+															   NULL, 10);
+		}
+	}
+	else if (nelts > 3) {
+		rspamd_fprintf(stderr, "bad number of shingles for %s: %ud\n",
+					   elts[0], nelts - 3);
+		goto end;
+	}
+
+	ret = TRUE;
+
+end:
+	g_strfreev(elts);
+
+	return ret;
+}
+
+static gboolean
+rspamadm_fuzzyload_digests(struct rspamadm_fuzzy_loader *ld, GPtrArray *inputs,
+						   int default_flag)
+{
+	struct fuzzy_peer_cmd pcmd;
+	char line[8192];
+	const char *fname;
+	FILE *in;
+	unsigned int i;
+
+	PTR_ARRAY_FOREACH(inputs, i, fname)
+	{
+		if ((in = fopen(fname, "r")) == NULL) {
+			rspamd_fprintf(stderr, "cannot open %s: %s\n", fname, strerror(errno));
+			continue;
+		}
+
+		while (fgets(line, sizeof(line), in) != NULL) {
+			g_strchomp(line);
+
+			if (rspamadm_fuzzyload_parse_digest(line, default_flag, &pcmd)) {
+				rspamadm_fuzzyload_push(ld, &pcmd);
+			}
+		}
+
+		fclose(in);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Converts raw commands returned by fuzzy_check.gen_hashes to the peer commands
+ */
+static int
+rspamadm_fuzzyload_push_commands(lua_State *L, int tbl_pos, int fd)
+{
+	struct fuzzy_peer_cmd pcmd;
+	const struct rspamd_fuzzy_cmd *cmd;
+	const char *raw;
+	gsize rawlen;
+	int nhashes = 0;
+
+	for (lua_pushnil(L); lua_next(L, tbl_pos); lua_pop(L, 1)) {
+		raw = lua_tolstring(L, -1, &rawlen);
+
+		if (raw == NULL || rawlen < sizeof(*cmd)) {
+			continue;
+		}
+
+		if (memcmp(raw, fuzzy_encrypted_magic, sizeof(fuzzy_encrypted_magic)) == 0) {
+			rspamd_fprintf(stderr, "encrypted command returned, cannot load it\n");
+			continue;
+		}
+
+		cmd = (const struct rspamd_fuzzy_cmd *) raw;
+		memset(&pcmd, 0, sizeof(pcmd));
+
+		if (cmd->shingles_count > 0) {
+			if (rawlen < sizeof(struct rspamd_fuzzy_shingle_cmd)) {
+				continue;
+			}
+
+			pcmd.is_shingle = TRUE;
+			memcpy(&pcmd.cmd.shingle, raw, sizeof(pcmd.cmd.shingle));
+		}
+		else {
+			memcpy(&pcmd.cmd.normal, raw, sizeof(pcmd.cmd.normal));
+		}
+
+		if (write(fd, &pcmd, sizeof(pcmd)) != sizeof(pcmd)) {
+			return -1;
+		}
+
+		nhashes++;
+	}
+
+	return nhashes;
+}
+
+static void
+rspamadm_fuzzyload_message(struct rspamd_config *cfg, const char *fname, int fd)
+{
+	lua_State *L = cfg->lua_state;
+	struct rspamd_task *task;
+	gpointer map;
+	gsize sz;
+	int err_idx, res_idx, found = 0;
+
+	if ((map = rspamd_file_xmap(fname, PROT_READ, &sz, TRUE)) == NULL) {
+		rspamd_fprintf(stderr, "cannot open %s: %s\n", fname, strerror(errno));
+		return;
+	}
+
+	task = rspamd_task_new(NULL, cfg, NULL, cfg->lang_det, NULL, FALSE);
+	task->msg.begin = map;
+	task->msg.len = sz;
+
+	if (!rspamd_message_parse(task)) {
+		rspamd_fprintf(stderr, "cannot parse %s\n", fname);
+		goto end;
+	}
+
+	rspamd_message_process(task);
+
+	lua_pushcfunction(L, &rspamd_lua_traceback);
+	err_idx = lua_gettop(L);
+
+	lua_getglobal(L, "rspamd_plugins");
+	lua_getfield(L, -1, "fuzzy_check");
+
+	if (lua_type(L, -1) != LUA_TTABLE) {
+		rspamd_fprintf(stderr, "fuzzy_check plugin is not loaded\n");
+		lua_settop(L, err_idx - 1);
+		goto end;
+	}
+
+	lua_getfield(L, -1, "gen_hashes");
+	rspamd_lua_task_push(L, task);
+
+	if (g_ascii_isdigit(flag_str[0])) {
+		lua_pushinteger(L, strtoul(flag_str, NULL, 10));
+	}
+	else {
+		lua_pushstring(L, flag_str);
+	}
+
+	lua_pushinteger(L, weight);
+	lua_pushnil(L);
+	lua_pushstring(L, delete_mode ? "delete" : "add");
+	/* We need unencrypted commands */
+	lua_pushboolean(L, TRUE);
+
+	if (lua_pcall(L, 6, 1, err_idx) != 0) {
+		rspamd_fprintf(stderr, "cannot generate hashes for %s: %s\n", fname,
+					   lua_tostring(L, -1));
+		lua_settop(L, err_idx - 1);
+		goto end;
+	}
+
+	res_idx = lua_gettop(L);
+
+	for (lua_pushnil(L); lua_next(L, res_idx); lua_pop(L, 1)) {
+		const char *name = lua_tostring(L, -2);
+
+		if (lua_type(L, -1) != LUA_TTABLE) {
+			continue;
+		}
+
+		if (rule_name && name && strcmp(name, rule_name) != 0) {
+			continue;
+		}
+
+		if (rule_name == NULL && found > 0) {
+			rspamd_fprintf(stderr, "multiple fuzzy rules match, use -r to select one\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (rspamadm_fuzzyload_push_commands(L, lua_gettop(L), fd) == -1) {
+			/* Parent is gone */
+			exit(EXIT_FAILURE);
+		}
+
+		found++;
+	}
+
+	lua_settop(L, err_idx - 1);
+
+end:
+	rspamd_task_free(task);
+	munmap(map, sz);
+}
+
+/*
+ * Reads peer commands from all hashing processes until they are finished
+ */
+static void
+rspamadm_fuzzyload_collect(struct rspamadm_fuzzy_loader *ld, int *fds,
+						   unsigned int nfds)
+{
+	struct pollfd *pfds;
+	struct fuzzy_peer_cmd pcmd;
+	unsigned int i, nactive = nfds;
+	gsize *offsets;
+	unsigned char **bufs;
+	ssize_t r;
+
+	pfds = g_new0(struct pollfd, nfds);
+	offsets = g_new0(gsize, nfds);
+	bufs = g_new0(unsigned char *, nfds);
+
+	for (i = 0; i < nfds; i++) {
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+		bufs[i] = g_malloc(sizeof(pcmd));
+	}
+
+	while (nactive > 0) {
+		if (poll(pfds, nfds, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (pfds[i].fd == -1 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+
+			r = read(pfds[i].fd, bufs[i] + offsets[i], sizeof(pcmd) - offsets[i]);
+
+			if (r <= 0) {
+				if (r == -1 && errno == EINTR) {
+					continue;
+				}
+
+				close(pfds[i].fd);
+				pfds[i].fd = -1;
+				nactive--;
+				continue;
+			}
+
+			offsets[i] += r;
+
+			if (offsets[i] == sizeof(pcmd)) {
+				memcpy(&pcmd, bufs[i], sizeof(pcmd));
+				offsets[i] = 0;
+				rspamadm_fuzzyload_push(ld, &pcmd);
+			}
+		}
+	}
+
+	for (i = 0; i < nfds; i++) {
+		g_free(bufs[i]);
+	}
+
+	g_free(bufs);
+	g_free(offsets);
+	g_free(pfds);
+}
+
+static const ucl_object_t *
+rspamadm_fuzzyload_backend_config(struct rspamd_config *cfg)
+{
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next(cur)) {
+		cf = cur->data;
+
+		if (cf->worker && strcmp(cf->worker->name, "fuzzy") == 0) {
+			return cf->options;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamadm_fuzzyload(int argc, char **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const char *confdir;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamadm_fuzzy_loader ld;
+	const ucl_object_t *bk_obj;
+	GPtrArray *inputs;
+	worker_t **pworker;
+	int *fds = NULL, default_flag = 0, i;
+	unsigned int j;
+	pid_t *pids = NULL;
+
+	context = g_option_context_new(
+		"fuzzyload - loads hashes to the fuzzy storage backend");
+	g_option_context_set_summary(context,
+								 "Summary:\n  Rspamd administration utility version " RVERSION
+								 "\n  Release id: " RID);
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		rspamd_fprintf(stderr, "option parsing failed: %s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (flag_str == NULL) {
+		rspamd_fprintf(stderr, "flag is missing\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (digests_mode) {
+		default_flag = strtoul(flag_str, NULL, 10);
+
+		if (default_flag == 0) {
+			rspamd_fprintf(stderr, "numeric flag is required for digests\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (batch_size <= 0) {
+		batch_size = 1000;
+	}
+
+	if (jobs <= 0) {
+		jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	}
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup(ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf("%s%c%s", confdir, G_DIR_SEPARATOR,
+								 "rspamd.conf");
+	}
+
+	pworker = &workers[0];
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string((*pworker)->name);
+		pworker++;
+	}
+
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read(cfg, cfg->cfg_name, config_logger, rspamd_main,
+							ucl_vars, FALSE, lua_env)) {
+		rspamd_fprintf(stderr, "cannot load config %s\n", config);
+		exit(EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config(cfg);
+	(void) rspamd_init_filters(cfg, false, false);
+	rspamd_config_post_load(cfg, RSPAMD_CONFIG_INIT_SYMCACHE);
+
+	if ((bk_obj = rspamadm_fuzzyload_backend_config(cfg)) == NULL) {
+		rspamd_fprintf(stderr, "no fuzzy worker defined in %s\n", config);
+		exit(EXIT_FAILURE);
+	}
+
+	inputs = rspamadm_fuzzyload_inputs(argc, argv);
+
+	if (!digests_mode) {
+		/* Hash messages in child processes before opening the backend */
+		jobs = MIN(jobs, MAX(inputs->len, 1));
+		fds = g_new(int, jobs);
+		pids = g_new(pid_t, jobs);
+
+		for (i = 0; i < jobs; i++) {
+			int pfd[2];
+
+			if (pipe(pfd) == -1) {
+				rspamd_fprintf(stderr, "cannot create pipe: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			pids[i] = fork();
+
+			if (pids[i] == -1) {
+				rspamd_fprintf(stderr, "cannot fork: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			else if (pids[i] == 0) {
+				close(pfd[0]);
+
+				for (j = i; j < inputs->len; j += jobs) {
+					rspamadm_fuzzyload_message(cfg,
+											   g_ptr_array_index(inputs, j), pfd[1]);
+				}
+
+				close(pfd[1]);
+				_exit(EXIT_SUCCESS);
+			}
+
+			close(pfd[1]);
+			fds[i] = pfd[0];
+		}
+	}
+
+	memset(&ld, 0, sizeof(ld));
+	ld.event_loop = rspamd_main->event_loop;
+	ld.pending = g_array_sized_new(FALSE, FALSE, sizeof(struct fuzzy_peer_cmd),
+								   batch_size);
+
+	if ((ld.backend = rspamd_fuzzy_backend_create(ld.event_loop, bk_obj, cfg,
+												  &error)) == NULL) {
+		rspamd_fprintf(stderr, "cannot open fuzzy backend: %e\n", error);
+		g_error_free(error);
+
+		if (pids) {
+			for (i = 0; i < jobs; i++) {
+				kill(pids[i], SIGTERM);
+			}
+		}
+
+		exit(EXIT_FAILURE);
+	}
+
+	if (digests_mode) {
+		rspamadm_fuzzyload_digests(&ld, inputs, default_flag);
+	}
+	else {
+		rspamadm_fuzzyload_collect(&ld, fds, jobs);
+
+		for (i = 0; i < jobs; i++) {
+			waitpid(pids[i], NULL, 0);
+		}
+
+		g_free(fds);
+		g_free(pids);
+	}
+
+	rspamadm_fuzzyload_flush(&ld);
+
+	rspamd_printf("loaded %uL hashes: %uL added, %uL deleted, %uL extended, "
+				  "%uL duplicates, %uL failed batches\n",
+				  ld.nwritten, ld.nadded, ld.ndeleted, ld.nextended, ld.nignored,
+				  ld.nfailed);
+
+	rspamd_fuzzy_backend_close(ld.backend);
+	g_array_free(ld.pending, TRUE);
+	g_ptr_array_free(inputs, TRUE);
+
+	if (ld.nfailed > 0) {
+		exit(EXIT_FAILURE);
+	}
+}
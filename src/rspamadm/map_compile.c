@@ -0,0 +1,146 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "libserver/maps/map.h"
+#include "libserver/maps/map_private.h"
+#include "libserver/maps/map_helpers.h"
+#include "libserver/maps/map_image.h"
+
+/*
+ * Compiles a text hash map to an image that rspamd maps directly via mmap
+ * instead of parsing, see map_image.h
+ */
+
+static gboolean quiet = FALSE;
+
+static void rspamadm_mapcompile(int argc, char **argv,
+								const struct rspamadm_command *cmd);
+static const char *rspamadm_mapcompile_help(gboolean full_help,
+											const struct rspamadm_command *cmd);
+
+struct rspamadm_command mapcompile_command = {
+	.name = "mapcompile",
+	.flags = 0,
+	.help = rspamadm_mapcompile_help,
+	.run = rspamadm_mapcompile,
+	.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+	{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+	 "Be quiet", NULL},
+	{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static const char *
+rspamadm_mapcompile_help(gboolean full_help, const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile hash map to an image loaded without parsing\n\n"
+				   "Usage: rspamadm mapcompile [-q] <input> <output>\n"
+				   "Where options are:\n\n"
+				   "-q: be quiet\n\n"
+				   "Input is a text map of keys with optional values, "
+				   "output can be used as a map file instead of the input\n";
+	}
+	else {
+		help_str = "Compile hash map to an image loaded without parsing";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_mapcompile(int argc, char **argv, const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_map map;
+	struct map_cb_data cbdata;
+	struct rspamd_hash_map_helper *htb;
+	struct rspamd_map_image *img;
+	char *input;
+	gsize len;
+
+	context = g_option_context_new(
+		"mapcompile - compile hash map to an image");
+	g_option_context_set_summary(context,
+								 "Summary:\n  Rspamd administration utility version " RVERSION
+								 "\n  Release id: " RID);
+	g_option_context_add_main_entries(context, entries, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		rspamd_fprintf(stderr, "option parsing failed: %s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(context);
+
+	if (argc != 3) {
+		rspamd_fprintf(stderr, "%s", rspamadm_mapcompile_help(TRUE, cmd));
+		exit(EXIT_FAILURE);
+	}
+
+	if (!g_file_get_contents(argv[1], &input, &len, &error)) {
+		rspamd_fprintf(stderr, "cannot read %s: %e\n", argv[1], error);
+		g_error_free(error);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Parse map exactly as rspamd does */
+	memset(&map, 0, sizeof(map));
+	memset(&cbdata, 0, sizeof(cbdata));
+	map.name = argv[1];
+	cbdata.map = &map;
+	rspamd_kv_list_read(input, len, &cbdata, TRUE);
+	g_free(input);
+	htb = cbdata.cur_data;
+
+	if (htb == NULL) {
+		rspamd_fprintf(stderr, "cannot parse %s\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!rspamd_map_helper_hash_save_image(htb, argv[2], &error)) {
+		rspamd_fprintf(stderr, "%e\n", error);
+		g_error_free(error);
+		rspamd_map_helper_destroy_hash(htb);
+		exit(EXIT_FAILURE);
+	}
+
+	rspamd_map_helper_destroy_hash(htb);
+
+	/* Check the result */
+	img = rspamd_map_image_open(argv[2], &error);
+
+	if (img == NULL) {
+		rspamd_fprintf(stderr, "%e\n", error);
+		g_error_free(error);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!quiet) {
+		rspamd_printf("compiled %uz elements from %s to %s\n",
+					  rspamd_map_image_nelts(img), argv[1], argv[2]);
+	}
+
+	rspamd_map_image_close(img);
+}
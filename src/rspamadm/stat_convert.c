@@ -37,6 +37,9 @@ static char *redis_db = NULL;
 static char *redis_username = NULL;
 static char *redis_password = NULL;
 static gboolean reset_previous = FALSE;
+static int connections = 4;
+static int batch = 1000;
+static char *checkpoint = NULL;
 
 static void rspamadm_statconvert(int argc, char **argv,
 								 const struct rspamadm_command *cmd);
@@ -58,6 +61,12 @@ static GOptionEntry entries[] = {
 	 "Reset previous data instead of appending values", NULL},
 	{"expire", 'e', 0, G_OPTION_ARG_DOUBLE, &expire,
 	 "Set expiration in seconds (can be fractional)", NULL},
+	{"connections", 'j', 0, G_OPTION_ARG_INT, &connections,
+	 "Number of redis connections with batches in flight (4 by default)", NULL},
+	{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+	 "Number of tokens per batch (1000 by default)", NULL},
+	{"checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &checkpoint,
+	 "Store progress in this file and resume from it", NULL},
 
 	{"symbol-spam", 0, 0, G_OPTION_ARG_STRING, &symbol_spam,
 	 "Symbol for spam (e.g. BAYES_SPAM)", NULL},
@@ -92,6 +101,9 @@ rspamadm_statconvert_help(gboolean full_help, const struct rspamadm_command *cmd
 				   "-c: config file to read data from\n"
 				   "-r: reset previous data instead of increasing values\n"
 				   "-e: set expire to that amount of seconds\n"
+				   "-j: number of redis connections with batches in flight\n"
+				   "-b: number of tokens per batch\n"
+				   "--checkpoint: store progress in this file and resume from it\n"
 				   "** Or specify options directly **\n"
 				   "--redis-host: output redis ip (in format ip:port)\n"
 				   "--redis-db: output redis database\n"
@@ -252,6 +264,16 @@ rspamadm_statconvert(int argc, char **argv, const struct rspamadm_command *cmd)
 							  "expire", 0, false);
 	}
 
+	ucl_object_insert_key(obj, ucl_object_fromint(connections),
+						  "connections", 0, false);
+	ucl_object_insert_key(obj, ucl_object_fromint(batch),
+						  "batch", 0, false);
+
+	if (checkpoint) {
+		ucl_object_insert_key(obj, ucl_object_fromstring(checkpoint),
+							  "checkpoint", 0, false);
+	}
+
 	rspamadm_execute_lua_ucl_subr(argc,
 								  argv,
 								  obj,
@@ -18,8 +18,11 @@
 #include "rspamd.h"
 #include "libserver/maps/map.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libmime/mime_encoding.h"
+#include "libmime/images.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -58,6 +61,10 @@
 #include "libserver/hyperscan_tools.h"
 #endif
 
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+#include <malloc.h>
+#endif
+
 /* 2 seconds to fork new process in place of dead one */
 #define SOFT_FORK_TIME 2
 
@@ -93,6 +100,7 @@ static gboolean is_insecure = FALSE;
 static GHashTable *ucl_vars = NULL;
 static char **lua_env = NULL;
 static gboolean skip_template = FALSE;
+static char *cfg_snapshot = NULL;
 
 static int term_attempts = 0;
 
@@ -131,6 +139,8 @@ static GOptionEntry entries[] =
 		 "Do not apply Jinja templates", NULL},
 		{"lua-env", '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &lua_env,
 		 "Load lua environment from the specified files", NULL},
+		{"config-snapshot", '\0', 0, G_OPTION_ARG_FILENAME, &cfg_snapshot,
+		 "Store parsed config in the specified file and load it when config files are unchanged", NULL},
 		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
 
 static gboolean
@@ -634,6 +644,34 @@ spawn_worker_type(struct rspamd_main *rspamd_main, struct ev_loop *event_loop,
 	}
 }
 
+/*
+ * Workers are forked from the main process after config, Lua plugins, symcache,
+ * hyperscan and file maps are initialised, so all of that is shared copy-on-write.
+ * Here we also do the warm-up that every worker would otherwise repeat on its
+ * own and drop init garbage, so children start with less private pages and
+ * respawned workers are ready right after fork.
+ */
+static void
+rspamd_main_prefork_warmup(struct rspamd_main *rspamd_main)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+
+	if (cfg->lua_thread_pool && cfg->lua_threads_prewarm > 0) {
+		/* Workers find these coroutines available and do not create their own */
+		lua_thread_pool_prewarm((struct lua_thread_pool *) cfg->lua_thread_pool,
+								cfg->lua_threads_prewarm);
+	}
+
+	/* ICU converters and their UTF-8 tables are shared by all workers */
+	rspamd_mime_preload_converters();
+	rspamd_images_shared_cache_init(cfg);
+
+	lua_gc(cfg->lua_state, LUA_GCCOLLECT, 0);
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+	malloc_trim(0);
+#endif
+}
+
 static void
 spawn_workers(struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 {
@@ -647,6 +685,8 @@ spawn_workers(struct rspamd_main *rspamd_main, struct ev_loop *ev_base)
 	worker_t **cw, *wrk;
 	unsigned int i;
 
+	rspamd_main_prefork_warmup(rspamd_main);
+
 	/* Special hack for hs_helper if it's not defined in a config */
 	seen_mandatory_workers = g_ptr_array_new();
 	cur = rspamd_main->cfg->workers;
@@ -952,6 +992,7 @@ load_rspamd_config(struct rspamd_main *rspamd_main,
 {
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
+	cfg->cfg_snapshot = cfg_snapshot;
 
 	if (!rspamd_config_read(cfg, cfg->cfg_name, config_logger, rspamd_main,
 							ucl_vars, skip_template, lua_env)) {
@@ -1101,7 +1142,7 @@ rspamd_stat_update_handler(struct ev_loop *loop, ev_timer *w, int revents)
 	struct rspamd_stat cur_stat;
 	char proctitle[128];
 
-	memcpy(&cur_stat, rspamd_main->stat, sizeof(cur_stat));
+	rspamd_main_stat_snapshot(rspamd_main, &cur_stat);
 
 	if (old_stat.messages_scanned > 0 &&
 		cur_stat.messages_scanned > old_stat.messages_scanned) {
@@ -1131,6 +1172,55 @@ rspamd_stat_update_handler(struct ev_loop *loop, ev_timer *w, int revents)
 	memcpy(&old_stat, &cur_stat, sizeof(cur_stat));
 }
 
+/* New workers report warm-up themselves, this is a grace time for their report */
+#define WARMUP_REPORT_GRACE 2.0
+#define WARMUP_CHECK_INTERVAL 0.5
+
+static ev_timer warmup_ev;
+static ev_tstamp warmup_deadline;
+
+static void
+count_warming_workers(gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_worker *w = value;
+	unsigned int *nwarming = ud;
+
+	if ((w->flags & RSPAMD_WORKER_WARMING) && !(w->flags & RSPAMD_WORKER_OLD_CONFIG) &&
+		w->state == rspamd_worker_state_running) {
+		(*nwarming)++;
+	}
+}
+
+static void
+rspamd_warmup_check_handler(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	struct rspamd_main *rspamd_main = (struct rspamd_main *) w->data;
+	unsigned int nwarming = 0;
+
+	if (rspamd_main->wanna_die) {
+		ev_timer_stop(loop, w);
+		return;
+	}
+
+	g_hash_table_foreach(rspamd_main->workers, count_warming_workers, &nwarming);
+
+	if (nwarming > 0 && ev_now(loop) < warmup_deadline) {
+		return;
+	}
+
+	ev_timer_stop(loop, w);
+
+	if (nwarming > 0) {
+		msg_warn_main("%ud new workers have not reported warm-up, kill old workers anyway",
+					  nwarming);
+	}
+	else {
+		msg_info_main("new workers are warmed up, kill old workers");
+	}
+
+	g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+}
+
 static void
 rspamd_hup_handler(struct ev_loop *loop, ev_signal *w, int revents)
 {
@@ -1147,11 +1237,32 @@ rspamd_hup_handler(struct ev_loop *loop, ev_signal *w, int revents)
 			/* Mark old workers */
 			g_hash_table_foreach(rspamd_main->workers, mark_old_workers, NULL);
 			msg_info_main("spawn workers with a new config");
+			rspamd_main->spawn_warming = rspamd_main->cfg->reload_warmup_timeout > 0;
 			spawn_workers(rspamd_main, rspamd_main->event_loop);
+			rspamd_main->spawn_warming = FALSE;
 			msg_info_main("workers spawning has been finished");
-			/* Kill marked */
-			msg_info_main("kill old workers");
-			g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+
+			if (rspamd_main->cfg->reload_warmup_timeout > 0) {
+				/* Old workers continue to accept until new ones are warmed up */
+				msg_info_main("wait up to %.2f sec for new workers to warm up",
+							  rspamd_main->cfg->reload_warmup_timeout);
+				warmup_deadline = ev_now(loop) + rspamd_main->cfg->reload_warmup_timeout +
+								  WARMUP_REPORT_GRACE;
+
+				if (ev_is_active(&warmup_ev)) {
+					ev_timer_stop(loop, &warmup_ev);
+				}
+
+				warmup_ev.data = rspamd_main;
+				ev_timer_init(&warmup_ev, rspamd_warmup_check_handler,
+							  WARMUP_CHECK_INTERVAL, WARMUP_CHECK_INTERVAL);
+				ev_timer_start(loop, &warmup_ev);
+			}
+			else {
+				/* Kill marked */
+				msg_info_main("kill old workers");
+				g_hash_table_foreach(rspamd_main->workers, kill_old_workers, NULL);
+			}
 		}
 		else {
 			/* Reattach old workers */
@@ -1426,9 +1537,17 @@ int main(int argc, char **argv, char **env)
 													  sizeof(struct rspamd_stat),
 													  RSPAMD_ALIGNOF(struct rspamd_stat),
 													  G_STRLOC);
+	rspamd_main->stat_slots = rspamd_mempool_alloc0_shared_(rspamd_main->server_pool,
+															sizeof(struct rspamd_stat_slot) * RSPAMD_STAT_MAX_SLOTS,
+															RSPAMD_ALIGNOF(struct rspamd_stat_slot),
+															G_STRLOC);
 	/* Set all time slots to nan */
 	for (i = 0; i < MAX_AVG_TIME_SLOTS; i++) {
 		rspamd_main->stat->avg_time.avg_time[i] = NAN;
+
+		for (int j = 0; j < RSPAMD_STAT_MAX_SLOTS; j++) {
+			rspamd_main->stat_slots[j].st.avg_time.avg_time[i] = NAN;
+		}
 	}
 
 	rspamd_main->cfg = rspamd_config_new(RSPAMD_CONFIG_INIT_DEFAULT);
@@ -1543,8 +1662,9 @@ int main(int argc, char **argv, char **env)
 	msg_info_main("cpu features: %s",
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->cpu_extensions);
 	msg_info_main("cryptobox configuration: curve25519(libsodium), "
-				  "chacha20(%s), poly1305(libsodium), siphash(libsodium), blake2(libsodium), base64(%s)",
+				  "chacha20(%s), poly1305(libsodium), siphash(libsodium), blake2(%s), base64(%s)",
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->chacha20_impl,
+				  rspamd_main->cfg->libs_ctx->crypto_ctx->blake2b_impl,
 				  rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
 	msg_info_main("libottery prf: %s", ottery_get_impl_name());
 
@@ -57,6 +57,7 @@ extern "C" {
 #endif
 
 struct rspamd_main;
+struct rspamd_cpu_pool;
 
 enum rspamd_worker_flags {
 	RSPAMD_WORKER_HAS_SOCKET = (1 << 0),
@@ -69,6 +70,10 @@ enum rspamd_worker_flags {
 	RSPAMD_WORKER_NO_TERMINATE_DELAY = (1 << 7),
 	RSPAMD_WORKER_OLD_CONFIG = (1 << 8),
 	RSPAMD_WORKER_NO_STRICT_CONFIG = (1 << 9),
+	/* Spawned on reload, does not accept connections until warmed up */
+	RSPAMD_WORKER_WARMING = (1 << 10),
+	/* Receives export records from scanners and runs finish scripts on termination */
+	RSPAMD_WORKER_EXPORTER = (1 << 11),
 };
 
 struct rspamd_worker_accept_event {
@@ -125,6 +130,10 @@ struct rspamd_worker {
 	ev_child cld_ev;                                  /**< to allow reaping								*/
 	rspamd_worker_term_cb term_handler;               /**< custom term handler						*/
 	GHashTable *control_events_pending;               /**< control events pending indexed by ptr		*/
+	struct rspamd_cpu_pool *cpu_pool;                 /**< optional threads for cpu bound jobs		*/
+	int stat_slot;                                    /**< index of statistics slot or -1				*/
+	gboolean memory_pressure;                         /**< optional work is shed to save memory			*/
+	unsigned int pressure_conns;                      /**< connections count when memory pressure started	*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -284,18 +293,99 @@ struct RSPAMD_ALIGNED(64) rspamd_avg_time {
 	uint32_t cur_slot;
 	float avg_time[MAX_AVG_TIME_SLOTS];
 };
+/*
+ * Log-linear histograms: two buckets per power of two of a value measured in
+ * microseconds or bytes, the last bucket is unbounded
+ */
+#define RSPAMD_STAT_HIST_BUCKETS 64
+#define RSPAMD_STAT_HIST_STAGES 18 /* number of task stages bits */
+#define RSPAMD_STAT_HIST_MAX_SYMBOLS 16
+
+enum rspamd_stat_hist_type {
+	RSPAMD_STAT_HIST_TASK = 0,
+	RSPAMD_STAT_HIST_STAGE, /* the first of stages histograms */
+	RSPAMD_STAT_HIST_DNS = RSPAMD_STAT_HIST_STAGE + RSPAMD_STAT_HIST_STAGES,
+	RSPAMD_STAT_HIST_REDIS,
+	RSPAMD_STAT_HIST_HTTP,
+	RSPAMD_STAT_HIST_MESSAGE_SIZE,
+	RSPAMD_STAT_HIST_SYMBOL, /* the first of opt-in symbols histograms */
+	RSPAMD_STAT_HIST_MAX = RSPAMD_STAT_HIST_SYMBOL + RSPAMD_STAT_HIST_MAX_SYMBOLS,
+};
+
+struct rspamd_stat_hist {
+	uint64_t sum;
+	unsigned int buckets[RSPAMD_STAT_HIST_BUCKETS];
+};
 /**
  * Server statistics
  */
 struct RSPAMD_ALIGNED(64) rspamd_stat {
-	unsigned int messages_scanned;                /**< total number of messages scanned				*/
-	unsigned int actions_stat[METRIC_ACTION_MAX]; /**< statistic for each action						*/
-	unsigned int connections_count;               /**< total connections count						*/
-	unsigned int control_connections_count;       /**< connections count to control interface			*/
-	unsigned int messages_learned;                /**< messages learned								*/
-	struct rspamd_avg_time avg_time;              /**< average time stats								*/
+	unsigned int messages_scanned;                         /**< total number of messages scanned				*/
+	unsigned int actions_stat[METRIC_ACTION_MAX];          /**< statistic for each action						*/
+	unsigned int connections_count;                        /**< total connections count						*/
+	unsigned int control_connections_count;                /**< connections count to control interface			*/
+	unsigned int messages_learned;                         /**< messages learned								*/
+	unsigned int messages_degraded;                        /**< messages scanned under memory pressure			*/
+	unsigned int memory_pressure_events;                   /**< number of times workers became degraded		*/
+	unsigned int workers_degraded;                         /**< workers degraded right now (not a counter)		*/
+	struct rspamd_avg_time avg_time;                       /**< average time stats								*/
+	struct rspamd_stat_hist hist[RSPAMD_STAT_HIST_MAX];    /**< latency and size histograms					*/
+};
+
+/*
+ * Every worker updates its own slot, so counters of different workers never
+ * share a cache line; readers sum all slots with the common part
+ */
+#define RSPAMD_STAT_MAX_SLOTS 256
+struct RSPAMD_ALIGNED(64) rspamd_stat_slot {
+	struct rspamd_stat st;
+	pid_t pid; /**< owner of this slot, 0 if the slot is free				*/
 };
 
+#ifdef HAVE_ATOMIC_BUILTINS
+#define RSPAMD_STAT_INC(st, field) __atomic_add_fetch(&(st)->field, 1, __ATOMIC_RELAXED)
+#define RSPAMD_STAT_ADD(st, field, v) __atomic_add_fetch(&(st)->field, (v), __ATOMIC_RELAXED)
+#else
+#define RSPAMD_STAT_INC(st, field) ((st)->field++)
+#define RSPAMD_STAT_ADD(st, field, v) ((st)->field += (v))
+#endif
+
+static inline unsigned int
+rspamd_stat_hist_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < 2) {
+		return v;
+	}
+
+	msb = 63 - __builtin_clzll(v);
+
+	if (msb >= RSPAMD_STAT_HIST_BUCKETS / 2) {
+		return RSPAMD_STAT_HIST_BUCKETS - 1;
+	}
+
+	return msb * 2 + ((v >> (msb - 1)) & 1);
+}
+
+/* Returns the largest value that falls into the bucket `i` */
+static inline uint64_t
+rspamd_stat_hist_bucket_bound(unsigned int i)
+{
+	if (i < 2) {
+		return i;
+	}
+
+	return ((3ULL + (i & 1)) << (i / 2 - 1)) - 1;
+}
+
+static inline void
+rspamd_stat_hist_add(struct rspamd_stat *st, unsigned int type, uint64_t v)
+{
+	RSPAMD_STAT_INC(st, hist[type].buckets[rspamd_stat_hist_bucket(v)]);
+	RSPAMD_STAT_ADD(st, hist[type].sum, v);
+}
+
 /**
  * Struct that determine main server object (for logging purposes)
  */
@@ -306,6 +396,8 @@ struct rspamd_main {
 	rspamd_pidfh_t *pfh;      /**< struct pidfh for pidfile						*/
 	GQuark type;              /**< process type									*/
 	struct rspamd_stat *stat; /**< pointer to statistics							*/
+	struct rspamd_stat_slot *stat_slots; /**< per worker statistics					*/
+	struct rspamd_stat *local_stat;      /**< statistics written by this process		*/
 
 	rspamd_mempool_t *server_pool;     /**< server's memory pool							*/
 	rspamd_mempool_mutex_t *start_mtx; /**< server is starting up							*/
@@ -317,6 +409,7 @@ struct rspamd_main {
 	gboolean is_privileged;       /**< true if run in privileged mode                 */
 	gboolean wanna_die;           /**< no respawn of processes						*/
 	gboolean cores_throttling;    /**< turn off cores when limits are exceeded		*/
+	gboolean spawn_warming;       /**< workers forked now must warm up before accepting */
 	struct roll_history *history; /**< rolling history								*/
 	struct ev_loop *event_loop;
 	ev_signal term_ev, int_ev, hup_ev, usr1_ev; /**< signals 										*/
@@ -348,6 +441,8 @@ struct zstd_dictionary {
 	void *dict;
 	gsize size;
 	unsigned int id;
+	void *cdict; /* digested dictionary for compression */
+	void *ddict; /* digested dictionary for decompression */
 };
 
 struct rspamd_external_libs_ctx {
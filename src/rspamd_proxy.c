@@ -17,6 +17,8 @@
 #include "libutil/util.h"
 #include "libserver/maps/map.h"
 #include "libutil/upstream.h"
+#include "libutil/hash.h"
+#include "libcryptobox/cryptobox.h"
 #include "libserver/http/http_connection.h"
 #include "libserver/http/http_private.h"
 #include "libserver/protocol.h"
@@ -52,6 +54,10 @@
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+#define PROXY_CACHE_KEY_LEN 16
+#define DEFAULT_CACHE_TTL 10.0
+#define DEFAULT_CACHE_MAX_REPLY (64 * 1024)
+#define DEFAULT_MIRROR_QUEUE_SIZE 1024
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL,                               \
 														 session->pool->tag.tagname, session->pool->tag.uid, \
@@ -161,6 +167,21 @@ struct rspamd_proxy_ctx {
 	struct rspamd_lang_detector *lang_det;
 	double task_timeout;
 	struct rspamd_main *srv;
+	/* Replies cache */
+	rspamd_lru_hash_t *replies_cache;
+	unsigned int cache_size;
+	double cache_ttl;
+	gsize cache_max_reply;
+	/* Request headers that are mixed into the cache key */
+	GList *cache_headers;
+	/* Start self scan of milter messages at the end of headers */
+	gboolean milter_early_scan;
+	/* Shadow sessions sent to mirrors */
+	unsigned int mirror_concurrency;
+	unsigned int mirror_queue_size;
+	gboolean mirror_drop_oldest;
+	unsigned int mirrors_inflight;
+	GQueue mirror_queue;
 };
 
 enum rspamd_backend_flags {
@@ -212,9 +233,44 @@ struct rspamd_proxy_session {
 	int client_sock;
 	enum rspamd_proxy_legacy_support legacy_support;
 	int retries;
+	/* Key in the replies cache, NULL if the reply must not be cached */
+	unsigned char *cache_key;
+	/* Detached session that sends a copy of this message to mirrors */
+	struct rspamd_proxy_session *shadow;
+	/* For shadow sessions: random value to select mirrors and pending requests */
+	double mirror_coin;
+	unsigned int mirrors_pending;
 	ref_entry_t ref;
 };
 
+struct rspamd_proxy_cached_reply {
+	rspamd_fstring_t *body;
+	char *ctype;
+	/* Pairs of header names and values */
+	GPtrArray *headers;
+	int code;
+};
+
+/* Request headers that always influence the reply */
+static const char *proxy_cache_fixed_headers[] = {
+	"Host",
+	"Accept",
+	"Flags",
+	"Compression",
+	"Settings-ID",
+	"Settings",
+};
+/* Envelope headers used when `cache_headers` is not set */
+static const char *proxy_cache_default_headers[] = {
+	"IP",
+	"Helo",
+	"Hostname",
+	"From",
+	"Rcpt",
+	"User",
+	"Deliver-To",
+};
+
 static gboolean proxy_send_master_message(struct rspamd_proxy_session *session);
 
 static GQuark
@@ -771,6 +827,10 @@ init_rspamd_proxy(struct rspamd_config *cfg)
 								  (rspamd_mempool_destruct_t) rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
 	ctx->spam_header = RSPAMD_MILTER_SPAM_HEADER;
+	ctx->cache_ttl = DEFAULT_CACHE_TTL;
+	ctx->cache_max_reply = DEFAULT_CACHE_MAX_REPLY;
+	ctx->mirror_queue_size = DEFAULT_MIRROR_QUEUE_SIZE;
+	g_queue_init(&ctx->mirror_queue);
 
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
@@ -893,6 +953,70 @@ init_rspamd_proxy(struct rspamd_config *cfg)
 									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, tempfail_message),
 									  0,
 									  "Use custom tempfail message");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cache_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, cache_size),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Maximum number of cached replies (default: 0, disabled)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cache_ttl",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, cache_ttl),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "Lifetime of a cached reply (default: 10s)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cache_max_reply",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, cache_max_reply),
+									  RSPAMD_CL_FLAG_INT_SIZE,
+									  "Do not cache replies larger than this (default: 64k)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cache_headers",
+									  rspamd_rcl_parse_struct_string_list,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, cache_headers),
+									  0,
+									  "Request headers used in the cache key besides the message digest and settings");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "milter_early_scan",
+									  rspamd_rcl_parse_struct_boolean,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, milter_early_scan),
+									  0,
+									  "Start self scan of milter messages when headers are received (default: false)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "mirror_concurrency",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, mirror_concurrency),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Maximum number of messages being sent to mirrors at the same time (default: 0, unlimited)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "mirror_queue_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, mirror_queue_size),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Maximum number of messages waiting to be sent to mirrors (default: 1024)");
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "mirror_drop_oldest",
+									  rspamd_rcl_parse_struct_boolean,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_proxy_ctx, mirror_drop_oldest),
+									  0,
+									  "Drop the oldest queued mirror message instead of the new one when the queue is full");
 
 	return ctx;
 }
@@ -1054,7 +1178,16 @@ proxy_session_dtor(struct rspamd_proxy_session *session)
 	int cbref;
 	struct rspamd_proxy_backend_connection *conn;
 
-	if (session->master_conn && session->master_conn->results) {
+	if (session->shadow) {
+		/* Compare scripts are called when mirrors are done */
+		if (session->master_conn && session->master_conn->results) {
+			session->shadow->master_conn->results =
+				ucl_object_ref(session->master_conn->results);
+		}
+
+		REF_RELEASE(session->shadow);
+	}
+	else if (session->master_conn && session->master_conn->results) {
 		for (i = 0; i < session->ctx->cmp_refs->len; i++) {
 			cbref = g_array_index(session->ctx->cmp_refs, int, i);
 			proxy_call_cmp_script(session, cbref);
@@ -1168,6 +1301,31 @@ proxy_request_compress(struct rspamd_http_message *msg)
 	}
 }
 
+/*
+ * Prepares a message to be sent to a backend on the same host: the body is written
+ * once into a shared memory segment and, for unix sockets, only the descriptor
+ * of this segment is passed to the backend
+ */
+static void
+proxy_prepare_local_message(struct rspamd_proxy_session *session,
+							struct rspamd_http_connection *conn,
+							struct rspamd_http_message *msg,
+							struct upstream *up)
+{
+	if (rspamd_inet_address_get_af(rspamd_upstream_addr_cur(up)) == AF_UNIX) {
+		rspamd_http_connection_allow_fd_passing(conn);
+	}
+
+	if (session->fname == NULL &&
+		!(rspamd_http_message_get_flags(msg) & RSPAMD_HTTP_FLAG_SHMEM)) {
+		/* E.g. milter messages, they are not read from HTTP */
+		if (!rspamd_http_message_move_body_to_shmem(msg)) {
+			msg_debug_session("cannot move message body to shared memory, "
+							  "send it as is");
+		}
+	}
+}
+
 static void
 proxy_request_decompress(struct rspamd_http_message *msg)
 {
@@ -1352,6 +1510,8 @@ proxy_check_file(struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+static void proxy_mirror_done(struct rspamd_proxy_session *session);
+
 static void
 proxy_backend_mirror_error_handler(struct rspamd_http_connection *conn, GError *err)
 {
@@ -1373,7 +1533,7 @@ proxy_backend_mirror_error_handler(struct rspamd_http_connection *conn, GError *
 	rspamd_upstream_fail(bk_conn->up, FALSE, err ? err->message : "unknown");
 
 	proxy_backend_close_connection(bk_conn);
-	REF_RELEASE(bk_conn->s);
+	proxy_mirror_done(session);
 }
 
 static int
@@ -1402,27 +1562,31 @@ proxy_backend_mirror_finish_handler(struct rspamd_http_connection *conn,
 	rspamd_upstream_ok(bk_conn->up);
 
 	proxy_backend_close_connection(bk_conn);
-	REF_RELEASE(bk_conn->s);
+	proxy_mirror_done(session);
 
 	return 0;
 }
 
+/*
+ * Sends the message of a shadow session to all mirrors selected for it
+ */
 static void
-proxy_open_mirror_connections(struct rspamd_proxy_session *session)
+proxy_mirror_send(struct rspamd_proxy_session *session)
 {
-	double coin;
 	struct rspamd_http_mirror *m;
 	unsigned int i;
 	struct rspamd_proxy_backend_connection *bk_conn;
 	struct rspamd_http_message *msg;
 	GError *err = NULL;
 
-	coin = rspamd_random_double();
+	session->ctx->mirrors_inflight++;
+	/* Guard against mirrors that fail synchronously */
+	session->mirrors_pending = 1;
 
 	for (i = 0; i < session->ctx->mirrors->len; i++) {
 		m = g_ptr_array_index(session->ctx->mirrors, i);
 
-		if (m->prob < coin) {
+		if (m->prob < session->mirror_coin) {
 			/* No luck */
 			continue;
 		}
@@ -1461,6 +1625,7 @@ proxy_open_mirror_connections(struct rspamd_proxy_session *session)
 			if (err) {
 				g_error_free(err);
 			}
+			close(bk_conn->backend_sock);
 			continue;
 		}
 
@@ -1493,36 +1658,31 @@ proxy_open_mirror_connections(struct rspamd_proxy_session *session)
 			msg->peer_key = rspamd_pubkey_ref(m->key);
 		}
 
+		g_ptr_array_add(session->mirror_conns, bk_conn);
+		session->mirrors_pending++;
+
 		if (m->local ||
 			rspamd_inet_address_is_local(rspamd_upstream_addr_cur(bk_conn->up))) {
-
-			if (session->fname) {
-				rspamd_http_message_add_header(msg, "File", session->fname);
-			}
-
+			proxy_prepare_local_message(session, bk_conn->backend_conn, msg,
+										bk_conn->up);
 			msg->method = HTTP_GET;
 			rspamd_http_connection_write_message_shared(bk_conn->backend_conn,
 														msg, rspamd_upstream_name(bk_conn->up), NULL, bk_conn,
 														bk_conn->timeout);
 		}
 		else {
-			if (session->fname) {
-				msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
-				rspamd_http_message_set_body(msg, session->map, session->map_len);
-			}
-
 			msg->method = HTTP_POST;
 
 			if (m->compress) {
 				proxy_request_compress(msg);
 
-				if (session->client_milter_conn) {
+				if (session->ctx->milter) {
 					rspamd_http_message_add_header(msg, "Content-Type",
 												   "application/octet-stream");
 				}
 			}
 			else {
-				if (session->client_milter_conn) {
+				if (session->ctx->milter) {
 					rspamd_http_message_add_header(msg, "Content-Type",
 												   "text/plain");
 				}
@@ -1533,10 +1693,155 @@ proxy_open_mirror_connections(struct rspamd_proxy_session *session)
 												 bk_conn->timeout);
 		}
 
-		g_ptr_array_add(session->mirror_conns, bk_conn);
-		REF_RETAIN(session);
 		msg_info_session("send request to %s", m->name);
 	}
+
+	proxy_mirror_done(session);
+}
+
+/*
+ * Called when a mirror request of a shadow session is finished, releases
+ * the concurrency slot and starts the next queued session if all mirrors
+ * of this one are done
+ */
+static void
+proxy_mirror_done(struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_proxy_session *next;
+
+	g_assert(session->mirrors_pending > 0);
+
+	if (--session->mirrors_pending > 0) {
+		return;
+	}
+
+	ctx->mirrors_inflight--;
+
+	while ((ctx->mirror_concurrency == 0 ||
+			ctx->mirrors_inflight < ctx->mirror_concurrency) &&
+		   (next = g_queue_pop_head(&ctx->mirror_queue)) != NULL) {
+		/* Queue reference is passed to the in-flight state */
+		proxy_mirror_send(next);
+	}
+
+	/* In-flight reference, may call compare scripts */
+	REF_RELEASE(session);
+}
+
+/*
+ * Detaches a copy of the client message into a shadow session that is sent
+ * to mirrors independently from the client session, so slow mirrors do not
+ * delay the reply and compare scripts are called once both sides are done
+ */
+static void
+proxy_open_mirror_connections(struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_proxy_session *shadow, *dropped;
+	struct rspamd_http_mirror *m;
+	struct rspamd_http_message *msg;
+	GError *err = NULL;
+	double coin;
+	unsigned int i;
+	gboolean selected = FALSE;
+
+	coin = rspamd_random_double();
+
+	for (i = 0; i < ctx->mirrors->len; i++) {
+		m = g_ptr_array_index(ctx->mirrors, i);
+
+		if (m->prob >= coin) {
+			selected = TRUE;
+			break;
+		}
+	}
+
+	if (!selected) {
+		return;
+	}
+
+	if (ctx->mirror_concurrency > 0 &&
+		ctx->mirrors_inflight >= ctx->mirror_concurrency &&
+		ctx->mirror_queue.length >= ctx->mirror_queue_size &&
+		!ctx->mirror_drop_oldest) {
+		msg_info_session("mirrors queue is full (%ud messages), do not mirror "
+						 "this message",
+						 ctx->mirror_queue.length);
+		return;
+	}
+
+	msg = rspamd_http_connection_copy_msg(session->client_message, &err);
+
+	if (msg == NULL) {
+		msg_err_session("cannot copy message to send to mirrors: %e", err);
+
+		if (err) {
+			g_error_free(err);
+		}
+
+		return;
+	}
+
+	if (session->fname) {
+		/* File might be removed by a client before mirrors are done */
+		msg->flags &= ~RSPAMD_HTTP_FLAG_SHMEM;
+		rspamd_http_message_set_body(msg, session->map, session->map_len);
+	}
+
+	shadow = g_malloc0(sizeof(*shadow));
+	shadow->ctx = ctx;
+	shadow->worker = session->worker;
+	shadow->pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "proxy", 0);
+	/* Keep the same log tag to match results in compare scripts */
+	rspamd_strlcpy(shadow->pool->tag.uid, session->pool->tag.uid,
+				   sizeof(shadow->pool->tag.uid));
+	shadow->client_sock = -1;
+	shadow->client_message = msg;
+	shadow->mirror_conns = g_ptr_array_sized_new(ctx->mirrors->len);
+	shadow->mirror_coin = coin;
+	shadow->master_conn = rspamd_mempool_alloc0(shadow->pool,
+												sizeof(*shadow->master_conn));
+	shadow->master_conn->s = shadow;
+	shadow->master_conn->name = "master";
+	shadow->worker->nconns++;
+
+	/* Owned by the client session */
+	REF_INIT_RETAIN(shadow, proxy_session_dtor);
+	session->shadow = shadow;
+
+	if (ctx->sessions_cache) {
+		rspamd_worker_session_cache_add(ctx->sessions_cache,
+										shadow->pool->tag.uid, &shadow->ref.refcount, shadow);
+	}
+
+	REF_RETAIN(shadow);
+
+	if (ctx->mirror_concurrency == 0 ||
+		ctx->mirrors_inflight < ctx->mirror_concurrency) {
+		proxy_mirror_send(shadow);
+	}
+	else {
+		if (ctx->mirror_drop_oldest &&
+			ctx->mirror_queue.length >= ctx->mirror_queue_size) {
+			dropped = g_queue_pop_head(&ctx->mirror_queue);
+
+			if (dropped) {
+				msg_info_session("mirrors queue is full (%ud messages), drop "
+								 "the oldest message",
+								 ctx->mirror_queue.length + 1);
+				REF_RELEASE(dropped);
+			}
+		}
+
+		if (ctx->mirror_queue.length < ctx->mirror_queue_size) {
+			g_queue_push_tail(&ctx->mirror_queue, shadow);
+		}
+		else {
+			/* Zero sized queue */
+			REF_RELEASE(shadow);
+		}
+	}
 }
 
 static void
@@ -1637,6 +1942,195 @@ proxy_backend_master_error_handler(struct rspamd_http_connection *conn, GError *
 	}
 }
 
+static unsigned int
+proxy_cache_key_hash(gconstpointer key)
+{
+	unsigned int h;
+
+	/* Key is already a cryptographic digest */
+	memcpy(&h, key, sizeof(h));
+
+	return h;
+}
+
+static gboolean
+proxy_cache_key_equal(gconstpointer k1, gconstpointer k2)
+{
+	return memcmp(k1, k2, PROXY_CACHE_KEY_LEN) == 0;
+}
+
+static void
+proxy_cached_reply_free(gpointer p)
+{
+	struct rspamd_proxy_cached_reply *cached = p;
+
+	rspamd_fstring_free(cached->body);
+	g_free(cached->ctype);
+	g_ptr_array_free(cached->headers, TRUE);
+	g_free(cached);
+}
+
+static void
+proxy_cache_key_update_header(rspamd_cryptobox_hash_state_t *st,
+							  struct rspamd_http_message *msg,
+							  const char *name)
+{
+	GPtrArray *values;
+	rspamd_ftok_t *value;
+	unsigned int i;
+
+	values = rspamd_http_message_find_header_multiple(msg, name);
+
+	/* Mix header name in to distinguish an empty header from a missing one */
+	rspamd_cryptobox_hash_update(st, (const unsigned char *) name, strlen(name) + 1);
+
+	if (values) {
+		PTR_ARRAY_FOREACH(values, i, value)
+		{
+			rspamd_cryptobox_hash_update(st, (const unsigned char *) &value->len,
+										 sizeof(value->len));
+			rspamd_cryptobox_hash_update(st, (const unsigned char *) value->begin,
+										 value->len);
+		}
+
+		g_ptr_array_free(values, TRUE);
+	}
+}
+
+/*
+ * Computes the replies cache key for a client request. Returns NULL if the
+ * reply for this request should not be cached
+ */
+static unsigned char *
+proxy_cache_key(struct rspamd_proxy_session *session,
+				struct rspamd_http_message *msg)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	rspamd_cryptobox_hash_state_t st;
+	unsigned char digest[rspamd_cryptobox_HASHBYTES], *key;
+	const char *body;
+	gsize body_len;
+	unsigned int i;
+	GList *cur;
+
+	if (ctx->replies_cache == NULL || session->client_milter_conn ||
+		session->legacy_support != LEGACY_SUPPORT_NO) {
+		return NULL;
+	}
+
+	body = rspamd_http_message_get_body(msg, &body_len);
+
+	if (body == NULL || body_len == 0) {
+		return NULL;
+	}
+
+	rspamd_cryptobox_hash_init(&st, NULL, 0);
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) msg->url->str,
+								 msg->url->len);
+
+	for (i = 0; i < G_N_ELEMENTS(proxy_cache_fixed_headers); i++) {
+		proxy_cache_key_update_header(&st, msg, proxy_cache_fixed_headers[i]);
+	}
+
+	if (ctx->cache_headers) {
+		for (cur = ctx->cache_headers; cur != NULL; cur = g_list_next(cur)) {
+			proxy_cache_key_update_header(&st, msg, (const char *) cur->data);
+		}
+	}
+	else {
+		for (i = 0; i < G_N_ELEMENTS(proxy_cache_default_headers); i++) {
+			proxy_cache_key_update_header(&st, msg, proxy_cache_default_headers[i]);
+		}
+	}
+
+	rspamd_cryptobox_hash_update(&st, (const unsigned char *) body, body_len);
+	rspamd_cryptobox_hash_final(&st, digest);
+
+	key = rspamd_mempool_alloc(session->pool, PROXY_CACHE_KEY_LEN);
+	memcpy(key, digest, PROXY_CACHE_KEY_LEN);
+
+	return key;
+}
+
+/*
+ * Writes a cached reply to the client if there is one, returns TRUE in this case
+ */
+static gboolean
+proxy_cache_reply(struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_cached_reply *cached;
+	struct rspamd_http_message *reply;
+	unsigned int i;
+
+	cached = rspamd_lru_hash_lookup(session->ctx->replies_cache,
+									session->cache_key,
+									(time_t) ev_now(session->ctx->event_loop));
+
+	if (cached == NULL) {
+		return FALSE;
+	}
+
+	reply = rspamd_http_new_message(HTTP_RESPONSE);
+	reply->code = cached->code;
+	reply->date = time(NULL);
+	rspamd_http_message_set_body(reply, cached->body->str, cached->body->len);
+
+	for (i = 0; i + 1 < cached->headers->len; i += 2) {
+		rspamd_http_message_add_header(reply,
+									   g_ptr_array_index(cached->headers, i),
+									   g_ptr_array_index(cached->headers, i + 1));
+	}
+
+	msg_info_session("reply has been found in the cache");
+	/* There is nothing to store after this reply */
+	session->cache_key = NULL;
+	rspamd_http_connection_reset(session->client_conn);
+	rspamd_http_connection_write_message(session->client_conn,
+										 reply, NULL, cached->ctype, session,
+										 session->ctx->timeout);
+
+	return TRUE;
+}
+
+static void
+proxy_cache_store(struct rspamd_proxy_session *session,
+				  struct rspamd_http_message *msg,
+				  const char *ctype)
+{
+	struct rspamd_proxy_ctx *ctx = session->ctx;
+	struct rspamd_proxy_cached_reply *cached;
+	struct rspamd_http_header *hdr, *hcur;
+	unsigned char *key;
+
+	if (session->cache_key == NULL || msg->code != 200 ||
+		session->master_conn->results == NULL ||
+		msg->body_buf.len > ctx->cache_max_reply) {
+		return;
+	}
+
+	cached = g_malloc0(sizeof(*cached));
+	cached->code = msg->code;
+	cached->body = rspamd_fstring_new_init(msg->body_buf.begin, msg->body_buf.len);
+	cached->ctype = g_strdup(ctype);
+	cached->headers = g_ptr_array_new_full(4, g_free);
+
+	kh_foreach_value(msg->headers, hdr, {
+		DL_FOREACH(hdr, hcur)
+		{
+			g_ptr_array_add(cached->headers,
+							g_strndup(hcur->name.begin, hcur->name.len));
+			g_ptr_array_add(cached->headers,
+							g_strndup(hcur->value.begin, hcur->value.len));
+		}
+	});
+
+	key = g_malloc(PROXY_CACHE_KEY_LEN);
+	memcpy(key, session->cache_key, PROXY_CACHE_KEY_LEN);
+	rspamd_lru_hash_insert(ctx->replies_cache, key, cached,
+						   (time_t) ev_now(ctx->event_loop),
+						   (unsigned int) ctx->cache_ttl);
+}
+
 static int
 proxy_backend_master_finish_handler(struct rspamd_http_connection *conn,
 									struct rspamd_http_message *msg)
@@ -1718,6 +2212,7 @@ proxy_backend_master_finish_handler(struct rspamd_http_connection *conn,
 			rspamd_http_message_remove_header(msg, "Content-Type");
 		}
 
+		proxy_cache_store(session, msg, passed_ct);
 		rspamd_http_connection_write_message(session->client_conn,
 											 msg, NULL, passed_ct, session,
 											 bk_conn->timeout);
@@ -1763,7 +2258,7 @@ rspamd_proxy_scan_self_reply(struct rspamd_task *task)
 		ctype = "text/plain";
 		break;
 	case CMD_METRICS:
-		memcpy(&stat_copy, session->ctx->srv->stat, sizeof(stat_copy));
+		rspamd_main_stat_snapshot(session->ctx->srv, &stat_copy);
 		output = rspamd_metrics_to_prometheus_string(
 			rspamd_worker_metrics_object(task->cfg, &stat_copy, ev_time() - session->ctx->srv->start_time));
 		rspamd_http_message_set_body_from_fstring_steal(msg, output);
@@ -1866,15 +2361,11 @@ rspamd_proxy_task_fin(void *ud)
 	return FALSE;
 }
 
-static gboolean
-rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
+static struct rspamd_task *
+rspamd_proxy_self_scan_task_new(struct rspamd_proxy_session *session)
 {
 	struct rspamd_task *task;
-	struct rspamd_http_message *msg;
-	const char *data;
-	gsize len;
 
-	msg = session->client_message;
 	task = rspamd_task_new(session->worker, session->ctx->cfg,
 						   session->pool, session->ctx->lang_det,
 						   session->ctx->event_loop, FALSE);
@@ -1899,31 +2390,20 @@ rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
 	task->resolver = session->ctx->resolver;
 	task->s = rspamd_session_create(task->task_pool, rspamd_proxy_task_fin,
 									NULL, (event_finalizer_t) rspamd_task_free, task);
-	data = rspamd_http_message_get_body(msg, &len);
 
 	if (session->backend->settings_id) {
-		rspamd_http_message_remove_header(msg, "Settings-ID");
-		rspamd_http_message_add_header(msg, "Settings-ID",
+		rspamd_http_message_remove_header(session->client_message, "Settings-ID");
+		rspamd_http_message_add_header(session->client_message, "Settings-ID",
 									   session->backend->settings_id);
 	}
 
-	/* Process message */
-	if (!rspamd_protocol_handle_request(task, msg)) {
-		msg_err_task("cannot handle request: %e", task->err);
-		task->flags |= RSPAMD_TASK_FLAG_SKIP;
-	}
-	else {
-		if (task->cmd == CMD_PING || task->cmd == CMD_METRICS) {
-			task->flags |= RSPAMD_TASK_FLAG_SKIP;
-		}
-		else {
-			if (!rspamd_task_load_message(task, msg, data, len)) {
-				msg_err_task("cannot load message: %e", task->err);
-				task->flags |= RSPAMD_TASK_FLAG_SKIP;
-			}
-		}
-	}
+	return task;
+}
 
+static void
+rspamd_proxy_self_scan_start(struct rspamd_proxy_session *session,
+							 struct rspamd_task *task)
+{
 	/* Set global timeout for the task */
 	if (session->ctx->default_upstream->timeout > 0.0) {
 		task->timeout_ev.data = task;
@@ -1931,6 +2411,7 @@ rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
 					  session->ctx->default_upstream->timeout,
 					  session->ctx->default_upstream->timeout);
 		ev_timer_start(task->event_loop, &task->timeout_ev);
+		task->deadline = ev_now(task->event_loop) + session->ctx->default_upstream->timeout;
 	}
 	else if (session->ctx->has_self_scan) {
 		if (!isnan(session->ctx->task_timeout) && session->ctx->task_timeout > 0) {
@@ -1939,6 +2420,7 @@ rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
 						  session->ctx->cfg->task_timeout,
 						  session->ctx->default_upstream->timeout);
 			ev_timer_start(task->event_loop, &task->timeout_ev);
+			task->deadline = ev_now(task->event_loop) + session->ctx->cfg->task_timeout;
 		}
 	}
 
@@ -1946,6 +2428,38 @@ rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
 	rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL);
 
 	rspamd_session_pending(task->s);
+}
+
+static gboolean
+rspamd_proxy_self_scan(struct rspamd_proxy_session *session)
+{
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+	const char *data;
+	gsize len;
+
+	msg = session->client_message;
+	task = rspamd_proxy_self_scan_task_new(session);
+	data = rspamd_http_message_get_body(msg, &len);
+
+	/* Process message */
+	if (!rspamd_protocol_handle_request(task, msg)) {
+		msg_err_task("cannot handle request: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else {
+		if (task->cmd == CMD_PING || task->cmd == CMD_METRICS) {
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+		else {
+			if (!rspamd_task_load_message(task, msg, data, len)) {
+				msg_err_task("cannot load message: %e", task->err);
+				task->flags |= RSPAMD_TASK_FLAG_SKIP;
+			}
+		}
+	}
+
+	rspamd_proxy_self_scan_start(session, task);
 
 	return TRUE;
 }
@@ -2092,6 +2606,9 @@ proxy_send_master_message(struct rspamd_proxy_session *session)
 				rspamd_http_message_add_header(msg, "File", session->fname);
 			}
 
+			proxy_prepare_local_message(session,
+										session->master_conn->backend_conn, msg,
+										session->master_conn->up);
 			msg->method = HTTP_GET;
 
 			rspamd_http_connection_write_message_shared(
@@ -2203,6 +2720,11 @@ proxy_client_finish_handler(struct rspamd_http_connection *conn,
 		rspamd_http_message_remove_header(msg, "Keep-Alive");
 		rspamd_http_message_remove_header(msg, "Connection");
 		rspamd_http_message_remove_header(msg, "Key");
+		session->cache_key = proxy_cache_key(session, session->client_message);
+
+		if (session->cache_key && proxy_cache_reply(session)) {
+			return 0;
+		}
 
 		proxy_open_mirror_connections(session);
 		rspamd_http_connection_reset(session->client_conn);
@@ -2230,6 +2752,95 @@ err:
 	return 0;
 }
 
+/*
+ * Starts self scan of a milter message when all its headers are received,
+ * so connection filters and DNS requests run while MTA sends the body
+ */
+static void
+proxy_milter_eoh_handler(int fd,
+						 struct rspamd_milter_session *rms,
+						 void *ud)
+{
+	struct rspamd_proxy_session *session = ud;
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+
+	if (session->ctx->default_upstream == NULL ||
+		!session->ctx->default_upstream->self_scan) {
+		return;
+	}
+
+	session->client_milter_conn = rms;
+
+	if (!session->master_conn) {
+		session->master_conn = rspamd_mempool_alloc0(session->pool,
+													 sizeof(*session->master_conn));
+	}
+	else if (session->master_conn->task) {
+		/* Previous message has been aborted after its headers */
+		rspamd_session_destroy(session->master_conn->task->s);
+		session->master_conn->task = NULL;
+	}
+
+	if (session->client_message) {
+		rspamd_http_message_unref(session->client_message);
+	}
+
+	msg = rspamd_milter_envelope_to_http(rms);
+	session->master_conn->s = session;
+	session->master_conn->name = "master";
+	session->client_message = msg;
+	session->backend = session->ctx->default_upstream;
+
+	task = rspamd_proxy_self_scan_task_new(session);
+	task->flags |= RSPAMD_TASK_FLAG_BODY_PENDING;
+	session->master_conn->task = task;
+
+	if (!rspamd_protocol_handle_request(task, msg)) {
+		msg_err_task("cannot handle request: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else if (!rspamd_protocol_handle_headers(task, msg)) {
+		msg_err_task("cannot handle headers: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else {
+		msg_debug_task("start early processing, body is still being received");
+		/* Stops before reading the message, as the body is pending */
+		rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL);
+	}
+}
+
+static void
+proxy_milter_self_scan_complete(struct rspamd_proxy_session *session,
+								struct rspamd_milter_session *rms)
+{
+	struct rspamd_task *task = session->master_conn->task;
+	const char *data;
+	gsize len;
+
+	if (rms->message) {
+		rspamd_http_message_set_body_from_fstring_steal(session->client_message,
+														rms->message);
+		rms->message = NULL;
+	}
+
+	task->flags &= ~RSPAMD_TASK_FLAG_BODY_PENDING;
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+		data = rspamd_http_message_get_body(session->client_message, &len);
+
+		/* Headers have been already processed in proxy_milter_eoh_handler */
+		if (!rspamd_task_load_message(task, NULL, data, len)) {
+			msg_err_task("cannot load message: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+	}
+
+	proxy_open_mirror_connections(session);
+	rspamd_proxy_self_scan_start(session, task);
+}
+
 static void
 proxy_milter_finish_handler(int fd,
 							struct rspamd_milter_session *rms,
@@ -2245,6 +2856,10 @@ proxy_milter_finish_handler(int fd,
 		proxy_backend_close_connection(session->master_conn);
 		REF_RELEASE(session);
 	}
+	else if (session->master_conn && session->master_conn->task &&
+			 (session->master_conn->task->flags & RSPAMD_TASK_FLAG_BODY_PENDING)) {
+		proxy_milter_self_scan_complete(session, rms);
+	}
 	else {
 		if (!session->master_conn) {
 			session->master_conn = rspamd_mempool_alloc0(session->pool,
@@ -2439,6 +3054,15 @@ start_rspamd_proxy(struct rspamd_worker *worker)
 								  (rspamd_mempool_destruct_t) rspamd_http_context_free,
 								  ctx->http_ctx);
 
+	if (ctx->cache_size > 0 && !ctx->milter) {
+		ctx->replies_cache = rspamd_lru_hash_new_full(ctx->cache_size,
+													  g_free, proxy_cached_reply_free,
+													  proxy_cache_key_hash, proxy_cache_key_equal);
+		rspamd_mempool_add_destructor(ctx->cfg->cfg_pool,
+									  (rspamd_mempool_destruct_t) rspamd_lru_hash_destroy,
+									  ctx->replies_cache);
+	}
+
 	if (ctx->has_self_scan) {
 		/* Additional initialisation needed */
 		rspamd_worker_init_scanner(worker, ctx->event_loop, ctx->resolver,
@@ -2465,6 +3089,11 @@ start_rspamd_proxy(struct rspamd_worker *worker)
 	ctx->milter_ctx.quarantine_message = ctx->quarantine_message;
 	ctx->milter_ctx.tempfail_message = ctx->tempfail_message;
 	ctx->milter_ctx.cfg = ctx->cfg;
+
+	if (ctx->milter_early_scan && ctx->has_self_scan) {
+		ctx->milter_ctx.eoh_cb = proxy_milter_eoh_handler;
+	}
+
 	rspamd_milter_init_library(&ctx->milter_ctx);
 
 	if (is_controller) {
@@ -25,6 +25,7 @@
 #include "libserver/cfg_file.h"
 #include "libserver/url.h"
 #include "libserver/dns.h"
+#include "libserver/re_cache.h"
 #include "libmime/message.h"
 #include "rspamd.h"
 #include "libstat/stat_api.h"
@@ -33,6 +34,7 @@
 #include "worker_private.h"
 #include "libserver/http/http_private.h"
 #include "libserver/cfg_file_private.h"
+#include "libutil/cxx/cpu_pool.h"
 #include <math.h>
 #include "unix-std.h"
 
@@ -74,6 +76,12 @@ struct rspamd_worker_session {
 	struct rspamd_worker_ctx *ctx;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_worker *worker;
+	/* Connection has been kept alive after a previous request */
+	gboolean reused;
+	/* Streaming mode: part of the body already searched for the end of headers */
+	gsize stream_scanned;
+	/* Streaming mode: headers have been processed before the body is complete */
+	gboolean stream_headers;
 };
 /*
  * Reduce number of tasks proceeded
@@ -102,12 +110,178 @@ reduce_tasks_count(gpointer arg)
 	}
 }
 
-static int
-rspamd_worker_body_handler(struct rspamd_http_connection *conn,
-						   struct rspamd_http_message *msg,
-						   const char *chunk, gsize len)
+/*
+ * Regexp batching: tasks that have got their messages processed in the same
+ * loop iteration are scanned by hyperscan together before filters are started,
+ * so databases and scratch space stay warm for the whole batch; with cpu_threads
+ * the scan itself is executed in the worker cpu pool
+ */
+
+/* Task waiting for a batch, allocated from the task pool */
+struct rspamd_worker_re_batch_elt {
+	struct rspamd_task *task;
+	struct rspamd_worker_ctx *ctx;
+	/* Session event is still registered */
+	gboolean waiting;
+};
+
+/* Batch scanned in the cpu pool, tasks are held until it is finished */
+struct rspamd_worker_re_batch_job {
+	struct rspamd_re_cache_batch *batch;
+	unsigned int nelts;
+	struct rspamd_worker_re_batch_elt *elts[];
+};
+
+static void
+rspamd_worker_re_batch_fin(gpointer ud)
+{
+	struct rspamd_worker_re_batch_elt *elt = (struct rspamd_worker_re_batch_elt *) ud;
+
+	/* Task could be terminated whilst waiting for the batch */
+	elt->waiting = FALSE;
+	g_ptr_array_remove_fast(elt->ctx->re_batch, elt);
+}
+
+static void
+rspamd_worker_re_batch_resume(struct rspamd_worker_re_batch_elt **elts,
+							  unsigned int nelts, gboolean held)
+{
+	struct rspamd_task *task;
+	unsigned int i;
+
+	for (i = 0; i < nelts; i++) {
+		task = elts[i]->task;
+
+		if (elts[i]->waiting) {
+			/* Processing of the task is resumed once the event is removed */
+			rspamd_session_remove_event(task->s, rspamd_worker_re_batch_fin,
+										elts[i]);
+		}
+
+		if (held) {
+			/* Task and the element can be freed here */
+			rspamd_task_release(task);
+		}
+	}
+}
+
+static void
+rspamd_worker_re_batch_work(void *ud)
+{
+	struct rspamd_worker_re_batch_job *job = (struct rspamd_worker_re_batch_job *) ud;
+
+	rspamd_re_cache_batch_scan(job->batch);
+}
+
+static void
+rspamd_worker_re_batch_done(void *ud)
+{
+	struct rspamd_worker_re_batch_job *job = (struct rspamd_worker_re_batch_job *) ud;
+
+	rspamd_re_cache_batch_finish(job->batch);
+	rspamd_worker_re_batch_resume(job->elts, job->nelts, TRUE);
+	g_free(job);
+}
+
+static void
+rspamd_worker_re_batch_flush(struct rspamd_worker_ctx *ctx)
+{
+	struct rspamd_worker_re_batch_elt **elts;
+	struct rspamd_worker_re_batch_job *job;
+	struct rspamd_re_cache_batch *batch = NULL;
+	struct rspamd_cpu_pool *pool;
+	struct rspamd_task **tasks;
+	unsigned int ntasks = ctx->re_batch->len, i;
+
+	ev_timer_stop(ctx->event_loop, &ctx->re_batch_ev);
+
+	if (ntasks == 0) {
+		return;
+	}
+
+	elts = g_alloca(sizeof(*elts) * ntasks);
+	tasks = g_alloca(sizeof(*tasks) * ntasks);
+	memcpy(elts, ctx->re_batch->pdata, sizeof(*elts) * ntasks);
+	g_ptr_array_set_size(ctx->re_batch, 0);
+
+	for (i = 0; i < ntasks; i++) {
+		tasks[i] = elts[i]->task;
+	}
+
+	if (ntasks > 1) {
+		batch = rspamd_re_cache_batch_new(tasks, ntasks);
+	}
+
+	if (batch != NULL) {
+		msg_debug("scan %ud tasks in a single regexp batch", ntasks);
+		pool = tasks[0]->worker ? tasks[0]->worker->cpu_pool : NULL;
+
+		if (pool != NULL) {
+			job = g_malloc(sizeof(*job) + sizeof(*elts) * ntasks);
+			job->batch = batch;
+			job->nelts = ntasks;
+			memcpy(job->elts, elts, sizeof(*elts) * ntasks);
+
+			if (rspamd_cpu_pool_push(pool, rspamd_worker_re_batch_work,
+									 rspamd_worker_re_batch_done, job)) {
+				/* Inputs of the batch point to the tasks memory */
+				for (i = 0; i < ntasks; i++) {
+					rspamd_task_hold(tasks[i]);
+				}
+
+				return;
+			}
+
+			g_free(job);
+		}
+
+		rspamd_re_cache_batch_scan(batch);
+		rspamd_re_cache_batch_finish(batch);
+	}
+
+	rspamd_worker_re_batch_resume(elts, ntasks, FALSE);
+}
+
+static void
+rspamd_worker_re_batch_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *) w->data;
+
+	rspamd_worker_re_batch_flush(ctx);
+}
+
+static void
+rspamd_worker_re_batch_add(struct rspamd_task *task, void *arg)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *) arg;
+	struct rspamd_worker_re_batch_elt *elt;
+
+	if (task->message == NULL || RSPAMD_TASK_IS_EMPTY(task)) {
+		return;
+	}
+
+	elt = rspamd_mempool_alloc(task->task_pool, sizeof(*elt));
+	elt->task = task;
+	elt->ctx = ctx;
+	elt->waiting = TRUE;
+	rspamd_session_add_event(task->s, rspamd_worker_re_batch_fin, elt,
+							 "re_batch");
+	g_ptr_array_add(ctx->re_batch, elt);
+
+	if (ctx->re_batch->len >= ctx->re_batch_size) {
+		rspamd_worker_re_batch_flush(ctx);
+	}
+	else if (!ev_is_active(&ctx->re_batch_ev)) {
+		/* Wait for other tasks ready in this loop iteration */
+		ev_timer_set(&ctx->re_batch_ev, 0.0, 0.0);
+		ev_timer_start(ctx->event_loop, &ctx->re_batch_ev);
+	}
+}
+
+static struct rspamd_task *
+rspamd_worker_session_task_new(struct rspamd_worker_session *session,
+							   struct rspamd_http_message *msg)
 {
-	struct rspamd_worker_session *session = (struct rspamd_worker_session *) conn->ud;
 	struct rspamd_task *task;
 	struct rspamd_worker_ctx *ctx;
 	const rspamd_ftok_t *hv_tok;
@@ -132,11 +306,27 @@ rspamd_worker_body_handler(struct rspamd_http_connection *conn,
 						   debug_mempool);
 	session->task = task;
 
+	if (ctx->re_batch_size > 1) {
+		task->processed_callback = rspamd_worker_re_batch_add;
+		task->processed_arg = ctx;
+	}
+
 	msg_info_task("accepted connection from %s port %d, task ptr: %p",
 				  rspamd_inet_address_to_string(session->addr),
 				  rspamd_inet_address_get_port(session->addr),
 				  task);
 
+	if (ctx->keepalive &&
+		(hv_tok = rspamd_http_message_find_header(msg, "Connection")) != NULL) {
+		rspamd_ftok_t cmp;
+
+		RSPAMD_FTOK_ASSIGN(&cmp, "keep-alive");
+
+		if (rspamd_ftok_casecmp(hv_tok, &cmp) == 0) {
+			task->protocol_flags |= RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE;
+		}
+	}
+
 	/* Copy some variables */
 	if (ctx->is_mime) {
 		task->flags |= RSPAMD_TASK_FLAG_MIME;
@@ -167,6 +357,224 @@ rspamd_worker_body_handler(struct rspamd_http_connection *conn,
 	task->s = rspamd_session_create(task->task_pool, rspamd_task_fin,
 									NULL, (event_finalizer_t) rspamd_task_free, task);
 
+	return task;
+}
+
+static void
+rspamd_worker_task_run(struct rspamd_worker_ctx *ctx, struct rspamd_task *task)
+{
+	/* Set global timeout for the task */
+	if (!isnan(ctx->task_timeout) && ctx->task_timeout > 0.0) {
+		ev_tstamp after = ctx->task_timeout;
+
+		if (task->deadline > 0) {
+			/* Streamed task: the timeout has been started with early processing */
+			after = MAX(task->deadline - ev_now(task->event_loop), 0.0);
+		}
+		else {
+			/* Async requests of the task are limited by this deadline */
+			task->deadline = ev_now(task->event_loop) + ctx->task_timeout;
+		}
+
+		task->timeout_ev.data = task;
+		ev_timer_init(&task->timeout_ev, rspamd_task_timeout,
+					  after,
+					  ctx->task_timeout);
+		ev_set_priority(&task->timeout_ev, EV_MAXPRI);
+		ev_timer_start(task->event_loop, &task->timeout_ev);
+	}
+
+	/* Set socket guard */
+	task->guard_ev.data = task;
+	ev_io_init(&task->guard_ev,
+			   rspamd_worker_guard_handler,
+			   task->sock, EV_READ);
+	ev_io_start(task->event_loop, &task->guard_ev);
+
+	rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL);
+}
+
+/*
+ * Adaptive concurrency limiter: additive increase of the limit while tasks
+ * finish within target latency and multiplicative decrease otherwise.
+ * Tasks above the limit wait in a FIFO queue for at most `queue_timeout`
+ * and are rejected with a temporary error afterwards, so a client could
+ * retry elsewhere instead of waiting for a task timeout.
+ */
+struct rspamd_worker_limiter_elt {
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
+	GList *link; /* Set when a task is queued */
+	ev_tstamp start;
+	gboolean admitted;
+};
+
+static GQuark
+rspamd_worker_quark(void)
+{
+	return g_quark_from_static_string("worker");
+}
+
+static void
+rspamd_worker_limiter_reject(struct rspamd_worker_limiter_elt *elt)
+{
+	struct rspamd_task *task = elt->task;
+
+	msg_info_task("reject task: %ud tasks in flight, limit is %.1f",
+				  elt->ctx->inflight, elt->ctx->concurrency_limit);
+	g_set_error(&task->err, rspamd_worker_quark(), 503,
+				"server is overloaded, try again later");
+	task->flags |= RSPAMD_TASK_FLAG_SKIP;
+}
+
+static void
+rspamd_worker_limiter_admit(struct rspamd_worker_limiter_elt *elt)
+{
+	elt->admitted = TRUE;
+	elt->start = ev_now(elt->ctx->event_loop);
+	elt->ctx->inflight++;
+}
+
+static void
+rspamd_worker_limiter_dequeue(struct rspamd_worker_limiter_elt *elt)
+{
+	struct rspamd_worker_ctx *ctx = elt->ctx;
+
+	g_queue_delete_link(&ctx->pending, elt->link);
+	elt->link = NULL;
+	/* Both watchers are initialised again when the task is started */
+	ev_timer_stop(ctx->event_loop, &elt->task->timeout_ev);
+	ev_io_stop(ctx->event_loop, &elt->task->guard_ev);
+}
+
+static void
+rspamd_worker_limiter_pending_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_ctx *ctx = (struct rspamd_worker_ctx *) w->data;
+	struct rspamd_worker_limiter_elt *elt;
+
+	ev_timer_stop(EV_A_ w);
+
+	while (ctx->pending.length > 0 &&
+		   ctx->inflight < (unsigned int) ctx->concurrency_limit) {
+		elt = (struct rspamd_worker_limiter_elt *) g_queue_peek_head(&ctx->pending);
+		rspamd_worker_limiter_dequeue(elt);
+		rspamd_worker_limiter_admit(elt);
+		rspamd_worker_task_run(ctx, elt->task);
+	}
+}
+
+static void
+rspamd_worker_limiter_queue_timeout(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_worker_limiter_elt *elt = (struct rspamd_worker_limiter_elt *) w->data;
+
+	rspamd_worker_limiter_dequeue(elt);
+	rspamd_worker_limiter_reject(elt);
+	rspamd_worker_task_run(elt->ctx, elt->task);
+}
+
+static void
+rspamd_worker_limiter_release(gpointer p)
+{
+	struct rspamd_worker_limiter_elt *elt = (struct rspamd_worker_limiter_elt *) p;
+	struct rspamd_worker_ctx *ctx = elt->ctx;
+	ev_tstamp now, latency;
+
+	if (elt->link) {
+		/* Task is destroyed while waiting, e.g. a client has gone */
+		g_queue_delete_link(&ctx->pending, elt->link);
+		elt->link = NULL;
+
+		return;
+	}
+
+	if (!elt->admitted) {
+		return;
+	}
+
+	now = ev_now(ctx->event_loop);
+	latency = now - elt->start;
+	ctx->inflight--;
+
+	if (latency > ctx->target_latency) {
+		/* Decrease once per latency window, not for each slow task */
+		if (now - ctx->last_decrease > ctx->target_latency) {
+			ctx->concurrency_limit = MAX(1.0, ctx->concurrency_limit * 0.9);
+			ctx->last_decrease = now;
+			msg_info_ctx("task latency %.2f exceeds target %.2f, decrease limit to %.1f",
+						 latency, ctx->target_latency, ctx->concurrency_limit);
+		}
+	}
+	else if (ctx->concurrency_limit < ctx->max_concurrency) {
+		ctx->concurrency_limit = MIN((double) ctx->max_concurrency,
+									 ctx->concurrency_limit + 1.0 / ctx->concurrency_limit);
+	}
+
+	if (ctx->pending.length > 0 && !ev_is_active(&ctx->pending_ev)) {
+		/* Start queued tasks outside of this task destruction */
+		ev_timer_set(&ctx->pending_ev, 0.0, 0.0);
+		ev_timer_start(ctx->event_loop, &ctx->pending_ev);
+	}
+}
+
+static void
+rspamd_worker_task_start(struct rspamd_worker_ctx *ctx, struct rspamd_task *task)
+{
+	struct rspamd_worker_limiter_elt *elt;
+
+	if (ctx->max_concurrency == 0 || (task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+		rspamd_worker_task_run(ctx, task);
+
+		return;
+	}
+
+	elt = rspamd_mempool_alloc0(task->task_pool, sizeof(*elt));
+	elt->ctx = ctx;
+	elt->task = task;
+	rspamd_mempool_add_destructor(task->task_pool,
+								  (rspamd_mempool_destruct_t) rspamd_worker_limiter_release,
+								  elt);
+
+	if (ctx->pending.length == 0 &&
+		ctx->inflight < (unsigned int) ctx->concurrency_limit) {
+		rspamd_worker_limiter_admit(elt);
+	}
+	else if (ctx->queue_timeout > 0) {
+		msg_debug_task("queue task: %ud tasks in flight, limit is %.1f",
+					   ctx->inflight, ctx->concurrency_limit);
+		g_queue_push_tail(&ctx->pending, elt);
+		elt->link = ctx->pending.tail;
+
+		task->timeout_ev.data = elt;
+		ev_timer_init(&task->timeout_ev, rspamd_worker_limiter_queue_timeout,
+					  ctx->queue_timeout, 0.0);
+		ev_timer_start(task->event_loop, &task->timeout_ev);
+		/* Detect clients that have gone while waiting */
+		task->guard_ev.data = task;
+		ev_io_init(&task->guard_ev,
+				   rspamd_worker_guard_handler,
+				   task->sock, EV_READ);
+		ev_io_start(task->event_loop, &task->guard_ev);
+
+		return;
+	}
+	else {
+		rspamd_worker_limiter_reject(elt);
+	}
+
+	rspamd_worker_task_run(ctx, task);
+}
+
+static void
+rspamd_worker_process_request(struct rspamd_worker_session *session,
+							  struct rspamd_http_message *msg,
+							  const char *chunk, gsize len)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_worker_session_task_new(session, msg);
+
 	if (!rspamd_protocol_handle_request(task, msg)) {
 		msg_err_task("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -183,24 +591,156 @@ rspamd_worker_body_handler(struct rspamd_http_connection *conn,
 		}
 	}
 
-	/* Set global timeout for the task */
+	rspamd_worker_task_start(session->ctx, task);
+}
+
+static void rspamd_worker_error_handler(struct rspamd_http_connection *conn,
+										GError *err);
+
+static void
+rspamd_worker_stream_timeout(EV_P_ ev_timer *w, int revents)
+{
+	struct rspamd_task *task = (struct rspamd_task *) w->data;
+	GError *err;
+
+	ev_timer_stop(EV_A_ w);
+	msg_info_task("message body has not been received in %.1fs",
+				  ev_now(EV_A) - task->task_timestamp);
+	err = g_error_new(rspamd_worker_quark(), 408,
+					  "message body has not been received in time");
+	rspamd_worker_error_handler(task->http_conn, err);
+	g_error_free(err);
+}
+
+/*
+ * Streaming mode: the task is created when the first portion of the body
+ * arrives, so the stages that do not need the message itself (connection
+ * filters and so on) run while the client is still uploading it
+ */
+static void
+rspamd_worker_stream_begin(struct rspamd_worker_session *session,
+						   struct rspamd_http_message *msg)
+{
+	struct rspamd_task *task;
+	struct rspamd_worker_ctx *ctx = session->ctx;
+
+	task = rspamd_worker_session_task_new(session, msg);
+	task->flags |= RSPAMD_TASK_FLAG_BODY_PENDING;
+
+	/* Task timeout starts with early processing, so slow clients cannot hold it */
 	if (!isnan(ctx->task_timeout) && ctx->task_timeout > 0.0) {
 		task->timeout_ev.data = task;
-		ev_timer_init(&task->timeout_ev, rspamd_task_timeout,
-					  ctx->task_timeout,
-					  ctx->task_timeout);
+		ev_timer_init(&task->timeout_ev, rspamd_worker_stream_timeout,
+					  ctx->task_timeout, 0.0);
 		ev_set_priority(&task->timeout_ev, EV_MAXPRI);
 		ev_timer_start(task->event_loop, &task->timeout_ev);
+		task->deadline = ev_now(task->event_loop) + ctx->task_timeout;
 	}
 
-	/* Set socket guard */
-	task->guard_ev.data = task;
-	ev_io_init(&task->guard_ev,
-			   rspamd_worker_guard_handler,
-			   task->sock, EV_READ);
-	ev_io_start(task->event_loop, &task->guard_ev);
+	if (!rspamd_protocol_handle_request(task, msg)) {
+		msg_err_task("cannot handle request: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else if (task->cmd == CMD_PING || task->cmd == CMD_METRICS) {
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else if (!rspamd_protocol_handle_headers(task, msg)) {
+		msg_err_task("cannot handle headers: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+	else {
+		msg_debug_task("start early processing, body is still being received");
+		/* Stops before reading the message, as the body is pending */
+		rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL);
+	}
+}
 
-	rspamd_task_process(task, RSPAMD_TASK_PROCESS_ALL);
+/*
+ * Streaming mode: once the headers are received, prefilters that need nothing
+ * but headers are started while the rest of the body is being uploaded
+ */
+static void
+rspamd_worker_stream_headers(struct rspamd_worker_session *session,
+							 struct rspamd_task *task,
+							 struct rspamd_http_message *msg)
+{
+	const char *p = msg->body_buf.begin, *end = p + msg->body_buf.len, *c;
+	gsize hdrs_len = 0;
+
+	if (session->stream_headers || (task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+		return;
+	}
+
+	/* Data before stream_scanned has been already checked */
+	c = p + (session->stream_scanned > 3 ? session->stream_scanned - 3 : 0);
+
+	while (c < end && (c = memchr(c, '\n', end - c)) != NULL) {
+		if (c + 1 < end && c[1] == '\n') {
+			hdrs_len = c + 1 - p;
+			break;
+		}
+		if (c + 2 < end && c[1] == '\r' && c[2] == '\n') {
+			hdrs_len = c + 1 - p;
+			break;
+		}
+		c++;
+	}
+
+	session->stream_scanned = msg->body_buf.len;
+
+	if (hdrs_len == 0) {
+		return;
+	}
+
+	session->stream_headers = TRUE;
+
+	if (rspamd_message_parse_headers(task, p, hdrs_len)) {
+		msg_debug_task("headers are received (%z bytes), run headers only prefilters",
+					   hdrs_len);
+		rspamd_symcache_process_symbols(task, task->cfg->cache,
+										RSPAMD_TASK_STAGE_PRE_FILTERS);
+	}
+}
+
+static void
+rspamd_worker_stream_complete(struct rspamd_worker_session *session,
+							  struct rspamd_task *task,
+							  struct rspamd_http_message *msg)
+{
+	task->flags &= ~RSPAMD_TASK_FLAG_BODY_PENDING;
+	ev_timer_stop(task->event_loop, &task->timeout_ev);
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+		/* Headers have been already processed in rspamd_worker_stream_begin */
+		if (!rspamd_task_load_message(task, NULL, msg->body_buf.begin,
+									  msg->body_buf.len)) {
+			msg_err_task("cannot load message: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+	}
+
+	rspamd_worker_task_start(session->ctx, task);
+}
+
+static int
+rspamd_worker_body_handler(struct rspamd_http_connection *conn,
+						   struct rspamd_http_message *msg,
+						   const char *chunk, gsize len)
+{
+	struct rspamd_worker_session *session = (struct rspamd_worker_session *) conn->ud;
+
+	if (conn->opts & RSPAMD_HTTP_BODY_PARTIAL) {
+		/* Body parts are accumulated in msg, the rest is done in finish handler */
+		if (session->task == NULL) {
+			rspamd_worker_stream_begin(session, msg);
+		}
+
+		rspamd_worker_stream_headers(session, session->task, msg);
+
+		return 0;
+	}
+
+	rspamd_worker_process_request(session, msg, chunk, len);
 
 	return 0;
 }
@@ -250,6 +790,8 @@ rspamd_worker_error_handler(struct rspamd_http_connection *conn, GError *err)
 		}
 		else {
 			task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+			/* Connection state is unknown after an error */
+			task->protocol_flags &= ~RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE;
 			msg = rspamd_http_new_message(HTTP_RESPONSE);
 
 			if (err) {
@@ -280,8 +822,15 @@ rspamd_worker_error_handler(struct rspamd_http_connection *conn, GError *err)
 	}
 	else {
 		/* If there was no task, then session is unmanaged */
-		msg_info("no data received from: %s, error: %e",
-				 rspamd_inet_address_to_string_pretty(session->addr), err);
+		if (session->reused) {
+			/* Client has closed an idle connection */
+			msg_debug("keep-alive connection from %s is closed: %e",
+					  rspamd_inet_address_to_string_pretty(session->addr), err);
+		}
+		else {
+			msg_info("no data received from: %s, error: %e",
+					 rspamd_inet_address_to_string_pretty(session->addr), err);
+		}
 		rspamd_http_connection_reset(session->http_conn);
 		rspamd_http_connection_unref(session->http_conn);
 		rspamd_inet_address_free(session->addr);
@@ -290,6 +839,9 @@ rspamd_worker_error_handler(struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+static void rspamd_worker_session_start(struct rspamd_worker *worker, int nfd,
+										rspamd_inet_addr_t *addr, gboolean reused);
+
 static int
 rspamd_worker_finish_handler(struct rspamd_http_connection *conn,
 							 struct rspamd_http_message *msg)
@@ -306,8 +858,41 @@ rspamd_worker_finish_handler(struct rspamd_http_connection *conn,
 		task = (struct rspamd_task *) conn->ud;
 	}
 
+	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) && session->magic == G_MAXINT64) {
+		if (task == NULL) {
+			/* Body handler is not called for requests with no body */
+			rspamd_worker_process_request(session, msg,
+										  msg->body_buf.begin, msg->body_buf.len);
+
+			return 0;
+		}
+		else if (task->flags & RSPAMD_TASK_FLAG_BODY_PENDING) {
+			rspamd_worker_stream_complete(session, task, msg);
+
+			return 0;
+		}
+	}
+
 	if (task) {
 		if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+			if ((task->protocol_flags & RSPAMD_TASK_PROTOCOL_FLAG_KEEP_ALIVE) &&
+				task->sock != -1 &&
+				task->worker->state == rspamd_worker_state_running) {
+				struct rspamd_worker *worker = task->worker;
+				rspamd_inet_addr_t *addr;
+				int fd = task->sock;
+
+				msg_debug_task("keep connection from %s for the next request",
+							   rspamd_inet_address_to_string(task->client_addr));
+				addr = rspamd_inet_address_copy(task->client_addr, NULL);
+				/* Socket is not closed with the task */
+				task->sock = -1;
+				rspamd_session_destroy(task->s);
+				rspamd_worker_session_start(worker, fd, addr, TRUE);
+
+				return 0;
+			}
+
 			/* We are done here */
 			msg_debug_task("normally closing connection from: %s",
 						   rspamd_inet_address_to_string(task->client_addr));
@@ -332,38 +917,16 @@ rspamd_worker_finish_handler(struct rspamd_http_connection *conn,
 }
 
 /*
- * Accept new connection and construct task
+ * Starts reading a request from a connection, that is either just accepted
+ * or kept alive after the previous request
  */
 static void
-accept_socket(EV_P_ ev_io *w, int revents)
+rspamd_worker_session_start(struct rspamd_worker *worker, int nfd,
+							rspamd_inet_addr_t *addr, gboolean reused)
 {
-	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
-	struct rspamd_worker_ctx *ctx;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
 	struct rspamd_worker_session *session;
-	rspamd_inet_addr_t *addr = NULL;
-	int nfd, http_opts = 0;
-
-	ctx = worker->ctx;
-
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
-		msg_info_ctx("current tasks is now: %uD while maximum is: %uD",
-					 worker->nconns,
-					 ctx->max_tasks);
-		return;
-	}
-
-	if ((nfd =
-			 rspamd_accept_from_socket(w->fd, &addr,
-									   rspamd_worker_throttle_accept_events, worker->accept_events)) == -1) {
-		msg_warn_ctx("accept failed: %s", strerror(errno));
-		return;
-	}
-	/* Check for EAGAIN */
-	if (nfd == 0) {
-		rspamd_inet_address_free(addr);
-
-		return;
-	}
+	int http_opts = 0;
 
 	session = g_malloc0(sizeof(*session));
 	session->magic = G_MAXINT64;
@@ -371,11 +934,17 @@ accept_socket(EV_P_ ev_io *w, int revents)
 	session->fd = nfd;
 	session->ctx = ctx;
 	session->worker = worker;
+	session->reused = reused;
 
 	if (ctx->encrypted_only && !rspamd_inet_address_is_local(addr)) {
 		http_opts = RSPAMD_HTTP_REQUIRE_ENCRYPTION;
 	}
 
+	if (ctx->streaming_scan && ctx->key == NULL) {
+		/* Encrypted bodies cannot be processed incrementally */
+		http_opts |= RSPAMD_HTTP_BODY_PARTIAL;
+	}
+
 	session->http_conn = rspamd_http_connection_new_server(
 		ctx->http_ctx,
 		nfd,
@@ -384,7 +953,6 @@ accept_socket(EV_P_ ev_io *w, int revents)
 		rspamd_worker_finish_handler,
 		http_opts);
 
-	worker->srv->stat->connections_count++;
 	rspamd_http_connection_set_max_size(session->http_conn,
 										ctx->cfg->max_message);
 
@@ -392,11 +960,64 @@ accept_socket(EV_P_ ev_io *w, int revents)
 		rspamd_http_connection_set_key(session->http_conn, ctx->key);
 	}
 
+	if (rspamd_inet_address_get_af(addr) == AF_UNIX) {
+		/* Local proxy can pass messages as shared memory descriptors */
+		rspamd_http_connection_allow_fd_passing(session->http_conn);
+	}
+
 	rspamd_http_connection_read_message(session->http_conn,
 										session,
 										ctx->timeout);
 }
 
+/*
+ * Accept new connection and construct task
+ */
+static void
+accept_socket(EV_P_ ev_io *w, int revents)
+{
+	struct rspamd_worker *worker = (struct rspamd_worker *) w->data;
+	struct rspamd_worker_ctx *ctx;
+	rspamd_inet_addr_t *addr = NULL;
+	int nfd;
+
+	ctx = worker->ctx;
+
+	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
+		msg_info_ctx("current tasks is now: %uD while maximum is: %uD",
+					 worker->nconns,
+					 ctx->max_tasks);
+		return;
+	}
+
+	if (worker->memory_pressure) {
+		unsigned int limit = ctx->max_tasks != 0 ? ctx->max_tasks : worker->pressure_conns;
+
+		/* Concurrency is halved while memory is short, tasks in flight are finished as usual */
+		if (worker->nconns >= MAX(limit / 2, 1)) {
+			msg_debug("do not accept new tasks due to memory pressure: %ud tasks are in flight",
+					  worker->nconns);
+			return;
+		}
+	}
+
+	if ((nfd =
+			 rspamd_accept_from_socket(w->fd, &addr,
+									   rspamd_worker_throttle_accept_events, worker->accept_events)) == -1) {
+		msg_warn_ctx("accept failed: %s", strerror(errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		rspamd_inet_address_free(addr);
+
+		return;
+	}
+
+	RSPAMD_STAT_INC(rspamd_main_local_stat(worker->srv), connections_count);
+	rspamd_worker_session_start(worker, nfd, addr, FALSE);
+}
+
 gpointer
 init_worker(struct rspamd_config *cfg)
 {
@@ -412,6 +1033,9 @@ init_worker(struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = NAN;
+	ctx->target_latency = NAN;
+	ctx->queue_timeout = 0.5;
+	ctx->keepalive = FALSE;
 
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
@@ -462,6 +1086,36 @@ init_worker(struct rspamd_config *cfg)
 									  RSPAMD_CL_FLAG_INT_32,
 									  "Maximum count of parallel tasks processed by a single worker process");
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "cpu_threads",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  cpu_threads),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Number of threads used to offload cpu bound jobs from the event loop (default: 0, disabled)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "streaming_scan",
+									  rspamd_rcl_parse_struct_boolean,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  streaming_scan),
+									  0,
+									  "Start processing of a task before the whole message is received (default: false, not used with keypair)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "keepalive",
+									  rspamd_rcl_parse_struct_boolean,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  keepalive),
+									  0,
+									  "Keep connection open after a reply if a client asks for it (default: false)");
+
 	rspamd_rcl_register_worker_option(cfg,
 									  type,
 									  "keypair",
@@ -472,6 +1126,46 @@ init_worker(struct rspamd_config *cfg)
 									  0,
 									  "Encryption keypair");
 
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "max_concurrency",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  max_concurrency),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Upper bound of the adaptive limit of in-flight tasks (default: 0, disabled)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "target_latency",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  target_latency),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "Tasks processed longer than this decrease concurrency limit (default: quarter of task_timeout)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "queue_timeout",
+									  rspamd_rcl_parse_struct_time,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  queue_timeout),
+									  RSPAMD_CL_FLAG_TIME_FLOAT,
+									  "Maximum time for a task to wait when concurrency limit is reached, 0 to reject immediately (default: 0.5 seconds)");
+
+	rspamd_rcl_register_worker_option(cfg,
+									  type,
+									  "re_batch_size",
+									  rspamd_rcl_parse_struct_integer,
+									  ctx,
+									  G_STRUCT_OFFSET(struct rspamd_worker_ctx,
+													  re_batch_size),
+									  RSPAMD_CL_FLAG_UINT,
+									  "Scan up to this number of concurrent tasks with hyperscan at once (default: 0, disabled)");
+
 	return ctx;
 }
 
@@ -492,6 +1186,25 @@ start_worker(struct rspamd_worker *worker)
 
 	ctx->task_timeout = rspamd_worker_check_and_adjust_timeout(ctx->cfg, ctx->task_timeout);
 
+	if (ctx->max_concurrency > 0) {
+		if (isnan(ctx->target_latency) || ctx->target_latency <= 0) {
+			ctx->target_latency = (!isnan(ctx->task_timeout) && ctx->task_timeout > 0) ? ctx->task_timeout / 4.0 : 2.0;
+		}
+
+		ctx->concurrency_limit = ctx->max_concurrency;
+		g_queue_init(&ctx->pending);
+		ctx->pending_ev.data = ctx;
+		ev_timer_init(&ctx->pending_ev, rspamd_worker_limiter_pending_cb, 0.0, 0.0);
+		msg_info_ctx("adaptive concurrency limit is enabled: max %ud tasks, target latency %.2f",
+					 ctx->max_concurrency, ctx->target_latency);
+	}
+
+	if (ctx->re_batch_size > 1) {
+		ctx->re_batch = g_ptr_array_sized_new(ctx->re_batch_size);
+		ctx->re_batch_ev.data = ctx;
+		ev_timer_init(&ctx->re_batch_ev, rspamd_worker_re_batch_cb, 0.0, 0.0);
+	}
+
 	ctx->resolver = rspamd_dns_resolver_init(worker->srv->logger,
 											 ctx->event_loop,
 											 worker->srv->cfg);
@@ -506,6 +1219,11 @@ start_worker(struct rspamd_worker *worker)
 	rspamd_worker_init_scanner(worker, ctx->event_loop, ctx->resolver,
 							   &ctx->lang_det);
 
+	if (ctx->cpu_threads > 0) {
+		worker->cpu_pool = rspamd_cpu_pool_new(ctx->event_loop, ctx->cpu_threads, 0);
+		msg_info_ctx("started %ud threads for cpu bound jobs", ctx->cpu_threads);
+	}
+
 	is_controller = rspamd_worker_check_controller_presence(worker);
 
 	if (is_controller) {
@@ -522,6 +1240,11 @@ start_worker(struct rspamd_worker *worker)
 	ev_loop(ctx->event_loop, 0);
 	rspamd_worker_block_signals();
 
+	if (worker->cpu_pool) {
+		rspamd_cpu_pool_destroy(worker->cpu_pool);
+		worker->cpu_pool = NULL;
+	}
+
 	if (is_controller) {
 		rspamd_controller_on_terminate(worker, NULL);
 	}
@@ -55,6 +55,29 @@ struct rspamd_worker_ctx {
 	struct rspamd_http_context *http_ctx;
 	/* Language detector */
 	struct rspamd_lang_detector *lang_det;
+	/* Number of threads for cpu bound jobs (0 to disable) */
+	unsigned int cpu_threads;
+	/* Start processing before the whole body is received */
+	gboolean streaming_scan;
+	/* Serve several requests over a connection if a client asks for it */
+	gboolean keepalive;
+	/* Upper bound for adaptive limit of in-flight tasks (0 to disable) */
+	unsigned int max_concurrency;
+	/* Tasks slower than this decrease concurrency limit */
+	ev_tstamp target_latency;
+	/* Maximum time for a task to wait for a free slot */
+	ev_tstamp queue_timeout;
+	/* Adaptive limiter state */
+	double concurrency_limit;
+	unsigned int inflight;
+	ev_tstamp last_decrease;
+	GQueue pending;
+	ev_timer pending_ev;
+	/* Maximum number of tasks scanned by regexps together (0 to disable) */
+	unsigned int re_batch_size;
+	/* Tasks waiting for the regexp batch */
+	GPtrArray *re_batch;
+	ev_timer re_batch_ev;
 };
 
 /*
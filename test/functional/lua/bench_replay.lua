@@ -0,0 +1,64 @@
+--[[[
+-- Requests served by replies recorded to configs/bench_replay.jsonl,
+-- no servers listen on these addresses
+--]]
+
+local rspamd_http = require "rspamd_http"
+local rspamd_redis = require "rspamd_redis"
+
+local function bench_replay_symbol(task)
+  local function dns_cb(_, to_resolve, results, err)
+    if not err and results and tostring(results[1]) == '10.0.0.1' then
+      task:insert_result('BENCH_REPLAY_DNS', 1.0, to_resolve)
+    end
+  end
+
+  local function redis_cb(err, data)
+    if not err and tostring(data) == 'bench_value' then
+      task:insert_result('BENCH_REPLAY_REDIS', 1.0)
+    end
+  end
+
+  local function http_cb(err, code, body)
+    if not err and code == 200 and tostring(body) == 'bench_body' then
+      task:insert_result('BENCH_REPLAY_HTTP', 1.0)
+    end
+  end
+
+  task:get_resolver():resolve_a({
+    task = task,
+    name = 'bench.replay.test',
+    callback = dns_cb
+  })
+
+  rspamd_redis.make_request({
+    task = task,
+    host = '127.0.0.1:56379',
+    cmd = 'GET',
+    args = { 'bench_key' },
+    callback = redis_cb,
+    timeout = 1,
+  })
+
+  rspamd_http.request({
+    task = task,
+    url = 'http://127.0.0.1:56380/bench',
+    callback = http_cb,
+    timeout = 1,
+  })
+end
+
+local id = rspamd_config:register_symbol({
+  name = 'BENCH_REPLAY',
+  score = 0.0,
+  callback = bench_replay_symbol,
+})
+
+for _, sym in ipairs({ 'BENCH_REPLAY_DNS', 'BENCH_REPLAY_REDIS', 'BENCH_REPLAY_HTTP' }) do
+  rspamd_config:register_symbol({
+    name = sym,
+    score = 5.0,
+    parent = id,
+    type = 'virtual',
+  })
+end
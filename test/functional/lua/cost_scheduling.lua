@@ -0,0 +1,25 @@
+-- Static weights of all filters are far below the reject threshold,
+-- so filters would be stopped before the first one is started if shots
+-- were not taken into account
+
+for i = 1, 20 do
+  rspamd_config:register_symbol({
+    name = string.format('COST_TEST_%02d', i),
+    score = 0.1,
+    one_shot = true,
+    callback = function()
+      return false
+    end
+  })
+end
+
+rspamd_config:register_symbol({
+  name = 'MULTI_SHOT_TEST',
+  score = 4.0,
+  nshots = 5,
+  callback = function(task)
+    for i = 1, 4 do
+      task:insert_result('MULTI_SHOT_TEST', 1.0, tostring(i))
+    end
+  end
+})
@@ -43,4 +43,29 @@ context("Inet addr check functions", function()
     end)
 
   end
-end)
\ No newline at end of file
+end)
+
+context("Inet addr formatting", function()
+  local rspamd_ip = require "rspamd_ip"
+
+  local cases = {
+    {'192.168.1.1', '192.168.1.1'},
+    {'0.0.0.0', '0.0.0.0'},
+    {'255.255.255.255', '255.255.255.255'},
+    {'010.001.000.9', '10.1.0.9'}, -- leading zeros
+    {'2A01:4F8:190:43B5:0:0:0:99', '2a01:4f8:190:43b5::99'},
+    {'::1', '::1'},
+    {'1:0:0:1:0:0:0:1', '1:0:0:1::1'},
+    {'1:0:0:0:1:0:0:1', '1::1:0:0:1'}, -- first of equal runs
+    {'1:0:1:0:1:0:1:0', '1:0:1:0:1:0:1:0'}, -- no runs of two
+    {'fe80::', 'fe80::'},
+  }
+
+  for _, c in ipairs(cases) do
+    test("Format inet addr " .. c[1], function()
+      local ip = rspamd_ip.from_string(c[1])
+      assert_not_nil(ip, "cannot parse " .. c[1])
+      assert_equal(ip:to_string(), c[2])
+    end)
+  end
+end)
@@ -42,5 +42,23 @@ context("Kann test", function()
         end)
   end
 
+  test("Batched apply matches apply1", function()
+    local batch = k:apply(inputs)
+    assert_equal(#inputs, #batch)
+    for i, inp in ipairs(inputs) do
+      assert_true(math.abs(batch[i][1] - k:apply1(inp)[1]) < 1e-5)
+    end
+  end)
+
+  test("Quantized ANN is close to the original one", function()
+    local q = k:quantize()
+    assert_not_nil(q)
+    q = kann.load_q8(q:save())
+    assert_not_nil(q)
+    for _, inp in ipairs(inputs) do
+      assert_true(math.abs(q:apply1(inp)[1] - k:apply1(inp)[1]) < 0.05)
+    end
+  end)
+
 
 end)
\ No newline at end of file
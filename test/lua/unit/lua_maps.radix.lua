@@ -0,0 +1,48 @@
+context("Radix maps", function()
+  local lua_maps = require "lua_maps"
+  local rspamd_ip = require "rspamd_ip"
+
+  local radix = lua_maps.map_add_from_ucl({
+    '10.0.0.0/8 private',
+    '192.168.1.0/24 lan',
+    '192.168.1.128/25 lan_high',
+    '2001:db8::/32 doc',
+    '2001:db8:1::/48 doc_sub',
+  }, 'radix', 'test radix map')
+
+  local addrs = {
+    '10.1.2.3',
+    '2001:db8:1::1',
+    '192.168.1.1',
+    '8.8.8.8',
+    rspamd_ip.from_string('192.168.1.200'),
+    '2001:db8:2::1',
+    '::1',
+    'not an ip',
+    rspamd_ip.from_string('2001:db9::1'),
+  }
+
+  test("Batch lookup matches single lookups", function()
+    local res = radix:get_key(addrs)
+
+    assert_equal(#addrs, #res)
+
+    for i, addr in ipairs(addrs) do
+      local single = radix:get_key(addr) or false
+      assert_equal(single, res[i],
+          string.format('%s: single %s, batch %s', tostring(addr),
+              tostring(single), tostring(res[i])))
+    end
+  end)
+
+  test("Batch lookup returns most specific prefixes", function()
+    local res = radix:get_key(addrs)
+    local expected = {
+      'private', 'doc_sub', 'lan', false, 'lan_high', 'doc', false, false, false
+    }
+
+    for i, v in ipairs(expected) do
+      assert_equal(v, res[i], tostring(addrs[i]))
+    end
+  end)
+end)
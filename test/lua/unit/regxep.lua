@@ -42,6 +42,9 @@ context("Regexp unit tests", function()
       {'Body=(\\S+)(?: Fuz1=(\\S+))?(?: Fuz2=(\\S+))?', 
       'mc-filter4 1120; Body=1 Fuz1=2 mc-filter4 1120; Body=1 Fuz1=2 Fuz2=3', 
       {'Body=1 Fuz1=2', '1', '2'}, {'Body=1 Fuz1=2 Fuz2=3', '1', '2', '3'}},
+      -- Lookbehind and anchors must see the whole subject
+      {'(?<=id=)(\\d+)', 'x id=42 y', {'42', '42'}},
+      {'/^From: (\\S+)/m', 'To: a\nFrom: b@c', {'From: b@c', 'b@c'}},
     }
     for _,c in ipairs(cases) do
       local r = re.create_cached(c[1])
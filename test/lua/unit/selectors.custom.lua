@@ -61,6 +61,38 @@ context("Selectors test", function()
     assert_not_nil(elts)
     assert_rspamd_table_eq({actual = elts, expect = {'simple value and a simple nail'}})
   end)
+
+  test("selector closure is computed once per task", function()
+    local ncalls = 0
+    lua_selectors.register_extractor(rspamd_config, "count_calls", {
+      get_value = function(task, args)
+        ncalls = ncalls + 1
+        return 'counted','string'
+      end,
+      volatile = false,
+    })
+
+    local sel1 = lua_selectors.create_selector_closure(cfg, 'count_calls', '')
+    local sel2 = lua_selectors.create_selector_closure(cfg, 'count_calls', '')
+    assert_equal(sel1(task), 'counted')
+    assert_equal(sel2(task), 'counted')
+    assert_equal(ncalls, 1)
+  end)
+
+  test("volatile selector closure is not cached", function()
+    local ncalls = 0
+    lua_selectors.register_extractor(rspamd_config, "count_volatile_calls", {
+      get_value = function(task, args)
+        ncalls = ncalls + 1
+        return 'counted','string'
+      end,
+    })
+
+    local sel = lua_selectors.create_selector_closure(cfg, 'count_volatile_calls', '')
+    assert_equal(sel(task), 'counted')
+    assert_equal(sel(task), 'counted')
+    assert_equal(ncalls, 2)
+  end)
 end)
 
 
@@ -394,6 +394,15 @@ context("Selectors test", function()
     end)
   end
 
+  test("shared extractors are not modified by transforms", function()
+    local sorted = check_selector_plain("rcpts:addr.sort")
+    local first = check_selector_plain("rcpts:addr.first")
+    local again = check_selector_plain("rcpts:addr")
+    assert_rspamd_table_eq({actual = sorted, expect = {{"no-one@example.com", "nobody@example.com"}}})
+    assert_rspamd_table_eq({actual = first, expect = {"nobody@example.com"}})
+    assert_rspamd_table_eq({actual = again, expect = {{"nobody@example.com", "no-one@example.com"}}})
+  end)
+
   local cases_kv = {
     ["ip"] = {
       selector = "id('ip');ip",
@@ -159,4 +159,18 @@ Thank you,
 
     task:destroy()
   end)
+  test("Text views of headers and urls", function()
+    local msg = hdrs .. body
+    local res,task = rspamd_task.load_from_string(msg)
+    assert_true(res, "failed to load message")
+    task:process_message()
+    local subj = task:get_header_text('Subject')
+    assert_equal(type(subj), 'userdata')
+    assert_equal(subj:str(), task:get_header('Subject'))
+    assert_nil(task:get_header_text('X-Missing'))
+    for _,u in ipairs(task:get_urls()) do
+      assert_equal(u:get_text(true):str(), u:get_text())
+    end
+    task:destroy()
+  end)
 end)
\ No newline at end of file
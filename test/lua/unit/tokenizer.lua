@@ -15,7 +15,10 @@ context("Text tokenization test", function()
     {",,,,,", {}},
     {"word,,,,,word    ", {"word", "word"}},
     {"word", {"word"}},
-    {",,,,word,,,", {"word"}}
+    {",,,,word,,,", {"word"}},
+    {"Don't stop: 3.14 foo_bar", {"Don't", "stop", "3.14", "foo_bar"}},
+    {"Привет, мир! Γειά σου", {"Привет", "мир", "Γειά", "σου"}},
+    {"cafe\xcc\x81 soft\xc2\xadhyphen", {"cafe\xcc\x81", "soft\xc2\xadhyphen"}},
   }
 
   for i,c in ipairs(cases) do
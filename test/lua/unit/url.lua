@@ -25,6 +25,9 @@ context("URL check functions", function()
     { "mailto:A.User@example.com text", { "example.com", "A.User" } },
     { "http://Тест.Рф:18 text", { "тест.рф", nil } },
     { "http://user:password@тест2.РФ:18 text", { "тест2.рф", "user" } },
+    { "http://ТЕСТ.рф text", { "тест.рф", nil } },
+    { "http://WWW.Example.COM/Path text", { "www.example.com", nil } },
+    { "http://XN--E1AYBC.xn--P1AI text", { "xn--e1aybc.xn--p1ai", nil } },
     { "somebody@example.com", { "example.com", "somebody" } },
     { "https://127.0.0.1/abc text", { "127.0.0.1", nil } },
     { "https:\\\\127.0.0.1/abc text", { "127.0.0.1", nil } },
@@ -0,0 +1,635 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Micro benchmarks for hot primitives of libutil, libserver and libcryptobox.
+ * Each benchmark is repeated until it runs for the requested time and
+ * reports time per operation and throughput for every CPU dispatch variant
+ * that is supported by the host
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/str_util.h"
+#include "libutil/shingles.h"
+#include "libutil/radix.h"
+#include "libutil/timer_wheel.h"
+#include "libserver/url.h"
+#include "libstat/stat_api.h"
+#include "libcryptobox/cryptobox.h"
+#include "libcryptobox/base64/base64.h"
+#include "libcryptobox/blake2/blake2.h"
+#include "contrib/libucl/khash.h"
+#include "contrib/ankerl/unordered_dense.h"
+
+#include <string>
+#include <vector>
+#include <random>
+#include <functional>
+
+extern "C" unsigned cpu_config;
+
+KHASH_MAP_INIT_INT64(rspamd_bench_hash, uint64_t);
+
+static double bench_time = 0.5;
+static int input_size = 64 * 1024;
+static char *bench_filter = nullptr;
+static gboolean all_variants = FALSE;
+
+static const GOptionEntry entries[] =
+	{
+		{"time", 't', 0, G_OPTION_ARG_DOUBLE, &bench_time,
+		 "Minimum time to run each benchmark (0.5 seconds by default)", nullptr},
+		{"size", 's', 0, G_OPTION_ARG_INT, &input_size,
+		 "Size of the input for string benchmarks (64k by default)", nullptr},
+		{"filter", 'f', 0, G_OPTION_ARG_STRING, &bench_filter,
+		 "Run only benchmarks which names contain this string", nullptr},
+		{"variants", 'V', 0, G_OPTION_ARG_NONE, &all_variants,
+		 "Run benchmarks for all CPU dispatch variants, not only the best one", nullptr},
+		{nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr}};
+
+struct bench_data {
+	std::string text;       /* ascii words */
+	std::string url_text;   /* words with a single url at the end */
+	std::string binary;     /* random bytes */
+	std::string b64, b32, qp;
+	std::string out;        /* output buffer for decoders */
+	GArray *words;
+	radix_compressed_t *radix;
+	std::vector<uint32_t> addrs;
+	std::vector<uint64_t> keys;
+	khash_t(rspamd_bench_hash) * kh;
+	ankerl::unordered_dense::map<uint64_t, uint64_t> ankerl_map;
+	rspamd_mempool_t *pool;
+};
+
+/* Function runs `niters` operations and returns the number of bytes processed */
+using bench_func = std::function<std::size_t(bench_data &, std::size_t)>;
+
+struct bench_case {
+	const char *name;
+	bench_func func;
+};
+
+static void
+bench_data_init(bench_data &d)
+{
+	static const char *url_tail = " please visit http://www.example.com/path/to/page?q=1";
+	std::mt19937_64 rng{0xdeadbabe};
+	gsize outlen;
+
+	d.text.reserve(input_size);
+
+	while (d.text.size() < (std::size_t) input_size) {
+		auto wlen = 2 + rng() % 10;
+
+		for (auto i = 0u; i < wlen; i++) {
+			char c = 'a' + rng() % 26;
+			/* Some capital letters for caseless functions */
+			d.text.push_back(rng() % 8 == 0 ? g_ascii_toupper(c) : c);
+		}
+
+		d.text.push_back(rng() % 16 == 0 ? '\n' : ' ');
+	}
+
+	d.text.resize(input_size);
+	d.url_text = d.text.substr(0, 4096) + url_tail;
+
+	d.binary.resize(input_size);
+	for (auto &c: d.binary) {
+		c = (char) (rng() & 0xff);
+	}
+
+	auto *b64 = rspamd_encode_base64((const unsigned char *) d.binary.data(),
+									 d.binary.size(), 0, &outlen);
+	d.b64.assign(b64, outlen);
+	g_free(b64);
+
+	auto *b32 = rspamd_encode_base32((const unsigned char *) d.binary.data(),
+									 d.binary.size(), RSPAMD_BASE32_DEFAULT);
+	d.b32.assign(b32);
+	g_free(b32);
+
+	/* Quoted printable of a text is a more realistic case than of random bytes */
+	auto *qp = rspamd_encode_qp_fold((const unsigned char *) d.text.data(),
+									 d.text.size(), 76, &outlen,
+									 RSPAMD_TASK_NEWLINES_CRLF);
+	d.qp.assign(qp, outlen);
+	g_free(qp);
+
+	d.out.resize(d.binary.size() * 4 + 16);
+
+	d.words = g_array_new(FALSE, TRUE, sizeof(rspamd_stat_token_t));
+	auto *p = d.text.data(), *end = d.text.data() + d.text.size();
+
+	while (p < end) {
+		auto *wend = p + strcspn(p, " \n");
+
+		if (wend > end) {
+			wend = end;
+		}
+
+		if (wend > p) {
+			rspamd_stat_token_t tok;
+
+			memset(&tok, 0, sizeof(tok));
+			tok.original.begin = p;
+			tok.original.len = wend - p;
+			tok.normalized = tok.original;
+			tok.stemmed = tok.original;
+			tok.flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
+			g_array_append_val(d.words, tok);
+		}
+
+		p = wend + 1;
+	}
+
+	d.radix = radix_create_compressed("bench");
+
+	for (auto i = 0; i < 10000; i++) {
+		uint32_t addr = rng();
+
+		radix_insert_compressed(d.radix, (uint8_t *) &addr, sizeof(addr),
+								32 - 8 - rng() % 16, i + 1);
+	}
+
+	d.addrs.resize(4096);
+	for (auto &a: d.addrs) {
+		a = rng();
+	}
+
+	d.kh = kh_init(rspamd_bench_hash);
+	d.keys.resize(4096);
+
+	for (auto &k: d.keys) {
+		int r;
+
+		k = rng();
+		auto it = kh_put(rspamd_bench_hash, d.kh, k, &r);
+		kh_value(d.kh, it) = k;
+		d.ankerl_map[k] = k;
+	}
+
+	/* Lookups must also miss */
+	for (auto i = 0; i < 4096; i++) {
+		d.keys.push_back(rng());
+	}
+
+	d.pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "bench", 0);
+}
+
+static void
+bench_data_destroy(bench_data &d)
+{
+	g_array_free(d.words, TRUE);
+	radix_destroy_compressed(d.radix);
+	kh_destroy(rspamd_bench_hash, d.kh);
+	rspamd_mempool_delete(d.pool);
+}
+
+static std::vector<bench_case>
+bench_cases()
+{
+	return {
+		{"mempool_alloc", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 std::size_t total = 0;
+			 auto *pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "bench", 0);
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto sz = 16 + (i & 127);
+
+				 if ((i & 0xffff) == 0xffff) {
+					 /* Do not let a pool grow infinitely */
+					 rspamd_mempool_delete(pool);
+					 pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "bench", 0);
+				 }
+
+				 auto *p = (char *) rspamd_mempool_alloc(pool, sz);
+				 p[0] = (char) i;
+				 total += sz;
+			 }
+
+			 rspamd_mempool_delete(pool);
+
+			 return total;
+		 }},
+		{"substring_search", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 static const char needle[] = "zzz-qqq";
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto r = rspamd_substring_search(d.text.data(), d.text.size(),
+												  needle, sizeof(needle) - 1);
+				 g_assert(r == -1);
+			 }
+
+			 return niters * d.text.size();
+		 }},
+		{"substring_search_caseless", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 static const char needle[] = "ZzZ-QqQ";
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto r = rspamd_substring_search_caseless(d.text.data(), d.text.size(),
+														   needle, sizeof(needle) - 1);
+				 g_assert(r == -1);
+			 }
+
+			 return niters * d.text.size();
+		 }},
+		{"substring_needle_caseless", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 static const char needle[] = "ZzZ-QqQ";
+			 auto *n = rspamd_substring_needle_new(needle, sizeof(needle) - 1, TRUE);
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto r = rspamd_substring_needle_search(n, d.text.data(), d.text.size());
+				 g_assert(r == -1);
+			 }
+
+			 rspamd_substring_needle_free(n);
+
+			 return niters * d.text.size();
+		 }},
+		{"lc_cmp", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 auto buf = d.text;
+			 std::size_t total = 0;
+
+			 rspamd_str_lc(buf.data(), buf.size());
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 total += rspamd_lc_cmp(buf.data(), d.text.data(), buf.size()) == 0;
+			 }
+
+			 g_assert(total == niters);
+
+			 return niters * buf.size();
+		 }},
+		{"str_lc", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 auto buf = d.text;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 /* Restore some upper case letters, so the conversion is not trivial */
+				 buf[i % buf.size()] = 'A';
+				 rspamd_str_lc(buf.data(), buf.size());
+			 }
+
+			 return niters * buf.size();
+		 }},
+		{"base64_encode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 gsize outlen;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_free(rspamd_encode_base64((const unsigned char *) d.binary.data(),
+											 d.binary.size(), 0, &outlen));
+			 }
+
+			 return niters * d.binary.size();
+		 }},
+		{"base64_decode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 for (std::size_t i = 0; i < niters; i++) {
+				 gsize outlen = d.out.size();
+
+				 g_assert(rspamd_cryptobox_base64_decode(d.b64.data(), d.b64.size(),
+														 (unsigned char *) d.out.data(), &outlen));
+			 }
+
+			 return niters * d.b64.size();
+		 }},
+		{"base32_encode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_assert(rspamd_encode_base32_buf((const unsigned char *) d.binary.data(),
+												   d.binary.size(), d.out.data(), d.out.size(),
+												   RSPAMD_BASE32_DEFAULT) > 0);
+			 }
+
+			 return niters * d.binary.size();
+		 }},
+		{"base32_decode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_assert(rspamd_decode_base32_buf(d.b32.data(), d.b32.size(),
+												   (unsigned char *) d.out.data(), d.out.size(),
+												   RSPAMD_BASE32_DEFAULT) > 0);
+			 }
+
+			 return niters * d.b32.size();
+		 }},
+		{"qp_encode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 gsize outlen;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_free(rspamd_encode_qp_fold((const unsigned char *) d.text.data(),
+											  d.text.size(), 76, &outlen,
+											  RSPAMD_TASK_NEWLINES_CRLF));
+			 }
+
+			 return niters * d.text.size();
+		 }},
+		{"qp_decode", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_assert(rspamd_decode_qp_buf(d.qp.data(), d.qp.size(),
+											   d.out.data(), d.out.size()) > 0);
+			 }
+
+			 return niters * d.qp.size();
+		 }},
+		{"shingles_from_text", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 static const unsigned char key[16] = "rspamd bench";
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 g_free(rspamd_shingles_from_text(d.words, key, nullptr,
+												  rspamd_shingles_default_filter, nullptr,
+												  RSPAMD_SHINGLES_FAST));
+			 }
+
+			 return niters * d.text.size();
+		 }},
+		{"radix_lookup", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 uintptr_t found = 0;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto addr = d.addrs[i % d.addrs.size()];
+
+				 found += radix_find_compressed(d.radix, (const uint8_t *) &addr,
+												sizeof(addr)) != RADIX_NO_VALUE;
+			 }
+
+			 g_assert(found <= niters);
+
+			 return niters * sizeof(uint32_t);
+		 }},
+		{"url_find", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 for (std::size_t i = 0; i < niters; i++) {
+				 char *url_str = nullptr;
+				 goffset url_pos;
+				 gboolean prefix_added;
+
+				 g_assert(rspamd_url_find(d.pool, d.url_text.data(), d.url_text.size(),
+										  &url_str, RSPAMD_URL_FIND_ALL, &url_pos,
+										  &prefix_added));
+
+				 if ((i & 0xfff) == 0xfff) {
+					 rspamd_mempool_delete(d.pool);
+					 d.pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), "bench", 0);
+				 }
+			 }
+
+			 return niters * d.url_text.size();
+		 }},
+		{"cryptobox_hash", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 unsigned char out[rspamd_cryptobox_HASHBYTES];
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 rspamd_cryptobox_hash(out, (const unsigned char *) d.binary.data(),
+									   d.binary.size(), nullptr, 0);
+			 }
+
+			 return niters * d.binary.size();
+		 }},
+		{"cryptobox_hash_multi", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 /* The same input split into small independent messages */
+			 constexpr std::size_t nsegs = 16;
+			 struct rspamd_cryptobox_segment segs[nsegs];
+			 unsigned char out[nsegs * rspamd_cryptobox_HASHBYTES];
+			 auto seglen = d.binary.size() / nsegs;
+
+			 for (std::size_t i = 0; i < nsegs; i++) {
+				 segs[i].data = (unsigned char *) d.binary.data() + i * seglen;
+				 segs[i].len = seglen;
+			 }
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 rspamd_cryptobox_hash_multi(out, segs, nsegs, nullptr, 0);
+			 }
+
+			 return niters * seglen * nsegs;
+		 }},
+		{"khash_lookup", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 uint64_t sum = 0;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto k = kh_get(rspamd_bench_hash, d.kh, d.keys[i % d.keys.size()]);
+
+				 if (k != kh_end(d.kh)) {
+					 sum += kh_value(d.kh, k);
+				 }
+			 }
+
+			 g_assert(niters == 0 || sum != 0);
+
+			 return niters * sizeof(uint64_t);
+		 }},
+		{"ankerl_lookup", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 uint64_t sum = 0;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto it = d.ankerl_map.find(d.keys[i % d.keys.size()]);
+
+				 if (it != d.ankerl_map.end()) {
+					 sum += it->second;
+				 }
+			 }
+
+			 g_assert(niters == 0 || sum != 0);
+
+			 return niters * sizeof(uint64_t);
+		 }},
+		{"printf", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 char buf[256];
+			 std::size_t total = 0;
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 total += rspamd_snprintf(buf, sizeof(buf), "%s: %d, %uL, %.2f, %*s",
+										  "symbol", (int) i, (uint64_t) i * 31,
+										  (double) i / 3.0, 8, d.text.data());
+			 }
+
+			 return total;
+		 }},
+		/* Rearm one of 10k concurrent timeouts per iteration, as IO timeouts do */
+		{"timer_wheel_rearm", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 auto *loop = ev_loop_new(EVFLAG_AUTO);
+			 auto *wheel = rspamd_timer_wheel_new(loop);
+			 std::vector<rspamd_timer_wheel_entry> timers(10000);
+
+			 for (auto &t: timers) {
+				 rspamd_timer_wheel_entry_init(&t, [](rspamd_timer_wheel_entry *, void *) {}, nullptr);
+				 rspamd_timer_wheel_add(wheel, &t, 1.0 + (&t - timers.data()) % 100);
+			 }
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto &t = timers[i % timers.size()];
+				 rspamd_timer_wheel_remove(wheel, &t);
+				 rspamd_timer_wheel_add(wheel, &t, 1.0 + i % 100);
+			 }
+
+			 rspamd_timer_wheel_destroy(wheel);
+			 ev_loop_destroy(loop);
+
+			 return niters;
+		 }},
+		{"ev_timer_rearm", [](bench_data &d, std::size_t niters) -> std::size_t {
+			 auto *loop = ev_loop_new(EVFLAG_AUTO);
+			 std::vector<ev_timer> timers(10000);
+
+			 for (auto &t: timers) {
+				 ev_timer_init(&t, [](struct ev_loop *, ev_timer *, int) {}, 1.0 + (&t - timers.data()) % 100, 0.0);
+				 ev_timer_start(loop, &t);
+			 }
+
+			 for (std::size_t i = 0; i < niters; i++) {
+				 auto &t = timers[i % timers.size()];
+				 ev_timer_stop(loop, &t);
+				 ev_timer_set(&t, 1.0 + i % 100, 0.0);
+				 ev_timer_start(loop, &t);
+			 }
+
+			 for (auto &t: timers) {
+				 ev_timer_stop(loop, &t);
+			 }
+
+			 ev_loop_destroy(loop);
+
+			 return niters;
+		 }},
+	};
+}
+
+/* Variants are applied by masking the detected CPU features */
+struct bench_variant {
+	const char *name;
+	unsigned mask;
+};
+
+static const bench_variant variants[] = {
+	{"native", ~0u},
+	{"avx", ~(unsigned) CPUID_AVX2},
+	{"sse42", ~(unsigned) (CPUID_AVX2 | CPUID_AVX)},
+	{"generic", 0},
+};
+
+static void
+bench_run(bench_data &d, const bench_case &bc, const char *variant)
+{
+	std::size_t niters = 1, bytes;
+	double t1, t2;
+
+	/* Warm up caches and calibrate the number of iterations */
+	for (;;) {
+		t1 = rspamd_get_ticks(TRUE);
+		bytes = bc.func(d, niters);
+		t2 = rspamd_get_ticks(TRUE);
+
+		if (t2 - t1 >= bench_time || niters >= (1ULL << 40)) {
+			break;
+		}
+
+		if (t2 - t1 < bench_time / 100.0) {
+			niters *= 10;
+		}
+		else {
+			niters = niters * (bench_time * 1.2 / (t2 - t1)) + 1;
+		}
+	}
+
+	auto elapsed = t2 - t1;
+
+	printf("%-28s %-8s %14.2f ns/op %12.2f MB/s %12zu ops\n",
+		   bc.name, variant, elapsed * 1e9 / niters,
+		   (double) bytes / elapsed / (1024.0 * 1024.0), niters);
+}
+
+int main(int argc, char **argv)
+{
+	struct rspamd_main *rspamd_main;
+	rspamd_mempool_t *pool;
+	struct rspamd_config *cfg;
+	GOptionContext *options_context;
+	GError *error = nullptr;
+
+	pool = rspamd_mempool_new(rspamd_mempool_suggest_size(), nullptr, 0);
+	rspamd_main = (struct rspamd_main *) rspamd_mempool_alloc0(pool, sizeof(*rspamd_main));
+	rspamd_main->server_pool = pool;
+	cfg = rspamd_config_new(RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs();
+	rspamd_main->cfg = cfg;
+	cfg->cfg_pool = pool;
+
+	options_context = g_option_context_new("- run rspamd micro benchmarks");
+	g_option_context_add_main_entries(options_context, entries, nullptr);
+
+	if (!g_option_context_parse(options_context, &argc, &argv, &error)) {
+		fprintf(stderr, "option parsing failed: %s\n", error->message);
+		g_option_context_free(options_context);
+		exit(EXIT_FAILURE);
+	}
+
+	g_option_context_free(options_context);
+
+	rspamd_main->logger = rspamd_log_open_emergency(rspamd_main->server_pool,
+													RSPAMD_LOG_FLAG_RSPAMADM);
+	rspamd_log_set_log_level(rspamd_main->logger, G_LOG_LEVEL_MESSAGE);
+	rspamd_url_init(nullptr);
+
+	if (input_size <= 0) {
+		input_size = 64 * 1024;
+	}
+
+	bench_data d;
+	bench_data_init(d);
+
+	auto native_config = cpu_config;
+	auto cases = bench_cases();
+	bool first = true;
+	unsigned prev_config = 0;
+
+	printf("cpu features: %s; input size: %d bytes\n",
+		   cfg->libs_ctx->crypto_ctx->cpu_extensions, input_size);
+
+	for (const auto &variant: variants) {
+		auto cur_config = native_config & variant.mask;
+
+		if (!first && cur_config == prev_config) {
+			/* Host does not support this variant, so it is the same as the previous one */
+			continue;
+		}
+
+		cpu_config = cur_config;
+		/* Implementations selected on load need to be reloaded */
+		base64_load();
+		blake2b_load();
+
+		for (const auto &bc: cases) {
+			if (bench_filter && strstr(bc.name, bench_filter) == nullptr) {
+				continue;
+			}
+
+			bench_run(d, bc, variant.name);
+		}
+
+		first = false;
+		prev_config = cur_config;
+
+		if (!all_variants) {
+			break;
+		}
+	}
+
+	cpu_config = native_config;
+	base64_load();
+	blake2b_load();
+
+	bench_data_destroy(d);
+
+	return 0;
+}
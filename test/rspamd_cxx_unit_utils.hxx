@@ -26,12 +26,23 @@
 #include "contrib/libottery/ottery.h"
 #include "libcryptobox/cryptobox.h"
 #include "libserver/http/http_message.h"
+#include "libutil/domain_trie.h"
+#include "libutil/regexp.h"
+#include "libutil/shm_cache.h"
+#include "libutil/str_util.h"
+#include "libutil/printf.h"
+#include "libutil/timer_wheel.h"
+#include "libutil/util.h"
 
 #include <vector>
 #include <utility>
 #include <string>
+#include <algorithm>
+#include <tuple>
 
 extern "C" long rspamd_http_parse_keepalive_timeout(const rspamd_ftok_t *tok);
+/* Runtime dispatch flags, tests clear them to compare vector and scalar code */
+extern "C" unsigned cpu_config;
 
 TEST_SUITE("rspamd_utils")
 {
@@ -231,6 +242,483 @@ TEST_SUITE("rspamd_utils")
 			}
 		}
 	}
+
+	TEST_CASE("rspamd_domain_trie")
+	{
+		auto *trie = rspamd_domain_trie_new();
+		static const char *suffixes[] = {"com", "co.uk", "uk", "ck", "example.com"};
+
+		rspamd_domain_trie_add(trie, "com", 3, RSPAMD_DOMAIN_TRIE_DEFAULT, suffixes[0]);
+		rspamd_domain_trie_add(trie, "co.uk", 5, RSPAMD_DOMAIN_TRIE_DEFAULT, suffixes[1]);
+		rspamd_domain_trie_add(trie, "uk", 2, RSPAMD_DOMAIN_TRIE_DEFAULT, suffixes[2]);
+		rspamd_domain_trie_add(trie, "ck", 2, RSPAMD_DOMAIN_TRIE_WILDCARD, suffixes[3]);
+		CHECK(rspamd_domain_trie_size(trie) == 4);
+
+		std::vector<std::pair<std::string, std::string>> esld_cases{
+			{"www.example.com", "example.com"},
+			{"WWW.Example.COM", "Example.COM"},
+			{"example.com.", "example.com"},
+			{"a.b.example.co.uk", "example.co.uk"},
+			{"example.uk", "example.uk"},
+			{"www.foo.bar.ck", "foo.bar.ck"},
+			{"bar.ck", "bar.ck"},
+			{"com", ""},
+			{"example.org", ""},
+			{"xcom", ""},
+		};
+
+		for (const auto &c: esld_cases) {
+			SUBCASE(("esld: " + c.first).c_str())
+			{
+				auto len = rspamd_domain_trie_esld(trie, c.first.data(), c.first.size());
+				auto hostlen = c.first.size();
+
+				if (len > 0 && c.first.back() == '.') {
+					hostlen--;
+				}
+
+				CHECK(c.first.substr(hostlen - len, len) == c.second);
+			}
+		}
+
+		rspamd_domain_trie_add(trie, "example.com", 11, RSPAMD_DOMAIN_TRIE_DEFAULT, suffixes[4]);
+
+		SUBCASE("longest suffix")
+		{
+			gsize slen;
+
+			CHECK(rspamd_domain_trie_lookup(trie, "www.example.com", 15, &slen) == suffixes[4]);
+			CHECK(slen == 11);
+			CHECK(rspamd_domain_trie_lookup(trie, "example.com", 11, &slen) == suffixes[4]);
+			CHECK(rspamd_domain_trie_lookup(trie, "www.example2.com", 16, &slen) == suffixes[0]);
+			CHECK(slen == 3);
+			CHECK(rspamd_domain_trie_lookup(trie, "www.example.org", 15, &slen) == nullptr);
+			CHECK(slen == 0);
+		}
+
+		rspamd_domain_trie_destroy(trie);
+	}
+
+	TEST_CASE("rspamd_substring_search")
+	{
+		/* Long enough to use vectorized search, and periodic to trigger KMP fallback */
+		std::string text(300, 'a');
+		text += "Hello, World! hello world";
+		text += std::string(100, 'b');
+
+		std::vector<std::tuple<std::string, goffset, goffset>> cases{
+			/* needle, case sensitive position, caseless position */
+			{"Hello", 300, 300},
+			{"hello", 314, 300},
+			{"WORLD", -1, 307},
+			{"aaab", -1, -1},
+			{"aaaH", 297, 297},
+			{"dbbb", 324, 324},
+			{"!", 312, 312},
+			{"W", 307, 307},
+			{"w", 320, 307},
+			{"zz", -1, -1},
+		};
+
+		for (const auto &c: cases) {
+			SUBCASE(("substring search: " + std::get<0>(c)).c_str())
+			{
+				const auto &needle = std::get<0>(c);
+
+				CHECK(rspamd_substring_search(text.data(), text.size(),
+											  needle.data(), needle.size()) == std::get<1>(c));
+				CHECK(rspamd_substring_search_caseless(text.data(), text.size(),
+													   needle.data(), needle.size()) == std::get<2>(c));
+
+				auto *n = rspamd_substring_needle_new(needle.data(), needle.size(), FALSE);
+				CHECK(rspamd_substring_needle_search(n, text.data(), text.size()) == std::get<1>(c));
+				rspamd_substring_needle_free(n);
+				n = rspamd_substring_needle_new(needle.data(), needle.size(), TRUE);
+				CHECK(rspamd_substring_needle_search(n, text.data(), text.size()) == std::get<2>(c));
+				rspamd_substring_needle_free(n);
+			}
+		}
+
+		SUBCASE("lowercase and caseless compare")
+		{
+			std::string upper = text, lower = text;
+
+			std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+			std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+			rspamd_str_lc(upper.data(), upper.size());
+			CHECK(upper == lower);
+			CHECK(rspamd_lc_cmp(text.data(), lower.data(), text.size()) == 0);
+			lower[310] = 'x';
+			CHECK(rspamd_lc_cmp(text.data(), lower.data(), text.size()) != 0);
+		}
+	}
+
+	TEST_CASE("rspamd_str_util vector paths")
+	{
+		/* Long and irregular input, so AVX2 and SSE2 blocks and tails are all used */
+		static const char alphabet[] = "abcXYZ-=\r\n\xe9\x80"
+									   "AZaz@[`{";
+		std::string text;
+
+		for (auto i = 0; i < 2000; i++) {
+			text += alphabet[(i * 7 + i / 13) % (sizeof(alphabet) - 1)];
+		}
+
+		auto run = [&](bool avx2) {
+			auto saved = cpu_config;
+			std::vector<goffset> res;
+			std::string lower = text, copy(text.size(), '\0');
+
+			if (!avx2) {
+				cpu_config &= ~CPUID_AVX2;
+			}
+
+			rspamd_str_lc(lower.data(), lower.size());
+			rspamd_str_copy_lc(text.data(), copy.data(), text.size());
+			CHECK(lower == copy);
+
+			for (auto len: {64, 65, 100, 127, 1000, 2000}) {
+				for (auto diff: {0, 31, 32, 33, 63, 64, 99}) {
+					std::string other = lower;
+
+					if (diff < len) {
+						other[diff] = '!';
+					}
+
+					res.push_back(rspamd_lc_cmp(text.data(), other.data(), len) == 0);
+				}
+			}
+
+			for (auto pos: {0, 1, 31, 32, 100, 500, 1234, 1990}) {
+				for (auto len: {1, 2, 3, 7, 16, 33}) {
+					if (pos + len > (int) text.size()) {
+						continue;
+					}
+
+					auto needle = text.substr(pos, len);
+					res.push_back(rspamd_substring_search(text.data(), text.size(),
+														  needle.data(), needle.size()));
+					res.push_back(rspamd_substring_search_caseless(text.data(), text.size(),
+																   needle.data(), needle.size()));
+				}
+			}
+
+			cpu_config = saved;
+
+			return std::make_pair(lower, res);
+		};
+
+		auto scalar = run(false);
+		auto vector = run(true);
+
+		CHECK(scalar.first == vector.first);
+		CHECK(scalar.second == vector.second);
+	}
+
+	TEST_CASE("rspamd_decode_qp vector paths")
+	{
+		/* Clean runs of all lengths around vector sizes between escapes */
+		std::string in;
+
+		for (auto run = 0; run < 200; run += 3) {
+			for (auto i = 0; i < run; i++) {
+				in += (char) ('a' + (run + i) % 26);
+			}
+
+			switch (run % 4) {
+			case 0:
+				in += "=3D";
+				break;
+			case 1:
+				in += "=\r\n";
+				break;
+			case 2:
+				in += "_=E9 \r\n";
+				break;
+			default:
+				in += "=4";
+				break;
+			}
+		}
+
+		auto run = [&](bool avx2) {
+			auto saved = cpu_config;
+			std::vector<std::string> res;
+			std::string out(in.size() + 2, '\0');
+			gssize r;
+
+			if (!avx2) {
+				cpu_config &= ~CPUID_AVX2;
+			}
+
+			r = rspamd_decode_qp_buf(in.data(), in.size(), out.data(), out.size());
+			REQUIRE(r >= 0);
+			res.emplace_back(out.data(), r);
+			r = rspamd_decode_qp2047_buf(in.data(), in.size(), out.data(), out.size());
+			REQUIRE(r >= 0);
+			res.emplace_back(out.data(), r);
+
+			for (auto chunk: {1, 17, 64, 100}) {
+				struct rspamd_qp_decoder dec;
+				std::string streamed;
+
+				rspamd_qp_decoder_init(&dec);
+
+				for (std::size_t off = 0; off < in.size(); off += chunk) {
+					auto len = std::min<std::size_t>(chunk, in.size() - off);
+
+					r = rspamd_qp_decoder_feed(&dec, in.data() + off, len,
+											   out.data(), out.size(),
+											   off + len == in.size());
+					REQUIRE(r >= 0);
+					streamed.append(out.data(), r);
+				}
+
+				CHECK(streamed == res[0]);
+			}
+
+			cpu_config = saved;
+
+			return res;
+		};
+
+		CHECK(run(false) == run(true));
+	}
+
+	TEST_CASE("rspamd_printf_cached")
+	{
+		static struct rspamd_printf_fmt_cache fmt = RSPAMD_PRINTF_FMT_INIT("sym: %s(%.2f){%*s;} %uz %xd %%");
+		char expected[128], buf[128];
+		auto expected_len = rspamd_snprintf(expected, sizeof(expected),
+											"sym: %s(%.2f){%*s;} %uz %xd %%",
+											"SYMBOL", 1.25, 3, "option", (gsize) 100500, 0xabc);
+
+		for (auto i = 0; i < 2; i++) {
+			auto len = rspamd_snprintf_cached(buf, sizeof(buf), &fmt,
+											  "SYMBOL", 1.25, 3, "option", (gsize) 100500, 0xabc);
+			CHECK(std::string{buf, (std::size_t) len} == std::string{expected, (std::size_t) expected_len});
+		}
+
+		CHECK(std::string{expected} == "sym: SYMBOL(1.25){opt;} 100500 abc %");
+
+		/* Truncated output */
+		auto len = rspamd_snprintf_cached(buf, 8, &fmt,
+										  "SYMBOL", 1.25, 3, "option", (gsize) 100500, 0xabc);
+		CHECK(std::string{buf, (std::size_t) len} == "sym: SY");
+	}
+
+	TEST_CASE("rspamd_timer_wheel")
+	{
+		struct test_timer {
+			struct rspamd_timer_wheel_entry ent;
+			int id;
+			std::vector<int> *fired;
+		};
+		auto *loop = ev_loop_new(EVFLAG_AUTO);
+		auto *wheel = rspamd_timer_wheel_attach(loop);
+		std::vector<int> fired;
+		test_timer timers[4];
+		auto cb = [](struct rspamd_timer_wheel_entry *ent, void *ud) {
+			auto *t = (test_timer *) ud;
+			t->fired->push_back(t->id);
+		};
+
+		CHECK(rspamd_timer_wheel_get(loop) == wheel);
+
+		for (auto i = 0; i < 4; i++) {
+			timers[i].id = i;
+			timers[i].fired = &fired;
+			rspamd_timer_wheel_entry_init(&timers[i].ent, cb, &timers[i]);
+		}
+
+		auto start = ev_time();
+		rspamd_timer_wheel_add(wheel, &timers[0].ent, 0.05);
+		rspamd_timer_wheel_add(wheel, &timers[1].ent, 0.01);
+		rspamd_timer_wheel_add(wheel, &timers[2].ent, 0.03);
+		rspamd_timer_wheel_add(wheel, &timers[3].ent, 0.02);
+		CHECK(rspamd_timer_wheel_count(wheel) == 4);
+		rspamd_timer_wheel_remove(wheel, &timers[3].ent);
+		CHECK(!rspamd_timer_wheel_entry_active(&timers[3].ent));
+		/* Rearm moves timer */
+		rspamd_timer_wheel_add(wheel, &timers[0].ent, 0.02);
+
+		/* Loop exits when the driving timer is stopped */
+		ev_run(loop, 0);
+
+		CHECK(fired == std::vector<int>{1, 0, 2});
+		CHECK(ev_time() - start >= 0.03);
+		CHECK(rspamd_timer_wheel_count(wheel) == 0);
+
+		rspamd_timer_wheel_detach(loop);
+		CHECK(rspamd_timer_wheel_get(loop) == nullptr);
+		ev_loop_destroy(loop);
+	}
+
+	TEST_CASE("rspamd_regexp_get_required_literal")
+	{
+		std::vector<std::pair<std::string, std::string>> cases{
+			{"/hello world/", "hello world"},
+			{"/abc*defg/", "defg"},
+			{"/viagra\\s+pills/", "viagra"},
+			{"/foo(bar|baz)quux/", "quux"},
+			{"/^Subject: free/", "Subject: free"},
+			{"/[abc]{3}defg/", "defg"},
+			{"/foo\\.bar/", "foo.bar"},
+			{"/FooBar/i", "foobar"},
+			{"/(?i)FooBar/", "foobar"},
+			{"/\\x41bcde/", "bcde"},
+			{"/colou?r/", "colo"},
+			{"/a|b/", ""},
+			{"/foo bar/x", ""},
+		};
+
+		for (const auto &c: cases) {
+			SUBCASE(("required literal: " + c.first).c_str())
+			{
+				auto *re = rspamd_regexp_new(c.first.c_str(), nullptr, nullptr);
+				REQUIRE(re != nullptr);
+				gsize len = 0;
+				gboolean icase;
+				auto *lit = rspamd_regexp_get_required_literal(re, &len, &icase);
+
+				CHECK(std::string{lit ? lit : "", len} == c.second);
+				g_free(lit);
+				rspamd_regexp_unref(re);
+			}
+		}
+	}
+
+	TEST_CASE("rspamd_strings_levenshtein_distance")
+	{
+		std::vector<std::tuple<std::string, std::string, unsigned int, int>> cases{
+			{"kitten", "sitting", 1, 3},
+			{"sitting", "kitten", 1, 3},
+			{"ca", "ac", 1, 1},
+			{"abcdef", "abdcef", 1, 1},
+			{"flaw", "lawn", 1, 2},
+			{"kitten", "sitting", 2, 5},
+			{"ca", "ac", 2, 2},
+			{"same", "same", 2, 0},
+			{std::string(100, 'a'), std::string(99, 'a') + "b", 1, 1},
+			{std::string(100, 'a') + "x", std::string(100, 'a'), 2, 1},
+			{std::string(70, 'a') + "bc", "cb" + std::string(70, 'a'), 2, 4},
+		};
+
+		for (const auto &c: cases) {
+			SUBCASE((std::get<0>(c) + " vs " + std::get<1>(c)).c_str())
+			{
+				const auto &s1 = std::get<0>(c), &s2 = std::get<1>(c);
+				CHECK(rspamd_strings_levenshtein_distance(s1.data(), s1.size(),
+														  s2.data(), s2.size(),
+														  std::get<2>(c)) == std::get<3>(c));
+			}
+		}
+	}
+
+	TEST_CASE("rspamd_cryptobox_hash_multi")
+	{
+		std::vector<std::size_t> lens{0, 1, 127, 128, 129, 256, 1000, 129, 300, 4096, 7};
+		std::vector<std::string> inputs;
+		std::vector<rspamd_cryptobox_segment> segs;
+		const unsigned char key[] = "hash_multi test key";
+
+		for (auto len: lens) {
+			std::string s(len, '\0');
+			ottery_rand_bytes(s.data(), s.size());
+			inputs.emplace_back(std::move(s));
+		}
+
+		for (auto &s: inputs) {
+			segs.push_back({(unsigned char *) s.data(), s.size()});
+		}
+
+		for (auto keylen: {std::size_t{0}, sizeof(key) - 1}) {
+			SUBCASE(("key length: " + std::to_string(keylen)).c_str())
+			{
+				std::vector<unsigned char> out(segs.size() * rspamd_cryptobox_HASHBYTES);
+				unsigned char expected[rspamd_cryptobox_HASHBYTES];
+
+				rspamd_cryptobox_hash_multi(out.data(), segs.data(), segs.size(),
+											keylen ? key : nullptr, keylen);
+
+				for (std::size_t i = 0; i < segs.size(); i++) {
+					rspamd_cryptobox_hash(expected, segs[i].data, segs[i].len,
+										  keylen ? key : nullptr, keylen);
+					CHECK(memcmp(expected, out.data() + i * rspamd_cryptobox_HASHBYTES,
+								 sizeof(expected)) == 0);
+				}
+			}
+		}
+	}
+
+	TEST_CASE("rspamd_sample_ranges")
+	{
+		struct rspamd_sample_range ranges[RSPAMD_SAMPLE_MAX_RANGES];
+
+		/* Everything fits */
+		CHECK(rspamd_sample_ranges(100, 0, ranges) == 1);
+		CHECK(ranges[0].len == 100);
+		CHECK(rspamd_sample_ranges(100, 100, ranges) == 1);
+		CHECK(ranges[0].len == 100);
+
+		for (auto [total, budget]: std::vector<std::pair<gsize, gsize>>{
+				 {101, 100}, {1000, 16}, {100000, 1000}, {12345678, 65536}, {50, 3}}) {
+			auto n = rspamd_sample_ranges(total, budget, ranges);
+			gsize sum = 0, last = 0;
+
+			CHECK(n <= RSPAMD_SAMPLE_MAX_RANGES);
+			CHECK(ranges[0].off == 0);
+
+			for (unsigned int i = 0; i < n; i++) {
+				CHECK(ranges[i].off >= last);
+				last = ranges[i].off + ranges[i].len;
+				sum += ranges[i].len;
+			}
+
+			CHECK(sum <= budget);
+			CHECK(last <= total);
+
+			if (budget >= 4) {
+				CHECK(last == total);
+			}
+		}
+	}
+
+	TEST_CASE("rspamd_shm_cache")
+	{
+		auto *c = rspamd_shm_cache_new("test", 64, 32, 0);
+		REQUIRE(c != nullptr);
+
+		char buf[32];
+		gsize len = 0;
+		double now = 1000.0;
+		struct rspamd_shm_cache_stat st;
+
+		CHECK(rspamd_shm_cache_lookup(c, "key", 3, now, buf, &len, nullptr, nullptr) == RSPAMD_SHM_CACHE_MISS);
+		CHECK(rspamd_shm_cache_insert(c, "key", 3, "value", 5, now, 10));
+		CHECK(rspamd_shm_cache_lookup(c, "key", 3, now + 1, buf, &len, nullptr, nullptr) == RSPAMD_SHM_CACHE_HIT);
+		CHECK(std::string(buf, len) == "value");
+		/* Expired */
+		CHECK(rspamd_shm_cache_lookup(c, "key", 3, now + 11, buf, &len, nullptr, nullptr) == RSPAMD_SHM_CACHE_MISS);
+		/* Value is too large */
+		CHECK(!rspamd_shm_cache_insert(c, "big", 3, std::string(33, 'x').data(), 33, now, 10));
+
+		rspamd_shm_cache_stat(c, &st);
+		CHECK(st.hits == 1);
+		CHECK(st.misses == 2);
+		CHECK(st.inserts == 1);
+
+		std::vector<std::string> names;
+		rspamd_shm_cache_foreach([](const char *name, rspamd_shm_cache_t *, void *ud) {
+			static_cast<std::vector<std::string> *>(ud)->emplace_back(name); }, &names);
+		CHECK(std::find(names.begin(), names.end(), "test") != names.end());
+
+		rspamd_shm_cache_destroy(c);
+		names.clear();
+		rspamd_shm_cache_foreach([](const char *name, rspamd_shm_cache_t *, void *ud) {
+			static_cast<std::vector<std::string> *>(ud)->emplace_back(name); }, &names);
+		CHECK(std::find(names.begin(), names.end(), "test") == names.end());
+	}
 }
 
 #endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "libcryptobox/cryptobox.h"
+#include "tests.h"
+
+extern struct ev_loop *event_loop;
+extern unsigned cpu_config;
+
+/*
+ * Builds a multipart message with boundaries and boundary like `\n--`
+ * sequences at every offset inside of vector blocks
+ */
+static GString *
+rspamd_mime_parser_test_message(void)
+{
+	GString *msg = g_string_new("From: a@example.com\r\n"
+								"Content-Type: multipart/mixed; boundary=\"bnd\"\r\n"
+								"\r\n");
+	unsigned int i, j;
+
+	for (i = 0; i < 70; i++) {
+		g_string_append(msg, "--bnd\r\n"
+							 "Content-Type: text/plain\r\n"
+							 "\r\n");
+
+		for (j = 0; j < i; j++) {
+			g_string_append_c(msg, 'a' + j % 26);
+		}
+
+		g_string_append(msg, "\n--not a boundary\r\n--");
+
+		for (j = 0; j < i % 5; j++) {
+			g_string_append_c(msg, '-');
+		}
+
+		g_string_append(msg, "\r\n");
+	}
+
+	g_string_append(msg, "--bnd--\r\n\r--");
+
+	return msg;
+}
+
+static GArray *
+rspamd_mime_parser_test_parts(GString *msg)
+{
+	struct rspamd_task *task;
+	struct rspamd_mime_part *part;
+	GArray *res = g_array_new(FALSE, FALSE, sizeof(goffset));
+	unsigned int i;
+	goffset off;
+
+	task = rspamd_task_new(NULL, rspamd_main->cfg, NULL, NULL, event_loop, FALSE);
+	task->msg.begin = msg->str;
+	task->msg.len = msg->len;
+	g_assert(rspamd_message_parse(task));
+
+	PTR_ARRAY_FOREACH(MESSAGE_FIELD(task, parts), i, part)
+	{
+		off = part->raw_data.begin - msg->str;
+		g_array_append_val(res, off);
+		off = part->raw_data.len;
+		g_array_append_val(res, off);
+	}
+
+	rspamd_task_free(task);
+
+	return res;
+}
+
+void rspamd_mime_parser_test_func(void)
+{
+	GString *msg = rspamd_mime_parser_test_message();
+	GArray *scalar, *vector;
+	unsigned int saved = cpu_config;
+
+	/* Boundaries found by the AVX2 scan must be the same as the SSE2/scalar ones */
+	cpu_config &= ~CPUID_AVX2;
+	scalar = rspamd_mime_parser_test_parts(msg);
+	cpu_config = saved;
+	vector = rspamd_mime_parser_test_parts(msg);
+
+	if (!(cpu_config & CPUID_AVX2)) {
+		msg_info("no AVX2 support, both scans use the same implementation");
+	}
+
+	/* Top multipart and all its text parts */
+	g_assert_cmpuint(scalar->len, ==, 2 * 71);
+	g_assert_cmpuint(vector->len, ==, scalar->len);
+	g_assert(memcmp(scalar->data, vector->data,
+					scalar->len * sizeof(goffset)) == 0);
+
+	g_array_free(scalar, TRUE);
+	g_array_free(vector, TRUE);
+	g_string_free(msg, TRUE);
+}
@@ -18,6 +18,7 @@
 #include "radix.h"
 #include "ottery.h"
 #include "btrie.h"
+#include "libserver/maps/map_helpers.h"
 
 const gsize max_elts = 500 * 1024;
 const int lookup_cycles = 1 * 1024;
@@ -202,6 +203,127 @@ rspamd_btrie_test_vec(void)
 	}
 }
 
+/* Checks that IPv4 table returns the same results as the trie */
+static void
+rspamd_radix_test_ipv4_table(void)
+{
+	radix_compressed_t *tree = radix_create_compressed(NULL);
+	const gsize nprefixes = 64 * 1024, nlookups = 256 * 1024;
+	rspamd_inet_addr_t *addrs[16];
+	uintptr_t batch[G_N_ELEMENTS(addrs)];
+	uint8_t key[16];
+	uint32_t a;
+	gsize i, j;
+
+	memset(key, 0, sizeof(key));
+	key[10] = 0xffu;
+	key[11] = 0xffu;
+
+	/* Default route and prefixes of all lengths */
+	radix_insert_compressed(tree, key, sizeof(key), 128, 1);
+
+	for (i = 0; i < nprefixes; i++) {
+		a = ottery_rand_uint32();
+		memcpy(key + 12, &a, sizeof(a));
+		radix_insert_compressed(tree, key, sizeof(key),
+								ottery_rand_range(32), i + 2);
+	}
+
+	radix_finalize_compressed(tree);
+
+	for (i = 0; i < nlookups; i += G_N_ELEMENTS(addrs)) {
+		for (j = 0; j < G_N_ELEMENTS(addrs); j++) {
+			a = ottery_rand_uint32();
+			addrs[j] = rspamd_inet_address_new(AF_INET, &a);
+		}
+
+		radix_find_compressed_addr_batch(tree,
+										 (const rspamd_inet_addr_t *const *) addrs,
+										 G_N_ELEMENTS(addrs), batch);
+
+		for (j = 0; j < G_N_ELEMENTS(addrs); j++) {
+			unsigned int klen;
+			const unsigned char *k = rspamd_inet_address_get_hash_key(addrs[j], &klen);
+
+			memcpy(key + 12, k, klen);
+			g_assert(batch[j] == radix_find_compressed(tree, key, sizeof(key)));
+			g_assert(batch[j] == radix_find_compressed_addr(tree, addrs[j]));
+			rspamd_inet_address_free(addrs[j]);
+		}
+	}
+
+	radix_destroy_compressed(tree);
+}
+
+/* Checks that batch lookups in a radix map match single lookups for mixed families */
+static void
+rspamd_radix_test_map_batch(void)
+{
+	struct rspamd_radix_map_helper *r = rspamd_map_helper_new_radix(NULL);
+	const char *prefixes[] = {
+		"10.0.0.0/8",
+		"192.168.1.0/24",
+		"192.168.1.128/25",
+		"2001:db8::/32",
+		"2001:db8:1::/48",
+		"::ffff:172.16.0.0/108",
+	};
+	const char *lookups[] = {
+		"10.1.2.3",
+		"2001:db8:1::1",
+		"192.168.1.1",
+		"8.8.8.8",
+		"192.168.1.200",
+		"2001:db8:2::1",
+		"::1",
+		"172.16.5.5",
+		"2001:db9::1",
+		"::ffff:10.0.0.1",
+	};
+	rspamd_inet_addr_t *addrs[G_N_ELEMENTS(lookups) * 8];
+	gconstpointer batch[G_N_ELEMENTS(addrs)];
+	gsize i, nfound, nsingle = 0;
+
+	for (i = 0; i < G_N_ELEMENTS(prefixes); i++) {
+		char val[16];
+
+		rspamd_snprintf(val, sizeof(val), "%z", i + 1);
+		rspamd_map_helper_insert_radix(r, prefixes[i], val);
+	}
+
+	/* More than one chunk of the batch lookup */
+	for (i = 0; i < G_N_ELEMENTS(addrs); i++) {
+		const char *ip = lookups[i % G_N_ELEMENTS(lookups)];
+
+		addrs[i] = NULL;
+		g_assert(rspamd_parse_inet_address(&addrs[i], ip, strlen(ip),
+										   RSPAMD_INET_ADDRESS_PARSE_NO_UNIX));
+	}
+
+	nfound = rspamd_match_radix_map_addr_batch(r,
+											   (const rspamd_inet_addr_t *const *) addrs,
+											   G_N_ELEMENTS(addrs), batch);
+
+	for (i = 0; i < G_N_ELEMENTS(addrs); i++) {
+		gconstpointer single = rspamd_match_radix_map_addr(r, addrs[i]);
+
+		if (single != NULL) {
+			nsingle++;
+			g_assert(batch[i] != NULL);
+			g_assert_cmpstr(batch[i], ==, single);
+		}
+		else {
+			g_assert(batch[i] == NULL);
+		}
+
+		rspamd_inet_address_free(addrs[i]);
+	}
+
+	g_assert_cmpuint(nfound, ==, nsingle);
+	g_assert_cmpuint(nfound, >, 0);
+	rspamd_map_helper_destroy_radix(r);
+}
+
 void rspamd_radix_test_func(void)
 {
 	struct btrie *btrie;
@@ -224,6 +346,8 @@ void rspamd_radix_test_func(void)
 	rspamd_btrie_test_vec();
 	rspamd_radix_test_vec();
 	rspamd_random_seed_fast();
+	rspamd_radix_test_ipv4_table();
+	rspamd_radix_test_map_batch();
 
 	nelts = max_elts;
 	/* First of all we generate many elements and push them to the array */
@@ -0,0 +1,341 @@
+/*
+ * Copyright 2024 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/re_cache.h"
+#include "libserver/task.h"
+#include "libmime/message.h"
+#include "libutil/cxx/cpu_pool.h"
+#include "tests.h"
+#include "unix-std.h"
+
+extern struct ev_loop *event_loop;
+
+static const char *test_messages[] = {
+	"From: a@example.com\r\n"
+	"Subject: cheap pills\r\n"
+	"\r\n"
+	"Buy cheap viagra now, viagra is cheap\r\n",
+	"From: b@example.org\r\n"
+	"Subject: hello\r\n"
+	"\r\n"
+	"Just a regular message\r\n",
+	"From: c@example.net\r\n"
+	"Subject: Cheap offer\r\n"
+	"X-Spam: yes\r\n"
+	"\r\n"
+	"VIAGRA\r\n",
+	"From: d@example.com\r\n"
+	"Subject: empty\r\n"
+	"\r\n",
+};
+
+static const struct {
+	const char *pattern;
+	enum rspamd_re_type type;
+} test_regexps[] = {
+	{"/^Subject: cheap/im", RSPAMD_RE_ALLHEADER},
+	{"/X-Spam/", RSPAMD_RE_ALLHEADER},
+	{"/viagra/i", RSPAMD_RE_BODY},
+	{"/regular/", RSPAMD_RE_BODY},
+	{"/never-matched-pattern/", RSPAMD_RE_BODY},
+};
+
+static void
+rspamd_re_cache_test_compiled(unsigned int ncompiled, GError *err, void *cbd)
+{
+	gboolean *done = (gboolean *) cbd;
+
+	if (err) {
+		msg_err("cannot compile hyperscan: %e", err);
+	}
+
+	*done = TRUE;
+	ev_break(event_loop, EVBREAK_ALL);
+}
+
+static struct rspamd_task *
+rspamd_re_cache_test_task(struct rspamd_config *cfg, const char *msg)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new(NULL, cfg, NULL, NULL, event_loop, FALSE);
+	task->msg.begin = msg;
+	task->msg.len = strlen(msg);
+	g_assert(rspamd_message_parse(task));
+
+	return task;
+}
+
+struct rspamd_re_cache_test_job {
+	struct rspamd_re_cache_batch *batch;
+	struct rspamd_task **tasks;
+	unsigned int ntasks;
+	unsigned int nscanned;
+	gboolean done;
+};
+
+static void
+rspamd_re_cache_test_job_work(void *ud)
+{
+	struct rspamd_re_cache_test_job *job = (struct rspamd_re_cache_test_job *) ud;
+
+	rspamd_re_cache_batch_scan(job->batch);
+}
+
+static void
+rspamd_re_cache_test_job_done(void *ud)
+{
+	struct rspamd_re_cache_test_job *job = (struct rspamd_re_cache_test_job *) ud;
+	unsigned int i;
+
+	job->nscanned = rspamd_re_cache_batch_finish(job->batch);
+
+	for (i = 0; i < job->ntasks; i++) {
+		rspamd_task_release(job->tasks[i]);
+	}
+
+	job->done = TRUE;
+}
+
+static void
+rspamd_re_cache_test_cleanup_dir(const char *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	if (dir) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *fpath = g_build_filename(path, name, NULL);
+
+			unlink(fpath);
+			g_free(fpath);
+		}
+
+		g_dir_close(dir);
+	}
+
+	rmdir(path);
+}
+
+/* Checks that batched scan gives the same results as scanning of single tasks */
+void rspamd_re_cache_test_func(void)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_re_cache *cache, *saved_cache;
+	rspamd_regexp_t *res[G_N_ELEMENTS(test_regexps)];
+	struct rspamd_task *batched[G_N_ELEMENTS(test_messages)],
+		*single[G_N_ELEMENTS(test_messages)],
+		*threaded[G_N_ELEMENTS(test_messages)];
+	struct rspamd_re_cache_test_job job;
+	struct rspamd_cpu_pool *pool;
+	char *cache_dir;
+	gboolean compiled = FALSE;
+	unsigned int i, j, nscanned;
+	int rb, rs;
+
+	cache = rspamd_re_cache_new();
+
+	for (i = 0; i < G_N_ELEMENTS(test_regexps); i++) {
+		rspamd_regexp_t *re = rspamd_regexp_new(test_regexps[i].pattern, NULL, NULL);
+
+		g_assert(re != NULL);
+		res[i] = rspamd_re_cache_add(cache, re, test_regexps[i].type, NULL, 0, -1);
+		rspamd_regexp_unref(re);
+	}
+
+	rspamd_re_cache_init(cache, cfg);
+	cache_dir = g_dir_make_tmp("rspamd-re-cache-XXXXXX", NULL);
+	g_assert(cache_dir != NULL);
+
+	if (rspamd_re_cache_compile_hyperscan(cache, cache_dir, 10.0, TRUE, event_loop,
+										  NULL, rspamd_re_cache_test_compiled,
+										  &compiled) == 0) {
+		while (!compiled) {
+			ev_run(event_loop, 0);
+		}
+
+		rspamd_re_cache_load_hyperscan(cache, cache_dir, false);
+	}
+
+	saved_cache = cfg->re_cache;
+	cfg->re_cache = cache;
+
+	for (i = 0; i < G_N_ELEMENTS(test_messages); i++) {
+		batched[i] = rspamd_re_cache_test_task(cfg, test_messages[i]);
+		single[i] = rspamd_re_cache_test_task(cfg, test_messages[i]);
+		threaded[i] = rspamd_re_cache_test_task(cfg, test_messages[i]);
+	}
+
+	cfg->re_cache = saved_cache;
+
+	nscanned = rspamd_re_cache_process_batch(batched, G_N_ELEMENTS(batched));
+
+	if (rspamd_re_cache_is_hs_loaded(cache) == RSPAMD_HYPERSCAN_LOADED_FULL) {
+		g_assert_cmpuint(nscanned, >, 0);
+	}
+
+	/* Shards scanned by the batch are not scanned again */
+	g_assert_cmpuint(rspamd_re_cache_process_batch(batched, G_N_ELEMENTS(batched)), ==, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(test_messages); i++) {
+		for (j = 0; j < G_N_ELEMENTS(test_regexps); j++) {
+			rs = rspamd_re_cache_process(single[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			rb = rspamd_re_cache_process(batched[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			g_assert_cmpint(rb, ==, rs);
+		}
+	}
+
+	/* Batch after per task lookups must not count hits twice */
+	g_assert_cmpuint(rspamd_re_cache_process_batch(single, G_N_ELEMENTS(single)), ==, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(test_messages); i++) {
+		for (j = 0; j < G_N_ELEMENTS(test_regexps); j++) {
+			rs = rspamd_re_cache_process(single[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			rb = rspamd_re_cache_process(batched[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			g_assert_cmpint(rb, ==, rs);
+		}
+	}
+
+	/* Scan in a thread, tasks are held until the batch is finished */
+	memset(&job, 0, sizeof(job));
+	job.tasks = threaded;
+	job.ntasks = G_N_ELEMENTS(threaded);
+	job.batch = rspamd_re_cache_batch_new(threaded, job.ntasks);
+
+	if (job.batch != NULL) {
+		pool = rspamd_cpu_pool_new(event_loop, 2, 0);
+
+		for (i = 0; i < job.ntasks; i++) {
+			rspamd_task_hold(threaded[i]);
+		}
+
+		g_assert(rspamd_cpu_pool_push(pool, rspamd_re_cache_test_job_work,
+									  rspamd_re_cache_test_job_done, &job));
+		/* Scanned by the task itself whilst the batch is running: must not be counted twice */
+		rspamd_re_cache_process(threaded[0], res[2], RSPAMD_RE_BODY, NULL, 0, FALSE);
+		/* Freeing of a held task is postponed until the batch is finished */
+		rspamd_task_free(threaded[G_N_ELEMENTS(threaded) - 1]);
+		rspamd_cpu_pool_wait(pool);
+		g_assert(job.done);
+		g_assert_cmpuint(job.nscanned, >, 0);
+		rspamd_cpu_pool_destroy(pool);
+	}
+	else {
+		rspamd_task_free(threaded[G_N_ELEMENTS(threaded) - 1]);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(test_messages) - 1; i++) {
+		for (j = 0; j < G_N_ELEMENTS(test_regexps); j++) {
+			rs = rspamd_re_cache_process(single[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			rb = rspamd_re_cache_process(threaded[i], res[j], test_regexps[j].type,
+										 NULL, 0, FALSE);
+			g_assert_cmpint(rb, ==, rs);
+		}
+	}
+
+	/* Sanity check of the expected matches */
+	g_assert_cmpint(rspamd_re_cache_process(batched[0], res[2], RSPAMD_RE_BODY,
+											NULL, 0, FALSE),
+					>, 0);
+	g_assert_cmpint(rspamd_re_cache_process(batched[1], res[2], RSPAMD_RE_BODY,
+											NULL, 0, FALSE),
+					==, 0);
+	g_assert_cmpint(rspamd_re_cache_process(batched[2], res[1], RSPAMD_RE_ALLHEADER,
+											NULL, 0, FALSE),
+					>, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(test_messages); i++) {
+		rspamd_task_free(batched[i]);
+		rspamd_task_free(single[i]);
+
+		if (i < G_N_ELEMENTS(test_messages) - 1) {
+			rspamd_task_free(threaded[i]);
+		}
+	}
+
+	rspamd_re_cache_unref(cache);
+	rspamd_re_cache_test_cleanup_dir(cache_dir);
+	g_free(cache_dir);
+}
+
+/* Values of a class are collected once per task and reused by its other regexps */
+void rspamd_re_cache_inputs_test_func(void)
+{
+	static const struct {
+		const char *pattern;
+		const char *header;
+		int expected;
+	} header_regexps[] = {
+		{"/cheap/i", "Subject", 1},
+		{"/offer/", "Subject", 1},
+		{"/never-matched-pattern/", "Subject", 0},
+		{"/anything/", "X-Missing", 0},
+		{"/.*/", "X-Missing", 0},
+	};
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamd_re_cache *cache, *saved_cache;
+	rspamd_regexp_t *res[G_N_ELEMENTS(header_regexps)];
+	const struct rspamd_re_cache_stat *stat;
+	struct rspamd_task *task;
+	unsigned int i;
+
+	cache = rspamd_re_cache_new();
+
+	for (i = 0; i < G_N_ELEMENTS(header_regexps); i++) {
+		rspamd_regexp_t *re = rspamd_regexp_new(header_regexps[i].pattern, NULL, NULL);
+
+		g_assert(re != NULL);
+		res[i] = rspamd_re_cache_add(cache, re, RSPAMD_RE_HEADER,
+									 header_regexps[i].header,
+									 strlen(header_regexps[i].header) + 1, -1);
+		rspamd_regexp_unref(re);
+	}
+
+	rspamd_re_cache_init(cache, cfg);
+	saved_cache = cfg->re_cache;
+	cfg->re_cache = cache;
+	task = rspamd_re_cache_test_task(cfg, test_messages[2]);
+	cfg->re_cache = saved_cache;
+
+	for (i = 0; i < G_N_ELEMENTS(header_regexps); i++) {
+		g_assert_cmpint(rspamd_re_cache_process(task, res[i], RSPAMD_RE_HEADER,
+												header_regexps[i].header,
+												strlen(header_regexps[i].header),
+												FALSE),
+						==, header_regexps[i].expected);
+	}
+
+	/* One collection per class, including the class with no data */
+	stat = rspamd_re_cache_get_stat(task->re_rt);
+	g_assert_cmpuint(stat->inputs_collected, ==, 2);
+	g_assert_cmpuint(stat->inputs_cached, ==, G_N_ELEMENTS(header_regexps) - 2);
+
+	/* Known results do not need the inputs at all */
+	g_assert_cmpint(rspamd_re_cache_process(task, res[0], RSPAMD_RE_HEADER,
+											"Subject", strlen("Subject"), FALSE),
+					==, 1);
+	g_assert_cmpuint(stat->inputs_collected + stat->inputs_cached, ==,
+					 G_N_ELEMENTS(header_regexps));
+
+	rspamd_task_free(task);
+	rspamd_re_cache_unref(cache);
+}
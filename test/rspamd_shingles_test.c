@@ -276,6 +276,14 @@ static const uint64_t expected_fasthash[RSPAMD_SHINGLE_SIZE] = {
 	0x954cda70edf6591f,
 };
 
+/* Same as the default filter but forces shingles to keep all hashes */
+static uint64_t
+test_min_filter(uint64_t *input, gsize count,
+				int shno, const unsigned char *key, gpointer ud)
+{
+	return rspamd_shingles_default_filter(input, count, shno, key, ud);
+}
+
 void rspamd_shingles_test_func(void)
 {
 	enum rspamd_shingle_alg alg = RSPAMD_SHINGLES_OLD;
@@ -326,6 +334,20 @@ void rspamd_shingles_test_func(void)
 	}
 	g_free(sgl);
 
+	sgl = rspamd_shingles_from_text(input, key, NULL,
+									test_min_filter, NULL, RSPAMD_SHINGLES_XXHASH);
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		g_assert(sgl->hashes[i] == expected_xxhash[i]);
+	}
+	g_free(sgl);
+
+	sgl = rspamd_shingles_from_text(input, key, NULL,
+									test_min_filter, NULL, RSPAMD_SHINGLES_FAST);
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
+		g_assert(sgl->hashes[i] == expected_fasthash[i]);
+	}
+	g_free(sgl);
+
 	for (alg = RSPAMD_SHINGLES_OLD; alg <= RSPAMD_SHINGLES_FAST; alg++) {
 		test_case(200, 10, 0.1, alg);
 		test_case(500, 20, 0.01, alg);
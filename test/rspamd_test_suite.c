@@ -73,6 +73,9 @@ int main(int argc, char **argv)
 
 	g_test_add_func("/rspamd/mem_pool", rspamd_mem_pool_test_func);
 	g_test_add_func("/rspamd/radix", rspamd_radix_test_func);
+	g_test_add_func("/rspamd/re_cache", rspamd_re_cache_test_func);
+	g_test_add_func("/rspamd/re_cache_inputs", rspamd_re_cache_inputs_test_func);
+	g_test_add_func("/rspamd/mime_parser", rspamd_mime_parser_test_func);
 	g_test_add_func("/rspamd/dns", rspamd_dns_test_func);
 	g_test_add_func("/rspamd/dkim", rspamd_dkim_test_func);
 	g_test_add_func("/rspamd/rrd", rspamd_rrd_test_func);
@@ -44,6 +44,27 @@ rspamd_upstream_test_method(struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_test_latency_cb(struct upstream *up, unsigned int idx, void *ud)
+{
+	/* Make kernel.org much faster than others */
+	if (strcmp(rspamd_upstream_name(up), "kernel.org") == 0) {
+		rspamd_upstream_ok_latency(up, 0.01);
+	}
+	else {
+		rspamd_upstream_ok_latency(up, 1.0);
+	}
+}
+
+static void
+rspamd_upstream_test_drain_cb(struct upstream *up, unsigned int idx, void *ud)
+{
+	/* Finish all requests in flight */
+	for (unsigned int i = 0; i < 30; i++) {
+		rspamd_upstream_ok(up);
+	}
+}
+
 static void
 rspamd_upstream_timeout_handler(EV_P_ ev_timer *w, int revents)
 {
@@ -133,6 +154,52 @@ void rspamd_upstream_test_func(void)
 	rspamd_upstream_test_method(ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "google.com");
 	rspamd_upstream_test_method(ls, RSPAMD_UPSTREAM_ROUND_ROBIN, "microsoft.com");
 
+	/* Test latency rotation: the fastest one wins when it is one of two choices */
+	rspamd_upstreams_foreach(ls, rspamd_upstream_test_latency_cb, NULL);
+	success = 0;
+
+	for (i = 0; i < 3000; i++) {
+		up = rspamd_upstream_get(ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert(up != NULL);
+
+		if (strcmp(rspamd_upstream_name(up), "kernel.org") == 0) {
+			success++;
+		}
+
+		rspamd_upstream_ok(up);
+	}
+
+	g_assert(success > 1500);
+	success = 0;
+
+	/* Test bounded hash rotation: the same key goes to the same upstream */
+	ottery_rand_bytes(test_key, sizeof(test_key));
+	upn = rspamd_upstream_get(ls, RSPAMD_UPSTREAM_HASHED_BOUNDED, test_key,
+							  sizeof(test_key));
+	g_assert(upn != NULL);
+	rspamd_upstream_ok(upn);
+
+	for (i = 0; i < 10; i++) {
+		up = rspamd_upstream_get(ls, RSPAMD_UPSTREAM_HASHED_BOUNDED, test_key,
+								 sizeof(test_key));
+		g_assert(up == upn);
+		rspamd_upstream_ok(up);
+	}
+
+	/* Hot key spills to other upstreams when its upstream is overloaded */
+	for (i = 0; i < 30; i++) {
+		up = rspamd_upstream_get(ls, RSPAMD_UPSTREAM_HASHED_BOUNDED, test_key,
+								 sizeof(test_key));
+
+		if (up == upn) {
+			success++;
+		}
+	}
+
+	g_assert(success < 30);
+	rspamd_upstreams_foreach(ls, rspamd_upstream_test_drain_cb, NULL);
+	success = 0;
+
 	/* Test stable hashing */
 	nls = rspamd_upstreams_create(cfg->ups_ctx);
 	g_assert(rspamd_upstreams_parse_line(nls, test_upstream_list, 443, NULL));
@@ -21,6 +21,13 @@ void rspamd_statfile_test_func(void);
 /* Radix test */
 void rspamd_radix_test_func(void);
 
+/* Regexp cache batches */
+void rspamd_re_cache_test_func(void);
+void rspamd_re_cache_inputs_test_func(void);
+
+/* MIME parser */
+void rspamd_mime_parser_test_func(void);
+
 /* DNS resolving */
 void rspamd_dns_test_func(void);
 